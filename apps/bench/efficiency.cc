@@ -1,14 +1,8 @@
 extern "C" {
-#include <base/log.h>
 #include <net/ip.h>
 }
-#undef min
-#undef max
 
-#include "thread.h"
-#include "sync.h"
-#include "timer.h"
-#include "net.h"
+#include "platform.h"
 #include "fake_worker.h"
 
 #include <iostream>
@@ -38,7 +32,9 @@ int step_us;
 // the maximum number of microseconds of fake work to measure.
 int end_us;
 
-uint64_t Worker(rt::UdpConn *c, int cur_us, rt::WaitGroup *wg) {
+template <typename P>
+uint64_t Worker(typename P::UdpConn *c, int cur_us,
+                typename P::WaitGroup *wg) {
   constexpr std::size_t kPayloadLen = 32;
   unsigned char buf[kPayloadLen];
 
@@ -73,15 +69,18 @@ uint64_t Worker(rt::UdpConn *c, int cur_us, rt::WaitGroup *wg) {
   return requests;
 }
 
-void MainHandler(void *arg) {
+template <typename P>
+void MainHandler() {
+  using UdpConn = typename P::UdpConn;
+
   for (int cur_us = step_us; cur_us <= end_us; cur_us += step_us) {
-    std::vector<std::pair<std::unique_ptr<rt::UdpConn>, uint64_t>> conns;
-    rt::WaitGroup wg(threads);
+    std::vector<std::pair<std::unique_ptr<UdpConn>, uint64_t>> conns;
+    typename P::WaitGroup wg(threads);
 
     // Open one UDP connection per thread.
     for (int i = 0; i < threads; ++i) {
       netaddr laddr = {0, 0};
-      std::unique_ptr<rt::UdpConn> c(rt::UdpConn::Dial(laddr, raddr));
+      std::unique_ptr<UdpConn> c(UdpConn::Dial(laddr, raddr));
       if (unlikely(c == nullptr)) panic("couldn't connect to raddr.");
       conns.emplace_back(std::move(c), 0);
     }
@@ -90,10 +89,10 @@ void MainHandler(void *arg) {
 
     // Launch a worker thread for each connection.
     for (auto& c: conns)
-      rt::Spawn([&](){c.second = Worker(c.first.get(), cur_us, &wg);});
+      P::Spawn([&](){c.second = Worker<P>(c.first.get(), cur_us, &wg);});
 
     // Sleep for the experiment measurement duration.
-    rt::Sleep(measure_sec * rt::kSeconds);
+    P::Sleep(measure_sec * rt::kSeconds);
 
     // Shutdown all the connections.
     for (auto& c: conns)
@@ -150,7 +149,7 @@ int main(int argc, char *argv[]) {
   step_us = std::stoi(argv[7], nullptr, 0);
   end_us = std::stoi(argv[8], nullptr, 0);
 
-  ret = runtime_init(argv[1], MainHandler, NULL);
+  ret = bench::Platform::Run(argv[1], MainHandler<bench::Platform>);
   if (ret) {
     printf("failed to start runtime\n");
     return ret;
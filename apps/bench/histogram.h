@@ -0,0 +1,88 @@
+// histogram.h - a fixed-size, high-dynamic-range latency histogram
+//
+// Values are binned log-linearly, like HdrHistogram: every power of two is
+// split into the same number of linear sub-buckets, so the relative error is
+// bounded (1 / 2^(kSubBits - 1), under 1%) across the whole 64-bit range
+// while recording stays a couple of shifts and an increment. The histogram is
+// trivially copyable, so it can be sent over the wire as is and merged on the
+// other end.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+class Histogram {
+ public:
+  // log2 of the number of sub-buckets per power of two.
+  static constexpr int kSubBits = 7;
+  static constexpr uint64_t kSubCount = 1UL << kSubBits;
+  static constexpr uint64_t kHalfCount = kSubCount / 2;
+  static constexpr int kCounts = (66 - kSubBits) * kHalfCount;
+
+  Histogram() { Reset(); }
+
+  void Reset() {
+    memset(counts_, 0, sizeof(counts_));
+    total_ = sum_ = max_ = 0;
+    min_ = std::numeric_limits<uint64_t>::max();
+  }
+
+  // Records one value.
+  void Record(uint64_t v) {
+    counts_[Index(v)]++;
+    total_++;
+    sum_ += v;
+    min_ = std::min(min_, v);
+    max_ = std::max(max_, v);
+  }
+
+  // Adds all of the values recorded in @h.
+  void Merge(const Histogram &h) {
+    for (int i = 0; i < kCounts; ++i) counts_[i] += h.counts_[i];
+    total_ += h.total_;
+    sum_ += h.sum_;
+    min_ = std::min(min_, h.min_);
+    max_ = std::max(max_, h.max_);
+  }
+
+  uint64_t Count() const { return total_; }
+  uint64_t Min() const { return total_ ? min_ : 0; }
+  uint64_t Max() const { return max_; }
+  double Mean() const {
+    return total_ ? static_cast<double>(sum_) / total_ : 0.0;
+  }
+
+  // Gets the value at quantile @q (0 to 1), reported as the largest value
+  // that falls in the same bucket and clamped to the largest value recorded.
+  uint64_t ValueAt(double q) const {
+    if (total_ == 0) return 0;
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(
+        q * static_cast<double>(total_) + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < kCounts; ++i) {
+      seen += counts_[i];
+      if (seen >= rank) return std::min(max_, HighestEquivalent(i));
+    }
+    return max_;
+  }
+
+ private:
+  static int Index(uint64_t v) {
+    if (v < kSubCount) return v;
+    int shift = 64 - __builtin_clzl(v) - kSubBits;
+    return shift * kHalfCount + (v >> shift);
+  }
+
+  static uint64_t HighestEquivalent(int idx) {
+    if (idx < static_cast<int>(kSubCount)) return idx;
+    int shift = idx / kHalfCount - 1;
+    uint64_t sub = idx - shift * kHalfCount;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  uint64_t counts_[kCounts];
+  uint64_t total_, sum_, min_, max_;
+};
@@ -0,0 +1,467 @@
+// loadgen.cc - an open-loop load generator for the netbench TCP server
+//
+// Every connection sends requests on a schedule drawn up in advance, whether
+// or not earlier requests were answered, and each latency is measured from
+// when its request was *supposed* to be sent. A closed-loop or catch-up
+// client stops sending when the server stalls, so the requests that would
+// have queued up behind the stall are never measured (coordinated omission);
+// here they are, and they show up in the tail.
+//
+// One machine leads the experiment and any number of agents (running
+// "loadgen [cfg] agent") share the load. Latencies go into HDR histograms,
+// which the agents send back to the leader to be merged, and the leader
+// prints one CSV line per offered load.
+
+extern "C" {
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ip.h>
+}
+#undef min
+#undef max
+
+#include "histogram.h"
+#include "net.h"
+#include "proto.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// The number of requests to send in one write, at most.
+constexpr int kBatchSize = 32;
+// The fraction of each run that is warmup and isn't measured.
+constexpr double kWarmupFraction = 0.1;
+// How long to wait for responses after the last request is sent.
+constexpr uint64_t kDrainUS = 1000000;
+// How far behind schedule a request can be sent before it counts as late.
+constexpr uint64_t kLateUS = 10;
+// How long the connections get to settle before the schedule starts.
+constexpr uint64_t kStartDelayUS = 1000;
+
+// A random distribution of request spacing or service times, the same ones
+// the synthetic client (apps/synthetic) supports.
+class Distribution {
+ public:
+  enum Kind : uint8_t {
+    kZero = 0,
+    kConstant,
+    kExponential,
+    kBimodal1,   // 10% of samples are 5.5x the mean, the rest 0.5x
+    kBimodal2,   // 0.1% of samples are 500.5x the mean, the rest 0.5x
+  };
+
+  Distribution(Kind kind, double mean) : kind_(kind), mean_(mean),
+                                         exp_(1.0 / mean), coin_(0.0, 1.0) { }
+
+  double operator()(std::mt19937_64 &g) {
+    switch (kind_) {
+      case kZero:
+        return 0.0;
+      case kConstant:
+        return mean_;
+      case kExponential:
+        return exp_(g);
+      case kBimodal1:
+        return coin_(g) < 0.1 ? mean_ * 5.5 : mean_ * 0.5;
+      case kBimodal2:
+        return coin_(g) < 0.001 ? mean_ * 500.5 : mean_ * 0.5;
+    }
+    return 0.0;
+  }
+
+  static const char *Name(Kind kind) {
+    static const char *names[] = {"zero", "constant", "exponential",
+                                  "bimodal1", "bimodal2"};
+    return names[kind];
+  }
+
+  // Parses a distribution name, "poisson" is an alias for "exponential".
+  static int Parse(const std::string &name, Kind *kind) {
+    if (name == "poisson") {
+      *kind = kExponential;
+      return 0;
+    }
+    for (int i = kZero; i <= kBimodal2; ++i) {
+      if (name == Name(static_cast<Kind>(i))) {
+        *kind = static_cast<Kind>(i);
+        return 0;
+      }
+    }
+    return -EINVAL;
+  }
+
+ private:
+  Kind kind_;
+  double mean_;
+  std::exponential_distribution<double> exp_;
+  std::uniform_real_distribution<double> coin_;
+};
+
+// The results of one connection, or of many merged together.
+struct results {
+  uint64_t sent, late, received;
+  Histogram h;
+};
+
+// Generates one machine's share of the load over many connections.
+class Generator {
+ public:
+  // Connects to the server, returns nullptr on failure.
+  static Generator *Create(const loadgen_req &req) {
+    std::unique_ptr<Generator> g(new Generator(req));
+    for (int i = 0; i < req.nconns; ++i) {
+      rt::TcpConn *c = rt::TcpConn::Dial({0, 0}, {req.server_ip,
+                                                  req.server_port});
+      if (c == nullptr) return nullptr;
+      g->conns_.emplace_back(c);
+    }
+    return g.release();
+  }
+
+  // Runs the schedule and merges the results of every connection. Latencies
+  // are recorded in nanoseconds.
+  void Run(loadgen_resp *resp, Histogram *h) {
+    uint64_t start_us = microtime() + kStartDelayUS;
+    std::vector<std::unique_ptr<results>> res;
+    std::vector<rt::Thread> th;
+
+    for (unsigned int i = 0; i < conns_.size(); ++i) {
+      res.emplace_back(new results());
+      results *r = res.back().get();
+      rt::TcpConn *c = conns_[i].get();
+      uint64_t seed = rdtsc() + i;
+      th.emplace_back(rt::Thread([=] { ConnWorker(c, start_us, seed, r); }));
+    }
+    for (auto &t : th) t.Join();
+
+    resp->magic = kMagic;
+    resp->sent = resp->late = resp->received = 0;
+    resp->window_us = req_.duration_us - WarmupUS();
+    for (auto &r : res) {
+      resp->sent += r->sent;
+      resp->late += r->late;
+      resp->received += r->received;
+      h->Merge(r->h);
+    }
+  }
+
+ private:
+  Generator(const loadgen_req &req) : req_(req) { }
+
+  uint64_t WarmupUS() const {
+    return static_cast<uint64_t>(req_.duration_us * kWarmupFraction);
+  }
+
+  void ConnWorker(rt::TcpConn *c, uint64_t start_us, uint64_t seed,
+                  results *r) {
+    std::mt19937_64 g(seed);
+    Distribution arrival(static_cast<Distribution::Kind>(req_.arrival),
+                         1000000.0 * req_.nconns / req_.rps);
+    Distribution service(static_cast<Distribution::Kind>(req_.service),
+                         req_.service_us);
+    uint64_t end_us = start_us + req_.duration_us;
+    uint64_t warm_tsc = start_tsc + (start_us + WarmupUS()) * cycles_per_us;
+    r->sent = r->late = r->received = 0;
+
+    // Requests carry the TSC they were due to be sent at in place of an
+    // index, and the server echoes it back, so the receiver needs no
+    // bookkeeping to find out how late the response is.
+    rt::Thread th([&] {
+      payload rp;
+      while (c->ReadFull(&rp, sizeof(rp)) ==
+             static_cast<ssize_t>(sizeof(rp))) {
+        uint64_t now = rdtsc();
+        if (rp.idx < warm_tsc) continue;
+        r->h.Record((now - rp.idx) * 1000 / cycles_per_us);
+        r->received++;
+      }
+    });
+
+    payload p[kBatchSize];
+    int j = 0;
+    auto flush = [&] {
+      if (j == 0) return;
+      ssize_t ret = c->WriteFull(p, sizeof(payload) * j);
+      if (ret != static_cast<ssize_t>(sizeof(payload) * j))
+        panic("write failed, ret = %ld", ret);
+      j = 0;
+    };
+
+    double next_us = start_us + arrival(g);
+    while (next_us < end_us) {
+      // Never skip a request that is behind schedule, it just counts from
+      // when it was due.
+      uint64_t now = microtime();
+      if (now < next_us) {
+        flush();
+        rt::SleepUntil(next_us);
+        now = microtime();
+      }
+
+      uint64_t due_tsc = start_tsc +
+                         static_cast<uint64_t>(next_us * cycles_per_us);
+      if (due_tsc >= warm_tsc) {
+        r->sent++;
+        if (now > next_us + kLateUS) r->late++;
+      }
+      p[j].tag = 0;
+      p[j].idx = due_tsc;
+      p[j].workn = service(g);
+      if (++j == kBatchSize) flush();
+      next_us += arrival(g);
+    }
+    flush();
+
+    // Requests that aren't answered in time count as lost.
+    rt::SleepUntil(end_us + kDrainUS);
+    c->Shutdown(SHUT_RDWR);
+    th.Join();
+  }
+
+  loadgen_req req_;
+  std::vector<std::unique_ptr<rt::TcpConn>> conns_;
+};
+
+void AgentWorker(std::unique_ptr<rt::TcpConn> c) {
+  while (true) {
+    // Receive the next set of orders.
+    loadgen_req req;
+    ssize_t ret = c->ReadFull(&req, sizeof(req));
+    if (ret != static_cast<ssize_t>(sizeof(req))) {
+      if (ret == 0 || ret == -ECONNRESET) break;
+      log_err("read failed, ret = %ld", ret);
+      break;
+    }
+    if (req.magic != kMagic) {
+      log_err("got an invalid request");
+      break;
+    }
+
+    // Connect, then wait for the leader to start the run.
+    std::unique_ptr<Generator> g(Generator::Create(req));
+    if (g == nullptr) {
+      log_err("couldn't connect to the server");
+      break;
+    }
+    uint32_t magic = kMagic;
+    if (c->WriteFull(&magic, sizeof(magic)) != sizeof(magic)) break;
+    if (c->ReadFull(&magic, sizeof(magic)) != sizeof(magic) ||
+        magic != kMagic) {
+      break;
+    }
+
+    // Run it and report back.
+    loadgen_resp resp;
+    std::unique_ptr<Histogram> h(new Histogram());
+    g->Run(&resp, h.get());
+    if (c->WriteFull(&resp, sizeof(resp)) != sizeof(resp) ||
+        c->WriteFull(h.get(), sizeof(*h)) != sizeof(*h)) {
+      log_err("couldn't send results");
+      break;
+    }
+  }
+}
+
+void AgentHandler(void *arg) {
+  std::unique_ptr<rt::TcpQueue> q(
+      rt::TcpQueue::Listen({0, kLoadgenPort}, 4096));
+  if (q == nullptr) panic("couldn't listen for connections");
+
+  while (true) {
+    rt::TcpConn *c = q->Accept();
+    if (c == nullptr) panic("couldn't accept a connection");
+    rt::Thread([=] { AgentWorker(std::unique_ptr<rt::TcpConn>(c)); })
+        .Detach();
+  }
+}
+
+// <- ARGUMENTS FOR EXPERIMENT ->
+// the number of connections each machine opens.
+int conns;
+// the address of the netbench server.
+netaddr raddr;
+// how requests are spaced and how long they take.
+Distribution::Kind arrival, service;
+// the mean service time in us.
+double st;
+// how long to run at each offered load, in us.
+uint64_t duration;
+// the range of offered loads (total over all machines) to sweep.
+double start_rps, end_rps, step_rps;
+// the addresses of the agents.
+std::vector<uint32_t> agent_ips;
+
+void PrintResults(double offered_rps, const loadgen_resp &r,
+                  const Histogram &h) {
+  auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+  std::cout << std::setprecision(2) << std::fixed
+            << Distribution::Name(arrival) << ","
+            << Distribution::Name(service) << ","
+            << offered_rps << ","
+            << r.received * 1000000.0 / r.window_us << ","
+            << r.sent << ","
+            << r.late << ","
+            << r.sent - r.received << ","
+            << us(h.Min()) << ","
+            << h.Mean() / 1000.0 << ","
+            << us(h.ValueAt(0.5)) << ","
+            << us(h.ValueAt(0.9)) << ","
+            << us(h.ValueAt(0.99)) << ","
+            << us(h.ValueAt(0.999)) << ","
+            << us(h.ValueAt(0.9999)) << ","
+            << us(h.Max()) << std::endl;
+}
+
+void RunPoint(std::vector<std::unique_ptr<rt::TcpConn>> &agents,
+              double offered_rps) {
+  loadgen_req req;
+  req.magic = kMagic;
+  req.nconns = conns;
+  req.server_ip = raddr.ip;
+  req.server_port = raddr.port;
+  req.arrival = arrival;
+  req.service = service;
+  req.rps = offered_rps / (agents.size() + 1);
+  req.service_us = st;
+  req.duration_us = duration;
+
+  // Hand out the orders and wait for every machine to connect.
+  for (auto &a : agents) {
+    if (a->WriteFull(&req, sizeof(req)) != sizeof(req))
+      panic("couldn't send a request to an agent");
+  }
+  std::unique_ptr<Generator> g(Generator::Create(req));
+  if (g == nullptr) panic("couldn't connect to the server");
+  for (auto &a : agents) {
+    uint32_t magic;
+    if (a->ReadFull(&magic, sizeof(magic)) != sizeof(magic) ||
+        magic != kMagic) {
+      panic("an agent failed to get ready");
+    }
+  }
+
+  // Start everyone, then gather up the results.
+  for (auto &a : agents) {
+    uint32_t magic = kMagic;
+    if (a->WriteFull(&magic, sizeof(magic)) != sizeof(magic))
+      panic("couldn't start an agent");
+  }
+  loadgen_resp total;
+  std::unique_ptr<Histogram> h(new Histogram());
+  g->Run(&total, h.get());
+
+  std::unique_ptr<Histogram> ah(new Histogram());
+  for (auto &a : agents) {
+    loadgen_resp resp;
+    if (a->ReadFull(&resp, sizeof(resp)) != sizeof(resp) ||
+        resp.magic != kMagic || a->ReadFull(ah.get(), sizeof(*ah)) !=
+        sizeof(*ah)) {
+      panic("couldn't get results from an agent");
+    }
+    total.sent += resp.sent;
+    total.late += resp.late;
+    total.received += resp.received;
+    h->Merge(*ah);
+  }
+
+  PrintResults(offered_rps, total, *h);
+}
+
+void ClientHandler(void *arg) {
+  std::vector<std::unique_ptr<rt::TcpConn>> agents;
+  for (uint32_t ip : agent_ips) {
+    rt::TcpConn *c = rt::TcpConn::Dial({0, 0}, {ip, kLoadgenPort});
+    if (c == nullptr) panic("couldn't connect to an agent");
+    agents.emplace_back(c);
+  }
+
+  std::cout << "arrival,service,offered_rps,achieved_rps,sent,late,lost,"
+               "min,mean,p50,p90,p99,p999,p9999,max" << std::endl;
+  for (double rps = start_rps; rps <= end_rps; rps += step_rps)
+    RunPoint(agents, rps);
+}
+
+int StringToAddr(const char *str, uint32_t *addr) {
+  uint8_t a, b, c, d;
+
+  if (sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) return -EINVAL;
+
+  *addr = MAKE_IP_ADDR(a, b, c, d);
+  return 0;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 3) {
+    std::cerr << "usage: [cfg_file] [cmd] ..." << std::endl;
+    return -EINVAL;
+  }
+
+  std::string cmd = argv[2];
+  if (cmd.compare("agent") == 0) {
+    ret = runtime_init(argv[1], AgentHandler, NULL);
+    if (ret) {
+      printf("failed to start runtime\n");
+      return ret;
+    }
+  } else if (cmd.compare("client") != 0) {
+    std::cerr << "invalid command: " << cmd << std::endl;
+    return -EINVAL;
+  }
+
+  if (argc < 10) {
+    std::cerr << "usage: [cfg_file] client [#conns] [server_ip] [arrival] "
+                 "[service] [service_us] [duration_us] "
+                 "[start_rps]:[end_rps]:[step_rps] [agent_ip]..."
+              << std::endl;
+    return -EINVAL;
+  }
+
+  conns = std::stoi(argv[3], nullptr, 0);
+
+  ret = StringToAddr(argv[4], &raddr.ip);
+  if (ret) return -EINVAL;
+  raddr.port = kNetbenchPort;
+
+  if (Distribution::Parse(argv[5], &arrival) ||
+      Distribution::Parse(argv[6], &service) ||
+      arrival == Distribution::kZero) {
+    std::cerr << "invalid distribution" << std::endl;
+    return -EINVAL;
+  }
+
+  st = std::stod(argv[7], nullptr);
+  duration = std::stoll(argv[8], nullptr, 0);
+
+  if (sscanf(argv[9], "%lf:%lf:%lf", &start_rps, &end_rps, &step_rps) != 3 ||
+      step_rps <= 0) {
+    std::cerr << "invalid load range: " << argv[9] << std::endl;
+    return -EINVAL;
+  }
+
+  for (int i = 10; i < argc; ++i) {
+    uint32_t ip;
+    ret = StringToAddr(argv[i], &ip);
+    if (ret) return -EINVAL;
+    agent_ips.push_back(ip);
+  }
+
+  ret = runtime_init(argv[1], ClientHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+
+  return 0;
+}
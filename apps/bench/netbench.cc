@@ -1,14 +1,10 @@
 extern "C" {
-#include <base/log.h>
+#include <base/stddef.h>
+#include <base/byteorder.h>
 #include <net/ip.h>
 }
-#undef min
-#undef max
 
-#include "thread.h"
-#include "sync.h"
-#include "timer.h"
-#include "net.h"
+#include "platform.h"
 #include "fake_worker.h"
 #include "proto.h"
 
@@ -21,6 +17,9 @@ extern "C" {
 #include <algorithm>
 #include <numeric>
 #include <random>
+#include <fstream>
+#include <sstream>
+#include <string>
 
 namespace {
 
@@ -39,46 +38,143 @@ netaddr raddr;
 uint64_t n;
 // the mean service time in us.
 double st;
+// whether to ask the server where each request's time went.
+bool breakdown;
 
-void ServerWorker(std::unique_ptr<rt::TcpConn> c) {
+// Converts the TSC cycles from @start to @end to nanoseconds.
+uint32_t CyclesToNs(uint64_t start, uint64_t end) {
+  if (start == 0 || end < start) return 0;
+  return (end - start) * 1000 / cycles_per_us;
+}
+
+// The uptime server, which reports the server machine's CPU usage, listens on
+// this port.
+constexpr uint64_t kUptimePort = 8002;
+constexpr uint64_t kUptimeMagic = 0xDEADBEEF;
+struct uptime {
+  uint64_t idle;
+  uint64_t busy;
+};
+
+template <typename P>
+void UptimeWorker(std::unique_ptr<typename P::TcpConn> c) {
+  while (true) {
+    // Receive an uptime request.
+    uint64_t magic;
+    ssize_t ret = c->ReadFull(&magic, sizeof(magic));
+    if (ret != static_cast<ssize_t>(sizeof(magic))) {
+      if (ret == 0 || ret == -ECONNRESET) break;
+      log_err("read failed, ret = %ld", ret);
+      break;
+    }
+
+    // Check for the right magic value.
+    if (ntoh64(magic) != kUptimeMagic) break;
+
+    // Calculate the current uptime.
+    std::ifstream file("/proc/stat");
+    std::string line;
+    std::getline(file, line);
+    std::istringstream ss(line);
+    std::string tmp;
+    uint64_t user, nice, system, idle, iowait, irq, softirq, steal, guest,
+             guest_nice;
+    ss >> tmp >> user >> nice >> system >> idle >> iowait >> irq >> softirq
+       >> steal >> guest >> guest_nice;
+    uptime u = {hton64(idle + iowait),
+                hton64(user + nice + system + irq + softirq + steal)};
+
+    // Send an uptime response.
+    ssize_t sret = c->WriteFull(&u, sizeof(u));
+    if (sret != sizeof(u)) {
+      if (sret == -EPIPE || sret == -ECONNRESET) break;
+      log_err("write failed, ret = %ld", sret);
+      break;
+    }
+  }
+}
+
+template <typename P>
+void UptimeServer() {
+  std::unique_ptr<typename P::TcpQueue> q(
+      P::TcpQueue::Listen({0, kUptimePort}, 4096));
+  if (q == nullptr) panic("couldn't listen for connections");
+
+  while (true) {
+    typename P::TcpConn *c = q->Accept();
+    if (c == nullptr) panic("couldn't accept a connection");
+    P::Spawn([=]{
+      UptimeWorker<P>(std::unique_ptr<typename P::TcpConn>(c));
+    });
+  }
+}
+
+template <typename P>
+void ServerWorker(std::unique_ptr<typename P::TcpConn> c) {
   payload p;
+  net_rx_ts ts;
+  char resp[sizeof(payload) + sizeof(payload_breakdown)];
+  uint32_t last_tx_ns = 0;
   std::unique_ptr<FakeWorker> w(FakeWorkerFactory("stridedmem:3200:64"));
   if (w == nullptr) panic("couldn't create worker");
 
   while (true) {
     // Receive a network response.
-    ssize_t ret = c->ReadFull(&p, sizeof(p));
+    ssize_t ret = c->ReadFull(&p, sizeof(p), &ts);
     if (ret <= 0 || ret > static_cast<ssize_t>(sizeof(p))) {
       if (ret == 0 || ret == -ECONNRESET) break;
       panic("read failed, ret = %ld", ret);
     }
+    uint64_t read_tsc = rdtsc();
 
     // Perform fake work if requested.
     if (p.workn != 0) w->Work(p.workn * 82.0);
 
-    // Send a network request.
-    ssize_t sret = c->WriteFull(&p, ret);
-    if (sret != ret) {
+    // Send a network request, followed by the breakdown if requested.
+    uint64_t done_tsc = rdtsc();
+    ssize_t len = ret;
+    memcpy(resp, &p, sizeof(p));
+    if (p.tag == kBreakdownTag) {
+      payload_breakdown b;
+      b.iokernel_ns = CyclesToNs(ts.iok_tsc, ts.enq_tsc);
+      b.softirq_ns = CyclesToNs(ts.enq_tsc, ts.softirq_tsc);
+      b.wait_ns = CyclesToNs(ts.softirq_tsc, read_tsc);
+      b.work_ns = CyclesToNs(read_tsc, done_tsc);
+      b.tx_ns = last_tx_ns;
+      memcpy(resp + sizeof(p), &b, sizeof(b));
+      len += sizeof(b);
+    }
+    ssize_t sret = c->WriteFull(resp, len);
+    if (sret != len) {
       if (sret == -EPIPE || sret == -ECONNRESET) break;
       panic("write failed, ret = %ld", sret);
     }
+    last_tx_ns = CyclesToNs(done_tsc, rdtsc());
   }
 }
 
-void ServerHandler(void *arg) {
-  std::unique_ptr<rt::TcpQueue> q(rt::TcpQueue::Listen({0, kNetbenchPort},
-				  4096));
+template <typename P>
+void ServerHandler() {
+  P::Spawn([]{ UptimeServer<P>(); });
+
+  std::unique_ptr<typename P::TcpQueue> q(
+      P::TcpQueue::Listen({0, kNetbenchPort}, 4096));
   if (q == nullptr) panic("couldn't listen for connections");
 
   while (true) {
-    rt::TcpConn *c = q->Accept();
+    typename P::TcpConn *c = q->Accept();
     if (c == nullptr) panic("couldn't accept a connection");
-    rt::Thread([=]{ServerWorker(std::unique_ptr<rt::TcpConn>(c));}).Detach();
+    P::Spawn([=]{
+      ServerWorker<P>(std::unique_ptr<typename P::TcpConn>(c));
+    });
   }
 }
 
-std::vector<double> PoissonWorker(rt::TcpConn *c, double req_rate,
-                                  double service_time, rt::WaitGroup *starter)
+template <typename P>
+std::vector<double> PoissonWorker(typename P::TcpConn *c, double req_rate,
+                                  double service_time,
+                                  typename P::WaitGroup *starter,
+                                  std::vector<payload_breakdown> *breakdowns)
 {
   constexpr int kBatchSize = 32;
 
@@ -108,12 +204,14 @@ std::vector<double> PoissonWorker(rt::TcpConn *c, double req_rate,
   std::vector<uint64_t> start_us(n);
 
   // Start the receiver thread.
-  auto th = rt::Thread([&]{
+  typename P::Thread th([&]{
+    char buf[sizeof(payload) + sizeof(payload_breakdown)];
+    ssize_t len = sizeof(payload) + (breakdown ? sizeof(payload_breakdown) : 0);
     payload rp;
 
     while (true) {
-     ssize_t ret = c->ReadFull(&rp, sizeof(rp));
-     if (ret != static_cast<ssize_t>(sizeof(rp))) {
+     ssize_t ret = c->ReadFull(buf, len);
+     if (ret != len) {
        if (ret == 0 || ret < 0) break;
        panic("read failed, ret = %ld", ret);
      }
@@ -121,7 +219,13 @@ std::vector<double> PoissonWorker(rt::TcpConn *c, double req_rate,
      barrier();
      uint64_t ts = microtime();
      barrier();
+     memcpy(&rp, buf, sizeof(rp));
      timings.push_back(ts - start_us[rp.idx]);
+     if (breakdown) {
+       payload_breakdown b;
+       memcpy(&b, buf + sizeof(rp), sizeof(b));
+       breakdowns->push_back(b);
+     }
     }
   });
 
@@ -147,7 +251,7 @@ std::vector<double> PoissonWorker(rt::TcpConn *c, double req_rate,
         panic("write failed, ret = %ld", ret);
       j = 0;
 
-      rt::Sleep(sched[i] - (microtime() - expstart));
+      P::Sleep(sched[i] - (microtime() - expstart));
       now = microtime();
     }
     if (now - expstart - sched[i] > kMaxCatchUpUS)
@@ -160,7 +264,7 @@ std::vector<double> PoissonWorker(rt::TcpConn *c, double req_rate,
     // Enqueue a network request.
     p[j].idx = i;
     p[j].workn = work[i];
-    p[j].tag = 0;
+    p[j].tag = breakdown ? kBreakdownTag : 0;
     j++;
 
     if (j >= kBatchSize || i == n - 1) {
@@ -177,23 +281,28 @@ std::vector<double> PoissonWorker(rt::TcpConn *c, double req_rate,
   return timings;
 }
 
-std::vector<double> RunExperiment(double req_rate, double *reqs_per_sec) {
+template <typename P>
+std::vector<double> RunExperiment(double req_rate, double *reqs_per_sec,
+                                  std::vector<payload_breakdown> *breakdowns) {
+  using TcpConn = typename P::TcpConn;
+
   // Create one TCP connection per thread.
-  std::vector<std::unique_ptr<rt::TcpConn>> conns;
+  std::vector<std::unique_ptr<TcpConn>> conns;
   for (int i = 0; i < threads; ++i) {
-    std::unique_ptr<rt::TcpConn> outc(rt::TcpConn::Dial({0, 0}, raddr));
+    std::unique_ptr<TcpConn> outc(TcpConn::Dial({0, 0}, raddr));
     if (unlikely(outc == nullptr)) panic("couldn't connect to raddr.");
     conns.emplace_back(std::move(outc));
   }
 
   // Launch a worker thread for each connection.
-  rt::WaitGroup starter(threads + 1);
-  std::vector<rt::Thread> th;
+  typename P::WaitGroup starter(threads + 1);
+  std::vector<typename P::Thread> th;
   std::unique_ptr<std::vector<double>> samples[threads];
+  std::vector<std::vector<payload_breakdown>> bds(threads);
   for (int i = 0; i < threads; ++i) {
-    th.emplace_back(rt::Thread([&, i]{
-      auto v = PoissonWorker(conns[i].get(), req_rate / threads, st,
-                             &starter);
+    th.emplace_back(typename P::Thread([&, i]{
+      auto v = PoissonWorker<P>(conns[i].get(), req_rate / threads, st,
+                                &starter, &bds[i]);
       samples[i].reset(new std::vector<double>(std::move(v)));
     }));
   }
@@ -230,6 +339,10 @@ std::vector<double> RunExperiment(double req_rate, double *reqs_per_sec) {
     v.erase(v.begin(), v.begin() + kDiscardSamples);
     v.erase(v.end() - kDiscardSamples, v.end());
     timings.insert(timings.end(), v.begin(), v.end());
+    if (!breakdown) continue;
+    auto &b = bds[i];
+    breakdowns->insert(breakdowns->end(), b.begin() + kDiscardSamples,
+                       b.end() - kDiscardSamples);
   }
 
   // Report results.
@@ -238,16 +351,39 @@ std::vector<double> RunExperiment(double req_rate, double *reqs_per_sec) {
   return timings;
 }
 
+// Prints the mean and 99th percentile of each stage of the breakdowns, in us.
+void PrintBreakdown(const std::vector<payload_breakdown> &breakdowns) {
+  auto stage = [&](const char *name, uint32_t payload_breakdown::*field) {
+    std::vector<uint32_t> v;
+    v.reserve(breakdowns.size());
+    for (const auto &b : breakdowns) v.push_back(b.*field);
+    std::sort(v.begin(), v.end());
+    double mean = std::accumulate(v.begin(), v.end(), 0.0) / v.size();
+    std::cout << " " << name << ": " << mean / 1000.0 << "/"
+              << v[v.size() * 0.99] / 1000.0;
+  };
+
+  std::cout << std::setprecision(2) << std::fixed << "breakdown mean/99%:";
+  stage("iokernel", &payload_breakdown::iokernel_ns);
+  stage("softirq", &payload_breakdown::softirq_ns);
+  stage("wait", &payload_breakdown::wait_ns);
+  stage("work", &payload_breakdown::work_ns);
+  stage("tx", &payload_breakdown::tx_ns);
+  std::cout << std::endl;
+}
+
+template <typename P>
 void DoExperiment(double req_rate) {
   constexpr int kRounds = 1;
   std::vector<double> timings;
+  std::vector<payload_breakdown> breakdowns;
   double reqs_per_sec = 0;
   for (int i = 0; i < kRounds; i++) {
     double tmp;
-    auto t = RunExperiment(req_rate, &tmp);
+    auto t = RunExperiment<P>(req_rate, &tmp, &breakdowns);
     timings.insert(timings.end(), t.begin(), t.end());
     reqs_per_sec += tmp;
-    rt::Sleep(500 * rt::kMilliseconds);
+    P::Sleep(500 * rt::kMilliseconds);
   }
   reqs_per_sec /= kRounds;
 
@@ -272,11 +408,13 @@ void DoExperiment(double req_rate) {
             << " 99.9%: "  << p999
             << " 99.99%: " << p9999
             << " max: "    << max << std::endl;
+  if (breakdown) PrintBreakdown(breakdowns);
 }
 
-void ClientHandler(void *arg) {
+template <typename P>
+void ClientHandler() {
   for (double i = 500000; i <= 5000000; i += 500000)
-    DoExperiment(i);
+    DoExperiment<P>(i);
 }
 
 int StringToAddr(const char *str, uint32_t *addr) {
@@ -301,7 +439,7 @@ int main(int argc, char *argv[]) {
 
   std::string cmd = argv[2];
   if (cmd.compare("server") == 0) {
-    ret = runtime_init(argv[1], ServerHandler, NULL);
+    ret = bench::Platform::Run(argv[1], ServerHandler<bench::Platform>);
     if (ret) {
       printf("failed to start runtime\n");
       return ret;
@@ -311,11 +449,12 @@ int main(int argc, char *argv[]) {
     return -EINVAL;
   }
 
-  if (argc != 7) {
-    std::cerr << "usage: [cfg_file] client [#threads] [remote_ip] [n] [service_us]"
-              << std::endl;
+  if (argc != 7 && !(argc == 8 && std::string(argv[7]) == "breakdown")) {
+    std::cerr << "usage: [cfg_file] client [#threads] [remote_ip] [n] [service_us] "
+                 "[breakdown]" << std::endl;
     return -EINVAL;
   }
+  breakdown = argc == 8;
 
   threads = std::stoi(argv[3], nullptr, 0);
 
@@ -326,7 +465,7 @@ int main(int argc, char *argv[]) {
   n = std::stoll(argv[5], nullptr, 0);
   st = std::stod(argv[6], nullptr);
 
-  ret = runtime_init(argv[1], ClientHandler, NULL);
+  ret = bench::Platform::Run(argv[1], ClientHandler<bench::Platform>);
   if (ret) {
     printf("failed to start runtime\n");
     return ret;
@@ -0,0 +1,68 @@
+// platform.h - builds a benchmark for either Shenango or Linux
+//
+// A benchmark written as a template over a platform gets its Linux baseline
+// from the same source, so the two measure exactly the same thing. Each
+// platform provides:
+//
+//   Run(cfg, fn)        runs fn as the benchmark's main thread
+//   Spawn(fn), Thread   start threads, like rt::Spawn() and rt::Thread
+//   WaitGroup           like rt::WaitGroup
+//   TcpConn, TcpQueue,  like their rt:: counterparts, with the methods the
+//   UdpConn             benchmarks use
+//   Sleep(us), Yield()
+//
+// ShenangoPlatform uses runtime threads and the runtime's network stack.
+// LinuxPlatform (platform_linux.h) uses pthreads and kernel sockets, and
+// ignores the config file so both take the same arguments. Building with
+// -DLINUX_BASELINE makes Platform the Linux one. Both get logging
+// (log_info(), panic()) and timekeeping (microtime(), rdtsc(),
+// cycles_per_us) from libbase.
+
+#pragma once
+
+extern "C" {
+#include <base/log.h>
+#include <base/time.h>
+}
+#undef min
+#undef max
+
+#include "net.h"
+#include "platform_linux.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <functional>
+#include <utility>
+
+namespace bench {
+
+struct ShenangoPlatform {
+  using Thread = rt::Thread;
+  using WaitGroup = rt::WaitGroup;
+  using TcpConn = rt::TcpConn;
+  using TcpQueue = rt::TcpQueue;
+  using UdpConn = rt::UdpConn;
+
+  // Starts the runtime with the config file @cfg and runs @fn in it. Only
+  // returns on failure.
+  static int Run(const char *cfg, std::function<void()> fn) {
+    return runtime_init(cfg, [](void *arg) {
+      (*static_cast<std::function<void()> *>(arg))();
+    }, &fn);
+  }
+
+  template <typename F>
+  static void Spawn(F&& fn) { rt::Spawn(std::forward<F>(fn)); }
+  static void Sleep(uint64_t us) { rt::Sleep(us); }
+  static void Yield() { rt::Yield(); }
+};
+
+#ifdef LINUX_BASELINE
+using Platform = LinuxPlatform;
+#else
+using Platform = ShenangoPlatform;
+#endif
+
+} // namespace bench
@@ -0,0 +1,147 @@
+// platform_linux.cc - kernel sockets for the Linux baseline platform
+
+extern "C" {
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// from base/init_internal.h; the Linux baseline only needs timekeeping
+extern int time_init(void);
+}
+
+#include "platform_linux.h"
+
+namespace bench {
+namespace linux_internal {
+namespace {
+
+sockaddr_in ToSockaddr(netaddr addr) {
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(addr.ip);
+  sin.sin_port = htons(addr.port);
+  return sin;
+}
+
+// Opens a socket of @type, bound to @laddr unless it's {0, 0}. Returns a file
+// descriptor, or < 0 on failure.
+int OpenSocket(int type, netaddr laddr) {
+  int fd = socket(AF_INET, type, 0);
+  if (fd < 0) return -errno;
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (laddr.ip == 0 && laddr.port == 0) return fd;
+
+  sockaddr_in sin = ToSockaddr(laddr);
+  if (bind(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+  return fd;
+}
+
+// Opens a socket of @type connected from @laddr to @raddr. Returns a file
+// descriptor, or < 0 on failure.
+int DialSocket(int type, netaddr laddr, netaddr raddr) {
+  int fd = OpenSocket(type, laddr);
+  if (fd < 0) return fd;
+
+  sockaddr_in sin = ToSockaddr(raddr);
+  if (connect(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+  return fd;
+}
+
+ssize_t ErrnoOr(ssize_t ret) { return ret < 0 ? -errno : ret; }
+
+} // anonymous namespace
+
+TcpConn::TcpConn(int fd) : fd_(fd) {
+  int one = 1;
+  setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+TcpConn::~TcpConn() { close(fd_); }
+
+TcpConn *TcpConn::Dial(netaddr laddr, netaddr raddr) {
+  int fd = DialSocket(SOCK_STREAM, laddr, raddr);
+  if (fd < 0) return nullptr;
+  return new TcpConn(fd);
+}
+
+ssize_t TcpConn::Read(void *buf, size_t len) {
+  return ErrnoOr(read(fd_, buf, len));
+}
+
+ssize_t TcpConn::Write(const void *buf, size_t len) {
+  return ErrnoOr(write(fd_, buf, len));
+}
+
+int TcpConn::Shutdown(int how) { return ErrnoOr(shutdown(fd_, how)); }
+
+void TcpConn::Abort() {
+  linger l = {1, 0};
+  setsockopt(fd_, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+  shutdown(fd_, SHUT_RDWR);
+}
+
+TcpQueue::~TcpQueue() { close(fd_); }
+
+TcpQueue *TcpQueue::Listen(netaddr laddr, int backlog) {
+  int fd = OpenSocket(SOCK_STREAM, laddr);
+  if (fd < 0) return nullptr;
+  if (listen(fd, backlog) < 0) {
+    close(fd);
+    return nullptr;
+  }
+  return new TcpQueue(fd);
+}
+
+TcpConn *TcpQueue::Accept() {
+  int fd = accept(fd_, nullptr, nullptr);
+  if (fd < 0) return nullptr;
+  return new TcpConn(fd);
+}
+
+void TcpQueue::Shutdown() { shutdown(fd_, SHUT_RDWR); }
+
+UdpConn::~UdpConn() { close(fd_); }
+
+UdpConn *UdpConn::Dial(netaddr laddr, netaddr raddr) {
+  int fd = DialSocket(SOCK_DGRAM, laddr, raddr);
+  if (fd < 0) return nullptr;
+  return new UdpConn(fd);
+}
+
+ssize_t UdpConn::Read(void *buf, size_t len) {
+  return ErrnoOr(recv(fd_, buf, len, 0));
+}
+
+ssize_t UdpConn::Write(const void *buf, size_t len) {
+  return ErrnoOr(send(fd_, buf, len, 0));
+}
+
+void UdpConn::Shutdown() { shutdown(fd_, SHUT_RDWR); }
+
+} // namespace linux_internal
+
+int LinuxPlatform::Run(const char *cfg, std::function<void()> fn) {
+  int ret = time_init();
+  if (ret) return ret;
+  // report broken connections as -EPIPE instead of dying
+  signal(SIGPIPE, SIG_IGN);
+  fn();
+  return 0;
+}
+
+} // namespace bench
@@ -0,0 +1,182 @@
+// platform_linux.h - the Linux baseline platform for benchmarks (see
+// platform.h)
+//
+// This header stays clear of the kernel's socket headers, which clash with
+// Shenango's net/ip.h; the sockets live in platform_linux.cc.
+
+#pragma once
+
+extern "C" {
+#include <runtime/net.h>
+#include <sys/types.h>
+}
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace bench {
+namespace linux_internal {
+
+class Thread {
+ public:
+  Thread() { }
+  explicit Thread(std::function<void()> fn) : th_(std::move(fn)) { }
+  Thread(Thread&& t) = default;
+  Thread& operator=(Thread&& t) = default;
+
+  void Join() { th_.join(); }
+  void Detach() { th_.detach(); }
+
+ private:
+  std::thread th_;
+};
+
+class WaitGroup {
+ public:
+  WaitGroup() : cnt_(0) { }
+  explicit WaitGroup(int count) : cnt_(count) { }
+
+  void Add(int count) {
+    std::lock_guard<std::mutex> l(mu_);
+    cnt_ += count;
+    if (cnt_ == 0) cv_.notify_all();
+  }
+  void Done() { Add(-1); }
+  void Wait() {
+    std::unique_lock<std::mutex> l(mu_);
+    cv_.wait(l, [this] { return cnt_ == 0; });
+  }
+
+ private:
+  std::mutex mu_;
+  std::condition_variable cv_;
+  int cnt_;
+
+  WaitGroup(const WaitGroup&) = delete;
+  WaitGroup& operator=(const WaitGroup&) = delete;
+};
+
+// A TCP connection on a kernel socket. Failures return -errno.
+class TcpConn {
+ public:
+  ~TcpConn();
+
+  static TcpConn *Dial(netaddr laddr, netaddr raddr);
+
+  ssize_t Read(void *buf, size_t len);
+  ssize_t Write(const void *buf, size_t len);
+
+  // Reads exactly @len bytes. Returns @len, or <= 0 on EOF or failure.
+  ssize_t ReadFull(void *buf, size_t len) {
+    char *pos = reinterpret_cast<char *>(buf);
+    size_t n = 0;
+    while (n < len) {
+      ssize_t ret = Read(pos + n, len - n);
+      if (ret <= 0) return ret;
+      n += ret;
+    }
+    return n;
+  }
+
+  // The kernel doesn't timestamp reads, so @ts is zeroed.
+  ssize_t ReadFull(void *buf, size_t len, net_rx_ts *ts) {
+    *ts = net_rx_ts();
+    return ReadFull(buf, len);
+  }
+
+  // Writes exactly @len bytes. Returns @len, or < 0 on failure.
+  ssize_t WriteFull(const void *buf, size_t len) {
+    const char *pos = reinterpret_cast<const char *>(buf);
+    size_t n = 0;
+    while (n < len) {
+      ssize_t ret = Write(pos + n, len - n);
+      if (ret < 0) return ret;
+      n += ret;
+    }
+    return n;
+  }
+
+  int Shutdown(int how);
+
+  // Resets the connection instead of closing it cleanly.
+  void Abort();
+
+ private:
+  friend class TcpQueue;
+
+  explicit TcpConn(int fd);
+
+  int fd_;
+
+  TcpConn(const TcpConn&) = delete;
+  TcpConn& operator=(const TcpConn&) = delete;
+};
+
+class TcpQueue {
+ public:
+  ~TcpQueue();
+
+  static TcpQueue *Listen(netaddr laddr, int backlog);
+
+  // Returns the next connection, or nullptr once shut down.
+  TcpConn *Accept();
+
+  void Shutdown();
+
+ private:
+  explicit TcpQueue(int fd) : fd_(fd) { }
+
+  int fd_;
+
+  TcpQueue(const TcpQueue&) = delete;
+  TcpQueue& operator=(const TcpQueue&) = delete;
+};
+
+// A connected UDP socket. Failures return -errno.
+class UdpConn {
+ public:
+  ~UdpConn();
+
+  static UdpConn *Dial(netaddr laddr, netaddr raddr);
+
+  ssize_t Read(void *buf, size_t len);
+  ssize_t Write(const void *buf, size_t len);
+
+  // Makes reads return 0 and writes fail with -EPIPE.
+  void Shutdown();
+
+ private:
+  explicit UdpConn(int fd) : fd_(fd) { }
+
+  int fd_;
+
+  UdpConn(const UdpConn&) = delete;
+  UdpConn& operator=(const UdpConn&) = delete;
+};
+
+} // namespace linux_internal
+
+struct LinuxPlatform {
+  using Thread = linux_internal::Thread;
+  using WaitGroup = linux_internal::WaitGroup;
+  using TcpConn = linux_internal::TcpConn;
+  using TcpQueue = linux_internal::TcpQueue;
+  using UdpConn = linux_internal::UdpConn;
+
+  // Runs @fn, ignoring @cfg. Returns once @fn does, or on failure.
+  static int Run(const char *cfg, std::function<void()> fn);
+
+  template <typename F>
+  static void Spawn(F&& fn) { std::thread(std::forward<F>(fn)).detach(); }
+  static void Sleep(uint64_t us) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+  }
+  // The kernel preempts threads on its own.
+  static void Yield() { }
+};
+
+} // namespace bench
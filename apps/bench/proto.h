@@ -25,3 +25,63 @@ struct payload {
   double workn;
   char pad[];
 };
+
+// A netbench request with this tag is answered with a payload_breakdown
+// after the echoed payload.
+constexpr uint32_t kBreakdownTag = 0x62726b64; // 'brkd'
+
+// Where a request spent its time on the server, in nanoseconds. The first two
+// stages come from the request's net_rx_ts, the rest from the server thread.
+struct payload_breakdown {
+  uint32_t iokernel_ns;   // polled from the NIC to queued to the runtime
+  uint32_t softirq_ns;    // queued to handled by the runtime's softirq
+  uint32_t wait_ns;       // handled to read by the server thread
+  uint32_t work_ns;       // read to finishing its fake work
+  uint32_t tx_ns;         // finishing the work to queueing the response to
+                          // the iokernel, for the connection's previous
+                          // request (this one's isn't known yet)
+};
+
+// loadgen agents take their orders on this port.
+constexpr uint64_t kLoadgenPort = 8003;
+
+// Asks an agent to generate its share of the load. The agent replies with
+// kMagic once its connections are up, then waits for kMagic again to start,
+// so every machine starts at about the same time.
+struct loadgen_req {
+  uint32_t magic;
+  int nconns;
+  uint32_t server_ip;
+  uint16_t server_port;
+  uint8_t arrival;        // how requests are spaced (a Distribution::Kind)
+  uint8_t service;        // how long requests take (a Distribution::Kind)
+  double rps;             // the agent's share of the offered load
+  double service_us;      // the mean service time
+  uint64_t duration_us;   // how long to generate load, including warmup
+};
+
+// An agent's results, followed by its latency Histogram (see histogram.h).
+struct loadgen_resp {
+  uint32_t magic;
+  uint64_t sent;          // requests sent after the warmup
+  uint64_t late;          // ... of which the agent sent late
+  uint64_t received;      // ... of which were answered
+  uint64_t window_us;     // how long the measured part of the run took
+};
+
+// The tcpbench server listens on this port.
+constexpr uint64_t kTcpbenchPort = 8004;
+
+// Starts a tcpbench connection, sent once by the client before any data.
+struct tcpbench_req {
+  uint32_t magic;
+  uint32_t mode;          // 0 streams to the server, 1 echoes requests
+  uint32_t msg_bytes;     // the size of each write (stream) or request (rpc)
+};
+
+// Sent by the tcpbench server once the client shuts down its side.
+struct tcpbench_resp {
+  uint32_t magic;
+  uint32_t retransmits;   // segments the server resent
+  uint64_t received;      // payload bytes the server read
+};
@@ -0,0 +1,89 @@
+#include "thread.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+using us = std::chrono::duration<double, std::micro>;
+constexpr int kYieldRounds = 1000000;
+constexpr int kSleepRounds = 2000;
+// Short enough that the kthread keeps polling, long enough that it parks.
+constexpr uint64_t kPollSleepUs = 1;
+constexpr uint64_t kParkSleepUs = 2000;
+
+// Returns the cost of a switch between two uthreads (us).
+double MeasureYield() {
+  auto th = rt::Thread([](){
+    for (int i = 0; i < kYieldRounds / 2; ++i)
+      rt::Yield();
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kYieldRounds / 2; ++i)
+    rt::Yield();
+  auto finish = std::chrono::steady_clock::now();
+  th.Join();
+
+  return std::chrono::duration_cast<us>(finish - start).count() / kYieldRounds;
+}
+
+// Returns the median time a sleep of @sleep_us overshoots by (us).
+double MeasureWakeup(uint64_t sleep_us) {
+  std::vector<double> samples;
+
+  samples.reserve(kSleepRounds);
+  for (int i = 0; i < kSleepRounds; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    rt::Sleep(sleep_us);
+    auto finish = std::chrono::steady_clock::now();
+    samples.push_back(
+        std::chrono::duration_cast<us>(finish - start).count() - sleep_us);
+  }
+
+  std::sort(samples.begin(), samples.end());
+  return samples[samples.size() / 2];
+}
+
+void MainHandler(void *arg) {
+  double yield_us = MeasureYield();
+  double poll_us = MeasureWakeup(kPollSleepUs);
+  double park_us = MeasureWakeup(kParkSleepUs);
+  double penalty_us = std::max(park_us - poll_us, 0.0);
+
+  std::cout << "yield took " << yield_us << " us." << std::endl;
+  std::cout << "waking while polling took " << poll_us << " us." << std::endl;
+  std::cout << "waking after parking took " << park_us << " us." << std::endl;
+
+  // Polling for as long as a park and wakeup costs wastes at most half the
+  // time spent idle, whenever work shows up.
+  unsigned int min_poll_us = std::max(1.0, std::ceil(penalty_us));
+  unsigned int poll_iters = std::max(1.0, std::min(64.0, std::ceil(
+      min_poll_us / std::max(yield_us, 0.01))));
+
+  std::cout << "recommended settings:" << std::endl;
+  std::cout << "runtime_sched_min_poll_us " << min_poll_us << std::endl;
+  std::cout << "runtime_sched_poll_iters " << poll_iters << std::endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 2) {
+    printf("arg must be config file\n");
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
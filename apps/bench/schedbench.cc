@@ -0,0 +1,287 @@
+// schedbench.cc - microbenchmarks for the scheduler
+//
+// Measures the scheduling paths in sched.c and kthread.c one at a time and
+// prints one CSV row per benchmark. Parallel benchmarks use as many threads
+// as the runtime has kthreads, so run it with configs that differ in
+// runtime_kthreads to see how each path scales; the kthread count is part of
+// every row. Cross-kthread benchmarks need at least two kthreads and work
+// best with runtime_spinning_kthreads set, otherwise they also measure how
+// long the iokernel takes to grant a core.
+
+extern "C" {
+#include <asm/ops.h>
+#include <base/time.h>
+#include <runtime/thread.h>
+}
+
+#include "histogram.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr int kSpawnRounds = 200000;
+constexpr int kPingPongRounds = 200000;
+constexpr int kStealRounds = 20000;
+constexpr int kMutexRounds = 200000;
+constexpr int kCondVarRounds = 200000;
+constexpr int kTimerRounds = 2000;
+constexpr int kParkRounds = 500;
+// Long enough for every kthread to give up polling and park.
+constexpr uint64_t kParkSleepUs = 2000;
+// How many times to spin before yielding to threads on the same kthread.
+constexpr int kSpinsPerYield = 4096;
+
+unsigned int kthreads;
+
+uint64_t TscToNs(uint64_t tsc) { return tsc * 1000 / cycles_per_us; }
+
+// A benchmark's samples; each sample is one operation in nanoseconds.
+struct result {
+  result() : ops(0), elapsed_tsc(0), h(new Histogram()) { }
+
+  uint64_t ops;
+  uint64_t elapsed_tsc;
+  std::unique_ptr<Histogram> h;
+};
+
+// Spins until @cond holds. Yields now and then, so the thread that should
+// make it hold gets to run even if no other kthread steals it.
+template <typename F>
+void SpinUntil(F cond) {
+  int spins = 0;
+  while (!cond()) {
+    cpu_relax();
+    if (++spins == kSpinsPerYield) {
+      spins = 0;
+      rt::Yield();
+    }
+  }
+}
+
+// Spawns and joins threads from every kthread in parallel.
+void BenchSpawnJoin(result *r) {
+  rt::Spin lock;
+  std::vector<rt::Thread> th;
+
+  for (unsigned int i = 0; i < kthreads; ++i) {
+    th.emplace_back(rt::Thread([&] {
+      std::unique_ptr<Histogram> h(new Histogram());
+      for (int j = 0; j < kSpawnRounds; ++j) {
+        uint64_t start = rdtsc();
+        rt::Thread([] { }).Join();
+        h->Record(TscToNs(rdtsc() - start));
+      }
+      rt::ScopedLock<rt::Spin> l(&lock);
+      r->h->Merge(*h);
+    }));
+  }
+  for (auto &t : th) t.Join();
+}
+
+// Bounces a flag between two threads that spin, which end up on different
+// kthreads once one of them is stolen. Samples are round trips.
+void BenchPingPong(result *r) {
+  std::atomic<int> turn(0);
+  std::atomic<bool> done(false);
+
+  rt::Thread th([&] {
+    while (true) {
+      SpinUntil([&] { return turn.load() == 1 || done.load(); });
+      if (done.load()) break;
+      turn.store(0);
+    }
+  });
+
+  for (int i = 0; i < kPingPongRounds; ++i) {
+    uint64_t start = rdtsc();
+    turn.store(1);
+    SpinUntil([&] { return turn.load() == 0; });
+    r->h->Record(TscToNs(rdtsc() - start));
+  }
+  done.store(true);
+  th.Join();
+}
+
+// Spawns a thread while keeping the local kthread busy, so the thread only
+// runs once another kthread steals it. Samples are spawn to first run.
+void BenchSteal(result *r) {
+  for (int i = 0; i < kStealRounds; ++i) {
+    std::atomic<uint64_t> ran(0);
+    uint64_t start = rdtsc();
+    rt::Spawn([&] { ran.store(rdtsc()); });
+    SpinUntil([&] { return ran.load() != 0; });
+    r->h->Record(TscToNs(ran.load() - start));
+  }
+}
+
+// Has two threads per kthread fight over one mutex. Samples are the time to
+// acquire it.
+void BenchMutex(result *r) {
+  rt::Mutex m;
+  rt::Spin lock;
+  std::vector<rt::Thread> th;
+  volatile unsigned long foo = 0;
+
+  for (unsigned int i = 0; i < kthreads * 2; ++i) {
+    th.emplace_back(rt::Thread([&] {
+      std::unique_ptr<Histogram> h(new Histogram());
+      for (int j = 0; j < kMutexRounds; ++j) {
+        uint64_t start = rdtsc();
+        m.Lock();
+        h->Record(TscToNs(rdtsc() - start));
+        foo++;
+        m.Unlock();
+      }
+      rt::ScopedLock<rt::Spin> l(&lock);
+      r->h->Merge(*h);
+    }));
+  }
+  for (auto &t : th) t.Join();
+}
+
+// Hands a turn back and forth between two threads with a condition
+// variable, so every handoff blocks one and wakes the other. Samples are
+// round trips.
+void BenchCondVar(result *r) {
+  rt::Mutex m;
+  rt::CondVar cv;
+  bool dir = false; // shared and protected by @m.
+
+  rt::Thread th([&] {
+    rt::ScopedLock<rt::Mutex> l(&m);
+    for (int i = 0; i < kCondVarRounds; ++i) {
+      while (!dir) cv.Wait(&m);
+      dir = false;
+      cv.Signal();
+    }
+  });
+
+  {
+    rt::ScopedLock<rt::Mutex> l(&m);
+    for (int i = 0; i < kCondVarRounds; ++i) {
+      uint64_t start = rdtsc();
+      dir = true;
+      cv.Signal();
+      while (dir) cv.Wait(&m);
+      r->h->Record(TscToNs(rdtsc() - start));
+    }
+  }
+  th.Join();
+}
+
+// Samples how late sleeps of @sleep_us wake up.
+void MeasureOvershoot(result *r, uint64_t sleep_us, int rounds) {
+  for (int i = 0; i < rounds; ++i) {
+    uint64_t start = rdtsc();
+    rt::Sleep(sleep_us);
+    uint64_t ns = TscToNs(rdtsc() - start);
+    r->h->Record(ns > sleep_us * 1000 ? ns - sleep_us * 1000 : 0);
+  }
+}
+
+void BenchTimer1(result *r) { MeasureOvershoot(r, 1, kTimerRounds); }
+void BenchTimer10(result *r) { MeasureOvershoot(r, 10, kTimerRounds); }
+void BenchTimer100(result *r) { MeasureOvershoot(r, 100, kTimerRounds); }
+
+// Sleeps long enough for every kthread to park, so waking up takes a round
+// trip through the iokernel. Samples are how late the sleeps wake up.
+void BenchParkWake(result *r) {
+  MeasureOvershoot(r, kParkSleepUs, kParkRounds);
+}
+
+struct benchmark {
+  const char *name;
+  void (*fn)(result *r);
+  unsigned int min_kthreads;
+};
+
+const benchmark benchmarks[] = {
+  {"spawn_join", BenchSpawnJoin, 1},
+  {"pingpong", BenchPingPong, 2},
+  {"steal", BenchSteal, 2},
+  {"mutex", BenchMutex, 1},
+  {"condvar", BenchCondVar, 1},
+  {"timer_1us", BenchTimer1, 1},
+  {"timer_10us", BenchTimer10, 1},
+  {"timer_100us", BenchTimer100, 1},
+  {"park_wake", BenchParkWake, 1},
+};
+
+void RunBenchmark(const benchmark &b) {
+  if (kthreads < b.min_kthreads) {
+    std::cerr << "skipping '" << b.name << "', it needs " << b.min_kthreads
+              << " kthreads" << std::endl;
+    return;
+  }
+
+  result r;
+  uint64_t start = rdtsc();
+  b.fn(&r);
+  r.elapsed_tsc = rdtsc() - start;
+  r.ops = r.h->Count();
+
+  double secs = static_cast<double>(TscToNs(r.elapsed_tsc)) / 1e9;
+  std::cout << b.name << ","
+            << kthreads << ","
+            << r.ops << ","
+            << static_cast<uint64_t>(r.ops / secs) << ","
+            << static_cast<uint64_t>(r.h->Mean()) << ","
+            << r.h->ValueAt(0.5) << ","
+            << r.h->ValueAt(0.99) << ","
+            << r.h->ValueAt(0.999) << ","
+            << r.h->Max() << std::endl;
+}
+
+std::vector<std::string> names;
+
+void MainHandler(void *arg) {
+  kthreads = runtime_max_cores();
+
+  std::cout << "benchmark,kthreads,ops,ops_per_sec,mean_ns,p50_ns,p99_ns,"
+               "p999_ns,max_ns" << std::endl;
+  for (const benchmark &b : benchmarks) {
+    if (!names.empty() &&
+        std::find(names.begin(), names.end(), b.name) == names.end()) {
+      continue;
+    }
+    RunBenchmark(b);
+  }
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 2) {
+    std::cerr << "usage: [cfg_file] [benchmark]..." << std::endl;
+    return -EINVAL;
+  }
+
+  for (int i = 2; i < argc; ++i) {
+    bool found = false;
+    for (const benchmark &b : benchmarks)
+      found |= std::string(b.name) == argv[i];
+    if (!found) {
+      std::cerr << "unknown benchmark: " << argv[i] << std::endl;
+      return -EINVAL;
+    }
+    names.emplace_back(argv[i]);
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
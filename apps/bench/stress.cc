@@ -1,12 +1,4 @@
-extern "C" {
-#include <base/log.h>
-#undef min
-#undef max
-}
-
-#include "thread.h"
-#include "sync.h"
-#include "timer.h"
+#include "platform.h"
 #include "fake_worker.h"
 
 #include <iostream>
@@ -18,12 +10,13 @@ int threads;
 uint64_t n;
 std::string worker_spec;
 
-void MainHandler(void *arg) {
-  rt::WaitGroup wg(1);
+template <typename P>
+void MainHandler() {
+  typename P::WaitGroup wg(1);
   uint64_t cnt[threads] = {};
 
   for (int i = 0; i < threads; ++i) {
-    rt::Spawn([&,i](){
+    P::Spawn([&,i](){
       auto *w = FakeWorkerFactory(worker_spec);
       if (w == nullptr) {
         std::cerr << "Failed to create worker." << std::endl;
@@ -33,16 +26,16 @@ void MainHandler(void *arg) {
       while (true) {
         w->Work(n);
         cnt[i]++;
-        rt::Yield();
+        P::Yield();
       }
     });
   }
 
-  rt::Spawn([&](){
+  P::Spawn([&](){
     uint64_t last_total = 0;
     auto last = std::chrono::steady_clock::now();
     while (1) {
-      rt::Sleep(rt::kSeconds);
+      P::Sleep(rt::kSeconds);
       auto now = std::chrono::steady_clock::now();
       uint64_t total = 0;
       double duration = std::chrono::duration_cast<
@@ -73,7 +66,7 @@ int main(int argc, char *argv[]) {
   n = std::stoul(argv[3], nullptr, 0);
   worker_spec = std::string(argv[4]);
 
-  ret = runtime_init(argv[1], MainHandler, NULL);
+  ret = bench::Platform::Run(argv[1], MainHandler<bench::Platform>);
   if (ret) {
     printf("failed to start runtime\n");
     return ret;
@@ -0,0 +1,295 @@
+// tcpbench.cc - goodput and latency of the TCP stack
+//
+// Runs bulk transfers ("stream") or fixed-size echoes ("rpc") over a number
+// of connections for a fixed time and prints one CSV line: goodput, the
+// segments both ends retransmitted, the client's smoothed RTT, and, for rpc,
+// the latency percentiles. Pair it with the iokernel's loopback bench mode
+// (bench_loop, with bench_drop, bench_delay, and bench_reorder), which runs
+// the client and server runtimes back to back on one machine over a path
+// with reproducible loss and reordering, to compare congestion control, loss
+// recovery, and RTO changes:
+//
+//   iokerneld bench_loop bench_drop=1 bench_delay=50
+//   tcpbench server.config server
+//   tcpbench client.config client <server_ip> stream 4 65536 5000000
+
+extern "C" {
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ip.h>
+#include <runtime/tcp.h>
+}
+#undef min
+#undef max
+
+#include "histogram.h"
+#include "net.h"
+#include "proto.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+enum : uint32_t {
+  kStream = 0,
+  kRpc,
+};
+
+// The largest write or request size.
+constexpr uint32_t kMaxMsgBytes = 1 << 20;
+// How much the server reads at once when streaming.
+constexpr size_t kReadBytes = 1 << 16;
+// The fraction of each rpc run that is warmup and isn't measured.
+constexpr double kWarmupFraction = 0.1;
+
+void ServerWorker(std::unique_ptr<rt::TcpConn> c) {
+  tcpbench_req req;
+  ssize_t ret = c->ReadFull(&req, sizeof(req));
+  if (ret != static_cast<ssize_t>(sizeof(req)) || req.magic != kMagic ||
+      req.mode > kRpc || req.msg_bytes == 0 || req.msg_bytes > kMaxMsgBytes) {
+    if (ret != 0 && ret != -ECONNRESET) log_err("got an invalid request");
+    return;
+  }
+
+  std::unique_ptr<char[]> buf(
+      new char[std::max<size_t>(req.msg_bytes, kReadBytes)]);
+  tcpbench_resp resp;
+  resp.magic = kMagic;
+  resp.received = 0;
+
+  // Either way, the client shutting down its side ends the run.
+  if (req.mode == kStream) {
+    while ((ret = c->Read(buf.get(), kReadBytes)) > 0) resp.received += ret;
+  } else {
+    while ((ret = c->ReadFull(buf.get(), req.msg_bytes)) ==
+           static_cast<ssize_t>(req.msg_bytes)) {
+      resp.received += ret;
+      if (c->WriteFull(buf.get(), req.msg_bytes) != ret) return;
+    }
+  }
+  if (ret < 0) {
+    log_err("read failed, ret = %ld", ret);
+    return;
+  }
+
+  tcp_conn_info info;
+  c->GetInfo(&info);
+  resp.retransmits = info.retransmits;
+  if (c->WriteFull(&resp, sizeof(resp)) != sizeof(resp))
+    log_err("couldn't send results");
+}
+
+void ServerHandler(void *arg) {
+  std::unique_ptr<rt::TcpQueue> q(
+      rt::TcpQueue::Listen({0, kTcpbenchPort}, 4096));
+  if (q == nullptr) panic("couldn't listen for connections");
+
+  while (true) {
+    rt::TcpConn *c = q->Accept();
+    if (c == nullptr) panic("couldn't accept a connection");
+    rt::Thread([=] { ServerWorker(std::unique_ptr<rt::TcpConn>(c)); })
+        .Detach();
+  }
+}
+
+// <- ARGUMENTS FOR EXPERIMENT ->
+// the address of the tcpbench server.
+netaddr raddr;
+// kStream or kRpc.
+uint32_t mode;
+// the number of connections to open.
+int conns;
+// the size of each write or request.
+uint32_t msg_bytes;
+// how long to run, in us.
+uint64_t duration;
+
+// The results of one connection, or of many added together.
+struct results {
+  results() : received(0), rpcs(0), retransmits(0), srtt_us(0) { }
+
+  uint64_t received;      // payload bytes the server read
+  uint64_t rpcs;          // requests answered after the warmup
+  uint64_t retransmits;   // segments either end resent
+  uint64_t srtt_us;       // the client's smoothed RTT
+  Histogram h;            // rpc latencies, in nanoseconds
+};
+
+void ClientWorker(rt::TcpConn *c, uint64_t start_tsc, results *r) {
+  std::unique_ptr<char[]> buf(new char[msg_bytes]);
+  uint64_t end_tsc = start_tsc + duration * cycles_per_us;
+  uint64_t warm_tsc = start_tsc +
+      static_cast<uint64_t>(duration * kWarmupFraction) * cycles_per_us;
+  memset(buf.get(), 0, msg_bytes);
+
+  tcpbench_req req;
+  req.magic = kMagic;
+  req.mode = mode;
+  req.msg_bytes = msg_bytes;
+  if (c->WriteFull(&req, sizeof(req)) != sizeof(req))
+    panic("couldn't start a connection");
+
+  while (rdtsc() < end_tsc) {
+    uint64_t start = rdtsc();
+    ssize_t ret = c->WriteFull(buf.get(), msg_bytes);
+    if (ret != static_cast<ssize_t>(msg_bytes))
+      panic("write failed, ret = %ld", ret);
+    if (mode == kStream) continue;
+
+    ret = c->ReadFull(buf.get(), msg_bytes);
+    if (ret != static_cast<ssize_t>(msg_bytes))
+      panic("read failed, ret = %ld", ret);
+    if (start < warm_tsc) continue;
+    r->h.Record((rdtsc() - start) * 1000 / cycles_per_us);
+    r->rpcs++;
+  }
+
+  // The server replies once everything sent has arrived.
+  tcpbench_resp resp;
+  c->Shutdown(SHUT_WR);
+  if (c->ReadFull(&resp, sizeof(resp)) != sizeof(resp) ||
+      resp.magic != kMagic) {
+    panic("couldn't get results from the server");
+  }
+
+  tcp_conn_info info;
+  c->GetInfo(&info);
+  r->received = resp.received;
+  r->retransmits = info.retransmits + resp.retransmits;
+  r->srtt_us = info.srtt;
+}
+
+void PrintResults(const results &r, uint64_t elapsed_us) {
+  auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+  // rpc payloads cross the path twice
+  double bytes = mode == kStream ? r.received : r.received * 2.0;
+
+  std::cout << std::setprecision(2) << std::fixed
+            << (mode == kStream ? "stream" : "rpc") << ","
+            << conns << ","
+            << msg_bytes << ","
+            << elapsed_us << ","
+            << bytes * 8.0 / elapsed_us << ","
+            << r.retransmits << ","
+            << r.srtt_us / conns << ","
+            << r.rpcs << ","
+            << us(r.h.Min()) << ","
+            << r.h.Mean() / 1000.0 << ","
+            << us(r.h.ValueAt(0.5)) << ","
+            << us(r.h.ValueAt(0.9)) << ","
+            << us(r.h.ValueAt(0.99)) << ","
+            << us(r.h.ValueAt(0.999)) << ","
+            << us(r.h.Max()) << std::endl;
+}
+
+void ClientHandler(void *arg) {
+  std::vector<std::unique_ptr<rt::TcpConn>> c;
+  for (int i = 0; i < conns; ++i) {
+    rt::TcpConn *outc = rt::TcpConn::Dial({0, 0}, raddr);
+    if (outc == nullptr) panic("couldn't connect to the server");
+    c.emplace_back(outc);
+  }
+
+  std::vector<std::unique_ptr<results>> res;
+  std::vector<rt::Thread> th;
+  uint64_t start_tsc = rdtsc();
+  for (int i = 0; i < conns; ++i) {
+    res.emplace_back(new results());
+    rt::TcpConn *conn = c[i].get();
+    results *r = res.back().get();
+    th.emplace_back(rt::Thread([=] { ClientWorker(conn, start_tsc, r); }));
+  }
+  for (auto &t : th) t.Join();
+  uint64_t elapsed_us = (rdtsc() - start_tsc) / cycles_per_us;
+
+  std::unique_ptr<results> total(new results());
+  for (auto &r : res) {
+    total->received += r->received;
+    total->rpcs += r->rpcs;
+    total->retransmits += r->retransmits;
+    total->srtt_us += r->srtt_us;
+    total->h.Merge(r->h);
+  }
+
+  std::cout << "mode,conns,msg_bytes,elapsed_us,goodput_mbps,retransmits,"
+               "srtt_us,rpcs,min,mean,p50,p90,p99,p999,max" << std::endl;
+  PrintResults(*total, elapsed_us);
+}
+
+int StringToAddr(const char *str, uint32_t *addr) {
+  uint8_t a, b, c, d;
+
+  if (sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) return -EINVAL;
+
+  *addr = MAKE_IP_ADDR(a, b, c, d);
+  return 0;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 3) {
+    std::cerr << "usage: [cfg_file] [cmd] ..." << std::endl;
+    return -EINVAL;
+  }
+
+  std::string cmd = argv[2];
+  if (cmd.compare("server") == 0) {
+    ret = runtime_init(argv[1], ServerHandler, NULL);
+    if (ret) {
+      printf("failed to start runtime\n");
+      return ret;
+    }
+    return 0;
+  } else if (cmd.compare("client") != 0) {
+    std::cerr << "invalid command: " << cmd << std::endl;
+    return -EINVAL;
+  }
+
+  if (argc < 8) {
+    std::cerr << "usage: [cfg_file] client [server_ip] [stream|rpc] [#conns] "
+                 "[msg_bytes] [duration_us]" << std::endl;
+    return -EINVAL;
+  }
+
+  ret = StringToAddr(argv[3], &raddr.ip);
+  if (ret) return -EINVAL;
+  raddr.port = kTcpbenchPort;
+
+  std::string m = argv[4];
+  if (m == "stream") {
+    mode = kStream;
+  } else if (m == "rpc") {
+    mode = kRpc;
+  } else {
+    std::cerr << "invalid mode: " << m << std::endl;
+    return -EINVAL;
+  }
+
+  conns = std::stoi(argv[5], nullptr, 0);
+  long bytes = std::stol(argv[6], nullptr, 0);
+  duration = std::stoll(argv[7], nullptr, 0);
+  if (conns < 1 || bytes < 1 || bytes > kMaxMsgBytes) {
+    std::cerr << "need at least one connection and 1-" << kMaxMsgBytes
+              << " byte messages" << std::endl;
+    return -EINVAL;
+  }
+  msg_bytes = bytes;
+
+  ret = runtime_init(argv[1], ClientHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+
+  return 0;
+}
@@ -8,7 +8,9 @@
 #include <rte_ethdev.h>
 #include <rte_ip.h>
 #include <rte_lcore.h>
+#include <rte_launch.h>
 #include <rte_mbuf.h>
+#include <rte_thash.h>
 #include <rte_udp.h>
 
 #define RX_RING_SIZE 128
@@ -19,6 +21,26 @@
 #define BURST_SIZE 32
 #define MAX_CORES 64
 #define UDP_MAX_PAYLOAD 1472
+/* the most payload sizes a client can run with, one after another */
+#define MAX_PAYLOADS 16
+/* a request with no reply after this long is counted as lost and resent */
+#define REQ_TIMEOUT_US 10000
+
+/* client latency histograms: 0.1 us buckets up to 1 ms, then one overflow */
+#define HIST_BUCKET_NS 100
+#define HIST_NR_BUCKETS 10000
+
+/*
+ * A fixed RSS key (the common Toeplitz default), so a client can predict which
+ * of its RX queues the replies to each of its UDP ports arrive on.
+ */
+static uint8_t rss_key[40] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
 
 static const struct rte_eth_conf port_conf_default = {
 	.rxmode = {
@@ -28,7 +50,8 @@ static const struct rte_eth_conf port_conf_default = {
 	},
 	.rx_adv_conf = {
 		.rss_conf = {
-			.rss_key = NULL,
+			.rss_key = rss_key,
+			.rss_key_len = sizeof(rss_key),
 			.rss_hf = ETH_RSS_UDP,
 		},
 	},
@@ -68,9 +91,15 @@ static uint32_t my_ip;
 static uint32_t server_ip;
 static int seconds;
 static size_t payload_len;
+static size_t payload_lens[MAX_PAYLOADS];
+static int nr_payload_lens;
 static unsigned int client_port;
 static unsigned int server_port;
-static unsigned int num_queues = 1;
+static unsigned int num_queues;
+static struct ether_addr server_eth;
+/* the RSS redirection table, programmed so entry i is queue i % num_queues */
+static uint16_t reta[ETH_RSS_RETA_SIZE_512];
+static uint16_t reta_size;
 struct ether_addr zero_mac = {
 		.addr_bytes = {0x0, 0x0, 0x0, 0x0, 0x0, 0x0}
 };
@@ -79,6 +108,24 @@ struct ether_addr broadcast_mac = {
 };
 uint16_t next_port = 50000;
 
+/* the state of one client core, which sends on its own queues */
+struct client_core {
+	unsigned int	queue;
+	uint16_t	client_port;
+	uint16_t	server_port;
+	bool		setup_port;
+
+	uint64_t	start_time;
+	uint64_t	end_time;
+	uint64_t	reqs;
+	uint64_t	lost;
+	uint64_t	total_ns;
+	uint64_t	max_ns;
+	uint64_t	hist[HIST_NR_BUCKETS + 1];
+} __rte_cache_aligned;
+
+static struct client_core client_cores[MAX_CORES];
+
 /* dpdk_netperf.c: simple implementation of netperf on DPDK */
 
 static int str_to_ip(const char *str, uint32_t *addr)
@@ -103,6 +150,31 @@ static int str_to_long(const char *str, long *val)
 	return 0;
 }
 
+/*
+ * Spreads RSS evenly over the queues, so replies can be steered by port.
+ */
+static int port_init_reta(uint8_t port, uint16_t size, unsigned int n_queues)
+{
+	struct rte_eth_rss_reta_entry64
+		reta_conf[ETH_RSS_RETA_SIZE_512 / RTE_RETA_GROUP_SIZE];
+	uint16_t i;
+
+	if (size == 0 || size > ETH_RSS_RETA_SIZE_512)
+		return -EINVAL;
+
+	memset(reta_conf, 0, sizeof(reta_conf));
+	for (i = 0; i < size; i++) {
+		reta[i] = i % n_queues;
+		reta_conf[i / RTE_RETA_GROUP_SIZE].mask |=
+			1ULL << (i % RTE_RETA_GROUP_SIZE);
+		reta_conf[i / RTE_RETA_GROUP_SIZE].reta[i % RTE_RETA_GROUP_SIZE] =
+			reta[i];
+	}
+
+	reta_size = size;
+	return rte_eth_dev_rss_reta_update(port, reta_conf, size);
+}
+
 /*
  * Initializes a given port using global settings and with the RX buffers
  * coming from the mbuf_pool passed as a parameter.
@@ -159,6 +231,13 @@ port_init(uint8_t port, struct rte_mempool *mbuf_pool, unsigned int n_queues)
 	if (retval < 0)
 		return retval;
 
+	/* clients must know where RSS sends each reply */
+	if (n_queues > 1) {
+		retval = port_init_reta(port, dev_info.reta_size, n_queues);
+		if (retval < 0 && mode == MODE_UDP_CLIENT)
+			return retval;
+	}
+
 	/* Display the port MAC address. */
 	rte_eth_macaddr_get(port, &my_eth);
 	printf("Port %u MAC: %02" PRIx8 " %02" PRIx8 " %02" PRIx8
@@ -177,7 +256,8 @@ port_init(uint8_t port, struct rte_mempool *mbuf_pool, unsigned int n_queues)
 /*
  * Send out an arp.
  */
-static void send_arp(uint16_t op, struct ether_addr dst_eth, uint32_t dst_ip)
+static void send_arp(uint16_t queue, uint16_t op, struct ether_addr dst_eth,
+		     uint32_t dst_ip)
 {
 	struct rte_mbuf *buf;
 	char *buf_ptr;
@@ -186,8 +266,10 @@ static void send_arp(uint16_t op, struct ether_addr dst_eth, uint32_t dst_ip)
 	int nb_tx;
 
 	buf = rte_pktmbuf_alloc(tx_mbuf_pool);
-	if (buf == NULL)
+	if (buf == NULL) {
 		printf("error allocating arp mbuf\n");
+		return;
+	}
 
 	/* ethernet header */
 	buf_ptr = rte_pktmbuf_append(buf, ETHER_HDR_LEN);
@@ -211,17 +293,18 @@ static void send_arp(uint16_t op, struct ether_addr dst_eth, uint32_t dst_ip)
 	ether_addr_copy(&dst_eth, &a_hdr->arp_data.arp_tha);
 	a_hdr->arp_data.arp_tip = rte_cpu_to_be_32(dst_ip);
 
-	nb_tx = rte_eth_tx_burst(dpdk_port, 0, &buf, 1);
+	nb_tx = rte_eth_tx_burst(dpdk_port, queue, &buf, 1);
 	if (unlikely(nb_tx != 1)) {
 		printf("error: could not send arp packet\n");
+		rte_pktmbuf_free(buf);
 	}
 }
 
 /*
  * Validate this ethernet header. Return true if this packet is for higher
- * layers, false otherwise.
+ * layers, false otherwise. ARP replies are sent on @queue.
  */
-static bool check_eth_hdr(struct rte_mbuf *buf)
+static bool check_eth_hdr(struct rte_mbuf *buf, uint16_t queue)
 {
 	struct ether_hdr *ptr_mac_hdr;
 	struct arp_hdr *a_hdr;
@@ -239,7 +322,7 @@ static bool check_eth_hdr(struct rte_mbuf *buf)
 				sizeof(struct ether_hdr));
 		if (a_hdr->arp_op == rte_cpu_to_be_16(ARP_OP_REQUEST)
 				&& a_hdr->arp_data.arp_tip == rte_cpu_to_be_32(my_ip))
-			send_arp(ARP_OP_REPLY, a_hdr->arp_data.arp_sha,
+			send_arp(queue, ARP_OP_REPLY, a_hdr->arp_data.arp_sha,
 					rte_be_to_cpu_32(a_hdr->arp_data.arp_sip));
 		return false;
 	}
@@ -269,25 +352,207 @@ static bool check_ip_hdr(struct rte_mbuf *buf)
 }
 
 /*
- * Run a netperf client
+ * Returns the RX queue RSS delivers a UDP packet with these addresses to.
+ */
+static unsigned int rss_queue(uint32_t src_ip, uint32_t dst_ip,
+			      uint16_t src_port, uint16_t dst_port)
+{
+	struct rte_ipv4_tuple tuple;
+	uint32_t hash;
+
+	tuple.src_addr = src_ip;
+	tuple.dst_addr = dst_ip;
+	tuple.sport = src_port;
+	tuple.dport = dst_port;
+	hash = rte_softrss((uint32_t *) &tuple, RTE_THASH_V4_L4_LEN, rss_key);
+	return reta[hash % reta_size];
+}
+
+/*
+ * Picks the first client port from @start whose replies from @srv_port arrive
+ * on @queue. With one queue, that's @start itself.
  */
-static void do_client(uint8_t port)
+static uint16_t pick_client_port(unsigned int queue, uint16_t start,
+				 uint16_t srv_port)
+{
+	uint32_t port;
+
+	if (num_queues == 1)
+		return start;
+
+	for (port = start; port <= UINT16_MAX; port++) {
+		if (rss_queue(server_ip, my_ip, srv_port, port) == queue)
+			return port;
+	}
+
+	rte_exit(EXIT_FAILURE, "no client port maps to queue %u\n", queue);
+}
+
+/*
+ * Get the MAC address of the server via ARP, on queue 0.
+ */
+static void client_arp_server(uint8_t port)
 {
-	uint64_t start_time, end_time;
 	struct rte_mbuf *bufs[BURST_SIZE];
-	struct rte_mbuf *buf;
 	struct ether_hdr *ptr_mac_hdr;
 	struct arp_hdr *a_hdr;
+	uint16_t nb_rx, i;
+	bool found = false;
+
+	while (!found) {
+		send_arp(0, ARP_OP_REQUEST, broadcast_mac, server_ip);
+		sleep(1);
+
+		nb_rx = rte_eth_rx_burst(port, 0, bufs, BURST_SIZE);
+		for (i = 0; i < nb_rx; i++) {
+			ptr_mac_hdr = rte_pktmbuf_mtod(bufs[i], struct ether_hdr *);
+			if (found ||
+			    !is_same_ether_addr(&ptr_mac_hdr->d_addr, &my_eth) ||
+			    ptr_mac_hdr->ether_type != rte_cpu_to_be_16(ETHER_TYPE_ARP))
+				goto next;
+
+			a_hdr = rte_pktmbuf_mtod_offset(bufs[i], struct arp_hdr *,
+					sizeof(struct ether_hdr));
+			if (a_hdr->arp_op == rte_cpu_to_be_16(ARP_OP_REPLY) &&
+			    is_same_ether_addr(&a_hdr->arp_data.arp_tha, &my_eth) &&
+			    a_hdr->arp_data.arp_tip == rte_cpu_to_be_32(my_ip)) {
+				/* got a response from server! */
+				ether_addr_copy(&a_hdr->arp_data.arp_sha, &server_eth);
+				found = true;
+			}
+		next:
+			rte_pktmbuf_free(bufs[i]);
+		}
+	}
+}
+
+/*
+ * Build a request from this client core.
+ */
+static struct rte_mbuf *client_build_req(struct client_core *c)
+{
+	struct rte_mbuf *buf;
 	char *buf_ptr;
 	struct ether_hdr *eth_hdr;
 	struct ipv4_hdr *ipv4_hdr;
 	struct udp_hdr *udp_hdr;
-	uint16_t nb_tx, nb_rx, i;
-	uint64_t reqs = 0;
-	struct ether_addr server_eth;
 	struct nbench_req *control_req;
+
+	buf = rte_pktmbuf_alloc(tx_mbuf_pool);
+	if (buf == NULL) {
+		printf("error allocating tx mbuf\n");
+		return NULL;
+	}
+
+	/* ethernet header */
+	buf_ptr = rte_pktmbuf_append(buf, ETHER_HDR_LEN);
+	eth_hdr = (struct ether_hdr *) buf_ptr;
+
+	ether_addr_copy(&my_eth, &eth_hdr->s_addr);
+	ether_addr_copy(&server_eth, &eth_hdr->d_addr);
+	eth_hdr->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+	/* IPv4 header */
+	buf_ptr = rte_pktmbuf_append(buf, sizeof(struct ipv4_hdr));
+	ipv4_hdr = (struct ipv4_hdr *) buf_ptr;
+	ipv4_hdr->version_ihl = 0x45;
+	ipv4_hdr->type_of_service = 0;
+	ipv4_hdr->total_length = rte_cpu_to_be_16(sizeof(struct ipv4_hdr) +
+			sizeof(struct udp_hdr) + payload_len);
+	ipv4_hdr->packet_id = 0;
+	ipv4_hdr->fragment_offset = 0;
+	ipv4_hdr->time_to_live = 64;
+	ipv4_hdr->next_proto_id = IPPROTO_UDP;
+	ipv4_hdr->hdr_checksum = 0;
+	ipv4_hdr->src_addr = rte_cpu_to_be_32(my_ip);
+	ipv4_hdr->dst_addr = rte_cpu_to_be_32(server_ip);
+
+	/* UDP header + data */
+	buf_ptr = rte_pktmbuf_append(buf,
+			sizeof(struct udp_hdr) + payload_len);
+	udp_hdr = (struct udp_hdr *) buf_ptr;
+	udp_hdr->src_port = rte_cpu_to_be_16(c->client_port);
+	udp_hdr->dst_port = rte_cpu_to_be_16(c->server_port);
+	udp_hdr->dgram_len = rte_cpu_to_be_16(sizeof(struct udp_hdr)
+			+ payload_len);
+	udp_hdr->dgram_cksum = 0;
+	memset(buf_ptr + sizeof(struct udp_hdr), 0xAB, payload_len);
+
+	/* control data in case our server is running netbench_udp */
+	control_req = (struct nbench_req *) (buf_ptr + sizeof(struct udp_hdr));
+	control_req->magic = kMagic;
+	control_req->nports = 1;
+
+	buf->l2_len = ETHER_HDR_LEN;
+	buf->l3_len = sizeof(struct ipv4_hdr);
+	buf->ol_flags = PKT_TX_IP_CKSUM | PKT_TX_IPV4;
+	return buf;
+}
+
+/*
+ * Check if @buf is the reply to this client core's request. Returns 1 for a
+ * reply, 2 for a netbench_udp control reply, or 0 otherwise.
+ */
+static int client_check_reply(struct client_core *c, struct rte_mbuf *buf)
+{
+	struct udp_hdr *udp_hdr;
 	struct nbench_resp *control_resp;
-	bool setup_port = false;
+
+	if (!check_eth_hdr(buf, c->queue))
+		return 0;
+
+	/* this packet is IPv4, check IP header */
+	if (!check_ip_hdr(buf))
+		return 0;
+
+	/* check UDP header */
+	udp_hdr = rte_pktmbuf_mtod_offset(buf, struct udp_hdr *,
+			ETHER_HDR_LEN + sizeof(struct ipv4_hdr));
+	if (udp_hdr->src_port != rte_cpu_to_be_16(c->server_port) ||
+	    udp_hdr->dst_port != rte_cpu_to_be_16(c->client_port))
+		return 0;
+
+	if (c->setup_port ||
+	    udp_hdr->dgram_len == rte_cpu_to_be_16(sizeof(struct udp_hdr) +
+						   payload_len))
+		return 1;
+
+	/* use port specified by netbench_udp server */
+	control_resp = rte_pktmbuf_mtod_offset(buf, struct nbench_resp *,
+			ETHER_HDR_LEN + sizeof(struct ipv4_hdr) +
+			sizeof(struct udp_hdr));
+	if (control_resp->nports != 1)
+		return 0;
+	c->server_port = control_resp->ports[0];
+	c->client_port = pick_client_port(c->queue, c->client_port,
+					  c->server_port);
+	c->setup_port = true;
+	return 2;
+}
+
+static void client_record_latency(struct client_core *c, uint64_t cycles)
+{
+	uint64_t ns = cycles * 1000 * 1000 * 1000 / rte_get_timer_hz();
+
+	c->hist[RTE_MIN(ns / HIST_BUCKET_NS, (uint64_t) HIST_NR_BUCKETS)]++;
+	c->total_ns += ns;
+	c->max_ns = RTE_MAX(c->max_ns, ns);
+	c->reqs++;
+}
+
+/*
+ * Run a netperf client on one core, with one request outstanding at a time on
+ * its own queues
+ */
+static int do_client(void *arg)
+{
+	uint8_t port = dpdk_port;
+	struct client_core *c = &client_cores[(uint64_t) arg];
+	struct rte_mbuf *bufs[BURST_SIZE];
+	struct rte_mbuf *buf;
+	uint64_t send_time, deadline, end_time, timeout;
+	uint16_t nb_tx, nb_rx, i;
+	int ret;
 
 	/*
 	 * Check that the port is on the same NUMA node as the polling thread
@@ -298,167 +563,167 @@ static void do_client(uint8_t port)
         printf("WARNING, port %u is on remote NUMA node to polling thread.\n\t"
                "Performance will not be optimal.\n", port);
 
-	printf("\nCore %u running in client mode. [Ctrl+C to quit]\n",
-			rte_lcore_id());
-
-	/* get the mac address of the server via ARP */
-	while (true) {
-		send_arp(ARP_OP_REQUEST, broadcast_mac, server_ip);
-		sleep(1);
-
-		nb_rx = rte_eth_rx_burst(port, 0, bufs, BURST_SIZE);
-		if (nb_rx == 0)
-			continue;
-
-		for (i = 0; i < nb_rx; i++) {
-			buf = bufs[i];
-
-			ptr_mac_hdr = rte_pktmbuf_mtod(buf, struct ether_hdr *);
-			if (!is_same_ether_addr(&ptr_mac_hdr->d_addr, &my_eth)) {
-					/* packet not to our ethernet addr */
-					continue;
-			}
-
-			if (ptr_mac_hdr->ether_type == rte_cpu_to_be_16(ETHER_TYPE_ARP)) {
-				/* this is an ARP */
-				a_hdr = rte_pktmbuf_mtod_offset(buf, struct arp_hdr *,
-						sizeof(struct ether_hdr));
-				if (a_hdr->arp_op == rte_cpu_to_be_16(ARP_OP_REPLY) &&
-						is_same_ether_addr(&a_hdr->arp_data.arp_tha, &my_eth) &&
-						a_hdr->arp_data.arp_tip == rte_cpu_to_be_32(my_ip)) {
-					/* got a response from server! */
-					ether_addr_copy(&a_hdr->arp_data.arp_sha, &server_eth);
-					goto got_mac;
-				}
-			}
-		}
-	}
-got_mac:
+	timeout = REQ_TIMEOUT_US * rte_get_timer_hz() / (1000 * 1000);
 
 	/* run for specified amount of time */
-	start_time = rte_get_timer_cycles();
-	while (rte_get_timer_cycles() <
-			start_time + seconds * rte_get_timer_hz()) {
-		buf = rte_pktmbuf_alloc(tx_mbuf_pool);
+	c->start_time = rte_get_timer_cycles();
+	end_time = c->start_time + seconds * rte_get_timer_hz();
+	while (rte_get_timer_cycles() < end_time) {
+		buf = client_build_req(c);
 		if (buf == NULL)
-			printf("error allocating tx mbuf\n");
-
-		/* ethernet header */
-		buf_ptr = rte_pktmbuf_append(buf, ETHER_HDR_LEN);
-		eth_hdr = (struct ether_hdr *) buf_ptr;
-
-		ether_addr_copy(&my_eth, &eth_hdr->s_addr);
-		ether_addr_copy(&server_eth, &eth_hdr->d_addr);
-		eth_hdr->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
-
-		/* IPv4 header */
-		buf_ptr = rte_pktmbuf_append(buf, sizeof(struct ipv4_hdr));
-		ipv4_hdr = (struct ipv4_hdr *) buf_ptr;
-		ipv4_hdr->version_ihl = 0x45;
-		ipv4_hdr->type_of_service = 0;
-		ipv4_hdr->total_length = rte_cpu_to_be_16(sizeof(struct ipv4_hdr) +
-				sizeof(struct udp_hdr) + payload_len);
-		ipv4_hdr->packet_id = 0;
-		ipv4_hdr->fragment_offset = 0;
-		ipv4_hdr->time_to_live = 64;
-		ipv4_hdr->next_proto_id = IPPROTO_UDP;
-		ipv4_hdr->hdr_checksum = 0;
-		ipv4_hdr->src_addr = rte_cpu_to_be_32(my_ip);
-		ipv4_hdr->dst_addr = rte_cpu_to_be_32(server_ip);
-
-		/* UDP header + data */
-		buf_ptr = rte_pktmbuf_append(buf,
-				sizeof(struct udp_hdr) + payload_len);
-		udp_hdr = (struct udp_hdr *) buf_ptr;
-		udp_hdr->src_port = rte_cpu_to_be_16(client_port);
-		udp_hdr->dst_port = rte_cpu_to_be_16(server_port);
-		udp_hdr->dgram_len = rte_cpu_to_be_16(sizeof(struct udp_hdr)
-				+ payload_len);
-		udp_hdr->dgram_cksum = 0;
-		memset(buf_ptr + sizeof(struct udp_hdr), 0xAB, payload_len);
-
-		/* control data in case our server is running netbench_udp */
-		control_req = (struct nbench_req *) (buf_ptr + sizeof(struct udp_hdr));
-		control_req->magic = kMagic;
-		control_req->nports = 1;
-
-		buf->l2_len = ETHER_HDR_LEN;
-		buf->l3_len = sizeof(struct ipv4_hdr);
-		buf->ol_flags = PKT_TX_IP_CKSUM | PKT_TX_IPV4;
+			continue;
 
 		/* send packet */
-		nb_tx = rte_eth_tx_burst(port, 0, &buf, 1);
+		send_time = rte_get_timer_cycles();
+		nb_tx = rte_eth_tx_burst(port, c->queue, &buf, 1);
 
 		if (unlikely(nb_tx != 1)) {
 			printf("error: could not send packet\n");
+			rte_pktmbuf_free(buf);
+			continue;
 		}
 
-		nb_rx = 0;
-		while (true) {
-			nb_rx = rte_eth_rx_burst(port, 0, bufs, BURST_SIZE);
-			if (nb_rx == 0)
+		ret = 0;
+		deadline = send_time + timeout;
+		while (ret == 0) {
+			nb_rx = rte_eth_rx_burst(port, c->queue, bufs, BURST_SIZE);
+			if (nb_rx == 0) {
+				if (rte_get_timer_cycles() > deadline) {
+					c->lost++;
+					break;
+				}
 				continue;
+			}
 
 			for (i = 0; i < nb_rx; i++) {
-				buf = bufs[i];
+				if (ret == 0)
+					ret = client_check_reply(c, bufs[i]);
+				rte_pktmbuf_free(bufs[i]);
+			}
+		}
 
-				if (!check_eth_hdr(buf))
-					goto no_match;
+		if (ret == 1) {
+			client_record_latency(c, rte_get_timer_cycles() - send_time);
+		} else if (ret == 2) {
+			/* reset start time so we don't include control message RTT */
+			c->start_time = rte_get_timer_cycles();
+			end_time = c->start_time + seconds * rte_get_timer_hz();
+		}
+	}
+	c->end_time = rte_get_timer_cycles();
 
-				/* this packet is IPv4, check IP header */
-				if (!check_ip_hdr(buf))
-					goto no_match;
+	return 0;
+}
 
-				/* check UDP header */
-				udp_hdr = rte_pktmbuf_mtod_offset(buf, struct udp_hdr *,
-						ETHER_HDR_LEN + sizeof(struct ipv4_hdr));
-				if (udp_hdr->src_port != rte_cpu_to_be_16(server_port) ||
-				    udp_hdr->dst_port != rte_cpu_to_be_16(client_port))
-					goto no_match;
-
-				if (!setup_port &&
-				    udp_hdr->dgram_len != rte_cpu_to_be_16(sizeof(struct udp_hdr) +
-									   payload_len)) {
-					/* use port specified by netbench_udp server */
-					control_resp = rte_pktmbuf_mtod_offset(buf, struct nbench_resp *,
-							ETHER_HDR_LEN + sizeof(struct ipv4_hdr) +
-							sizeof(struct udp_hdr));
-					if (control_resp->nports != 1)
-						goto no_match;
-					server_port = control_resp->ports[0];
-
-					/* reset start time so we don't include control message RTT */
-					start_time = rte_get_timer_cycles();
-					setup_port = true;
-				}
+/*
+ * Returns the latency (us) below which @pct percent of requests completed,
+ * the upper bound of its histogram bucket.
+ */
+static double hist_percentile(const uint64_t *hist, uint64_t total,
+			      uint64_t max_ns, double pct)
+{
+	uint64_t target = (uint64_t) (total * pct / 100.0), seen = 0;
+	unsigned int i;
 
-				/* packet matches */
-				rte_pktmbuf_free(buf);
-				goto found_match;
+	for (i = 0; i < HIST_NR_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen > target)
+			return (double) (i + 1) * HIST_BUCKET_NS / 1000;
+	}
 
-			no_match:
-				/* packet isn't what we're looking for, free it and rx again */
-				rte_pktmbuf_free(buf);
-			}
+	return (double) max_ns / 1000;
+}
+
+/*
+ * Print the results of all client cores.
+ */
+static void client_print_results(unsigned int n_cores)
+{
+	static uint64_t hist[HIST_NR_BUCKETS + 1];
+	struct client_core *c;
+	uint64_t reqs = 0, lost = 0, total_ns = 0, max_ns = 0;
+	double secs, rate = 0, max_secs = 0;
+	unsigned int i, j;
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < n_cores; i++) {
+		c = &client_cores[i];
+		secs = (double) (c->end_time - c->start_time) / rte_get_timer_hz();
+		rate += c->reqs / secs;
+		max_secs = RTE_MAX(max_secs, secs);
+		reqs += c->reqs;
+		lost += c->lost;
+		total_ns += c->total_ns;
+		max_ns = RTE_MAX(max_ns, c->max_ns);
+		for (j = 0; j <= HIST_NR_BUCKETS; j++)
+			hist[j] += c->hist[j];
+		if (n_cores > 1)
+			printf("core %u (queue %u, port %u): %"PRIu64" reqs, "
+			       "%f reqs/s\n", i, c->queue, c->client_port,
+			       c->reqs, c->reqs / secs);
+	}
+
+	if (reqs == 0) {
+		printf("no replies received\n");
+		return;
+	}
+
+	printf("ran for %f seconds, sent %"PRIu64" packets\n", max_secs, reqs);
+	printf("client reqs/s: %f\n", rate);
+	printf("mean latency (us): %f\n", (double) total_ns / reqs / 1000);
+	printf("latency (us): 50th %.1f 90th %.1f 99th %.1f 99.9th %.1f "
+	       "max %.1f\n",
+	       hist_percentile(hist, reqs, max_ns, 50),
+	       hist_percentile(hist, reqs, max_ns, 90),
+	       hist_percentile(hist, reqs, max_ns, 99),
+	       hist_percentile(hist, reqs, max_ns, 99.9),
+	       (double) max_ns / 1000);
+	if (lost > 0)
+		printf("lost requests (no reply within %d us): %"PRIu64"\n",
+		       REQ_TIMEOUT_US, lost);
+}
+
+/*
+ * Run the client on every lcore, once for each payload size
+ */
+static void run_clients(void)
+{
+	unsigned int lcore_id, n_cores = 0, i;
+	struct client_core *c;
+	int k;
+
+	printf("\nRunning in client mode on %u cores. [Ctrl+C to quit]\n",
+	       num_queues);
+	client_arp_server(dpdk_port);
+
+	for (k = 0; k < nr_payload_lens; k++) {
+		payload_len = payload_lens[k];
+		n_cores = num_queues;
+		for (i = 0; i < n_cores; i++) {
+			c = &client_cores[i];
+			memset(c, 0, sizeof(*c));
+			c->queue = i;
+			c->server_port = server_port;
+			c->client_port = pick_client_port(i, client_port,
+							  server_port);
 		}
-	found_match:
 
-		reqs++;
+		i = 0;
+		RTE_LCORE_FOREACH_SLAVE(lcore_id)
+			rte_eal_remote_launch(do_client, (void *) (uint64_t) i++,
+					      lcore_id);
+		do_client((void *) (uint64_t) i);
+		rte_eal_mp_wait_lcore();
+
+		if (nr_payload_lens > 1)
+			printf("payload %zu bytes:\n", payload_len);
+		client_print_results(n_cores);
 	}
-	end_time = rte_get_timer_cycles();
-	if (setup_port)
-		reqs--;
-
-	printf("ran for %f seconds, sent %"PRIu64" packets\n",
-			(float) (end_time - start_time) / rte_get_timer_hz(), reqs);
-	printf("client reqs/s: %f\n",
-			(float) (reqs * rte_get_timer_hz()) / (end_time - start_time));
-	printf("mean latency (us): %f\n", (float) (end_time - start_time) *
-			1000 * 1000 / (reqs * rte_get_timer_hz()));
 }
 
 /*
- * Run a netperf server
+ * Run a netperf server. Each core polls its own queues, those from @arg on in
+ * steps of the number of cores.
  */
 static int
 do_server(void *arg)
@@ -476,6 +741,7 @@ do_server(void *arg)
 	uint16_t tmp_port;
 	struct nbench_req *control_req;
 	struct nbench_resp *control_resp;
+	size_t resp_len;
 
 	printf("on server core with lcore_id: %d, queue: %d", rte_lcore_id(),
 			queue);
@@ -494,7 +760,7 @@ do_server(void *arg)
 
 	/* Run until the application is quit or killed. */
 	for (;;) {
-		for (q = 0; q < num_queues; q++) {
+		for (q = queue; q < num_queues; q += rte_lcore_count()) {
 
 			/* receive packets */
 			nb_rx = rte_eth_rx_burst(port, q, rx_bufs, BURST_SIZE);
@@ -506,7 +772,7 @@ do_server(void *arg)
 			for (i = 0; i < nb_rx; i++) {
 				buf = rx_bufs[i];
 
-				if (!check_eth_hdr(buf))
+				if (!check_eth_hdr(buf, q))
 					goto free_buf;
 
 				/* this packet is IPv4, check IP header */
@@ -549,16 +815,18 @@ do_server(void *arg)
 					/* add ports to response */
 					for (j = 0; j < control_req->nports; j++) {
 						/* simple port allocation */
-						control_resp->ports[j] = rte_cpu_to_be_16(next_port++);
+						control_resp->ports[j] = rte_cpu_to_be_16(
+							__atomic_fetch_add(&next_port, 1,
+									   __ATOMIC_RELAXED));
 					}
 
 					/* adjust lengths in UDP and IPv4 headers */
-					payload_len = sizeof(struct nbench_resp) +
+					resp_len = sizeof(struct nbench_resp) +
 						sizeof(uint16_t) * control_req->nports;
 					udp_hdr->dgram_len = rte_cpu_to_be_16(sizeof(struct udp_hdr) +
-									payload_len);
+									resp_len);
 					ptr_ipv4_hdr->total_length = rte_cpu_to_be_16(sizeof(struct ipv4_hdr) +
-										sizeof(struct udp_hdr) + payload_len);
+										sizeof(struct udp_hdr) + resp_len);
 
 					/* enable computation of IPv4 checksum in hardware */
 					ptr_ipv4_hdr->hdr_checksum = 0;
@@ -578,9 +846,12 @@ do_server(void *arg)
 			/* transmit packets */
 			nb_tx = rte_eth_tx_burst(port, q, tx_bufs, n_to_tx);
 
-			if (nb_tx != n_to_tx)
+			if (nb_tx != n_to_tx) {
 				printf("error: could not transmit all packets: %d %d\n",
 					n_to_tx, nb_tx);
+				for (i = nb_tx; i < n_to_tx; i++)
+					rte_pktmbuf_free(tx_bufs[i]);
+			}
 		}
 	}
 
@@ -593,6 +864,7 @@ do_server(void *arg)
 static int dpdk_init(int argc, char *argv[])
 {
 	int args_parsed;
+	unsigned int nb_mbufs;
 
 	/* Initialize the Environment Abstraction Layer (EAL). */
 	args_parsed = rte_eal_init(argc, argv);
@@ -603,15 +875,18 @@ static int dpdk_init(int argc, char *argv[])
 	if (!rte_eth_dev_is_valid_port(0))
 		rte_exit(EXIT_FAILURE, "Error: no available ports\n");
 
-	/* Creates a new mempool in memory to hold the mbufs. */
-	rx_mbuf_pool = rte_pktmbuf_pool_create("MBUF_RX_POOL", NUM_MBUFS,
+	/* Creates a new mempool in memory to hold the mbufs, enough to fill
+	 * every core's RX ring. */
+	nb_mbufs = NUM_MBUFS + rte_lcore_count() *
+		(RX_RING_SIZE + BURST_SIZE + MBUF_CACHE_SIZE);
+	rx_mbuf_pool = rte_pktmbuf_pool_create("MBUF_RX_POOL", nb_mbufs,
 		MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
 
 	if (rx_mbuf_pool == NULL)
 		rte_exit(EXIT_FAILURE, "Cannot create rx mbuf pool\n");
 
 	/* Creates a new mempool in memory to hold the mbufs. */
-	tx_mbuf_pool = rte_pktmbuf_pool_create("MBUF_TX_POOL", NUM_MBUFS,
+	tx_mbuf_pool = rte_pktmbuf_pool_create("MBUF_TX_POOL", nb_mbufs,
 		MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
 
 	if (tx_mbuf_pool == NULL)
@@ -620,6 +895,32 @@ static int dpdk_init(int argc, char *argv[])
 	return args_parsed;
 }
 
+/*
+ * Parse a comma-separated list of UDP payload sizes.
+ */
+static int parse_payload_lens(char *str)
+{
+	char *tok, *pos;
+	long tmp;
+
+	nr_payload_lens = 0;
+	for (tok = strtok_r(str, ",", &pos); tok;
+	     tok = strtok_r(NULL, ",", &pos)) {
+		if (nr_payload_lens == MAX_PAYLOADS ||
+		    str_to_long(tok, &tmp) ||
+		    tmp < (long) sizeof(struct nbench_req) ||
+		    tmp > UDP_MAX_PAYLOAD) {
+			printf("invalid payload size '%s' (%zu to %d bytes, at "
+			       "most %d sizes)\n", tok, sizeof(struct nbench_req),
+			       UDP_MAX_PAYLOAD, MAX_PAYLOADS);
+			return -EINVAL;
+		}
+		payload_lens[nr_payload_lens++] = tmp;
+	}
+
+	return nr_payload_lens > 0 ? 0 : -EINVAL;
+}
+
 static int parse_netperf_args(int argc, char *argv[])
 {
 	long tmp;
@@ -646,8 +947,8 @@ static int parse_netperf_args(int argc, char *argv[])
 			return -EINVAL;
 		str_to_long(argv[6], &tmp);
 		seconds = tmp;
-		str_to_long(argv[7], &tmp);
-		payload_len = tmp;
+		if (parse_payload_lens(argv[7]))
+			return -EINVAL;
 	} else if (!strcmp(argv[1], "UDP_SERVER")) {
 		mode = MODE_UDP_SERVER;
 		argc -= 3;
@@ -683,14 +984,16 @@ main(int argc, char *argv[])
 	if (res < 0)
 		return 0;
 
-	/* initialize port */
-	if (mode == MODE_UDP_CLIENT && rte_lcore_count() > 1)
-		printf("\nWARNING: Too many lcores enabled. Only 1 used.\n");
+	/* initialize port, with a queue for each core by default */
+	if (mode == MODE_UDP_CLIENT || num_queues == 0)
+		num_queues = rte_lcore_count();
+	if (num_queues > MAX_CORES)
+		rte_exit(EXIT_FAILURE, "at most %d queues\n", MAX_CORES);
 	if (port_init(dpdk_port, rx_mbuf_pool, num_queues) != 0)
 		rte_exit(EXIT_FAILURE, "Cannot init port %"PRIu8 "\n", dpdk_port);
 
 	if (mode == MODE_UDP_CLIENT)
-		do_client(dpdk_port);
+		run_clients();
 	else {
 		i = 0;
 		RTE_LCORE_FOREACH_SLAVE(lcore_id)
@@ -0,0 +1,687 @@
+// memcached.cc - a memcached binary-protocol server on the runtime
+//
+// Serves the memcached binary protocol over TCP and UDP on one port (11211
+// by default) out of the store in store.h, with one partition per kthread.
+// TCP connections are accepted from per-kthread listener shards, read
+// pipelined requests in batches, and write each batch of responses with one
+// zero-copy write: responses are built directly in a TCP stack buffer, so a
+// hit copies its value exactly once, from the store to the buffer on its way
+// to the NIC. UDP requests are handled in a thread spawned on the kthread
+// that received them (see udp_create_spawner()), using memcached's UDP frame
+// header, and large responses are split over several datagrams the same way
+// memcached does.
+//
+// Supports get, set, add, replace, append, prepend, delete, incr, decr, and
+// flush (and their quiet and key-returning variants), noop, version, and
+// quit. apps/synthetic can drive it with --protocol memcached.
+
+extern "C" {
+#include <base/stddef.h>
+#include <base/byteorder.h>
+#include <base/log.h>
+#include <net/ip.h>
+#include <runtime/udp.h>
+}
+#undef min
+#undef max
+
+#include "net.h"
+#include "store.h"
+#include "thread.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr uint16_t kDefaultPort = 11211;
+constexpr size_t kDefaultMemoryMB = 1024;
+// The size of the buffer TCP connections first read requests into.
+constexpr size_t kReadBufLen = 64 * 1024;
+// The largest request, which is a set of the largest value.
+constexpr size_t kMaxRequestLen = 24 + 8 + kv::kMaxKeyLen + kv::kMaxValueLen;
+// Responses to one UDP datagram start out in a buffer on the stack.
+constexpr size_t kUdpStackBufLen = 2048;
+// The reply to the version command.
+const char kVersion[] = "1.4.0-shenango";
+
+enum : uint8_t {
+  kMagicRequest = 0x80,
+  kMagicResponse = 0x81,
+};
+
+enum : uint8_t {
+  kOpGet = 0x00,
+  kOpSet = 0x01,
+  kOpAdd = 0x02,
+  kOpReplace = 0x03,
+  kOpDelete = 0x04,
+  kOpIncrement = 0x05,
+  kOpDecrement = 0x06,
+  kOpQuit = 0x07,
+  kOpFlush = 0x08,
+  kOpGetQ = 0x09,
+  kOpNoop = 0x0a,
+  kOpVersion = 0x0b,
+  kOpGetK = 0x0c,
+  kOpGetKQ = 0x0d,
+  kOpAppend = 0x0e,
+  kOpPrepend = 0x0f,
+  kOpSetQ = 0x11,
+  kOpAddQ = 0x12,
+  kOpReplaceQ = 0x13,
+  kOpDeleteQ = 0x14,
+  kOpIncrementQ = 0x15,
+  kOpDecrementQ = 0x16,
+  kOpQuitQ = 0x17,
+  kOpFlushQ = 0x18,
+  kOpAppendQ = 0x19,
+  kOpPrependQ = 0x1a,
+};
+
+enum : uint16_t {
+  kStatusOk = 0x00,
+  kStatusNotFound = 0x01,
+  kStatusExists = 0x02,
+  kStatusTooLarge = 0x03,
+  kStatusInvalid = 0x04,
+  kStatusNotStored = 0x05,
+  kStatusNonNumeric = 0x06,
+  kStatusUnknownCommand = 0x81,
+};
+
+// The header of every request and response, in network byte order.
+struct header {
+  uint8_t magic;
+  uint8_t opcode;
+  uint16_t keylen;
+  uint8_t extlen;
+  uint8_t datatype;
+  uint16_t status;        // the vbucket id in requests
+  uint32_t bodylen;
+  uint32_t opaque;
+  uint64_t cas;
+} __packed;
+
+static_assert(sizeof(header) == 24, "the header is 24 bytes");
+
+// Prefixes every datagram sent over UDP.
+struct udp_frame {
+  uint16_t id;
+  uint16_t seq;
+  uint16_t total;
+  uint16_t reserved;
+} __packed;
+
+// A parsed request, in host byte order.
+struct request {
+  uint8_t opcode;
+  uint32_t opaque;
+  uint64_t cas;
+  const char *ext;
+  size_t extlen;
+  const char *key;
+  size_t keylen;
+  const char *val;
+  size_t vallen;
+};
+
+kv::Store *store;
+
+uint16_t ToStatus(kv::Status s) {
+  switch (s) {
+    case kv::Status::kOk:
+      return kStatusOk;
+    case kv::Status::kNotFound:
+      return kStatusNotFound;
+    case kv::Status::kExists:
+      return kStatusExists;
+    case kv::Status::kNotStored:
+      return kStatusNotStored;
+    case kv::Status::kTooLarge:
+      return kStatusTooLarge;
+    case kv::Status::kNonNumeric:
+      return kStatusNonNumeric;
+    case kv::Status::kInvalid:
+    case kv::Status::kNoSpace:
+      break;
+  }
+  return kStatusInvalid;
+}
+
+// Collects the responses to a batch of requests.
+class Output {
+ public:
+  virtual ~Output() { }
+
+  // Gets space for a response of at least @len bytes, or nullptr on failure.
+  // Room() then tells how much can be written there, in case it's more.
+  virtual char *Reserve(size_t len) = 0;
+  virtual size_t Room() const = 0;
+  // Adds the first @len bytes of the reserved space to the output.
+  virtual void Commit(size_t len) = 0;
+};
+
+// Fills in the header of a response at @p.
+void PutHeader(char *p, const request &req, uint16_t status, size_t extlen,
+               size_t keylen, size_t vallen, uint64_t cas) {
+  header *h = reinterpret_cast<header *>(p);
+  h->magic = kMagicResponse;
+  h->opcode = req.opcode;
+  h->keylen = hton16(keylen);
+  h->extlen = extlen;
+  h->datatype = 0;
+  h->status = hton16(status);
+  h->bodylen = hton32(extlen + keylen + vallen);
+  h->opaque = req.opaque;
+  h->cas = hton64(cas);
+}
+
+// Adds a response to @out.
+void PutResponse(Output *out, const request &req, uint16_t status,
+                 const void *ext, size_t extlen, const void *key,
+                 size_t keylen, const void *val, size_t vallen,
+                 uint64_t cas) {
+  size_t len = sizeof(header) + extlen + keylen + vallen;
+  char *p = out->Reserve(len);
+  if (!p) return;
+
+  PutHeader(p, req, status, extlen, keylen, vallen, cas);
+  p += sizeof(header);
+  if (extlen) memcpy(p, ext, extlen);
+  p += extlen;
+  if (keylen) memcpy(p, key, keylen);
+  p += keylen;
+  if (vallen) memcpy(p, val, vallen);
+  out->Commit(len);
+}
+
+void PutStatus(Output *out, const request &req, uint16_t status,
+               uint64_t cas = 0) {
+  const char *msg = "";
+  size_t len = 0;
+  if (status != kStatusOk) {
+    // memcached explains errors in the value
+    msg = status == kStatusUnknownCommand ? "Unknown command" : "Error";
+    len = strlen(msg);
+  }
+  PutResponse(out, req, status, nullptr, 0, nullptr, 0, msg, len, cas);
+}
+
+void HandleGet(const request &req, Output *out) {
+  bool quiet = req.opcode == kOpGetQ || req.opcode == kOpGetKQ;
+  bool with_key = req.opcode == kOpGetK || req.opcode == kOpGetKQ;
+  size_t keylen = with_key ? req.keylen : 0;
+  size_t base = sizeof(header) + sizeof(uint32_t) + keylen;
+  size_t want = base;
+
+  // Copy the value straight into the response, and if it doesn't fit, try
+  // again with room for it.
+  while (true) {
+    char *p = out->Reserve(want);
+    if (!p) return;
+
+    kv::ItemInfo info;
+    kv::Status s = store->Get(req.key, req.keylen, p + base,
+                              out->Room() - base, &info);
+    if (s == kv::Status::kNoSpace) {
+      want = base + info.vallen;
+      continue;
+    }
+    if (s != kv::Status::kOk) {
+      if (s == kv::Status::kNotFound && quiet) return;
+      if (s == kv::Status::kNotFound) {
+        PutResponse(out, req, kStatusNotFound, nullptr, 0, req.key, keylen,
+                    "Not found", strlen("Not found"), 0);
+      } else {
+        PutStatus(out, req, ToStatus(s));
+      }
+      return;
+    }
+
+    uint32_t flags = hton32(info.flags);
+    PutHeader(p, req, kStatusOk, sizeof(flags), keylen, info.vallen,
+              info.cas);
+    memcpy(p + sizeof(header), &flags, sizeof(flags));
+    memcpy(p + sizeof(header) + sizeof(flags), req.key, keylen);
+    out->Commit(base + info.vallen);
+    return;
+  }
+}
+
+void HandleSet(const request &req, Output *out) {
+  kv::SetMode mode;
+  uint32_t flags = 0, exptime = 0;
+  bool quiet = false;
+
+  switch (req.opcode) {
+    case kOpSetQ:
+      quiet = true;
+      // fall through
+    case kOpSet:
+      mode = kv::SetMode::kSet;
+      break;
+    case kOpAddQ:
+      quiet = true;
+      // fall through
+    case kOpAdd:
+      mode = kv::SetMode::kAdd;
+      break;
+    case kOpReplaceQ:
+      quiet = true;
+      // fall through
+    case kOpReplace:
+      mode = kv::SetMode::kReplace;
+      break;
+    case kOpAppendQ:
+      quiet = true;
+      // fall through
+    case kOpAppend:
+      mode = kv::SetMode::kAppend;
+      break;
+    case kOpPrependQ:
+      quiet = true;
+      // fall through
+    default:
+      mode = kv::SetMode::kPrepend;
+      break;
+  }
+
+  bool concat = mode == kv::SetMode::kAppend || mode == kv::SetMode::kPrepend;
+  if (req.extlen != (concat ? 0 : 8)) {
+    PutStatus(out, req, kStatusInvalid);
+    return;
+  }
+  if (!concat) {
+    memcpy(&flags, req.ext, sizeof(flags));
+    memcpy(&exptime, req.ext + sizeof(flags), sizeof(exptime));
+    flags = ntoh32(flags);
+    exptime = kv::Store::ExpTime(ntoh32(exptime));
+  }
+
+  uint64_t cas;
+  kv::Status s = store->Set(mode, req.key, req.keylen, req.val, req.vallen,
+                            flags, exptime, req.cas, &cas);
+  if (s == kv::Status::kOk && quiet) return;
+  PutStatus(out, req, ToStatus(s), s == kv::Status::kOk ? cas : 0);
+}
+
+void HandleDelete(const request &req, Output *out) {
+  if (req.extlen || req.vallen) {
+    PutStatus(out, req, kStatusInvalid);
+    return;
+  }
+
+  kv::Status s = store->Delete(req.key, req.keylen, req.cas);
+  if (s == kv::Status::kOk && req.opcode == kOpDeleteQ) return;
+  PutStatus(out, req, ToStatus(s));
+}
+
+void HandleIncr(const request &req, Output *out) {
+  struct {
+    uint64_t delta;
+    uint64_t initial;
+    uint32_t exptime;
+  } __packed ext;
+
+  if (req.extlen != sizeof(ext) || req.vallen) {
+    PutStatus(out, req, kStatusInvalid);
+    return;
+  }
+  memcpy(&ext, req.ext, sizeof(ext));
+
+  // an expiration time of all ones means don't create the item
+  uint32_t exptime = ntoh32(ext.exptime);
+  bool create = exptime != UINT32_MAX;
+  bool decr = req.opcode == kOpDecrement || req.opcode == kOpDecrementQ;
+  uint64_t val, cas;
+  kv::Status s = store->Incr(req.key, req.keylen, decr, ntoh64(ext.delta),
+                             create, ntoh64(ext.initial),
+                             create ? kv::Store::ExpTime(exptime) : 0,
+                             req.cas, &val, &cas);
+  if (s != kv::Status::kOk) {
+    PutStatus(out, req, ToStatus(s));
+    return;
+  }
+  if (req.opcode == kOpIncrementQ || req.opcode == kOpDecrementQ) return;
+  val = hton64(val);
+  PutResponse(out, req, kStatusOk, nullptr, 0, nullptr, 0, &val, sizeof(val),
+              cas);
+}
+
+// Handles one request. Returns false if the connection should be closed.
+bool HandleRequest(const request &req, Output *out) {
+  switch (req.opcode) {
+    case kOpGet:
+    case kOpGetQ:
+    case kOpGetK:
+    case kOpGetKQ:
+      HandleGet(req, out);
+      break;
+
+    case kOpSet:
+    case kOpSetQ:
+    case kOpAdd:
+    case kOpAddQ:
+    case kOpReplace:
+    case kOpReplaceQ:
+    case kOpAppend:
+    case kOpAppendQ:
+    case kOpPrepend:
+    case kOpPrependQ:
+      HandleSet(req, out);
+      break;
+
+    case kOpDelete:
+    case kOpDeleteQ:
+      HandleDelete(req, out);
+      break;
+
+    case kOpIncrement:
+    case kOpIncrementQ:
+    case kOpDecrement:
+    case kOpDecrementQ:
+      HandleIncr(req, out);
+      break;
+
+    case kOpFlush:
+    case kOpFlushQ:
+      // delayed flushes (with an expiration time) happen right away
+      store->Flush();
+      if (req.opcode == kOpFlush) PutStatus(out, req, kStatusOk);
+      break;
+
+    case kOpNoop:
+      PutStatus(out, req, kStatusOk);
+      break;
+
+    case kOpVersion:
+      PutResponse(out, req, kStatusOk, nullptr, 0, nullptr, 0, kVersion,
+                  strlen(kVersion), 0);
+      break;
+
+    case kOpQuit:
+      PutStatus(out, req, kStatusOk);
+      return false;
+    case kOpQuitQ:
+      return false;
+
+    default:
+      PutStatus(out, req, kStatusUnknownCommand);
+      break;
+  }
+
+  return true;
+}
+
+// Parses the request at @buf if all @len bytes of it are there. Returns the
+// request's length (0 if it's incomplete), or < 0 if it's malformed.
+ssize_t ParseRequest(const char *buf, size_t len, request *req) {
+  if (len < sizeof(header)) return 0;
+
+  header h;
+  memcpy(&h, buf, sizeof(h));
+  if (h.magic != kMagicRequest) return -EINVAL;
+  size_t bodylen = ntoh32(h.bodylen);
+  size_t keylen = ntoh16(h.keylen);
+  if (bodylen > kMaxRequestLen - sizeof(h) || h.extlen + keylen > bodylen)
+    return -EINVAL;
+  if (len < sizeof(h) + bodylen) return 0;
+
+  req->opcode = h.opcode;
+  req->opaque = h.opaque;
+  req->cas = ntoh64(h.cas);
+  req->ext = buf + sizeof(h);
+  req->extlen = h.extlen;
+  req->key = req->ext + req->extlen;
+  req->keylen = keylen;
+  req->val = req->key + keylen;
+  req->vallen = bodylen - h.extlen - keylen;
+  return sizeof(h) + bodylen;
+}
+
+// The needed length of the (incomplete) request at @buf.
+size_t RequestLen(const char *buf) {
+  header h;
+  memcpy(&h, buf, sizeof(h));
+  return sizeof(h) + ntoh32(h.bodylen);
+}
+
+// Writes responses into TCP stack buffers, each sent with one zero-copy
+// write, and falls back to a plain write for responses too large for one.
+class TcpOutput : public Output {
+ public:
+  TcpOutput(rt::TcpConn *c) : c_(c), buf_(nullptr), len_(0), large_(false),
+                              failed_(false) { }
+  ~TcpOutput() { delete buf_; }
+
+  char *Reserve(size_t len) {
+    if (failed_) return nullptr;
+    if (buf_ && len_ + len <= buf_->Capacity()) return Data() + len_;
+    Flush();
+    if (failed_) return nullptr;
+    if (!buf_) buf_ = rt::TcpTxBuf::Alloc(kReadBufLen);
+    if (buf_ && len <= buf_->Capacity()) return Data();
+    large_buf_.resize(len);
+    large_ = true;
+    return large_buf_.data();
+  }
+
+  size_t Room() const {
+    return large_ ? large_buf_.size() : buf_->Capacity() - len_;
+  }
+
+  void Commit(size_t len) {
+    if (!large_) {
+      len_ += len;
+      return;
+    }
+    large_ = false;
+    if (c_->WriteFull(large_buf_.data(), len) != static_cast<ssize_t>(len))
+      failed_ = true;
+  }
+
+  // Sends the responses collected so far. Returns false if the connection
+  // failed.
+  bool Flush() {
+    if (failed_) return false;
+    if (len_ == 0) return true;
+
+    // the stack owns the buffer until the data is acknowledged
+    rt::TcpTxBuf *buf = buf_;
+    buf_ = nullptr;
+    ssize_t ret = c_->WriteZc(buf, len_, FreeTxBuf, buf);
+    if (ret <= 0) delete buf;
+    if (ret != static_cast<ssize_t>(len_)) failed_ = true;
+    len_ = 0;
+    return !failed_;
+  }
+
+ private:
+  static void FreeTxBuf(void *arg) { delete static_cast<rt::TcpTxBuf *>(arg); }
+
+  char *Data() const { return static_cast<char *>(buf_->Data()); }
+
+  rt::TcpConn *c_;
+  rt::TcpTxBuf *buf_;
+  size_t len_;
+  std::vector<char> large_buf_;
+  bool large_;
+  bool failed_;
+};
+
+void TcpWorker(std::unique_ptr<rt::TcpConn> c) {
+  std::vector<char> in(kReadBufLen);
+  size_t start = 0, end = 0;
+  TcpOutput out(c.get());
+
+  while (true) {
+    ssize_t ret = c->Read(in.data() + end, in.size() - end);
+    if (ret <= 0) {
+      if (ret < 0 && ret != -ECONNRESET) log_err("read failed, ret = %ld", ret);
+      return;
+    }
+    end += ret;
+
+    // Handle every complete request, then send all the responses at once.
+    while (true) {
+      request req;
+      ssize_t len = ParseRequest(in.data() + start, end - start, &req);
+      if (len < 0) {
+        log_warn("closing a connection that sent a malformed request");
+        return;
+      }
+      if (len == 0) break;
+      start += len;
+      if (!HandleRequest(req, &out)) {
+        out.Flush();
+        c->Shutdown(SHUT_RDWR);
+        return;
+      }
+    }
+    if (!out.Flush()) return;
+
+    // Move the incomplete request (if any) to the front, and make sure there
+    // is room for all of it.
+    memmove(in.data(), in.data() + start, end - start);
+    end -= start;
+    start = 0;
+    if (end >= sizeof(header))
+      in.resize(std::max(in.size(), RequestLen(in.data())));
+  }
+}
+
+void TcpListener(netaddr laddr) {
+  std::unique_ptr<rt::TcpQueue> q(rt::TcpQueue::ListenSharded(laddr, 4096));
+  if (q == nullptr) panic("couldn't listen for TCP connections");
+
+  while (true) {
+    rt::TcpConn *c = q->Accept();
+    if (c == nullptr) panic("couldn't accept a connection");
+    rt::Thread([=] { TcpWorker(std::unique_ptr<rt::TcpConn>(c)); }).Detach();
+  }
+}
+
+// Collects the responses to one datagram, on the stack unless they're large.
+class UdpOutput : public Output {
+ public:
+  UdpOutput() : buf_(stack_buf_), cap_(sizeof(stack_buf_)), len_(0) { }
+
+  char *Reserve(size_t len) {
+    if (len_ + len > cap_) {
+      size_t cap = std::max(cap_ * 2, len_ + len);
+      std::unique_ptr<char[]> buf(new char[cap]);
+      memcpy(buf.get(), buf_, len_);
+      heap_buf_.swap(buf);
+      buf_ = heap_buf_.get();
+      cap_ = cap;
+    }
+    return buf_ + len_;
+  }
+
+  size_t Room() const { return cap_ - len_; }
+  void Commit(size_t len) { len_ += len; }
+
+  // Sends the responses in as many datagrams as needed.
+  void Send(const udp_frame &req_frame, udp_spawn_data *d) {
+    size_t per_dgram = udp_max_payload() - sizeof(udp_frame);
+    uint16_t total = div_up(len_, per_dgram);
+
+    for (uint16_t seq = 0; seq < total; ++seq) {
+      udp_frame frame;
+      frame.id = req_frame.id;
+      frame.seq = hton16(seq);
+      frame.total = hton16(total);
+      frame.reserved = 0;
+      size_t off = seq * per_dgram;
+      iovec iov[2];
+      iov[0].iov_base = &frame;
+      iov[0].iov_len = sizeof(frame);
+      iov[1].iov_base = buf_ + off;
+      iov[1].iov_len = std::min(per_dgram, len_ - off);
+      udp_respondv(iov, 2, d);
+    }
+  }
+
+ private:
+  char stack_buf_[kUdpStackBufLen];
+  std::unique_ptr<char[]> heap_buf_;
+  char *buf_;
+  size_t cap_;
+  size_t len_;
+};
+
+void UdpHandler(udp_spawn_data *d) {
+  const char *buf = static_cast<const char *>(d->buf);
+  size_t len = d->len;
+  udp_frame frame;
+
+  // requests that span datagrams aren't supported (memcached drops them too)
+  if (len < sizeof(frame)) goto done;
+  memcpy(&frame, buf, sizeof(frame));
+  if (ntoh16(frame.total) != 1) goto done;
+  buf += sizeof(frame);
+  len -= sizeof(frame);
+
+  {
+    UdpOutput out;
+    while (len > 0) {
+      request req;
+      ssize_t ret = ParseRequest(buf, len, &req);
+      if (ret <= 0) break;
+      buf += ret;
+      len -= ret;
+      if (!HandleRequest(req, &out)) break;
+    }
+    out.Send(frame, d);
+  }
+
+done:
+  udp_spawn_data_release(d->release_data);
+}
+
+size_t memory_mb = kDefaultMemoryMB;
+uint16_t port = kDefaultPort;
+
+void MainHandler(void *arg) {
+  unsigned int nr_parts = runtime_max_cores();
+  store = new kv::Store(nr_parts, memory_mb << 20);
+
+  udpspawner_t *s;
+  int ret = udp_create_spawner({0, port}, UdpHandler, &s);
+  if (ret) panic("couldn't listen for UDP requests, ret = %d", ret);
+
+  log_info("memcached: serving %lu MB in %u partitions on port %u",
+           memory_mb, nr_parts, port);
+  TcpListener({0, port});
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 2 || argc > 4) {
+    std::cerr << "usage: [cfg_file] [memory_mb] [port]" << std::endl;
+    return -EINVAL;
+  }
+
+  if (argc > 2) memory_mb = std::stoul(argv[2], nullptr, 0);
+  if (argc > 3) port = std::stoul(argv[3], nullptr, 0);
+  if (memory_mb == 0 || port == 0) {
+    std::cerr << "memory and port must be nonzero" << std::endl;
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+
+  return 0;
+}
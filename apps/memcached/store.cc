@@ -0,0 +1,433 @@
+// store.cc - a partitioned, lossy key-value cache (see store.h)
+
+extern "C" {
+#include <asm/cpu.h>
+#include <asm/ops.h>
+#include <base/compiler.h>
+#include <base/log.h>
+#include <base/stddef.h>
+#include <base/time.h>
+}
+#undef min
+#undef max
+
+#include "store.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+namespace kv {
+
+namespace {
+
+// Index entries per bucket, so that a bucket fills one cache line.
+constexpr int kBucketSlots = 7;
+// Index entries hold a 16-bit tag from the key's hash and a log offset.
+constexpr int kTagShift = 48;
+constexpr uint64_t kOffsetMask = (1UL << kTagShift) - 1;
+// The index is sized for items of about this many bytes.
+constexpr size_t kAvgItemLen = 64;
+// Every partition's log must hold at least two of the largest items.
+constexpr size_t kMinLogBytes = 4 << 20;
+// memcached treats expiration times over 30 days as Unix times.
+constexpr uint32_t kMaxRelativeExpTime = 60 * 60 * 24 * 30;
+
+// A bucket of the hash index. Writers make @version odd while they change
+// the entries, so readers can tell that what they saw was stable.
+struct Bucket {
+  std::atomic<uint32_t> version;
+  uint32_t pad;
+  std::atomic<uint64_t> slots[kBucketSlots];
+};
+
+static_assert(sizeof(Bucket) == CACHE_LINE_SIZE, "buckets must fill a line");
+
+// An item in the log, followed by its key and then its value.
+struct Item {
+  uint32_t vallen;
+  uint16_t keylen;
+  uint16_t pad;
+  uint32_t flags;
+  uint32_t exptime;
+  uint64_t cas;
+};
+
+size_t ItemLen(size_t keylen, size_t vallen) {
+  return align_up(sizeof(Item) + keylen + vallen, sizeof(uint64_t));
+}
+
+// FNV-1a, finished with MurmurHash3's mixer so the high bits are usable.
+uint64_t HashKey(const void *key, size_t keylen) {
+  const unsigned char *p = static_cast<const unsigned char *>(key);
+  uint64_t h = 14695981039346656037UL;
+
+  for (size_t i = 0; i < keylen; ++i) {
+    h ^= p[i];
+    h *= 1099511628211UL;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdUL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53UL;
+  h ^= h >> 33;
+  return h;
+}
+
+// The tag of a key's index entries, never 0 so that 0 means an empty slot.
+uint64_t Tag(uint64_t hash) {
+  uint64_t tag = hash >> kTagShift;
+  return tag ? tag : 1;
+}
+
+uint64_t MakeEntry(uint64_t tag, uint64_t off) {
+  return (tag << kTagShift) | (off & kOffsetMask);
+}
+
+} // anonymous namespace
+
+struct Store::Partition {
+  Partition(size_t log_bytes, size_t nr_buckets);
+  ~Partition();
+
+  Bucket *BucketOf(uint64_t hash) const {
+    return &buckets[hash & bucket_mask];
+  }
+
+  // Copies out the item at @off if it holds @key. Safe without @lock.
+  Status Read(uint64_t off, const void *key, size_t keylen, void *buf,
+              size_t cap, ItemInfo *info) const;
+  // Finds @key's slot in @b, or returns -1. Needs @lock.
+  int Find(const Bucket *b, uint64_t tag, const void *key, size_t keylen,
+           ItemInfo *info, uint64_t *off) const;
+  // Picks a slot in @b for a new key, evicting the oldest if they're full.
+  int Victim(const Bucket *b) const;
+  // Copies the value of the item at @off, which must be intact.
+  void CopyValue(uint64_t off, size_t keylen, void *buf, size_t len) const;
+  // Writes an item with the value @a then @b to the log. Needs @lock.
+  uint64_t Append(const void *key, size_t keylen, const ItemInfo &info,
+                  const void *a, size_t alen, const void *b, size_t blen);
+  // Points slot @slot of @b at @entry. Needs @lock.
+  void Publish(Bucket *b, int slot, uint64_t entry);
+
+  rt::Spin lock;                  // serializes writers
+  std::atomic<uint64_t> head;     // the log offset of the next item
+  std::atomic<uint64_t> flushed;  // items before this offset were flushed
+  uint64_t next_cas;              // protected by @lock
+  char *log;
+  uint64_t log_size;
+  Bucket *buckets;
+  uint64_t bucket_mask;
+};
+
+Store::Partition::Partition(size_t log_bytes, size_t nr_buckets)
+    : head(0), flushed(0), next_cas(0), log(new char[log_bytes]),
+      log_size(log_bytes), bucket_mask(nr_buckets - 1) {
+  size_t len = nr_buckets * sizeof(Bucket);
+  buckets = static_cast<Bucket *>(aligned_alloc(CACHE_LINE_SIZE, len));
+  if (!buckets) panic("couldn't allocate the hash index");
+  memset(static_cast<void *>(buckets), 0, len);
+}
+
+Store::Partition::~Partition() {
+  free(buckets);
+  delete[] log;
+}
+
+Status Store::Partition::Read(uint64_t off, const void *key, size_t keylen,
+                              void *buf, size_t cap, ItemInfo *info) const {
+  if (off < flushed.load(std::memory_order_acquire)) return Status::kNotFound;
+
+  // The item may be getting overwritten, so check it before trusting it.
+  uint64_t pos = off % log_size;
+  Item it;
+  if (pos + sizeof(it) > log_size) return Status::kNotFound;
+  memcpy(&it, log + pos, sizeof(it));
+  if (it.keylen != keylen || it.vallen > kMaxValueLen ||
+      pos + ItemLen(it.keylen, it.vallen) > log_size) {
+    return Status::kNotFound;
+  }
+  const char *data = log + pos + sizeof(it);
+  if (memcmp(data, key, keylen) != 0) return Status::kNotFound;
+
+  Status ret = Status::kOk;
+  if (it.vallen > cap)
+    ret = Status::kNoSpace;
+  else if (it.vallen)
+    memcpy(buf, data + keylen, it.vallen);
+
+  // Writers move @head before overwriting anything, so if it hasn't lapped
+  // the item yet, what was copied is intact.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (head.load(std::memory_order_relaxed) > off + log_size)
+    return Status::kNotFound;
+  if (it.exptime && it.exptime <= Now()) return Status::kNotFound;
+
+  info->flags = it.flags;
+  info->exptime = it.exptime;
+  info->cas = it.cas;
+  info->vallen = it.vallen;
+  return ret;
+}
+
+int Store::Partition::Find(const Bucket *b, uint64_t tag, const void *key,
+                           size_t keylen, ItemInfo *info,
+                           uint64_t *off) const {
+  for (int i = 0; i < kBucketSlots; ++i) {
+    uint64_t e = b->slots[i].load(std::memory_order_relaxed);
+    if ((e >> kTagShift) != tag) continue;
+    if (Read(e & kOffsetMask, key, keylen, nullptr, 0, info) !=
+        Status::kNotFound) {
+      *off = e & kOffsetMask;
+      return i;
+    }
+  }
+  return -1;
+}
+
+int Store::Partition::Victim(const Bucket *b) const {
+  int victim = 0;
+  uint64_t oldest = kOffsetMask;
+
+  for (int i = 0; i < kBucketSlots; ++i) {
+    uint64_t e = b->slots[i].load(std::memory_order_relaxed);
+    if (e == 0) return i;
+    if ((e & kOffsetMask) < oldest) {
+      oldest = e & kOffsetMask;
+      victim = i;
+    }
+  }
+  return victim;
+}
+
+void Store::Partition::CopyValue(uint64_t off, size_t keylen, void *buf,
+                                 size_t len) const {
+  memcpy(buf, log + off % log_size + sizeof(Item) + keylen, len);
+}
+
+uint64_t Store::Partition::Append(const void *key, size_t keylen,
+                                  const ItemInfo &info, const void *a,
+                                  size_t alen, const void *b, size_t blen) {
+  size_t len = ItemLen(keylen, alen + blen);
+  uint64_t off = head.load(std::memory_order_relaxed);
+
+  // Items never wrap around the end of the log.
+  if (off % log_size + len > log_size) off += log_size - off % log_size;
+
+  // Claim the space before overwriting it, see Read().
+  head.store(off + len, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  Item *it = reinterpret_cast<Item *>(log + off % log_size);
+  it->vallen = alen + blen;
+  it->keylen = keylen;
+  it->pad = 0;
+  it->flags = info.flags;
+  it->exptime = info.exptime;
+  it->cas = info.cas;
+  char *data = reinterpret_cast<char *>(it + 1);
+  memcpy(data, key, keylen);
+  if (alen) memcpy(data + keylen, a, alen);
+  if (blen) memcpy(data + keylen + alen, b, blen);
+  return off;
+}
+
+void Store::Partition::Publish(Bucket *b, int slot, uint64_t entry) {
+  uint32_t v = b->version.load(std::memory_order_relaxed);
+
+  b->version.store(v + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  b->slots[slot].store(entry, std::memory_order_relaxed);
+  b->version.store(v + 2, std::memory_order_release);
+}
+
+Store::Store(unsigned int nr_parts, size_t bytes) {
+  size_t log_bytes = align_down(bytes / nr_parts, CACHE_LINE_SIZE);
+  log_bytes = std::max(log_bytes, kMinLogBytes);
+  size_t nr_buckets = 1;
+  while (nr_buckets * kBucketSlots * kAvgItemLen < log_bytes)
+    nr_buckets <<= 1;
+
+  for (unsigned int i = 0; i < nr_parts; ++i)
+    parts_.emplace_back(new Partition(log_bytes, nr_buckets));
+}
+
+Store::~Store() { }
+
+Store::Partition *Store::PartitionOf(uint64_t hash) const {
+  // The bucket index comes from the low bits and the tag from the top ones.
+  return parts_[(hash >> 32) % parts_.size()].get();
+}
+
+Status Store::Get(const void *key, size_t keylen, void *buf, size_t cap,
+                  ItemInfo *info) {
+  if (keylen == 0 || keylen > kMaxKeyLen) return Status::kInvalid;
+
+  uint64_t h = HashKey(key, keylen);
+  Partition *p = PartitionOf(h);
+  Bucket *b = p->BucketOf(h);
+  uint64_t tag = Tag(h);
+
+  while (true) {
+    uint32_t v = b->version.load(std::memory_order_acquire);
+    if (unlikely(v & 1)) {
+      cpu_relax();
+      continue;
+    }
+
+    Status ret = Status::kNotFound;
+    for (int i = 0; i < kBucketSlots && ret == Status::kNotFound; ++i) {
+      uint64_t e = b->slots[i].load(std::memory_order_relaxed);
+      if ((e >> kTagShift) != tag) continue;
+      ret = p->Read(e & kOffsetMask, key, keylen, buf, cap, info);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (likely(b->version.load(std::memory_order_relaxed) == v)) return ret;
+  }
+}
+
+Status Store::Set(SetMode mode, const void *key, size_t keylen,
+                  const void *val, size_t vallen, uint32_t flags,
+                  uint32_t exptime, uint64_t cas, uint64_t *cas_out) {
+  if (keylen == 0 || keylen > kMaxKeyLen) return Status::kInvalid;
+  if (vallen > kMaxValueLen) return Status::kTooLarge;
+
+  uint64_t h = HashKey(key, keylen);
+  Partition *p = PartitionOf(h);
+  Bucket *b = p->BucketOf(h);
+  uint64_t tag = Tag(h);
+  bool concat = mode == SetMode::kAppend || mode == SetMode::kPrepend;
+
+  rt::ScopedLock<rt::Spin> l(&p->lock);
+  ItemInfo old;
+  uint64_t off;
+  int slot = p->Find(b, tag, key, keylen, &old, &off);
+  if (slot < 0) {
+    if (concat) return Status::kNotStored;
+    if (cas || mode == SetMode::kReplace) return Status::kNotFound;
+  } else {
+    if (mode == SetMode::kAdd) return Status::kNotStored;
+    if (cas && cas != old.cas) return Status::kExists;
+  }
+
+  // The new copy could overwrite the old one, so save its value first.
+  std::unique_ptr<char[]> prev;
+  size_t prevlen = 0;
+  if (concat) {
+    if (old.vallen + vallen > kMaxValueLen) return Status::kTooLarge;
+    prevlen = old.vallen;
+    prev.reset(new char[prevlen]);
+    p->CopyValue(off, keylen, prev.get(), prevlen);
+    flags = old.flags;
+    exptime = old.exptime;
+  }
+
+  ItemInfo info;
+  info.flags = flags;
+  info.exptime = exptime;
+  info.cas = ++p->next_cas;
+  uint64_t noff;
+  if (mode == SetMode::kPrepend)
+    noff = p->Append(key, keylen, info, val, vallen, prev.get(), prevlen);
+  else
+    noff = p->Append(key, keylen, info, prev.get(), prevlen, val, vallen);
+  p->Publish(b, slot >= 0 ? slot : p->Victim(b), MakeEntry(tag, noff));
+  *cas_out = info.cas;
+  return Status::kOk;
+}
+
+Status Store::Delete(const void *key, size_t keylen, uint64_t cas) {
+  if (keylen == 0 || keylen > kMaxKeyLen) return Status::kInvalid;
+
+  uint64_t h = HashKey(key, keylen);
+  Partition *p = PartitionOf(h);
+  Bucket *b = p->BucketOf(h);
+
+  rt::ScopedLock<rt::Spin> l(&p->lock);
+  ItemInfo old;
+  uint64_t off;
+  int slot = p->Find(b, Tag(h), key, keylen, &old, &off);
+  if (slot < 0) return Status::kNotFound;
+  if (cas && cas != old.cas) return Status::kExists;
+  p->Publish(b, slot, 0);
+  return Status::kOk;
+}
+
+Status Store::Incr(const void *key, size_t keylen, bool decr, uint64_t delta,
+                   bool create, uint64_t initial, uint32_t exptime,
+                   uint64_t cas, uint64_t *val_out, uint64_t *cas_out) {
+  if (keylen == 0 || keylen > kMaxKeyLen) return Status::kInvalid;
+
+  uint64_t h = HashKey(key, keylen);
+  Partition *p = PartitionOf(h);
+  Bucket *b = p->BucketOf(h);
+  uint64_t tag = Tag(h);
+
+  rt::ScopedLock<rt::Spin> l(&p->lock);
+  ItemInfo info;
+  uint64_t off, val;
+  int slot = p->Find(b, tag, key, keylen, &info, &off);
+  if (slot < 0) {
+    if (cas || !create) return Status::kNotFound;
+    val = initial;
+    info.flags = 0;
+    info.exptime = exptime;
+  } else {
+    if (cas && cas != info.cas) return Status::kExists;
+
+    // at most 20 digits, like memcached
+    char digits[20];
+    if (info.vallen == 0 || info.vallen > sizeof(digits))
+      return Status::kNonNumeric;
+    p->CopyValue(off, keylen, digits, info.vallen);
+    val = 0;
+    for (uint32_t i = 0; i < info.vallen; ++i) {
+      if (digits[i] < '0' || digits[i] > '9' ||
+          __builtin_mul_overflow(val, 10, &val) ||
+          __builtin_add_overflow(val, digits[i] - '0', &val)) {
+        return Status::kNonNumeric;
+      }
+    }
+    if (decr)
+      val = val > delta ? val - delta : 0;
+    else
+      val += delta;
+  }
+
+  char str[21];
+  int len = snprintf(str, sizeof(str), "%lu", val);
+  info.cas = ++p->next_cas;
+  uint64_t noff = p->Append(key, keylen, info, str, len, nullptr, 0);
+  p->Publish(b, slot >= 0 ? slot : p->Victim(b), MakeEntry(tag, noff));
+  *val_out = val;
+  *cas_out = info.cas;
+  return Status::kOk;
+}
+
+void Store::Flush() {
+  for (auto &p : parts_) {
+    rt::ScopedLock<rt::Spin> l(&p->lock);
+    p->flushed.store(p->head.load(std::memory_order_relaxed),
+                     std::memory_order_release);
+  }
+}
+
+uint32_t Store::Now() {
+  return microtime() / ONE_SECOND + 1;
+}
+
+uint32_t Store::ExpTime(uint32_t exptime) {
+  if (exptime == 0) return 0;
+  if (exptime <= kMaxRelativeExpTime) return Now() + exptime;
+
+  // already expired, since Now() starts at 1
+  time_t now = time(nullptr);
+  if (static_cast<time_t>(exptime) <= now) return 1;
+  return Now() + (exptime - now);
+}
+
+} // namespace kv
@@ -0,0 +1,109 @@
+// store.h - a partitioned, lossy key-value cache
+//
+// Keys are spread over partitions by hash, one per kthread by default. Each
+// partition keeps its items in a circular log and finds them through a
+// bucketed hash index, in the style of MICA: writers append a fresh copy of
+// the item to the log and repoint its index entry under the partition's lock,
+// and once the log wraps around, new items overwrite the oldest ones. Readers
+// take no locks and write no shared memory. They copy the item out of the log
+// and check afterwards that neither its bucket nor the bytes they copied were
+// changed in the meantime, retrying or missing if they were. Hits therefore
+// scale with the number of kthreads regardless of which one a flow's RSS hash
+// lands on, and only writers to the same partition ever contend.
+
+#pragma once
+
+#include "sync.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace kv {
+
+// memcached's limits.
+constexpr size_t kMaxKeyLen = 250;
+constexpr size_t kMaxValueLen = 1 << 20;
+
+// The outcome of an operation, with the same meanings as memcached's.
+enum class Status {
+  kOk = 0,
+  kNotFound,      // the key is missing (or its cas didn't match a miss)
+  kExists,        // the cas didn't match
+  kNotStored,     // add found the key, or append/prepend didn't
+  kTooLarge,      // the value is over kMaxValueLen
+  kInvalid,       // the key is empty or over kMaxKeyLen
+  kNonNumeric,    // incr/decr on a value that isn't a number
+  kNoSpace,       // Get()'s buffer is too small, see Get()
+};
+
+// An item's metadata.
+struct ItemInfo {
+  uint32_t flags;     // opaque to the server
+  uint32_t exptime;   // in Store::Now() seconds, 0 if never
+  uint64_t cas;       // changes every time the item does
+  uint32_t vallen;
+};
+
+// How Set() treats an existing item.
+enum class SetMode {
+  kSet,           // store unconditionally
+  kAdd,           // only if the key is missing
+  kReplace,       // only if the key exists
+  kAppend,        // add to the end of an existing value
+  kPrepend,       // add to the start of an existing value
+};
+
+class Store {
+ public:
+  // Creates a store with @nr_parts partitions that share about @bytes.
+  Store(unsigned int nr_parts, size_t bytes);
+  ~Store();
+
+  // Copies the value of @key into @buf, which holds @cap bytes. Never takes
+  // a lock. Returns kNoSpace, with @info->vallen set, if the value doesn't
+  // fit, so the caller can try again with a larger buffer.
+  Status Get(const void *key, size_t keylen, void *buf, size_t cap,
+             ItemInfo *info);
+
+  // Stores @val under @key. If @cas is nonzero, the item must exist and have
+  // that cas. Sets @cas_out to the new cas on success.
+  Status Set(SetMode mode, const void *key, size_t keylen, const void *val,
+             size_t vallen, uint32_t flags, uint32_t exptime, uint64_t cas,
+             uint64_t *cas_out);
+
+  // Removes @key. If @cas is nonzero, it must match the item's.
+  Status Delete(const void *key, size_t keylen, uint64_t cas);
+
+  // Adds @delta to (or, if @decr, subtracts it from, stopping at zero) the
+  // decimal number stored under @key. A missing key is set to @initial,
+  // unless @create is false. Sets @val_out and @cas_out on success.
+  Status Incr(const void *key, size_t keylen, bool decr, uint64_t delta,
+              bool create, uint64_t initial, uint32_t exptime, uint64_t cas,
+              uint64_t *val_out, uint64_t *cas_out);
+
+  // Drops every item.
+  void Flush();
+
+  // Gets the current time for expiration, in seconds since the process
+  // started (starting at 1, so 0 can mean never).
+  static uint32_t Now();
+  // Converts a memcached expiration time (0 for never, seconds from now up
+  // to 30 days, or else a Unix time) to Now() seconds.
+  static uint32_t ExpTime(uint32_t exptime);
+
+ private:
+  struct Partition;
+
+  Partition *PartitionOf(uint64_t hash) const;
+
+  std::vector<std::unique_ptr<Partition>> parts_;
+
+  // disable move and copy.
+  Store(const Store&) = delete;
+  Store& operator=(const Store&) = delete;
+};
+
+} // namespace kv
@@ -44,6 +44,9 @@ pub struct Packet {
     actual_start: Option<Duration>,
     completion_time_ns: AtomicU64,
     completion_time: Option<Duration>,
+    /// The key and value size recorded in a trace, if replaying one.
+    key: Option<u64>,
+    value_size: u64,
 }
 
 mod fakework;
@@ -55,6 +58,9 @@ use memcached::MemcachedProtocol;
 mod dns;
 use dns::DnsProtocol;
 
+mod trace;
+use trace::Trace;
+
 #[derive(Copy, Clone, Debug)]
 enum Distribution {
     Zero,
@@ -294,6 +300,59 @@ struct RequestSchedule {
     output: OutputMode,
     runtime: Duration,
     discard_pct: usize,
+    /// Replays the requests of a trace instead of sampling arrival and service.
+    trace: Option<&'static Trace>,
+}
+
+impl RequestSchedule {
+    fn name(&self) -> &'static str {
+        match self.trace {
+            Some(_) => "trace",
+            None => self.service.name(),
+        }
+    }
+}
+
+/// Generates the requests of client thread `tidx` of `nthreads`.
+fn gen_thread_packets<R: Rng>(
+    schedules: &Vec<RequestSchedule>,
+    tidx: usize,
+    nthreads: usize,
+    rng: &mut R,
+) -> Vec<Packet> {
+    let mut last = 100_000_000;
+    let mut thread_packets: Vec<Packet> = Vec::new();
+    for sched in schedules {
+        let end = last + duration_to_ns(sched.runtime);
+        if let Some(trace) = sched.trace {
+            for r in trace.thread_records(tidx, nthreads) {
+                if last + r.offset >= end {
+                    break;
+                }
+                thread_packets.push(Packet {
+                    randomness: rng.gen::<u64>(),
+                    target_start: Duration::from_nanos(last + r.offset),
+                    work_iterations: r.work_iterations,
+                    key: Some(r.key),
+                    value_size: r.size,
+                    ..Default::default()
+                });
+            }
+            last = end;
+            continue;
+        }
+
+        while last < end {
+            last += sched.arrival.sample(rng);
+            thread_packets.push(Packet {
+                randomness: rng.gen::<u64>(),
+                target_start: Duration::from_nanos(last),
+                work_iterations: sched.service.sample(rng),
+                ..Default::default()
+            });
+        }
+    }
+    thread_packets
 }
 
 fn gen_classic_packet_schedule(
@@ -316,6 +375,7 @@ fn gen_classic_packet_schedule(
             output: OutputMode::Silent,
             runtime: Duration::from_millis(100),
             discard_pct: 0,
+            trace: None,
         });
     }
 
@@ -326,11 +386,28 @@ fn gen_classic_packet_schedule(
         output: output,
         runtime: runtime,
         discard_pct: 10,
+        trace: None,
     });
 
     sched
 }
 
+/// Replays a trace once, or for `runtime` if that's shorter.
+fn gen_trace_schedule(
+    trace: &'static Trace,
+    runtime: Duration,
+    output: OutputMode,
+) -> Vec<RequestSchedule> {
+    vec![RequestSchedule {
+        arrival: Distribution::Zero,
+        service: Distribution::Zero,
+        output: output,
+        runtime: std::cmp::min(runtime, trace.duration()),
+        discard_pct: 0,
+        trace: Some(trace),
+    }]
+}
+
 fn gen_loadshift_experiment(
     spec: &str,
     service: Distribution,
@@ -348,6 +425,7 @@ fn gen_loadshift_experiment(
                 output: OutputMode::Trace,
                 runtime: Duration::from_micros(micros),
                 discard_pct: 0,
+                trace: None,
             }
         })
         .collect()
@@ -375,7 +453,7 @@ fn process_result(sched: &RequestSchedule, packets: &mut [Packet], wct_start: Sy
                 let last_send = packets.iter().map(|p| p.target_start).max().unwrap();
                 println!(
                     "{}, {}, 0, {}, {}, {}",
-                    sched.service.name(),
+                    sched.name(),
                     packets.len() as u64 * 1000_000_000 / duration_to_ns(last_send - first_send),
                     dropped,
                     never_sent,
@@ -412,7 +490,7 @@ fn process_result(sched: &RequestSchedule, packets: &mut [Packet], wct_start: Sy
 
     println!(
         "{}, {}, {}, {}, {}, {:.1}, {:.1}, {:.1}, {:.1}, {:.1}, {}",
-        sched.service.name(),
+        sched.name(),
         (packets.len() - never_sent) as u64 * 1000_000_000 / duration_to_ns(last_send - first_send),
         latencies.len() as u64 * 1000_000_000 / duration_to_ns(last_send - first_send),
         dropped,
@@ -480,20 +558,7 @@ fn run_client(
 
     let packet_schedules: Vec<(Vec<Packet>, Vec<Option<Duration>>, Connection)> = (0..nthreads)
         .map(|tidx| {
-            let mut last = 100_000_000;
-            let mut thread_packets: Vec<Packet> = Vec::new();
-            for sched in schedules {
-                let end = last + duration_to_ns(sched.runtime);
-                while last < end {
-                    last += sched.arrival.sample(&mut rng);
-                    thread_packets.push(Packet {
-                        randomness: rng.gen::<u64>(),
-                        target_start: Duration::from_nanos(last),
-                        work_iterations: sched.service.sample(&mut rng),
-                        ..Default::default()
-                    });
-                }
-            }
+            let thread_packets = gen_thread_packets(schedules, tidx, nthreads, &mut rng);
 
             let src_addr = SocketAddrV4::new(
                 Ipv4Addr::new(0, 0, 0, 0),
@@ -544,7 +609,7 @@ fn run_client(
         send_threads.push(backend.spawn_thread(move || {
             // If the send or receive thread is still running 500 ms after it should have finished,
             // then stop it by triggering a shutdown on the socket.
-            let last = packets[packets.len() - 1].target_start;
+            let last = packets.last().map_or(Duration::from_secs(0), |p| p.target_start);
             let socket = socket2.clone();
             let timer = backend.spawn_thread(move || {
                 backend.sleep(last + Duration::from_millis(500));
@@ -626,23 +691,7 @@ fn run_local(
     let mut rng = rand::thread_rng();
 
     let packet_schedules: Vec<Vec<Packet>> = (0..nthreads)
-        .map(|_| {
-            let mut last = 100_000_000;
-            let mut thread_packets: Vec<Packet> = Vec::new();
-            for sched in schedules {
-                let end = last + duration_to_ns(sched.runtime);
-                while last < end {
-                    last += sched.arrival.sample(&mut rng);
-                    thread_packets.push(Packet {
-                        randomness: rng.gen::<u64>(),
-                        target_start: Duration::from_nanos(last),
-                        work_iterations: sched.service.sample(&mut rng),
-                        ..Default::default()
-                    });
-                }
-            }
-            thread_packets
-        })
+        .map(|tidx| gen_thread_packets(schedules, tidx, nthreads, &mut rng))
         .collect();
 
     let start_unix = SystemTime::now();
@@ -868,6 +917,33 @@ fn main() {
                 .default_value("")
                 .help("loadshift spec"),
         )
+        .arg(
+            Arg::with_name("trace")
+                .long("trace")
+                .takes_value(true)
+                .help("Replay the requests of a trace file (timestamp, size, service, key)"),
+        )
+        .arg(
+            Arg::with_name("trace-speedup")
+                .long("trace-speedup")
+                .takes_value(true)
+                .default_value("1.0")
+                .help("Compress the trace's arrival times by this factor"),
+        )
+        .arg(
+            Arg::with_name("trace-shard")
+                .long("trace-shard")
+                .takes_value(true)
+                .default_value("0/1")
+                .help("Replay shard i/n of the trace, one shard per client"),
+        )
+        .arg(
+            Arg::with_name("trace-iteration-ns")
+                .long("trace-iteration-ns")
+                .takes_value(true)
+                .default_value("1.0")
+                .help("ns of service time per work iteration (see work-bench)"),
+        )
         .get_matches();
 
     let addr: SocketAddrV4 = FromStr::from_str(matches.value_of("ADDR").unwrap()).unwrap();
@@ -908,6 +984,25 @@ fn main() {
     });
 
     let loadshift_spec = value_t_or_exit!(matches, "loadshift", String);
+    let trace: Option<&'static Trace> = matches.value_of("trace").map(|path| {
+        let shard: Vec<usize> = matches
+            .value_of("trace-shard")
+            .unwrap()
+            .split("/")
+            .map(|s| s.parse().unwrap())
+            .collect();
+        assert!(shard.len() == 2);
+        let trace = Trace::load(
+            path,
+            shard[0],
+            shard[1],
+            value_t_or_exit!(matches, "trace-iteration-ns", f64),
+            value_t_or_exit!(matches, "trace-speedup", f64),
+        )
+        .unwrap_or_else(|e| panic!("Could not load trace {}: {}", path, e));
+        // the schedules of every run borrow it
+        &*Box::leak(Box::new(trace))
+    });
     let fakeworker = FakeWorker::create(matches.value_of("fakework").unwrap()).unwrap();
 
     match mode {
@@ -938,6 +1033,11 @@ fn main() {
         "local-client" => {
             backend.init_and_run(config, move || {
                 println!("Distribution, Target, Actual, Dropped, Never Sent, Median, 90th, 99th, 99.9th, 99.99th, Start");
+                if let Some(trace) = trace {
+                    let sched = gen_trace_schedule(trace, runtime, output);
+                    run_local(backend, nthreads, fakeworker.clone(), &sched);
+                    return;
+                }
                 if dowarmup {
                     for packets_per_second in (1..3).map(|i| i * 100000) {
                         let sched = gen_classic_packet_schedule(
@@ -989,6 +1089,24 @@ fn main() {
                     _ => (),
                 };
 
+                if let Some(trace) = trace {
+                    let sched = gen_trace_schedule(trace, runtime, output);
+                    run_client(
+                        backend,
+                        addr,
+                        nthreads,
+                        proto,
+                        tport,
+                        &mut barrier_group,
+                        &sched,
+                        0,
+                    );
+                    if let Some(ref mut g) = barrier_group {
+                        g.barrier();
+                    }
+                    return;
+                }
+
                 if !loadshift_spec.is_empty() {
                     let sched = gen_loadshift_experiment(&loadshift_spec, distribution, nthreads);
                     run_client(
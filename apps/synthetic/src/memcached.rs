@@ -119,6 +119,16 @@ pub struct MemcachedProtocol;
 
 impl MemcachedProtocol {
     pub fn set_request(key: u64, opaque: u32, buf: &mut Vec<u8>, tport: Transport) {
+        MemcachedProtocol::set_request_sized(key, VALUE_SIZE, opaque, buf, tport);
+    }
+
+    fn set_request_sized(
+        key: u64,
+        value_size: usize,
+        opaque: u32,
+        buf: &mut Vec<u8>,
+        tport: Transport,
+    ) {
         if let Transport::Udp = tport {
             buf.extend_from_slice(UDP_HEADER);
         }
@@ -128,7 +138,7 @@ impl MemcachedProtocol {
             opcode: Opcode::Set as u8,
             key_length: KEY_SIZE as u16,
             extras_length: 8,
-            total_body_length: (8 + KEY_SIZE + VALUE_SIZE) as u32,
+            total_body_length: (8 + KEY_SIZE + value_size) as u32,
             opaque: opaque,
             ..Default::default()
         }
@@ -139,12 +149,28 @@ impl MemcachedProtocol {
 
         write_key(buf, key);
 
-        for i in 0..VALUE_SIZE {
+        for i in 0..value_size {
             buf.push((((key * i as u64) >> (i % 4)) & 0xff) as u8);
         }
     }
 
     pub fn gen_request(i: usize, p: &Packet, buf: &mut Vec<u8>, tport: Transport) {
+        // A trace gives the key, and sets have a value size
+        if let Some(key) = p.key {
+            if p.value_size > 0 {
+                MemcachedProtocol::set_request_sized(
+                    key,
+                    p.value_size as usize,
+                    i as u32,
+                    buf,
+                    tport,
+                );
+                return;
+            }
+            MemcachedProtocol::get_request(key, i as u32, buf, tport);
+            return;
+        }
+
         // Use first 32 bits of randomness to determine if this is a SET or GET req
         let low32 = p.randomness & 0xffffffff;
         let key = (p.randomness >> 32) % NVALUES;
@@ -154,6 +180,10 @@ impl MemcachedProtocol {
             return;
         }
 
+        MemcachedProtocol::get_request(key, i as u32, buf, tport);
+    }
+
+    fn get_request(key: u64, opaque: u32, buf: &mut Vec<u8>, tport: Transport) {
         if let Transport::Udp = tport {
             buf.extend_from_slice(UDP_HEADER);
         }
@@ -163,7 +193,7 @@ impl MemcachedProtocol {
             opcode: Opcode::Get as u8,
             key_length: KEY_SIZE as u16,
             total_body_length: KEY_SIZE as u32,
-            opaque: i as u32,
+            opaque: opaque,
             ..Default::default()
         }
         .write(buf)
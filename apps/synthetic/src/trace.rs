@@ -0,0 +1,111 @@
+use std::fs::File;
+use std::io::{self, BufRead, BufReader, Error, ErrorKind};
+use std::time::Duration;
+
+/// One request of a recorded trace.
+#[derive(Copy, Clone, Debug)]
+pub struct TraceRecord {
+    /// When the request arrived, in ns after the first request of the trace.
+    pub offset: u64,
+    pub work_iterations: u64,
+    /// Value size in bytes, 0 for a lookup (only memcached uses it).
+    pub size: u64,
+    pub key: u64,
+}
+
+/// The part of a recorded trace that this client replays.
+///
+/// A trace is a text file with one request per line: the arrival timestamp
+/// (ns), the value size (bytes), the service time (ns), and the key, separated
+/// by commas or whitespace. Lines starting with '#' are ignored, and the
+/// timestamps may start anywhere and be out of order.
+///
+/// With several clients, each loads the same file with its own shard index and
+/// keeps every nshards'th request. Offsets are taken from the first request of
+/// the whole trace, so the shards stay aligned in time.
+pub struct Trace {
+    records: Vec<TraceRecord>,
+}
+
+fn parse_field(line: usize, field: Option<&str>) -> io::Result<u64> {
+    field
+        .and_then(|f| f.parse::<u64>().ok())
+        .ok_or_else(|| {
+            Error::new(
+                ErrorKind::InvalidData,
+                format!("trace line {}: expected timestamp, size, service, key", line),
+            )
+        })
+}
+
+impl Trace {
+    /// Loads shard `shard` of `nshards` from `path`. Service times are
+    /// converted to work iterations of `iteration_ns` each (as measured by the
+    /// work-bench mode), and the arrivals are sped up by `speedup`.
+    pub fn load(
+        path: &str,
+        shard: usize,
+        nshards: usize,
+        iteration_ns: f64,
+        speedup: f64,
+    ) -> io::Result<Trace> {
+        assert!(shard < nshards && iteration_ns > 0.0 && speedup > 0.0);
+
+        let mut rows: Vec<(u64, u64, u64, u64)> = Vec::new();
+        for (i, line) in BufReader::new(File::open(path)?).lines().enumerate() {
+            let line = line?;
+            let line = line.trim();
+            if line.is_empty() || line.starts_with('#') {
+                continue;
+            }
+
+            let mut fields = line
+                .split(|c: char| c == ',' || c.is_whitespace())
+                .filter(|f| !f.is_empty());
+            let timestamp = parse_field(i + 1, fields.next())?;
+            let size = parse_field(i + 1, fields.next())?;
+            let service = parse_field(i + 1, fields.next())?;
+            let key = parse_field(i + 1, fields.next())?;
+            rows.push((timestamp, size, service, key));
+        }
+
+        if rows.is_empty() {
+            return Err(Error::new(ErrorKind::InvalidData, "trace is empty"));
+        }
+
+        // Requests that arrived together keep their order in the file.
+        rows.sort_by_key(|r| r.0);
+        let first = rows[0].0;
+
+        let records = rows
+            .into_iter()
+            .enumerate()
+            .filter(|&(i, _)| i % nshards == shard)
+            .map(|(_, (timestamp, size, service, key))| TraceRecord {
+                offset: ((timestamp - first) as f64 / speedup) as u64,
+                work_iterations: (service as f64 / iteration_ns) as u64,
+                size: size,
+                key: key,
+            })
+            .collect::<Vec<_>>();
+        if records.is_empty() {
+            return Err(Error::new(ErrorKind::InvalidData, "trace shard is empty"));
+        }
+
+        Ok(Trace { records: records })
+    }
+
+    /// How long it takes to replay this shard of the trace.
+    pub fn duration(&self) -> Duration {
+        Duration::from_nanos(self.records.last().map_or(0, |r| r.offset) + 1)
+    }
+
+    /// The records that client thread `tidx` of `nthreads` sends, in order.
+    pub fn thread_records<'a>(
+        &'a self,
+        tidx: usize,
+        nthreads: usize,
+    ) -> impl Iterator<Item = &'a TraceRecord> + 'a {
+        self.records.iter().skip(tidx).step_by(nthreads)
+    }
+}
@@ -0,0 +1,163 @@
+/*
+ * allocprof.c - a sampling profiler for memory allocations
+ *
+ * When enabled, every allocprof_rate'th allocation on each thread is charged
+ * to its call site (or cache) in a small lock-free hash table. The table can
+ * be read while allocations continue, so profiles can be taken from running
+ * production instances.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/allocprof.h>
+#include <base/atomic.h>
+#include <base/hash.h>
+
+/* sample one in this many allocations per thread (0 disables profiling) */
+unsigned int allocprof_rate;
+/* allocations left until the next sample on this thread */
+__thread int allocprof_countdown;
+/* samples lost because the site table was full */
+uint64_t allocprof_dropped;
+
+struct allocprof_slot {
+	/* the key shifted left two bits, ORed with the kind (0 if unused) */
+	uintptr_t		tag;
+	const char		*name;
+	uint64_t		samples;
+	uint64_t		bytes;
+};
+
+static struct allocprof_slot allocprof_slots[ALLOCPROF_NR_SITES];
+
+static const char *allocprof_kind_names[] = {
+	"slab",
+	"tcache",
+	"smalloc",
+};
+
+BUILD_ASSERT(ARRAY_SIZE(allocprof_kind_names) == ALLOCPROF_NR_KINDS);
+BUILD_ASSERT(ALLOCPROF_NR_KINDS <= 4);
+BUILD_ASSERT(is_power_of_two(ALLOCPROF_NR_SITES));
+
+/**
+ * __allocprof_record - charges a sampled allocation to its site
+ * @kind: the allocator (ALLOCPROF_*)
+ * @key: the call site address, or the cache for ALLOCPROF_TCACHE
+ * @name: an optional human readable name for @key (may be NULL)
+ * @size: the size of the allocation
+ */
+void __allocprof_record(int kind, const void *key, const char *name,
+			size_t size)
+{
+	uintptr_t tag = ((uintptr_t)key << 2) | kind;
+	uint32_t idx = hash_crc32c_one(0, tag);
+	struct allocprof_slot *slot;
+	unsigned int i;
+
+	allocprof_countdown = ACCESS_ONCE(allocprof_rate);
+
+	for (i = 0; i < ALLOCPROF_NR_SITES; i++, idx++) {
+		slot = &allocprof_slots[idx & (ALLOCPROF_NR_SITES - 1)];
+		if (ACCESS_ONCE(slot->tag) != tag &&
+		    !__sync_bool_compare_and_swap(&slot->tag, 0, tag) &&
+		    ACCESS_ONCE(slot->tag) != tag)
+			continue;
+
+		if (name && !ACCESS_ONCE(slot->name))
+			ACCESS_ONCE(slot->name) = name;
+		__sync_fetch_and_add(&slot->samples, 1);
+		__sync_fetch_and_add(&slot->bytes, size);
+		return;
+	}
+
+	__sync_fetch_and_add(&allocprof_dropped, 1);
+}
+
+/**
+ * allocprof_set_rate - enables or disables allocation sampling
+ * @rate: sample one in every @rate allocations, or 0 to disable
+ */
+void allocprof_set_rate(unsigned int rate)
+{
+	ACCESS_ONCE(allocprof_rate) = rate;
+}
+
+static int allocprof_site_cmp(const void *a, const void *b)
+{
+	const struct allocprof_site *sa = a, *sb = b;
+
+	if (sa->samples == sb->samples)
+		return 0;
+	return sa->samples < sb->samples ? 1 : -1;
+}
+
+/**
+ * allocprof_snapshot - copies out the sampled sites
+ * @sites: an array to store the sites
+ * @capacity: the size of @sites
+ *
+ * Sites are sorted by number of samples, most frequent first. If @capacity is
+ * ALLOCPROF_NR_SITES in size, then all sites will fit.
+ *
+ * Returns the number of sites stored.
+ */
+int allocprof_snapshot(struct allocprof_site *sites, int capacity)
+{
+	struct allocprof_site all[ALLOCPROF_NR_SITES];
+	struct allocprof_slot *slot;
+	uintptr_t tag;
+	int i, nr = 0;
+
+	for (i = 0; i < ALLOCPROF_NR_SITES; i++) {
+		slot = &allocprof_slots[i];
+		tag = ACCESS_ONCE(slot->tag);
+
+		if (!tag)
+			continue;
+		all[nr].key = (const void *)(tag >> 2);
+		all[nr].kind = tag & 3;
+		all[nr].name = ACCESS_ONCE(slot->name);
+		all[nr].samples = ACCESS_ONCE(slot->samples);
+		all[nr].bytes = ACCESS_ONCE(slot->bytes);
+		nr++;
+	}
+
+	qsort(all, nr, sizeof(all[0]), allocprof_site_cmp);
+	nr = min(nr, capacity);
+	memcpy(sites, all, sizeof(all[0]) * nr);
+	return nr;
+}
+
+/**
+ * allocprof_reset - discards all samples collected so far
+ *
+ * Samples recorded concurrently with a reset may be partially lost.
+ */
+void allocprof_reset(void)
+{
+	int i;
+
+	for (i = 0; i < ALLOCPROF_NR_SITES; i++) {
+		struct allocprof_slot *slot = &allocprof_slots[i];
+
+		ACCESS_ONCE(slot->samples) = 0;
+		ACCESS_ONCE(slot->bytes) = 0;
+		ACCESS_ONCE(slot->name) = NULL;
+		ACCESS_ONCE(slot->tag) = 0;
+	}
+	ACCESS_ONCE(allocprof_dropped) = 0;
+}
+
+/**
+ * allocprof_kind_name - returns the name of an allocator kind
+ * @kind: the allocator (ALLOCPROF_*)
+ */
+const char *allocprof_kind_name(int kind)
+{
+	if (kind < 0 || kind >= ALLOCPROF_NR_KINDS)
+		return "unknown";
+	return allocprof_kind_names[kind];
+}
@@ -5,6 +5,10 @@
 #include <base/stddef.h>
 #include <base/bitmap.h>
 
+/*
+ * Whole words are skipped at a time, and the first bit of a nonzero word is
+ * found with a single count-trailing-zeros (tzcnt or bsf).
+ */
 static __always_inline int
 bitmap_find_next(unsigned long *bits, int nbits, int pos, bool invert)
 {
@@ -18,7 +22,7 @@ bitmap_find_next(unsigned long *bits, int nbits, int pos, bool invert)
 			val = ~val;
 		val &= mask;
 		if (val)
-			return min(idx + __builtin_ffsl(val) - 1, nbits);
+			return min(idx + __builtin_ctzl(val), nbits);
 		mask = ~0UL;
 	}
 
@@ -50,3 +54,24 @@ int bitmap_find_next_set(unsigned long *bits, int nbits, int pos)
 {
 	return bitmap_find_next(bits, nbits, pos, false);
 }
+
+/**
+ * bitmap_weight - counts the set bits
+ * @bits: the bitmap
+ * @nbits: the number of total bits
+ *
+ * Returns the number of set bits.
+ */
+int bitmap_weight(unsigned long *bits, int nbits)
+{
+	int i, weight = 0;
+
+	for (i = 0; i < nbits / BITS_PER_LONG; i++)
+		weight += __builtin_popcountl(bits[i]);
+	if (BITMAP_POS_SHIFT(nbits)) {
+		weight += __builtin_popcountl(bits[i] &
+			((1UL << BITMAP_POS_SHIFT(nbits)) - 1));
+	}
+
+	return weight;
+}
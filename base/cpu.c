@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/syscall.h>
 
 #include <base/stddef.h>
@@ -20,8 +21,153 @@
 int cpu_count;
 /* the number of NUMA nodes detected */
 int numa_count;
+/* the number of last-level cache domains detected */
+int llc_count;
 /* a table of information on each CPU */
 struct cpu_info cpu_info_tbl[NCPU];
+/* the distance between each pair of NUMA nodes */
+int numa_distance_tbl[NNUMA][NNUMA];
+
+/*
+ * Records the caches of @cpu. A cache without an id is named after the lowest
+ * CPU that shares it.
+ */
+static void cpu_scan_caches(int cpu)
+{
+	struct cpu_info *info = &cpu_info_tbl[cpu];
+	struct cpu_cache *c;
+	DEFINE_BITMAP(shared_mask, NCPU);
+	char path[PATH_MAX], type[32];
+	uint64_t tmp;
+	int i;
+
+	for (i = 0; info->nr_caches < CPU_MAX_CACHES; i++) {
+		c = &info->caches[info->nr_caches];
+
+		snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH
+			 "/index%d/level", cpu, i);
+		if (sysfs_parse_val(path, &tmp))
+			break;
+		c->level = (int)tmp;
+
+		snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH
+			 "/index%d/type", cpu, i);
+		if (sysfs_parse_str(path, type, sizeof(type)))
+			continue;
+		if (strcmp(type, "Data") == 0)
+			c->type = CPU_CACHE_DATA;
+		else if (strcmp(type, "Instruction") == 0)
+			c->type = CPU_CACHE_INST;
+		else
+			c->type = CPU_CACHE_UNIFIED;
+
+		snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH
+			 "/index%d/size", cpu, i);
+		if (sysfs_parse_size(path, &tmp))
+			tmp = 0;
+		c->size = tmp;
+
+		snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH
+			 "/index%d/coherency_line_size", cpu, i);
+		c->line_size = sysfs_parse_val(path, &tmp) ? CACHE_LINE_SIZE :
+							     (int)tmp;
+
+		snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH
+			 "/index%d/id", cpu, i);
+		if (sysfs_parse_val(path, &tmp) == 0) {
+			c->id = (int)tmp;
+		} else {
+			snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH
+				 "/index%d/shared_cpu_list", cpu, i);
+			if (sysfs_parse_bitlist(path, shared_mask, cpu_count))
+				c->id = cpu;
+			else
+				c->id = bitmap_find_next_set(shared_mask,
+							     cpu_count, 0);
+		}
+
+		info->nr_caches++;
+	}
+}
+
+/*
+ * Numbers the last-level cache domains densely, in order of their lowest CPU.
+ */
+static void cpu_number_llcs(void)
+{
+	int i, first;
+
+	for (i = 0; i < cpu_count; i++) {
+		first = bitmap_find_next_set(cpu_info_tbl[i].llc_siblings_mask,
+					     cpu_count, 0);
+		if (first >= i || first >= cpu_count)
+			cpu_info_tbl[i].llc = llc_count++;
+		else
+			cpu_info_tbl[i].llc = cpu_info_tbl[first].llc;
+	}
+}
+
+/*
+ * Finds the NUMA node of each CPU and the distances between nodes. Without
+ * per-node CPU lists, each package is assumed to be a node.
+ */
+static void cpu_scan_numa(void)
+{
+	char path[PATH_MAX];
+	DEFINE_BITMAP(node_cpus, NCPU);
+	uint64_t dist[NNUMA];
+	int i, j, nr;
+
+	for (i = 0; i < cpu_count; i++)
+		cpu_info_tbl[i].node = min(cpu_info_tbl[i].package,
+					   numa_count - 1);
+
+	for (i = 0; i < numa_count; i++) {
+		snprintf(path, sizeof(path), SYSFS_NODE_PATH "/cpulist", i);
+		if (sysfs_parse_bitlist(path, node_cpus, cpu_count) == 0) {
+			bitmap_for_each_set(node_cpus, cpu_count, j)
+				cpu_info_tbl[j].node = i;
+		}
+
+		snprintf(path, sizeof(path), SYSFS_NODE_PATH "/distance", i);
+		nr = sysfs_parse_vals(path, dist, NNUMA);
+		for (j = 0; j < numa_count; j++) {
+			if (j < nr)
+				numa_distance_tbl[i][j] = (int)dist[j];
+			else
+				numa_distance_tbl[i][j] = i == j ? 10 : 20;
+		}
+	}
+}
+
+/**
+ * numa_nearest_nodes - lists NUMA nodes from nearest to farthest
+ * @node: the node to measure from
+ * @nodes: an array of numa_count entries to store the list
+ *
+ * @node itself comes first. Returns the number of nodes stored.
+ */
+int numa_nearest_nodes(int node, int *nodes)
+{
+	int i, j, tmp;
+
+	for (i = 0; i < numa_count; i++)
+		nodes[i] = i;
+	nodes[0] = node;
+	nodes[node] = 0;
+
+	/* there are only a few nodes, so insertion sort is plenty */
+	for (i = 2; i < numa_count; i++) {
+		for (j = i; j > 1 && numa_distance(node, nodes[j]) <
+				     numa_distance(node, nodes[j - 1]); j--) {
+			tmp = nodes[j];
+			nodes[j] = nodes[j - 1];
+			nodes[j - 1] = tmp;
+		}
+	}
+
+	return numa_count;
+}
 
 static int cpu_scan_topology(void)
 {
@@ -35,12 +181,10 @@ static int cpu_scan_topology(void)
 	if (sysfs_parse_bitlist("/sys/devices/system/node/online",
 			        numa_mask, NNUMA))
 		return -EIO;
-	bitmap_for_each_set(numa_mask, NNUMA, i) {
-		numa_count++;
-		if (numa_count <= i) {
-			log_err("cpu: can't support non-contiguous NUMA mask.");
-			return -EINVAL;
-		}
+	numa_count = bitmap_weight(numa_mask, NNUMA);
+	if (bitmap_find_next_cleared(numa_mask, NNUMA, 0) < numa_count) {
+		log_err("cpu: can't support non-contiguous NUMA mask.");
+		return -EINVAL;
 	}
 
 	if (numa_count <= 0 || numa_count > NNUMA) {
@@ -53,12 +197,10 @@ static int cpu_scan_topology(void)
 	if (sysfs_parse_bitlist("/sys/devices/system/cpu/online",
 			        cpu_mask, NCPU))
 		return -EIO;
-	bitmap_for_each_set(cpu_mask, NCPU, i) {
-		cpu_count++;
-		if (cpu_count <= i) {
-			log_err("cpu: can't support non-contiguous CPU mask.");
-			return -EINVAL;
-		}
+	cpu_count = bitmap_weight(cpu_mask, NCPU);
+	if (bitmap_find_next_cleared(cpu_mask, NCPU, 0) < cpu_count) {
+		log_err("cpu: can't support non-contiguous CPU mask.");
+		return -EINVAL;
 	}
 
 	if (cpu_count <= 0 || cpu_count > NCPU) {
@@ -88,8 +230,22 @@ static int cpu_scan_topology(void)
 		if (sysfs_parse_bitlist(path,
 			cpu_info_tbl[i].thread_siblings_mask, cpu_count))
 			return -EIO;
+
+		/* fall back to the package if the LLC isn't reported */
+		snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH
+			 "/index3/shared_cpu_list", i);
+		if (sysfs_parse_bitlist(path,
+			cpu_info_tbl[i].llc_siblings_mask, cpu_count)) {
+			memcpy(cpu_info_tbl[i].llc_siblings_mask,
+			       cpu_info_tbl[i].core_siblings_mask,
+			       sizeof(cpu_info_tbl[i].llc_siblings_mask));
+		}
+
+		cpu_scan_caches(i);
 	}
 
+	cpu_number_llcs();
+	cpu_scan_numa();
 	return 0;
 }
 
@@ -100,10 +256,20 @@ static int cpu_scan_topology(void)
  */
 int cpu_init(void)
 {
-	int ret = cpu_scan_topology();
+	const struct cpu_cache *c;
+	int ret, level;
+
+	ret = cpu_scan_topology();
 	if (ret)
 		return ret;
 
-	log_info("cpu: detected %d cores, %d nodes", cpu_count, numa_count);
+	log_info("cpu: detected %d cores, %d LLC domains, %d nodes",
+		 cpu_count, llc_count, numa_count);
+	for (level = 1; level <= 3; level++) {
+		c = cpu_cache_at_level(0, level);
+		if (c)
+			log_info("cpu: L%d cache %ld KB, %d byte lines", level,
+				 c->size / 1024, c->line_size);
+	}
 	return 0;
 }
@@ -72,7 +72,11 @@ static int init_internal(void)
 	if (ret)
 		return ret;
 
-	return slab_init();
+	ret = slab_init();
+	if (ret)
+		return ret;
+
+	return stat_init();
 }
 
 static const struct init_level init_base_levels[] = {
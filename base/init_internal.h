@@ -9,6 +9,7 @@ extern int cpu_init(void);
 extern int time_init(void);
 extern int page_init(void);
 extern int slab_init(void);
+extern int stat_init(void);
 extern int smalloc_init(void);
 
 /* internal base library per-thread initializers */
@@ -0,0 +1,285 @@
+/*
+ * lockprof.c - a contention profiler for locks
+ *
+ * When enabled, every acquisition of a spinlock_t, mutex_t or rwmutex_t is
+ * charged to its call site in a small lock-free hash table, with the cycles
+ * spent waiting for the lock and holding it. Like the allocation profiler,
+ * the table can be read while locks are in use, so contention can be
+ * measured on running production instances.
+ *
+ * Mutexes keep their own acquisition time, since a uthread may migrate while
+ * holding one. Spinlocks are always released by the thread that took them, so
+ * each thread instead keeps a small stack of the spinlocks it holds.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/atomic.h>
+#include <base/hash.h>
+#include <base/lock.h>
+#include <base/time.h>
+
+/* the spinlocks nested deeper on a thread don't get hold times */
+#define LOCKPROF_SPIN_DEPTH	4
+
+unsigned int lockprof_epoch;
+/* acquisitions lost because the site table was full */
+uint64_t lockprof_dropped;
+
+struct lockprof_slot {
+	/* the site shifted left two bits, ORed with the kind (0 if unused) */
+	uintptr_t		tag;
+	uint64_t		acquires;
+	uint64_t		contended;
+	uint64_t		wait_cycles;
+	uint64_t		hold_cycles;
+};
+
+struct lockprof_held {
+	spinlock_t		*l;
+	const void		*site;
+	uint64_t		tsc;
+	unsigned int		epoch;
+};
+
+static struct lockprof_slot lockprof_slots[LOCKPROF_NR_SITES];
+static unsigned int lockprof_last_epoch;
+
+/* the spinlocks this thread holds, oldest first */
+static __thread struct lockprof_held lockprof_held[LOCKPROF_SPIN_DEPTH];
+static __thread int lockprof_nr_held;
+
+static const char *lockprof_kind_names[] = {
+	"spin",
+	"mutex",
+	"rwmutex_rd",
+	"rwmutex_wr",
+};
+
+BUILD_ASSERT(ARRAY_SIZE(lockprof_kind_names) == LOCKPROF_NR_KINDS);
+BUILD_ASSERT(LOCKPROF_NR_KINDS <= 4);
+BUILD_ASSERT(is_power_of_two(LOCKPROF_NR_SITES));
+
+/* finds or claims the slot of a call site, or returns NULL if full */
+static struct lockprof_slot *lockprof_find(int kind, const void *site)
+{
+	uintptr_t tag = ((uintptr_t)site << 2) | kind;
+	uint32_t idx = hash_crc32c_one(0, tag);
+	struct lockprof_slot *slot;
+	unsigned int i;
+
+	for (i = 0; i < LOCKPROF_NR_SITES; i++, idx++) {
+		slot = &lockprof_slots[idx & (LOCKPROF_NR_SITES - 1)];
+		if (ACCESS_ONCE(slot->tag) == tag ||
+		    __sync_bool_compare_and_swap(&slot->tag, 0, tag) ||
+		    ACCESS_ONCE(slot->tag) == tag)
+			return slot;
+	}
+
+	__sync_fetch_and_add(&lockprof_dropped, 1);
+	return NULL;
+}
+
+/**
+ * __lockprof_acquired - charges an acquisition to its call site
+ * @kind: the lock type (LOCKPROF_*)
+ * @site: the call site
+ * @wait_start: when the caller started waiting, or 0 if it didn't
+ */
+void __lockprof_acquired(int kind, const void *site, uint64_t wait_start)
+{
+	struct lockprof_slot *slot = lockprof_find(kind, site);
+
+	if (!slot)
+		return;
+
+	__sync_fetch_and_add(&slot->acquires, 1);
+	if (wait_start) {
+		__sync_fetch_and_add(&slot->contended, 1);
+		__sync_fetch_and_add(&slot->wait_cycles, rdtsc() - wait_start);
+	}
+}
+
+/**
+ * __lockprof_released - charges the time a lock was held to its call site
+ * @kind: the lock type (LOCKPROF_*)
+ * @site: the call site that acquired it
+ * @acquire_tsc: when it was acquired
+ */
+void __lockprof_released(int kind, const void *site, uint64_t acquire_tsc)
+{
+	struct lockprof_slot *slot = lockprof_find(kind, site);
+
+	if (slot)
+		__sync_fetch_and_add(&slot->hold_cycles, rdtsc() - acquire_tsc);
+}
+
+/* starts timing the hold of @l, if it isn't nested too deeply */
+static void lockprof_spin_push(spinlock_t *l, const void *site)
+{
+	unsigned int epoch = ACCESS_ONCE(lockprof_epoch);
+	struct lockprof_held *h;
+
+	/* forget spinlocks taken while profiling was previously on */
+	while (lockprof_nr_held > 0 &&
+	       lockprof_held[lockprof_nr_held - 1].epoch != epoch)
+		lockprof_nr_held--;
+	if (lockprof_nr_held >= LOCKPROF_SPIN_DEPTH)
+		return;
+
+	h = &lockprof_held[lockprof_nr_held++];
+	h->l = l;
+	h->site = site;
+	h->tsc = rdtsc();
+	h->epoch = epoch;
+}
+
+/**
+ * __lockprof_spin_acquired - records that a spinlock was taken uncontended
+ * @l: the spinlock
+ * @site: the call site
+ */
+void __lockprof_spin_acquired(spinlock_t *l, const void *site)
+{
+	__lockprof_acquired(LOCKPROF_SPIN, site, 0);
+	lockprof_spin_push(l, site);
+}
+
+/**
+ * __lockprof_spin_lock - takes a spinlock while profiling
+ * @l: the spinlock
+ * @site: the call site
+ */
+void __lockprof_spin_lock(spinlock_t *l, const void *site)
+{
+	uint64_t wait_start = 0;
+
+	while (__sync_lock_test_and_set(&l->locked, 1)) {
+		if (!wait_start)
+			wait_start = rdtsc();
+		while (l->locked)
+			cpu_relax();
+	}
+
+	__lockprof_acquired(LOCKPROF_SPIN, site, wait_start);
+	lockprof_spin_push(l, site);
+}
+
+/**
+ * __lockprof_spin_release - charges the hold time of a spinlock being released
+ * @l: the spinlock
+ */
+void __lockprof_spin_release(spinlock_t *l)
+{
+	unsigned int epoch = ACCESS_ONCE(lockprof_epoch);
+	struct lockprof_held *h;
+	int i;
+
+	for (i = lockprof_nr_held - 1; i >= 0; i--) {
+		h = &lockprof_held[i];
+		if (h->l != l || h->epoch != epoch)
+			continue;
+
+		__lockprof_released(LOCKPROF_SPIN, h->site, h->tsc);
+		memmove(h, h + 1, sizeof(*h) * (lockprof_nr_held - i - 1));
+		lockprof_nr_held--;
+		return;
+	}
+}
+
+/**
+ * lockprof_enable - turns lock profiling on or off
+ * @enable: true to record acquisitions from now on
+ */
+void lockprof_enable(bool enable)
+{
+	unsigned int epoch = 0;
+
+	if (enable) {
+		epoch = __sync_add_and_fetch(&lockprof_last_epoch, 1);
+		if (!epoch)
+			epoch = __sync_add_and_fetch(&lockprof_last_epoch, 1);
+	}
+	ACCESS_ONCE(lockprof_epoch) = epoch;
+}
+
+static int lockprof_site_cmp(const void *a, const void *b)
+{
+	const struct lockprof_site *sa = a, *sb = b;
+
+	if (sa->wait_cycles == sb->wait_cycles)
+		return 0;
+	return sa->wait_cycles < sb->wait_cycles ? 1 : -1;
+}
+
+/**
+ * lockprof_snapshot - copies out the profiled call sites
+ * @sites: an array to store the sites
+ * @capacity: the size of @sites
+ *
+ * Sites are sorted by cycles spent waiting, most first. If @capacity is
+ * LOCKPROF_NR_SITES in size, then all sites will fit.
+ *
+ * Returns the number of sites stored.
+ */
+int lockprof_snapshot(struct lockprof_site *sites, int capacity)
+{
+	struct lockprof_site all[LOCKPROF_NR_SITES];
+	struct lockprof_slot *slot;
+	uintptr_t tag;
+	int i, nr = 0;
+
+	for (i = 0; i < LOCKPROF_NR_SITES; i++) {
+		slot = &lockprof_slots[i];
+		tag = ACCESS_ONCE(slot->tag);
+
+		if (!tag)
+			continue;
+		all[nr].site = (const void *)(tag >> 2);
+		all[nr].kind = tag & 3;
+		all[nr].acquires = ACCESS_ONCE(slot->acquires);
+		all[nr].contended = ACCESS_ONCE(slot->contended);
+		all[nr].wait_cycles = ACCESS_ONCE(slot->wait_cycles);
+		all[nr].hold_cycles = ACCESS_ONCE(slot->hold_cycles);
+		nr++;
+	}
+
+	qsort(all, nr, sizeof(all[0]), lockprof_site_cmp);
+	nr = min(nr, capacity);
+	memcpy(sites, all, sizeof(all[0]) * nr);
+	return nr;
+}
+
+/**
+ * lockprof_reset - discards all acquisitions recorded so far
+ *
+ * Acquisitions recorded concurrently with a reset may be partially lost.
+ */
+void lockprof_reset(void)
+{
+	int i;
+
+	for (i = 0; i < LOCKPROF_NR_SITES; i++) {
+		struct lockprof_slot *slot = &lockprof_slots[i];
+
+		ACCESS_ONCE(slot->acquires) = 0;
+		ACCESS_ONCE(slot->contended) = 0;
+		ACCESS_ONCE(slot->wait_cycles) = 0;
+		ACCESS_ONCE(slot->hold_cycles) = 0;
+		ACCESS_ONCE(slot->tag) = 0;
+	}
+	ACCESS_ONCE(lockprof_dropped) = 0;
+}
+
+/**
+ * lockprof_kind_name - returns the name of a lock type
+ * @kind: the lock type (LOCKPROF_*)
+ */
+const char *lockprof_kind_name(int kind)
+{
+	if (kind < 0 || kind >= LOCKPROF_NR_KINDS)
+		return "unknown";
+	return lockprof_kind_names[kind];
+}
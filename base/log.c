@@ -6,9 +6,13 @@
 #include <string.h>
 #include <stdarg.h>
 #include <execinfo.h>
+#include <pthread.h>
 #include <sched.h>
+#include <unistd.h>
 
 #include <base/stddef.h>
+#include <base/atomic.h>
+#include <base/lock.h>
 #include <base/log.h>
 #include <base/time.h>
 #include <asm/ops.h>
@@ -20,15 +24,450 @@ int max_loglevel = LOG_DEBUG;
 /* stored here to avoid pushing too much on the stack */
 static __thread char buf[MAX_LOG_LEN];
 
+
+/*
+ * Asynchronous logging
+ *
+ * Each thread saves its messages in a ring of its own, as the format string
+ * pointer and the raw arguments (strings are copied, since they may not live
+ * long enough). A background thread formats and writes them. Messages that
+ * can't be saved this way, because of an unsupported conversion or because the
+ * ring is in use by another thread (e.g., a preempted uthread), are written
+ * right away instead.
+ */
+
+#define LOG_RING_SIZE	1024	/* entries per thread, a power of two */
+#define LOG_MAX_RINGS	256
+#define LOG_MAX_ARGS	12
+#define LOG_STR_LEN	136	/* bytes of copied string arguments per entry */
+#define LOG_DRAIN_US	1000	/* how often the background thread wakes up */
+
+struct log_entry {
+	const char	*fmt;
+	uint64_t	us;
+	int16_t		level;
+	int16_t		cpu;
+	uint16_t	str_len;
+	uint64_t	args[LOG_MAX_ARGS];
+	char		strs[LOG_STR_LEN];
+};
+
+BUILD_ASSERT(sizeof(struct log_entry) == 256);
+
+struct log_ring {
+	/* written by the owning thread */
+	uint32_t		head;
+	int			busy;
+	uint64_t		drops;	/* messages lost while the ring was full */
+
+	/* written by the background thread */
+	uint32_t		tail __aligned(CACHE_LINE_SIZE);
+	uint64_t		drops_reported;
+
+	struct log_entry	entries[LOG_RING_SIZE] __aligned(CACHE_LINE_SIZE);
+};
+
+static bool log_async;
+static struct log_ring *log_rings[LOG_MAX_RINGS];
+static int nr_log_rings;
+static DEFINE_SPINLOCK(log_drain_lock);
+static __thread struct log_ring *log_ring;
+static __thread bool log_ring_failed;
+
+enum {
+	LOG_ARG_NONE = 0,	/* "%%" */
+	LOG_ARG_INT,
+	LOG_ARG_LONG,
+	LOG_ARG_LLONG,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_PTR,
+	LOG_ARG_STR,
+	LOG_ARG_BAD,		/* not supported, e.g. "%n" or "%Lf" */
+};
+
+struct log_spec {
+	const char	*end;	/* just past the conversion */
+	int		type;	/* LOG_ARG_* */
+	bool		star_width;
+	bool		star_prec;
+};
+
+/* parses the conversion specification after a '%' at @p */
+static void log_parse_spec(const char *p, struct log_spec *s)
+{
+	int lng = 0;
+
+	s->star_width = s->star_prec = false;
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+	if (*p == '*') {
+		s->star_width = true;
+		p++;
+	}
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			s->star_prec = true;
+			p++;
+		}
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+
+	switch (*p) {
+	case 'h':
+		if (*++p == 'h')
+			p++;
+		break;
+	case 'l':
+		lng = 1;
+		if (*++p == 'l') {
+			lng = 2;
+			p++;
+		}
+		break;
+	case 'z':
+	case 'j':
+	case 't':
+		lng = 1;
+		p++;
+		break;
+	case 'L':
+		lng = 3;
+		p++;
+		break;
+	}
+
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+		s->type = lng == 0 ? LOG_ARG_INT : lng == 1 ? LOG_ARG_LONG :
+			  lng == 2 ? LOG_ARG_LLONG : LOG_ARG_BAD;
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+	case 'a': case 'A':
+		s->type = lng == 3 ? LOG_ARG_BAD : LOG_ARG_DOUBLE;
+		break;
+	case 'p':
+		s->type = LOG_ARG_PTR;
+		break;
+	case 's':
+		s->type = lng ? LOG_ARG_BAD : LOG_ARG_STR;
+		break;
+	case '%':
+		s->type = LOG_ARG_NONE;
+		break;
+	default:
+		s->type = LOG_ARG_BAD;
+		break;
+	}
+
+	s->end = *p ? p + 1 : p;
+}
+
+/* saves the arguments of a message, returns false if they can't be */
+static bool log_capture(struct log_entry *e, const char *fmt, va_list ap)
+{
+	struct log_spec s;
+	const char *p = fmt, *str;
+	size_t room, len;
+	double d;
+	int n = 0;
+
+	e->str_len = 0;
+	while ((p = strchr(p, '%')) != NULL) {
+		log_parse_spec(p + 1, &s);
+		p = s.end;
+		if (s.type == LOG_ARG_BAD)
+			return false;
+		if (s.type == LOG_ARG_NONE)
+			continue;
+		if (n + s.star_width + s.star_prec >= LOG_MAX_ARGS)
+			return false;
+
+		if (s.star_width)
+			e->args[n++] = va_arg(ap, int);
+		if (s.star_prec)
+			e->args[n++] = va_arg(ap, int);
+
+		switch (s.type) {
+		case LOG_ARG_INT:
+			e->args[n++] = va_arg(ap, int);
+			break;
+		case LOG_ARG_LONG:
+			e->args[n++] = va_arg(ap, long);
+			break;
+		case LOG_ARG_LLONG:
+			e->args[n++] = va_arg(ap, long long);
+			break;
+		case LOG_ARG_DOUBLE:
+			d = va_arg(ap, double);
+			memcpy(&e->args[n++], &d, sizeof(d));
+			break;
+		case LOG_ARG_PTR:
+			e->args[n++] = (uintptr_t)va_arg(ap, void *);
+			break;
+		case LOG_ARG_STR:
+			str = va_arg(ap, const char *);
+			if (!str)
+				str = "(null)";
+			room = LOG_STR_LEN - e->str_len;
+			if (room == 0)
+				return false;
+			/* long strings are truncated */
+			len = strnlen(str, room - 1);
+			memcpy(e->strs + e->str_len, str, len);
+			e->strs[e->str_len + len] = '\0';
+			e->args[n++] = e->str_len;
+			e->str_len += len + 1;
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void log_append(char *out, size_t size, size_t *off, int ret)
+{
+	if (ret > 0)
+		*off = min(*off + ret, size - 1);
+}
+
+/* formats a saved message into @out */
+static void log_format(char *out, size_t size, const struct log_entry *e)
+{
+	const char *p = e->fmt, *pct, *c;
+	struct log_spec s;
+	char spec[64];
+	size_t off = 0, soff;
+	uint64_t arg;
+	double d;
+	int n = 0;
+
+	out[0] = '\0';
+	while ((pct = strchr(p, '%')) != NULL) {
+		log_append(out, size, &off,
+			   snprintf(out + off, size - off, "%.*s",
+				    (int)(pct - p), p));
+		log_parse_spec(pct + 1, &s);
+		p = s.end;
+		if (s.type == LOG_ARG_NONE) {
+			log_append(out, size, &off,
+				   snprintf(out + off, size - off, "%%"));
+			continue;
+		}
+
+		/* rebuild the specification with any '*' filled in */
+		for (c = pct, soff = 0; c < s.end && soff < sizeof(spec) - 12;
+		     c++) {
+			if (*c == '*') {
+				soff += snprintf(spec + soff, sizeof(spec) - soff,
+						 "%d", (int)e->args[n++]);
+			} else {
+				spec[soff++] = *c;
+			}
+		}
+		spec[soff] = '\0';
+
+		arg = e->args[n++];
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+		switch (s.type) {
+		case LOG_ARG_INT:
+			log_append(out, size, &off, snprintf(out + off,
+				   size - off, spec, (int)arg));
+			break;
+		case LOG_ARG_LONG:
+			log_append(out, size, &off, snprintf(out + off,
+				   size - off, spec, (long)arg));
+			break;
+		case LOG_ARG_LLONG:
+			log_append(out, size, &off, snprintf(out + off,
+				   size - off, spec, (long long)arg));
+			break;
+		case LOG_ARG_DOUBLE:
+			memcpy(&d, &arg, sizeof(d));
+			log_append(out, size, &off, snprintf(out + off,
+				   size - off, spec, d));
+			break;
+		case LOG_ARG_PTR:
+			log_append(out, size, &off, snprintf(out + off,
+				   size - off, spec, (void *)(uintptr_t)arg));
+			break;
+		case LOG_ARG_STR:
+			log_append(out, size, &off, snprintf(out + off,
+				   size - off, spec, e->strs + arg));
+			break;
+		}
+#pragma GCC diagnostic pop
+	}
+
+	snprintf(out + off, size - off, "%s", p);
+}
+
+/* writes out and empties every ring */
+static void log_drain(void)
+{
+	static char line[MAX_LOG_LEN];
+	struct log_ring *r;
+	struct log_entry *e;
+	uint32_t head, tail;
+	uint64_t drops;
+	int i, off;
+
+	spin_lock(&log_drain_lock);
+	for (i = 0; i < min(load_acquire(&nr_log_rings), LOG_MAX_RINGS); i++) {
+		r = load_acquire(&log_rings[i]);
+		if (!r)
+			continue;
+
+		head = load_acquire(&r->head);
+		for (tail = r->tail; tail != head; tail++) {
+			e = &r->entries[tail & (LOG_RING_SIZE - 1)];
+			off = snprintf(line, sizeof(line),
+				       "[%3d.%06d] CPU %02d| <%d> ",
+				       (int)(e->us / ONE_SECOND),
+				       (int)(e->us % ONE_SECOND),
+				       e->cpu, e->level);
+			log_format(line + off, sizeof(line) - off, e);
+			puts(line);
+		}
+		store_release(&r->tail, tail);
+
+		drops = ACCESS_ONCE(r->drops);
+		if (unlikely(drops != r->drops_reported)) {
+			printf("log: dropped %lu messages from a full ring\n",
+			       drops - r->drops_reported);
+			r->drops_reported = drops;
+		}
+	}
+	fflush(stdout);
+	spin_unlock(&log_drain_lock);
+}
+
+static void *log_async_thread(void *arg)
+{
+	while (true) {
+		log_drain();
+		usleep(LOG_DRAIN_US);
+	}
+
+	return NULL;
+}
+
+/* gets the calling thread's ring, creating it on first use */
+static struct log_ring *log_get_ring(void)
+{
+	struct log_ring *r;
+	int idx;
+
+	if (likely(log_ring) || log_ring_failed)
+		return log_ring;
+
+	log_ring_failed = true;
+	r = aligned_alloc(CACHE_LINE_SIZE, sizeof(*r));
+	if (!r)
+		return NULL;
+	memset(r, 0, sizeof(*r));
+
+	idx = __sync_fetch_and_add(&nr_log_rings, 1);
+	if (idx >= LOG_MAX_RINGS) {
+		free(r);
+		return NULL;
+	}
+	store_release(&log_rings[idx], r);
+	log_ring_failed = false;
+	log_ring = r;
+	return r;
+}
+
+/* saves a message for the background thread, returns false if it can't */
+static bool log_push(int level, const char *fmt, va_list ap)
+{
+	struct log_ring *r = log_get_ring();
+	struct log_entry *e;
+	uint32_t head;
+	bool ret;
+
+	if (unlikely(!r))
+		return false;
+
+	/* another uthread was interrupted while writing to this ring */
+	if (unlikely(!__sync_bool_compare_and_swap(&r->busy, 0, 1)))
+		return false;
+
+	head = r->head;
+	if (unlikely(head - load_acquire(&r->tail) >= LOG_RING_SIZE)) {
+		ACCESS_ONCE(r->drops) = r->drops + 1;
+		store_release(&r->busy, 0);
+		return true;
+	}
+
+	e = &r->entries[head & (LOG_RING_SIZE - 1)];
+	e->fmt = fmt;
+	e->us = microtime();
+	e->level = level;
+	e->cpu = sched_getcpu();
+	ret = log_capture(e, fmt, ap);
+	if (ret)
+		store_release(&r->head, head + 1);
+	store_release(&r->busy, 0);
+	return ret;
+}
+
+/**
+ * log_async_init - moves log output off of the calling threads
+ *
+ * Afterward, messages less severe than LOG_ERR are saved in a ring per thread
+ * and formatted and written by a background thread, so logging on a hot path
+ * only costs a few copies. Errors are still written right away, after the
+ * messages queued before them. If a thread's ring fills up, its messages are
+ * dropped and counted.
+ *
+ * Returns 0 if successful.
+ */
+int log_async_init(void)
+{
+	pthread_t tid;
+	int ret;
+
+	if (log_async)
+		return 0;
+
+	ret = pthread_create(&tid, NULL, log_async_thread, NULL);
+	if (ret)
+		return -ret;
+	pthread_detach(tid);
+	atexit(log_drain);
+
+	store_release(&log_async, true);
+	return 0;
+}
+
 void logk(int level, const char *fmt, ...)
 {
 	va_list ptr;
 	off_t off;
 	int cpu;
+	bool pushed;
 
 	if (level > max_loglevel)
 		return;
 
+	if (load_acquire(&log_async)) {
+		if (level > LOG_ERR) {
+			va_start(ptr, fmt);
+			pushed = log_push(level, fmt, ptr);
+			va_end(ptr);
+			if (likely(pushed))
+				return;
+		}
+
+		/* keep it in order with the messages queued before it */
+		log_drain();
+	}
+
 	cpu = sched_getcpu();
 
 	if (likely(base_init_done)) {
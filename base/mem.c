@@ -6,6 +6,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdio.h>
+#include <pthread.h>
 #include <numaif.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
@@ -17,6 +19,8 @@
 #include <base/mem.h>
 #include <base/log.h>
 #include <base/limits.h>
+#include <base/atomic.h>
+#include <base/cpu.h>
 
 #if !defined(MAP_HUGE_2MB) || !defined(MAP_HUGE_1GB)
 #warning "Your system does not support specifying MAP_HUGETLB page sizes"
@@ -26,6 +30,11 @@
 #warning "Your system does not support specifying SHM_HUGETLB page sizes"
 #endif
 
+/* the total bytes mapped at each page size, and how often we fell back */
+uint64_t mem_mapped_4kb_bytes;
+uint64_t mem_mapped_2mb_bytes;
+uint64_t mem_mapped_1gb_bytes;
+uint64_t mem_map_fallbacks;
 
 long mbind(void *start, size_t len, int mode,
 	   const unsigned long *nmask, unsigned long maxnode,
@@ -34,33 +43,162 @@ long mbind(void *start, size_t len, int mode,
 	return syscall(__NR_mbind, start, len, mode, nmask, maxnode, flags);
 }
 
+/* the number of threads that fault in large mappings (0 for every CPU) */
+unsigned int mem_prefault_threads = 1;
+
 static void sigbus_error(int sig)
 {
 	panic("couldn't map pages");
 }
 
-static void touch_mapping(void *base, size_t len, size_t pgsize)
+struct touch_args {
+	char		*base;
+	size_t		len;
+	size_t		pgsize;
+	bool		write;
+	int		node;
+};
+
+static void touch_range(struct touch_args *args)
 {
-	__sighandler_t s;
 	char *pos;
 
+	for (pos = args->base; pos < args->base + args->len;
+	     pos += args->pgsize) {
+		/* a read fault on private memory would only map the zero page */
+		if (args->write)
+			__sync_fetch_and_add(pos, 0);
+		else
+			ACCESS_ONCE(*pos);
+	}
+}
+
+static void *touch_worker(void *arg)
+{
+	struct touch_args *args = arg;
+	unsigned long mask = 1UL << args->node;
+
+	/*
+	 * Prefer the caller's node so that mappings without their own policy
+	 * land where they would have if the caller faulted them in alone.
+	 */
+	if (args->node >= 0)
+		syscall(__NR_set_mempolicy, MPOL_PREFERRED, &mask, NNUMA);
+	touch_range(args);
+	return NULL;
+}
+
+static void touch_mapping(void *base, size_t len, size_t pgsize, bool write)
+{
+	struct touch_args args[NCPU];
+	pthread_t tids[NCPU];
+	bool spawned[NCPU];
+	__sighandler_t s;
+	unsigned int i, nr, cpu, node;
+	size_t chunk;
+	int home;
+
 	/*
 	 * Unfortunately mmap() provides no error message if MAP_POPULATE fails
-	 * because of insufficient memory. Therefore, we manually force a write
-	 * on each page to make sure the mapping was successful.
+	 * because of insufficient memory. Therefore, we manually force a fault
+	 * on each page to make sure the mapping was successful. Large mappings
+	 * are split across several threads, because faulting in tens of GB of
+	 * huge pages from one thread takes seconds.
 	 */
+	nr = mem_prefault_threads ? mem_prefault_threads : cpu_count;
+	nr = min(nr, max(cpu_count, 1));
+	nr = min(nr, len / MEM_PREFAULT_MIN_CHUNK);
+	nr = min(max(nr, 1), NCPU);
+	chunk = align_up(div_up(len, nr), pgsize);
+
+	home = -1;
+	if (!syscall(__NR_getcpu, &cpu, &node, NULL) && node < NNUMA)
+		home = node;
+
 	s = signal(SIGBUS, sigbus_error);
-	for (pos = (char *)base; pos < (char *)base + len; pos += pgsize)
-		ACCESS_ONCE(*pos);
+	for (i = 0; i < nr; i++) {
+		args[i].base = (char *)base + min(len, chunk * i);
+		args[i].len = min(len, chunk * (i + 1)) - min(len, chunk * i);
+		args[i].pgsize = pgsize;
+		args[i].write = write;
+		args[i].node = home;
+		spawned[i] = false;
+		if (i == 0 || !args[i].len)
+			continue;
+
+		/* if a thread can't be created, fault the range in below */
+		spawned[i] = !pthread_create(&tids[i], NULL, touch_worker,
+					     &args[i]);
+	}
+
+	touch_range(&args[0]);
+	for (i = 1; i < nr; i++) {
+		if (spawned[i])
+			pthread_join(tids[i], NULL);
+		else
+			touch_range(&args[i]);
+	}
 	signal(SIGBUS, s);
-} 
+}
+
+static void mem_account(size_t len, size_t pgsize)
+{
+	switch (pgsize) {
+	case PGSIZE_4KB:
+		__sync_fetch_and_add(&mem_mapped_4kb_bytes, len);
+		break;
+	case PGSIZE_2MB:
+		__sync_fetch_and_add(&mem_mapped_2mb_bytes, len);
+		break;
+	case PGSIZE_1GB:
+		__sync_fetch_and_add(&mem_mapped_1gb_bytes, len);
+		break;
+	}
+}
+
+/* returns the next smaller page size to try, or zero if none is left */
+static size_t mem_next_pgsize(void *base, size_t len, size_t pgsize,
+			      size_t min_pgsize)
+{
+	while (pgsize > min_pgsize) {
+		pgsize = (pgsize == PGSIZE_1GB) ? PGSIZE_2MB : PGSIZE_4KB;
+
+		/* avoid rounding the region up past a whole extra page */
+		if (pgsize > len && pgsize > min_pgsize)
+			continue;
+		if (base && ((uintptr_t)base & (pgsize - 1)))
+			continue;
+		return pgsize;
+	}
+
+	return 0;
+}
+
+/* returns the first page size of a policy that fits the region */
+static size_t mem_first_pgsize(void *base, size_t len, size_t pgsize,
+			       size_t min_pgsize)
+{
+	if ((pgsize <= len || pgsize == min_pgsize) &&
+	    (!base || !((uintptr_t)base & (pgsize - 1))))
+		return pgsize;
+	return mem_next_pgsize(base, len, pgsize, min_pgsize);
+}
+
+static void
+mem_log_fallback(const char *kind, size_t len, size_t want, size_t got)
+{
+	__sync_fetch_and_add(&mem_map_fallbacks, 1);
+	log_warn_ratelimited("mem: %s mapping of %ld KB wanted %ld KB "
+			     "pages, got %ld KB pages", kind, len / 1024,
+			     want / 1024, got / 1024);
+}
 
 static void *
 __mem_map_anom(void *base, size_t len, size_t pgsize,
 	       unsigned long *mask, int numa_policy)
 {
 	void *addr;
-	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
 
 	len = align_up(len, pgsize);
 
@@ -91,12 +229,18 @@ __mem_map_anom(void *base, size_t len, size_t pgsize,
 	if (addr == MAP_FAILED)
 		return MAP_FAILED;
 
+	/*
+	 * The pages are faulted in only after mbind(), so they are allocated
+	 * according to the NUMA policy instead of being migrated (or rejected
+	 * by MPOL_MF_STRICT) afterward.
+	 */
 	BUILD_ASSERT(sizeof(unsigned long) * 8 >= NNUMA);
 	if (mbind(addr, len, numa_policy, mask ? mask : NULL,
 		  mask ? NNUMA : 0, MPOL_MF_STRICT))
 		goto fail;
 
-	touch_mapping(addr, len, pgsize);
+	touch_mapping(addr, len, pgsize, true);
+	mem_account(len, pgsize);
 	return addr;
 
 fail:
@@ -119,6 +263,42 @@ void *mem_map_anom(void *base, size_t len, size_t pgsize, int node)
 	return __mem_map_anom(base, len, pgsize, &mask, MPOL_BIND);
 }
 
+/**
+ * mem_map_anom_fallback - map anonymous memory, falling back to smaller pages
+ * @base: the base address (or NULL for automatic)
+ * @len: the length of the mapping
+ * @pgsize: the preferred (largest) page size
+ * @min_pgsize: the smallest acceptable page size
+ * @node: the NUMA node
+ * @pgsize_out: if not NULL, stores the page size actually used
+ *
+ * Tries @pgsize first, then each smaller page size down to @min_pgsize (1 GB,
+ * then 2 MB, then 4 KB). Page sizes larger than @len are skipped, as are sizes
+ * that @base isn't aligned to. A warning is logged if the preferred size is
+ * unavailable.
+ *
+ * Returns the base address, or MAP_FAILED if out of memory
+ */
+void *mem_map_anom_fallback(void *base, size_t len, size_t pgsize,
+			    size_t min_pgsize, int node, size_t *pgsize_out)
+{
+	size_t sz = mem_first_pgsize(base, len, pgsize, min_pgsize);
+	void *addr;
+
+	for (; sz; sz = mem_next_pgsize(base, len, sz, min_pgsize)) {
+		addr = mem_map_anom(base, len, sz, node);
+		if (addr == MAP_FAILED)
+			continue;
+		if (sz != pgsize)
+			mem_log_fallback("anonymous", len, pgsize, sz);
+		if (pgsize_out)
+			*pgsize_out = sz;
+		return addr;
+	}
+
+	return MAP_FAILED;
+}
+
 /**
  * mem_map_file - maps a file into memory
  * @base: the address (or automatic if NULL)
@@ -182,10 +362,51 @@ void *mem_map_shm(mem_key_t key, void *base, size_t len, size_t pgsize,
 	if (addr == MAP_FAILED)
 		return MAP_FAILED;
 
-	touch_mapping(addr, len, pgsize);
+	touch_mapping(addr, len, pgsize, false);
+	mem_account(len, pgsize);
 	return addr;
 }
 
+/**
+ * mem_map_shm_fallback - maps a System V shared memory segment, falling back
+ *                        to smaller pages
+ * @key: the unique key that identifies the shared region (e.g. use ftok())
+ * @base: the base address to map the shared segment (or automatic if NULL)
+ * @len: the length of the mapping
+ * @pgsize: the preferred (largest) page size
+ * @min_pgsize: the smallest acceptable page size
+ * @exclusive: ensure this call creates the shared segment
+ * @pgsize_out: if not NULL, stores the page size actually used
+ *
+ * Follows the same policy as mem_map_anom_fallback(). Only falls back if huge
+ * pages couldn't be obtained, not if the segment already exists.
+ *
+ * Returns a pointer to the mapping, or MAP_FAILED if the mapping failed.
+ */
+void *mem_map_shm_fallback(mem_key_t key, void *base, size_t len,
+			   size_t pgsize, size_t min_pgsize, bool exclusive,
+			   size_t *pgsize_out)
+{
+	size_t sz = mem_first_pgsize(base, len, pgsize, min_pgsize);
+	void *addr;
+
+	for (; sz; sz = mem_next_pgsize(base, len, sz, min_pgsize)) {
+		addr = mem_map_shm(key, base, len, sz, exclusive);
+		if (addr == MAP_FAILED) {
+			if (errno == EEXIST || errno == EACCES)
+				return MAP_FAILED;
+			continue;
+		}
+		if (sz != pgsize)
+			mem_log_fallback("shared", len, pgsize, sz);
+		if (pgsize_out)
+			*pgsize_out = sz;
+		return addr;
+	}
+
+	return MAP_FAILED;
+}
+
 /**
  * mem_unmap_shm - detach a shared memory mapping
  * @addr: the base address of the mapping
@@ -235,12 +456,9 @@ int mem_lookup_page_phys_addrs(void *addr, size_t len,
 
 	for (pos = (uintptr_t)addr; pos < (uintptr_t)addr + len;
 	     pos += pgsize) {
-		if (lseek(fd, pos / PGSIZE_4KB * sizeof(uint64_t), SEEK_SET) ==
-		    (off_t)-1) {
-			ret = -EIO;
-			goto out;
-		}
-		if (read(fd, &tmp, sizeof(uint64_t)) <= 0) {
+		if (pread(fd, &tmp, sizeof(uint64_t),
+			  pos / PGSIZE_4KB * sizeof(uint64_t)) !=
+		    sizeof(uint64_t)) {
 			ret = -EIO;
 			goto out;
 		}
@@ -256,3 +474,41 @@ out:
 	close(fd);
 	return ret;
 }
+
+/**
+ * mem_lookup_page_size - determines the page size backing a mapping
+ * @addr: an address inside the mapping
+ * @pgsize: a pointer to store the page size
+ *
+ * Useful for memory mapped by another process, e.g. a shared memory segment
+ * whose creator picked the page size.
+ *
+ * Returns 0 if successful, otherwise failure.
+ */
+int mem_lookup_page_size(void *addr, size_t *pgsize)
+{
+	char line[256];
+	unsigned long start, end, kb;
+	bool found = false;
+	FILE *f;
+	int ret = -ENOENT;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f)
+		return -EIO;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			found = (uintptr_t)addr >= start && (uintptr_t)addr < end;
+			continue;
+		}
+		if (found && sscanf(line, "KernelPageSize: %lu kB", &kb) == 1) {
+			*pgsize = kb * 1024;
+			ret = 0;
+			break;
+		}
+	}
+
+	fclose(f);
+	return ret;
+}
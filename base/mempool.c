@@ -10,6 +10,7 @@
 
 #include <base/mempool.h>
 #include <base/assert.h>
+#include <base/atomic.h>
 
 #ifdef DEBUG
 
@@ -43,6 +44,107 @@ void __mempool_free_debug_check(struct mempool *m, void *item)
 
 #endif /* DEBUG */
 
+static uint32_t mempool_ring_slots(unsigned int count)
+{
+	uint32_t size = 1;
+
+	while (size < count)
+		size <<= 1;
+	return size;
+}
+
+/**
+ * mempool_ring_bytes - returns the memory needed for a ring
+ * @count: the number of items the ring must hold
+ */
+size_t mempool_ring_bytes(unsigned int count)
+{
+	return sizeof(struct mempool_ring) +
+	       sizeof(void *) * mempool_ring_slots(count);
+}
+
+/**
+ * mempool_ring_init - initializes an empty ring
+ * @r: memory for the ring (at least mempool_ring_bytes(@count) bytes)
+ * @count: the number of items the ring must hold
+ *
+ * The ring's size is @count rounded up to the next power of two.
+ */
+void mempool_ring_init(struct mempool_ring *r, unsigned int count)
+{
+	r->size = mempool_ring_slots(count);
+	r->mask = r->size - 1;
+	r->prod_head = r->prod_tail = 0;
+	r->cons_head = r->cons_tail = 0;
+}
+
+/**
+ * mempool_ring_enqueue - adds items to a ring
+ * @r: the ring
+ * @items: the items to add
+ * @n: the number of items
+ *
+ * Safe to call concurrently from any number of threads. Either all @n items
+ * are added or none are.
+ *
+ * Returns 0 if successful, or -ENOBUFS if there isn't enough room.
+ */
+int mempool_ring_enqueue(struct mempool_ring *r, void * const *items,
+			 unsigned int n)
+{
+	uint32_t head;
+	unsigned int i;
+
+	/* reserve slots */
+	do {
+		head = ACCESS_ONCE(r->prod_head);
+		if (unlikely(n > r->size - (head - load_acquire(&r->cons_tail))))
+			return -ENOBUFS;
+	} while (!__sync_bool_compare_and_swap(&r->prod_head, head, head + n));
+
+	for (i = 0; i < n; i++)
+		r->slots[(head + i) & r->mask] = items[i];
+
+	/* publish in reservation order */
+	while (ACCESS_ONCE(r->prod_tail) != head)
+		cpu_relax();
+	store_release(&r->prod_tail, head + n);
+	return 0;
+}
+
+/**
+ * mempool_ring_dequeue - removes items from a ring
+ * @r: the ring
+ * @items: an array to store the removed items
+ * @n: the number of items
+ *
+ * Safe to call concurrently from any number of threads. Either all @n items
+ * are removed or none are.
+ *
+ * Returns 0 if successful, or -ENOBUFS if there aren't enough items.
+ */
+int mempool_ring_dequeue(struct mempool_ring *r, void **items, unsigned int n)
+{
+	uint32_t head;
+	unsigned int i;
+
+	/* reserve items */
+	do {
+		head = ACCESS_ONCE(r->cons_head);
+		if (unlikely(n > load_acquire(&r->prod_tail) - head))
+			return -ENOBUFS;
+	} while (!__sync_bool_compare_and_swap(&r->cons_head, head, head + n));
+
+	for (i = 0; i < n; i++)
+		items[i] = r->slots[(head + i) & r->mask];
+
+	/* release the slots in reservation order */
+	while (ACCESS_ONCE(r->cons_tail) != head)
+		cpu_relax();
+	store_release(&r->cons_tail, head + n);
+	return 0;
+}
+
 static int mempool_populate(struct mempool *m, void *buf, size_t len,
 			    size_t pgsize, size_t item_len)
 {
@@ -79,6 +181,8 @@ int mempool_create(struct mempool *m, void *buf, size_t len,
 		return -EINVAL;
 		
 	m->allocated = 0;
+	m->capacity = 0;
+	m->ring = NULL;
 	m->buf = buf;
 	m->len = len;
 	m->pgsize = pgsize;
@@ -87,6 +191,47 @@ int mempool_create(struct mempool *m, void *buf, size_t len,
 	return mempool_populate(m, buf, len, pgsize, item_len);
 }
 
+/**
+ * mempool_create_mpmc - initializes a memory pool backed by a lock-free ring
+ * @m: the memory pool to initialize
+ * @buf: the start of the buffer region managed by the pool
+ * @len: the length of the buffer region managed by the pool
+ * @pgsize: the size of the pages in the buffer region (must be uniform)
+ * @item_len: the length of each item in the pool
+ *
+ * Use this mode for pools whose items are routinely freed on a different core
+ * than the one that allocated them. A tcache created with
+ * mempool_create_tcache() then exchanges magazines with the pool without
+ * taking a lock.
+ */
+int mempool_create_mpmc(struct mempool *m, void *buf, size_t len,
+			size_t pgsize, size_t item_len)
+{
+	struct mempool_ring *r;
+	size_t bytes;
+	int ret;
+
+	ret = mempool_create(m, buf, len, pgsize, item_len);
+	if (ret)
+		return ret;
+
+	bytes = align_up(mempool_ring_bytes(m->capacity), CACHE_LINE_SIZE);
+	r = aligned_alloc(CACHE_LINE_SIZE, bytes);
+	if (!r) {
+		mempool_destroy(m);
+		return -ENOMEM;
+	}
+
+	mempool_ring_init(r, m->capacity);
+	ret = mempool_ring_enqueue(r, m->free_items, m->capacity);
+	BUG_ON(ret);
+
+	free(m->free_items);
+	m->free_items = NULL;
+	m->ring = r;
+	return 0;
+}
+
 /**
  * mempool_destroy - tears down a memory pool
  * @m: the memory pool to tear down
@@ -94,6 +239,7 @@ int mempool_create(struct mempool *m, void *buf, size_t len,
 void mempool_destroy(struct mempool *m)
 {
 	free(m->free_items);
+	free(m->ring);
 }
 
 struct mempool_tc {
@@ -137,6 +283,36 @@ static const struct tcache_ops mempool_tcache_ops = {
     .alloc = mempool_tcache_alloc, .free = mempool_tcache_free,
 };
 
+static void mempool_ring_tcache_free(struct tcache *tc, int nr, void **items)
+{
+	struct mempool_tc *mptc = (struct mempool_tc *)tc->data;
+	int i, ret;
+
+	for (i = 0; i < nr; i++)
+		__mempool_free_debug_check(mptc->m, items[i]);
+
+	/* the ring fits every item, so it can only overflow on a double free */
+	ret = mempool_ring_enqueue(mptc->m->ring, items, nr);
+	BUG_ON(ret);
+}
+
+static int mempool_ring_tcache_alloc(struct tcache *tc, int nr, void **items)
+{
+	struct mempool_tc *mptc = (struct mempool_tc *)tc->data;
+	int i;
+
+	if (mempool_ring_dequeue(mptc->m->ring, items, nr))
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++)
+		__mempool_alloc_debug_check(mptc->m, items[i]);
+	return 0;
+}
+
+static const struct tcache_ops mempool_ring_tcache_ops = {
+    .alloc = mempool_ring_tcache_alloc, .free = mempool_ring_tcache_free,
+};
+
 struct tcache *mempool_create_tcache(struct mempool *m, const char *name,
 				     unsigned int mag_size)
 {
@@ -150,7 +326,8 @@ struct tcache *mempool_create_tcache(struct mempool *m, const char *name,
 	mptc->m = m;
 	spin_lock_init(&mptc->lock);
 
-	tc = tcache_create(name, &mempool_tcache_ops, mag_size, m->item_len);
+	tc = tcache_create(name, m->ring ? &mempool_ring_tcache_ops :
+			   &mempool_tcache_ops, mag_size, m->item_len);
 	if (!tc) {
 		free(mptc);
 		return NULL;
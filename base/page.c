@@ -13,6 +13,7 @@
 #include <base/log.h>
 #include <base/init.h>
 #include <base/tcache.h>
+#include <base/time.h>
 
 #include "init_internal.h"
 
@@ -27,11 +28,16 @@ struct lgpage_node {
 	spinlock_t		lock;
 	unsigned int		idx;
 	struct page		*tbl; /* aliases page_tbl above */
-	struct list_head	pages;
-	uint64_t		pad[4];
+	struct list_head	pages; /* free and unmapped */
+	struct list_head	cached; /* free but still mapped, newest first */
+	unsigned int		nr_cached;
 } __aligned(CACHE_LINE_SIZE);
 static struct lgpage_node lgpage_nodes[NNUMA];
 
+uint64_t page_reclaim_idle_us;
+uint64_t page_reclaim_watermark;
+uint64_t page_reclaimed_bytes;
+
 /* small page (4KB) definitions */
 extern struct slab smpage_slab; /* defined in mm/slab.c */
 extern struct tcache *smpage_tcache;
@@ -89,18 +95,26 @@ static void page_free_check(struct page *pg, size_t pgsize) {;}
 static int lgpage_create(struct page *pg, int numa_node)
 {
 	void *pgaddr = lgpage_to_addr(pg);
+	size_t pgsize;
 	int ret;
 
-	pgaddr = mem_map_anom(pgaddr, PGSIZE_2MB, PGSIZE_2MB, numa_node);
+	/* fall back to 4KB pages if the host is out of huge pages */
+	pgaddr = mem_map_anom_fallback(pgaddr, PGSIZE_2MB, PGSIZE_2MB,
+				       PGSIZE_4KB, numa_node, &pgsize);
 	if (pgaddr == MAP_FAILED) {
-		log_err_ratelimited("page: out of 2mb pages\n");
+		log_err_ratelimited("page: out of memory\n");
 		return -ENOMEM;
 	}
 
-	ret = mem_lookup_page_phys_addr(pgaddr, PGSIZE_2MB, &pg->paddr);
-	if (ret) {
-		munmap(pgaddr, PGSIZE_2MB);
-		return ret;
+	/* physical addresses are only stable for huge pages */
+	if (pgsize == PGSIZE_4KB) {
+		pg->paddr = 0;
+	} else {
+		ret = mem_lookup_page_phys_addr(pgaddr, PGSIZE_2MB, &pg->paddr);
+		if (ret) {
+			munmap(pgaddr, PGSIZE_2MB);
+			return ret;
+		}
 	}
 
 	kref_init(&pg->ref);
@@ -125,6 +139,16 @@ static struct page *lgpage_alloc_on_node(int numa_node)
 	node = &lgpage_nodes[numa_node];
 
 	spin_lock(&node->lock);
+	pg = list_pop(&node->cached, struct page, link);
+	if (pg) {
+		/* still mapped, so skip the mmap() and physical address lookup */
+		node->nr_cached--;
+		spin_unlock(&node->lock);
+		kref_init(&pg->ref);
+		pg->flags = PAGE_FLAG_LARGE | PAGE_FLAG_IN_USE;
+		return pg;
+	}
+
 	pg = list_pop(&node->pages, struct page, link);
 	if (!pg) {
 		if (unlikely(node->idx >= LGPAGE_META_ENTS)) {
@@ -154,12 +178,134 @@ static void lgpage_free(struct page *pg)
 	struct lgpage_node *node = &lgpage_nodes[numa_node];
 
 	assert(numa_node < NNUMA);
-	lgpage_destroy(pg);
+	if (!ACCESS_ONCE(page_reclaim_idle_us)) {
+		lgpage_destroy(pg);
+		spin_lock(&node->lock);
+		list_add(&node->pages, &pg->link);
+		spin_unlock(&node->lock);
+		return;
+	}
+
+	/* keep the page mapped until page_reclaim() finds it idle */
+	pg->flags = PAGE_FLAG_LARGE;
+	pg->item_count = microtime(); /* reused as the time of the free */
 	spin_lock(&node->lock);
-	list_add(&node->pages, &pg->link);
+	list_add(&node->cached, &pg->link);
+	node->nr_cached++;
 	spin_unlock(&node->lock);
 }
 
+static void lgpage_reclaim_node(struct lgpage_node *node, uint64_t now,
+				struct list_head *victims)
+{
+	struct page *pg;
+
+	/* the oldest pages are at the tail */
+	spin_lock(&node->lock);
+	while (node->nr_cached > page_reclaim_watermark) {
+		pg = list_tail(&node->cached, struct page, link);
+		if (now - pg->item_count < page_reclaim_idle_us)
+			break;
+		list_del_from(&node->cached, &pg->link);
+		node->nr_cached--;
+		list_add_tail(victims, &pg->link);
+	}
+	spin_unlock(&node->lock);
+}
+
+/**
+ * page_reclaim_collect - takes idle large pages off the free lists
+ * @victims: the list to add the pages to
+ *
+ * Finds free large pages that have been idle for at least
+ * page_reclaim_idle_us, keeping page_reclaim_watermark pages per NUMA node.
+ * Nothing is unmapped yet; pass @victims to page_reclaim_unmap().
+ */
+void page_reclaim_collect(struct list_head *victims)
+{
+	uint64_t now = microtime();
+	int i;
+
+	for (i = 0; i < numa_count; i++)
+		lgpage_reclaim_node(&lgpage_nodes[i], now, victims);
+}
+
+/**
+ * page_reclaim_unmap - returns collected large pages to the kernel
+ * @victims: the pages from page_reclaim_collect()
+ *
+ * Takes no locks, so the caller may be preempted during the munmap() calls.
+ * The pages stay on @victims until page_reclaim_finish().
+ *
+ * Returns the number of bytes unmapped.
+ */
+size_t page_reclaim_unmap(struct list_head *victims)
+{
+	struct page *pg;
+	size_t bytes = 0;
+
+	list_for_each(victims, pg, link) {
+		lgpage_destroy(pg);
+		bytes += PGSIZE_2MB;
+	}
+
+	if (bytes)
+		__sync_fetch_and_add(&page_reclaimed_bytes, bytes);
+	return bytes;
+}
+
+/**
+ * page_reclaim_finish - lets unmapped large pages be created again
+ * @victims: the pages from page_reclaim_unmap()
+ */
+void page_reclaim_finish(struct list_head *victims)
+{
+	struct lgpage_node *node;
+	struct page *pg;
+
+	while ((pg = list_pop(victims, struct page, link))) {
+		node = &lgpage_nodes[addr_to_numa_node(lgpage_to_addr(pg))];
+		spin_lock(&node->lock);
+		list_add(&node->pages, &pg->link);
+		spin_unlock(&node->lock);
+	}
+}
+
+/**
+ * page_reclaim - returns idle large pages to the kernel
+ *
+ * Combines page_reclaim_collect(), page_reclaim_unmap(), and
+ * page_reclaim_finish(). Memory held in thread-local caches is not freed until
+ * they release it (see tcache_reclaim()).
+ *
+ * Returns the number of bytes unmapped.
+ */
+size_t page_reclaim(void)
+{
+	LIST_HEAD(victims);
+	size_t bytes;
+
+	page_reclaim_collect(&victims);
+	bytes = page_reclaim_unmap(&victims);
+	page_reclaim_finish(&victims);
+	return bytes;
+}
+
+/**
+ * page_cached_bytes - gets the amount of free large page memory still mapped
+ *
+ * Returns the number of bytes.
+ */
+size_t page_cached_bytes(void)
+{
+	size_t bytes = 0;
+	int i;
+
+	for (i = 0; i < numa_count; i++)
+		bytes += ACCESS_ONCE(lgpage_nodes[i].nr_cached) * PGSIZE_2MB;
+	return bytes;
+}
+
 static struct page *smpage_alloc_on_node(int numa_node)
 {
 	struct page *pg;
@@ -365,14 +511,17 @@ int page_init(void)
 	/* Then map NUMA-local large pages on top. */
 	for (i = 0; i < numa_count; i++) {
 		node = &lgpage_nodes[i];
-		node->tbl = mem_map_anom(
+		node->tbl = mem_map_anom_fallback(
 			(char *)addr + i * LGPAGE_META_LEN,
-			LGPAGE_META_NR_LGPAGES * PGSIZE_2MB, PGSIZE_2MB, i);
+			LGPAGE_META_NR_LGPAGES * PGSIZE_2MB, PGSIZE_2MB,
+			PGSIZE_4KB, i, NULL);
 		if (node->tbl == MAP_FAILED)
 			return -ENOMEM;
 
 		spin_lock_init(&node->lock);
 		list_head_init(&node->pages);
+		list_head_init(&node->cached);
+		node->nr_cached = 0;
 		node->idx = 0;
 	}
 
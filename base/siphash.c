@@ -0,0 +1,65 @@
+/*
+ * siphash.c - SipHash-2-4, a keyed pseudorandom function
+ *
+ * Based on SipHash: a fast short-input PRF. Jean-Philippe Aumasson and
+ * Daniel J. Bernstein. Unlike the crc32c and city hashes, SipHash is safe to
+ * use where an attacker must not be able to predict or forge hash values.
+ */
+
+#include <base/stddef.h>
+#include <base/hash.h>
+
+static inline uint64_t sip_rotl(uint64_t x, int b)
+{
+	return (x << b) | (x >> (64 - b));
+}
+
+#define SIP_ROUND(v0, v1, v2, v3)					\
+do {									\
+	v0 += v1; v1 = sip_rotl(v1, 13); v1 ^= v0; v0 = sip_rotl(v0, 32); \
+	v2 += v3; v3 = sip_rotl(v3, 16); v3 ^= v2;			\
+	v0 += v3; v3 = sip_rotl(v3, 21); v3 ^= v0;			\
+	v2 += v1; v1 = sip_rotl(v1, 17); v1 ^= v2; v2 = sip_rotl(v2, 32); \
+} while (0)
+
+/**
+ * siphash24 - hashes 64-bit words with SipHash-2-4
+ * @key: the 128-bit secret key
+ * @words: the words to hash
+ * @nr: the number of words
+ *
+ * The result is the standard SipHash-2-4 of the words' little-endian bytes.
+ *
+ * Returns a 64-bit hash value.
+ */
+uint64_t siphash24(const uint64_t key[2], const uint64_t *words, size_t nr)
+{
+	uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+	uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+	uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+	uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+	uint64_t m;
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		m = words[i];
+		v3 ^= m;
+		SIP_ROUND(v0, v1, v2, v3);
+		SIP_ROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	/* the final block holds only the message length */
+	m = (uint64_t)(nr * sizeof(uint64_t)) << 56;
+	v3 ^= m;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -15,6 +15,7 @@
 
 #include <string.h>
 
+#include <base/allocprof.h>
 #include <base/slab.h>
 #include <base/lock.h>
 #include <base/log.h>
@@ -62,6 +63,23 @@ __slab_create_node(struct slab_node *n, int numa_node,
 	n->flags = flags;
 	n->nr_elems = nr_elems;
 
+	/*
+	 * Each new page starts its items at a different cache line offset
+	 * (color) within the slack left at the end of the page, so that the
+	 * same item in different pages doesn't always map to the same cache
+	 * sets. Page-managing slabs must keep their items page aligned.
+	 */
+	n->color = 0;
+	n->nr_colors = 1;
+	if (!(flags & SLAB_FLAG_PAGES)) {
+		size_t pgsize = (flags & SLAB_FLAG_LGPAGE) ?
+				PGSIZE_2MB : PGSIZE_4KB;
+		size_t used = offset + size * nr_elems;
+
+		if (used < pgsize)
+			n->nr_colors = (pgsize - used) / SLAB_COLOR_ALIGN + 1;
+	}
+
 	n->cur_pg = NULL;
 	n->pg_off = 0;
 	n->nr_pages = 0;
@@ -174,6 +192,8 @@ int slab_create(struct slab *s, const char *name, size_t size, int flags)
 	int pgsize;
 
 	/* force cache line size alignment to prevent false sharing */
+	if (flags & SLAB_FLAG_CACHE_ALIGNED)
+		flags &= ~SLAB_FLAG_FALSE_OKAY;
 	if (!(flags & SLAB_FLAG_FALSE_OKAY))
 		size = align_up(size, CACHE_LINE_SIZE);
 	else
@@ -223,9 +243,11 @@ static void slab_item_check(struct slab_node *n, void *item)
 
 	/* alignment */
 	if (n->flags & SLAB_FLAG_LGPAGE)
-		assert(PGOFF_2MB(item) % n->size == 0);
+		assert((PGOFF_2MB(item) - pg->offset) % n->size == 0);
 	else
-		assert(PGOFF_4KB(item) % n->size == 0);
+		assert((PGOFF_4KB(item) - pg->offset) % n->size == 0);
+	if (n->flags & SLAB_FLAG_CACHE_ALIGNED)
+		assert(((uintptr_t)item & (CACHE_LINE_SIZE - 1)) == 0);
 
 	if (unlikely(!thread_init_done))
 		return;
@@ -278,7 +300,10 @@ static struct page *__slab_node_get_page(struct slab_node *n)
 				memset(page_to_addr(pg), 0, n->offset);
 			}
 			pg->snode = n;
-			n->pg_off = n->offset;
+			n->pg_off = n->offset + n->color * SLAB_COLOR_ALIGN;
+			pg->offset = n->pg_off;
+			if (++n->color == n->nr_colors)
+				n->color = 0;
 			pg->item_count = n->nr_elems;
 			pg->next = NULL;
 		}
@@ -331,6 +356,9 @@ void *slab_alloc_on_node(struct slab *s, int numa_node)
 	struct slab_node *n = s->nodes[numa_node];
 	void *item;
 
+	allocprof_sample(ALLOCPROF_SLAB, __builtin_return_address(0), s->name,
+			 s->size);
+
 	spin_lock(&n->page_lock);
 	item = __slab_node_alloc(n);
 	spin_unlock(&n->page_lock);
@@ -415,12 +443,11 @@ fail:
 static void slab_tcache_free(struct tcache *tc, int nr, void **items)
 {
 	struct slab *s = (struct slab *)tc->data;
-	struct slab_node *n = s->nodes[thread_numa_node];
 	int i;
 
+	/* magazines are usually from one node, but items must go home */
 	for (i = 0; i < nr; i++)
-		slab_node_free(n, items[i]);
-
+		slab_node_free(s->nodes[addr_to_numa_node(items[i])], items[i]);
 }
 
 static const struct tcache_ops slab_tcache_ops = {
@@ -441,7 +468,11 @@ slab_create_tcache(struct slab *s, unsigned int mag_size)
 	struct tcache *tc;
 
 	tc = tcache_create(s->name, &slab_tcache_ops, mag_size, s->size);
+	if (!tc)
+		return NULL;
+
 	tc->data = (unsigned long)s;
+	tc->numa = true;
 	return tc;
 }
 
@@ -458,20 +489,28 @@ void slab_print_usage(void)
 
 	spin_lock(&slab_lock);
 	list_for_each(&slab_list, s, link) {
+		size_t node_usage[NNUMA];
 		size_t usage = 0;
 
 		for (i = 0; i < numa_count; i++) {
 			struct slab_node *n = s->nodes[i];
 
 			if (n->flags & SLAB_FLAG_LGPAGE) {
-				usage += n->nr_pages * PGSIZE_2MB;
+				node_usage[i] = n->nr_pages * PGSIZE_2MB;
 				total += n->nr_pages * PGSIZE_2MB;
 			} else {
-				usage += n->nr_pages * PGSIZE_4KB;
+				node_usage[i] = n->nr_pages * PGSIZE_4KB;
 			}
+			usage += node_usage[i];
 		}
 
 		log_info("%8ld KB\t%s", usage / 1024, s->name);
+		if (numa_count == 1)
+			continue;
+		for (i = 0; i < numa_count; i++) {
+			log_info("%8ld KB\t  node %d (%d pages)",
+				 node_usage[i] / 1024, i, s->nodes[i]->nr_pages);
+		}
 	}
 	spin_unlock(&slab_lock);
 
@@ -7,6 +7,9 @@
 #include <base/stat.h>
 #include <base/lock.h>
 #include <base/log.h>
+#include <base/page.h>
+
+#include "init_internal.h"
 
 
 /*
@@ -125,3 +128,114 @@ uint64_t __stat_perthread_var_collect(struct stat_entry *e, unsigned long data)
 	}
 	return val;
 }
+
+
+/*
+ * memory stats
+ */
+
+static struct stat_entry mem_stat_entries[8];
+
+static uint64_t mem_cached_collect(struct stat_entry *e, unsigned long data)
+{
+	return page_cached_bytes();
+}
+
+static int mem_stat_init(void)
+{
+	int ret;
+
+	ret = stat_register_var(&mem_stat_entries[0], "mem_reclaim_idle_us",
+				&page_reclaim_idle_us);
+	if (ret)
+		return ret;
+	ret = stat_register_var(&mem_stat_entries[1], "mem_reclaim_watermark",
+				&page_reclaim_watermark);
+	if (ret)
+		return ret;
+	ret = stat_register_var(&mem_stat_entries[2], "mem_reclaimed_bytes",
+				&page_reclaimed_bytes);
+	if (ret)
+		return ret;
+
+	ret = stat_register_var(&mem_stat_entries[3], "mem_mapped_4kb_bytes",
+				&mem_mapped_4kb_bytes);
+	if (ret)
+		return ret;
+	ret = stat_register_var(&mem_stat_entries[4], "mem_mapped_2mb_bytes",
+				&mem_mapped_2mb_bytes);
+	if (ret)
+		return ret;
+	ret = stat_register_var(&mem_stat_entries[5], "mem_mapped_1gb_bytes",
+				&mem_mapped_1gb_bytes);
+	if (ret)
+		return ret;
+	ret = stat_register_var(&mem_stat_entries[6], "mem_map_fallbacks",
+				&mem_map_fallbacks);
+	if (ret)
+		return ret;
+
+	mem_stat_entries[7].name = "mem_cached_bytes";
+	mem_stat_entries[7].handler = mem_cached_collect;
+	mem_stat_entries[7].data = 0;
+	return stat_register(&mem_stat_entries[7]);
+}
+
+
+/*
+ * lock stats
+ */
+
+#ifdef LOCK_STATS
+
+DEFINE_PERTHREAD(uint64_t, lock_acquires);
+DEFINE_PERTHREAD(uint64_t, lock_contended);
+DEFINE_PERTHREAD(uint64_t, lock_wait_cycles);
+DEFINE_PERTHREAD(uint64_t, lock_hold_cycles);
+
+static struct stat_entry lock_stat_entries[4];
+
+static int lock_stat_init(void)
+{
+	int ret;
+
+	ret = stat_register_perthread_var(&lock_stat_entries[0],
+		"lock_acquires", &__perthread_lock_acquires);
+	if (ret)
+		return ret;
+	ret = stat_register_perthread_var(&lock_stat_entries[1],
+		"lock_contended", &__perthread_lock_contended);
+	if (ret)
+		return ret;
+	ret = stat_register_perthread_var(&lock_stat_entries[2],
+		"lock_wait_cycles", &__perthread_lock_wait_cycles);
+	if (ret)
+		return ret;
+	return stat_register_perthread_var(&lock_stat_entries[3],
+		"lock_hold_cycles", &__perthread_lock_hold_cycles);
+}
+
+#else /* LOCK_STATS */
+
+static int lock_stat_init(void)
+{
+	return 0;
+}
+
+#endif /* LOCK_STATS */
+
+/**
+ * stat_init - registers the base library counters
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int stat_init(void)
+{
+	int ret;
+
+	ret = mem_stat_init();
+	if (ret)
+		return ret;
+
+	return lock_stat_init();
+}
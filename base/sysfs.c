@@ -140,3 +140,119 @@ out:
 	fclose(f);
 	return ret;
 }
+
+/**
+ * sysfs_parse_size - parses a size with an optional K, M, or G suffix
+ * @path: the sysfs file path
+ * @size_out: a pointer to store the result in bytes
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int sysfs_parse_size(const char *path, uint64_t *size_out)
+{
+	FILE *f;
+	char buf[BUFSIZ];
+	char *end;
+	int ret = 0;
+	uint64_t val;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -EIO;
+
+	if (!fgets(buf, sizeof(buf), f)) {
+		ret = -EIO;
+		goto out;
+	}
+
+	val = strtoull(buf, &end, 10);
+	if (end == buf) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	switch (*end) {
+	case 'G':
+		val *= 1024;
+		/* fallthrough */
+	case 'M':
+		val *= 1024;
+		/* fallthrough */
+	case 'K':
+		val *= 1024;
+		end++;
+		break;
+	}
+	if (*end != '\n') {
+		ret = -EINVAL;
+		goto out;
+	}
+	*size_out = val;
+
+out:
+	fclose(f);
+	return ret;
+}
+
+/**
+ * sysfs_parse_vals - parses a list of space-separated values
+ * @path: the sysfs file path
+ * @vals: an array to store the results
+ * @n: the size of @vals
+ *
+ * Returns the number of values parsed, or < 0 if fail.
+ */
+int sysfs_parse_vals(const char *path, uint64_t *vals, int n)
+{
+	FILE *f;
+	char buf[BUFSIZ];
+	char *pos, *end;
+	int nr = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -EIO;
+
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return -EIO;
+	}
+	fclose(f);
+
+	pos = &buf[0];
+	while (nr < n) {
+		vals[nr] = strtoull(pos, &end, 0);
+		if (end == pos)
+			break;
+		nr++;
+		pos = end;
+	}
+
+	return nr;
+}
+
+/**
+ * sysfs_parse_str - reads the first line of a sysfs file
+ * @path: the sysfs file path
+ * @buf: a buffer to store the line, without its newline
+ * @len: the size of @buf
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int sysfs_parse_str(const char *path, char *buf, size_t len)
+{
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -EIO;
+
+	if (!fgets(buf, len, f)) {
+		fclose(f);
+		return -EIO;
+	}
+	fclose(f);
+
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
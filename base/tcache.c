@@ -4,7 +4,21 @@
  * Based heavily on Magazines and Vmem: Extending the Slab Allocator to Many
  * CPUs and Arbitrary Resources. Jeff Bonwick and Johnathan Adams.
  *
- * TODO: Improve NUMA awareness.
+ * The depot of full magazines is a stack. Its head, an ABA tag, and the current
+ * magazine size share one 16-byte word updated with cmpxchg16b. Pushes are
+ * lock-free, but anything that removes magazines holds the depot lock. Popping
+ * must read the head magazine's link, and the magazine's memory can be
+ * returned to the OS as soon as someone else removes it, so removals must not
+ * race with each other.
+ *
+ * Magazines start at the size given to tcache_create(). If threads trade
+ * magazines with the shared depot too often (e.g. items allocated on one thread
+ * and freed on another), the magazine size doubles, up to a bound, so that each
+ * trip to the depot moves more items.
+ *
+ * Each NUMA node has its own depot. When a cache's items come from the page
+ * allocator, items freed on the wrong node are batched and sent home.
+ *
  * TODO: Provide an interface to tear-down thread caches.
  * TODO: Remove dependence on libc malloc().
  * TODO: Use RCU for tcache list so printing stats doesn't block creating
@@ -14,32 +28,41 @@
 #include <stdlib.h>
 
 #include <base/stddef.h>
+#include <base/allocprof.h>
 #include <base/log.h>
 #include <base/lock.h>
 #include <base/tcache.h>
+#include <base/time.h>
+#include <base/cpu.h>
+#include <asm/ops.h>
+
+/* the number of depot trips between checks for resizing */
+#define TCACHE_RESIZE_TRIPS	256
+/* grow the magazines if the trips took less than this much time */
+#define TCACHE_RESIZE_US	1000
 
 static DEFINE_SPINLOCK(tcache_lock);
 static LIST_HEAD(tcache_list);
 
-static struct tcache_hdr *tcache_alloc_mag(struct tcache *tc)
+static struct tcache_hdr *tcache_alloc_mag(struct tcache *tc, unsigned int nr)
 {
 	void *items[TCACHE_MAX_MAG_SIZE];
 	struct tcache_hdr *head, **pos;
 	int err, i;
 
-	err = tc->ops->alloc(tc, tc->mag_size, items);
+	err = tc->ops->alloc(tc, nr, items);
 	if (err)
 		return NULL;
 
 	head = (struct tcache_hdr *)items[0];
 	pos = &head->next_item;
-	for (i = 1; i < tc->mag_size; i++) {
+	for (i = 1; i < nr; i++) {
 		*pos = (struct tcache_hdr *)items[i];
 		pos = &(*pos)->next_item;
 	}
 
 	*pos = NULL;
-	atomic64_inc(&tc->mags_allocated);
+	atomic64_fetch_and_add(&tc->items_allocated, nr);
 	return head;
 }
 
@@ -49,25 +72,164 @@ static void tcache_free_mag(struct tcache *tc, struct tcache_hdr *hdr)
 	int nr = 0;
 
 	do {
+		assert(nr < TCACHE_MAX_MAG_SIZE);
 		items[nr++] = hdr;
 		hdr = hdr->next_item;
 	} while (hdr);
 
-	assert(nr == tc->mag_size);
 	tc->ops->free(tc, nr, items);
-	atomic64_dec(&tc->mags_allocated);
+	atomic64_fetch_and_sub(&tc->items_allocated, nr);
+}
+
+static void tcache_free_mags(struct tcache *tc, struct tcache_hdr *hdr)
+{
+	struct tcache_hdr *next;
+
+	while (hdr) {
+		next = hdr->next_mag;
+		tcache_free_mag(tc, hdr);
+		hdr = next;
+	}
+}
+
+static inline void tcache_depot_read(struct tcache_depot *d,
+				     struct tcache_depot *snap)
+{
+	/* a torn read is harmless because cmpxchg16b() compares both halves */
+	snap->word = ACCESS_ONCE(d->word);
+	snap->head = ACCESS_ONCE(d->head);
+}
+
+static inline bool tcache_depot_cas(struct tcache_depot *d,
+				    struct tcache_depot *old,
+				    struct tcache_hdr *head,
+				    unsigned int mag_size)
+{
+	uint64_t word = ((uint64_t)mag_size << 32) | (uint32_t)(old->tag + 1);
+
+	return cmpxchg16b(d, (uint64_t)old->head, old->word,
+			  (uint64_t)head, word);
+}
+
+/* Pops a full magazine, or returns NULL. Stores its size in @mag_size. */
+static struct tcache_hdr *tcache_depot_pop(struct tcache_depot *d,
+					   unsigned int *mag_size)
+{
+	struct tcache_depot old;
+	struct tcache_hdr *next;
+
+	if (!ACCESS_ONCE(d->head)) {
+		*mag_size = ACCESS_ONCE(d->mag_size);
+		return NULL;
+	}
+
+	spin_lock(&d->lock);
+	do {
+		tcache_depot_read(d, &old);
+		*mag_size = old.mag_size;
+		if (!old.head)
+			break;
+		/* @old.head can't be removed while we hold the lock */
+		next = ACCESS_ONCE(old.head->next_mag);
+	} while (!tcache_depot_cas(d, &old, next, old.mag_size));
+	spin_unlock(&d->lock);
+
+	return old.head;
+}
+
+/*
+ * Pushes a full magazine of @mag_size items. Fails if the depot holds a
+ * different size, in which case @mag_size is updated to the current size.
+ */
+static bool tcache_depot_push(struct tcache_depot *d, struct tcache_hdr *mag,
+			      unsigned int *mag_size)
+{
+	struct tcache_depot old;
+
+	do {
+		tcache_depot_read(d, &old);
+		if (old.mag_size != *mag_size) {
+			*mag_size = old.mag_size;
+			return false;
+		}
+		mag->next_mag = old.head;
+	} while (!tcache_depot_cas(d, &old, mag, old.mag_size));
+
+	return true;
+}
+
+/* Empties the depot, returning the magazines it held. */
+static struct tcache_hdr *tcache_depot_flush(struct tcache_depot *d)
+{
+	struct tcache_depot old;
+
+	spin_lock(&d->lock);
+	do {
+		tcache_depot_read(d, &old);
+	} while (!tcache_depot_cas(d, &old, NULL, old.mag_size));
+	spin_unlock(&d->lock);
+
+	return old.head;
+}
+
+/*
+ * Counts a trip to the depot and grows the magazine size if this thread's
+ * trips are too frequent. Returns the magazines in the depot that are now the
+ * wrong size, which the caller must free.
+ */
+static struct tcache_hdr *tcache_depot_trip(struct tcache_perthread *ltc)
+{
+	struct tcache *tc = ltc->tc;
+	struct tcache_depot *d = &tc->depots[ltc->node];
+	struct tcache_depot old;
+	uint64_t now, elapsed;
+
+	if (++ltc->trips < TCACHE_RESIZE_TRIPS)
+		return NULL;
+
+	atomic64_fetch_and_add(&tc->depot_hits, ltc->hits);
+	atomic64_fetch_and_add(&tc->depot_misses, ltc->misses);
+	atomic64_fetch_and_add(&tc->depot_frees, ltc->frees);
+	atomic64_fetch_and_add(&tc->remote_frees, ltc->remotes);
+	ltc->trips = ltc->hits = ltc->misses = ltc->frees = 0;
+	ltc->remotes = 0;
+
+	now = microtime();
+	elapsed = now - ltc->trips_us;
+	ltc->trips_us = now;
+	if (elapsed >= TCACHE_RESIZE_US)
+		return NULL;
+
+	/* only the first thread to see this size grows it */
+	spin_lock(&d->lock);
+	do {
+		tcache_depot_read(d, &old);
+		if (old.mag_size != ltc->capacity ||
+		    old.mag_size >= tc->max_mag_size) {
+			spin_unlock(&d->lock);
+			return NULL;
+		}
+	} while (!tcache_depot_cas(d, &old, NULL,
+				   min(old.mag_size * 2, tc->max_mag_size)));
+	spin_unlock(&d->lock);
+
+	atomic64_inc(&tc->depot_resizes);
+	return old.head;
 }
 
 /* The thread-local cache allocation slow path. */
 void *__tcache_alloc(struct tcache_perthread *ltc)
 {
 	struct tcache *tc = ltc->tc;
+	struct tcache_hdr *stale;
 	void *item;
 
 	/* must be out of rounds */
 	assert(ltc->rounds == 0);
 	assert(ltc->loaded == NULL);
 
+	allocprof_sample(ALLOCPROF_TCACHE, tc, tc->name, tc->item_size);
+
 	/* CASE 1: exchange empty loaded mag with full previous mag */
 	if (ltc->previous) {
 		ltc->loaded = ltc->previous;
@@ -76,16 +238,18 @@ void *__tcache_alloc(struct tcache_perthread *ltc)
 	}
 
 	/* CASE 2: grab a magazine from the shared pool */
-	spin_lock(&tc->lock);
-	ltc->loaded = tc->shared_mags;
-	if (tc->shared_mags)
-		tc->shared_mags = tc->shared_mags->next_mag;
-	spin_unlock(&tc->lock);
-	if (ltc->loaded)
+	stale = tcache_depot_trip(ltc);
+	tcache_free_mags(tc, stale);
+	/* no magazines are held here, so it's safe to switch sizes */
+	ltc->loaded = tcache_depot_pop(&tc->depots[ltc->node], &ltc->capacity);
+	if (ltc->loaded) {
+		ltc->hits++;
 		goto alloc;
+	}
+	ltc->misses++;
 
 	/* CASE 3: allocate a new magazine */
-	ltc->loaded = tcache_alloc_mag(tc);
+	ltc->loaded = tcache_alloc_mag(tc, ltc->capacity);
 	if (unlikely(!ltc->loaded))
 		return NULL;
 
@@ -102,6 +266,7 @@ void __tcache_free(struct tcache_perthread *ltc, void *item)
 {
 	struct tcache *tc = ltc->tc;
 	struct tcache_hdr *hdr = (struct tcache_hdr *)item;
+	struct tcache_hdr *stale;
 
 	/* magazine must be full */
 	assert(ltc->rounds == ltc->capacity);
@@ -114,11 +279,19 @@ void __tcache_free(struct tcache_perthread *ltc, void *item)
 	}
 
 	/* CASE 2: return a magazine to the shared pool */
-	spin_lock(&tc->lock);
-	ltc->previous->next_mag = tc->shared_mags;
-	tc->shared_mags = ltc->previous;
-	spin_unlock(&tc->lock);
-	ltc->previous = ltc->loaded;
+	stale = tcache_depot_trip(ltc);
+	tcache_free_mags(tc, stale);
+	if (likely(tcache_depot_push(&tc->depots[ltc->node], ltc->previous,
+				     &ltc->capacity))) {
+		ltc->previous = ltc->loaded;
+		ltc->frees++;
+		goto free;
+	}
+
+	/* both held magazines are the old size, so release them */
+	tcache_free_mag(tc, ltc->previous);
+	tcache_free_mag(tc, ltc->loaded);
+	ltc->previous = NULL;
 
 free:
 	/* start a new magazine and free the item */
@@ -127,6 +300,33 @@ free:
 	hdr->next_item = NULL;
 }
 
+/*
+ * The free path for items that belong to another NUMA node. They are batched
+ * into a magazine and pushed to their home node's depot, so they get reused
+ * there instead of being handed out again from remote memory.
+ */
+void __tcache_free_remote(struct tcache_perthread *ltc, void *item)
+{
+	struct tcache *tc = ltc->tc;
+	struct tcache_hdr *hdr = (struct tcache_hdr *)item;
+	unsigned int node = addr_to_numa_node(item);
+	struct tcache_depot *d = &tc->depots[node];
+	unsigned int nr;
+
+	assert(node < numa_count);
+	hdr->next_item = ltc->remote[node];
+	ltc->remote[node] = hdr;
+	nr = ++ltc->remote_nr[node];
+	ltc->remotes++;
+	if (nr < ACCESS_ONCE(d->mag_size))
+		return;
+
+	ltc->remote[node] = NULL;
+	ltc->remote_nr[node] = 0;
+	if (!tcache_depot_push(d, hdr, &nr))
+		tcache_free_mag(tc, hdr);
+}
+
 /**
  * tcache_create - creates a new thread-local cache
  * @name: a human-readable name to identify the cache
@@ -136,6 +336,9 @@ free:
  *
  * Returns a thread cache or NULL of out of memory.
  *
+ * The magazine size can grow at runtime, up to TCACHE_MAX_MAG_GROWTH times
+ * @mag_size, if threads exchange magazines with the shared pool frequently.
+ *
  * After creating a thread-local cache, you'll want to attach one or more
  * thread-local handles using tcache_init_perthread().
  */
@@ -143,22 +346,35 @@ struct tcache *tcache_create(const char *name, const struct tcache_ops *ops,
 			     unsigned int mag_size, size_t item_size)
 {
 	struct tcache *tc;
+	int i;
 
 	/* we assume the caller is aware of the tcache size limits */
 	assert(item_size >= TCACHE_MIN_ITEM_SIZE);
 	assert(mag_size <= TCACHE_MAX_MAG_SIZE);
 
-	tc = malloc(sizeof(*tc));
+	tc = aligned_alloc(CACHE_LINE_SIZE,
+			   align_up(sizeof(*tc), CACHE_LINE_SIZE));
 	if (!tc)
 		return NULL;
 
 	tc->name = name;
 	tc->ops = ops;
 	tc->item_size = item_size;
-	atomic64_write(&tc->mags_allocated, 0);
-	tc->mag_size = mag_size;
-	spin_lock_init(&tc->lock);
-	tc->shared_mags = NULL;
+	atomic64_write(&tc->items_allocated, 0);
+	tc->max_mag_size = min(mag_size * TCACHE_MAX_MAG_GROWTH,
+			       TCACHE_MAX_MAG_SIZE);
+	atomic64_write(&tc->depot_hits, 0);
+	atomic64_write(&tc->depot_misses, 0);
+	atomic64_write(&tc->depot_frees, 0);
+	atomic64_write(&tc->depot_resizes, 0);
+	atomic64_write(&tc->remote_frees, 0);
+	tc->numa = false;
+	for (i = 0; i < NNUMA; i++) {
+		tc->depots[i].head = NULL;
+		tc->depots[i].tag = 0;
+		tc->depots[i].mag_size = mag_size;
+		spin_lock_init(&tc->depots[i].lock);
+	}
 
 	spin_lock(&tcache_lock);
 	list_add_tail(&tcache_list, &tc->link);
@@ -175,10 +391,21 @@ struct tcache *tcache_create(const char *name, const struct tcache_ops *ops,
  */
 void tcache_init_perthread(struct tcache *tc, struct tcache_perthread *ltc)
 {
+	int i;
+
 	ltc->tc = tc;
 	ltc->loaded = ltc->previous = NULL;
 	ltc->rounds = 0;
-	ltc->capacity = tc->mag_size; 
+	ltc->node = thread_numa_node;
+	ltc->numa = tc->numa && numa_count > 1;
+	ltc->capacity = ACCESS_ONCE(tc->depots[ltc->node].mag_size);
+	ltc->trips = ltc->hits = ltc->misses = ltc->frees = 0;
+	ltc->remotes = 0;
+	ltc->trips_us = microtime();
+	for (i = 0; i < NNUMA; i++) {
+		ltc->remote[i] = NULL;
+		ltc->remote_nr[i] = 0;
+	}
 }
 
 /**
@@ -187,18 +414,26 @@ void tcache_init_perthread(struct tcache *tc, struct tcache_perthread *ltc)
  */
 void tcache_reclaim(struct tcache *tc)
 {
-	struct tcache_hdr *hdr, *next;
+	int i;
 
-	spin_lock(&tc->lock);
-	hdr = tc->shared_mags;
-	tc->shared_mags = NULL;
-	spin_unlock(&tc->lock);
+	for (i = 0; i < NNUMA; i++)
+		tcache_free_mags(tc, tcache_depot_flush(&tc->depots[i]));
+}
 
-	while (hdr) {
-		next = hdr->next_mag;
-		tcache_free_mag(tc, hdr);
-		hdr = next;
-	}
+/**
+ * tcache_reclaim_all - reclaims unused memory from every thread-local cache
+ *
+ * Only magazines in the shared depots are released. Magazines loaded by
+ * threads are left alone.
+ */
+void tcache_reclaim_all(void)
+{
+	struct tcache *tc;
+
+	spin_lock(&tcache_lock);
+	list_for_each(&tcache_list, tc, link)
+		tcache_reclaim(tc);
+	spin_unlock(&tcache_lock);
 }
 
 /**
@@ -213,9 +448,18 @@ void tcache_print_usage(void)
 
 	spin_lock(&tcache_lock);
 	list_for_each(&tcache_list, tc, link) {
-		long mags = atomic64_read(&tc->mags_allocated);
-		size_t usage = tc->mag_size * tc->item_size * mags;
-		log_info("%8ld KB\t%s", usage / 1024, tc->name);
+		long items = atomic64_read(&tc->items_allocated);
+		size_t usage = tc->item_size * items;
+
+		log_info("%8ld KB\t%s (mag %u, depot hits %ld misses %ld "
+			 "frees %ld, resizes %ld, remote frees %ld)",
+			 usage / 1024, tc->name,
+			 ACCESS_ONCE(tc->depots[0].mag_size),
+			 atomic64_read(&tc->depot_hits),
+			 atomic64_read(&tc->depot_misses),
+			 atomic64_read(&tc->depot_frees),
+			 atomic64_read(&tc->depot_resizes),
+			 atomic64_read(&tc->remote_frees));
 		total += usage;
 	}
 	spin_unlock(&tcache_lock);
@@ -2,6 +2,7 @@
  * thread.c - support for thread-local storage and initialization
  */
 
+#include <sched.h>
 #include <unistd.h>
 #include <limits.h>
 #include <sys/syscall.h>
@@ -54,7 +55,7 @@ static int thread_alloc_perthread(void)
  */
 int thread_init_perthread(void)
 {
-	int ret;
+	int ret, cpu;
 
 	spin_lock(&thread_lock);
 	if (thread_count >= NTHREAD) {
@@ -65,8 +66,9 @@ int thread_init_perthread(void)
 	thread_id = thread_count++;
 	spin_unlock(&thread_lock);
 
-	/* TODO: figure out how to support NUMA */
-	thread_numa_node = 0;
+	/* per-thread memory comes from the node the thread starts on */
+	cpu = sched_getcpu();
+	thread_numa_node = cpu >= 0 && cpu < cpu_count ? cpu_to_node(cpu) : 0;
 
 	ret = thread_alloc_perthread();
 	if (ret)
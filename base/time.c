@@ -10,8 +10,19 @@
 
 #include "init_internal.h"
 
+/* the most the clock is sped up or slowed down to correct an offset */
+#define TIME_MAX_SLEW_PPM	500
+/* how long an offset takes to be corrected, at most TIME_MAX_SLEW_PPM */
+#define TIME_SLEW_NS		1000000000L
+
 int cycles_per_us __aligned(CACHE_LINE_SIZE);
 uint64_t start_tsc;
+struct time_clock time_clock __aligned(CACHE_LINE_SIZE);
+
+/* the CLOCK_MONOTONIC_RAW time (ns) at start_tsc */
+static uint64_t start_raw_ns;
+/* the first TSC and CLOCK_MONOTONIC_RAW readings, to measure the rate from */
+static uint64_t calib_tsc, calib_raw_ns;
 
 /**
  * __timer_delay_us - spins the CPU for the specified delay
@@ -26,35 +37,116 @@ void __time_delay_us(uint64_t us)
 		cpu_relax();
 }
 
+/**
+ * __microtime - gets the number of microseconds since the process started
+ *
+ * The same as microtime(), for callers that can't use inline functions.
+ */
+uint64_t __microtime(void)
+{
+	return microtime();
+}
+
+/*
+ * Reads CLOCK_MONOTONIC_RAW (ns) and the TSC at the same instant, using the
+ * TSC at the middle of the clock_gettime() call.
+ */
+static int time_read_raw(uint64_t *raw_ns, uint64_t *tsc)
+{
+	struct timespec ts;
+	uint64_t before, after;
+
+	before = rdtsc();
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts))
+		return -1;
+	after = rdtscp(NULL);
+
+	*raw_ns = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	*tsc = before + (after - before) / 2;
+	return 0;
+}
+
+/* converts nanoseconds per cycle to a time_clock multiplier */
+static uint64_t time_ns_mult(double ns_per_cycle)
+{
+	return (uint64_t)(ns_per_cycle * (double)(1UL << TIME_SHIFT) + 0.5);
+}
+
+/* the nearest integer cycles_per_us for @ns_per_cycle */
+static int time_cycles_per_us(double ns_per_cycle)
+{
+	return (int)(1000.0 / ns_per_cycle + 0.5);
+}
+
+/* updates the clock, which must already agree with @base_ns at @base_tsc */
+static void time_clock_update(uint64_t base_tsc, uint64_t base_ns,
+			      uint64_t ns_mult)
+{
+	ACCESS_ONCE(time_clock.seq)++;
+	wmb();
+	time_clock.base_tsc = base_tsc;
+	time_clock.base_ns = base_ns;
+	time_clock.ns_mult = ns_mult;
+	wmb();
+	ACCESS_ONCE(time_clock.seq)++;
+}
+
+/**
+ * time_recalibrate - corrects the TSC clock against CLOCK_MONOTONIC_RAW
+ *
+ * The TSC frequency is measured again over the whole time since startup, which
+ * gets more precise the longer the process runs. Any offset between the two
+ * clocks is slewed away, like NTP does, by running the TSC clock up to
+ * TIME_MAX_SLEW_PPM faster or slower for a while. Time never steps or goes
+ * backward. Call it about once a second, from one thread at a time.
+ */
+void time_recalibrate(void)
+{
+	uint64_t raw_ns, tsc, ns;
+	double rate, slew;
+	int64_t offset;
+
+	if (time_read_raw(&raw_ns, &tsc) || tsc <= start_tsc)
+		return;
+
+	/* the offset the TSC clock has built up so far */
+	ns = __time_tsc_to_ns(&time_clock, tsc);
+	offset = (int64_t)(raw_ns - start_raw_ns) - (int64_t)ns;
+
+	/* correct it over the next TIME_SLEW_NS */
+	rate = (double)(raw_ns - calib_raw_ns) / (tsc - calib_tsc);
+	slew = (double)offset / TIME_SLEW_NS;
+	if (slew > TIME_MAX_SLEW_PPM / 1e6)
+		slew = TIME_MAX_SLEW_PPM / 1e6;
+	else if (slew < -TIME_MAX_SLEW_PPM / 1e6)
+		slew = -TIME_MAX_SLEW_PPM / 1e6;
+
+	time_clock_update(tsc, ns, time_ns_mult(rate * (1.0 + slew)));
+	ACCESS_ONCE(cycles_per_us) = time_cycles_per_us(rate);
+}
+
 /* derived from DPDK */
 static int time_calibrate_tsc(void)
 {
 	/* TODO: New Intel CPUs report this value in CPUID */
 	struct timespec sleeptime = {.tv_nsec = 5E8 }; /* 1/2 second */
-	struct timespec t_start, t_end;
+	double rate;
 
 	cpu_serialize();
-	if (clock_gettime(CLOCK_MONOTONIC_RAW, &t_start) == 0) {
-		uint64_t ns, end, start;
-		double secs;
-
-		start = rdtsc();
-		nanosleep(&sleeptime, NULL);
-		clock_gettime(CLOCK_MONOTONIC_RAW, &t_end);
-		end = rdtscp(NULL);
-		ns = ((t_end.tv_sec - t_start.tv_sec) * 1E9);
-		ns += (t_end.tv_nsec - t_start.tv_nsec);
-
-		secs = (double)ns / 1000;
-		cycles_per_us = (uint64_t)((end - start) / secs);
-		log_info("time: detected %d ticks / us", cycles_per_us);
-
-		/* record the start time of the binary */
-		start_tsc = rdtsc();
-		return 0;
-	}
-
-	return -1;
+	if (time_read_raw(&calib_raw_ns, &calib_tsc))
+		return -1;
+	nanosleep(&sleeptime, NULL);
+	if (time_read_raw(&start_raw_ns, &start_tsc))
+		return -1;
+
+	/* keep the fraction, which an integer cycles_per_us truncates */
+	rate = (double)(start_raw_ns - calib_raw_ns) / (start_tsc - calib_tsc);
+	cycles_per_us = time_cycles_per_us(rate);
+	log_info("time: detected %.3f ticks / us", 1000.0 / rate);
+
+	/* the clock starts at the end of calibration */
+	time_clock_update(start_tsc, 0, time_ns_mult(rate));
+	return 0;
 }
 
 /**
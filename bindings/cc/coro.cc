@@ -0,0 +1,145 @@
+#include "coro.h"
+#include "thread.h"
+
+namespace rt {
+namespace coro_internal {
+
+void Wakeup::Arm(Executor *e, std::coroutine_handle<> h) {
+  h_ = h;
+  poll_arm(&trigger_, &e->w_, reinterpret_cast<unsigned long>(
+           static_cast<Notifier *>(this)));
+}
+
+void Wakeup::Dispatch(Notifier *n, unsigned int events) {
+  Wakeup *w = static_cast<Wakeup *>(n);
+  // waits for Fire() to let go of the trigger, which might be in the frame
+  poll_disarm(&w->trigger_);
+  w->h_.resume();
+}
+
+} // namespace coro_internal
+
+Executor::Executor() : stop_(false), pos_(0), nr_(0) {
+  poll_init(&w_);
+  poll_trigger_init(&stop_trigger_);
+  stop_notifier_.fn = StopDispatch;
+  poll_arm(&stop_trigger_, &w_, reinterpret_cast<unsigned long>(
+           &stop_notifier_));
+  waitgroup_init(&wg_);
+  waitgroup_add(&wg_, 1);
+  rt::Spawn([this] {
+    Run();
+    waitgroup_done(&wg_);
+  });
+}
+
+Executor::~Executor() {
+  ACCESS_ONCE(stop_) = true;
+  __poll_set(&stop_trigger_, POLL_IN);
+  waitgroup_wait(&wg_);
+  poll_disarm(&stop_trigger_);
+}
+
+void Executor::StopDispatch(coro_internal::Notifier *n, unsigned int events) {
+  // nothing to do, Run() checks for stop_
+}
+
+void Executor::Run() {
+  while (!ACCESS_ONCE(stop_)) {
+    nr_ = poll_wait(&w_, evs_, kBatch);
+    for (pos_ = 0; pos_ < nr_;) {
+      const poll_event &ev = evs_[pos_++];
+      coro_internal::Notifier *n =
+          reinterpret_cast<coro_internal::Notifier *>(ev.data);
+      if (n) n->fn(n, ev.events);
+    }
+  }
+}
+
+void Executor::Forget(coro_internal::Notifier *n) {
+  for (int i = pos_; i < nr_; i++) {
+    if (evs_[i].data == reinterpret_cast<unsigned long>(n))
+      evs_[i].data = 0;
+  }
+}
+
+AsyncTcpConn::AsyncTcpConn(Executor *e, TcpConn *c) : e_(e), c_(c) {
+  fn = Dispatch;
+  tcp_set_nonblocking(c_->c_, true);
+  tcp_poll_register(c_->c_, &e_->w_, reinterpret_cast<unsigned long>(
+                    static_cast<coro_internal::Notifier *>(this)));
+}
+
+AsyncTcpConn::~AsyncTcpConn() {
+  tcp_poll_unregister(c_->c_);
+  e_->Forget(this);
+  delete c_;
+}
+
+void AsyncTcpConn::Dispatch(coro_internal::Notifier *n, unsigned int events) {
+  AsyncTcpConn *c = static_cast<AsyncTcpConn *>(n);
+  std::coroutine_handle<> rx, tx;
+
+  // the reader might free the connection, so take both first
+  if (events & POLL_IN) rx = c->rx_.Take();
+  if (events & POLL_OUT) tx = c->tx_.Take();
+  if (rx) rx.resume();
+  if (tx) tx.resume();
+}
+
+Task<ssize_t> AsyncTcpConn::Read(void *buf, size_t len) {
+  while (true) {
+    ssize_t ret = tcp_read(c_->c_, buf, len);
+    if (ret != -EAGAIN) co_return ret;
+    co_await rx_.Wait();
+  }
+}
+
+Task<ssize_t> AsyncTcpConn::Write(const void *buf, size_t len) {
+  while (true) {
+    ssize_t ret = tcp_write(c_->c_, buf, len);
+    if (ret != -EAGAIN) co_return ret;
+    co_await tx_.Wait();
+  }
+}
+
+Task<ssize_t> AsyncTcpConn::WriteFull(const void *buf, size_t len) {
+  const char *pos = reinterpret_cast<const char *>(buf);
+  size_t n = 0;
+  while (n < len) {
+    ssize_t ret = co_await Write(pos + n, len - n);
+    if (ret < 0) co_return ret;
+    n += ret;
+  }
+  co_return n;
+}
+
+AsyncTcpQueue::AsyncTcpQueue(Executor *e, TcpQueue *q) : e_(e), q_(q) {
+  fn = Dispatch;
+  tcp_qset_nonblocking(q_->q_, true);
+  tcp_qpoll_register(q_->q_, &e_->w_, reinterpret_cast<unsigned long>(
+                     static_cast<coro_internal::Notifier *>(this)));
+}
+
+AsyncTcpQueue::~AsyncTcpQueue() {
+  tcp_qpoll_unregister(q_->q_);
+  e_->Forget(this);
+  delete q_;
+}
+
+void AsyncTcpQueue::Dispatch(coro_internal::Notifier *n, unsigned int events) {
+  std::coroutine_handle<> h = static_cast<AsyncTcpQueue *>(n)->slot_.Take();
+  if (h) h.resume();
+}
+
+Task<AsyncTcpConn *> AsyncTcpQueue::Accept() {
+  while (true) {
+    tcpconn_t *c;
+    int ret = tcp_accept(q_->q_, &c);
+    if (ret == 0) co_return new AsyncTcpConn(e_, new TcpConn(c));
+    if (ret != -EAGAIN) co_return nullptr;
+    co_await slot_.Wait();
+  }
+}
+
+} // namespace rt
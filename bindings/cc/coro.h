@@ -0,0 +1,313 @@
+// coro.h - support for C++20 coroutines
+//
+// A coroutine is much cheaper than a thread: its frame holds only the locals
+// that live across a co_await, and switching to it is a function call. An
+// Executor runs coroutines on a single runtime thread and resumes them as the
+// timers and sockets they wait on become ready, so one thread (and one stack)
+// can serve many connections:
+//
+//   rt::Task<void> Echo(rt::AsyncTcpConn *c) {
+//     char buf[1024];
+//     ssize_t n;
+//     while ((n = co_await c->Read(buf, sizeof(buf))) > 0)
+//       if (co_await c->WriteFull(buf, n) < 0) break;
+//     delete c;
+//   }
+//
+// Coroutines on the same executor never run in parallel, so they can share
+// state without locks. Use one executor per kthread to use more cores.
+
+#pragma once
+
+extern "C" {
+#include <base/assert.h>
+#include <base/time.h>
+#include <runtime/poll.h>
+#include <runtime/sync.h>
+#include <runtime/timer.h>
+}
+
+#include <coroutine>
+#include <optional>
+#include <utility>
+
+#include "macros.h"
+#include "net.h"
+
+namespace rt {
+
+class Executor;
+template <typename T> class Task;
+
+namespace coro_internal {
+
+// Something an executor's worker dispatches poll events to.
+struct Notifier {
+  void (*fn)(Notifier *n, unsigned int events);
+};
+
+// State shared by the promises of every coroutine type.
+struct PromiseBase {
+  Executor *exec_ = nullptr;
+};
+
+// Resumes a suspended coroutine on its executor's worker, from any context.
+class Wakeup : public Notifier {
+ public:
+  Wakeup() { fn = Dispatch; poll_trigger_init(&trigger_); }
+  DISALLOW_COPY_AND_ASSIGN(Wakeup);
+
+  // Prepares to resume @h on @e.
+  void Arm(Executor *e, std::coroutine_handle<> h);
+  // Queues the coroutine to run. Safe from timer handlers and softirqs.
+  void Fire() { __poll_set(&trigger_, POLL_IN); }
+
+ private:
+  static void Dispatch(Notifier *n, unsigned int events);
+
+  poll_trigger_t trigger_;
+  std::coroutine_handle<> h_;
+};
+
+// A coroutine waiting for a socket to become ready. Only touched on the
+// executor's thread, so readiness can't be reported between a coroutine's
+// attempt and its suspension.
+class WaitSlot {
+ public:
+  // Takes the waiting coroutine, if there is one.
+  std::coroutine_handle<> Take() { return std::exchange(h_, nullptr); }
+
+  // Suspends until the coroutine is taken.
+  auto Wait() {
+    struct Awaiter {
+      WaitSlot *s;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) noexcept { s->h_ = h; }
+      void await_resume() const noexcept { }
+    };
+    return Awaiter{this};
+  }
+
+ private:
+  std::coroutine_handle<> h_;
+};
+
+// A coroutine started by Executor::Spawn(), which frees itself when done.
+struct Detached {
+  struct promise_type : PromiseBase {
+    Detached get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept { }
+    void unhandled_exception() noexcept { BUG(); }
+  };
+};
+
+template <typename T>
+struct TaskPromise : PromiseBase {
+  std::optional<T> value_;
+  template <typename U> void return_value(U&& v) {
+    value_.emplace(std::forward<U>(v));
+  }
+  T TakeValue() { return std::move(*value_); }
+};
+
+template <>
+struct TaskPromise<void> : PromiseBase {
+  void return_void() noexcept { }
+  void TakeValue() { }
+};
+
+// Suspends the awaiting coroutine until a deadline.
+struct SleepAwaiter {
+  uint64_t deadline_us;
+  Wakeup w;
+  struct timer_entry t;
+
+  static void Expired(unsigned long arg) {
+    reinterpret_cast<SleepAwaiter *>(arg)->w.Fire();
+  }
+
+  bool await_ready() const noexcept { return deadline_us <= microtime(); }
+  template <typename P>
+  void await_suspend(std::coroutine_handle<P> h) noexcept {
+    w.Arm(h.promise().exec_, h);
+    timer_init(&t, Expired, reinterpret_cast<unsigned long>(this));
+    timer_start(&t, deadline_us);
+  }
+  void await_resume() const noexcept { }
+};
+
+} // namespace coro_internal
+
+// A coroutine that returns a T to the coroutine that co_awaits it. It starts
+// running when awaited, on the awaiting coroutine's executor.
+template <typename T = void>
+class [[nodiscard]] Task {
+ public:
+  struct promise_type : coro_internal::TaskPromise<T> {
+    std::coroutine_handle<> cont_;
+
+    Task get_return_object() noexcept {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    auto final_suspend() noexcept {
+      // continue the awaiting coroutine without growing the stack
+      struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<promise_type> h) noexcept {
+          return h.promise().cont_;
+        }
+        void await_resume() const noexcept { }
+      };
+      return FinalAwaiter{};
+    }
+    void unhandled_exception() noexcept { BUG(); }
+  };
+
+  Task(Task&& t) noexcept : h_(std::exchange(t.h_, nullptr)) { }
+  Task& operator=(Task&& t) noexcept {
+    if (h_) h_.destroy();
+    h_ = std::exchange(t.h_, nullptr);
+    return *this;
+  }
+  ~Task() { if (h_) h_.destroy(); }
+
+  bool await_ready() const noexcept { return false; }
+  template <typename P>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+    h_.promise().exec_ = h.promise().exec_;
+    h_.promise().cont_ = h;
+    return h_;
+  }
+  T await_resume() { return h_.promise().TakeValue(); }
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> h) : h_(h) { }
+
+  // disable copy.
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  std::coroutine_handle<promise_type> h_;
+};
+
+// Runs coroutines on a runtime thread.
+class Executor {
+  friend class coro_internal::Wakeup;
+  friend class AsyncTcpConn;
+  friend class AsyncTcpQueue;
+
+ public:
+  // Spawns the thread that runs the coroutines.
+  Executor();
+  // Stops the thread. Coroutines that are still suspended are abandoned.
+  ~Executor();
+
+  // Starts running a coroutine on this executor. It frees itself when done.
+  void Spawn(Task<void>&& t) { Start(this, std::move(t)); }
+
+  // Moves the awaiting coroutine to the back of the executor's queue.
+  auto Yield() { return Schedule(this); }
+
+ private:
+  static constexpr int kBatch = 16;
+
+  struct ScheduleAwaiter {
+    Executor *e;
+    coro_internal::Wakeup w;
+    bool await_ready() const noexcept { return false; }
+    template <typename P>
+    void await_suspend(std::coroutine_handle<P> h) noexcept {
+      h.promise().exec_ = e;
+      w.Arm(e, h);
+      w.Fire();
+    }
+    void await_resume() const noexcept { }
+  };
+
+  static ScheduleAwaiter Schedule(Executor *e) { return ScheduleAwaiter{e}; }
+  static coro_internal::Detached Start(Executor *e, Task<void> t) {
+    co_await Schedule(e);
+    co_await std::move(t);
+  }
+
+  static void StopDispatch(coro_internal::Notifier *n, unsigned int events);
+  void Run();
+  // Drops events for @n that were received but not yet dispatched.
+  void Forget(coro_internal::Notifier *n);
+
+  poll_waiter_t w_;
+  poll_trigger_t stop_trigger_;
+  coro_internal::Notifier stop_notifier_;
+  bool stop_;
+  waitgroup_t wg_;
+
+  // the batch of events being dispatched
+  poll_event evs_[kBatch];
+  int pos_, nr_;
+
+  DISALLOW_COPY_AND_ASSIGN(Executor);
+};
+
+// Suspends the awaiting coroutine until a microsecond deadline.
+static inline auto SleepUntilAsync(uint64_t deadline_us) {
+  return coro_internal::SleepAwaiter{deadline_us, {}, {}};
+}
+
+// Suspends the awaiting coroutine for a microsecond duration.
+static inline auto SleepAsync(uint64_t duration_us) {
+  return SleepUntilAsync(microtime() + duration_us);
+}
+
+// A TCP connection for coroutines. Reads and writes suspend the awaiting
+// coroutine instead of blocking its executor's thread.
+class AsyncTcpConn : private coro_internal::Notifier {
+ public:
+  // Takes ownership of @c, which must not be used by threads anymore.
+  AsyncTcpConn(Executor *e, TcpConn *c);
+  ~AsyncTcpConn();
+
+  // Reads from the TCP stream.
+  Task<ssize_t> Read(void *buf, size_t len);
+  // Writes to the TCP stream.
+  Task<ssize_t> Write(const void *buf, size_t len);
+  // Writes exactly @len bytes to the TCP stream.
+  Task<ssize_t> WriteFull(const void *buf, size_t len);
+
+  // Gets the connection.
+  TcpConn *Conn() const { return c_; }
+
+ private:
+  static void Dispatch(coro_internal::Notifier *n, unsigned int events);
+
+  Executor *e_;
+  TcpConn *c_;
+  coro_internal::WaitSlot rx_, tx_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncTcpConn);
+};
+
+// A TCP listener queue for coroutines.
+class AsyncTcpQueue : private coro_internal::Notifier {
+ public:
+  // Takes ownership of @q, which must not be used by threads anymore.
+  AsyncTcpQueue(Executor *e, TcpQueue *q);
+  ~AsyncTcpQueue();
+
+  // Accepts a connection, or returns nullptr if the queue was shut down.
+  Task<AsyncTcpConn *> Accept();
+
+ private:
+  static void Dispatch(coro_internal::Notifier *n, unsigned int events);
+
+  Executor *e_;
+  TcpQueue *q_;
+  coro_internal::WaitSlot slot_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncTcpQueue);
+};
+
+} // namespace rt
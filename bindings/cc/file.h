@@ -0,0 +1,56 @@
+// file.h - support for file I/O
+
+#pragma once
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <runtime/fileio.h>
+#include <runtime/offload.h>
+}
+
+namespace rt {
+
+// A file whose I/O parks the calling thread instead of blocking its kthread.
+class File {
+ public:
+  ~File() { close(fd_); }
+
+  // Opens a file, takes the same flags and mode as open(). Returns nullptr
+  // on failure.
+  static File *Open(const char *path, int flags, mode_t mode = 0644) {
+    long fd = offload_syscall(SYS_openat, static_cast<long>(AT_FDCWD), path,
+                              static_cast<long>(flags),
+                              static_cast<long>(mode));
+    if (fd < 0) return nullptr;
+    return new File(static_cast<int>(fd));
+  }
+
+  // Reads at an offset, or at the file position if @off is -1.
+  ssize_t ReadAt(void *buf, size_t len, off_t off) {
+    return file_read(fd_, buf, len, off);
+  }
+
+  // Writes at an offset, or at the file position if @off is -1.
+  ssize_t WriteAt(const void *buf, size_t len, off_t off) {
+    return file_write(fd_, buf, len, off);
+  }
+
+  // Flushes the file to storage. With @datasync, only the data and the
+  // metadata needed to read it back are flushed.
+  int Sync(bool datasync = false) { return file_fsync(fd_, datasync); }
+
+  // Gets the file descriptor.
+  int Fd() const { return fd_; }
+
+ private:
+  File(int fd) : fd_(fd) { }
+
+  int fd_;
+
+  File(const File&) = delete;
+  File& operator=(const File&) = delete;
+};
+
+} // namespace rt
@@ -12,6 +12,7 @@ namespace rt {
 
 class NetConn {
  public:
+  virtual ~NetConn() { }
   virtual ssize_t Read(void *buf, size_t len) = 0;
   virtual ssize_t Write(const void *buf, size_t len) = 0;
 };
@@ -70,6 +71,36 @@ class UdpConn : public NetConn {
     return udp_write(c_, buf, len);
   }
 
+  // Reads a datagram into a vector and gets from remote address.
+  ssize_t ReadvFrom(const iovec *iov, int iovcnt, netaddr *raddr) {
+    return udp_readv_from(c_, iov, iovcnt, raddr);
+  }
+
+  // Writes a datagram from a vector and sets to remote address.
+  ssize_t WritevTo(const iovec *iov, int iovcnt, const netaddr *raddr) {
+    return udp_writev_to(c_, iov, iovcnt, raddr);
+  }
+
+  // Reads a datagram into a vector.
+  ssize_t Readv(const iovec *iov, int iovcnt) {
+    return udp_readv_from(c_, iov, iovcnt, nullptr);
+  }
+
+  // Writes a datagram from a vector.
+  ssize_t Writev(const iovec *iov, int iovcnt) {
+    return udp_writev_to(c_, iov, iovcnt, nullptr);
+  }
+
+  // Reads up to @n datagrams, returning how many were read.
+  int ReadBatch(udp_msg *msgs, int n) {
+    return udp_read_batch(c_, msgs, n);
+  }
+
+  // Writes up to @n datagrams, returning how many were sent.
+  int WriteBatch(const udp_msg *msgs, int n) {
+    return udp_write_batch(c_, msgs, n);
+  }
+
   // Shutdown the socket (no more receives).
   void Shutdown() {
     udp_shutdown(c_);
@@ -85,9 +116,44 @@ class UdpConn : public NetConn {
   udpconn_t *c_;
 };
 
+// A buffer for zero-copy TCP writes, see TcpConn::WriteZc().
+class TcpTxBuf {
+  friend class TcpConn;
+
+ public:
+  ~TcpTxBuf() { if (b_.handle) tcp_tx_buf_free(&b_); }
+
+  // Allocates a buffer for payloads of up to @len bytes. Returns nullptr on
+  // failure.
+  static TcpTxBuf *Alloc(size_t len) {
+    TcpTxBuf *buf = new TcpTxBuf();
+    if (tcp_tx_buf_alloc(&buf->b_, len)) {
+      delete buf;
+      return nullptr;
+    }
+    return buf;
+  }
+
+  // Gets the payload to fill in.
+  void *Data() const { return b_.buf; }
+  // Gets the largest payload the buffer can hold.
+  size_t Capacity() const { return b_.cap; }
+
+ private:
+  TcpTxBuf() { b_.handle = nullptr; }
+
+  // disable move and copy.
+  TcpTxBuf(const TcpTxBuf&) = delete;
+  TcpTxBuf& operator=(const TcpTxBuf&) = delete;
+
+  tcp_tx_buf b_;
+};
+
 // TCP connections.
 class TcpConn : public NetConn {
   friend class TcpQueue;
+  friend class AsyncTcpConn;
+  friend class AsyncTcpQueue;
 
  public:
   ~TcpConn() { tcp_close(c_); }
@@ -104,6 +170,8 @@ class TcpConn : public NetConn {
   netaddr LocalAddr() const { return tcp_local_addr(c_); }
   // Gets the remote TCP address.
   netaddr RemoteAddr() const { return tcp_remote_addr(c_); }
+  // Gets a snapshot of the connection's state (RTT, retransmits, windows).
+  void GetInfo(tcp_conn_info *info) const { tcp_get_info(c_, info); }
 
   // Reads from the TCP stream.
   ssize_t Read(void *buf, size_t len) {
@@ -122,6 +190,23 @@ class TcpConn : public NetConn {
     return tcp_writev(c_, iov, iovcnt);
   }
 
+  // Reads up to @len bytes from the TCP stream without copying. Each view
+  // in @bufs must be freed with ReleaseZc().
+  ssize_t ReadZc(size_t len, tcp_rx_buf *bufs, int nr) {
+    return tcp_read_zc(c_, len, bufs, nr);
+  }
+  // Frees a view returned by ReadZc().
+  static void ReleaseZc(const tcp_rx_buf &buf) {
+    tcp_rx_buf_release(buf.release_data);
+  }
+
+  // Writes @len bytes of @buf's payload without copying. @buf must not be
+  // modified or freed until @done is called (see tcp_write_zc()).
+  ssize_t WriteZc(TcpTxBuf *buf, size_t len, void (*done)(void *arg),
+                  void *arg) {
+    return tcp_write_zc(c_, &buf->b_, len, done, arg);
+  }
+
   // Reads exactly @len bytes from the TCP stream.
   ssize_t ReadFull(void *buf, size_t len) {
     char *pos = reinterpret_cast<char*>(buf);
@@ -135,6 +220,16 @@ class TcpConn : public NetConn {
     return n;
   }
 
+  // Reads exactly @len bytes from the TCP stream, and sets @ts to when the
+  // first of them arrived.
+  ssize_t ReadFull(void *buf, size_t len, net_rx_ts *ts) {
+    ssize_t ret = tcp_read_ts(c_, buf, len, ts);
+    if (ret <= 0 || static_cast<size_t>(ret) == len) return ret;
+    ssize_t rest = ReadFull(reinterpret_cast<char*>(buf) + ret, len - ret);
+    if (rest <= 0) return rest;
+    return len;
+  }
+
   // Writes exactly @len bytes to the TCP stream.
   ssize_t WriteFull(const void *buf, size_t len) {
     const char *pos = reinterpret_cast<const char*>(buf);
@@ -167,6 +262,8 @@ class TcpConn : public NetConn {
 
 // TCP listener queues.
 class TcpQueue {
+  friend class AsyncTcpQueue;
+
  public:
   ~TcpQueue() { tcp_qclose(q_); }
 
@@ -178,6 +275,14 @@ class TcpQueue {
     return new TcpQueue(q);
   }
 
+  // Creates a TCP listener queue with per-kthread shards (like SO_REUSEPORT).
+  static TcpQueue *ListenSharded(netaddr laddr, int backlog) {
+    tcpqueue_t *q;
+    int ret = tcp_listen_sharded(laddr, backlog, &q);
+    if (ret) return nullptr;
+    return new TcpQueue(q);
+  }
+
   // Accept a connection from the listener queue.
   TcpConn *Accept() {
     tcpconn_t *c;
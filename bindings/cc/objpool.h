@@ -0,0 +1,66 @@
+// objpool.h - typed pools of fixed-size objects
+
+#pragma once
+
+extern "C" {
+#include <runtime/objpool.h>
+}
+
+#include <new>
+#include <utility>
+
+namespace rt {
+
+// A pool of T objects, allocated from per-kthread magazines of a slab that
+// holds only T. Pools are never freed, so make one per type (e.g. a static
+// local) and create it from a runtime thread.
+template <typename T>
+class ObjectPool {
+  static_assert(alignof(T) <= CACHE_LINE_SIZE, "T is overaligned");
+
+ public:
+  explicit ObjectPool(const char *name = "rt::ObjectPool")
+      : pool_(objpool_create(
+            name, sizeof(T),
+            alignof(T) > alignof(void *) ? OBJPOOL_CACHE_ALIGNED : 0)) {
+    if (unlikely(!pool_)) throw std::bad_alloc();
+  }
+
+  // disable copy.
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  // Allocates uninitialized storage for a T.
+  void *Allocate() {
+    void *p = objpool_alloc(pool_);
+    if (unlikely(!p)) throw std::bad_alloc();
+    return p;
+  }
+
+  // Frees storage from Allocate() without destroying a T.
+  void Deallocate(void *p) noexcept { objpool_free(pool_, p); }
+
+  // Allocates and constructs a T in place.
+  template <typename... Args>
+  T *New(Args&&... args) {
+    void *p = Allocate();
+    try {
+      return new (p) T(std::forward<Args>(args)...);
+    } catch (...) {
+      Deallocate(p);
+      throw;
+    }
+  }
+
+  // Destroys and frees a T from New().
+  void Delete(T *p) noexcept {
+    if (!p) return;
+    p->~T();
+    Deallocate(p);
+  }
+
+ private:
+  struct objpool *pool_;
+};
+
+} // namespace rt
@@ -0,0 +1,385 @@
+// rpc.cc - support for request-response messaging over TCP
+
+#include "rpc.h"
+
+extern "C" {
+#include <base/log.h>
+}
+
+#include <algorithm>
+#include <cstring>
+
+namespace rt {
+namespace {
+
+// How much a connection reads at once; smaller messages are batched.
+constexpr size_t kReadBufLen = 64 * 1024;
+// The most requests a server connection runs before it stops reading more.
+constexpr int kMaxInflight = 256;
+
+// Reads pipelined messages off a connection, many small ones per tcp_read().
+class MessageReader {
+ public:
+  explicit MessageReader(TcpConn *c)
+  : c_(c), buf_(new char[kReadBufLen]), head_(0), tail_(0) { }
+
+  // Reads the next header. Returns 0 if successful, -ESHUTDOWN if the peer
+  // closed the connection between messages, or < 0 on any other failure.
+  int ReadHeader(rpc_hdr *hdr) {
+    while (tail_ - head_ < sizeof(*hdr)) {
+      int ret = Fill();
+      if (ret) return ret == -ESHUTDOWN && tail_ > head_ ? -ECONNRESET : ret;
+    }
+    memcpy(hdr, buf_.get() + head_, sizeof(*hdr));
+    head_ += sizeof(*hdr);
+    if (hdr->magic != kRpcMagic || hdr->len > kRpcMaxLen) return -EPROTO;
+    return 0;
+  }
+
+  // Reads the @len byte payload that follows the last header into @dst.
+  // Returns 0 if successful, or < 0 on failure.
+  int ReadPayload(char *dst, size_t len) {
+    while (true) {
+      size_t n = std::min(len, tail_ - head_);
+      memcpy(dst, buf_.get() + head_, n);
+      head_ += n;
+      dst += n;
+      len -= n;
+      if (len == 0) return 0;
+
+      // large payloads skip the buffer
+      if (len >= kReadBufLen / 2) {
+        ssize_t ret = c_->ReadFull(dst, len);
+        if (ret == static_cast<ssize_t>(len)) return 0;
+        return ret < 0 ? ret : -ECONNRESET;
+      }
+
+      int ret = Fill();
+      if (ret) return ret == -ESHUTDOWN ? -ECONNRESET : ret;
+    }
+  }
+
+ private:
+  int Fill() {
+    if (head_ > 0) {
+      memmove(buf_.get(), buf_.get() + head_, tail_ - head_);
+      tail_ -= head_;
+      head_ = 0;
+    }
+    ssize_t ret = c_->Read(buf_.get() + tail_, kReadBufLen - tail_);
+    if (ret <= 0) return ret == 0 ? -ESHUTDOWN : ret;
+    tail_ += ret;
+    return 0;
+  }
+
+  TcpConn *c_;
+  std::unique_ptr<char[]> buf_;
+  size_t head_, tail_;
+};
+
+// Writes all of @iov, which is modified to track partial writes.
+ssize_t WritevFull(TcpConn *c, iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+
+  while (iovcnt > 0) {
+    ssize_t ret = c->Writev(iov, iovcnt);
+    if (ret < 0) return ret;
+    BUG_ON(ret == 0);
+    total += ret;
+
+    while (iovcnt > 0 && static_cast<size_t>(ret) >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (ret > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + ret;
+      iov->iov_len -= ret;
+    }
+  }
+
+  return total;
+}
+
+// Adds a message to @iov, leaving out empty payloads (tcp_writev() stops at
+// them).
+void AppendMessage(std::vector<iovec> *iov, const rpc_hdr *hdr,
+                   const void *payload) {
+  iov->push_back({const_cast<rpc_hdr *>(hdr), sizeof(*hdr)});
+  if (hdr->len > 0)
+    iov->push_back({const_cast<void *>(payload), hdr->len});
+}
+
+// The server's end of a connection.
+class ServerConn : public std::enable_shared_from_this<ServerConn> {
+ public:
+  ServerConn(TcpConn *c, std::shared_ptr<RpcHandler> handler)
+  : c_(c), handler_(std::move(handler)), inflight_(0), sending_(false),
+    err_(0) { }
+
+  // Runs requests until the client hangs up, then closes the connection once
+  // every response is sent.
+  void ReadLoop();
+
+ private:
+  struct Response {
+    uint64_t id;
+    std::string payload;
+  };
+
+  void Complete(uint64_t id, std::string &&resp);
+
+  std::unique_ptr<TcpConn> c_;
+  std::shared_ptr<RpcHandler> handler_;
+  Mutex mu_;
+  // signaled when responses are sent
+  CondVar cv_;
+  // requests read but not yet answered
+  int inflight_;
+  // whether a thread is sending; it also sends anything put in doneq_
+  bool sending_;
+  // the error sending failed with, or 0
+  int err_;
+  std::vector<Response> doneq_;
+  // the sending thread's scratch space
+  std::vector<Response> batch_;
+  std::vector<rpc_hdr> hdrs_;
+  std::vector<iovec> iov_;
+};
+
+void ServerConn::ReadLoop() {
+  MessageReader r(c_.get());
+  std::shared_ptr<ServerConn> self = shared_from_this();
+  int ret;
+
+  while (true) {
+    rpc_hdr hdr;
+    ret = r.ReadHeader(&hdr);
+    if (ret) break;
+    std::string req(hdr.len, '\0');
+    ret = r.ReadPayload(req.data(), hdr.len);
+    if (ret) break;
+
+    mu_.Lock();
+    while (inflight_ >= kMaxInflight && !err_) cv_.Wait(&mu_);
+    if (err_) {
+      mu_.Unlock();
+      break;
+    }
+    inflight_++;
+    mu_.Unlock();
+
+    Spawn([self, id = hdr.id, req = std::move(req)] {
+      std::string resp;
+      (*self->handler_)(req.data(), req.size(), &resp);
+      self->Complete(id, std::move(resp));
+    });
+  }
+
+  if (ret == -EPROTO) log_err("rpc: got an invalid request, closing");
+
+  mu_.Lock();
+  while (inflight_ > 0) cv_.Wait(&mu_);
+  mu_.Unlock();
+  c_->Shutdown(SHUT_RDWR);
+}
+
+void ServerConn::Complete(uint64_t id, std::string &&resp) {
+  mu_.Lock();
+  doneq_.push_back({id, std::move(resp)});
+  if (sending_) {
+    mu_.Unlock();
+    return;
+  }
+
+  sending_ = true;
+  while (!doneq_.empty() && !err_) {
+    batch_.swap(doneq_);
+    mu_.Unlock();
+
+    hdrs_.resize(batch_.size());
+    iov_.clear();
+    for (size_t i = 0; i < batch_.size(); i++) {
+      hdrs_[i] = {kRpcMagic, static_cast<uint32_t>(batch_[i].payload.size()),
+                  batch_[i].id};
+      AppendMessage(&iov_, &hdrs_[i], batch_[i].payload.data());
+    }
+    ssize_t ret = WritevFull(c_.get(), iov_.data(), iov_.size());
+    size_t n = batch_.size();
+    batch_.clear();
+
+    mu_.Lock();
+    if (ret < 0) err_ = ret;
+    inflight_ -= n;
+  }
+
+  // responses to a broken connection are dropped
+  inflight_ -= doneq_.size();
+  doneq_.clear();
+  sending_ = false;
+  cv_.SignalAll();
+  mu_.Unlock();
+}
+
+} // anonymous namespace
+
+RpcServer::RpcServer(TcpQueue *q, RpcHandler handler)
+: q_(q), handler_(std::make_shared<RpcHandler>(std::move(handler))) {
+  th_ = Thread([this] { AcceptLoop(); });
+}
+
+RpcServer::~RpcServer() {
+  q_->Shutdown();
+  th_.Join();
+}
+
+RpcServer *RpcServer::Listen(netaddr laddr, RpcHandler handler, int backlog) {
+  TcpQueue *q = TcpQueue::Listen(laddr, backlog);
+  if (q == nullptr) return nullptr;
+  return new RpcServer(q, std::move(handler));
+}
+
+void RpcServer::AcceptLoop() {
+  TcpConn *c;
+
+  while ((c = q_->Accept()) != nullptr) {
+    auto conn = std::make_shared<ServerConn>(c, handler_);
+    Spawn([conn] { conn->ReadLoop(); });
+  }
+}
+
+// A call waiting for its response.
+struct RpcClient::PendingCall {
+  const void *req;
+  uint32_t len;
+  uint64_t id;
+  std::string *resp;
+  bool done;
+  int ret;
+  CondVar cv;
+};
+
+RpcClient::RpcClient(TcpConn *c)
+: c_(c), next_id_(0), sending_(false), err_(0) {
+  th_ = Thread([this] { ReceiveLoop(); });
+}
+
+RpcClient::~RpcClient() {
+  c_->Shutdown(SHUT_RDWR);
+  th_.Join();
+}
+
+RpcClient *RpcClient::Dial(netaddr raddr) {
+  TcpConn *c = TcpConn::Dial({0, 0}, raddr);
+  if (c == nullptr) return nullptr;
+  return new RpcClient(c);
+}
+
+int RpcClient::Call(const void *req, size_t len, std::string *resp) {
+  if (len > kRpcMaxLen) return -EINVAL;
+
+  PendingCall call;
+  call.req = req;
+  call.len = len;
+  call.resp = resp;
+  call.done = false;
+  call.ret = 0;
+
+  mu_.Lock();
+  if (err_) {
+    int ret = err_;
+    mu_.Unlock();
+    return ret;
+  }
+  call.id = next_id_++;
+  pending_[call.id] = &call;
+  sendq_.push_back(&call);
+  if (!sending_) Send();
+
+  while (!call.done) call.cv.Wait(&mu_);
+  // a failed request may still be part of a write in progress
+  if (call.ret < 0) {
+    while (sending_) idle_.Wait(&mu_);
+  }
+  mu_.Unlock();
+  return call.ret;
+}
+
+// Sends everything in sendq_, including requests queued while sending.
+// Called, and returns, with mu_ held.
+void RpcClient::Send() {
+  sending_ = true;
+  while (!sendq_.empty() && !err_) {
+    batch_.swap(sendq_);
+    mu_.Unlock();
+
+    hdrs_.resize(batch_.size());
+    iov_.clear();
+    for (size_t i = 0; i < batch_.size(); i++) {
+      hdrs_[i] = {kRpcMagic, batch_[i]->len, batch_[i]->id};
+      AppendMessage(&iov_, &hdrs_[i], batch_[i]->req);
+    }
+    ssize_t ret = WritevFull(c_.get(), iov_.data(), iov_.size());
+    batch_.clear();
+
+    mu_.Lock();
+    if (ret < 0) Fail(ret);
+  }
+  sending_ = false;
+  idle_.SignalAll();
+}
+
+void RpcClient::ReceiveLoop() {
+  MessageReader r(c_.get());
+  int ret;
+
+  while (true) {
+    rpc_hdr hdr;
+    ret = r.ReadHeader(&hdr);
+    if (ret) break;
+
+    // once removed from pending_, the call can only be finished here
+    mu_.Lock();
+    auto it = pending_.find(hdr.id);
+    if (it == pending_.end()) {
+      mu_.Unlock();
+      ret = -EPROTO;
+      break;
+    }
+    PendingCall *call = it->second;
+    pending_.erase(it);
+    mu_.Unlock();
+
+    call->resp->resize(hdr.len);
+    ret = r.ReadPayload(call->resp->data(), hdr.len);
+
+    mu_.Lock();
+    call->ret = ret;
+    call->done = true;
+    call->cv.Signal();
+    mu_.Unlock();
+    if (ret) break;
+  }
+
+  if (ret == -EPROTO) log_err("rpc: got an invalid response, closing");
+
+  mu_.Lock();
+  Fail(ret == -ESHUTDOWN ? -ECONNRESET : ret);
+  mu_.Unlock();
+}
+
+// Fails every call in progress with @err. Called with mu_ held.
+void RpcClient::Fail(int err) {
+  if (err_) return;
+  err_ = err;
+  for (auto &p : pending_) {
+    p.second->ret = err;
+    p.second->done = true;
+    p.second->cv.Signal();
+  }
+  pending_.clear();
+  sendq_.clear();
+  c_->Shutdown(SHUT_RDWR);
+}
+
+} // namespace rt
@@ -0,0 +1,132 @@
+// rpc.h - support for request-response messaging over TCP
+//
+// Every message on the wire is an rpc_hdr followed by its payload. Requests
+// carry an id that the server echoes back in the response, so a client can
+// keep many requests outstanding on one connection (pipelining) and the
+// server can answer them in whatever order its handlers finish:
+//
+//   rt::RpcServer *s = rt::RpcServer::Listen({0, 8000},
+//       [](const char *req, size_t len, std::string *resp) {
+//         resp->assign(req, len);
+//       });
+//
+//   rt::RpcClient *c = rt::RpcClient::Dial({server_ip, 8000});
+//   std::string resp;
+//   c->Call("hello", 5, &resp);
+//
+// Each request runs its handler in its own thread, so a slow request doesn't
+// hold up the ones behind it. On both ends, whoever finds the connection idle
+// sends not just its own message but every message queued up while the last
+// write was in progress, in a single tcp_writev(). Under load, many small
+// messages share one trip through the TCP stack.
+
+#pragma once
+
+extern "C" {
+#include <base/stddef.h>
+#include <runtime/tcp.h>
+}
+#undef min
+#undef max
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "net.h"
+#include "sync.h"
+#include "thread.h"
+
+namespace rt {
+
+// The header in front of every request and response.
+struct rpc_hdr {
+  uint32_t magic;    // kRpcMagic
+  uint32_t len;      // the payload length, up to kRpcMaxLen
+  uint64_t id;       // chosen by the client, echoed by the server
+};
+
+constexpr uint32_t kRpcMagic = 0x52504321;
+constexpr uint32_t kRpcMaxLen = 16 << 20;
+
+// Handles a request of @len bytes at @req by filling in @resp, which starts
+// out empty. Runs in its own thread and may block.
+using RpcHandler =
+    std::function<void(const char *req, size_t len, std::string *resp)>;
+
+// Serves RPCs on every connection to a local address.
+class RpcServer {
+ public:
+  // Stops accepting connections; the ones already open keep being served
+  // until their clients hang up.
+  ~RpcServer();
+
+  // Starts serving RPCs on @laddr with @handler. Returns nullptr on failure.
+  static RpcServer *Listen(netaddr laddr, RpcHandler handler,
+                           int backlog = 4096);
+
+ private:
+  RpcServer(TcpQueue *q, RpcHandler handler);
+
+  void AcceptLoop();
+
+  // disable move and copy.
+  RpcServer(const RpcServer&) = delete;
+  RpcServer& operator=(const RpcServer&) = delete;
+
+  std::unique_ptr<TcpQueue> q_;
+  std::shared_ptr<RpcHandler> handler_;
+  Thread th_;
+};
+
+// Makes RPCs over a single connection.
+class RpcClient {
+ public:
+  // Closes the connection. There must be no calls in progress.
+  ~RpcClient();
+
+  // Connects to the server at @raddr. Returns nullptr on failure.
+  static RpcClient *Dial(netaddr raddr);
+
+  // Sends the @len byte request at @req and blocks until @resp holds the
+  // response. Can be called from many threads at once; their requests are
+  // pipelined and batched. Returns 0 if successful, or < 0 if the request is
+  // too large or the connection failed, after which every call fails.
+  int Call(const void *req, size_t len, std::string *resp);
+
+ private:
+  struct PendingCall;
+
+  explicit RpcClient(TcpConn *c);
+
+  void Send();
+  void ReceiveLoop();
+  void Fail(int err);
+
+  // disable move and copy.
+  RpcClient(const RpcClient&) = delete;
+  RpcClient& operator=(const RpcClient&) = delete;
+
+  std::unique_ptr<TcpConn> c_;
+  Mutex mu_;
+  // signaled when a send finishes
+  CondVar idle_;
+  uint64_t next_id_;
+  // whether a thread is sending; it also sends anything put in sendq_
+  bool sending_;
+  // the error the connection failed with, or 0
+  int err_;
+  std::vector<PendingCall *> sendq_;
+  // calls waiting for a response, by id
+  std::unordered_map<uint64_t, PendingCall *> pending_;
+  // the sending thread's scratch space
+  std::vector<PendingCall *> batch_;
+  std::vector<rpc_hdr> hdrs_;
+  std::vector<iovec> iov_;
+  Thread th_;
+};
+
+} // namespace rt
@@ -0,0 +1,65 @@
+// smalloc.h - support for allocating C++ objects with smalloc()
+
+#pragma once
+
+extern "C" {
+#include <runtime/smalloc.h>
+}
+
+#include <cstddef>
+#include <new>
+
+namespace rt {
+
+// A base class that allocates derived objects with smalloc(). Deletes pass
+// the object size back with sfree_sized(), which skips the slab page lookup.
+// Objects must be created and destroyed from runtime threads.
+class SmallocObject {
+ public:
+  static void *operator new(size_t size) {
+    void *p = smalloc(size);
+    if (unlikely(!p)) throw std::bad_alloc();
+    return p;
+  }
+  static void *operator new[](size_t size) {
+    return operator new(size);
+  }
+  static void operator delete(void *p, size_t size) noexcept {
+    if (p) sfree_sized(p, size);
+  }
+  static void operator delete[](void *p, size_t size) noexcept {
+    if (p) sfree_sized(p, size);
+  }
+};
+
+// An STL allocator backed by smalloc(), e.g. for std::vector or std::map.
+template <typename T>
+class SmallocAllocator {
+ public:
+  typedef T value_type;
+
+  SmallocAllocator() noexcept {}
+  template <typename U>
+  SmallocAllocator(const SmallocAllocator<U>&) noexcept {}
+
+  T *allocate(size_t n) {
+    void *p = smalloc_array(n, sizeof(T));
+    if (unlikely(!p)) throw std::bad_alloc();
+    return static_cast<T *>(p);
+  }
+  void deallocate(T *p, size_t n) noexcept {
+    sfree_sized(p, n * sizeof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const SmallocAllocator<T>&, const SmallocAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const SmallocAllocator<T>&, const SmallocAllocator<U>&) {
+  return false;
+}
+
+} // namespace rt
@@ -5,6 +5,7 @@
 extern "C" {
 #include <base/stddef.h>
 #include <base/lock.h>
+#include <runtime/chan.h>
 #include <runtime/sync.h>
 }
 
@@ -83,9 +84,19 @@ class CondVar {
   // after wakeup, as no guarantees are made about preventing spurious wakeups.
   void Wait(Mutex *mu) { condvar_wait(&cv_, &mu->mu_); }
 
+  // Like Wait(), but gives up after @timeout_us microseconds. Returns true if
+  // the condition variable was signaled, or false if the timeout expired.
+  bool WaitFor(Mutex *mu, uint64_t timeout_us) {
+    return condvar_wait_timeout(&cv_, &mu->mu_, timeout_us);
+  }
+
   // Wake up one waiter.
   void Signal() { condvar_signal(&cv_); }
 
+  // Wake up one waiter and run it right away on this core. Call it after
+  // unlocking the mutex.
+  void SignalYield() { condvar_signal_yield(&cv_); }
+
   // Wake up all waiters.
   void SignalAll() { condvar_broadcast(&cv_); }
 
@@ -126,4 +137,54 @@ class WaitGroup {
   WaitGroup& operator=(const WaitGroup&) = delete;
 };
 
+
+// Golang-like channel support, passing pointers to T between threads.
+template<typename T> class Channel {
+ public:
+  ~Channel() { chan_destroy(ch_); }
+
+  // Creates a channel that holds @cap messages. With @unbounded, messages past
+  // @cap are kept in an overflow list instead of blocking senders. Returns
+  // nullptr on failure.
+  static Channel *Create(unsigned int cap, bool unbounded = false) {
+    chan_t *ch;
+    int ret = chan_create(&ch, cap, unbounded ? CHAN_UNBOUNDED : 0);
+    if (ret) return nullptr;
+    return new Channel(ch);
+  }
+
+  // Sends a message, blocking while the channel is full. Returns false if the
+  // channel is closed.
+  bool Send(T *msg) { return chan_send(ch_, msg) == 0; }
+
+  // Sends a message only if there is room. Returns true if successful.
+  bool TrySend(T *msg) { return chan_try_send(ch_, msg) == 0; }
+
+  // Receives a message, blocking while the channel is empty. Returns nullptr
+  // once the channel is closed and empty.
+  T *Recv() {
+    void *msg;
+    if (chan_recv(ch_, &msg)) return nullptr;
+    return static_cast<T *>(msg);
+  }
+
+  // Receives a message only if one is waiting. Returns nullptr otherwise.
+  T *TryRecv() {
+    void *msg;
+    if (chan_try_recv(ch_, &msg)) return nullptr;
+    return static_cast<T *>(msg);
+  }
+
+  // Closes the channel, waking all blocked senders and receivers.
+  void Close() { chan_close(ch_); }
+
+ private:
+  explicit Channel(chan_t *ch) : ch_(ch) {}
+
+  chan_t *ch_;
+
+  Channel(const Channel&) = delete;
+  Channel& operator=(const Channel&) = delete;
+};
+
 } // namespace rt
@@ -4,6 +4,9 @@ extern "C" {
 }
 
 #include <string>
+#include "coro.h"
+#include "objpool.h"
+#include "sync.h"
 #include "thread.h"
 #include "timer.h"
 
@@ -15,6 +18,20 @@ void foo(int arg) {
   if (arg != kTestValue) BUG();
 }
 
+rt::Task<int> Twice(rt::Executor *e, int arg) {
+  co_await e->Yield();
+  co_return arg * 2;
+}
+
+rt::Task<void> CoroTest(rt::Executor *e, rt::WaitGroup *wg) {
+  uint64_t start = rt::MicroTime();
+  co_await rt::SleepAsync(1 * rt::kMilliseconds);
+  if (rt::MicroTime() - start < 1 * rt::kMilliseconds) BUG();
+  if (co_await Twice(e, kTestValue) != kTestValue * 2) BUG();
+  log_info("hello from a coroutine!");
+  wg->Done();
+}
+
 void MainHandler(void *arg) {
   std::string str = "captured!";
   int i = kTestValue;
@@ -41,6 +58,16 @@ void MainHandler(void *arg) {
     foo(i);
   });
   th.Join();
+
+  rt::ObjectPool<std::string> pool("test strings");
+  std::string *s = pool.New(str);
+  if (*s != str) BUG();
+  pool.Delete(s);
+
+  rt::Executor e;
+  rt::WaitGroup wg(1);
+  e.Spawn(CoroTest(&e, &wg));
+  wg.Wait();
 }
 
 } // anonymous namespace
@@ -3,11 +3,6 @@
 namespace rt {
 namespace thread_internal {
 
-// A helper to jump from a C function to a C++ std::function.
-void ThreadTrampoline(void *arg) {
-  (*static_cast<std::function<void()>*>(arg))();
-}
-
 // A helper to jump from a C function to a C++ std::function. This variant
 // can wait for the thread to be joined.
 void ThreadTrampolineWithJoin(void *arg) {
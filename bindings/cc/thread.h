@@ -7,7 +7,10 @@ extern "C" {
 #include <runtime/sync.h>
 }
 
+#include <cstddef>
 #include <functional>
+#include <type_traits>
+#include <utility>
 
 #include "macros.h"
 
@@ -31,28 +34,30 @@ struct join_data {
   std::function<void()>	func_;
 };
 
-extern void ThreadTrampoline(void *arg);
+// A helper to call a callable stored in a thread's stack buffer.
+template <typename F>
+void InlineTrampoline(void *arg) {
+  F *f = static_cast<F*>(arg);
+  (*f)();
+  f->~F();
+}
+
 extern void ThreadTrampolineWithJoin(void *arg);
 
 } // namespace thread_internal
 
-// Spawns a new thread by copying.
-static inline void Spawn(const std::function<void()>& func) {
-  void *buf;
-  thread_t *th = thread_create_with_buf(thread_internal::ThreadTrampoline, &buf,
-					sizeof(std::function<void()>));
-  if (unlikely(!th)) BUG();
-  new(buf) std::function<void()>(func);
-  thread_ready(th);
-}
-
-// Spawns a new thread by moving.
-static inline void Spawn(std::function<void()>&& func) {
+// Spawns a new thread that runs @func. The callable is copied or moved into
+// the new thread's stack, so there's no type erasure or heap allocation.
+template <typename F>
+static inline void Spawn(F&& func) {
+  using Fn = typename std::decay<F>::type;
+  static_assert(alignof(Fn) <= alignof(std::max_align_t),
+                "the stack buffer isn't aligned enough for this callable");
   void *buf;
-  thread_t *th = thread_create_with_buf(thread_internal::ThreadTrampoline, &buf,
-					sizeof(std::function<void()>));
+  thread_t *th = thread_create_with_buf(thread_internal::InlineTrampoline<Fn>,
+                                        &buf, sizeof(Fn));
   if (unlikely(!th)) BUG();
-  new(buf) std::function<void()>(std::move(func));
+  new(buf) Fn(std::forward<F>(func));
   thread_ready(th);
 }
 
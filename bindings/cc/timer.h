@@ -17,6 +17,11 @@ static inline uint64_t MicroTime() {
   return microtime();
 }
 
+// Gets the current number of nanoseconds since the launch of the runtime.
+static inline uint64_t NanoTime() {
+  return nanotime();
+}
+
 // Busy-spins for a microsecond duration.
 static inline void Delay(uint64_t us) {
   delay_us(us);
@@ -32,4 +37,14 @@ static inline void Sleep(uint64_t duration_us) {
   timer_sleep(duration_us);
 }
 
+// Sleeps until a nanosecond deadline.
+static inline void SleepUntilNs(uint64_t deadline_ns) {
+  timer_sleep_until_ns(deadline_ns);
+}
+
+// Sleeps for a nanosecond duration.
+static inline void SleepNs(uint64_t duration_ns) {
+  timer_sleep_ns(duration_ns);
+}
+
 } // namespace rt
@@ -8,6 +8,8 @@
 #include <base/slab.h>
 #include <base/tcache.h>
 
+#include <runtime/chan.h>
+#include <runtime/poll.h>
 #include <runtime/preempt.h>
 #include <runtime/smalloc.h>
 #include <runtime/sync.h>
@@ -0,0 +1,598 @@
+//! A single-threaded executor for futures.
+//!
+//! An `Executor` polls futures on the uthread that calls `run()`. Between
+//! polls, that thread sleeps on a poll waiter (see runtime/poll.h), which
+//! collects readiness events from the async sockets registered with it and
+//! wakeups from wakers, so one uthread can multiplex many connections. Waking
+//! a task queues it and readies the executor's thread, from any thread or
+//! timer handler.
+
+use std::cell::UnsafeCell;
+use std::future::Future;
+use std::io;
+use std::mem::{self, ManuallyDrop};
+use std::os::raw::{c_int, c_ulong};
+use std::pin::Pin;
+use std::ptr;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::task::{Context, Poll, RawWaker, RawWakerVTable, Waker};
+use std::time::Duration;
+
+use super::*;
+
+pub(crate) const POLL_IN: u32 = 1 << 0;
+pub(crate) const POLL_OUT: u32 = 1 << 1;
+
+const EAGAIN: isize = 11;
+
+/// The most readiness events handled between polls of queued tasks.
+const EVENT_BATCH: usize = 16;
+
+/// A spawned future.
+struct Task {
+    future: UnsafeCell<Option<Pin<Box<dyn Future<Output = ()> + Send>>>>,
+    queued: AtomicBool,
+    next: UnsafeCell<*const Task>, // protected by the executor's lock
+    exec: Arc<Inner>,
+}
+// The future is only touched on the executor's thread.
+unsafe impl Send for Task {}
+unsafe impl Sync for Task {}
+
+impl Task {
+    /// Queues the task on its executor, unless it is already queued.
+    fn schedule(task: Arc<Task>) {
+        if task.queued.swap(true, Ordering::AcqRel) {
+            return;
+        }
+        let exec = task.exec.clone();
+        exec.push(task);
+    }
+
+    fn run(task: Arc<Task>) {
+        task.queued.store(false, Ordering::Release);
+        let future = unsafe { &mut *task.future.get() };
+        let done = match future.as_mut() {
+            Some(f) => {
+                let waker = task_waker(task.clone());
+                let mut cx = Context::from_waker(&waker);
+                f.as_mut().poll(&mut cx).is_ready()
+            }
+            None => false,
+        };
+        if done {
+            *future = None;
+        }
+    }
+}
+
+unsafe fn task_clone(p: *const ()) -> RawWaker {
+    let task = ManuallyDrop::new(Arc::from_raw(p as *const Task));
+    mem::forget(Arc::clone(&task));
+    RawWaker::new(p, &TASK_WAKER_VTABLE)
+}
+
+unsafe fn task_wake(p: *const ()) {
+    Task::schedule(Arc::from_raw(p as *const Task));
+}
+
+unsafe fn task_wake_by_ref(p: *const ()) {
+    let task = ManuallyDrop::new(Arc::from_raw(p as *const Task));
+    Task::schedule(Arc::clone(&task));
+}
+
+unsafe fn task_drop(p: *const ()) {
+    drop(Arc::from_raw(p as *const Task));
+}
+
+static TASK_WAKER_VTABLE: RawWakerVTable =
+    RawWakerVTable::new(task_clone, task_wake, task_wake_by_ref, task_drop);
+
+fn task_waker(task: Arc<Task>) -> Waker {
+    let raw = RawWaker::new(Arc::into_raw(task) as *const (), &TASK_WAKER_VTABLE);
+    unsafe { Waker::from_raw(raw) }
+}
+
+// The future passed to run() isn't a task, its waker just sets a flag.
+unsafe fn main_clone(p: *const ()) -> RawWaker {
+    let inner = ManuallyDrop::new(Arc::from_raw(p as *const Inner));
+    mem::forget(Arc::clone(&inner));
+    RawWaker::new(p, &MAIN_WAKER_VTABLE)
+}
+
+unsafe fn main_wake(p: *const ()) {
+    main_wake_by_ref(p);
+    main_drop(p);
+}
+
+unsafe fn main_wake_by_ref(p: *const ()) {
+    let inner = &*(p as *const Inner);
+    inner.main_woken.store(true, Ordering::Release);
+    inner.poke();
+}
+
+unsafe fn main_drop(p: *const ()) {
+    drop(Arc::from_raw(p as *const Inner));
+}
+
+static MAIN_WAKER_VTABLE: RawWakerVTable =
+    RawWakerVTable::new(main_clone, main_wake, main_wake_by_ref, main_drop);
+
+struct Inner {
+    waiter: UnsafeCell<ffi::poll_waiter>,
+    wake_trigger: UnsafeCell<ffi::poll_trigger>,
+    main_woken: AtomicBool,
+
+    // protected by @lock
+    lock: SpinLock,
+    head: UnsafeCell<*const Task>,
+    tail: UnsafeCell<*const Task>,
+    graveyard: UnsafeCell<Vec<*const IoState>>,
+}
+unsafe impl Send for Inner {}
+unsafe impl Sync for Inner {}
+
+impl Inner {
+    fn new() -> Arc<Inner> {
+        let inner = Arc::new(Inner {
+            waiter: UnsafeCell::new(unsafe { mem::zeroed() }),
+            wake_trigger: UnsafeCell::new(unsafe { mem::zeroed() }),
+            main_woken: AtomicBool::new(false),
+            lock: SpinLock::new(),
+            head: UnsafeCell::new(ptr::null()),
+            tail: UnsafeCell::new(ptr::null()),
+            graveyard: UnsafeCell::new(Vec::new()),
+        });
+        unsafe {
+            ffi::poll_init(inner.waiter.get());
+            ffi::poll_trigger_init(inner.wake_trigger.get());
+            // wakeups are reported with no data
+            ffi::poll_arm(inner.wake_trigger.get(), inner.waiter.get(), 0);
+        }
+        inner
+    }
+
+    /// Makes the executor's thread return from poll_wait().
+    fn poke(&self) {
+        unsafe { ffi::__poll_set(self.wake_trigger.get(), POLL_IN) }
+    }
+
+    fn push(&self, task: Arc<Task>) {
+        let p = Arc::into_raw(task);
+        self.lock.lock_np();
+        unsafe {
+            *(*p).next.get() = ptr::null();
+            let tail = *self.tail.get();
+            if tail.is_null() {
+                *self.head.get() = p;
+            } else {
+                *(*tail).next.get() = p;
+            }
+            *self.tail.get() = p;
+        }
+        self.lock.unlock_np();
+        self.poke();
+    }
+
+    /// Takes every queued task, returns the first one.
+    fn take_all(&self) -> *const Task {
+        self.lock.lock_np();
+        let head = unsafe { *self.head.get() };
+        unsafe {
+            *self.head.get() = ptr::null();
+            *self.tail.get() = ptr::null();
+        }
+        self.lock.unlock_np();
+        head
+    }
+
+    fn has_queued(&self) -> bool {
+        unsafe { !ptr::read_volatile(self.head.get()).is_null() }
+    }
+
+    /// Runs every task that was queued when called.
+    fn run_queued(&self) {
+        let mut p = self.take_all();
+        while !p.is_null() {
+            let task = unsafe { Arc::from_raw(p) };
+            // running the task may queue it again
+            p = unsafe { *task.next.get() };
+            Task::run(task);
+        }
+    }
+
+    /// Drops the queued tasks without running them.
+    fn drop_queued(&self) {
+        let mut p = self.take_all();
+        while !p.is_null() {
+            let task = unsafe { Arc::from_raw(p) };
+            p = unsafe { *task.next.get() };
+            task.queued.store(false, Ordering::Release);
+            unsafe { *task.future.get() = None };
+        }
+    }
+
+    /// Frees the state of sockets unregistered since the last call.
+    fn bury(&self) {
+        self.lock.lock_np();
+        let dead = mem::replace(unsafe { &mut *self.graveyard.get() }, Vec::new());
+        self.lock.unlock_np();
+        for p in dead {
+            drop(unsafe { Arc::from_raw(p) });
+        }
+    }
+}
+
+/// Runs futures on a single uthread.
+pub struct Executor {
+    inner: Arc<Inner>,
+}
+
+impl Executor {
+    pub fn new() -> Self {
+        Executor { inner: Inner::new() }
+    }
+
+    /// Gets a handle for spawning tasks and creating async sockets.
+    pub fn handle(&self) -> Handle {
+        Handle {
+            inner: self.inner.clone(),
+        }
+    }
+
+    /// Runs `f` and the spawned tasks on the calling thread until `f`
+    /// completes, and returns its output. Unfinished tasks resume the next
+    /// time the executor runs.
+    pub fn run<F: Future>(&self, f: F) -> F::Output {
+        let inner = &self.inner;
+        let mut f = f;
+        let mut f = unsafe { Pin::new_unchecked(&mut f) };
+        let raw = RawWaker::new(
+            Arc::into_raw(inner.clone()) as *const (),
+            &MAIN_WAKER_VTABLE,
+        );
+        let waker = unsafe { Waker::from_raw(raw) };
+        let mut cx = Context::from_waker(&waker);
+        let mut evs: [ffi::poll_event; EVENT_BATCH] = unsafe { mem::zeroed() };
+
+        inner.main_woken.store(true, Ordering::Release);
+        loop {
+            if inner.main_woken.swap(false, Ordering::AcqRel) {
+                if let Poll::Ready(v) = f.as_mut().poll(&mut cx) {
+                    inner.bury();
+                    return v;
+                }
+            }
+
+            inner.run_queued();
+            if inner.main_woken.load(Ordering::Acquire) || inner.has_queued() {
+                continue;
+            }
+
+            // wakeups and socket events both end the wait
+            let n = unsafe {
+                ffi::poll_wait(inner.waiter.get(), evs.as_mut_ptr(), EVENT_BATCH as c_int)
+            };
+            for ev in &evs[..n.max(0) as usize] {
+                if ev.data != 0 {
+                    unsafe { (&*(ev.data as *const IoState)).notify(ev.events) };
+                }
+            }
+            inner.bury();
+        }
+    }
+}
+
+impl Drop for Executor {
+    /// Drops the queued tasks. Tasks that are waiting for a wakeup are leaked.
+    fn drop(&mut self) {
+        self.inner.drop_queued();
+        self.inner.bury();
+        unsafe { ffi::poll_disarm(self.inner.wake_trigger.get()) };
+    }
+}
+
+/// A handle to an executor, which can be sent to other threads.
+#[derive(Clone)]
+pub struct Handle {
+    inner: Arc<Inner>,
+}
+
+impl Handle {
+    /// Starts running `f` on the executor.
+    pub fn spawn<F>(&self, f: F)
+    where
+        F: Future<Output = ()> + Send + 'static,
+    {
+        let task = Arc::new(Task {
+            future: UnsafeCell::new(Some(Box::pin(f))),
+            queued: AtomicBool::new(false),
+            next: UnsafeCell::new(ptr::null()),
+            exec: self.inner.clone(),
+        });
+        Task::schedule(task);
+    }
+}
+
+/// Waits for readiness in one direction of a socket.
+struct IoSlot {
+    lock: SpinLock,
+    waker: UnsafeCell<Option<Waker>>,
+    ready: UnsafeCell<bool>,
+}
+
+unsafe impl Send for IoSlot {}
+unsafe impl Sync for IoSlot {}
+
+impl IoSlot {
+    fn new() -> Self {
+        IoSlot {
+            lock: SpinLock::new(),
+            waker: UnsafeCell::new(None),
+            ready: UnsafeCell::new(false),
+        }
+    }
+
+    /// Forgets readiness reported before the caller's next attempt.
+    fn clear(&self) {
+        self.lock.lock_np();
+        unsafe { *self.ready.get() = false };
+        self.lock.unlock_np();
+    }
+
+    /// Saves a waker, unless readiness was reported since clear(). Returns
+    /// false if the caller should try again instead of waiting.
+    fn park(&self, waker: &Waker) -> bool {
+        self.lock.lock_np();
+        if unsafe { *self.ready.get() } {
+            self.lock.unlock_np();
+            return false;
+        }
+        let slot = unsafe { &mut *self.waker.get() };
+        if !slot.as_ref().map_or(false, |w| w.will_wake(waker)) {
+            *slot = Some(waker.clone());
+        }
+        self.lock.unlock_np();
+        true
+    }
+
+    fn notify(&self) {
+        self.lock.lock_np();
+        unsafe { *self.ready.get() = true };
+        let waker = unsafe { (*self.waker.get()).take() };
+        self.lock.unlock_np();
+        if let Some(w) = waker {
+            w.wake();
+        }
+    }
+}
+
+/// The readiness of a socket registered with an executor.
+pub(crate) struct IoState {
+    rx: IoSlot,
+    tx: IoSlot,
+}
+
+impl IoState {
+    fn notify(&self, events: u32) {
+        if events & POLL_IN != 0 {
+            self.rx.notify();
+        }
+        if events & POLL_OUT != 0 {
+            self.tx.notify();
+        }
+    }
+}
+
+/// Ties a nonblocking socket to an executor.
+pub(crate) struct Registration {
+    state: Arc<IoState>,
+    exec: Arc<Inner>,
+}
+
+impl Registration {
+    /// The socket must then be registered with `waiter()` and `data()`.
+    pub(crate) fn new(handle: &Handle) -> Self {
+        Registration {
+            state: Arc::new(IoState {
+                rx: IoSlot::new(),
+                tx: IoSlot::new(),
+            }),
+            exec: handle.inner.clone(),
+        }
+    }
+
+    /// Gets a handle to the executor.
+    pub(crate) fn handle(&self) -> Handle {
+        Handle {
+            inner: self.exec.clone(),
+        }
+    }
+
+    pub(crate) fn waiter(&self) -> *mut ffi::poll_waiter {
+        self.exec.waiter.get()
+    }
+
+    /// The value to report with events, which holds a reference to the
+    /// state until the registration is dropped. Call it once.
+    pub(crate) fn data(&self) -> c_ulong {
+        Arc::into_raw(self.state.clone()) as c_ulong
+    }
+
+    fn poll_io<F>(&self, slot: &IoSlot, cx: &mut Context, mut op: F) -> Poll<io::Result<usize>>
+    where
+        F: FnMut() -> isize,
+    {
+        loop {
+            slot.clear();
+            let ret = op();
+            if ret != -EAGAIN {
+                return Poll::Ready(if ret >= 0 {
+                    Ok(ret as usize)
+                } else {
+                    Err(io::Error::from_raw_os_error(-ret as i32))
+                });
+            }
+            if slot.park(cx.waker()) {
+                return Poll::Pending;
+            }
+        }
+    }
+
+    /// Tries a read-side operation, or waits for the socket to be readable.
+    pub(crate) fn poll_read<F>(&self, cx: &mut Context, op: F) -> Poll<io::Result<usize>>
+    where
+        F: FnMut() -> isize,
+    {
+        self.poll_io(&self.state.rx, cx, op)
+    }
+
+    /// Tries a write-side operation, or waits for the socket to be writable.
+    pub(crate) fn poll_write<F>(&self, cx: &mut Context, op: F) -> Poll<io::Result<usize>>
+    where
+        F: FnMut() -> isize,
+    {
+        self.poll_io(&self.state.tx, cx, op)
+    }
+}
+
+impl Drop for Registration {
+    /// The socket must be unregistered first. Events for it may still be in
+    /// the executor's current batch, so the reference from `data()` is
+    /// dropped after the batch.
+    fn drop(&mut self) {
+        let p = &*self.state as *const IoState;
+        self.exec.lock.lock_np();
+        unsafe { (*self.exec.graveyard.get()).push(p) };
+        self.exec.lock.unlock_np();
+    }
+}
+
+/// A future created from a closure.
+pub struct PollFn<F> {
+    f: F,
+}
+
+impl<F> Unpin for PollFn<F> {}
+
+/// Creates a future that calls `f` each time it's polled.
+pub fn poll_fn<T, F>(f: F) -> PollFn<F>
+where
+    F: FnMut(&mut Context) -> Poll<T>,
+{
+    PollFn { f }
+}
+
+impl<T, F> Future for PollFn<F>
+where
+    F: FnMut(&mut Context) -> Poll<T>,
+{
+    type Output = T;
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context) -> Poll<T> {
+        (&mut self.f)(cx)
+    }
+}
+
+/// A yield point: the first poll wakes the task again and returns Pending.
+pub fn yield_now() -> impl Future<Output = ()> {
+    let mut yielded = false;
+    poll_fn(move |cx| {
+        if yielded {
+            return Poll::Ready(());
+        }
+        yielded = true;
+        cx.waker().wake_by_ref();
+        Poll::Pending
+    })
+}
+
+struct SleepState {
+    timer: UnsafeCell<ffi::timer_entry>,
+    lock: SpinLock,
+    waker: UnsafeCell<Option<Waker>>,
+    fired: AtomicBool,
+    done: AtomicBool, // the timer handler has returned
+}
+unsafe impl Send for SleepState {}
+unsafe impl Sync for SleepState {}
+
+extern "C" fn sleep_expired(arg: c_ulong) {
+    let s = unsafe { &*(arg as *const SleepState) };
+    // preemption is already disabled
+    s.lock.lock();
+    s.fired.store(true, Ordering::Release);
+    if let Some(w) = unsafe { (*s.waker.get()).as_ref() } {
+        w.wake_by_ref();
+    }
+    s.lock.unlock();
+    s.done.store(true, Ordering::Release);
+}
+
+/// A future that completes at a deadline, see `sleep()`.
+pub struct Sleep {
+    deadline_us: u64,
+    state: Option<Box<SleepState>>,
+}
+
+/// Creates a future that completes after `duration`.
+pub fn sleep(duration: Duration) -> Sleep {
+    let us = duration.as_secs() * 1000_000 + duration.subsec_nanos() as u64 / 1000;
+    sleep_until(microtime() + us)
+}
+
+/// Creates a future that completes at a deadline in microseconds (see
+/// `microtime()`).
+pub fn sleep_until(deadline_us: u64) -> Sleep {
+    Sleep {
+        deadline_us,
+        state: None,
+    }
+}
+
+impl Future for Sleep {
+    type Output = ();
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context) -> Poll<()> {
+        if let Some(ref s) = self.state {
+            s.lock.lock_np();
+            let fired = s.fired.load(Ordering::Acquire);
+            if !fired {
+                unsafe { *s.waker.get() = Some(cx.waker().clone()) };
+            }
+            s.lock.unlock_np();
+            return if fired { Poll::Ready(()) } else { Poll::Pending };
+        }
+
+        if microtime() >= self.deadline_us {
+            return Poll::Ready(());
+        }
+        let s = Box::new(SleepState {
+            timer: UnsafeCell::new(unsafe { mem::zeroed() }),
+            lock: SpinLock::new(),
+            waker: UnsafeCell::new(Some(cx.waker().clone())),
+            fired: AtomicBool::new(false),
+            done: AtomicBool::new(false),
+        });
+        unsafe {
+            let t = &mut *s.timer.get();
+            t.fn_ = Some(sleep_expired);
+            t.arg = &*s as *const SleepState as c_ulong;
+            ffi::timer_start(t, self.deadline_us);
+        }
+        self.state = Some(s);
+        Poll::Pending
+    }
+}
+
+impl Drop for Sleep {
+    fn drop(&mut self) {
+        if let Some(ref s) = self.state {
+            // wait for a handler that's already running to let go
+            if !unsafe { ffi::timer_cancel(s.timer.get()) } {
+                while !s.done.load(Ordering::Acquire) {
+                    cpu_relax();
+                }
+            }
+        }
+    }
+}
@@ -9,8 +9,10 @@ extern crate byteorder;
 
 use std::cell::UnsafeCell;
 use std::ffi::CString;
+use std::marker::PhantomData;
 use std::mem;
 use std::os::raw::{c_int, c_void};
+use std::ptr;
 use std::sync::Arc;
 use std::sync::atomic::{AtomicI32, Ordering};
 use std::time::Duration;
@@ -20,6 +22,7 @@ pub mod ffi {
 }
 
 mod asm;
+pub mod executor;
 pub mod tcp;
 pub mod thread;
 pub mod udp;
@@ -69,7 +72,7 @@ pub fn delay_us(microseconds: u64) {
 
 #[inline]
 pub fn microtime() -> u64 {
-    unsafe { (rdtsc() - ffi::start_tsc as u64) / ffi::cycles_per_us as u64 }
+    unsafe { ffi::__microtime() }
 }
 
 pub fn sleep(duration: Duration) {
@@ -171,6 +174,137 @@ impl SpinLock {
 unsafe impl Send for SpinLock {}
 unsafe impl Sync for SpinLock {}
 
+pub struct Mutex {
+    inner: Box<UnsafeCell<ffi::mutex>>,
+}
+impl Mutex {
+    pub fn new() -> Self {
+        let inner = Box::new(UnsafeCell::new(unsafe { std::mem::uninitialized() }));
+        unsafe { ffi::mutex_init(inner.get()) };
+        Self { inner }
+    }
+    fn as_raw(&self) -> *mut ffi::mutex {
+        self.inner.get()
+    }
+    pub fn lock(&self) {
+        unsafe { ffi::mutex_lock(self.as_raw()) }
+    }
+    pub fn try_lock(&self) -> bool {
+        unsafe { ffi::mutex_try_lock(self.as_raw()) }
+    }
+    pub fn unlock(&self) {
+        unsafe { ffi::mutex_unlock(self.as_raw()) }
+    }
+}
+unsafe impl Send for Mutex {}
+unsafe impl Sync for Mutex {}
+
+pub struct CondVar {
+    inner: Box<UnsafeCell<ffi::condvar>>,
+}
+impl CondVar {
+    pub fn new() -> Self {
+        let inner = Box::new(UnsafeCell::new(unsafe { std::mem::uninitialized() }));
+        unsafe { ffi::condvar_init(inner.get()) };
+        Self { inner }
+    }
+    /// Blocks until signaled; `mutex` must be held and is held again on return.
+    pub fn wait(&self, mutex: &Mutex) {
+        unsafe { ffi::condvar_wait(self.inner.get(), mutex.as_raw()) }
+    }
+    /// Like `wait`, but gives up after `timeout`. Returns false if it expired.
+    pub fn wait_timeout(&self, mutex: &Mutex, timeout: Duration) -> bool {
+        let us = timeout.as_secs() * 1000_000 + timeout.subsec_nanos() as u64 / 1000;
+        unsafe { ffi::condvar_wait_timeout(self.inner.get(), mutex.as_raw(), us) }
+    }
+    pub fn signal(&self) {
+        unsafe { ffi::condvar_signal(self.inner.get()) }
+    }
+    pub fn signal_all(&self) {
+        unsafe { ffi::condvar_broadcast(self.inner.get()) }
+    }
+}
+unsafe impl Send for CondVar {}
+unsafe impl Sync for CondVar {}
+
+/// A Go-like channel that passes values of `T` between threads.
+pub struct Channel<T: Send> {
+    inner: *mut ffi::chan_t,
+    _marker: PhantomData<T>,
+}
+impl<T: Send> Channel<T> {
+    /// Creates a channel that holds `cap` values. With `unbounded`, values past
+    /// `cap` are kept in an overflow list instead of blocking senders.
+    pub fn new(cap: u32, unbounded: bool) -> Result<Self, i32> {
+        let mut inner = ptr::null_mut();
+        let flags = if unbounded { ffi::CHAN_UNBOUNDED } else { 0 };
+        convert_error(unsafe { ffi::chan_create(&mut inner, cap, flags) })?;
+        Ok(Self {
+            inner,
+            _marker: PhantomData,
+        })
+    }
+    fn send_with(&self, value: T, blocking: bool) -> Result<(), T> {
+        let msg = Box::into_raw(Box::new(value)) as *mut c_void;
+        let ret = unsafe {
+            if blocking {
+                ffi::chan_send(self.inner, msg)
+            } else {
+                ffi::chan_try_send(self.inner, msg)
+            }
+        };
+        if ret == 0 {
+            Ok(())
+        } else {
+            Err(*unsafe { Box::from_raw(msg as *mut T) })
+        }
+    }
+    fn recv_with(&self, blocking: bool) -> Option<T> {
+        let mut msg = ptr::null_mut();
+        let ret = unsafe {
+            if blocking {
+                ffi::chan_recv(self.inner, &mut msg)
+            } else {
+                ffi::chan_try_recv(self.inner, &mut msg)
+            }
+        };
+        if ret != 0 {
+            return None;
+        }
+        Some(*unsafe { Box::from_raw(msg as *mut T) })
+    }
+    /// Sends a value, blocking while the channel is full. Gives the value back
+    /// if the channel is closed.
+    pub fn send(&self, value: T) -> Result<(), T> {
+        self.send_with(value, true)
+    }
+    /// Sends a value only if there is room. Gives the value back otherwise.
+    pub fn try_send(&self, value: T) -> Result<(), T> {
+        self.send_with(value, false)
+    }
+    /// Receives a value, blocking while the channel is empty. Returns `None`
+    /// once the channel is closed and empty.
+    pub fn recv(&self) -> Option<T> {
+        self.recv_with(true)
+    }
+    /// Receives a value only if one is waiting.
+    pub fn try_recv(&self) -> Option<T> {
+        self.recv_with(false)
+    }
+    /// Closes the channel, waking all blocked senders and receivers.
+    pub fn close(&self) {
+        unsafe { ffi::chan_close(self.inner) }
+    }
+}
+impl<T: Send> Drop for Channel<T> {
+    fn drop(&mut self) {
+        while self.try_recv().is_some() {}
+        unsafe { ffi::chan_destroy(self.inner) }
+    }
+}
+unsafe impl<T: Send> Send for Channel<T> {}
+unsafe impl<T: Send> Sync for Channel<T> {}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -1,6 +1,11 @@
-use std::io::{self, Read, Write};
+use std::future::Future;
+use std::io::{self, IoSlice, IoSliceMut, Read, Write};
 use std::net::SocketAddrV4;
+use std::mem;
+use std::ops::{Deref, DerefMut};
 use std::ptr;
+use std::slice;
+use std::task::{Context, Poll};
 
 use byteorder::{ByteOrder, NetworkEndian};
 
@@ -20,6 +25,7 @@ impl TcpQueue {
         let laddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&local_addr.ip().octets()),
             port: local_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
         let mut queue = ptr::null_mut();
         let ret = unsafe { ffi::tcp_listen(laddr, backlog, &mut queue as *mut _) };
@@ -50,16 +56,68 @@ impl Drop for TcpQueue {
 unsafe impl Send for TcpQueue {}
 unsafe impl Sync for TcpQueue {}
 
+/// The maximum number of buffers returned by a single zero-copy read.
+const TCP_READ_ZC_MAX_BUFS: usize = 16;
+
+/// A received buffer that is released back to the runtime when dropped.
+pub struct TcpRxBuf(ffi::tcp_rx_buf);
+impl Deref for TcpRxBuf {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.0.buf as *const u8, self.0.len) }
+    }
+}
+impl Drop for TcpRxBuf {
+    fn drop(&mut self) {
+        unsafe { ffi::tcp_rx_buf_release(self.0.release_data) }
+    }
+}
+unsafe impl Send for TcpRxBuf {}
+
+/// A buffer for zero-copy writes, see `TcpConnection::write_zc()`.
+pub struct TcpTxBuf(ffi::tcp_tx_buf);
+impl TcpTxBuf {
+    /// Allocates a buffer for payloads of up to `len` bytes.
+    pub fn alloc(len: usize) -> io::Result<Self> {
+        let mut b: ffi::tcp_tx_buf = unsafe { mem::zeroed() };
+        let ret = unsafe { ffi::tcp_tx_buf_alloc(&mut b, len) };
+        if ret < 0 {
+            Err(io::Error::from_raw_os_error(-ret as i32))
+        } else {
+            Ok(TcpTxBuf(b))
+        }
+    }
+}
+impl Deref for TcpTxBuf {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.0.buf as *const u8, self.0.cap) }
+    }
+}
+impl DerefMut for TcpTxBuf {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        unsafe { slice::from_raw_parts_mut(self.0.buf as *mut u8, self.0.cap) }
+    }
+}
+impl Drop for TcpTxBuf {
+    fn drop(&mut self) {
+        unsafe { ffi::tcp_tx_buf_free(&mut self.0) }
+    }
+}
+unsafe impl Send for TcpTxBuf {}
+
 pub struct TcpConnection(*mut ffi::tcpconn_t);
 impl TcpConnection {
     pub fn dial(local_addr: SocketAddrV4, remote_addr: SocketAddrV4) -> io::Result<Self> {
         let laddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&local_addr.ip().octets()),
             port: local_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
         let raddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&remote_addr.ip().octets()),
             port: remote_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
 
         let mut conn = ptr::null_mut();
@@ -93,6 +151,53 @@ impl TcpConnection {
     pub fn abort(&self) {
         unsafe { ffi::tcp_abort(self.0) };
     }
+
+    /// Reads up to `len` bytes without copying. Returns an empty vector if
+    /// the connection is closed.
+    pub fn read_zc(&self, len: usize) -> io::Result<Vec<TcpRxBuf>> {
+        let mut bufs: [ffi::tcp_rx_buf; TCP_READ_ZC_MAX_BUFS] = unsafe { mem::zeroed() };
+        isize_to_result(unsafe {
+            ffi::tcp_read_zc(self.0, len, bufs.as_mut_ptr(), TCP_READ_ZC_MAX_BUFS as c_int)
+        })?;
+        Ok(bufs
+            .iter()
+            .take_while(|b| b.len > 0)
+            .map(|b| TcpRxBuf(*b))
+            .collect())
+    }
+
+    /// Reads into several buffers, in order. Same as read_vectored, but
+    /// doesn't take a &mut self.
+    pub fn readv(&self, bufs: &mut [IoSliceMut]) -> io::Result<usize> {
+        // IoSliceMut has the same layout as struct iovec
+        isize_to_result(unsafe {
+            ffi::tcp_readv(self.0, bufs.as_ptr() as *const ffi::iovec, bufs.len() as c_int)
+        })
+    }
+
+    /// Writes from several buffers, in order. Same as write_vectored, but
+    /// doesn't take a &mut self.
+    pub fn writev(&self, bufs: &[IoSlice]) -> io::Result<usize> {
+        isize_to_result(unsafe {
+            ffi::tcp_writev(self.0, bufs.as_ptr() as *const ffi::iovec, bufs.len() as c_int)
+        })
+    }
+
+    /// Writes the first `len` bytes of `buf` without copying, and calls
+    /// `done(arg)` once the stack no longer references it. Returns how many
+    /// bytes were written.
+    ///
+    /// This is unsafe because `buf` must not be modified or dropped until
+    /// `done` is called.
+    pub unsafe fn write_zc(
+        &self,
+        buf: &mut TcpTxBuf,
+        len: usize,
+        done: Option<unsafe extern "C" fn(arg: *mut c_void)>,
+        arg: *mut c_void,
+    ) -> io::Result<usize> {
+        isize_to_result(ffi::tcp_write_zc(self.0, &mut buf.0, len, done, arg))
+    }
 }
 
 impl<'a> Read for &'a TcpConnection {
@@ -101,6 +206,9 @@ impl<'a> Read for &'a TcpConnection {
             ffi::tcp_read(self.0, buf.as_mut_ptr() as *mut c_void, buf.len())
         })
     }
+    fn read_vectored(&mut self, bufs: &mut [IoSliceMut]) -> io::Result<usize> {
+        self.readv(bufs)
+    }
 }
 impl Read for TcpConnection {
     fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
@@ -108,11 +216,17 @@ impl Read for TcpConnection {
             ffi::tcp_read(self.0, buf.as_mut_ptr() as *mut c_void, buf.len())
         })
     }
+    fn read_vectored(&mut self, bufs: &mut [IoSliceMut]) -> io::Result<usize> {
+        self.readv(bufs)
+    }
 }
 impl<'a> Write for &'a TcpConnection {
     fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
         isize_to_result(unsafe { ffi::tcp_write(self.0, buf.as_ptr() as *const c_void, buf.len()) })
     }
+    fn write_vectored(&mut self, bufs: &[IoSlice]) -> io::Result<usize> {
+        self.writev(bufs)
+    }
     fn flush(&mut self) -> io::Result<()> {
         Ok(())
     }
@@ -121,6 +235,9 @@ impl Write for TcpConnection {
     fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
         isize_to_result(unsafe { ffi::tcp_write(self.0, buf.as_ptr() as *const c_void, buf.len()) })
     }
+    fn write_vectored(&mut self, bufs: &[IoSlice]) -> io::Result<usize> {
+        self.writev(bufs)
+    }
     fn flush(&mut self) -> io::Result<()> {
         Ok(())
     }
@@ -132,3 +249,110 @@ impl Drop for TcpConnection {
 }
 unsafe impl Send for TcpConnection {}
 unsafe impl Sync for TcpConnection {}
+
+/// A listener queue whose accepts wait on an executor instead of blocking.
+pub struct AsyncTcpQueue {
+    reg: executor::Registration,
+    queue: TcpQueue,
+}
+impl AsyncTcpQueue {
+    pub fn new(handle: &executor::Handle, queue: TcpQueue) -> Self {
+        let reg = executor::Registration::new(handle);
+        unsafe {
+            ffi::tcp_qset_nonblocking(queue.0, true);
+            ffi::tcp_qpoll_register(queue.0, reg.waiter(), reg.data());
+        }
+        AsyncTcpQueue { reg, queue }
+    }
+
+    pub fn poll_accept(&self, cx: &mut Context) -> Poll<io::Result<AsyncTcpConnection>> {
+        let mut conn = ptr::null_mut();
+        match self.reg.poll_read(cx, || unsafe {
+            ffi::tcp_accept(self.queue.0, &mut conn as *mut _) as isize
+        }) {
+            Poll::Ready(Ok(_)) => {
+                let handle = self.reg.handle();
+                Poll::Ready(Ok(AsyncTcpConnection::new(&handle, TcpConnection(conn))))
+            }
+            Poll::Ready(Err(e)) => Poll::Ready(Err(e)),
+            Poll::Pending => Poll::Pending,
+        }
+    }
+
+    /// Accepts a connection, registered with the same executor.
+    pub fn accept<'a>(&'a self) -> impl Future<Output = io::Result<AsyncTcpConnection>> + 'a {
+        executor::poll_fn(move |cx| self.poll_accept(cx))
+    }
+
+    pub fn get_ref(&self) -> &TcpQueue {
+        &self.queue
+    }
+}
+impl Drop for AsyncTcpQueue {
+    fn drop(&mut self) {
+        unsafe { ffi::tcp_qpoll_unregister(self.queue.0) }
+    }
+}
+
+/// A connection whose reads and writes wait on an executor instead of
+/// blocking.
+pub struct AsyncTcpConnection {
+    reg: executor::Registration,
+    conn: TcpConnection,
+}
+impl AsyncTcpConnection {
+    pub fn new(handle: &executor::Handle, conn: TcpConnection) -> Self {
+        let reg = executor::Registration::new(handle);
+        unsafe {
+            ffi::tcp_set_nonblocking(conn.0, true);
+            ffi::tcp_poll_register(conn.0, reg.waiter(), reg.data());
+        }
+        AsyncTcpConnection { reg, conn }
+    }
+
+    pub fn poll_read(&self, cx: &mut Context, buf: &mut [u8]) -> Poll<io::Result<usize>> {
+        self.reg.poll_read(cx, || unsafe {
+            ffi::tcp_read(self.conn.0, buf.as_mut_ptr() as *mut c_void, buf.len())
+        })
+    }
+
+    pub fn poll_write(&self, cx: &mut Context, buf: &[u8]) -> Poll<io::Result<usize>> {
+        self.reg.poll_write(cx, || unsafe {
+            ffi::tcp_write(self.conn.0, buf.as_ptr() as *const c_void, buf.len())
+        })
+    }
+
+    /// Reads from the stream, returns 0 at EOF.
+    pub fn read<'a>(&'a self, buf: &'a mut [u8]) -> impl Future<Output = io::Result<usize>> + 'a {
+        executor::poll_fn(move |cx| self.poll_read(cx, buf))
+    }
+
+    /// Writes to the stream, returns how much was written.
+    pub fn write<'a>(&'a self, buf: &'a [u8]) -> impl Future<Output = io::Result<usize>> + 'a {
+        executor::poll_fn(move |cx| self.poll_write(cx, buf))
+    }
+
+    /// Writes all of `buf` to the stream.
+    pub fn write_all<'a>(&'a self, buf: &'a [u8]) -> impl Future<Output = io::Result<()>> + 'a {
+        let mut pos = 0;
+        executor::poll_fn(move |cx| {
+            while pos < buf.len() {
+                match self.poll_write(cx, &buf[pos..]) {
+                    Poll::Ready(Ok(n)) => pos += n,
+                    Poll::Ready(Err(e)) => return Poll::Ready(Err(e)),
+                    Poll::Pending => return Poll::Pending,
+                }
+            }
+            Poll::Ready(Ok(()))
+        })
+    }
+
+    pub fn get_ref(&self) -> &TcpConnection {
+        &self.conn
+    }
+}
+impl Drop for AsyncTcpConnection {
+    fn drop(&mut self) {
+        unsafe { ffi::tcp_poll_unregister(self.conn.0) }
+    }
+}
@@ -1,6 +1,9 @@
-use std::io::{self, Read, Write};
+use std::future::Future;
+use std::io::{self, IoSlice, IoSliceMut, Read, Write};
+use std::mem;
 use std::net::SocketAddrV4;
 use std::ptr;
+use std::task::{Context, Poll};
 
 use byteorder::{ByteOrder, NetworkEndian};
 
@@ -20,10 +23,12 @@ impl UdpConnection {
         let laddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&local_addr.ip().octets()),
             port: local_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
         let raddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&remote_addr.ip().octets()),
             port: remote_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
 
         let mut conn = ptr::null_mut();
@@ -39,6 +44,7 @@ impl UdpConnection {
         let laddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&local_addr.ip().octets()),
             port: local_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
         let mut conn = ptr::null_mut();
         let ret = unsafe { ffi::udp_listen(laddr, &mut conn as *mut _) };
@@ -56,7 +62,7 @@ impl UdpConnection {
     }
 
     pub fn read_from(&self, buf: &mut [u8]) -> io::Result<(usize, SocketAddrV4)> {
-        let mut raddr = ffi::netaddr { ip: 0, port: 0 };
+        let mut raddr = unsafe { mem::zeroed::<ffi::netaddr>() };
         isize_to_result(unsafe {
             ffi::udp_read_from(
                 self.0,
@@ -72,6 +78,7 @@ impl UdpConnection {
         let mut raddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&remote_addr.ip().octets()),
             port: remote_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
         isize_to_result(unsafe {
             ffi::udp_write_to(
@@ -83,6 +90,120 @@ impl UdpConnection {
         })
     }
 
+    /// Reads a datagram into several buffers, in order, and gets its sender.
+    /// Whatever doesn't fit is dropped.
+    pub fn read_vectored_from(
+        &self,
+        bufs: &mut [IoSliceMut],
+    ) -> io::Result<(usize, SocketAddrV4)> {
+        let mut raddr = unsafe { mem::zeroed::<ffi::netaddr>() };
+        // IoSliceMut has the same layout as struct iovec
+        isize_to_result(unsafe {
+            ffi::udp_readv_from(
+                self.0,
+                bufs.as_ptr() as *const ffi::iovec,
+                bufs.len() as c_int,
+                &mut raddr as *mut _,
+            )
+        })
+        .map(|u| (u, SocketAddrV4::new(raddr.ip.into(), raddr.port)))
+    }
+
+    /// Writes a datagram gathered from several buffers to an address.
+    pub fn write_vectored_to(
+        &self,
+        bufs: &[IoSlice],
+        remote_addr: SocketAddrV4,
+    ) -> io::Result<usize> {
+        let raddr = ffi::netaddr {
+            ip: NetworkEndian::read_u32(&remote_addr.ip().octets()),
+            port: remote_addr.port(),
+            ..unsafe { mem::zeroed() }
+        };
+        isize_to_result(unsafe {
+            ffi::udp_writev_to(
+                self.0,
+                bufs.as_ptr() as *const ffi::iovec,
+                bufs.len() as c_int,
+                &raddr as *const _,
+            )
+        })
+    }
+
+    /// Reads up to `bufs.len()` datagrams, storing the length and sender of
+    /// each in `out`. Returns how many were read.
+    pub fn read_batch(
+        &self,
+        bufs: &mut [&mut [u8]],
+        out: &mut [(usize, SocketAddrV4)],
+    ) -> io::Result<usize> {
+        let n = bufs.len().min(out.len()).min(ffi::UDP_BATCH_MAX as usize);
+        let mut raddrs = vec![unsafe { mem::zeroed::<ffi::netaddr>() }; n];
+        let mut msgs: Vec<ffi::udp_msg> = bufs[..n]
+            .iter_mut()
+            .zip(raddrs.iter_mut())
+            .map(|(buf, raddr)| ffi::udp_msg {
+                buf: buf.as_mut_ptr() as *mut c_void,
+                len: buf.len(),
+                raddr: raddr as *mut _,
+                recv_len: 0,
+            })
+            .collect();
+        let ret = unsafe { ffi::udp_read_batch(self.0, msgs.as_mut_ptr(), n as c_int) };
+        isize_to_result(ret as isize).map(|nr| {
+            for i in 0..nr {
+                out[i] = (
+                    msgs[i].recv_len,
+                    SocketAddrV4::new(raddrs[i].ip.into(), raddrs[i].port),
+                );
+            }
+            nr
+        })
+    }
+
+    /// Writes each buffer in `msgs` as a datagram to its address. Returns
+    /// how many were sent.
+    pub fn write_batch_to(&self, msgs: &[(&[u8], SocketAddrV4)]) -> io::Result<usize> {
+        let n = msgs.len().min(ffi::UDP_BATCH_MAX as usize);
+        let mut raddrs: Vec<ffi::netaddr> = msgs[..n]
+            .iter()
+            .map(|(_, addr)| ffi::netaddr {
+                ip: NetworkEndian::read_u32(&addr.ip().octets()),
+                port: addr.port(),
+                ..unsafe { mem::zeroed() }
+            })
+            .collect();
+        let cmsgs: Vec<ffi::udp_msg> = msgs[..n]
+            .iter()
+            .zip(raddrs.iter_mut())
+            .map(|((buf, _), raddr)| ffi::udp_msg {
+                buf: buf.as_ptr() as *const c_void as *mut c_void,
+                len: buf.len(),
+                raddr: raddr as *mut _,
+                recv_len: 0,
+            })
+            .collect();
+        let ret = unsafe { ffi::udp_write_batch(self.0, cmsgs.as_ptr(), n as c_int) };
+        isize_to_result(ret as isize)
+    }
+
+    /// Writes each buffer as a datagram to the connection's remote address.
+    /// Returns how many were sent.
+    pub fn send_batch(&self, bufs: &[&[u8]]) -> io::Result<usize> {
+        let n = bufs.len().min(ffi::UDP_BATCH_MAX as usize);
+        let cmsgs: Vec<ffi::udp_msg> = bufs[..n]
+            .iter()
+            .map(|buf| ffi::udp_msg {
+                buf: buf.as_ptr() as *const c_void as *mut c_void,
+                len: buf.len(),
+                raddr: ptr::null_mut(),
+                recv_len: 0,
+            })
+            .collect();
+        let ret = unsafe { ffi::udp_write_batch(self.0, cmsgs.as_ptr(), n as c_int) };
+        isize_to_result(ret as isize)
+    }
+
     /// Same as read, but doesn't take a &mut self.
     pub fn recv(&self, buf: &mut [u8]) -> io::Result<usize> {
         isize_to_result(unsafe {
@@ -93,6 +214,28 @@ impl UdpConnection {
     pub fn send(&self, buf: &[u8]) -> io::Result<usize> {
         isize_to_result(unsafe { ffi::udp_write(self.0, buf.as_ptr() as *const c_void, buf.len()) })
     }
+    /// Same as read_vectored, but doesn't take a &mut self.
+    pub fn recv_vectored(&self, bufs: &mut [IoSliceMut]) -> io::Result<usize> {
+        isize_to_result(unsafe {
+            ffi::udp_readv_from(
+                self.0,
+                bufs.as_ptr() as *const ffi::iovec,
+                bufs.len() as c_int,
+                ptr::null_mut(),
+            )
+        })
+    }
+    /// Same as write_vectored, but doesn't take a &mut self.
+    pub fn send_vectored(&self, bufs: &[IoSlice]) -> io::Result<usize> {
+        isize_to_result(unsafe {
+            ffi::udp_writev_to(
+                self.0,
+                bufs.as_ptr() as *const ffi::iovec,
+                bufs.len() as c_int,
+                ptr::null(),
+            )
+        })
+    }
 
     pub fn local_addr(&self) -> SocketAddrV4 {
         let local_addr = unsafe { ffi::udp_local_addr(self.0) };
@@ -115,6 +258,9 @@ impl Read for UdpConnection {
             ffi::udp_read(self.0, buf.as_mut_ptr() as *mut c_void, buf.len())
         })
     }
+    fn read_vectored(&mut self, bufs: &mut [IoSliceMut]) -> io::Result<usize> {
+        self.recv_vectored(bufs)
+    }
 }
 
 impl<'a> Read for &'a UdpConnection {
@@ -123,6 +269,9 @@ impl<'a> Read for &'a UdpConnection {
             ffi::udp_read(self.0, buf.as_mut_ptr() as *mut c_void, buf.len())
         })
     }
+    fn read_vectored(&mut self, bufs: &mut [IoSliceMut]) -> io::Result<usize> {
+        self.recv_vectored(bufs)
+    }
 }
 
 impl Write for UdpConnection {
@@ -130,6 +279,10 @@ impl Write for UdpConnection {
         isize_to_result(unsafe { ffi::udp_write(self.0, buf.as_ptr() as *const c_void, buf.len()) })
     }
 
+    fn write_vectored(&mut self, bufs: &[IoSlice]) -> io::Result<usize> {
+        self.send_vectored(bufs)
+    }
+
     fn flush(&mut self) -> io::Result<()> {
         Ok(())
     }
@@ -140,6 +293,10 @@ impl<'a> Write for &'a UdpConnection {
         isize_to_result(unsafe { ffi::udp_write(self.0, buf.as_ptr() as *const c_void, buf.len()) })
     }
 
+    fn write_vectored(&mut self, bufs: &[IoSlice]) -> io::Result<usize> {
+        self.send_vectored(bufs)
+    }
+
     fn flush(&mut self) -> io::Result<()> {
         Ok(())
     }
@@ -164,6 +321,7 @@ impl UdpSpawner {
         let laddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&local_addr.ip().octets()),
             port: local_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
 
         let mut spawner: *mut ffi::udpspawner_t = ptr::null_mut();
@@ -195,3 +353,111 @@ impl Drop for UdpSpawner {
         unsafe { ffi::udp_destroy_spawner(self.0) }
     }
 }
+
+/// A UDP connection whose reads and writes wait on an executor instead of
+/// blocking.
+pub struct AsyncUdpConnection {
+    reg: executor::Registration,
+    conn: UdpConnection,
+}
+impl AsyncUdpConnection {
+    pub fn new(handle: &executor::Handle, conn: UdpConnection) -> Self {
+        let reg = executor::Registration::new(handle);
+        unsafe {
+            ffi::udp_set_nonblocking(conn.0, true);
+            ffi::udp_poll_register(conn.0, reg.waiter(), reg.data());
+        }
+        AsyncUdpConnection { reg, conn }
+    }
+
+    pub fn poll_recv_from(
+        &self,
+        cx: &mut Context,
+        buf: &mut [u8],
+    ) -> Poll<io::Result<(usize, SocketAddrV4)>> {
+        let mut raddr = unsafe { mem::zeroed::<ffi::netaddr>() };
+        match self.reg.poll_read(cx, || unsafe {
+            ffi::udp_read_from(
+                self.conn.0,
+                buf.as_mut_ptr() as *mut c_void,
+                buf.len(),
+                &mut raddr as *mut _,
+            )
+        }) {
+            Poll::Ready(Ok(n)) => {
+                Poll::Ready(Ok((n, SocketAddrV4::new(raddr.ip.into(), raddr.port))))
+            }
+            Poll::Ready(Err(e)) => Poll::Ready(Err(e)),
+            Poll::Pending => Poll::Pending,
+        }
+    }
+
+    pub fn poll_send_to(
+        &self,
+        cx: &mut Context,
+        buf: &[u8],
+        remote_addr: SocketAddrV4,
+    ) -> Poll<io::Result<usize>> {
+        let mut raddr = ffi::netaddr {
+            ip: NetworkEndian::read_u32(&remote_addr.ip().octets()),
+            port: remote_addr.port(),
+            ..unsafe { mem::zeroed() }
+        };
+        self.reg.poll_write(cx, || unsafe {
+            ffi::udp_write_to(
+                self.conn.0,
+                buf.as_ptr() as *const c_void as *mut c_void,
+                buf.len(),
+                &mut raddr as *mut _,
+            )
+        })
+    }
+
+    pub fn poll_recv(&self, cx: &mut Context, buf: &mut [u8]) -> Poll<io::Result<usize>> {
+        self.reg.poll_read(cx, || unsafe {
+            ffi::udp_read(self.conn.0, buf.as_mut_ptr() as *mut c_void, buf.len())
+        })
+    }
+
+    pub fn poll_send(&self, cx: &mut Context, buf: &[u8]) -> Poll<io::Result<usize>> {
+        self.reg.poll_write(cx, || unsafe {
+            ffi::udp_write(self.conn.0, buf.as_ptr() as *const c_void, buf.len())
+        })
+    }
+
+    /// Reads a datagram and gets its sender.
+    pub fn recv_from<'a>(
+        &'a self,
+        buf: &'a mut [u8],
+    ) -> impl Future<Output = io::Result<(usize, SocketAddrV4)>> + 'a {
+        executor::poll_fn(move |cx| self.poll_recv_from(cx, buf))
+    }
+
+    /// Writes a datagram to an address.
+    pub fn send_to<'a>(
+        &'a self,
+        buf: &'a [u8],
+        remote_addr: SocketAddrV4,
+    ) -> impl Future<Output = io::Result<usize>> + 'a {
+        executor::poll_fn(move |cx| self.poll_send_to(cx, buf, remote_addr))
+    }
+
+    /// Reads a datagram from the remote address.
+    pub fn recv<'a>(&'a self, buf: &'a mut [u8]) -> impl Future<Output = io::Result<usize>> + 'a {
+        executor::poll_fn(move |cx| self.poll_recv(cx, buf))
+    }
+
+    /// Writes a datagram to the remote address.
+    pub fn send<'a>(&'a self, buf: &'a [u8]) -> impl Future<Output = io::Result<usize>> + 'a {
+        executor::poll_fn(move |cx| self.poll_send(cx, buf))
+    }
+
+    pub fn get_ref(&self) -> &UdpConnection {
+        &self.conn
+    }
+}
+impl Drop for AsyncUdpConnection {
+    fn drop(&mut self) {
+        unsafe { ffi::udp_poll_unregister(self.conn.0) }
+    }
+}
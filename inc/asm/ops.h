@@ -37,3 +37,26 @@ static inline uint64_t __mm_crc32_u64(uint64_t crc, uint64_t val)
 	asm("crc32q %1, %0" : "+r" (crc) : "rm" (val));
 	return crc;
 }
+
+/**
+ * cmpxchg16b - atomically compares and exchanges 16 bytes
+ * @p: the location, which must be 16-byte aligned
+ * @old_lo: the expected low 8 bytes
+ * @old_hi: the expected high 8 bytes
+ * @new_lo: the low 8 bytes to store
+ * @new_hi: the high 8 bytes to store
+ *
+ * Returns true if the location matched and was updated.
+ */
+static inline bool cmpxchg16b(void *p, uint64_t old_lo, uint64_t old_hi,
+			      uint64_t new_lo, uint64_t new_hi)
+{
+	uint8_t ret;
+
+	asm volatile("lock; cmpxchg16b %1\n\tsetz %0"
+		     : "=q" (ret), "+m" (*(volatile char (*)[16])p),
+		       "+a" (old_lo), "+d" (old_hi)
+		     : "b" (new_lo), "c" (new_hi)
+		     : "memory", "cc");
+	return ret;
+}
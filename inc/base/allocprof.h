@@ -0,0 +1,56 @@
+/*
+ * allocprof.h - a sampling profiler for memory allocations
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+
+/* the allocators that can be sampled */
+enum {
+	ALLOCPROF_SLAB = 0,	/* slab_alloc_on_node(), keyed by call site */
+	ALLOCPROF_TCACHE,	/* depot refills in __tcache_alloc(), by tcache */
+	ALLOCPROF_SMALLOC,	/* smalloc(), keyed by call site */
+	ALLOCPROF_NR_KINDS,
+};
+
+/* the maximum number of distinct sites tracked (must be a power of two) */
+#define ALLOCPROF_NR_SITES	256
+
+struct allocprof_site {
+	const void		*key;
+	const char		*name;
+	int			kind;
+	uint64_t		samples;
+	uint64_t		bytes;
+};
+
+extern unsigned int allocprof_rate;
+extern __thread int allocprof_countdown;
+extern uint64_t allocprof_dropped;
+
+extern void __allocprof_record(int kind, const void *key, const char *name,
+			       size_t size);
+extern void allocprof_set_rate(unsigned int rate);
+extern int allocprof_snapshot(struct allocprof_site *sites, int capacity);
+extern void allocprof_reset(void);
+extern const char *allocprof_kind_name(int kind);
+
+/**
+ * allocprof_sample - records one in every allocprof_rate allocations
+ * @kind: the allocator (ALLOCPROF_*)
+ * @key: the call site address, or the cache for ALLOCPROF_TCACHE
+ * @name: an optional human readable name for @key (may be NULL)
+ * @size: the size of the allocation
+ *
+ * Costs a single load and branch while profiling is disabled (the default).
+ */
+static __always_inline void
+allocprof_sample(int kind, const void *key, const char *name, size_t size)
+{
+	if (likely(!ACCESS_ONCE(allocprof_rate)))
+		return;
+	if (likely(--allocprof_countdown > 0))
+		return;
+	__allocprof_record(kind, key, name, size);
+}
@@ -110,8 +110,41 @@ static inline void bitmap_init(unsigned long *bits, int nbits, bool state)
 	memset(bits, state ? 0xff : 0, BITMAP_LONG_SIZE(nbits) * sizeof(long));
 }
 
+/**
+ * bitmap_and - computes the intersection of two bitmaps
+ * @dst: the bitmap to store the result (may be @a or @b)
+ * @a: the first bitmap
+ * @b: the second bitmap
+ * @nbits: the number of total bits
+ */
+static inline void bitmap_and(unsigned long *dst, const unsigned long *a,
+			      const unsigned long *b, int nbits)
+{
+	int i;
+
+	for (i = 0; i < BITMAP_LONG_SIZE(nbits); i++)
+		dst[i] = a[i] & b[i];
+}
+
+/**
+ * bitmap_andnot - computes the bits set in one bitmap but not another
+ * @dst: the bitmap to store the result (may be @a or @b)
+ * @a: the bitmap to take bits from
+ * @b: the bitmap of bits to leave out
+ * @nbits: the number of total bits
+ */
+static inline void bitmap_andnot(unsigned long *dst, const unsigned long *a,
+				 const unsigned long *b, int nbits)
+{
+	int i;
+
+	for (i = 0; i < BITMAP_LONG_SIZE(nbits); i++)
+		dst[i] = a[i] & ~b[i];
+}
+
 extern int bitmap_find_next_set(unsigned long *bits, int nbits, int pos);
 extern int bitmap_find_next_cleared(unsigned long *bits, int nbits, int pos);
+extern int bitmap_weight(unsigned long *bits, int nbits);
 
 /**
  * bitmap_for_each_set - generates a loop iteration over each set bit
@@ -10,11 +10,123 @@
 
 extern int cpu_count; /* the number of available CPUs */
 extern int numa_count; /* the number of NUMA nodes */
+extern int llc_count; /* the number of last-level cache domains */
+
+/* the most cache levels and types (e.g., L1d and L1i) recorded per CPU */
+#define CPU_MAX_CACHES	6
+
+enum {
+	CPU_CACHE_DATA = 0,
+	CPU_CACHE_INST,
+	CPU_CACHE_UNIFIED,
+};
+
+struct cpu_cache {
+	int	level;
+	int	type;		/* CPU_CACHE_* */
+	int	id;		/* CPUs with the same level, type, and id share it */
+	int	line_size;	/* bytes */
+	size_t	size;		/* bytes */
+};
 
 struct cpu_info {
 	DEFINE_BITMAP(thread_siblings_mask, NCPU);
 	DEFINE_BITMAP(core_siblings_mask, NCPU);
+	DEFINE_BITMAP(llc_siblings_mask, NCPU);
 	int package;
+	int node;	/* the NUMA node */
+	int llc;	/* the last-level cache domain, 0 to llc_count - 1 */
+	int nr_caches;
+	struct cpu_cache caches[CPU_MAX_CACHES];
 };
 
 extern struct cpu_info cpu_info_tbl[NCPU];
+
+/* NUMA distances as reported by firmware, 10 for the local node */
+extern int numa_distance_tbl[NNUMA][NNUMA];
+
+/* how far apart two CPUs are, nearest first */
+enum {
+	CPU_DIST_SELF = 0,	/* the same CPU */
+	CPU_DIST_CORE,		/* hyperthreads of the same physical core */
+	CPU_DIST_LLC,		/* sharing the last-level cache */
+	CPU_DIST_NODE,		/* on the same NUMA node */
+	CPU_DIST_PACKAGE,	/* in the same package, on different nodes */
+	CPU_DIST_REMOTE,	/* everything else */
+	CPU_DIST_NR,
+};
+
+/**
+ * cpu_to_node - gets the NUMA node of a CPU
+ * @cpu: the CPU
+ */
+static inline int cpu_to_node(int cpu)
+{
+	return cpu_info_tbl[cpu].node;
+}
+
+/**
+ * cpu_to_llc - gets the last-level cache domain of a CPU
+ * @cpu: the CPU
+ */
+static inline int cpu_to_llc(int cpu)
+{
+	return cpu_info_tbl[cpu].llc;
+}
+
+/**
+ * cpu_distance - gets how far apart two CPUs are (CPU_DIST_*)
+ * @a: the first CPU
+ * @b: the second CPU
+ */
+static inline int cpu_distance(int a, int b)
+{
+	struct cpu_info *ia = &cpu_info_tbl[a], *ib = &cpu_info_tbl[b];
+
+	if (a == b)
+		return CPU_DIST_SELF;
+	if (bitmap_test(ia->thread_siblings_mask, b))
+		return CPU_DIST_CORE;
+	if (ia->llc == ib->llc)
+		return CPU_DIST_LLC;
+	if (ia->node == ib->node)
+		return CPU_DIST_NODE;
+	if (ia->package == ib->package)
+		return CPU_DIST_PACKAGE;
+	return CPU_DIST_REMOTE;
+}
+
+/**
+ * numa_distance - gets the firmware distance between two NUMA nodes
+ * @a: the first node
+ * @b: the second node
+ *
+ * Returns 10 for the same node, and more for nodes that are farther apart.
+ */
+static inline int numa_distance(int a, int b)
+{
+	return numa_distance_tbl[a][b];
+}
+
+/**
+ * cpu_cache_at_level - gets a CPU's data or unified cache at a level
+ * @cpu: the CPU
+ * @level: the cache level (e.g., 2 for L2)
+ *
+ * Returns the cache, or NULL if there isn't one.
+ */
+static inline const struct cpu_cache *cpu_cache_at_level(int cpu, int level)
+{
+	const struct cpu_info *info = &cpu_info_tbl[cpu];
+	int i;
+
+	for (i = 0; i < info->nr_caches; i++) {
+		if (info->caches[i].level == level &&
+		    info->caches[i].type != CPU_CACHE_INST)
+			return &info->caches[i];
+	}
+
+	return NULL;
+}
+
+extern int numa_nearest_nodes(int node, int *nodes);
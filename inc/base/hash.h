@@ -6,7 +6,8 @@
  * (e.g. IP source, IP destionation, source port, destination port,
  * etc.)
  *
- * Jenkins hash is provided for arbitrary length inputs.
+ * Jenkins hash is provided for arbitrary length inputs, and SipHash for
+ * inputs an attacker must not be able to forge hashes for.
  */
 
 #pragma once
@@ -39,6 +40,40 @@ static inline uint32_t hash_crc32c_two(uint32_t seed, uint64_t a, uint64_t b)
 	return __mm_crc32_u64(seed, b);
 }
 
+/**
+ * hash_crc32c_two_batch - hashes many pairs of 64-bit words
+ * @seeds: the seed for each pair
+ * @a: the first word of each pair
+ * @b: the second word of each pair
+ * @out: an array to store the 32-bit hash values
+ * @n: the number of pairs
+ *
+ * Each result is the same as hash_crc32c_two(). A crc32 takes three cycles,
+ * but a new one can start every cycle, so four pairs are hashed at a time
+ * with their chains interleaved.
+ */
+static inline void hash_crc32c_two_batch(const uint32_t *seeds,
+					 const uint64_t *a, const uint64_t *b,
+					 uint32_t *out, unsigned int n)
+{
+	uint64_t h0, h1, h2, h3;
+	unsigned int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		h0 = __mm_crc32_u64(seeds[i], a[i]);
+		h1 = __mm_crc32_u64(seeds[i + 1], a[i + 1]);
+		h2 = __mm_crc32_u64(seeds[i + 2], a[i + 2]);
+		h3 = __mm_crc32_u64(seeds[i + 3], a[i + 3]);
+		out[i] = __mm_crc32_u64(h0, b[i]);
+		out[i + 1] = __mm_crc32_u64(h1, b[i + 1]);
+		out[i + 2] = __mm_crc32_u64(h2, b[i + 2]);
+		out[i + 3] = __mm_crc32_u64(h3, b[i + 3]);
+	}
+
+	for (; i < n; i++)
+		out[i] = hash_crc32c_two(seeds[i], a[i], b[i]);
+}
+
 /*
  * These functions are a simplified subset of CityHash, modified to focus
  * just on small input values. They are based on Google's original CityHash
@@ -123,6 +158,8 @@ static inline uint64_t hash_city_two(uint64_t val_a, uint64_t val_b)
 }
 
 extern uint32_t jenkins_hash(const void *key, size_t length);
+extern uint64_t siphash24(const uint64_t key[2], const uint64_t *words,
+			  size_t nr);
 
 /**
  * rand_crc32c - generates a very fast pseudorandom value using crc32c
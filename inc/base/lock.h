@@ -5,7 +5,12 @@
 #pragma once
 
 #include <base/stddef.h>
+#include <base/lockprof.h>
 #include <asm/ops.h>
+#ifdef LOCK_STATS
+#include <base/thread.h>
+#include <base/time.h>
+#endif
 
 #define SPINLOCK_INITIALIZER {.locked = 0}
 #define DEFINE_SPINLOCK(name) spinlock_t name = SPINLOCK_INITIALIZER
@@ -46,6 +51,11 @@ static inline void assert_spin_lock_held(spinlock_t *l)
  */
 static inline void spin_lock(spinlock_t *l)
 {
+	if (lockprof_enabled()) {
+		__lockprof_spin_lock(l, LOCKPROF_THIS_IP);
+		return;
+	}
+
 	while (__sync_lock_test_and_set(&l->locked, 1)) {
 		while (l->locked)
 			cpu_relax();
@@ -60,8 +70,11 @@ static inline void spin_lock(spinlock_t *l)
  */
 static inline bool spin_try_lock(spinlock_t *l)
 {
-	if (!__sync_lock_test_and_set(&l->locked, 1))
+	if (!__sync_lock_test_and_set(&l->locked, 1)) {
+		if (lockprof_enabled())
+			__lockprof_spin_acquired(l, LOCKPROF_THIS_IP);
 		return true;
+	}
 	return false;
 }
 
@@ -72,5 +85,144 @@ static inline bool spin_try_lock(spinlock_t *l)
 static inline void spin_unlock(spinlock_t *l)
 {
 	assert_spin_lock_held(l);
+	if (lockprof_enabled())
+		__lockprof_spin_release(l);
 	__sync_lock_release(&l->locked);
 }
+
+
+/*
+ * Ticket locks
+ *
+ * A fair alternative to spinlock_t for heavily contended locks. Waiters spin
+ * reading their ticket rather than retrying an atomic exchange, and
+ * ticket_try_lock() only writes the lock line if the lock is free, so many
+ * cores polling a busy lock don't keep stealing the line from the holder.
+ *
+ * When built with LOCK_STATS, acquisitions, contended acquisitions, and the
+ * cycles spent waiting for and holding ticket locks are counted per thread and
+ * exported as base stats (see base/stat.c).
+ */
+
+#ifdef LOCK_STATS
+DECLARE_PERTHREAD(uint64_t, lock_acquires);
+DECLARE_PERTHREAD(uint64_t, lock_contended);
+DECLARE_PERTHREAD(uint64_t, lock_wait_cycles);
+DECLARE_PERTHREAD(uint64_t, lock_hold_cycles);
+
+/*
+ * Hold cycles are the sum of release times minus the sum of acquire times, so
+ * they add up correctly even if locks aren't released in LIFO order.
+ */
+static inline void __ticket_stat_acquired(uint64_t wait_start)
+{
+	uint64_t now = rdtsc();
+
+	perthread_get(lock_acquires)++;
+	if (wait_start) {
+		perthread_get(lock_contended)++;
+		perthread_get(lock_wait_cycles) += now - wait_start;
+	}
+	perthread_get(lock_hold_cycles) -= now;
+}
+
+static inline void __ticket_stat_released(void)
+{
+	perthread_get(lock_hold_cycles) += rdtsc();
+}
+#else /* LOCK_STATS */
+static inline void __ticket_stat_acquired(uint64_t wait_start) {}
+static inline void __ticket_stat_released(void) {}
+#endif /* LOCK_STATS */
+
+#define TICKETLOCK_INITIALIZER {.val = 0}
+#define DEFINE_TICKETLOCK(name) ticketlock_t name = TICKETLOCK_INITIALIZER
+#define DECLARE_TICKETLOCK(name) extern ticketlock_t name
+
+/**
+ * ticket_lock_init - prepares a ticket lock for use
+ * @l: the ticket lock
+ */
+static inline void ticket_lock_init(ticketlock_t *l)
+{
+	l->val = 0;
+}
+
+/**
+ * ticket_lock_held - determines if the lock is held
+ * @l: the ticket lock
+ *
+ * Returns true if the lock is held.
+ */
+static inline bool ticket_lock_held(ticketlock_t *l)
+{
+	ticketlock_t v = {.val = l->val};
+
+	return v.owner != v.next;
+}
+
+/**
+ * assert_ticket_lock_held - asserts that the lock is currently held
+ * @l: the ticket lock
+ */
+static inline void assert_ticket_lock_held(ticketlock_t *l)
+{
+	assert(ticket_lock_held(l));
+}
+
+/**
+ * ticket_lock - takes a ticket lock
+ * @l: the ticket lock
+ *
+ * Waiters are served in FIFO order.
+ */
+static inline void ticket_lock(ticketlock_t *l)
+{
+	uint16_t ticket = __sync_fetch_and_add(&l->next, 1);
+	uint64_t wait_start = 0;
+
+	if (unlikely(l->owner != ticket)) {
+#ifdef LOCK_STATS
+		wait_start = rdtsc();
+#endif
+		while (l->owner != ticket)
+			cpu_relax();
+	}
+	barrier();
+	__ticket_stat_acquired(wait_start);
+}
+
+/**
+ * ticket_try_lock - takes a ticket lock, but only if it is available
+ * @l: the ticket lock
+ *
+ * Returns true if successful, otherwise false.
+ */
+static inline bool ticket_try_lock(ticketlock_t *l)
+{
+	ticketlock_t old, next;
+
+	old.val = ACCESS_ONCE(l->val);
+	if (old.owner != old.next)
+		return false;
+
+	next = old;
+	next.next++;
+	if (!__sync_bool_compare_and_swap(&l->val, old.val, next.val))
+		return false;
+
+	__ticket_stat_acquired(0);
+	return true;
+}
+
+/**
+ * ticket_unlock - releases a ticket lock
+ * @l: the ticket lock
+ */
+static inline void ticket_unlock(ticketlock_t *l)
+{
+	assert_ticket_lock_held(l);
+	__ticket_stat_released();
+	barrier();
+	ACCESS_ONCE(l->owner) = l->owner + 1;
+}
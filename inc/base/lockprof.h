@@ -0,0 +1,57 @@
+/*
+ * lockprof.h - a contention profiler for locks
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+
+/* the locks that can be profiled */
+enum {
+	LOCKPROF_SPIN = 0,	/* spinlock_t */
+	LOCKPROF_MUTEX,		/* mutex_t */
+	LOCKPROF_RWMUTEX_RD,	/* rwmutex_t, read side (no hold times) */
+	LOCKPROF_RWMUTEX_WR,	/* rwmutex_t, write side */
+	LOCKPROF_NR_KINDS,
+};
+
+/* the maximum number of distinct call sites tracked (a power of two) */
+#define LOCKPROF_NR_SITES	256
+
+struct lockprof_site {
+	const void		*site;
+	int			kind;
+	uint64_t		acquires;
+	uint64_t		contended;
+	uint64_t		wait_cycles;
+	uint64_t		hold_cycles;
+};
+
+/* nonzero while profiling, changes each time profiling is turned on */
+extern unsigned int lockprof_epoch;
+extern uint64_t lockprof_dropped;
+
+extern void __lockprof_spin_lock(spinlock_t *l, const void *site);
+extern void __lockprof_spin_acquired(spinlock_t *l, const void *site);
+extern void __lockprof_spin_release(spinlock_t *l);
+extern void __lockprof_acquired(int kind, const void *site,
+				uint64_t wait_start);
+extern void __lockprof_released(int kind, const void *site,
+				uint64_t acquire_tsc);
+extern void lockprof_enable(bool enable);
+extern int lockprof_snapshot(struct lockprof_site *sites, int capacity);
+extern void lockprof_reset(void);
+extern const char *lockprof_kind_name(int kind);
+
+/* the address of the code where this is expanded, after inlining */
+#define LOCKPROF_THIS_IP ({ __label__ __here; __here: (const void *)&&__here; })
+
+/**
+ * lockprof_enabled - returns true while lock contention is being profiled
+ *
+ * Costs a single load and branch while profiling is disabled (the default).
+ */
+static __always_inline bool lockprof_enabled(void)
+{
+	return unlikely(ACCESS_ONCE(lockprof_epoch) != 0);
+}
@@ -13,6 +13,7 @@
 extern void logk(int level, const char *fmt, ...)
 	__attribute__((__format__ (__printf__, 2, 3)));
 extern void logk_backtrace(void);
+extern int log_async_init(void);
 
 /* forces format checking */
 #define no_logk(level, fmt, ...) \
@@ -92,21 +93,24 @@ enum {
 	no_logk(LOG_DEBUG, fmt, ##__VA_ARGS__)
 #endif /* DEBUG */
 
+/* at most one message per second per call site, even across threads */
 #define log_ratelimited(level, fmt, ...)		\
 ({							\
 	static uint64_t __last_us = 0;			\
 	static uint64_t __suppressed = 0;		\
 	uint64_t __cur_us = microtime();		\
-	if (__cur_us - __last_us >= ONE_SECOND) {	\
-		if (__suppressed) {			\
+	uint64_t __prev_us = ACCESS_ONCE(__last_us);	\
+	if (__cur_us - __prev_us >= ONE_SECOND &&	\
+	    __sync_bool_compare_and_swap(&__last_us, __prev_us, __cur_us)) { \
+		uint64_t __n = ACCESS_ONCE(__suppressed);	\
+		if (__n) {				\
+			ACCESS_ONCE(__suppressed) = 0;	\
 			logk(level, "%s:%d %s() suppressed %ld times", \
-			     __FILE__, __LINE__, __func__, __suppressed); \
-			__suppressed = 0;		\
+			     __FILE__, __LINE__, __func__, __n); \
 		}					\
 		logk(level, fmt, ##__VA_ARGS__);	\
-		__last_us = __cur_us;			\
 	} else						\
-		__suppressed++;				\
+		ACCESS_ONCE(__suppressed)++;		\
 })
 
 #define log_emerg_ratelimited(fmt, ...) \
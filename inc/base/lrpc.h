@@ -20,6 +20,13 @@ struct lrpc_msg {
 #define LRPC_DONE_PARITY	(1UL << 63)
 #define LRPC_CMD_MASK		(~LRPC_DONE_PARITY)
 
+/*
+ * Messages are grouped into cache lines, so message tables should be cache
+ * line aligned. The receiver prefetches the next line as it enters a new one.
+ */
+#define LRPC_MSGS_PER_LINE	(CACHE_LINE_SIZE / sizeof(struct lrpc_msg))
+BUILD_ASSERT(CACHE_LINE_SIZE % sizeof(struct lrpc_msg) == 0);
+
 
 /*
  * Egress Channel Support
@@ -62,6 +69,55 @@ static inline bool lrpc_send(struct lrpc_chan_out *chan, uint64_t cmd,
 	return true;
 }
 
+/**
+ * lrpc_send_burst - sends several messages on the channel
+ * @chan: the egress channel
+ * @msgs: the messages to send
+ * @n: the number of messages in @msgs
+ *
+ * The messages are published together by a single release of the first slot,
+ * so the receiver sees either none or all of them.
+ *
+ * Returns the number of messages sent, which can be less than @n if the
+ * channel is full.
+ */
+static inline unsigned int lrpc_send_burst(struct lrpc_chan_out *chan,
+					   const struct lrpc_msg *msgs,
+					   unsigned int n)
+{
+	struct lrpc_msg *dst;
+	uint32_t head = chan->send_head;
+	uint64_t cmd;
+	unsigned int i;
+
+	/* refresh the cached window at most once */
+	if (unlikely(head - chan->send_tail + n > chan->size)) {
+		chan->send_tail = load_acquire(chan->recv_head_wb);
+		n = min(n, chan->size - head + chan->send_tail);
+	}
+	if (unlikely(n == 0))
+		return 0;
+
+	/* fill in every slot but the first, which makes the burst visible */
+	for (i = 1; i < n; i++) {
+		assert(!(msgs[i].cmd & LRPC_DONE_PARITY));
+		dst = &chan->tbl[(head + i) & (chan->size - 1)];
+		cmd = msgs[i].cmd;
+		cmd |= ((head + i) & chan->size) ? 0 : LRPC_DONE_PARITY;
+		dst->payload = msgs[i].payload;
+		ACCESS_ONCE(dst->cmd) = cmd;
+	}
+
+	assert(!(msgs[0].cmd & LRPC_DONE_PARITY));
+	dst = &chan->tbl[head & (chan->size - 1)];
+	cmd = msgs[0].cmd | ((head & chan->size) ? 0 : LRPC_DONE_PARITY);
+	dst->payload = msgs[0].payload;
+	store_release(&dst->cmd, cmd);
+
+	chan->send_head = head + n;
+	return n;
+}
+
 /**
  * lrpc_get_cached_send_window - retrieves the last known number of slots
  * available for sending
@@ -118,6 +174,15 @@ struct lrpc_chan_in {
 	uint32_t	size;
 };
 
+/* prefetches the line after @head if @head starts a new line of messages */
+static inline void lrpc_prefetch_next_line(struct lrpc_chan_in *chan,
+					   uint32_t head)
+{
+	if ((head & (LRPC_MSGS_PER_LINE - 1)) == 0)
+		prefetch(&chan->tbl[(head + LRPC_MSGS_PER_LINE) &
+				    (chan->size - 1)]);
+}
+
 /**
  * lrpc_recv - receives a message on the channel
  * @chan: the ingress channel
@@ -138,6 +203,7 @@ static inline bool lrpc_recv(struct lrpc_chan_in *chan, uint64_t *cmd_out,
         if ((cmd & LRPC_DONE_PARITY) != parity)
 		return false;
 	chan->recv_head++;
+	lrpc_prefetch_next_line(chan, chan->recv_head);
 
 	*cmd_out = cmd & LRPC_CMD_MASK;
 	*payload_out = m->payload;
@@ -145,6 +211,74 @@ static inline bool lrpc_recv(struct lrpc_chan_in *chan, uint64_t *cmd_out,
 	return true;
 }
 
+/**
+ * lrpc_peek_burst - looks at several messages without receiving them
+ * @chan: the ingress channel
+ * @msgs: an array to store the messages
+ * @n: the maximum number of messages to look at
+ *
+ * Call lrpc_recv_commit() afterward to receive some or all of the messages.
+ *
+ * Returns the number of messages stored in @msgs.
+ */
+static inline unsigned int lrpc_peek_burst(struct lrpc_chan_in *chan,
+					   struct lrpc_msg *msgs,
+					   unsigned int n)
+{
+	struct lrpc_msg *m;
+	uint32_t head = chan->recv_head;
+	uint64_t parity, cmd;
+	unsigned int i;
+
+	for (i = 0; i < n; i++, head++) {
+		m = &chan->tbl[head & (chan->size - 1)];
+		parity = (head & chan->size) ? 0 : LRPC_DONE_PARITY;
+		cmd = load_acquire(&m->cmd);
+		if ((cmd & LRPC_DONE_PARITY) != parity)
+			break;
+
+		msgs[i].cmd = cmd & LRPC_CMD_MASK;
+		msgs[i].payload = m->payload;
+	}
+
+	return i;
+}
+
+/**
+ * lrpc_recv_commit - receives messages returned by lrpc_peek_burst()
+ * @chan: the ingress channel
+ * @n: the number of messages to receive
+ *
+ * The sender is told about all @n slots with a single update.
+ */
+static inline void lrpc_recv_commit(struct lrpc_chan_in *chan, unsigned int n)
+{
+	if (n == 0)
+		return;
+
+	chan->recv_head += n;
+	lrpc_prefetch_next_line(chan, chan->recv_head & ~(LRPC_MSGS_PER_LINE - 1));
+	store_release(chan->recv_head_wb, chan->recv_head);
+}
+
+/**
+ * lrpc_recv_burst - receives several messages on the channel
+ * @chan: the ingress channel
+ * @msgs: an array to store the received messages
+ * @n: the maximum number of messages to receive
+ *
+ * Returns the number of messages received, or 0 if the channel is empty.
+ */
+static inline unsigned int lrpc_recv_burst(struct lrpc_chan_in *chan,
+					   struct lrpc_msg *msgs,
+					   unsigned int n)
+{
+	unsigned int nr = lrpc_peek_burst(chan, msgs, n);
+
+	lrpc_recv_commit(chan, nr);
+	return nr;
+}
+
 /**
  * lrpc_empty - returns true if the channel has no available messages
  * @chan: the ingress channel
@@ -157,5 +291,46 @@ static inline bool lrpc_empty(struct lrpc_chan_in *chan)
 	return (ACCESS_ONCE(m->cmd) & LRPC_DONE_PARITY) != parity;
 }
 
+/**
+ * lrpc_has_more_than - returns true if more than @n messages are available
+ * @chan: the ingress channel
+ * @n: the number of messages, which must be less than the channel's size
+ *
+ * Only a hint, since a burst may become visible out of order.
+ */
+static inline bool lrpc_has_more_than(struct lrpc_chan_in *chan,
+				      unsigned int n)
+{
+	uint32_t head = chan->recv_head + n;
+	struct lrpc_msg *m = &chan->tbl[head & (chan->size - 1)];
+	uint64_t parity = (head & chan->size) ? 0 : LRPC_DONE_PARITY;
+
+	return (ACCESS_ONCE(m->cmd) & LRPC_DONE_PARITY) == parity;
+}
+
+/**
+ * lrpc_next_cmd - gets the command word the next message will be written to
+ * @chan: the ingress channel
+ * @parity: set to the parity that marks the word as written
+ *
+ * Lets a poller keep many channels' next slots in a compact array and check
+ * them with lrpc_cmd_ready(). Only valid until the channel receives again.
+ */
+static inline uint64_t *lrpc_next_cmd(struct lrpc_chan_in *chan, bool *parity)
+{
+	*parity = !(chan->recv_head & chan->size);
+	return &chan->tbl[chan->recv_head & (chan->size - 1)].cmd;
+}
+
+/**
+ * lrpc_cmd_ready - returns true if a message was written to a command word
+ * @cmd: the word, from lrpc_next_cmd()
+ * @parity: its parity, from lrpc_next_cmd()
+ */
+static inline bool lrpc_cmd_ready(const uint64_t *cmd, bool parity)
+{
+	return !!(ACCESS_ONCE(*cmd) & LRPC_DONE_PARITY) == parity;
+}
+
 extern int lrpc_init_in(struct lrpc_chan_in *chan, struct lrpc_msg *tbl,
 			unsigned int size, uint32_t *recv_head_wb);
@@ -44,13 +44,29 @@ typedef unsigned long virtaddr_t; /* virtual addresses */
 
 typedef unsigned int mem_key_t;
 
+extern uint64_t mem_mapped_4kb_bytes;
+extern uint64_t mem_mapped_2mb_bytes;
+extern uint64_t mem_mapped_1gb_bytes;
+extern uint64_t mem_map_fallbacks;
+
+/* the smallest range worth handing to its own pre-faulting thread */
+#define MEM_PREFAULT_MIN_CHUNK	(256 * 1024 * 1024)
+extern unsigned int mem_prefault_threads;
+
 extern void *mem_map_anom(void *base, size_t len, size_t pgsize, int node);
+extern void *mem_map_anom_fallback(void *base, size_t len, size_t pgsize,
+				   size_t min_pgsize, int node,
+				   size_t *pgsize_out);
 extern void *mem_map_file(void *base, size_t len, int fd, off_t offset);
 extern void *mem_map_shm(mem_key_t key, void *base, size_t len,
 			 size_t pgsize, bool exclusive);
+extern void *mem_map_shm_fallback(mem_key_t key, void *base, size_t len,
+				  size_t pgsize, size_t min_pgsize,
+				  bool exclusive, size_t *pgsize_out);
 extern int mem_unmap_shm(void *base);
 extern int mem_lookup_page_phys_addrs(void *addr, size_t len, size_t pgsize,
 				      physaddr_t *maddrs);
+extern int mem_lookup_page_size(void *addr, size_t *pgsize);
 
 static inline int
 mem_lookup_page_phys_addr(void *addr, size_t pgsize, physaddr_t *paddr)
@@ -7,8 +7,45 @@
 #include <base/stddef.h>
 #include <base/tcache.h>
 
+/*
+ * A bounded lock-free ring of items that any number of threads can enqueue to
+ * and dequeue from concurrently. Producers and consumers each reserve a range
+ * of slots with a compare-and-swap on their head, then publish it by advancing
+ * their tail in order.
+ */
+struct mempool_ring {
+	uint32_t		size;
+	uint32_t		mask;
+
+	uint32_t		prod_head __aligned(CACHE_LINE_SIZE);
+	uint32_t		prod_tail;
+
+	uint32_t		cons_head __aligned(CACHE_LINE_SIZE);
+	uint32_t		cons_tail;
+
+	void			*slots[] __aligned(CACHE_LINE_SIZE);
+};
+
+extern size_t mempool_ring_bytes(unsigned int count);
+extern void mempool_ring_init(struct mempool_ring *r, unsigned int count);
+extern int mempool_ring_enqueue(struct mempool_ring *r, void * const *items,
+				unsigned int n);
+extern int mempool_ring_dequeue(struct mempool_ring *r, void **items,
+				unsigned int n);
+
+/**
+ * mempool_ring_count - returns the number of items in the ring
+ * @r: the ring
+ */
+static inline unsigned int mempool_ring_count(const struct mempool_ring *r)
+{
+	return ACCESS_ONCE(r->prod_tail) - ACCESS_ONCE(r->cons_tail);
+}
+
 struct mempool {
 	void			**free_items;
+	/* if set, items are kept in this ring instead of @free_items */
+	struct mempool_ring	*ring;
 	size_t			allocated;
 	size_t			capacity;
 	void			*buf;
@@ -29,11 +66,15 @@ static inline void __mempool_free_debug_check(struct mempool *m, void *item) {}
  * mempool_alloc - allocates an item from the pool
  * @m: the memory pool to allocate from
  *
+ * The caller must serialize access to the pool, and the pool must not have
+ * been created with mempool_create_mpmc().
+ *
  * Returns an item, or NULL if the pool is empty.
  */
 static inline void *mempool_alloc(struct mempool *m)
 {
 	void *item;
+	assert(!m->ring);
 	if (unlikely(m->allocated >= m->capacity))
 		return NULL;
 	item = m->free_items[m->allocated++];
@@ -48,6 +89,7 @@ static inline void *mempool_alloc(struct mempool *m)
  */
 static inline void mempool_free(struct mempool *m, void *item)
 {
+	assert(!m->ring);
 	__mempool_free_debug_check(m, item);
 	m->free_items[--m->allocated] = item;
 	assert(m->allocated <= m->capacity); /* could have overflowed */
@@ -55,6 +97,8 @@ static inline void mempool_free(struct mempool *m, void *item)
 
 extern int mempool_create(struct mempool *m, void *buf, size_t len,
 			  size_t pgsize, size_t item_len);
+extern int mempool_create_mpmc(struct mempool *m, void *buf, size_t len,
+			       size_t pgsize, size_t item_len);
 extern void mempool_destroy(struct mempool *m);
 
 extern struct tcache *mempool_create_tcache(struct mempool *m, const char *name,
@@ -206,6 +206,19 @@ extern void *page_zalloc_addr(size_t pgsize) __page_malloc;
 extern void page_put_addr(void *addr);
 extern void page_release(struct kref *ref);
 
+/* free large pages stay mapped for this long (0 means unmap immediately) */
+extern uint64_t page_reclaim_idle_us;
+/* the number of free large pages per NUMA node that are never unmapped */
+extern uint64_t page_reclaim_watermark;
+/* the total bytes of large pages unmapped by page_reclaim() */
+extern uint64_t page_reclaimed_bytes;
+
+extern void page_reclaim_collect(struct list_head *victims);
+extern size_t page_reclaim_unmap(struct list_head *victims);
+extern void page_reclaim_finish(struct list_head *victims);
+extern size_t page_reclaim(void);
+extern size_t page_cached_bytes(void);
+
 /**
  * page_get - increments the page reference count
  * @pg: the page to reference
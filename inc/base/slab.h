@@ -32,6 +32,9 @@ struct slab_node {
 	int			offset;
 	int			flags;
 	int			nr_elems;
+	/* the next and the number of distinct page colors */
+	int			color;
+	int			nr_colors;
 	spinlock_t		page_lock;
 
 	/* slab pages */
@@ -55,6 +58,11 @@ struct slab {
 #define SLAB_FLAG_FALSE_OKAY	BIT(1)
 /* managing 4kb pages (internal use only) */
 #define SLAB_FLAG_PAGES		BIT(2)
+/* items start on cache line boundaries (overrides SLAB_FLAG_FALSE_OKAY) */
+#define SLAB_FLAG_CACHE_ALIGNED	BIT(3)
+
+/* page colors are spaced this far apart */
+#define SLAB_COLOR_ALIGN	CACHE_LINE_SIZE
 
 extern int slab_create(struct slab *s, const char *name, size_t size, int flags);
 extern void slab_destroy(struct slab *s);
@@ -8,8 +8,12 @@
 
 #define SYSFS_PCI_PATH		"/sys/bus/pci/devices"
 #define SYSFS_CPU_TOPOLOGY_PATH	"/sys/devices/system/cpu/cpu%d/topology"
+#define SYSFS_CPU_CACHE_PATH	"/sys/devices/system/cpu/cpu%d/cache"
 #define SYSFS_NODE_PATH		"/sys/devices/system/node/node%d"
 
 extern int sysfs_parse_val(const char *path, uint64_t *val_out);
 extern int sysfs_parse_bitlist(const char *path, unsigned long *bits,
 			       int nbits);
+extern int sysfs_parse_size(const char *path, uint64_t *size_out);
+extern int sysfs_parse_vals(const char *path, uint64_t *vals, int n);
+extern int sysfs_parse_str(const char *path, char *buf, size_t len);
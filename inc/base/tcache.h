@@ -8,9 +8,14 @@
 #include <base/lock.h>
 #include <base/list.h>
 #include <base/atomic.h>
+#include <base/limits.h>
+#include <base/page.h>
+#include <base/thread.h>
 
 #define TCACHE_MAX_MAG_SIZE	64
 #define TCACHE_DEFAULT_MAG_SIZE	8
+/* magazines grow to at most this multiple of their initial size */
+#define TCACHE_MAX_MAG_GROWTH	4
 
 struct tcache;
 
@@ -32,23 +37,64 @@ struct tcache_perthread {
 	unsigned int		capacity;
 	struct tcache_hdr	*loaded;
 	struct tcache_hdr	*previous;
+
+	/* depot trips since @trips_us, flushed to @tc periodically */
+	unsigned int		trips;
+	unsigned int		hits;
+	unsigned int		misses;
+	unsigned int		frees;
+	uint64_t		trips_us;
+
+	/* the local NUMA node, and whether items must return to their own */
+	unsigned int		node;
+	bool			numa;
+	unsigned int		remotes;
+
+	/* partial magazines of items that belong to other NUMA nodes */
+	struct tcache_hdr	*remote[NNUMA];
+	unsigned int		remote_nr[NNUMA];
 };
 
+/* a per-NUMA node pool of full magazines, updated with cmpxchg16b() */
+struct tcache_depot {
+	struct tcache_hdr	*head;
+	union {
+		struct {
+			/* incremented on every update to prevent ABA */
+			uint32_t	tag;
+			/* the number of items in each magazine */
+			uint32_t	mag_size;
+		};
+		uint64_t		word;
+	};
+	/* serializes removals, so a popper never reads a freed magazine */
+	spinlock_t		lock;
+} __aligned(CACHE_LINE_SIZE);
+
 struct tcache {
 	const char		*name;
 	const struct tcache_ops	*ops;
 	size_t			item_size;
-	atomic64_t		mags_allocated;
+	atomic64_t		items_allocated;
 	struct list_node	link;
-
-	unsigned int		mag_size;
-	spinlock_t		lock;
-	struct tcache_hdr	*shared_mags;
+	unsigned int		max_mag_size;
 	unsigned long		data;
+	/* items come from the page allocator, so addr_to_numa_node() works */
+	bool			numa;
+
+	/* depot statistics */
+	atomic64_t		depot_hits;
+	atomic64_t		depot_misses;
+	atomic64_t		depot_frees;
+	atomic64_t		depot_resizes;
+	atomic64_t		remote_frees;
+
+	struct tcache_depot	depots[NNUMA];
 };
 
 extern void *__tcache_alloc(struct tcache_perthread *ltc);
 extern void __tcache_free(struct tcache_perthread *ltc, void *item);
+extern void __tcache_free_remote(struct tcache_perthread *ltc, void *item);
 
 /**
  * tcache_alloc - allocates an item from the thread cache
@@ -77,6 +123,8 @@ static inline void tcache_free(struct tcache_perthread *ltc, void *item)
 {
 	struct tcache_hdr *hdr = (struct tcache_hdr *)item;
 
+	if (ltc->numa && unlikely(addr_to_numa_node(item) != ltc->node))
+		return __tcache_free_remote(ltc, item);
 	if (ltc->rounds >= ltc->capacity)
 		return __tcache_free(ltc, item);
 
@@ -91,4 +139,5 @@ extern struct tcache *tcache_create(const char *name,
 extern void tcache_init_perthread(struct tcache *tc,
 				  struct tcache_perthread *ltc);
 extern void tcache_reclaim(struct tcache *tc);
+extern void tcache_reclaim_all(void);
 extern void tcache_print_usage(void);
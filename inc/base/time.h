@@ -5,24 +5,88 @@
 #pragma once
 
 #include <base/types.h>
+#include <asm/atomic.h>
 #include <asm/ops.h>
 
 #define ONE_SECOND	1000000
 #define ONE_MS		1000
 #define ONE_US		1
 
+/* cycles per microsecond, rounded (see time_clock for exact conversions) */
 extern int cycles_per_us;
 extern uint64_t start_tsc; 
 
+/* the fixed-point scale of time_clock.ns_mult */
+#define TIME_SHIFT	32
+
+/*
+ * Converts the TSC to nanoseconds since start_tsc as
+ * base_ns + (tsc - base_tsc) * ns_mult >> TIME_SHIFT. time_recalibrate()
+ * moves the base forward whenever it changes ns_mult, so the clock never
+ * steps. @seq is odd while the fields are being updated.
+ */
+struct time_clock {
+	uint32_t	seq;
+	uint64_t	base_tsc;
+	uint64_t	base_ns;
+	uint64_t	ns_mult;
+};
+
+extern struct time_clock time_clock;
+
+static inline uint64_t __time_tsc_to_ns(const struct time_clock *c,
+					uint64_t tsc)
+{
+	/* another core's TSC may be slightly behind the base */
+	if (unlikely((int64_t)(tsc - c->base_tsc) < 0))
+		return c->base_ns;
+
+	return c->base_ns + (uint64_t)(((unsigned __int128)(tsc - c->base_tsc) *
+				       c->ns_mult) >> TIME_SHIFT);
+}
+
+/**
+ * tsc_to_ns - converts a TSC value to nanoseconds since the process started
+ * @tsc: the TSC value, from rdtsc()
+ */
+static inline uint64_t tsc_to_ns(uint64_t tsc)
+{
+	uint64_t ns;
+	uint32_t seq;
+
+	do {
+		seq = ACCESS_ONCE(time_clock.seq);
+		rmb();
+		ns = __time_tsc_to_ns(&time_clock, tsc);
+		rmb();
+	} while (unlikely((seq & 1) || seq != ACCESS_ONCE(time_clock.seq)));
+
+	return ns;
+}
+
+/**
+ * nanotime - gets the number of nanoseconds since the process started
+ * This routine is very inexpensive, even compared to clock_gettime().
+ */
+static inline uint64_t nanotime(void)
+{
+	return tsc_to_ns(rdtsc());
+}
+
 /**
  * microtime - gets the number of microseconds since the process started
  * This routine is very inexpensive, even compared to clock_gettime().
  */
 static inline uint64_t microtime(void)
 {
-	return (rdtsc() - start_tsc) / cycles_per_us;
+	return nanotime() / 1000;
 }
 
+/* how often time_recalibrate() should run (us) */
+#define TIME_RECALIBRATE_US	ONE_SECOND
+
+extern uint64_t __microtime(void);
+extern void time_recalibrate(void);
 extern void __time_delay_us(uint64_t us);
 
 /**
@@ -48,6 +48,14 @@ typedef struct {
 	volatile int locked;
 } spinlock_t;
 
+typedef union {
+	struct {
+		volatile uint16_t owner;	/* the ticket being served */
+		volatile uint16_t next;		/* the next ticket to hand out */
+	};
+	volatile uint32_t val;
+} ticketlock_t;
+
 typedef struct {
 	volatile int cnt;
 } atomic_t;
@@ -13,11 +13,36 @@
 /* The abstract namespace path for the control socket. */
 #define CONTROL_SOCK_PATH	"\0/control/iokernel.sock"
 
+/*
+ * A runtime may reserve one of the iokernel's pre-registered shm regions by
+ * sending CONTROL_PREREG_KEY and the length it needs in place of its own key
+ * and length. The iokernel replies with the mem_key_t of the reserved region,
+ * or 0 if none is free, and the runtime then registers with that key.
+ */
+#define CONTROL_PREREG_KEY	((mem_key_t)0x70726567) /* "preg" */
+/* the keys of the pre-registered regions, one per slot */
+#define CONTROL_PREREG_KEY_BASE	((mem_key_t)0x696f6b00)
+
+/*
+ * A tool owned by the iokernel's user may upgrade it in place by sending
+ * CONTROL_HANDOVER_KEY and a zero length. The iokernel parks every runtime and
+ * re-executes its binary, which takes the runtimes over. It replies with an
+ * int32_t, 0 right before the exec or a negative errno if it can't hand over.
+ */
+#define CONTROL_HANDOVER_KEY	((mem_key_t)0x686e646f) /* "hndo" */
+
 /* describes a queue */
 struct q_ptrs {
 	uint32_t rxq_wb; /* must be first */
-	uint32_t rq_head;
+	/* kept off the line of @rxq_wb, which is written far more often */
+	uint32_t rq_head __aligned(CACHE_LINE_SIZE);
 	uint32_t rq_tail;
+	/* set by the iokernel to ask the kthread to park, cleared on park */
+	uint32_t preempt_req __aligned(CACHE_LINE_SIZE);
+	/* the RX completions the iokernel has consumed */
+	uint32_t rxc_tail;
+	/* the RX completions the runtime has produced */
+	uint32_t rxc_head __aligned(CACHE_LINE_SIZE);
 };
 
 /* describes a runtime kernel thread */
@@ -26,6 +51,7 @@ struct thread_spec {
 	struct queue_spec	txpktq;
 	struct queue_spec	txcmdq;
 	shmptr_t		q_ptrs;
+	shmptr_t		rx_completions;
 	pid_t			tid;
 	int32_t			park_efd;
 };
@@ -34,15 +60,35 @@ enum {
 	SCHED_PRIORITY_SYSTEM = 0, /* high priority, system-level services */
 	SCHED_PRIORITY_NORMAL,     /* normal priority, typical tasks */
 	SCHED_PRIORITY_BATCH,      /* low priority, batch processing */
+	SCHED_PRIORITY_NR,
 };
 
+enum {
+	SCHED_HT_SHARE = 0,	/* hyperthreads may be shared with any proc */
+	SCHED_HT_PAIR,		/* prefer both hyperthreads of a physical core */
+	SCHED_HT_EXCLUSIVE,	/* never share a physical core with another proc */
+	SCHED_HT_NR,
+};
+
+/* the largest fair-share weight a runtime may request */
+#define SCHED_WEIGHT_MAX	1000
+/* the highest egress rate limit a runtime may request (Mbits/s) */
+#define SCHED_TX_RATE_MAX_MBPS	1000000
+
 /* describes scheduler options */
 struct sched_spec {
 	unsigned int		priority;
+	/* the initial core limit, raised later with TXCMD_CORE_LIMIT */
 	unsigned int		max_cores;
 	unsigned int		guaranteed_cores;
 	unsigned int		congestion_latency_us;
 	unsigned int		scaleout_latency_us;
+	/* share of burstable cores relative to procs of the same priority */
+	unsigned int		weight;
+	/* how cores may be shared with other procs (SCHED_HT_*) */
+	unsigned int		ht_policy;
+	/* the egress rate limit (Mbits/s), or 0 for no limit */
+	unsigned int		tx_rate_mbps;
 };
 
 #define CONTROL_HDR_MAGIC	0x696f6b3a /* "iok:" */
@@ -53,6 +99,7 @@ struct control_hdr {
 	unsigned int		thread_count;
 	unsigned long		egress_buf_count;
 	struct eth_addr		mac;
+	uint16_t		mtu;
 	struct sched_spec	sched_cfg;
 	struct thread_spec	threads[];
 };
@@ -0,0 +1,53 @@
+/*
+ * pcap.h - the format of the iokernel's packet capture ring
+ *
+ * With capture on, the iokernel copies the first bytes of packets it receives
+ * from the NIC and sends for runtimes into a ring, optionally only those that
+ * match a classic BPF filter, and only one in every N of those. A client can
+ * dump the ring by connecting to CONTROL_SOCK_PATH and sending
+ * CONTROL_PCAP_KEY followed by a zero shm length, instead of registering a
+ * runtime. The iokernel replies with a struct ikpcap_hdr, then @nr_records
+ * struct ikpcap_rec, oldest first.
+ */
+
+#pragma once
+
+#include <base/types.h>
+#include <base/mem.h>
+
+/* the shm key that requests a capture dump over the control socket */
+#define CONTROL_PCAP_KEY	((mem_key_t)0x70636170) /* "pcap" */
+
+#define IKPCAP_MAGIC		0x6b70636170000001ul
+#define IKPCAP_RING_SIZE	16384 /* must be a power of two */
+/* the most bytes kept of each packet */
+#define IKPCAP_MAX_SNAPLEN	240
+/* the most instructions in a capture filter (as in Linux's BPF_MAXINSNS) */
+#define IKPCAP_MAX_INSNS	4096
+
+enum {
+	IKPCAP_DIR_RX = 0,	/* received from the NIC */
+	IKPCAP_DIR_TX,		/* sent by a runtime */
+};
+
+struct ikpcap_rec {
+	uint64_t	tsc;
+	/* the length of the packet, and of the part that was kept */
+	uint32_t	wire_len;
+	uint16_t	cap_len;
+	uint8_t		dir;
+	uint8_t		pad;
+	uint8_t		data[IKPCAP_MAX_SNAPLEN];
+};
+
+struct ikpcap_hdr {
+	uint64_t	magic;
+	uint64_t	cycles_per_us;
+	/* the TSC and the time of day (ns) when the dump was taken */
+	uint64_t	now_tsc;
+	uint64_t	now_ns;
+	uint32_t	snaplen;
+	uint32_t	nr_records;
+	/* records older than the ring that were overwritten */
+	uint64_t	nr_lost;
+};
@@ -13,18 +13,47 @@ struct rx_net_hdr {
 	unsigned int rss_hash;	/* the HW RSS 5-tuple hash */
 	unsigned int csum_type; /* the type of checksum */
 	unsigned int csum;	/* 16-bit one's complement */
+	uint64_t     rx_tsc;	/* when the iokernel polled it (TSC) */
+	uint64_t     nic_ts;	/* the NIC's RX timestamp (its clock), or 0 */
+	uint64_t     enq_tsc;	/* when the iokernel queued it to the runtime */
 	char	     payload[];	/* packet data */
 };
 
 /* preamble to egress network packets */
 struct tx_net_hdr {
 	unsigned long completion_data; /* a tag to help complete the request */
-	unsigned int len;	/* the length of the payload */
-	unsigned int olflags;	/* offload flags */
-	unsigned short pad;	/* because of 14 byte ethernet header */
+	uint64_t     tx_tsc;	/* when the runtime queued it (TSC) */
+	unsigned int len;	/* the length of the payload (first segment) */
+	unsigned short olflags;	/* offload flags */
+	unsigned short nr_segs;	/* segments after the first, see below */
+	unsigned short tso_segsz; /* TSO payload size, also pads the 14 byte
+				     ethernet header */
 	char	     payload[];	/* packet data */
 } __attribute__((__packed__));
 
+/*
+ * A multi-segment packet continues after the @len bytes of @payload with each
+ * segment in a table of @nr_segs entries, which is stored right after
+ * @payload. Each entry points into the runtime's egress region.
+ */
+struct tx_net_seg {
+	unsigned long	data;	/* the segment's shmptr_t in the region */
+	unsigned int	len;	/* the length of the segment */
+	unsigned int	pad;
+} __attribute__((__packed__));
+
+/* the most segments a packet may have after the first */
+#define TX_NET_MAX_SEGS		7
+
+/**
+ * tx_net_hdr_segs - returns the segment table of an egress packet
+ * @hdr: the packet's preamble
+ */
+static inline struct tx_net_seg *tx_net_hdr_segs(const struct tx_net_hdr *hdr)
+{
+	return (struct tx_net_seg *)(hdr->payload + hdr->len);
+}
+
 /* possible values for @csum_type above */
 enum {
 	/*
@@ -51,6 +80,9 @@ enum {
 #define OLFLAG_TCP_CHKSUM	BIT(1)	/* enable TCP checksum generation */
 #define OLFLAG_IPV4		BIT(2)  /* indicates the packet is IPv4 */
 #define OLFLAG_IPV6		BIT(3)  /* indicates the packet is IPv6 */
+#define OLFLAG_TCP_TSO		BIT(4)	/* segment TCP payload by @tso_segsz */
+#define OLFLAG_UDP_CHKSUM	BIT(5)	/* enable UDP checksum generation */
+#define OLFLAG_UDP_GSO		BIT(6)	/* segment UDP payload by @tso_segsz */
 
 /*
  * RX queues: IOKERNEL -> RUNTIMES
@@ -83,5 +115,31 @@ enum {
 	TXCMD_NET_COMPLETE = 0,	/* contains rx_net_hdr.completion_data */
 	TXCMD_PARKED,		/* hint to iokernel that kthread is parked */
 	TXCMD_PARKED_LAST,	/* the last undetached kthread is parking */
+	TXCMD_CORE_DEMAND,	/* cores expected to be needed, see below */
+	TXCMD_MCAST_JOIN,	/* subscribe to an IPv4 multicast group */
+	TXCMD_MCAST_LEAVE,	/* unsubscribe from an IPv4 multicast group */
+	TXCMD_CORE_LIMIT,	/* the most cores the runtime may be granted */
+	TXCMD_FLOW_STEER,	/* deliver the flow with this RSS hash here */
+	TXCMD_FLOW_ADOPT,	/* deliver the flows of this detached kthread here */
 	TXCMD_NR,		/* number of commands */
 };
+
+/*
+ * RX completion rings: RUNTIMES -> IOKERNEL
+ * Each kthread returns ingress buffers by writing their completion_data to a
+ * ring in shared memory and advancing q_ptrs.rxc_head in batches, which the
+ * iokernel polls. TXCMD_NET_COMPLETE is only used if the ring is full.
+ */
+#define RX_COMPLETION_RING_SIZE	4096 /* must be a power of two */
+
+/* the payload of TXCMD_CORE_DEMAND: a core count and a duration (us) */
+#define TXCMD_CORE_DEMAND_PAYLOAD(nr, us) \
+	(((unsigned long)(us) << 32) | (uint32_t)(nr))
+#define TXCMD_CORE_DEMAND_NR(payload)	((uint32_t)(payload))
+#define TXCMD_CORE_DEMAND_US(payload)	((uint32_t)((payload) >> 32))
+
+/*
+ * The payload of TXCMD_MCAST_JOIN and TXCMD_MCAST_LEAVE is the group address
+ * (in native byte order). Memberships are per runtime, not per kthread, and
+ * are dropped when the runtime exits.
+ */
@@ -0,0 +1,51 @@
+/*
+ * stat.h - the format of the iokernel's counters
+ *
+ * The iokernel's dataplane counters are always kept. A client can read them
+ * by connecting to CONTROL_SOCK_PATH and sending CONTROL_STATS_KEY followed
+ * by a zero shm length, instead of registering a runtime. The iokernel
+ * replies with a struct ikstat_hdr, then @nr_counters struct ikstat_counter,
+ * then @nr_procs struct ikstat_proc. Every counter is a running total since
+ * the iokernel (or, for a proc, the runtime) started.
+ */
+
+#pragma once
+
+#include <base/types.h>
+#include <base/mem.h>
+
+/* the shm key that requests the counters over the control socket */
+#define CONTROL_STATS_KEY	((mem_key_t)0x73746174) /* "stat" */
+
+#define IKSTAT_MAGIC		0x6b73746174000001ul
+#define IKSTAT_NAME_LEN		32
+
+struct ikstat_hdr {
+	uint64_t	magic;
+	uint64_t	uptime_us;
+	uint32_t	nr_counters;
+	uint32_t	nr_procs;
+};
+
+struct ikstat_counter {
+	char		name[IKSTAT_NAME_LEN];
+	uint64_t	val;
+};
+
+/* the counters the dataplane keeps for each proc */
+struct ikstat_proc_counters {
+	uint64_t	rx_pkts;	/* packets delivered to the runtime */
+	uint64_t	rx_bytes;
+	uint64_t	rx_drops;	/* over quota, or the RX queue was full */
+	uint64_t	tx_pkts;	/* packets sent by the runtime */
+	uint64_t	tx_bytes;
+	uint64_t	grants;		/* cores granted to the runtime */
+	uint64_t	preempts;	/* cores taken away from the runtime */
+};
+
+struct ikstat_proc {
+	uint64_t	uniqid;
+	int32_t		pid;
+	uint32_t	pad;
+	struct ikstat_proc_counters c;
+};
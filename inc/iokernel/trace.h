@@ -0,0 +1,84 @@
+/*
+ * trace.h - the format of the iokernel's core allocation trace
+ *
+ * The iokernel records every core allocation decision in a ring. A client can
+ * dump it by connecting to CONTROL_SOCK_PATH and sending CONTROL_TRACE_KEY
+ * followed by a zero shm length, instead of registering a runtime. The
+ * iokernel replies with a struct trace_hdr, then @nr_procs struct trace_proc,
+ * then @nr_entries struct trace_entry, oldest first.
+ */
+
+#pragma once
+
+#include <base/types.h>
+#include <base/mem.h>
+
+/* the shm key that requests a trace dump over the control socket */
+#define CONTROL_TRACE_KEY	((mem_key_t)0x74726163) /* "trac" */
+
+#define TRACE_MAGIC		0x6b74726365000001ul
+#define TRACE_RING_SIZE		65536 /* must be a power of two */
+
+enum {
+	TRACE_GRANT = 0,	/* a core was chosen for a proc */
+	TRACE_PREEMPT,		/* a kthread was asked to give up its core */
+	TRACE_PARK,		/* a kthread gave up its core */
+	TRACE_WAKE,		/* a kthread was woken on a core */
+	TRACE_NR,
+};
+
+/* reasons for TRACE_GRANT */
+enum {
+	TRACE_GRANT_LAUNCH = 0,	/* the proc's first core */
+	TRACE_GRANT_CONGESTED,	/* the proc is below its guarantee */
+	TRACE_GRANT_BURST,	/* the proc is overloaded and may burst */
+	TRACE_GRANT_RX_BACKLOG,	/* a RX queue crossed its depth threshold */
+	TRACE_GRANT_RX_WAKE,	/* a packet arrived for a proc with no cores */
+	TRACE_GRANT_DEMAND,	/* the runtime asked for cores in advance */
+};
+
+/* reasons for TRACE_PREEMPT */
+enum {
+	TRACE_PREEMPT_REQUEST = 0, /* the preemption flag was set */
+	TRACE_PREEMPT_SIGNAL,	   /* the kthread was too slow, so signaled */
+};
+
+/* reasons for TRACE_PARK */
+enum {
+	TRACE_PARK_IDLE = 0,	/* the runtime had no more work */
+	TRACE_PARK_PREEMPTED,	/* the kthread gave way to a preemption */
+	TRACE_PARK_FORCED,	/* the proc is exiting */
+	TRACE_PARK_RACE,	/* packets arrived, so the kthread stays awake */
+};
+
+/* reasons for TRACE_WAKE */
+enum {
+	TRACE_WAKE_IDLE = 0,	/* the core was idle */
+	TRACE_WAKE_HANDOFF,	/* the core was passed on by a parking kthread */
+};
+
+struct trace_entry {
+	uint64_t	tsc;
+	uint64_t	uniqid;
+	uint16_t	core;
+	uint8_t		event;
+	uint8_t		reason;
+	uint32_t	kthread;
+};
+
+struct trace_hdr {
+	uint64_t	magic;
+	uint64_t	cycles_per_us;
+	uint64_t	start_tsc;
+	uint32_t	nr_procs;
+	uint32_t	nr_entries;
+	/* entries older than the ring that were overwritten */
+	uint64_t	nr_lost;
+};
+
+/* maps a proc's uniqid to its pid, for procs that are still running */
+struct trace_proc {
+	uint64_t	uniqid;
+	int32_t		pid;
+	uint32_t	pad;
+};
@@ -6,6 +6,7 @@
 
 #include <base/stddef.h>
 #include <net/ip.h>
+#include <net/ip6.h>
 
 /*
  * SPDX-License-Identifier: BSD-3-Clause
@@ -77,6 +78,11 @@ __raw_cksum_reduce(uint32_t sum)
 	return (uint16_t)sum;
 }
 
+/* buffers at least this long are summed with SIMD, see net/chksum.c */
+#define RAW_CKSUM_LARGE_LEN	256
+
+extern uint32_t __raw_cksum_large(const void *buf, size_t len, uint32_t sum);
+
 /**
  * Process the non-complemented checksum of a buffer.
  *
@@ -92,7 +98,10 @@ raw_cksum(const void *buf, size_t len)
 {
 	uint32_t sum;
 
-	sum = __raw_cksum(buf, len, 0);
+	if (len >= RAW_CKSUM_LARGE_LEN)
+		sum = __raw_cksum_large(buf, len, 0);
+	else
+		sum = __raw_cksum(buf, len, 0);
 	return __raw_cksum_reduce(sum);
 }
 
@@ -140,3 +149,83 @@ ipv4_udptcp_cksum(uint8_t proto, uint32_t saddr, uint32_t daddr,
 
 	return (uint16_t)cksum;
 }
+
+/**
+ * Verify the checksum of a TCP or UDP segment received over IPv4.
+ *
+ * @return
+ *   True if the segment, including its checksum field, sums to all ones.
+ */
+static inline bool
+ipv4_udptcp_cksum_ok(uint8_t proto, uint32_t saddr, uint32_t daddr,
+		     uint16_t l4len, const void *l4hdr)
+{
+	uint32_t cksum;
+
+	cksum = raw_cksum(l4hdr, l4len);
+	cksum += ipv4_phdr_cksum(proto, saddr, daddr, l4len);
+	cksum = ((cksum & 0xffff0000) >> 16) + (cksum & 0xffff);
+	return cksum == 0xffff;
+}
+
+/**
+ * Process the pseudo-header checksum of an IPv6 header.
+ *
+ * @return
+ *   The non-complemented checksum to set in the L4 header.
+ */
+static inline uint16_t
+ipv6_phdr_cksum(uint8_t proto, const struct ip6_addr *saddr,
+		const struct ip6_addr *daddr, uint32_t l4len)
+{
+	struct ipv6_psd_header {
+		struct ip6_addr saddr; /* IP address of source host. */
+		struct ip6_addr daddr; /* IP address of destination host. */
+		uint32_t len;          /* L4 length. */
+		uint8_t  zero[3];      /* zero. */
+		uint8_t  proto;        /* L4 protocol type. */
+	} psd_hdr;
+
+	psd_hdr.saddr = *saddr;
+	psd_hdr.daddr = *daddr;
+	psd_hdr.len = hton32(l4len);
+	psd_hdr.zero[0] = psd_hdr.zero[1] = psd_hdr.zero[2] = 0;
+	psd_hdr.proto = proto;
+	return raw_cksum(&psd_hdr, sizeof(psd_hdr));
+}
+
+static inline uint16_t
+ipv6_udptcp_cksum(uint8_t proto, const struct ip6_addr *saddr,
+		  const struct ip6_addr *daddr, uint32_t l4len,
+		  const void *l4hdr)
+{
+	uint32_t cksum;
+
+	cksum = raw_cksum(l4hdr, l4len);
+	cksum += ipv6_phdr_cksum(proto, saddr, daddr, l4len);
+	cksum = ((cksum & 0xffff0000) >> 16) + (cksum & 0xffff);
+	cksum = (~cksum) & 0xffff;
+	if (cksum == 0)
+		cksum = 0xffff;
+
+	return (uint16_t)cksum;
+}
+
+/**
+ * Verify the checksum of a TCP, UDP, or ICMPv6 message received over IPv6.
+ *
+ * @return
+ *   True if the message, including its checksum field, sums to all ones.
+ */
+static inline bool
+ipv6_udptcp_cksum_ok(uint8_t proto, const struct ip6_addr *saddr,
+		     const struct ip6_addr *daddr, uint32_t l4len,
+		     const void *l4hdr)
+{
+	uint32_t cksum;
+
+	cksum = raw_cksum(l4hdr, l4len);
+	cksum += ipv6_phdr_cksum(proto, saddr, daddr, l4len);
+	cksum = ((cksum & 0xffff0000) >> 16) + (cksum & 0xffff);
+	return cksum == 0xffff;
+}
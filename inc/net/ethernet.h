@@ -17,6 +17,7 @@
 #define ETH_MAX_LEN		1518
 #define	ETH_MAX_LEN_JUMBO	9018	/* max jumbo frame len, including CRC */
 #define ETH_MTU			1500
+#define ETH_MTU_JUMBO		9000
 
 struct eth_addr {
 	uint8_t addr[ETH_ADDR_LEN];
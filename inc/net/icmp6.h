@@ -0,0 +1,71 @@
+/*
+ * icmp6.h - definitions for ICMPv6 and neighbor discovery
+ *
+ * Per RFC 4443 and RFC 4861.
+ */
+
+#pragma once
+
+#include <base/types.h>
+#include <base/compiler.h>
+#include <net/ethernet.h>
+#include <net/ip6.h>
+
+struct icmp6_hdr {
+	uint8_t		type;
+	uint8_t		code;
+	uint16_t	chksum;
+} __packed;
+
+/* error messages */
+#define ICMP6_DST_UNREACH	1
+#define ICMP6_PACKET_TOO_BIG	2
+#define ICMP6_TIME_EXCEEDED	3
+#define ICMP6_PARAM_PROB	4
+
+/* informational messages */
+#define ICMP6_ECHO_REQUEST	128
+#define ICMP6_ECHO_REPLY	129
+
+/* neighbor discovery */
+#define ND_ROUTER_SOLICIT	133
+#define ND_ROUTER_ADVERT	134
+#define ND_NEIGHBOR_SOLICIT	135
+#define ND_NEIGHBOR_ADVERT	136
+#define ND_REDIRECT		137
+
+/* every neighbor discovery packet must have this hop limit */
+#define ND_HOP_LIMIT		255
+
+struct icmp6_echo {
+	struct icmp6_hdr	hdr;
+	uint16_t		id;
+	uint16_t		seq;
+} __packed;
+
+/* a neighbor solicitation or advertisement */
+struct nd_neigh_msg {
+	struct icmp6_hdr	hdr;
+	uint32_t		flags;	/* only used by advertisements */
+	struct ip6_addr		target;
+} __packed;
+
+/* flags for advertisements (in network byte order) */
+#define ND_NA_FLAG_ROUTER	hton32(0x80000000)
+#define ND_NA_FLAG_SOLICITED	hton32(0x40000000)
+#define ND_NA_FLAG_OVERRIDE	hton32(0x20000000)
+
+/* options */
+#define ND_OPT_SOURCE_LLADDR	1
+#define ND_OPT_TARGET_LLADDR	2
+
+struct nd_opt_hdr {
+	uint8_t			type;
+	uint8_t			len;	/* in units of 8 bytes */
+} __packed;
+
+/* a source or target link-layer address option for ethernet */
+struct nd_opt_lladdr {
+	struct nd_opt_hdr	hdr;
+	struct eth_addr		addr;
+} __packed;
@@ -0,0 +1,35 @@
+/*
+ * igmp.h - definitions for the Internet Group Management Protocol (IGMP)
+ *
+ * Per RFC 2236 (IGMPv2). Hosts only need to send v2 reports, but v3 queries
+ * must be recognized (RFC 3376).
+ */
+
+#pragma once
+
+#include <base/types.h>
+#include <base/compiler.h>
+
+struct igmp_hdr {
+	uint8_t		type;
+	uint8_t		max_resp;	/* in tenths of a second, queries only */
+	uint16_t	chksum;
+	uint32_t	group;
+} __packed;
+
+/* message types */
+#define IGMP_MEMBERSHIP_QUERY		0x11
+#define IGMP_V1_MEMBERSHIP_REPORT	0x12
+#define IGMP_V2_MEMBERSHIP_REPORT	0x16
+#define IGMP_V2_LEAVE_GROUP		0x17
+#define IGMP_V3_MEMBERSHIP_REPORT	0x22
+
+/* every IGMP packet must have this TTL */
+#define IGMP_TTL			1
+
+/* the router alert option (RFC 2113) that IGMPv2 messages carry */
+struct igmp_ip_opt_ra {
+	uint8_t		type;		/* IPOPT_RA */
+	uint8_t		len;		/* 4 */
+	uint16_t	value;		/* 0, every router examines it */
+} __packed;
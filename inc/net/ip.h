@@ -42,6 +42,7 @@
  * Per RFC 791, September 1981.
  */
 #define	IPVERSION	4
+#define IP_MIN_MTU	576	/* the datagram size every host must accept */
 
 #define MAKE_IP_ADDR(a, b, c, d)			\
 	(((uint32_t) a << 24) | ((uint32_t) b << 16) |	\
@@ -49,6 +50,23 @@
 
 #define IP_ADDR_STR_LEN	16
 
+/* well-known multicast groups */
+#define IP_ADDR_ALL_HOSTS	MAKE_IP_ADDR(224, 0, 0, 1)
+#define IP_ADDR_ALL_ROUTERS	MAKE_IP_ADDR(224, 0, 0, 2)
+#define IP_ADDR_BROADCAST	MAKE_IP_ADDR(255, 255, 255, 255)
+
+/* true if @addr (in native byte order) is a multicast group (224.0.0.0/4) */
+static inline bool ip_addr_is_multicast(uint32_t addr)
+{
+	return (addr >> 28) == 0xe;
+}
+
+/* true if @addr is in 224.0.0.0/24, groups that are never routed */
+static inline bool ip_addr_is_local_multicast(uint32_t addr)
+{
+	return (addr >> 8) == 0xe00000;
+}
+
 extern char *ip_addr_to_str(uint32_t addr, char *str);
 
 /*
@@ -0,0 +1,127 @@
+/*
+ * ip6.h - definitions for internet protocol version 6
+ *
+ * Per RFC 8200. Extension headers aren't supported, so only the fixed header
+ * is defined here.
+ */
+
+#pragma once
+
+#include <string.h>
+
+#include <base/types.h>
+#include <base/compiler.h>
+#include <base/byteorder.h>
+
+#define IP6VERSION		6
+#define IP6_MIN_MTU		1280	/* the link MTU every host must accept */
+#define IP6_DEFAULT_HOPS	64
+
+/* enough for "ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255" */
+#define IP6_ADDR_STR_LEN	46
+
+/* an IPv6 address, always in network byte order */
+struct ip6_addr {
+	union {
+		uint8_t		addr[16];
+		uint32_t	addr32[4];
+	};
+};
+
+/*
+ * Structure of the fixed IPv6 header.
+ */
+struct ip6_hdr {
+	uint32_t	vtc_flow;	/* version, traffic class, flow label */
+	uint16_t	payload_len;	/* length after this header */
+	uint8_t		nexthdr;	/* the next header (the L4 protocol) */
+	uint8_t		hop_limit;
+	struct ip6_addr	saddr;		/* source address */
+	struct ip6_addr	daddr;		/* dest address */
+};
+
+extern char *ip6_addr_to_str(const struct ip6_addr *addr, char *str);
+extern int str_to_ip6_addr(const char *str, struct ip6_addr *addr);
+
+/* ff02::1, every node on the link */
+static const struct ip6_addr ip6_addr_all_nodes = {
+	.addr = { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01 },
+};
+
+static inline uint8_t ip6_hdr_version(const struct ip6_hdr *hdr)
+{
+	return ntoh32(hdr->vtc_flow) >> 28;
+}
+
+static inline uint8_t ip6_hdr_tclass(const struct ip6_hdr *hdr)
+{
+	return (ntoh32(hdr->vtc_flow) >> 20) & 0xff;
+}
+
+/* the vtc_flow field (in network byte order) for a traffic class */
+static inline uint32_t ip6_vtc_flow(uint8_t tclass)
+{
+	return hton32((uint32_t)IP6VERSION << 28 | (uint32_t)tclass << 20);
+}
+
+static inline bool ip6_addr_equal(const struct ip6_addr *a,
+				  const struct ip6_addr *b)
+{
+	return ((a->addr32[0] ^ b->addr32[0]) | (a->addr32[1] ^ b->addr32[1]) |
+		(a->addr32[2] ^ b->addr32[2]) | (a->addr32[3] ^ b->addr32[3]))
+		== 0;
+}
+
+static inline bool ip6_addr_is_zero(const struct ip6_addr *a)
+{
+	return (a->addr32[0] | a->addr32[1] | a->addr32[2] | a->addr32[3]) == 0;
+}
+
+static inline bool ip6_addr_is_multicast(const struct ip6_addr *a)
+{
+	return a->addr[0] == 0xff;
+}
+
+/* fe80::/10 */
+static inline bool ip6_addr_is_linklocal(const struct ip6_addr *a)
+{
+	return a->addr[0] == 0xfe && (a->addr[1] & 0xc0) == 0x80;
+}
+
+/**
+ * ip6_prefix_equal - checks whether two addresses share a prefix
+ * @a: the first address
+ * @b: the second address
+ * @len: the prefix length in bits (0 to 128)
+ */
+static inline bool ip6_prefix_equal(const struct ip6_addr *a,
+				    const struct ip6_addr *b, int len)
+{
+	int bytes = len / 8, bits = len % 8;
+	uint8_t mask;
+
+	if (memcmp(a->addr, b->addr, bytes) != 0)
+		return false;
+	if (!bits)
+		return true;
+	mask = 0xff << (8 - bits);
+	return ((a->addr[bytes] ^ b->addr[bytes]) & mask) == 0;
+}
+
+/**
+ * ip6_solicited_node - computes the solicited-node multicast group
+ * @a: the unicast address
+ * @group: stores ff02::1:ffXX:XXXX, formed from the low 24 bits of @a
+ */
+static inline void ip6_solicited_node(const struct ip6_addr *a,
+				      struct ip6_addr *group)
+{
+	memset(group, 0, sizeof(*group));
+	group->addr[0] = 0xff;
+	group->addr[1] = 0x02;
+	group->addr[11] = 0x01;
+	group->addr[12] = 0xff;
+	group->addr[13] = a->addr[13];
+	group->addr[14] = a->addr[14];
+	group->addr[15] = a->addr[15];
+}
@@ -17,10 +17,13 @@
 
 #define MBUF_DEFAULT_LEN	2048
 #define MBUF_DEFAULT_HEADROOM	128
+#define MBUF_JUMBO_LEN		(16 * 1024) /* buffers when the MTU is > ETH_MTU */
+#define MBUF_TSO_LEN		(64 * 1024) /* egress TCP super-segments */
 
 
 struct mbuf {
 	struct mbuf	*next;	   /* the next mbuf in the mbufq */
+	struct mbuf	*frag;	   /* the next segment of this packet, or NULL */
 	unsigned char	*head;	   /* start of the buffer */
 	unsigned char	*data;	   /* current position within the buffer */
 	unsigned int	head_len;  /* length of the entire buffer from @head */
@@ -32,19 +35,27 @@ struct mbuf {
 		unsigned int	txflags;  /* TX offload flags */
 		unsigned int	rss_hash; /* RSS 5-tuple hash from HW */
 	};
+	uint32_t	rx_enq_cycles; /* from @rx_tsc to queued to the runtime */
+	uint64_t	rx_tsc;	   /* when the iokernel received it (TSC) */
 
 	unsigned short	network_off;	/* the offset of the network header */
 	unsigned short	transport_off;	/* the offset of the transport header */
+	unsigned short	tso_segsz;	/* segment size if OLFLAG_TCP_TSO */
 	unsigned long   release_data;	/* data for the release method */
 	void		(*release)(struct mbuf *m); /* frees the mbuf */
 
 	/* TCP fields */
 	struct list_node link;	    /* list node for RX and TX queues */
-	uint64_t	timestamp;  /* the time the packet was last sent */
+	union {
+		uint64_t timestamp; /* the time the packet was last sent */
+		uint64_t nic_ts;    /* the NIC's RX timestamp, or 0 */
+	};
 	uint32_t	seg_seq;    /* the first seg number */
 	uint32_t	seg_end;    /* the last seg number (noninclusive) */
 	uint8_t		flags;	    /* which flags were set? */
+	bool		sacked;	    /* selectively acknowledged by the peer? */
 	atomic_t	ref;	    /* a reference count for the mbuf */
+	uint32_t	rx_softirq_cycles; /* from @rx_tsc to the RX softirq */
 };
 
 static inline unsigned char *__mbuf_pull(struct mbuf *m, unsigned int len)
@@ -254,15 +265,83 @@ static inline void mbuf_init(struct mbuf *m, unsigned char *head,
 	m->head_len = head_len;
 	m->data = m->head + reserve_len;
 	m->len = 0;
+	m->frag = NULL;
+}
+
+/*
+ * Multi-segment packets: a packet can span a chain of mbufs linked through
+ * @frag, for example a header in one buffer and a zero-copy payload in
+ * another. The first mbuf holds the packet metadata (offload flags, offsets,
+ * the release method), and the others only contribute their data. The chain
+ * is owned by its first mbuf, so mbufs that are shared through a reference
+ * count can't be chained.
+ */
+
+/**
+ * mbuf_for_each_seg - iterates over the segments of a packet
+ * @m: the first mbuf of the packet
+ * @seg: the current segment
+ */
+#define mbuf_for_each_seg(m, seg) \
+	for ((seg) = (m); (seg); (seg) = (seg)->frag)
+
+/**
+ * mbuf_chain - appends a segment to the end of a packet
+ * @m: the first mbuf of the packet
+ * @seg: the segment to append (must not be part of another chain)
+ */
+static inline void mbuf_chain(struct mbuf *m, struct mbuf *seg)
+{
+	while (m->frag)
+		m = m->frag;
+	m->frag = seg;
+	seg->frag = NULL;
+}
+
+/**
+ * mbuf_nr_segs - returns the number of segments in a packet
+ * @m: the first mbuf of the packet
+ */
+static inline unsigned int mbuf_nr_segs(struct mbuf *m)
+{
+	unsigned int nr = 0;
+	struct mbuf *seg;
+
+	mbuf_for_each_seg(m, seg)
+		nr++;
+	return nr;
+}
+
+/**
+ * mbuf_chain_length - returns the data length of a packet, across segments
+ * @m: the first mbuf of the packet
+ */
+static inline unsigned int mbuf_chain_length(struct mbuf *m)
+{
+	unsigned int len = 0;
+	struct mbuf *seg;
+
+	mbuf_for_each_seg(m, seg)
+		len += mbuf_length(seg);
+	return len;
 }
 
 /**
  * mbuf_free - frees an mbuf back to an allocator
  * @m: the mbuf to free
+ *
+ * Frees the rest of the segments too if @m starts a chain.
  */
 static inline void mbuf_free(struct mbuf *m)
 {
-	m->release(m);
+	struct mbuf *frag;
+
+	do {
+		/* the release method may reuse the mbuf */
+		frag = m->frag;
+		m->release(m);
+		m = frag;
+	} while (m);
 }
 
 extern struct mbuf *mbuf_clone(struct mbuf *dst, struct mbuf *src);
@@ -44,3 +44,21 @@ struct tcp_hdr {
 	uint16_t	sum;		/* checksum */
 	uint16_t	urp;		/* urgent pointer */
 };
+
+#define	TCPOPT_EOL		0
+#define	   TCPOLEN_EOL			1
+#define	TCPOPT_NOP		1
+#define	   TCPOLEN_NOP			1
+#define	TCPOPT_MAXSEG		2
+#define	   TCPOLEN_MAXSEG		4
+#define	TCPOPT_WINDOW		3
+#define	   TCPOLEN_WINDOW		3
+#define	TCPOPT_SACK_PERMITTED	4
+#define	   TCPOLEN_SACK_PERMITTED	2
+#define	TCPOPT_SACK		5
+#define	   TCPOLEN_SACKHDR		2
+#define	   TCPOLEN_SACK			8	/* 2*sizeof(tcp_seq) */
+
+#define	TCP_MAXHLEN	(0xf<<2)	/* max length of header in bytes */
+#define	TCP_MAXOLEN	(TCP_MAXHLEN - sizeof(struct tcp_hdr))
+					/* max space left for options */
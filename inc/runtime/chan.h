@@ -0,0 +1,21 @@
+/*
+ * chan.h - channels for passing messages between threads
+ */
+
+#pragma once
+
+#include <base/types.h>
+
+struct chan;
+typedef struct chan chan_t;
+
+/* flags for chan_create() */
+#define CHAN_UNBOUNDED	0x1	/* senders never block, messages past @cap spill */
+
+extern int chan_create(chan_t **ch_out, unsigned int cap, unsigned int flags);
+extern void chan_destroy(chan_t *ch);
+extern int chan_send(chan_t *ch, void *msg);
+extern int chan_try_send(chan_t *ch, void *msg);
+extern int chan_recv(chan_t *ch, void **msg_out);
+extern int chan_try_recv(chan_t *ch, void **msg_out);
+extern void chan_close(chan_t *ch);
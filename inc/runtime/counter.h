@@ -0,0 +1,69 @@
+/*
+ * counter.h - per-kthread counters for applications
+ *
+ * A counter keeps one value per kthread, like the runtime's own statistics,
+ * so incrementing it is a plain add to a local cache line instead of an atomic
+ * that bounces between cores. Reads sum the values of every kthread.
+ *
+ * Counters defined with DEFINE_STAT_COUNTER() are found at link time and
+ * exported by the stat port after the runtime's counters, in the "stat" and
+ * "bstat" replies and the stats page, so give them names that won't collide.
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+#include <base/thread.h>
+#include <runtime/preempt.h>
+
+/* the most application counters that are exported */
+#define STAT_COUNTERS_MAX	64
+
+struct stat_counter {
+	const char		*name;
+	uint64_t __perthread	*key;
+};
+
+extern uint64_t stat_counter_read(const struct stat_counter *c);
+
+/**
+ * DEFINE_STAT_COUNTER - defines a counter
+ * @name: the counter's identifier, which is also its exported name
+ */
+#define DEFINE_STAT_COUNTER(name)					\
+	DEFINE_PERTHREAD(uint64_t, statc_##name);			\
+	const struct stat_counter __stat_counter_##name			\
+	__attribute__((section("stat_counters"), used, aligned(16))) =	\
+		{ #name, &__perthread_statc_##name }
+
+/**
+ * DECLARE_STAT_COUNTER - makes a counter defined elsewhere available
+ * @name: the counter's identifier
+ */
+#define DECLARE_STAT_COUNTER(name)					\
+	DECLARE_PERTHREAD(uint64_t, statc_##name);			\
+	extern const struct stat_counter __stat_counter_##name
+
+/**
+ * stat_counter_add - adds to a counter on the local kthread
+ * @name: the counter's identifier
+ * @val: the amount to add
+ */
+#define stat_counter_add(name, val)					\
+do {									\
+	preempt_disable();						\
+	perthread_get(statc_##name) += (val);				\
+	preempt_enable();						\
+} while (0)
+
+/**
+ * stat_counter_inc - increments a counter on the local kthread
+ * @name: the counter's identifier
+ */
+#define stat_counter_inc(name) stat_counter_add(name, 1)
+
+/**
+ * stat_counter_sum - returns the total of a counter across kthreads
+ * @name: the counter's identifier
+ */
+#define stat_counter_sum(name) stat_counter_read(&__stat_counter_##name)
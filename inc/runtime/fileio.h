@@ -0,0 +1,13 @@
+/*
+ * fileio.h - asynchronous file I/O for threads
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <base/types.h>
+
+extern ssize_t file_read(int fd, void *buf, size_t len, off_t off);
+extern ssize_t file_write(int fd, const void *buf, size_t len, off_t off);
+extern int file_fsync(int fd, bool datasync);
@@ -5,10 +5,67 @@
 #pragma once
 
 #include <base/types.h>
+#include <net/ip6.h>
 
+/* address families for struct netaddr */
+#define NET_AF_INET	0	/* IPv4, the default for a zeroed netaddr */
+#define NET_AF_INET6	1
+
+/*
+ * A transport endpoint. @ip is used for IPv4 and @ip6 for IPv6, as selected
+ * by @family. Always zero-initialize a netaddr before filling in its fields,
+ * so existing IPv4 code keeps working and unused fields compare equal.
+ */
 struct netaddr {
 	uint32_t ip;
 	uint16_t port;
+	uint8_t family;
+	struct ip6_addr ip6;
+};
+
+/* when an ingress packet arrived, see udp_read_from_ts() and tcp_read_ts() */
+struct net_rx_ts {
+	uint64_t	iok_tsc; /* when the iokernel polled it from the NIC (TSC) */
+	uint64_t	nic_ts;	 /* the NIC's timestamp in its own clock, or 0 */
+	uint64_t	enq_tsc; /* when the iokernel queued it to the runtime */
+	uint64_t	softirq_tsc; /* when the runtime's softirq handled it */
 };
 
 extern int str_to_netaddr(const char *str, struct netaddr *addr);
+
+/**
+ * netaddr_ip_equal - checks whether two netaddrs have the same IP address
+ * @a: the first address
+ * @b: the second address
+ *
+ * Ports are ignored.
+ */
+static inline bool netaddr_ip_equal(const struct netaddr *a,
+				    const struct netaddr *b)
+{
+	if (a->family != b->family)
+		return false;
+	if (a->family == NET_AF_INET6)
+		return ip6_addr_equal(&a->ip6, &b->ip6);
+	return a->ip == b->ip;
+}
+
+/**
+ * netaddr_ip_is_zero - checks whether a netaddr's IP address is unspecified
+ * @a: the address
+ */
+static inline bool netaddr_ip_is_zero(const struct netaddr *a)
+{
+	if (a->family == NET_AF_INET6)
+		return ip6_addr_is_zero(&a->ip6);
+	return a->ip == 0;
+}
+
+/* a buffer for netaddr_ip_to_str() */
+#define NETADDR_IP_STR_LEN	IP6_ADDR_STR_LEN
+
+extern char *netaddr_ip_to_str(const struct netaddr *a, char *str);
+
+/* the longest a read may busy-poll, see tcp_set_busy_poll() and
+ * udp_set_busy_poll() */
+#define NET_BUSY_POLL_MAX_US	1000
@@ -0,0 +1,17 @@
+/*
+ * objpool.h - pools of fixed-size objects with per-kthread caches
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+
+/* start each object on a cache line (by default objects may share them) */
+#define OBJPOOL_CACHE_ALIGNED	BIT(0)
+
+struct objpool;
+
+extern struct objpool *objpool_create(const char *name, size_t size,
+				      int flags);
+extern void *objpool_alloc(struct objpool *p) __malloc;
+extern void objpool_free(struct objpool *p, void *item);
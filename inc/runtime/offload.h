@@ -0,0 +1,13 @@
+/*
+ * offload.h - runs blocking calls on helper kernel threads
+ */
+
+#pragma once
+
+#include <base/types.h>
+
+/* returns a result, or -errno since errno isn't carried back to the caller */
+typedef long (*offload_fn_t)(void *arg);
+
+extern long offload_call(offload_fn_t fn, void *arg);
+extern long offload_syscall(long nr, ...);
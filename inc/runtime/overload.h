@@ -0,0 +1,50 @@
+/*
+ * overload.h - receiver-driven admission control and load shedding
+ */
+
+#pragma once
+
+#include <base/types.h>
+
+extern unsigned int overload_target_us;
+
+extern bool __overload_admit(void);
+extern void __overload_complete(void);
+extern bool __overload_shedding(void);
+
+/**
+ * overload_admit - decides whether to accept a new request
+ *
+ * Returns true if the request may proceed, in which case the caller must call
+ * overload_complete() once it is done. Returns false if it should be rejected
+ * right away (e.g., with a cheap error reply) because the runtime is
+ * overloaded. Always true unless runtime_qdelay_target_us is set.
+ */
+static inline bool overload_admit(void)
+{
+	if (!overload_target_us)
+		return true;
+	return __overload_admit();
+}
+
+/**
+ * overload_complete - marks a request admitted by overload_admit() as done
+ */
+static inline void overload_complete(void)
+{
+	if (overload_target_us)
+		__overload_complete();
+}
+
+/**
+ * overload_shedding - returns true if new work should be refused
+ *
+ * For work that isn't tracked per request, such as new connections. True
+ * while queueing delay is above runtime_qdelay_target_us.
+ */
+static inline bool overload_shedding(void)
+{
+	if (!overload_target_us)
+		return false;
+	return __overload_shedding();
+}
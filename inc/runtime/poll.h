@@ -0,0 +1,75 @@
+/*
+ * poll.h - readiness notification for many connections
+ *
+ * A poll waiter collects events from any number of sockets, so a few threads
+ * can serve many mostly idle connections instead of parking a thread (and its
+ * stack) in each one. Register a socket with tcp_poll_register(),
+ * tcp_qpoll_register(), or udp_poll_register(), make it nonblocking, and then
+ * call poll_wait() to learn which sockets became ready.
+ *
+ * Notifications are edge-triggered: a socket is reported once each time it
+ * becomes ready, and again only after more data arrives or more room frees
+ * up. So keep reading (or writing) until the socket returns -EAGAIN before
+ * waiting again. Registering reports a socket right away if it's ready.
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+#include <base/list.h>
+#include <base/lock.h>
+
+#define POLL_IN		BIT(0)	/* data, a connection, EOF, or an error */
+#define POLL_OUT	BIT(1)	/* room to write, or an error */
+
+struct poll_waiter {
+	spinlock_t		lock;
+	struct list_head	ready;	 /* triggers with events to report */
+	struct list_head	waiters; /* threads blocked in poll_wait() */
+};
+
+typedef struct poll_waiter poll_waiter_t;
+
+/* embedded in each socket that can be registered with a waiter */
+struct poll_trigger {
+	spinlock_t		lock;	 /* protects @waiter */
+	poll_waiter_t		*waiter;
+	unsigned long		data;
+
+	/* protected by the waiter's lock */
+	unsigned int		events;	 /* fired but not yet reported */
+	struct list_node	link;
+};
+
+typedef struct poll_trigger poll_trigger_t;
+
+/* a socket that became ready, see poll_wait() */
+struct poll_event {
+	unsigned long		data;	 /* as passed when registering */
+	unsigned int		events;	 /* POLL_IN and/or POLL_OUT */
+};
+
+extern void poll_init(poll_waiter_t *w);
+extern int poll_wait(poll_waiter_t *w, struct poll_event *evs, int n);
+extern int poll_wait_timeout(poll_waiter_t *w, struct poll_event *evs, int n,
+			     uint64_t timeout_us);
+extern int poll_try_wait(poll_waiter_t *w, struct poll_event *evs, int n);
+
+/* for sockets */
+extern void poll_trigger_init(poll_trigger_t *t);
+extern void poll_arm(poll_trigger_t *t, poll_waiter_t *w, unsigned long data);
+extern void poll_disarm(poll_trigger_t *t);
+extern void __poll_set(poll_trigger_t *t, unsigned int events);
+
+/**
+ * poll_set - reports events on a socket to its waiter, if it has one
+ * @t: the socket's trigger
+ * @events: the events that happened (POLL_IN and/or POLL_OUT)
+ */
+static inline void poll_set(poll_trigger_t *t, unsigned int events)
+{
+	/* sockets that aren't registered only pay for this check */
+	if (likely(!ACCESS_ONCE(t->waiter)))
+		return;
+	__poll_set(t, events);
+}
@@ -7,9 +7,24 @@
 #include <base/stddef.h>
 
 extern volatile __thread unsigned int preempt_cnt;
+extern __thread volatile uint32_t *preempt_req;
 extern void preempt(void);
+extern void __preempt_poll(void);
 
-#define PREEMPT_NOT_PENDING	(1 << 31)
+#define PREEMPT_NOT_PENDING	(1U << 31)
+
+/**
+ * preempt_poll - checks for a preemption request from the iokernel
+ *
+ * The iokernel sets a flag in shared memory and only falls back to a signal
+ * if the flag isn't noticed in time. If it is set, this marks a preemption as
+ * pending, like the signal would.
+ */
+static inline void preempt_poll(void)
+{
+	if (unlikely(*preempt_req))
+		__preempt_poll();
+}
 
 /**
  * preempt_disable - disables preemption
@@ -36,13 +51,17 @@ static inline void preempt_enable_nocheck(void)
 /**
  * preempt_enable - reenables preemption
  *
- * Can be nested.
+ * Can be nested. Only the outermost call polls for a preemption request, and
+ * nested calls take a single branch.
  */
 static inline void preempt_enable(void)
 {
 	preempt_enable_nocheck();
-	if (unlikely(preempt_cnt == 0))
-		preempt();
+	if ((preempt_cnt & ~PREEMPT_NOT_PENDING) == 0) {
+		preempt_poll();
+		if (unlikely(preempt_cnt == 0))
+			preempt();
+	}
 }
 
 /**
@@ -13,6 +13,7 @@
 extern void *smalloc(size_t size) __smalloc_attr;
 extern void *__szalloc(size_t size) __smalloc_attr;
 extern void sfree(void *item);
+extern void sfree_sized(void *item, size_t size);
 
 /**
  * szalloc - allocates zeroed memory
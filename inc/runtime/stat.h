@@ -0,0 +1,68 @@
+/*
+ * stat.h - binary statistics formats, for agents that collect counters
+ *
+ * Counters are also available as text from the "stat" command on UDP port 40.
+ * The binary formats below carry the same counters, in the same order as the
+ * names returned by "bstat names", without any text formatting.
+ */
+
+#pragma once
+
+#include <base/types.h>
+
+#define STAT_FMT_MAGIC		0x73746174 /* "stat" */
+#define STAT_FMT_VERSION	1
+
+/*
+ * The shared-memory stats page, at STAT_PAGE_PATH with the runtime's pid. It
+ * is only created if the runtime_stat_page option is set, and rewritten every
+ * stat_page.period_us. Readers retry while @seq is odd or changes underneath
+ * them.
+ */
+#define STAT_PAGE_PATH		"/dev/shm/shenango-stat.%d"
+
+struct stat_page {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	nr_stats;
+	uint32_t	names_off;	/* NUL-terminated names, one per counter */
+	uint32_t	values_off;	/* @nr_stats uint64_t counters */
+	uint64_t	seq;		/* odd while the values are updated */
+	uint64_t	update_us;	/* when the values were last updated */
+	uint64_t	cycles_per_us;
+	uint32_t	period_us;
+	uint32_t	pad;
+};
+
+/*
+ * The reply to "bstat [<base_seq>]": a header followed by @nr_stats signed
+ * LEB128 (zigzag) varints. If STAT_MSG_DELTA is set, each is the change since
+ * the snapshot numbered @base_seq, which is the one the requester last saw.
+ * Otherwise they are the counters themselves.
+ */
+#define STAT_MSG_DELTA		0x1
+
+struct stat_msg_hdr {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	flags;
+	uint32_t	seq;		/* this snapshot, pass it in the next request */
+	uint32_t	base_seq;
+	uint16_t	nr_stats;
+	uint16_t	pad;
+	uint32_t	cycles_per_us;
+};
+
+/*
+ * The reply to "kstat <kthread>": a stat_msg_hdr with STAT_MSG_KTHREAD set,
+ * then a stat_kthread_hdr and @nr_stats varints holding that kthread's own
+ * counters (never deltas). Only the runtime's counters are included, so
+ * @nr_stats may be less than the number of names.
+ */
+#define STAT_MSG_KTHREAD	0x2
+
+struct stat_kthread_hdr {
+	uint16_t	idx;
+	uint16_t	nr_kthreads;	/* how many kthreads there are to ask for */
+	int32_t		core;		/* where it last ran, or -1 if parked */
+};
@@ -4,9 +4,12 @@
 
 #pragma once
 
+#include <limits.h>
+
 #include <base/stddef.h>
 #include <base/list.h>
 #include <base/lock.h>
+#include <base/atomic.h>
 #include <runtime/thread.h>
 #include <runtime/preempt.h>
 
@@ -19,6 +22,10 @@ struct mutex {
 	bool			held;
 	spinlock_t		waiter_lock;
 	struct list_head	waiters;
+	thread_t		*owner;	/* a hint for adaptive spinning */
+	/* when and where the owner acquired it, while profiling */
+	uint64_t		prof_tsc;
+	const void		*prof_site;
 };
 
 typedef struct mutex mutex_t;
@@ -59,7 +66,10 @@ struct condvar {
 typedef struct condvar condvar_t;
 
 extern void condvar_wait(condvar_t *cv, mutex_t *m);
+extern bool condvar_wait_timeout(condvar_t *cv, mutex_t *m,
+				 uint64_t timeout_us);
 extern void condvar_signal(condvar_t *cv);
+extern void condvar_signal_yield(condvar_t *cv);
 extern void condvar_broadcast(condvar_t *cv);
 extern void condvar_init(condvar_t *cv);
 
@@ -90,6 +100,45 @@ static inline void waitgroup_done(waitgroup_t *wg)
 }
 
 
+/*
+ * Sharded wait group support
+ *
+ * Like a wait group, but each kthread keeps its own count until a thread
+ * waits, so adds and dones from many kthreads don't share a cache line. The
+ * counts are then combined into one, which is used until it reaches zero.
+ */
+
+struct swaitgroup_shard {
+	spinlock_t		lock;
+	long			cnt;
+} __aligned(CACHE_LINE_SIZE);
+
+struct swaitgroup {
+	/* true while counting in @cnt, rather than in @shards */
+	bool			combined;
+	atomic64_t		cnt;
+	spinlock_t		lock;
+	struct list_head	waiters;
+	struct swaitgroup_shard	*shards;
+};
+
+typedef struct swaitgroup swaitgroup_t;
+
+extern int swaitgroup_init(swaitgroup_t *wg);
+extern void swaitgroup_destroy(swaitgroup_t *wg);
+extern void swaitgroup_add(swaitgroup_t *wg, long cnt);
+extern void swaitgroup_wait(swaitgroup_t *wg);
+
+/**
+ * swaitgroup_done - notifies the wait group that one waiting event completed
+ * @wg: the wait group to complete
+ */
+static inline void swaitgroup_done(swaitgroup_t *wg)
+{
+	swaitgroup_add(wg, -1);
+}
+
+
 /*
  * Spin lock support
  */
@@ -130,6 +179,43 @@ static inline void spin_unlock_np(spinlock_t *l)
 	preempt_enable();
 }
 
+/**
+ * ticket_lock_np - takes a ticket lock and disables preemption
+ * @l: the ticket lock
+ */
+static inline void ticket_lock_np(ticketlock_t *l)
+{
+	preempt_disable();
+	ticket_lock(l);
+}
+
+/**
+ * ticket_try_lock_np - takes a ticket lock if its available and disables
+ * preemption
+ * @l: the ticket lock
+ *
+ * Returns true if successful, otherwise fail.
+ */
+static inline bool ticket_try_lock_np(ticketlock_t *l)
+{
+	preempt_disable();
+	if (ticket_try_lock(l))
+		return true;
+
+	preempt_enable();
+	return false;
+}
+
+/**
+ * ticket_unlock_np - releases a ticket lock and re-enables preemption
+ * @l: the ticket lock
+ */
+static inline void ticket_unlock_np(ticketlock_t *l)
+{
+	ticket_unlock(l);
+	preempt_enable();
+}
+
 
 /*
  * Barrier support
@@ -147,6 +233,63 @@ typedef struct barrier barrier_t;
 extern void barrier_init(barrier_t *b, int count);
 extern bool barrier_wait(barrier_t *b);
 
+/*
+ * Tree barrier support
+ *
+ * Each participant arrives at a leaf shared with at most TBARRIER_FANIN - 1
+ * others, and only the last arrival at each node climbs to its parent, so no
+ * lock is taken by more than TBARRIER_FANIN threads. Releases fan back out the
+ * same way, with each parked thread waking the nodes it climbed through.
+ */
+
+#define TBARRIER_FANIN		4
+#define TBARRIER_MAX_LEVELS	16
+
+struct tbarrier_node {
+	spinlock_t		lock;
+	int			arrived;
+	int			expected;
+	struct list_head	waiters;
+} __aligned(CACHE_LINE_SIZE);
+
+struct tbarrier {
+	int			count;
+	int			nr_levels;
+	/* the index of the first node of each level, leaves first */
+	int			level_start[TBARRIER_MAX_LEVELS];
+	struct tbarrier_node	*nodes;
+};
+
+typedef struct tbarrier tbarrier_t;
+
+extern int tbarrier_init(tbarrier_t *b, int count);
+extern void tbarrier_destroy(tbarrier_t *b);
+extern bool tbarrier_wait(tbarrier_t *b, int idx);
+
+
+/*
+ * Wait/notify support, like futex(2) for uthreads
+ *
+ * Threads sleep on an address rather than on an object, so other
+ * synchronization primitives can be built on a word of their own state.
+ */
+
+extern int thread_wait_on(const uint32_t *addr, uint32_t expected);
+extern int thread_wait_on_timeout(const uint32_t *addr, uint32_t expected,
+				  uint64_t timeout_us);
+extern int thread_notify(const uint32_t *addr, int n);
+
+/**
+ * thread_notify_all - wakes every thread waiting on an address
+ * @addr: the address
+ *
+ * Returns the number of threads woken.
+ */
+static inline int thread_notify_all(const uint32_t *addr)
+{
+	return thread_notify(addr, INT_MAX);
+}
+
 
 /*
  * Read-write mutex support
@@ -158,6 +301,9 @@ struct rwmutex {
 	struct list_head	read_waiters;
 	struct list_head	write_waiters;
 	int			read_waiter_count;
+	/* when and where the writer acquired it, while profiling */
+	uint64_t		prof_tsc;
+	const void		*prof_site;
 };
 
 typedef struct rwmutex rwmutex_t;
@@ -168,3 +314,31 @@ extern void rwmutex_wrlock(rwmutex_t *m);
 extern bool rwmutex_try_rdlock(rwmutex_t *m);
 extern bool rwmutex_try_wrlock(rwmutex_t *m);
 extern void rwmutex_unlock(rwmutex_t *m);
+
+
+/*
+ * Big-reader mutex support
+ */
+
+/* a reader count, one per kthread, each in its own cache line */
+struct brmutex_reader {
+	atomic_t		cnt;
+} __aligned(CACHE_LINE_SIZE);
+
+struct brmutex {
+	mutex_t			write_lock;	/* serializes writers */
+	spinlock_t		waiter_lock;
+	bool			writer;		/* a writer holds or wants it */
+	thread_t		*write_waiter;	/* waiting for readers to exit */
+	struct list_head	read_waiters;
+	struct brmutex_reader	*readers;
+};
+
+typedef struct brmutex brmutex_t;
+
+extern int brmutex_init(brmutex_t *m);
+extern void brmutex_destroy(brmutex_t *m);
+extern void brmutex_rdlock(brmutex_t *m);
+extern void brmutex_rdunlock(brmutex_t *m);
+extern void brmutex_wrlock(brmutex_t *m);
+extern void brmutex_wrunlock(brmutex_t *m);
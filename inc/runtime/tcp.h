@@ -5,6 +5,7 @@
 #pragma once
 
 #include <runtime/net.h>
+#include <runtime/poll.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
 
@@ -13,18 +14,140 @@ typedef struct tcpqueue tcpqueue_t;
 struct tcpconn;
 typedef struct tcpconn tcpconn_t;
 
+/* connection states (RFC 793 Section 3.2) */
+enum {
+	TCP_STATE_SYN_SENT = 0,
+	TCP_STATE_SYN_RECEIVED,
+	TCP_STATE_ESTABLISHED,
+	TCP_STATE_FIN_WAIT1,
+	TCP_STATE_FIN_WAIT2,
+	TCP_STATE_CLOSE_WAIT,
+	TCP_STATE_CLOSING,
+	TCP_STATE_LAST_ACK,
+	TCP_STATE_TIME_WAIT,
+	TCP_STATE_CLOSED,
+};
+
+/* a snapshot of a connection's state, see tcp_get_info() */
+struct tcp_conn_info {
+	struct netaddr	laddr;
+	struct netaddr	raddr;
+	int		state;		/* one of TCP_STATE_* */
+	uint32_t	mss;
+	uint32_t	srtt;		/* smoothed RTT (us), 0 if not sampled */
+	uint32_t	rttvar;		/* RTT variation (us) */
+	uint32_t	rto;		/* retransmission timeout (us) */
+	uint32_t	retransmits;	/* segments resent so far */
+	uint32_t	cwnd;		/* congestion window (bytes) */
+	uint32_t	ssthresh;	/* slow start threshold (bytes) */
+	uint32_t	snd_wnd;	/* the peer's receive window (bytes) */
+	uint32_t	rcv_wnd;	/* our advertised window (bytes) */
+	uint32_t	in_flight;	/* sent but unacknowledged (bytes) */
+	uint32_t	rx_queued;	/* received but not yet read (bytes) */
+	uint32_t	tx_queued;	/* written but unacknowledged (bytes) */
+};
+
+/* when received data is acknowledged, see tcp_set_ack_policy() */
+enum {
+	TCP_ACK_DELAYED = 0,	/* after a timeout, unless a reply carries it */
+	TCP_ACK_QUICK,		/* right away, for every segment */
+	TCP_ACK_EVERY,		/* every @arg segments, or after a timeout */
+	TCP_ACK_ADAPTIVE,	/* delayed, but quick while the app lags */
+};
+
+/* how small writes are coalesced, see tcp_set_cork() */
+enum {
+	TCP_CORK_OFF = 0,	/* each write is sent right away */
+	TCP_CORK_ON,		/* held until uncorked or a threshold */
+	TCP_CORK_AUTO,		/* held while earlier data is in flight */
+};
+
+/*
+ * An in-place transform of a connection's byte stream, such as TLS record
+ * encryption, see tcp_set_transform(). Each hook is called for consecutive
+ * ranges of the stream in order; @off is the stream offset of the first byte
+ * (modulo 2^32). Either hook may be NULL.
+ */
+struct tcp_transform {
+	/* writes @len egress bytes to @dst, transformed from @src (may alias) */
+	void	(*tx)(void *arg, uint32_t off, void *dst, const void *src,
+		      size_t len);
+	/* transforms @len ingress bytes in place, before they can be read */
+	void	(*rx)(void *arg, uint32_t off, void *buf, size_t len);
+};
+
 extern int tcp_dial(struct netaddr laddr, struct netaddr raddr,
 		    tcpconn_t **c_out);
 extern int tcp_listen(struct netaddr laddr, int backlog, tcpqueue_t **q_out);
+extern int tcp_listen_sharded(struct netaddr laddr, int backlog,
+			      tcpqueue_t **q_out);
 extern int tcp_accept(tcpqueue_t *q, tcpconn_t **c_out);
 extern void tcp_qshutdown(tcpqueue_t *q);
 extern void tcp_qclose(tcpqueue_t *q);
 extern struct netaddr tcp_local_addr(tcpconn_t *c);
 extern struct netaddr tcp_remote_addr(tcpconn_t *c);
 extern ssize_t tcp_read(tcpconn_t *c, void *buf, size_t len);
+extern ssize_t tcp_read_ts(tcpconn_t *c, void *buf, size_t len,
+			   struct net_rx_ts *ts);
 extern ssize_t tcp_write(tcpconn_t *c, const void *buf, size_t len);
 extern ssize_t tcp_readv(tcpconn_t *c, const struct iovec *iov, int iovcnt);
 extern ssize_t tcp_writev(tcpconn_t *c, const struct iovec *iov, int iovcnt);
+/* a zero-copy view of received data, see tcp_read_zc() */
+struct tcp_rx_buf {
+	const void	*buf;
+	size_t		len;
+	void		*release_data;
+};
+
+extern ssize_t tcp_read_zc(tcpconn_t *c, size_t len, struct tcp_rx_buf *bufs,
+			   int nr);
+extern void tcp_rx_buf_release(void *release_data);
+/* an application-owned egress buffer, see tcp_write_zc() */
+struct tcp_tx_buf {
+	void		*buf;	/* the payload, filled in by the application */
+	size_t		cap;	/* the maximum length of the payload */
+	void		(*done)(void *arg);
+	void		*arg;
+	void		*handle;
+};
+
+extern int tcp_tx_buf_alloc(struct tcp_tx_buf *b, size_t len);
+extern void tcp_tx_buf_free(struct tcp_tx_buf *b);
+extern ssize_t tcp_write_zc(tcpconn_t *c, struct tcp_tx_buf *b, size_t len,
+			    void (*done)(void *arg), void *arg);
+extern ssize_t tcp_sendfile(tcpconn_t *c, int fd, off_t *offset, size_t count);
+extern int tcp_set_buffers(tcpconn_t *c, int read_len, int write_len);
 extern int tcp_shutdown(tcpconn_t *c, int how);
 extern void tcp_abort(tcpconn_t *c);
 extern void tcp_close(tcpconn_t *c);
+extern int tcp_set_ack_policy(tcpconn_t *c, int policy, unsigned int arg);
+extern int tcp_set_cork(tcpconn_t *c, int mode, size_t threshold);
+extern int tcp_set_transform(tcpconn_t *c, const struct tcp_transform *xf,
+			     void *arg);
+extern void tcp_set_nonblocking(tcpconn_t *c, bool nonblock);
+extern void tcp_get_info(tcpconn_t *c, struct tcp_conn_info *info);
+extern const char *tcp_state_name(int state);
+extern int tcp_set_busy_poll(tcpconn_t *c, unsigned int us);
+extern void tcp_set_priority(tcpconn_t *c, bool high);
+extern void tcp_poll_register(tcpconn_t *c, poll_waiter_t *w,
+			      unsigned long data);
+extern void tcp_poll_unregister(tcpconn_t *c);
+extern void tcp_qset_nonblocking(tcpqueue_t *q, bool nonblock);
+extern void tcp_qpoll_register(tcpqueue_t *q, poll_waiter_t *w,
+			       unsigned long data);
+extern void tcp_qpoll_unregister(tcpqueue_t *q);
+
+/* congestion control state of a connection */
+struct tcp_cc_stats {
+	uint32_t	cwnd;		/* congestion window (bytes) */
+	uint32_t	ssthresh;	/* slow start threshold (bytes) */
+	uint32_t	snd_wnd;	/* peer's advertised window (bytes) */
+	uint32_t	in_flight;	/* unacknowledged bytes */
+	uint32_t	dctcp_alpha;	/* DCTCP estimate (scaled by 1024) */
+	bool		ecn;		/* ECN was negotiated */
+	uint32_t	srtt_us;	/* smoothed round-trip time */
+	uint32_t	rttvar_us;	/* round-trip time variation */
+	uint32_t	rto_us;		/* retransmission timeout */
+};
+
+extern void tcp_get_cc_stats(tcpconn_t *c, struct tcp_cc_stats *stats);
@@ -12,6 +12,13 @@ struct thread;
 typedef void (*thread_fn_t)(void *arg);
 typedef struct thread thread_t;
 
+/* stack size classes */
+enum {
+	THREAD_STACK_DEFAULT = 0,	/* 128 KB */
+	THREAD_STACK_SMALL,		/* 16 KB, e.g. for connection handlers */
+	THREAD_STACK_NR_CLASSES,
+};
+
 
 /*
  * Low-level routines, these are helpful for bindings and synchronization
@@ -20,8 +27,13 @@ typedef struct thread thread_t;
 
 extern void thread_park_and_unlock_np(spinlock_t *l);
 extern void thread_ready(thread_t *thread);
+extern void thread_yield_to(thread_t *thread);
 extern thread_t *thread_create(thread_fn_t fn, void *arg);
 extern thread_t *thread_create_with_buf(thread_fn_t fn, void **buf, size_t len);
+extern thread_t *thread_create_with_stack(thread_fn_t fn, void *arg,
+					  int stack_class);
+extern void thread_set_background(thread_t *th, bool background);
+extern void thread_set_deadline(thread_t *th, uint64_t deadline_us);
 
 extern __thread thread_t *__self;
 
@@ -40,7 +52,19 @@ inline thread_t *thread_self(void)
 
 extern void thread_yield(void);
 extern int thread_spawn(thread_fn_t fn, void *arg);
+extern int thread_spawn_background(thread_fn_t fn, void *arg);
+extern int thread_spawn_with_stack(thread_fn_t fn, void *arg, int stack_class);
 extern void thread_exit(void) __noreturn;
+extern uint64_t thread_run_us(void);
+extern bool thread_deadline_passed(void);
+
+/* per-thread storage keys */
+#define THREAD_KEYS_MAX		128
+
+extern int thread_key_create(unsigned int *key, void (*dtor)(void *val));
+extern int thread_key_delete(unsigned int key);
+extern void *thread_getspecific(unsigned int key);
+extern int thread_setspecific(unsigned int key, void *val);
 
 /* main initialization */
 typedef int (*initializer_fn_t)(void);
@@ -49,3 +73,8 @@ extern int runtime_set_initializers(initializer_fn_t global_fn,
 				    initializer_fn_t perthread_fn,
 				    initializer_fn_t late_fn);
 extern int runtime_init(const char *cfgpath, thread_fn_t main_fn, void *arg);
+
+/* tells the iokernel how many cores are about to be needed */
+extern int runtime_request_cores(unsigned int nr, unsigned int duration_us);
+/* the most cores the runtime can use (runtime_kthreads in the config) */
+extern unsigned int runtime_max_cores(void);
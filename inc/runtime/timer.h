@@ -5,17 +5,21 @@
 #pragma once
 
 #include <base/stddef.h>
+#include <base/list.h>
 
 typedef void (*timer_fn_t)(unsigned long arg);
 
 struct kthread;
 
 struct timer_entry {
-	bool		armed;
-	unsigned int	idx;
-	timer_fn_t	fn;
-	unsigned long	arg;
-	struct kthread *localk;
+	bool			armed;
+	unsigned int		idx;
+	uint64_t		deadline_us;	/* the wheel slot */
+	uint64_t		deadline_ns;
+	struct list_node	link;
+	timer_fn_t		fn;
+	unsigned long		arg;
+	struct kthread		*localk;
 };
 
 
@@ -26,7 +30,7 @@ struct timer_entry {
 /**
  * timer_init - initializes a timer
  * @e: the timer entry to initialize
- * @fn: the timer handler (called when the timer fires)
+ * @fn: the timer handler (called with preemption disabled, must not block)
  * @arg: an argument passed to the timer handler
  */
 static inline void
@@ -38,6 +42,7 @@ timer_init(struct timer_entry *e, timer_fn_t fn, unsigned long arg)
 }
 
 extern void timer_start(struct timer_entry *e, uint64_t deadline_us);
+extern void timer_start_ns(struct timer_entry *e, uint64_t deadline_ns);
 extern bool timer_cancel(struct timer_entry *e);
 
 
@@ -47,3 +52,5 @@ extern bool timer_cancel(struct timer_entry *e);
 
 extern void timer_sleep_until(uint64_t deadline_us);
 extern void timer_sleep(uint64_t duration_us);
+extern void timer_sleep_until_ns(uint64_t deadline_ns);
+extern void timer_sleep_ns(uint64_t duration_ns);
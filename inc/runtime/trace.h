@@ -0,0 +1,53 @@
+/*
+ * trace.h - the format of the runtime's scheduling event trace
+ *
+ * Each kthread records events in its own ring while tracing is on. Sending
+ * "trace on", "trace off" or "trace dump" to the stat port (UDP port 40)
+ * controls it. A dump writes the rings to RTRACE_PATH (with the runtime's pid)
+ * as a struct rtrace_hdr, then for each kthread a struct rtrace_kthread
+ * followed by its @nr_entries struct rtrace_entry, oldest first.
+ * scripts/rtrace.py converts a dump to the Chrome trace (Perfetto) format.
+ */
+
+#pragma once
+
+#include <base/types.h>
+
+#define RTRACE_PATH		"/tmp/shenango-trace.%d"
+#define RTRACE_MAGIC		0x7274726365000001ul
+#define RTRACE_RING_SIZE	16384 /* per kthread, must be a power of two */
+
+enum {
+	RTRACE_SWITCH = 0,	/* a thread started running (@arg is the thread) */
+	RTRACE_SCHED,		/* it stopped running and the scheduler took over */
+	RTRACE_STEAL,		/* threads were stolen (@arg is the victim) */
+	RTRACE_PARK,		/* the kthread parked */
+	RTRACE_UNPARK,		/* ... and was woken up again */
+	RTRACE_SOFTIRQ_START,	/* softirq processing (@arg is the event count) */
+	RTRACE_SOFTIRQ_END,
+	RTRACE_TCP_RETRANSMIT,	/* @arg is the segment's sequence number */
+	RTRACE_NR,
+};
+
+struct rtrace_entry {
+	uint64_t	tsc;
+	uint64_t	arg;
+	uint32_t	aux;	/* e.g. how many threads were stolen */
+	uint16_t	event;
+	uint16_t	pad;
+};
+
+struct rtrace_hdr {
+	uint64_t	magic;
+	uint64_t	cycles_per_us;
+	uint64_t	start_tsc;
+	uint32_t	nr_kthreads;
+	uint32_t	pad;
+};
+
+struct rtrace_kthread {
+	uint32_t	idx;
+	uint32_t	nr_entries;
+	/* entries older than the ring that were overwritten */
+	uint64_t	nr_lost;
+};
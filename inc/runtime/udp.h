@@ -7,10 +7,21 @@
 #include <base/types.h>
 #include <net/udp.h>
 #include <runtime/net.h>
+#include <runtime/poll.h>
 #include <sys/uio.h>
 
-/* the maximum size of a UDP payload */
+/* the maximum size of a UDP payload with a 1500-byte MTU */
 #define UDP_MAX_PAYLOAD 1472
+/* the maximum size of a UDP payload with jumbo frames (a 9000-byte MTU) */
+#define UDP_MAX_PAYLOAD_JUMBO 8972
+/* the most datagrams udp_read_batch() and udp_write_batch() move per call */
+#define UDP_BATCH_MAX	32
+/*
+ * the most datagrams and payload bytes udp_write_gso_to() sends per call (the
+ * iokernel splits a packet into at most 64 segments)
+ */
+#define UDP_GSO_MAX_SEGS 64
+#define UDP_GSO_MAX_LEN	65000
 
 
 /*
@@ -20,20 +31,48 @@
 struct udpconn;
 typedef struct udpconn udpconn_t;
 
+/* one datagram for udp_read_batch() and udp_write_batch() */
+struct udp_msg {
+	void		*buf;	  /* the payload, or a buffer to read it into */
+	size_t		len;	  /* the length of @buf */
+	struct netaddr	*raddr;	  /* the remote address (if not NULL) */
+	size_t		recv_len; /* set by udp_read_batch() */
+};
+
 extern int udp_dial(struct netaddr laddr, struct netaddr raddr,
 		    udpconn_t **c_out);
 extern int udp_listen(struct netaddr laddr, udpconn_t **c_out);
 extern struct netaddr udp_local_addr(udpconn_t *c);
 extern struct netaddr udp_remote_addr(udpconn_t *c);
 extern int udp_set_buffers(udpconn_t *c, int read_mbufs, int write_mbufs);
+extern uint64_t udp_rx_drops(udpconn_t *c);
+extern int udp_join_group(udpconn_t *c, uint32_t group);
+extern int udp_leave_group(udpconn_t *c, uint32_t group);
 extern ssize_t udp_read_from(udpconn_t *c, void *buf, size_t len,
 			     struct netaddr *raddr);
+extern ssize_t udp_read_from_ts(udpconn_t *c, void *buf, size_t len,
+				struct netaddr *raddr, struct net_rx_ts *ts);
 extern ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
 			    const struct netaddr *raddr);
+extern ssize_t udp_readv_from(udpconn_t *c, const struct iovec *iov,
+			      int iovcnt, struct netaddr *raddr);
+extern ssize_t udp_writev_to(udpconn_t *c, const struct iovec *iov,
+			     int iovcnt, const struct netaddr *raddr);
 extern ssize_t udp_read(udpconn_t *c, void *buf, size_t len);
 extern ssize_t udp_write(udpconn_t *c, const void *buf, size_t len);
+extern int udp_read_batch(udpconn_t *c, struct udp_msg *msgs, int n);
+extern int udp_write_batch(udpconn_t *c, const struct udp_msg *msgs, int n);
+extern ssize_t udp_write_gso_to(udpconn_t *c, const void *buf, size_t len,
+				size_t segsz, const struct netaddr *raddr);
 extern void udp_shutdown(udpconn_t *c);
 extern void udp_close(udpconn_t *c);
+extern size_t udp_max_payload(void);
+extern void udp_set_nonblocking(udpconn_t *c, bool nonblock);
+extern int udp_set_busy_poll(udpconn_t *c, unsigned int us);
+extern void udp_set_priority(udpconn_t *c, bool high);
+extern void udp_poll_register(udpconn_t *c, poll_waiter_t *w,
+			      unsigned long data);
+extern void udp_poll_unregister(udpconn_t *c);
 
 
 /*
@@ -55,7 +94,10 @@ typedef void (*udpspawn_fn_t)(struct udp_spawn_data *d);
 
 extern int udp_create_spawner(struct netaddr laddr, udpspawn_fn_t fn,
 			      udpspawner_t **s_out);
+extern int udp_create_spawner_pool(struct netaddr laddr, udpspawn_fn_t fn,
+				   int pool_size, udpspawner_t **s_out);
 extern void udp_destroy_spawner(udpspawner_t *s);
+extern void udp_spawner_set_reject(udpspawner_t *s, udpspawn_fn_t reject);
 extern ssize_t udp_send(const void *buf, size_t len,
 			struct netaddr laddr, struct netaddr raddr);
 extern ssize_t udp_sendv(const struct iovec *iov, int iovcnt,
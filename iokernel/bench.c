@@ -0,0 +1,507 @@
+/*
+ * bench.c - a synthetic NIC for benchmarking the dataplane
+ *
+ * In benchmark mode, the port is backed by a pair of rte_rings instead of a
+ * NIC. The dataplane core fills the RX rings with UDP packets addressed to
+ * the registered runtimes, at a fixed rate or as fast as it drains them, and
+ * frees whatever the runtimes send, answering their ARP requests so replies
+ * can go out. Each second it logs how many cycles each dataplane stage spent
+ * per packet, so changes to rx.c, commands.c, and tx.c can be compared
+ * without a NIC or clients.
+ *
+ * Packets are marked as if the NIC verified their checksums and computed an
+ * RSS hash, and are sent to the IPv4 broadcast address so the runtimes accept
+ * them whatever their IP addresses are.
+ *
+ * In loopback mode (bench_loop), the port instead acts as a switch between
+ * the runtimes: each sent packet is copied back into the RX rings, where
+ * rx.c delivers it by destination MAC like any other. Forwarded packets can
+ * be dropped, delayed, and reordered (held back longer than the rest) to
+ * benchmark the TCP stack on a lossy path. The impairments are drawn from a
+ * seeded generator, so a run with the same settings and traffic sees the
+ * same losses. A generator (bench=<pps>) can run alongside.
+ */
+
+#include <string.h>
+
+#include <rte_arp.h>
+#include <rte_eth_ring.h>
+#include <rte_ethdev.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_mbuf.h>
+#include <rte_ring.h>
+#include <rte_udp.h>
+
+#include <base/log.h>
+
+#include "defs.h"
+
+#define BENCH_RING_SIZE		1024
+/* the most packets in the RX rings in flood mode (bench=0) */
+#define BENCH_FLOOD_LEVEL	(IOKERNEL_RX_BURST_SIZE * 2)
+/* the subnet the synthetic clients send from */
+#define BENCH_SRC_IP		IPv4(10, 255, 0, 0)
+#define BENCH_SRC_PORTS		4096
+/* the most forwarded packets that can be held back at once, per line */
+#define BENCH_LINE_SIZE		8192
+
+/* benchmark mode settings, from the command line */
+bool bench_enabled;
+unsigned long bench_pps;
+unsigned int bench_pkt_len = ETHER_MIN_LEN - ETHER_CRC_LEN;
+uint16_t bench_udp_port = 9;
+bool bench_gen;
+bool bench_loop;
+double bench_drop_pct, bench_reorder_pct;
+unsigned long bench_delay_us;
+unsigned long bench_reorder_us = 100;
+uint64_t bench_seed = 1;
+
+/* busy cycles spent in each dataplane stage */
+uint64_t bench_cycles[BENCH_NR_STAGES];
+
+static const char *bench_stage_names[] = {
+	"rx_burst",
+	"commands_rx",
+	"tx_burst",
+	"completions",
+};
+
+BUILD_ASSERT(ARRAY_SIZE(bench_stage_names) == BENCH_NR_STAGES);
+
+static struct rte_ring *bench_rx_rings[IOKERNEL_MAX_DP_QUEUES];
+static struct rte_ring *bench_tx_ring;
+static const struct ether_addr bench_mac = {
+	.addr_bytes = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01},
+};
+
+static uint64_t bench_last_tsc;
+static uint64_t bench_seq;
+static unsigned int bench_next_client;
+
+static uint64_t bench_rx_enqueued, bench_tx_pkts, bench_drops, bench_nombuf;
+
+/* a FIFO of forwarded packets, each held until its due time */
+struct bench_line {
+	unsigned int		head, tail;
+	struct {
+		struct rte_mbuf	*buf;
+		uint64_t	due_tsc;
+	} slots[BENCH_LINE_SIZE];
+};
+
+/* loopback mode state, see bench_forward() */
+static struct bench_line bench_delay_line, bench_reorder_line;
+static uint64_t bench_rand_state;
+static uint64_t bench_drop_thresh, bench_reorder_thresh;
+static uint64_t bench_delay_tsc, bench_reorder_tsc;
+static uint64_t bench_fwd_pkts, bench_lost, bench_reordered;
+
+/**
+ * bench_port_create - creates the ring-backed port
+ *
+ * Returns the port, or < 0 on failure.
+ */
+int bench_port_create(void)
+{
+	char name[RTE_RING_NAMESIZE];
+	unsigned int q;
+	int port;
+
+	if (bench_pkt_len > dp.mtu + ETH_HDR_LEN) {
+		log_err("bench: %u byte packets are over the MTU (%u)",
+			bench_pkt_len, dp.mtu);
+		return -EINVAL;
+	}
+
+	for (q = 0; q < dp.nr_queues; q++) {
+		snprintf(name, sizeof(name), "bench_rx%u", q);
+		bench_rx_rings[q] = rte_ring_create(name, BENCH_RING_SIZE,
+						    rte_socket_id(), 0);
+		if (!bench_rx_rings[q])
+			return -ENOMEM;
+	}
+
+	/* only the dataplane core transmits */
+	bench_tx_ring = rte_ring_create("bench_tx", BENCH_RING_SIZE,
+					rte_socket_id(),
+					RING_F_SP_ENQ | RING_F_SC_DEQ);
+	if (!bench_tx_ring)
+		return -ENOMEM;
+
+	port = rte_eth_from_rings("net_bench", bench_rx_rings, dp.nr_queues,
+				  &bench_tx_ring, 1, rte_socket_id());
+	if (port < 0)
+		return port;
+
+	if (bench_gen) {
+		log_info("bench: synthetic NIC on port %d, %lu pps (0 = flood), "
+			 "%u byte packets to UDP port %u", port, bench_pps,
+			 bench_pkt_len, bench_udp_port);
+	}
+	if (bench_loop) {
+		log_info("bench: looping back sent packets, %.3f%% dropped, "
+			 "%lu us delay, %.3f%% reordered by %lu us, seed %lu",
+			 bench_drop_pct, bench_delay_us, bench_reorder_pct,
+			 bench_reorder_us, bench_seed);
+	}
+
+	/* thresholds out of 2^32, compared against 32 random bits */
+	bench_drop_thresh = (uint64_t)(bench_drop_pct / 100.0 * (1UL << 32));
+	bench_reorder_thresh =
+		(uint64_t)(bench_reorder_pct / 100.0 * (1UL << 32));
+	bench_delay_tsc = bench_delay_us * cycles_per_us;
+	bench_reorder_tsc = bench_reorder_us * cycles_per_us;
+	/* xorshift gets stuck at zero */
+	bench_rand_state = bench_seed ? bench_seed : 1;
+
+	bench_last_tsc = rdtsc();
+	return port;
+}
+
+static void bench_fill_pkt(struct rte_mbuf *buf, struct proc *p)
+{
+	struct ether_hdr *eth;
+	struct ipv4_hdr *ip;
+	struct udp_hdr *udp;
+	uint16_t sport = bench_seq % BENCH_SRC_PORTS;
+	char *data;
+
+	data = rte_pktmbuf_append(buf, bench_pkt_len);
+	memset(data, 0, bench_pkt_len);
+
+	eth = (struct ether_hdr *)data;
+	memcpy(&eth->d_addr, &p->mac, sizeof(eth->d_addr));
+	ether_addr_copy(&bench_mac, &eth->s_addr);
+	eth->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+	ip = (struct ipv4_hdr *)(eth + 1);
+	ip->version_ihl = 0x45;
+	ip->total_length = rte_cpu_to_be_16(bench_pkt_len - sizeof(*eth));
+	ip->time_to_live = 64;
+	ip->next_proto_id = IPPROTO_UDP;
+	ip->src_addr = rte_cpu_to_be_32(BENCH_SRC_IP | (sport >> 8));
+	ip->dst_addr = rte_cpu_to_be_32(IPv4(255, 255, 255, 255));
+	ip->hdr_checksum = rte_ipv4_cksum(ip);
+
+	udp = (struct udp_hdr *)(ip + 1);
+	udp->src_port = rte_cpu_to_be_16(1024 + sport);
+	udp->dst_port = rte_cpu_to_be_16(bench_udp_port);
+	udp->dgram_len = rte_cpu_to_be_16(bench_pkt_len - sizeof(*eth) -
+					  sizeof(*ip));
+
+	/* what a NIC with checksum offload and RSS would report */
+	buf->ol_flags = PKT_RX_IP_CKSUM_GOOD | PKT_RX_L4_CKSUM_GOOD |
+			PKT_RX_RSS_HASH;
+	buf->hash.rss = (uint32_t)(sport * 2654435761U);
+	bench_seq++;
+}
+
+static void bench_enqueue(struct rte_mbuf **bufs, unsigned int n)
+{
+	unsigned int q, i, nb;
+
+	q = dp.nr_queues > 1 ? bench_seq % dp.nr_queues : 0;
+	nb = rte_ring_enqueue_burst(bench_rx_rings[q], (void **)bufs, n, NULL);
+	bench_rx_enqueued += nb;
+
+	/* like a NIC that runs out of descriptors */
+	for (i = nb; i < n; i++)
+		rte_pktmbuf_free(bufs[i]);
+	bench_drops += n - nb;
+}
+
+/* adds the generated packets that are due to the RX rings */
+static void bench_generate(void)
+{
+	struct rte_mbuf *bufs[IOKERNEL_RX_BURST_SIZE];
+	uint64_t now = rdtsc();
+	unsigned int n, i;
+
+	if (dp.nr_clients == 0) {
+		bench_last_tsc = now;
+		return;
+	}
+
+	if (bench_pps == 0) {
+		n = rte_ring_count(bench_rx_rings[0]);
+		n = n < BENCH_FLOOD_LEVEL ? BENCH_FLOOD_LEVEL - n : 0;
+	} else {
+		n = (now - bench_last_tsc) * bench_pps /
+		    ((uint64_t)cycles_per_us * ONE_SECOND);
+	}
+	if (n == 0)
+		return;
+	n = min(n, IOKERNEL_RX_BURST_SIZE);
+	/* carry the remainder over to the next call */
+	if (bench_pps)
+		bench_last_tsc += n * (uint64_t)cycles_per_us * ONE_SECOND /
+				  bench_pps;
+
+	if (rte_pktmbuf_alloc_bulk(dp.rx_mbuf_pool, bufs, n)) {
+		bench_nombuf += n;
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		bench_next_client %= dp.nr_clients;
+		bench_fill_pkt(bufs[i], dp.clients[bench_next_client++]);
+	}
+	bench_enqueue(bufs, n);
+}
+
+/* xorshift64*, returns 32 random bits */
+static uint32_t bench_rand(void)
+{
+	bench_rand_state ^= bench_rand_state >> 12;
+	bench_rand_state ^= bench_rand_state << 25;
+	bench_rand_state ^= bench_rand_state >> 27;
+	return (bench_rand_state * 2685821657736338717UL) >> 32;
+}
+
+static void bench_hold(struct bench_line *l, struct rte_mbuf *buf,
+		       uint64_t due_tsc)
+{
+	unsigned int idx;
+
+	if (unlikely(l->tail - l->head >= BENCH_LINE_SIZE)) {
+		rte_pktmbuf_free(buf);
+		bench_drops++;
+		return;
+	}
+
+	idx = l->tail++ % BENCH_LINE_SIZE;
+	l->slots[idx].buf = buf;
+	l->slots[idx].due_tsc = due_tsc;
+}
+
+/* moves the packets that are due from @l to the RX rings */
+static void bench_release(struct bench_line *l, uint64_t now)
+{
+	struct rte_mbuf *bufs[IOKERNEL_RX_BURST_SIZE];
+	unsigned int n = 0, idx;
+
+	while (l->head != l->tail && n < IOKERNEL_RX_BURST_SIZE) {
+		idx = l->head % BENCH_LINE_SIZE;
+		if (l->slots[idx].due_tsc > now)
+			break;
+		bufs[n++] = l->slots[idx].buf;
+		l->head++;
+	}
+
+	if (n)
+		bench_enqueue(bufs, n);
+}
+
+/**
+ * bench_fill_rx - adds the packets that are due to the RX rings
+ */
+void bench_fill_rx(void)
+{
+	uint64_t now;
+
+	if (bench_loop) {
+		now = rdtsc();
+		bench_release(&bench_delay_line, now);
+		bench_release(&bench_reorder_line, now);
+	}
+
+	if (bench_gen)
+		bench_generate();
+}
+
+/* copies a sent packet into an RX mbuf, as if it crossed a wire */
+static struct rte_mbuf *bench_copy(struct rte_mbuf *tx)
+{
+	unsigned int room = rte_pktmbuf_data_room_size(dp.rx_mbuf_pool) -
+			    RTE_PKTMBUF_HEADROOM;
+	struct rte_mbuf *buf, *seg;
+	char *data;
+
+	if (rte_pktmbuf_pkt_len(tx) > room) {
+		bench_drops++;
+		return NULL;
+	}
+
+	buf = rte_pktmbuf_alloc(dp.rx_mbuf_pool);
+	if (!buf) {
+		bench_nombuf++;
+		return NULL;
+	}
+
+	data = rte_pktmbuf_append(buf, rte_pktmbuf_pkt_len(tx));
+	for (seg = tx; seg; seg = seg->next) {
+		memcpy(data, rte_pktmbuf_mtod(seg, void *),
+		       rte_pktmbuf_data_len(seg));
+		data += rte_pktmbuf_data_len(seg);
+	}
+
+	/* the runtimes rely on checksum offload, so there are none to check */
+	buf->ol_flags = PKT_RX_IP_CKSUM_GOOD | PKT_RX_L4_CKSUM_GOOD |
+			PKT_RX_RSS_HASH;
+	buf->hash.rss = rx_sw_flow_hash(buf);
+	return buf;
+}
+
+/* loops a sent packet back to the runtimes, through the impairments */
+static void bench_forward(struct rte_mbuf *tx, bool is_arp)
+{
+	struct bench_line *l = &bench_delay_line;
+	struct rte_mbuf *buf;
+	uint64_t due_tsc;
+
+	buf = bench_copy(tx);
+	if (!buf)
+		return;
+	bench_fwd_pkts++;
+
+	/* impair only data packets, so the runtimes can always resolve peers */
+	if (is_arp) {
+		bench_enqueue(&buf, 1);
+		return;
+	}
+
+	if (bench_rand() < bench_drop_thresh) {
+		rte_pktmbuf_free(buf);
+		bench_lost++;
+		return;
+	}
+
+	due_tsc = rdtsc() + bench_delay_tsc;
+	if (bench_rand() < bench_reorder_thresh) {
+		l = &bench_reorder_line;
+		due_tsc += bench_reorder_tsc;
+		bench_reordered++;
+	}
+	bench_hold(l, buf, due_tsc);
+}
+
+/* answers an ARP request from a runtime, so its replies can go out */
+static void bench_reply_arp(struct rte_mbuf *req)
+{
+	struct ether_hdr *eth = rte_pktmbuf_mtod(req, struct ether_hdr *);
+	struct arp_hdr *arp = (struct arp_hdr *)(eth + 1);
+	struct ether_hdr *reth;
+	struct arp_hdr *rarp;
+	struct rte_mbuf *buf;
+
+	if (rte_pktmbuf_data_len(req) < sizeof(*eth) + sizeof(*arp) ||
+	    arp->arp_op != rte_cpu_to_be_16(ARP_OP_REQUEST))
+		return;
+
+	buf = rte_pktmbuf_alloc(dp.rx_mbuf_pool);
+	if (!buf) {
+		bench_nombuf++;
+		return;
+	}
+
+	reth = (struct ether_hdr *)rte_pktmbuf_append(buf, sizeof(*reth) +
+						      sizeof(*rarp));
+	ether_addr_copy(&eth->s_addr, &reth->d_addr);
+	ether_addr_copy(&bench_mac, &reth->s_addr);
+	reth->ether_type = rte_cpu_to_be_16(ETHER_TYPE_ARP);
+
+	rarp = (struct arp_hdr *)(reth + 1);
+	*rarp = *arp;
+	rarp->arp_op = rte_cpu_to_be_16(ARP_OP_REPLY);
+	ether_addr_copy(&bench_mac, &rarp->arp_data.arp_sha);
+	rarp->arp_data.arp_sip = arp->arp_data.arp_tip;
+	ether_addr_copy(&arp->arp_data.arp_sha, &rarp->arp_data.arp_tha);
+	rarp->arp_data.arp_tip = arp->arp_data.arp_sip;
+
+	bench_enqueue(&buf, 1);
+}
+
+/**
+ * bench_drain_tx - frees (or loops back) the packets the runtimes sent
+ *
+ * Returns true if any packets were sent.
+ */
+bool bench_drain_tx(void)
+{
+	struct rte_mbuf *bufs[IOKERNEL_TX_BURST_SIZE];
+	struct ether_hdr *eth;
+	unsigned int n, i;
+	bool is_arp;
+
+	n = rte_ring_dequeue_burst(bench_tx_ring, (void **)bufs,
+				   IOKERNEL_TX_BURST_SIZE, NULL);
+	for (i = 0; i < n; i++) {
+		eth = rte_pktmbuf_mtod(bufs[i], struct ether_hdr *);
+		is_arp = eth->ether_type == rte_cpu_to_be_16(ETHER_TYPE_ARP);
+		if (bench_loop)
+			bench_forward(bufs[i], is_arp);
+		else if (unlikely(is_arp))
+			bench_reply_arp(bufs[i]);
+		/* runs the TX completion, like a NIC finishing a send */
+		rte_pktmbuf_free(bufs[i]);
+	}
+
+	bench_tx_pkts += n;
+	return n > 0;
+}
+
+/* cycles per packet, or 0 if there were no packets */
+static unsigned long bench_per_pkt(uint64_t cycles, uint64_t pkts)
+{
+	return pkts ? cycles / pkts : 0;
+}
+
+/**
+ * bench_report - logs the rates and per-stage costs since the last report
+ * @elapsed_us: the time since the last report
+ */
+void bench_report(uint64_t elapsed_us)
+{
+	static uint64_t last_cycles[BENCH_NR_STAGES];
+	static uint64_t last_rx, last_tx, last_drops, last_nombuf;
+	static uint64_t last_fwd, last_lost, last_reordered;
+	uint64_t cycles[BENCH_NR_STAGES], rx, tx, backlog = 0;
+	unsigned int q, i;
+
+	if (elapsed_us == 0)
+		return;
+
+	for (q = 0; q < dp.nr_queues; q++)
+		backlog += rte_ring_count(bench_rx_rings[q]);
+	rx = bench_rx_enqueued - backlog - last_rx;
+	tx = bench_tx_pkts - last_tx;
+	for (i = 0; i < BENCH_NR_STAGES; i++) {
+		cycles[i] = bench_cycles[i] - last_cycles[i];
+		last_cycles[i] = bench_cycles[i];
+	}
+
+	/*
+	 * rx_burst() is charged to received packets, the TX stages to sent
+	 * ones, and commands_rx() (RX completions and TX submissions) to both.
+	 */
+	log_info("bench: rx %lu tx %lu drop %lu nombuf %lu pps | cycles/pkt "
+		 "%s %lu %s %lu %s %lu %s %lu",
+		 rx * ONE_SECOND / elapsed_us, tx * ONE_SECOND / elapsed_us,
+		 (bench_drops - last_drops) * ONE_SECOND / elapsed_us,
+		 (bench_nombuf - last_nombuf) * ONE_SECOND / elapsed_us,
+		 bench_stage_names[BENCH_RX], bench_per_pkt(cycles[BENCH_RX], rx),
+		 bench_stage_names[BENCH_COMMANDS],
+		 bench_per_pkt(cycles[BENCH_COMMANDS], rx + tx),
+		 bench_stage_names[BENCH_TX], bench_per_pkt(cycles[BENCH_TX], tx),
+		 bench_stage_names[BENCH_COMPLETIONS],
+		 bench_per_pkt(cycles[BENCH_COMPLETIONS], tx));
+	if (bench_loop) {
+		log_info("bench: loop fwd %lu lost %lu reordered %lu pps, %u held",
+			 (bench_fwd_pkts - last_fwd) * ONE_SECOND / elapsed_us,
+			 (bench_lost - last_lost) * ONE_SECOND / elapsed_us,
+			 (bench_reordered - last_reordered) * ONE_SECOND /
+			 elapsed_us,
+			 (bench_delay_line.tail - bench_delay_line.head) +
+			 (bench_reorder_line.tail - bench_reorder_line.head));
+	}
+
+	last_rx += rx;
+	last_tx = bench_tx_pkts;
+	last_drops = bench_drops;
+	last_nombuf = bench_nombuf;
+	last_fwd = bench_fwd_pkts;
+	last_lost = bench_lost;
+	last_reordered = bench_reordered;
+}
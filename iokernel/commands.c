@@ -10,24 +10,68 @@
 
 #include "defs.h"
 
-static int commands_drain_queue(struct thread *t, struct rte_mbuf **bufs, int n)
+#define CMD_PREFETCH_STRIDE 2
+
+/*
+ * Collects up to @n ingress buffers that @t returned through its RX
+ * completion ring.
+ */
+static int commands_drain_completions(struct thread *t, struct rte_mbuf **bufs,
+				      int n)
 {
-	int i, n_bufs = 0;
+	uint32_t head = load_acquire(&t->q_ptrs->rxc_head);
+	int nr = 0;
 
-	for (i = 0; i < n; i++) {
-		uint64_t cmd;
-		unsigned long payload;
+	while (t->rxc_tail != head && nr < n) {
+		bufs[nr++] = (struct rte_mbuf *)
+			t->rxc_ring[t->rxc_tail++ & (RX_COMPLETION_RING_SIZE - 1)];
+	}
 
-		if (!lrpc_recv(&t->txcmdq, &cmd, &payload))
-			break;
+	/* TODO: validate pointers */
+	if (nr > 0) {
+		store_release(&t->q_ptrs->rxc_tail, t->rxc_tail);
+		proc_rx_uncharge(t->p, nr);
+	}
+	return nr;
+}
+
+/**
+ * commands_free_completions - frees every buffer in a kthread's RX completion
+ * ring
+ * @t: the kthread, which must be parking or gone
+ */
+void commands_free_completions(struct thread *t)
+{
+	struct rte_mbuf *bufs[IOKERNEL_CMD_BURST_SIZE];
+	int i, nr;
+
+	do {
+		nr = commands_drain_completions(t, bufs, IOKERNEL_CMD_BURST_SIZE);
+		for (i = 0; i < nr; i++)
+			rte_pktmbuf_free(bufs[i]);
+	} while (nr > 0);
+}
+
+static int commands_drain_queue(struct thread *t, struct rte_mbuf **bufs, int n)
+{
+	struct lrpc_msg msgs[IOKERNEL_CMD_BURST_SIZE];
+	int i, nr, n_bufs = 0;
+
+	nr = lrpc_recv_burst(&t->txcmdq, msgs, n);
+	for (i = 0; i < nr; i++) {
+		uint64_t cmd = msgs[i].cmd;
+		unsigned long payload = msgs[i].payload;
 
 		switch (cmd) {
 		case TXCMD_NET_COMPLETE:
 			bufs[n_bufs++] = (struct rte_mbuf *)payload;
 			/* TODO: validate pointer @buf */
+			proc_rx_uncharge(t->p, 1);
 			break;
 
 		case TXCMD_PARKED_LAST:
+			/* the kthread can't return more buffers until woken */
+			commands_free_completions(t);
 			if (cores_park_kthread(t, false) &&
 			    t->p->active_thread_count == 0 && payload) {
 				t->p->pending_timer = true;
@@ -35,6 +79,7 @@ static int commands_drain_queue(struct thread *t, struct rte_mbuf **bufs, int n)
 			}
 			break;
 		case TXCMD_PARKED:
+			commands_free_completions(t);
 			/* notify another kthread if the park was involuntary */
 			if (cores_park_kthread(t, false) && payload != 0) {
 				bool success = rx_send_to_runtime(t->p, t->p->next_thread_rr++, RX_JOIN, payload);
@@ -42,6 +87,28 @@ static int commands_drain_queue(struct thread *t, struct rte_mbuf **bufs, int n)
 					STAT_INC(RX_JOIN_FAIL, 1);
 			}
 			break;
+		case TXCMD_CORE_DEMAND:
+			cores_demand_hint(t->p, TXCMD_CORE_DEMAND_NR(payload),
+					  TXCMD_CORE_DEMAND_US(payload));
+			break;
+		case TXCMD_MCAST_JOIN:
+			if (unlikely(mcast_join(t->p, payload)))
+				log_warn_ratelimited("commands: pid %d can't "
+						     "join group %lx",
+						     t->p->pid, payload);
+			break;
+		case TXCMD_MCAST_LEAVE:
+			mcast_leave(t->p, payload);
+			break;
+		case TXCMD_CORE_LIMIT:
+			cores_set_limit(t->p, payload);
+			break;
+		case TXCMD_FLOW_STEER:
+			cores_steer_flow(t, payload);
+			break;
+		case TXCMD_FLOW_ADOPT:
+			cores_adopt_flows(t, payload);
+			break;
 
 		default:
 			/* kill the runtime? */
@@ -58,6 +125,8 @@ static int commands_drain_queue(struct thread *t, struct rte_mbuf **bufs, int n)
 bool commands_rx(void)
 {
 	struct rte_mbuf *bufs[IOKERNEL_CMD_BURST_SIZE];
+	struct thread_poll *tp;
+	struct thread *t;
 	int i, n_bufs = 0;
 	static unsigned int pos = 0;
 
@@ -70,8 +139,24 @@ bool commands_rx(void)
 
 		if (n_bufs >= IOKERNEL_CMD_BURST_SIZE)
 			break;
-		n_bufs += commands_drain_queue(ts[idx], &bufs[n_bufs],
+
+		/* most threads are idle, so look ahead at their queues */
+		if (i + CMD_PREFETCH_STRIDE < nrts) {
+			tp = &ts_poll[(idx + CMD_PREFETCH_STRIDE) % nrts];
+			prefetch(tp->rxc_head);
+			prefetch(tp->txcmdq_next);
+		}
+		if (!thread_poll_has_cmds(&ts_poll[idx]))
+			continue;
+
+		t = ts[idx];
+		n_bufs += commands_drain_completions(t, &bufs[n_bufs],
 				IOKERNEL_CMD_BURST_SIZE - n_bufs);
+		if (n_bufs < IOKERNEL_CMD_BURST_SIZE) {
+			n_bufs += commands_drain_queue(t, &bufs[n_bufs],
+					IOKERNEL_CMD_BURST_SIZE - n_bufs);
+		}
+		thread_poll_refresh(t);
 	}
 
 	STAT_INC(COMMANDS_PULLED, n_bufs);
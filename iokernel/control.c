@@ -3,11 +3,12 @@
  */
 
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -18,7 +19,9 @@
 #include <base/mem.h>
 #include <base/log.h>
 #include <base/thread.h>
+#include <base/time.h>
 #include <iokernel/control.h>
+#include <iokernel/queue.h>
 
 #include "defs.h"
 
@@ -31,6 +34,127 @@ struct lrpc_params lrpc_data_to_control_params;
 static struct lrpc_chan_out lrpc_control_to_data;
 static struct lrpc_chan_in lrpc_data_to_control;
 static int nr_guaranteed;
+/* the tool that asked for a running handover, or -1 */
+static int handover_reqfd = -1;
+
+/*
+ * Fills in the table of 2MB page physical addresses of a shm region. Runtimes
+ * map their egress region with 1GB pages when they can, and each of those is
+ * physically contiguous, so one pagemap lookup covers 512 table entries.
+ */
+int control_lookup_paddrs(void *base, size_t len, physaddr_t *paddrs)
+{
+	size_t pgsize, i, nr, per_1gb = PGSIZE_1GB / PGSIZE_2MB;
+	physaddr_t *paddrs_1gb;
+	int ret;
+
+	if (mem_lookup_page_size(base, &pgsize) || pgsize != PGSIZE_1GB ||
+	    PGOFF_1GB(base))
+		return mem_lookup_page_phys_addrs(base, len, PGSIZE_2MB, paddrs);
+
+	paddrs_1gb = malloc(div_up(len, PGSIZE_1GB) * sizeof(*paddrs_1gb));
+	if (!paddrs_1gb)
+		return -ENOMEM;
+	ret = mem_lookup_page_phys_addrs(base, len, PGSIZE_1GB, paddrs_1gb);
+	if (ret)
+		goto out;
+
+	nr = div_up(len, PGSIZE_2MB);
+	for (i = 0; i < nr; i++) {
+		paddrs[i] = paddrs_1gb[i / per_1gb] +
+			    (i % per_1gb) * PGSIZE_2MB;
+	}
+
+out:
+	free(paddrs_1gb);
+	return ret;
+}
+
+/*
+ * Procs are torn down by a reaper thread rather than the control thread, since
+ * unmapping a large region or zeroing a pre-registered slot takes a while and
+ * would hold up attaching other runtimes. By then the proc's last reference is
+ * gone, so nothing on the dataplane points into its region anymore. Up to
+ * PROC_CACHE_NR freed procs are kept with their tables of physical addresses,
+ * so attaching skips the allocation, and a slot's table is only copied once.
+ */
+#define PROC_CACHE_NR	16
+
+static pthread_mutex_t reap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reap_cond = PTHREAD_COND_INITIALIZER;
+static struct proc *reap_list;
+static struct proc *proc_cache[PROC_CACHE_NR];
+static int nr_proc_cache;
+
+/*
+ * Allocates a proc with room for @nr_pages physical addresses, recycled if
+ * possible. Sets @warm if its table already holds those of @slot.
+ */
+static struct proc *control_alloc_proc(size_t nr_pages,
+				       struct prereg_slot *slot, bool *warm)
+{
+	struct proc *p = NULL, *c;
+	int i, best = -1;
+
+	*warm = false;
+	pthread_mutex_lock(&reap_lock);
+	for (i = 0; i < nr_proc_cache; i++) {
+		c = proc_cache[i];
+		if (c->paddrs_cap < nr_pages)
+			continue;
+		if (slot && c->paddrs_slot == slot && c->paddrs_nr >= nr_pages) {
+			best = i;
+			*warm = true;
+			break;
+		}
+		if (best < 0 || c->paddrs_cap < proc_cache[best]->paddrs_cap)
+			best = i;
+	}
+	if (best >= 0) {
+		p = proc_cache[best];
+		proc_cache[best] = proc_cache[--nr_proc_cache];
+	}
+	pthread_mutex_unlock(&reap_lock);
+
+	if (p) {
+		STAT_INC(PROCS_RECYCLED, 1);
+	} else {
+		p = malloc(sizeof(*p) + nr_pages * sizeof(physaddr_t));
+		if (!p)
+			return NULL;
+		p->paddrs_cap = nr_pages;
+	}
+
+	if (!*warm) {
+		p->paddrs_slot = NULL;
+		p->paddrs_nr = 0;
+	}
+	p->threads = NULL;
+	p->active_threads = NULL;
+	p->available_threads = NULL;
+	p->overflow_queue = NULL;
+#ifdef MLX
+	p->mr = NULL;
+#endif
+	return p;
+}
+
+/* frees a proc's per-thread arrays, and the proc unless the pool has room */
+static void control_free_proc(struct proc *p)
+{
+	free(p->threads);
+	free(p->active_threads);
+	free(p->available_threads);
+	free(p->overflow_queue);
+
+	pthread_mutex_lock(&reap_lock);
+	if (nr_proc_cache < PROC_CACHE_NR) {
+		proc_cache[nr_proc_cache++] = p;
+		p = NULL;
+	}
+	pthread_mutex_unlock(&reap_lock);
+	free(p);
+}
 
 static struct proc *control_create_proc(mem_key_t key, size_t len, pid_t pid,
 		int *fds, int n_fds)
@@ -40,15 +164,28 @@ static struct proc *control_create_proc(mem_key_t key, size_t len, pid_t pid,
 	size_t nr_pages;
 	struct proc *p;
 	struct thread_spec *threads;
+	struct prereg_slot *slot = NULL;
 	void *shbuf;
+	uint64_t start_us, lookup_us;
+	bool warm;
 	int i, ret;
 
+	start_us = microtime();
+
 	/* attach the shared memory region */
 	if (len < sizeof(hdr))
 		goto fail;
-	shbuf = mem_map_shm(key, NULL, len, PGSIZE_2MB, false);
-	if (shbuf == MAP_FAILED)
-		goto fail;
+	if (prereg_is_key(key)) {
+		/* already mapped, and reserved by this runtime */
+		slot = prereg_claim(key, pid, len);
+		if (!slot)
+			goto fail;
+		shbuf = slot->base;
+	} else {
+		shbuf = mem_map_shm(key, NULL, len, PGSIZE_2MB, false);
+		if (shbuf == MAP_FAILED)
+			goto fail;
+	}
 
 	/* parse the control header */
 	memcpy(&hdr, (struct control_hdr *)shbuf, sizeof(hdr)); /* TOCTOU */
@@ -63,13 +200,37 @@ static struct proc *control_create_proc(mem_key_t key, size_t len, pid_t pid,
 		goto fail_unmap;
 	}
 
+	if (hdr.sched_cfg.priority >= SCHED_PRIORITY_NR ||
+	    hdr.sched_cfg.weight > SCHED_WEIGHT_MAX ||
+	    hdr.sched_cfg.ht_policy >= SCHED_HT_NR ||
+	    hdr.sched_cfg.tx_rate_mbps > SCHED_TX_RATE_MAX_MBPS) {
+		log_err("invalid scheduling priority, weight, ht policy, or "
+			"tx rate");
+		goto fail_unmap;
+	}
+
+	if (hdr.mtu > dp.mtu) {
+		log_err("runtime MTU %u exceeds the iokernel's (%u), start it "
+			"with mtu=<bytes>", hdr.mtu, dp.mtu);
+		goto fail_unmap;
+	}
+	if (hdr.sched_cfg.weight == 0)
+		hdr.sched_cfg.weight = 1;
+
 	nr_guaranteed += hdr.sched_cfg.guaranteed_cores;
 
 	/* create the process */
 	nr_pages = div_up(len, PGSIZE_2MB);
-	p = malloc(sizeof(*p) + nr_pages * sizeof(physaddr_t));
+	p = control_alloc_proc(nr_pages, slot, &warm);
 	if (!p)
 		goto fail_unmap;
+	p->threads = calloc(hdr.thread_count, sizeof(*p->threads));
+	p->active_threads = calloc(hdr.thread_count,
+				   sizeof(*p->active_threads));
+	p->available_threads = calloc(BITMAP_LONG_SIZE(hdr.thread_count),
+				      sizeof(unsigned long));
+	if (!p->threads || !p->active_threads || !p->available_threads)
+		goto fail_free_just_proc;
 
 	threads = malloc(sizeof(*threads) * hdr.thread_count);
 	if (!threads)
@@ -78,6 +239,7 @@ static struct proc *control_create_proc(mem_key_t key, size_t len, pid_t pid,
 	       sizeof(*threads) * hdr.thread_count);
 
 	p->pid = pid;
+	p->key = key;
 	ref_init(&p->ref);
 	reg.base = shbuf;
 	reg.len = len;
@@ -85,11 +247,24 @@ static struct proc *control_create_proc(mem_key_t key, size_t len, pid_t pid,
 	p->removed = false;
 	p->sched_cfg = hdr.sched_cfg;
 	p->thread_count = hdr.thread_count;
+	p->core_limit = hdr.sched_cfg.max_cores;
+	if (p->core_limit == 0 || p->core_limit > p->thread_count)
+		p->core_limit = p->thread_count;
 	if (eth_addr_is_multicast(&hdr.mac) || eth_addr_is_zero(&hdr.mac))
 		goto fail_free_proc;
 	p->mac = hdr.mac;
 	p->pending_timer = false;
+	p->last_poll_us = microtime();
+	p->scan_idx = -1;
 	p->uniqid = rdtsc();
+	p->prereg = slot;
+	p->rx_bufs = 0;
+#ifdef STATS
+	p->rx_bufs_peak = 0;
+	p->rx_quota_drops = 0;
+#endif
+	memset(&p->stats, 0, sizeof(p->stats));
+	tx_init_proc(p);
 
 	/* initialize the threads */
 	for (i = 0; i < hdr.thread_count; i++) {
@@ -116,24 +291,49 @@ static struct proc *control_create_proc(mem_key_t key, size_t len, pid_t pid,
 		th->p = p;
 		th->parked = true;
 		th->waking = false;
+		th->preempt_req_us = 0;
 		th->reaffinitize = true;
 		th->at_idx = -1;
 		th->ts_idx = -1;
+		th->last_rq_tail = th->last_rxq_tail = 0;
+		th->last_rq_head = th->last_rxq_head = 0;
+		th->rq_oldest_us = th->rxq_oldest_us = 0;
+		th->tx_wait_since_us = 0;
 
 		/* initialize pointer to queue pointers in shared memory */
 		th->q_ptrs = (struct q_ptrs *) shmptr_to_ptr(&reg, s->q_ptrs,
 				sizeof(struct q_ptrs));
 		if (!th->q_ptrs)
 			goto fail_free_proc;
+
+		/* and to the ring ingress buffers are returned through */
+		th->rxc_ring = (unsigned long *) shmptr_to_ptr(&reg,
+				s->rx_completions,
+				sizeof(unsigned long) * RX_COMPLETION_RING_SIZE);
+		if (!th->rxc_ring)
+			goto fail_free_proc;
+		th->rxc_tail = 0;
 	}
 
 	free(threads);
 
 	/* initialize the table of physical page addresses */
-	ret = mem_lookup_page_phys_addrs(p->region.base, p->region.len, PGSIZE_2MB,
-			p->page_paddrs);
+	lookup_us = microtime();
+	if (warm) {
+		ret = 0;
+	} else if (slot) {
+		memcpy(p->page_paddrs, slot->paddrs,
+		       nr_pages * sizeof(physaddr_t));
+		p->paddrs_slot = slot;
+		p->paddrs_nr = nr_pages;
+		ret = 0;
+	} else {
+		ret = control_lookup_paddrs(p->region.base, p->region.len,
+					    p->page_paddrs);
+	}
 	if (ret)
 		goto fail_free_just_proc;
+	lookup_us = microtime() - lookup_us;
 
 	p->max_overflows = hdr.egress_buf_count;
 	p->nr_overflows = 0;
@@ -141,19 +341,71 @@ static struct proc *control_create_proc(mem_key_t key, size_t len, pid_t pid,
 	if (p->overflow_queue == NULL)
 		goto fail_free_just_proc;
 
+	start_us = microtime() - start_us;
+	STAT_INC(REGISTRATIONS, 1);
+	STAT_INC(REGISTRATION_US, start_us);
+	log_info("control: attached pid %d (%ld MB of shm) in %ld us, %ld us "
+		 "looking up physical addresses", pid, len / (1024 * 1024),
+		 start_us, lookup_us);
+
 	return p;
 
 fail_free_proc:
 	free(threads);
 fail_free_just_proc:
-	free(p);
+	control_free_proc(p);
 fail_unmap:
-	mem_unmap_shm(shbuf);
+	if (slot)
+		prereg_release(slot);
+	else
+		mem_unmap_shm(shbuf);
 fail:
 	log_err("control: couldn't attach pid %d", pid);
 	return NULL;
 }
 
+/* unmaps or recycles a proc's region, then frees the proc */
+static void control_teardown_proc(struct proc *p)
+{
+	uint64_t start_us = microtime();
+
+#ifdef MLX
+	if (p->mr)
+		mlx_dereg_mem(p->mr);
+#endif
+	if (p->prereg)
+		prereg_recycle(p->prereg);
+	else
+		mem_unmap_shm(p->region.base);
+	control_free_proc(p);
+
+	STAT_INC(TEARDOWNS, 1);
+	STAT_INC(TEARDOWN_US, microtime() - start_us);
+}
+
+static void *control_reap_thread(void *data)
+{
+	struct proc *p;
+
+	/* stay off the dataplane's cores */
+	if (cores_pin_thread(gettid(), core_assign.ctrl_core) < 0)
+		log_warn("control: failed to pin the reaper thread");
+
+	while (true) {
+		pthread_mutex_lock(&reap_lock);
+		while (!reap_list)
+			pthread_cond_wait(&reap_cond, &reap_lock);
+		p = reap_list;
+		reap_list = p->reap_next;
+		pthread_mutex_unlock(&reap_lock);
+
+		control_teardown_proc(p);
+	}
+
+	return NULL;
+}
+
+/* detaches a proc, leaving its memory to the reaper */
 static void control_destroy_proc(struct proc *p)
 {
 	int i;
@@ -163,9 +415,12 @@ static void control_destroy_proc(struct proc *p)
 		close(p->threads[i].park_efd);
 
 	nr_guaranteed -= p->sched_cfg.guaranteed_cores;
-	mem_unmap_shm(p->region.base);
-	free(p->overflow_queue);
-	free(p);
+
+	pthread_mutex_lock(&reap_lock);
+	p->reap_next = reap_list;
+	reap_list = p;
+	pthread_cond_signal(&reap_cond);
+	pthread_mutex_unlock(&reap_lock);
 }
 
 /*
@@ -224,6 +479,65 @@ static int control_recv_fds(int fd, int *fds, int n)
 	return n_fds;
 }
 
+/* sends a tool the result of its request */
+static void control_reply(int fd, int32_t ret)
+{
+	if (write(fd, &ret, sizeof(ret)) != sizeof(ret))
+		log_warn("control: failed to reply [%s]", strerror(errno));
+}
+
+static void control_start_handover(int fd, const struct ucred *ucred)
+{
+	int i, ret;
+
+	if (handover_reqfd >= 0)
+		ret = -EBUSY;
+	else if (ucred->uid != 0 && ucred->uid != geteuid())
+		ret = -EPERM;
+	else
+		ret = handover_prepare();
+
+	/* pre-registered regions only live as long as the iokernel's mapping */
+	for (i = 0; !ret && i < nr_clients; i++) {
+		if (clients[i]->prereg)
+			ret = -EBUSY;
+	}
+
+	if (!ret && !lrpc_send(&lrpc_control_to_data, DATAPLANE_HANDOVER, 0))
+		ret = -EAGAIN;
+	if (ret) {
+		log_warn("control: refusing a handover [%s]", strerror(-ret));
+		control_reply(fd, ret);
+		close(fd);
+		return;
+	}
+
+	log_info("control: handing over to a new iokernel");
+	intr_notify();
+	handover_reqfd = fd;
+}
+
+/* execs the new image once the dataplane has stopped, or resumes */
+static void control_poll_handover(void)
+{
+	int ret;
+
+	switch (handover_status()) {
+	case HANDOVER_QUIESCED:
+		ret = handover_exec(clients, clientfds, nr_clients, controlfd,
+				    handover_reqfd);
+		/* the NIC is stopped, so there's no going back */
+		log_err("control: handover failed [%s]", strerror(-ret));
+		exit(EXIT_FAILURE);
+	case HANDOVER_FAILED:
+		control_reply(handover_reqfd, -ETIMEDOUT);
+		close(handover_reqfd);
+		handover_reqfd = -1;
+		handover_reset();
+		break;
+	}
+}
+
 static void control_add_client(void)
 {
 	struct proc *p;
@@ -266,6 +580,52 @@ static void control_add_client(void)
 		goto fail;
 	}
 
+	/* a tool asking for the core allocation trace, not a runtime */
+	if (shm_key == CONTROL_TRACE_KEY && shm_len == 0) {
+		ret = trace_dump(fd, clients, nr_clients);
+		if (ret)
+			log_warn("control: failed to dump the trace [%s]",
+				 strerror(-ret));
+		close(fd);
+		return;
+	}
+
+	/* a tool asking for the captured packets */
+	if (shm_key == CONTROL_PCAP_KEY && shm_len == 0) {
+		ret = pcap_dump(fd);
+		if (ret)
+			log_warn("control: failed to dump the capture [%s]",
+				 strerror(-ret));
+		close(fd);
+		return;
+	}
+
+	/* a tool asking for the counters */
+	if (shm_key == CONTROL_STATS_KEY && shm_len == 0) {
+		ret = stat_dump(fd, clients, nr_clients);
+		if (ret)
+			log_warn("control: failed to dump the counters [%s]",
+				 strerror(-ret));
+		close(fd);
+		return;
+	}
+
+	/* a tool asking for a live upgrade */
+	if (shm_key == CONTROL_HANDOVER_KEY && shm_len == 0) {
+		control_start_handover(fd, &ucred);
+		return;
+	}
+
+	/* a runtime reserving a pre-registered slot, it registers later */
+	if (shm_key == CONTROL_PREREG_KEY) {
+		shm_key = prereg_reserve(ucred.pid, shm_len);
+		if (write(fd, &shm_key, sizeof(shm_key)) != sizeof(shm_key))
+			log_warn("control: failed to send the prereg key [%s]",
+				 strerror(errno));
+		close(fd);
+		return;
+	}
+
 	n_fds = control_recv_fds(fd, &fds[0], NCPU);
 	if (n_fds <= 0) {
 		log_err("control: control_recv_fds() failed with ret %d", n_fds);
@@ -284,6 +644,7 @@ static void control_add_client(void)
 				ucred.pid);
 		goto fail_destroy_proc;
 	}
+	intr_notify();
 
 	clients[nr_clients] = p;
 	clientfds[nr_clients++] = fd;
@@ -317,6 +678,7 @@ static void control_instruct_dataplane_to_remove_client(int fd)
 			(unsigned long) clients[i])) {
 		log_err("control: failed to inform dataplane of removed client");
 	}
+	intr_notify();
 }
 
 static void control_remove_client(struct proc *p)
@@ -341,44 +703,86 @@ static void control_remove_client(struct proc *p)
 	nr_clients--;
 }
 
+/**
+ * control_restore_client - attaches a runtime inherited from a handover
+ * @key: the shm key of the runtime's region
+ * @len: the length of the region
+ * @pid: the runtime's pid
+ * @fd: the runtime's control connection
+ * @efds: the eventfds of its kthreads
+ * @n_efds: the number of kthreads
+ *
+ * Runs before the control thread starts. Takes over the descriptors, and
+ * closes them on failure. Returns the proc, which the caller must add to the
+ * dataplane, or NULL on failure.
+ */
+struct proc *control_restore_client(mem_key_t key, size_t len, pid_t pid,
+				    int fd, int *efds, int n_efds)
+{
+	struct proc *p = NULL;
+	int i;
+
+	if (nr_clients < IOKERNEL_MAX_PROC)
+		p = control_create_proc(key, len, pid, efds, n_efds);
+	if (!p) {
+		for (i = 0; i < n_efds; i++)
+			close(efds[i]);
+		close(fd);
+		return NULL;
+	}
+
+	clients[nr_clients] = p;
+	clientfds[nr_clients++] = fd;
+	return p;
+}
+
 static void control_loop(void)
 {
-	fd_set readset;
-	int maxfd, i, nrdy;
+	/* select() can't watch descriptors past FD_SETSIZE, poll() can */
+	static struct pollfd pfds[IOKERNEL_MAX_PROC + 1];
+	int nr_pfds, i, nrdy;
 	uint64_t cmd;
 	unsigned long payload;
 	struct proc *p;
 
 	while (1) {
-		maxfd = controlfd;
-		FD_ZERO(&readset);
-		FD_SET(controlfd, &readset);
-
-		for (i = 0; i < nr_clients; i++) {
+		nr_pfds = 0;
+
+		/*
+		 * During a handover, poll for the dataplane to stop. New and
+		 * exiting runtimes are left to the new image, which inherits
+		 * their connections.
+		 */
+		for (i = 0; handover_reqfd < 0 && i < nr_clients; i++) {
 			if (clients[i]->removed)
 				continue;
 
-			FD_SET(clientfds[i], &readset);
-			maxfd = (clientfds[i] > maxfd) ? clientfds[i] : maxfd;
+			pfds[nr_pfds].fd = clientfds[i];
+			pfds[nr_pfds++].events = POLLIN;
+		}
+		if (handover_reqfd < 0) {
+			pfds[nr_pfds].fd = controlfd;
+			pfds[nr_pfds++].events = POLLIN;
 		}
 
-		nrdy = select(maxfd + 1, &readset, NULL, NULL, NULL);
+		nrdy = poll(pfds, nr_pfds, handover_reqfd < 0 ? -1 : 1);
 		if (nrdy == -1) {
-			log_err("control: select() failed [%s]",
+			log_err("control: poll() failed [%s]",
 				strerror(errno));
 			BUG();
 		}
 
-		for (i = 0; i <= maxfd && nrdy > 0; i++) {
-			if (!FD_ISSET(i, &readset))
+		for (i = 0; i < nr_pfds && nrdy > 0; i++) {
+			if (!pfds[i].revents)
 				continue;
 
-			if (i == controlfd) {
+			if (pfds[i].fd == controlfd) {
 				/* accept a new connection */
 				control_add_client();
 			} else {
 				/* close an existing connection */
-				control_instruct_dataplane_to_remove_client(i);
+				control_instruct_dataplane_to_remove_client(
+					pfds[i].fd);
 			}
 
 			nrdy--;
@@ -391,6 +795,9 @@ static void control_loop(void)
 			/* it is now safe to remove data structures for this client */
 			control_remove_client(p);
 		}
+
+		if (handover_reqfd >= 0)
+			control_poll_handover();
 	}
 }
 
@@ -419,7 +826,7 @@ static int control_init_dataplane_comm(void)
 	struct lrpc_msg *buffer_out, *buffer_in;
 	uint32_t *wb_out, *wb_in;
 
-	buffer_out = malloc(sizeof(struct lrpc_msg) *
+	buffer_out = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct lrpc_msg) *
 			CONTROL_DATAPLANE_QUEUE_SIZE);
 	if (!buffer_out)
 		goto fail;
@@ -438,7 +845,8 @@ static int control_init_dataplane_comm(void)
 		goto fail_free_wb_out;
 	}
 
-	buffer_in = malloc(sizeof(struct lrpc_msg) * CONTROL_DATAPLANE_QUEUE_SIZE);
+	buffer_in = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct lrpc_msg) *
+			CONTROL_DATAPLANE_QUEUE_SIZE);
 	if (!buffer_in)
 		goto fail_free_wb_out;
 	wb_in = malloc(CACHE_LINE_SIZE);
@@ -470,11 +878,10 @@ fail:
 	return -1;
 }
 
-int control_init(void)
+static int control_listen(void)
 {
 	struct sockaddr_un addr;
-	pthread_t tid;
-	int sfd, ret;
+	int sfd;
 
 	BUILD_ASSERT(strlen(CONTROL_SOCK_PATH) <= sizeof(addr.sun_path) - 1);
 
@@ -501,20 +908,70 @@ int control_init(void)
 		return -errno;
 	}
 
-	ret = control_init_dataplane_comm();
-	if (ret < 0) {
-		log_err("control: cannot initialize communication with dataplane");
-		return ret;
-	}
+	return sfd;
+}
+
+/**
+ * control_start - spawns the control thread
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int control_start(void)
+{
+	pthread_t tid;
 
 	log_info("control: spawning control thread");
-	controlfd = sfd;
+	if (pthread_create(&tid, NULL, control_reap_thread, NULL)) {
+		log_err("control: couldn't spawn the reaper thread");
+		close(controlfd);
+		return -ENOMEM;
+	}
 	if (pthread_create(&tid, NULL, control_thread, NULL) == -1) {
 		log_err("control: pthread_create() failed [%s]",
 			strerror(errno));
-		close(sfd);
+		close(controlfd);
 		return -errno;
 	}
 
-	return 0;	
+	return 0;
+}
+
+/*
+ * Each runtime holds a connection and an eventfd per kthread, so hundreds of
+ * them quickly pass the default soft limit of 1024 descriptors.
+ */
+static void control_raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur == rl.rlim_max)
+		return;
+
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl))
+		log_warn("control: couldn't raise the descriptor limit [%s]",
+			 strerror(errno));
+}
+
+int control_init(void)
+{
+	int ret;
+
+	control_raise_fd_limit();
+
+	/* after a handover, the socket is inherited and already bound */
+	controlfd = handover_mode ? handover_control_fd() : control_listen();
+	if (controlfd < 0)
+		return controlfd;
+
+	ret = control_init_dataplane_comm();
+	if (ret < 0) {
+		log_err("control: cannot initialize communication with dataplane");
+		return ret;
+	}
+
+	/* inherited runtimes are attached first, see handover_late_init() */
+	if (handover_mode)
+		return 0;
+	return control_start();
 }
@@ -2,9 +2,15 @@
  * cores.c - manages assignments of cores to runtimes, the iokernel, and linux
  */
 
+#include <fcntl.h>
+#include <numaif.h>
 #include <sched.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/syscall.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 #include <base/bitmap.h>
@@ -14,17 +20,25 @@
 #include <iokernel/queue.h>
 
 #include "defs.h"
+#include "../ksched/ksched.h"
+
+#define KSCHED_DEV_PATH	"/dev/ksched"
 
 /*#define CORES_NOHT 1*/
 
 static unsigned int nr_avail_cores;
+static unsigned int nr_avail_cores_node[NNUMA];
+static unsigned int nr_cores_node[NNUMA];
 static unsigned int total_cores;
 static DEFINE_BITMAP(online_cores, NCPU);
+/* the online cores of each NUMA node */
+static DEFINE_BITMAP(node_cores[NNUMA], NCPU);
 
 DEFINE_BITMAP(avail_cores, NCPU);
 struct core_assignments core_assign;
 unsigned int nrts = 0;
 struct thread *ts[NCPU];
+struct thread_poll ts_poll[NCPU];
 
 /* maps each cpu number to the number of its hyperthread buddy */
 static int cpu_siblings[NCPU];
@@ -39,6 +53,16 @@ unsigned int get_total_cores(void)
 	return total_cores;
 }
 
+bool cores_is_online(unsigned int core)
+{
+	return bitmap_test(online_cores, core);
+}
+
+bool cores_is_idle(unsigned int core)
+{
+	return bitmap_test(avail_cores, core);
+}
+
 /**
  * cpu_to_sibling_cpu - gets the sibling (hyperthread pair) of a cpu
  * @cpu: the number of the cpu
@@ -61,6 +85,30 @@ struct core {
 
 static struct core core_history[NCPU];
 
+/*
+ * Wakeups and preemptions are batched during an allocation pass and sent out
+ * together by cores_flush_batch(). Preemptions go out as one KSCHED_IOC_WAKE
+ * if the ksched module is loaded, and as one tgkill() each otherwise.
+ */
+static int ksched_fd = -1;
+static bool batching;
+static unsigned int nr_batch_wakes;
+static struct thread *batch_wakes[NCPU];
+static struct thread *batch_preempts[NCPU];
+static struct ksched_wake_req *batch_req;
+
+/* returns the NUMA node of @core */
+static inline int core_node(unsigned int core)
+{
+	return cpu_to_node(core);
+}
+
+/* returns true if @core is on the socket that @p prefers */
+static inline bool core_is_home(struct proc *p, unsigned int core)
+{
+	return !dp.numa || core_node(core) == p->home_node;
+}
+
 /**
  * core_reserve - record that core is now in use by thread
  * @core: the core to reserve
@@ -72,6 +120,12 @@ static inline void core_reserve(unsigned int core, struct thread *th)
 
 	bitmap_clear(avail_cores, core);
 	nr_avail_cores--;
+	nr_avail_cores_node[core_node(core)]--;
+	if (!core_is_home(th->p, core))
+		STAT_INC(REMOTE_CORE_GRANTS, 1);
+	if (power_core_is_deep(core))
+		STAT_INC(POWER_DEEP_GRANTS, 1);
+	rdt_core_grant(core, th->p);
 
 	BUG_ON(core_history[core].next && th != core_history[core].next);
 
@@ -94,6 +148,7 @@ static inline void core_cede(unsigned int core)
 
 	bitmap_set(avail_cores, core);
 	nr_avail_cores++;
+	nr_avail_cores_node[core_node(core)]++;
 }
 
 /**
@@ -105,6 +160,9 @@ static inline void core_init(unsigned int core)
 	bitmap_set(avail_cores, core);
 	bitmap_set(online_cores, core);
 	nr_avail_cores++;
+	nr_avail_cores_node[core_node(core)]++;
+	nr_cores_node[core_node(core)]++;
+	bitmap_set(node_cores[core_node(core)], core);
 	total_cores++;
 	core_history[core].current = NULL;
 	core_history[core].prev = NULL;
@@ -219,6 +277,292 @@ static inline struct proc *get_bursting_proc()
 	return list_top(&bursting_procs, struct proc, bursting_link);
 }
 
+/**
+ * proc_preempt_before - returns true if @a should give up a core before @b
+ * @a: the first process
+ * @b: the second process
+ *
+ * Lower priority classes lose cores first. Within a class, the proc using the
+ * most cores relative to its weight loses first.
+ */
+static inline bool proc_preempt_before(struct proc *a, struct proc *b)
+{
+	if (a->sched_cfg.priority != b->sched_cfg.priority)
+		return a->sched_cfg.priority > b->sched_cfg.priority;
+
+	return (uint64_t)a->active_thread_count * b->sched_cfg.weight >
+	       (uint64_t)b->active_thread_count * a->sched_cfg.weight;
+}
+
+/**
+ * proc_can_preempt - returns true if @p may take a core from @victim
+ * @p: the process that wants a core
+ * @victim: the process currently running on the core
+ *
+ * Guaranteed cores are never taken. A proc below its guarantee may take any
+ * burstable core, otherwise it may only take burstable cores from a lower
+ * priority class, or from a proc of its own class that would still have a
+ * larger weighted share afterward.
+ */
+static bool proc_can_preempt(struct proc *p, struct proc *victim)
+{
+	if (victim == p || !proc_is_bursting(victim))
+		return false;
+
+	if (p->active_thread_count < p->sched_cfg.guaranteed_cores)
+		return true;
+
+	if (p->sched_cfg.priority != victim->sched_cfg.priority)
+		return p->sched_cfg.priority < victim->sched_cfg.priority;
+
+	return (uint64_t)victim->active_thread_count * p->sched_cfg.weight >
+	       (uint64_t)(p->active_thread_count + 1) * victim->sched_cfg.weight;
+}
+
+/* returns the proc running (or about to run) on @core, or NULL if none */
+static struct proc *core_occupant(int core)
+{
+	if (core_history[core].next)
+		return core_history[core].next->p;
+	if (core_available(core) || !core_history[core].current)
+		return NULL;
+	return core_history[core].current->p;
+}
+
+/**
+ * core_compatible - returns true if @p may run on @core given the proc on its
+ * hyperthread pair core
+ * @p: the process that wants the core
+ * @core: the core to check
+ */
+static bool core_compatible(struct proc *p, int core)
+{
+	struct proc *buddy_proc = core_occupant(cpu_to_sibling_cpu(core));
+
+	if (!buddy_proc || buddy_proc == p)
+		return true;
+
+	return p->sched_cfg.ht_policy != SCHED_HT_EXCLUSIVE &&
+	       buddy_proc->sched_cfg.ht_policy != SCHED_HT_EXCLUSIVE;
+}
+
+/* returns true if both hyperthreads of @core's physical core are idle */
+static inline bool core_pair_available(int core)
+{
+	return core_available(core) &&
+	       core_available(cpu_to_sibling_cpu(core));
+}
+
+/**
+ * pick_overloaded_proc - returns the overloaded proc that should be granted a
+ * core first, or NULL if none exists
+ * @core: the core to be granted, or -1 if not yet known
+ */
+static struct proc *pick_overloaded_proc(int core)
+{
+	struct proc *p, *best = NULL;
+
+	list_for_each(&overloaded_procs, p, overloaded_link) {
+		if (core >= 0 && !core_compatible(p, core))
+			continue;
+		if (!best || proc_preempt_before(best, p)) {
+			best = p;
+			continue;
+		}
+
+		/* between equals, prefer the proc whose home has the core */
+		if (core >= 0 && !proc_preempt_before(p, best) &&
+		    core_is_home(p, core) && !core_is_home(best, core))
+			best = p;
+	}
+
+	return best;
+}
+
+/*
+ * Steers an even share of flow buckets to a newly active thread, taking them
+ * only from threads that have more than their share. A thread that parked
+ * still owns its buckets unless they were adopted, so it gets them back.
+ */
+static void proc_flows_add_thread(struct proc *p, struct thread *th)
+{
+	struct thread *owner;
+	unsigned int i, target, moved = 0;
+
+	target = IOKERNEL_FLOW_BUCKETS / p->active_thread_count;
+	for (i = 0; i < IOKERNEL_FLOW_BUCKETS; i++) {
+		if (th->nr_flow_buckets >= target)
+			break;
+
+		owner = p->flow_tbl[i];
+		if (owner == th)
+			continue;
+		if (owner && !owner->parked && owner->nr_flow_buckets <= target)
+			continue;
+		/* packets still queued to a parked owner must be read first */
+		if (owner && owner->parked && !thread_rxq_drained(owner))
+			continue;
+
+		if (owner) {
+			owner->nr_flow_buckets--;
+			moved++;
+		}
+		p->flow_tbl[i] = th;
+		th->nr_flow_buckets++;
+	}
+
+	STAT_INC(FLOW_TBL_UPDATES, 1);
+	STAT_INC(FLOW_BUCKETS_MOVED, moved);
+	log_debug("cores: moved %u flow buckets to kthread %ld of pid %d",
+		  moved, th - p->threads, p->pid);
+}
+
+/**
+ * cores_steer_flow - steers a flow's bucket to the thread that reads it
+ * @th: the thread that asked
+ * @hash: the RSS hash of the flow
+ *
+ * Ignored if @th isn't active. The bucket may move again when threads are
+ * added or removed.
+ */
+void cores_steer_flow(struct thread *th, uint32_t hash)
+{
+	struct thread **slot = &th->p->flow_tbl[hash % IOKERNEL_FLOW_BUCKETS];
+
+	if (th->parked || *slot == th)
+		return;
+
+	if (*slot)
+		(*slot)->nr_flow_buckets--;
+	*slot = th;
+	th->nr_flow_buckets++;
+	STAT_INC(FLOW_STEERS, 1);
+}
+
+/**
+ * cores_release_flows - hands the flow buckets of a parked thread to the
+ * active threads with the fewest buckets
+ * @th: the parked thread
+ *
+ * Only safe once the runtime has read everything queued to @th, otherwise
+ * packets of a flow could be handled out of order.
+ */
+void cores_release_flows(struct thread *th)
+{
+	struct proc *p = th->p;
+	struct thread *least;
+	unsigned int i, j, moved = 0;
+
+	if (p->active_thread_count == 0 || th->nr_flow_buckets == 0)
+		return;
+
+	for (i = 0; i < IOKERNEL_FLOW_BUCKETS; i++) {
+		if (p->flow_tbl[i] != th)
+			continue;
+
+		least = p->active_threads[0];
+		for (j = 1; j < p->active_thread_count; j++) {
+			if (p->active_threads[j]->nr_flow_buckets <
+			    least->nr_flow_buckets)
+				least = p->active_threads[j];
+		}
+
+		p->flow_tbl[i] = least;
+		least->nr_flow_buckets++;
+		moved++;
+	}
+
+	th->nr_flow_buckets = 0;
+	STAT_INC(FLOW_TBL_UPDATES, 1);
+	STAT_INC(FLOW_BUCKETS_MOVED, moved);
+	log_debug("cores: moved %u flow buckets from kthread %ld of pid %d",
+		  moved, th - p->threads, p->pid);
+}
+
+/**
+ * cores_adopt_flows - moves the flow buckets of a detached thread to the
+ * thread that detached it
+ * @th: the thread that detached the other (TXCMD_FLOW_ADOPT)
+ * @kthread: the index of the detached thread
+ *
+ * The runtime sends this after taking the detached thread's timers and egress
+ * packets, which it only does once that thread's RX queue is empty, so the
+ * adopted flows keep their order and stay on one kthread with their timers.
+ */
+void cores_adopt_flows(struct thread *th, unsigned long kthread)
+{
+	struct proc *p = th->p;
+	struct thread *old;
+	unsigned int i, moved = 0;
+
+	if (unlikely(kthread >= p->thread_count))
+		return;
+	old = &p->threads[kthread];
+
+	/* it may have been woken again since, then it keeps its flows */
+	if (old == th || !old->parked || old->nr_flow_buckets == 0)
+		return;
+
+	/* the adopter may have parked too, then spread the flows out */
+	if (th->parked) {
+		cores_release_flows(old);
+		return;
+	}
+
+	for (i = 0; i < IOKERNEL_FLOW_BUCKETS; i++) {
+		if (p->flow_tbl[i] != old)
+			continue;
+		p->flow_tbl[i] = th;
+		moved++;
+	}
+
+	th->nr_flow_buckets += moved;
+	old->nr_flow_buckets = 0;
+	STAT_INC(FLOW_TBL_UPDATES, 1);
+	STAT_INC(FLOW_BUCKETS_MOVED, moved);
+	STAT_INC(FLOW_ADOPTS, 1);
+	log_debug("cores: kthread %ld of pid %d adopted %u flow buckets of "
+		  "kthread %ld", th - p->threads, p->pid, moved, old - p->threads);
+}
+
+/**
+ * cores_scan_proc - makes the allocation scans look at a proc
+ * @p: the proc
+ *
+ * Called when @p gets an active kthread or a demand hint, or a timer while
+ * it may be idle. The scans drop it again once it has none of them.
+ */
+void cores_scan_proc(struct proc *p)
+{
+	if (p->scan_idx >= 0)
+		return;
+
+	/* queue positions and delays from before it was dropped are stale */
+	p->last_poll_us = microtime();
+	p->scan_idx = dp.nr_scan_procs;
+	dp.scan_procs[dp.nr_scan_procs++] = p;
+}
+
+static void cores_unscan_proc(struct proc *p)
+{
+	struct proc *last;
+
+	if (p->scan_idx < 0)
+		return;
+
+	last = dp.scan_procs[--dp.nr_scan_procs];
+	dp.scan_procs[p->scan_idx] = last;
+	last->scan_idx = p->scan_idx;
+	p->scan_idx = -1;
+}
+
+/* returns true if the allocation scans have nothing to do for @p */
+static bool cores_scan_is_idle(struct proc *p)
+{
+	return p->active_thread_count == 0 && !p->pending_timer &&
+	       !p->demand_deadline_us;
+}
+
 /**
  * thread_reserve - record that thread th will now run on core.
  * @th: the thread to reserve
@@ -238,6 +582,7 @@ static inline void thread_reserve(struct thread *th, unsigned int core)
 	p->active_threads[p->active_thread_count] = th;
 	th->at_idx = p->active_thread_count++;
 	list_del_from(&p->idle_threads, &th->idle_link);
+	cores_scan_proc(p);
 
 	if (p->active_thread_count > p->sched_cfg.guaranteed_cores)
 		proc_set_bursting(p);
@@ -248,6 +593,8 @@ static inline void thread_reserve(struct thread *th, unsigned int core)
 	th->parked = false;
 	th->waking = true;
 	poll_thread(th);
+
+	proc_flows_add_thread(p, th);
 }
 
 /**
@@ -270,10 +617,20 @@ static inline void thread_cede(struct thread *th)
 	if (p->active_thread_count == p->sched_cfg.guaranteed_cores)
 		proc_clear_bursting(p);
 
+	/* parking satisfies any preemption request */
+	th->preempt_req_us = 0;
+	ACCESS_ONCE(th->q_ptrs->preempt_req) = 0;
+
 	/* remove the thread from the polling array (if queues are empty) */
 	th->parked = true;
 	if (lrpc_empty(&th->txpktq))
 		unpoll_thread(th);
+
+	/*
+	 * The thread keeps its flow buckets until the runtime detaches it and
+	 * the detaching kthread adopts them (see cores_adopt_flows()), so that
+	 * packets arriving meanwhile queue behind those already sent to it.
+	 */
 }
 
 /*
@@ -347,69 +704,174 @@ static struct thread *pick_thread_for_proc(struct proc *p, int core)
 	return list_tail(&p->idle_threads, struct thread, idle_link);
 }
 
+/*
+ * Considers preempting @core on behalf of @p, keeping it in @best if it runs
+ * the proc that should give up a core first. Ties go to cores on @p's home
+ * socket, then to earlier candidates.
+ */
+static void consider_victim_core(struct proc *p, int core, int *best)
+{
+	struct proc *victim, *best_victim;
+
+	if (core_available(core) || !core_history[core].current ||
+	    core_history[core].next != NULL)
+		return;
+
+	victim = core_history[core].current->p;
+	if (!proc_can_preempt(p, victim) || !core_compatible(p, core))
+		return;
+
+	if (*best < 0) {
+		*best = core;
+		return;
+	}
+
+	best_victim = core_history[*best].current->p;
+	if (proc_preempt_before(victim, best_victim) ||
+	    (!proc_preempt_before(best_victim, victim) &&
+	     core_is_home(p, core) && !core_is_home(p, *best)))
+		*best = core;
+}
+
 /**
- * pick_core_for_proc - choose a core to allocate to proc p.
+ * pick_victim_core - choose a busy core to preempt for proc p.
  * @p: the process to allocate a core to
  *
- * Returns an available core if one exists, or else a core to be preempted.
+ * Prefers hyperthread pairs of cores the proc already runs on, then the core
+ * it ran on most recently, as long as the victim is just as preemptible.
+ *
+ * Returns a core, or -1 if no core may be preempted.
  */
-static int pick_core_for_proc(struct proc *p)
+static int pick_victim_core(struct proc *p)
 {
-	int buddy_core, core;
-	int i;
+	int i, best = -1;
 	struct thread *t;
-	struct proc *buddy_proc, *core_proc;
 
 #ifndef CORES_NOHT
-	/* try to allocate a hyperthread pair core */
 	for (i = 0; i < p->active_thread_count; i++) {
 		t = p->active_threads[i];
-		buddy_core = cpu_to_sibling_cpu(t->core);
+		consider_victim_core(p, cpu_to_sibling_cpu(t->core), &best);
+	}
+#endif
 
-		if (core_available(buddy_core))
-			return buddy_core;
+	t = list_top(&p->idle_threads, struct thread, idle_link);
+	consider_victim_core(p, t->core, &best);
 
-		if (nr_avail_cores > 0 || core_history[buddy_core].next != NULL)
-			continue;
+	for (i = 0; i < cpu_count; i++)
+		consider_victim_core(p, i, &best);
 
-		buddy_proc = core_history[buddy_core].current->p;
-		if (buddy_proc != p && proc_is_bursting(buddy_proc))
-			return buddy_core;
+	return best;
+}
+
+/* flags for pick_available_core() */
+#define PICK_HOME_ONLY		BIT(0) /* only cores on the proc's home socket */
+#define PICK_SHALLOW_ONLY	BIT(1) /* only cores that will wake quickly */
+
+/*
+ * Computes the idle cores that can be considered under @flags into @cands,
+ * a word at a time rather than testing each core.
+ */
+static inline void pick_candidates(struct proc *p, int flags,
+				   unsigned long *cands)
+{
+	if ((flags & PICK_HOME_ONLY) && dp.numa)
+		bitmap_and(cands, avail_cores, node_cores[p->home_node], NCPU);
+	else
+		memcpy(cands, avail_cores, sizeof(avail_cores));
+	if (flags & PICK_SHALLOW_ONLY)
+		bitmap_andnot(cands, cands, power_deep_cores, NCPU);
+}
+
+/*
+ * Chooses an idle core for @p among those allowed by @flags. Returns -1 if
+ * there is none.
+ */
+static int pick_available_core(struct proc *p, int flags)
+{
+	DEFINE_BITMAP(cands, NCPU);
+	struct thread *t;
+	int core;
+
+	if ((flags & PICK_HOME_ONLY) && dp.numa &&
+	    nr_avail_cores_node[p->home_node] == 0)
+		return -1;
+
+	pick_candidates(p, flags, cands);
+
+	/* procs that pair or don't share hyperthreads start a new physical
+	   core if there is an idle one */
+	t = list_top(&p->idle_threads, struct thread, idle_link);
+	if (p->sched_cfg.ht_policy != SCHED_HT_SHARE) {
+		if (bitmap_test(cands, t->core) &&
+		    core_pair_available(t->core))
+			return t->core;
+		bitmap_for_each_set(cands, cpu_count, core) {
+			if (core_pair_available(core))
+				return core;
+		}
 	}
-#endif
 
 	/* try the core that we most recently ran on */
-	t = list_top(&p->idle_threads, struct thread, idle_link);
 	core = t->core;
-	if (core_available(core))
+	if (bitmap_test(cands, core) && core_compatible(p, core))
 		return core;
 
-	/* core is busy, should we preempt it? */
-	if (nr_avail_cores == 0 && core_history[core].next == NULL) {
-		core_proc = core_history[core].current->p;
-		if (core_proc != p && proc_is_bursting(core_proc))
+	/* pick the lowest available core */
+	bitmap_for_each_set(cands, cpu_count, core) {
+		if (core_compatible(p, core))
 			return core;
 	}
 
-	/* pick the lowest available core */
-	core = bitmap_find_next_set(avail_cores, cpu_count, 0);
-	if (core != cpu_count)
-		return core;
+	return -1;
+}
 
-	/* no cores available, take from the first bursting proc */
-	for (i = 0; i < cpu_count; i++) {
-		if (!core_history[i].current)
-			continue;
-		if (!proc_is_bursting(core_history[i].current->p))
-			continue;
-		if (core_history[i].next != NULL)
+/**
+ * pick_core_for_proc - choose a core to allocate to proc p.
+ * @p: the process to allocate a core to
+ *
+ * Cores whose hyperthread pair runs a different proc are skipped if either
+ * proc uses SCHED_HT_EXCLUSIVE.
+ *
+ * Returns an available core if one exists, or else a core to be preempted, or
+ * -1 if there is neither.
+ */
+static int pick_core_for_proc(struct proc *p)
+{
+	static const int pick_passes[] = {
+		PICK_HOME_ONLY | PICK_SHALLOW_ONLY,
+		PICK_HOME_ONLY,
+		PICK_SHALLOW_ONLY,
+		0,
+	};
+	int buddy_core, core, mask;
+	int i;
+	struct thread *t;
+
+#ifndef CORES_NOHT
+	/* try to allocate a hyperthread pair core */
+	for (i = 0; i < p->active_thread_count; i++) {
+		t = p->active_threads[i];
+		buddy_core = cpu_to_sibling_cpu(t->core);
+
+		if (core_available(buddy_core) && core_is_home(p, buddy_core))
+			return buddy_core;
+	}
+#endif
+
+	/* prefer cores on the proc's home socket, then cores that aren't in
+	   a deep C-state, skipping passes with flags that don't apply */
+	mask = (dp.numa ? PICK_HOME_ONLY : 0) |
+	       (power_enabled ? PICK_SHALLOW_ONLY : 0);
+	for (i = 0; i < ARRAY_SIZE(pick_passes) && nr_avail_cores > 0; i++) {
+		if (pick_passes[i] & ~mask)
 			continue;
-		return i;
+		core = pick_available_core(p, pick_passes[i]);
+		if (core >= 0)
+			return core;
 	}
 
-	log_err("pick_core_for_proc: no available cores!");
-	BUG();
-	return 0;
+	/* no cores available, take one from the proc that can best spare it */
+	return pick_victim_core(p);
 }
 
 /**
@@ -423,7 +885,7 @@ static struct thread *pick_thread_for_core(int core)
 {
 	struct thread *th_next;
 	int buddy_core;
-	struct proc *p;
+	struct proc *p, *best;
 
 	/* if this core was preempted, grant it to the thread that is waiting for
 	 * it */
@@ -433,14 +895,24 @@ static struct thread *pick_thread_for_core(int core)
 		return th_next;
 	}
 
+	/* a handover is parking every kthread */
+	if (unlikely(handover_pending))
+		return NULL;
+
 	/* try to find an overloaded proc to grant this core to */
 	if (no_overloaded_procs())
 		return NULL;
 
+	/* cache locality only decides between equally deserving procs */
+	best = pick_overloaded_proc(core);
+	if (!best)
+		return NULL;
+
 	/* try to allocate to the process that used this core most recently */
 	if (core_history[core].current) {
 		p = core_history[core].current->p;
-		if (!p->removed && proc_is_overloaded(p))
+		if (!p->removed && proc_is_overloaded(p) &&
+		    core_compatible(p, core) && !proc_preempt_before(p, best))
 			goto chose_proc;
 	}
 
@@ -449,7 +921,8 @@ static struct thread *pick_thread_for_core(int core)
 	buddy_core = cpu_to_sibling_cpu(core);
 	if (core_history[buddy_core].current) {
 		p = core_history[buddy_core].current->p;
-		if (!p->removed && proc_is_overloaded(p))
+		if (!p->removed && proc_is_overloaded(p) &&
+		    core_compatible(p, core) && !proc_preempt_before(p, best))
 			goto chose_proc;
 	}
 #endif
@@ -457,12 +930,13 @@ static struct thread *pick_thread_for_core(int core)
 	/* try to allocate to the process that used this core previously */
 	if (core_history[core].prev) {
 		p = core_history[core].prev->p;
-		if (!p->removed && proc_is_overloaded(p))
+		if (!p->removed && proc_is_overloaded(p) &&
+		    core_compatible(p, core) && !proc_preempt_before(p, best))
 			goto chose_proc;
 	}
 
-	/* choose any overloaded proc */
-	p = get_overloaded_proc();
+	/* choose the most deserving overloaded proc */
+	p = best;
 
 chose_proc:
 	return pick_thread_for_proc(p, core);
@@ -473,19 +947,12 @@ chose_proc:
  * @p: the process to choose a kthread from
  * @core: the core to wake a kthread on
  */
-static void wake_kthread_on_core(struct thread *th, int core)
+static void kthread_send_wake(struct thread *th)
 {
 	int ret;
 	ssize_t s;
 	uint64_t val;
 
-	BUG_ON(!core_available(core)); /* core should be idle now */
-
-	/* mark core and kthread as reserved */
-	core_reserve(core, th);
-	if (th->parked)
-		thread_reserve(th, core);
-
 	/* assign the kthread to its core */
 	if (th->reaffinitize) {
 		ret = cores_pin_thread(th->tid, th->core);
@@ -505,6 +972,151 @@ static void wake_kthread_on_core(struct thread *th, int core)
 	BUG_ON(s != sizeof(uint64_t));
 }
 
+static void kthread_send_preempt(struct thread *th)
+{
+	if (unlikely(syscall(SYS_tgkill, th->p->pid, th->tid, SIGUSR1) < 0))
+		WARN();
+}
+
+/*
+ * Starts batching wakeups and preemptions until cores_flush_batch().
+ */
+static void cores_start_batch(void)
+{
+	batching = true;
+}
+
+/*
+ * Sends all batched preemptions, then all batched wakeups.
+ */
+static void cores_flush_batch(void)
+{
+	unsigned int i;
+
+	batching = false;
+
+	if (batch_req->nr > 0 && ksched_fd >= 0 &&
+	    ioctl(ksched_fd, KSCHED_IOC_WAKE, batch_req) == 0) {
+		batch_req->nr = 0;
+	}
+
+	/* fall back to signals directly if ksched is missing or failed */
+	for (i = 0; i < batch_req->nr; i++)
+		kthread_send_preempt(batch_preempts[i]);
+	batch_req->nr = 0;
+
+	for (i = 0; i < nr_batch_wakes; i++)
+		kthread_send_wake(batch_wakes[i]);
+	nr_batch_wakes = 0;
+}
+
+static void wake_kthread_on_core(struct thread *th, int core, int reason)
+{
+	BUG_ON(!core_available(core)); /* core should be idle now */
+	trace_record(TRACE_WAKE, reason, th, core);
+
+	/* mark core and kthread as reserved */
+	core_reserve(core, th);
+	if (th->parked)
+		thread_reserve(th, core);
+
+	if (batching) {
+		assert(nr_batch_wakes < NCPU);
+		batch_wakes[nr_batch_wakes++] = th;
+		return;
+	}
+
+	kthread_send_wake(th);
+}
+
+/*
+ * Interrupts @victim with a signal so that it gives up @core.
+ */
+static void signal_kthread_on_core(struct thread *victim, int core)
+{
+	struct ksched_wakeup *w;
+
+	STAT_INC(PREEMPT_SIGNALS, 1);
+	trace_record(TRACE_PREEMPT, TRACE_PREEMPT_SIGNAL, victim, core);
+	if (!batching) {
+		kthread_send_preempt(victim);
+		return;
+	}
+
+	assert(batch_req->nr < NCPU);
+	batch_preempts[batch_req->nr] = victim;
+	w = &batch_req->wakeups[batch_req->nr++];
+	w->preempt = true;
+	w->cpu = core;
+	w->prev_tid = victim->tid;
+	w->next_tid = core_history[core].next->tid;
+}
+
+/*
+ * Asks @victim to give up @core. The runtime polls a flag in its shared queue
+ * pointers, and cores_check_preempts() sends a signal if it doesn't park in
+ * time.
+ */
+static void preempt_kthread_on_core(struct thread *victim, int core)
+{
+	trace_record(TRACE_PREEMPT, TRACE_PREEMPT_REQUEST, victim, core);
+	store_release(&victim->q_ptrs->preempt_req, 1);
+	victim->preempt_req_us = microtime();
+}
+
+/*
+ * Signals the kthreads that haven't acted on a preemption request within
+ * CORES_PREEMPT_SIGNAL_US.
+ */
+static void cores_check_preempts(void)
+{
+	struct thread *th;
+	uint64_t now = microtime();
+	int i;
+
+	for (i = 0; i < cpu_count; i++) {
+		if (!core_history[i].next)
+			continue;
+
+		th = core_history[i].current;
+		if (!th->preempt_req_us ||
+		    now - th->preempt_req_us < CORES_PREEMPT_SIGNAL_US)
+			continue;
+
+		th->preempt_req_us = 0;
+		signal_kthread_on_core(th, i);
+	}
+}
+
+/**
+ * cores_quiesce - asks every running kthread to park, for a handover
+ *
+ * Kthreads that don't act on the request within CORES_PREEMPT_SIGNAL_US are
+ * signaled, and again every CORES_PREEMPT_SIGNAL_US after that. Returns true
+ * once no kthread is running or has egress packets queued.
+ */
+bool cores_quiesce(void)
+{
+	struct thread *th;
+	uint64_t now = microtime();
+	unsigned int i;
+
+	for (i = 0; i < nrts; i++) {
+		th = ts[i];
+		if (th->parked)
+			continue;
+
+		if (!th->preempt_req_us) {
+			preempt_kthread_on_core(th, th->core);
+		} else if (now - th->preempt_req_us >= CORES_PREEMPT_SIGNAL_US) {
+			th->preempt_req_us = now;
+			signal_kthread_on_core(th, th->core);
+		}
+	}
+
+	return nrts == 0;
+}
+
 /**
  * cores_park_kthread - parks the given kthread and frees its core.
  * @th: thread to park
@@ -520,6 +1132,7 @@ bool cores_park_kthread(struct thread *th, bool force)
 	ssize_t s;
 	uint64_t val;
 	struct thread *th_new;
+	int reason;
 
 	assert(kthread < NCPU);
 
@@ -527,14 +1140,16 @@ bool cores_park_kthread(struct thread *th, bool force)
 	BUG_ON(bitmap_test(avail_cores, core));
 	BUG_ON(bitmap_test(p->available_threads, kthread));
 
-	/* check for race conditions with the runtime */
-	if (core_history[core].next == NULL && !force) {
+	/* check for race conditions with the runtime (packets may wait in the
+	 * RX queue during a handover) */
+	if (core_history[core].next == NULL && !force && !handover_pending) {
 		lrpc_poll_send_tail(&th->rxq);
 		if (unlikely(lrpc_get_cached_length(&th->rxq) > 0)) {
 			/* the runtime parked while packets were in flight */
 			val = th->core + 1;
 			s = write(th->park_efd, &val, sizeof(val));
 			BUG_ON(s != sizeof(uint64_t));
+			trace_record(TRACE_PARK, TRACE_PARK_RACE, th, core);
 			return false;
 		}
 	}
@@ -550,6 +1165,14 @@ bool cores_park_kthread(struct thread *th, bool force)
 	}
 #endif
 
+	if (force)
+		reason = TRACE_PARK_FORCED;
+	else if (core_history[core].next)
+		reason = TRACE_PARK_PREEMPTED;
+	else
+		reason = TRACE_PARK_IDLE;
+	trace_record(TRACE_PARK, reason, th, core);
+
 	/* mark core and kthread as available */
 	core_cede(core);
 	thread_cede(th);
@@ -557,31 +1180,51 @@ bool cores_park_kthread(struct thread *th, bool force)
 	/* try to find another thread to run on this core */
 	th_new = pick_thread_for_core(core);
 	if (th_new)
-		wake_kthread_on_core(th_new, core);
+		wake_kthread_on_core(th_new, core, TRACE_WAKE_HANDOFF);
 
 	return true;
 }
 
+/* preemption stats are indexed by priority class */
+BUILD_ASSERT(PREEMPT_BATCH - PREEMPT_SYSTEM == SCHED_PRIORITY_BATCH);
+
 /**
  * cores_add_core - allocate a core for this process. If the core is idle, this
  * function immediately wakes a kthread on it. Otherwise, a kthread will be
  * woken on the core once the preempted kthread parks.
  * @p: the process to allocate a core to
+ * @reason: why the core is needed (TRACE_GRANT_*), recorded in the trace
+ *
+ * Returns the thread that will run on the core, or NULL if none could be
+ * allocated. If no core may be preempted, the proc is left overloaded so it
+ * receives the next core that frees up.
  */
-struct thread *cores_add_core(struct proc *p)
+struct thread *cores_add_core(struct proc *p, int reason)
 {
 	int core;
 	struct thread *th, *th_current;
 
-	/* can't add cores if we're already using all available kthreads */
-	if (p->active_thread_count == p->thread_count)
+	/* a handover is parking every kthread */
+	if (unlikely(handover_pending))
+		return NULL;
+
+	/* can't add cores if we're already using all the kthreads allowed */
+	if (p->active_thread_count >= p->core_limit) {
+		proc_clear_overloaded(p);
 		return NULL;
+	}
+
+	/* pick a core to add */
+	core = pick_core_for_proc(p);
+	if (core < 0) {
+		proc_set_overloaded(p);
+		return NULL;
+	}
 
 	/* Cancel pending timers */
 	p->pending_timer = false;
 
-	/* pick a core to add and a thread to run on it */
-	core = pick_core_for_proc(p);
+	/* pick a thread to run on the core */
 	th = pick_thread_for_proc(p, core);
 	if (!th) {
 		log_err("cores: proc already has max allowed kthreads (%d)",
@@ -589,24 +1232,25 @@ struct thread *cores_add_core(struct proc *p)
 		BUG();
 	}
 	BUG_ON(!bitmap_test(p->available_threads, th - p->threads));
+	trace_record(TRACE_GRANT, reason, th, core);
+	p->stats.grants++;
 
 	if (core_available(core)) {
 		/* core is idle, immediately wake a kthread on it */
-		wake_kthread_on_core(th, core);
+		wake_kthread_on_core(th, core, TRACE_WAKE_IDLE);
 		return th;
 	}
 
 	/* core is busy, preempt the currently running thread */
 	thread_reserve(th, core);
 	th_current = core_history[core].current;
+	STAT_INC(PREEMPT_SYSTEM + th_current->p->sched_cfg.priority, 1);
+	th_current->p->stats.preempts++;
 	proc_set_overloaded(th_current->p);
 	th_current->p->inflight_preempts++;
 	BUG_ON(core_history[core].next);
 	core_history[core].next = th;
-	if (unlikely(syscall(SYS_tgkill, th_current->p->pid,
-		     th_current->tid, SIGUSR1) < 0)) {
-		WARN();
-	}
+	preempt_kthread_on_core(th_current, core);
 
 	return th;
 }
@@ -634,12 +1278,46 @@ int cores_pin_thread(pid_t tid, int core)
 	return 0;
 }
 
+/*
+ * Finds the node a proc should run on: where its shm region was allocated, or
+ * else the node nearest it (or the NIC) that has cores for runtimes.
+ */
+static int cores_proc_home_node(struct proc *p)
+{
+	int nodes[NNUMA];
+	int node, i, nr;
+
+	if (get_mempolicy(&node, NULL, 0, p->region.base,
+			  MPOL_F_NODE | MPOL_F_ADDR) != 0 ||
+	    node < 0 || node >= numa_count) {
+		if (dp.nic_node >= numa_count)
+			return 0;
+		node = dp.nic_node;
+	}
+
+	nr = numa_nearest_nodes(node, nodes);
+	for (i = 0; i < nr; i++) {
+		if (nr_cores_node[nodes[i]] > 0)
+			return nodes[i];
+	}
+	return 0;
+}
+
 /*
  * Initialize proc state for managing cores.
  */
 void cores_init_proc(struct proc *p)
 {
-	int i, ret;
+	int i, ret, first_core;
+
+	p->home_node = dp.numa ? cores_proc_home_node(p) : 0;
+	first_core = bitmap_find_next_set(online_cores, NCPU, 0);
+	bitmap_for_each_set(online_cores, cpu_count, i) {
+		if (core_is_home(p, i)) {
+			first_core = i;
+			break;
+		}
+	}
 
 	/* all threads are initially pinned to the linux core and will park
 	 * themselves immediately */
@@ -647,7 +1325,11 @@ void cores_init_proc(struct proc *p)
 	bitmap_init(p->available_threads, p->thread_count, true);
 	list_head_init(&p->idle_threads);
 	p->inflight_preempts = 0;
+	p->demand_cores = 0;
+	p->demand_deadline_us = 0;
+	memset(p->flow_tbl, 0, sizeof(p->flow_tbl));
 	for (i = 0; i < p->thread_count; i++) {
+		p->threads[i].nr_flow_buckets = 0;
 		ret = cores_pin_thread(p->threads[i].tid, core_assign.linux_core);
 		if (ret < 0) {
 			log_err("cores: failed to pin thread %d in cores_init_proc",
@@ -655,10 +1337,10 @@ void cores_init_proc(struct proc *p)
 			/* continue running but performance is unpredictable */
 		}
 
-		/* init core to 0 - this will result in incorrect cache locality
-		 * decisions at first but saves us from always checking if this thread
-		 * has run yet */
-		p->threads[i].core = bitmap_find_next_set(online_cores, NCPU, 0);
+		/* init core to the first home core - this will result in
+		 * incorrect cache locality decisions at first but saves us from
+		 * always checking if this thread has run yet */
+		p->threads[i].core = first_core;
 		list_add_tail(&p->idle_threads, &p->threads[i].idle_link);
 	}
 
@@ -667,7 +1349,7 @@ void cores_init_proc(struct proc *p)
 	p->launched = true;
 
 	/* wake the first kthread so the runtime can run the main_fn */
-	cores_add_core(p);
+	cores_add_core(p, TRACE_GRANT_LAUNCH);
 }
 
 /*
@@ -682,36 +1364,104 @@ void cores_free_proc(struct proc *p)
 
 	bitmap_for_each_cleared(p->available_threads, p->thread_count, i)
 		cores_park_kthread(&p->threads[i], true);
+	cores_unscan_proc(p);
+}
+
+/*
+ * Estimates how long the oldest item in a queue has been waiting, given the
+ * queue positions seen now and at the last poll (@last_us). An item that was
+ * already queued at the last poll has waited at least since then; this is
+ * accurate to within one polling interval.
+ */
+static uint64_t cores_queue_delay(uint32_t tail, uint32_t head,
+				  uint32_t last_tail, uint32_t last_head,
+				  uint64_t *oldest_us, uint64_t last_us,
+				  uint64_t now)
+{
+	/* the queue is empty */
+	if (tail == head) {
+		*oldest_us = 0;
+		return 0;
+	}
+
+	/* a different item is now the oldest */
+	if (tail != last_tail || !*oldest_us)
+		*oldest_us = wraps_lt(tail, last_head) ? last_us : now;
+
+	return now - *oldest_us;
 }
 
-static bool cores_is_proc_congested(struct proc *p)
+/*
+ * Returns true if the proc needs more cores. @scaleout is set if it should also
+ * get burstable cores beyond its guarantee.
+ *
+ * If the proc set congestion_latency_us, congestion is when the oldest item in
+ * any runqueue or RX queue has waited at least that long, and scaling out
+ * happens at scaleout_latency_us (or at the same latency if that is zero).
+ * Otherwise, congestion is any item that was queued across two polls.
+ */
+static bool cores_is_proc_congested(struct proc *p, bool *scaleout)
 {
 	struct thread *th;
-	uint32_t rq_tail, rxq_tail, last_rq_head, last_rxq_head;
-	bool congested = false;
+	uint32_t rq_tail, rxq_tail, rq_head, rxq_head;
+	uint32_t last_rq_tail, last_rxq_tail, last_rq_head, last_rxq_head;
+	uint64_t now = microtime(), last_us = p->last_poll_us;
+	uint64_t delay, max_delay = 0;
+	unsigned int congestion_us = p->sched_cfg.congestion_latency_us;
+	unsigned int scaleout_us = p->sched_cfg.scaleout_latency_us;
+	bool congested = false, worst_is_rxq = false;
 	int i;
 
+	p->last_poll_us = now;
 	for (i = 0; i < p->active_thread_count; i++) {
 		th = p->active_threads[i];
 
 		/* update the queue positions */
 		rq_tail = load_acquire(&th->q_ptrs->rq_tail);
 		rxq_tail = lrpc_poll_send_tail(&th->rxq);
+		rq_head = ACCESS_ONCE(th->q_ptrs->rq_head);
+		rxq_head = ACCESS_ONCE(th->rxq.send_head);
+		last_rq_tail = th->last_rq_tail;
+		last_rxq_tail = th->last_rxq_tail;
 		last_rq_head = th->last_rq_head;
 		last_rxq_head = th->last_rxq_head;
-		th->last_rq_head = ACCESS_ONCE(th->q_ptrs->rq_head);
-		th->last_rxq_head = ACCESS_ONCE(th->rxq.send_head);
-
-		/* if one prior queue was congested, no need to find more */
-		if (congested)
-			continue;
+		th->last_rq_tail = rq_tail;
+		th->last_rxq_tail = rxq_tail;
+		th->last_rq_head = rq_head;
+		th->last_rxq_head = rxq_head;
 
 		/* if the thread just woke up, give it a pass this round */
 		if (th->waking) {
 			th->waking = false;
+			th->rq_oldest_us = th->rxq_oldest_us = 0;
+			continue;
+		}
+
+		if (congestion_us) {
+			delay = cores_queue_delay(rq_tail, rq_head,
+						  last_rq_tail, last_rq_head,
+						  &th->rq_oldest_us, last_us,
+						  now);
+			if (delay > max_delay) {
+				max_delay = delay;
+				worst_is_rxq = false;
+			}
+
+			delay = cores_queue_delay(rxq_tail, rxq_head,
+						  last_rxq_tail, last_rxq_head,
+						  &th->rxq_oldest_us, last_us,
+						  now);
+			if (delay > max_delay) {
+				max_delay = delay;
+				worst_is_rxq = true;
+			}
 			continue;
 		}
 
+		/* if one prior queue was congested, no need to find more */
+		if (congested)
+			continue;
+
 		/* check if the runqueue is congested */
 		if (wraps_lt(rq_tail, last_rq_head)) {
 			STAT_INC(RQ_GRANT, 1);
@@ -728,48 +1478,189 @@ static bool cores_is_proc_congested(struct proc *p)
 
 	}
 
-	if (p->pending_timer && microtime() >= p->deadline_us)
-		congested = true;
+	*scaleout = congested;
+	if (congestion_us) {
+		congested = max_delay >= congestion_us;
+		*scaleout = max_delay >= (scaleout_us ? scaleout_us :
+					  congestion_us);
+		if (congested && worst_is_rxq) {
+			STAT_INC(RX_GRANT, 1);
+		} else if (congested) {
+			STAT_INC(RQ_GRANT, 1);
+		}
+	}
+
+	if (p->pending_timer && now >= p->deadline_us)
+		congested = *scaleout = true;
+
+	/* without latency targets, the wait is bounded by the last poll */
+	if (congested)
+		stat_adjust_latency(congestion_us ? max_delay : now - last_us);
 
 	return congested;
 }
 
+/*
+ * Grants cores until @p has as many as its demand hint asks for. Returns true
+ * if a hint is in effect.
+ */
+static bool cores_meet_demand(struct proc *p)
+{
+	if (!p->demand_deadline_us)
+		return false;
+
+	if (microtime() >= p->demand_deadline_us) {
+		p->demand_deadline_us = 0;
+		return false;
+	}
+
+	while (p->active_thread_count < p->demand_cores) {
+		if (!cores_add_core(p, TRACE_GRANT_DEMAND))
+			break;
+	}
+
+	return true;
+}
+
+/**
+ * cores_demand_hint - grants cores a runtime expects to need soon
+ * @p: the proc that sent the hint
+ * @nr: the number of cores it wants
+ * @duration_us: how long it will want them (us)
+ *
+ * Cores are granted right away, under the same priority and preemption rules
+ * as any other grant, and topped up by each scan until the hint expires.
+ */
+void cores_demand_hint(struct proc *p, unsigned int nr,
+		       unsigned int duration_us)
+{
+	STAT_INC(CORE_DEMAND_HINTS, 1);
+
+	p->demand_cores = min(nr, p->core_limit);
+	p->demand_deadline_us = microtime() +
+				min(duration_us, CORES_DEMAND_MAX_US);
+	cores_scan_proc(p);
+
+	cores_start_batch();
+	cores_meet_demand(p);
+	cores_flush_batch();
+}
+
+/**
+ * cores_set_limit - changes the most cores a runtime may be granted
+ * @p: the proc that sent the request
+ * @nr: the new limit
+ *
+ * The limit stays between the proc's guaranteed cores and its kthread count.
+ * Lowering it doesn't take cores away, but no more are granted until the proc
+ * falls back under it.
+ */
+void cores_set_limit(struct proc *p, unsigned int nr)
+{
+	STAT_INC(CORE_LIMIT_CHANGES, 1);
+
+	nr = max(max(nr, p->sched_cfg.guaranteed_cores), 1U);
+	p->core_limit = min(nr, p->thread_count);
+	p->demand_cores = min(p->demand_cores, p->core_limit);
+}
+
 /*
  * Rebalances the allocation of cores to runtimes. Grants more cores to
  * runtimes that would benefit from them.
  */
 void cores_adjust_assignments(void)
 {
-	struct proc *p, *next;
+	struct proc *p;
+	bool scaleout;
 	int i;
 
+	cores_start_batch();
+	cores_check_preempts();
+
 	/* determine which procs need more cores to meet their guarantees, and
 	   which procs want more burstable cores */
-	for (i = 0; i < dp.nr_clients; i++) {
-		p = dp.clients[i];
+	for (i = 0; i < dp.nr_scan_procs;) {
+		p = dp.scan_procs[i];
+
+		/* an idle proc rejoins on its next grant, timer, or hint */
+		if (cores_scan_is_idle(p)) {
+			cores_unscan_proc(p);
+			continue;
+		}
+		i++;
 
 		/* clear overloaded flag as long as we haven't been preempted
 		   down to 0 cores */
 		if (p->active_thread_count - p->inflight_preempts > 0)
 			proc_clear_overloaded(p);
 
-		if (!cores_is_proc_congested(p))
+		/* keep granting cores the runtime said it would need */
+		if (cores_meet_demand(p))
+			continue;
+
+		if (!cores_is_proc_congested(p, &scaleout))
 			continue;
 
 		/* the proc is congested, add cores if possible */
 		if (p->active_thread_count < p->sched_cfg.guaranteed_cores)
-			cores_add_core(p);
-		else
+			cores_add_core(p, TRACE_GRANT_CONGESTED);
+		else if (scaleout)
 			proc_set_overloaded(p);
 	}
 
-	/* grant cores to procs that are bursting until we run out of cores */
-	list_for_each_safe(&overloaded_procs, p, next, overloaded_link) {
-		if (nr_avail_cores == 0)
+	/* grant cores to bursting procs, in priority and then weighted share
+	   order, until no more cores can be idle or preempted */
+	for (i = 0; i < dp.nr_clients; i++) {
+		p = pick_overloaded_proc(-1);
+		if (!p)
+			break;
+
+		if (!cores_add_core(p, TRACE_GRANT_BURST) && proc_is_overloaded(p))
 			break;
+	}
+
+	cores_flush_batch();
+}
+
+/**
+ * cores_rx_backlogged - grants a core to a proc between allocation scans
+ * @th: the active thread whose RX queue crossed CORES_RXQ_DEPTH_THRESH
+ *
+ * Called from rx_burst() so a burst of packets doesn't have to wait for the
+ * next periodic scan. Does nothing if a core is already on its way.
+ */
+void cores_rx_backlogged(struct thread *th)
+{
+	struct proc *p = th->p;
+	uint64_t now;
+	int i;
+
+	if (th->parked || p->inflight_preempts > 0)
+		return;
+
+	for (i = 0; i < p->active_thread_count; i++) {
+		if (p->active_threads[i]->waking)
+			return;
+	}
+
+	if (!cores_add_core(p, TRACE_GRANT_RX_BACKLOG))
+		return;
 
-		cores_add_core(p);
+	now = microtime();
+	stat_adjust_latency(th->rxq_oldest_us ? now - th->rxq_oldest_us : 0);
+}
+
+/* returns true if the core is polling an RSS queue for an RX worker */
+static bool cores_is_rx_core(int core)
+{
+	unsigned int q;
+
+	for (q = 1; q < dp.nr_queues; q++) {
+		if (core_assign.rx_cores[q] == core)
+			return true;
 	}
+
+	return false;
 }
 
 /*
@@ -777,6 +1668,7 @@ void cores_adjust_assignments(void)
  */
 int cores_init(void)
 {
+	unsigned int q;
 	int i, j;
 
 	/* assign first non-zero core on socket 0 to the dataplane thread */
@@ -812,6 +1704,17 @@ int cores_init(void)
 	core_assign.linux_core = cpu_to_sibling_cpu(core_assign.dp_core);
 	core_assign.ctrl_core = cpu_to_sibling_cpu(core_assign.dp_core);
 
+	/* assign the next cores on socket 0 to poll the other RSS queues */
+	for (i = core_assign.dp_core + 1, q = 1; q < dp.nr_queues; i++) {
+		if (i == cpu_count)
+			panic("cores: not enough cores for %u dataplane queues",
+			      dp.nr_queues);
+		if (cpu_info_tbl[i].package != 0 ||
+		    i == core_assign.linux_core)
+			continue;
+		core_assign.rx_cores[q++] = i;
+	}
+
 	/* mark all cores as unavailable */
 	bitmap_init(avail_cores, cpu_count, false);
 
@@ -823,7 +1726,8 @@ int cores_init(void)
 	for (i = 0; i < cpu_count; i++) {
 		if (i == core_assign.linux_core ||
 		    i == core_assign.ctrl_core ||
-		    i == core_assign.dp_core) {
+		    i == core_assign.dp_core ||
+		    cores_is_rx_core(i)) {
 			continue;
 		}
 
@@ -835,13 +1739,27 @@ int cores_init(void)
 			continue;
 #endif
 
-		if (cpu_info_tbl[i].package == 0)
+		if (dp.numa || cpu_info_tbl[i].package == 0)
 			core_init(i);
 	}
 
 	log_info("cores: linux on core %d, control on %d, dataplane on %d",
 		 core_assign.linux_core, core_assign.ctrl_core,
 		 core_assign.dp_core);
+	for (q = 1; q < dp.nr_queues; q++)
+		log_info("cores: rx queue %u on core %d", q,
+			 core_assign.rx_cores[q]);
+
+	batch_req = calloc(1, sizeof(*batch_req) +
+			   sizeof(struct ksched_wakeup) * NCPU);
+	if (!batch_req)
+		return -ENOMEM;
+
+	/* ksched is optional, preemptions fall back to tgkill() */
+	ksched_fd = open(KSCHED_DEV_PATH, O_RDWR);
+	if (ksched_fd < 0)
+		log_info("cores: %s not available, preempting with signals",
+			 KSCHED_DEV_PATH);
 
 	return 0;
 }
@@ -10,24 +10,40 @@
 #undef LIST_HEAD /* hack to deal with DPDK being annoying */
 #include <base/list.h>
 #include <iokernel/control.h>
+#include <iokernel/stat.h>
+#include <iokernel/pcap.h>
+#include <iokernel/trace.h>
 #include <net/ethernet.h>
 
 #include "mlx.h"
 #include "ref.h"
 
+/*
+ * Counters are always kept. Define STATS to also log them every second, and
+ * to time how long egress packets wait, which costs a rdtsc() per burst.
+ */
 /* #define STATS 1 */
 
 /*
  * Constant limits
  */
-#define IOKERNEL_MAX_PROC		1024
+#define IOKERNEL_MAX_PROC		4096
 #define IOKERNEL_NUM_MBUFS		(8192 * 16)
 #define IOKERNEL_NUM_COMPLETIONS	32767
 #define IOKERNEL_OVERFLOW_BATCH_DRAIN	64
+/* each pass drains at least this fraction of all overflowed completions */
+#define IOKERNEL_OVERFLOW_DRAIN_FRACTION 8
 #define IOKERNEL_TX_BURST_SIZE		64
 #define IOKERNEL_CMD_BURST_SIZE		64
 #define IOKERNEL_RX_BURST_SIZE		64
 #define IOKERNEL_CONTROL_BURST_SIZE	4
+#define IOKERNEL_MAX_DP_QUEUES		8
+#define IOKERNEL_RX_RING_SIZE		1024
+#define IOKERNEL_MAX_FLOW_QUEUES	8
+#define IOKERNEL_FLOW_BUCKETS		128
+#define IOKERNEL_MAX_MTU		ETH_MTU_JUMBO
+#define IOKERNEL_MAX_MCAST_GROUPS	64
+#define IOKERNEL_MAX_MCAST_SUBS		64
 
 
 /*
@@ -47,8 +63,20 @@ struct thread {
 	pid_t			tid;
 	int32_t			park_efd;
 	struct q_ptrs		*q_ptrs;
+	/* ingress buffers returned by the runtime, see RX_COMPLETION_RING_SIZE */
+	unsigned long		*rxc_ring;
+	uint32_t		rxc_tail;
 	uint32_t		last_rq_head;
 	uint32_t		last_rxq_head;
+	uint32_t		last_rq_tail;
+	uint32_t		last_rxq_tail;
+	/* when a preemption was requested through @q_ptrs (us), or 0 */
+	uint64_t		preempt_req_us;
+	/* when the oldest queued item was first seen (us), or 0 if empty */
+	uint64_t		rq_oldest_us;
+	uint64_t		rxq_oldest_us;
+	/* when the egress scheduler first saw the queued packets (us), or 0 */
+	uint64_t		tx_wait_since_us;
 	/* current or most recent core this thread ran on, depending on whether
 	 * this thread is parked or not */
 	unsigned int		core;
@@ -56,12 +84,15 @@ struct thread {
 	unsigned int		ts_idx;
 	/* the proc->active_threads index (if active) */
 	unsigned int		at_idx;
+	/* the number of proc->flow_tbl buckets steered to this thread */
+	unsigned int		nr_flow_buckets;
 	/* list link for when idle */
 	struct list_node	idle_link;
 };
 
 struct proc {
 	pid_t			pid;
+	mem_key_t		key;	/* of the shm @region */
 	struct shm_region	region;
 	bool			removed;
 	struct ref		ref;
@@ -80,21 +111,62 @@ struct proc {
 	/* runtime threads */
 	unsigned int		thread_count;
 	unsigned int		active_thread_count;
-	struct thread		threads[NCPU];
-	struct thread		*active_threads[NCPU];
-	DEFINE_BITMAP(available_threads, NCPU);
+	unsigned int		core_limit; /* at most @thread_count */
+	/* sized by @thread_count, so small runtimes stay small */
+	struct thread		*threads;
+	struct thread		**active_threads;
+	unsigned long		*available_threads; /* bitmap */
 	struct list_head	idle_threads;
 	unsigned int		inflight_preempts;
 	unsigned int		next_thread_rr; // for spraying join requests/overflow completions
 
+	/*
+	 * Maps flow hash buckets to active threads. Only the buckets of a
+	 * thread that is added or removed move, so most flows keep their
+	 * kthread when cores are granted or revoked.
+	 */
+	struct thread		*flow_tbl[IOKERNEL_FLOW_BUCKETS];
+
 	/* network data */
 	struct eth_addr		mac;
+	/* the dp.flow_procs index if steered by hardware, otherwise -1 */
+	int			flow_queue;
 
 	/* next pending timer, only valid if pending_timer is true */
 	bool			pending_timer;
 	uint64_t		deadline_us;
 	unsigned int		timer_idx;
 
+	/* when the queues were last checked for congestion (us) */
+	uint64_t		last_poll_us;
+	/* the dp.scan_procs index, or -1 if the allocation scans skip it */
+	int			scan_idx;
+
+	/*
+	 * Egress scheduler state. Each round, a proc may send up to its
+	 * weight times TX_DRR_QUANTUM bytes, and no faster than its
+	 * tx_rate_mbps, if limited. Both balances may go negative.
+	 */
+	int64_t			tx_deficit;
+	unsigned long		tx_round;
+	int64_t			tx_tokens; /* bits */
+	uint64_t		tx_tokens_us;
+#ifdef STATS
+	uint64_t		tx_wait_us_total;
+	uint64_t		tx_wait_samples;
+	uint64_t		tx_wait_us_max;
+	/* TSC cycles from the runtime queueing packets to pulling them */
+	uint64_t		tx_queue_cycles;
+	uint64_t		tx_queue_samples;
+#endif
+
+	/* cores the runtime expects to need, until @demand_deadline_us */
+	unsigned int		demand_cores;
+	uint64_t		demand_deadline_us;
+
+	/* the NUMA node of the shm region, where cores are granted first */
+	int			home_node;
+
 	/* Unique identifier -- never recycled across runtimes*/
 	uintptr_t		uniqid;
 #ifdef MLX
@@ -102,11 +174,30 @@ struct proc {
 	void *mr;
 #endif
 
+	/* the pre-registered slot backing @region, or NULL */
+	struct prereg_slot	*prereg;
+
+	/* ingress mbufs delivered to the runtime and not yet returned */
+	unsigned int		rx_bufs;
+#ifdef STATS
+	unsigned int		rx_bufs_peak;
+	uint64_t		rx_quota_drops;
+#endif
+
+	/* written only by the dataplane, read racily for CONTROL_STATS_KEY */
+	struct ikstat_proc_counters stats;
+
 	/* Overfloq queue for completion data */
 	size_t max_overflows;
 	size_t nr_overflows;
 	unsigned long *overflow_queue;
 
+	/* for the reaper and the pool of recycled procs (see control.c) */
+	size_t			paddrs_cap;	/* entries @page_paddrs can hold */
+	size_t			paddrs_nr;	/* ... and hold of @paddrs_slot */
+	struct prereg_slot	*paddrs_slot;
+	struct proc		*reap_next;
+
 	/* table of physical addresses for shared memory */
 	physaddr_t		page_paddrs[];
 };
@@ -134,10 +225,65 @@ static inline void proc_put(struct proc *p)
 	ref_put(&p->ref, proc_release);
 }
 
+/*
+ * The queue positions of a polled thread, packed by ts_idx so the dataplane
+ * can tell which threads have work without touching their struct thread.
+ * An entry may lag its thread, which can make an empty queue look ready but
+ * never hides a message.
+ */
+struct thread_poll {
+	uint64_t		*txpktq_next; /* see lrpc_next_cmd() */
+	uint64_t		*txcmdq_next;
+	uint32_t		*rxc_head;    /* in shm, the producer's head */
+	uint32_t		rxc_tail;     /* a copy of the thread's */
+	bool			txpktq_parity;
+	bool			txcmdq_parity;
+};
+
 /* the number of active threads to be polled (across all procs) */
 extern unsigned int nrts;
 /* an array of active threads to be polled (across all procs) */
 extern struct thread *ts[NCPU];
+/* the polling state of each thread in @ts, at the same index */
+extern struct thread_poll ts_poll[NCPU];
+
+/**
+ * thread_poll_refresh - updates a thread's polling state after it received
+ * @th: the thread, which needn't be polled
+ */
+static inline void thread_poll_refresh(struct thread *th)
+{
+	struct thread_poll *tp;
+
+	if (th->ts_idx == -1)
+		return;
+
+	tp = &ts_poll[th->ts_idx];
+	tp->txpktq_next = lrpc_next_cmd(&th->txpktq, &tp->txpktq_parity);
+	tp->txcmdq_next = lrpc_next_cmd(&th->txcmdq, &tp->txcmdq_parity);
+	tp->rxc_head = &th->q_ptrs->rxc_head;
+	tp->rxc_tail = th->rxc_tail;
+}
+
+/**
+ * thread_poll_has_cmds - returns true if a polled thread may have commands or
+ * RX completions
+ * @tp: the thread's polling state
+ */
+static inline bool thread_poll_has_cmds(struct thread_poll *tp)
+{
+	return ACCESS_ONCE(*tp->rxc_head) != tp->rxc_tail ||
+	       lrpc_cmd_ready(tp->txcmdq_next, tp->txcmdq_parity);
+}
+
+/**
+ * thread_poll_has_pkts - returns true if a polled thread may have packets
+ * @tp: the thread's polling state
+ */
+static inline bool thread_poll_has_pkts(struct thread_poll *tp)
+{
+	return lrpc_cmd_ready(tp->txpktq_next, tp->txpktq_parity);
+}
 
 /**
  * poll_thread - adds a thread to the queue polling array
@@ -152,6 +298,7 @@ static inline void poll_thread(struct thread *th)
 	proc_get(th->p);
 	ts[nrts] = th;
 	th->ts_idx = nrts++;
+	thread_poll_refresh(th);
 }
 
 /**
@@ -163,11 +310,23 @@ static inline void unpoll_thread(struct thread *th)
 	if (th->ts_idx == -1)
 		return;
 	ts[th->ts_idx] = ts[--nrts];
+	ts_poll[th->ts_idx] = ts_poll[nrts];
 	ts[th->ts_idx]->ts_idx = th->ts_idx;
 	th->ts_idx = -1;
 	proc_put(th->p);
 }
 
+/**
+ * thread_rxq_drained - returns true if the runtime has read everything queued
+ * to a thread's RX queue
+ * @th: the thread
+ */
+static inline bool thread_rxq_drained(struct thread *th)
+{
+	lrpc_poll_send_tail(&th->rxq);
+	return lrpc_get_cached_length(&th->rxq) == 0;
+}
+
 /*
  * Communication between control plane and data-plane in the I/O kernel
  */
@@ -185,6 +344,7 @@ extern struct lrpc_params lrpc_data_to_control_params;
 enum {
 	DATAPLANE_ADD_CLIENT,		/* points to a struct proc */
 	DATAPLANE_REMOVE_CLIENT,	/* points to a struct proc */
+	DATAPLANE_HANDOVER,		/* quiesce for a new iokernel */
 	DATAPLANE_NR,			/* number of commands */
 };
 
@@ -196,16 +356,63 @@ enum {
 	CONTROL_PLANE_NR,		/* number of commands */
 };
 
+/* how multiple NIC ports are combined */
+enum {
+	DP_BOND_NONE = 0,	/* only the first port is used */
+	DP_BOND_BALANCE,	/* static link aggregation */
+	DP_BOND_LACP,		/* IEEE 802.3ad dynamic link aggregation */
+};
+
 /*
  * Dataplane state
  */
 struct dataplane {
+	/* the NIC port, or a bonded port over all of them */
 	uint8_t			port;
+	int			bond_mode;
 	struct rte_mempool	*rx_mbuf_pool;
+	unsigned int		mtu;	/* the largest MTU runtimes may use */
 
 	struct proc		*clients[IOKERNEL_MAX_PROC];
 	int			nr_clients;
+	/*
+	 * The clients cores_adjust_assignments() must look at: those with an
+	 * active kthread, a pending timer, or a demand hint. With many mostly
+	 * idle runtimes, this is far shorter than @clients.
+	 */
+	struct proc		*scan_procs[IOKERNEL_MAX_PROC];
+	int			nr_scan_procs;
 	struct rte_hash		*mac_to_proc;
+	bool			tso;	/* the NIC can segment TCP */
+	bool			sw_csum; /* tx.c computes egress checksums */
+	bool			tx_multi_seg; /* the NIC can send mbuf chains */
+	/* a kernel interface to use through AF_XDP instead of a PCI NIC */
+	const char		*xdp_iface;
+
+	/*
+	 * RSS queues on the port. Queue 0 is polled by the main dataplane
+	 * core, the others by RX worker cores that hand packets over through
+	 * @rx_rings.
+	 */
+	unsigned int		nr_queues;
+	struct rte_ring		*rx_rings[IOKERNEL_MAX_DP_QUEUES];
+
+	/*
+	 * Hardware flow steering. Flow queue i is NIC queue nr_queues + i and
+	 * receives only the traffic of @flow_procs[i].
+	 */
+	bool			flow_steering;
+	unsigned int		nr_flow_queues;
+	struct proc		*flow_procs[IOKERNEL_MAX_FLOW_QUEUES];
+	struct rte_flow		*flows[IOKERNEL_MAX_FLOW_QUEUES];
+
+	/*
+	 * Grant runtimes cores on every socket, preferring each proc's
+	 * @home_node. Otherwise only socket 0 is used.
+	 */
+	bool			numa;
+	/* the NUMA node the NIC is attached to */
+	int			nic_node;
 };
 
 extern struct dataplane dp;
@@ -217,6 +424,8 @@ struct core_assignments {
 	uint8_t linux_core;
 	uint8_t ctrl_core;
 	uint8_t dp_core;
+	/* the cores polling RSS queues 1 through dp.nr_queues - 1 */
+	uint8_t rx_cores[IOKERNEL_MAX_DP_QUEUES];
 };
 
 extern struct core_assignments core_assign;
@@ -229,8 +438,11 @@ enum {
 	RX_UNREGISTERED_MAC = 0,
 	RX_UNICAST_FAIL,
 	RX_BROADCAST_FAIL,
+	RX_MCAST_FAIL,
+	RX_MCAST_UNJOINED,
 	RX_UNHANDLED,
 	RX_JOIN_FAIL,
+	RX_QUOTA_DROP,
 
 	TX_COMPLETION_OVERFLOW,
 	TX_COMPLETION_FAIL,
@@ -242,24 +454,173 @@ enum {
 	BATCH_TOTAL,
 	TX_PULLED,
 	TX_BACKPRESSURE,
+	TX_SW_TSO,
+	TX_SW_GSO,
+	TX_LOOPBACK,
+	TX_SW_LINEARIZE,
+	TX_BAD_SEGS,
 
 	RQ_GRANT,
 	RX_GRANT,
+	FLOW_TBL_UPDATES,
+	FLOW_BUCKETS_MOVED,
+	FLOW_STEERS,
+	FLOW_ADOPTS,
 
 	ADJUSTS,
 
+	/* preemptions of cores, by the priority class of the victim */
+	PREEMPT_SYSTEM,
+	PREEMPT_NORMAL,
+	PREEMPT_BATCH,
+
+	/* preemptions that fell back to a signal */
+	PREEMPT_SIGNALS,
+
+	/* cores granted on a different socket than the proc's home node */
+	REMOTE_CORE_GRANTS,
+
+	/* idle cores allowed into deep C-states, and later granted from one */
+	POWER_DEEP_IDLES,
+	POWER_DEEP_GRANTS,
+
+	/* cores moved between LLC and memory bandwidth partitions */
+	RDT_CLASS_CHANGES,
+
+	/* packets kept in the capture ring */
+	PCAP_CAPTURED,
+
+	/* demand hints received from runtimes */
+	CORE_DEMAND_HINTS,
+	CORE_LIMIT_CHANGES,
+	INTR_SLEEPS,
+	INTR_SLEEP_US,
+
+	/* runtimes attached, and the control-plane time spent attaching them */
+	REGISTRATIONS,
+	REGISTRATION_US,
+	/* ... torn down off the control thread, and the time that took */
+	TEARDOWNS,
+	TEARDOWN_US,
+	PROCS_RECYCLED,
+
+	/* log2 histogram of core allocation decision latency */
+	ADJUST_LAT_LT1US,
+	ADJUST_LAT_LT2US,
+	ADJUST_LAT_LT4US,
+	ADJUST_LAT_LT8US,
+	ADJUST_LAT_LT16US,
+	ADJUST_LAT_LT32US,
+	ADJUST_LAT_LT64US,
+	ADJUST_LAT_LT128US,
+	ADJUST_LAT_LT256US,
+	ADJUST_LAT_GE256US,
+
 	NR_STATS,
 
 };
 
+/*
+ * Only the dataplane core updates most counters, so plain increments suffice.
+ * Readers may see a slightly stale value, never a torn one.
+ */
 extern uint64_t stats[NR_STATS];
 extern void print_stats(void);
+extern int stat_dump(int fd, struct proc **procs, int nr_procs);
 
-#ifdef STATS
-#define STAT_INC(stat_name, amt) do { stats[stat_name] += amt; } while (0);
-#else
-#define STAT_INC(stat_name, amt) ;
-#endif
+#define STAT_INC(stat_name, amt) do { stats[stat_name] += amt; } while (0)
+
+/* records how long a proc waited for a core allocation decision */
+static inline void stat_adjust_latency(uint64_t us)
+{
+	int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	bucket = min(bucket, ADJUST_LAT_GE256US - ADJUST_LAT_LT1US);
+	STAT_INC(ADJUST_LAT_LT1US + bucket, 1);
+}
+
+/*
+ * Core allocation trace
+ */
+
+extern struct trace_entry trace_ring[TRACE_RING_SIZE];
+extern uint64_t trace_head;
+extern int trace_dump(int fd, struct proc **procs, int nr_procs);
+
+/**
+ * trace_record - records a core allocation event in the trace ring
+ * @event: the event type (TRACE_*)
+ * @reason: the event-specific reason
+ * @th: the kthread involved
+ * @core: the core involved
+ *
+ * Must only be called from the dataplane core, the ring's sole writer.
+ */
+static inline void trace_record(int event, int reason, struct thread *th,
+				unsigned int core)
+{
+	uint64_t head = trace_head;
+	struct trace_entry *e = &trace_ring[head & (TRACE_RING_SIZE - 1)];
+
+	e->tsc = rdtsc();
+	e->uniqid = th->p->uniqid;
+	e->core = core;
+	e->event = event;
+	e->reason = reason;
+	e->kthread = th - th->p->threads;
+	store_release(&trace_head, head + 1);
+}
+
+/*
+ * Packet capture (see pcap.c)
+ */
+
+extern bool pcap_enabled;
+extern unsigned int pcap_snaplen;
+extern unsigned int pcap_sample;
+extern const char *pcap_filter_path;
+extern void __pcap_capture(const void *data, uint32_t len, int dir);
+extern int pcap_dump(int fd);
+
+/**
+ * pcap_capture - captures a packet if capture is on
+ * @data: the packet, starting with its Ethernet header
+ * @len: the length of the packet
+ * @dir: IKPCAP_DIR_RX or IKPCAP_DIR_TX
+ *
+ * Must only be called from the dataplane core, the ring's sole writer.
+ */
+static inline void pcap_capture(const void *data, uint32_t len, int dir)
+{
+	if (unlikely(pcap_enabled))
+		__pcap_capture(data, len, dir);
+}
+
+/*
+ * pre-registered shm regions (see prereg.c)
+ */
+
+/* the default length of each pre-registered region */
+#define PREREG_DEFAULT_MB	3072UL
+
+struct prereg_slot {
+	mem_key_t		key;
+	void			*base;
+	size_t			len;
+	int			state;
+	pid_t			pid;	/* the runtime that reserved it */
+	/* the physical address of each 2MB page */
+	physaddr_t		*paddrs;
+};
+
+extern unsigned int prereg_nr;
+extern size_t prereg_len;
+extern mem_key_t prereg_reserve(pid_t pid, size_t len);
+extern bool prereg_is_key(mem_key_t key);
+extern struct prereg_slot *prereg_claim(mem_key_t key, pid_t pid, size_t len);
+extern void prereg_release(struct prereg_slot *s);
+extern void prereg_recycle(struct prereg_slot *s);
+extern int control_lookup_paddrs(void *base, size_t len, physaddr_t *paddrs);
 
 /*
  * RXQ command steering
@@ -268,31 +629,97 @@ extern void print_stats(void);
 extern bool rx_send_to_runtime(struct proc *p, uint32_t hash, uint64_t cmd,
 			       unsigned long payload);
 
+/*
+ * Ingress buffer quotas
+ *
+ * Each proc may hold at most rx_buf_quota ingress mbufs at a time (0 for no
+ * limit). Packets past the quota are dropped on arrival, so a runtime that
+ * stops returning buffers can't drain the pool shared by every runtime.
+ */
+#define IOKERNEL_RX_QUOTA_DEFAULT	(IOKERNEL_NUM_MBUFS / 4)
+extern unsigned int rx_buf_quota;
+
+/**
+ * proc_rx_uncharge - records ingress mbufs a proc has returned
+ * @p: the proc
+ * @nr: the number of mbufs
+ */
+static inline void proc_rx_uncharge(struct proc *p, unsigned int nr)
+{
+	/* the runtime's completions aren't validated, so don't underflow */
+	p->rx_bufs -= min(nr, p->rx_bufs);
+}
+
 /*
  * Initialization
  */
 
 extern int cores_init(void);
+extern int power_init(void);
+extern int rdt_init(void);
+extern int pcap_init(void);
+extern int handover_init(void);
+extern int prereg_init(void);
 extern int control_init(void);
 extern int dpdk_init();
 extern int rx_init();
+extern uint16_t rx_mbuf_buf_size(void);
 extern int tx_init();
 extern int dp_clients_init();
 extern int dpdk_late_init();
+extern int intr_init(void);
+extern int handover_late_init(void);
 
 /*
  * dataplane RX/TX functions
  */
+struct rte_mbuf;
+struct ether_addr;
+
 extern bool rx_burst();
+extern void rx_mac_cache_flush(void);
+extern uint32_t rx_sw_flow_hash(struct rte_mbuf *buf);
+extern struct proc *rx_local_proc(const struct ether_addr *addr);
+extern void rx_loopback(struct rte_mbuf **bufs, unsigned int n);
+extern int rx_worker_loop(void *arg);
+extern bool tx_loopback;
 extern bool tx_burst();
-extern bool tx_send_completion(void *obj);
+extern void tx_send_completions(void * const *objs, unsigned int n);
+extern void tx_forget_overflows(struct proc *p);
+extern void tx_init_proc(struct proc *p);
 extern bool tx_drain_completions();
 
+/*
+ * IPv4 multicast group membership
+ */
+
+/* the runtimes subscribed to a group */
+struct mcast_group {
+	uint32_t		addr;	/* the group address */
+	int			nr_subs;
+	struct proc		*subs[IOKERNEL_MAX_MCAST_SUBS];
+};
+
+extern struct mcast_group *mcast_lookup(uint32_t addr);
+extern int mcast_join(struct proc *p, uint32_t addr);
+extern void mcast_leave(struct proc *p, uint32_t addr);
+extern void mcast_remove_proc(struct proc *p);
+extern int mcast_proc_groups(struct proc *p, uint32_t *addrs, int n);
+
+/*
+ * hardware flow steering
+ */
+extern void flow_steer_add(struct proc *p);
+extern void flow_steer_remove(struct proc *p);
+
 /*
  * other dataplane functions
  */
 extern void dp_clients_rx_control_lrpcs();
+extern bool dp_clients_control_pending(void);
+extern void dp_clients_add_client(struct proc *p);
 extern bool commands_rx();
+extern void commands_free_completions(struct thread *t);
 extern void dpdk_print_eth_stats();
 
 /*
@@ -302,8 +729,182 @@ extern void cores_init_proc(struct proc *p);
 extern void cores_free_proc(struct proc *p);
 extern int cores_pin_thread(pid_t tid, int core);
 extern bool cores_park_kthread(struct thread *t, bool force);
-extern struct thread *cores_add_core(struct proc *p);
+extern struct thread *cores_add_core(struct proc *p, int reason);
 extern void cores_adjust_assignments();
+extern void cores_rx_backlogged(struct thread *th);
+extern void cores_demand_hint(struct proc *p, unsigned int nr,
+			      unsigned int duration_us);
+extern void cores_set_limit(struct proc *p, unsigned int nr);
+extern void cores_steer_flow(struct thread *th, uint32_t hash);
+extern void cores_release_flows(struct thread *th);
+extern void cores_adopt_flows(struct thread *th, unsigned long kthread);
+extern void cores_scan_proc(struct proc *p);
+extern bool cores_quiesce(void);
+
+/* the period of the core allocation scan (us) */
+extern unsigned int cores_adjust_interval_us;
+
+/* the longest a runtime's demand hint is honored (us) */
+#define CORES_DEMAND_MAX_US	10000
+
+/* how long a kthread may ignore a preemption request before it is signaled */
+#define CORES_PREEMPT_SIGNAL_US	5
+
+/* RX queue depth at which rx_burst() asks for a core between scans */
+#define CORES_RXQ_DEPTH_THRESH	64
 extern void proc_set_overloaded(struct proc *p);
 extern unsigned int get_nr_avail_cores(void);
 extern unsigned int get_total_cores(void);
+extern bool cores_is_online(unsigned int core);
+extern bool cores_is_idle(unsigned int core);
+
+/*
+ * idle core power management
+ */
+
+/* the C-state exit latency allowed for idle cores that aren't deep (us) */
+#define POWER_SHALLOW_LATENCY_US	10
+
+extern bool power_enabled;
+extern unsigned int power_wake_latency_us[NCPU];
+extern unsigned long power_deep_cores[BITMAP_LONG_SIZE(NCPU)];
+
+/*
+ * LLC and memory bandwidth partitioning
+ */
+
+/* the default LLC ways and percent of memory bandwidth for batch procs */
+#define RDT_BATCH_WAYS		2
+#define RDT_BATCH_MB		30
+
+/* the resctrl groups a core can be in */
+enum {
+	RDT_CLASS_NONE = 0,	/* the default group, until first granted */
+	RDT_CLASS_LC,		/* system and normal priority procs */
+	RDT_CLASS_BATCH,	/* batch priority procs */
+	RDT_CLASS_NR,
+};
+
+extern bool rdt_enabled;
+extern unsigned int rdt_batch_ways;
+extern unsigned int rdt_batch_mb;
+extern uint8_t rdt_core_class[NCPU];
+
+/*
+ * interrupt-driven dataplane
+ */
+
+/* empty dataplane passes before sleeping on interrupts */
+#define INTR_IDLE_PASSES	10000
+/* the largest wakeup latency budget (us) */
+#define INTR_BUDGET_MAX_US	(100 * 1000)
+
+extern unsigned int intr_budget_us;
+extern bool intr_enabled;
+extern void intr_sleep(void);
+extern void intr_notify(void);
+
+/*
+ * live upgrades (see handover.c)
+ */
+
+/* how long runtimes get to park before a handover is called off */
+#define HANDOVER_QUIESCE_TIMEOUT_US	(200 * 1000)
+
+enum {
+	HANDOVER_IDLE = 0,
+	HANDOVER_QUIESCING,	/* the dataplane is parking every kthread */
+	HANDOVER_QUIESCED,	/* the dataplane has stopped, exec the new image */
+	HANDOVER_FAILED,	/* the kthreads didn't park, keep running */
+};
+
+extern bool handover_mode;
+extern int handover_fd;
+extern bool handover_pending;
+extern void handover_save_cmdline(int argc, char *argv[]);
+extern int handover_prepare(void);
+extern int handover_status(void);
+extern void handover_reset(void);
+extern int handover_exec(struct proc * const *procs, const int *procfds,
+			 int nr, int controlfd, int reqfd);
+extern void handover_begin(void);
+extern void handover_poll(void);
+extern int handover_control_fd(void);
+extern void *handover_ingress_base(void);
+extern int handover_restore_mbufs(struct rte_mempool *mp);
+extern struct proc *control_restore_client(mem_key_t key, size_t len,
+					   pid_t pid, int fd, int *efds,
+					   int n_efds);
+extern int control_start(void);
+extern const struct shm_region *rx_ingress_region(void);
+extern void rx_stop_workers(void);
+extern void tx_restore_overflows(struct proc *p,
+				 const unsigned long *completions, size_t nr);
+
+/*
+ * dataplane benchmark mode (a synthetic NIC, see bench.c)
+ */
+
+enum {
+	BENCH_RX = 0,
+	BENCH_COMMANDS,
+	BENCH_TX,
+	BENCH_COMPLETIONS,
+	BENCH_NR_STAGES,
+};
+
+/* the smallest packet the synthetic NIC sends (Ethernet, IPv4, and UDP) */
+#define BENCH_MIN_PKT_LEN	42
+
+extern bool bench_enabled;
+extern unsigned long bench_pps;
+extern unsigned int bench_pkt_len;
+extern uint16_t bench_udp_port;
+extern bool bench_gen;
+extern bool bench_loop;
+extern double bench_drop_pct, bench_reorder_pct;
+extern unsigned long bench_delay_us;
+extern unsigned long bench_reorder_us;
+extern uint64_t bench_seed;
+extern uint64_t bench_cycles[BENCH_NR_STAGES];
+extern int bench_port_create(void);
+extern void bench_fill_rx(void);
+extern bool bench_drain_tx(void);
+extern void bench_report(uint64_t elapsed_us);
+
+/* runs a dataplane stage, charging its cycles to @stage if it did work */
+#define BENCH_STAGE(stage, expr)					\
+({									\
+	uint64_t __start = unlikely(bench_enabled) ? rdtsc() : 0;	\
+	bool __ret = (expr);						\
+	if (unlikely(bench_enabled) && __ret)				\
+		bench_cycles[stage] += rdtsc() - __start;		\
+	__ret;								\
+})
+
+/**
+ * rdt_core_grant - records the partition a core should be in for a proc
+ * @core: the core being granted
+ * @p: the proc it's granted to
+ *
+ * The rdt thread moves the core shortly afterwards.
+ */
+static inline void rdt_core_grant(unsigned int core, struct proc *p)
+{
+	if (!rdt_enabled)
+		return;
+
+	ACCESS_ONCE(rdt_core_class[core]) =
+		p->sched_cfg.priority == SCHED_PRIORITY_BATCH ?
+		RDT_CLASS_BATCH : RDT_CLASS_LC;
+}
+
+/**
+ * power_core_is_deep - returns true if an idle core may be in a deep C-state
+ * @core: the core to check
+ */
+static inline bool power_core_is_deep(unsigned int core)
+{
+	return ACCESS_ONCE(power_wake_latency_us[core]) >
+	       POWER_SHALLOW_LATENCY_US;
+}
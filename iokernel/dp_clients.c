@@ -12,15 +12,19 @@
 
 #include "defs.h"
 
-#define MAC_TO_PROC_ENTRIES	128
+#define MAC_TO_PROC_ENTRIES	IOKERNEL_MAX_PROC
 
 static struct lrpc_chan_out lrpc_data_to_control;
 static struct lrpc_chan_in lrpc_control_to_data;
 
-/*
- * Add a new client.
+/**
+ * dp_clients_add_client - adds a new client to the dataplane
+ * @p: the client
+ *
+ * Called for DATAPLANE_ADD_CLIENT, or directly for the clients inherited from
+ * a handover, before the dataplane loop starts.
  */
-static void dp_clients_add_client(struct proc *p)
+void dp_clients_add_client(struct proc *p)
 {
 	int ret;
 
@@ -30,6 +34,8 @@ static void dp_clients_add_client(struct proc *p)
 	ret = rte_hash_add_key_data(dp.mac_to_proc, &p->mac.addr[0], p);
 	if (ret < 0)
 		log_err("dp_clients: failed to add MAC to hash table in add_client");
+	rx_mac_cache_flush();
+	flow_steer_add(p);
 
 #ifdef MLX
 	p->mr = mlx_reg_mem(dp.port, p->region.base, p->region.len, &p->lkey);
@@ -73,11 +79,14 @@ static void dp_clients_remove_client(struct proc *p)
 	if (ret < 0)
 		log_err("dp_clients: failed to remove MAC from hash table in remove "
 				"client");
-#ifdef MLX
-	mlx_dereg_mem(p->mr);
-#endif
+	rx_mac_cache_flush();
+	flow_steer_remove(p);
+	mcast_remove_proc(p);
 
 	/* TODO: free queued packets/commands? */
+	for (i = 0; i < p->thread_count; i++)
+		commands_free_completions(&p->threads[i]);
+	tx_forget_overflows(p);
 
 	/* release cores assigned to this runtime */
 	p->kill = true;
@@ -107,6 +116,9 @@ void dp_clients_rx_control_lrpcs()
 		case DATAPLANE_REMOVE_CLIENT:
 			dp_clients_remove_client(p);
 			break;
+		case DATAPLANE_HANDOVER:
+			handover_begin();
+			break;
 		default:
 			log_err("dp_clients: received unrecognized command %lu", cmd);
 		}
@@ -115,6 +127,14 @@ void dp_clients_rx_control_lrpcs()
 	}
 }
 
+/*
+ * Returns true if the control plane has sent messages that weren't handled.
+ */
+bool dp_clients_control_pending(void)
+{
+	return !lrpc_empty(&lrpc_control_to_data);
+}
+
 /*
  * Initialize channels for communicating with the I/O kernel control plane.
  */
@@ -140,6 +160,7 @@ int dp_clients_init(void)
 	}
 
 	dp.nr_clients = 0;
+	dp.nr_scan_procs = 0;
 
 	/* initialize the hash table for mapping MACs to runtimes */
 	hash_params.name = "mac_to_proc_hash_table";
@@ -36,7 +36,10 @@
  */
 
 #include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
 #include <rte_eal.h>
+#include <rte_eth_bond.h>
 #include <rte_ethdev.h>
 #include <rte_ether.h>
 #include <rte_lcore.h>
@@ -65,6 +68,30 @@ static const struct rte_eth_conf port_conf_default = {
 	},
 };
 
+/*
+ * Limits RSS to the first dp.nr_queues queues, leaving the rest for flows that
+ * are steered by rte_flow rules.
+ */
+static int dpdk_port_restrict_rss(uint8_t port, uint16_t reta_size)
+{
+	struct rte_eth_rss_reta_entry64
+		reta_conf[ETH_RSS_RETA_SIZE_512 / RTE_RETA_GROUP_SIZE];
+	uint16_t i;
+
+	if (reta_size == 0 || reta_size > ETH_RSS_RETA_SIZE_512)
+		return -EINVAL;
+
+	memset(reta_conf, 0, sizeof(reta_conf));
+	for (i = 0; i < reta_size; i++) {
+		reta_conf[i / RTE_RETA_GROUP_SIZE].mask |=
+			1ULL << (i % RTE_RETA_GROUP_SIZE);
+		reta_conf[i / RTE_RETA_GROUP_SIZE].reta[i % RTE_RETA_GROUP_SIZE] =
+			i % dp.nr_queues;
+	}
+
+	return rte_eth_dev_rss_reta_update(port, reta_conf, reta_size);
+}
+
 /*
  * Initializes a given port using global settings and with the RX buffers
  * coming from the mbuf_pool passed as a parameter.
@@ -72,7 +99,7 @@ static const struct rte_eth_conf port_conf_default = {
 static inline int dpdk_port_init(uint8_t port, struct rte_mempool *mbuf_pool)
 {
 	struct rte_eth_conf port_conf = port_conf_default;
-	const uint16_t rx_rings = 1, tx_rings = 1;
+	uint16_t rx_rings, tx_rings = 1;
 	uint16_t nb_rxd = RX_RING_SIZE;
 	uint16_t nb_txd = TX_RING_SIZE;
 	int retval;
@@ -84,20 +111,108 @@ static inline int dpdk_port_init(uint8_t port, struct rte_mempool *mbuf_pool)
 	if (!rte_eth_dev_is_valid_port(port))
 		return -1;
 
+	/* Use TCP segmentation offload if available, tx.c falls back to SW */
+	rte_eth_dev_info_get(port, &dev_info);
+
+	/* the synthetic NIC and kernel sockets lack most offloads */
+	if (bench_enabled || dp.xdp_iface) {
+		port_conf.rxmode.offloads &= dev_info.rx_offload_capa;
+		port_conf.txmode.offloads &= dev_info.tx_offload_capa;
+		port_conf.rx_adv_conf.rss_conf.rss_hf &=
+			dev_info.flow_type_rss_offloads;
+		if (!port_conf.rx_adv_conf.rss_conf.rss_hf)
+			port_conf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+	}
+
+	/* without TX checksum offload, tx.c computes them (bench.c needs none) */
+	dp.sw_csum = !bench_enabled && port_conf.txmode.offloads !=
+				       port_conf_default.txmode.offloads;
+	if (dp.sw_csum)
+		log_info("dpdk: TX checksum offload unavailable, using software");
+
+	dp.tso = (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_TCP_TSO) != 0;
+	if (dp.tso)
+		port_conf.txmode.offloads |= DEV_TX_OFFLOAD_TCP_TSO;
+	log_info("dpdk: TCP segmentation offload %s",
+		 dp.tso ? "enabled" : "unavailable, using software");
+
+	/* multi-segment packets are otherwise copied into one buffer */
+	dp.tx_multi_seg = (dev_info.tx_offload_capa &
+			   DEV_TX_OFFLOAD_MULTI_SEGS) != 0;
+	if (dp.tx_multi_seg)
+		port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MULTI_SEGS;
+
+	/* otherwise runtimes verify TCP and UDP checksums in software */
+	if ((dev_info.rx_offload_capa & (DEV_RX_OFFLOAD_TCP_CKSUM |
+					 DEV_RX_OFFLOAD_UDP_CKSUM)) ==
+	    (DEV_RX_OFFLOAD_TCP_CKSUM | DEV_RX_OFFLOAD_UDP_CKSUM))
+		port_conf.rxmode.offloads |= DEV_RX_OFFLOAD_TCP_CKSUM |
+					     DEV_RX_OFFLOAD_UDP_CKSUM;
+
+	/* accept frames up to the largest MTU runtimes may use */
+	if (dp.mtu > ETHER_MTU) {
+		if (!(dev_info.rx_offload_capa & DEV_RX_OFFLOAD_JUMBO_FRAME)) {
+			log_err("dpdk: port %u doesn't support jumbo frames",
+				port);
+			return -ENOTSUP;
+		}
+		port_conf.rxmode.offloads |= DEV_RX_OFFLOAD_JUMBO_FRAME;
+		port_conf.rxmode.max_rx_pkt_len = dp.mtu + ETHER_HDR_LEN +
+						  ETHER_CRC_LEN;
+	}
+
+	/* runtimes see the NIC's RX timestamps when it has them */
+	if (dev_info.rx_offload_capa & DEV_RX_OFFLOAD_TIMESTAMP)
+		port_conf.rxmode.offloads |= DEV_RX_OFFLOAD_TIMESTAMP;
+
+	/* reserve extra queues for hardware flow steering */
+	dp.nr_flow_queues = 0;
+	if (dp.flow_steering) {
+		if (dev_info.max_rx_queues > dp.nr_queues) {
+			dp.nr_flow_queues = min(IOKERNEL_MAX_FLOW_QUEUES,
+				dev_info.max_rx_queues - (int)dp.nr_queues);
+		}
+		if (dp.nr_flow_queues == 0)
+			dp.flow_steering = false;
+		log_info("dpdk: hardware flow steering %s (%u queues)",
+			 dp.flow_steering ? "enabled" : "unavailable",
+			 dp.nr_flow_queues);
+	}
+	rx_rings = dp.nr_queues + dp.nr_flow_queues;
+
+	/* let the dataplane core sleep on RX interrupts (see intr.c) */
+	port_conf.intr_conf.rxq = intr_budget_us && dp.nr_queues == 1;
+
 	/* Configure the Ethernet device. */
 	retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
+	if (retval != 0 && port_conf.intr_conf.rxq) {
+		log_warn("dpdk: RX interrupts unavailable, always polling");
+		port_conf.intr_conf.rxq = 0;
+		retval = rte_eth_dev_configure(port, rx_rings, tx_rings,
+					       &port_conf);
+	}
 	if (retval != 0)
 		return retval;
 
+	if (dp.mtu > ETHER_MTU) {
+		retval = rte_eth_dev_set_mtu(port, dp.mtu);
+		if (retval != 0) {
+			log_err("dpdk: couldn't set port %u MTU to %u", port,
+				dp.mtu);
+			return retval;
+		}
+		log_info("dpdk: port %u MTU %u", port, dp.mtu);
+	}
+
 	retval = rte_eth_dev_adjust_nb_rx_tx_desc(port, &nb_rxd, &nb_txd);
 	if (retval != 0)
 		return retval;
 
-	rte_eth_dev_info_get(0, &dev_info);
+	rte_eth_dev_info_get(port, &dev_info);
 	rxconf = &dev_info.default_rxconf;
 	rxconf->rx_free_thresh = 64;
 
-	/* Allocate and set up 1 RX queue per Ethernet port. */
+	/* Allocate and set up 1 RX queue per dataplane core and flow queue. */
 	for (q = 0; q < rx_rings; q++) {
 		retval = rte_eth_rx_queue_setup(port, q, nb_rxd,
 				rte_eth_dev_socket_id(port), rxconf, mbuf_pool);
@@ -123,6 +238,15 @@ static inline int dpdk_port_init(uint8_t port, struct rte_mempool *mbuf_pool)
 	if (retval < 0)
 		return retval;
 
+	/* keep RSS traffic off of the flow queues */
+	if (dp.nr_flow_queues > 0) {
+		retval = dpdk_port_restrict_rss(port, dev_info.reta_size);
+		if (retval) {
+			log_err("dpdk: couldn't restrict RSS for flow steering");
+			return retval;
+		}
+	}
+
 	/* Display the port MAC address. */
 	struct ether_addr addr;
 	rte_eth_macaddr_get(port, &addr);
@@ -139,6 +263,54 @@ static inline int dpdk_port_init(uint8_t port, struct rte_mempool *mbuf_pool)
 	return 0;
 }
 
+/*
+ * Creates a bonded port over every NIC port, so all of them serve runtimes.
+ * Egress flows are hashed across the ports by their addresses and L4 ports.
+ * Returns the bonded port, or < 0 on failure.
+ */
+static int dpdk_bond_create(void)
+{
+	uint16_t port, slaves[RTE_MAX_ETHPORTS];
+	unsigned int nr = 0, i;
+	uint8_t mode;
+	int bond, ret;
+
+	RTE_ETH_FOREACH_DEV(port)
+		slaves[nr++] = port;
+	if (nr < 2) {
+		log_err("dpdk: bonding needs at least two ports, found %u", nr);
+		return -ENODEV;
+	}
+
+	mode = dp.bond_mode == DP_BOND_LACP ? BONDING_MODE_8023AD :
+					      BONDING_MODE_BALANCE;
+	bond = rte_eth_bond_create("net_bonding0", mode,
+				   rte_eth_dev_socket_id(slaves[0]));
+	if (bond < 0) {
+		log_err("dpdk: couldn't create a bonded port");
+		return bond;
+	}
+
+	for (i = 0; i < nr; i++) {
+		ret = rte_eth_bond_slave_add(bond, slaves[i]);
+		if (ret) {
+			log_err("dpdk: couldn't add port %u to the bond",
+				slaves[i]);
+			return ret;
+		}
+	}
+
+	ret = rte_eth_bond_xmit_policy_set(bond, BALANCE_XMIT_POLICY_LAYER34);
+	if (ret) {
+		log_err("dpdk: couldn't set the bond's transmit policy");
+		return ret;
+	}
+
+	log_info("dpdk: bonded %u ports as port %d (%s)", nr, bond,
+		 dp.bond_mode == DP_BOND_LACP ? "802.3ad" : "balance");
+	return bond;
+}
+
 /*
  * Log some ethernet port stats.
  */
@@ -161,37 +333,72 @@ void dpdk_print_eth_stats()
 			stats.ierrors, stats.oerrors, stats.rx_nombuf);
 }
 
+/*
+ * Formats the EAL argument that opens dp.xdp_iface as the dataplane port. The
+ * AF_XDP driver arrived in DPDK 19.05 (CONFIG_RTE_LIBRTE_PMD_AF_XDP, which
+ * needs libbpf). Without it, this falls back to AF_PACKET, which also needs
+ * no NIC ownership but copies every packet through the kernel.
+ */
+static char *dpdk_xdp_vdev(char *buf, size_t len)
+{
+#ifdef RTE_LIBRTE_PMD_AF_XDP
+	snprintf(buf, len, "--vdev=net_af_xdp0,iface=%s", dp.xdp_iface);
+	log_info("dpdk: using interface %s through AF_XDP", dp.xdp_iface);
+#else
+	snprintf(buf, len, "--vdev=net_af_packet0,iface=%s,qpairs=%u",
+		 dp.xdp_iface, dp.nr_queues);
+	log_warn("dpdk: DPDK was built without AF_XDP, using interface %s "
+		 "through AF_PACKET", dp.xdp_iface);
+#endif
+	return buf;
+}
+
 /*
  * Initialize dpdk, must be done as soon as possible.
  */
 int dpdk_init()
 {
-	char *argv[4];
-	char buf[10];
+	char *argv[6];
+	char buf[IOKERNEL_MAX_DP_QUEUES * 4];
+	char vdev[64];
+	unsigned int q;
+	int argc = 4, off;
 
 	/* init args */
 	argv[0] = "./iokerneld";
 	argv[1] = "-l";
-	/* use our assigned core */
-	sprintf(buf, "%d", core_assign.dp_core);
+	/* use our assigned cores, the first one becomes the main lcore */
+	off = sprintf(buf, "%d", core_assign.dp_core);
+	for (q = 1; q < dp.nr_queues; q++)
+		off += sprintf(buf + off, ",%d", core_assign.rx_cores[q]);
 	argv[2] = buf;
 	argv[3] = "--socket-mem=128";
+	/* the synthetic NIC stands in for the real ones */
+	if (bench_enabled)
+		argv[argc++] = "--no-pci";
+
+	/* a kernel interface stands in for the NIC, see dpdk_xdp_vdev() */
+	if (!bench_enabled && dp.xdp_iface) {
+		argv[argc++] = "--no-pci";
+		argv[argc++] = dpdk_xdp_vdev(vdev, sizeof(vdev));
+	}
 
 	/* initialize the Environment Abstraction Layer (EAL) */
-	int ret = rte_eal_init(sizeof(argv) / sizeof(argv[0]), argv);
+	int ret = rte_eal_init(argc, argv);
 	if (ret < 0) {
 		log_err("dpdk: error with EAL initialization");
 		return -1;
 	}
 
 	/* check that there is a port to send/receive on */
-	if (!rte_eth_dev_is_valid_port(0)) {
+	if (!bench_enabled && !rte_eth_dev_is_valid_port(0)) {
 		log_err("dpdk: no available ports");
 		return -1;
 	}
 
-	if (rte_lcore_count() > 1)
-		log_warn("dpdk: too many lcores enabled, only 1 used");
+	if (rte_lcore_count() != dp.nr_queues)
+		log_warn("dpdk: %u lcores enabled, expected %u",
+			 rte_lcore_count(), dp.nr_queues);
 
 	return 0;
 }
@@ -201,12 +408,40 @@ int dpdk_init()
  */
 int dpdk_late_init()
 {
+	unsigned int q;
+	int ret;
+
 	/* initialize port */
 	dp.port = 0;
+	if (bench_enabled) {
+		ret = bench_port_create();
+		if (ret < 0) {
+			log_err("dpdk: couldn't create the synthetic NIC");
+			return -1;
+		}
+		dp.port = ret;
+	} else if (dp.bond_mode != DP_BOND_NONE) {
+		ret = dpdk_bond_create();
+		if (ret < 0)
+			return -1;
+		dp.port = ret;
+	}
 	if (dpdk_port_init(dp.port, dp.rx_mbuf_pool) != 0) {
 		log_err("dpdk: cannot init port %"PRIu8 "\n", dp.port);
 		return -1;
 	}
+	dp.nic_node = max(rte_eth_dev_socket_id(dp.port), 0);
+
+	/* start polling the other RSS queues */
+	for (q = 1; q < dp.nr_queues; q++) {
+		ret = rte_eal_remote_launch(rx_worker_loop, (void *)(uintptr_t)q,
+					    core_assign.rx_cores[q]);
+		if (ret) {
+			log_err("dpdk: couldn't launch rx worker on core %u",
+				core_assign.rx_cores[q]);
+			return -1;
+		}
+	}
 
 	return 0;
 }
@@ -0,0 +1,94 @@
+/*
+ * flow.c - hardware flow steering of runtime traffic to dedicated NIC queues
+ *
+ * When enabled, each registered runtime MAC gets an rte_flow rule that steers
+ * its packets to a NIC queue of its own. Packets on these queues are known to
+ * belong to one runtime, so the dataplane can skip the MAC lookup.
+ */
+
+#include <string.h>
+
+#include <rte_ethdev.h>
+#include <rte_flow.h>
+
+#include <base/log.h>
+
+#include "defs.h"
+
+/*
+ * Install a flow rule steering a runtime's MAC to a free flow queue. If no
+ * queue is free or the NIC rejects the rule, the runtime's packets keep going
+ * through RSS and the MAC lookup.
+ */
+void flow_steer_add(struct proc *p)
+{
+	struct rte_flow_attr attr = { .ingress = 1 };
+	struct rte_flow_item_eth eth_spec, eth_mask;
+	struct rte_flow_item pattern[2];
+	struct rte_flow_action_queue queue;
+	struct rte_flow_action actions[2];
+	struct rte_flow_error err;
+	struct rte_flow *flow;
+	unsigned int i;
+
+	p->flow_queue = -1;
+	if (!dp.flow_steering)
+		return;
+
+	for (i = 0; i < dp.nr_flow_queues; i++) {
+		if (!dp.flow_procs[i])
+			break;
+	}
+	if (i == dp.nr_flow_queues) {
+		log_debug("flow: no free queue for new client");
+		return;
+	}
+
+	memset(&eth_spec, 0, sizeof(eth_spec));
+	memset(&eth_mask, 0, sizeof(eth_mask));
+	memcpy(&eth_spec.dst, &p->mac, sizeof(eth_spec.dst));
+	memset(&eth_mask.dst, 0xff, sizeof(eth_mask.dst));
+
+	memset(pattern, 0, sizeof(pattern));
+	pattern[0].type = RTE_FLOW_ITEM_TYPE_ETH;
+	pattern[0].spec = &eth_spec;
+	pattern[0].mask = &eth_mask;
+	pattern[1].type = RTE_FLOW_ITEM_TYPE_END;
+
+	queue.index = dp.nr_queues + i;
+	memset(actions, 0, sizeof(actions));
+	actions[0].type = RTE_FLOW_ACTION_TYPE_QUEUE;
+	actions[0].conf = &queue;
+	actions[1].type = RTE_FLOW_ACTION_TYPE_END;
+
+	flow = rte_flow_create(dp.port, &attr, pattern, actions, &err);
+	if (!flow) {
+		log_warn("flow: couldn't steer client to queue %u (%s)",
+			 queue.index, err.message ? err.message : "unknown");
+		return;
+	}
+
+	dp.flows[i] = flow;
+	dp.flow_procs[i] = p;
+	p->flow_queue = i;
+}
+
+/*
+ * Remove a runtime's flow rule, if it has one. Packets still in its queue
+ * fall back to the MAC lookup.
+ */
+void flow_steer_remove(struct proc *p)
+{
+	struct rte_flow_error err;
+	int i = p->flow_queue;
+
+	if (i < 0)
+		return;
+
+	if (rte_flow_destroy(dp.port, dp.flows[i], &err))
+		log_err("flow: couldn't remove rule for queue %u",
+			dp.nr_queues + i);
+	dp.flows[i] = NULL;
+	dp.flow_procs[i] = NULL;
+	p->flow_queue = -1;
+}
@@ -0,0 +1,756 @@
+/*
+ * handover.c - live upgrades of the iokernel
+ *
+ * Runtimes keep running across an upgrade. A tool sends CONTROL_HANDOVER_KEY
+ * over the control socket, and the dataplane parks every kthread, drains the
+ * egress queues, and stops the NIC. The control thread then writes the state
+ * of every runtime to a memfd and re-executes the iokernel binary (the new
+ * one, if it was replaced) with handover=<fd>.
+ *
+ * An exec keeps the process and its descriptors, so the new image inherits the
+ * control socket and every runtime's connection and eventfds. It also keeps
+ * the ingress mbuf region alive: with kernel.shm_rmid_forced, the segment
+ * would be removed with the process that created it. Runtimes return ingress
+ * mbufs by their addresses, so the new image maps the region where the old one
+ * did, and keeps the mbufs runtimes still hold out of its pool.
+ *
+ * Packets are dropped from when RX stops until the new image starts the port
+ * again, which is mostly DPDK's EAL init; the new image logs how long it took.
+ * Runtimes only see their kthreads parked for that long.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rte_ethdev.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_mempool.h>
+
+#include <base/stddef.h>
+#include <base/atomic.h>
+#include <base/log.h>
+#include <base/mem.h>
+#include <base/time.h>
+#include <iokernel/control.h>
+
+#include "defs.h"
+
+#define HANDOVER_MAGIC		0x686e646f76720002ul
+
+/*
+ * The state passed to the new image: a struct handover_hdr, @nr_inuse struct
+ * handover_mbuf, then @nr_procs struct handover_proc, each followed by its
+ * threads and its overflowed completions.
+ */
+struct handover_hdr {
+	uint64_t	magic;
+	uint64_t	rx_stop_us;	/* wall clock time when RX stopped */
+	uint64_t	ingress_base;
+	uint32_t	nr_ingress_mbufs;
+	uint32_t	nr_inuse;
+	uint32_t	nr_procs;
+	uint32_t	mtu;
+	int32_t		controlfd;
+};
+
+/* an ingress mbuf still held by a runtime */
+struct handover_mbuf {
+	uint64_t	off;	/* from the base of the ingress region */
+	uint16_t	refcnt;
+};
+
+struct handover_proc {
+	pid_t		pid;
+	mem_key_t	key;
+	uint64_t	len;
+	int32_t		fd;
+	uint32_t	thread_count;
+	uint32_t	core_limit;
+	uint32_t	nr_overflows;
+	uint32_t	rx_bufs;	/* ingress mbufs charged to the proc */
+	int64_t		timer_us;	/* until the pending timer fires, or -1 */
+	uint32_t	nr_mcast;
+	uint32_t	mcast[IOKERNEL_MAX_MCAST_GROUPS];
+};
+
+struct handover_thread {
+	int32_t		park_efd;
+	uint32_t	rxq_send_head;
+	uint32_t	txpktq_recv_head;
+	uint32_t	txcmdq_recv_head;
+	uint32_t	rxc_tail;
+};
+
+bool handover_mode;
+int handover_fd = -1;
+bool handover_pending;
+static int handover_state;
+
+/* how to exec the iokernel again */
+static char handover_path[PATH_MAX];
+static char **handover_argv;
+static int handover_argc;
+
+/* the old image's state, filled in by the dataplane as it stops */
+static uint64_t handover_start_us, handover_rx_stop_us;
+static void **free_objs;
+static struct handover_mbuf *inuse;
+static unsigned int nr_inuse, nr_free;
+
+/* the new image's inherited state */
+static void *state;
+static size_t state_len;
+static void *ingress_base = MAP_FAILED;
+
+static uint64_t handover_wall_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * ONE_SECOND + ts.tv_nsec / 1000;
+}
+
+static int handover_write(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -errno;
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * handover_save_cmdline - remembers how the iokernel was started
+ * @argc: the argument count
+ * @argv: the arguments
+ *
+ * A handover execs the same path with the same arguments. The path is looked
+ * up now, because /proc/self/exe goes stale once the binary is replaced.
+ */
+void handover_save_cmdline(int argc, char *argv[])
+{
+	ssize_t len;
+	int i;
+
+	len = readlink("/proc/self/exe", handover_path,
+		       sizeof(handover_path) - 1);
+	if (len < 0)
+		len = 0;
+	handover_path[len] = '\0';
+
+	/* room for handover=<fd> and the terminating NULL */
+	handover_argv = calloc(argc + 2, sizeof(*handover_argv));
+	if (!handover_argv)
+		return;
+	for (i = 0; i < argc; i++) {
+		/* this image's own state fd isn't passed on */
+		if (strncmp(argv[i], "handover=", strlen("handover=")) == 0)
+			continue;
+		handover_argv[handover_argc++] = argv[i];
+	}
+}
+
+/**
+ * handover_prepare - checks that the iokernel can hand over
+ *
+ * Runs on the control thread before a handover begins, since the NIC is
+ * stopped midway and the iokernel can't resume after that. Returns 0 if
+ * the handover may begin, otherwise a negative errno.
+ */
+int handover_prepare(void)
+{
+	if (!handover_argv || handover_path[0] == '\0')
+		return -ENOENT;
+	if (access(handover_path, X_OK))
+		return -errno;
+
+	/* the synthetic NIC holds egress buffers in its own queues */
+	if (bench_enabled)
+		return -EOPNOTSUPP;
+	return 0;
+}
+
+/**
+ * handover_status - the progress of the handover (HANDOVER_*)
+ */
+int handover_status(void)
+{
+	return load_acquire(&handover_state);
+}
+
+/**
+ * handover_reset - allows another handover after a failed one
+ */
+void handover_reset(void)
+{
+	store_release(&handover_state, HANDOVER_IDLE);
+}
+
+static void handover_free_mbuf_lists(void)
+{
+	free(free_objs);
+	free(inuse);
+	free_objs = NULL;
+	inuse = NULL;
+}
+
+/**
+ * handover_begin - starts parking every kthread for a handover
+ *
+ * Runs on the dataplane core. Until handover_poll() is done, cores are only
+ * handed off, never granted, so once parked the kthreads stay parked.
+ */
+void handover_begin(void)
+{
+	unsigned int size = dp.rx_mbuf_pool->size;
+
+	/* allocate now, stopping the NIC must not fail halfway */
+	free_objs = malloc(size * sizeof(*free_objs));
+	inuse = malloc(size * sizeof(*inuse));
+	if (!free_objs || !inuse) {
+		log_err("handover: out of memory");
+		handover_free_mbuf_lists();
+		store_release(&handover_state, HANDOVER_FAILED);
+		return;
+	}
+
+	log_info("handover: parking every kthread");
+	handover_start_us = microtime();
+	handover_pending = true;
+	store_release(&handover_state, HANDOVER_QUIESCING);
+}
+
+static int handover_cmp_obj(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)*(void * const *)a;
+	uintptr_t y = (uintptr_t)*(void * const *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int handover_cmp_mbuf(const void *a, const void *b)
+{
+	const struct handover_mbuf *x = a, *y = b;
+
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+static void handover_note_mbuf(struct rte_mempool *mp, void *opaque,
+			       void *obj, unsigned int idx)
+{
+	const struct shm_region *r = rx_ingress_region();
+	struct handover_mbuf *m;
+
+	if (bsearch(&obj, free_objs, nr_free, sizeof(*free_objs),
+		    handover_cmp_obj))
+		return;
+
+	m = &inuse[nr_inuse++];
+	m->off = (uintptr_t)obj - (uintptr_t)r->base;
+	m->refcnt = rte_mbuf_refcnt_read((struct rte_mbuf *)obj);
+}
+
+/* records the ingress mbufs that aren't free, so runtimes hold them */
+static void handover_find_inuse(struct rte_mempool *mp)
+{
+	struct rte_mempool_cache *c;
+	unsigned int lcore;
+
+	for (lcore = 0; lcore < RTE_MAX_LCORE; lcore++) {
+		c = rte_mempool_default_cache(mp, lcore);
+		if (c)
+			rte_mempool_cache_flush(c, mp);
+	}
+
+	nr_free = rte_mempool_ops_get_count(mp);
+	if (rte_mempool_ops_dequeue_bulk(mp, free_objs, nr_free)) {
+		for (nr_free = 0; nr_free < mp->size; nr_free++) {
+			if (rte_mempool_ops_dequeue_bulk(mp,
+					&free_objs[nr_free], 1))
+				break;
+		}
+	}
+	qsort(free_objs, nr_free, sizeof(*free_objs), handover_cmp_obj);
+
+	nr_inuse = 0;
+	rte_mempool_obj_iter(mp, handover_note_mbuf, NULL);
+	qsort(inuse, nr_inuse, sizeof(*inuse), handover_cmp_mbuf);
+}
+
+/* stops RX and the NIC once every kthread has parked */
+static void handover_finish(void)
+{
+	struct proc *p;
+	int i, j;
+
+	rx_stop_workers();
+	handover_rx_stop_us = handover_wall_us();
+
+	for (i = 0; i < dp.nr_clients; i++) {
+		p = dp.clients[i];
+		for (j = 0; j < p->thread_count; j++)
+			commands_free_completions(&p->threads[j]);
+	}
+
+	/* the driver frees the mbufs it holds, completing egress buffers */
+	rte_eth_dev_stop(dp.port);
+	rte_eth_dev_close(dp.port);
+	tx_drain_completions();
+
+	handover_find_inuse(dp.rx_mbuf_pool);
+
+	log_info("handover: stopped in %ld us, runtimes hold %u ingress mbufs",
+		 microtime() - handover_start_us, nr_inuse);
+	store_release(&handover_state, HANDOVER_QUIESCED);
+}
+
+/**
+ * handover_poll - advances a handover, in place of a dataplane loop pass
+ *
+ * Keeps delivering packets, which wait in the RX queues of parked kthreads,
+ * and handling commands until every kthread has parked and sent its egress
+ * packets. Gives up after HANDOVER_QUIESCE_TIMEOUT_US.
+ */
+void handover_poll(void)
+{
+	bool busy;
+
+	/* once stopped, wait for the control thread to exec */
+	if (load_acquire(&handover_state) != HANDOVER_QUIESCING) {
+		cpu_relax();
+		return;
+	}
+
+	rx_burst();
+	dp_clients_rx_control_lrpcs();
+	commands_rx();
+	tx_drain_completions();
+	busy = tx_burst();
+
+	if (cores_quiesce() && !busy) {
+		handover_finish();
+		return;
+	}
+
+	if (microtime() - handover_start_us > HANDOVER_QUIESCE_TIMEOUT_US) {
+		log_warn("handover: kthreads didn't park within %d ms, resuming",
+			 HANDOVER_QUIESCE_TIMEOUT_US / 1000);
+		handover_free_mbuf_lists();
+		handover_pending = false;
+		store_release(&handover_state, HANDOVER_FAILED);
+	}
+}
+
+/* marks every descriptor beyond stdio close-on-exec */
+static int handover_cloexec_all(void)
+{
+	struct dirent *e;
+	DIR *d;
+	int fd;
+
+	d = opendir("/proc/self/fd");
+	if (!d)
+		return -errno;
+
+	while ((e = readdir(d)) != NULL) {
+		fd = atoi(e->d_name);
+		if (fd <= STDERR_FILENO || fd == dirfd(d))
+			continue;
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	closedir(d);
+	return 0;
+}
+
+static int handover_keep_fd(int fd)
+{
+	if (fcntl(fd, F_SETFD, 0))
+		return -errno;
+	return 0;
+}
+
+static int handover_write_proc(int fd, struct proc *p, int procfd)
+{
+	struct handover_proc hp;
+	struct handover_thread ht;
+	struct thread *th;
+	uint64_t now = microtime();
+	int i, ret;
+
+	memset(&hp, 0, sizeof(hp));
+	hp.pid = p->pid;
+	hp.key = p->key;
+	hp.len = p->region.len;
+	hp.fd = procfd;
+	hp.thread_count = p->thread_count;
+	hp.core_limit = p->core_limit;
+	hp.nr_overflows = p->nr_overflows;
+	hp.rx_bufs = p->rx_bufs;
+	hp.timer_us = -1;
+	if (p->pending_timer)
+		hp.timer_us = p->deadline_us > now ? p->deadline_us - now : 0;
+	hp.nr_mcast = mcast_proc_groups(p, hp.mcast,
+					IOKERNEL_MAX_MCAST_GROUPS);
+
+	ret = handover_write(fd, &hp, sizeof(hp));
+	if (ret)
+		return ret;
+	ret = handover_keep_fd(procfd);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < p->thread_count; i++) {
+		th = &p->threads[i];
+		ht.park_efd = th->park_efd;
+		ht.rxq_send_head = th->rxq.send_head;
+		ht.txpktq_recv_head = th->txpktq.recv_head;
+		ht.txcmdq_recv_head = th->txcmdq.recv_head;
+		ht.rxc_tail = th->rxc_tail;
+
+		ret = handover_write(fd, &ht, sizeof(ht));
+		if (ret)
+			return ret;
+		ret = handover_keep_fd(th->park_efd);
+		if (ret)
+			return ret;
+	}
+
+	return handover_write(fd, p->overflow_queue,
+			      sizeof(*p->overflow_queue) * p->nr_overflows);
+}
+
+/**
+ * handover_exec - hands the runtimes over to a new image of the iokernel
+ * @procs: the procs attached to the control plane
+ * @procfds: their control connections
+ * @nr: the number of procs
+ * @controlfd: the listening control socket
+ * @reqfd: the connection of the tool that asked for the handover
+ *
+ * Runs on the control thread once the dataplane has quiesced. Only returns on
+ * failure, and the NIC is stopped by then, so the caller can't resume.
+ */
+int handover_exec(struct proc * const *procs, const int *procfds, int nr,
+		  int controlfd, int reqfd)
+{
+	struct handover_hdr hdr;
+	cpu_set_t cpuset;
+	char arg[32];
+	int32_t reply = 0;
+	int fd, i, ret;
+
+	fd = memfd_create("iokernel-handover", 0);
+	if (fd < 0)
+		return -errno;
+
+	ret = handover_cloexec_all();
+	if (ret)
+		return ret;
+	ret = handover_keep_fd(fd);
+	if (ret)
+		return ret;
+	ret = handover_keep_fd(controlfd);
+	if (ret)
+		return ret;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = HANDOVER_MAGIC;
+	hdr.rx_stop_us = handover_rx_stop_us;
+	hdr.ingress_base = (uintptr_t)rx_ingress_region()->base;
+	hdr.nr_ingress_mbufs = dp.rx_mbuf_pool->size;
+	hdr.nr_inuse = nr_inuse;
+	hdr.mtu = dp.mtu;
+	hdr.controlfd = controlfd;
+	for (i = 0; i < nr; i++)
+		hdr.nr_procs += !procs[i]->removed;
+
+	ret = handover_write(fd, &hdr, sizeof(hdr));
+	if (ret)
+		return ret;
+	ret = handover_write(fd, inuse, sizeof(*inuse) * nr_inuse);
+	if (ret)
+		return ret;
+
+	/* the new image notices removed procs by their closed connections */
+	for (i = 0; i < nr; i++) {
+		if (procs[i]->removed)
+			continue;
+		ret = handover_write_proc(fd, procs[i], procfds[i]);
+		if (ret)
+			return ret;
+	}
+
+	/* the new image starts on this thread, which is pinned */
+	CPU_ZERO(&cpuset);
+	for (i = 0; i < CPU_SETSIZE; i++)
+		CPU_SET(i, &cpuset);
+	sched_setaffinity(0, sizeof(cpuset), &cpuset);
+
+	snprintf(arg, sizeof(arg), "handover=%d", fd);
+	handover_argv[handover_argc] = arg;
+	log_info("handover: executing %s with %u runtimes", handover_path,
+		 hdr.nr_procs);
+	if (write(reqfd, &reply, sizeof(reply)) != sizeof(reply))
+		log_warn("handover: couldn't reply to the requester");
+
+	execv(handover_path, handover_argv);
+	return -errno;
+}
+
+/*
+ * The new image
+ */
+
+/* returns the next @len bytes of inherited state at @pos, or NULL */
+static const void *handover_pull(size_t *pos, size_t len)
+{
+	const void *p = (const char *)state + *pos;
+
+	if (len > state_len - *pos)
+		return NULL;
+	*pos += len;
+	return p;
+}
+
+/**
+ * handover_control_fd - the control socket inherited from the old image
+ */
+int handover_control_fd(void)
+{
+	return ((const struct handover_hdr *)state)->controlfd;
+}
+
+/**
+ * handover_ingress_base - the ingress region, mapped where the old image had it
+ */
+void *handover_ingress_base(void)
+{
+	return ingress_base;
+}
+
+/**
+ * handover_restore_mbufs - takes runtimes' ingress mbufs out of a new pool
+ * @mp: the ingress mbuf pool, just created in the inherited region
+ *
+ * Returns 0 if successful, or -EINVAL if the pool's layout doesn't match the
+ * old image's.
+ */
+int handover_restore_mbufs(struct rte_mempool *mp)
+{
+	const struct handover_hdr *hdr = state;
+	const struct handover_mbuf *held = (const void *)(hdr + 1);
+	struct handover_mbuf key;
+	struct handover_mbuf *m;
+	unsigned int i, nr, nr_objs = 0, matched = 0;
+	void **objs;
+
+	if (mp->size != hdr->nr_ingress_mbufs) {
+		log_err("handover: the pool has %u ingress mbufs, the old "
+			"iokernel had %u", mp->size, hdr->nr_ingress_mbufs);
+		return -EINVAL;
+	}
+
+	objs = malloc(mp->size * sizeof(*objs));
+	if (!objs)
+		return -ENOMEM;
+
+	nr = rte_mempool_ops_get_count(mp);
+	if (rte_mempool_ops_dequeue_bulk(mp, objs, nr)) {
+		free(objs);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < nr; i++) {
+		key.off = (uintptr_t)objs[i] - (uintptr_t)ingress_base;
+		m = bsearch(&key, held, hdr->nr_inuse, sizeof(*held),
+			    handover_cmp_mbuf);
+		if (!m) {
+			objs[nr_objs++] = objs[i];
+			continue;
+		}
+
+		rte_mbuf_refcnt_set((struct rte_mbuf *)objs[i], m->refcnt);
+		matched++;
+	}
+
+	rte_mempool_ops_enqueue_bulk(mp, objs, nr_objs);
+	free(objs);
+
+	if (matched != hdr->nr_inuse) {
+		log_err("handover: only found %u of the %u ingress mbufs held "
+			"by runtimes", matched, hdr->nr_inuse);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int handover_restore_proc(size_t *pos)
+{
+	const struct handover_proc *hp;
+	const struct handover_thread *ht;
+	const unsigned long *overflows;
+	int efds[NCPU];
+	struct thread *th;
+	struct proc *p;
+	unsigned int i;
+
+	hp = handover_pull(pos, sizeof(*hp));
+	if (!hp || hp->thread_count > NCPU)
+		return -EINVAL;
+	ht = handover_pull(pos, sizeof(*ht) * hp->thread_count);
+	overflows = handover_pull(pos, sizeof(*overflows) * hp->nr_overflows);
+	if (!ht || !overflows)
+		return -EINVAL;
+
+	for (i = 0; i < hp->thread_count; i++)
+		efds[i] = ht[i].park_efd;
+	p = control_restore_client(hp->key, hp->len, hp->pid, hp->fd, efds,
+				   hp->thread_count);
+	if (!p) {
+		log_err("handover: couldn't take over pid %d", hp->pid);
+		return 0;
+	}
+
+	/* pick the queues up where the old image left them */
+	for (i = 0; i < p->thread_count; i++) {
+		th = &p->threads[i];
+		th->rxq.send_head = ht[i].rxq_send_head;
+		lrpc_poll_send_tail(&th->rxq);
+		th->txpktq.recv_head = ht[i].txpktq_recv_head;
+		th->txcmdq.recv_head = ht[i].txcmdq_recv_head;
+		th->rxc_tail = ht[i].rxc_tail;
+	}
+	tx_restore_overflows(p, overflows, hp->nr_overflows);
+	if (hp->core_limit > 0)
+		p->core_limit = min(hp->core_limit, p->thread_count);
+	p->rx_bufs = hp->rx_bufs;
+
+	dp_clients_add_client(p);
+	for (i = 0; i < min(hp->nr_mcast, IOKERNEL_MAX_MCAST_GROUPS); i++)
+		mcast_join(p, hp->mcast[i]);
+
+	/* adding the proc woke a kthread and cleared any timer */
+	if (hp->timer_us >= 0) {
+		p->pending_timer = true;
+		p->deadline_us = microtime() + hp->timer_us;
+		cores_scan_proc(p);
+	}
+
+	/* packets that arrived while the kthreads were parked */
+	for (i = 0; i < p->thread_count; i++) {
+		if (lrpc_get_cached_length(&p->threads[i].rxq) > 0) {
+			proc_set_overloaded(p);
+			break;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Reads the old image's state and maps the ingress region where it was,
+ * before anything else can take the address.
+ */
+int handover_init(void)
+{
+	const struct handover_hdr *hdr;
+	struct stat st;
+	ssize_t ret;
+
+	if (!handover_mode)
+		return 0;
+
+	if (fstat(handover_fd, &st)) {
+		log_err("handover: bad state fd %d [%s]", handover_fd,
+			strerror(errno));
+		return -errno;
+	}
+
+	state_len = st.st_size;
+	state = malloc(max(state_len, sizeof(*hdr)));
+	if (!state)
+		return -ENOMEM;
+	ret = pread(handover_fd, state, state_len, 0);
+	close(handover_fd);
+	hdr = state;
+	if (ret != (ssize_t)state_len || state_len < sizeof(*hdr) ||
+	    hdr->magic != HANDOVER_MAGIC ||
+	    state_len - sizeof(*hdr) < hdr->nr_inuse *
+				       sizeof(struct handover_mbuf)) {
+		log_err("handover: the old iokernel's state is invalid");
+		return -EINVAL;
+	}
+
+	if (hdr->mtu != dp.mtu) {
+		log_err("handover: mtu %u differs from the old iokernel's (%u)",
+			dp.mtu, hdr->mtu);
+		return -EINVAL;
+	}
+
+	/* runtimes hold pointers into the region, so it can't move */
+	ingress_base = mem_map_shm(INGRESS_MBUF_SHM_KEY,
+				   (void *)hdr->ingress_base,
+				   INGRESS_MBUF_SHM_SIZE, PGSIZE_2MB, false);
+	if (ingress_base != (void *)hdr->ingress_base) {
+		log_err("handover: couldn't map the ingress region at %p",
+			(void *)hdr->ingress_base);
+		return -ENOMEM;
+	}
+
+	log_info("handover: taking over %u runtimes", hdr->nr_procs);
+	return 0;
+}
+
+/*
+ * Attaches the inherited runtimes once the dataplane is set up, then starts
+ * the control thread. Runs on the dataplane core before its loop.
+ */
+int handover_late_init(void)
+{
+	const struct handover_hdr *hdr = state;
+	unsigned int i, nr_restored = 0;
+	size_t pos;
+	int ret;
+
+	if (!handover_mode)
+		return 0;
+
+	pos = sizeof(*hdr) + hdr->nr_inuse * sizeof(struct handover_mbuf);
+	for (i = 0; i < hdr->nr_procs; i++) {
+		ret = handover_restore_proc(&pos);
+		if (ret < 0) {
+			log_err("handover: the state of runtime %u is truncated",
+				i);
+			break;
+		}
+		nr_restored += ret;
+	}
+
+	log_info("handover: took over %u of %u runtimes, RX was stopped for "
+		 "%ld us", nr_restored, hdr->nr_procs,
+		 handover_wall_us() - hdr->rx_stop_us);
+	free(state);
+	state = NULL;
+	return control_start();
+}
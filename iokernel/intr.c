@@ -0,0 +1,192 @@
+/*
+ * intr.c - lets the dataplane core sleep on interrupts when the host is quiet
+ *
+ * While no runtime has a running kthread, the dataplane core only waits for
+ * packets, control traffic (runtimes attaching or leaving), and runtime timers.
+ * After INTR_IDLE_PASSES empty passes, it arms the NIC's RX interrupts and
+ * blocks until one fires, the control thread signals an eventfd, or a timerfd
+ * expires at the next runtime timer. The sleep never exceeds intr_budget_us,
+ * which bounds the wakeup latency even if an interrupt is missed.
+ */
+
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <rte_ethdev.h>
+#include <rte_interrupts.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+
+#include "defs.h"
+
+#define INTR_MAX_EVENTS		8
+
+/* the longest the dataplane core may sleep (us), or 0 to always poll */
+unsigned int intr_budget_us;
+/* true if the dataplane core sleeps when idle */
+bool intr_enabled;
+
+static bool intr_sleeping;
+static int intr_efd = -1;
+static int intr_tfd = -1;
+static struct rte_epoll_event intr_efd_ev, intr_tfd_ev;
+
+/* the NIC queues the dataplane core polls itself */
+static uint16_t intr_nr_queues(void)
+{
+	return dp.nr_queues + dp.nr_flow_queues;
+}
+
+static bool intr_rx_pending(void)
+{
+	uint16_t q;
+
+	/* PMDs that can't count return < 0, so rely on the interrupt */
+	for (q = 0; q < intr_nr_queues(); q++) {
+		if (rte_eth_rx_queue_count(dp.port, q) > 0)
+			return true;
+	}
+
+	return false;
+}
+
+static void intr_set_timer(uint64_t us)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = us / ONE_SECOND;
+	its.it_value.tv_nsec = (us % ONE_SECOND) * 1000;
+	timerfd_settime(intr_tfd, 0, &its, NULL);
+}
+
+/**
+ * intr_sleep - blocks the dataplane core until there may be work
+ *
+ * Must only be called from the dataplane core while no kthread is polled.
+ */
+void intr_sleep(void)
+{
+	struct rte_epoll_event ev[INTR_MAX_EVENTS];
+	uint64_t now, deadline, val;
+	struct proc *p;
+	uint16_t q;
+	int i;
+
+	/* runtime timers are handled by the dataplane, so wake up for them */
+	now = microtime();
+	deadline = now + intr_budget_us;
+	for (i = 0; i < dp.nr_clients; i++) {
+		p = dp.clients[i];
+		if (p->pending_timer)
+			deadline = min(deadline, p->deadline_us);
+	}
+	if (deadline <= now)
+		return;
+
+	for (q = 0; q < intr_nr_queues(); q++)
+		rte_eth_dev_rx_intr_enable(dp.port, q);
+
+	/* pairs with the barrier in intr_notify() */
+	store_release(&intr_sleeping, true);
+	mb();
+	if (dp_clients_control_pending() || intr_rx_pending())
+		goto out;
+
+	STAT_INC(INTR_SLEEPS, 1);
+	intr_set_timer(deadline - now);
+	rte_epoll_wait(RTE_EPOLL_PER_THREAD, ev, INTR_MAX_EVENTS, -1);
+	intr_set_timer(0);
+
+	/* both are nonblocking, and may not have fired */
+	if (read(intr_efd, &val, sizeof(val)) != sizeof(val))
+		val = 0;
+	if (read(intr_tfd, &val, sizeof(val)) != sizeof(val))
+		val = 0;
+	STAT_INC(INTR_SLEEP_US, microtime() - now);
+
+out:
+	store_release(&intr_sleeping, false);
+	for (q = 0; q < intr_nr_queues(); q++)
+		rte_eth_dev_rx_intr_disable(dp.port, q);
+}
+
+/**
+ * intr_notify - wakes the dataplane core after sending it a control message
+ *
+ * Called from the control thread.
+ */
+void intr_notify(void)
+{
+	uint64_t val = 1;
+
+	/* pairs with the barrier in intr_sleep() */
+	mb();
+	if (!load_acquire(&intr_sleeping))
+		return;
+
+	if (write(intr_efd, &val, sizeof(val)) != sizeof(val))
+		log_warn("intr: couldn't wake the dataplane core");
+}
+
+static int intr_add_fd(int fd, struct rte_epoll_event *ev)
+{
+	ev->epdata.event = EPOLLIN;
+	ev->epdata.data = NULL;
+	ev->epdata.cb_fun = NULL;
+	ev->epdata.cb_arg = NULL;
+	return rte_epoll_ctl(RTE_EPOLL_PER_THREAD, EPOLL_CTL_ADD, fd, ev);
+}
+
+/*
+ * Registers the wakeup sources with the dataplane core's epoll instance.
+ * Does nothing unless intr_budget_us is set. Must run on the dataplane core.
+ */
+int intr_init(void)
+{
+	uint16_t q;
+	int ret;
+
+	if (!intr_budget_us)
+		return 0;
+
+	/* RX workers would keep polling, and they can't be woken */
+	if (dp.nr_queues > 1) {
+		log_warn("intr: not supported with RX worker cores, disabling");
+		return 0;
+	}
+
+	for (q = 0; q < intr_nr_queues(); q++) {
+		ret = rte_eth_dev_rx_intr_ctl_q(dp.port, q,
+						RTE_EPOLL_PER_THREAD,
+						RTE_INTR_EVENT_ADD, NULL);
+		if (ret) {
+			log_warn("intr: port %u has no RX interrupts, disabling",
+				 dp.port);
+			return 0;
+		}
+	}
+
+	intr_efd = eventfd(0, EFD_NONBLOCK);
+	intr_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (intr_efd < 0 || intr_tfd < 0) {
+		log_err("intr: couldn't create wakeup fds");
+		return -1;
+	}
+
+	if (intr_add_fd(intr_efd, &intr_efd_ev) ||
+	    intr_add_fd(intr_tfd, &intr_tfd_ev)) {
+		log_err("intr: couldn't add wakeup fds to epoll");
+		return -1;
+	}
+
+	intr_enabled = true;
+	log_info("intr: dataplane sleeps when idle, for at most %u us",
+		 intr_budget_us);
+	return 0;
+}
@@ -2,18 +2,24 @@
  * main.c - initialization and main dataplane loop for the iokernel
  */
 
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <rte_ethdev.h>
 #include <rte_lcore.h>
 
 #include <base/init.h>
 #include <base/log.h>
+#include <base/mem.h>
 #include <base/stddef.h>
 
 #include "defs.h"
 
-#define CORES_ADJUST_INTERVAL_US	5
 #define LOG_INTERVAL_US		(1000 * 1000)
+#define CORES_ADJUST_INTERVAL_MAX_US	1000
 struct dataplane dp;
+unsigned int cores_adjust_interval_us = 5;
 
 struct init_entry {
 	const char *name;
@@ -23,15 +29,23 @@ struct init_entry {
 #define IOK_INITIALIZER(name) \
 	{__cstr(name), &name ## _init}
 
+/* write log messages from a background thread (see log_async_init()) */
+static bool log_async;
+
 /* iokernel subsystem initialization */
 static const struct init_entry iok_init_handlers[] = {
 	/* base */
 	IOK_INITIALIZER(base),
 
 	/* general iokernel */
+	IOK_INITIALIZER(handover),
 	IOK_INITIALIZER(cores),
+	IOK_INITIALIZER(power),
+	IOK_INITIALIZER(rdt),
+	IOK_INITIALIZER(pcap),
 
 	/* control plane */
+	IOK_INITIALIZER(prereg),
 	IOK_INITIALIZER(control),
 
 	/* data plane */
@@ -40,6 +54,8 @@ static const struct init_entry iok_init_handlers[] = {
 	IOK_INITIALIZER(tx),
 	IOK_INITIALIZER(dp_clients),
 	IOK_INITIALIZER(dpdk_late),
+	IOK_INITIALIZER(intr),
+	IOK_INITIALIZER(handover_late),
 };
 
 static int run_init_handlers(const char *phase, const struct init_entry *h,
@@ -66,10 +82,12 @@ static int run_init_handlers(const char *phase, const struct init_entry *h,
 void dataplane_loop()
 {
 	bool work_done;
+	unsigned int idle_passes = 0;
 #ifdef STATS
 	uint64_t next_log_time = microtime();
 #endif
 	uint64_t now, last_time = microtime();
+	uint64_t last_bench_report = last_time, last_recalibrate = last_time;
 
 	/*
 	 * Check that the port is on the same NUMA node as the polling thread
@@ -85,10 +103,20 @@ void dataplane_loop()
 
 	/* run until quit or killed */
 	for (;;) {
+		/* a handover takes over the loop until the new image execs */
+		if (unlikely(handover_pending)) {
+			handover_poll();
+			continue;
+		}
+
 		work_done = false;
 
+		/* feed the synthetic NIC */
+		if (unlikely(bench_enabled))
+			bench_fill_rx();
+
 		/* handle a burst of ingress packets */
-		work_done |= rx_burst();
+		work_done |= BENCH_STAGE(BENCH_RX, rx_burst());
 
 		/* handle control messages */
 		if (!work_done)
@@ -96,23 +124,47 @@ void dataplane_loop()
 
 		now = microtime();
 
-		/* adjust core assignments */
-		if (now - last_time > CORES_ADJUST_INTERVAL_US) {
+		/* adjust core assignments (rx_burst() also reacts to deep
+		   RX queues in between) */
+		if (now - last_time >= cores_adjust_interval_us) {
 			cores_adjust_assignments();
 			last_time = now;
 		}
 
 		/* process a batch of commands from runtimes */
-		work_done |= commands_rx();
+		work_done |= BENCH_STAGE(BENCH_COMMANDS, commands_rx());
 
 		/* drain overflow completion queues */
-		work_done |= tx_drain_completions();
+		work_done |= BENCH_STAGE(BENCH_COMPLETIONS,
+					 tx_drain_completions());
 
 		/* send a burst of egress packets */
-		work_done |= tx_burst();
+		work_done |= BENCH_STAGE(BENCH_TX, tx_burst());
+
+		/* a NIC would free sent packets during tx_burst() */
+		if (unlikely(bench_enabled)) {
+			work_done |= BENCH_STAGE(BENCH_TX, bench_drain_tx());
+			if (now - last_bench_report >= LOG_INTERVAL_US) {
+				bench_report(now - last_bench_report);
+				last_bench_report = now;
+			}
+		}
+
+		/* keep the TSC clock in sync with the system clock */
+		if (unlikely(now - last_recalibrate >= TIME_RECALIBRATE_US)) {
+			time_recalibrate();
+			last_recalibrate = now;
+		}
 
 		STAT_INC(BATCH_TOTAL, IOKERNEL_RX_BURST_SIZE);
 
+		/* sleep on interrupts once no runtime has needed us for a while */
+		idle_passes = work_done || nrts > 0 ? 0 : idle_passes + 1;
+		if (unlikely(idle_passes >= INTR_IDLE_PASSES) && intr_enabled) {
+			intr_sleep();
+			idle_passes = 0;
+		}
+
 #ifdef STATS
 		if (microtime() > next_log_time) {
 			print_stats();
@@ -123,15 +175,397 @@ void dataplane_loop()
 	}
 }
 
+/*
+ * Parses the command line:
+ *   iokerneld [nr_dataplane_cores] [flowsteer] [numa] [power] [adjust=<us>]
+ *             [rdt] [rdt_ways=<n>] [rdt_mb=<%>]
+ *             [pcap] [pcap_snaplen=<bytes>] [pcap_sample=<n>]
+ *             [pcap_filter=<file>]
+ *             [intr=<us>] [mtu=<bytes>] [bond | bond=lacp] [loopback]
+ *             [afxdp=<iface>] [logasync]
+ *             [prereg=<n>] [prereg_mb=<MB>] [handover=<fd>]
+ *             [rx_quota=<mbufs>] [bench=<pps>] [bench_len=<bytes>] [bench_port=<port>]
+ *             [bench_loop] [bench_drop=<%>] [bench_delay=<us>]
+ *             [bench_reorder=<%>] [bench_reorder_us=<us>] [bench_seed=<n>]
+ *
+ * adjust=0 scans on every pass through the dataplane loop. intr=<us> lets the
+ * dataplane core sleep on interrupts when idle, for at most <us> at a time.
+ * mtu=<bytes> enables jumbo frames, and runtimes may use any MTU up to it.
+ * loopback delivers packets between runtimes on this host without the NIC.
+ * afxdp=<iface> uses a kernel network interface through AF_XDP instead of a
+ * NIC bound to DPDK. logasync formats and writes log messages on a background
+ * thread instead of the dataplane.
+ * prereg=<n> keeps <n> shm regions of prereg_mb each mapped and ready for
+ * runtimes started with runtime_prereg (see prereg.c). handover=<fd> is only
+ * passed by the iokernel to its new image during a live upgrade, and names the
+ * memfd holding the old image's state (see handover.c). rx_quota=<mbufs>
+ * caps the ingress mbufs each runtime may hold (0 for no cap).
+ * rdt partitions the LLC and memory bandwidth through resctrl, giving cores
+ * of batch procs rdt_ways LLC ways and rdt_mb percent of the bandwidth, and
+ * cores of other procs the rest (see rdt.c).
+ * pcap keeps the first pcap_snaplen bytes of one in every pcap_sample packets
+ * received or sent in a ring that scripts/ikpcap saves as pcapng, only
+ * counting those that match pcap_filter, the output of "tcpdump -ddd <expr>"
+ * (see pcap.c).
+ * bench=<pps> replaces the NIC with a synthetic one that sends <pps> UDP
+ * packets per second (or as many as possible, if 0) of bench_len bytes to
+ * bench_port on every runtime (see bench.c). bench_loop forwards sent packets
+ * back to the runtimes instead, dropping bench_drop percent of them, delaying
+ * all by bench_delay, and delaying bench_reorder percent by bench_reorder_us
+ * more.
+ */
+static int parse_args(int argc, char *argv[])
+{
+	char *end;
+	double pct;
+	long nr;
+	int i;
+
+	dp.nr_queues = 1;
+	dp.flow_steering = false;
+	dp.numa = false;
+	dp.bond_mode = DP_BOND_NONE;
+	dp.mtu = ETH_MTU;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "flowsteer") == 0) {
+			dp.flow_steering = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "numa") == 0) {
+			dp.numa = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "bond") == 0) {
+			dp.bond_mode = DP_BOND_BALANCE;
+			continue;
+		}
+
+		if (strcmp(argv[i], "bond=lacp") == 0) {
+			dp.bond_mode = DP_BOND_LACP;
+			continue;
+		}
+
+		if (strncmp(argv[i], "afxdp=", strlen("afxdp=")) == 0) {
+			dp.xdp_iface = argv[i] + strlen("afxdp=");
+			if (*dp.xdp_iface == '\0') {
+				log_err("main: afxdp needs an interface name");
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "loopback") == 0) {
+			tx_loopback = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "logasync") == 0) {
+			log_async = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "power") == 0) {
+			power_enabled = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "rdt") == 0) {
+			rdt_enabled = true;
+			continue;
+		}
+
+		if (strncmp(argv[i], "rdt_ways=", strlen("rdt_ways=")) == 0) {
+			nr = strtol(argv[i] + strlen("rdt_ways="), &end, 10);
+			if (*end != '\0' || nr < 1 || nr >= BITS_PER_LONG) {
+				log_err("main: rdt ways must be 1-%d",
+					(int)BITS_PER_LONG - 1);
+				return -EINVAL;
+			}
+			rdt_batch_ways = nr;
+			rdt_enabled = true;
+			continue;
+		}
+
+		if (strncmp(argv[i], "rdt_mb=", strlen("rdt_mb=")) == 0) {
+			nr = strtol(argv[i] + strlen("rdt_mb="), &end, 10);
+			if (*end != '\0' || nr < 1 || nr > 100) {
+				log_err("main: rdt bandwidth must be 1-100%%");
+				return -EINVAL;
+			}
+			rdt_batch_mb = nr;
+			rdt_enabled = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "pcap") == 0) {
+			pcap_enabled = true;
+			continue;
+		}
+
+		if (strncmp(argv[i], "pcap_snaplen=",
+			    strlen("pcap_snaplen=")) == 0) {
+			nr = strtol(argv[i] + strlen("pcap_snaplen="), &end, 10);
+			if (*end != '\0' || nr < 1 || nr > IKPCAP_MAX_SNAPLEN) {
+				log_err("main: pcap snaplen must be 1-%d bytes",
+					IKPCAP_MAX_SNAPLEN);
+				return -EINVAL;
+			}
+			pcap_snaplen = nr;
+			pcap_enabled = true;
+			continue;
+		}
+
+		if (strncmp(argv[i], "pcap_sample=",
+			    strlen("pcap_sample=")) == 0) {
+			nr = strtol(argv[i] + strlen("pcap_sample="), &end, 10);
+			if (*end != '\0' || nr < 1 || nr > UINT32_MAX) {
+				log_err("main: pcap sample must be at least 1");
+				return -EINVAL;
+			}
+			pcap_sample = nr;
+			pcap_enabled = true;
+			continue;
+		}
+
+		if (strncmp(argv[i], "pcap_filter=",
+			    strlen("pcap_filter=")) == 0) {
+			pcap_filter_path = argv[i] + strlen("pcap_filter=");
+			pcap_enabled = true;
+			continue;
+		}
+
+		if (strncmp(argv[i], "adjust=", strlen("adjust=")) == 0) {
+			nr = strtol(argv[i] + strlen("adjust="), &end, 10);
+			if (*end != '\0' || nr < 0 ||
+			    nr > CORES_ADJUST_INTERVAL_MAX_US) {
+				log_err("main: adjust interval must be 0-%d us",
+					CORES_ADJUST_INTERVAL_MAX_US);
+				return -EINVAL;
+			}
+			cores_adjust_interval_us = nr;
+			continue;
+		}
+
+		if (strncmp(argv[i], "intr=", strlen("intr=")) == 0) {
+			nr = strtol(argv[i] + strlen("intr="), &end, 10);
+			if (*end != '\0' || nr < 1 || nr > INTR_BUDGET_MAX_US) {
+				log_err("main: intr budget must be 1-%d us",
+					INTR_BUDGET_MAX_US);
+				return -EINVAL;
+			}
+			intr_budget_us = nr;
+			continue;
+		}
+
+		if (strncmp(argv[i], "mtu=", strlen("mtu=")) == 0) {
+			nr = strtol(argv[i] + strlen("mtu="), &end, 10);
+			if (*end != '\0' || nr < ETH_MTU ||
+			    nr > IOKERNEL_MAX_MTU) {
+				log_err("main: mtu must be %d-%d bytes",
+					ETH_MTU, IOKERNEL_MAX_MTU);
+				return -EINVAL;
+			}
+			dp.mtu = nr;
+			continue;
+		}
+
+		if (strncmp(argv[i], "prereg=", strlen("prereg=")) == 0) {
+			nr = strtol(argv[i] + strlen("prereg="), &end, 10);
+			if (*end != '\0' || nr < 0 || nr > IOKERNEL_MAX_PROC) {
+				log_err("main: prereg must be 0-%d regions",
+					IOKERNEL_MAX_PROC);
+				return -EINVAL;
+			}
+			prereg_nr = nr;
+			continue;
+		}
+
+		if (strncmp(argv[i], "prereg_mb=", strlen("prereg_mb=")) == 0) {
+			nr = strtol(argv[i] + strlen("prereg_mb="), &end, 10);
+			if (*end != '\0' || nr < 2) {
+				log_err("main: prereg_mb must be >= 2 MB");
+				return -EINVAL;
+			}
+			prereg_len = align_up((size_t)nr * 1024 * 1024,
+					      PGSIZE_2MB);
+			continue;
+		}
+
+		if (strncmp(argv[i], "handover=", strlen("handover=")) == 0) {
+			nr = strtol(argv[i] + strlen("handover="), &end, 10);
+			if (*end != '\0' || nr < 0 || nr > INT_MAX) {
+				log_err("main: handover must be a file descriptor");
+				return -EINVAL;
+			}
+			handover_mode = true;
+			handover_fd = nr;
+			continue;
+		}
+
+		if (strncmp(argv[i], "rx_quota=", strlen("rx_quota=")) == 0) {
+			nr = strtol(argv[i] + strlen("rx_quota="), &end, 10);
+			if (*end != '\0' || nr < 0 || nr > IOKERNEL_NUM_MBUFS) {
+				log_err("main: rx_quota must be 0-%d mbufs",
+					IOKERNEL_NUM_MBUFS);
+				return -EINVAL;
+			}
+			rx_buf_quota = nr;
+			continue;
+		}
+
+		if (strncmp(argv[i], "bench=", strlen("bench=")) == 0) {
+			nr = strtol(argv[i] + strlen("bench="), &end, 10);
+			if (*end != '\0' || nr < 0) {
+				log_err("main: bench rate must be >= 0 pps");
+				return -EINVAL;
+			}
+			bench_enabled = true;
+			bench_gen = true;
+			bench_pps = nr;
+			continue;
+		}
+
+		if (strcmp(argv[i], "bench_loop") == 0) {
+			bench_enabled = true;
+			bench_loop = true;
+			continue;
+		}
+
+		if (strncmp(argv[i], "bench_drop=", strlen("bench_drop=")) == 0) {
+			pct = strtod(argv[i] + strlen("bench_drop="), &end);
+			if (*end != '\0' || !(pct >= 0.0 && pct <= 100.0)) {
+				log_err("main: bench drop rate must be 0-100%%");
+				return -EINVAL;
+			}
+			bench_drop_pct = pct;
+			continue;
+		}
+
+		if (strncmp(argv[i], "bench_reorder=",
+			    strlen("bench_reorder=")) == 0) {
+			pct = strtod(argv[i] + strlen("bench_reorder="), &end);
+			if (*end != '\0' || !(pct >= 0.0 && pct <= 100.0)) {
+				log_err("main: bench reorder rate must be 0-100%%");
+				return -EINVAL;
+			}
+			bench_reorder_pct = pct;
+			continue;
+		}
+
+		if (strncmp(argv[i], "bench_delay=", strlen("bench_delay=")) == 0) {
+			nr = strtol(argv[i] + strlen("bench_delay="), &end, 10);
+			if (*end != '\0' || nr < 0 || nr > ONE_SECOND) {
+				log_err("main: bench delay must be 0-%d us",
+					ONE_SECOND);
+				return -EINVAL;
+			}
+			bench_delay_us = nr;
+			continue;
+		}
+
+		if (strncmp(argv[i], "bench_reorder_us=",
+			    strlen("bench_reorder_us=")) == 0) {
+			nr = strtol(argv[i] + strlen("bench_reorder_us="), &end,
+				    10);
+			if (*end != '\0' || nr < 0 || nr > ONE_SECOND) {
+				log_err("main: bench reorder delay must be 0-%d us",
+					ONE_SECOND);
+				return -EINVAL;
+			}
+			bench_reorder_us = nr;
+			continue;
+		}
+
+		if (strncmp(argv[i], "bench_seed=", strlen("bench_seed=")) == 0) {
+			nr = strtol(argv[i] + strlen("bench_seed="), &end, 10);
+			if (*end != '\0' || nr < 0) {
+				log_err("main: bench seed must be >= 0");
+				return -EINVAL;
+			}
+			bench_seed = nr;
+			continue;
+		}
+
+		if (strncmp(argv[i], "bench_len=", strlen("bench_len=")) == 0) {
+			nr = strtol(argv[i] + strlen("bench_len="), &end, 10);
+			if (*end != '\0' || nr < BENCH_MIN_PKT_LEN ||
+			    nr > IOKERNEL_MAX_MTU + ETH_HDR_LEN) {
+				log_err("main: bench packets must be %d-%d bytes",
+					BENCH_MIN_PKT_LEN,
+					IOKERNEL_MAX_MTU + ETH_HDR_LEN);
+				return -EINVAL;
+			}
+			bench_pkt_len = nr;
+			continue;
+		}
+
+		if (strncmp(argv[i], "bench_port=", strlen("bench_port=")) == 0) {
+			nr = strtol(argv[i] + strlen("bench_port="), &end, 10);
+			if (*end != '\0' || nr < 1 || nr > UINT16_MAX) {
+				log_err("main: bench port must be 1-%d",
+					UINT16_MAX);
+				return -EINVAL;
+			}
+			bench_udp_port = nr;
+			continue;
+		}
+
+		nr = strtol(argv[i], &end, 10);
+		if (*end != '\0' || nr < 1 || nr > IOKERNEL_MAX_DP_QUEUES) {
+			log_err("usage: %s [nr_dataplane_cores (1-%d)] "
+				"[flowsteer] [numa] [power] [adjust=<us>] "
+				"[rdt] [rdt_ways=<n>] [rdt_mb=<%%>] "
+				"[pcap] [pcap_snaplen=<bytes>] "
+				"[pcap_sample=<n>] [pcap_filter=<file>] "
+				"[intr=<us>] [mtu=<bytes>] [bond | bond=lacp] "
+				"[loopback] [afxdp=<iface>] [logasync] "
+				"[prereg=<n>] [prereg_mb=<MB>] [handover=<fd>] "
+				"[rx_quota=<mbufs>] "
+				"[bench=<pps>] [bench_len=<bytes>] "
+				"[bench_port=<port>] [bench_loop] "
+				"[bench_drop=<%%>] [bench_delay=<us>] "
+				"[bench_reorder=<%%>] [bench_reorder_us=<us>] "
+				"[bench_seed=<n>]",
+				argv[0],
+				IOKERNEL_MAX_DP_QUEUES);
+			return -EINVAL;
+		}
+		dp.nr_queues = nr;
+	}
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int ret;
 
+	handover_save_cmdline(argc, argv);
+	ret = parse_args(argc, argv);
+	if (ret)
+		return ret;
+
+	/* nothing else runs yet, so use every CPU to fault in memory */
+	mem_prefault_threads = 0;
+
 	ret = run_init_handlers("iokernel", iok_init_handlers,
 			ARRAY_SIZE(iok_init_handlers));
 	if (ret)
 		return ret;
 
+	/* the clock is calibrated now, so messages can be timestamped */
+	if (log_async) {
+		ret = log_async_init();
+		if (ret) {
+			log_err("main: couldn't start the log thread, ret = %d",
+				ret);
+			return ret;
+		}
+	}
+
 	dataplane_loop();
 	return 0;
 }
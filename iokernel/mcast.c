@@ -0,0 +1,142 @@
+/*
+ * mcast.c - IPv4 multicast group membership of runtimes
+ *
+ * Runtimes join and leave groups with TXCMD_MCAST_JOIN and TXCMD_MCAST_LEAVE.
+ * Ingress packets to a group are fanned out to its subscribers only, sharing
+ * one mbuf between them. All of this state is owned by the dataplane core.
+ */
+
+#include <errno.h>
+
+#include <base/log.h>
+#include <net/ip.h>
+
+#include "defs.h"
+
+static struct mcast_group mcast_groups[IOKERNEL_MAX_MCAST_GROUPS];
+static int nr_mcast_groups;
+
+static int mcast_find_sub(struct mcast_group *g, struct proc *p)
+{
+	int i;
+
+	for (i = 0; i < g->nr_subs; i++) {
+		if (g->subs[i] == p)
+			return i;
+	}
+
+	return -1;
+}
+
+/* removes subscriber @i, and the group itself once it has none left */
+static void mcast_remove_sub(struct mcast_group *g, int i)
+{
+	g->subs[i] = g->subs[--g->nr_subs];
+	if (g->nr_subs == 0)
+		*g = mcast_groups[--nr_mcast_groups];
+}
+
+/**
+ * mcast_lookup - finds the subscribers of a multicast group
+ * @addr: the group address (in native byte order)
+ *
+ * Groups are few, so a linear scan is fast enough. Returns the group, or NULL
+ * if no runtime has joined it.
+ */
+struct mcast_group *mcast_lookup(uint32_t addr)
+{
+	int i;
+
+	for (i = 0; i < nr_mcast_groups; i++) {
+		if (mcast_groups[i].addr == addr)
+			return &mcast_groups[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * mcast_join - subscribes a runtime to a multicast group
+ * @p: the runtime
+ * @addr: the group address (in native byte order)
+ *
+ * Joining a group twice has no effect. Returns 0 if successful, -EINVAL if
+ * @addr isn't a multicast group, or -ENOSPC if the table is full.
+ */
+int mcast_join(struct proc *p, uint32_t addr)
+{
+	struct mcast_group *g;
+
+	if (!ip_addr_is_multicast(addr))
+		return -EINVAL;
+
+	g = mcast_lookup(addr);
+	if (!g) {
+		if (nr_mcast_groups >= IOKERNEL_MAX_MCAST_GROUPS)
+			return -ENOSPC;
+		g = &mcast_groups[nr_mcast_groups++];
+		g->addr = addr;
+		g->nr_subs = 0;
+	} else if (mcast_find_sub(g, p) >= 0) {
+		return 0;
+	}
+
+	if (g->nr_subs >= IOKERNEL_MAX_MCAST_SUBS)
+		return -ENOSPC;
+	g->subs[g->nr_subs++] = p;
+	return 0;
+}
+
+/**
+ * mcast_leave - unsubscribes a runtime from a multicast group
+ * @p: the runtime
+ * @addr: the group address (in native byte order)
+ */
+void mcast_leave(struct proc *p, uint32_t addr)
+{
+	struct mcast_group *g = mcast_lookup(addr);
+	int i;
+
+	if (!g)
+		return;
+	i = mcast_find_sub(g, p);
+	if (i >= 0)
+		mcast_remove_sub(g, i);
+}
+
+/**
+ * mcast_proc_groups - lists the groups a runtime has joined
+ * @p: the runtime
+ * @addrs: an array to store the group addresses in
+ * @n: the size of @addrs
+ *
+ * Also safe from the control thread once a handover has stopped the dataplane.
+ * Returns the number of groups stored.
+ */
+int mcast_proc_groups(struct proc *p, uint32_t *addrs, int n)
+{
+	int i, nr = 0;
+
+	for (i = 0; i < nr_mcast_groups && nr < n; i++) {
+		if (mcast_find_sub(&mcast_groups[i], p) >= 0)
+			addrs[nr++] = mcast_groups[i].addr;
+	}
+
+	return nr;
+}
+
+/**
+ * mcast_remove_proc - drops every group membership of a runtime
+ * @p: the runtime, which is being torn down
+ */
+void mcast_remove_proc(struct proc *p)
+{
+	int i, j;
+
+	/* removals move the last group into the current slot, so go backwards */
+	for (i = nr_mcast_groups - 1; i >= 0; i--) {
+		j = mcast_find_sub(&mcast_groups[i], p);
+		if (j >= 0)
+			mcast_remove_sub(&mcast_groups[i], j);
+	}
+}
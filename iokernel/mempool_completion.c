@@ -1,77 +1,57 @@
 /*
- * mempool_completion.c - a single producer, single consumer mempool that sends
- * completion events when tx buffers can be freed. Based on rte_mempool_stack.c.
+ * mempool_completion.c - a multi-producer, multi-consumer mempool that sends
+ * completion events when tx buffers can be freed. Backed by a lock-free ring so
+ * that mbufs may be freed from any lcore.
  */
 
 #include <rte_mempool.h>
 #include <rte_malloc.h>
 
 #include <base/log.h>
+#include <base/mempool.h>
 
 #include "defs.h"
 
-struct completion_stack {
-	uint32_t size;
-	uint32_t len;
-	void *objs[];
-};
-
 static int completion_enqueue(struct rte_mempool *mp, void * const *obj_table,
 		unsigned n)
 {
-	unsigned long i;
-	struct completion_stack *s = mp->pool_data;
+	struct mempool_ring *r = mp->pool_data;
 
-	if (unlikely(s->len + n > s->size))
+	if (unlikely(mempool_ring_count(r) + n > mp->size))
 		return -ENOBUFS;
 
-	for (i = 0; i < n; i++)
-		// Give up on notifying the runtime if this returns false.
-		tx_send_completion(obj_table[i]);
+	tx_send_completions(obj_table, n);
 
-#pragma GCC ivdep
-	for (i = 0; i < n; i++)
-		s->objs[s->len + i] = obj_table[i];
-
-	s->len += n;
-	return 0;
+	/* can't overflow, the ring has room for every mbuf in the pool */
+	return mempool_ring_enqueue(r, obj_table, n);
 }
 
 static int completion_dequeue(struct rte_mempool *mp, void  ** obj_table, unsigned n)
 {
-	unsigned long i, j;
-	struct completion_stack *s = mp->pool_data;
-	if (unlikely(n > s->len))
-		return -ENOBUFS;
-
-	s->len -= n;
-#pragma GCC ivdep
-	for (i = 0, j = s->len; i < n; i++, j++)
-		obj_table[i] = s->objs[j];
+	struct mempool_ring *r = mp->pool_data;
 
-	return 0;
+	return mempool_ring_dequeue(r, obj_table, n);
 }
 
 static unsigned completion_get_count(const struct rte_mempool *mp)
 {
-	struct completion_stack *s = mp->pool_data;
-	return s->len;
+	struct mempool_ring *r = mp->pool_data;
+	return mempool_ring_count(r);
 }
 
 static int completion_alloc(struct rte_mempool *mp)
 {
-	struct completion_stack *s;
-	unsigned n = mp->size;
-	int size = sizeof(*s) + (n + 16) * sizeof(void *);
-	s = rte_zmalloc_socket(mp->name, size, RTE_CACHE_LINE_SIZE, mp->socket_id);
-	if (!s) {
-		log_err("Could not allocate stack");
+	struct mempool_ring *r;
+
+	r = rte_zmalloc_socket(mp->name, mempool_ring_bytes(mp->size),
+			       RTE_CACHE_LINE_SIZE, mp->socket_id);
+	if (!r) {
+		log_err("Could not allocate ring");
 		return -ENOMEM;
 	}
 
-	s->len = 0;
-	s->size = n;
-	mp->pool_data = s;
+	mempool_ring_init(r, mp->size);
+	mp->pool_data = r;
 	return 0;
 }
 
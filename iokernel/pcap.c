@@ -0,0 +1,443 @@
+/*
+ * pcap.c - a lossy ring of captured packets for debugging
+ *
+ * The dataplane core is the only writer, as in trace.c: capturing a packet
+ * copies its first pcap_snaplen bytes into the next slot and releases the head
+ * index, overwriting the oldest slot once the ring is full. The control
+ * thread copies the ring for scripts/ikpcap, which writes it out as pcapng,
+ * without stopping the writer.
+ *
+ * Packets can be narrowed down with a classic BPF program, as compiled by
+ * "tcpdump -ddd <expr>", and then sampled so that only one in every
+ * pcap_sample of the matching packets is kept.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/filter.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+
+#include "defs.h"
+
+BUILD_ASSERT(is_power_of_two(IKPCAP_RING_SIZE));
+
+/* true if packets are being captured */
+bool pcap_enabled;
+/* the most bytes kept of each packet */
+unsigned int pcap_snaplen = IKPCAP_MAX_SNAPLEN;
+/* keep one in every @pcap_sample packets that match the filter */
+unsigned int pcap_sample = 1;
+/* a file with the filter in "tcpdump -ddd" format, or NULL for no filter */
+const char *pcap_filter_path;
+
+static struct ikpcap_rec pcap_ring[IKPCAP_RING_SIZE];
+static uint64_t pcap_head __aligned(CACHE_LINE_SIZE);
+static unsigned int pcap_skipped;
+
+static struct sock_filter *pcap_filter;
+static unsigned int pcap_filter_len;
+
+/* loads @size bytes of @pkt at @off, in network byte order */
+static inline uint32_t pcap_load(const uint8_t *pkt, uint32_t off,
+				 unsigned int size)
+{
+	uint32_t val = 0;
+
+	while (size--)
+		val = (val << 8) | pkt[off++];
+	return val;
+}
+
+/*
+ * Runs the filter on a packet. Returns how many of its bytes to keep, 0 to
+ * drop it. pcap_filter_load() checked that the program is safe to run.
+ */
+static uint32_t pcap_filter_run(const uint8_t *pkt, uint32_t len)
+{
+	const struct sock_filter *f = pcap_filter;
+	uint32_t a = 0, x = 0, mem[BPF_MEMWORDS] = { 0 }, src, off;
+	unsigned int pc, size;
+
+	for (pc = 0; pc < pcap_filter_len; pc++, f++) {
+		switch (BPF_CLASS(f->code)) {
+		case BPF_LD:
+			switch (BPF_MODE(f->code)) {
+			case BPF_IMM:
+				a = f->k;
+				break;
+			case BPF_LEN:
+				a = len;
+				break;
+			case BPF_MEM:
+				a = mem[f->k];
+				break;
+			default:
+				size = BPF_SIZE(f->code) == BPF_W ? 4 :
+				       BPF_SIZE(f->code) == BPF_H ? 2 : 1;
+				off = f->k;
+				if (BPF_MODE(f->code) == BPF_IND) {
+					off += x;
+					if (off < x)
+						return 0;
+				}
+				if (off > len || len - off < size)
+					return 0;
+				a = pcap_load(pkt, off, size);
+			}
+			break;
+
+		case BPF_LDX:
+			switch (BPF_MODE(f->code)) {
+			case BPF_IMM:
+				x = f->k;
+				break;
+			case BPF_LEN:
+				x = len;
+				break;
+			case BPF_MEM:
+				x = mem[f->k];
+				break;
+			default: /* BPF_MSH */
+				if (f->k >= len)
+					return 0;
+				x = (pkt[f->k] & 0xf) << 2;
+			}
+			break;
+
+		case BPF_ST:
+			mem[f->k] = a;
+			break;
+		case BPF_STX:
+			mem[f->k] = x;
+			break;
+
+		case BPF_ALU:
+			src = BPF_SRC(f->code) == BPF_X ? x : f->k;
+			switch (BPF_OP(f->code)) {
+			case BPF_ADD:
+				a += src;
+				break;
+			case BPF_SUB:
+				a -= src;
+				break;
+			case BPF_MUL:
+				a *= src;
+				break;
+			case BPF_DIV:
+				if (src == 0)
+					return 0;
+				a /= src;
+				break;
+			case BPF_MOD:
+				if (src == 0)
+					return 0;
+				a %= src;
+				break;
+			case BPF_OR:
+				a |= src;
+				break;
+			case BPF_AND:
+				a &= src;
+				break;
+			case BPF_XOR:
+				a ^= src;
+				break;
+			case BPF_LSH:
+				a = src < 32 ? a << src : 0;
+				break;
+			case BPF_RSH:
+				a = src < 32 ? a >> src : 0;
+				break;
+			default: /* BPF_NEG */
+				a = -a;
+			}
+			break;
+
+		case BPF_JMP:
+			src = BPF_SRC(f->code) == BPF_X ? x : f->k;
+			switch (BPF_OP(f->code)) {
+			case BPF_JA:
+				pc += f->k;
+				f += f->k;
+				continue;
+			case BPF_JEQ:
+				off = a == src;
+				break;
+			case BPF_JGT:
+				off = a > src;
+				break;
+			case BPF_JGE:
+				off = a >= src;
+				break;
+			default: /* BPF_JSET */
+				off = (a & src) != 0;
+			}
+			pc += off ? f->jt : f->jf;
+			f += off ? f->jt : f->jf;
+			break;
+
+		case BPF_RET:
+			return BPF_RVAL(f->code) == BPF_A ? a : f->k;
+
+		default: /* BPF_MISC */
+			if (BPF_MISCOP(f->code) == BPF_TAX)
+				x = a;
+			else
+				a = x;
+		}
+	}
+
+	/* not reached, programs end with a return */
+	return 0;
+}
+
+/* checks that an instruction is one pcap_filter_run() handles safely */
+static bool pcap_insn_valid(const struct sock_filter *f, unsigned int pc,
+			    unsigned int len)
+{
+	unsigned int left = len - pc - 1;
+
+	switch (BPF_CLASS(f->code)) {
+	case BPF_LD:
+	case BPF_LDX:
+		if (BPF_MODE(f->code) == BPF_MEM)
+			return f->k < BPF_MEMWORDS;
+		if (BPF_CLASS(f->code) == BPF_LDX)
+			return BPF_MODE(f->code) == BPF_IMM ||
+			       BPF_MODE(f->code) == BPF_LEN ||
+			       (BPF_MODE(f->code) == BPF_MSH &&
+				BPF_SIZE(f->code) == BPF_B);
+		if (BPF_MODE(f->code) == BPF_IMM || BPF_MODE(f->code) == BPF_LEN)
+			return true;
+		return (BPF_MODE(f->code) == BPF_ABS ||
+			BPF_MODE(f->code) == BPF_IND) &&
+		       BPF_SIZE(f->code) != 0x18;
+	case BPF_ST:
+	case BPF_STX:
+		return f->k < BPF_MEMWORDS;
+	case BPF_ALU:
+		switch (BPF_OP(f->code)) {
+		case BPF_DIV:
+		case BPF_MOD:
+			return BPF_SRC(f->code) == BPF_X || f->k != 0;
+		case BPF_ADD: case BPF_SUB: case BPF_MUL: case BPF_OR:
+		case BPF_AND: case BPF_XOR: case BPF_LSH: case BPF_RSH:
+		case BPF_NEG:
+			return true;
+		}
+		return false;
+	case BPF_JMP:
+		if (BPF_OP(f->code) == BPF_JA)
+			return f->k < left;
+		switch (BPF_OP(f->code)) {
+		case BPF_JEQ: case BPF_JGT: case BPF_JGE: case BPF_JSET:
+			return f->jt < left && f->jf < left;
+		}
+		return false;
+	case BPF_RET:
+		return BPF_RVAL(f->code) == BPF_K || BPF_RVAL(f->code) == BPF_A;
+	case BPF_MISC:
+		return BPF_MISCOP(f->code) == BPF_TAX ||
+		       BPF_MISCOP(f->code) == BPF_TXA;
+	}
+
+	return false;
+}
+
+/* loads and checks the filter in @path, written by "tcpdump -ddd" */
+static int pcap_filter_load(const char *path)
+{
+	struct sock_filter *f;
+	unsigned int i, nr, code, jt, jf, k;
+	FILE *file;
+	int ret = -EINVAL;
+
+	file = fopen(path, "r");
+	if (!file) {
+		log_err("pcap: can't open filter %s [%s]", path,
+			strerror(errno));
+		return -errno;
+	}
+
+	if (fscanf(file, "%u", &nr) != 1 || nr == 0 ||
+	    nr > IKPCAP_MAX_INSNS) {
+		log_err("pcap: %s doesn't start with an instruction count",
+			path);
+		goto out;
+	}
+
+	f = calloc(nr, sizeof(*f));
+	if (!f) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (fscanf(file, "%u %u %u %u", &code, &jt, &jf, &k) != 4 ||
+		    code > UINT16_MAX || jt > UINT8_MAX || jf > UINT8_MAX) {
+			log_err("pcap: bad instruction %u in %s", i, path);
+			goto fail;
+		}
+
+		f[i].code = code;
+		f[i].jt = jt;
+		f[i].jf = jf;
+		f[i].k = k;
+		if (!pcap_insn_valid(&f[i], i, nr)) {
+			log_err("pcap: unsupported instruction %u in %s",
+				i, path);
+			goto fail;
+		}
+	}
+
+	if (BPF_CLASS(f[nr - 1].code) != BPF_RET) {
+		log_err("pcap: %s doesn't end with a return", path);
+		goto fail;
+	}
+
+	pcap_filter = f;
+	pcap_filter_len = nr;
+	ret = 0;
+	goto out;
+
+fail:
+	free(f);
+out:
+	fclose(file);
+	return ret;
+}
+
+/**
+ * __pcap_capture - captures a packet, if it passes the filter and sampling
+ * @data: the packet, starting with its Ethernet header
+ * @len: the length of the packet
+ * @dir: IKPCAP_DIR_RX or IKPCAP_DIR_TX
+ *
+ * Must only be called from the dataplane core, the ring's sole writer.
+ */
+void __pcap_capture(const void *data, uint32_t len, int dir)
+{
+	uint64_t head = pcap_head;
+	struct ikpcap_rec *r;
+	uint32_t cap_len = min(len, pcap_snaplen);
+
+	if (pcap_filter) {
+		cap_len = min(cap_len, pcap_filter_run(data, len));
+		if (!cap_len)
+			return;
+	}
+
+	if (pcap_sample > 1) {
+		if (++pcap_skipped < pcap_sample)
+			return;
+		pcap_skipped = 0;
+	}
+
+	r = &pcap_ring[head & (IKPCAP_RING_SIZE - 1)];
+	r->tsc = rdtsc();
+	r->wire_len = len;
+	r->cap_len = cap_len;
+	r->dir = dir;
+	r->pad = 0;
+	memcpy(r->data, data, cap_len);
+	store_release(&pcap_head, head + 1);
+	STAT_INC(PCAP_CAPTURED, 1);
+}
+
+static int pcap_write(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, pos, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * pcap_dump - writes a snapshot of the capture ring to a file descriptor
+ * @fd: the file descriptor to write to
+ *
+ * Safe to call from any thread. Returns 0 if successful, otherwise < 0.
+ */
+int pcap_dump(int fd)
+{
+	struct ikpcap_rec *recs;
+	struct ikpcap_hdr hdr;
+	struct timespec ts;
+	uint64_t first, last, start, i;
+	int ret;
+
+	recs = malloc(sizeof(pcap_ring));
+	if (!recs)
+		return -ENOMEM;
+
+	/* copy the slots that were written before @last */
+	last = load_acquire(&pcap_head);
+	first = last > IKPCAP_RING_SIZE ? last - IKPCAP_RING_SIZE : 0;
+	for (i = first; i < last; i++)
+		recs[i - first] = pcap_ring[i & (IKPCAP_RING_SIZE - 1)];
+
+	/* discard the slots the writer may have lapped (as in trace.c) */
+	mb();
+	start = load_acquire(&pcap_head);
+	start = start >= IKPCAP_RING_SIZE ? start - IKPCAP_RING_SIZE + 1 : 0;
+	start = max(start, first);
+	if (start > last)
+		start = last;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	hdr.magic = IKPCAP_MAGIC;
+	hdr.cycles_per_us = cycles_per_us;
+	hdr.now_tsc = rdtsc();
+	hdr.now_ns = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	hdr.snaplen = pcap_snaplen;
+	hdr.nr_records = last - start;
+	hdr.nr_lost = start;
+
+	ret = pcap_write(fd, &hdr, sizeof(hdr));
+	if (!ret)
+		ret = pcap_write(fd, &recs[start - first],
+				 sizeof(*recs) * (last - start));
+
+	free(recs);
+	return ret;
+}
+
+/*
+ * Loads the capture filter, if any. Does nothing unless pcap_enabled is set.
+ */
+int pcap_init(void)
+{
+	int ret;
+
+	if (!pcap_enabled)
+		return 0;
+
+	if (pcap_filter_path) {
+		ret = pcap_filter_load(pcap_filter_path);
+		if (ret)
+			return ret;
+	}
+
+	log_info("pcap: capturing %u bytes of 1 in %u packets%s%s",
+		 pcap_snaplen, pcap_sample, pcap_filter_path ? " matching " : "",
+		 pcap_filter_path ? pcap_filter_path : "");
+	return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * power.c - puts cores that have been idle for a long time in deep C-states
+ *
+ * Idle cores are limited to shallow C-states through their per-cpu PM QoS
+ * resume latency, so a core that is granted soon after it's released wakes up
+ * quickly. Once a core has been idle for POWER_DEEP_IDLE_US, the limit is
+ * lifted so Linux may put it in a deep C-state. pick_core_for_proc() uses the
+ * resulting wakeup latency estimates to prefer shallow cores.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/sysfs.h>
+#include <base/thread.h>
+#include <base/time.h>
+
+#include "defs.h"
+
+#define SYSFS_CPU_QOS_PATH \
+	"/sys/devices/system/cpu/cpu%d/power/pm_qos_resume_latency_us"
+#define SYSFS_CPU_IDLE_LATENCY_PATH \
+	"/sys/devices/system/cpu/cpu%d/cpuidle/state%d/latency"
+#define POWER_MAX_IDLE_STATES	16
+
+/* how often idle cores are checked */
+#define POWER_POLL_INTERVAL_US	1000
+/* how long a core must be idle before it may enter a deep C-state */
+#define POWER_DEEP_IDLE_US	(20 * 1000)
+
+/* true if the iokernel manages C-states of idle cores */
+bool power_enabled;
+/* the estimated time to wake each core, or 0 if it's shallow */
+unsigned int power_wake_latency_us[NCPU];
+/* the idle cores that may be in a deep C-state */
+DEFINE_BITMAP(power_deep_cores, NCPU);
+
+struct power_core {
+	int		qos_fd;
+	bool		deep;
+	uint64_t	idle_since_us;
+	unsigned int	deep_latency_us;
+};
+
+static struct power_core power_cores[NCPU];
+
+static int power_set_qos(struct power_core *c, unsigned int latency_us)
+{
+	char buf[16];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%u", latency_us);
+	if (pwrite(c->qos_fd, buf, len, 0) != len)
+		return -errno;
+	return 0;
+}
+
+/* finds the exit latency of the deepest C-state a core supports */
+static unsigned int power_deep_latency(int cpu)
+{
+	char path[PATH_MAX];
+	uint64_t val, max_val = 0;
+	int i;
+
+	for (i = 0; i < POWER_MAX_IDLE_STATES; i++) {
+		snprintf(path, sizeof(path), SYSFS_CPU_IDLE_LATENCY_PATH, cpu, i);
+		if (sysfs_parse_val(path, &val))
+			break;
+		max_val = max(max_val, val);
+	}
+
+	return max_val;
+}
+
+static void power_poll(uint64_t now)
+{
+	struct power_core *c;
+	int i;
+
+	for (i = 0; i < cpu_count; i++) {
+		c = &power_cores[i];
+		if (c->qos_fd < 0)
+			continue;
+
+		if (!cores_is_idle(i)) {
+			c->idle_since_us = 0;
+			if (!c->deep)
+				continue;
+
+			/* the core was granted, keep it shallow from now on */
+			if (power_set_qos(c, POWER_SHALLOW_LATENCY_US) == 0) {
+				c->deep = false;
+				ACCESS_ONCE(power_wake_latency_us[i]) = 0;
+				bitmap_atomic_clear(power_deep_cores, i);
+			}
+			continue;
+		}
+
+		if (!c->idle_since_us) {
+			c->idle_since_us = now;
+			continue;
+		}
+
+		if (c->deep || now - c->idle_since_us < POWER_DEEP_IDLE_US)
+			continue;
+
+		/* 0 removes the limit, letting cpuidle pick any C-state */
+		if (power_set_qos(c, 0) == 0) {
+			c->deep = true;
+			ACCESS_ONCE(power_wake_latency_us[i]) =
+				c->deep_latency_us;
+			if (c->deep_latency_us > POWER_SHALLOW_LATENCY_US)
+				bitmap_atomic_set(power_deep_cores, i);
+			STAT_INC(POWER_DEEP_IDLES, 1);
+		}
+	}
+}
+
+static void *power_thread(void *data)
+{
+	int ret;
+
+	/* share the control thread's core */
+	ret = cores_pin_thread(gettid(), core_assign.ctrl_core);
+	if (ret < 0) {
+		log_err("power: failed to pin power thread to core %d",
+			core_assign.ctrl_core);
+		/* continue running but performance is unpredictable */
+	}
+
+	while (true) {
+		power_poll(microtime());
+		usleep(POWER_POLL_INTERVAL_US);
+	}
+
+	return NULL;
+}
+
+/*
+ * Limits all runtime cores to shallow C-states and starts the power thread.
+ * Does nothing unless power_enabled is set.
+ */
+int power_init(void)
+{
+	char path[PATH_MAX];
+	struct power_core *c;
+	pthread_t tid;
+	int i, nr = 0;
+
+	for (i = 0; i < NCPU; i++)
+		power_cores[i].qos_fd = -1;
+
+	if (!power_enabled)
+		return 0;
+
+	for (i = 0; i < cpu_count; i++) {
+		if (!cores_is_online(i))
+			continue;
+
+		c = &power_cores[i];
+		snprintf(path, sizeof(path), SYSFS_CPU_QOS_PATH, i);
+		c->qos_fd = open(path, O_WRONLY);
+		if (c->qos_fd < 0) {
+			log_warn("power: can't open %s [%s]", path,
+				 strerror(errno));
+			continue;
+		}
+
+		c->deep_latency_us = power_deep_latency(i);
+		if (power_set_qos(c, POWER_SHALLOW_LATENCY_US)) {
+			log_warn("power: can't limit the C-states of core %d",
+				 i);
+			close(c->qos_fd);
+			c->qos_fd = -1;
+			continue;
+		}
+		nr++;
+	}
+
+	if (nr == 0) {
+		log_warn("power: no cores support PM QoS, disabling");
+		power_enabled = false;
+		return 0;
+	}
+
+	if (pthread_create(&tid, NULL, power_thread, NULL)) {
+		log_err("power: pthread_create() failed");
+		return -1;
+	}
+
+	log_info("power: managing C-states of %d cores", nr);
+	return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * prereg.c - a pool of pre-registered shm regions for fast runtime startup
+ *
+ * Creating a runtime's egress region, faulting it in, and looking up its
+ * physical addresses dominates registration. With prereg=<n>, the iokernel does
+ * all of that at startup for <n> slots of prereg_mb=<MB> each. A runtime
+ * started with runtime_prereg reserves a free slot over the control socket,
+ * lays out its queues in it, and then registers as usual with the slot's key.
+ * Slots released by a proc are zeroed in the background before the next
+ * runtime may reserve them, so nothing leaks from one tenant to another.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <base/stddef.h>
+#include <base/atomic.h>
+#include <base/log.h>
+#include <base/mem.h>
+#include <base/time.h>
+#include <iokernel/control.h>
+
+#include "defs.h"
+
+enum {
+	PREREG_FREE = 0,	/* ready to be reserved */
+	PREREG_RESERVED,	/* handed to a runtime that hasn't attached yet */
+	PREREG_ATTACHED,	/* backing a proc */
+	PREREG_SCRUBBING,	/* being zeroed after its last user */
+};
+
+unsigned int prereg_nr;
+size_t prereg_len = PREREG_DEFAULT_MB * 1024 * 1024;
+static struct prereg_slot *slots;
+
+static void *prereg_scrub_thread(void *arg)
+{
+	struct prereg_slot *s = arg;
+
+	memset(s->base, 0, s->len);
+	store_release(&s->state, PREREG_FREE);
+	return NULL;
+}
+
+/* zeroes @s off the control thread, then makes it free again */
+static void prereg_scrub(struct prereg_slot *s)
+{
+	pthread_t tid;
+
+	s->state = PREREG_SCRUBBING;
+	if (pthread_create(&tid, NULL, prereg_scrub_thread, s)) {
+		log_warn("prereg: couldn't spawn a scrubber, zeroing inline");
+		prereg_scrub_thread(s);
+		return;
+	}
+	pthread_detach(tid);
+}
+
+/**
+ * prereg_reserve - reserves a free slot for a runtime
+ * @pid: the runtime's pid
+ * @len: the length of shm it needs
+ *
+ * Returns the slot's shm key, or 0 if no free slot is large enough.
+ */
+mem_key_t prereg_reserve(pid_t pid, size_t len)
+{
+	struct prereg_slot *s;
+	unsigned int i;
+
+	for (i = 0; i < prereg_nr; i++) {
+		s = &slots[i];
+
+		/* reclaim slots whose runtime died before attaching */
+		if (s->state == PREREG_RESERVED && kill(s->pid, 0) &&
+		    errno == ESRCH) {
+			log_info("prereg: pid %d never attached to slot %u",
+				 s->pid, i);
+			prereg_scrub(s);
+			continue;
+		}
+
+		if (load_acquire(&s->state) != PREREG_FREE || s->len < len)
+			continue;
+
+		s->state = PREREG_RESERVED;
+		s->pid = pid;
+		return s->key;
+	}
+
+	log_warn("prereg: no free slot of %ld MB for pid %d",
+		 len / (1024 * 1024), pid);
+	return 0;
+}
+
+/**
+ * prereg_is_key - determines if a shm key belongs to a pre-registered slot
+ * @key: the shm key
+ */
+bool prereg_is_key(mem_key_t key)
+{
+	return key >= CONTROL_PREREG_KEY_BASE &&
+	       key - CONTROL_PREREG_KEY_BASE < prereg_nr;
+}
+
+/**
+ * prereg_claim - attaches a proc to the slot its runtime reserved
+ * @key: the slot's shm key (see prereg_is_key())
+ * @pid: the runtime's pid
+ * @len: the length of shm the runtime uses
+ *
+ * Returns the slot, or NULL if @pid hasn't reserved it.
+ */
+struct prereg_slot *prereg_claim(mem_key_t key, pid_t pid, size_t len)
+{
+	struct prereg_slot *s = &slots[key - CONTROL_PREREG_KEY_BASE];
+
+	if (s->state != PREREG_RESERVED || s->pid != pid || s->len < len) {
+		log_err("prereg: pid %d didn't reserve slot key %x", pid, key);
+		return NULL;
+	}
+
+	s->state = PREREG_ATTACHED;
+	return s;
+}
+
+/**
+ * prereg_release - returns a slot to the pool once its proc is gone
+ * @s: the slot
+ */
+void prereg_release(struct prereg_slot *s)
+{
+	prereg_scrub(s);
+}
+
+/**
+ * prereg_recycle - zeroes a slot and returns it to the pool
+ * @s: the slot, whose proc is gone
+ *
+ * Unlike prereg_release(), zeroes @s in the calling thread, so it must not be
+ * called on the control thread.
+ */
+void prereg_recycle(struct prereg_slot *s)
+{
+	store_release(&s->state, PREREG_SCRUBBING);
+	prereg_scrub_thread(s);
+}
+
+int prereg_init(void)
+{
+	struct prereg_slot *s;
+	unsigned int i;
+	size_t pgsize;
+	uint64_t start_us = microtime();
+	int shmid, ret;
+
+	if (!prereg_nr)
+		return 0;
+
+	slots = calloc(prereg_nr, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < prereg_nr; i++) {
+		s = &slots[i];
+		s->key = CONTROL_PREREG_KEY_BASE + i;
+		s->len = prereg_len;
+
+		/* a previous iokernel's segment can't be told apart from ours */
+		shmid = shmget(s->key, 0, 0);
+		if (shmid != -1)
+			shmctl(shmid, IPC_RMID, NULL);
+
+		s->base = mem_map_shm_fallback(s->key, NULL, s->len,
+					       PGSIZE_1GB, PGSIZE_2MB, true,
+					       &pgsize);
+		if (s->base == MAP_FAILED) {
+			log_err("prereg: couldn't map slot %u", i);
+			return -ENOMEM;
+		}
+
+		s->paddrs = malloc(div_up(s->len, PGSIZE_2MB) *
+				   sizeof(*s->paddrs));
+		if (!s->paddrs)
+			return -ENOMEM;
+		ret = control_lookup_paddrs(s->base, s->len, s->paddrs);
+		if (ret) {
+			log_err("prereg: couldn't look up slot %u's physical "
+				"addresses", i);
+			return ret;
+		}
+	}
+
+	log_info("prereg: %u slots of %ld MB with %ld KB pages ready in %ld us",
+		 prereg_nr, prereg_len / (1024 * 1024), pgsize / 1024,
+		 microtime() - start_us);
+	return 0;
+}
@@ -0,0 +1,347 @@
+/*
+ * rdt.c - partitions the LLC and memory bandwidth between priority classes
+ *
+ * With Intel RDT through Linux's resctrl filesystem, cores running batch
+ * procs are placed in a class of service that may only fill RDT_BATCH_WAYS
+ * ways of the LLC and use rdt_batch_mb percent of memory bandwidth, while
+ * cores running system and normal procs get the remaining ways and all of
+ * the bandwidth. Runtime kthreads stay in the default resctrl group, so the
+ * class of the core they run on applies.
+ *
+ * core_reserve() records the class a core should be in whenever it's granted.
+ * Moving a core between groups takes a write to resctrl, which interrupts the
+ * core, so the writes are made by a thread on the control core that polls
+ * for changes, rather than by the dataplane.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <base/stddef.h>
+#include <base/bitmap.h>
+#include <base/cpu.h>
+#include <base/log.h>
+#include <base/sysfs.h>
+#include <base/thread.h>
+
+#include "defs.h"
+
+#define RESCTRL_PATH		"/sys/fs/resctrl"
+#define RDT_GROUP_PREFIX	"shenango-"
+/* the most cache or memory controller domains in a schemata line */
+#define RDT_MAX_DOMAINS		(NNUMA * 4)
+
+/* how often core class changes are written to resctrl */
+#define RDT_POLL_INTERVAL_US	100
+
+/* true if the iokernel partitions the LLC and memory bandwidth */
+bool rdt_enabled;
+/* LLC ways batch cores may fill */
+unsigned int rdt_batch_ways = RDT_BATCH_WAYS;
+/* percent of memory bandwidth batch cores may use */
+unsigned int rdt_batch_mb = RDT_BATCH_MB;
+/* the class each core should be in, set when the core is granted */
+uint8_t rdt_core_class[NCPU];
+
+struct rdt_group {
+	const char	*name;
+	char		path[PATH_MAX];
+	DEFINE_BITMAP(cores, NCPU);
+	bool		created;
+};
+
+static struct rdt_group rdt_groups[RDT_CLASS_NR] = {
+	[RDT_CLASS_NONE]	= { .name = NULL },
+	[RDT_CLASS_LC]		= { .name = RDT_GROUP_PREFIX "lc" },
+	[RDT_CLASS_BATCH]	= { .name = RDT_GROUP_PREFIX "batch" },
+};
+
+/* the class each core is in, as last written to resctrl */
+static uint8_t rdt_applied_class[NCPU];
+
+static int rdt_write(const char *path, const char *buf)
+{
+	ssize_t len = strlen(buf), ret;
+	int fd;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	ret = write(fd, buf, len);
+	close(fd);
+	if (ret != len)
+		return ret < 0 ? -errno : -EIO;
+	return 0;
+}
+
+/* writes the cores of @g to its cpus_list, moving them out of other groups */
+static int rdt_write_cores(struct rdt_group *g)
+{
+	char path[PATH_MAX + 16], buf[NCPU * 4 + 2], *pos = buf;
+	int i;
+
+	buf[0] = '\0';
+	bitmap_for_each_set(g->cores, NCPU, i)
+		pos += sprintf(pos, "%s%d", pos == buf ? "" : ",", i);
+	strcpy(pos, "\n");
+
+	snprintf(path, sizeof(path), "%s/cpus_list", g->path);
+	return rdt_write(path, buf);
+}
+
+/*
+ * Finds the domain ids of a resource in the default group's schemata, which
+ * has lines such as "L3:0=7ff;1=7ff". Returns how many were found.
+ */
+static int rdt_parse_domains(const char *resource, int *ids)
+{
+	char line[256], *pos;
+	size_t len = strlen(resource);
+	int nr = 0;
+	FILE *f;
+
+	f = fopen(RESCTRL_PATH "/schemata", "r");
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		pos = line;
+		while (*pos == ' ')
+			pos++;
+		if (strncmp(pos, resource, len) != 0 || pos[len] != ':')
+			continue;
+
+		pos += len + 1;
+		while (nr < RDT_MAX_DOMAINS && *pos) {
+			ids[nr++] = strtol(pos, &pos, 10);
+			pos = strchr(pos, ';');
+			if (!pos)
+				break;
+			pos++;
+		}
+		break;
+	}
+
+	fclose(f);
+	return nr;
+}
+
+/* writes a schemata line giving @val to every domain of @resource */
+static int rdt_write_schemata(struct rdt_group *g, const char *resource,
+			      const char *fmt, unsigned long val)
+{
+	char path[PATH_MAX + 16], buf[RDT_MAX_DOMAINS * 24 + 16], *pos = buf;
+	int ids[RDT_MAX_DOMAINS], i, nr;
+
+	nr = rdt_parse_domains(resource, ids);
+	if (nr == 0)
+		return -ENOENT;
+
+	pos += sprintf(pos, "%s:", resource);
+	for (i = 0; i < nr; i++) {
+		pos += sprintf(pos, "%s%d=", i ? ";" : "", ids[i]);
+		pos += sprintf(pos, fmt, val);
+	}
+	strcpy(pos, "\n");
+
+	snprintf(path, sizeof(path), "%s/schemata", g->path);
+	return rdt_write(path, buf);
+}
+
+static int rdt_create_group(struct rdt_group *g)
+{
+	snprintf(g->path, sizeof(g->path), RESCTRL_PATH "/%s", g->name);
+	if (mkdir(g->path, 0755) && errno != EEXIST) {
+		log_err("rdt: can't create %s [%s]", g->path, strerror(errno));
+		return -errno;
+	}
+
+	g->created = true;
+	return 0;
+}
+
+/* computes the LLC way masks of each class, returns 0 if CAT is usable */
+static int rdt_cat_masks(unsigned long *lc_mask, unsigned long *batch_mask)
+{
+	char buf[32];
+	uint64_t min_bits;
+	unsigned long full;
+	unsigned int ways;
+
+	if (sysfs_parse_str(RESCTRL_PATH "/info/L3/cbm_mask", buf, sizeof(buf)))
+		return -ENOTSUP;
+	full = strtoul(buf, NULL, 16);
+	ways = __builtin_popcountl(full);
+	if (sysfs_parse_val(RESCTRL_PATH "/info/L3/min_cbm_bits", &min_bits))
+		min_bits = 1;
+
+	if (rdt_batch_ways < min_bits || ways - rdt_batch_ways < min_bits) {
+		log_err("rdt: batch ways must leave at least %lu of %u ways "
+			"to each class", min_bits, ways);
+		return -EINVAL;
+	}
+
+	/* give batch the low ways, and everyone else the rest */
+	*batch_mask = (1UL << rdt_batch_ways) - 1;
+	*batch_mask <<= __builtin_ctzl(full);
+	*lc_mask = full & ~*batch_mask;
+	return 0;
+}
+
+/* rounds the batch bandwidth to what MBA supports, returns 0 if usable */
+static int rdt_mba_percent(unsigned long *pct)
+{
+	uint64_t min_bw, gran;
+
+	if (sysfs_parse_val(RESCTRL_PATH "/info/MB/min_bandwidth", &min_bw) ||
+	    sysfs_parse_val(RESCTRL_PATH "/info/MB/bandwidth_gran", &gran))
+		return -ENOTSUP;
+
+	gran = max(gran, 1UL);
+	*pct = max(rdt_batch_mb / gran * gran, min_bw);
+	return 0;
+}
+
+static void rdt_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < RDT_CLASS_NR; i++) {
+		/* removing a group returns its cores to the default group */
+		if (rdt_groups[i].created)
+			rmdir(rdt_groups[i].path);
+	}
+}
+
+static void rdt_poll(void)
+{
+	bool dirty[RDT_CLASS_NR] = { false };
+	uint8_t cls, old;
+	int i, ret;
+
+	for (i = 0; i < cpu_count; i++) {
+		cls = ACCESS_ONCE(rdt_core_class[i]);
+		old = rdt_applied_class[i];
+		if (cls == old)
+			continue;
+
+		bitmap_clear(rdt_groups[old].cores, i);
+		bitmap_set(rdt_groups[cls].cores, i);
+		dirty[cls] = true;
+		rdt_applied_class[i] = cls;
+		STAT_INC(RDT_CLASS_CHANGES, 1);
+	}
+
+	/* a core joining one group leaves the other, so only write joins */
+	for (i = 0; i < RDT_CLASS_NR; i++) {
+		if (!dirty[i] || !rdt_groups[i].created)
+			continue;
+		ret = rdt_write_cores(&rdt_groups[i]);
+		if (ret)
+			log_warn_ratelimited("rdt: can't move cores to %s [%s]",
+					     rdt_groups[i].name, strerror(-ret));
+	}
+}
+
+static void *rdt_thread(void *data)
+{
+	int ret;
+
+	/* share the control thread's core */
+	ret = cores_pin_thread(gettid(), core_assign.ctrl_core);
+	if (ret < 0) {
+		log_err("rdt: failed to pin rdt thread to core %d",
+			core_assign.ctrl_core);
+		/* continue running but performance is unpredictable */
+	}
+
+	while (true) {
+		rdt_poll();
+		usleep(RDT_POLL_INTERVAL_US);
+	}
+
+	return NULL;
+}
+
+/*
+ * Creates a resctrl group for each class and starts the rdt thread. Does
+ * nothing unless rdt_enabled is set.
+ */
+int rdt_init(void)
+{
+	struct rdt_group *lc = &rdt_groups[RDT_CLASS_LC];
+	struct rdt_group *batch = &rdt_groups[RDT_CLASS_BATCH];
+	unsigned long lc_mask, batch_mask, pct;
+	bool cat, mba;
+	pthread_t tid;
+	int ret;
+
+	if (!rdt_enabled)
+		return 0;
+
+	if (access(RESCTRL_PATH "/info", F_OK)) {
+		log_warn("rdt: resctrl isn't mounted at %s, disabling",
+			 RESCTRL_PATH);
+		rdt_enabled = false;
+		return 0;
+	}
+
+	ret = rdt_cat_masks(&lc_mask, &batch_mask);
+	if (ret == -EINVAL)
+		return ret;
+	cat = ret == 0;
+	mba = rdt_mba_percent(&pct) == 0;
+	if (!cat && !mba) {
+		log_warn("rdt: neither L3 CAT nor MBA is supported, disabling");
+		rdt_enabled = false;
+		return 0;
+	}
+
+	atexit(rdt_cleanup);
+	ret = rdt_create_group(lc);
+	if (!ret)
+		ret = rdt_create_group(batch);
+	if (ret)
+		return ret;
+
+	if (cat) {
+		ret = rdt_write_schemata(lc, "L3", "%lx", lc_mask);
+		if (!ret)
+			ret = rdt_write_schemata(batch, "L3", "%lx", batch_mask);
+		if (ret) {
+			log_err("rdt: can't set the L3 masks [%s]",
+				strerror(-ret));
+			return ret;
+		}
+	}
+
+	if (mba) {
+		ret = rdt_write_schemata(lc, "MB", "%lu", 100);
+		if (!ret)
+			ret = rdt_write_schemata(batch, "MB", "%lu", pct);
+		if (ret) {
+			log_err("rdt: can't set the bandwidth limits [%s]",
+				strerror(-ret));
+			return ret;
+		}
+	}
+
+	if (pthread_create(&tid, NULL, rdt_thread, NULL)) {
+		log_err("rdt: pthread_create() failed");
+		return -1;
+	}
+
+	if (cat)
+		log_info("rdt: L3 ways %lx for batch, %lx for others",
+			 batch_mask, lc_mask);
+	if (mba)
+		log_info("rdt: %lu%% of memory bandwidth for batch", pct);
+	return 0;
+}
@@ -2,12 +2,20 @@
  * rx.c - the receive path for the I/O kernel (network -> runtimes)
  */
 
+#include <stddef.h>
+#include <string.h>
+#include <tmmintrin.h>
+
 #include <rte_ethdev.h>
 #include <rte_ether.h>
 #include <rte_hash.h>
+#include <rte_ip.h>
+#include <rte_launch.h>
 #include <rte_mbuf.h>
 #include <rte_mempool.h>
+#include <rte_ring.h>
 
+#include <base/hash.h>
 #include <base/log.h>
 #include <iokernel/queue.h>
 #include <iokernel/shm.h>
@@ -16,32 +24,124 @@
 
 #define MBUF_CACHE_SIZE 250
 #define RX_PREFETCH_STRIDE 2
+#define RX_MAC_CACHE_SIZE 16 /* must be a power of two */
+#define RX_PREAMBLE_BATCH 4
 
 static struct shm_region ingress_mbuf_region;
+/* set to stop the RX worker cores */
+static bool rx_workers_stop;
+
+unsigned int rx_buf_quota = IOKERNEL_RX_QUOTA_DEFAULT;
+
+/* unicast packets waiting to be enqueued to runtimes together */
+struct rx_staged_pkt {
+	struct thread		*th;
+	struct lrpc_msg		msg;
+	struct rte_mbuf		*buf;
+	struct rx_net_hdr	*hdr;
+};
+
+static struct rx_staged_pkt rx_staged[IOKERNEL_RX_BURST_SIZE];
+static unsigned int nr_rx_staged;
+
+/*
+ * A direct-mapped cache of recent MAC lookups, indexed by the MAC's hash.
+ * With a few runtimes, nearly every packet hits and skips the hash table.
+ */
+struct rx_mac_cache_entry {
+	struct eth_addr		mac;
+	struct proc		*p;
+};
+
+static struct rx_mac_cache_entry rx_mac_cache[RX_MAC_CACHE_SIZE];
+
+BUILD_ASSERT(is_power_of_two(RX_MAC_CACHE_SIZE));
+BUILD_ASSERT(IOKERNEL_RX_BURST_SIZE <= RTE_HASH_LOOKUP_BULK_MAX);
+
+/**
+ * rx_mac_cache_flush - forgets all cached MAC lookups
+ *
+ * Must be called whenever a MAC is added to or removed from dp.mac_to_proc.
+ */
+void rx_mac_cache_flush(void)
+{
+	memset(rx_mac_cache, 0, sizeof(rx_mac_cache));
+}
 
 /*
- * Prepend rx_net_hdr preamble to ingress packets.
+ * The packet length and RSS hash are 8 bytes apart in the mbuf, and the
+ * preamble keeps them next to the checksum fields, so one 16-byte load,
+ * shuffle, and store fills in everything but @completion_data.
  */
-static struct rx_net_hdr *rx_prepend_rx_preamble(struct rte_mbuf *buf)
+BUILD_ASSERT(offsetof(struct rte_mbuf, pkt_len) ==
+	     offsetof(struct rte_mbuf, rx_descriptor_fields1) + 4);
+BUILD_ASSERT(offsetof(struct rte_mbuf, hash) ==
+	     offsetof(struct rte_mbuf, rx_descriptor_fields1) + 12);
+BUILD_ASSERT(offsetof(struct rx_net_hdr, rss_hash) ==
+	     offsetof(struct rx_net_hdr, len) + 4);
+BUILD_ASSERT(offsetof(struct rx_net_hdr, csum_type) ==
+	     offsetof(struct rx_net_hdr, len) + 8);
+BUILD_ASSERT(offsetof(struct rx_net_hdr, csum) ==
+	     offsetof(struct rx_net_hdr, len) + 12);
+
+static inline __m128i rx_load_desc_fields(struct rte_mbuf *buf)
+{
+	return _mm_loadu_si128((__m128i *)&buf->rx_descriptor_fields1);
+}
+
+static inline void rx_store_preamble(struct rte_mbuf *buf, __m128i fields,
+				     uint64_t tsc)
 {
+	/* pkt_len into @len, hash.rss into @rss_hash, and zero the rest */
+	const __m128i shuf = _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+					  15, 14, 13, 12, 7, 6, 5, 4);
 	struct rx_net_hdr *net_hdr;
-	uint64_t masked_ol_flags;
+	uint32_t csum_type;
+
+	/* the runtime verifies in software unless both L3 and L4 were good */
+	csum_type = (buf->ol_flags & (PKT_RX_IP_CKSUM_MASK |
+				      PKT_RX_L4_CKSUM_MASK)) ==
+		    (PKT_RX_IP_CKSUM_GOOD | PKT_RX_L4_CKSUM_GOOD) ?
+		    CHECKSUM_TYPE_UNNECESSARY : CHECKSUM_TYPE_NEEDED;
+	fields = _mm_or_si128(_mm_shuffle_epi8(fields, shuf),
+			      _mm_slli_si128(_mm_cvtsi32_si128(csum_type), 8));
 
 	net_hdr = (struct rx_net_hdr *) rte_pktmbuf_prepend(buf,
 			(uint16_t) sizeof(*net_hdr));
 	RTE_ASSERT(net_hdr != NULL);
 
 	net_hdr->completion_data = (unsigned long)buf;
-	net_hdr->len = rte_pktmbuf_pkt_len(buf) - sizeof(*net_hdr);
-	net_hdr->rss_hash = buf->hash.rss;
-	masked_ol_flags = buf->ol_flags & PKT_RX_IP_CKSUM_MASK;
-	if (masked_ol_flags == PKT_RX_IP_CKSUM_GOOD)
-		net_hdr->csum_type = CHECKSUM_TYPE_UNNECESSARY;
-	else
-		net_hdr->csum_type = CHECKSUM_TYPE_NEEDED;
-	net_hdr->csum = 0; /* unused for now */
+	_mm_storeu_si128((__m128i *)&net_hdr->len, fields);
+	net_hdr->rx_tsc = tsc;
+	net_hdr->nic_ts = (buf->ol_flags & PKT_RX_TIMESTAMP) ?
+			  buf->timestamp : 0;
+}
+
+/*
+ * Prepend rx_net_hdr preambles to a batch of ingress packets. The mbuf fields
+ * are loaded RX_PREAMBLE_BATCH packets at a time so their cache misses
+ * overlap. The whole batch shares one TSC timestamp.
+ */
+static void rx_prepend_rx_preambles(struct rte_mbuf **bufs, unsigned int n)
+{
+	__m128i fields[RX_PREAMBLE_BATCH];
+	unsigned int i, j;
+	uint64_t tsc;
 
-	return net_hdr;
+	if (n == 0)
+		return;
+
+	tsc = rdtsc();
+
+	for (i = 0; i + RX_PREAMBLE_BATCH <= n; i += RX_PREAMBLE_BATCH) {
+		for (j = 0; j < RX_PREAMBLE_BATCH; j++)
+			fields[j] = rx_load_desc_fields(bufs[i + j]);
+		for (j = 0; j < RX_PREAMBLE_BATCH; j++)
+			rx_store_preamble(bufs[i + j], fields[j], tsc);
+	}
+
+	for (; i < n; i++)
+		rx_store_preamble(bufs[i], rx_load_desc_fields(bufs[i]), tsc);
 }
 
 /**
@@ -54,45 +154,288 @@ static struct rx_net_hdr *rx_prepend_rx_preamble(struct rte_mbuf *buf)
  * Returns true if the command was enqueued, otherwise a thread is not running
  * and can't be woken or the queue was full.
  */
-bool rx_send_to_runtime(struct proc *p, uint32_t hash, uint64_t cmd,
-			unsigned long payload)
+/*
+ * Choose the thread that should receive a command, waking a core if needed.
+ * Returns NULL if no thread can be woken.
+ */
+static struct thread *rx_pick_thread(struct proc *p, uint32_t hash)
 {
 	struct thread *th;
 
 	if (likely(p->active_thread_count > 0)) {
 		/* load balance between active threads */
-		th = p->active_threads[hash % p->active_thread_count];
+		th = p->flow_tbl[hash % IOKERNEL_FLOW_BUCKETS];
+		/*
+		 * A parked thread keeps its flows until it's detached. If
+		 * nothing is queued to it, they can move now without reordering.
+		 */
+		if (unlikely(th->parked) && thread_rxq_drained(th)) {
+			cores_release_flows(th);
+			th = p->flow_tbl[hash % IOKERNEL_FLOW_BUCKETS];
+		}
 	} else if (p->sched_cfg.guaranteed_cores > 0 || get_nr_avail_cores() > 0) {
-		th = cores_add_core(p);
-		if (unlikely(!th))
-			return false;
+		th = cores_add_core(p, TRACE_GRANT_RX_WAKE);
 	} else {
 		/* enqueue to the first idle thread, which will be woken next */
 		th = list_top(&p->idle_threads, struct thread, idle_link);
 		proc_set_overloaded(p);
 	}
 
+	return th;
+}
+
+/**
+ * rx_send_to_runtime - enqueues a command to an RXQ for a runtime
+ * @p: the runtime's proc structure
+ * @hash: the 5-tuple hash for the flow the command is related to
+ * @cmd: the command to send
+ * @payload: the command payload to send
+ *
+ * Returns true if the command was enqueued, otherwise a thread is not running
+ * and can't be woken or the queue was full.
+ */
+bool rx_send_to_runtime(struct proc *p, uint32_t hash, uint64_t cmd,
+			unsigned long payload)
+{
+	struct thread *th;
+
+	th = rx_pick_thread(p, hash);
+	if (unlikely(!th))
+		return false;
+
 	return lrpc_send(&th->rxq, cmd, payload);
 }
 
 
+/*
+ * Charges an ingress mbuf to @p. Returns false if @p already holds its quota,
+ * in which case the packet must be dropped.
+ */
+static bool rx_charge(struct proc *p)
+{
+	if (unlikely(rx_buf_quota && p->rx_bufs >= rx_buf_quota)) {
+		STAT_INC(RX_QUOTA_DROP, 1);
+		p->stats.rx_drops++;
+#ifdef STATS
+		p->rx_quota_drops++;
+#endif
+		log_debug_ratelimited("rx: pid %d is holding its quota of %u "
+				      "ingress buffers", p->pid, rx_buf_quota);
+		return false;
+	}
+
+	p->rx_bufs++;
+#ifdef STATS
+	p->rx_bufs_peak = max(p->rx_bufs_peak, p->rx_bufs);
+#endif
+	return true;
+}
+
 static bool rx_send_pkt_to_runtime(struct proc *p, struct rx_net_hdr *hdr)
 {
 	shmptr_t shmptr;
 
+	if (!rx_charge(p))
+		return false;
+
 	shmptr = ptr_to_shmptr(&ingress_mbuf_region, hdr, sizeof(*hdr));
-	return rx_send_to_runtime(p, hdr->rss_hash, RX_NET_RECV, shmptr);
+	if (unlikely(!rx_send_to_runtime(p, hdr->rss_hash, RX_NET_RECV,
+					 shmptr))) {
+		proc_rx_uncharge(p, 1);
+		p->stats.rx_drops++;
+		return false;
+	}
+
+	p->stats.rx_pkts++;
+	p->stats.rx_bytes += hdr->len;
+	return true;
 }
 
-static void rx_one_pkt(struct rte_mbuf *buf)
+/*
+ * Sends a packet to several runtimes. They share the mbuf, each holding a
+ * reference, so the payload is never copied. The references are only dropped
+ * on this core, so they can be added after the packet is sent.
+ */
+static void rx_fanout_pkt(struct rte_mbuf *buf, struct proc * const *procs,
+			  int nr, int fail_stat)
+{
+	struct rx_net_hdr *net_hdr = rte_pktmbuf_mtod(buf, struct rx_net_hdr *);
+	int i, n_sent = 0;
+
+	net_hdr->enq_tsc = rdtsc();
+	for (i = 0; i < nr; i++) {
+		if (likely(rx_send_pkt_to_runtime(procs[i], net_hdr))) {
+			n_sent++;
+		} else {
+			STAT_INC(fail_stat, 1);
+			log_debug_ratelimited("rx: failed to enqueue multicast "
+					      "packet to runtime");
+		}
+	}
+
+	if (n_sent == 0) {
+		rte_pktmbuf_free(buf);
+		return;
+	}
+	rte_mbuf_refcnt_update(buf, n_sent - 1);
+}
+
+/*
+ * Returns the destination of an IPv4 packet to a routable multicast group (in
+ * native byte order), otherwise 0. Packets to 224.0.0.0/24, such as IGMP
+ * queries, go to every runtime instead.
+ */
+static uint32_t rx_mcast_group(struct rte_mbuf *buf)
+{
+	struct rx_net_hdr *net_hdr = rte_pktmbuf_mtod(buf, struct rx_net_hdr *);
+	const struct ether_hdr *eth_hdr = (struct ether_hdr *)(net_hdr + 1);
+	const struct ipv4_hdr *iphdr = (const struct ipv4_hdr *)(eth_hdr + 1);
+	uint32_t addr;
+
+	if (eth_hdr->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4) ||
+	    net_hdr->len < ETHER_HDR_LEN + sizeof(*iphdr))
+		return 0;
+
+	addr = rte_be_to_cpu_32(iphdr->dst_addr);
+	if ((addr >> 28) != 0xe || (addr >> 8) == 0xe00000)
+		return 0;
+	return addr;
+}
+
+static void rx_unicast_fail(struct rte_mbuf *buf)
+{
+	STAT_INC(RX_UNICAST_FAIL, 1);
+	log_debug_ratelimited("rx: failed to send unicast packet to runtime");
+	rte_pktmbuf_free(buf);
+}
+
+/*
+ * Queue a unicast packet to be sent to a runtime by rx_flush_staged(), so
+ * that packets for the same thread are published together.
+ */
+static void rx_stage_pkt(struct proc *p, struct rx_net_hdr *hdr,
+			 struct rte_mbuf *buf)
+{
+	struct rx_staged_pkt *s;
+	struct thread *th;
+
+	/* drop before waking a core for a runtime that isn't keeping up */
+	if (unlikely(!rx_charge(p))) {
+		rte_pktmbuf_free(buf);
+		return;
+	}
+
+	th = rx_pick_thread(p, hdr->rss_hash);
+	if (unlikely(!th)) {
+		proc_rx_uncharge(p, 1);
+		rx_unicast_fail(buf);
+		return;
+	}
+
+	assert(nr_rx_staged < IOKERNEL_RX_BURST_SIZE);
+	s = &rx_staged[nr_rx_staged++];
+	s->th = th;
+	s->msg.cmd = RX_NET_RECV;
+	s->msg.payload = ptr_to_shmptr(&ingress_mbuf_region, hdr, sizeof(*hdr));
+	s->buf = buf;
+	s->hdr = hdr;
+}
+
+/*
+ * Enqueue staged packets, with one burst for each destination thread.
+ */
+static void rx_flush_staged(void)
+{
+	struct lrpc_msg msgs[IOKERNEL_RX_BURST_SIZE];
+	struct rte_mbuf *bufs[IOKERNEL_RX_BURST_SIZE];
+	struct thread *th;
+	unsigned int i, j, n, sent;
+	uint64_t tsc;
+
+	if (nr_rx_staged == 0)
+		return;
+
+	/* when the runtime's share of the RX path starts, see net_rx_ts */
+	tsc = rdtsc();
+	for (i = 0; i < nr_rx_staged; i++) {
+		th = rx_staged[i].th;
+		if (!th)
+			continue;
+
+		/* gather the packets for this thread, keeping their order */
+		n = 0;
+		for (j = i; j < nr_rx_staged; j++) {
+			if (rx_staged[j].th != th)
+				continue;
+			rx_staged[j].hdr->enq_tsc = tsc;
+			msgs[n] = rx_staged[j].msg;
+			bufs[n++] = rx_staged[j].buf;
+			rx_staged[j].th = NULL;
+		}
+
+		sent = lrpc_send_burst(&th->rxq, msgs, n);
+		proc_rx_uncharge(th->p, n - sent);
+		for (j = sent; j < n; j++)
+			rx_unicast_fail(bufs[j]);
+
+		/* the cached length can only overestimate, so confirm it */
+		if (unlikely(lrpc_get_cached_length(&th->rxq) >=
+			     CORES_RXQ_DEPTH_THRESH)) {
+			lrpc_poll_send_tail(&th->rxq);
+			if (lrpc_get_cached_length(&th->rxq) >=
+			    CORES_RXQ_DEPTH_THRESH)
+				cores_rx_backlogged(th);
+		}
+	}
+
+	nr_rx_staged = 0;
+}
+
+/*
+ * Hashes the destination MAC of an ingress packet for steering. This runs on
+ * whichever core polled the packet, so it must not touch state owned by the
+ * main dataplane core.
+ */
+static void rx_prepare_pkt(struct rte_mbuf *buf)
 {
 	struct ether_hdr *ptr_mac_hdr;
 	struct ether_addr *ptr_dst_addr;
-	struct rx_net_hdr *net_hdr;
-	int i, ret;
 
 	ptr_mac_hdr = rte_pktmbuf_mtod(buf, struct ether_hdr *);
 	ptr_dst_addr = &ptr_mac_hdr->d_addr;
+
+	/* the hash table itself isn't read, so this is safe on any core */
+	if (likely(is_unicast_ether_addr(ptr_dst_addr))) {
+		buf->udata64 = rte_hash_hash(dp.mac_to_proc,
+					     &ptr_dst_addr->addr_bytes[0]);
+	}
+
+	/* ports without RSS (e.g., AF_XDP) still need flows spread out */
+	if (unlikely(!(buf->ol_flags & PKT_RX_RSS_HASH)))
+		buf->hash.rss = rx_sw_flow_hash(buf);
+}
+
+static inline struct ether_addr *rx_dst_addr(struct rte_mbuf *buf)
+{
+	struct rx_net_hdr *net_hdr = rte_pktmbuf_mtod(buf, struct rx_net_hdr *);
+
+	return &((struct ether_hdr *)(net_hdr + 1))->d_addr;
+}
+
+/*
+ * Steers a packet whose destination MAC lookup already happened. @p is the
+ * runtime that owns a unicast MAC, or NULL if it's unregistered or not a
+ * unicast packet.
+ */
+static void rx_dispatch_pkt(struct rte_mbuf *buf, struct proc *p)
+{
+	struct ether_addr *ptr_dst_addr;
+	struct rx_net_hdr *net_hdr;
+	struct mcast_group *g;
+	uint32_t group;
+
+	net_hdr = rte_pktmbuf_mtod(buf, struct rx_net_hdr *);
+	ptr_dst_addr = rx_dst_addr(buf);
 	log_debug("rx: rx packet with MAC %02" PRIx8 " %02" PRIx8 " %02"
 		  PRIx8 " %02" PRIx8 " %02" PRIx8 " %02" PRIx8,
 		  ptr_dst_addr->addr_bytes[0], ptr_dst_addr->addr_bytes[1],
@@ -101,51 +444,39 @@ static void rx_one_pkt(struct rte_mbuf *buf)
 
 	/* handle unicast destinations (send to a single runtime) */
 	if (likely(is_unicast_ether_addr(ptr_dst_addr))) {
-		void *data;
-		struct proc *p;
-
-		/* lookup runtime by MAC in hash table */
-		ret = rte_hash_lookup_data(dp.mac_to_proc,
-				&ptr_dst_addr->addr_bytes[0], &data);
-		if (unlikely(ret < 0)) {
+		if (unlikely(!p)) {
 			STAT_INC(RX_UNREGISTERED_MAC, 1);
 			log_debug_ratelimited("rx: received packet for unregistered MAC");
 			rte_pktmbuf_free(buf);
 			return;
 		}
 
-		p = (struct proc *)data;
-		net_hdr = rx_prepend_rx_preamble(buf);
-		if (!rx_send_pkt_to_runtime(p, net_hdr)) {
-			STAT_INC(RX_UNICAST_FAIL, 1);
-			log_debug_ratelimited("rx: failed to send unicast packet to runtime");
-			rte_pktmbuf_free(buf);
-		}
+		rx_stage_pkt(p, net_hdr, buf);
 		return;
 	}
 
-	/* handle broadcast destinations (send to all runtimes) */
-	if (is_broadcast_ether_addr(ptr_dst_addr) && dp.nr_clients > 0) {
-		bool success;
-		int n_sent = 0;
-
-		net_hdr = rx_prepend_rx_preamble(buf);
-		for (i = 0; i < dp.nr_clients; i++) {
-			success = rx_send_pkt_to_runtime(dp.clients[i], net_hdr);
-			if (success) {
-				n_sent++;
-			} else {
-				STAT_INC(RX_BROADCAST_FAIL, 1);
-				log_debug_ratelimited("rx: failed to enqueue broadcast "
-					 "packet to runtime");
-			}
-		}
-
-		if (n_sent == 0) {
+	/* handle IPv4 multicast groups (send to their subscribers) */
+	if (is_multicast_ether_addr(ptr_dst_addr) &&
+	    (group = rx_mcast_group(buf)) != 0) {
+		g = mcast_lookup(group);
+		if (!g) {
+			STAT_INC(RX_MCAST_UNJOINED, 1);
 			rte_pktmbuf_free(buf);
 			return;
 		}
-		rte_mbuf_refcnt_update(buf, n_sent - 1);
+
+		rx_fanout_pkt(buf, g->subs, g->nr_subs, RX_MCAST_FAIL);
+		return;
+	}
+
+	/*
+	 * Handle other broadcast and multicast destinations (send to all
+	 * runtimes). IPv6 neighbor discovery depends on multicast, and each
+	 * runtime filters out the groups it hasn't joined.
+	 */
+	if (is_multicast_ether_addr(ptr_dst_addr) && dp.nr_clients > 0) {
+		rx_fanout_pkt(buf, dp.clients, dp.nr_clients,
+			      RX_BROADCAST_FAIL);
 		return;
 	}
 
@@ -158,6 +489,186 @@ static void rx_one_pkt(struct rte_mbuf *buf)
 	STAT_INC(RX_UNHANDLED, 1);
 }
 
+static inline struct rx_mac_cache_entry *
+rx_mac_cache_slot(struct rte_mbuf *buf)
+{
+	return &rx_mac_cache[buf->udata64 & (RX_MAC_CACHE_SIZE - 1)];
+}
+
+/*
+ * Looks up the runtimes for a batch of packets, first in rx_mac_cache and
+ * then with one bulk lookup for the misses, and steers them in order.
+ */
+static void rx_steer_pkts(struct rte_mbuf **bufs, unsigned int n)
+{
+	const void *keys[IOKERNEL_RX_BURST_SIZE];
+	void *data[IOKERNEL_RX_BURST_SIZE];
+	struct proc *procs[IOKERNEL_RX_BURST_SIZE];
+	unsigned int misses[IOKERNEL_RX_BURST_SIZE];
+	struct rx_mac_cache_entry *e;
+	struct ether_addr *addr;
+	unsigned int i, j, nr_misses = 0;
+	uint64_t hits;
+
+	for (i = 0; i < n; i++) {
+		procs[i] = NULL;
+		addr = rx_dst_addr(bufs[i]);
+		if (unlikely(!is_unicast_ether_addr(addr)))
+			continue;
+
+		e = rx_mac_cache_slot(bufs[i]);
+		if (likely(e->p && !memcmp(&e->mac, addr, sizeof(e->mac)))) {
+			procs[i] = e->p;
+			continue;
+		}
+
+		keys[nr_misses] = &addr->addr_bytes[0];
+		misses[nr_misses++] = i;
+	}
+
+	if (nr_misses > 0) {
+		rte_hash_lookup_bulk_data(dp.mac_to_proc, keys, nr_misses,
+					  &hits, data);
+		for (j = 0; j < nr_misses; j++) {
+			if (!(hits & BIT(j)))
+				continue;
+
+			i = misses[j];
+			procs[i] = (struct proc *)data[j];
+			e = rx_mac_cache_slot(bufs[i]);
+			memcpy(&e->mac, keys[j], sizeof(e->mac));
+			e->p = procs[i];
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		rx_dispatch_pkt(bufs[i], procs[i]);
+}
+
+static void rx_one_pkt(struct rte_mbuf *buf)
+{
+	rx_steer_pkts(&buf, 1);
+}
+
+/*
+ * Handle a packet from a flow queue, which is steered to @p by hardware. The
+ * MAC is still checked in case the queue was recently reassigned.
+ */
+static void rx_one_flow_pkt(struct proc *p, struct rte_mbuf *buf)
+{
+	struct rx_net_hdr *net_hdr;
+	struct ether_hdr *ptr_mac_hdr;
+
+	net_hdr = rte_pktmbuf_mtod(buf, struct rx_net_hdr *);
+	ptr_mac_hdr = (struct ether_hdr *)(net_hdr + 1);
+	if (unlikely(!p || memcmp(&ptr_mac_hdr->d_addr, &p->mac,
+				  sizeof(p->mac)) != 0)) {
+		rx_one_pkt(buf);
+		return;
+	}
+
+	rx_stage_pkt(p, net_hdr, buf);
+}
+
+/**
+ * rx_sw_flow_hash - computes a flow hash for a packet in software
+ * @buf: the packet, starting with its Ethernet header
+ *
+ * Stands in for the RSS hash of packets that didn't come from the NIC.
+ * Returns 0 if the packet isn't TCP or UDP over IPv4.
+ */
+uint32_t rx_sw_flow_hash(struct rte_mbuf *buf)
+{
+	struct ether_hdr *eth = rte_pktmbuf_mtod(buf, struct ether_hdr *);
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(eth + 1);
+	uint32_t *ports;
+
+	if (eth->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4) ||
+	    rte_pktmbuf_data_len(buf) < sizeof(*eth) + sizeof(*ip) +
+					 sizeof(*ports) ||
+	    (ip->next_proto_id != IPPROTO_TCP &&
+	     ip->next_proto_id != IPPROTO_UDP))
+		return 0;
+
+	ports = (uint32_t *)((char *)ip + (ip->version_ihl & 0xf) * 4);
+	if ((char *)(ports + 1) > (char *)eth + rte_pktmbuf_data_len(buf))
+		return 0;
+
+	return hash_crc32c_two(0, ((uint64_t)ip->src_addr << 32) |
+				  ip->dst_addr, *ports);
+}
+
+/**
+ * rx_local_proc - finds the runtime that owns a MAC address
+ * @addr: the MAC address
+ *
+ * Returns the runtime, or NULL if no runtime on this host owns @addr.
+ */
+struct proc *rx_local_proc(const struct ether_addr *addr)
+{
+	void *data;
+
+	if (!is_unicast_ether_addr(addr) ||
+	    rte_hash_lookup_data(dp.mac_to_proc, &addr->addr_bytes[0],
+				 &data) < 0)
+		return NULL;
+	return data;
+}
+
+/* captures packets that already carry their RX preamble */
+static void rx_capture(struct rte_mbuf **bufs, unsigned int n, int dir)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		pcap_capture(rte_pktmbuf_mtod(bufs[i], char *) +
+			     sizeof(struct rx_net_hdr),
+			     rte_pktmbuf_data_len(bufs[i]) -
+			     sizeof(struct rx_net_hdr), dir);
+	}
+}
+
+/**
+ * rx_loopback - delivers packets sent by runtimes on this host
+ * @bufs: the packets, in ingress mbufs and starting with Ethernet headers
+ * @n: the number of packets
+ *
+ * The packets are steered to their runtimes as if the NIC had received them.
+ */
+void rx_loopback(struct rte_mbuf **bufs, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		rx_prepare_pkt(bufs[i]);
+	rx_prepend_rx_preambles(bufs, n);
+	/* never reach the NIC, so they're captured here instead */
+	if (unlikely(pcap_enabled))
+		rx_capture(bufs, n, IKPCAP_DIR_TX);
+	rx_steer_pkts(bufs, n);
+	rx_flush_staged();
+}
+
+/*
+ * Retrieve a batch of packets from a NIC queue and prepare them for steering.
+ */
+static uint16_t rx_poll_queue(uint16_t q, struct rte_mbuf **bufs)
+{
+	uint16_t nb_rx, i;
+
+	nb_rx = rte_eth_rx_burst(dp.port, q, bufs, IOKERNEL_RX_BURST_SIZE);
+	for (i = 0; i < nb_rx; i++) {
+		if (i + RX_PREFETCH_STRIDE < nb_rx) {
+			prefetch(rte_pktmbuf_mtod(bufs[i + RX_PREFETCH_STRIDE],
+				 char *));
+		}
+		rx_prepare_pkt(bufs[i]);
+	}
+	rx_prepend_rx_preambles(bufs, nb_rx);
+
+	return nb_rx;
+}
+
 /*
  * Process a batch of incoming packets.
  */
@@ -165,22 +676,106 @@ bool rx_burst(void)
 {
 	struct rte_mbuf *bufs[IOKERNEL_RX_BURST_SIZE];
 	uint16_t nb_rx, i;
+	unsigned int q;
+	bool work_done;
 
 	/* retrieve packets from NIC queue */
-	nb_rx = rte_eth_rx_burst(dp.port, 0, bufs, IOKERNEL_RX_BURST_SIZE);
+	nb_rx = rx_poll_queue(0, bufs);
 	STAT_INC(RX_PULLED, nb_rx);
 	if (nb_rx > 0)
 		log_debug("rx: received %d packets on port %d", nb_rx, dp.port);
+	if (unlikely(pcap_enabled))
+		rx_capture(bufs, nb_rx, IKPCAP_DIR_RX);
+
+	rx_steer_pkts(bufs, nb_rx);
+	rx_flush_staged();
+	work_done = nb_rx > 0;
+
+	/* steer packets polled by the RX worker cores */
+	for (q = 1; q < dp.nr_queues; q++) {
+		nb_rx = rte_ring_dequeue_burst(dp.rx_rings[q], (void **)bufs,
+					       IOKERNEL_RX_BURST_SIZE, NULL);
+		STAT_INC(RX_PULLED, nb_rx);
+		for (i = 0; i < nb_rx; i++)
+			prefetch(rte_pktmbuf_mtod(bufs[i], char *));
+		if (unlikely(pcap_enabled))
+			rx_capture(bufs, nb_rx, IKPCAP_DIR_RX);
+		rx_steer_pkts(bufs, nb_rx);
+		rx_flush_staged();
+		work_done |= nb_rx > 0;
+	}
 
-	for (i = 0; i < nb_rx; i++) {
-		if (i + RX_PREFETCH_STRIDE < nb_rx) {
-			prefetch(rte_pktmbuf_mtod(bufs[i + RX_PREFETCH_STRIDE],
-				 char *));
-		}
-		rx_one_pkt(bufs[i]);
+	/* handle packets steered to a runtime by the NIC */
+	for (q = 0; q < dp.nr_flow_queues; q++) {
+		nb_rx = rx_poll_queue(dp.nr_queues + q, bufs);
+		STAT_INC(RX_PULLED, nb_rx);
+		if (unlikely(pcap_enabled))
+			rx_capture(bufs, nb_rx, IKPCAP_DIR_RX);
+		for (i = 0; i < nb_rx; i++)
+			rx_one_flow_pkt(dp.flow_procs[q], bufs[i]);
+		rx_flush_staged();
+		work_done |= nb_rx > 0;
 	}
 
-	return nb_rx > 0;
+	return work_done;
+}
+
+/**
+ * rx_worker_loop - the main loop of an RX worker core
+ * @arg: the RSS queue to poll
+ *
+ * Polls a NIC queue and hands prepared packets to the main dataplane core,
+ * which steers them to runtimes. Runs on its own DPDK lcore.
+ */
+int rx_worker_loop(void *arg)
+{
+	struct rte_mbuf *bufs[IOKERNEL_RX_BURST_SIZE];
+	uint16_t q = (uint16_t)(uintptr_t)arg;
+	unsigned int nb_rx, nb_enq, i;
+
+	log_info("rx: core %u polling queue %u", rte_lcore_id(), q);
+
+	while (!load_acquire(&rx_workers_stop)) {
+		nb_rx = rx_poll_queue(q, bufs);
+		if (nb_rx == 0)
+			continue;
+
+		nb_enq = rte_ring_enqueue_burst(dp.rx_rings[q], (void **)bufs,
+						nb_rx, NULL);
+
+		/* drop what the main dataplane core can't keep up with */
+		for (i = nb_enq; i < nb_rx; i++)
+			rte_pktmbuf_free(bufs[i]);
+	}
+
+	return 0;
+}
+
+/**
+ * rx_stop_workers - stops the RX worker cores, for a handover
+ *
+ * Frees the packets they handed over that haven't been steered yet.
+ */
+void rx_stop_workers(void)
+{
+	struct rte_mbuf *buf;
+	unsigned int q;
+
+	store_release(&rx_workers_stop, true);
+	rte_eal_mp_wait_lcore();
+
+	for (q = 1; q < dp.nr_queues; q++) {
+		while (rte_ring_dequeue(dp.rx_rings[q], (void **)&buf) == 0)
+			rte_pktmbuf_free(buf);
+	}
+}
+
+/**
+ * rx_ingress_region - the shared memory region holding ingress mbufs
+ */
+const struct shm_region *rx_ingress_region(void)
+{
+	return &ingress_mbuf_region;
 }
 
 /*
@@ -238,8 +833,13 @@ static struct rte_mempool *rx_pktmbuf_pool_create_in_shm(const char *name,
 		goto fail_free_mempool;
 	}
 
-	shbuf = mem_map_shm(INGRESS_MBUF_SHM_KEY, NULL, INGRESS_MBUF_SHM_SIZE,
-			pg_size, true);
+	/* after a handover, runtimes still use the old image's mapping */
+	if (handover_mode) {
+		shbuf = handover_ingress_base();
+	} else {
+		shbuf = mem_map_shm(INGRESS_MBUF_SHM_KEY, NULL,
+				    INGRESS_MBUF_SHM_SIZE, pg_size, true);
+	}
 	if (shbuf == MAP_FAILED) {
 		log_err("rx: mem_map_shm failed");
 		goto fail_free_mempool;
@@ -257,6 +857,10 @@ static struct rte_mempool *rx_pktmbuf_pool_create_in_shm(const char *name,
 
 	rte_mempool_obj_iter(mp, rte_pktmbuf_init, NULL);
 
+	/* the mbufs runtimes still hold aren't free */
+	if (handover_mode && handover_restore_mbufs(mp))
+		goto fail_free_mempool;
+
 	return mp;
 
 fail_unmap_memory:
@@ -268,20 +872,50 @@ fail:
 	return NULL;
 }
 
+/**
+ * rx_mbuf_buf_size - the mbuf buffer size for frames of the configured MTU
+ *
+ * Includes the headroom used for struct rx_net_hdr.
+ */
+uint16_t rx_mbuf_buf_size(void)
+{
+	return max((unsigned int)RTE_MBUF_DEFAULT_BUF_SIZE,
+		   RTE_PKTMBUF_HEADROOM + dp.mtu + ETHER_HDR_LEN + ETHER_CRC_LEN);
+}
+
 /*
  * Initialize rx state.
  */
 int rx_init()
 {
-	/* create a mempool in shared memory to hold the rx mbufs */
+	char name[RTE_RING_NAMESIZE];
+	uint16_t buf_size = rx_mbuf_buf_size();
+	unsigned int q;
+
+	/*
+	 * Create a mempool in shared memory to hold the rx mbufs. Jumbo mbufs get
+	 * proportionally fewer so the pool still fits in the shared region.
+	 */
 	dp.rx_mbuf_pool = rx_pktmbuf_pool_create_in_shm("RX_MBUF_POOL",
-			IOKERNEL_NUM_MBUFS, MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE,
-			rte_socket_id());
+			IOKERNEL_NUM_MBUFS / div_up(buf_size,
+						    RTE_MBUF_DEFAULT_BUF_SIZE),
+			MBUF_CACHE_SIZE, 0, buf_size, rte_socket_id());
 
 	if (dp.rx_mbuf_pool == NULL) {
 		log_err("rx: couldn't create rx mbuf pool");
 		return -1;
 	}
 
+	/* create the rings used to hand off packets from RX worker cores */
+	for (q = 1; q < dp.nr_queues; q++) {
+		snprintf(name, sizeof(name), "RX_RING_%u", q);
+		dp.rx_rings[q] = rte_ring_create(name, IOKERNEL_RX_RING_SIZE,
+				rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
+		if (dp.rx_rings[q] == NULL) {
+			log_err("rx: couldn't create rx ring %u", q);
+			return -1;
+		}
+	}
+
 	return 0;
 }
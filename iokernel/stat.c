@@ -1,20 +1,28 @@
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <base/log.h>
+#include <base/time.h>
 
 #include "defs.h"
 
 #define BUFSIZE 4096
 
-uint64_t stats[NR_STATS];
+uint64_t stats[NR_STATS] __aligned(CACHE_LINE_SIZE);
 
 static const char *stat_names[] = {
 	"RX_UNREGISTERED_MAC",
 	"RX_UNICAST_FAIL",
 	"RX_BROADCAST_FAIL",
+	"RX_MCAST_FAIL",
+	"RX_MCAST_UNJOINED",
 	"RX_UNHANDLED",
 	"RX_JOIN_FAIL",
+	"RX_QUOTA_DROP",
 	"TX_COMPLETION_OVERFLOW",
 	"TX_COMPLETION_FAIL",
 	"RX_PULLED",
@@ -24,13 +32,93 @@ static const char *stat_names[] = {
 	"BATCH_TOTAL",
 	"TX_PULLED",
 	"TX_BACKPRESSURE",
+	"TX_SW_TSO",
+	"TX_SW_GSO",
+	"TX_LOOPBACK",
+	"TX_SW_LINEARIZE",
+	"TX_BAD_SEGS",
 	"RQ_GRANT",
 	"RX_GRANT",
+	"FLOW_TBL_UPDATES",
+	"FLOW_BUCKETS_MOVED",
+	"FLOW_STEERS",
+	"FLOW_ADOPTS",
 	"ADJUSTS",
+	"PREEMPT_SYSTEM",
+	"PREEMPT_NORMAL",
+	"PREEMPT_BATCH",
+	"PREEMPT_SIGNALS",
+	"REMOTE_CORE_GRANTS",
+	"POWER_DEEP_IDLES",
+	"POWER_DEEP_GRANTS",
+	"RDT_CLASS_CHANGES",
+	"PCAP_CAPTURED",
+	"CORE_DEMAND_HINTS",
+	"CORE_LIMIT_CHANGES",
+	"INTR_SLEEPS",
+	"INTR_SLEEP_US",
+	"REGISTRATIONS",
+	"REGISTRATION_US",
+	"TEARDOWNS",
+	"TEARDOWN_US",
+	"PROCS_RECYCLED",
+	"ADJUST_LAT_LT1US",
+	"ADJUST_LAT_LT2US",
+	"ADJUST_LAT_LT4US",
+	"ADJUST_LAT_LT8US",
+	"ADJUST_LAT_LT16US",
+	"ADJUST_LAT_LT32US",
+	"ADJUST_LAT_LT64US",
+	"ADJUST_LAT_LT128US",
+	"ADJUST_LAT_LT256US",
+	"ADJUST_LAT_GE256US",
 };
 
 BUILD_ASSERT(ARRAY_SIZE(stat_names) == NR_STATS);
 
+/* prints each proc's egress totals, and resets its wait times */
+static void print_proc_tx_stats(void)
+{
+#ifdef STATS
+	struct proc *p;
+	int i;
+
+	for (i = 0; i < dp.nr_clients; i++) {
+		p = dp.clients[i];
+		fprintf(stderr, "TX pid %d: bytes %lu pkts %lu wait_avg_us %lu "
+			"wait_max_us %lu queue_avg_ns %lu\n", p->pid,
+			p->stats.tx_bytes, p->stats.tx_pkts,
+			p->tx_wait_samples ?
+			p->tx_wait_us_total / p->tx_wait_samples : 0,
+			p->tx_wait_us_max,
+			p->tx_queue_samples ? p->tx_queue_cycles * 1000 /
+				(p->tx_queue_samples * cycles_per_us) : 0);
+		p->tx_wait_us_total = p->tx_wait_samples = 0;
+		p->tx_wait_us_max = 0;
+		p->tx_queue_cycles = p->tx_queue_samples = 0;
+	}
+#endif
+}
+
+/* prints each proc's ingress buffer usage, resetting the peak and drops */
+static void print_proc_rx_stats(void)
+{
+#ifdef STATS
+	struct proc *p;
+	int i;
+
+	for (i = 0; i < dp.nr_clients; i++) {
+		p = dp.clients[i];
+		fprintf(stderr, "RX pid %d: pkts %lu bufs_held %u bufs_peak %u "
+			"quota %u quota_drops %lu\n", p->pid, p->stats.rx_pkts,
+			p->rx_bufs, p->rx_bufs_peak, rx_buf_quota,
+			p->rx_quota_drops);
+		p->rx_bufs_peak = p->rx_bufs;
+		p->rx_quota_drops = 0;
+	}
+#endif
+}
+
 void print_stats(void)
 {
 	int i;
@@ -47,4 +135,70 @@ void print_stats(void)
 	buf[done] = 0;
 
 	fprintf(stderr, "Stats:\n%s", buf);
+	print_proc_tx_stats();
+	print_proc_rx_stats();
+}
+
+static int stat_write(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, pos, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * stat_dump - writes a snapshot of the counters to a file descriptor
+ * @fd: the file descriptor to write to
+ * @procs: the procs that are currently running
+ * @nr_procs: the number of procs
+ *
+ * Safe to call from any thread, though the counters of a proc may be a few
+ * updates apart from each other. Returns 0 if successful, otherwise < 0.
+ */
+int stat_dump(int fd, struct proc **procs, int nr_procs)
+{
+	struct ikstat_hdr *hdr;
+	struct ikstat_counter *c;
+	struct ikstat_proc *sp;
+	size_t len;
+	int i, ret;
+
+	len = sizeof(*hdr) + sizeof(*c) * NR_STATS + sizeof(*sp) * nr_procs;
+	hdr = calloc(1, len);
+	if (!hdr)
+		return -ENOMEM;
+
+	hdr->magic = IKSTAT_MAGIC;
+	hdr->uptime_us = microtime();
+	hdr->nr_counters = NR_STATS;
+	hdr->nr_procs = nr_procs;
+
+	c = (struct ikstat_counter *)(hdr + 1);
+	for (i = 0; i < NR_STATS; i++) {
+		strncpy(c[i].name, stat_names[i], IKSTAT_NAME_LEN - 1);
+		c[i].val = ACCESS_ONCE(stats[i]);
+	}
+
+	sp = (struct ikstat_proc *)(c + NR_STATS);
+	for (i = 0; i < nr_procs; i++) {
+		sp[i].uniqid = procs[i]->uniqid;
+		sp[i].pid = procs[i]->pid;
+		sp[i].c = ACCESS_ONCE(procs[i]->stats);
+	}
+
+	ret = stat_write(fd, hdr, len);
+	free(hdr);
+	return ret;
 }
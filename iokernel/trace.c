@@ -0,0 +1,109 @@
+/*
+ * trace.c - a ring of core allocation decisions for offline analysis
+ *
+ * The dataplane core is the only writer, so recording an event is a few
+ * stores and a release of the head index. The control thread copies the ring
+ * without stopping the writer, then discards any entries that may have been
+ * overwritten while it was copying.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+
+#include "defs.h"
+
+struct trace_entry trace_ring[TRACE_RING_SIZE];
+uint64_t trace_head __aligned(CACHE_LINE_SIZE);
+
+BUILD_ASSERT(is_power_of_two(TRACE_RING_SIZE));
+
+static int trace_write(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, pos, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * trace_dump - writes a snapshot of the trace ring to a file descriptor
+ * @fd: the file descriptor to write to
+ * @procs: the procs that are currently running
+ * @nr_procs: the number of procs
+ *
+ * Safe to call from any thread. Returns 0 if successful, otherwise < 0.
+ */
+int trace_dump(int fd, struct proc **procs, int nr_procs)
+{
+	struct trace_entry *entries;
+	struct trace_proc tp;
+	struct trace_hdr hdr;
+	uint64_t first, last, start, i;
+	int j, ret;
+
+	entries = malloc(sizeof(trace_ring));
+	if (!entries)
+		return -ENOMEM;
+
+	/* copy the slots that were written before @last */
+	last = load_acquire(&trace_head);
+	first = last > TRACE_RING_SIZE ? last - TRACE_RING_SIZE : 0;
+	for (i = first; i < last; i++)
+		entries[i - first] = trace_ring[i & (TRACE_RING_SIZE - 1)];
+
+	/*
+	 * The writer may have lapped us while copying. Its slot for the next
+	 * index is being overwritten too, so anything at or below
+	 * head - TRACE_RING_SIZE can't be trusted.
+	 */
+	mb();
+	start = load_acquire(&trace_head);
+	start = start >= TRACE_RING_SIZE ? start - TRACE_RING_SIZE + 1 : 0;
+	start = max(start, first);
+	if (start > last)
+		start = last;
+
+	hdr.magic = TRACE_MAGIC;
+	hdr.cycles_per_us = cycles_per_us;
+	hdr.start_tsc = start_tsc;
+	hdr.nr_procs = nr_procs;
+	hdr.nr_entries = last - start;
+	hdr.nr_lost = start;
+
+	ret = trace_write(fd, &hdr, sizeof(hdr));
+	if (ret)
+		goto out;
+
+	for (j = 0; j < nr_procs; j++) {
+		tp.uniqid = procs[j]->uniqid;
+		tp.pid = procs[j]->pid;
+		tp.pad = 0;
+		ret = trace_write(fd, &tp, sizeof(tp));
+		if (ret)
+			goto out;
+	}
+
+	ret = trace_write(fd, &entries[start - first],
+			  sizeof(*entries) * (last - start));
+
+out:
+	free(entries);
+	return ret;
+}
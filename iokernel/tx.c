@@ -8,15 +8,35 @@
 #include <rte_ip.h>
 #include <rte_mbuf.h>
 #include <rte_tcp.h>
+#include <rte_udp.h>
 
 #include <base/log.h>
+#include <base/time.h>
 #include <iokernel/queue.h>
 
 #include "defs.h"
 
 #define TX_PREFETCH_STRIDE 2
+/* the maximum segments a packet can be split into by software TSO */
+#define TX_SW_TSO_MAX_SEGS 64
+#define TX_SW_TSO_POOL_SIZE 2047
+#define TX_SW_TSO_POOL_CACHE 256
+/* TCP flags that only belong on the last segment of a TSO packet */
+#define TX_TCP_FIN_PSH (0x01 | 0x08)
+/* the bytes a proc of weight 1 may send per egress scheduling round */
+#define TX_DRR_QUANTUM (16 * 1024)
+/* how long a rate-limited proc may save up its allowance for (us) */
+#define TX_RATE_BURST_US 100
+
+/* deliver packets between runtimes on this host without the NIC */
+bool tx_loopback;
 
 static struct rte_mempool *tx_mbuf_pool;
+static struct rte_mempool *tx_sw_tso_pool;
+
+/* segments produced by software TSO, waiting to be sent */
+static struct rte_mbuf *sw_segs[TX_SW_TSO_MAX_SEGS];
+static unsigned int n_sw_segs, sw_segs_pos;
 
 /*
  * Private data stored in egress mbufs, used to send completions to runtimes.
@@ -30,52 +50,196 @@ struct tx_pktmbuf_priv {
 	unsigned long	completion_data;
 };
 
+/* the mbuf offload fields for each combination of OLFLAG_* bits but TSO */
+struct tx_offload_ent {
+	uint64_t	ol_flags;
+	uint64_t	tx_offload;	/* packed l2_len, l3_len, and l4_len */
+};
+
+#define TX_OLFLAG_NR	(OLFLAG_UDP_CHKSUM << 1)
+static struct tx_offload_ent tx_offload_tbl[TX_OLFLAG_NR];
+/* data_off, refcnt, nb_segs, and port of an mbuf ready to send */
+static uint64_t tx_mbuf_rearm;
+
 static inline struct tx_pktmbuf_priv *tx_pktmbuf_get_priv(struct rte_mbuf *buf)
 {
 	return (struct tx_pktmbuf_priv *)(((char *)buf)
 			+ sizeof(struct rte_mbuf));
 }
 
+/* returns the length of a packet across its segments */
+static unsigned int tx_pkt_len(const struct tx_net_hdr *net_hdr)
+{
+	const struct tx_net_seg *segs = tx_net_hdr_segs(net_hdr);
+	unsigned int i, len = net_hdr->len;
+
+	for (i = 0; i < net_hdr->nr_segs; i++)
+		len += segs[i].len;
+	return len;
+}
+
+/*
+ * Checks that a multi-segment packet's segment table and segments are in @p's
+ * region. This is done once when the packet is drained, so later steps can
+ * translate the segments' addresses without checking them again.
+ */
+static bool tx_segs_valid(struct proc *p, shmptr_t shm,
+			  const struct tx_net_hdr *net_hdr)
+{
+	const struct tx_net_seg *segs;
+	unsigned int i;
+
+	if (unlikely(net_hdr->nr_segs > TX_NET_MAX_SEGS))
+		return false;
+
+	segs = shmptr_to_ptr(&p->region, shm + sizeof(*net_hdr) + net_hdr->len,
+			     net_hdr->nr_segs * sizeof(*segs));
+	if (unlikely(!segs))
+		return false;
+
+	for (i = 0; i < net_hdr->nr_segs; i++) {
+		if (unlikely(segs[i].len == 0 || segs[i].len > UINT16_MAX ||
+			     !shmptr_to_ptr(&p->region, segs[i].data,
+					    segs[i].len)))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Copies @len bytes of a packet into @dst, starting @off bytes in and
+ * gathering them across its segments.
+ */
+static void tx_copy_pkt(struct proc *p, const struct tx_net_hdr *net_hdr,
+			unsigned int off, char *dst, unsigned int len)
+{
+	const struct tx_net_seg *segs = tx_net_hdr_segs(net_hdr);
+	const char *src = net_hdr->payload;
+	unsigned int i = 0, seg_len = net_hdr->len, n;
+
+	while (true) {
+		if (off < seg_len) {
+			n = min(seg_len - off, len);
+			memcpy(dst, src + off, n);
+			dst += n;
+			len -= n;
+			off = 0;
+		} else {
+			off -= seg_len;
+		}
+
+		if (len == 0 || i == net_hdr->nr_segs)
+			break;
+		src = (const char *)p->region.base + segs[i].data;
+		seg_len = segs[i++].len;
+	}
+}
+
+/* points an mbuf at a buffer in @p's region */
+static inline void tx_mbuf_attach(struct rte_mbuf *buf, struct proc *p,
+				  const char *data, unsigned int len)
+{
+	uint32_t page_number;
+
+	buf->buf_addr = (char *)data;
+	page_number = PGN_2MB((uintptr_t)data - (uintptr_t)p->region.base);
+	buf->buf_physaddr = p->page_paddrs[page_number] + PGOFF_2MB(data);
+	*(uint64_t *)&buf->rearm_data = tx_mbuf_rearm;
+
+	buf->buf_len = len;
+	buf->data_len = len;
+}
+
 /*
- * Prepare rte_mbuf struct for transmission.
+ * Chains an mbuf to @buf for each segment of a packet after the first. They
+ * carry no completion, the first mbuf sends it. Returns false if out of mbufs.
  */
-static void tx_prepare_tx_mbuf(struct rte_mbuf *buf,
+static bool tx_prepare_segs(struct rte_mbuf *buf,
+			    const struct tx_net_hdr *net_hdr, struct proc *p)
+{
+	const struct tx_net_seg *segs = tx_net_hdr_segs(net_hdr);
+	struct rte_mbuf *bufs[TX_NET_MAX_SEGS], *prev = buf;
+	struct tx_pktmbuf_priv *priv_data;
+	unsigned int i, nr = net_hdr->nr_segs;
+
+	if (unlikely(rte_mempool_get_bulk(tx_mbuf_pool, (void **)bufs, nr))) {
+		log_warn_ratelimited("tx: error getting %u mbufs for segments",
+				     nr);
+		return false;
+	}
+
+	for (i = 0; i < nr; i++) {
+		tx_mbuf_attach(bufs[i], p,
+			       (const char *)p->region.base + segs[i].data,
+			       segs[i].len);
+		priv_data = tx_pktmbuf_get_priv(bufs[i]);
+		priv_data->p = NULL;
+#ifdef MLX
+		priv_data->lkey = p->lkey;
+#endif /* MLX */
+		buf->pkt_len += segs[i].len;
+		prev->next = bufs[i];
+		prev = bufs[i];
+	}
+
+	prev->next = NULL;
+	buf->nb_segs = nr + 1;
+	return true;
+}
+
+/*
+ * Prepare rte_mbuf struct for transmission. Returns false if the packet can't
+ * be sent, and then @buf has no completion to send.
+ */
+static bool tx_prepare_tx_mbuf(struct rte_mbuf *buf,
 			       const struct tx_net_hdr *net_hdr,
 			       struct thread *th)
 {
 	struct proc *p = th->p;
-	uint32_t page_number;
 	struct tx_pktmbuf_priv *priv_data;
+	const struct tx_offload_ent *ol;
 
 	/* initialize mbuf to point to net_hdr->payload */
-	buf->buf_addr = (char *)net_hdr->payload;
-	page_number = PGN_2MB((uintptr_t)buf->buf_addr - (uintptr_t)p->region.base);
-	buf->buf_physaddr = p->page_paddrs[page_number] + PGOFF_2MB(buf->buf_addr);
-	buf->data_off = 0;
-	rte_mbuf_refcnt_set(buf, 1);
-
-	buf->buf_len = net_hdr->len;
+	tx_mbuf_attach(buf, p, net_hdr->payload, net_hdr->len);
 	buf->pkt_len = net_hdr->len;
-	buf->data_len = net_hdr->len;
-
-	buf->ol_flags = 0;
-	if (net_hdr->olflags != 0) {
-		if (net_hdr->olflags & OLFLAG_IP_CHKSUM)
-			buf->ol_flags |= PKT_TX_IP_CKSUM;
-		if (net_hdr->olflags & OLFLAG_TCP_CHKSUM)
-			buf->ol_flags |= PKT_TX_TCP_CKSUM;
-		if (net_hdr->olflags & OLFLAG_IPV4)
-			buf->ol_flags |= PKT_TX_IPV4;
-		if (net_hdr->olflags & OLFLAG_IPV6)
-			buf->ol_flags |= PKT_TX_IPV6;
-
-		buf->l4_len = sizeof(struct tcp_hdr);
-		buf->l3_len = sizeof(struct ipv4_hdr);
+	buf->next = NULL;
+
+	priv_data = tx_pktmbuf_get_priv(buf);
+	if (unlikely(net_hdr->nr_segs > 0) &&
+	    unlikely(!tx_prepare_segs(buf, net_hdr, p))) {
+		priv_data->p = NULL;
+		return false;
+	}
+
+	if (unlikely(net_hdr->olflags & OLFLAG_TCP_TSO)) {
+		const struct ipv4_hdr *iphdr;
+		const struct tcp_hdr *tcphdr;
+
+		iphdr = (const struct ipv4_hdr *)(net_hdr->payload +
+						    ETHER_HDR_LEN);
+		if (net_hdr->olflags & OLFLAG_IPV6) {
+			buf->ol_flags = PKT_TX_TCP_SEG | PKT_TX_IPV6 |
+					PKT_TX_TCP_CKSUM;
+			buf->l3_len = sizeof(struct ipv6_hdr);
+		} else {
+			buf->ol_flags = PKT_TX_TCP_SEG | PKT_TX_IPV4 |
+					PKT_TX_IP_CKSUM | PKT_TX_TCP_CKSUM;
+			buf->l3_len = (iphdr->version_ihl & IPV4_HDR_IHL_MASK) * 4;
+		}
+		tcphdr = (const struct tcp_hdr *)((const char *)iphdr +
+						  buf->l3_len);
+		buf->tso_segsz = net_hdr->tso_segsz;
 		buf->l2_len = ETHER_HDR_LEN;
+		buf->l4_len = (tcphdr->data_off >> 4) * 4;
+	} else {
+		/* the rest only depends on the flags, see tx_init_offloads() */
+		ol = &tx_offload_tbl[net_hdr->olflags & (TX_OLFLAG_NR - 1)];
+		buf->ol_flags = ol->ol_flags;
+		buf->tx_offload = ol->tx_offload;
 	}
 
 	/* initialize the private data, used to send completion events */
-	priv_data = tx_pktmbuf_get_priv(buf);
 	priv_data->p = p;
 	priv_data->th = th;
 	priv_data->completion_data = net_hdr->completion_data;
@@ -87,43 +251,28 @@ static void tx_prepare_tx_mbuf(struct rte_mbuf *buf,
 
 	/* reference count @p so it doesn't get freed before the completion */
 	proc_get(p);
+	return true;
 }
 
+/* completions waiting in overflow queues, across all procs */
+static unsigned long tx_nr_overflows;
+
 /*
- * Send a completion event to the runtime for the mbuf pointed to by obj.
+ * Send a completion event to the runtime (or queue it if the RXQ is full).
+ * Returns false if the completion couldn't be delivered or queued.
  */
-bool tx_send_completion(void *obj)
+static bool tx_complete(struct proc *p, struct thread *th,
+			unsigned long completion_data)
 {
-	struct rte_mbuf *buf;
-	struct tx_pktmbuf_priv *priv_data;
-	struct thread *th;
-	struct proc *p;
-
-	buf = (struct rte_mbuf *)obj;
-	priv_data = tx_pktmbuf_get_priv(buf);
-	p = priv_data->p;
-
-	/* during initialization, the mbufs are enqueued for the first time */
-	if (unlikely(!p))
-		return true;
-
-	/* check if runtime is still registered */
-	if(unlikely(p->kill)) {
-		proc_put(p);
-		return true; /* no need to send a completion */
-	}
-
-	/* send completion to runtime */
-	th = priv_data->th;
 	if (!th->parked) {
 		if (likely(lrpc_send(&th->rxq, RX_NET_COMPLETE,
-			       priv_data->completion_data))) {
-			goto success;
+			       completion_data))) {
+			return true;
 		}
 	} else {
 		if (likely(rx_send_to_runtime(p, p->next_thread_rr++, RX_NET_COMPLETE,
-					priv_data->completion_data))) {
-			goto success;
+					completion_data))) {
+			return true;
 		}
 	}
 
@@ -131,21 +280,126 @@ bool tx_send_completion(void *obj)
 		log_warn("tx: Completion overflow queue is full");
 		return false;
 	}
-	p->overflow_queue[p->nr_overflows++] = priv_data->completion_data;
+	p->overflow_queue[p->nr_overflows++] = completion_data;
+	tx_nr_overflows++;
 	log_debug_ratelimited("tx: failed to send completion to runtime");
 	STAT_INC(COMPLETION_ENQUEUED, -1);
 	STAT_INC(TX_COMPLETION_OVERFLOW, 1);
+	return true;
+}
 
+/* a single completion, staged so completions to a thread are sent together */
+struct tx_staged_completion {
+	struct thread	*th;
+	unsigned long	completion_data;
+};
 
-success:
-	proc_put(p);
-	STAT_INC(COMPLETION_ENQUEUED, 1);
-	return true;
+/*
+ * Send staged completions, one lrpc burst per destination thread. Any that
+ * don't fit go through tx_complete(), which tries other threads and then the
+ * proc's overflow queue.
+ */
+static void tx_flush_completions(struct tx_staged_completion *c,
+				 unsigned int n)
+{
+	struct lrpc_msg msgs[IOKERNEL_TX_BURST_SIZE];
+	struct thread *th;
+	struct proc *p;
+	unsigned int i, j, nr, sent, done;
+
+	for (i = 0; i < n; i++) {
+		th = c[i].th;
+		if (!th)
+			continue;
+
+		/* gather the completions for this thread, keeping their order */
+		nr = 0;
+		for (j = i; j < n; j++) {
+			if (c[j].th != th)
+				continue;
+			msgs[nr].cmd = RX_NET_COMPLETE;
+			msgs[nr++].payload = c[j].completion_data;
+			c[j].th = NULL;
+		}
+
+		p = th->p;
+		sent = th->parked ? 0 : lrpc_send_burst(&th->rxq, msgs, nr);
+		done = sent;
+		for (j = sent; j < nr; j++) {
+			/* if this fails, give up and leave @p referenced */
+			if (tx_complete(p, th, msgs[j].payload))
+				done++;
+		}
+
+		STAT_INC(COMPLETION_ENQUEUED, done);
+		for (j = 0; j < done; j++)
+			proc_put(p);
+	}
+}
+
+/**
+ * tx_send_completions - sends completion events for freed egress mbufs
+ * @objs: the mbufs
+ * @n: the number of mbufs
+ *
+ * Completions are gathered so each thread's are sent with one lrpc burst.
+ */
+void tx_send_completions(void * const *objs, unsigned int n)
+{
+	struct tx_staged_completion staged[IOKERNEL_TX_BURST_SIZE];
+	struct tx_pktmbuf_priv *priv_data;
+	unsigned int i, nr = 0;
+	struct proc *p;
+
+	for (i = 0; i < n; i++) {
+		priv_data = tx_pktmbuf_get_priv((struct rte_mbuf *)objs[i]);
+		p = priv_data->p;
+
+		/* during initialization, the mbufs are enqueued for the first
+		   time */
+		if (unlikely(!p))
+			continue;
+
+		/* check if runtime is still registered */
+		if (unlikely(p->kill)) {
+			proc_put(p);
+			continue; /* no need to send a completion */
+		}
+
+		staged[nr].th = priv_data->th;
+		staged[nr++].completion_data = priv_data->completion_data;
+		if (nr == IOKERNEL_TX_BURST_SIZE) {
+			tx_flush_completions(staged, nr);
+			nr = 0;
+		}
+	}
+
+	tx_flush_completions(staged, nr);
 }
 
 static int drain_overflow_queue(struct proc *p, int n)
 {
-	int i = 0;
+	struct lrpc_msg msgs[IOKERNEL_OVERFLOW_BATCH_DRAIN];
+	struct thread *th;
+	int i = 0, nr, sent;
+
+	/* with a running thread, send as much as fits in one burst */
+	if (p->active_thread_count > 0) {
+		th = p->active_threads[p->next_thread_rr++ %
+				       p->active_thread_count];
+		nr = min(n, min((int)p->nr_overflows,
+				IOKERNEL_OVERFLOW_BATCH_DRAIN));
+		for (i = 0; i < nr; i++) {
+			msgs[i].cmd = RX_NET_COMPLETE;
+			msgs[i].payload =
+				p->overflow_queue[p->nr_overflows - 1 - i];
+		}
+		sent = lrpc_send_burst(&th->rxq, msgs, nr);
+		p->nr_overflows -= sent;
+		return sent;
+	}
+
+	/* otherwise a core may have to be woken */
 	while (p->nr_overflows > 0 && i < n) {
 		if (!rx_send_to_runtime(p, p->next_thread_rr++, RX_NET_COMPLETE,
 				p->overflow_queue[--p->nr_overflows])) {
@@ -157,19 +411,55 @@ static int drain_overflow_queue(struct proc *p, int n)
 	return i;
 }
 
+/**
+ * tx_forget_overflows - discards a removed proc's overflowed completions
+ * @p: the proc, which will no longer be drained
+ */
+void tx_forget_overflows(struct proc *p)
+{
+	tx_nr_overflows -= p->nr_overflows;
+	p->nr_overflows = 0;
+}
+
+/**
+ * tx_restore_overflows - requeues a proc's overflowed completions
+ * @p: the proc, inherited from a handover
+ * @completions: the completions the old image hadn't delivered
+ * @nr: the number of completions
+ */
+void tx_restore_overflows(struct proc *p, const unsigned long *completions,
+			  size_t nr)
+{
+	nr = min(nr, (size_t)p->max_overflows);
+	memcpy(p->overflow_queue, completions, nr * sizeof(*completions));
+	p->nr_overflows = nr;
+	tx_nr_overflows += nr;
+}
+
 bool tx_drain_completions()
 {
 	static unsigned long pos = 0;
 	unsigned long i;
-	size_t drained = 0;
+	size_t drained = 0, budget;
 	struct proc *p;
 
-	for (i = 0; i < dp.nr_clients && drained < IOKERNEL_OVERFLOW_BATCH_DRAIN; i++) {
+	if (likely(tx_nr_overflows == 0))
+		return false;
+
+	/* drain faster the further behind we are, so a backlog spread
+	   across many runtimes still clears */
+	budget = max((size_t)IOKERNEL_OVERFLOW_BATCH_DRAIN,
+		     tx_nr_overflows / IOKERNEL_OVERFLOW_DRAIN_FRACTION);
+
+	for (i = 0; i < dp.nr_clients && drained < budget; i++) {
 		p = dp.clients[(pos + i) % dp.nr_clients];
-		drained += drain_overflow_queue(p, IOKERNEL_OVERFLOW_BATCH_DRAIN - drained);
+		if (p->nr_overflows == 0)
+			continue;
+		drained += drain_overflow_queue(p, budget - drained);
 	}
 
 	pos++;
+	tx_nr_overflows -= drained;
 
 	STAT_INC(COMPLETION_DRAINED, drained);
 
@@ -177,34 +467,485 @@ bool tx_drain_completions()
 
 }
 
-static int tx_drain_queue(struct thread *t, int n,
-			  const struct tx_net_hdr **hdrs)
+/*
+ * Computes the checksums a packet asks the NIC for, for ports that can't.
+ */
+static void tx_sw_csum(struct rte_mbuf *m)
 {
-	int i;
+	struct ipv4_hdr *iphdr;
+	struct tcp_hdr *tcphdr;
+	struct udp_hdr *udphdr;
+	void *l4hdr;
 
-	for (i = 0; i < n; i++) {
-		uint64_t cmd;
-		unsigned long payload;
+	if (!(m->ol_flags & (PKT_TX_IP_CKSUM | PKT_TX_L4_MASK)))
+		return;
 
-		if (!lrpc_recv(&t->txpktq, &cmd, &payload)) {
-			if (unlikely(t->parked))
-				unpoll_thread(t);
-			break;
+	iphdr = rte_pktmbuf_mtod_offset(m, struct ipv4_hdr *, m->l2_len);
+	l4hdr = (char *)iphdr + m->l3_len;
+	if (m->ol_flags & PKT_TX_IP_CKSUM) {
+		iphdr->hdr_checksum = 0;
+		iphdr->hdr_checksum = rte_ipv4_cksum(iphdr);
+	}
+
+	switch (m->ol_flags & PKT_TX_L4_MASK) {
+	case PKT_TX_TCP_CKSUM:
+		tcphdr = l4hdr;
+		tcphdr->cksum = 0;
+		tcphdr->cksum = (m->ol_flags & PKT_TX_IPV6) ?
+			rte_ipv6_udptcp_cksum((struct ipv6_hdr *)iphdr, l4hdr) :
+			rte_ipv4_udptcp_cksum(iphdr, l4hdr);
+		break;
+	case PKT_TX_UDP_CKSUM:
+		udphdr = l4hdr;
+		udphdr->dgram_cksum = 0;
+		udphdr->dgram_cksum = (m->ol_flags & PKT_TX_IPV6) ?
+			rte_ipv6_udptcp_cksum((struct ipv6_hdr *)iphdr, l4hdr) :
+			rte_ipv4_udptcp_cksum(iphdr, l4hdr);
+		break;
+	}
+
+	m->ol_flags &= ~(PKT_TX_IP_CKSUM | PKT_TX_L4_MASK);
+}
+
+/*
+ * Split a TSO packet into MSS-sized copies for NICs that lack TSO, or a UDP
+ * GSO packet into datagrams of @tso_segsz payload bytes each. The payload is
+ * copied, gathered across segments, so the runtime's buffer is completed
+ * right away. The headers must all be in the first segment.
+ */
+static void tx_sw_tso(struct thread *t, const struct tx_net_hdr *net_hdr)
+{
+	const struct ipv4_hdr *iphdr;
+	const struct tcp_hdr *tcphdr;
+	struct ipv4_hdr *seg_iphdr;
+	struct ipv6_hdr *seg_ip6hdr;
+	struct tcp_hdr *seg_tcphdr;
+	struct udp_hdr *seg_udphdr;
+	struct rte_mbuf *m;
+	unsigned int l3_len, l4_len, hdr_len, payload_len, seg_len, off;
+	unsigned int i, nr, len = tx_pkt_len(net_hdr);
+	uint64_t l4_flag;
+	uint16_t *cksum;
+	uint32_t seq;
+	uint16_t id;
+	bool ip6 = net_hdr->olflags & OLFLAG_IPV6;
+	bool udp = net_hdr->olflags & OLFLAG_UDP_GSO;
+	char *data;
+
+	STAT_INC(udp ? TX_SW_GSO : TX_SW_TSO, 1);
+
+	iphdr = (const struct ipv4_hdr *)(net_hdr->payload + ETHER_HDR_LEN);
+	if (ip6)
+		l3_len = sizeof(struct ipv6_hdr);
+	else
+		l3_len = (iphdr->version_ihl & IPV4_HDR_IHL_MASK) * 4;
+	tcphdr = (const struct tcp_hdr *)((const char *)iphdr + l3_len);
+	if (udp) {
+		l4_len = sizeof(struct udp_hdr);
+		l4_flag = PKT_TX_UDP_CKSUM;
+	} else {
+		l4_len = (tcphdr->data_off >> 4) * 4;
+		l4_flag = PKT_TX_TCP_CKSUM;
+	}
+	hdr_len = ETHER_HDR_LEN + l3_len + l4_len;
+	if (unlikely(hdr_len > net_hdr->len || net_hdr->tso_segsz == 0))
+		goto done;
+
+	payload_len = len - hdr_len;
+	nr = div_up(payload_len, net_hdr->tso_segsz);
+	if (unlikely(nr == 0 || nr > TX_SW_TSO_MAX_SEGS ||
+		     net_hdr->tso_segsz + hdr_len >
+		     rte_pktmbuf_data_room_size(tx_sw_tso_pool) -
+		     RTE_PKTMBUF_HEADROOM)) {
+		log_warn_ratelimited("tx: can't segment %s packet (len %u)",
+				     udp ? "GSO" : "TSO", len);
+		goto done;
+	}
+
+	if (unlikely(rte_pktmbuf_alloc_bulk(tx_sw_tso_pool, sw_segs, nr))) {
+		stats[TX_COMPLETION_FAIL]++;
+		log_warn_ratelimited("tx: out of software TSO mbufs");
+		goto done;
+	}
+
+	seq = udp ? 0 : rte_be_to_cpu_32(tcphdr->sent_seq);
+	id = ip6 ? 0 : rte_be_to_cpu_16(iphdr->packet_id);
+	for (i = 0, off = 0; i < nr; i++, off += seg_len) {
+		m = sw_segs[i];
+		seg_len = min(payload_len - off, (unsigned int)net_hdr->tso_segsz);
+		data = rte_pktmbuf_append(m, hdr_len + seg_len);
+		memcpy(data, net_hdr->payload, hdr_len);
+		tx_copy_pkt(t->p, net_hdr, hdr_len + off, data + hdr_len,
+			    seg_len);
+
+		if (udp) {
+			seg_udphdr = (struct udp_hdr *)(data + ETHER_HDR_LEN +
+							l3_len);
+			seg_udphdr->dgram_len = rte_cpu_to_be_16(l4_len +
+								 seg_len);
+			cksum = &seg_udphdr->dgram_cksum;
+		} else {
+			seg_tcphdr = (struct tcp_hdr *)(data + ETHER_HDR_LEN +
+							l3_len);
+			seg_tcphdr->sent_seq = rte_cpu_to_be_32(seq + off);
+			if (i != nr - 1)
+				seg_tcphdr->tcp_flags &= ~TX_TCP_FIN_PSH;
+			cksum = &seg_tcphdr->cksum;
+		}
+
+		m->l2_len = ETHER_HDR_LEN;
+		m->l3_len = l3_len;
+		m->l4_len = l4_len;
+
+		/* IPv6 has no header checksum or fragment id to update */
+		if (ip6) {
+			seg_ip6hdr = (struct ipv6_hdr *)(data + ETHER_HDR_LEN);
+			seg_ip6hdr->payload_len = rte_cpu_to_be_16(l4_len +
+								   seg_len);
+			m->ol_flags = PKT_TX_IPV6 | l4_flag;
+			*cksum = rte_ipv6_phdr_cksum(seg_ip6hdr, m->ol_flags);
+			continue;
 		}
 
+		seg_iphdr = (struct ipv4_hdr *)(data + ETHER_HDR_LEN);
+		seg_iphdr->total_length = rte_cpu_to_be_16(l3_len + l4_len +
+							   seg_len);
+		seg_iphdr->packet_id = rte_cpu_to_be_16(id + i);
+		seg_iphdr->hdr_checksum = 0;
+		m->ol_flags = PKT_TX_IPV4 | PKT_TX_IP_CKSUM | l4_flag;
+		*cksum = rte_ipv4_phdr_cksum(seg_iphdr, m->ol_flags);
+	}
+
+	if (unlikely(dp.sw_csum)) {
+		for (i = 0; i < nr; i++)
+			tx_sw_csum(sw_segs[i]);
+	}
+
+	n_sw_segs = nr;
+	sw_segs_pos = 0;
+
+done:
+	if (likely(!t->p->kill))
+		tx_complete(t->p, t, net_hdr->completion_data);
+}
+
+/*
+ * Copy a multi-segment packet into one mbuf, for NICs that can't send mbuf
+ * chains or compute checksums. The runtime's buffer is completed right away.
+ */
+static void tx_sw_linearize(struct thread *t, const struct tx_net_hdr *net_hdr)
+{
+	const struct tx_offload_ent *ol;
+	unsigned int len = tx_pkt_len(net_hdr);
+	struct rte_mbuf *m;
+
+	STAT_INC(TX_SW_LINEARIZE, 1);
+
+	if (unlikely(len > rte_pktmbuf_data_room_size(tx_sw_tso_pool) -
+			   RTE_PKTMBUF_HEADROOM)) {
+		log_warn_ratelimited("tx: can't linearize packet (len %u)", len);
+		goto done;
+	}
+
+	m = rte_pktmbuf_alloc(tx_sw_tso_pool);
+	if (unlikely(!m)) {
+		stats[TX_COMPLETION_FAIL]++;
+		log_warn_ratelimited("tx: out of software TSO mbufs");
+		goto done;
+	}
+
+	tx_copy_pkt(t->p, net_hdr, 0, rte_pktmbuf_append(m, len), len);
+	ol = &tx_offload_tbl[net_hdr->olflags & (TX_OLFLAG_NR - 1)];
+	m->ol_flags = ol->ol_flags;
+	m->tx_offload = ol->tx_offload;
+	if (unlikely(dp.sw_csum))
+		tx_sw_csum(m);
+
+	/* sent like a software TSO segment, after the packets before it */
+	sw_segs[0] = m;
+	n_sw_segs = 1;
+	sw_segs_pos = 0;
+
+done:
+	if (likely(!t->p->kill))
+		tx_complete(t->p, t, net_hdr->completion_data);
+}
+
+/*
+ * Transmit pending software TSO segments. Returns true if all were sent.
+ */
+static bool tx_sw_tso_flush(void)
+{
+	int ret;
+
+	ret = rte_eth_tx_burst(dp.port, 0, &sw_segs[sw_segs_pos],
+			       n_sw_segs - sw_segs_pos);
+	sw_segs_pos += ret;
+	if (sw_segs_pos < n_sw_segs) {
+		STAT_INC(TX_BACKPRESSURE, n_sw_segs - sw_segs_pos);
+		return false;
+	}
+
+	n_sw_segs = sw_segs_pos = 0;
+	return true;
+}
+
+/*
+ * The egress scheduler: deficit round robin across procs, in front of the NIC.
+ *
+ * tx_burst() visits the threads in @ts in order, and a full pass is a round.
+ * The first time a proc is visited in a round, its deficit grows by its
+ * quantum, and its threads may send while the deficit is positive. A thread
+ * keeps its turn until its proc runs out or its queue is empty, so a bulk
+ * sender can't crowd out the packets of other procs for more than a quantum.
+ */
+
+static unsigned int tx_pos;
+static unsigned long tx_round;
+
+/**
+ * tx_init_proc - initializes a new proc's egress scheduler state
+ * @p: the proc
+ */
+void tx_init_proc(struct proc *p)
+{
+	p->tx_deficit = 0;
+	p->tx_round = ~0UL;
+	p->tx_tokens = 0;
+	p->tx_tokens_us = microtime();
+#ifdef STATS
+	p->tx_wait_us_total = p->tx_wait_samples = p->tx_wait_us_max = 0;
+	p->tx_queue_cycles = p->tx_queue_samples = 0;
+#endif
+}
+
+static void tx_sched_refill(struct proc *p, uint64_t now)
+{
+	int64_t quantum, burst;
+	unsigned int rate = p->sched_cfg.tx_rate_mbps;
+
+	if (p->tx_round != tx_round) {
+		/* unused allowance doesn't carry over past one quantum */
+		quantum = (int64_t)TX_DRR_QUANTUM * p->sched_cfg.weight;
+		p->tx_deficit = min(p->tx_deficit + quantum, quantum);
+		p->tx_round = tx_round;
+	}
+
+	if (rate) {
+		/* Mbits/s is bits per microsecond */
+		burst = (int64_t)rate * TX_RATE_BURST_US;
+		p->tx_tokens = min(p->tx_tokens +
+				   (int64_t)(now - p->tx_tokens_us) * rate, burst);
+		p->tx_tokens_us = now;
+	}
+}
+
+static bool tx_sched_admit(struct proc *p, unsigned int len)
+{
+	if (p->tx_deficit <= 0)
+		return false;
+	if (p->sched_cfg.tx_rate_mbps) {
+		if (p->tx_tokens <= 0)
+			return false;
+		p->tx_tokens -= (int64_t)len * 8;
+	}
+
+	p->tx_deficit -= len;
+	p->stats.tx_bytes += len;
+	p->stats.tx_pkts++;
+	return true;
+}
+
+/* records how long a thread's packets waited for the scheduler */
+static void tx_sched_account_wait(struct thread *t, uint64_t now,
+				  int consumed)
+{
+#ifdef STATS
+	struct proc *p = t->p;
+	uint64_t wait;
+
+	if (consumed == 0)
+		return;
+
+	wait = now - t->tx_wait_since_us;
+	p->tx_wait_us_total += wait;
+	p->tx_wait_samples++;
+	p->tx_wait_us_max = max(p->tx_wait_us_max, wait);
+	t->tx_wait_since_us = lrpc_empty(&t->txpktq) ? 0 : now;
+#endif
+}
+
+/* moves on to the next thread, starting a new round after the last one */
+static void tx_sched_advance(void)
+{
+	if (++tx_pos >= nrts) {
+		tx_pos = 0;
+		tx_round++;
+	}
+}
+
+static int tx_drain_queue(struct thread *t, int n,
+			  const struct tx_net_hdr **hdrs, uint64_t now)
+{
+	struct lrpc_msg msgs[IOKERNEL_TX_BURST_SIZE];
+	int i = 0, nr, consumed = 0;
+	unsigned int len;
+	bool tso, linearize;
+#ifdef STATS
+	uint64_t tsc;
+#endif
+
+	nr = lrpc_peek_burst(&t->txpktq, msgs, n);
+	if (nr == 0)
+		goto out;
+#ifdef STATS
+	tsc = rdtsc();
+#endif
+
+	if (!t->tx_wait_since_us)
+		t->tx_wait_since_us = now;
+	tx_sched_refill(t->p, now);
+	consumed = nr;
+
+	for (i = 0; i < nr; i++) {
 		/* TODO: need to kill the process? */
-		BUG_ON(cmd != TXPKT_NET_XMIT);
+		BUG_ON(msgs[i].cmd != TXPKT_NET_XMIT);
 
-		hdrs[i] = shmptr_to_ptr(&t->p->region, payload,
+		hdrs[i] = shmptr_to_ptr(&t->p->region, msgs[i].payload,
 					sizeof(struct tx_net_hdr));
 		/* TODO: need to kill the process? */
 		BUG_ON(!hdrs[i]);
+
+		len = hdrs[i]->len;
+		if (unlikely(hdrs[i]->nr_segs > 0)) {
+			/* drop a packet with bad segments, like a send error */
+			if (unlikely(!tx_segs_valid(t->p, msgs[i].payload,
+						    hdrs[i]))) {
+				STAT_INC(TX_BAD_SEGS, 1);
+				log_warn_ratelimited("tx: bad packet segments");
+				if (likely(!t->p->kill))
+					tx_complete(t->p, t,
+						    hdrs[i]->completion_data);
+				consumed = i + 1;
+				break;
+			}
+			len = tx_pkt_len(hdrs[i]);
+		}
+
+		/* leave the rest queued until the proc's next turn */
+		if (!tx_sched_admit(t->p, len)) {
+			consumed = i;
+			break;
+		}
+#ifdef STATS
+		t->p->tx_queue_cycles += tsc - hdrs[i]->tx_tsc;
+		t->p->tx_queue_samples++;
+#endif
+
+		/*
+		 * Segment in software if the NIC can't (UDP GSO always is),
+		 * and copy chains into one buffer if the NIC can't send them
+		 * or checksums are computed in software. Stop draining so that
+		 * the copies are sent after earlier packets.
+		 */
+		tso = hdrs[i]->olflags & OLFLAG_TCP_TSO;
+		linearize = hdrs[i]->nr_segs > 0 &&
+			    (!dp.tx_multi_seg || dp.sw_csum);
+		if (unlikely((tso && (!dp.tso || linearize)) ||
+			     (hdrs[i]->olflags & OLFLAG_UDP_GSO))) {
+			tx_sw_tso(t, hdrs[i]);
+			consumed = i + 1;
+			break;
+		}
+		if (unlikely(linearize)) {
+			tx_sw_linearize(t, hdrs[i]);
+			consumed = i + 1;
+			break;
+		}
 	}
 
+	/* release all of the slots at once */
+	lrpc_recv_commit(&t->txpktq, consumed);
+	tx_sched_account_wait(t, now, consumed);
+
+out:
+	/* idle threads are skipped, so this must catch the last packet */
+	if (unlikely(t->parked) && lrpc_empty(&t->txpktq))
+		unpoll_thread(t);
 	return i;
 }
 
 
+/*
+ * Copies a packet for a runtime on this host into an ingress mbuf. Returns
+ * NULL if it must go out on the NIC instead.
+ */
+static struct rte_mbuf *tx_loopback_copy(struct proc *p,
+					 const struct tx_net_hdr *hdr)
+{
+	unsigned int room = rte_pktmbuf_data_room_size(dp.rx_mbuf_pool) -
+			    RTE_PKTMBUF_HEADROOM;
+	unsigned int len = tx_pkt_len(hdr);
+	const struct ether_hdr *eth;
+	struct rte_mbuf *buf;
+
+	/* leave segmentation to the NIC or to software segmentation */
+	if ((hdr->olflags & (OLFLAG_TCP_TSO | OLFLAG_UDP_GSO)) ||
+	    len > room || hdr->len < ETHER_HDR_LEN)
+		return NULL;
+
+	eth = (const struct ether_hdr *)hdr->payload;
+	if (!rx_local_proc(&eth->d_addr))
+		return NULL;
+
+	buf = rte_pktmbuf_alloc(dp.rx_mbuf_pool);
+	if (unlikely(!buf))
+		return NULL;
+
+	tx_copy_pkt(p, hdr, 0, rte_pktmbuf_append(buf, len), len);
+
+	/* checksums left to offload were never computed, nor can be corrupted */
+	buf->ol_flags = PKT_RX_IP_CKSUM_GOOD | PKT_RX_L4_CKSUM_GOOD |
+			PKT_RX_RSS_HASH;
+	buf->hash.rss = rx_sw_flow_hash(buf);
+	return buf;
+}
+
+/*
+ * Delivers the packets in @hdrs that are for runtimes on this host straight
+ * to them, completing their egress buffers right away since they were copied.
+ * The rest are compacted to the front. Returns how many are left to send.
+ */
+BUILD_ASSERT(IOKERNEL_TX_BURST_SIZE <= IOKERNEL_RX_BURST_SIZE);
+
+static int tx_loopback_pkts(const struct tx_net_hdr **hdrs,
+			    struct thread **threads, int n)
+{
+	struct rte_mbuf *bufs[IOKERNEL_TX_BURST_SIZE];
+	struct rte_mbuf *buf;
+	int i, nr = 0, nr_loop = 0;
+
+	for (i = 0; i < n; i++) {
+		buf = tx_loopback_copy(threads[i]->p, hdrs[i]);
+		if (!buf) {
+			hdrs[nr] = hdrs[i];
+			threads[nr++] = threads[i];
+			continue;
+		}
+
+		bufs[nr_loop++] = buf;
+		if (tx_complete(threads[i]->p, threads[i],
+				hdrs[i]->completion_data))
+			STAT_INC(COMPLETION_ENQUEUED, 1);
+	}
+
+	if (nr_loop > 0) {
+		rx_loopback(bufs, nr_loop);
+		STAT_INC(TX_LOOPBACK, nr_loop);
+	}
+	return nr;
+}
+
 /*
  * Process a batch of outgoing packets.
  */
@@ -214,31 +955,63 @@ bool tx_burst(void)
 	static struct rte_mbuf *bufs[IOKERNEL_TX_BURST_SIZE];
 	struct thread *threads[IOKERNEL_TX_BURST_SIZE];
 	int i, j, ret, pulltotal = 0;
-	static unsigned int pos = 0, n_pkts = 0, n_bufs = 0;
+	static unsigned int n_pkts = 0, n_bufs = 0;
 	struct thread *t;
+	uint64_t now;
+
+	/* finish sending software TSO segments before pulling more packets */
+	if (unlikely(n_sw_segs > 0))
+		goto full;
 
 	/*
-	 * Poll each kthread in each runtime until all have been polled or we
-	 * have PKT_BURST_SIZE pkts.
+	 * Poll each kthread in each runtime, in scheduler order, until all
+	 * have been polled or we have PKT_BURST_SIZE pkts.
 	 */
+	now = microtime();
+	if (tx_pos >= nrts)
+		tx_pos = 0;
 	for (i = 0; i < nrts; i++) {
-		unsigned int idx = (pos + i) % nrts;
-		t = ts[idx];
-
 		if (n_pkts >= IOKERNEL_TX_BURST_SIZE)
 			goto full;
+
+		/* most threads are idle, so look ahead at their queues */
+		if (i + TX_PREFETCH_STRIDE < nrts)
+			prefetch(ts_poll[(tx_pos + TX_PREFETCH_STRIDE) %
+					 nrts].txpktq_next);
+		if (!thread_poll_has_pkts(&ts_poll[tx_pos])) {
+			tx_sched_advance();
+			continue;
+		}
+
+		t = ts[tx_pos];
 		ret = tx_drain_queue(t, IOKERNEL_TX_BURST_SIZE - n_pkts,
-				     &hdrs[n_pkts]);
+				     &hdrs[n_pkts], now);
+		thread_poll_refresh(t);
 		for (j = n_pkts; j < n_pkts + ret; j++)
 			threads[j] = t;
 		n_pkts += ret;
 		pulltotal += ret;
+		if (unlikely(n_sw_segs > 0))
+			break;
+
+		/* a thread that filled the burst may have more to send */
+		if (n_pkts >= IOKERNEL_TX_BURST_SIZE)
+			break;
+		tx_sched_advance();
 	}
 
-	if (n_pkts == 0)
-		return false;
+	if (tx_loopback && n_pkts > n_bufs) {
+		n_pkts = n_bufs + tx_loopback_pkts(&hdrs[n_bufs],
+						   &threads[n_bufs],
+						   n_pkts - n_bufs);
+		if (n_pkts == 0 && n_sw_segs == 0) {
+			stats[TX_PULLED] += pulltotal;
+			return true;
+		}
+	}
 
-	pos++;
+	if (n_pkts == 0 && n_sw_segs == 0)
+		return false;
 
 full:
 
@@ -255,11 +1028,32 @@ full:
 		}
 	}
 
-	/* fill in packet metadata */
-	for (i = n_bufs; i < n_pkts; i++) {
+	/* fill in packet metadata, dropping packets that can't be sent */
+	for (i = j = n_bufs; i < n_pkts; i++) {
 		if (i + TX_PREFETCH_STRIDE < n_pkts)
 			prefetch(hdrs[i + TX_PREFETCH_STRIDE]);
-		tx_prepare_tx_mbuf(bufs[i], hdrs[i], threads[i]);
+		if (unlikely(!tx_prepare_tx_mbuf(bufs[j], hdrs[i], threads[i]))) {
+			stats[TX_COMPLETION_FAIL]++;
+			if (likely(!threads[i]->p->kill))
+				tx_complete(threads[i]->p, threads[i],
+					    hdrs[i]->completion_data);
+			continue;
+		}
+		if (unlikely(dp.sw_csum))
+			tx_sw_csum(bufs[j]);
+		/* only the first segment of a chain is captured */
+		pcap_capture(rte_pktmbuf_mtod(bufs[j], void *),
+			     rte_pktmbuf_data_len(bufs[j]), IKPCAP_DIR_TX);
+		j++;
+	}
+
+	/* the mbufs left over by dropped packets have no completions */
+	if (unlikely(j < n_pkts)) {
+		for (i = j; i < n_pkts; i++)
+			tx_pktmbuf_get_priv(bufs[i])->p = NULL;
+		rte_mempool_put_bulk(tx_mbuf_pool, (void **)&bufs[j],
+				     n_pkts - j);
+		n_pkts = j;
 	}
 
 	n_bufs = n_pkts;
@@ -279,9 +1073,62 @@ full:
 	}
 
 	n_bufs = n_pkts;
+
+	/* send software TSO segments once the packets before them are out */
+	if (unlikely(n_sw_segs > 0) && n_pkts == 0)
+		tx_sw_tso_flush();
 	return true;
 }
 
+/*
+ * Fills in tx_offload_tbl and tx_mbuf_rearm, which tx_prepare_tx_mbuf() copies
+ * into each mbuf instead of deriving its fields packet by packet.
+ */
+static void tx_init_offloads(void)
+{
+	struct rte_mbuf m;
+	unsigned int f;
+
+	BUILD_ASSERT(((OLFLAG_IP_CHKSUM | OLFLAG_TCP_CHKSUM | OLFLAG_IPV4 |
+		       OLFLAG_IPV6 | OLFLAG_TCP_TSO | OLFLAG_UDP_CHKSUM) &
+		      ~(TX_OLFLAG_NR - 1)) == 0);
+
+	for (f = 0; f < TX_OLFLAG_NR; f++) {
+		memset(&m, 0, sizeof(m));
+		if (f & OLFLAG_IP_CHKSUM)
+			m.ol_flags |= PKT_TX_IP_CKSUM;
+		if (f & OLFLAG_TCP_CHKSUM)
+			m.ol_flags |= PKT_TX_TCP_CKSUM;
+		if (f & OLFLAG_UDP_CHKSUM)
+			m.ol_flags |= PKT_TX_UDP_CKSUM;
+		if (f & OLFLAG_IPV4)
+			m.ol_flags |= PKT_TX_IPV4;
+		if (f & OLFLAG_IPV6)
+			m.ol_flags |= PKT_TX_IPV6;
+
+		if (f != 0) {
+			m.l4_len = (f & OLFLAG_UDP_CHKSUM) ?
+				   sizeof(struct udp_hdr) :
+				   sizeof(struct tcp_hdr);
+			m.l3_len = (f & OLFLAG_IPV6) ?
+				   sizeof(struct ipv6_hdr) :
+				   sizeof(struct ipv4_hdr);
+			m.l2_len = ETHER_HDR_LEN;
+		}
+
+		tx_offload_tbl[f].ol_flags = m.ol_flags;
+		tx_offload_tbl[f].tx_offload = m.tx_offload;
+	}
+
+	/* what rte_pktmbuf_init() leaves, with the data at the buffer start */
+	memset(&m, 0, sizeof(m));
+	m.data_off = 0;
+	rte_mbuf_refcnt_set(&m, 1);
+	m.nb_segs = 1;
+	m.port = MBUF_INVALID_PORT;
+	tx_mbuf_rearm = *(uint64_t *)&m.rearm_data;
+}
+
 /*
  * Zero out private data for a packet
  */
@@ -348,6 +1195,8 @@ static struct rte_mempool *tx_pktmbuf_completion_pool_create(const char *name,
  */
 int tx_init()
 {
+	tx_init_offloads();
+
 	/* create a mempool to hold struct rte_mbufs and handle completions */
 	tx_mbuf_pool = tx_pktmbuf_completion_pool_create("TX_MBUF_POOL",
 			IOKERNEL_NUM_COMPLETIONS, sizeof(struct tx_pktmbuf_priv),
@@ -358,5 +1207,14 @@ int tx_init()
 		return -1;
 	}
 
+	/* create a mempool for segmenting UDP GSO and (if the NIC can't) TSO packets */
+	tx_sw_tso_pool = rte_pktmbuf_pool_create("TX_SW_TSO_POOL",
+			TX_SW_TSO_POOL_SIZE, TX_SW_TSO_POOL_CACHE, 0,
+			rx_mbuf_buf_size(), rte_socket_id());
+	if (tx_sw_tso_pool == NULL) {
+		log_err("tx: couldn't create software TSO mbuf pool");
+		return -1;
+	}
+
 	return 0;
 }
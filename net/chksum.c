@@ -0,0 +1,71 @@
+/*
+ * chksum.c - vectorized internet checksums for large buffers
+ */
+
+#include <immintrin.h>
+
+#include <base/stddef.h>
+#include <net/chksum.h>
+
+/* 32-bit lanes absorb one 16-bit word per 32-byte step, so fold before 2^16 */
+#define CHKSUM_AVX2_FOLD_STEPS	32768
+
+/* 0 if not yet probed, otherwise 1 if AVX2 is available or -1 if not */
+static int chksum_avx2;
+
+static __attribute__((target("avx2"))) uint64_t
+__raw_cksum_avx2(const void *buf, size_t len)
+{
+	const __m256i *p = buf;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo, hi, v;
+	uint32_t lanes[8];
+	uint64_t sum = 0;
+	size_t steps, i;
+	int j;
+
+	while (len >= sizeof(*p)) {
+		steps = min(len / sizeof(*p), (size_t)CHKSUM_AVX2_FOLD_STEPS);
+		lo = hi = zero;
+		for (i = 0; i < steps; i++) {
+			v = _mm256_loadu_si256(p++);
+			lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(v, zero));
+			hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(v, zero));
+		}
+		len -= steps * sizeof(*p);
+
+		_mm256_storeu_si256((__m256i *)lanes, lo);
+		for (j = 0; j < 8; j++)
+			sum += lanes[j];
+		_mm256_storeu_si256((__m256i *)lanes, hi);
+		for (j = 0; j < 8; j++)
+			sum += lanes[j];
+	}
+
+	/* the rest starts on an even offset, so words stay aligned */
+	return sum + __raw_cksum(p, len, 0);
+}
+
+/**
+ * __raw_cksum_large - sums the 16-bit words of a large buffer
+ * @buf: the buffer
+ * @len: the length in bytes
+ * @sum: the initial value of the sum
+ *
+ * Uses AVX2 if the CPU supports it. Returns @sum plus the sum of all words,
+ * folded so that it fits in 32 bits.
+ */
+uint32_t __raw_cksum_large(const void *buf, size_t len, uint32_t sum)
+{
+	uint64_t s;
+
+	if (unlikely(!chksum_avx2))
+		chksum_avx2 = __builtin_cpu_supports("avx2") ? 1 : -1;
+	if (chksum_avx2 < 0)
+		return __raw_cksum_reduce(__raw_cksum(buf, len, 0)) + sum;
+
+	s = __raw_cksum_avx2(buf, len);
+	while (s >> 16)
+		s = (s & 0xffff) + (s >> 16);
+	return (uint32_t)s + sum;
+}
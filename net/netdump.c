@@ -5,7 +5,9 @@
  * for debugging, but could also serve a role in error reporting.
  */
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <base/stddef.h>
 #include <base/log.h>
@@ -13,6 +15,7 @@
 #include <net/ethernet.h>
 #include <net/arp.h>
 #include <net/ip.h>
+#include <net/ip6.h>
 #include <net/udp.h>
 
 /**
@@ -125,3 +128,96 @@ char *ip_addr_to_str(uint32_t addr, char *str)
                  (addr & 0xff));
 	return str;
 }
+
+/**
+ * ip6_addr_to_str - prints an IPv6 address as a human-readable string
+ * @addr: the IPv6 address
+ * @str: a buffer to store the string
+ *
+ * The buffer must be IP6_ADDR_STR_LEN in size.
+ */
+char *ip6_addr_to_str(const struct ip6_addr *addr, char *str)
+{
+	uint16_t w[8];
+	int i, d = 0, run, best = -1, best_len = 1;
+
+	for (i = 0; i < 8; i++)
+		w[i] = (addr->addr[i * 2] << 8) | addr->addr[i * 2 + 1];
+
+	/* find the longest run of zero words (at least two) to elide */
+	for (i = 0; i < 8; i += run ? run : 1) {
+		for (run = 0; i + run < 8 && w[i + run] == 0; run++);
+		if (run > best_len) {
+			best = i;
+			best_len = run;
+		}
+	}
+
+	for (i = 0; i < 8; i++) {
+		if (i == best) {
+			d += snprintf(str + d, IP6_ADDR_STR_LEN - d, "::");
+			i += best_len - 1;
+			continue;
+		}
+		d += snprintf(str + d, IP6_ADDR_STR_LEN - d, "%s%x",
+			      (i == 0 || i == best + best_len) ? "" : ":",
+			      w[i]);
+	}
+	return str;
+}
+
+/**
+ * str_to_ip6_addr - parses an IPv6 address
+ * @str: a string in the standard notation (e.g. "fd00::1")
+ * @addr: stores the address
+ *
+ * Embedded IPv4 notation isn't supported. Returns 0 if successful, otherwise
+ * -EINVAL.
+ */
+int str_to_ip6_addr(const char *str, struct ip6_addr *addr)
+{
+	uint16_t w[8];
+	int i, n = 0, gap = -1;
+	unsigned long val;
+	char *end;
+
+	if (str[0] == ':' && str[1] == ':') {
+		gap = 0;
+		str += 2;
+	}
+
+	while (*str) {
+		if (n == 8)
+			return -EINVAL;
+		val = strtoul(str, &end, 16);
+		if (end == str || end - str > 4 || val > 0xffff)
+			return -EINVAL;
+		w[n++] = val;
+		str = end;
+		if (*str == '\0')
+			break;
+		if (*str != ':')
+			return -EINVAL;
+		str++;
+		if (*str == ':') {
+			if (gap >= 0)
+				return -EINVAL;
+			gap = n;
+			str++;
+		} else if (*str == '\0') {
+			return -EINVAL;
+		}
+	}
+
+	if ((gap < 0 && n != 8) || (gap >= 0 && n == 8))
+		return -EINVAL;
+
+	memset(addr, 0, sizeof(*addr));
+	for (i = 0; i < n; i++) {
+		int pos = (gap >= 0 && i >= gap) ? 8 - n + i : i;
+
+		addr->addr[pos * 2] = w[i] >> 8;
+		addr->addr[pos * 2 + 1] = w[i] & 0xff;
+	}
+	return 0;
+}
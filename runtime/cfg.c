@@ -8,14 +8,18 @@
 #include <limits.h>
 
 #include <base/stddef.h>
+#include <base/allocprof.h>
 #include <base/bitmap.h>
 #include <base/log.h>
 #include <base/cpu.h>
+#include <runtime/overload.h>
 
 #include "defs.h"
 
 int arp_static_count = 0;
 struct cfg_arp_static_entry static_entries[MAX_ARP_STATIC_ENTRIES];
+/* the hard limit on kthreads (runtime_max_kthreads), or 0 for none */
+static unsigned int cfg_max_kthreads;
 
 /*
  * Configuration Options
@@ -97,6 +101,56 @@ static int parse_host_ip(const char *name, const char *val)
 	return 0;
 }
 
+/* copies the first word of a value, without its trailing newline */
+static int cfg_copy_word(const char *val, char *buf, size_t len)
+{
+	size_t n;
+
+	if (!val)
+		return -EINVAL;
+	n = strcspn(val, " \n");
+	if (n == 0 || n >= len)
+		return -EINVAL;
+	memcpy(buf, val, n);
+	buf[n] = '\0';
+	return 0;
+}
+
+static int parse_host_ip6(const char *name, const char *val)
+{
+	char buf[IP6_ADDR_STR_LEN + 4], *slash;
+	struct ip6_addr addr;
+	long len;
+
+	if (cfg_copy_word(val, buf, sizeof(buf)))
+		return -EINVAL;
+
+	if (!strcmp(name, "host_gateway6")) {
+		if (str_to_ip6_addr(buf, &netcfg6.gateway)) {
+			log_err("invalid IPv6 gateway: %s", buf);
+			return -EINVAL;
+		}
+		return 0;
+	}
+
+	slash = strchr(buf, '/');
+	if (!slash || str_to_long(slash + 1, &len) || len < 1 || len > 128) {
+		log_err("IPv6 address needs a prefix length (e.g. fd00::5/64)");
+		return -EINVAL;
+	}
+	*slash = '\0';
+	if (str_to_ip6_addr(buf, &addr) || ip6_addr_is_zero(&addr) ||
+	    ip6_addr_is_multicast(&addr)) {
+		log_err("invalid IPv6 address: %s", buf);
+		return -EINVAL;
+	}
+
+	netcfg6.addr = addr;
+	netcfg6.prefix_len = len;
+	netcfg6.enabled = true;
+	return 0;
+}
+
 static int parse_runtime_kthreads(const char *name, const char *val)
 {
 	long tmp;
@@ -116,6 +170,25 @@ static int parse_runtime_kthreads(const char *name, const char *val)
 	return 0;
 }
 
+static int parse_runtime_max_kthreads(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 1 || tmp > cpu_count - 1) {
+		log_err("invalid maximum number of kthreads requested, '%ld'", tmp);
+		log_err("must be > 0 and < %d (number of CPUs)", cpu_count);
+		return -EINVAL;
+	}
+
+	cfg_max_kthreads = tmp;
+	return 0;
+}
+
 static int parse_runtime_spinning_kthreads(const char *name, const char *val)
 {
 	long tmp;
@@ -131,7 +204,31 @@ static int parse_runtime_spinning_kthreads(const char *name, const char *val)
 		return -EINVAL;
 	}
 
-	spinks = tmp;
+	if (!strcmp(name, "runtime_spinning_kthreads_max")) {
+		spinks_max = tmp;
+	} else {
+		spinks = tmp;
+		spinks_min = tmp;
+	}
+	return 0;
+}
+
+static int parse_runtime_offload_threads(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > RUNTIME_OFFLOAD_MAX_THREADS) {
+		log_err("%s must be between 0 and %d", name,
+			RUNTIME_OFFLOAD_MAX_THREADS);
+		return -EINVAL;
+	}
+
+	offload_threads = tmp;
 	return 0;
 }
 
@@ -156,6 +253,121 @@ static int parse_runtime_guaranteed_kthreads(const char *name, const char *val)
 	return 0;
 }
 
+static int parse_runtime_latency(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > ONE_SECOND) {
+		log_err("%s must be between 0 and %d", name, ONE_SECOND);
+		return -EINVAL;
+	}
+
+	if (!strcmp(name, "runtime_congestion_latency_us"))
+		congestion_latency_us = tmp;
+	else
+		scaleout_latency_us = tmp;
+	return 0;
+}
+
+static int parse_qdelay_target(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > ONE_SECOND) {
+		log_err("%s must be between 0 and %d", name, ONE_SECOND);
+		return -EINVAL;
+	}
+
+	overload_target_us = tmp;
+	return 0;
+}
+
+static int parse_runtime_priority(const char *name, const char *val)
+{
+	if (!val)
+		return -EINVAL;
+
+	if (!strcmp(val, "system")) {
+		sched_priority = SCHED_PRIORITY_SYSTEM;
+	} else if (!strcmp(val, "normal")) {
+		sched_priority = SCHED_PRIORITY_NORMAL;
+	} else if (!strcmp(val, "batch")) {
+		sched_priority = SCHED_PRIORITY_BATCH;
+	} else {
+		log_err("runtime_priority must be system, normal, or batch");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int parse_runtime_weight(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 1 || tmp > SCHED_WEIGHT_MAX) {
+		log_err("runtime_weight must be between 1 and %d",
+			SCHED_WEIGHT_MAX);
+		return -EINVAL;
+	}
+
+	sched_weight = tmp;
+	return 0;
+}
+
+static int parse_runtime_ht_policy(const char *name, const char *val)
+{
+	if (!val)
+		return -EINVAL;
+
+	if (!strcmp(val, "share")) {
+		sched_ht_policy = SCHED_HT_SHARE;
+	} else if (!strcmp(val, "pair")) {
+		sched_ht_policy = SCHED_HT_PAIR;
+	} else if (!strcmp(val, "exclusive")) {
+		sched_ht_policy = SCHED_HT_EXCLUSIVE;
+	} else {
+		log_err("runtime_ht_policy must be share, pair, or exclusive");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int parse_runtime_tx_rate(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > SCHED_TX_RATE_MAX_MBPS) {
+		log_err("runtime_tx_rate_mbps must be between 0 and %d",
+			SCHED_TX_RATE_MAX_MBPS);
+		return -EINVAL;
+	}
+
+	sched_tx_rate_mbps = tmp;
+	return 0;
+}
+
 static int parse_mac_address(const char *name, const char *val)
 {
 	int ret = str_to_mac(val, &netcfg.mac);
@@ -164,12 +376,114 @@ static int parse_mac_address(const char *name, const char *val)
 	return ret;
 }
 
+static int parse_mtu(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < IP_MIN_MTU || tmp > ETH_MTU_JUMBO) {
+		log_err("mtu must be between %d and %d", IP_MIN_MTU,
+			ETH_MTU_JUMBO);
+		return -EINVAL;
+	}
+
+	netcfg.mtu = tmp;
+	return 0;
+}
+
 static int parse_watchdog_flag(const char *name, const char *val)
 {
 	disable_watchdog = true;
 	return 0;
 }
 
+static int parse_sched_tunable(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > ONE_SECOND) {
+		log_err("%s must be between 0 and %d", name, ONE_SECOND);
+		return -EINVAL;
+	}
+
+	if (!strcmp(name, "runtime_sched_poll_iters")) {
+		sched_poll_iters = tmp;
+	} else if (!strcmp(name, "runtime_sched_min_poll_us")) {
+		sched_min_poll_us = tmp;
+	} else if (!strcmp(name, "runtime_softirq_starve_us")) {
+		softirq_starve_us = tmp;
+	} else if (!strcmp(name, "runtime_timer_spin_us")) {
+		timer_spin_us = tmp;
+	} else if (!strcmp(name, "runtime_spin_qdelay_us")) {
+		spin_qdelay_us = tmp;
+	} else {
+		if (tmp == 0) {
+			log_err("%s must be > 0, use disable_watchdog instead",
+				name);
+			return -EINVAL;
+		}
+		watchdog_us = tmp;
+	}
+	return 0;
+}
+
+static int parse_stat_page_flag(const char *name, const char *val)
+{
+	stat_page_enabled = true;
+	return 0;
+}
+
+static int parse_prereg_flag(const char *name, const char *val)
+{
+	prereg_enabled = true;
+	return 0;
+}
+
+static int parse_flow_affinity_flag(const char *name, const char *val)
+{
+	flow_affinity = true;
+	return 0;
+}
+
+static int parse_edf_drop_expired_flag(const char *name, const char *val)
+{
+	edf_drop_expired = true;
+	return 0;
+}
+
+static int parse_tso_flag(const char *name, const char *val)
+{
+	enable_tso = true;
+	return 0;
+}
+
+static int parse_tcp_pacing_flag(const char *name, const char *val)
+{
+	tcp_pacing = true;
+	return 0;
+}
+
+static int parse_stack_hugepages_flag(const char *name, const char *val)
+{
+	stack_hugepages = true;
+	return 0;
+}
+
+static int parse_stack_depth_flag(const char *name, const char *val)
+{
+	stack_depth_enabled = true;
+	return 0;
+}
+
 static int parse_static_arp_entry(const char *name, const char *val)
 {
 	int ret;
@@ -192,6 +506,272 @@ static int parse_static_arp_entry(const char *name, const char *val)
 	return 0;
 }
 
+/* e.g. "host_route 10.2.0.0/16 10.0.0.254", or a gateway of 0.0.0.0 if on-link */
+static int parse_host_route(const char *name, const char *val)
+{
+	struct cfg_route *r = &route_entries[route_count];
+	uint8_t a, b, c, d;
+	const char *gw;
+	int ret;
+
+	if (route_count >= MAX_ROUTES) {
+		log_err("too many routes, the limit is %d", MAX_ROUTES);
+		return -EINVAL;
+	}
+
+	if (!val || sscanf(val, "%hhu.%hhu.%hhu.%hhu/%d",
+			   &a, &b, &c, &d, &r->len) != 5 ||
+	    r->len < 0 || r->len > 32) {
+		log_err("Could not parse route prefix: %s", val);
+		return -EINVAL;
+	}
+	r->prefix = MAKE_IP_ADDR(a, b, c, d);
+
+	gw = strtok(NULL, " ");
+	ret = gw ? str_to_ip(gw, &r->gateway) : -EINVAL;
+	if (ret) {
+		log_err("Could not parse route gateway for: %s", val);
+		return ret;
+	}
+
+	route_count++;
+	return 0;
+}
+
+static int parse_tcp_congestion_control(const char *name, const char *val)
+{
+	if (!val)
+		return -EINVAL;
+
+	return tcp_cc_set_default(val);
+}
+
+static int parse_tcp_rto_min(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 1 || tmp > ONE_SECOND) {
+		log_err("tcp_rto_min_us must be between 1 and %d", ONE_SECOND);
+		return -EINVAL;
+	}
+
+	tcp_rto_min = tmp;
+	return 0;
+}
+
+static int parse_tcp_ack_timeout(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 1 || tmp > ONE_SECOND) {
+		log_err("tcp_ack_timeout_us must be between 1 and %d",
+			ONE_SECOND);
+		return -EINVAL;
+	}
+
+	tcp_ack_timeout = tmp;
+	return 0;
+}
+
+static int parse_tcp_syn_backlog(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > INT_MAX) {
+		log_err("tcp_syn_backlog must be between 0 and %d", INT_MAX);
+		return -EINVAL;
+	}
+
+	tcp_syn_backlog = tmp;
+	return 0;
+}
+
+static int parse_mem_reclaim_idle(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > 3600L * ONE_SECOND) {
+		log_err("mem_reclaim_idle_us must be between 0 and %ld",
+			3600L * ONE_SECOND);
+		return -EINVAL;
+	}
+
+	page_reclaim_idle_us = tmp;
+	return 0;
+}
+
+static int parse_mem_reclaim_watermark(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > INT_MAX) {
+		log_err("mem_reclaim_watermark_mb must be between 0 and %d",
+			INT_MAX);
+		return -EINVAL;
+	}
+
+	/* in units of large pages */
+	page_reclaim_watermark = div_up(tmp * 1024 * 1024, PGSIZE_2MB);
+	return 0;
+}
+
+static int parse_allocprof_rate(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > UINT_MAX) {
+		log_err("allocprof_rate must be between 0 and %u", UINT_MAX);
+		return -EINVAL;
+	}
+
+	allocprof_set_rate(tmp);
+	return 0;
+}
+
+static int parse_cpuprof_hz(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > 10000) {
+		log_err("runtime_cpuprof_hz must be between 0 and 10000");
+		return -EINVAL;
+	}
+
+	cpuprof_hz = tmp;
+	return 0;
+}
+
+static int parse_rx_priority_dscp(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	/* 0 leaves priority to the application */
+	if (tmp < 0 || tmp > 63) {
+		log_err("rx_priority_dscp must be between 0 and 63");
+		return -EINVAL;
+	}
+
+	trans_rx_prio_dscp = tmp;
+	return 0;
+}
+
+static int parse_tcp_timer_slack(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > ONE_SECOND) {
+		log_err("tcp_timer_slack_us must be between 0 and %d",
+			ONE_SECOND);
+		return -EINVAL;
+	}
+
+	tcp_timer_slack = tmp;
+	return 0;
+}
+
+static int parse_preempt_quantum(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > ONE_SECOND) {
+		log_err("runtime_quantum_us must be between 0 and %d", ONE_SECOND);
+		return -EINVAL;
+	}
+
+	preempt_quantum_us = tmp;
+	return 0;
+}
+
+static int parse_stack_watermark(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > RUNTIME_MAX_THREADS) {
+		log_err("runtime_stack_watermark must be between 0 and %d",
+			RUNTIME_MAX_THREADS);
+		return -EINVAL;
+	}
+
+	stack_reclaim_watermark = tmp;
+	return 0;
+}
+
+static int parse_tcp_buffer(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 1 || tmp > TCP_MAX_BUF) {
+		log_err("%s must be between 1 and %d", name, TCP_MAX_BUF);
+		return -EINVAL;
+	}
+
+	if (!strcmp(name, "tcp_rx_buffer"))
+		tcp_rx_buf_default = tmp;
+	else
+		tcp_tx_buf_default = tmp;
+	return 0;
+}
+
 static int parse_log_level(const char *name, const char *val)
 {
 	long tmp;
@@ -211,6 +791,15 @@ static int parse_log_level(const char *name, const char *val)
 	return 0;
 }
 
+static int parse_log_async_flag(const char *name, const char *val)
+{
+	int ret = log_async_init();
+
+	if (ret)
+		log_err("couldn't start the log thread, ret = %d", ret);
+	return ret;
+}
+
 
 /*
  * Parsing Infrastructure
@@ -228,14 +817,58 @@ static const struct cfg_handler cfg_handlers[] = {
 	{ "host_addr", parse_host_ip, true },
 	{ "host_netmask", parse_host_ip, true },
 	{ "host_gateway", parse_host_ip, true },
+	{ "host_addr6", parse_host_ip6, false },
+	{ "host_gateway6", parse_host_ip6, false },
 	{ "host_mac", parse_mac_address, false },
+	{ "mtu", parse_mtu, false },
 	{ "runtime_kthreads", parse_runtime_kthreads, true },
+	{ "runtime_max_kthreads", parse_runtime_max_kthreads, false },
 	{ "runtime_spinning_kthreads", parse_runtime_spinning_kthreads, false },
+	{ "runtime_spinning_kthreads_max", parse_runtime_spinning_kthreads,
+			false },
 	{ "runtime_guaranteed_kthreads", parse_runtime_guaranteed_kthreads,
 			false },
+	{ "runtime_offload_threads", parse_runtime_offload_threads, false },
 	{ "static_arp", parse_static_arp_entry, false },
+	{ "host_route", parse_host_route, false },
 	{ "log_level", parse_log_level, false },
+	{ "runtime_log_async", parse_log_async_flag, false },
 	{ "disable_watchdog", parse_watchdog_flag, false },
+	{ "runtime_stat_page", parse_stat_page_flag, false },
+	{ "runtime_prereg", parse_prereg_flag, false },
+	{ "runtime_flow_affinity", parse_flow_affinity_flag, false },
+	{ "runtime_watchdog_us", parse_sched_tunable, false },
+	{ "runtime_sched_poll_iters", parse_sched_tunable, false },
+	{ "runtime_sched_min_poll_us", parse_sched_tunable, false },
+	{ "runtime_softirq_starve_us", parse_sched_tunable, false },
+	{ "runtime_timer_spin_us", parse_sched_tunable, false },
+	{ "runtime_spin_qdelay_us", parse_sched_tunable, false },
+	{ "runtime_quantum_us", parse_preempt_quantum, false },
+	{ "runtime_edf_drop_expired", parse_edf_drop_expired_flag, false },
+	{ "runtime_stack_watermark", parse_stack_watermark, false },
+	{ "runtime_stack_hugepages", parse_stack_hugepages_flag, false },
+	{ "runtime_stack_depth", parse_stack_depth_flag, false },
+	{ "runtime_congestion_latency_us", parse_runtime_latency, false },
+	{ "runtime_scaleout_latency_us", parse_runtime_latency, false },
+	{ "runtime_qdelay_target_us", parse_qdelay_target, false },
+	{ "runtime_priority", parse_runtime_priority, false },
+	{ "runtime_weight", parse_runtime_weight, false },
+	{ "runtime_ht_policy", parse_runtime_ht_policy, false },
+	{ "runtime_tx_rate_mbps", parse_runtime_tx_rate, false },
+	{ "enable_tso", parse_tso_flag, false },
+	{ "tcp_congestion_control", parse_tcp_congestion_control, false },
+	{ "tcp_rto_min_us", parse_tcp_rto_min, false },
+	{ "tcp_ack_timeout_us", parse_tcp_ack_timeout, false },
+	{ "tcp_timer_slack_us", parse_tcp_timer_slack, false },
+	{ "rx_priority_dscp", parse_rx_priority_dscp, false },
+	{ "tcp_syn_backlog", parse_tcp_syn_backlog, false },
+	{ "tcp_pacing", parse_tcp_pacing_flag, false },
+	{ "tcp_rx_buffer", parse_tcp_buffer, false },
+	{ "mem_reclaim_idle_us", parse_mem_reclaim_idle, false },
+	{ "mem_reclaim_watermark_mb", parse_mem_reclaim_watermark, false },
+	{ "tcp_tx_buffer", parse_tcp_buffer, false },
+	{ "allocprof_rate", parse_allocprof_rate, false },
+	{ "runtime_cpuprof_hz", parse_cpuprof_hz, false },
 };
 
 /**
@@ -290,6 +923,10 @@ int cfg_load(const char *path)
 	for (i = 0; i < ARRAY_SIZE(cfg_handlers); i++) {
 		const struct cfg_handler *h = &cfg_handlers[i];
 		if (h->required && !bitmap_test(parsed, i)) {
+			/* an IPv6-only host needs no IPv4 addressing */
+			if (netcfg6.enabled && !netcfg.addr &&
+			    !strncmp(h->name, "host_", 5))
+				continue;
 			log_err("missing required config option '%s'", h->name);
 			ret = -EINVAL;
 			goto out;
@@ -304,6 +941,26 @@ int cfg_load(const char *path)
 		goto out;
 	}
 
+	/* without a maximum, the number of spinning kthreads stays fixed */
+	if (spinks_max && spinks_max < spinks_min) {
+		log_err("runtime_spinning_kthreads_max must be >= %d "
+			"(runtime_spinning_kthreads)", spinks_min);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* extra kthreads are set up now, but only run once the limit grows */
+	kthread_limit = maxks;
+	if (cfg_max_kthreads) {
+		if (cfg_max_kthreads < maxks) {
+			log_err("runtime_max_kthreads must be >= %d "
+				"(runtime_kthreads)", maxks);
+			ret = -EINVAL;
+			goto out;
+		}
+		maxks = cfg_max_kthreads;
+	}
+
 out:
 	fclose(f);
 	return ret;
@@ -0,0 +1,478 @@
+/*
+ * chan.c - channels for passing messages between threads
+ *
+ * Messages go through a lock-free MPMC ring (Vyukov's bounded queue), so a
+ * send or receive that doesn't have to wait is one compare-and-swap. Threads
+ * that have to wait park on lists under a spinlock, and counts of the parked
+ * threads let the other side skip the lock while nobody is waiting. A send to
+ * a parked receiver hands the message over directly instead of going through
+ * the ring. Unbounded channels spill messages that don't fit in the ring to a
+ * list under the lock, and senders use the list until receivers drain it, so
+ * messages stay in order.
+ */
+
+#include <stdlib.h>
+
+#include <base/stddef.h>
+#include <base/list.h>
+#include <base/lock.h>
+#include <runtime/chan.h>
+#include <runtime/preempt.h>
+#include <runtime/smalloc.h>
+#include <runtime/sync.h>
+#include <runtime/thread.h>
+
+#include "defs.h"
+
+/* the most messages a channel's ring can hold */
+#define CHAN_MAX_CAP	(1 << 24)
+
+struct chan_slot {
+	uint64_t		seq;
+	void			*msg;
+};
+
+/* a thread parked in chan_send() or chan_recv(), on its stack */
+struct chan_waiter {
+	struct list_node	link;
+	thread_t		*th;
+	void			*msg;
+	bool			handed;	/* a sender passed @msg directly */
+};
+
+/* a message that didn't fit in an unbounded channel's ring */
+struct chan_spill {
+	struct list_node	link;
+	void			*msg;
+};
+
+struct chan {
+	/* read-mostly */
+	uint64_t		mask;
+	bool			unbounded;
+	bool			closed;
+	struct chan_slot	*slots;
+
+	/* the next positions to send to and receive from */
+	uint64_t		tail __aligned(CACHE_LINE_SIZE);
+	uint64_t		head __aligned(CACHE_LINE_SIZE);
+
+	/* the slow path, protected by @lock (the counts are read without) */
+	spinlock_t		lock __aligned(CACHE_LINE_SIZE);
+	int			nr_recv_waiters;
+	int			nr_send_waiters;
+	unsigned int		nr_spilled;
+	struct list_head	recv_waiters;
+	struct list_head	send_waiters;
+	struct list_head	spilled;
+};
+
+static bool chan_ring_push(chan_t *ch, void *msg)
+{
+	struct chan_slot *s;
+	uint64_t pos = ACCESS_ONCE(ch->tail);
+	int64_t dif;
+
+	while (true) {
+		s = &ch->slots[pos & ch->mask];
+		dif = (int64_t)(load_acquire(&s->seq) - pos);
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&ch->tail, pos,
+							 pos + 1))
+				break;
+		} else if (dif < 0) {
+			return false;
+		}
+		pos = ACCESS_ONCE(ch->tail);
+	}
+
+	s->msg = msg;
+	store_release(&s->seq, pos + 1);
+	return true;
+}
+
+static bool chan_ring_pop(chan_t *ch, void **msg_out)
+{
+	struct chan_slot *s;
+	uint64_t pos = ACCESS_ONCE(ch->head);
+	int64_t dif;
+
+	while (true) {
+		s = &ch->slots[pos & ch->mask];
+		dif = (int64_t)(load_acquire(&s->seq) - (pos + 1));
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&ch->head, pos,
+							 pos + 1))
+				break;
+		} else if (dif < 0) {
+			return false;
+		}
+		pos = ACCESS_ONCE(ch->head);
+	}
+
+	*msg_out = s->msg;
+	store_release(&s->seq, pos + ch->mask + 1);
+	return true;
+}
+
+/* the ring operations run with preemption off to keep claimed slots short */
+static bool chan_push(chan_t *ch, void *msg)
+{
+	bool ret;
+
+	preempt_disable();
+	ret = chan_ring_push(ch, msg);
+	preempt_enable();
+	return ret;
+}
+
+static bool chan_pop(chan_t *ch, void **msg_out)
+{
+	bool ret;
+
+	preempt_disable();
+	ret = chan_ring_pop(ch, msg_out);
+	preempt_enable();
+	return ret;
+}
+
+/* wakes one parked thread, if any, which then tries again */
+static void chan_wake_one(chan_t *ch, struct list_head *waiters, int *nr)
+{
+	struct chan_waiter *w;
+	thread_t *th = NULL;
+
+	spin_lock_np(&ch->lock);
+	w = list_pop(waiters, struct chan_waiter, link);
+	if (w) {
+		(*nr)--;
+		th = w->th;
+	}
+	spin_unlock_np(&ch->lock);
+
+	if (th)
+		thread_ready(th);
+}
+
+/* called after a message is added, in case a receiver parked meanwhile */
+static void chan_sent(chan_t *ch)
+{
+	mb();
+	if (unlikely(ACCESS_ONCE(ch->nr_recv_waiters)))
+		chan_wake_one(ch, &ch->recv_waiters, &ch->nr_recv_waiters);
+}
+
+/* called after a message is removed, in case a sender parked meanwhile */
+static void chan_received(chan_t *ch)
+{
+	mb();
+	if (unlikely(ACCESS_ONCE(ch->nr_send_waiters)))
+		chan_wake_one(ch, &ch->send_waiters, &ch->nr_send_waiters);
+}
+
+/* passes @msg straight to a parked receiver, returns false if none */
+static bool chan_handoff(chan_t *ch, void *msg)
+{
+	struct chan_waiter *w;
+	thread_t *th;
+
+	spin_lock_np(&ch->lock);
+	w = list_pop(&ch->recv_waiters, struct chan_waiter, link);
+	if (!w) {
+		spin_unlock_np(&ch->lock);
+		return false;
+	}
+	ch->nr_recv_waiters--;
+	w->msg = msg;
+	w->handed = true;
+	th = w->th;
+	spin_unlock_np(&ch->lock);
+
+	thread_ready(th);
+	return true;
+}
+
+/* adds @msg to an unbounded channel whose ring is full or has spilled */
+static int chan_spill(chan_t *ch, void *msg)
+{
+	struct chan_spill *sp;
+
+	sp = smalloc(sizeof(*sp));
+	if (unlikely(!sp))
+		return -ENOMEM;
+	sp->msg = msg;
+
+	spin_lock_np(&ch->lock);
+	if (unlikely(ch->closed)) {
+		spin_unlock_np(&ch->lock);
+		sfree(sp);
+		return -EPIPE;
+	}
+	if (!ch->nr_spilled && chan_ring_push(ch, msg)) {
+		spin_unlock_np(&ch->lock);
+		sfree(sp);
+		chan_sent(ch);
+		return 0;
+	}
+	list_add_tail(&ch->spilled, &sp->link);
+	ACCESS_ONCE(ch->nr_spilled) = ch->nr_spilled + 1;
+	spin_unlock_np(&ch->lock);
+
+	chan_sent(ch);
+	return 0;
+}
+
+static int __chan_send(chan_t *ch, void *msg, bool block)
+{
+	struct chan_waiter w;
+
+	/* skip the ring if a receiver is already waiting */
+	if (unlikely(ACCESS_ONCE(ch->nr_recv_waiters)) &&
+	    !ACCESS_ONCE(ch->closed) && chan_handoff(ch, msg))
+		return 0;
+
+	while (true) {
+		if (unlikely(ACCESS_ONCE(ch->closed)))
+			return -EPIPE;
+		if (likely(!ACCESS_ONCE(ch->nr_spilled)) &&
+		    chan_push(ch, msg)) {
+			chan_sent(ch);
+			return 0;
+		}
+		if (ch->unbounded)
+			return chan_spill(ch, msg);
+
+		spin_lock_np(&ch->lock);
+		if (unlikely(ch->closed)) {
+			spin_unlock_np(&ch->lock);
+			return -EPIPE;
+		}
+		if (!block) {
+			spin_unlock_np(&ch->lock);
+			return -EAGAIN;
+		}
+
+		/* try again in case a receiver made room before seeing us */
+		ch->nr_send_waiters++;
+		mb();
+		if (chan_ring_push(ch, msg)) {
+			ch->nr_send_waiters--;
+			spin_unlock_np(&ch->lock);
+			chan_sent(ch);
+			return 0;
+		}
+
+		w.th = thread_self();
+		w.handed = false;
+		list_add_tail(&ch->send_waiters, &w.link);
+		thread_park_and_unlock_np(&ch->lock);
+	}
+}
+
+static int __chan_recv(chan_t *ch, void **msg_out, bool block)
+{
+	struct chan_waiter w;
+	struct chan_spill *sp;
+
+	while (true) {
+		if (likely(chan_pop(ch, msg_out))) {
+			chan_received(ch);
+			return 0;
+		}
+
+		spin_lock_np(&ch->lock);
+		sp = list_pop(&ch->spilled, struct chan_spill, link);
+		if (sp) {
+			ACCESS_ONCE(ch->nr_spilled) = ch->nr_spilled - 1;
+			spin_unlock_np(&ch->lock);
+			*msg_out = sp->msg;
+			sfree(sp);
+			return 0;
+		}
+
+		/* try again in case a sender added one before seeing us */
+		ch->nr_recv_waiters++;
+		mb();
+		if (chan_ring_pop(ch, msg_out)) {
+			ch->nr_recv_waiters--;
+			spin_unlock_np(&ch->lock);
+			chan_received(ch);
+			return 0;
+		}
+		if (ch->closed) {
+			ch->nr_recv_waiters--;
+			spin_unlock_np(&ch->lock);
+			return -EPIPE;
+		}
+		if (!block) {
+			ch->nr_recv_waiters--;
+			spin_unlock_np(&ch->lock);
+			return -EAGAIN;
+		}
+
+		w.th = thread_self();
+		w.handed = false;
+		list_add_tail(&ch->recv_waiters, &w.link);
+		thread_park_and_unlock_np(&ch->lock);
+
+		if (w.handed) {
+			*msg_out = w.msg;
+			return 0;
+		}
+	}
+}
+
+/**
+ * chan_send - sends a message on a channel
+ * @ch: the channel
+ * @msg: the message
+ *
+ * If a receiver is parked, @msg is handed to it directly. Blocks while the
+ * channel is full, unless it was created with CHAN_UNBOUNDED.
+ *
+ * Returns 0 if successful, -EPIPE if the channel is closed, or -ENOMEM if an
+ * unbounded channel couldn't grow.
+ */
+int chan_send(chan_t *ch, void *msg)
+{
+	return __chan_send(ch, msg, true);
+}
+
+/**
+ * chan_try_send - sends a message on a channel without blocking
+ * @ch: the channel
+ * @msg: the message
+ *
+ * Returns 0 if successful, -EAGAIN if the channel is full, or otherwise like
+ * chan_send().
+ */
+int chan_try_send(chan_t *ch, void *msg)
+{
+	return __chan_send(ch, msg, false);
+}
+
+/**
+ * chan_recv - receives a message from a channel
+ * @ch: the channel
+ * @msg_out: set to the message
+ *
+ * Blocks while the channel is empty. Messages sent before chan_close() are
+ * still received after it.
+ *
+ * Returns 0 if successful, or -EPIPE if the channel is closed and empty.
+ */
+int chan_recv(chan_t *ch, void **msg_out)
+{
+	return __chan_recv(ch, msg_out, true);
+}
+
+/**
+ * chan_try_recv - receives a message from a channel without blocking
+ * @ch: the channel
+ * @msg_out: set to the message
+ *
+ * Returns 0 if successful, -EAGAIN if the channel is empty, or -EPIPE if it is
+ * closed and empty.
+ */
+int chan_try_recv(chan_t *ch, void **msg_out)
+{
+	return __chan_recv(ch, msg_out, false);
+}
+
+/**
+ * chan_close - closes a channel
+ * @ch: the channel
+ *
+ * Later sends fail, and receives fail once the remaining messages are taken.
+ * All parked threads are woken.
+ */
+void chan_close(chan_t *ch)
+{
+	struct list_head waiters;
+	struct chan_waiter *w;
+
+	list_head_init(&waiters);
+
+	spin_lock_np(&ch->lock);
+	ch->closed = true;
+	list_append_list(&waiters, &ch->recv_waiters);
+	list_append_list(&waiters, &ch->send_waiters);
+	ch->nr_recv_waiters = 0;
+	ch->nr_send_waiters = 0;
+	spin_unlock_np(&ch->lock);
+
+	while ((w = list_pop(&waiters, struct chan_waiter, link)))
+		thread_ready(w->th);
+}
+
+/**
+ * chan_create - creates a channel
+ * @ch_out: set to the new channel
+ * @cap: the number of messages the channel holds (rounded up to a power of 2)
+ * @flags: CHAN_* flags
+ *
+ * With CHAN_UNBOUNDED, messages past @cap are kept in a slower overflow list
+ * instead of blocking senders.
+ *
+ * Returns 0 if successful, -EINVAL if @cap is 0 or too large, or -ENOMEM if
+ * out of memory.
+ */
+int chan_create(chan_t **ch_out, unsigned int cap, unsigned int flags)
+{
+	chan_t *ch;
+	uint64_t i;
+
+	if (cap == 0 || cap > CHAN_MAX_CAP)
+		return -EINVAL;
+	if (!is_power_of_two(cap))
+		cap = 1U << (32 - __builtin_clz(cap));
+
+	ch = aligned_alloc(CACHE_LINE_SIZE, align_up(sizeof(*ch),
+						      CACHE_LINE_SIZE));
+	if (!ch)
+		return -ENOMEM;
+	ch->slots = aligned_alloc(CACHE_LINE_SIZE,
+				  align_up(sizeof(*ch->slots) * cap,
+					   CACHE_LINE_SIZE));
+	if (!ch->slots) {
+		free(ch);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < cap; i++)
+		ch->slots[i].seq = i;
+	ch->mask = cap - 1;
+	ch->unbounded = (flags & CHAN_UNBOUNDED) != 0;
+	ch->closed = false;
+	ch->tail = 0;
+	ch->head = 0;
+	spin_lock_init(&ch->lock);
+	ch->nr_recv_waiters = 0;
+	ch->nr_send_waiters = 0;
+	ch->nr_spilled = 0;
+	list_head_init(&ch->recv_waiters);
+	list_head_init(&ch->send_waiters);
+	list_head_init(&ch->spilled);
+
+	*ch_out = ch;
+	return 0;
+}
+
+/**
+ * chan_destroy - frees a channel
+ * @ch: the channel
+ *
+ * WARNING: No threads may be using the channel. Messages still in it are
+ * dropped.
+ */
+void chan_destroy(chan_t *ch)
+{
+	struct chan_spill *sp;
+
+	assert(list_empty(&ch->recv_waiters) && list_empty(&ch->send_waiters));
+
+	while ((sp = list_pop(&ch->spilled, struct chan_spill, link)))
+		sfree(sp);
+	free(ch->slots);
+	free(ch);
+}
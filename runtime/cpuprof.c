@@ -0,0 +1,348 @@
+/*
+ * cpuprof.c - a sampling CPU profiler that tells uthreads apart
+ *
+ * With runtime_cpuprof_hz set, each kthread has a timer on its own CPU clock
+ * that delivers SIGPROF while profiling is on. The handler records the
+ * interrupted uthread, the function it was created with, and a walk of its
+ * frame pointers in the kthread's ring, so samples are charged to the uthread
+ * that was running rather than to the kthread, as perf would. Stacks are only
+ * walked within the running uthread's own stack, so code built without frame
+ * pointers truncates them but can't make the walk fault.
+ *
+ * A dump merges identical stacks into the folded format of flamegraph.pl, one
+ * "<entry>;<outermost frame>;...;<innermost frame> <samples>" line each.
+ */
+
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+
+#include "defs.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+BUILD_ASSERT(is_power_of_two(CPUPROF_RING_SIZE));
+
+/* samples per second of CPU time on each kthread (0 disables the profiler) */
+unsigned int cpuprof_hz;
+/* true while samples are being recorded */
+bool cpuprof_enabled;
+
+static void handle_sigprof(int s, siginfo_t *si, void *c)
+{
+	ucontext_t *uc = c;
+	struct kthread *k = myk();
+	struct cpuprof_sample *ring = load_acquire(&k->prof_ring), *smp;
+	thread_t *th = __self;
+	uintptr_t fp, lo, hi, *frame;
+	uint64_t head;
+	unsigned int depth = 0;
+
+	if (!ring || !ACCESS_ONCE(cpuprof_enabled))
+		return;
+
+	head = k->prof_head;
+	smp = &ring[head & (CPUPROF_RING_SIZE - 1)];
+	smp->pcs[depth++] = uc->uc_mcontext.gregs[REG_RIP];
+
+	if (th) {
+		/* the thread sits at the top of its stack */
+		lo = (uintptr_t)th->stack->usable;
+		hi = (uintptr_t)th;
+		fp = uc->uc_mcontext.gregs[REG_RBP];
+		while (depth < CPUPROF_MAX_DEPTH && fp >= lo &&
+		       fp + 2 * sizeof(uintptr_t) <= hi &&
+		       !(fp & (sizeof(uintptr_t) - 1))) {
+			frame = (uintptr_t *)fp;
+			if (frame[1] == (uintptr_t)thread_exit)
+				break;
+			smp->pcs[depth++] = frame[1];
+			/* frames only grow towards the top of the stack */
+			if (frame[0] <= fp)
+				break;
+			fp = frame[0];
+		}
+	}
+
+	smp->th = (uintptr_t)th;
+	smp->entry = th ? th->entry : 0;
+	smp->depth = depth;
+	smp->pad = 0;
+	store_release(&k->prof_head, head + 1);
+}
+
+static int cpuprof_set_timers(unsigned int hz)
+{
+	struct itimerspec its;
+	uint64_t ns = hz ? 1000000000UL / hz : 0;
+	int i;
+
+	its.it_interval.tv_sec = ns / 1000000000UL;
+	its.it_interval.tv_nsec = ns % 1000000000UL;
+	its.it_value = its.it_interval;
+
+	for (i = 0; i < maxks; i++) {
+		if (timer_settime(allks[i]->prof_timer, 0, &its, NULL) == -1)
+			return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * cpuprof_start - starts sampling every kthread
+ *
+ * Returns 0 if successful, -ENOTSUP if runtime_cpuprof_hz isn't set, or
+ * -ENOMEM if the rings couldn't be allocated.
+ */
+int cpuprof_start(void)
+{
+	struct cpuprof_sample *ring;
+	int i;
+
+	if (!cpuprof_hz)
+		return -ENOTSUP;
+
+	for (i = 0; i < maxks; i++) {
+		if (allks[i]->prof_ring)
+			continue;
+		ring = aligned_alloc(CACHE_LINE_SIZE,
+				     sizeof(*ring) * CPUPROF_RING_SIZE);
+		if (!ring)
+			return -ENOMEM;
+		store_release(&allks[i]->prof_ring, ring);
+	}
+
+	store_release(&cpuprof_enabled, true);
+	return cpuprof_set_timers(cpuprof_hz);
+}
+
+/**
+ * cpuprof_stop - stops sampling, keeping the rings for a later dump
+ */
+void cpuprof_stop(void)
+{
+	if (!cpuprof_hz)
+		return;
+
+	store_release(&cpuprof_enabled, false);
+	WARN_ON(cpuprof_set_timers(0));
+}
+
+/* copies the samples in @k's ring that weren't overwritten, returns how many */
+static size_t cpuprof_copy_kthread(struct kthread *k,
+				   struct cpuprof_sample *samples)
+{
+	struct cpuprof_sample *ring = load_acquire(&k->prof_ring);
+	uint64_t first, last, start, i;
+
+	if (!ring)
+		return 0;
+
+	last = load_acquire(&k->prof_head);
+	first = last > CPUPROF_RING_SIZE ? last - CPUPROF_RING_SIZE : 0;
+	for (i = first; i < last; i++)
+		samples[i - first] = ring[i & (CPUPROF_RING_SIZE - 1)];
+
+	/* the writer may have lapped us while copying (as in trace.c) */
+	mb();
+	start = load_acquire(&k->prof_head);
+	start = start >= CPUPROF_RING_SIZE ? start - CPUPROF_RING_SIZE + 1 : 0;
+	start = max(start, first);
+	if (start > last)
+		start = last;
+
+	if (start > first)
+		memmove(samples, &samples[start - first],
+			sizeof(*samples) * (last - start));
+	return last - start;
+}
+
+/* orders samples by uthread (if not cleared), entry, and then stack */
+static int cpuprof_cmp(const void *a, const void *b)
+{
+	const struct cpuprof_sample *x = a, *y = b;
+	unsigned int i;
+
+	if (x->th != y->th)
+		return x->th < y->th ? -1 : 1;
+	if (x->entry != y->entry)
+		return x->entry < y->entry ? -1 : 1;
+	if (x->depth != y->depth)
+		return x->depth < y->depth ? -1 : 1;
+	for (i = 0; i < x->depth; i++) {
+		if (x->pcs[i] != y->pcs[i])
+			return x->pcs[i] < y->pcs[i] ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the function name in @sym, a line from backtrace_symbols() such as
+ * "./app(func+0x1a) [0x4005d0]", or @addr if the binary doesn't export it
+ * (link with -rdynamic for the names).
+ */
+static void cpuprof_write_frame(FILE *f, const char *sym, uintptr_t addr)
+{
+	const char *start = sym ? strchr(sym, '(') : NULL;
+	size_t len;
+
+	if (start) {
+		start++;
+		len = strcspn(start, "+)");
+		if (len > 0) {
+			fprintf(f, "%.*s", (int)len, start);
+			return;
+		}
+	}
+
+	fprintf(f, "0x%lx", addr);
+}
+
+static void cpuprof_write_stack(FILE *f, const struct cpuprof_sample *smp,
+				bool by_thread, size_t count)
+{
+	void *addrs[CPUPROF_MAX_DEPTH + 1];
+	char **syms;
+	int i, n = 0;
+
+	if (by_thread)
+		fprintf(f, "uthread-0x%lx;", smp->th);
+
+	if (smp->th)
+		addrs[n++] = (void *)smp->entry;
+	for (i = smp->depth - 1; i >= 0; i--)
+		addrs[n++] = (void *)smp->pcs[i];
+
+	syms = backtrace_symbols(addrs, n);
+	if (!smp->th)
+		fprintf(f, "[scheduler];");
+	for (i = 0; i < n; i++) {
+		if (i > 0)
+			fputc(';', f);
+		cpuprof_write_frame(f, syms ? syms[i] : NULL,
+				    (uintptr_t)addrs[i]);
+	}
+	fprintf(f, " %lu\n", count);
+	free(syms);
+}
+
+/**
+ * cpuprof_dump - writes the samples of every kthread to CPUPROF_PATH
+ * @by_thread: if true, adds a root frame for each uthread instead of merging
+ * the stacks of uthreads created with the same function
+ *
+ * Profiling may stay on while dumping. Returns the number of samples written,
+ * or < 0 on failure.
+ */
+ssize_t cpuprof_dump(bool by_thread)
+{
+	struct cpuprof_sample *samples;
+	char path[64];
+	size_t nr = 0, i, run;
+	FILE *f;
+	int j;
+
+	samples = malloc(sizeof(*samples) * CPUPROF_RING_SIZE * maxks);
+	if (!samples)
+		return -ENOMEM;
+
+	for (j = 0; j < maxks; j++)
+		nr += cpuprof_copy_kthread(allks[j], &samples[nr]);
+
+	if (!by_thread) {
+		for (i = 0; i < nr; i++)
+			samples[i].th = samples[i].th ? 1 : 0;
+	}
+	qsort(samples, nr, sizeof(*samples), cpuprof_cmp);
+
+	snprintf(path, sizeof(path), CPUPROF_PATH, getpid());
+	f = fopen(path, "w");
+	if (!f) {
+		free(samples);
+		return -errno;
+	}
+
+	for (i = 0; i < nr; i += run) {
+		for (run = 1; i + run < nr; run++) {
+			if (cpuprof_cmp(&samples[i], &samples[i + run]))
+				break;
+		}
+		cpuprof_write_stack(f, &samples[i], by_thread, run);
+	}
+
+	free(samples);
+	if (fclose(f))
+		return -errno;
+	return nr;
+}
+
+/**
+ * cpuprof_init - global initializer for the CPU profiler
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int cpuprof_init(void)
+{
+	struct sigaction act;
+
+	if (!cpuprof_hz)
+		return 0;
+
+	act.sa_sigaction = handle_sigprof;
+	act.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+
+	/* preemption must not switch uthreads in the middle of a sample */
+	if (sigemptyset(&act.sa_mask) != 0 ||
+	    sigaddset(&act.sa_mask, SIGUSR1) != 0 ||
+	    sigaddset(&act.sa_mask, SIGUSR2) != 0) {
+		log_err("cpuprof: couldn't set the signal handler mask");
+		return -errno;
+	}
+
+	if (sigaction(SIGPROF, &act, NULL) == -1) {
+		log_err("cpuprof: couldn't register signal handler");
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * cpuprof_init_thread - per-kthread initializer for the CPU profiler
+ *
+ * Creates this kthread's sampling timer, which stays disarmed until profiling
+ * is turned on.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int cpuprof_init_thread(void)
+{
+	struct sigevent sev;
+
+	if (!cpuprof_hz)
+		return 0;
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_notify_thread_id = gettid();
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev,
+			 &myk()->prof_timer) == -1) {
+		log_err("cpuprof: couldn't create sampling timer");
+		return -errno;
+	}
+
+	return 0;
+}
@@ -14,27 +14,47 @@
 #include <base/time.h>
 #include <net/ethernet.h>
 #include <net/ip.h>
+#include <net/ip6.h>
 #include <iokernel/control.h>
 #include <net/mbufq.h>
 #include <runtime/thread.h>
 #include <runtime/rcu.h>
 #include <runtime/preempt.h>
+#include <runtime/trace.h>
 
 
 /*
- * constant limits
- * TODO: make these configurable?
+ * constant limits, the scheduler's polling and watchdog intervals are only
+ * defaults (see the runtime_sched_* and runtime_watchdog_us options)
  */
 
 #define RUNTIME_MAX_THREADS		100000
 #define RUNTIME_STACK_SIZE		128 * KB
 #define RUNTIME_GUARD_SIZE		128 * KB
-#define RUNTIME_RQ_SIZE			32
-#define RUNTIME_SOFTIRQ_BUDGET		16
-#define RUNTIME_MAX_TIMERS		4096
+#define RUNTIME_SMALL_STACK_SIZE	16 * KB
+#define RUNTIME_SMALL_GUARD_SIZE	4 * KB
+#ifndef RUNTIME_RQ_SIZE
+#define RUNTIME_RQ_SIZE			32	/* override with RQ_SIZE=<n> */
+#endif
+#define RUNTIME_RQ_MASK			(RUNTIME_RQ_SIZE - 1)
+#define RUNTIME_SOFTIRQ_BUDGET		16	/* the starting budget */
 #define RUNTIME_SCHED_POLL_ITERS	4
 #define RUNTIME_SCHED_MIN_POLL_US	2
 #define RUNTIME_WATCHDOG_US		50
+#define RUNTIME_PARK_SPIN_US		20	/* the longest spin before parking */
+#define RUNTIME_TIMER_SPIN_US		10	/* polls for timers due this soon */
+#define RUNTIME_SPIN_ADAPT_US		1000	/* between spinks adjustments */
+#define RUNTIME_SPIN_QDELAY_US		10	/* the delay spinning aims under */
+#define RUNTIME_IDLE_GAP_MAX_US		1000	/* caps idle gap samples */
+#define RUNTIME_KTHREAD_GROW_US		100	/* between kthread limit raises */
+#define RUNTIME_OFFLOAD_MAX_THREADS	64	/* syscall offload helpers */
+#define RUNTIME_OFFLOAD_POLL_US		50	/* parked wakeups for blocking I/O */
+#define RUNTIME_TX_STAGE_SIZE		16	/* egress packets per txpktq burst */
+#define RUNTIME_EDF_SIZE		64	/* queued threads with deadlines */
+
+/* the runqueue indexes wrap, so masking them needs a power of two */
+BUILD_ASSERT(RUNTIME_RQ_SIZE >= 2 &&
+	     (RUNTIME_RQ_SIZE & RUNTIME_RQ_MASK) == 0);
 
 
 /*
@@ -91,15 +111,35 @@ enum {
 
 struct stack;
 
+struct thread_tls_slot;
+
 struct thread {
 	struct thread_tf	tf;
 	struct list_node	link;
 	struct stack		*stack;
 	unsigned int		main_thread:1;
+	unsigned int		background:1;
+	unsigned int		stack_class:1;
 	unsigned int		state;
 	unsigned int		stack_busy;
+	uint64_t		ready_tsc;	/* when it last became runnable */
+	uint64_t		run_tsc;	/* when it last started running */
+	uint64_t		run_cycles;	/* the total time it has run */
+	uint64_t		deadline_us;	/* see thread_set_deadline() */
+	struct thread_tls_slot	*tls;		/* key values, set on first use */
+	uintptr_t		entry;		/* the function it was created with */
 };
 
+/* marks a thread runnable, stamping it for the scheduling latency histogram */
+static inline void thread_set_runnable(thread_t *th)
+{
+	th->state = THREAD_STATE_RUNNABLE;
+	th->ready_tsc = rdtsc();
+}
+
+/* runs the destructors for a thread's keys, see tls.c */
+extern void thread_tls_exit(void);
+
 typedef void (*runtime_fn_t)(void);
 
 /* assembly helper routines from switch.S */
@@ -119,32 +159,154 @@ extern void __jmp_runtime_nosave(runtime_fn_t fn, void *stack) __noreturn;
 #define STACK_PTR_SIZE	(RUNTIME_STACK_SIZE / sizeof(uintptr_t))
 #define GUARD_PTR_SIZE	(RUNTIME_GUARD_SIZE / sizeof(uintptr_t))
 
+/*
+ * The layout of a THREAD_STACK_DEFAULT stack. Smaller classes use only the
+ * start of usable[], followed by their own (smaller) guard region.
+ */
 struct stack {
 	uintptr_t	usable[STACK_PTR_SIZE];
 	uintptr_t	guard[GUARD_PTR_SIZE]; /* unreadable and unwritable */
 };
 
+BUILD_ASSERT(THREAD_STACK_NR_CLASSES <= 2); /* fits thread->stack_class */
+
 DECLARE_PERTHREAD(struct tcache_perthread, stack_pt);
+DECLARE_PERTHREAD(struct tcache_perthread, small_stack_pt);
+
+extern unsigned int stack_reclaim_watermark;
+extern bool stack_hugepages;
+
+/*
+ * Huge page stacks have no guard pages. Instead, the lowest words of each
+ * stack hold a canary that is checked whenever its thread stops running.
+ */
+#define STACK_CANARY		0x5ca1ab1e0ddba11UL
+#define STACK_CANARY_WORDS	(CACHE_LINE_SIZE / sizeof(uintptr_t))
+
+extern void __stack_canary_failed(struct stack *s) __noreturn;
+
+static inline void stack_set_canary(struct stack *s)
+{
+	int i;
+
+	for (i = 0; i < STACK_CANARY_WORDS; i++)
+		s->usable[i] = STACK_CANARY;
+}
+
+/**
+ * stack_check_canary - panics if a thread overflowed its stack
+ * @s: the stack to check
+ *
+ * Only huge page stacks have a canary; otherwise this does nothing.
+ */
+static inline void stack_check_canary(struct stack *s)
+{
+	int i;
+
+	if (likely(!stack_hugepages))
+		return;
+	for (i = 0; i < STACK_CANARY_WORDS; i++) {
+		if (unlikely(s->usable[i] != STACK_CANARY))
+			__stack_canary_failed(s);
+	}
+}
+
+/* the words at the top of each stack that hold its struct thread */
+#define STACK_THREAD_PTR_SIZE \
+	(align_up(sizeof(struct thread), CACHE_LINE_SIZE) / sizeof(uintptr_t))
+
+/**
+ * stack_ptr_size - returns the number of words in a stack class that are
+ * usable as a call stack
+ * @cls: the stack class (THREAD_STACK_*)
+ *
+ * The rest of the stack, above the call stack, is reserved for the thread.
+ */
+static inline size_t stack_ptr_size(int cls)
+{
+	if (cls == THREAD_STACK_SMALL)
+		return RUNTIME_SMALL_STACK_SIZE / sizeof(uintptr_t) -
+		       STACK_THREAD_PTR_SIZE;
+	return STACK_PTR_SIZE - STACK_THREAD_PTR_SIZE;
+}
+
+/**
+ * stack_thread - returns the thread control block embedded in a stack
+ * @s: the stack
+ * @cls: the stack class of @s
+ *
+ * A thread and its stack are allocated together, so the thread's state
+ * shares cache lines with the top of the call stack.
+ */
+static inline struct thread *stack_thread(struct stack *s, int cls)
+{
+	return (struct thread *)&s->usable[stack_ptr_size(cls)];
+}
+
+/*
+ * Stack depth tracking. Unused stack words are kept zero, so the deepest a
+ * thread went is the lowest nonzero word when it exits.
+ */
+
+/* log2 buckets of the deepest stack use: <1KB, <2KB, ..., <128KB */
+#define STACK_DEPTH_NR_BUCKETS	8
+/* the maximum number of distinct entry functions tracked (a power of two) */
+#define STACK_DEPTH_NR_SITES	256
+
+struct stack_depth_site {
+	uintptr_t	entry;
+	int		cls;
+	uint64_t	exits;
+	uint64_t	max;	/* bytes */
+	uint64_t	hist[STACK_DEPTH_NR_BUCKETS];
+};
+
+extern bool stack_depth_enabled;
+extern uint64_t stack_depth_dropped;
+extern void __stack_record_depth(struct thread *th);
+extern int stack_depth_snapshot(struct stack_depth_site *sites, int capacity);
+extern void stack_depth_reset(void);
+
+/**
+ * stack_record_depth - records how deep an exiting thread's stack went
+ * @th: the thread, which must not be running
+ *
+ * Zeroes the used part of the stack again for its next thread.
+ */
+static inline void stack_record_depth(struct thread *th)
+{
+	if (unlikely(stack_depth_enabled))
+		__stack_record_depth(th);
+}
+
+static inline struct tcache_perthread *stack_perthread(int cls)
+{
+	if (cls == THREAD_STACK_SMALL)
+		return &perthread_get(small_stack_pt);
+	return &perthread_get(stack_pt);
+}
 
 /**
  * stack_alloc - allocates a stack
+ * @cls: the stack class (THREAD_STACK_*)
  *
  * Stack allocation is extremely cheap, think less than taking a lock.
  *
  * Returns an unitialized stack.
  */
-static inline struct stack *stack_alloc(void)
+static inline struct stack *stack_alloc(int cls)
 {
-	return tcache_alloc(&perthread_get(stack_pt));
+	return tcache_alloc(stack_perthread(cls));
 }
 
 /**
  * stack_free - frees a stack
  * @s: the stack to free
+ * @cls: the stack class that @s was allocated from
  */
-static inline void stack_free(struct stack *s)
+static inline void stack_free(struct stack *s, int cls)
 {
-	tcache_free(&perthread_get(stack_pt), (void *)s);
+	tcache_free(stack_perthread(cls), (void *)s);
 }
 
 #define RSP_ALIGNMENT	16
@@ -164,16 +326,19 @@ static inline void assert_rsp_aligned(uint64_t rsp)
 /**
  * stack_init_to_rsp - sets up an exit handler and returns the top of the stack
  * @s: the stack to initialize
+ * @cls: the stack class of @s
  * @exit_fn: exit handler that is called when the top of the call stack returns
  *
  * Returns the top of the stack as a stack pointer.
  */
-static inline uint64_t stack_init_to_rsp(struct stack *s, void (*exit_fn)(void))
+static inline uint64_t stack_init_to_rsp(struct stack *s, int cls,
+					 void (*exit_fn)(void))
 {
 	uint64_t rsp;
+	size_t top = stack_ptr_size(cls);
 
-	s->usable[STACK_PTR_SIZE - 1] = (uintptr_t)exit_fn;
-	rsp = (uint64_t)&s->usable[STACK_PTR_SIZE - 1];
+	s->usable[top - 1] = (uintptr_t)exit_fn;
+	rsp = (uint64_t)&s->usable[top - 1];
 	assert_rsp_aligned(rsp);
 	return rsp;
 }
@@ -182,6 +347,7 @@ static inline uint64_t stack_init_to_rsp(struct stack *s, void (*exit_fn)(void))
  * stack_init_to_rsp_with_buf - sets up an exit handler and returns the top of
  * the stack, reserving space for a buffer above
  * @s: the stack to initialize
+ * @cls: the stack class of @s
  * @buf: a pointer to store the buffer pointer
  * @buf_len: the length of the buffer to reserve
  * @exit_fn: exit handler that is called when the top of the call stack returns
@@ -189,10 +355,10 @@ static inline uint64_t stack_init_to_rsp(struct stack *s, void (*exit_fn)(void))
  * Returns the top of the stack as a stack pointer.
  */
 static inline uint64_t
-stack_init_to_rsp_with_buf(struct stack *s, void **buf, size_t buf_len,
-			   void (*exit_fn)(void))
+stack_init_to_rsp_with_buf(struct stack *s, int cls, void **buf,
+			   size_t buf_len, void (*exit_fn)(void))
 {
-	uint64_t rsp, pos = STACK_PTR_SIZE;
+	uint64_t rsp, pos = stack_ptr_size(cls);
 
 	/* reserve the buffer */
 	pos -= div_up(buf_len, sizeof(uint64_t));
@@ -212,6 +378,8 @@ stack_init_to_rsp_with_buf(struct stack *s, void **buf, size_t buf_len,
 
 DECLARE_SPINLOCK(qlock);
 extern unsigned int nrqs;
+/* attach to one of the iokernel's pre-registered shm regions if possible */
+extern bool prereg_enabled;
 
 struct iokernel_control {
 	int fd;
@@ -221,6 +389,8 @@ struct iokernel_control {
 	struct thread_spec threads[NCPU];
 	void *tx_buf;
 	size_t tx_len;
+	void *tso_buf;
+	size_t tso_len;
 };
 
 extern struct iokernel_control iok;
@@ -244,12 +414,44 @@ enum {
 	STAT_SCHED_CYCLES,
 	STAT_PROGRAM_CYCLES,
 	STAT_THREADS_STOLEN,
+	STAT_STEAL_ATTEMPTS,
+	STAT_BG_THREADS_STOLEN,
+	STAT_EDF_THREADS_STOLEN,
+	STAT_EDF_EXPIRED,
+	STAT_DIRECT_SWITCHES,
 	STAT_SOFTIRQS_STOLEN,
 	STAT_SOFTIRQS_LOCAL,
+	STAT_SOFTIRQS_INLINE,
+	STAT_SOFTIRQS_SPLIT,
 	STAT_PARKS,
+	STAT_PARK_SPIN_HITS,	/* work arrived while spinning before a park */
+	STAT_PARK_SPIN_MISSES,	/* ... or the kthread parked anyway */
+	STAT_TIMER_POLLS,	/* polled instead of parked for a timer */
+	STAT_TIMER_SPINS,	/* a timer waited out its last microsecond */
+	STAT_KTHREAD_LIMIT_RAISES, /* asked the iokernel for another kthread */
+	STAT_SPINKS_RAISES,	/* another kthread stopped parking */
+	STAT_SPINKS_CUTS,	/* ... or one was allowed to park again */
+	STAT_FLOW_STEERS,	/* asked the iokernel to move a flow here */
+	STAT_FLOW_ADOPTS,	/* took over the flows of a detached kthread */
 	STAT_PREEMPTIONS,
 	STAT_PREEMPTIONS_STOLEN,
+	STAT_PREEMPTIONS_QUANTUM,
+	STAT_PREEMPTIONS_POLLED,
+	STAT_PREEMPTIONS_STARVED, /* a thread held up softirqs too long */
 	STAT_CORE_MIGRATIONS,
+	STAT_STEALS_CORE,	/* steals from each distance (see sched.c) */
+	STAT_STEALS_LLC,
+	STAT_STEALS_SOCKET,
+	STAT_STEALS_REMOTE,
+	STAT_SOFTIRQ_BATCHES,	/* softirq invocations that gathered work */
+	STAT_SOFTIRQ_EVENTS,	/* ... and the events they gathered */
+	STAT_SOFTIRQ_BUDGET,	/* ... and the sum of their budgets */
+	STAT_WATCHDOG_RUNS,
+	STAT_SOFTIRQ_STARVED,	/* the watchdog found softirqs delayed too long */
+	STAT_OFFLOAD_CALLS,	/* blocking calls run on a helper thread */
+	STAT_FILEIO_REQUESTS,	/* file I/O submitted to an io_uring */
+	STAT_OVERLOAD_ADMITS,	/* requests admitted by overload_admit() */
+	STAT_OVERLOAD_REJECTS,	/* ... or rejected, with connections refused */
 
 	/* network stack counters */
 	STAT_RX_BYTES,
@@ -260,16 +462,65 @@ enum {
 	STAT_RX_TCP_IN_ORDER,
 	STAT_RX_TCP_OUT_OF_ORDER,
 	STAT_RX_TCP_TEXT_CYCLES,
+	STAT_RX_GRO_MERGED,
+	STAT_RX_QUEUE_CYCLES,	/* from the iokernel to the softirq */
+	STAT_RX_UDP_INQ_DROPS,	/* a UDP socket's ingress ring was full */
+	STAT_RX_PRIORITY_PACKETS, /* handled first for high-priority entries */
+	STAT_ARP_PENDING_DROPS, /* too many packets waited on an ARP reply */
+	STAT_NDISC_PENDING_DROPS, /* ... or on a neighbor advertisement */
+	STAT_RX_L4_CSUM_ERRORS,	/* a TCP or UDP checksum was wrong */
+	STAT_TCP_SYNCOOKIES_SENT,
+	STAT_TCP_SYNCOOKIES_OK,
+	STAT_TCP_RX_BYTES,	/* in-order payload bytes received */
+	STAT_TCP_TX_ACKS,	/* ACKs sent without data */
+	STAT_TCP_TIME_WAIT_REUSED, /* a SYN took over a TIME-WAIT 4-tuple */
+	STAT_NET_BUSY_POLL_HITS, /* a busy-polling read found data */
+	STAT_NET_BUSY_POLL_MISSES, /* ... or gave up and blocked */
 
 	/* total number of counters */
 	STAT_NR,
 };
 
-struct timer_idx;
+/*
+ * Scheduling histograms are log-linear in TSC cycles: each power of two is
+ * split into SCHED_HIST_SUB buckets, so a bucket's width is within 25% of its
+ * lower bound. The last bucket also holds everything larger.
+ */
+#define SCHED_HIST_SUB_BITS	2
+#define SCHED_HIST_SUB		(1 << SCHED_HIST_SUB_BITS)
+#define SCHED_HIST_NR		(36 * SCHED_HIST_SUB)
+
+/* returns the histogram bucket for a duration of @cycles */
+static inline unsigned int sched_hist_idx(uint64_t cycles)
+{
+	unsigned int e, idx;
+
+	if (cycles < SCHED_HIST_SUB)
+		return cycles;
+
+	e = 63 - __builtin_clzll(cycles);
+	idx = (e - SCHED_HIST_SUB_BITS + 1) * SCHED_HIST_SUB +
+	      ((cycles >> (e - SCHED_HIST_SUB_BITS)) & (SCHED_HIST_SUB - 1));
+	return min(idx, SCHED_HIST_NR - 1);
+}
+
+/* returns the smallest duration (in cycles) that falls in bucket @idx */
+static inline uint64_t sched_hist_lower(unsigned int idx)
+{
+	unsigned int e = idx / SCHED_HIST_SUB + SCHED_HIST_SUB_BITS - 1;
+
+	if (idx < SCHED_HIST_SUB)
+		return idx;
+	return (uint64_t)(SCHED_HIST_SUB + idx % SCHED_HIST_SUB) <<
+	       (e - SCHED_HIST_SUB_BITS);
+}
+
+struct timer_wheel;
+struct fileio_ring;
 
 struct kthread {
 	/* 1st cache-line */
-	spinlock_t		lock;
+	ticketlock_t		lock;
 	uint32_t		generation;
 	uint32_t		rq_head;
 	uint32_t		rq_tail;
@@ -286,23 +537,73 @@ struct kthread {
 	unsigned int		rcu_gen;
 	unsigned int		curr_cpu;
 	uint64_t		park_us;
-	unsigned long		pad1[1];
+	unsigned int		rq_overflow_len;
+	unsigned int		idx;	/* the index in allks[] */
 
 	/* 3rd cache-line */
 	struct lrpc_chan_out	txpktq;
 	struct lrpc_chan_out	txcmdq;
 
-	/* 4th-7th cache-line */
+	/* 4th-7th cache-line (with the default RUNTIME_RQ_SIZE) */
 	thread_t		*rq[RUNTIME_RQ_SIZE];
 
 	/* 8th cache-line */
 	spinlock_t		timer_lock;
 	unsigned int		timern;
-	struct timer_idx	*timers;
-	unsigned long		pad2[6];
-
-	/* 9th cache-line, statistics counters */
+	struct timer_wheel	*timer_wheel;
+	uint64_t		timer_next_us;
+	struct list_head	rq_bg;
+	unsigned int		rq_bg_len;
+	unsigned int		softirq_budget;	/* protected by @lock */
+	struct rcu_head		*rcu_head;	/* callbacks queued here */
+	unsigned int		idle_gap_us;	/* protected by @lock */
+	unsigned int		rq_edf_len;	/* protected by @lock */
+
+	/* 9th cache-line, RX completions (see RX_COMPLETION_RING_SIZE) */
+	unsigned long		*rxc_ring;
+	uint32_t		rxc_head;
+	uint32_t		rxc_tail; /* cached from q_ptrs->rxc_tail */
+	uint32_t		rxc_published; /* last written to q_ptrs */
+	uint32_t		pad4[11];
+
+	/* 10th cache-line, statistics counters */
 	uint64_t		stats[STAT_NR];
+
+	/* scheduling latency and run length histograms (see sched_hist_idx()) */
+	uint64_t		lat_hist[SCHED_HIST_NR];
+	uint64_t		run_hist[SCHED_HIST_NR];
+	/* how long softirq work had waited each time the watchdog ran */
+	uint64_t		softirq_hist[SCHED_HIST_NR];
+	/* how late each timer ran after its deadline (see timer_softirq()) */
+	uint64_t		timer_hist[SCHED_HIST_NR];
+	/* when the RX queue was last seen empty (see softirq_delay()) */
+	uint64_t		rxq_empty_tsc;
+	/* the longest runqueue wait since overload.c last took it (cycles) */
+	uint64_t		qdelay_max;
+	/* ... and since kthread_adapt_spin() last took it */
+	uint64_t		spin_qdelay_max;
+
+	/* the event trace ring, allocated when tracing is first turned on */
+	struct rtrace_entry	*trace_ring;
+	uint64_t		trace_head;
+
+	/* the CPU profile ring and its sampling timer (see cpuprof.c) */
+	struct cpuprof_sample	*prof_ring;
+	uint64_t		prof_head;
+	timer_t			prof_timer;
+
+	/* the io_uring for file I/O, or NULL if unavailable (see fileio.c) */
+	struct fileio_ring	*fileio;
+
+	/* the index of this kthread's queues in the iokernel's thread table */
+	unsigned int		iok_idx;
+
+	/* egress packets not yet published to txpktq (see net_tx_flush()) */
+	unsigned int		nr_tx_staged;
+	struct mbuf		*tx_staged[RUNTIME_TX_STAGE_SIZE];
+
+	/* a min-heap of runnable threads by deadline, protected by @lock */
+	thread_t		*rq_edf[RUNTIME_EDF_SIZE];
 };
 
 /* compile-time verification of cache-line alignment */
@@ -311,6 +612,7 @@ BUILD_ASSERT(offsetof(struct kthread, q_ptrs) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, txpktq) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, rq) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, timer_lock) % CACHE_LINE_SIZE == 0);
+BUILD_ASSERT(offsetof(struct kthread, rxc_ring) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, stats) % CACHE_LINE_SIZE == 0);
 
 extern __thread struct kthread *mykthread;
@@ -345,14 +647,28 @@ static inline void putk(void)
 
 DECLARE_SPINLOCK(klock);
 extern unsigned int maxks;
+extern unsigned int kthread_limit;
 extern unsigned int spinks;
+extern unsigned int spinks_min;
+extern unsigned int spinks_max;
+extern unsigned int spin_qdelay_us;
 extern unsigned int guaranteedks;
+extern unsigned int congestion_latency_us;
+extern unsigned int scaleout_latency_us;
+extern unsigned int sched_priority;
+extern unsigned int sched_weight;
+extern unsigned int sched_ht_policy;
+extern unsigned int sched_tx_rate_mbps;
+extern uint64_t core_demand_deadline_tsc;
+extern bool flow_affinity;
 extern unsigned int nrks;
 extern struct kthread *ks[NCPU];
 extern struct kthread *allks[NCPU];
 
 extern void kthread_detach(struct kthread *r);
 extern void kthread_park(bool voluntary);
+extern void kthread_grow_limit(void);
+extern bool kthread_steer_flow(uint32_t rss_hash);
 extern void kthread_wait_to_attach(void);
 
 struct cpu_record {
@@ -375,18 +691,101 @@ extern struct cpu_record cpu_map[NCPU];
 #define STAT(counter) (myk()->stats[STAT_ ## counter])
 
 
+/*
+ * Event tracing (see inc/runtime/trace.h)
+ */
+
+extern bool rtrace_enabled;
+extern void __rtrace(int event, uint64_t arg, uint32_t aux);
+extern int rtrace_start(void);
+extern void rtrace_stop(void);
+extern ssize_t rtrace_dump(void);
+
+/**
+ * rtrace - records an event in the local kthread's trace ring
+ * @event: the event type (RTRACE_*)
+ * @arg: the event-specific argument
+ * @aux: more of it
+ *
+ * Costs a single predictable branch while tracing is off.
+ */
+static inline void rtrace(int event, uint64_t arg, uint32_t aux)
+{
+	if (unlikely(ACCESS_ONCE(rtrace_enabled)))
+		__rtrace(event, arg, aux);
+}
+
+
+/*
+ * CPU profiler (see cpuprof.c)
+ */
+
+#define CPUPROF_PATH		"/tmp/shenango-cpuprof.%d"
+#define CPUPROF_RING_SIZE	8192 /* per kthread, must be a power of two */
+#define CPUPROF_MAX_DEPTH	29
+
+struct cpuprof_sample {
+	uint64_t	th;	/* the running uthread, or 0 in the scheduler */
+	uint64_t	entry;	/* the function @th was created with */
+	uint32_t	depth;
+	uint32_t	pad;
+	uint64_t	pcs[CPUPROF_MAX_DEPTH]; /* innermost first */
+};
+
+extern unsigned int cpuprof_hz;
+extern bool cpuprof_enabled;
+extern int cpuprof_start(void);
+extern void cpuprof_stop(void);
+extern ssize_t cpuprof_dump(bool by_thread);
+
+
+
+/*
+ * Time slice preemption support
+ */
+
+extern unsigned int preempt_quantum_us;
+extern __thread uint64_t slice_start_tsc;
+
+extern void preempt_quantum_pause(void);
+extern void preempt_quantum_resume(void);
+
+
 
 /*
  * Softirq support
  */
 
-/* the maximum number of events to handle in a softirq invocation */
+/*
+ * The range of the adaptive per-kthread budget, the number of events to
+ * handle in a softirq invocation (see softirq_adapt_budget()).
+ */
+#define SOFTIRQ_MIN_BUDGET	4
 #define SOFTIRQ_MAX_BUDGET	128
 
+/* the largest batch the scheduler handles inline (see softirq_run_inline()) */
+#define SOFTIRQ_INLINE_MAX	8
+
+/*
+ * Ingress batches of at least twice SOFTIRQ_SPLIT_MIN packets are split by
+ * flow into up to SOFTIRQ_SPLIT_MAX threads, which other kthreads may steal.
+ */
+#define SOFTIRQ_SPLIT_MIN	32
+#define SOFTIRQ_SPLIT_MAX	4
+
 extern bool disable_watchdog;
+extern unsigned int sched_poll_iters;
+extern unsigned int sched_min_poll_us;
+extern unsigned int watchdog_us;
+extern unsigned int softirq_starve_us;
+extern bool edf_drop_expired;
+
+extern void sched_request_watchdog(void);
 
-extern thread_t *softirq_run_thread(struct kthread *k, unsigned int budget);
-extern void softirq_run(unsigned int budget);
+extern uint64_t softirq_delay(struct kthread *k, uint64_t now);
+extern thread_t *softirq_run_thread(struct kthread *k);
+extern bool softirq_run_inline(struct kthread *k);
+extern void softirq_run(void);
 
 
 /*
@@ -400,13 +799,32 @@ struct net_cfg {
 	uint32_t		netmask;
 	uint32_t		gateway;
 	struct eth_addr		mac;
-	uint8_t			pad[14];
+	uint16_t		mtu;
+	uint8_t			pad[12];
 } __packed;
 
 BUILD_ASSERT(sizeof(struct net_cfg) == CACHE_LINE_SIZE);
 
 extern struct net_cfg netcfg;
 
+/* IPv6 addressing, enabled by the "host_addr6" option */
+struct net_cfg6 {
+	struct ip6_addr		addr;	 /* the global address */
+	struct ip6_addr		addr_ll; /* the link-local address (EUI-64) */
+	struct ip6_addr		gateway; /* the default router, or zero */
+	int			prefix_len; /* of the on-link prefix of @addr */
+	bool			enabled;
+};
+
+extern struct net_cfg6 netcfg6;
+
+/* the size of RX and egress buffers, enough for an L2 frame of netcfg.mtu */
+static inline size_t net_buf_len(void)
+{
+	return netcfg.mtu > ETH_MTU ? MBUF_JUMBO_LEN : MBUF_DEFAULT_LEN;
+}
+extern bool enable_tso;
+
 #define MAX_ARP_STATIC_ENTRIES 1024
 struct cfg_arp_static_entry {
 	uint32_t ip;
@@ -415,23 +833,76 @@ struct cfg_arp_static_entry {
 extern int arp_static_count;
 extern struct cfg_arp_static_entry static_entries[MAX_ARP_STATIC_ENTRIES];
 
+#define MAX_ROUTES 64
+struct cfg_route {
+	uint32_t prefix;
+	int len;
+	uint32_t gateway; /* or 0 if the prefix is on-link */
+};
+extern int route_count;
+extern struct cfg_route route_entries[MAX_ROUTES];
+
+extern unsigned int trans_rx_prio_dscp;
+extern int tcp_cc_set_default(const char *name);
+extern unsigned int tcp_rto_min;
+extern unsigned int tcp_ack_timeout;
+extern unsigned int tcp_timer_slack;
+extern unsigned int tcp_syn_backlog;
+extern bool tcp_pacing;
+#define TCP_MAX_BUF	(64 * 1024 * 1024)
+extern unsigned int tcp_rx_buf_default;
+extern unsigned int tcp_tx_buf_default;
+
 extern void __net_recurrent(void);
 extern void net_rx_softirq(struct rx_net_hdr **hdrs, unsigned int nr);
 
+/* RX completions are published to the iokernel in batches of this many */
+#define NET_RX_COMPLETION_BATCH	64
+
+extern void __net_tx_flush(struct kthread *k);
+
+/**
+ * net_tx_flush - publishes a kthread's staged egress packets to the iokernel
+ * @k: the local kthread
+ *
+ * Packets are staged only while other uthreads are queued to run on @k, so
+ * their sends share one txpktq burst. They are flushed when the stage fills,
+ * before the last queued uthread runs, on entry to the scheduler, and before
+ * the kthread parks.
+ */
+static inline void net_tx_flush(struct kthread *k)
+{
+	if (k->nr_tx_staged)
+		__net_tx_flush(k);
+}
+
+/**
+ * net_rx_flush_completions - lets the iokernel see a kthread's RX completions
+ * @k: the local kthread
+ *
+ * Called when a batch fills, at the end of each RX softirq, and before the
+ * kthread parks, so no completion is held back for long.
+ */
+static inline void net_rx_flush_completions(struct kthread *k)
+{
+	if (k->rxc_published == k->rxc_head)
+		return;
+
+	k->rxc_published = k->rxc_head;
+	store_release(&k->q_ptrs->rxc_head, k->rxc_head);
+}
+
 
 /*
  * Timer support
  */
 
+extern unsigned int timer_spin_us;
+
 extern void timer_softirq(struct kthread *k, unsigned int budget);
 extern void timer_merge(struct kthread *r);
 extern uint64_t timer_earliest_deadline(void);
 
-struct timer_idx {
-	uint64_t		deadline_us;
-	struct timer_entry	*e;
-};
-
 /**
  * timer_needed - returns true if pending timers have to be handled
  * @k: the kthread to check
@@ -439,10 +910,82 @@ struct timer_idx {
 static inline bool timer_needed(struct kthread *k)
 {
 	/* deliberate race condition */
-	return k->timern > 0 && k->timers[0].deadline_us <= microtime();
+	return k->timern > 0 && k->timer_next_us <= microtime();
+}
+
+/**
+ * timer_imminent - returns true if a timer is due within timer_spin_us
+ * @k: the kthread to check
+ *
+ * Waking a parked kthread takes longer than that, so the scheduler keeps
+ * polling instead.
+ */
+static inline bool timer_imminent(struct kthread *k)
+{
+	/* deliberate race condition */
+	return k->timern > 0 &&
+	       k->timer_next_us <= microtime() + timer_spin_us;
+}
+
+
+/*
+ * Blocking call offload and file I/O support
+ */
+
+extern unsigned int offload_threads;
+extern atomic_t offload_nr_pending;
+extern unsigned int offload_nr_done;
+extern void offload_softirq(void);
+
+/**
+ * offload_needed - returns true if finished offloaded calls have to be handled
+ */
+static inline bool offload_needed(void)
+{
+	return ACCESS_ONCE(offload_nr_done) > 0;
+}
+
+extern atomic_t fileio_nr_inflight;
+extern bool __fileio_needed(void);
+extern void fileio_softirq(void);
+
+/**
+ * fileio_needed - returns true if completed file I/O has to be handled
+ */
+static inline bool fileio_needed(void)
+{
+	return atomic_read(&fileio_nr_inflight) > 0 && __fileio_needed();
+}
+
+/**
+ * blocking_io_needed - returns true if offloaded calls or file I/O finished
+ */
+static inline bool blocking_io_needed(void)
+{
+	return offload_needed() || fileio_needed();
+}
+
+/**
+ * blocking_io_pending - returns true if offloaded calls or file I/O haven't
+ * been handled yet
+ */
+static inline bool blocking_io_pending(void)
+{
+	return atomic_read(&offload_nr_pending) > 0 ||
+	       atomic_read(&fileio_nr_inflight) > 0;
 }
 
 
+/*
+ * Memory reclaim support
+ */
+
+/* free large pages idle for this long are unmapped (see page_reclaim()) */
+#define MEM_RECLAIM_IDLE_DEFAULT	(5 * ONE_SECOND)
+/* the number of free large pages kept mapped per NUMA node */
+#define MEM_RECLAIM_WATERMARK_DEFAULT	8
+
+
 /*
  * Init
  */
@@ -452,27 +995,56 @@ extern int kthread_init_thread(void);
 extern int ioqueues_init_thread(void);
 extern int stack_init_thread(void);
 extern int timer_init_thread(void);
+extern int preempt_init_thread(void);
 extern int sched_init_thread(void);
 extern int stat_init_thread(void);
 extern int net_init_thread(void);
+extern int tcp_init_thread(void);
+extern int udp_init_thread(void);
 extern int smalloc_init_thread(void);
+extern int fileio_init_thread(void);
+extern int cpuprof_init_thread(void);
 
 /* global initialization */
 extern int ioqueues_init(unsigned int threads);
 extern int stack_init(void);
 extern int sched_init(void);
 extern int preempt_init(void);
+extern int offload_init(void);
+extern int overload_init(void);
+extern int cpuprof_init(void);
+extern int waitaddr_init(void);
 extern int net_init(void);
 extern int arp_init(void);
+extern int ndisc_init(void);
+extern int route_init(void);
 extern int trans_init(void);
+
+/* chain length buckets from trans_table_hist(): 0, 1, 2, 3, 4-7, 8+ */
+#define TRANS_HIST_NR	6
+extern unsigned int trans_table_hist(uint64_t *hist);
+extern int tcp_init(void);
+extern int udp_init(void);
+
+/* how tcp_top_conns() ranks connections, for the stat port */
+enum {
+	TCP_TOP_RETRANSMITS = 0,
+	TCP_TOP_QUEUED,
+};
+
+struct tcp_conn_info;
+extern int tcp_top_conns(struct tcp_conn_info *infos, int n, int key);
 extern int smalloc_init(void);
 
 /* late initialization */
 extern int ioqueues_register_iokernel(void);
 extern int arp_init_late(void);
 extern int stat_init_late(void);
+extern bool stat_page_enabled;
 extern int tcp_init_late(void);
 extern int rcu_init_late(void);
+extern int smalloc_init_late(void);
+extern int timer_init_late(void);
 
 /* configuration loading */
 extern int cfg_load(const char *path);
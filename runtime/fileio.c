@@ -0,0 +1,353 @@
+/*
+ * fileio.c - asynchronous file I/O through one io_uring per kthread
+ *
+ * A thread submits its request to the io_uring of the kthread it runs on and
+ * parks. Completions are reaped as softirq work by whichever kthread gets to
+ * them first, so I/O submitted by a kthread that has since parked still
+ * finishes. If every kthread parks while requests are in flight, the last one
+ * asks the iokernel to wake it up after RUNTIME_OFFLOAD_POLL_US (see
+ * kthread_park()). The kernel reads the SQ ring, so submitting still takes an
+ * io_uring_enter() call, but it doesn't block.
+ *
+ * If the kernel doesn't support io_uring (or it's disallowed), requests are
+ * handed to the offload helpers instead (see offload.c).
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <base/log.h>
+#include <runtime/fileio.h>
+#include <runtime/offload.h>
+#include <runtime/sync.h>
+
+#include "defs.h"
+
+/* the most requests in flight per kthread */
+#define FILEIO_RING_DEPTH	64
+/* the most completions reaped from a ring at once */
+#define FILEIO_REAP_BATCH	16
+
+struct fileio_ring {
+	spinlock_t		lock;
+	int			fd;
+	unsigned int		inflight;	/* protected by @lock */
+
+	/* the submission queue */
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+
+	/* the completion queue */
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+};
+
+struct fileio_req {
+	thread_t		*th;
+	int			res;
+	struct iovec		iov;
+};
+
+/* requests in flight on every kthread's ring */
+atomic_t fileio_nr_inflight;
+
+static long fileio_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static long fileio_enter(int fd, unsigned int to_submit)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static struct fileio_ring *fileio_ring_create(void)
+{
+	struct io_uring_params p;
+	struct fileio_ring *r;
+	size_t sq_len, cq_len;
+	void *sq, *cq, *sqes;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = fileio_setup(FILEIO_RING_DEPTH, &p);
+	if (fd < 0)
+		return NULL;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = max(sq_len, cq_len);
+
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+	}
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+		    IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto fail;
+
+	r = aligned_alloc(CACHE_LINE_SIZE, align_up(sizeof(*r),
+						     CACHE_LINE_SIZE));
+	if (!r)
+		goto fail;
+	spin_lock_init(&r->lock);
+	r->fd = fd;
+	r->inflight = 0;
+	r->sq_tail = sq + p.sq_off.tail;
+	r->sq_mask = sq + p.sq_off.ring_mask;
+	r->sq_array = sq + p.sq_off.array;
+	r->sqes = sqes;
+	r->cq_head = cq + p.cq_off.head;
+	r->cq_tail = cq + p.cq_off.tail;
+	r->cq_mask = cq + p.cq_off.ring_mask;
+	r->cqes = cq + p.cq_off.cqes;
+	return r;
+
+fail:
+	/* the mappings go away with the process, this only happens at init */
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Queues a request on the local ring and parks until it completes. Returns
+ * false if the ring is full or unavailable, without queueing anything.
+ */
+static bool fileio_submit(struct fileio_req *req, uint8_t opcode, int fd,
+			  off_t off, uint32_t flags)
+{
+	struct io_uring_sqe *sqe;
+	struct fileio_ring *r;
+	struct kthread *k;
+	unsigned int tail;
+
+	k = getk();
+	r = k->fileio;
+	if (unlikely(!r)) {
+		putk();
+		return false;
+	}
+
+	spin_lock(&r->lock);
+	if (unlikely(r->inflight >= FILEIO_RING_DEPTH)) {
+		spin_unlock(&r->lock);
+		putk();
+		return false;
+	}
+
+	tail = *r->sq_tail;
+	sqe = &r->sqes[tail & *r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->off = off;
+	sqe->user_data = (uintptr_t)req;
+	if (opcode == IORING_OP_FSYNC) {
+		sqe->fsync_flags = flags;
+	} else {
+		sqe->addr = (uintptr_t)&req->iov;
+		sqe->len = 1;
+	}
+	r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+	store_release(r->sq_tail, tail + 1);
+
+	/* the kernel only takes entries during the call, so undo on failure */
+	if (unlikely(fileio_enter(r->fd, 1) != 1)) {
+		store_release(r->sq_tail, tail);
+		spin_unlock(&r->lock);
+		putk();
+		return false;
+	}
+
+	r->inflight++;
+	atomic_inc(&fileio_nr_inflight);
+	STAT(FILEIO_REQUESTS)++;
+	req->th = thread_self();
+	thread_park_and_unlock_np(&r->lock);
+	return true;
+}
+
+/* reaps up to a batch of @r's completions, returns the number reaped */
+static int fileio_reap(struct fileio_ring *r)
+{
+	thread_t *ths[FILEIO_REAP_BATCH];
+	struct io_uring_cqe *cqe;
+	struct fileio_req *req;
+	unsigned int head;
+	int i, n = 0;
+
+	spin_lock_np(&r->lock);
+	head = *r->cq_head;
+	while (n < FILEIO_REAP_BATCH && head != load_acquire(r->cq_tail)) {
+		cqe = &r->cqes[head & *r->cq_mask];
+		req = (struct fileio_req *)cqe->user_data;
+		req->res = cqe->res;
+		/* @req is gone once its thread runs */
+		ths[n++] = req->th;
+		head++;
+	}
+	store_release(r->cq_head, head);
+	r->inflight -= n;
+	spin_unlock_np(&r->lock);
+
+	atomic_sub_and_fetch(&fileio_nr_inflight, n);
+	for (i = 0; i < n; i++)
+		thread_ready(ths[i]);
+	return n;
+}
+
+static bool fileio_ring_ready(struct fileio_ring *r)
+{
+	return r && ACCESS_ONCE(r->inflight) > 0 &&
+	       ACCESS_ONCE(*r->cq_head) != load_acquire(r->cq_tail);
+}
+
+/**
+ * __fileio_needed - returns true if any kthread's ring has completions
+ *
+ * Only called while requests are in flight (see fileio_needed()).
+ */
+bool __fileio_needed(void)
+{
+	int i;
+
+	for (i = 0; i < maxks; i++) {
+		if (fileio_ring_ready(ACCESS_ONCE(allks[i]->fileio)))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * fileio_softirq - makes the threads of completed requests runnable
+ *
+ * Called from softirq context on any kthread.
+ */
+void fileio_softirq(void)
+{
+	struct fileio_ring *r;
+	int i;
+
+	for (i = 0; i < maxks; i++) {
+		r = ACCESS_ONCE(allks[i]->fileio);
+		while (fileio_ring_ready(r)) {
+			if (fileio_reap(r) < FILEIO_REAP_BATCH)
+				break;
+		}
+	}
+}
+
+static ssize_t fileio_rw(uint8_t opcode, int fd, void *buf, size_t len,
+			 off_t off)
+{
+	struct fileio_req req;
+
+	req.iov.iov_base = buf;
+	req.iov.iov_len = len;
+	if (likely(thread_self() && fileio_submit(&req, opcode, fd, off, 0)))
+		return req.res;
+
+	/* the positional calls don't take -1 for the file position */
+	if (off == -1) {
+		return offload_syscall(opcode == IORING_OP_READV ?
+				       SYS_readv : SYS_writev, (long)fd,
+				       &req.iov, 1L);
+	}
+	return offload_syscall(opcode == IORING_OP_READV ?
+			       SYS_preadv : SYS_pwritev, (long)fd, &req.iov,
+			       1L, off, 0L);
+}
+
+/**
+ * file_read - reads from a file
+ * @fd: the file descriptor
+ * @buf: a buffer to store the data
+ * @len: the length of @buf
+ * @off: the offset in the file, or -1 to read at (and advance) the file
+ *	 position
+ *
+ * The calling thread parks until the read finishes, while other threads keep
+ * running on its kthread.
+ *
+ * Returns the number of bytes read, or < 0 on failure.
+ */
+ssize_t file_read(int fd, void *buf, size_t len, off_t off)
+{
+	return fileio_rw(IORING_OP_READV, fd, buf, len, off);
+}
+
+/**
+ * file_write - writes to a file
+ * @fd: the file descriptor
+ * @buf: the data
+ * @len: the length of @buf
+ * @off: the offset in the file, or -1 to write at (and advance) the file
+ *	 position
+ *
+ * Like file_read(), the calling thread parks until the write finishes.
+ *
+ * Returns the number of bytes written, or < 0 on failure.
+ */
+ssize_t file_write(int fd, const void *buf, size_t len, off_t off)
+{
+	return fileio_rw(IORING_OP_WRITEV, fd, (void *)buf, len, off);
+}
+
+/**
+ * file_fsync - flushes a file to storage
+ * @fd: the file descriptor
+ * @datasync: only flush the data and the metadata needed to read it back
+ *	      (like fdatasync())
+ *
+ * Returns 0 if successful, or < 0 on failure.
+ */
+int file_fsync(int fd, bool datasync)
+{
+	struct fileio_req req;
+
+	if (likely(thread_self() &&
+		   fileio_submit(&req, IORING_OP_FSYNC, fd, 0,
+				 datasync ? IORING_FSYNC_DATASYNC : 0)))
+		return req.res;
+
+	return offload_syscall(datasync ? SYS_fdatasync : SYS_fsync, (long)fd);
+}
+
+/**
+ * fileio_init_thread - creates the kthread's io_uring
+ */
+int fileio_init_thread(void)
+{
+	static bool warned;
+	struct kthread *k = myk();
+
+	k->fileio = fileio_ring_create();
+	if (!k->fileio && !warned) {
+		warned = true;
+		log_warn("fileio: io_uring is unavailable, file I/O will use "
+			 "the offload helpers");
+	}
+
+	return 0;
+}
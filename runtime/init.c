@@ -8,6 +8,7 @@
 #include <base/init.h>
 #include <base/log.h>
 #include <base/limits.h>
+#include <base/mem.h>
 #include <runtime/thread.h>
 
 #include "defs.h"
@@ -34,11 +35,19 @@ static const struct init_entry global_init_handlers[] = {
 	GLOBAL_INITIALIZER(sched),
 	GLOBAL_INITIALIZER(preempt),
 	GLOBAL_INITIALIZER(smalloc),
+	GLOBAL_INITIALIZER(offload),
+	GLOBAL_INITIALIZER(overload),
+	GLOBAL_INITIALIZER(cpuprof),
+	GLOBAL_INITIALIZER(waitaddr),
 
 	/* network stack */
 	GLOBAL_INITIALIZER(net),
 	GLOBAL_INITIALIZER(arp),
+	GLOBAL_INITIALIZER(ndisc),
+	GLOBAL_INITIALIZER(route),
 	GLOBAL_INITIALIZER(trans),
+	GLOBAL_INITIALIZER(tcp),
+	GLOBAL_INITIALIZER(udp),
 };
 
 #define THREAD_INITIALIZER(name) \
@@ -51,11 +60,16 @@ static const struct init_entry thread_init_handlers[] = {
 	THREAD_INITIALIZER(ioqueues),
 	THREAD_INITIALIZER(stack),
 	THREAD_INITIALIZER(timer),
+	THREAD_INITIALIZER(preempt),
 	THREAD_INITIALIZER(sched),
 	THREAD_INITIALIZER(smalloc),
+	THREAD_INITIALIZER(fileio),
+	THREAD_INITIALIZER(cpuprof),
 
 	/* network stack */
 	THREAD_INITIALIZER(net),
+	THREAD_INITIALIZER(tcp),
+	THREAD_INITIALIZER(udp),
 };
 
 #define LATE_INITIALIZER(name) \
@@ -67,6 +81,8 @@ static const struct init_entry late_init_handlers[] = {
 	LATE_INITIALIZER(stat),
 	LATE_INITIALIZER(tcp),
 	LATE_INITIALIZER(rcu),
+	LATE_INITIALIZER(smalloc),
+	LATE_INITIALIZER(timer),
 };
 
 static int run_init_handlers(const char *phase,
@@ -154,12 +170,19 @@ int runtime_init(const char *cfgpath, thread_fn_t main_fn, void *arg)
 		return ret;
 	}
 
+	/* cache free large pages unless the config file says otherwise */
+	page_reclaim_idle_us = MEM_RECLAIM_IDLE_DEFAULT;
+	page_reclaim_watermark = MEM_RECLAIM_WATERMARK_DEFAULT;
+
 	ret = cfg_load(cfgpath);
 	if (ret)
 		return ret;
 
 	pthread_barrier_init(&init_barrier, NULL, maxks);
 
+	/* fault in the shared memory regions with one thread per kthread */
+	mem_prefault_threads = maxks;
+
 	ret = ioqueues_init(maxks);
 	if (ret) {
 		log_err("couldn't initialize ioqueues, ret = %d", ret);
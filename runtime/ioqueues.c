@@ -26,14 +26,22 @@
 
 #define PACKET_QUEUE_MCOUNT	4096
 #define COMMAND_QUEUE_MCOUNT	4096
-/* the egress buffer pool must be large enough to fill all the TXQs entirely */
+/*
+ * The egress buffer pool must be large enough to fill all the TXQs entirely.
+ * Its size is fixed, so it holds fewer (larger) buffers with jumbo frames.
+ */
 #define EGRESS_POOL_SIZE(nks) \
 	(PACKET_QUEUE_MCOUNT * MBUF_DEFAULT_LEN * max(16, (nks)) * 16UL)
+/* TSO buffers are optional, TCP falls back to regular buffers if exhausted */
+#define EGRESS_TSO_POOL_MCOUNT	256
+#define EGRESS_TSO_POOL_SIZE(nks) \
+	(enable_tso ? EGRESS_TSO_POOL_MCOUNT * MBUF_TSO_LEN * max(16, (nks)) : 0)
 
 DEFINE_SPINLOCK(qlock);
 unsigned int nrqs = 0;
 
 struct iokernel_control iok;
+bool prereg_enabled;
 
 static int generate_random_mac(struct eth_addr *mac)
 {
@@ -84,15 +92,28 @@ static size_t calculate_shm_space(unsigned int thread_count)
 	q = align_up(sizeof(struct q_ptrs), CACHE_LINE_SIZE);
 	ret += q * thread_count;
 
+	// RX completion rings
+	q = align_up(sizeof(unsigned long) * RX_COMPLETION_RING_SIZE,
+		     CACHE_LINE_SIZE);
+	ret += q * thread_count;
+
 	ret = align_up(ret, PGSIZE_2MB);
 
 	// Egress buffers
 	BUILD_ASSERT(ETH_MAX_LEN + sizeof(struct tx_net_hdr) <=
 			MBUF_DEFAULT_LEN);
 	BUILD_ASSERT(PGSIZE_2MB % MBUF_DEFAULT_LEN == 0);
+	BUILD_ASSERT(ETH_MAX_LEN_JUMBO + sizeof(struct tx_net_hdr) <=
+			MBUF_JUMBO_LEN);
+	BUILD_ASSERT(PGSIZE_2MB % MBUF_JUMBO_LEN == 0);
 	ret += EGRESS_POOL_SIZE(thread_count);
 	ret = align_up(ret, PGSIZE_2MB);
 
+	// Egress TSO buffers
+	BUILD_ASSERT(PGSIZE_2MB % MBUF_TSO_LEN == 0);
+	ret += EGRESS_TSO_POOL_SIZE(thread_count);
+	ret = align_up(ret, PGSIZE_2MB);
+
 	return ret;
 }
 
@@ -117,16 +138,83 @@ static void queue_pointers_alloc(struct shm_region *r,
 	tspec->rxq.wb = ptr_to_shmptr(r, *ptr, sizeof(struct q_ptrs));
 
 	tspec->q_ptrs = ptr_to_shmptr(r, *ptr, sizeof(struct q_ptrs));
-	*((uint32_t *) *ptr) = 0;
+	memset(*ptr, 0, sizeof(struct q_ptrs));
 	*ptr += align_up(sizeof(struct q_ptrs), CACHE_LINE_SIZE);
 }
 
+static void rx_completions_alloc(struct shm_region *r,
+		struct thread_spec *tspec, char **ptr)
+{
+	size_t len = sizeof(unsigned long) * RX_COMPLETION_RING_SIZE;
+
+	tspec->rx_completions = ptr_to_shmptr(r, *ptr, len);
+	*ptr += align_up(len, CACHE_LINE_SIZE);
+}
+
+/*
+ * Connect to the iokernel's control socket. Returns a file descriptor, or -1
+ * on error.
+ */
+static int ioqueues_connect_iokernel(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	BUILD_ASSERT(strlen(CONTROL_SOCK_PATH) <= sizeof(addr.sun_path) - 1);
+	memset(&addr, 0x0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, CONTROL_SOCK_PATH, sizeof(addr.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		log_err("connect_iokernel: socket() failed [%s]",
+			strerror(errno));
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr,
+		    sizeof(struct sockaddr_un)) == -1) {
+		log_err("connect_iokernel: connect() failed [%s]",
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Reserve one of the iokernel's pre-registered shm regions, which is already
+ * mapped and faulted in. Returns its key, or 0 if none is free.
+ */
+static mem_key_t ioqueues_prereg_reserve(size_t len)
+{
+	mem_key_t key = CONTROL_PREREG_KEY;
+	int fd;
+
+	fd = ioqueues_connect_iokernel();
+	if (fd == -1)
+		return 0;
+
+	if (write(fd, &key, sizeof(key)) != sizeof(key) ||
+	    write(fd, &len, sizeof(len)) != sizeof(len) ||
+	    read(fd, &key, sizeof(key)) != sizeof(key)) {
+		log_err("prereg_reserve: couldn't reach the iokernel [%s]",
+			strerror(errno));
+		key = 0;
+	}
+
+	close(fd);
+	return key;
+}
+
 static int ioqueues_shm_setup(unsigned int threads)
 {
 	struct shm_region *r = &netcfg.tx_region, *ingress_region = &netcfg.rx_region;
 	char *ptr;
 	int i, ret;
-	size_t shm_len;
+	size_t shm_len, pgsize;
+	bool prereg = false;
 
 	if (!netcfg.mac.addr[0]) {
 		ret = generate_random_mac(&netcfg.mac);
@@ -134,18 +222,45 @@ static int ioqueues_shm_setup(unsigned int threads)
 			return ret;
 	}
 
-	BUILD_ASSERT(sizeof(netcfg.mac) >= sizeof(mem_key_t));
-	iok.key = *(mem_key_t*)(&netcfg.mac);
-	iok.key = rand_crc32c(iok.key);
-
 	/* map shared memory for control header, command queues, and egress pkts */
 	shm_len = calculate_shm_space(threads);
 	r->len = shm_len;
-	r->base = mem_map_shm(iok.key, NULL, shm_len, PGSIZE_2MB, true);
+	r->base = MAP_FAILED;
+
+	/* the iokernel has (zeroed) pre-registered regions ready */
+	iok.key = prereg_enabled ? ioqueues_prereg_reserve(shm_len) : 0;
+	if (iok.key) {
+		r->base = mem_map_shm(iok.key, NULL, shm_len, PGSIZE_2MB,
+				      false);
+		if (r->base == MAP_FAILED)
+			log_warn("control_setup: couldn't map prereg region");
+		else
+			prereg = true;
+		if (prereg && mem_lookup_page_size(r->base, &pgsize))
+			pgsize = PGSIZE_2MB;
+	}
+
 	if (r->base == MAP_FAILED) {
-		log_err("control_setup: mem_map_shm() failed");
-		return -1;
+		BUILD_ASSERT(sizeof(netcfg.mac) >= sizeof(mem_key_t));
+		iok.key = *(mem_key_t*)(&netcfg.mac);
+		iok.key = rand_crc32c(iok.key);
+
+		/*
+		 * The iokernel DMAs out of this region, so it needs at least
+		 * 2MB pages, and it's mapped before anything else so it gets
+		 * first pick.
+		 */
+		r->base = mem_map_shm_fallback(iok.key, NULL, shm_len,
+					       PGSIZE_1GB, PGSIZE_2MB, true,
+					       &pgsize);
+		if (r->base == MAP_FAILED) {
+			log_err("control_setup: mem_map_shm() failed");
+			return -1;
+		}
 	}
+	log_info("control_setup: mapped %ld KB of egress memory with %ld KB "
+		 "pages%s", shm_len / 1024, pgsize / 1024,
+		 prereg ? " (pre-registered)" : "");
 
 	/* map ingress memory */
 	ingress_region->base =
@@ -171,6 +286,7 @@ static int ioqueues_shm_setup(unsigned int threads)
 		ioqueue_alloc(r, &tspec->txcmdq, &ptr, COMMAND_QUEUE_MCOUNT, true);
 
 		queue_pointers_alloc(r, tspec, &ptr);
+		rx_completions_alloc(r, tspec, &ptr);
 	}
 
 	ptr = (char *)align_up((uintptr_t)ptr, PGSIZE_2MB);
@@ -180,6 +296,13 @@ static int ioqueues_shm_setup(unsigned int threads)
 	ptr_to_shmptr(r, ptr, iok.tx_len);
 	ptr += iok.tx_len;
 
+	ptr = (char *)align_up((uintptr_t)ptr, PGSIZE_2MB);
+	iok.tso_buf = ptr;
+	iok.tso_len = EGRESS_TSO_POOL_SIZE(threads);
+
+	ptr_to_shmptr(r, ptr, iok.tso_len);
+	ptr += iok.tso_len;
+
 	iok.next_free = ptr_to_shmptr(r, ptr, 0);
 
 	return 0;
@@ -231,43 +354,34 @@ int ioqueues_register_iokernel(void)
 {
 	struct control_hdr *hdr;
 	struct shm_region *r = &netcfg.tx_region;
-	struct sockaddr_un addr;
 	int ret, i;
 	int kthread_fds[NCPU];
 
 	/* initialize control header */
 	hdr = r->base;
 	hdr->magic = CONTROL_HDR_MAGIC;
-	hdr->egress_buf_count = EGRESS_POOL_SIZE(iok.thread_count) / MBUF_DEFAULT_LEN;
+	hdr->egress_buf_count = EGRESS_POOL_SIZE(iok.thread_count) / net_buf_len() +
+				EGRESS_TSO_POOL_SIZE(iok.thread_count) / MBUF_TSO_LEN;
 	hdr->thread_count = iok.thread_count;
 	hdr->mac = netcfg.mac;
+	hdr->mtu = netcfg.mtu;
 
-	hdr->sched_cfg.priority = SCHED_PRIORITY_NORMAL;
-	hdr->sched_cfg.max_cores = iok.thread_count;
+	hdr->sched_cfg.priority = sched_priority;
+	hdr->sched_cfg.max_cores = kthread_limit;
 	hdr->sched_cfg.guaranteed_cores = guaranteedks;
-	hdr->sched_cfg.congestion_latency_us = 0;
-	hdr->sched_cfg.scaleout_latency_us = 0;
+	hdr->sched_cfg.congestion_latency_us = congestion_latency_us;
+	hdr->sched_cfg.scaleout_latency_us = scaleout_latency_us;
+	hdr->sched_cfg.weight = sched_weight;
+	hdr->sched_cfg.ht_policy = sched_ht_policy;
+	hdr->sched_cfg.tx_rate_mbps = sched_tx_rate_mbps;
 
 	memcpy(hdr->threads, iok.threads,
 			sizeof(struct thread_spec) * iok.thread_count);
 
 	/* register with iokernel */
-	BUILD_ASSERT(strlen(CONTROL_SOCK_PATH) <= sizeof(addr.sun_path) - 1);
-	memset(&addr, 0x0, sizeof(struct sockaddr_un));
-	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, CONTROL_SOCK_PATH, sizeof(addr.sun_path) - 1);
-
-	iok.fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (iok.fd == -1) {
-		log_err("register_iokernel: socket() failed [%s]", strerror(errno));
+	iok.fd = ioqueues_connect_iokernel();
+	if (iok.fd == -1)
 		goto fail;
-	}
-
-	if (connect(iok.fd, (struct sockaddr *)&addr,
-		 sizeof(struct sockaddr_un)) == -1) {
-		log_err("register_iokernel: connect() failed [%s]", strerror(errno));
-		goto fail_close_fd;
-	}
 
 	ret = write(iok.fd, &iok.key, sizeof(iok.key));
 	if (ret != sizeof(iok.key)) {
@@ -308,7 +422,8 @@ int ioqueues_init_thread(void)
 
 	spin_lock(&qlock);
 	assert(nrqs < iok.thread_count);
-	struct thread_spec *ts = &iok.threads[nrqs++];
+	struct thread_spec *ts = &iok.threads[nrqs];
+	myk()->iok_idx = nrqs++;
 	ts->tid = tid;
 	ts->park_efd = myk()->park_efd;
 	spin_unlock(&qlock);
@@ -323,8 +438,15 @@ int ioqueues_init_thread(void)
 	BUG_ON(ret);
 
 	myk()->q_ptrs = (struct q_ptrs *) shmptr_to_ptr(r, ts->q_ptrs,
-			sizeof(uint32_t));
+			sizeof(struct q_ptrs));
 	BUG_ON(!myk()->q_ptrs);
+	preempt_req = &myk()->q_ptrs->preempt_req;
+
+	myk()->rxc_ring = (unsigned long *) shmptr_to_ptr(r,
+			ts->rx_completions,
+			sizeof(unsigned long) * RX_COMPLETION_RING_SIZE);
+	BUG_ON(!myk()->rxc_ring);
+	myk()->rxc_head = myk()->rxc_tail = myk()->rxc_published = 0;
 
 	return 0;
 }
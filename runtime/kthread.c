@@ -21,13 +21,33 @@
 DEFINE_SPINLOCK(klock);
 /* the maximum number of kthreads */
 unsigned int maxks;
+/* the most kthreads the iokernel may run at once, raised up to @maxks */
+unsigned int kthread_limit;
 /* the total number of attached kthreads (i.e. the size of @ks) */
 unsigned int nrks;
 /* the number of busy spinning kthreads (threads that don't park) */
 unsigned int spinks;
+/* the range kthread_adapt_spin() moves @spinks in (fixed if max <= min) */
+unsigned int spinks_min;
+unsigned int spinks_max;
+/* the runqueue delay (us) above which another kthread is kept spinning */
+unsigned int spin_qdelay_us = RUNTIME_SPIN_QDELAY_US;
 /* the number of guaranteed kthreads (we can always have this many if we want,
  * must be >= 1) */
 unsigned int guaranteedks = 1;
+/* queueing delay targets (us) reported to the iokernel (0 uses its default) */
+unsigned int congestion_latency_us;
+unsigned int scaleout_latency_us;
+/* the iokernel scheduling class and fair-share weight */
+unsigned int sched_priority = SCHED_PRIORITY_NORMAL;
+unsigned int sched_weight = 1;
+unsigned int sched_ht_policy = SCHED_HT_SHARE;
+/* the egress rate limit enforced by the iokernel (Mbits/s), or 0 */
+unsigned int sched_tx_rate_mbps;
+/* idle kthreads keep polling until this time (TSC) after a demand hint */
+uint64_t core_demand_deadline_tsc;
+/* steer flows to the kthreads that read them (see tcp_rx_steer()) */
+bool flow_affinity;
 /* the number of active kthreads */
 static atomic_t runningks;
 /* an array of attached kthreads (@nrks in total) */
@@ -49,8 +69,12 @@ static struct kthread *allock(void)
 		return NULL;
 
 	memset(k, 0, sizeof(*k));
-	spin_lock_init(&k->lock);
+	ticket_lock_init(&k->lock);
 	list_head_init(&k->rq_overflow);
+	list_head_init(&k->rq_bg);
+	k->softirq_budget = RUNTIME_SOFTIRQ_BUDGET;
+	k->idle_gap_us = RUNTIME_IDLE_GAP_MAX_US;
+	k->rxq_empty_tsc = rdtsc();
 	mbufq_init(&k->txpktq_overflow);
 	mbufq_init(&k->txcmdq_overflow);
 	spin_lock_init(&k->timer_lock);
@@ -74,6 +98,7 @@ int kthread_init_thread(void)
 		return -ENOMEM;
 
 	spin_lock_np(&klock);
+	mykthread->idx = allksn;
 	allks[allksn++] = mykthread;
 	assert(allksn <= maxks);
 	spin_unlock_np(&klock);
@@ -117,7 +142,7 @@ void kthread_detach(struct kthread *r)
 	struct kthread *k = myk();
 	int i;
 
-	assert_spin_lock_held(&r->lock);
+	assert_ticket_lock_held(&r->lock);
 	assert(r != k);
 	assert(r->parked == true);
 	assert(r->detached == false);
@@ -150,11 +175,24 @@ found:
 	/* merge timer queue into our own */
 	timer_merge(r);
 
+	/*
+	 * Have its flows delivered here too, so a connection's packets, timers
+	 * and egress stay together. Nothing is left in its RX queue, so none
+	 * are reordered. If this is lost, the iokernel spreads the flows out
+	 * once a packet for one arrives.
+	 */
+	if (likely(lrpc_send(&k->txcmdq, TXCMD_FLOW_ADOPT, r->iok_idx)))
+		STAT(FLOW_ADOPTS)++;
+
 	/* verify the kthread is correctly detached */
 	assert(r->rq_head == r->rq_tail);
 	assert(list_empty(&r->rq_overflow));
+	assert(r->rq_overflow_len == 0);
+	assert(list_empty(&r->rq_bg));
+	assert(r->rq_edf_len == 0);
 	assert(mbufq_empty(&r->txpktq_overflow));
 	assert(mbufq_empty(&r->txcmdq_overflow));
+	assert(r->nr_tx_staged == 0);
 	assert(r->timern == 0);
 
 	/* set state */
@@ -170,6 +208,8 @@ static void kthread_yield_to_iokernel(void)
 	ssize_t s;
 	uint64_t assigned_core, last_core = k->curr_cpu;
 
+	/* any preemption request is satisfied by parking */
+	ACCESS_ONCE(k->q_ptrs->preempt_req) = 0;
 	clear_preempt_needed();
 
 	/* yield to the iokernel */
@@ -188,6 +228,110 @@ static void kthread_yield_to_iokernel(void)
 	store_release(&cpu_map[assigned_core - 1].recent_kthread, k);
 }
 
+/* folds the length of an idle period into @k's moving average */
+static void kthread_update_idle_gap(struct kthread *k, uint64_t gap_us)
+{
+	gap_us = min(gap_us, (uint64_t)RUNTIME_IDLE_GAP_MAX_US);
+	k->idle_gap_us = (k->idle_gap_us * 7 + gap_us) / 8;
+}
+
+static bool kthread_has_work(struct kthread *k)
+{
+	return !lrpc_empty(&k->rxq) || timer_needed(k) || blocking_io_needed() ||
+	       ACCESS_ONCE(k->rq_head) != ACCESS_ONCE(k->rq_tail) ||
+	       !list_empty(&k->rq_overflow) || ACCESS_ONCE(k->rq_edf_len);
+}
+
+/*
+ * Spins for a while if work has recently come back soon after this kthread
+ * went idle, since parking and waking up takes several microseconds. The
+ * window is twice the average idle gap, and no spinning happens once gaps
+ * grow past RUNTIME_PARK_SPIN_US / 2. Returns true if work showed up.
+ */
+static bool kthread_park_spin(struct kthread *k, uint64_t start_us)
+{
+	uint64_t window_us = k->idle_gap_us * 2, now_us;
+
+	if (window_us > RUNTIME_PARK_SPIN_US)
+		return false;
+
+	do {
+		cpu_relax();
+		preempt_poll();
+		if (preempt_needed())
+			break;
+		now_us = microtime();
+		if (kthread_has_work(k)) {
+			kthread_update_idle_gap(k, now_us - start_us);
+			STAT(PARK_SPIN_HITS)++;
+			return true;
+		}
+	} while (now_us - start_us < window_us);
+
+	STAT(PARK_SPIN_MISSES)++;
+	return false;
+}
+
+/*
+ * Adjusts @spinks between @spinks_min and @spinks_max, once every
+ * RUNTIME_SPIN_ADAPT_US on whichever kthread gets there first. A wakeup from
+ * the iokernel takes several microseconds, so when threads waited longer than
+ * @spin_qdelay_us while kthreads were parking, or kthreads parked and were
+ * woken up often, one more kthread is kept spinning. Once neither has been
+ * the case for SPIN_CALM_ROUNDS in a row, one is allowed to park again, so an
+ * idle runtime gives its cores back to other tenants.
+ */
+#define SPIN_CALM_ROUNDS	100
+/* parks per round that count as frequent wakeups */
+#define SPIN_PARKS_BUSY		10
+
+static void kthread_adapt_spin(void)
+{
+	static uint64_t last_tsc, last_parks;
+	static unsigned int calm_rounds;
+	uint64_t now = rdtsc(), last = ACCESS_ONCE(last_tsc);
+	uint64_t delay = 0, parks = 0, d, target;
+	unsigned int n = ACCESS_ONCE(spinks);
+	struct kthread *k;
+	int i;
+
+	if (spinks_max <= spinks_min)
+		return;
+	if (now - last < (uint64_t)RUNTIME_SPIN_ADAPT_US * cycles_per_us)
+		return;
+	if (!__sync_bool_compare_and_swap(&last_tsc, last, now))
+		return;
+
+	for (i = 0; i < maxks; i++) {
+		k = ACCESS_ONCE(allks[i]);
+		if (!k)
+			continue;
+		parks += ACCESS_ONCE(k->stats[STAT_PARKS]);
+		d = ACCESS_ONCE(k->spin_qdelay_max);
+		if (d) {
+			ACCESS_ONCE(k->spin_qdelay_max) = 0;
+			delay = max(delay, d);
+		}
+	}
+	d = parks - last_parks;
+	last_parks = parks;
+
+	target = (uint64_t)spin_qdelay_us * cycles_per_us;
+	if ((delay > target && d > 0) || d >= SPIN_PARKS_BUSY) {
+		calm_rounds = 0;
+		if (n < spinks_max) {
+			ACCESS_ONCE(spinks) = n + 1;
+			STAT(SPINKS_RAISES)++;
+		}
+	} else if (++calm_rounds >= SPIN_CALM_ROUNDS) {
+		calm_rounds = 0;
+		if (n > spinks_min) {
+			ACCESS_ONCE(spinks) = n - 1;
+			STAT(SPINKS_CUTS)++;
+		}
+	}
+}
+
 /*
  * kthread_park - block this kthread until the iokernel wakes it up.
  * @voluntary: true if this kthread parked because it had no work left
@@ -199,17 +343,26 @@ void kthread_park(bool voluntary)
 {
 	struct kthread *k = myk();
 	unsigned long payload = 0;
-	uint64_t cmd = TXCMD_PARKED, deadline_us;
+	uint64_t cmd = TXCMD_PARKED, deadline_us, idle_start_us;
 
+	net_tx_flush(k);
 	if (!voluntary ||
 	    !mbufq_empty(&k->txpktq_overflow) ||
 	    !mbufq_empty(&k->txcmdq_overflow)) {
 		payload = (unsigned long)k;
 	}
 
-	assert_spin_lock_held(&k->lock);
+	assert_ticket_lock_held(&k->lock);
 	assert(k->parked == false);
 
+	kthread_adapt_spin();
+
+	/* don't bother parking if more work is likely about to arrive */
+	idle_start_us = microtime();
+	if (voluntary && atomic_read(&runningks) > spinks &&
+	    kthread_park_spin(k, idle_start_us))
+		return;
+
 	/* atomically verify we have at least @spinks kthreads running */
 	if (atomic_read(&runningks) <= spinks)
 		return;
@@ -237,28 +390,97 @@ void kthread_park(bool voluntary)
 		}
 	}
 
+	/* offloaded calls and file I/O may finish while every kthread is parked */
+	if (!remaining_ks && blocking_io_pending() &&
+	    (cmd == TXCMD_PARKED_LAST || !payload)) {
+		cmd = TXCMD_PARKED_LAST;
+		if (!payload || payload > RUNTIME_OFFLOAD_POLL_US)
+			payload = RUNTIME_OFFLOAD_POLL_US;
+	}
+
 	k->parked = true;
 	k->park_us = now;
 	STAT(PARKS)++;
-	spin_unlock(&k->lock);
+	/* the iokernel frees the completions it can see when this parks */
+	net_rx_flush_completions(k);
+	ticket_unlock(&k->lock);
 
 	/* signal to iokernel that we're about to park */
+	rtrace(RTRACE_PARK, cmd, 0);
 	while (!lrpc_send(&k->txcmdq, cmd, payload))
 		cpu_relax();
 
+	preempt_quantum_pause();
 	kthread_yield_to_iokernel();
+	preempt_quantum_resume();
 
 	/* iokernel has unparked us */
+	rtrace(RTRACE_UNPARK, k->curr_cpu, 0);
+	/* the wakeup's latency is the iokernel's, not a softirq delay */
+	ACCESS_ONCE(k->rxq_empty_tsc) = rdtsc();
 
-	spin_lock(&k->lock);
+	ticket_lock(&k->lock);
 	k->parked = false;
 	atomic_inc(&runningks);
+	if (voluntary)
+		kthread_update_idle_gap(k, microtime() - idle_start_us);
 
 	/* reattach kthread if necessary */
 	if (k->detached)
 		kthread_attach();
 }
 
+/**
+ * kthread_grow_limit - lets the iokernel run one more kthread
+ *
+ * Called by the scheduler when its runqueue overflows. If every kthread the
+ * iokernel may currently run is busy, the limit is raised by one, at most
+ * every RUNTIME_KTHREAD_GROW_US. The limit is never lowered again.
+ */
+void kthread_grow_limit(void)
+{
+	static uint64_t last_grow_us;
+	struct kthread *k = myk();
+	unsigned int limit = ACCESS_ONCE(kthread_limit);
+	uint64_t now;
+
+	assert_preempt_disabled();
+
+	if (limit >= maxks || ACCESS_ONCE(nrks) < limit)
+		return;
+	now = microtime();
+	if (now - ACCESS_ONCE(last_grow_us) < RUNTIME_KTHREAD_GROW_US)
+		return;
+	if (!__sync_bool_compare_and_swap(&kthread_limit, limit, limit + 1))
+		return;
+	ACCESS_ONCE(last_grow_us) = now;
+
+	if (unlikely(!lrpc_send(&k->txcmdq, TXCMD_CORE_LIMIT, limit + 1))) {
+		__sync_bool_compare_and_swap(&kthread_limit, limit + 1, limit);
+		return;
+	}
+	STAT(KTHREAD_LIMIT_RAISES)++;
+}
+
+/**
+ * kthread_steer_flow - asks the iokernel to deliver a flow to this kthread
+ * @rss_hash: the RSS hash of the flow's packets
+ *
+ * The iokernel moves the flow's bucket (and any other flows in it) to this
+ * kthread while it is running. Must be called with preemption disabled.
+ *
+ * Returns true if the request was sent.
+ */
+bool kthread_steer_flow(uint32_t rss_hash)
+{
+	assert_preempt_disabled();
+
+	if (unlikely(!lrpc_send(&myk()->txcmdq, TXCMD_FLOW_STEER, rss_hash)))
+		return false;
+	STAT(FLOW_STEERS)++;
+	return true;
+}
+
 /**
  * kthread_wait_to_attach - block this kthread until the iokernel wakes it up.
  *
@@ -272,3 +494,46 @@ void kthread_wait_to_attach(void)
 	kthread_attach();
 	atomic_inc(&runningks);
 }
+
+/**
+ * runtime_request_cores - hints that cores will be needed soon
+ * @nr: the number of cores the runtime expects to use
+ * @duration_us: how long they will be needed for (us)
+ *
+ * Call this before a burst of work that is known in advance, such as a
+ * fan-out, so the iokernel grants cores before queues build up instead of
+ * reacting to congestion. Grants still follow the runtime's priority and
+ * guarantees, and idle kthreads keep polling rather than parking until
+ * @duration_us passes.
+ *
+ * Returns 0 if successful, -EINVAL if @nr or @duration_us is invalid, or
+ * -EAGAIN if the command queue is full.
+ */
+int runtime_request_cores(unsigned int nr, unsigned int duration_us)
+{
+	struct kthread *k;
+	unsigned long payload;
+	bool sent;
+
+	if (nr == 0 || nr > maxks || duration_us == 0)
+		return -EINVAL;
+
+	payload = TXCMD_CORE_DEMAND_PAYLOAD(nr, duration_us);
+	k = getk();
+	sent = lrpc_send(&k->txcmdq, TXCMD_CORE_DEMAND, payload);
+	putk();
+	if (!sent)
+		return -EAGAIN;
+
+	ACCESS_ONCE(core_demand_deadline_tsc) = rdtsc() +
+		(uint64_t)duration_us * cycles_per_us;
+	return 0;
+}
+
+/**
+ * runtime_max_cores - gets the most cores (kthreads) the runtime can use
+ */
+unsigned int runtime_max_cores(void)
+{
+	return maxks;
+}
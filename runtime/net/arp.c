@@ -3,6 +3,7 @@
  */
 
 #include <stddef.h>
+#include <string.h>
 
 #include <base/lock.h>
 #include <base/log.h>
@@ -20,6 +21,8 @@
 #define ARP_RETRIES		3
 #define ARP_RETRY_TIME		ONE_SECOND
 #define ARP_REPROBE_TIME	(10 * ONE_SECOND)
+/* the most packets that may wait on one unresolved entry */
+#define ARP_MAX_PENDING		32
 
 enum {
 	/* the MAC address is being probed */
@@ -32,7 +35,11 @@ enum {
 	ARP_STATE_STATIC,
 };
 
-/* A single entry in the ARP table. */
+/*
+ * A single entry in the ARP table. Readers never take a lock: @eth is written
+ * before @state leaves ARP_STATE_PROBING and then never changes, and an entry
+ * whose MAC address changes is replaced by a new one under RCU.
+ */
 struct arp_entry {
 	/* accessed by RCU sections */
 	uint32_t		state;
@@ -40,16 +47,36 @@ struct arp_entry {
 	struct eth_addr		eth;
 	struct rcu_hlist_node	link;
 
-	/* accessed only with @arp_lock */
+	/* accessed only with the bucket lock */
 	struct mbufq		q;
+	int			q_len;
 	struct rcu_head		rcuh;
 	uint64_t		ts;
 	int			tries_left;
-	int			pad;
 };
 
-static DEFINE_SPINLOCK(arp_lock);
-static struct rcu_hlist_head arp_tbl[ARP_TABLE_CAPACITY];
+/* updates are serialized per bucket */
+struct arp_bucket {
+	spinlock_t		lock;
+	struct rcu_hlist_head	head;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct arp_bucket arp_tbl[ARP_TABLE_CAPACITY];
+static atomic_t arp_worker_started;
+
+/*
+ * Nearly all traffic goes to the gateway, so each kthread remembers its last
+ * hit. Any change that could make a remembered address stale (a new MAC or a
+ * deleted entry) bumps @arp_gen, which invalidates every kthread's copy.
+ */
+struct arp_last_hit {
+	uint32_t		ip;
+	int			gen;
+	struct eth_addr		eth;
+};
+
+atomic_t arp_gen = ATOMIC_INIT(1);
+static DEFINE_PERTHREAD(struct arp_last_hit, arp_last);
 
 static void arp_worker(void *arg);
 
@@ -63,7 +90,7 @@ static struct arp_entry *lookup_entry(int idx, uint32_t daddr)
 	struct arp_entry *e;
 	struct rcu_hlist_node *node;
 
-	rcu_hlist_for_each(&arp_tbl[idx], node, true) {
+	rcu_hlist_for_each(&arp_tbl[idx].head, node, true) {
 		e = rcu_hlist_entry(node, struct arp_entry, link);
 		if (e->ip == daddr)
 			return e;
@@ -72,6 +99,11 @@ static struct arp_entry *lookup_entry(int idx, uint32_t daddr)
 	return NULL;
 }
 
+static inline void arp_invalidate_last_hits(void)
+{
+	atomic_inc(&arp_gen);
+}
+
 static void release_entry(struct rcu_head *h)
 {
 	struct arp_entry *e = container_of(h, struct arp_entry, rcuh);
@@ -81,6 +113,7 @@ static void release_entry(struct rcu_head *h)
 static void delete_entry(struct arp_entry *e)
 {
 	rcu_hlist_del(&e->link);
+	arp_invalidate_last_hits();
 
 	/* free any mbufs waiting for an ARP response */
 	while (!mbufq_empty(&e->q)) {
@@ -94,15 +127,13 @@ static void delete_entry(struct arp_entry *e)
 
 static void insert_entry(struct arp_entry *e, int idx)
 {
-	static bool worker_running;
-
-	rcu_hlist_add_head(&arp_tbl[idx], &e->link);
+	rcu_hlist_add_head(&arp_tbl[idx].head, &e->link);
 
-	if (unlikely(!worker_running && e->state != ARP_STATE_STATIC)) {
-		worker_running = true;
+	if (unlikely(e->state != ARP_STATE_STATIC &&
+		     !atomic_read(&arp_worker_started) &&
+		     atomic_cmpxchg(&arp_worker_started, 0, 1))) {
 		BUG_ON(thread_spawn(arp_worker, NULL));
 	}
-
 }
 
 static struct arp_entry *create_entry(uint32_t daddr)
@@ -116,6 +147,7 @@ static struct arp_entry *create_entry(uint32_t daddr)
 	e->ts = microtime();
 	e->tries_left = ARP_RETRIES;
 	mbufq_init(&e->q);
+	e->q_len = 0;
 	return e;
 }
 
@@ -181,7 +213,7 @@ static void arp_age_entry(uint64_t now_us, struct arp_entry *e)
 static void arp_worker(void *arg)
 {
 	struct arp_entry *e;
-	struct rcu_hlist_node *node;
+	struct rcu_hlist_node *node, *tmp;
 	uint64_t now_us;
 	int i;
 
@@ -190,13 +222,14 @@ static void arp_worker(void *arg)
 		now_us = microtime();
 
 		for (i = 0; i < ARP_TABLE_CAPACITY; i++) {
-			spin_lock_np(&arp_lock);
-			rcu_hlist_for_each(&arp_tbl[i], node, true) {
+			spin_lock_np(&arp_tbl[i].lock);
+			rcu_hlist_for_each_safe(&arp_tbl[i].head, node, tmp,
+						true) {
 				e = rcu_hlist_entry(node,
 						    struct arp_entry, link);
 				arp_age_entry(now_us, e);
 			}
-			spin_unlock_np(&arp_lock);
+			spin_unlock_np(&arp_tbl[i].lock);
 		}
 
 		timer_sleep(ONE_SECOND);
@@ -207,29 +240,44 @@ static void arp_update(uint32_t daddr, struct eth_addr dhost)
 {
 	struct mbufq q;
 	int idx = hash_ip(daddr);
-	struct arp_entry *e;
+	struct arp_entry *e, *newe;
 
 	mbufq_init(&q);
 
-	spin_lock_np(&arp_lock);
+	spin_lock_np(&arp_tbl[idx].lock);
 	e = lookup_entry(idx, daddr);
 	if (!e) {
 		e = create_entry(daddr);
 		if (unlikely(!e)) {
-			spin_unlock_np(&arp_lock);
+			spin_unlock_np(&arp_tbl[idx].lock);
 			return;
 		}
 
 		insert_entry(e, idx);
 	} else if (load_acquire(&e->state) == ARP_STATE_STATIC) {
-		spin_unlock_np(&arp_lock);
+		spin_unlock_np(&arp_tbl[idx].lock);
+		return;
+	} else if (e->state != ARP_STATE_PROBING &&
+		   memcmp(&e->eth, &dhost, sizeof(dhost)) != 0) {
+		/* readers may be copying the old MAC, so replace the entry */
+		newe = create_entry(daddr);
+		if (unlikely(!newe)) {
+			spin_unlock_np(&arp_tbl[idx].lock);
+			return;
+		}
+		newe->eth = dhost;
+		newe->state = ARP_STATE_VALID;
+		insert_entry(newe, idx);
+		delete_entry(e);
+		spin_unlock_np(&arp_tbl[idx].lock);
 		return;
 	}
 	e->eth = dhost;
 	e->ts = microtime();
 	store_release(&e->state, ARP_STATE_VALID);
 	mbufq_merge_to_tail(&q, &e->q);
-	spin_unlock_np(&arp_lock);
+	e->q_len = 0;
+	spin_unlock_np(&arp_tbl[idx].lock);
 
 	/* drain mbufs waiting for ARP response */
 	while (!mbufq_empty(&q)) {
@@ -304,13 +352,28 @@ out:
 int arp_lookup(uint32_t daddr, struct eth_addr *dhost_out, struct mbuf *m)
 {
 	struct arp_entry *e, *newe = NULL;
+	struct arp_last_hit *last;
 	int idx = hash_ip(daddr);
+	int gen;
+	bool drop = false;
 
-	/* hot-path: @daddr hits in ARP cache */
+	/* hottest path: @daddr was this kthread's last hit */
 	rcu_read_lock();
+	last = &perthread_get(arp_last);
+	gen = atomic_read(&arp_gen);
+	if (likely(last->ip == daddr && last->gen == gen)) {
+		*dhost_out = last->eth;
+		rcu_read_unlock();
+		return 0;
+	}
+
+	/* hot-path: @daddr hits in ARP cache */
 	e = lookup_entry(idx, daddr);
 	if (likely(e && load_acquire(&e->state) != ARP_STATE_PROBING)) {
 		*dhost_out = e->eth;
+		last->ip = daddr;
+		last->eth = e->eth;
+		last->gen = gen;
 		rcu_read_unlock();
 		return 0;
 	}
@@ -325,7 +388,7 @@ int arp_lookup(uint32_t daddr, struct eth_addr *dhost_out, struct mbuf *m)
 	}
 
 	/* check again for @daddr in ARP cache; we own @m going forward */
-	spin_lock_np(&arp_lock);
+	spin_lock_np(&arp_tbl[idx].lock);
 	e = lookup_entry(idx, daddr);
 	if (e) {
 		/* entry already exists */
@@ -333,7 +396,7 @@ int arp_lookup(uint32_t daddr, struct eth_addr *dhost_out, struct mbuf *m)
 			sfree(newe);
 		if (e->state != ARP_STATE_PROBING) {
 			*dhost_out = e->eth;
-			spin_unlock_np(&arp_lock);
+			spin_unlock_np(&arp_tbl[idx].lock);
 			return 0;
 		}
 	} else if (newe) {
@@ -342,10 +405,21 @@ int arp_lookup(uint32_t daddr, struct eth_addr *dhost_out, struct mbuf *m)
 		insert_entry(e, idx);
 	}
 
-	/* enqueue the mbuf for later transmission */
-	if (m && e)
-		mbufq_push_tail(&e->q, m);
-	spin_unlock_np(&arp_lock);
+	/* enqueue the mbuf for later transmission, if there's room */
+	if (m && e) {
+		if (likely(e->q_len < ARP_MAX_PENDING)) {
+			mbufq_push_tail(&e->q, m);
+			e->q_len++;
+		} else {
+			drop = true;
+		}
+	}
+	spin_unlock_np(&arp_tbl[idx].lock);
+
+	if (m && drop) {
+		STAT(ARP_PENDING_DROPS)++;
+		mbuf_free(m);
+	}
 
 	/* if the entry was removed, assume unreachable and free */
 	if (m && !e)
@@ -363,9 +437,11 @@ int arp_init(void)
 {
 	int i;
 
-	spin_lock_init(&arp_lock);
-	for (i = 0; i < ARP_TABLE_CAPACITY; i++)
-		rcu_hlist_init_head(&arp_tbl[i]);
+	for (i = 0; i < ARP_TABLE_CAPACITY; i++) {
+		spin_lock_init(&arp_tbl[i].lock);
+		rcu_hlist_init_head(&arp_tbl[i].head);
+	}
+	atomic_write(&arp_worker_started, 0);
 
 	return 0;
 }
@@ -380,8 +456,6 @@ int arp_init_late(void)
 	int i, idx;
 	struct arp_entry *e;
 
-	spin_lock_np(&arp_lock);
-
 	for (i = 0; i < arp_static_count; i++) {
 		e = create_entry(static_entries[i].ip);
 		if (!e)
@@ -389,10 +463,10 @@ int arp_init_late(void)
 		idx = hash_ip(static_entries[i].ip);
 		e->eth = static_entries[i].addr;
 		e->state = ARP_STATE_STATIC;
+		spin_lock_np(&arp_tbl[idx].lock);
 		insert_entry(e, idx);
+		spin_unlock_np(&arp_tbl[idx].lock);
 	}
 
-	spin_unlock_np(&arp_lock);
-
 	return 0;
 }
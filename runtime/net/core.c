@@ -3,6 +3,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include <base/log.h>
 #include <base/mempool.h>
@@ -10,27 +11,45 @@
 #include <base/hash.h>
 #include <base/thread.h>
 #include <asm/chksum.h>
+#include <net/chksum.h>
+#include <net/ip6.h>
 #include <runtime/net.h>
+#include <net/tcp.h>
+#include <net/udp.h>
 
 #include "defs.h"
 
 #define IP_ID_SEED	0x42345323
 #define RX_PREFETCH_STRIDE 2
+#define NET_GRO_BUCKETS	8 /* must be a power of two */
+#define NET_GRO_MAX_SEGS	16
+#define NET_GRO_BUF_LEN	(32 * 1024)
 
 /* important global state */
-struct net_cfg netcfg __aligned(CACHE_LINE_SIZE);
+struct net_cfg netcfg __aligned(CACHE_LINE_SIZE) = { .mtu = ETH_MTU };
+struct net_cfg6 netcfg6;
+/* emit TCP super-segments for the NIC (or iokernel) to split */
+bool enable_tso;
 
 /* RX buffer allocation */
 static struct slab net_rx_buf_slab;
 static struct tcache *net_rx_buf_tcache;
 static DEFINE_PERTHREAD(struct tcache_perthread, net_rx_buf_pt);
 
+/* RX buffer allocation for coalesced TCP segments (GRO) */
+static struct slab net_rx_gro_buf_slab;
+static struct tcache *net_rx_gro_buf_tcache;
+static DEFINE_PERTHREAD(struct tcache_perthread, net_rx_gro_buf_pt);
+
 /* TX buffer allocation */
 static struct mempool net_tx_buf_mp;
 static struct tcache *net_tx_buf_tcache;
 static DEFINE_PERTHREAD(struct tcache_perthread, net_tx_buf_pt);
 
-#define MBUF_RESERVED (align_up(sizeof(struct mbuf), CACHE_LINE_SIZE))
+/* TX buffer allocation for TCP segmentation offload (if enabled) */
+static struct mempool net_tx_tso_buf_mp;
+static struct tcache *net_tx_tso_buf_tcache;
+static DEFINE_PERTHREAD(struct tcache_perthread, net_tx_tso_buf_pt);
 
 
 /*
@@ -44,13 +63,32 @@ static void net_rx_release_mbuf(struct mbuf *m)
 	preempt_enable();
 }
 
+static void net_rx_release_gro_mbuf(struct mbuf *m)
+{
+	preempt_disable();
+	tcache_free(&perthread_get(net_rx_gro_buf_pt), m);
+	preempt_enable();
+}
+
+/* returns an ingress buffer to the iokernel */
 static void net_rx_send_completion(unsigned long completion_data)
 {
 	struct kthread *k;
+	uint32_t head;
 
 	k = getk();
-	if (unlikely(!lrpc_send(&k->txcmdq, TXCMD_NET_COMPLETE,
-				completion_data))) {
+	head = k->rxc_head;
+	if (unlikely(head - k->rxc_tail >= RX_COMPLETION_RING_SIZE))
+		k->rxc_tail = load_acquire(&k->q_ptrs->rxc_tail);
+
+	if (likely(head - k->rxc_tail < RX_COMPLETION_RING_SIZE)) {
+		k->rxc_ring[head & (RX_COMPLETION_RING_SIZE - 1)] =
+			completion_data;
+		k->rxc_head = head + 1;
+		if (k->rxc_head - k->rxc_published >= NET_RX_COMPLETION_BATCH)
+			net_rx_flush_completions(k);
+	} else if (unlikely(!lrpc_send(&k->txcmdq, TXCMD_NET_COMPLETE,
+				       completion_data))) {
 		WARN();
 	}
 	putk();
@@ -61,6 +99,10 @@ static struct mbuf *net_rx_alloc_mbuf(struct rx_net_hdr *hdr)
 	struct mbuf *m;
 	void *buf;
 
+	/* the iokernel's MTU may be larger than ours */
+	if (unlikely(hdr->len > net_buf_len() - MBUF_RESERVED))
+		goto fail_buf;
+
 	preempt_disable();
 	/* allocate the buffer to store the payload */
 	m = tcache_alloc(&perthread_get(net_rx_buf_pt));
@@ -76,11 +118,14 @@ static struct mbuf *net_rx_alloc_mbuf(struct rx_net_hdr *hdr)
 	/* copy the payload and release the buffer back to the iokernel */
 	memcpy(buf, hdr->payload, hdr->len);
 
-	mbuf_init(m, buf, MBUF_DEFAULT_LEN - MBUF_RESERVED, 0);
+	mbuf_init(m, buf, net_buf_len() - MBUF_RESERVED, 0);
 	m->len = hdr->len;
 	m->csum_type = hdr->csum_type;
 	m->csum = hdr->csum;
 	m->rss_hash = hdr->rss_hash;
+	m->rx_tsc = hdr->rx_tsc;
+	m->rx_enq_cycles = hdr->enq_tsc - hdr->rx_tsc;
+	m->nic_ts = hdr->nic_ts;
 
 	barrier();
 	net_rx_send_completion(hdr->completion_data);
@@ -112,6 +157,18 @@ static inline bool ip_hdr_supported(const struct ip_hdr *iphdr)
 void net_error(struct mbuf *m, int err)
 {
 	const struct ip_hdr *iphdr;
+	const struct ip6_hdr *ip6hdr;
+
+	if (mbuf_length(m) < 1)
+		return;
+	mbuf_mark_network_offset(m);
+	if (mbuf_network_is_ip6(m)) {
+		ip6hdr = mbuf_pull_hdr_or_null(m, *ip6hdr);
+		if (ip6hdr && (ip6hdr->nexthdr == IPPROTO_UDP ||
+			       ip6hdr->nexthdr == IPPROTO_TCP))
+			trans_error(m, err);
+		return;
+	}
 
 	iphdr = mbuf_pull_hdr_or_null(m, *iphdr);
 	if (unlikely(!iphdr))
@@ -126,16 +183,161 @@ void net_error(struct mbuf *m, int err)
 		trans_error(m, err);
 }
 
-static struct mbuf *net_rx_one(struct rx_net_hdr *hdr)
+static bool net_rx_l4_cksum_ok(const struct ip_hdr *iphdr, struct mbuf *m,
+			       uint16_t len)
+{
+	const struct udp_hdr *udphdr;
+
+	if (iphdr->proto == IPPROTO_UDP) {
+		udphdr = (const struct udp_hdr *)mbuf_data(m);
+		if (len < sizeof(*udphdr))
+			return false;
+		/* the sender didn't compute one */
+		if (udphdr->chksum == 0)
+			return true;
+	}
+
+	return ipv4_udptcp_cksum_ok(iphdr->proto, ntoh32(iphdr->saddr),
+				    ntoh32(iphdr->daddr), len, mbuf_data(m));
+}
+
+static bool net_rx_l4_cksum6_ok(const struct ip6_hdr *ip6hdr, struct mbuf *m,
+				uint16_t len)
+{
+	const struct udp_hdr *udphdr;
+
+	if (ip6hdr->nexthdr == IPPROTO_UDP) {
+		udphdr = (const struct udp_hdr *)mbuf_data(m);
+		/* the checksum is mandatory over IPv6 */
+		if (len < sizeof(*udphdr) || udphdr->chksum == 0)
+			return false;
+	}
+
+	return ipv6_udptcp_cksum_ok(ip6hdr->nexthdr, &ip6hdr->saddr,
+				    &ip6hdr->daddr, len, mbuf_data(m));
+}
+
+/* true if @addr is a multicast group we belong to */
+static bool net_ip6_is_our_group(const struct ip6_addr *addr)
+{
+	struct ip6_addr group;
+
+	if (ip6_addr_equal(addr, &ip6_addr_all_nodes))
+		return true;
+	ip6_solicited_node(&netcfg6.addr, &group);
+	if (ip6_addr_equal(addr, &group))
+		return true;
+	ip6_solicited_node(&netcfg6.addr_ll, &group);
+	return ip6_addr_equal(addr, &group);
+}
+
+/* handles the network layer of an IPv6 packet, the ethernet header is pulled */
+static struct mbuf *net_rx_ip6(struct rx_net_hdr *hdr, struct mbuf *m,
+			       const struct eth_hdr *llhdr)
+{
+	const struct ip6_hdr *ip6hdr;
+	uint16_t len;
+
+	/* our MAC address, or an IPv6 multicast one (33:33:xx:xx:xx:xx) */
+	if (unlikely(!netcfg6.enabled))
+		goto drop;
+	if (memcmp(llhdr->dhost.addr, netcfg.mac.addr,
+		   sizeof(llhdr->dhost.addr)) != 0 &&
+	    (llhdr->dhost.addr[0] != 0x33 || llhdr->dhost.addr[1] != 0x33))
+		goto drop;
+
+	mbuf_mark_network_offset(m);
+	ip6hdr = mbuf_pull_hdr_or_null(m, *ip6hdr);
+	if (unlikely(!ip6hdr))
+		goto drop;
+	if (unlikely(ip6_hdr_version(ip6hdr) != IP6VERSION))
+		goto drop;
+
+	len = ntoh16(ip6hdr->payload_len);
+	if (unlikely(mbuf_length(m) < len))
+		goto drop;
+	if (len < mbuf_length(m))
+		mbuf_trim(m, mbuf_length(m) - len);
+
+	/* only neighbor discovery and pings are sent to multicast groups */
+	if (unlikely(ip6_addr_is_multicast(&ip6hdr->daddr))) {
+		if (ip6hdr->nexthdr != IPPROTO_ICMPV6 ||
+		    !net_ip6_is_our_group(&ip6hdr->daddr))
+			goto drop;
+	} else if (unlikely(!net_ip6_is_local(&ip6hdr->daddr))) {
+		goto drop;
+	}
+
+	/* extension headers aren't supported */
+	switch (ip6hdr->nexthdr) {
+	case IPPROTO_ICMPV6:
+		net_rx_icmp6(m, ip6hdr, len);
+		break;
+
+	case IPPROTO_UDP:
+	case IPPROTO_TCP:
+		if (hdr->csum_type != CHECKSUM_TYPE_UNNECESSARY) {
+			if (unlikely(!net_rx_l4_cksum6_ok(ip6hdr, m, len))) {
+				STAT(RX_L4_CSUM_ERRORS)++;
+				goto drop;
+			}
+			m->csum_type = CHECKSUM_TYPE_UNNECESSARY;
+		}
+		return m;
+
+	default:
+		goto drop;
+	}
+
+	return NULL;
+
+drop:
+	mbuf_drop(m);
+	return NULL;
+}
+
+/* handles IGMP, which carries IP options, the fixed IP header is pulled */
+static void net_rx_ip_igmp(struct mbuf *m, const struct ip_hdr *iphdr)
+{
+	unsigned int hdr_len = iphdr->header_len * sizeof(uint32_t);
+	uint16_t len;
+
+	if (unlikely(iphdr->version != IPVERSION ||
+		     hdr_len < sizeof(*iphdr) || ntoh16(iphdr->len) < hdr_len ||
+		     (ntoh16(iphdr->off) & (IP_MF | IP_OFFMASK)) != 0))
+		goto drop;
+	if (unlikely(!mbuf_pull_or_null(m, hdr_len - sizeof(*iphdr)) ||
+		     chksum_internet((char *)iphdr, hdr_len) != 0))
+		goto drop;
+
+	len = ntoh16(iphdr->len) - hdr_len;
+	if (unlikely(mbuf_length(m) < len))
+		goto drop;
+	if (len < mbuf_length(m))
+		mbuf_trim(m, mbuf_length(m) - len);
+
+	if (unlikely(!net_ip_is_our_group(ntoh32(iphdr->daddr))))
+		goto drop;
+	net_rx_igmp(m, iphdr, len);
+	return;
+
+drop:
+	mbuf_drop(m);
+}
+
+static struct mbuf *net_rx_one(struct rx_net_hdr *hdr, uint64_t now)
 {
 	struct mbuf *m;
 	const struct eth_hdr *llhdr;
 	const struct ip_hdr *iphdr;
+	uint32_t daddr;
 	uint16_t len;
+	bool mcast;
 
 	m = net_rx_alloc_mbuf(hdr);
 	if (unlikely(!m))
 		return NULL;
+	m->rx_softirq_cycles = now - m->rx_tsc;
 
 	STAT(RX_PACKETS)++;
 	STAT(RX_BYTES) += mbuf_length(m);
@@ -155,11 +357,16 @@ static struct mbuf *net_rx_one(struct rx_net_hdr *hdr)
 		return NULL;
 	}
 
+	if (ntoh16(llhdr->type) == ETHTYPE_IPV6)
+		return net_rx_ip6(hdr, m, llhdr);
+
 	/* filter out requests we can't handle */
 	BUILD_ASSERT(sizeof(llhdr->dhost.addr) == sizeof(netcfg.mac.addr));
-	if (unlikely(ntoh16(llhdr->type) != ETHTYPE_IP ||
-		     memcmp(llhdr->dhost.addr, netcfg.mac.addr,
-			    sizeof(llhdr->dhost.addr)) != 0))
+	if (unlikely(ntoh16(llhdr->type) != ETHTYPE_IP))
+		goto drop;
+	mcast = memcmp(llhdr->dhost.addr, netcfg.mac.addr,
+		       sizeof(llhdr->dhost.addr)) != 0;
+	if (unlikely(mcast && !(llhdr->dhost.addr[0] & ETH_ADDR_GROUP)))
 		goto drop;
 
 
@@ -172,6 +379,11 @@ static struct mbuf *net_rx_one(struct rx_net_hdr *hdr)
 	if (unlikely(!iphdr))
 		goto drop;
 
+	if (unlikely(iphdr->proto == IPPROTO_IGMP)) {
+		net_rx_ip_igmp(m, iphdr);
+		return NULL;
+	}
+
 	/* Did HW checksum verification pass? */
 	if (hdr->csum_type != CHECKSUM_TYPE_UNNECESSARY) {
 		if (chksum_internet(iphdr, sizeof(*iphdr)))
@@ -187,6 +399,17 @@ static struct mbuf *net_rx_one(struct rx_net_hdr *hdr)
 	if (len < mbuf_length(m))
 		mbuf_trim(m, mbuf_length(m) - len);
 
+	/* only UDP sockets receive broadcasts and joined groups */
+	if (unlikely(mcast)) {
+		daddr = ntoh32(iphdr->daddr);
+		if (iphdr->proto != IPPROTO_UDP)
+			goto drop;
+		if (!net_ip_is_broadcast(daddr) &&
+		    !(ip_addr_is_multicast(daddr) &&
+		      net_ip_is_our_group(daddr)))
+			goto drop;
+	}
+
 	switch(iphdr->proto) {
 	case IPPROTO_ICMP:
 		net_rx_icmp(m, iphdr, len);
@@ -194,6 +417,14 @@ static struct mbuf *net_rx_one(struct rx_net_hdr *hdr)
 
 	case IPPROTO_UDP:
 	case IPPROTO_TCP:
+		/* verify L4 checksums the NIC didn't */
+		if (hdr->csum_type != CHECKSUM_TYPE_UNNECESSARY) {
+			if (unlikely(!net_rx_l4_cksum_ok(iphdr, m, len))) {
+				STAT(RX_L4_CSUM_ERRORS)++;
+				goto drop;
+			}
+			m->csum_type = CHECKSUM_TYPE_UNNECESSARY;
+		}
 		return m;
 
 	default:
@@ -207,6 +438,184 @@ drop:
 	return NULL;
 }
 
+
+/*
+ * Generic Receive Offload (GRO)
+ *
+ * In-order TCP segments of the same flow within a softirq batch are merged
+ * into a single large mbuf, so TCP processes them with one lock acquisition
+ * and one ACK decision. Flows are bucketed by their RSS hash.
+ */
+
+/* an open aggregate of TCP segments */
+struct net_gro_flow {
+	struct mbuf	**slot;		/* the aggregate in the L4 batch */
+	uint32_t	rss_hash;	/* the flow's RSS hash */
+	uint32_t	seq_end;	/* the next expected sequence number */
+	unsigned int	nr;		/* the number of segments merged */
+};
+
+static inline struct net_gro_flow *
+net_gro_bucket(struct net_gro_flow *gro, uint32_t rss_hash)
+{
+	return &gro[rss_hash & (NET_GRO_BUCKETS - 1)];
+}
+
+/* moves a regular RX mbuf into a GRO buffer, keeping the same offsets */
+static struct mbuf *net_gro_promote(struct mbuf *m)
+{
+	struct mbuf *n;
+	unsigned char *buf;
+	unsigned int off = mbuf_headroom(m);
+
+	preempt_disable();
+	n = tcache_alloc(&perthread_get(net_rx_gro_buf_pt));
+	preempt_enable();
+	if (unlikely(!n))
+		return NULL;
+
+	buf = (unsigned char *)n + MBUF_RESERVED;
+	memcpy(buf, m->head, off + mbuf_length(m));
+	mbuf_init(n, buf, NET_GRO_BUF_LEN - MBUF_RESERVED, off);
+	n->len = mbuf_length(m);
+	n->csum_type = m->csum_type;
+	n->csum = m->csum;
+	n->rss_hash = m->rss_hash;
+	n->rx_tsc = m->rx_tsc;
+	n->rx_enq_cycles = m->rx_enq_cycles;
+	n->rx_softirq_cycles = m->rx_softirq_cycles;
+	n->nic_ts = m->nic_ts;
+	n->network_off = m->network_off;
+	n->transport_off = m->transport_off;
+	n->release_data = 0;
+	n->release = net_rx_release_gro_mbuf;
+
+	mbuf_free(m);
+	return n;
+}
+
+/* returns the TCP payload length if @tcphdr can be merged, otherwise 0 */
+static unsigned int net_gro_payload_len(const struct tcp_hdr *tcphdr,
+					unsigned int l4len)
+{
+	unsigned int hdr_len = tcphdr->off * 4;
+
+	if (hdr_len < sizeof(*tcphdr) || hdr_len >= l4len)
+		return 0;
+	if ((tcphdr->flags & ~TCP_PUSH) != TCP_ACK)
+		return 0;
+	return l4len - hdr_len;
+}
+
+/* opens an aggregate for a TCP segment that passed L3 processing */
+static void net_gro_track(struct net_gro_flow *gro, struct mbuf **slot)
+{
+	struct mbuf *m = *slot;
+	struct net_gro_flow *f = net_gro_bucket(gro, m->rss_hash);
+	const struct ip_hdr *iphdr = mbuf_network_hdr(m, *iphdr);
+	const struct tcp_hdr *tcphdr;
+	unsigned int len;
+
+	/* a segment that can't start an aggregate ends the previous one */
+	f->slot = NULL;
+	if (mbuf_network_is_ip6(m) || iphdr->proto != IPPROTO_TCP ||
+	    m->csum_type != CHECKSUM_TYPE_UNNECESSARY ||
+	    mbuf_length(m) < sizeof(*tcphdr))
+		return;
+
+	tcphdr = (const struct tcp_hdr *)mbuf_data(m);
+	len = net_gro_payload_len(tcphdr, mbuf_length(m));
+	if (len == 0 || (tcphdr->flags & TCP_PUSH))
+		return;
+
+	f->slot = slot;
+	f->rss_hash = m->rss_hash;
+	f->seq_end = ntoh32(tcphdr->seq) + len;
+	f->nr = 1;
+}
+
+/* tries to merge an ingress packet into an open aggregate */
+static bool net_gro_merge(struct net_gro_flow *gro, struct rx_net_hdr *hdr)
+{
+	struct net_gro_flow *f = net_gro_bucket(gro, hdr->rss_hash);
+	const struct eth_hdr *llhdr;
+	const struct ip_hdr *iphdr;
+	const struct tcp_hdr *tcphdr;
+	struct ip_hdr *agg_iphdr;
+	struct tcp_hdr *agg_tcphdr;
+	struct mbuf *agg;
+	unsigned int ip_len, len;
+
+	if (!f->slot || f->rss_hash != hdr->rss_hash ||
+	    hdr->csum_type != CHECKSUM_TYPE_UNNECESSARY ||
+	    hdr->len < sizeof(*llhdr) + sizeof(*iphdr) + sizeof(*tcphdr))
+		return false;
+
+	/* parse the headers in place, before copying the packet */
+	llhdr = (const struct eth_hdr *)hdr->payload;
+	iphdr = (const struct ip_hdr *)(llhdr + 1);
+	tcphdr = (const struct tcp_hdr *)(iphdr + 1);
+	if (ntoh16(llhdr->type) != ETHTYPE_IP ||
+	    memcmp(llhdr->dhost.addr, netcfg.mac.addr,
+		   sizeof(llhdr->dhost.addr)) != 0 ||
+	    !ip_hdr_supported(iphdr) || iphdr->proto != IPPROTO_TCP)
+		return false;
+	ip_len = ntoh16(iphdr->len);
+	if (ip_len < sizeof(*iphdr) || ip_len > hdr->len - sizeof(*llhdr))
+		return false;
+	len = net_gro_payload_len(tcphdr, ip_len - sizeof(*iphdr));
+	if (len == 0)
+		return false;
+
+	/* must be the next in-order segment of the same flow */
+	agg = *f->slot;
+	agg_iphdr = mbuf_network_hdr(agg, *agg_iphdr);
+	agg_tcphdr = (struct tcp_hdr *)mbuf_data(agg);
+	if (iphdr->saddr != agg_iphdr->saddr ||
+	    iphdr->daddr != agg_iphdr->daddr ||
+	    iphdr->tos != agg_iphdr->tos ||
+	    tcphdr->sport != agg_tcphdr->sport ||
+	    tcphdr->dport != agg_tcphdr->dport ||
+	    tcphdr->ack != agg_tcphdr->ack ||
+	    tcphdr->off != agg_tcphdr->off ||
+	    ntoh32(tcphdr->seq) != f->seq_end ||
+	    memcmp(tcphdr + 1, agg_tcphdr + 1,
+		   tcphdr->off * 4 - sizeof(*tcphdr)) != 0)
+		return false;
+
+	/* make room in the aggregate */
+	if (f->nr >= NET_GRO_MAX_SEGS)
+		return false;
+	if (agg->head_len < NET_GRO_BUF_LEN - MBUF_RESERVED) {
+		agg = net_gro_promote(agg);
+		if (unlikely(!agg))
+			return false;
+		*f->slot = agg;
+		agg_iphdr = mbuf_network_hdr(agg, *agg_iphdr);
+		agg_tcphdr = (struct tcp_hdr *)mbuf_data(agg);
+	}
+	if (mbuf_tailroom(agg) < len)
+		return false;
+
+	/* append the payload and fix up the headers */
+	memcpy(mbuf_put(agg, len), (const char *)tcphdr + tcphdr->off * 4, len);
+	agg_iphdr->len = hton16(ntoh16(agg_iphdr->len) + len);
+	agg_tcphdr->win = tcphdr->win;
+	agg_tcphdr->flags |= tcphdr->flags & TCP_PUSH;
+	f->seq_end += len;
+	f->nr++;
+
+	/* a push ends the aggregate */
+	if (tcphdr->flags & TCP_PUSH)
+		f->slot = NULL;
+
+	STAT(RX_PACKETS)++;
+	STAT(RX_BYTES) += hdr->len;
+	STAT(RX_GRO_MERGED)++;
+	net_rx_send_completion(hdr->completion_data);
+	return true;
+}
+
 /**
  * net_rx_softirq - handles ingress packet processing
  * @hdrs: an array of ingress packet headers
@@ -215,19 +624,73 @@ drop:
 void net_rx_softirq(struct rx_net_hdr **hdrs, unsigned int nr)
 {
 	struct mbuf *l4_reqs[SOFTIRQ_MAX_BUDGET];
+	struct net_gro_flow gro[NET_GRO_BUCKETS];
+	struct kthread *k;
+	uint64_t now = rdtsc();
 	int i, l4idx = 0;
 
+	for (i = 0; i < NET_GRO_BUCKETS; i++)
+		gro[i].slot = NULL;
+
 	for (i = 0; i < nr; i++) {
 		if (i + RX_PREFETCH_STRIDE < nr)
 			prefetch(hdrs[i + RX_PREFETCH_STRIDE]);
-		l4_reqs[l4idx] = net_rx_one(hdrs[i]);
-		if (l4_reqs[l4idx] != NULL)
+		STAT(RX_QUEUE_CYCLES) += now - hdrs[i]->rx_tsc;
+		if (net_gro_merge(gro, hdrs[i]))
+			continue;
+		l4_reqs[l4idx] = net_rx_one(hdrs[i], now);
+		if (l4_reqs[l4idx] != NULL) {
+			net_gro_track(gro, &l4_reqs[l4idx]);
 			l4idx++;
+		}
 	}
 
 	/* handle transport protocol layer */
 	if (l4idx > 0)
 		net_rx_trans(l4_reqs, l4idx);
+
+	/* this thread may have moved kthreads, flush wherever it is now */
+	k = getk();
+	net_rx_flush_completions(k);
+	putk();
+}
+
+/**
+ * net_busy_poll - handles ingress packets in this thread until a socket is ready
+ * @us: the most time to spend, in microseconds
+ * @ready: returns true once the caller no longer has to wait
+ * @arg: an argument passed to @ready
+ *
+ * Spinning avoids the cost of parking and waking a thread when a reply is
+ * expected soon. It stops early if other threads are waiting to run or a
+ * preemption is pending, so it never delays other work on this core.
+ *
+ * Returns true if @ready returned true, or false if the caller should block.
+ */
+bool net_busy_poll(unsigned int us, bool (*ready)(void *arg), void *arg)
+{
+	uint64_t deadline = rdtsc() + (uint64_t)us * cycles_per_us;
+	struct kthread *k;
+	bool idle;
+
+	do {
+		softirq_run();
+		if (ready(arg)) {
+			STAT(NET_BUSY_POLL_HITS)++;
+			return true;
+		}
+
+		k = getk();
+		idle = ACCESS_ONCE(k->rq_head) == ACCESS_ONCE(k->rq_tail) &&
+		       list_empty(&k->rq_overflow);
+		putk();
+		if (!idle || preempt_needed())
+			break;
+		cpu_relax();
+	} while (rdtsc() < deadline);
+
+	STAT(NET_BUSY_POLL_MISSES)++;
+	return false;
 }
 
 
@@ -245,7 +708,10 @@ void net_rx_softirq(struct rx_net_hdr **hdrs, unsigned int nr)
 void net_tx_release_mbuf(struct mbuf *m)
 {
 	preempt_disable();
-	tcache_free(&perthread_get(net_tx_buf_pt), m);
+	if (unlikely(m->head_len > net_buf_len()))
+		tcache_free(&perthread_get(net_tx_tso_buf_pt), m);
+	else
+		tcache_free(&perthread_get(net_tx_buf_pt), m);
 	preempt_enable();
 }
 
@@ -271,10 +737,45 @@ struct mbuf *net_tx_alloc_mbuf(void)
 
 	buf = (unsigned char *)m + MBUF_RESERVED;
 
-	mbuf_init(m, buf, MBUF_DEFAULT_LEN - MBUF_RESERVED,
+	mbuf_init(m, buf, net_buf_len() - MBUF_RESERVED,
 		  MBUF_DEFAULT_HEADROOM);
 	m->csum_type = CHECKSUM_TYPE_NEEDED;
 	m->txflags = 0;
+	m->tso_segsz = 0;
+	m->release_data = 0;
+	m->release = net_tx_release_mbuf;
+	return m;
+}
+
+/**
+ * net_tx_alloc_tso_mbuf - allocates a large mbuf for TCP segmentation offload
+ *
+ * The mbuf can hold up to NET_TX_TSO_MAX_LEN bytes of payload.
+ *
+ * Returns an mbuf, or NULL if TSO is disabled or out of memory. Callers
+ * should fall back to net_tx_alloc_mbuf().
+ */
+struct mbuf *net_tx_alloc_tso_mbuf(void)
+{
+	struct mbuf *m;
+	unsigned char *buf;
+
+	if (!enable_tso)
+		return NULL;
+
+	preempt_disable();
+	m = tcache_alloc(&perthread_get(net_tx_tso_buf_pt));
+	preempt_enable();
+	if (unlikely(!m))
+		return NULL;
+
+	buf = (unsigned char *)m + MBUF_RESERVED;
+
+	mbuf_init(m, buf, MBUF_TSO_LEN - MBUF_RESERVED,
+		  MBUF_DEFAULT_HEADROOM);
+	m->csum_type = CHECKSUM_TYPE_NEEDED;
+	m->txflags = 0;
+	m->tso_segsz = 0;
 	m->release_data = 0;
 	m->release = net_tx_release_mbuf;
 	return m;
@@ -302,30 +803,117 @@ void __noinline net_tx_drain_overflow(void)
 	}
 }
 
-static void net_tx_raw(struct mbuf *m)
+/**
+ * __net_tx_flush - publishes a kthread's staged egress packets in one burst
+ * @k: the local kthread
+ *
+ * Packets that don't fit in txpktq go to the overflow queue, behind any that
+ * are already there.
+ */
+void __net_tx_flush(struct kthread *k)
 {
-	struct kthread *k;
-	shmptr_t shm;
-	struct tx_net_hdr *hdr;
-	unsigned int len = mbuf_length(m);
+	struct lrpc_msg msgs[RUNTIME_TX_STAGE_SIZE];
+	unsigned int i, n = k->nr_tx_staged, sent = 0;
+	struct mbuf *m;
+
+	assert_preempt_disabled();
+	assert(k == myk());
+
+	k->nr_tx_staged = 0;
 
-	k = getk();
 	/* drain pending overflow packets first */
 	if (!mbufq_empty(&k->txpktq_overflow))
 		net_tx_drain_overflow();
 
-	STAT(TX_PACKETS)++;
-	STAT(TX_BYTES) += len;
+	if (likely(mbufq_empty(&k->txpktq_overflow))) {
+		for (i = 0; i < n; i++) {
+			m = k->tx_staged[i];
+			msgs[i].cmd = TXPKT_NET_XMIT;
+			msgs[i].payload = ptr_to_shmptr(&netcfg.tx_region,
+							mbuf_data(m),
+							mbuf_length(m));
+		}
+		sent = lrpc_send_burst(&k->txpktq, msgs, n);
+	}
+
+	for (i = sent; i < n; i++)
+		mbufq_push_tail(&k->txpktq_overflow, k->tx_staged[i]);
+}
+
+/*
+ * Writes the segment table of a multi-segment packet into the tailroom of its
+ * first segment. Returns the length of the other segments, or -EINVAL if the
+ * table doesn't fit or a segment isn't in the egress region.
+ */
+static int net_tx_push_segs(struct mbuf *m, struct tx_net_hdr *hdr)
+{
+	struct tx_net_seg *segs;
+	struct mbuf *seg;
+	unsigned int nr_segs = mbuf_nr_segs(m) - 1, len = 0;
+	/* an aligned copy, since netcfg is packed */
+	struct shm_region tx_region = netcfg.tx_region;
+	uintptr_t base = (uintptr_t)tx_region.base;
+
+	if (unlikely(nr_segs > TX_NET_MAX_SEGS ||
+		     mbuf_tailroom(m) < nr_segs * sizeof(*segs)))
+		return -EINVAL;
+
+	mbuf_for_each_seg(m->frag, seg) {
+		if (unlikely((uintptr_t)mbuf_data(seg) < base ||
+			     (uintptr_t)mbuf_data(seg) + mbuf_length(seg) >
+			     base + tx_region.len))
+			return -EINVAL;
+	}
+
+	hdr->nr_segs = nr_segs;
+	segs = tx_net_hdr_segs(hdr);
+	mbuf_for_each_seg(m->frag, seg) {
+		segs->data = ptr_to_shmptr(&tx_region, mbuf_data(seg),
+					   mbuf_length(seg));
+		segs->len = mbuf_length(seg);
+		segs->pad = 0;
+		len += segs->len;
+		segs++;
+	}
+
+	return len;
+}
+
+static int net_tx_raw(struct mbuf *m)
+{
+	struct kthread *k;
+	struct tx_net_hdr *hdr;
+	unsigned int len = mbuf_length(m);
+	int ret;
 
 	hdr = mbuf_push_hdr(m, *hdr);
 	hdr->completion_data = (unsigned long)m;
+	hdr->tx_tsc = rdtsc();
 	hdr->len = len;
 	hdr->olflags = m->txflags;
-	shm = ptr_to_shmptr(&netcfg.tx_region, hdr, len + sizeof(*hdr));
+	hdr->nr_segs = 0;
+	hdr->tso_segsz = m->tso_segsz;
+
+	if (unlikely(m->frag)) {
+		ret = net_tx_push_segs(m, hdr);
+		if (unlikely(ret < 0)) {
+			mbuf_pull_hdr(m, *hdr);
+			return ret;
+		}
+		len += ret;
+	}
 
-	if (!lrpc_send(&k->txpktq, TXPKT_NET_XMIT, shm))
-		mbufq_push_tail(&k->txpktq_overflow, m);
+	STAT(TX_PACKETS)++;
+	STAT(TX_BYTES) += len;
+
+	/* hold the packet back only if other uthreads may send soon */
+	k = getk();
+	k->tx_staged[k->nr_tx_staged++] = m;
+	if (k->nr_tx_staged == RUNTIME_TX_STAGE_SIZE ||
+	    k->rq_head == ACCESS_ONCE(k->rq_tail))
+		__net_tx_flush(k);
 	putk();
+	return 0;
 }
 
 /**
@@ -337,7 +925,9 @@ static void net_tx_raw(struct mbuf *m)
  * The payload must start with the network (L3) header. The ethernet (L2)
  * header will be prepended by this function.
  *
- * @m must have been allocated with net_tx_alloc_mbuf().
+ * @m must have been allocated with net_tx_alloc_mbuf(). It may continue in
+ * other segments chained with mbuf_chain(), whose data must also be in the
+ * egress region.
  *
  * Returns 0 if successful. If successful, the mbuf will be freed when the
  * transmit completes. Otherwise, the mbuf still belongs to the caller.
@@ -350,26 +940,27 @@ int net_tx_eth(struct mbuf *m, uint16_t type, struct eth_addr dhost)
 	eth_hdr->shost = netcfg.mac;
 	eth_hdr->dhost = dhost;
 	eth_hdr->type = hton16(type);
-	net_tx_raw(m);
-	return 0;
+	return net_tx_raw(m);
 }
 
-static void net_push_iphdr(struct mbuf *m, uint8_t proto, uint32_t daddr)
+/* This must be unique across datagrams within a flow, see RFC 6864 */
+static inline uint16_t net_ip_id(uint8_t proto, uint32_t daddr)
 {
-	struct ip_hdr *iphdr;
+	return hash_crc32c_two(IP_ID_SEED, rdtsc() ^ proto,
+			       (uint64_t)daddr | ((uint64_t)netcfg.addr << 32));
+}
 
+static void net_build_iphdr(struct ip_hdr *iphdr, uint8_t proto, uint8_t tos,
+			    uint32_t daddr, uint16_t len)
+{
 	/* TODO: Support "don't fragment" (DF) flag? */
 
 	/* populate IP header */
-	iphdr = mbuf_push_hdr(m, *iphdr);
 	iphdr->version = IPVERSION;
 	iphdr->header_len = 5;
-	iphdr->tos = IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT;
-	iphdr->len = hton16(mbuf_length(m));
-	/* This must be unique across datagrams within a flow, see RFC 6864 */
-	iphdr->id = hash_crc32c_two(IP_ID_SEED, rdtsc() ^ proto,
-				    (uint64_t)daddr |
-				    ((uint64_t)netcfg.addr << 32));
+	iphdr->tos = tos;
+	iphdr->len = hton16(len);
+	iphdr->id = net_ip_id(proto, daddr);
 	iphdr->off = 0;
 	iphdr->ttl = 64;
 	iphdr->proto = proto;
@@ -378,41 +969,103 @@ static void net_push_iphdr(struct mbuf *m, uint8_t proto, uint32_t daddr)
 	iphdr->daddr = hton32(daddr);
 }
 
-static uint32_t net_get_ip_route(uint32_t daddr)
+static void net_push_iphdr(struct mbuf *m, uint8_t proto, uint8_t tos,
+			   uint32_t daddr)
 {
-	/* simple IP routing */
-	if ((daddr & netcfg.netmask) != (netcfg.addr & netcfg.netmask))
-		daddr = netcfg.gateway;
-	return daddr;
+	uint16_t len = mbuf_length(m) + sizeof(struct ip_hdr);
+
+	net_build_iphdr(mbuf_push_hdr(m, struct ip_hdr), proto, tos, daddr,
+			len);
+}
+
+/* pushes @rc's headers onto @m, returns false if there were none to push */
+static bool net_route_cache_push(struct net_route_cache *rc, struct mbuf *m,
+				 uint8_t tos)
+{
+	struct ip_hdr *iphdr;
+	unsigned char *p;
+	int seq = atomic_read(&rc->seq);
+	uint16_t len = mbuf_length(m) + sizeof(struct ip_hdr);
+
+	if (seq & 1)
+		return false;
+	rmb();
+	if (ACCESS_ONCE(rc->gen) != atomic_read(&arp_gen))
+		return false;
+
+	p = mbuf_push(m, NET_HDR_TMPL_LEN);
+	memcpy(p, &rc->hdr.eth, NET_HDR_TMPL_LEN);
+	rmb();
+	if (unlikely(atomic_read(&rc->seq) != seq)) {
+		mbuf_pull(m, NET_HDR_TMPL_LEN);
+		return false;
+	}
+
+	iphdr = (struct ip_hdr *)(p + sizeof(struct eth_hdr));
+	iphdr->tos = tos;
+	iphdr->len = hton16(len);
+	iphdr->id = net_ip_id(iphdr->proto, ntoh32(iphdr->daddr));
+	return true;
+}
+
+static void net_route_cache_set(struct net_route_cache *rc, int gen,
+				const struct ip_hdr *iphdr,
+				struct eth_addr dhost)
+{
+	int seq = atomic_read(&rc->seq);
+
+	/* another sender is filling it, so let them */
+	if ((seq & 1) || !atomic_cmpxchg(&rc->seq, seq, seq + 1))
+		return;
+	rc->gen = gen;
+	rc->hdr.eth.dhost = dhost;
+	rc->hdr.eth.shost = netcfg.mac;
+	rc->hdr.eth.type = hton16(ETHTYPE_IP);
+	rc->hdr.ip = *iphdr;
+	wmb();
+	atomic_write(&rc->seq, seq + 2);
 }
 
 /**
- * net_tx_ip - transmits an IP packet
+ * net_tx_ip_cached - transmits an IP packet, remembering where it went
  * @m: the mbuf to transmit
  * @proto: the transport protocol
+ * @tos: the IP type of service (DSCP and ECN codepoints)
  * @daddr: the destination IP address (in native byte order)
+ * @rc: cached headers for packets to @daddr, or NULL
  *
  * The payload must start with the transport (L4) header. The IPv4 (L3) and
  * ethernet (L2) headers will be prepended by this function.
  *
- * @m must have been allocated with net_tx_alloc_mbuf().
+ * @m must have been allocated with net_tx_alloc_mbuf(). @rc must only ever be
+ * used with the same @daddr.
  *
  * Returns 0 if successful. If successful, the mbuf will be freed when the
  * transmit completes. Otherwise, the mbuf still belongs to the caller.
  */
-int net_tx_ip(struct mbuf *m, uint8_t proto, uint32_t daddr)
+int net_tx_ip_cached(struct mbuf *m, uint8_t proto, uint8_t tos,
+		     uint32_t daddr, struct net_route_cache *rc)
 {
 	struct eth_addr dhost;
-	int ret;
-
-	/* prepend the IP header */
-	net_push_iphdr(m, proto, daddr);
+	int ret, gen;
 
 	/* ask NIC to calculate IP checksum */
 	m->txflags |= OLFLAG_IP_CHKSUM | OLFLAG_IPV4;
 
+	/* hot-path: the connection already has its headers */
+	if (rc && likely(net_route_cache_push(rc, m, tos)))
+		return net_tx_raw(m);
+
+	/* prepend the IP header */
+	net_push_iphdr(m, proto, tos, daddr);
+	gen = atomic_read(&arp_gen);
+
+	/* groups and broadcasts map directly to a MAC address */
+	if (unlikely(net_ip_mcast_dhost(daddr, &dhost)))
+		goto xmit;
+
 	/* apply IP routing */
-	daddr = net_get_ip_route(daddr);
+	daddr = net_route_lookup(daddr);
 
 	/* need to use ARP to resolve dhost */
 	ret = arp_lookup(daddr, &dhost, m);
@@ -427,11 +1080,140 @@ int net_tx_ip(struct mbuf *m, uint8_t proto, uint32_t daddr)
 		}
 	}
 
+xmit:
+	if (rc)
+		net_route_cache_set(rc, gen, (struct ip_hdr *)mbuf_data(m),
+				    dhost);
+
 	ret = net_tx_eth(m, ETHTYPE_IP, dhost);
 	assert(!ret); /* can't fail as implemented so far */
 	return 0;
 }
 
+static void net_push_ip6hdr(struct mbuf *m, uint8_t proto, uint8_t tclass,
+			    const struct ip6_addr *saddr,
+			    const struct ip6_addr *daddr)
+{
+	uint16_t len = mbuf_length(m);
+	struct ip6_hdr *ip6hdr = mbuf_push_hdr(m, *ip6hdr);
+
+	ip6hdr->vtc_flow = ip6_vtc_flow(tclass);
+	ip6hdr->payload_len = hton16(len);
+	ip6hdr->nexthdr = proto;
+	ip6hdr->hop_limit = IP6_DEFAULT_HOPS;
+	ip6hdr->saddr = *saddr;
+	ip6hdr->daddr = *daddr;
+}
+
+/* like net_route_cache_push(), but for IPv6 headers */
+static bool net_route_cache_push6(struct net_route_cache *rc, struct mbuf *m,
+				  uint8_t tclass)
+{
+	struct ip6_hdr *ip6hdr;
+	unsigned char *p;
+	int seq = atomic_read(&rc->seq);
+	uint16_t len = mbuf_length(m);
+
+	if (seq & 1)
+		return false;
+	rmb();
+	if (ACCESS_ONCE(rc->gen) != atomic_read(&arp_gen))
+		return false;
+
+	p = mbuf_push(m, NET_HDR6_TMPL_LEN);
+	memcpy(p, &rc->hdr6.eth, NET_HDR6_TMPL_LEN);
+	rmb();
+	if (unlikely(atomic_read(&rc->seq) != seq)) {
+		mbuf_pull(m, NET_HDR6_TMPL_LEN);
+		return false;
+	}
+
+	ip6hdr = (struct ip6_hdr *)(p + sizeof(struct eth_hdr));
+	ip6hdr->vtc_flow = ip6_vtc_flow(tclass);
+	ip6hdr->payload_len = hton16(len);
+	return true;
+}
+
+static void net_route_cache_set6(struct net_route_cache *rc, int gen,
+				 const struct ip6_hdr *ip6hdr,
+				 struct eth_addr dhost)
+{
+	int seq = atomic_read(&rc->seq);
+
+	if ((seq & 1) || !atomic_cmpxchg(&rc->seq, seq, seq + 1))
+		return;
+	rc->gen = gen;
+	rc->hdr6.eth.dhost = dhost;
+	rc->hdr6.eth.shost = netcfg.mac;
+	rc->hdr6.eth.type = hton16(ETHTYPE_IPV6);
+	rc->hdr6.ip6 = *ip6hdr;
+	wmb();
+	atomic_write(&rc->seq, seq + 2);
+}
+
+/**
+ * net_tx_ip6_cached - transmits an IPv6 packet, remembering where it went
+ * @m: the mbuf to transmit
+ * @proto: the transport protocol
+ * @tclass: the traffic class (DSCP and ECN codepoints)
+ * @saddr: the source address, one of ours
+ * @daddr: the destination address
+ * @rc: cached headers for packets to @daddr, or NULL
+ *
+ * Like net_tx_ip_cached(), but the next hop is resolved with neighbor
+ * discovery, and packets to a multicast group use its multicast MAC address.
+ * @rc must only ever be used with the same @saddr and @daddr.
+ *
+ * Returns 0 if successful. If successful, the mbuf will be freed when the
+ * transmit completes. Otherwise, the mbuf still belongs to the caller.
+ */
+int net_tx_ip6_cached(struct mbuf *m, uint8_t proto, uint8_t tclass,
+		      const struct ip6_addr *saddr,
+		      const struct ip6_addr *daddr, struct net_route_cache *rc)
+{
+	struct ip6_addr nexthop;
+	struct eth_addr dhost;
+	int ret, gen;
+
+	m->txflags |= OLFLAG_IPV6;
+
+	/* hot-path: the connection already has its headers */
+	if (rc && likely(net_route_cache_push6(rc, m, tclass)))
+		return net_tx_raw(m);
+
+	/* 33:33 followed by the low 32 bits of the group */
+	if (unlikely(ip6_addr_is_multicast(daddr))) {
+		dhost.addr[0] = dhost.addr[1] = 0x33;
+		memcpy(&dhost.addr[2], &daddr->addr[12], 4);
+		net_push_ip6hdr(m, proto, tclass, saddr, daddr);
+		ret = net_tx_eth(m, ETHTYPE_IPV6, dhost);
+		assert(!ret);
+		return 0;
+	}
+
+	ret = net_route6_lookup(daddr, &nexthop);
+	if (unlikely(ret))
+		return ret;
+	net_push_ip6hdr(m, proto, tclass, saddr, daddr);
+
+	/* need to use neighbor discovery to resolve dhost */
+	gen = atomic_read(&arp_gen);
+	ret = ndisc_lookup(&nexthop, &dhost, m);
+	if (unlikely(ret)) {
+		if (ret == -EINPROGRESS)
+			return 0;
+		mbuf_pull_hdr(m, struct ip6_hdr);
+		return ret;
+	}
+	if (rc)
+		net_route_cache_set6(rc, gen, (struct ip6_hdr *)mbuf_data(m),
+				     dhost);
+
+	ret = net_tx_eth(m, ETHTYPE_IPV6, dhost);
+	assert(!ret); /* can't fail as implemented so far */
+	return 0;
+}
+
 /**
  * net_tx_ip_burst - transmits a burst of IP packets
  * @ms: an array of mbuf pointers to transmit
@@ -446,8 +1228,8 @@ int net_tx_ip(struct mbuf *m, uint8_t proto, uint32_t daddr)
  *
  * Returns 0 if successful. If successful, the mbufs will be freed when the
  * transmit completes. Otherwise, the mbufs still belongs to the caller. If
- * ARP doesn't have a cached entry, only the first mbuf will be transmitted
- * when the ARP request resolves.
+ * ARP doesn't have a cached entry, the mbufs are queued until the ARP request
+ * resolves.
  */
 int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto, uint32_t daddr)
 {
@@ -459,20 +1241,35 @@ int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto, uint32_t daddr)
 	/* prepare the mbufs */
 	for (i = 0; i < n; i++) {
 		/* prepend the IP header */
-		net_push_iphdr(ms[i], proto, daddr);
+		net_push_iphdr(ms[i], proto, IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT,
+			       daddr);
 
 		/* ask NIC to calculate IP checksum */
 		ms[i]->txflags |= OLFLAG_IP_CHKSUM | OLFLAG_IPV4;
 	}
 
+	/* groups and broadcasts map directly to a MAC address */
+	if (unlikely(net_ip_mcast_dhost(daddr, &dhost)))
+		goto xmit;
+
 	/* apply IP routing */
-	daddr = net_get_ip_route(daddr);
+	daddr = net_route_lookup(daddr);
 
 	/* use ARP to resolve dhost */
 	ret = arp_lookup(daddr, &dhost, ms[0]);
 	if (unlikely(ret)) {
 		if (ret == -EINPROGRESS) {
-			/* ARP code now owns the first mbuf */
+			/* ARP code now owns the first mbuf, queue the rest too */
+			for (i = 1; i < n; i++) {
+				ret = arp_lookup(daddr, &dhost, ms[i]);
+				if (!ret) {
+					ret = net_tx_eth(ms[i], ETHTYPE_IP,
+							 dhost);
+					assert(!ret);
+				} else if (ret != -EINPROGRESS) {
+					mbuf_free(ms[i]);
+				}
+			}
 			return 0;
 		} else {
 			/* An unrecoverable error occurred */
@@ -482,6 +1279,7 @@ int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto, uint32_t daddr)
 		}
 	}
 
+xmit:
 	/* finally, transmit the packets */
 	for (i = 0; i < n; i++) {
 		ret = net_tx_eth(ms[i], ETHTYPE_IP, dhost);
@@ -491,12 +1289,49 @@ int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto, uint32_t daddr)
 	return 0;
 }
 
+/* parses "[fd00::1]:80", or "fd00::1" for an ephemeral port */
+static int str_to_netaddr6(const char *str, struct netaddr *addr)
+{
+	char buf[IP6_ADDR_STR_LEN];
+	const char *start = str, *end;
+	uint16_t port = 0;
+	char c;
+
+	if (*start == '[') {
+		start++;
+		end = strchr(start, ']');
+		if (!end)
+			return -EINVAL;
+		if (end[1] == ':' &&
+		    sscanf(end + 2, "%hu%c", &port, &c) != 1)
+			return -EINVAL;
+		else if (end[1] != ':' && end[1] != '\0')
+			return -EINVAL;
+	} else {
+		end = start + strlen(start);
+	}
+
+	if (end - start >= sizeof(buf))
+		return -EINVAL;
+	memcpy(buf, start, end - start);
+	buf[end - start] = '\0';
+
+	memset(addr, 0, sizeof(*addr));
+	if (str_to_ip6_addr(buf, &addr->ip6))
+		return -EINVAL;
+	addr->family = NET_AF_INET6;
+	addr->port = port;
+	return 0;
+}
+
 /**
- * str_to_netaddr - converts a string to an IPv4 address and port
+ * str_to_netaddr - converts a string to an IP address and port
  * @str: the string to convert
  * @addr: the location to store the parsed address
  *
  * Takes a string like "192.168.1.1:80" or "192.168.1.1" for an ephemeral port.
+ * IPv6 addresses are written like "[fd00::1]:80", or "fd00::1" for an
+ * ephemeral port.
  *
  * Returns 0 if successful, otherwise -EINVAL if the parsing failed.
  */
@@ -505,6 +1340,9 @@ int str_to_netaddr(const char *str, struct netaddr *addr)
 	uint8_t a, b, c, d;
 	uint16_t port;
 
+	if (str[0] == '[' || strchr(str, ':') != strrchr(str, ':'))
+		return str_to_netaddr6(str, addr);
+
 	if(sscanf(str, "%hhu.%hhu.%hhu.%hhu:%hu",
 	          &a, &b, &c, &d, &port) != 5) {
 		port = 0; /* try with an ephemeral port */
@@ -512,11 +1350,24 @@ int str_to_netaddr(const char *str, struct netaddr *addr)
 			return -EINVAL;
 	}
 
+	memset(addr, 0, sizeof(*addr));
 	addr->ip = MAKE_IP_ADDR(a, b, c, d);
 	addr->port = port;
 	return 0;
 }
 
+/**
+ * netaddr_ip_to_str - prints the IP address of a netaddr
+ * @a: the address
+ * @str: a buffer to store the string, NETADDR_IP_STR_LEN in size
+ */
+char *netaddr_ip_to_str(const struct netaddr *a, char *str)
+{
+	if (a->family == NET_AF_INET6)
+		return ip6_addr_to_str(&a->ip6, str);
+	return ip_addr_to_str(a->ip, str);
+}
+
 /**
  * net_init_thread - initializes per-thread state for the network stack
  *
@@ -525,14 +1376,20 @@ int str_to_netaddr(const char *str, struct netaddr *addr)
 int net_init_thread(void)
 {
 	tcache_init_perthread(net_rx_buf_tcache, &perthread_get(net_rx_buf_pt));
+	tcache_init_perthread(net_rx_gro_buf_tcache,
+			      &perthread_get(net_rx_gro_buf_pt));
 	tcache_init_perthread(net_tx_buf_tcache, &perthread_get(net_tx_buf_pt));
+	if (net_tx_tso_buf_tcache) {
+		tcache_init_perthread(net_tx_tso_buf_tcache,
+				      &perthread_get(net_tx_tso_buf_pt));
+	}
 	return 0;
 }
 
 
 static void net_dump_config(void)
 {
-	char buf[IP_ADDR_STR_LEN];
+	char buf[IP6_ADDR_STR_LEN];
 
 	log_info("net: using the following configuration:");
 	log_info("  addr:\t%s", ip_addr_to_str(netcfg.addr, buf));
@@ -541,6 +1398,31 @@ static void net_dump_config(void)
 	log_info("  mac:\t%02X:%02X:%02X:%02X:%02X:%02X",
 		 netcfg.mac.addr[0], netcfg.mac.addr[1], netcfg.mac.addr[2],
 		 netcfg.mac.addr[3], netcfg.mac.addr[4], netcfg.mac.addr[5]);
+	log_info("  mtu:\t%u", netcfg.mtu);
+	if (!netcfg6.enabled)
+		return;
+	log_info("  addr6:\t%s/%d", ip6_addr_to_str(&netcfg6.addr, buf),
+		 netcfg6.prefix_len);
+	log_info("  link-local:\t%s", ip6_addr_to_str(&netcfg6.addr_ll, buf));
+	log_info("  gateway6:\t%s", ip6_addr_to_str(&netcfg6.gateway, buf));
+}
+
+/* forms the link-local address fe80::/64 from the MAC (modified EUI-64) */
+static void net_init_addr_ll(void)
+{
+	struct ip6_addr *ll = &netcfg6.addr_ll;
+
+	memset(ll, 0, sizeof(*ll));
+	ll->addr[0] = 0xfe;
+	ll->addr[1] = 0x80;
+	ll->addr[8] = netcfg.mac.addr[0] ^ 0x02;
+	ll->addr[9] = netcfg.mac.addr[1];
+	ll->addr[10] = netcfg.mac.addr[2];
+	ll->addr[11] = 0xff;
+	ll->addr[12] = 0xfe;
+	ll->addr[13] = netcfg.mac.addr[3];
+	ll->addr[14] = netcfg.mac.addr[4];
+	ll->addr[15] = netcfg.mac.addr[5];
 }
 
 /**
@@ -553,7 +1435,7 @@ int net_init(void)
 	int ret;
 
 	ret = slab_create(&net_rx_buf_slab, "runtime_rx_bufs",
-			  MBUF_DEFAULT_LEN, SLAB_FLAG_LGPAGE);
+			  net_buf_len(), SLAB_FLAG_LGPAGE);
 	if (ret)
 		return ret;
 
@@ -562,8 +1444,19 @@ int net_init(void)
 	if (!net_rx_buf_tcache)
 		return -ENOMEM;
 
-	ret = mempool_create(&net_tx_buf_mp, iok.tx_buf, iok.tx_len,
-			     PGSIZE_2MB, MBUF_DEFAULT_LEN);
+	ret = slab_create(&net_rx_gro_buf_slab, "runtime_rx_gro_bufs",
+			  NET_GRO_BUF_LEN, SLAB_FLAG_LGPAGE);
+	if (ret)
+		return ret;
+
+	net_rx_gro_buf_tcache = slab_create_tcache(&net_rx_gro_buf_slab,
+						   TCACHE_DEFAULT_MAG_SIZE);
+	if (!net_rx_gro_buf_tcache)
+		return -ENOMEM;
+
+	/* tx buffers are often freed by a different kthread (e.g. TCP acks) */
+	ret = mempool_create_mpmc(&net_tx_buf_mp, iok.tx_buf, iok.tx_len,
+				  PGSIZE_2MB, net_buf_len());
 	if (ret)
 		return ret;
 
@@ -572,6 +1465,24 @@ int net_init(void)
 	if (!net_tx_buf_tcache)
 		return -ENOMEM;
 
+	if (enable_tso) {
+		BUILD_ASSERT(PGSIZE_2MB % MBUF_TSO_LEN == 0);
+		ret = mempool_create_mpmc(&net_tx_tso_buf_mp, iok.tso_buf,
+					  iok.tso_len, PGSIZE_2MB,
+					  MBUF_TSO_LEN);
+		if (ret)
+			return ret;
+
+		net_tx_tso_buf_tcache = mempool_create_tcache(
+			&net_tx_tso_buf_mp, "runtime_tx_tso_bufs",
+			TCACHE_DEFAULT_MAG_SIZE);
+		if (!net_tx_tso_buf_tcache)
+			return -ENOMEM;
+	}
+
+	if (netcfg6.enabled)
+		net_init_addr_ll();
+
 	log_info("net: started network stack");
 	net_dump_config();
 	return 0;
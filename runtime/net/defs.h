@@ -7,6 +7,8 @@
 #include <net/mbuf.h>
 #include <net/ethernet.h>
 #include <net/ip.h>
+#include <net/ip6.h>
+#include <net/chksum.h>
 #include <runtime/net.h>
 #include <runtime/rculist.h>
 
@@ -27,9 +29,132 @@ extern void net_error(struct mbuf *m, int err);
 extern void net_rx_arp(struct mbuf *m);
 extern void net_rx_icmp(struct mbuf *m, const struct ip_hdr *iphdr,
 			uint16_t len);
+extern void net_rx_icmp6(struct mbuf *m, const struct ip6_hdr *ip6hdr,
+			 uint16_t len);
+extern void net_rx_igmp(struct mbuf *m, const struct ip_hdr *iphdr,
+			uint16_t len);
+extern bool net_ip_is_our_group(uint32_t addr);
+extern void ndisc_rx_solicit(struct mbuf *m, const struct ip6_hdr *ip6hdr,
+			     uint16_t len);
+extern void ndisc_rx_advert(struct mbuf *m, const struct ip6_hdr *ip6hdr,
+			    uint16_t len);
 extern void net_rx_trans(struct mbuf **ms, const unsigned int nr);
 extern void tcp_rx_closed(struct mbuf *m);
 
+/* true if the network header of an ingress packet is IPv6 */
+static inline bool mbuf_network_is_ip6(struct mbuf *m)
+{
+	return (*mbuf_network_offset(m) >> 4) == IP6VERSION;
+}
+
+/* true if @addr (in native byte order) is a broadcast address of our subnet */
+static inline bool net_ip_is_broadcast(uint32_t addr)
+{
+	return addr == IP_ADDR_BROADCAST ||
+	       (netcfg.netmask && addr == (netcfg.addr | ~netcfg.netmask));
+}
+
+/* true if @addr is one of our unicast IPv6 addresses */
+static inline bool net_ip6_is_local(const struct ip6_addr *addr)
+{
+	return ip6_addr_equal(addr, &netcfg6.addr) ||
+	       ip6_addr_equal(addr, &netcfg6.addr_ll);
+}
+
+/**
+ * net_rx_saddr - gets the source address of an ingress packet
+ * @m: the packet, after L3 processing
+ * @port: the port to store in the address
+ */
+static inline struct netaddr net_rx_saddr(struct mbuf *m, uint16_t port)
+{
+	const struct ip6_hdr *ip6hdr;
+	const struct ip_hdr *iphdr;
+	struct netaddr a = { .port = port };
+
+	if (mbuf_network_is_ip6(m)) {
+		ip6hdr = mbuf_network_hdr(m, *ip6hdr);
+		a.family = NET_AF_INET6;
+		a.ip6 = ip6hdr->saddr;
+	} else {
+		iphdr = mbuf_network_hdr(m, *iphdr);
+		a.ip = ntoh32(iphdr->saddr);
+	}
+	return a;
+}
+
+/**
+ * net_rx_daddr - gets the destination address of an ingress packet
+ * @m: the packet, after L3 processing
+ * @port: the port to store in the address
+ */
+static inline struct netaddr net_rx_daddr(struct mbuf *m, uint16_t port)
+{
+	const struct ip6_hdr *ip6hdr;
+	const struct ip_hdr *iphdr;
+	struct netaddr a = { .port = port };
+
+	if (mbuf_network_is_ip6(m)) {
+		ip6hdr = mbuf_network_hdr(m, *ip6hdr);
+		a.family = NET_AF_INET6;
+		a.ip6 = ip6hdr->daddr;
+	} else {
+		iphdr = mbuf_network_hdr(m, *iphdr);
+		a.ip = ntoh32(iphdr->daddr);
+	}
+	return a;
+}
+
+/* the transport protocol of an ingress packet */
+static inline uint8_t net_rx_proto(struct mbuf *m)
+{
+	const struct ip6_hdr *ip6hdr;
+	const struct ip_hdr *iphdr;
+
+	if (mbuf_network_is_ip6(m)) {
+		ip6hdr = mbuf_network_hdr(m, *ip6hdr);
+		return ip6hdr->nexthdr;
+	}
+	iphdr = mbuf_network_hdr(m, *iphdr);
+	return iphdr->proto;
+}
+
+/* the type of service (or traffic class) of an ingress packet */
+static inline uint8_t net_rx_tos(struct mbuf *m)
+{
+	const struct ip6_hdr *ip6hdr;
+	const struct ip_hdr *iphdr;
+
+	if (mbuf_network_is_ip6(m)) {
+		ip6hdr = mbuf_network_hdr(m, *ip6hdr);
+		return ip6_hdr_tclass(ip6hdr);
+	}
+	iphdr = mbuf_network_hdr(m, *iphdr);
+	return iphdr->tos;
+}
+
+/* the length of an ingress packet after its network header */
+static inline uint16_t net_rx_l4_len(struct mbuf *m)
+{
+	const struct ip6_hdr *ip6hdr;
+	const struct ip_hdr *iphdr;
+
+	if (mbuf_network_is_ip6(m)) {
+		ip6hdr = mbuf_network_hdr(m, *ip6hdr);
+		return ntoh16(ip6hdr->payload_len);
+	}
+	iphdr = mbuf_network_hdr(m, *iphdr);
+	return ntoh16(iphdr->len) - sizeof(*iphdr);
+}
+
+/* fills in when an ingress packet arrived, for tcp_read_ts() and friends */
+static inline void net_rx_get_ts(const struct mbuf *m, struct net_rx_ts *ts)
+{
+	ts->iok_tsc = m->rx_tsc;
+	ts->nic_ts = m->nic_ts;
+	ts->enq_tsc = m->rx_tsc + m->rx_enq_cycles;
+	ts->softirq_tsc = m->rx_tsc + m->rx_softirq_cycles;
+}
 
 /*
  * TX Networking Functions
@@ -37,12 +162,97 @@ extern void tcp_rx_closed(struct mbuf *m);
 
 extern int arp_lookup(uint32_t daddr, struct eth_addr *dhost_out,
 		      struct mbuf *m) __must_use_return;
+extern uint32_t net_route_lookup(uint32_t daddr);
+extern int ndisc_lookup(const struct ip6_addr *daddr,
+			struct eth_addr *dhost_out,
+			struct mbuf *m) __must_use_return;
+extern int net_route6_lookup(const struct ip6_addr *daddr,
+			     struct ip6_addr *nexthop) __must_use_return;
+
+/* IPv4 multicast group membership, see igmp.c */
+extern int net_mcast_join(uint32_t group);
+extern void net_mcast_leave(uint32_t group);
+
+/* spins handling packets before a read blocks, see core.c */
+extern bool net_busy_poll(unsigned int us, bool (*ready)(void *arg),
+			  void *arg);
+
+/*
+ * Bumped whenever a resolved MAC address could have become stale, by ARP or
+ * by neighbor discovery.
+ */
+extern atomic_t arp_gen;
+
+/*
+ * The ethernet and IP headers of an egress packet, as they appear on the wire
+ * starting at @eth. The leading padding keeps the IP header aligned without
+ * packing the struct, so copy NET_HDR_TMPL_LEN bytes from @eth.
+ */
+struct net_hdr_tmpl {
+	uint16_t		pad;
+	struct eth_hdr		eth;
+	struct ip_hdr		ip;
+};
+
+#define NET_HDR_TMPL_LEN	(sizeof(struct eth_hdr) + sizeof(struct ip_hdr))
+BUILD_ASSERT(offsetof(struct net_hdr_tmpl, ip) ==
+	     offsetof(struct net_hdr_tmpl, eth) + sizeof(struct eth_hdr));
+BUILD_ASSERT(sizeof(struct net_hdr_tmpl) ==
+	     offsetof(struct net_hdr_tmpl, eth) + NET_HDR_TMPL_LEN);
+
+/* the same for IPv6 */
+struct net_hdr6_tmpl {
+	uint16_t		pad;
+	struct eth_hdr		eth;
+	struct ip6_hdr		ip6;
+};
+
+#define NET_HDR6_TMPL_LEN	(sizeof(struct eth_hdr) + sizeof(struct ip6_hdr))
+BUILD_ASSERT(offsetof(struct net_hdr6_tmpl, ip6) ==
+	     offsetof(struct net_hdr6_tmpl, eth) + sizeof(struct eth_hdr));
+BUILD_ASSERT(sizeof(struct net_hdr6_tmpl) ==
+	     offsetof(struct net_hdr6_tmpl, eth) + NET_HDR6_TMPL_LEN);
+
+/*
+ * Remembers a connection's prebuilt ethernet and IP headers, so routing, ARP,
+ * and header construction are skipped for every packet; only the IP length,
+ * ID, and type of service are patched in. Routes never change after startup,
+ * so the cache is only invalidated by ARP changes (see arp_gen). Any number of
+ * senders may race: fills are skipped while another is in progress, and
+ * readers retry with a full lookup if @seq changed under them.
+ */
+struct net_route_cache {
+	atomic_t		seq;	/* odd while being filled */
+	int			gen;	/* arp_gen when filled, 0 if empty */
+	union {
+		struct net_hdr_tmpl	hdr;
+		struct net_hdr6_tmpl	hdr6;
+	};
+};
+
+static inline void net_route_cache_init(struct net_route_cache *rc)
+{
+	atomic_write(&rc->seq, 0);
+	rc->gen = 0;
+}
+/* space reserved at the start of each buffer for struct mbuf */
+#define MBUF_RESERVED (align_up(sizeof(struct mbuf), CACHE_LINE_SIZE))
+/* the largest payload that fits in a TSO mbuf (after headroom) */
+#define NET_TX_TSO_MAX_LEN \
+	(MBUF_TSO_LEN - MBUF_RESERVED - MBUF_DEFAULT_HEADROOM)
+
 extern struct mbuf *net_tx_alloc_mbuf(void);
+extern struct mbuf *net_tx_alloc_tso_mbuf(void);
 extern void net_tx_release_mbuf(struct mbuf *m);
 extern int net_tx_eth(struct mbuf *m, uint16_t proto,
 		      struct eth_addr dhost) __must_use_return;
-extern int net_tx_ip(struct mbuf *m, uint8_t proto,
-		     uint32_t daddr) __must_use_return;
+extern int net_tx_ip_cached(struct mbuf *m, uint8_t proto, uint8_t tos,
+			    uint32_t daddr, struct net_route_cache *rc)
+			    __must_use_return;
+extern int net_tx_ip6_cached(struct mbuf *m, uint8_t proto, uint8_t tclass,
+			     const struct ip6_addr *saddr,
+			     const struct ip6_addr *daddr,
+			     struct net_route_cache *rc) __must_use_return;
 extern int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto,
 		     uint32_t daddr) __must_use_return;
 extern int net_tx_icmp(struct mbuf *m, uint8_t type, uint8_t code,
@@ -59,6 +269,33 @@ extern int net_tx_icmp(struct mbuf *m, uint8_t type, uint8_t code,
  *
  * @m must have been allocated with net_tx_alloc_mbuf().
  */
+/**
+ * net_ip_mcast_dhost - maps a multicast or broadcast IP address to its MAC
+ * @daddr: the destination IP address (in native byte order)
+ * @dhost: stores the MAC address
+ *
+ * Groups map to 01:00:5e followed by the low 23 bits of the address, per RFC
+ * 1112. Returns false if @daddr is a unicast address, which needs ARP instead.
+ */
+static inline bool net_ip_mcast_dhost(uint32_t daddr, struct eth_addr *dhost)
+{
+	if (ip_addr_is_multicast(daddr)) {
+		dhost->addr[0] = 0x01;
+		dhost->addr[1] = 0x00;
+		dhost->addr[2] = 0x5e;
+		dhost->addr[3] = (daddr >> 16) & 0x7f;
+		dhost->addr[4] = (daddr >> 8) & 0xff;
+		dhost->addr[5] = daddr & 0xff;
+		return true;
+	}
+	if (net_ip_is_broadcast(daddr)) {
+		*dhost = eth_addr_broadcast;
+		return true;
+	}
+
+	return false;
+}
+
 static inline void net_tx_eth_or_free(struct mbuf *m, uint16_t type,
 				      struct eth_addr dhost)
 {
@@ -66,6 +303,42 @@ static inline void net_tx_eth_or_free(struct mbuf *m, uint16_t type,
 		mbuf_free(m);
 }
 
+/**
+ * net_tx_ip_tos - transmits an IP packet with a type of service
+ * @m: the mbuf to transmit
+ * @proto: the transport protocol
+ * @tos: the IP type of service (DSCP and ECN codepoints)
+ * @daddr: the destination IP address (in native byte order)
+ *
+ * See net_tx_ip_cached(), but always routes and resolves @daddr.
+ */
+static inline __must_use_return int
+net_tx_ip_tos(struct mbuf *m, uint8_t proto, uint8_t tos, uint32_t daddr)
+{
+	return net_tx_ip_cached(m, proto, tos, daddr, NULL);
+}
+
+/**
+ * net_tx_ip - transmits an IP packet
+ * @m: the mbuf to transmit
+ * @proto: the transport protocol
+ * @daddr: the destination IP address (in native byte order)
+ *
+ * The payload must start with the transport (L4) header. The IPv4 (L3) and
+ * ethernet (L2) headers will be prepended by this function.
+ *
+ * @m must have been allocated with net_tx_alloc_mbuf().
+ *
+ * Returns 0 if successful. If successful, the mbuf will be freed when the
+ * transmit completes. Otherwise, the mbuf still belongs to the caller.
+ */
+static inline __must_use_return int
+net_tx_ip(struct mbuf *m, uint8_t proto, uint32_t daddr)
+{
+	return net_tx_ip_tos(m, proto, IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT,
+			     daddr);
+}
+
 /**
  * net_tx_ip - transmits an IP packet, or frees it on failure
  * @m: the mbuf to transmit
@@ -84,6 +357,91 @@ static inline void net_tx_ip_or_free(struct mbuf *m, uint8_t proto,
 		mbuf_free(m);
 }
 
+/**
+ * net_tx_ip_addr - transmits an IPv4 or IPv6 packet between two endpoints
+ * @m: the mbuf to transmit
+ * @proto: the transport protocol
+ * @tos: the type of service (or IPv6 traffic class)
+ * @laddr: the local address, the source of the packet
+ * @raddr: the remote address, the destination of the packet
+ * @rc: cached headers for packets to @raddr, or NULL
+ *
+ * See net_tx_ip_cached(). @laddr and @raddr must be of the same family.
+ */
+static inline __must_use_return int
+net_tx_ip_addr(struct mbuf *m, uint8_t proto, uint8_t tos,
+	       const struct netaddr *laddr, const struct netaddr *raddr,
+	       struct net_route_cache *rc)
+{
+	if (raddr->family == NET_AF_INET6)
+		return net_tx_ip6_cached(m, proto, tos, &laddr->ip6,
+					 &raddr->ip6, rc);
+	return net_tx_ip_cached(m, proto, tos, raddr->ip, rc);
+}
+
+/* the length of the network header of packets to @addr */
+static inline size_t net_ip_hdr_len(const struct netaddr *addr)
+{
+	if (addr->family == NET_AF_INET6)
+		return sizeof(struct ip6_hdr);
+	return sizeof(struct ip_hdr);
+}
+
+/**
+ * net_phdr_cksum - computes the pseudo-header checksum of a TCP or UDP packet
+ * @proto: the transport protocol
+ * @laddr: the local address, the source of the packet
+ * @raddr: the remote address, the destination of the packet
+ * @len: the length of the transport header and payload
+ */
+static inline uint16_t net_phdr_cksum(uint8_t proto,
+				      const struct netaddr *laddr,
+				      const struct netaddr *raddr,
+				      uint32_t len)
+{
+	if (raddr->family == NET_AF_INET6)
+		return ipv6_phdr_cksum(proto, &laddr->ip6, &raddr->ip6, len);
+	return ipv4_phdr_cksum(proto, laddr->ip, raddr->ip, len);
+}
+
+/**
+ * net_bind_laddr - fills in or checks the local address of a socket
+ * @laddr: the local address to bind, updated in place
+ * @raddr: the remote address to connect to, or NULL if listening
+ *
+ * An unspecified address becomes our own address in the family of @raddr (or
+ * of @laddr when listening).
+ *
+ * Returns 0 if successful, -EADDRNOTAVAIL if the family isn't configured, or
+ * -EINVAL if @laddr isn't one of ours.
+ */
+static inline int net_bind_laddr(struct netaddr *laddr,
+				 const struct netaddr *raddr)
+{
+	if (raddr && netaddr_ip_is_zero(laddr))
+		laddr->family = raddr->family;
+	if (raddr && raddr->family != laddr->family)
+		return -EINVAL;
+
+	if (laddr->family == NET_AF_INET6) {
+		if (!netcfg6.enabled)
+			return -EADDRNOTAVAIL;
+		if (ip6_addr_is_zero(&laddr->ip6))
+			laddr->ip6 = netcfg6.addr;
+		else if (!net_ip6_is_local(&laddr->ip6))
+			return -EINVAL;
+		return 0;
+	}
+
+	if (!netcfg.addr)
+		return -EADDRNOTAVAIL;
+	if (laddr->ip == 0)
+		laddr->ip = netcfg.addr;
+	else if (laddr->ip != netcfg.addr)
+		return -EINVAL;
+	return 0;
+}
+
 /**
  * mbuf_drop - frees an mbuf, counting it as a drop
  * @m: the mbuf to free
@@ -108,9 +466,14 @@ enum {
 
 struct trans_entry;
 
+/* the most packets net_rx_trans() demultiplexes at once */
+#define TRANS_RX_BATCH	32
+
 struct trans_ops {
 	/* receive an ingress packet */
 	void (*recv) (struct trans_entry *e, struct mbuf *m);
+	/* receive ingress packets in arrival order (optional) */
+	void (*recv_batch) (struct trans_entry *e, struct mbuf **ms, int nr);
 	/* propagate a network error */
 	void (*err) (struct trans_entry *e, int err);
 };
@@ -120,6 +483,9 @@ struct trans_entry {
 	uint8_t			proto;
 	struct netaddr		laddr;
 	struct netaddr		raddr;
+	bool			ephemeral; /* laddr.port is from the allocator */
+	bool			priority; /* see trans_set_priority() */
+	struct net_route_cache	rc; /* prebuilt headers for raddr */
 	struct rcu_hlist_node	link;
 	struct rcu_head		rcu;
 	const struct trans_ops	*ops;
@@ -139,6 +505,9 @@ static inline void trans_init_3tuple(struct trans_entry *e, uint8_t proto,
 	e->match = TRANS_MATCH_3TUPLE;
 	e->proto = proto;
 	e->laddr = laddr;
+	e->ephemeral = false;
+	e->priority = false;
+	net_route_cache_init(&e->rc);
 	e->ops = ops;
 }
 
@@ -158,9 +527,29 @@ static inline void trans_init_5tuple(struct trans_entry *e, uint8_t proto,
 	e->proto = proto;
 	e->laddr = laddr;
 	e->raddr = raddr;
+	e->ephemeral = false;
+	e->priority = false;
+	net_route_cache_init(&e->rc);
 	e->ops = ops;
 }
 
+/**
+ * trans_set_priority - marks an entry's ingress packets as latency-critical
+ * @e: the entry
+ * @high: true to handle its packets ahead of the rest of each batch
+ *
+ * Packets with a DSCP of at least trans_rx_prio_dscp also mark their entry.
+ */
+static inline void trans_set_priority(struct trans_entry *e, bool high)
+{
+	ACCESS_ONCE(e->priority) = high;
+}
+
 extern int trans_table_add(struct trans_entry *e);
 extern int trans_table_add_with_ephemeral_port(struct trans_entry *e);
 extern void trans_table_remove(struct trans_entry *e);
+extern void trans_table_replace(struct trans_entry *old,
+				struct trans_entry *new);
+extern void trans_rx_redeliver(struct mbuf *m);
+extern void trans_table_for_each(void (*fn)(struct trans_entry *e, void *arg),
+				 void *arg);
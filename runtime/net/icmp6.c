@@ -0,0 +1,96 @@
+/*
+ * icmp6.c - support for Internet Control Message Protocol for IPv6 (ICMPv6)
+ */
+
+#include <string.h>
+
+#include <base/compiler.h>
+#include <base/log.h>
+#include <net/chksum.h>
+#include <net/icmp6.h>
+
+#include "defs.h"
+
+static void net_rx_icmp6_echo(struct mbuf *m_in,
+		const struct icmp6_hdr *in_icmp6hdr,
+		const struct ip6_hdr *in_ip6hdr, uint16_t len)
+{
+	const struct ip6_addr *saddr = &in_ip6hdr->daddr;
+	struct mbuf *m;
+	struct icmp6_hdr *out_icmp6hdr;
+
+	log_debug("icmp6: responding to icmp6 echo request");
+
+	/* answer a multicast ping from the matching unicast address */
+	if (ip6_addr_is_multicast(saddr)) {
+		saddr = ip6_addr_is_linklocal(&in_ip6hdr->saddr) ?
+			&netcfg6.addr_ll : &netcfg6.addr;
+	}
+
+	m = net_tx_alloc_mbuf();
+	if (unlikely(!m)) {
+		mbuf_drop(m_in);
+		return;
+	}
+
+	/* copy incoming ICMPv6 hdr and data, set type and checksum */
+	out_icmp6hdr = (struct icmp6_hdr *)mbuf_put(m, len);
+	memcpy(out_icmp6hdr, in_icmp6hdr, len);
+	out_icmp6hdr->type = ICMP6_ECHO_REPLY;
+	out_icmp6hdr->chksum = 0;
+	out_icmp6hdr->chksum = ipv6_udptcp_cksum(IPPROTO_ICMPV6, saddr,
+						 &in_ip6hdr->saddr, len,
+						 out_icmp6hdr);
+
+	/* send the echo reply */
+	if (unlikely(net_tx_ip6_cached(m, IPPROTO_ICMPV6, 0, saddr,
+				       &in_ip6hdr->saddr, NULL)))
+		mbuf_free(m);
+	mbuf_free(m_in);
+}
+
+/**
+ * net_rx_icmp6 - receives an ICMPv6 message
+ * @m: the mbuf, starting at the ICMPv6 header
+ * @ip6hdr: its IPv6 header
+ * @len: the length of the ICMPv6 message
+ *
+ * ICMPv6 checksums are always verified in software, since they're rare and
+ * NICs may not check them.
+ */
+void net_rx_icmp6(struct mbuf *m, const struct ip6_hdr *ip6hdr, uint16_t len)
+{
+	const struct icmp6_hdr *icmp6hdr;
+
+	if (unlikely(len < sizeof(*icmp6hdr)))
+		goto drop;
+	icmp6hdr = (const struct icmp6_hdr *)mbuf_data(m);
+	if (unlikely(!ipv6_udptcp_cksum_ok(IPPROTO_ICMPV6, &ip6hdr->saddr,
+					   &ip6hdr->daddr, len, icmp6hdr)))
+		goto drop;
+
+	switch (icmp6hdr->type) {
+	case ND_NEIGHBOR_SOLICIT:
+		ndisc_rx_solicit(m, ip6hdr, len);
+		break;
+	case ND_NEIGHBOR_ADVERT:
+		ndisc_rx_advert(m, ip6hdr, len);
+		break;
+	case ICMP6_ECHO_REQUEST:
+		if (unlikely(ip6_addr_is_multicast(&ip6hdr->daddr) &&
+			     !ip6_addr_equal(&ip6hdr->daddr,
+					     &ip6_addr_all_nodes)))
+			goto drop;
+		net_rx_icmp6_echo(m, icmp6hdr, ip6hdr, len);
+		break;
+	default:
+		/* router advertisements and errors are ignored */
+		log_debug("icmp6: type %d not supported", icmp6hdr->type);
+		goto drop;
+	}
+
+	return;
+
+drop:
+	mbuf_drop(m);
+}
@@ -0,0 +1,235 @@
+/*
+ * igmp.c - IPv4 multicast group membership (IGMPv2)
+ *
+ * The iokernel only delivers a group's packets to the runtimes that joined it,
+ * so joins and leaves are passed on to it as well as announced to routers.
+ * Groups are refcounted, since several sockets may join the same one.
+ */
+
+#include <string.h>
+
+#include <asm/chksum.h>
+#include <base/lock.h>
+#include <base/log.h>
+#include <iokernel/queue.h>
+#include <net/igmp.h>
+#include <runtime/sync.h>
+
+#include "defs.h"
+
+/* the most groups a runtime may join */
+#define IGMP_MAX_GROUPS		32
+
+struct igmp_group {
+	uint32_t	addr;
+	int		refcnt;
+};
+
+static DEFINE_SPINLOCK(igmp_lock);
+static struct igmp_group igmp_groups[IGMP_MAX_GROUPS];
+static int igmp_nr_groups;
+
+/* sends an IGMP message with the router alert option */
+static void igmp_send(uint8_t type, uint32_t group, uint32_t daddr)
+{
+	struct igmp_ip_opt_ra *ra;
+	struct igmp_hdr *igmphdr;
+	struct ip_hdr *iphdr;
+	struct eth_addr dhost;
+	struct mbuf *m;
+
+	m = net_tx_alloc_mbuf();
+	if (unlikely(!m))
+		return;
+
+	igmphdr = mbuf_put_hdr(m, *igmphdr);
+	igmphdr->type = type;
+	igmphdr->max_resp = 0;
+	igmphdr->chksum = 0;
+	igmphdr->group = hton32(group);
+	igmphdr->chksum = chksum_internet((char *)igmphdr, sizeof(*igmphdr));
+
+	ra = mbuf_push_hdr(m, *ra);
+	ra->type = IPOPT_RA;
+	ra->len = sizeof(*ra);
+	ra->value = 0;
+
+	iphdr = mbuf_push_hdr(m, *iphdr);
+	iphdr->version = IPVERSION;
+	iphdr->header_len = (sizeof(*iphdr) + sizeof(*ra)) / sizeof(uint32_t);
+	iphdr->tos = IPTOS_PREC_INTERNETCONTROL;
+	iphdr->len = hton16(mbuf_length(m));
+	iphdr->id = 0;
+	iphdr->off = 0;
+	iphdr->ttl = IGMP_TTL;
+	iphdr->proto = IPPROTO_IGMP;
+	iphdr->chksum = 0;
+	iphdr->saddr = hton32(netcfg.addr);
+	iphdr->daddr = hton32(daddr);
+	iphdr->chksum = chksum_internet((char *)iphdr,
+					sizeof(*iphdr) + sizeof(*ra));
+
+	net_ip_mcast_dhost(daddr, &dhost);
+	net_tx_eth_or_free(m, ETHTYPE_IP, dhost);
+}
+
+static void igmp_send_report(uint32_t group)
+{
+	igmp_send(IGMP_V2_MEMBERSHIP_REPORT, group, group);
+}
+
+static struct igmp_group *igmp_find(uint32_t addr)
+{
+	int i;
+
+	for (i = 0; i < igmp_nr_groups; i++) {
+		if (igmp_groups[i].addr == addr)
+			return &igmp_groups[i];
+	}
+
+	return NULL;
+}
+
+/* tells the iokernel about a membership change, returns false if it can't */
+static bool igmp_notify_iokernel(uint64_t cmd, uint32_t group)
+{
+	struct kthread *k;
+	bool sent;
+
+	k = getk();
+	sent = lrpc_send(&k->txcmdq, cmd, group);
+	putk();
+	return sent;
+}
+
+/**
+ * net_ip_is_our_group - checks if this runtime has joined a multicast group
+ * @addr: the group address (in native byte order)
+ *
+ * Runs on the ingress path without the lock; a packet racing a join or a
+ * leave may be accepted or dropped either way.
+ */
+bool net_ip_is_our_group(uint32_t addr)
+{
+	int i, nr = ACCESS_ONCE(igmp_nr_groups);
+
+	if (addr == IP_ADDR_ALL_HOSTS)
+		return true;
+	for (i = 0; i < nr; i++) {
+		if (ACCESS_ONCE(igmp_groups[i].addr) == addr)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * net_mcast_join - joins an IPv4 multicast group
+ * @group: the group address (in native byte order)
+ *
+ * Returns 0 if successful, -EINVAL if @group isn't a routable multicast group,
+ * -ENOSPC if too many groups are joined, or -EAGAIN if the iokernel couldn't
+ * be told.
+ */
+int net_mcast_join(uint32_t group)
+{
+	struct igmp_group *g;
+
+	if (!ip_addr_is_multicast(group) || ip_addr_is_local_multicast(group))
+		return -EINVAL;
+
+	spin_lock_np(&igmp_lock);
+	g = igmp_find(group);
+	if (g) {
+		g->refcnt++;
+		spin_unlock_np(&igmp_lock);
+		return 0;
+	}
+	if (igmp_nr_groups >= IGMP_MAX_GROUPS) {
+		spin_unlock_np(&igmp_lock);
+		return -ENOSPC;
+	}
+	if (!igmp_notify_iokernel(TXCMD_MCAST_JOIN, group)) {
+		spin_unlock_np(&igmp_lock);
+		return -EAGAIN;
+	}
+
+	g = &igmp_groups[igmp_nr_groups];
+	g->addr = group;
+	g->refcnt = 1;
+	store_release(&igmp_nr_groups, igmp_nr_groups + 1);
+	spin_unlock_np(&igmp_lock);
+
+	/* an unsolicited report, so routers start forwarding right away */
+	igmp_send_report(group);
+	return 0;
+}
+
+/**
+ * net_mcast_leave - leaves an IPv4 multicast group
+ * @group: the group address, which must have been joined
+ */
+void net_mcast_leave(uint32_t group)
+{
+	struct igmp_group *g;
+
+	spin_lock_np(&igmp_lock);
+	g = igmp_find(group);
+	if (unlikely(!g)) {
+		spin_unlock_np(&igmp_lock);
+		WARN();
+		return;
+	}
+	if (--g->refcnt > 0) {
+		spin_unlock_np(&igmp_lock);
+		return;
+	}
+
+	*g = igmp_groups[igmp_nr_groups - 1];
+	store_release(&igmp_nr_groups, igmp_nr_groups - 1);
+	if (!igmp_notify_iokernel(TXCMD_MCAST_LEAVE, group))
+		log_warn("igmp: couldn't tell the iokernel to leave a group");
+	spin_unlock_np(&igmp_lock);
+
+	igmp_send(IGMP_V2_LEAVE_GROUP, group, IP_ADDR_ALL_ROUTERS);
+}
+
+/**
+ * net_rx_igmp - receives an IGMP message
+ * @m: the mbuf, starting at the IGMP header
+ * @iphdr: its IP header
+ * @len: the length of the IGMP message
+ *
+ * Queries are answered right away instead of after a random delay, and
+ * reports from other hosts don't suppress ours. Both are allowed by RFC 2236,
+ * at the cost of a few more reports.
+ */
+void net_rx_igmp(struct mbuf *m, const struct ip_hdr *iphdr, uint16_t len)
+{
+	const struct igmp_hdr *igmphdr;
+	uint32_t groups[IGMP_MAX_GROUPS];
+	uint32_t group;
+	int i, nr = 0;
+
+	igmphdr = (const struct igmp_hdr *)mbuf_data(m);
+	if (unlikely(len < sizeof(*igmphdr) ||
+		     chksum_internet((char *)igmphdr, len) != 0))
+		goto out;
+	if (igmphdr->type != IGMP_MEMBERSHIP_QUERY)
+		goto out;
+
+	/* a general query has no group, a group-specific query has one */
+	group = ntoh32(igmphdr->group);
+	spin_lock_np(&igmp_lock);
+	for (i = 0; i < igmp_nr_groups; i++) {
+		if (group == 0 || igmp_groups[i].addr == group)
+			groups[nr++] = igmp_groups[i].addr;
+	}
+	spin_unlock_np(&igmp_lock);
+
+	for (i = 0; i < nr; i++)
+		igmp_send_report(groups[i]);
+
+out:
+	mbuf_free(m);
+}
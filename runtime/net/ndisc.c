@@ -0,0 +1,549 @@
+/*
+ * ndisc.c - support for IPv6 neighbor discovery (RFC 4861)
+ *
+ * Resolves the MAC addresses of on-link IPv6 neighbors, the way arp.c does
+ * for IPv4, and with the same lock-free lookups. Only address resolution is
+ * implemented: there is no router discovery or duplicate address detection,
+ * since addresses and the default router are configured statically.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <base/lock.h>
+#include <base/log.h>
+#include <base/hash.h>
+#include <net/icmp6.h>
+#include <runtime/rculist.h>
+#include <runtime/timer.h>
+#include <runtime/smalloc.h>
+#include <runtime/sync.h>
+
+#include "defs.h"
+
+#define NDISC_SEED		0x5B1E39C7
+#define NDISC_TABLE_CAPACITY	1024
+#define NDISC_RETRIES		3
+#define NDISC_RETRY_TIME	ONE_SECOND
+#define NDISC_REPROBE_TIME	(10 * ONE_SECOND)
+/* the most packets that may wait on one unresolved entry */
+#define NDISC_MAX_PENDING	32
+
+enum {
+	/* the MAC address is being probed */
+	NDISC_STATE_PROBING = 0,
+	/* the MAC address is valid */
+	NDISC_STATE_VALID,
+	/* the MAC address is probably valid but is being confirmed */
+	NDISC_STATE_VALID_BUT_REPROBING,
+};
+
+/* a neighbor cache entry, with the same RCU rules as struct arp_entry */
+struct ndisc_entry {
+	/* accessed by RCU sections */
+	uint32_t		state;
+	struct ip6_addr		ip6;
+	struct eth_addr		eth;
+	struct rcu_hlist_node	link;
+
+	/* accessed only with the bucket lock */
+	struct mbufq		q;
+	int			q_len;
+	struct rcu_head		rcuh;
+	uint64_t		ts;
+	int			tries_left;
+};
+
+struct ndisc_bucket {
+	spinlock_t		lock;
+	struct rcu_hlist_head	head;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct ndisc_bucket ndisc_tbl[NDISC_TABLE_CAPACITY];
+static atomic_t ndisc_worker_started;
+
+/* each kthread remembers its last hit, invalidated by bumping arp_gen */
+struct ndisc_last_hit {
+	struct ip6_addr		ip6;
+	int			gen;
+	struct eth_addr		eth;
+};
+
+static DEFINE_PERTHREAD(struct ndisc_last_hit, ndisc_last);
+
+static void ndisc_worker(void *arg);
+
+static inline int hash_ip6(const struct ip6_addr *addr)
+{
+	uint64_t lo, hi;
+
+	memcpy(&lo, &addr->addr[0], sizeof(lo));
+	memcpy(&hi, &addr->addr[8], sizeof(hi));
+	return hash_crc32c_two(NDISC_SEED, lo, hi) % NDISC_TABLE_CAPACITY;
+}
+
+static struct ndisc_entry *lookup_entry(int idx, const struct ip6_addr *daddr)
+{
+	struct ndisc_entry *e;
+	struct rcu_hlist_node *node;
+
+	rcu_hlist_for_each(&ndisc_tbl[idx].head, node, true) {
+		e = rcu_hlist_entry(node, struct ndisc_entry, link);
+		if (ip6_addr_equal(&e->ip6, daddr))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void release_entry(struct rcu_head *h)
+{
+	struct ndisc_entry *e = container_of(h, struct ndisc_entry, rcuh);
+	sfree(e);
+}
+
+static void delete_entry(struct ndisc_entry *e)
+{
+	rcu_hlist_del(&e->link);
+	atomic_inc(&arp_gen);
+
+	/* free any mbufs waiting for an advertisement */
+	while (!mbufq_empty(&e->q)) {
+		struct mbuf *m = mbufq_pop_head(&e->q);
+		net_error(m, EHOSTUNREACH);
+		mbuf_free(m);
+	}
+
+	rcu_free(&e->rcuh, release_entry);
+}
+
+static void insert_entry(struct ndisc_entry *e, int idx)
+{
+	rcu_hlist_add_head(&ndisc_tbl[idx].head, &e->link);
+
+	if (unlikely(!atomic_read(&ndisc_worker_started) &&
+		     atomic_cmpxchg(&ndisc_worker_started, 0, 1))) {
+		BUG_ON(thread_spawn(ndisc_worker, NULL));
+	}
+}
+
+static struct ndisc_entry *create_entry(const struct ip6_addr *daddr)
+{
+	struct ndisc_entry *e = smalloc(sizeof(*e));
+	if (!e)
+		return NULL;
+
+	e->ip6 = *daddr;
+	e->state = NDISC_STATE_PROBING;
+	e->ts = microtime();
+	e->tries_left = NDISC_RETRIES;
+	mbufq_init(&e->q);
+	e->q_len = 0;
+	return e;
+}
+
+/* our address in the same scope as @addr */
+static const struct ip6_addr *ndisc_saddr(const struct ip6_addr *addr)
+{
+	if (ip6_addr_is_linklocal(addr))
+		return &netcfg6.addr_ll;
+	return &netcfg6.addr;
+}
+
+/* checksums a neighbor discovery message and sends it with hop limit 255 */
+static void ndisc_tx(struct mbuf *m, const struct ip6_addr *saddr,
+		     const struct ip6_addr *daddr, struct eth_addr dhost)
+{
+	struct icmp6_hdr *icmp6hdr = (struct icmp6_hdr *)mbuf_data(m);
+	uint16_t len = mbuf_length(m);
+	struct ip6_hdr *ip6hdr;
+
+	icmp6hdr->chksum = 0;
+	icmp6hdr->chksum = ipv6_udptcp_cksum(IPPROTO_ICMPV6, saddr, daddr,
+					     len, icmp6hdr);
+
+	ip6hdr = mbuf_push_hdr(m, *ip6hdr);
+	ip6hdr->vtc_flow = ip6_vtc_flow(0);
+	ip6hdr->payload_len = hton16(len);
+	ip6hdr->nexthdr = IPPROTO_ICMPV6;
+	ip6hdr->hop_limit = ND_HOP_LIMIT;
+	ip6hdr->saddr = *saddr;
+	ip6hdr->daddr = *daddr;
+
+	m->txflags |= OLFLAG_IPV6;
+	net_tx_eth_or_free(m, ETHTYPE_IPV6, dhost);
+}
+
+static void ndisc_send(uint8_t type, const struct ip6_addr *target,
+		       const struct ip6_addr *daddr, struct eth_addr dhost,
+		       uint32_t flags)
+{
+	struct mbuf *m;
+	struct nd_neigh_msg *msg;
+	struct nd_opt_lladdr *opt;
+
+	m = net_tx_alloc_mbuf();
+	if (unlikely(!m))
+		return;
+
+	msg = mbuf_put_hdr(m, *msg);
+	msg->hdr.type = type;
+	msg->hdr.code = 0;
+	msg->flags = flags;
+	msg->target = *target;
+
+	opt = mbuf_put_hdr(m, *opt);
+	opt->hdr.type = type == ND_NEIGHBOR_SOLICIT ?
+			ND_OPT_SOURCE_LLADDR : ND_OPT_TARGET_LLADDR;
+	opt->hdr.len = sizeof(*opt) / 8;
+	opt->addr = netcfg.mac;
+
+	/* a solicitation's source must match the scope of its target */
+	ndisc_tx(m, type == ND_NEIGHBOR_SOLICIT ? ndisc_saddr(target) : target,
+		 daddr, dhost);
+}
+
+/* multicasts a solicitation to the neighbor's solicited-node group */
+static void ndisc_solicit(const struct ip6_addr *target)
+{
+	struct ip6_addr group;
+	struct eth_addr dhost;
+
+	ip6_solicited_node(target, &group);
+	dhost.addr[0] = dhost.addr[1] = 0x33;
+	memcpy(&dhost.addr[2], &group.addr[12], 4);
+	ndisc_send(ND_NEIGHBOR_SOLICIT, target, &group, dhost, 0);
+}
+
+static void ndisc_age_entry(uint64_t now_us, struct ndisc_entry *e)
+{
+	/* check if this entry has timed out */
+	if (now_us - e->ts < ((e->state == NDISC_STATE_VALID) ?
+			      NDISC_REPROBE_TIME : NDISC_RETRY_TIME))
+		return;
+
+	switch (e->state) {
+	case NDISC_STATE_PROBING:
+	case NDISC_STATE_VALID_BUT_REPROBING:
+		if (e->tries_left == 0) {
+			delete_entry(e);
+			return;
+		}
+		e->tries_left--;
+		break;
+
+	case NDISC_STATE_VALID:
+		e->state = NDISC_STATE_VALID_BUT_REPROBING;
+		e->tries_left = NDISC_RETRIES;
+		break;
+
+	default:
+		panic("ndisc: invalid entry state %d", e->state);
+	}
+
+	ndisc_solicit(&e->ip6);
+	e->ts = microtime();
+}
+
+static void ndisc_worker(void *arg)
+{
+	struct ndisc_entry *e;
+	struct rcu_hlist_node *node, *tmp;
+	uint64_t now_us;
+	int i;
+
+	/* wake up each second and update the neighbor cache */
+	while (true) {
+		now_us = microtime();
+
+		for (i = 0; i < NDISC_TABLE_CAPACITY; i++) {
+			spin_lock_np(&ndisc_tbl[i].lock);
+			rcu_hlist_for_each_safe(&ndisc_tbl[i].head, node, tmp,
+						true) {
+				e = rcu_hlist_entry(node,
+						    struct ndisc_entry, link);
+				ndisc_age_entry(now_us, e);
+			}
+			spin_unlock_np(&ndisc_tbl[i].lock);
+		}
+
+		timer_sleep(ONE_SECOND);
+	}
+}
+
+/* records a neighbor's MAC address, creating an entry only if @create */
+static void ndisc_update(const struct ip6_addr *daddr, struct eth_addr dhost,
+			 bool create)
+{
+	struct mbufq q;
+	int idx = hash_ip6(daddr);
+	struct ndisc_entry *e, *newe;
+
+	mbufq_init(&q);
+
+	spin_lock_np(&ndisc_tbl[idx].lock);
+	e = lookup_entry(idx, daddr);
+	if (!e) {
+		if (!create) {
+			spin_unlock_np(&ndisc_tbl[idx].lock);
+			return;
+		}
+		e = create_entry(daddr);
+		if (unlikely(!e)) {
+			spin_unlock_np(&ndisc_tbl[idx].lock);
+			return;
+		}
+
+		insert_entry(e, idx);
+	} else if (e->state != NDISC_STATE_PROBING &&
+		   memcmp(&e->eth, &dhost, sizeof(dhost)) != 0) {
+		/* readers may be copying the old MAC, so replace the entry */
+		newe = create_entry(daddr);
+		if (unlikely(!newe)) {
+			spin_unlock_np(&ndisc_tbl[idx].lock);
+			return;
+		}
+		newe->eth = dhost;
+		newe->state = NDISC_STATE_VALID;
+		insert_entry(newe, idx);
+		delete_entry(e);
+		spin_unlock_np(&ndisc_tbl[idx].lock);
+		return;
+	}
+	e->eth = dhost;
+	e->ts = microtime();
+	store_release(&e->state, NDISC_STATE_VALID);
+	mbufq_merge_to_tail(&q, &e->q);
+	e->q_len = 0;
+	spin_unlock_np(&ndisc_tbl[idx].lock);
+
+	/* drain mbufs waiting for an advertisement */
+	while (!mbufq_empty(&q)) {
+		struct mbuf *m = mbufq_pop_head(&q);
+		net_tx_eth_or_free(m, ETHTYPE_IPV6, dhost);
+	}
+}
+
+/*
+ * Pulls a neighbor solicitation or advertisement, copying out its target
+ * address, and finds its link-layer address option of type @opt_type. Returns
+ * false if it isn't valid.
+ */
+static bool ndisc_parse(struct mbuf *m, const struct ip6_hdr *ip6hdr,
+			uint16_t len, uint8_t opt_type, struct ip6_addr *target,
+			struct eth_addr *lladdr, bool *has_lladdr)
+{
+	const struct nd_neigh_msg *msg;
+	const struct nd_opt_hdr *opt;
+	size_t opt_len;
+
+	/* routers don't forward these, so the hop limit is intact */
+	if (ip6hdr->hop_limit != ND_HOP_LIMIT || len < sizeof(*msg))
+		return false;
+	msg = mbuf_pull_hdr_or_null(m, *msg);
+	if (!msg || msg->hdr.code != 0)
+		return false;
+	/* the message is packed, so the address may be unaligned */
+	memcpy(target, &msg->target, sizeof(*target));
+	if (ip6_addr_is_multicast(target))
+		return false;
+
+	*has_lladdr = false;
+	while (mbuf_length(m) > 0) {
+		opt = mbuf_pull_hdr_or_null(m, *opt);
+		if (!opt || opt->len == 0)
+			return false;
+		opt_len = opt->len * 8 - sizeof(*opt);
+		if (mbuf_length(m) < opt_len)
+			return false;
+		if (opt->type == opt_type && opt_len >= sizeof(*lladdr)) {
+			memcpy(lladdr, mbuf_data(m), sizeof(*lladdr));
+			*has_lladdr = true;
+		}
+		mbuf_pull(m, opt_len);
+	}
+
+	return !*has_lladdr || !eth_addr_is_multicast(lladdr);
+}
+
+/**
+ * ndisc_rx_solicit - receives a neighbor solicitation
+ * @m: the mbuf, starting at the ICMPv6 header
+ * @ip6hdr: its IPv6 header
+ * @len: the length of the ICMPv6 message
+ *
+ * Learns the sender's MAC address and advertises ours if we're the target.
+ * Takes ownership of @m.
+ */
+void ndisc_rx_solicit(struct mbuf *m, const struct ip6_hdr *ip6hdr,
+		      uint16_t len)
+{
+	struct ip6_addr target, saddr = ip6hdr->saddr;
+	struct eth_addr lladdr;
+	bool has_lladdr;
+	uint32_t flags;
+
+	if (!ndisc_parse(m, ip6hdr, len, ND_OPT_SOURCE_LLADDR, &target,
+			 &lladdr, &has_lladdr) ||
+	    !net_ip6_is_local(&target))
+		goto out;
+
+	/* duplicate address detection (from ::) gets a multicast reply */
+	flags = ND_NA_FLAG_OVERRIDE;
+	if (ip6_addr_is_zero(&saddr)) {
+		if (has_lladdr)
+			goto out;
+		saddr = ip6_addr_all_nodes;
+		lladdr.addr[0] = lladdr.addr[1] = 0x33;
+		memset(&lladdr.addr[2], 0, 3);
+		lladdr.addr[5] = 0x01;
+	} else if (has_lladdr) {
+		flags |= ND_NA_FLAG_SOLICITED;
+		ndisc_update(&saddr, lladdr, true);
+	} else {
+		/* a unicast probe, so look up the sender like any neighbor */
+		flags |= ND_NA_FLAG_SOLICITED;
+		if (ndisc_lookup(&saddr, &lladdr, NULL))
+			goto out;
+	}
+
+	ndisc_send(ND_NEIGHBOR_ADVERT, &target, &saddr, lladdr, flags);
+
+out:
+	mbuf_free(m);
+}
+
+/**
+ * ndisc_rx_advert - receives a neighbor advertisement
+ * @m: the mbuf, starting at the ICMPv6 header
+ * @ip6hdr: its IPv6 header
+ * @len: the length of the ICMPv6 message
+ *
+ * Updates the neighbor cache. Takes ownership of @m.
+ */
+void ndisc_rx_advert(struct mbuf *m, const struct ip6_hdr *ip6hdr,
+		     uint16_t len)
+{
+	struct ip6_addr target;
+	struct eth_addr lladdr;
+	bool has_lladdr;
+
+	if (!ndisc_parse(m, ip6hdr, len, ND_OPT_TARGET_LLADDR, &target,
+			 &lladdr, &has_lladdr) || !has_lladdr)
+		goto out;
+
+	/* unsolicited advertisements only refresh neighbors we know about */
+	ndisc_update(&target, lladdr, false);
+
+out:
+	mbuf_free(m);
+}
+
+/**
+ * ndisc_lookup - retrieve a MAC address for a given IPv6 address
+ * @daddr: the target IPv6 address (must be on-link)
+ * @dhost_out: A buffer to store the MAC address
+ * @m: the mbuf requiring the lookup (can be NULL, otherwise must start with
+ * a network header (L3))
+ *
+ * Returns 0 and writes to @dhost_out if successful. Otherwise returns:
+ * -ENOMEM: If out of memory
+ * -EINPROGRESS: If the solicitation is still resolving. Takes ownership of @m.
+ */
+int ndisc_lookup(const struct ip6_addr *daddr, struct eth_addr *dhost_out,
+		 struct mbuf *m)
+{
+	struct ndisc_entry *e, *newe = NULL;
+	struct ndisc_last_hit *last;
+	int idx = hash_ip6(daddr);
+	int gen;
+	bool drop = false;
+
+	/* hottest path: @daddr was this kthread's last hit */
+	rcu_read_lock();
+	last = &perthread_get(ndisc_last);
+	gen = atomic_read(&arp_gen);
+	if (likely(last->gen == gen && ip6_addr_equal(&last->ip6, daddr))) {
+		*dhost_out = last->eth;
+		rcu_read_unlock();
+		return 0;
+	}
+
+	/* hot-path: @daddr hits in the neighbor cache */
+	e = lookup_entry(idx, daddr);
+	if (likely(e && load_acquire(&e->state) != NDISC_STATE_PROBING)) {
+		*dhost_out = e->eth;
+		last->ip6 = *daddr;
+		last->eth = e->eth;
+		last->gen = gen;
+		rcu_read_unlock();
+		return 0;
+	}
+	rcu_read_unlock();
+
+	/* cold-path: solicit an advertisement */
+	if (!e) {
+		ndisc_solicit(daddr);
+		newe = create_entry(daddr);
+		if (!newe)
+			return -ENOMEM;
+	}
+
+	/* check again for @daddr in the cache; we own @m going forward */
+	spin_lock_np(&ndisc_tbl[idx].lock);
+	e = lookup_entry(idx, daddr);
+	if (e) {
+		/* entry already exists */
+		if (newe)
+			sfree(newe);
+		if (e->state != NDISC_STATE_PROBING) {
+			*dhost_out = e->eth;
+			spin_unlock_np(&ndisc_tbl[idx].lock);
+			return 0;
+		}
+	} else if (newe) {
+		/* insert new entry */
+		e = newe;
+		insert_entry(e, idx);
+	}
+
+	/* enqueue the mbuf for later transmission, if there's room */
+	if (m && e) {
+		if (likely(e->q_len < NDISC_MAX_PENDING)) {
+			mbufq_push_tail(&e->q, m);
+			e->q_len++;
+		} else {
+			drop = true;
+		}
+	}
+	spin_unlock_np(&ndisc_tbl[idx].lock);
+
+	if (m && drop) {
+		STAT(NDISC_PENDING_DROPS)++;
+		mbuf_free(m);
+	}
+
+	/* if the entry was removed, assume unreachable and free */
+	if (m && !e)
+		mbuf_free(m);
+
+	return -EINPROGRESS;
+}
+
+/**
+ * ndisc_init - initializes the neighbor discovery subsystem
+ *
+ * Always returns 0 for success.
+ */
+int ndisc_init(void)
+{
+	int i;
+
+	for (i = 0; i < NDISC_TABLE_CAPACITY; i++) {
+		spin_lock_init(&ndisc_tbl[i].lock);
+		rcu_hlist_init_head(&ndisc_tbl[i].head);
+	}
+	atomic_write(&ndisc_worker_started, 0);
+
+	return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * route.c - IPv4 routing with longest-prefix match
+ *
+ * The routing table is a multibit trie with a fixed stride of eight bits, so
+ * a lookup takes at most four dependent loads and usually one or two. Routes
+ * are leaf-pushed: every slot holds either the next hop of the longest prefix
+ * covering it or a link to a child node, and no lookup ever backtracks. The
+ * table is built once at startup from the local subnet, the default gateway,
+ * and any "host_route" config entries; it is read-only afterwards.
+ *
+ * IPv6 has only an on-link prefix and a default router, so it needs no table.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+
+#include "defs.h"
+
+#define ROUTE_STRIDE		8
+#define ROUTE_FANOUT		(1 << ROUTE_STRIDE)
+/* set in a slot that links to a child node instead of a next hop */
+#define ROUTE_CHILD		(1u << 31)
+
+/* the two routes that are always present */
+#define ROUTE_NR_IMPLICIT	2
+
+int route_count;
+struct cfg_route route_entries[MAX_ROUTES];
+
+struct route_node {
+	uint32_t	slots[ROUTE_FANOUT];
+};
+
+/*
+ * Slot values index @route_nexthops, and slot 0 means there is no route. A
+ * next hop of 0 means the destination is directly reachable (on-link).
+ */
+static struct route_node *route_nodes;
+static unsigned int route_nr_nodes;
+static uint32_t route_nexthops[MAX_ROUTES + ROUTE_NR_IMPLICIT + 1];
+
+static unsigned int route_slot(uint32_t addr, int level)
+{
+	return (addr >> (32 - ROUTE_STRIDE * (level + 1))) & (ROUTE_FANOUT - 1);
+}
+
+static uint32_t route_new_node(uint32_t fill)
+{
+	struct route_node *n = &route_nodes[route_nr_nodes];
+	int i;
+
+	for (i = 0; i < ROUTE_FANOUT; i++)
+		n->slots[i] = fill;
+	return route_nr_nodes++;
+}
+
+/*
+ * Routes must be inserted from the shortest prefix to the longest, so a
+ * prefix never covers a child node and can overwrite its slots outright.
+ */
+static void route_insert(uint32_t prefix, int len, uint32_t nh)
+{
+	uint32_t *slot, node = 0;
+	unsigned int i, start, span;
+	int level;
+
+	for (level = 0; len > ROUTE_STRIDE * (level + 1); level++) {
+		slot = &route_nodes[node].slots[route_slot(prefix, level)];
+		if (!(*slot & ROUTE_CHILD))
+			*slot = route_new_node(*slot) | ROUTE_CHILD;
+		node = *slot & ~ROUTE_CHILD;
+	}
+
+	/* the prefix ends in this node, so it covers a run of slots */
+	span = 1 << (ROUTE_STRIDE * (level + 1) - len);
+	start = route_slot(prefix, level) & ~(span - 1);
+	for (i = start; i < start + span; i++) {
+		BUG_ON(route_nodes[node].slots[i] & ROUTE_CHILD);
+		route_nodes[node].slots[i] = nh;
+	}
+}
+
+static uint32_t route_mask(int len)
+{
+	return len ? ~0u << (32 - len) : 0;
+}
+
+/**
+ * net_route_lookup - finds the next hop toward a destination
+ * @daddr: the destination IP address (in native byte order)
+ *
+ * Returns the IP address to resolve with ARP: @daddr itself if it is on-link,
+ * otherwise the gateway of the longest matching route.
+ */
+uint32_t net_route_lookup(uint32_t daddr)
+{
+	uint32_t v;
+	int level = 0;
+
+	v = route_nodes[0].slots[route_slot(daddr, 0)];
+	while (v & ROUTE_CHILD) {
+		level++;
+		v = route_nodes[v & ~ROUTE_CHILD].slots[route_slot(daddr, level)];
+	}
+
+	return route_nexthops[v] ? route_nexthops[v] : daddr;
+}
+
+/**
+ * net_route6_lookup - finds the next hop toward an IPv6 destination
+ * @daddr: the destination address
+ * @nexthop: stores the address to resolve with neighbor discovery
+ *
+ * Link-local destinations and those within the prefix of our address are
+ * on-link, and everything else goes through the default router.
+ *
+ * Returns 0 if successful, or -EHOSTUNREACH if there is no route.
+ */
+int net_route6_lookup(const struct ip6_addr *daddr, struct ip6_addr *nexthop)
+{
+	if (ip6_addr_is_linklocal(daddr) ||
+	    ip6_prefix_equal(daddr, &netcfg6.addr, netcfg6.prefix_len)) {
+		*nexthop = *daddr;
+		return 0;
+	}
+
+	if (unlikely(ip6_addr_is_zero(&netcfg6.gateway)))
+		return -EHOSTUNREACH;
+	*nexthop = netcfg6.gateway;
+	return 0;
+}
+
+/**
+ * route_init - builds the routing table
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int route_init(void)
+{
+	struct cfg_route routes[MAX_ROUTES + ROUTE_NR_IMPLICIT];
+	uint32_t subnet = netcfg.addr & netcfg.netmask;
+	char buf[IP_ADDR_STR_LEN];
+	unsigned int max_nodes;
+	int i, nr = 0;
+
+	/* the default route and the local subnet (absent on IPv6-only hosts) */
+	routes[nr++] = (struct cfg_route){ 0, 0, netcfg.gateway };
+	if (netcfg.netmask) {
+		routes[nr++] = (struct cfg_route){ subnet,
+			32 - __builtin_ctz(netcfg.netmask), 0 };
+	}
+
+	for (i = 0; i < route_count; i++) {
+		const struct cfg_route *r = &route_entries[i];
+
+		if (r->gateway &&
+		    (r->gateway & netcfg.netmask) != subnet) {
+			log_err("route: gateway %s is not on-link",
+				ip_addr_to_str(r->gateway, buf));
+			return -EINVAL;
+		}
+		routes[nr++] = *r;
+	}
+
+	/* stable, so a config entry overrides an implicit route of equal length */
+	for (i = 1; i < nr; i++) {
+		struct cfg_route tmp = routes[i];
+		int j = i;
+
+		while (j > 0 && routes[j - 1].len > tmp.len) {
+			routes[j] = routes[j - 1];
+			j--;
+		}
+		routes[j] = tmp;
+	}
+
+	/* a prefix longer than a stride needs a node at each deeper level */
+	max_nodes = 1;
+	for (i = 0; i < nr; i++)
+		max_nodes += (routes[i].len - 1) / ROUTE_STRIDE;
+
+	route_nodes = malloc(sizeof(*route_nodes) * max_nodes);
+	if (!route_nodes)
+		return -ENOMEM;
+	route_new_node(0);
+
+	for (i = 0; i < nr; i++) {
+		route_nexthops[i + 1] = routes[i].gateway;
+		route_insert(routes[i].prefix & route_mask(routes[i].len),
+			     routes[i].len, i + 1);
+	}
+
+	log_info("route: %d routes in %u trie nodes (%lu KB)", nr,
+		 route_nr_nodes, route_nr_nodes * sizeof(*route_nodes) / 1024);
+	return 0;
+}
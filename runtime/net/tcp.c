@@ -7,6 +7,9 @@
 #include <base/stddef.h>
 #include <base/hash.h>
 #include <base/log.h>
+#include <base/slab.h>
+#include <base/tcache.h>
+#include <runtime/fileio.h>
 #include <runtime/smalloc.h>
 #include <runtime/thread.h>
 #include <runtime/tcp.h>
@@ -14,16 +17,77 @@
 
 #include "tcp.h"
 
-/* protects @tcp_conns */
-static DEFINE_SPINLOCK(tcp_lock);
-/* a list of all TCP connections */
-static LIST_HEAD(tcp_conns);
+/* the minimum retransmission timeout (us), set by the config file */
+unsigned int tcp_rto_min = TCP_RTO_MIN_DEFAULT;
+/* the default delay (us) before acknowledging data, set by the config file */
+unsigned int tcp_ack_timeout = TCP_ACK_TIMEOUT_DEFAULT;
+/* the default buffer sizes (bytes) for new connections, set by the config */
+unsigned int tcp_rx_buf_default = TCP_DEFAULT_RX_BUF;
+unsigned int tcp_tx_buf_default = TCP_DEFAULT_TX_BUF;
+/* the maximum slack (us) added to timer deadlines, set by the config file */
+unsigned int tcp_timer_slack = TCP_TIMER_SLACK_DEFAULT;
+/* the half-open connections allowed before using SYN cookies, set by config */
+unsigned int tcp_syn_backlog = TCP_SYN_BACKLOG_DEFAULT;
+/* spread data segments over the RTT instead of sending in bursts */
+bool tcp_pacing;
+/* the MSS for netcfg.mtu (see tcp_init()) */
+unsigned int tcp_mss;
+
+/* connections get their own cache-aligned, colored slab (see tcp_init()) */
+static struct slab tcp_conn_slab;
+static struct tcache *tcp_conn_tcache;
+static DEFINE_PERTHREAD(struct tcache_perthread, tcp_conn_pt);
 
 static void tcp_retransmit(void *arg);
 
+/*
+ * Rounds a deadline up to a power-of-two boundary no coarser than 1/8th of the
+ * remaining time (and at most @tcp_timer_slack), so that timeouts from many
+ * connections land in the same timer wheel slot and expire as a batch.
+ */
+static uint64_t tcp_timer_slack_deadline(uint64_t deadline, uint64_t now)
+{
+	uint64_t slack;
+
+	if (deadline <= now)
+		return deadline;
+
+	slack = min((deadline - now) >> TCP_TIMER_SLACK_SHIFT,
+		    (uint64_t)tcp_timer_slack);
+	if (slack < 2)
+		return deadline;
+
+	slack = 1UL << (63 - __builtin_clzl(slack));
+	return align_up(deadline, slack);
+}
+
+/* arms the connection's timer if it isn't already set to fire by @deadline */
+static void tcp_timer_arm(tcpconn_t *c, uint64_t deadline)
+{
+	assert_spin_lock_held(&c->lock);
+
+	if (unlikely(c->timer_dead) || c->timer_deadline <= deadline)
+		return;
+
+	/*
+	 * Only move the timer earlier. A later deadline is handled lazily:
+	 * the timer fires early, finds nothing due, and rearms itself. If the
+	 * cancel fails, the handler is already running and will rearm.
+	 */
+	if (c->timer_deadline != UINT64_MAX && !timer_cancel(&c->timer))
+		return;
+
+	c->timer_deadline = deadline;
+	timer_start(&c->timer, deadline);
+}
+
+/**
+ * tcp_timer_update - arms the timer for the connection's next timeout
+ * @c: the TCP connection (must hold @c->lock)
+ */
 void tcp_timer_update(tcpconn_t *c)
 {
-	uint64_t next_timeout = -1L;
+	uint64_t next_timeout = -1L, now = microtime();
 	struct mbuf *m;
 	assert_spin_lock_held(&c->lock);
 
@@ -31,18 +95,28 @@ void tcp_timer_update(tcpconn_t *c)
 		next_timeout = c->time_wait_ts + TCP_TIME_WAIT_TIMEOUT;
 
 	if (c->ack_delayed)
-		next_timeout = min(next_timeout, c->ack_ts + TCP_ACK_TIMEOUT);
+		next_timeout = min(next_timeout, c->ack_ts + c->ack_timeout);
 
 	if (!c->tx_exclusive) {
 		m = list_top(&c->txq, struct mbuf, link);
 		if (m)
-			next_timeout = min(next_timeout, m->timestamp + TCP_RETRANSMIT_TIMEOUT);
+			next_timeout = min(next_timeout, m->timestamp + c->rto);
+	}
+
+	if (!tcp_ooo_empty(c))
+		next_timeout = min(next_timeout, now + TCP_OOQ_ACK_TIMEOUT);
+
+	if (c->cork != TCP_CORK_OFF && !c->tx_exclusive && c->tx_pending) {
+		next_timeout = min(next_timeout,
+				   c->tx_pending->timestamp + TCP_CORK_TIMEOUT);
 	}
 
-	if (!list_empty(&c->rxq_ooo))
-		next_timeout = min(next_timeout, microtime() + TCP_OOQ_ACK_TIMEOUT);
+	if (next_timeout != -1L)
+		tcp_timer_arm(c, tcp_timer_slack_deadline(next_timeout, now));
 
-	store_release(&c->next_timeout, next_timeout);
+	/* paced segments can't wait for slack */
+	if (!mbufq_empty(&c->pace_q))
+		tcp_timer_arm(c, div_up(c->pace_next_ns, 1000));
 }
 
 /* check for timeouts in a TCP connection */
@@ -64,22 +138,35 @@ static void tcp_handle_timeouts(tcpconn_t *c, uint64_t now)
 		tcp_conn_put(c);
 		return;
 	}
-	if (c->ack_delayed && now - c->ack_ts >= TCP_ACK_TIMEOUT) {
+	tcp_tx_pace_release(c, now);
+	if (c->ack_delayed && now - c->ack_ts >= c->ack_timeout) {
 		log_debug("tcp: %p delayed ack timeout", c);
 		c->ack_delayed = false;
+		c->ack_segs = 0;
+		/* the app hasn't read the data yet, so waiting didn't pay off */
+		if (c->ack_policy == TCP_ACK_ADAPTIVE && !list_empty(&c->rxq))
+			c->ack_quick = true;
 		do_ack = true;
 	}
 	if (!c->tx_exclusive && !list_empty(&c->txq)) {
 		struct mbuf *m = list_top(&c->txq, struct mbuf, link);
-		if (now - m->timestamp >= TCP_RETRANSMIT_TIMEOUT) {
+		if (now - m->timestamp >= c->rto) {
 			log_debug("tcp: %p retransmission timeout", c);
+			c->in_recovery = false;
+			c->cc->timeout(c);
 			/* It is safe to take a reference, since state != closed */
 			tcp_conn_get(c);
 			do_retransmit = true;
 		}
 	}
 
-	do_ack |= !list_empty(&c->rxq_ooo);
+	do_ack |= !tcp_ooo_empty(c);
+
+	if (c->cork != TCP_CORK_OFF && !c->tx_exclusive && c->tx_pending &&
+	    now - c->tx_pending->timestamp >= TCP_CORK_TIMEOUT) {
+		log_debug("tcp: %p cork timeout", c);
+		tcp_tx_flush_pending(c);
+	}
 
 	tcp_timer_update(c);
 
@@ -91,24 +178,38 @@ static void tcp_handle_timeouts(tcpconn_t *c, uint64_t now)
 		thread_spawn(tcp_retransmit, c);
 }
 
-/* a periodic background thread that handles timeout events */
-static void tcp_worker(void *arg)
+/* the timer handler, runs in the timer softirq with preemption disabled */
+static void tcp_timer_fire(unsigned long arg)
 {
-	tcpconn_t *c;
-	uint64_t now;
+	tcpconn_t *c = (tcpconn_t *)arg;
 
-	while (true) {
-		now = microtime();
+	spin_lock_np(&c->lock);
+	c->timer_deadline = UINT64_MAX;
+	if (unlikely(c->timer_dead)) {
+		spin_unlock_np(&c->lock);
+		return;
+	}
+	spin_unlock_np(&c->lock);
 
-		spin_lock_np(&tcp_lock);
-		list_for_each(&tcp_conns, c, global_link) {
-			if (load_acquire(&c->next_timeout) <= now)
-				tcp_handle_timeouts(c, now);
-		}
-		spin_unlock_np(&tcp_lock);
+	tcp_handle_timeouts(c, microtime());
+}
+
+/* updates the RTT estimate and the RTO with a new sample (RFC 6298) */
+static void tcp_rtt_sample(tcpconn_t *c, uint32_t rtt)
+{
+	uint32_t err;
 
-		timer_sleep(10 * ONE_MS);
+	if (c->srtt == 0) {
+		c->srtt = max(rtt, 1U);
+		c->rttvar = rtt / 2;
+	} else {
+		err = rtt > c->srtt ? rtt - c->srtt : c->srtt - rtt;
+		c->rttvar = c->rttvar - c->rttvar / 4 + err / 4;
+		c->srtt = c->srtt - c->srtt / 8 + rtt / 8;
 	}
+
+	c->rto = c->srtt + max(4 * c->rttvar, 1U);
+	c->rto = min(max(c->rto, tcp_rto_min), TCP_RTO_MAX);
 }
 
 /**
@@ -121,7 +222,7 @@ static void tcp_worker(void *arg)
  */
 void tcp_conn_ack(tcpconn_t *c, struct list_head *freeq)
 {
-	struct mbuf *m;
+	struct mbuf *m, *last = NULL;
 
 	assert_spin_lock_held(&c->lock);
 
@@ -139,6 +240,42 @@ void tcp_conn_ack(tcpconn_t *c, struct list_head *freeq)
 
 		list_pop(&c->txq, struct mbuf, link);
 		list_add_tail(freeq, &m->link);
+		last = m;
+	}
+
+	/* sample the RTT, skipping retransmitted segments (Karn's algorithm) */
+	if (last && wraps_gt(last->seg_end, c->retransmit_end))
+		tcp_rtt_sample(c, microtime() - last->timestamp);
+}
+
+/**
+ * tcp_conn_sack - marks selectively acknowledged packets in the TX queue
+ * @c: the TCP connection to update
+ * @blks: the SACK blocks received from the peer
+ * @nr: the number of blocks in @blks
+ *
+ * WARNING: the caller must hold @c->lock and the TX queue must not be owned
+ * by a writer (@c->tx_exclusive).
+ */
+void tcp_conn_sack(tcpconn_t *c, const struct tcp_sack_block *blks,
+		   unsigned int nr)
+{
+	struct mbuf *m;
+	unsigned int i;
+
+	assert_spin_lock_held(&c->lock);
+	assert(!c->tx_exclusive);
+
+	list_for_each(&c->txq, m, link) {
+		if (m->sacked)
+			continue;
+		for (i = 0; i < nr; i++) {
+			if (wraps_lte(blks[i].start, m->seg_seq) &&
+			    wraps_lte(m->seg_end, blks[i].end)) {
+				m->sacked = true;
+				break;
+			}
+		}
 	}
 }
 
@@ -159,6 +296,13 @@ void tcp_conn_set_state(tcpconn_t *c, int new_state)
 	if (c->pcb.state < TCP_STATE_ESTABLISHED &&
 	    new_state >= TCP_STATE_ESTABLISHED) {
 		waitq_release(&c->tx_wq);
+		poll_set(&c->poll, POLL_OUT);
+	}
+
+	/* the handshake finished (or failed), so it's no longer half-open */
+	if (c->half_open && new_state != TCP_STATE_SYN_RECEIVED) {
+		c->half_open = false;
+		atomic_dec(&tcp_half_open);
 	}
 
 	tcp_debug_state_change(c, c->pcb.state, new_state);
@@ -196,7 +340,9 @@ tcpconn_t *tcp_conn_alloc(void)
 {
 	tcpconn_t *c;
 
-	c = smalloc(sizeof(*c));
+	preempt_disable();
+	c = tcache_alloc(&perthread_get(tcp_conn_pt));
+	preempt_enable();
 	if (!c)
 		return NULL;
 
@@ -205,13 +351,24 @@ tcpconn_t *tcp_conn_alloc(void)
 	spin_lock_init(&c->lock);
 	kref_init(&c->ref);
 	c->err = 0;
+	c->half_open = false;
+	c->app_closed = false;
+	c->tw_replaced = false;
+	c->nonblock = false;
+	c->busy_poll_us = 0;
+	poll_trigger_init(&c->poll);
 
 	/* ingress fields */
 	c->rx_closed = false;
 	c->rx_exclusive = false;
 	waitq_init(&c->rx_wq);
-	list_head_init(&c->rxq_ooo);
+	memset(&c->rxq_ooo, 0, sizeof(c->rxq_ooo));
 	list_head_init(&c->rxq);
+	c->sack_ok = false;
+	c->rx_sack_nr = 0;
+	c->rx_k = NULL;
+	c->rx_hash = 0;
+	c->rx_steer_tsc = 0;
 
 	/* egress fields */
 	c->tx_closed = false;
@@ -220,23 +377,57 @@ tcpconn_t *tcp_conn_alloc(void)
 	c->tx_last_ack = 0;
 	c->tx_last_win = 0;
 	c->tx_pending = NULL;
+	c->cork = TCP_CORK_OFF;
+	c->cork_bytes = UINT32_MAX;
+	c->xform = NULL;
+	c->xform_arg = NULL;
 	list_head_init(&c->txq);
 	c->do_fast_retransmit = false;
+	c->tx_sack_nr = 0;
+	mbufq_init(&c->pace_q);
+	c->pace_next_ns = 0;
 
 	/* timeouts */
-	c->next_timeout = -1L;
+	timer_init(&c->timer, tcp_timer_fire, (unsigned long)c);
+	c->timer_deadline = UINT64_MAX;
+	c->timer_dead = false;
 	c->ack_delayed = false;
 	c->rcv_wnd_full = false;
 	c->ack_ts = 0;
 	c->time_wait_ts = 0;
 	c->rep_acks = 0;
+	c->ack_policy = TCP_ACK_DELAYED;
+	c->ack_quick = false;
+	c->ack_every = 0;
+	c->ack_segs = 0;
+	c->ack_timeout = tcp_ack_timeout;
 
 	/* initialize egress half of PCB */
 	c->pcb.state = TCP_STATE_CLOSED;
 	c->pcb.iss = rand_crc32c(0x12345678); /* TODO: not enough */
 	c->pcb.snd_nxt = c->pcb.iss;
 	c->pcb.snd_una = c->pcb.iss;
-	c->pcb.rcv_wnd = TCP_WIN;
+	c->rcv_buf = tcp_rx_buf_default;
+	c->snd_buf = tcp_tx_buf_default;
+	c->pcb.rcv_wnd = c->rcv_buf;
+
+	/* window scaling (RFC 7323), disabled if the peer doesn't support it */
+	c->rcv_wscale = tcp_wscale_for_buf(c->rcv_buf);
+	c->snd_wscale = 0;
+	c->wscale_ok = false;
+
+	/* lowered once the peer's MSS option is known */
+	c->mss = tcp_mss;
+
+	/* congestion control */
+	tcp_cc_init_conn(c);
+
+	/* RTT estimation */
+	c->srtt = 0;
+	c->rttvar = 0;
+	c->rto = max(TCP_RTO_INIT, tcp_rto_min);
+	c->retransmit_end = c->pcb.iss;
+	c->retransmits = 0;
 
 	return c;
 }
@@ -254,10 +445,10 @@ int tcp_conn_attach(tcpconn_t *c, struct netaddr laddr, struct netaddr raddr)
 {
 	int ret;
 
-	if (laddr.ip == 0)
-		 laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	ret = net_bind_laddr(&laddr, &raddr);
+	if (ret)
+		return ret;
+	c->mss = min(c->mss, tcp_mss_for(&raddr));
 
 	trans_init_5tuple(&c->e, IPPROTO_TCP, &tcp_conn_ops, laddr, raddr);
 	if (laddr.port == 0)
@@ -267,34 +458,50 @@ int tcp_conn_attach(tcpconn_t *c, struct netaddr laddr, struct netaddr raddr)
 	if (ret)
 		return ret;
 
-	static bool worker_running;
-	bool start_worker = false;
-	spin_lock_np(&tcp_lock);
-	if (unlikely(!worker_running))
-		worker_running = start_worker = true;
-	list_add_tail(&tcp_conns, &c->global_link);
-	spin_unlock_np(&tcp_lock);
-
-	if (start_worker)
-		BUG_ON(thread_spawn(tcp_worker, NULL));
-
 	return 0;
 }
 
+/**
+ * tcp_conn_free - frees a TCP connection struct
+ * @c: the connection, which must not be attached or referenced anymore
+ */
+void tcp_conn_free(tcpconn_t *c)
+{
+	preempt_disable();
+	tcache_free(&perthread_get(tcp_conn_pt), c);
+	preempt_enable();
+}
+
 static void tcp_conn_release(struct rcu_head *h)
 {
 	tcpconn_t *c = container_of(h, tcpconn_t, e.rcu);
 
-	spin_lock_np(&tcp_lock);
-	list_del_from(&tcp_conns, &c->global_link);
-	spin_unlock_np(&tcp_lock);
+	/*
+	 * A timer popped but not yet finished runs in an RCU read-side
+	 * section (see timer_softirq()), so wait one more grace period for it.
+	 */
+	spin_lock_np(&c->lock);
+	c->timer_dead = true;
+	if (c->timer_deadline != UINT64_MAX && !timer_cancel(&c->timer)) {
+		spin_unlock_np(&c->lock);
+		rcu_free(&c->e.rcu, tcp_conn_release);
+		return;
+	}
+	spin_unlock_np(&c->lock);
+
+	/* destroyed before the handshake finished (e.g. by tcp_qclose()) */
+	if (c->half_open)
+		atomic_dec(&tcp_half_open);
 
 	if (c->tx_pending)
 		mbuf_free(c->tx_pending);
-	mbuf_list_free(&c->rxq_ooo);
+	/* drop the references held for segments that were never sent */
+	while (!mbufq_empty(&c->pace_q))
+		mbuf_free(mbufq_pop_head(&c->pace_q));
+	tcp_ooo_free(c);
 	mbuf_list_free(&c->rxq);
 	mbuf_list_free(&c->txq);
-	sfree(c);
+	tcp_conn_free(c);
 }
 
 /**
@@ -303,7 +510,8 @@ static void tcp_conn_release(struct rcu_head *h)
  */
 void tcp_conn_destroy(tcpconn_t *c)
 {
-	trans_table_remove(&c->e);
+	if (!c->tw_replaced)
+		trans_table_remove(&c->e);
 	rcu_free(&c->e.rcu, tcp_conn_release);
 }
 
@@ -323,42 +531,76 @@ void tcp_conn_release_ref(struct kref *r)
  * Support for accepting new connections
  */
 
-struct tcpqueue {
-	struct trans_entry	e;
+/*
+ * A listen queue keeps pending connections in one or more shards. With a
+ * sharded queue (see tcp_listen_sharded()), each kthread queues the SYNs it
+ * receives in its own shard, and accepting threads check their local shard
+ * first, so the connection tends to stay on the core the NIC steered it to.
+ */
+struct tcpqueue_shard {
 	spinlock_t		l;
-	waitq_t			wq;
 	struct list_head	conns;
 	int			backlog;
+} __aligned(CACHE_LINE_SIZE);
+
+struct tcpqueue {
+	struct trans_entry	e;
+	spinlock_t		l;	/* protects @wq and @nr_idle */
+	waitq_t			wq;
+	unsigned int		nr_idle; /* accepting threads that found no conn */
 	bool			shutdown;
+	bool			nonblock; /* return -EAGAIN instead of blocking */
+	poll_trigger_t		poll; /* readiness notification, see poll.h */
+	unsigned int		nr_shards;
+	struct tcpqueue_shard	shards[];
 };
 
+static inline struct tcpqueue_shard *tcp_queue_local_shard(tcpqueue_t *q)
+{
+	if (q->nr_shards == 1)
+		return &q->shards[0];
+	return &q->shards[myk()->idx % q->nr_shards];
+}
+
 static void tcp_queue_recv(struct trans_entry *e, struct mbuf *m)
 {
 	tcpqueue_t *q = container_of(e, tcpqueue_t, e);
+	struct tcpqueue_shard *s = tcp_queue_local_shard(q);
 	tcpconn_t *c;
 	thread_t *th;
 
 	/* make sure the connection queue isn't full */
-	spin_lock_np(&q->l);
-	if (unlikely(q->backlog == 0 || q->shutdown)) {
-		spin_unlock_np(&q->l);
+	spin_lock_np(&s->l);
+	if (unlikely(s->backlog == 0 || ACCESS_ONCE(q->shutdown))) {
+		spin_unlock_np(&s->l);
 		goto done;
 	}
-	q->backlog--;
-	spin_unlock_np(&q->l);
+	s->backlog--;
+	spin_unlock_np(&s->l);
 
 	/* create a new connection */
 	c = tcp_rx_listener(e->laddr, m);
 	if (!c) {
-		spin_lock_np(&q->l);
-		q->backlog++;
-		spin_unlock_np(&q->l);
+		spin_lock_np(&s->l);
+		s->backlog++;
+		spin_unlock_np(&s->l);
 		goto done;
 	}
 
-	/* wake a thread to accept the connection */
+	spin_lock_np(&s->l);
+	list_add_tail(&s->conns, &c->queue_link);
+	spin_unlock_np(&s->l);
+	poll_set(&q->poll, POLL_IN);
+
+	/*
+	 * Wake a thread to accept the connection. An accepting thread counts
+	 * itself in @nr_idle before it scans the shards, and the shard lock
+	 * orders the scan against the insert, so either it finds the conn or
+	 * it's visible here.
+	 */
+	if (!ACCESS_ONCE(q->nr_idle))
+		goto done;
 	spin_lock_np(&q->l);
-	list_add_tail(&q->conns, &c->queue_link);
 	th = waitq_signal(&q->wq, &q->l);
 	spin_unlock_np(&q->l);
 	waitq_signal_finish(th);
@@ -372,38 +614,37 @@ const struct trans_ops tcp_queue_ops = {
 	.recv = tcp_queue_recv,
 };
 
-/**
- * tcp_listen - creates a TCP listening queue for a local address
- * @laddr: the local address to listen on
- * @backlog: the maximum number of unaccepted sockets to queue
- * @q_out: a pointer to store the newly created listening queue
- *
- * Returns 0 if successful, otherwise fails.
- */
-int tcp_listen(struct netaddr laddr, int backlog, tcpqueue_t **q_out)
+static int __tcp_listen(struct netaddr laddr, int backlog,
+			unsigned int nr_shards, tcpqueue_t **q_out)
 {
 	tcpqueue_t *q;
-	int ret;
+	int i, ret;
 
 	if (backlog < 1)
 		return -EINVAL;
 
-	/* only can support one local IP so far */
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	/* only can support one local IP (per family) so far */
+	ret = net_bind_laddr(&laddr, NULL);
+	if (ret)
+		return ret;
 
-	q = smalloc(sizeof(*q));
+	q = smalloc(sizeof(*q) + sizeof(struct tcpqueue_shard) * nr_shards);
 	if (!q)
 		return -ENOMEM;
 
 	trans_init_3tuple(&q->e, IPPROTO_TCP, &tcp_queue_ops, laddr);
 	spin_lock_init(&q->l);
 	waitq_init(&q->wq);
-	list_head_init(&q->conns);
-	q->backlog = backlog;
+	q->nr_idle = 0;
 	q->shutdown = false;
+	q->nonblock = false;
+	poll_trigger_init(&q->poll);
+	q->nr_shards = nr_shards;
+	for (i = 0; i < nr_shards; i++) {
+		spin_lock_init(&q->shards[i].l);
+		list_head_init(&q->shards[i].conns);
+		q->shards[i].backlog = div_up(backlog, nr_shards);
+	}
 
 	ret = trans_table_add(&q->e);
 	if (ret) {
@@ -415,37 +656,161 @@ int tcp_listen(struct netaddr laddr, int backlog, tcpqueue_t **q_out)
 	return 0;
 }
 
+/**
+ * tcp_listen - creates a TCP listening queue for a local address
+ * @laddr: the local address to listen on
+ * @backlog: the maximum number of unaccepted sockets to queue
+ * @q_out: a pointer to store the newly created listening queue
+ *
+ * Returns 0 if successful, otherwise fails.
+ */
+int tcp_listen(struct netaddr laddr, int backlog, tcpqueue_t **q_out)
+{
+	return __tcp_listen(laddr, backlog, 1, q_out);
+}
+
+/**
+ * tcp_listen_sharded - creates a TCP listening queue with per-kthread shards
+ * @laddr: the local address to listen on
+ * @backlog: the maximum number of unaccepted sockets to queue (split evenly
+ * across the shards)
+ * @q_out: a pointer to store the newly created listening queue
+ *
+ * Like SO_REUSEPORT, but within one runtime: new connections are queued on the
+ * kthread that received their SYN (and thus their RSS-steered packets), and
+ * tcp_accept() prefers connections queued on the caller's kthread. Accepting
+ * threads fall back to other shards, so no connection is stranded.
+ *
+ * Returns 0 if successful, otherwise fails.
+ */
+int tcp_listen_sharded(struct netaddr laddr, int backlog, tcpqueue_t **q_out)
+{
+	return __tcp_listen(laddr, backlog, maxks, q_out);
+}
+
+static tcpconn_t *tcp_queue_pop_shard(struct tcpqueue_shard *s)
+{
+	tcpconn_t *c;
+
+	spin_lock_np(&s->l);
+	c = list_pop(&s->conns, tcpconn_t, queue_link);
+	if (c)
+		s->backlog++;
+	spin_unlock_np(&s->l);
+
+	return c;
+}
+
+/* pops a pending connection, trying the local shard first */
+static tcpconn_t *tcp_queue_pop(tcpqueue_t *q)
+{
+	struct tcpqueue_shard *local;
+	tcpconn_t *c;
+	int i;
+
+	preempt_disable();
+	local = tcp_queue_local_shard(q);
+	preempt_enable();
+
+	c = tcp_queue_pop_shard(local);
+	if (c || q->nr_shards == 1)
+		return c;
+
+	for (i = 0; i < q->nr_shards; i++) {
+		if (&q->shards[i] == local)
+			continue;
+		c = tcp_queue_pop_shard(&q->shards[i]);
+		if (c)
+			return c;
+	}
+
+	return NULL;
+}
+
 /**
  * tcp_accept - accepts a TCP connection
  * @q: the listen queue to accept the connection on
  * @c_out: a pointer to store the connection
  *
- * Returns 0 if successful, otherwise -EPIPE if the listen queue was closed.
+ * Returns 0 if successful, otherwise -EPIPE if the listen queue was closed, or
+ * -EAGAIN if it's nonblocking and no connection is pending.
  */
 int tcp_accept(tcpqueue_t *q, tcpconn_t **c_out)
 {
 	tcpconn_t *c;
 
+	/* fast path: take a pending connection without the queue lock */
+	c = tcp_queue_pop(q);
+	if (c)
+		goto out;
+	if (q->nonblock)
+		return ACCESS_ONCE(q->shutdown) ? -EPIPE : -EAGAIN;
+
 	spin_lock_np(&q->l);
-	while (list_empty(&q->conns) && !q->shutdown)
+	q->nr_idle++;
+	while (true) {
+		/* drain pending connections before reporting shutdown */
+		c = tcp_queue_pop(q);
+		if (c || q->shutdown)
+			break;
 		waitq_wait(&q->wq, &q->l);
+	}
+	q->nr_idle--;
+	spin_unlock_np(&q->l);
 
 	/* was the queue drained and shutdown? */
-	if (list_empty(&q->conns) && q->shutdown) {
-		spin_unlock_np(&q->l);
+	if (!c)
 		return -EPIPE;
-	}
-
-	/* otherwise a new connection is available */
-	q->backlog++;
-	c = list_pop(&q->conns, tcpconn_t, queue_link);
-	assert(c != NULL);
-	spin_unlock_np(&q->l);
 
+out:
 	*c_out = c;
 	return 0;
 }
 
+/**
+ * tcp_qset_nonblocking - makes tcp_accept() fail instead of blocking
+ * @q: the listen queue
+ * @nonblock: if true, tcp_accept() returns -EAGAIN when it would block
+ */
+void tcp_qset_nonblocking(tcpqueue_t *q, bool nonblock)
+{
+	ACCESS_ONCE(q->nonblock) = nonblock;
+}
+
+/**
+ * tcp_qpoll_register - reports new connections on a listen queue to a waiter
+ * @q: the listen queue
+ * @w: the waiter, replacing any previous one
+ * @data: a value returned with each event
+ *
+ * The queue reports POLL_IN when connections are pending or it was shutdown.
+ */
+void tcp_qpoll_register(tcpqueue_t *q, poll_waiter_t *w, unsigned long data)
+{
+	bool ready = ACCESS_ONCE(q->shutdown);
+	int i;
+
+	poll_arm(&q->poll, w, data);
+
+	/* report connections that arrived before registering */
+	for (i = 0; i < q->nr_shards && !ready; i++) {
+		spin_lock_np(&q->shards[i].l);
+		ready = !list_empty(&q->shards[i].conns);
+		spin_unlock_np(&q->shards[i].l);
+	}
+	if (ready)
+		poll_set(&q->poll, POLL_IN);
+}
+
+/**
+ * tcp_qpoll_unregister - stops reporting a listen queue's events
+ * @q: the listen queue
+ */
+void tcp_qpoll_unregister(tcpqueue_t *q)
+{
+	poll_disarm(&q->poll);
+}
+
 static void __tcp_qshutdown(tcpqueue_t *q)
 {
 	/* mark the listen queue as shutdown */
@@ -471,6 +836,7 @@ void tcp_qshutdown(tcpqueue_t *q)
 
 	/* wake up all pending threads */
 	waitq_release(&q->wq);
+	poll_set(&q->poll, POLL_IN);
 }
 
 static void tcp_queue_release(struct rcu_head *h)
@@ -489,16 +855,22 @@ static void tcp_queue_release(struct rcu_head *h)
 void tcp_qclose(tcpqueue_t *q)
 {
 	tcpconn_t *c, *nextc;
+	int i;
 
 	if (!q->shutdown)
 		__tcp_qshutdown(q);
 
 	BUG_ON(!waitq_empty(&q->wq));
+	poll_disarm(&q->poll);
 
 	/* free all pending connections */
-	list_for_each_safe(&q->conns, c, nextc, queue_link) {
-		list_del_from(&q->conns, &c->queue_link);
-		tcp_conn_destroy(c);
+	for (i = 0; i < q->nr_shards; i++) {
+		struct tcpqueue_shard *s = &q->shards[i];
+
+		list_for_each_safe(&s->conns, c, nextc, queue_link) {
+			list_del_from(&s->conns, &c->queue_link);
+			tcp_conn_destroy(c);
+		}
 	}
 
 	rcu_free(&q->e.rcu, tcp_queue_release);
@@ -533,13 +905,13 @@ int tcp_dial(struct netaddr laddr, struct netaddr raddr, tcpconn_t **c_out)
 	 */
 	ret = tcp_conn_attach(c, laddr, raddr);
 	if (unlikely(ret)) {
-		sfree(c);
+		tcp_conn_free(c);
 		return ret;
 	}
 
-	/* send a SYN to the remote host */
+	/* send a SYN to the remote host (requesting ECN if needed) */
 	spin_lock_np(&c->lock);
-	ret = tcp_tx_ctl(c, TCP_SYN);
+	ret = tcp_tx_ctl(c, TCP_SYN | (c->cc->ecn ? TCP_ECE | TCP_CWR : 0));
 	if (unlikely(ret)) {
 		spin_unlock_np(&c->lock);
 		tcp_conn_destroy(c);
@@ -583,18 +955,60 @@ struct netaddr tcp_remote_addr(tcpconn_t *c)
 	return c->e.raddr;
 }
 
+/* checked without the lock while busy-polling, so it may be stale */
+static bool tcp_read_ready(void *arg)
+{
+	tcpconn_t *c = arg;
+
+	return c->rx_closed || (!c->rx_exclusive && !list_empty(&c->rxq));
+}
+
+/*
+ * The reader of @c runs on a different kthread than the one its segments
+ * arrive on, so ask the iokernel to deliver them here instead. Then softirq
+ * processing and the woken reader share this core's caches. Requests are
+ * rate limited, since the flow's bucket may be shared with other readers.
+ */
+static void tcp_rx_steer(tcpconn_t *c)
+{
+	uint64_t now;
+
+	assert_spin_lock_held(&c->lock);
+
+	if (likely(!flow_affinity || !c->rx_k || c->rx_k == myk()))
+		return;
+	now = rdtsc();
+	if (now - c->rx_steer_tsc < TCP_RX_STEER_INTERVAL * cycles_per_us)
+		return;
+	if (kthread_steer_flow(c->rx_hash))
+		c->rx_steer_tsc = now;
+}
+
 static ssize_t tcp_read_wait(tcpconn_t *c, size_t len,
 			     struct list_head *q, struct mbuf **mout)
 {
 	struct mbuf *m;
 	size_t readlen = 0;
+	bool busy_polled = false;
 
 	*mout = NULL;
 	spin_lock_np(&c->lock);
 
 	/* block until there is an actionable event */
-	while (!c->rx_closed && (c->rx_exclusive || list_empty(&c->rxq)))
+	while (!c->rx_closed && (c->rx_exclusive || list_empty(&c->rxq))) {
+		if (c->nonblock) {
+			spin_unlock_np(&c->lock);
+			return -EAGAIN;
+		}
+		if (c->busy_poll_us > 0 && !busy_polled) {
+			busy_polled = true;
+			spin_unlock_np(&c->lock);
+			net_busy_poll(c->busy_poll_us, tcp_read_ready, c);
+			spin_lock_np(&c->lock);
+			continue;
+		}
 		waitq_wait(&c->rx_wq, &c->lock);
+	}
 
 	/* is the socket closed? */
 	if (c->rx_closed) {
@@ -626,8 +1040,11 @@ static ssize_t tcp_read_wait(tcpconn_t *c, size_t len,
 		readlen += mbuf_length(m);
 	}
 
-	c->pcb.rcv_wnd += readlen;
-	if (unlikely(c->rcv_wnd_full && c->pcb.rcv_wnd >= TCP_WIN / 4)) {
+	if (readlen > 0)
+		tcp_rx_steer(c);
+	c->pcb.rcv_wnd = min(c->pcb.rcv_wnd + (uint32_t)readlen, c->rcv_buf);
+	c->ack_quick = false; /* the app caught up, so delay ACKs again */
+	if (unlikely(c->rcv_wnd_full && c->pcb.rcv_wnd >= c->rcv_buf / 4)) {
 		tcp_tx_ack(c);
 		c->rcv_wnd_full = false;
 	}
@@ -652,15 +1069,16 @@ static void tcp_read_finish(tcpconn_t *c, struct mbuf *m)
 }
 
 /**
- * tcp_read - reads data from a TCP connection
+ * tcp_read_ts - reads data from a TCP connection, with its arrival time
  * @c: the TCP connection
  * @buf: a buffer to store the read data
  * @len: the length of @buf
+ * @ts: a pointer to store when the first segment read arrived (if not NULL)
  *
  * Returns the number of bytes read, 0 if the connection is closed, or < 0
  * if an error occurred.
  */
-ssize_t tcp_read(tcpconn_t *c, void *buf, size_t len)
+ssize_t tcp_read_ts(tcpconn_t *c, void *buf, size_t len, struct net_rx_ts *ts)
 {
 	char *pos = buf;
 	struct list_head q;
@@ -676,6 +1094,13 @@ ssize_t tcp_read(tcpconn_t *c, void *buf, size_t len)
 	if (ret <= 0)
 		return ret;
 
+	if (ts) {
+		struct mbuf *first = list_top(&q, struct mbuf, link);
+		if (!first)
+			first = m;
+		net_rx_get_ts(first, ts);
+	}
+
 	/* copy the data from the buffers */
 	while (true) {
 		struct mbuf *cur = list_pop(&q, struct mbuf, link);
@@ -700,6 +1125,20 @@ ssize_t tcp_read(tcpconn_t *c, void *buf, size_t len)
 	return ret;
 }
 
+/**
+ * tcp_read - reads data from a TCP connection
+ * @c: the TCP connection
+ * @buf: a buffer to store the read data
+ * @len: the length of @buf
+ *
+ * Returns the number of bytes read, 0 if the connection is closed, or < 0
+ * if an error occurred.
+ */
+ssize_t tcp_read(tcpconn_t *c, void *buf, size_t len)
+{
+	return tcp_read_ts(c, buf, len, NULL);
+}
+
 static size_t iov_len(const struct iovec *iov, int iovcnt)
 {
 	size_t len = 0;
@@ -788,27 +1227,149 @@ ssize_t tcp_readv(tcpconn_t *c, const struct iovec *iov, int iovcnt)
 	return len;
 }
 
-static int tcp_write_wait(tcpconn_t *c, size_t *winlen)
+/* releases a reference to an mbuf shared with zero-copy readers */
+static void tcp_rx_release_shared_mbuf(struct mbuf *m)
+{
+	if (!atomic_dec_and_test(&m->ref))
+		return;
+
+	/* restore and call the original release method */
+	m->release = (void (*)(struct mbuf *))m->release_data;
+	m->release_data = 0;
+	m->release(m);
+}
+
+/* takes a reference to an mbuf so it can be shared with a zero-copy reader */
+static void tcp_rx_share_mbuf(struct mbuf *m)
+{
+	if (m->release != tcp_rx_release_shared_mbuf) {
+		m->release_data = (unsigned long)m->release;
+		m->release = tcp_rx_release_shared_mbuf;
+		atomic_write(&m->ref, 1);
+	}
+	atomic_inc(&m->ref);
+}
+
+/**
+ * tcp_read_zc - reads data from a TCP connection without copying
+ * @c: the TCP connection
+ * @len: the maximum number of bytes to read
+ * @bufs: an array to store views of the received data
+ * @nr: the maximum number of views to store in @bufs
+ *
+ * Each view points directly into a receive buffer and must be released with
+ * tcp_rx_buf_release() when the caller is finished with it. If a receive
+ * buffer is only partially consumed, the view holds a reference to it.
+ *
+ * Returns the number of bytes read, 0 if the connection is closed, or < 0
+ * if an error occurred. Unused entries in @bufs have a length of zero.
+ */
+ssize_t tcp_read_zc(tcpconn_t *c, size_t len, struct tcp_rx_buf *bufs,
+		    int nr)
 {
+	struct mbuf *m;
+	size_t readlen = 0, cpylen;
+	int i = 0;
+
+	if (nr <= 0)
+		return -EINVAL;
+
 	spin_lock_np(&c->lock);
 
 	/* block until there is an actionable event */
-	while (!c->tx_closed &&
-	       (c->pcb.state < TCP_STATE_ESTABLISHED || c->tx_exclusive ||
-		wraps_lte(c->pcb.snd_una + c->pcb.snd_wnd, c->pcb.snd_nxt))) {
-		waitq_wait(&c->tx_wq, &c->lock);
+	while (!c->rx_closed && (c->rx_exclusive || list_empty(&c->rxq))) {
+		if (c->nonblock) {
+			spin_unlock_np(&c->lock);
+			return -EAGAIN;
+		}
+		waitq_wait(&c->rx_wq, &c->lock);
 	}
 
 	/* is the socket closed? */
-	if (c->tx_closed) {
+	if (c->rx_closed) {
 		spin_unlock_np(&c->lock);
-		return c->err ? -c->err : -EPIPE;
+		return -c->err;
 	}
 
-	/* drop the lock to allow concurrent RX processing */
-	c->tx_exclusive = true;
-	/* TODO: must allow at least one byte to avoid zero window deadlock */
-	*winlen = c->pcb.snd_una + c->pcb.snd_wnd - c->pcb.snd_nxt;
+	/* hand out views of the mbufs that will be read */
+	while (readlen < len && i < nr) {
+		m = list_top(&c->rxq, struct mbuf, link);
+		if (!m)
+			break;
+
+		if (unlikely((m->flags & TCP_FIN) > 0)) {
+			tcp_conn_shutdown_rx(c);
+			if (mbuf_length(m) == 0)
+				break;
+		}
+
+		bufs[i].buf = mbuf_data(m);
+		bufs[i].release_data = m;
+
+		/* share the buffer if it's only partially consumed */
+		if (len - readlen < mbuf_length(m)) {
+			cpylen = len - readlen;
+			tcp_rx_share_mbuf(m);
+			mbuf_pull(m, cpylen);
+			m->seg_seq += cpylen;
+		} else {
+			cpylen = mbuf_length(m);
+			list_del_from(&c->rxq, &m->link);
+		}
+
+		bufs[i++].len = cpylen;
+		readlen += cpylen;
+	}
+
+	c->pcb.rcv_wnd = min(c->pcb.rcv_wnd + (uint32_t)readlen, c->rcv_buf);
+	c->ack_quick = false; /* the app caught up, so delay ACKs again */
+	if (unlikely(c->rcv_wnd_full && c->pcb.rcv_wnd >= c->rcv_buf / 4)) {
+		tcp_tx_ack(c);
+		c->rcv_wnd_full = false;
+	}
+	spin_unlock_np(&c->lock);
+
+	for (; i < nr; i++)
+		bufs[i].len = 0;
+
+	return readlen;
+}
+
+/**
+ * tcp_rx_buf_release - frees a view returned by tcp_read_zc()
+ * @release_data: the release data pointer from struct tcp_rx_buf
+ */
+void tcp_rx_buf_release(void *release_data)
+{
+	struct mbuf *m = release_data;
+	mbuf_free(m);
+}
+
+static int tcp_write_wait(tcpconn_t *c, size_t *winlen)
+{
+	spin_lock_np(&c->lock);
+
+	/* block until there is an actionable event */
+	while (!c->tx_closed &&
+	       (c->pcb.state < TCP_STATE_ESTABLISHED || c->tx_exclusive ||
+		wraps_lte(c->pcb.snd_una + tcp_snd_wnd(c), c->pcb.snd_nxt))) {
+		if (c->nonblock) {
+			spin_unlock_np(&c->lock);
+			return -EAGAIN;
+		}
+		waitq_wait(&c->tx_wq, &c->lock);
+	}
+
+	/* is the socket closed? */
+	if (c->tx_closed) {
+		spin_unlock_np(&c->lock);
+		return c->err ? -c->err : -EPIPE;
+	}
+
+	/* drop the lock to allow concurrent RX processing */
+	c->tx_exclusive = true;
+	/* TODO: must allow at least one byte to avoid zero window deadlock */
+	*winlen = c->pcb.snd_una + tcp_snd_wnd(c) - c->pcb.snd_nxt;
 	spin_unlock_np(&c->lock);
 
 	return 0;
@@ -827,9 +1388,14 @@ static void tcp_write_finish(tcpconn_t *c)
 	spin_lock_np(&c->lock);
 	c->tx_exclusive = false;
 	tcp_conn_ack(c, &q);
-	if (c->pcb.rcv_nxt == c->tx_last_ack) /* race condition check */
+	if (c->tx_sack_nr > 0) {
+		tcp_conn_sack(c, c->tx_sacks, c->tx_sack_nr);
+		c->tx_sack_nr = 0;
+	}
+	if (c->pcb.rcv_nxt == c->tx_last_ack) { /* race condition check */
 		c->ack_delayed = false;
-	else
+		c->ack_segs = 0;
+	} else
 		c->ack_ts = microtime();
 	if (c->pcb.state == TCP_STATE_CLOSED) {
 		list_append_list(&q, &c->txq);
@@ -843,6 +1409,11 @@ static void tcp_write_finish(tcpconn_t *c)
 			retransmit = tcp_tx_fast_retransmit_start(c);
 	}
 
+	/* autocork: the data in flight was acked during the write */
+	if (c->cork == TCP_CORK_AUTO && c->pcb.state != TCP_STATE_CLOSED &&
+	    tcp_tx_only_pending(c))
+		tcp_tx_flush_pending(c);
+
 	tcp_timer_update(c);
 	waitq_release_start(&c->tx_wq, &waiters);
 	spin_unlock_np(&c->lock);
@@ -852,6 +1423,15 @@ static void tcp_write_finish(tcpconn_t *c)
 	mbuf_list_free(&q);
 }
 
+/* returns true if a write should be held back to coalesce with later ones */
+static bool tcp_write_corked(tcpconn_t *c)
+{
+	if (c->cork == TCP_CORK_ON)
+		return true;
+	return c->cork == TCP_CORK_AUTO &&
+	       load_acquire(&c->pcb.snd_una) != c->pcb.snd_nxt;
+}
+
 /**
  * tcp_write - writes data to a TCP connection
  * @c: the TCP connection
@@ -872,7 +1452,8 @@ ssize_t tcp_write(tcpconn_t *c, const void *buf, size_t len)
 		return ret;
 
 	/* actually send the data */
-	ret = tcp_tx_send(c, buf, min(len, winlen), len <= winlen);
+	ret = tcp_tx_send(c, buf, min(len, winlen),
+			  len <= winlen && !tcp_write_corked(c));
 
 	/* catch up on any pending work */
 	tcp_write_finish(c);
@@ -905,7 +1486,8 @@ ssize_t tcp_writev(tcpconn_t *c, const struct iovec *iov, int iovcnt)
 		if (winlen <= 0)
 			break;
 		ret = tcp_tx_send(c, iov->iov_base, min(iov->iov_len, winlen),
-				  i == iovcnt - 1 && iov->iov_len <= winlen);
+				  i == iovcnt - 1 && iov->iov_len <= winlen &&
+				  !tcp_write_corked(c));
 		if (ret <= 0)
 			break;
 		winlen -= ret;
@@ -918,6 +1500,174 @@ ssize_t tcp_writev(tcpconn_t *c, const struct iovec *iov, int iovcnt)
 	return sent > 0 ? sent : ret;
 }
 
+/**
+ * tcp_tx_buf_alloc - allocates a buffer for zero-copy writes
+ * @b: the buffer to initialize
+ * @len: the largest payload that will be written from the buffer
+ *
+ * The buffer lives in the egress region shared with the iokernel, so its
+ * payload can be transmitted without copying. It can be reused for many
+ * writes, and must be freed with tcp_tx_buf_free() once it is no longer needed
+ * and not in flight.
+ *
+ * Returns 0 if successful, -EINVAL if @len is too large, or -ENOBUFS if out
+ * of memory.
+ */
+int tcp_tx_buf_alloc(struct tcp_tx_buf *b, size_t len)
+{
+	struct mbuf *m = NULL;
+
+	if (len > TCP_TSO_MAX_LEN(tcp_mss) || (len > tcp_mss && !enable_tso))
+		return -EINVAL;
+
+	if (len > tcp_mss)
+		m = net_tx_alloc_tso_mbuf();
+	else
+		m = net_tx_alloc_mbuf();
+	if (unlikely(!m))
+		return -ENOBUFS;
+
+	b->buf = mbuf_data(m);
+	b->cap = len > tcp_mss ? TCP_TSO_MAX_LEN(tcp_mss) : tcp_mss;
+	b->done = NULL;
+	b->arg = NULL;
+	b->handle = m;
+	return 0;
+}
+
+/**
+ * tcp_tx_buf_free - frees a buffer allocated with tcp_tx_buf_alloc()
+ * @b: the buffer to free
+ *
+ * WARNING: The buffer must not be in flight (i.e. any write has completed).
+ */
+void tcp_tx_buf_free(struct tcp_tx_buf *b)
+{
+	net_tx_release_mbuf(b->handle);
+	b->handle = NULL;
+}
+
+/**
+ * tcp_write_zc - writes an application-owned buffer to a TCP connection
+ * @c: the TCP connection
+ * @b: a buffer from tcp_tx_buf_alloc() with its payload filled in
+ * @len: the length of the payload (at most @b->cap)
+ * @done: called once the stack no longer references the buffer
+ * @arg: an argument passed to @done
+ *
+ * The buffer is referenced until its data is acknowledged, so it must not be
+ * modified, reused, or freed until @done is called. If the send window is too
+ * small to hold the entire payload, it is copied instead and @done may be
+ * called before this function returns.
+ *
+ * Returns the number of bytes written (could be less than @len), or < 0
+ * if there was a failure. @done is only called if some data was written.
+ */
+ssize_t tcp_write_zc(tcpconn_t *c, struct tcp_tx_buf *b, size_t len,
+		     void (*done)(void *arg), void *arg)
+{
+	size_t winlen, n = 0;
+	ssize_t ret;
+
+	if (len == 0 || len > b->cap)
+		return -EINVAL;
+
+	b->done = done;
+	b->arg = arg;
+
+	/* block until the data can be sent */
+	ret = tcp_write_wait(c, &winlen);
+	if (ret)
+		return ret;
+
+	if (likely(winlen >= len)) {
+		/* actually send the data */
+		ret = tcp_tx_send_zc(c, b, len);
+
+		/* catch up on any pending work */
+		tcp_write_finish(c);
+		return ret;
+	}
+
+	/* fall back to copying the payload */
+	ret = tcp_tx_send(c, b->buf, winlen, false);
+	tcp_write_finish(c);
+	if (ret > 0) {
+		n = ret;
+		while (n < len) {
+			ret = tcp_write(c, (char *)b->buf + n, len - n);
+			if (ret <= 0)
+				break;
+			n += ret;
+		}
+	}
+	if (n == 0)
+		return ret;
+
+	done(arg);
+	return n;
+}
+
+static void tcp_sendfile_done(void *arg)
+{
+	struct tcp_tx_buf *b = arg;
+
+	tcp_tx_buf_free(b);
+	sfree(b);
+}
+
+/**
+ * tcp_sendfile - writes part of a file to a TCP connection
+ * @c: the TCP connection
+ * @fd: the file to read from
+ * @offset: the file offset to start at, advanced past the bytes written
+ * @count: the number of bytes to write
+ *
+ * Like sendfile(2). Each chunk of the file is read with file_read() straight
+ * into a buffer in the egress region and then sent with tcp_write_zc(), so the
+ * data isn't copied again on its way to the NIC. The iokernel can only
+ * transmit from the egress region, so page cache pages can't be sent in place,
+ * but files opened with O_DIRECT are read into the egress buffers by DMA.
+ *
+ * Returns the number of bytes written (less than @count at the end of the
+ * file or if interrupted), or < 0 if there was a failure before any were.
+ */
+ssize_t tcp_sendfile(tcpconn_t *c, int fd, off_t *offset, size_t count)
+{
+	size_t chunk_max = enable_tso ? TCP_TSO_MAX_LEN(tcp_mss) : tcp_mss;
+	struct tcp_tx_buf *b;
+	size_t chunk, sent = 0;
+	ssize_t ret = 0;
+
+	while (sent < count) {
+		chunk = min(count - sent, chunk_max);
+		b = smalloc(sizeof(*b));
+		if (unlikely(!b)) {
+			ret = -ENOMEM;
+			break;
+		}
+		ret = tcp_tx_buf_alloc(b, chunk);
+		if (unlikely(ret)) {
+			sfree(b);
+			break;
+		}
+
+		ret = file_read(fd, b->buf, chunk, *offset);
+		if (ret > 0)
+			ret = tcp_write_zc(c, b, ret, tcp_sendfile_done, b);
+		if (ret <= 0) {
+			/* @done is only called if some data was written */
+			tcp_sendfile_done(b);
+			break;
+		}
+
+		*offset += ret;
+		sent += ret;
+	}
+
+	return sent > 0 ? sent : ret;
+}
+
 /* resend any pending egress packets that timed out */
 static void tcp_retransmit(void *arg)
 {
@@ -964,6 +1714,7 @@ void tcp_conn_fail(tcpconn_t *c, int err)
 		c->tx_closed = true;
 		waitq_release(&c->tx_wq);
 	}
+	poll_set(&c->poll, POLL_IN | POLL_OUT);
 
 	/* will be freed by the writer if one is busy */
 	if (!c->tx_exclusive) {
@@ -975,7 +1726,7 @@ void tcp_conn_fail(tcpconn_t *c, int err)
 	}
 	if (!c->rx_exclusive)
 		mbuf_list_free(&c->rxq);
-	mbuf_list_free(&c->rxq_ooo);
+	tcp_ooo_free(c);
 
 	/* state machine is disabled, drop ref */
 	tcp_conn_put(c);
@@ -996,6 +1747,7 @@ void tcp_conn_shutdown_rx(tcpconn_t *c)
 
 	c->rx_closed = true;
 	waitq_release(&c->rx_wq);
+	poll_set(&c->poll, POLL_IN);
 }
 
 static int tcp_conn_shutdown_tx(tcpconn_t *c)
@@ -1059,6 +1811,386 @@ int tcp_shutdown(tcpconn_t *c, int how)
 	return 0;
 }
 
+/**
+ * tcp_set_ack_policy - chooses when a connection acknowledges received data
+ * @c: the TCP connection
+ * @policy: the policy (TCP_ACK_DELAYED, TCP_ACK_QUICK, etc.)
+ * @arg: the policy's parameter
+ *
+ * TCP_ACK_DELAYED (the default) waits for a reply to carry the ACK, for up to
+ * @arg us (or the tcp_ack_timeout_us config option, if @arg is 0). It suits
+ * request/response traffic where the app answers promptly. TCP_ACK_QUICK
+ * acknowledges each segment right away, which helps senders that wait for
+ * ACKs (e.g., a request spanning a few segments). TCP_ACK_EVERY acknowledges
+ * every @arg segments, or after tcp_ack_timeout_us, which suits bulk
+ * transfers. TCP_ACK_ADAPTIVE delays up to @arg us, but if the app hasn't
+ * read the data by then, it acknowledges right away until the app catches up.
+ *
+ * Returns 0 if successful, or -EINVAL if @policy or @arg are invalid.
+ */
+int tcp_set_ack_policy(tcpconn_t *c, int policy, unsigned int arg)
+{
+	uint32_t timeout = tcp_ack_timeout;
+	uint16_t every = 0;
+
+	switch (policy) {
+	case TCP_ACK_QUICK:
+		break;
+	case TCP_ACK_EVERY:
+		if (arg < 1 || arg > UINT16_MAX)
+			return -EINVAL;
+		every = arg;
+		break;
+	case TCP_ACK_DELAYED:
+	case TCP_ACK_ADAPTIVE:
+		if (arg > ONE_SECOND || (policy == TCP_ACK_ADAPTIVE && !arg))
+			return -EINVAL;
+		if (arg)
+			timeout = arg;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	spin_lock_np(&c->lock);
+	c->ack_policy = policy;
+	c->ack_every = every;
+	c->ack_timeout = timeout;
+	c->ack_quick = false;
+	spin_unlock_np(&c->lock);
+
+	return 0;
+}
+
+/**
+ * tcp_set_cork - coalesces small writes into fewer segments
+ * @c: the TCP connection
+ * @mode: TCP_CORK_OFF, TCP_CORK_ON, or TCP_CORK_AUTO
+ * @threshold: send held data once this many bytes are buffered, or 0 to wait
+ * for a full segment
+ *
+ * TCP_CORK_ON holds back writes until @threshold is reached, the connection is
+ * uncorked, or TCP_CORK_TIMEOUT passes, so a burst of small writes (e.g., a
+ * batch of pipelined requests) is sent as one segment. TCP_CORK_AUTO sends a
+ * write right away only if no earlier data is in flight; otherwise it's held
+ * until the ACK arrives. Switching to TCP_CORK_OFF sends held data right away.
+ *
+ * Returns 0 if successful, or -EINVAL if @mode is invalid.
+ */
+int tcp_set_cork(tcpconn_t *c, int mode, size_t threshold)
+{
+	if (mode != TCP_CORK_OFF && mode != TCP_CORK_ON && mode != TCP_CORK_AUTO)
+		return -EINVAL;
+
+	spin_lock_np(&c->lock);
+	c->cork = mode;
+	c->cork_bytes = threshold ? min(threshold, (size_t)UINT32_MAX) :
+			UINT32_MAX;
+	if (c->pcb.state >= TCP_STATE_ESTABLISHED &&
+	    c->pcb.state != TCP_STATE_CLOSED &&
+	    (mode == TCP_CORK_OFF ||
+	     (mode == TCP_CORK_AUTO && tcp_tx_only_pending(c))))
+		tcp_tx_flush_pending(c);
+	if (c->pcb.state != TCP_STATE_CLOSED)
+		tcp_timer_update(c);
+	spin_unlock_np(&c->lock);
+
+	return 0;
+}
+
+/**
+ * tcp_set_transform - transforms the byte stream in place, e.g. for TLS
+ * @c: the TCP connection
+ * @xf: the transform hooks, or NULL to remove them
+ * @arg: an argument passed to the hooks
+ *
+ * The TX hook writes each payload into its egress buffer, so encryption takes
+ * the place of the copy tcp_write() makes anyway, and zero-copy buffers are
+ * transformed where they are. The RX hook runs on ingress buffers as they
+ * become readable, including data already queued but not read when the hooks
+ * are installed (e.g., after a TLS handshake), so tcp_read_zc() returns the
+ * results without a copy. Retransmissions reuse transformed buffers, so each
+ * byte is transformed exactly once.
+ *
+ * The transform must keep the length of the data; framing such as TLS record
+ * headers and tags is written into the stream by the application. The RX hook
+ * runs in softirq context with the connection locked, so it must not block.
+ *
+ * Returns 0 if successful, or -EBUSY if a read or write is in progress.
+ */
+int tcp_set_transform(tcpconn_t *c, const struct tcp_transform *xf, void *arg)
+{
+	struct mbuf *m;
+
+	spin_lock_np(&c->lock);
+	if (c->rx_exclusive || c->tx_exclusive) {
+		spin_unlock_np(&c->lock);
+		return -EBUSY;
+	}
+
+	c->xform = xf;
+	c->xform_arg = arg;
+	if (xf && xf->rx) {
+		list_for_each(&c->rxq, m, link) {
+			xf->rx(arg, m->seg_seq - c->pcb.irs - 1, mbuf_data(m),
+			       mbuf_length(m));
+		}
+	}
+	spin_unlock_np(&c->lock);
+
+	return 0;
+}
+
+/**
+ * tcp_set_buffers - changes send and receive buffer sizes
+ * @c: the TCP connection
+ * @read_len: the maximum number of bytes to buffer for reading
+ * @write_len: the maximum number of bytes to keep unacknowledged in flight
+ *
+ * The window scale is negotiated during the handshake from the default
+ * receive buffer size (see the tcp_rx_buffer config option), so a larger
+ * receive buffer set afterward may only be partially advertised. A smaller
+ * receive buffer takes effect as buffered data is consumed.
+ *
+ * Returns 0 if the inputs were valid.
+ */
+int tcp_set_buffers(tcpconn_t *c, int read_len, int write_len)
+{
+	struct list_head waiters;
+	uint32_t old_len;
+
+	if (read_len <= 0 || read_len > TCP_MAX_BUF ||
+	    write_len <= 0 || write_len > TCP_MAX_BUF)
+		return -EINVAL;
+
+	list_head_init(&waiters);
+	spin_lock_np(&c->lock);
+
+	/* resize the receive window */
+	old_len = c->rcv_buf;
+	c->rcv_buf = read_len;
+	if (c->rcv_buf > old_len) {
+		c->pcb.rcv_wnd += c->rcv_buf - old_len;
+		if (c->rcv_wnd_full && c->pcb.rcv_wnd >= c->rcv_buf / 4) {
+			tcp_tx_ack(c);
+			c->rcv_wnd_full = false;
+		}
+	} else {
+		c->pcb.rcv_wnd -= min(c->pcb.rcv_wnd, old_len - c->rcv_buf);
+		if (c->pcb.rcv_wnd == 0)
+			c->rcv_wnd_full = true;
+	}
+
+	/* resize the send buffer, waking writers if there is more room */
+	old_len = c->snd_buf;
+	c->snd_buf = write_len;
+	if (c->snd_buf > old_len) {
+		waitq_release_start(&c->tx_wq, &waiters);
+		poll_set(&c->poll, POLL_OUT);
+	}
+	spin_unlock_np(&c->lock);
+
+	waitq_release_finish(&waiters);
+	return 0;
+}
+
+/**
+ * tcp_set_nonblocking - makes reads and writes fail instead of blocking
+ * @c: the TCP connection
+ * @nonblock: if true, tcp_read(), tcp_write(), etc. return -EAGAIN when they
+ * would block
+ */
+void tcp_set_nonblocking(tcpconn_t *c, bool nonblock)
+{
+	spin_lock_np(&c->lock);
+	c->nonblock = nonblock;
+	spin_unlock_np(&c->lock);
+}
+
+/**
+ * tcp_set_busy_poll - makes reads spin for a while before blocking
+ * @c: the TCP connection
+ * @us: how long to spin handling packets on this core, in microseconds, or 0
+ * to block right away (the default)
+ *
+ * Busy-polling lowers latency when data is expected soon, at the cost of CPU
+ * time. A spinning read still gives way to other runnable threads.
+ *
+ * Returns 0 if successful, or -EINVAL if @us is more than
+ * NET_BUSY_POLL_MAX_US.
+ */
+int tcp_set_busy_poll(tcpconn_t *c, unsigned int us)
+{
+	if (us > NET_BUSY_POLL_MAX_US)
+		return -EINVAL;
+
+	spin_lock_np(&c->lock);
+	c->busy_poll_us = us;
+	spin_unlock_np(&c->lock);
+	return 0;
+}
+
+/**
+ * tcp_set_priority - handles a connection's ingress packets ahead of others
+ * @c: the TCP connection
+ * @high: true if the connection is latency-critical
+ *
+ * Each batch of ingress packets is handled for high-priority connections
+ * first, so their threads wake up without waiting behind bulk transfers.
+ */
+void tcp_set_priority(tcpconn_t *c, bool high)
+{
+	trans_set_priority(&c->e, high);
+}
+
+/**
+ * tcp_get_info - takes a snapshot of a connection's state
+ * @c: the TCP connection
+ * @info: a pointer to store the snapshot
+ *
+ * Meant for introspection, so it costs a walk of the receive queue.
+ */
+void tcp_get_info(tcpconn_t *c, struct tcp_conn_info *info)
+{
+	uint32_t rx_queued = 0, pending = 0;
+	struct mbuf *m;
+
+	spin_lock_np(&c->lock);
+	info->laddr = c->e.laddr;
+	info->raddr = c->e.raddr;
+	info->state = c->pcb.state;
+	info->mss = c->mss;
+	info->srtt = c->srtt;
+	info->rttvar = c->rttvar;
+	info->rto = c->rto;
+	info->retransmits = c->retransmits;
+	info->cwnd = c->cwnd;
+	info->ssthresh = c->ssthresh;
+	info->snd_wnd = c->pcb.snd_wnd;
+	info->rcv_wnd = c->pcb.rcv_wnd;
+
+	/* a reader holding exclusion has already taken its mbufs off rxq */
+	list_for_each(&c->rxq, m, link)
+		rx_queued += mbuf_length(m);
+	info->rx_queued = rx_queued;
+
+	/* held back data has a sequence number but hasn't been sent */
+	if (!c->tx_exclusive && c->tx_pending)
+		pending = c->tx_pending->seg_end - c->tx_pending->seg_seq;
+	info->tx_queued = tcp_flight_size(c);
+	info->in_flight = info->tx_queued - pending;
+	spin_unlock_np(&c->lock);
+}
+
+struct tcp_top {
+	struct tcp_conn_info	*infos;
+	int			nr;
+	int			max;
+	int			key;
+};
+
+static uint64_t tcp_top_rank(const struct tcp_conn_info *info, int key)
+{
+	uint64_t queued = min((uint64_t)info->rx_queued + info->tx_queued,
+			      (uint64_t)UINT32_MAX);
+
+	/* the other measure breaks ties */
+	if (key == TCP_TOP_QUEUED)
+		return (queued << 32) | info->retransmits;
+	return ((uint64_t)info->retransmits << 32) | queued;
+}
+
+static void tcp_top_visit(struct trans_entry *e, void *arg)
+{
+	struct tcp_top *t = arg;
+	struct tcp_conn_info info;
+	uint64_t rank;
+	int i;
+
+	if (e->ops != &tcp_conn_ops)
+		return;
+
+	tcp_get_info(container_of(e, tcpconn_t, e), &info);
+	rank = tcp_top_rank(&info, t->key);
+	if (t->nr == t->max &&
+	    rank <= tcp_top_rank(&t->infos[t->nr - 1], t->key))
+		return;
+
+	/* insert in order, pushing out the lowest entry if full */
+	i = min(t->nr, t->max - 1);
+	while (i > 0 && tcp_top_rank(&t->infos[i - 1], t->key) < rank) {
+		t->infos[i] = t->infos[i - 1];
+		i--;
+	}
+	t->infos[i] = info;
+	if (t->nr < t->max)
+		t->nr++;
+}
+
+/**
+ * tcp_top_conns - finds the connections with the most retransmits or queuing
+ * @infos: an array to store snapshots of the connections, highest first
+ * @n: the size of @infos
+ * @key: TCP_TOP_RETRANSMITS or TCP_TOP_QUEUED (bytes queued in either
+ * direction)
+ *
+ * Walks every attached connection, so it's only meant for sampling.
+ * Returns the number of connections stored.
+ */
+int tcp_top_conns(struct tcp_conn_info *infos, int n, int key)
+{
+	struct tcp_top t = {
+		.infos = infos,
+		.nr = 0,
+		.max = n,
+		.key = key,
+	};
+
+	if (n <= 0)
+		return 0;
+
+	trans_table_for_each(tcp_top_visit, &t);
+	return t.nr;
+}
+
+/**
+ * tcp_poll_register - reports a TCP connection's readiness to a waiter
+ * @c: the TCP connection
+ * @w: the waiter, replacing any previous one
+ * @data: a value returned with each event
+ *
+ * The connection reports POLL_IN when there is data to read, or it was shut
+ * down or failed, and POLL_OUT when there is room to write or it failed.
+ * tcp_close() unregisters the connection.
+ */
+void tcp_poll_register(tcpconn_t *c, poll_waiter_t *w, unsigned long data)
+{
+	unsigned int events = 0;
+
+	spin_lock_np(&c->lock);
+	poll_arm(&c->poll, w, data);
+
+	/* report readiness that came before registering */
+	if (c->rx_closed || (!c->rx_exclusive && !list_empty(&c->rxq)))
+		events |= POLL_IN;
+	if (c->tx_closed ||
+	    (c->pcb.state >= TCP_STATE_ESTABLISHED && !c->tx_exclusive &&
+	     wraps_gt(c->pcb.snd_una + tcp_snd_wnd(c), c->pcb.snd_nxt)))
+		events |= POLL_OUT;
+	if (events)
+		poll_set(&c->poll, events);
+	spin_unlock_np(&c->lock);
+}
+
+/**
+ * tcp_poll_unregister - stops reporting a TCP connection's readiness
+ * @c: the TCP connection
+ */
+void tcp_poll_unregister(tcpconn_t *c)
+{
+	poll_disarm(&c->poll);
+}
+
 /**
  * tcp_abort - force an immediate (ungraceful) close of the connection
  * @c: the TCP connection to abort
@@ -1107,23 +2239,64 @@ void tcp_close(tcpconn_t *c)
 {
 	int ret;
 
+	poll_disarm(&c->poll);
+
 	spin_lock_np(&c->lock);
 	BUG_ON(!waitq_empty(&c->rx_wq));
 	ret = tcp_conn_shutdown_tx(c);
 	if (ret)
 		tcp_conn_fail(c, -ret);
 	tcp_conn_shutdown_rx(c);
+	c->app_closed = true;
 	spin_unlock_np(&c->lock);
 
+	/* otherwise, the ingress path does this once TIME-WAIT is reached */
+	if (ACCESS_ONCE(c->pcb.state) == TCP_STATE_TIME_WAIT)
+		tcp_tw_start(c);
 	tcp_conn_put(c);
 }
 
 /**
- * tcp_init_late - starts the TCP worker thread
+ * tcp_init - allocates the TCP connection cache
  *
  * Returns 0 if successful.
  */
-int tcp_init_late(void)
+int tcp_init(void)
+{
+	int ret;
+
+	tcp_mss = netcfg.mtu - sizeof(struct ip_hdr) - sizeof(struct tcp_hdr);
+
+	ret = slab_create(&tcp_conn_slab, "runtime_tcp_conns",
+			  sizeof(tcpconn_t), SLAB_FLAG_CACHE_ALIGNED);
+	if (ret)
+		return ret;
+
+	tcp_conn_tcache = slab_create_tcache(&tcp_conn_slab,
+					     TCACHE_DEFAULT_MAG_SIZE);
+	if (!tcp_conn_tcache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * tcp_init_thread - initializes per-thread TCP state
+ *
+ * Returns 0 if successful.
+ */
+int tcp_init_thread(void)
 {
+	tcache_init_perthread(tcp_conn_tcache, &perthread_get(tcp_conn_pt));
 	return 0;
 }
+
+/**
+ * tcp_init_late - initializes TCP state
+ *
+ * Returns 0 if successful.
+ */
+int tcp_init_late(void)
+{
+	return tcp_rx_init();
+}
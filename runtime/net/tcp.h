@@ -5,9 +5,11 @@
 #include <base/stddef.h>
 #include <base/list.h>
 #include <base/kref.h>
+#include <base/atomic.h>
 #include <base/time.h>
 #include <runtime/sync.h>
 #include <runtime/tcp.h>
+#include <runtime/timer.h>
 #include <net/tcp.h>
 #include <net/mbuf.h>
 #include <net/mbufq.h>
@@ -16,29 +18,37 @@
 #include "waitq.h"
 
 /* adjustable constants */
-#define TCP_MSS	(ETH_MTU - sizeof(struct ip_hdr) - sizeof(struct tcp_hdr))
-#define TCP_WIN	((65535 / TCP_MSS) * TCP_MSS)
-#define TCP_ACK_TIMEOUT (10 * ONE_MS)
+/* the MSS with a standard 1500-byte MTU, see tcp_mss for ours */
+#define TCP_MSS_STD (ETH_MTU - sizeof(struct ip_hdr) - sizeof(struct tcp_hdr))
+#define TCP_DEFAULT_MSS 536 /* if the peer sends no MSS option (RFC 9293) */
+#define TCP_MIN_MSS 88 /* smaller MSS options are rounded up */
+#define TCP_WIN	((65535 / TCP_MSS_STD) * TCP_MSS_STD)
+#define TCP_DEFAULT_RX_BUF TCP_WIN
+#define TCP_DEFAULT_TX_BUF (1024 * 1024)
+#define TCP_MAX_WSCALE 14 /* RFC 7323 Section 2.3 */
+#define TCP_ACK_TIMEOUT_DEFAULT (10 * ONE_MS)
+#define TCP_CORK_TIMEOUT (1 * ONE_MS) /* the longest a corked write waits */
 #define TCP_OOQ_ACK_TIMEOUT (300 * ONE_MS)
 #define TCP_TIME_WAIT_TIMEOUT (1 * ONE_SECOND) /* FIXME: should be 8 minutes */
-#define TCP_RETRANSMIT_TIMEOUT (300 * ONE_MS) /* FIXME: should be dynamic */
+#define TCP_RTO_INIT (300 * ONE_MS) /* before the first RTT sample */
+#define TCP_RTO_MIN_DEFAULT (10 * ONE_MS)
+#define TCP_RTO_MAX (60 * ONE_SECOND) /* RFC 6298 Section 2.5 */
+#define TCP_SYN_BACKLOG_DEFAULT 1024 /* half-open conns before SYN cookies */
+#define TCP_TIMER_SLACK_DEFAULT (1 * ONE_MS) /* max rounding of deadlines */
+#define TCP_TIMER_SLACK_SHIFT 3 /* slack is at most 1/8th of the timeout */
 #define TCP_FAST_RETRANSMIT_THRESH 3
 #define TCP_OOO_MAX_SIZE 2048
+#define TCP_OOO_MIN_CAPACITY 16
+#define TCP_SACK_MAX_BLOCKS 4 /* fits in the option space without timestamps */
+#define TCP_RX_STEER_INTERVAL (10 * ONE_MS) /* min time between flow steers */
 #define TCP_RETRANSMIT_BATCH 16
-
-/* connecion states (RFC 793 Section 3.2) */
-enum {
-	TCP_STATE_SYN_SENT = 0,
-	TCP_STATE_SYN_RECEIVED,
-	TCP_STATE_ESTABLISHED,
-	TCP_STATE_FIN_WAIT1,
-	TCP_STATE_FIN_WAIT2,
-	TCP_STATE_CLOSE_WAIT,
-	TCP_STATE_CLOSING,
-	TCP_STATE_LAST_ACK,
-	TCP_STATE_TIME_WAIT,
-	TCP_STATE_CLOSED,
-};
+#define TCP_INIT_CWND(c) (10 * (c)->mss) /* RFC 6928 */
+#define TCP_MIN_CWND(c) (2 * (c)->mss)
+/* paced rates as a percentage of cwnd per RTT, in slow start and after it */
+#define TCP_PACING_SS_RATIO 200
+#define TCP_PACING_CA_RATIO 120
+/* the largest super-segment when TSO is enabled (IP length is 16-bit) */
+#define TCP_TSO_MAX_LEN(mss) ((NET_TX_TSO_MAX_LEN / (mss)) * (mss))
 
 /* TCP protocol control block (PCB) */
 struct tcp_pcb {
@@ -65,22 +75,73 @@ struct tcp_pcb {
 	uint32_t	irs;		/* initial receive sequence number */
 };
 
+/* a SACK block (RFC 2018), can be loaded and stored atomically */
+struct tcp_sack_block {
+	union {
+		struct {
+			uint32_t	start;	/* the first seq number */
+			uint32_t	end;	/* the last seq number (noninclusive) */
+		};
+		uint64_t	raw;
+	};
+};
+
+/* a sorted array of out-of-order ingress segments */
+struct tcp_ooo {
+	struct mbuf		**segs;
+	unsigned int		head;
+	unsigned int		nr;
+	unsigned int		cap;
+};
+
+/* congestion control algorithm operations */
+struct tcp_cc_ops {
+	const char	*name;
+	/* does the algorithm require ECN negotiation? */
+	bool		ecn;
+	/* initialize congestion state for a new connection */
+	void (*init)(tcpconn_t *c);
+	/* new data was acknowledged (@ece is set if ECN-Echo was received) */
+	void (*ack)(tcpconn_t *c, uint32_t acked, bool ece);
+	/* a loss was detected by duplicate ACKs (entering fast recovery) */
+	void (*loss)(tcpconn_t *c);
+	/* the retransmission timer expired */
+	void (*timeout)(tcpconn_t *c);
+};
+
 /* the TCP connection struct */
 struct tcpconn {
 	struct trans_entry	e;
 	struct tcp_pcb		pcb;
-	struct list_node	global_link;
 	struct list_node	queue_link;
 	spinlock_t		lock;
 	struct kref		ref;
 	int			err; /* error code for read(), write(), etc. */
+	bool			half_open; /* counted in tcp_half_open */
+	bool			app_closed; /* tcp_close() was called */
+	bool			tw_replaced; /* a TIME-WAIT minisocket took e */
+	bool			nonblock; /* return -EAGAIN instead of blocking */
+	unsigned int		busy_poll_us; /* spin before reads block */
+	poll_trigger_t		poll; /* readiness notification, see poll.h */
 
 	/* ingress path */
 	unsigned int		rx_closed:1;
 	unsigned int		rx_exclusive:1;
 	waitq_t			rx_wq;
-	struct list_head	rxq_ooo;
+	struct tcp_ooo		rxq_ooo;
 	struct list_head	rxq;
+	bool			sack_ok;	/* SACK was negotiated */
+	unsigned int		rx_sack_nr;	/* SACK blocks to advertise */
+	struct tcp_sack_block	rx_sacks[TCP_SACK_MAX_BLOCKS];
+	uint32_t		rcv_buf;	/* receive buffer size (bytes) */
+	uint8_t			rcv_wscale;	/* shift for advertised windows */
+	struct kthread		*rx_k;		/* handled the last segment */
+	uint32_t		rx_hash;	/* the RSS hash of the flow */
+	uint64_t		rx_steer_tsc;	/* when it was last steered */
+
+	/* the stream transform (see tcp_set_transform()), NULL if none */
+	const struct tcp_transform *xform;
+	void			*xform_arg;
 
 	/* egress path */
 	unsigned int		tx_closed:1;
@@ -88,30 +149,133 @@ struct tcpconn {
 	waitq_t			tx_wq;
 	uint32_t		tx_last_ack;
 	uint16_t		tx_last_win;
-	struct mbuf		*tx_pending;
+	struct mbuf		*tx_pending;	/* a partial segment held back */
+	uint8_t			cork;		/* see tcp_set_cork() */
+	uint32_t		cork_bytes;	/* send tx_pending at this size */
 	struct list_head	txq;
 	bool			do_fast_retransmit;
 	uint32_t		fast_retransmit_last_ack;
+	unsigned int		tx_sack_nr;	/* deferred peer SACK blocks */
+	struct tcp_sack_block	tx_sacks[TCP_SACK_MAX_BLOCKS];
+	uint32_t		snd_buf;	/* send buffer size (bytes) */
+	uint8_t			snd_wscale;	/* shift for the peer's windows */
+	bool			wscale_ok;	/* window scaling was negotiated */
+	uint32_t		mss;		/* ours or the peer's if smaller */
+
+	/* congestion control */
+	const struct tcp_cc_ops	*cc;
+	uint32_t		cwnd;		/* congestion window */
+	uint32_t		ssthresh;	/* slow start threshold */
+	uint32_t		cwnd_cnt;	/* bytes acked toward cwnd growth */
+	uint32_t		recover;	/* snd_nxt when recovery began */
+	bool			in_recovery;
+	bool			ecn_ok;		/* ECN was negotiated */
+	bool			ecn_ce;		/* last ingress segment had CE */
+	uint32_t		dctcp_alpha;	/* DCTCP congestion estimate */
+	uint32_t		dctcp_acked;	/* bytes acked in this window */
+	uint32_t		dctcp_marked;	/* bytes marked in this window */
+	uint32_t		dctcp_next_seq;	/* end of the current window */
+
+	/* round-trip time estimation (RFC 6298) */
+	uint32_t		srtt;		/* smoothed RTT (us), 0 if none */
+	uint32_t		rttvar;		/* RTT variation (us) */
+	uint32_t		rto;		/* retransmission timeout (us) */
+	uint32_t		retransmit_end;	/* end of last resent segment */
+	uint32_t		retransmits;	/* segments resent, ever */
+
+	/* pacing (if tcp_pacing is set), protected by @lock */
+	struct mbufq		pace_q;		/* segments held until due */
+	uint64_t		pace_next_ns;	/* when the next may be sent */
 
 	/* timeouts */
-	uint64_t next_timeout;
+	struct timer_entry	timer;
+	uint64_t		timer_deadline;	/* UINT64_MAX if not armed */
+	bool			timer_dead;	/* never rearm the timer */
 	bool			ack_delayed;
 	bool			rcv_wnd_full;
 	uint64_t		ack_ts;
+
+	/* delayed ACKs (see tcp_set_ack_policy()), protected by @lock */
+	uint8_t			ack_policy;
+	bool			ack_quick;	/* the app was slow to read */
+	uint16_t		ack_every;	/* segments per ACK */
+	uint16_t		ack_segs;	/* segments since the last ACK */
+	uint32_t		ack_timeout;	/* the longest delay (us) */
 	uint64_t		time_wait_ts;
 	int			rep_acks;
 };
 
 extern tcpconn_t *tcp_conn_alloc(void);
+extern void tcp_conn_free(tcpconn_t *c);
 extern int tcp_conn_attach(tcpconn_t *c, struct netaddr laddr,
 			   struct netaddr raddr);
 extern void tcp_conn_ack(tcpconn_t *c, struct list_head *freeq);
+extern void tcp_conn_sack(tcpconn_t *c, const struct tcp_sack_block *blks,
+			  unsigned int nr);
 extern void tcp_conn_set_state(tcpconn_t *c, int new_state);
 extern void tcp_conn_fail(tcpconn_t *c, int err);
 extern void tcp_conn_shutdown_rx(tcpconn_t *c);
 extern void tcp_conn_destroy(tcpconn_t *c);
 
 extern void tcp_timer_update(tcpconn_t *c);
+extern void tcp_tw_start(tcpconn_t *c);
+
+/**
+ * tcp_snd_wnd - the usable send window
+ * @c: the TCP connection
+ *
+ * Returns the minimum of the peer's receive window, the congestion window,
+ * and the local send buffer size.
+ */
+static inline uint32_t tcp_snd_wnd(tcpconn_t *c)
+{
+	return min(min(c->pcb.snd_wnd, c->cwnd), c->snd_buf);
+}
+
+/**
+ * tcp_wscale_for_buf - picks a window scale shift for a receive buffer
+ * @buf: the receive buffer size in bytes
+ *
+ * Returns the smallest shift that can advertise the entire buffer.
+ */
+static inline uint8_t tcp_wscale_for_buf(uint32_t buf)
+{
+	uint8_t shift = 0;
+
+	while (shift < TCP_MAX_WSCALE && (buf >> shift) > UINT16_MAX)
+		shift++;
+	return shift;
+}
+
+/**
+ * tcp_flight_size - the number of unacknowledged bytes in flight
+ * @c: the TCP connection
+ */
+static inline uint32_t tcp_flight_size(tcpconn_t *c)
+{
+	return load_acquire(&c->pcb.snd_nxt) - c->pcb.snd_una;
+}
+
+
+/* the MSS for our MTU, which we advertise */
+extern unsigned int tcp_mss;
+
+/* the MSS for our MTU toward @addr, IPv6 headers take 20 more bytes */
+static inline unsigned int tcp_mss_for(const struct netaddr *addr)
+{
+	return tcp_mss + sizeof(struct ip_hdr) - net_ip_hdr_len(addr);
+}
+
+
+/*
+ * congestion control
+ */
+
+extern const struct tcp_cc_ops tcp_cc_newreno;
+extern const struct tcp_cc_ops tcp_cc_dctcp;
+extern const struct tcp_cc_ops *tcp_cc_default;
+
+extern void tcp_cc_init_conn(tcpconn_t *c);
 
 /**
  * tcp_conn_get - increments the connection ref count
@@ -141,8 +305,20 @@ static inline void tcp_conn_put(tcpconn_t *c)
  * ingress path
  */
 
+extern atomic_t tcp_half_open;
+extern int tcp_rx_init(void);
 extern void tcp_rx_conn(struct trans_entry *e, struct mbuf *m);
 extern tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m);
+extern void tcp_ooo_free(tcpconn_t *c);
+
+/**
+ * tcp_ooo_empty - returns true if no out-of-order segments are queued
+ * @c: the TCP connection
+ */
+static inline bool tcp_ooo_empty(tcpconn_t *c)
+{
+	return c->rxq_ooo.nr == 0;
+}
 
 
 /*
@@ -153,13 +329,32 @@ extern int tcp_tx_raw_rst(struct netaddr laddr, struct netaddr raddr,
 			  tcp_seq seq);
 extern int tcp_tx_raw_rst_ack(struct netaddr laddr, struct netaddr raddr,
 			      tcp_seq seq, tcp_seq ack);
+extern int tcp_tx_raw_ack(struct netaddr laddr, struct netaddr raddr,
+			  tcp_seq seq, tcp_seq ack, uint16_t win);
+extern int tcp_tx_raw_synack(struct netaddr laddr, struct netaddr raddr,
+			     tcp_seq seq, tcp_seq ack, bool sack, int wscale);
 extern int tcp_tx_ack(tcpconn_t *c);
 extern int tcp_tx_ctl(tcpconn_t *c, uint8_t flags);
 extern ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len,
 			   bool push);
+extern ssize_t tcp_tx_send_zc(tcpconn_t *c, struct tcp_tx_buf *b, size_t len);
 extern void tcp_tx_retransmit(tcpconn_t *c);
 extern struct mbuf *tcp_tx_fast_retransmit_start(tcpconn_t *c);
 extern void tcp_tx_fast_retransmit_finish(tcpconn_t *c, struct mbuf *m);
+extern void tcp_tx_pace_release(tcpconn_t *c, uint64_t now);
+extern void tcp_tx_flush_pending(tcpconn_t *c);
+
+/**
+ * tcp_tx_only_pending - returns true if the only unacknowledged data is held
+ * back in tx_pending
+ * @c: the TCP connection (@c->lock must be held)
+ */
+static inline bool tcp_tx_only_pending(tcpconn_t *c)
+{
+	assert_spin_lock_held(&c->lock);
+	return !c->tx_exclusive && c->tx_pending &&
+	       c->tx_pending->seg_seq == c->pcb.snd_una;
+}
 
 /*
  * utilities
@@ -0,0 +1,217 @@
+/*
+ * tcp_cc.c - TCP congestion control algorithms
+ *
+ * NewReno is based on RFC 5681 and RFC 6582. DCTCP is based on RFC 8257.
+ */
+
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+
+#include "tcp.h"
+
+/* DCTCP's congestion estimate is fixed point, scaled by this factor */
+#define DCTCP_MAX_ALPHA		1024U
+/* the estimation gain (g = 1 / 2^DCTCP_SHIFT_G) */
+#define DCTCP_SHIFT_G		4
+
+/* the algorithm used for new connections */
+const struct tcp_cc_ops *tcp_cc_default = &tcp_cc_newreno;
+
+static const struct tcp_cc_ops *tcp_cc_algs[] = {
+	&tcp_cc_newreno,
+	&tcp_cc_dctcp,
+};
+
+
+/*
+ * NewReno
+ */
+
+static void reno_init(tcpconn_t *c)
+{
+	c->cwnd = TCP_INIT_CWND(c);
+	c->ssthresh = UINT32_MAX;
+	c->cwnd_cnt = 0;
+}
+
+/* slow start and congestion avoidance (RFC 5681 Section 3.1) */
+static void reno_cong_avoid(tcpconn_t *c, uint32_t acked)
+{
+	/* don't grow the window while recovering from a loss */
+	if (c->in_recovery)
+		return;
+
+	if (c->cwnd < c->ssthresh) {
+		/* slow start: grow by at most one MSS per ACK */
+		c->cwnd += min(acked, c->mss);
+		return;
+	}
+
+	/* congestion avoidance: grow by about one MSS per RTT */
+	c->cwnd_cnt += acked;
+	if (c->cwnd_cnt >= c->cwnd) {
+		c->cwnd_cnt -= c->cwnd;
+		c->cwnd += c->mss;
+	}
+}
+
+static void reno_ack(tcpconn_t *c, uint32_t acked, bool ece)
+{
+	reno_cong_avoid(c, acked);
+}
+
+static void reno_loss(tcpconn_t *c)
+{
+	c->ssthresh = max(tcp_flight_size(c) / 2, TCP_MIN_CWND(c));
+	c->cwnd = c->ssthresh;
+	c->cwnd_cnt = 0;
+}
+
+static void reno_timeout(tcpconn_t *c)
+{
+	c->ssthresh = max(tcp_flight_size(c) / 2, TCP_MIN_CWND(c));
+	c->cwnd = c->mss;
+	c->cwnd_cnt = 0;
+}
+
+const struct tcp_cc_ops tcp_cc_newreno = {
+	.name		= "newreno",
+	.ecn		= false,
+	.init		= reno_init,
+	.ack		= reno_ack,
+	.loss		= reno_loss,
+	.timeout	= reno_timeout,
+};
+
+
+/*
+ * DCTCP
+ */
+
+static void dctcp_init(tcpconn_t *c)
+{
+	reno_init(c);
+	c->dctcp_alpha = DCTCP_MAX_ALPHA;
+	c->dctcp_acked = 0;
+	c->dctcp_marked = 0;
+	c->dctcp_next_seq = c->pcb.snd_nxt;
+}
+
+static void dctcp_ack(tcpconn_t *c, uint32_t acked, bool ece)
+{
+	uint32_t alpha;
+
+	/* fall back to NewReno behavior if the peer doesn't support ECN */
+	if (!c->ecn_ok) {
+		reno_cong_avoid(c, acked);
+		return;
+	}
+
+	c->dctcp_acked += acked;
+	if (ece)
+		c->dctcp_marked += acked;
+
+	/* update the estimate once per window of data (RFC 8257 Section 3.3) */
+	if (wraps_lt(c->pcb.snd_una, c->dctcp_next_seq)) {
+		if (!ece)
+			reno_cong_avoid(c, acked);
+		return;
+	}
+
+	alpha = c->dctcp_alpha;
+	alpha -= alpha >> DCTCP_SHIFT_G;
+	if (c->dctcp_marked) {
+		uint64_t frac = ((uint64_t)c->dctcp_marked * DCTCP_MAX_ALPHA) /
+				max(c->dctcp_acked, 1U);
+		alpha += frac >> DCTCP_SHIFT_G;
+	}
+	c->dctcp_alpha = min(alpha, DCTCP_MAX_ALPHA);
+
+	/* reduce the window in proportion to the extent of congestion */
+	if (c->dctcp_marked) {
+		c->cwnd -= ((uint64_t)c->cwnd * c->dctcp_alpha) /
+			   (2 * DCTCP_MAX_ALPHA);
+		c->cwnd = max(c->cwnd, TCP_MIN_CWND(c));
+		c->ssthresh = c->cwnd;
+		c->cwnd_cnt = 0;
+	} else {
+		reno_cong_avoid(c, acked);
+	}
+
+	c->dctcp_acked = 0;
+	c->dctcp_marked = 0;
+	c->dctcp_next_seq = load_acquire(&c->pcb.snd_nxt);
+}
+
+const struct tcp_cc_ops tcp_cc_dctcp = {
+	.name		= "dctcp",
+	.ecn		= true,
+	.init		= dctcp_init,
+	.ack		= dctcp_ack,
+	.loss		= reno_loss,
+	.timeout	= reno_timeout,
+};
+
+
+/**
+ * tcp_cc_init_conn - initializes congestion control for a new connection
+ * @c: the TCP connection
+ */
+void tcp_cc_init_conn(tcpconn_t *c)
+{
+	c->cc = tcp_cc_default;
+	c->in_recovery = false;
+	c->recover = c->pcb.snd_nxt;
+	c->ecn_ok = false;
+	c->ecn_ce = false;
+	c->dctcp_alpha = 0;
+	c->cc->init(c);
+}
+
+/**
+ * tcp_cc_set_default - selects the congestion control algorithm by name
+ * @name: the name of the algorithm (e.g. "newreno" or "dctcp")
+ *
+ * Only affects connections created afterward.
+ *
+ * Returns 0 if successful, or -EINVAL if the algorithm is unknown.
+ */
+int tcp_cc_set_default(const char *name)
+{
+	size_t len;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tcp_cc_algs); i++) {
+		len = strlen(tcp_cc_algs[i]->name);
+		if (strncmp(name, tcp_cc_algs[i]->name, len) == 0 &&
+		    (name[len] == '\0' || name[len] == '\n')) {
+			tcp_cc_default = tcp_cc_algs[i];
+			return 0;
+		}
+	}
+
+	log_err("tcp: unknown congestion control algorithm '%s'", name);
+	return -EINVAL;
+}
+
+/**
+ * tcp_get_cc_stats - reads congestion control state for a connection
+ * @c: the TCP connection
+ * @stats: a pointer to store the state
+ */
+void tcp_get_cc_stats(tcpconn_t *c, struct tcp_cc_stats *stats)
+{
+	spin_lock_np(&c->lock);
+	stats->cwnd = c->cwnd;
+	stats->ssthresh = c->ssthresh;
+	stats->snd_wnd = c->pcb.snd_wnd;
+	stats->in_flight = tcp_flight_size(c);
+	stats->dctcp_alpha = c->dctcp_alpha;
+	stats->ecn = c->ecn_ok;
+	stats->srtt_us = c->srtt;
+	stats->rttvar_us = c->rttvar;
+	stats->rto_us = c->rto;
+	spin_unlock_np(&c->lock);
+}
@@ -1,5 +1,5 @@
 /*
- * tcp_debug.c - prints TCP debug information
+ * tcp_debug.c - prints TCP debug information and connection states
  */
 
 #include <string.h>
@@ -9,6 +9,33 @@
 
 #include "tcp.h"
 
+/* must correspond to the TCP_STATE_* enum in runtime/tcp.h */
+static const char *state_names[] = {
+	"SYN-SENT",
+	"SYN-RECEIVED",
+	"ESTABLISHED",
+	"FIN-WAIT1",
+	"FIN-WAIT2",
+	"CLOSE-WAIT",
+	"CLOSING",
+	"LAST-ACK",
+	"TIME-WAIT",
+	"CLOSED",
+};
+
+BUILD_ASSERT(ARRAY_SIZE(state_names) == TCP_STATE_CLOSED + 1);
+
+/**
+ * tcp_state_name - gets the RFC 793 name of a connection state
+ * @state: one of TCP_STATE_*
+ */
+const char *tcp_state_name(int state)
+{
+	if (unlikely(state < 0 || state > TCP_STATE_CLOSED))
+		return "UNKNOWN";
+	return state_names[state];
+}
+
 #if defined(DEBUG)
 #define TCP_FLAG_STR_LEN 25
 
@@ -62,8 +89,8 @@ static void tcp_flags_to_str(uint8_t flags, char *str)
 static void tcp_dump_pkt(tcpconn_t *c, const struct tcp_hdr *tcphdr,
 			 uint32_t len, bool egress)
 {
-	char in_ip[IP_ADDR_STR_LEN];
-	char out_ip[IP_ADDR_STR_LEN];
+	char in_ip[NETADDR_IP_STR_LEN];
+	char out_ip[NETADDR_IP_STR_LEN];
 	char flags[TCP_FLAG_STR_LEN];
 	uint32_t ack, seq;
 	uint16_t in_port, out_port;
@@ -72,15 +99,15 @@ static void tcp_dump_pkt(tcpconn_t *c, const struct tcp_hdr *tcphdr,
 	wnd = ntoh16(tcphdr->win);
 
 	if (egress) {
-		ip_addr_to_str(c->e.laddr.ip, in_ip);
-		ip_addr_to_str(c->e.raddr.ip, out_ip);
+		netaddr_ip_to_str(&c->e.laddr, in_ip);
+		netaddr_ip_to_str(&c->e.raddr, out_ip);
 		ack = ntoh32(tcphdr->ack) - c->pcb.irs;
 		seq = ntoh32(tcphdr->seq) - c->pcb.iss;
 		in_port = c->e.laddr.port;
 		out_port = c->e.raddr.port;
 	} else {
-		ip_addr_to_str(c->e.laddr.ip, out_ip);
-		ip_addr_to_str(c->e.raddr.ip, in_ip);
+		netaddr_ip_to_str(&c->e.laddr, out_ip);
+		netaddr_ip_to_str(&c->e.raddr, in_ip);
 		ack = ntoh32(tcphdr->ack) - c->pcb.iss;
 		seq = ntoh32(tcphdr->seq) - c->pcb.irs;
 		out_port = c->e.laddr.port;
@@ -110,19 +137,6 @@ void tcp_debug_ingress_pkt(tcpconn_t *c, struct mbuf *m)
 		     mbuf_length(m), false);
 }
 
-static const char *state_names[] = {
-	"SYN-SENT",
-	"SYN-RECEIVED",
-	"ESTABLISHED",
-	"FIN-WAIT1",
-	"FIN-WAIT2",
-	"CLOSE-WAIT",
-	"CLOSING",
-	"LAST-ACK",
-	"TIME-WAIT",
-	"CLOSED",
-};
-
 /* prints a TCP state change */
 void tcp_debug_state_change(tcpconn_t *c, int last, int next)
 {
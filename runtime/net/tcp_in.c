@@ -1,13 +1,19 @@
 /*
  * tcp_in.c - the ingress datapath for TCP
  *
- * Based on RFC 793 and RFC 1122 (errata).
+ * Based on RFC 793 and RFC 1122 (errata). SACK is based on RFC 2018.
  *
  * FIXME: We do too little to prevent heavy fragmentation in the out-of-order
  * RX queue.
  */
 
+#include <string.h>
+#include <sys/random.h>
+
 #include <base/stddef.h>
+#include <base/hash.h>
+#include <base/log.h>
+#include <runtime/overload.h>
 #include <runtime/smalloc.h>
 #include <net/ip.h>
 #include <net/tcp.h>
@@ -15,6 +21,292 @@
 #include "tcp.h"
 #include "defs.h"
 
+/* options parsed from an ingress segment */
+struct tcp_options {
+	uint16_t		mss;	/* 0 if not present */
+	bool			sack_permitted;
+	bool			wscale_ok;
+	uint8_t			wscale;
+	unsigned int		sack_nr;
+	struct tcp_sack_block	sacks[TCP_SACK_MAX_BLOCKS];
+};
+
+/* parses the TCP options following @tcphdr (must be within the mbuf) */
+static void tcp_parse_options(const struct tcp_hdr *tcphdr,
+			      struct tcp_options *opts)
+{
+	const uint8_t *pos = (const uint8_t *)(tcphdr + 1);
+	const uint8_t *end = (const uint8_t *)tcphdr + tcphdr->off * 4;
+	uint32_t seq;
+	uint16_t mss;
+	int i, len;
+
+	opts->mss = 0;
+	opts->sack_permitted = false;
+	opts->wscale_ok = false;
+	opts->wscale = 0;
+	opts->sack_nr = 0;
+
+	while (pos < end) {
+		if (*pos == TCPOPT_EOL)
+			break;
+		if (*pos == TCPOPT_NOP) {
+			pos++;
+			continue;
+		}
+		if (end - pos < 2)
+			break;
+		len = pos[1];
+		if (len < 2 || len > end - pos)
+			break;
+
+		switch (*pos) {
+		case TCPOPT_MAXSEG:
+			if (len != TCPOLEN_MAXSEG)
+				break;
+			memcpy(&mss, pos + 2, 2);
+			opts->mss = ntoh16(mss);
+			break;
+
+		case TCPOPT_WINDOW:
+			if (len != TCPOLEN_WINDOW)
+				break;
+			opts->wscale_ok = true;
+			opts->wscale = min(pos[2], (uint8_t)TCP_MAX_WSCALE);
+			break;
+
+		case TCPOPT_SACK_PERMITTED:
+			if (len == TCPOLEN_SACK_PERMITTED)
+				opts->sack_permitted = true;
+			break;
+
+		case TCPOPT_SACK:
+			if ((len - TCPOLEN_SACKHDR) % TCPOLEN_SACK != 0)
+				break;
+			opts->sack_nr = min((len - TCPOLEN_SACKHDR) /
+					    TCPOLEN_SACK, TCP_SACK_MAX_BLOCKS);
+			for (i = 0; i < opts->sack_nr; i++) {
+				memcpy(&seq, pos + 2 + i * TCPOLEN_SACK, 4);
+				opts->sacks[i].start = ntoh32(seq);
+				memcpy(&seq, pos + 6 + i * TCPOLEN_SACK, 4);
+				opts->sacks[i].end = ntoh32(seq);
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		pos += len;
+	}
+}
+
+/* applies the window scale option from the peer's SYN (RFC 7323 Section 2.2) */
+static void tcp_wscale_negotiate(tcpconn_t *c, const struct tcp_options *opts)
+{
+	c->wscale_ok = opts->wscale_ok;
+	c->snd_wscale = opts->wscale_ok ? opts->wscale : 0;
+}
+
+/* sends segments no larger than the MSS in the peer's SYN (RFC 9293 3.7.1) */
+static void tcp_mss_negotiate(tcpconn_t *c, const struct tcp_options *opts,
+			      const struct netaddr *raddr)
+{
+	uint32_t mss = opts->mss ? max(opts->mss, TCP_MIN_MSS) : TCP_DEFAULT_MSS;
+
+	c->mss = min(mss, tcp_mss_for(raddr));
+	/* nothing was sent yet, so the initial window can be resized */
+	c->cwnd = TCP_INIT_CWND(c);
+}
+
+/* returns true if received data should be acknowledged without delay */
+static bool tcp_rx_ack_now(tcpconn_t *c)
+{
+	switch (c->ack_policy) {
+	case TCP_ACK_QUICK:
+		return true;
+	case TCP_ACK_EVERY:
+		return c->ack_segs >= c->ack_every;
+	case TCP_ACK_ADAPTIVE:
+		return c->ack_quick;
+	default:
+		return false;
+	}
+}
+
+/* the peer's advertised window, SYN segments are never scaled */
+static uint32_t tcp_peer_wnd(tcpconn_t *c, const struct tcp_hdr *tcphdr)
+{
+	uint32_t wnd = ntoh16(tcphdr->win);
+
+	if (!(tcphdr->flags & TCP_SYN))
+		wnd <<= c->snd_wscale;
+	return wnd;
+}
+
+
+/*
+ * Out-of-order segment array
+ */
+
+static struct mbuf *tcp_ooo_top(struct tcp_ooo *q)
+{
+	return q->nr > 0 ? q->segs[q->head] : NULL;
+}
+
+static void tcp_ooo_pop(struct tcp_ooo *q)
+{
+	assert(q->nr > 0);
+	q->head++;
+	q->nr--;
+
+	/* release the array once it drains to keep idle connections small */
+	if (q->nr == 0) {
+		sfree(q->segs);
+		q->segs = NULL;
+		q->head = q->cap = 0;
+	}
+}
+
+/* makes room for at least one more segment at the end of the array */
+static bool tcp_ooo_reserve(struct tcp_ooo *q)
+{
+	struct mbuf **segs;
+	unsigned int cap;
+
+	if (q->head + q->nr < q->cap)
+		return true;
+
+	/* compact the array if space was freed at the front */
+	if (q->head > 0) {
+		memmove(q->segs, &q->segs[q->head], q->nr * sizeof(*q->segs));
+		q->head = 0;
+		return true;
+	}
+
+	cap = max(q->cap * 2, TCP_OOO_MIN_CAPACITY);
+	segs = smalloc(cap * sizeof(*segs));
+	if (unlikely(!segs))
+		return false;
+	if (q->segs) {
+		memcpy(segs, q->segs, q->nr * sizeof(*segs));
+		sfree(q->segs);
+	}
+	q->segs = segs;
+	q->cap = cap;
+	return true;
+}
+
+/*
+ * Inserts a segment sorted by sequence number, returning false if it was
+ * already covered by a queued segment or if the queue is full.
+ */
+static bool tcp_ooo_insert(struct tcp_ooo *q, struct mbuf *m)
+{
+	unsigned int lo = 0, hi = q->nr, mid;
+	struct mbuf **segs;
+
+	/* find the first segment that starts after @m */
+	segs = &q->segs[q->head];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (wraps_lt(m->seg_seq, segs[mid]->seg_seq))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	/* is the text already covered by the previous segment? */
+	if (lo > 0 && wraps_lte(m->seg_end, segs[lo - 1]->seg_end))
+		return false;
+
+	if (q->nr >= TCP_OOO_MAX_SIZE || !tcp_ooo_reserve(q))
+		return false;
+
+	segs = &q->segs[q->head];
+	memmove(&segs[lo + 1], &segs[lo], (q->nr - lo) * sizeof(*segs));
+	segs[lo] = m;
+	q->nr++;
+	return true;
+}
+
+/**
+ * tcp_ooo_free - frees all queued out-of-order segments
+ * @c: the TCP connection
+ */
+void tcp_ooo_free(tcpconn_t *c)
+{
+	struct mbuf *m;
+
+	while ((m = tcp_ooo_top(&c->rxq_ooo))) {
+		tcp_ooo_pop(&c->rxq_ooo);
+		mbuf_free(m);
+	}
+}
+
+
+/*
+ * SACK block generation
+ */
+
+static void tcp_sack_store(tcpconn_t *c, const struct tcp_sack_block *blks,
+			   unsigned int nr)
+{
+	unsigned int i;
+
+	/* tcp_tx_ack() reads the blocks without holding the lock */
+	for (i = 0; i < nr; i++)
+		ACCESS_ONCE(c->rx_sacks[i].raw) = blks[i].raw;
+	store_release(&c->rx_sack_nr, nr);
+}
+
+/* records newly received out-of-order text as the first SACK block */
+static void tcp_sack_update(tcpconn_t *c, uint32_t start, uint32_t end)
+{
+	struct tcp_sack_block blks[TCP_SACK_MAX_BLOCKS], b;
+	unsigned int i, nr = 1;
+
+	assert_spin_lock_held(&c->lock);
+
+	blks[0].start = start;
+	blks[0].end = end;
+	for (i = 0; i < c->rx_sack_nr; i++) {
+		b = c->rx_sacks[i];
+
+		/* merge overlapping or adjacent blocks */
+		if (wraps_lte(b.start, blks[0].end) &&
+		    wraps_lte(blks[0].start, b.end)) {
+			if (wraps_lt(b.start, blks[0].start))
+				blks[0].start = b.start;
+			if (wraps_gt(b.end, blks[0].end))
+				blks[0].end = b.end;
+			continue;
+		}
+
+		if (nr < TCP_SACK_MAX_BLOCKS)
+			blks[nr++] = b;
+	}
+
+	tcp_sack_store(c, blks, nr);
+}
+
+/* drops SACK blocks that are now covered by the cumulative ACK */
+static void tcp_sack_prune(tcpconn_t *c)
+{
+	struct tcp_sack_block blks[TCP_SACK_MAX_BLOCKS];
+	unsigned int i, nr = 0;
+
+	assert_spin_lock_held(&c->lock);
+
+	for (i = 0; i < c->rx_sack_nr; i++) {
+		if (wraps_gt(c->rx_sacks[i].end, c->pcb.rcv_nxt))
+			blks[nr++] = c->rx_sacks[i];
+	}
+
+	if (nr != c->rx_sack_nr)
+		tcp_sack_store(c, blks, nr);
+}
+
 /* four cases for the acceptability test for an incoming segment */
 static bool is_acceptable(tcpconn_t *c, uint32_t len, uint32_t seq)
 {
@@ -41,7 +333,29 @@ static bool is_snd_full(tcpconn_t *c)
 {
 	assert_spin_lock_held(&c->lock);
 
-	return wraps_lte(c->pcb.snd_una + c->pcb.snd_wnd, c->pcb.snd_nxt);
+	return wraps_lte(c->pcb.snd_una + tcp_snd_wnd(c), c->pcb.snd_nxt);
+}
+
+/* updates congestion state after new data was acknowledged */
+static void tcp_rx_cc_ack(tcpconn_t *c, uint32_t acked, bool ece,
+			  struct mbuf **retransmit)
+{
+	assert_spin_lock_held(&c->lock);
+
+	if (c->in_recovery) {
+		if (wraps_gte(c->pcb.snd_una, c->recover)) {
+			/* a full ACK ends fast recovery (RFC 6582) */
+			c->in_recovery = false;
+		} else if (c->tx_exclusive) {
+			/* a partial ACK retransmits the next hole */
+			c->do_fast_retransmit = true;
+			c->fast_retransmit_last_ack = c->pcb.snd_una;
+		} else {
+			*retransmit = tcp_tx_fast_retransmit_start(c);
+		}
+	}
+
+	c->cc->ack(c, acked, ece && c->ecn_ok);
 }
 
 /* see reset generation (RFC 793) */
@@ -79,6 +393,12 @@ static void tcp_rx_append_text(tcpconn_t *c, struct mbuf *m)
 		m->seg_end = c->pcb.rcv_nxt + c->pcb.rcv_wnd;
 	}
 
+	/* transform the text in place before it becomes readable */
+	if (c->xform && c->xform->rx) {
+		c->xform->rx(c->xform_arg, m->seg_seq - c->pcb.irs - 1,
+			     mbuf_data(m), mbuf_length(m));
+	}
+
 	/* enqueue the text */
 	assert(c->pcb.rcv_wnd >= m->seg_end - m->seg_seq);
 	uint64_t nxt_wnd =  (uint64_t)m->seg_end | ((uint64_t)(c->pcb.rcv_wnd - (m->seg_end - m->seg_seq)) << 32);
@@ -108,33 +428,21 @@ static bool tcp_rx_text(tcpconn_t *c, struct mbuf *m, bool *wake)
 	} else {
 		/* we got an out-of-order segment */
 		STAT(RX_TCP_OUT_OF_ORDER)++;
-		int size = 0;
-		list_for_each(&c->rxq_ooo, pos, link) {
-			if (wraps_lt(m->seg_seq, pos->seg_seq)) {
-				list_add_before(&pos->link, &m->link);
-				goto drain;
-			} else if (wraps_lte(m->seg_end, pos->seg_end)) {
-				return false;
-			}
-			size++;
-		}
-
-		if (size >= TCP_OOO_MAX_SIZE)
-			 return false;
-
- 		list_add_tail(&c->rxq_ooo, &m->link);
+		if (!tcp_ooo_insert(&c->rxq_ooo, m))
+			return false;
+		if (c->sack_ok)
+			tcp_sack_update(c, m->seg_seq, m->seg_end);
 	}
 
-drain:
 	/* attempt to drain the out-of-order RX queue */
 	while (true) {
-		pos = list_top(&c->rxq_ooo, struct mbuf, link);
+		pos = tcp_ooo_top(&c->rxq_ooo);
 		if (!pos)
 			break;
 
 		/* has the segment been fully received already? */
 		if (wraps_lte(pos->seg_end, c->pcb.rcv_nxt)) {
-			list_del(&pos->link);
+			tcp_ooo_pop(&c->rxq_ooo);
 			mbuf_free(pos);
 			continue;
 		}
@@ -144,12 +452,15 @@ drain:
 			break;
 
 		/* we got the next in-order segment */
-		list_del(&pos->link);
-		if ((m->flags & (TCP_PUSH | TCP_FIN)) > 0)
+		tcp_ooo_pop(&c->rxq_ooo);
+		if ((pos->flags & (TCP_PUSH | TCP_FIN)) > 0)
 			*wake = true;
 		tcp_rx_append_text(c, pos);
 	}
 
+	if (c->rx_sack_nr > 0)
+		tcp_sack_prune(c);
+
 	if (c->pcb.rcv_wnd == 0)
 		*wake = true;
 
@@ -163,11 +474,10 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	struct list_head q, waiters;
 	thread_t *rx_th = NULL;
 	struct mbuf *retransmit = NULL;
-	const struct ip_hdr *iphdr;
 	const struct tcp_hdr *tcphdr;
-	uint32_t seq, ack, len, snd_nxt, hdr_len;
-	uint16_t win;
-	bool do_ack = false, do_drop = true;
+	struct tcp_options opts;
+	uint32_t seq, ack, len, snd_nxt, hdr_len, win;
+	bool do_ack = false, do_drop = true, do_tw = false;
 	int ret;
 
 	assert_preempt_disabled();
@@ -177,7 +487,6 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	snd_nxt = load_acquire(&c->pcb.snd_nxt);
 
 	/* find header offsets */
-	iphdr = mbuf_network_hdr(m, *iphdr);
 	tcphdr = mbuf_pull_hdr_or_null(m, *tcphdr);
 	if (unlikely(!tcphdr)) {
 		mbuf_free(m);
@@ -187,19 +496,20 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	/* parse header */
 	seq = ntoh32(tcphdr->seq);
 	ack = ntoh32(tcphdr->ack);
-	win = ntoh16(tcphdr->win);
 	hdr_len = tcphdr->off * 4;
-	if (unlikely(hdr_len < sizeof(struct tcp_hdr))) {
+	if (unlikely(hdr_len < sizeof(struct tcp_hdr) ||
+		     hdr_len - sizeof(struct tcp_hdr) > mbuf_length(m))) {
 		mbuf_free(m);
 		return;
 	}
-	len = ntoh16(iphdr->len) - sizeof(*iphdr) - hdr_len;
+	len = net_rx_l4_len(m) - hdr_len;
 	if (unlikely(len > mbuf_length(m))) {
 		mbuf_free(m);
 		return;
 	}
 	if (unlikely((tcphdr->flags & TCP_FIN) > 0))
 		len++;
+	tcp_parse_options(tcphdr, &opts);
 	mbuf_pull(m, hdr_len - sizeof(struct tcp_hdr)); /* strip off options */
 
 	spin_lock_np(&c->lock);
@@ -231,12 +541,19 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 		if ((tcphdr->flags & TCP_SYN) > 0) {
 			c->pcb.rcv_nxt = seq + 1;
 			c->pcb.irs = seq;
+			tcp_wscale_negotiate(c, &opts);
+			tcp_mss_negotiate(c, &opts, &c->e.raddr);
 			if ((tcphdr->flags & TCP_ACK) > 0) {
 				c->pcb.snd_una = ack;
 				tcp_conn_ack(c, &q);
+				c->ecn_ok = c->cc->ecn &&
+					    (tcphdr->flags & (TCP_ECE | TCP_CWR)) ==
+					    TCP_ECE;
+				c->sack_ok = opts.sack_permitted;
 			}
 			if (wraps_gt(c->pcb.snd_una, c->pcb.iss)) {
 				do_ack = true;
+				win = tcp_peer_wnd(c, tcphdr);
 				c->pcb.snd_wnd = win > 1 ? win - 2 : 0; // reserve 1 byte for FIN and one byte for the sequence number on an RST packet
 				c->pcb.snd_wl1 = seq;
 				c->pcb.snd_wl2 = ack;
@@ -291,11 +608,24 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 			do_drop = true;
 			goto done;
 		}
+		win = tcp_peer_wnd(c, tcphdr);
 		c->pcb.snd_wnd = win > 1 ? win - 2 : 0; // reserve 1 byte for FIN and one byte for the sequence number on an RST packet
 		c->pcb.snd_wl1 = seq;
 		c->pcb.snd_wl2 = ack;
 		tcp_conn_set_state(c, TCP_STATE_ESTABLISHED);
 	}
+	/* record data the peer has selectively acknowledged */
+	if (c->sack_ok && opts.sack_nr > 0) {
+		if (c->tx_exclusive) {
+			/* the writer will apply them when it finishes */
+			memcpy(c->tx_sacks, opts.sacks,
+			       opts.sack_nr * sizeof(*opts.sacks));
+			c->tx_sack_nr = opts.sack_nr;
+		} else {
+			tcp_conn_sack(c, opts.sacks, opts.sack_nr);
+		}
+	}
+
 	/*
 	 * Detect a duplicate ACK if:
 	 * 1. The ACK number is the same as the largest seen.
@@ -304,10 +634,16 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	 * 4. There is no window update.
 	 */
 	if (ack == c->pcb.snd_una &&
-	    c->pcb.snd_una != c->pcb.snd_nxt &&
+	    c->pcb.snd_una != c->pcb.snd_nxt && !tcp_tx_only_pending(c) &&
 	    len == 0) {
 		c->rep_acks++;
 		if (c->rep_acks >= TCP_FAST_RETRANSMIT_THRESH) {
+			/* reduce the congestion window once per recovery */
+			if (!c->in_recovery) {
+				c->in_recovery = true;
+				c->recover = snd_nxt;
+				c->cc->loss(c);
+			}
 			if (c->tx_exclusive) {
 				c->do_fast_retransmit = true;
 				c->fast_retransmit_last_ack = ack;
@@ -320,10 +656,14 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	bool snd_was_full = is_snd_full(c);
 	if (wraps_lte(c->pcb.snd_una, ack) &&
 	    wraps_lte(ack, snd_nxt)) {
+		uint32_t acked = ack - c->pcb.snd_una;
 		if (c->pcb.snd_una != ack)
 			c->rep_acks = 0;
 		c->pcb.snd_una = ack;
 		tcp_conn_ack(c, &q);
+		if (acked > 0)
+			tcp_rx_cc_ack(c, acked,
+				      (tcphdr->flags & TCP_ECE) > 0, &retransmit);
 	} else if (wraps_gt(ack, snd_nxt)) {
 		do_ack = true;
 		goto done;
@@ -332,13 +672,20 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	if (wraps_lt(c->pcb.snd_wl1, seq) ||
 	    (c->pcb.snd_wl1 == seq &&
 	     wraps_lte(c->pcb.snd_wl2, ack))) {
+		win = tcp_peer_wnd(c, tcphdr);
 		c->pcb.snd_wnd = win > 1 ? win - 2 : 0; // reserve 1 byte for FIN and one byte for the sequence number on an RST packet
 		c->pcb.snd_wl1 = seq;
 		c->pcb.snd_wl2 = ack;
 		c->rep_acks = 0;
 	}
-	if (snd_was_full && !is_snd_full(c))
+	if (snd_was_full && !is_snd_full(c)) {
 		waitq_release_start(&c->tx_wq, &waiters);
+		poll_set(&c->poll, POLL_OUT);
+	}
+
+	/* autocork: everything in flight was acked, so send what was held */
+	if (c->cork == TCP_CORK_AUTO && tcp_tx_only_pending(c))
+		tcp_tx_flush_pending(c);
 
 	if (c->pcb.state == TCP_STATE_FIN_WAIT1 &&
 	    c->pcb.snd_una == snd_nxt) {
@@ -347,6 +694,7 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 		   c->pcb.snd_una == snd_nxt) {
 		c->time_wait_ts = microtime();
 		tcp_conn_set_state(c, TCP_STATE_TIME_WAIT);
+		do_tw = c->app_closed;
 	} else if (c->pcb.state == TCP_STATE_LAST_ACK &&
 		   c->pcb.snd_una == snd_nxt) {
 		tcp_conn_set_state(c, TCP_STATE_CLOSED);
@@ -365,6 +713,18 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 		m->seg_seq = seq;
 		m->seg_end = seq + len;
 		m->flags = tcphdr->flags;
+		c->rx_k = myk();
+		c->rx_hash = m->rss_hash;
+
+		/* track congestion experienced marks for ECN-Echo */
+		if (c->ecn_ok) {
+			bool ce = (net_rx_tos(m) & IPTOS_ECN_MASK) ==
+				  IPTOS_ECN_CE;
+			if (ce != c->ecn_ce) {
+				c->ecn_ce = ce;
+				do_ack = true;
+			}
+		}
 
 #ifdef TCP_RX_STATS
 		uint64_t before_tsc = rdtsc();
@@ -378,12 +738,17 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 			assert(!list_empty(&c->rxq));
 			assert(do_drop == false);
 			rx_th = waitq_signal(&c->rx_wq, &c->lock);
+			poll_set(&c->poll, POLL_IN);
 		}
-		if (!c->ack_delayed) {
+		STAT(TCP_RX_BYTES) += len;
+		c->ack_segs++;
+		if (tcp_rx_ack_now(c))
+			do_ack = true;
+		else if (!c->ack_delayed) {
 			c->ack_delayed = true;
 			c->ack_ts = microtime();
 		}
-		do_ack |= !list_empty(&c->rxq_ooo);
+		do_ack |= !tcp_ooo_empty(c);
 	}
 
 	/* step 8 - FIN */
@@ -399,9 +764,15 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 		c->time_wait_ts = microtime();
 		do_ack = true;
 		tcp_conn_set_state(c, TCP_STATE_TIME_WAIT);
+		do_tw = c->app_closed;
 	}
 
 done:
+	if (do_ack) {
+		/* the ACK sent below covers everything received so far */
+		c->ack_delayed = false;
+		c->ack_segs = 0;
+	}
 	tcp_timer_update(c);
 	tcp_debug_ingress_pkt(c, m);
 	spin_unlock_np(&c->lock);
@@ -414,32 +785,252 @@ done:
 	tcp_tx_fast_retransmit_finish(c, retransmit);
 	if (do_ack)
 		tcp_tx_ack(c);
+	if (do_tw)
+		tcp_tw_start(c);
 	if (do_drop)
 		mbuf_free(m);
 }
 
+
+/*
+ * SYN cookies
+ *
+ * Once more than tcp_syn_backlog connections are half-open, listeners stop
+ * allocating connections for SYNs. Instead, they answer with a SYN/ACK whose
+ * sequence number encodes the handshake state, and create the connection only
+ * when the final ACK returns it. The cookie is laid out as:
+ *
+ *   [31:27] a coarse timestamp, [26:25] the peer's MSS rounded down to an entry
+ *   of tcp_cookie_mss(), [24] SACK permitted, [23:20] the peer's window scale
+ *   (or TCP_COOKIE_NO_WSCALE), [19:0] a keyed hash of the above and the
+ *   connection's addresses and initial receive sequence number.
+ *
+ * The hash is SipHash-2-4 with a random key for each cookie period, so cookies
+ * can't be forged by observing others. The key of the previous period is kept
+ * so its cookies are still accepted.
+ *
+ * Connections created from cookies don't use ECN.
+ */
+
+#define TCP_COOKIE_PERIOD	(64 * ONE_SECOND)
+#define TCP_COOKIE_TS_SHIFT	27
+#define TCP_COOKIE_INFO_SHIFT	20
+#define TCP_COOKIE_HASH_MASK	((1U << TCP_COOKIE_INFO_SHIFT) - 1)
+#define TCP_COOKIE_NO_WSCALE	15
+#define TCP_COOKIE_MSS_SHIFT	5
+#define TCP_COOKIE_NR_MSS	3
+
+/* the number of connections in SYN_RECEIVED created by listeners */
+atomic_t tcp_half_open;
+/* the SipHash keys for SYN cookies, indexed by the low bit of the period */
+static uint64_t tcp_cookie_keys[2][2];
+/* the latest period with a key */
+static uint64_t tcp_cookie_key_period;
+static DEFINE_SPINLOCK(tcp_cookie_lock);
+/* the last time a cookie was sent (cookies are only accepted shortly after) */
+static uint64_t tcp_cookie_last_us;
+
+static int tcp_cookie_rekey(uint64_t *key)
+{
+	if (getrandom(key, sizeof(tcp_cookie_keys[0]), 0) !=
+	    sizeof(tcp_cookie_keys[0]))
+		return -errno;
+	return 0;
+}
+
+/* returns the key for cookies of @period, making new keys as periods pass */
+static const uint64_t *tcp_cookie_key(uint64_t period)
+{
+	uint64_t last;
+
+	if (likely(period <= load_acquire(&tcp_cookie_key_period)))
+		return tcp_cookie_keys[period & 1];
+
+	spin_lock_np(&tcp_cookie_lock);
+	last = tcp_cookie_key_period;
+	if (period > last) {
+		/* on failure the old key stays, which is still secret */
+		if (tcp_cookie_rekey(tcp_cookie_keys[period & 1]))
+			log_err_once("tcp: couldn't make a SYN cookie key");
+		/* no cookies were made in the previous period */
+		if (period - last > 1)
+			tcp_cookie_rekey(tcp_cookie_keys[(period - 1) & 1]);
+		store_release(&tcp_cookie_key_period, period);
+	}
+	spin_unlock_np(&tcp_cookie_lock);
+
+	return tcp_cookie_keys[period & 1];
+}
+
+/**
+ * tcp_rx_init - initializes ingress state
+ *
+ * Returns 0 if successful.
+ */
+int tcp_rx_init(void)
+{
+	int ret;
+
+	atomic_write(&tcp_half_open, 0);
+	tcp_cookie_key_period = microtime() / TCP_COOKIE_PERIOD;
+	ret = tcp_cookie_rekey(tcp_cookie_keys[0]);
+	if (!ret)
+		ret = tcp_cookie_rekey(tcp_cookie_keys[1]);
+	if (ret)
+		log_err("tcp: couldn't generate SYN cookie keys, ret = %d", ret);
+	return ret;
+}
+
+/* the MSS values a cookie can encode, in increasing order */
+static uint32_t tcp_cookie_mss(unsigned int idx)
+{
+	switch (idx) {
+	case 0:
+		return TCP_DEFAULT_MSS;
+	case 1:
+		return min(TCP_MSS_STD, tcp_mss);
+	default:
+		return tcp_mss;
+	}
+}
+
+static uint32_t tcp_cookie_hash(struct netaddr laddr, struct netaddr raddr,
+				tcp_seq irs, uint32_t ts_info, uint64_t period)
+{
+	uint64_t w[7];
+	size_t nr = 0;
+
+	if (raddr.family == NET_AF_INET6) {
+		memcpy(&w[0], laddr.ip6.addr, sizeof(laddr.ip6));
+		memcpy(&w[2], raddr.ip6.addr, sizeof(raddr.ip6));
+		nr = 4;
+	}
+	w[nr++] = (uint64_t)laddr.ip | ((uint64_t)laddr.port << 32);
+	w[nr++] = (uint64_t)raddr.ip | ((uint64_t)raddr.port << 32);
+	w[nr++] = (uint64_t)irs | ((uint64_t)ts_info << 32);
+	return siphash24(tcp_cookie_key(period), w, nr) & TCP_COOKIE_HASH_MASK;
+}
+
+static tcp_seq tcp_cookie_make(struct netaddr laddr, struct netaddr raddr,
+			       tcp_seq irs, const struct tcp_options *opts)
+{
+	uint64_t period = microtime() / TCP_COOKIE_PERIOD;
+	uint32_t ts = period & 0x1f;
+	uint32_t info = opts->wscale_ok ? opts->wscale : TCP_COOKIE_NO_WSCALE;
+	uint32_t ts_info, mss = opts->mss ? opts->mss : TCP_DEFAULT_MSS;
+	unsigned int idx = TCP_COOKIE_NR_MSS - 1;
+
+	ACCESS_ONCE(tcp_cookie_last_us) = microtime();
+	info |= opts->sack_permitted ? 0x10 : 0;
+	while (idx > 0 && tcp_cookie_mss(idx) > mss)
+		idx--;
+	info |= idx << TCP_COOKIE_MSS_SHIFT;
+	ts_info = (ts << TCP_COOKIE_TS_SHIFT) | (info << TCP_COOKIE_INFO_SHIFT);
+	return ts_info | tcp_cookie_hash(laddr, raddr, irs, ts_info, period);
+}
+
+/* returns true if @cookie is valid, filling in the negotiated options */
+static bool tcp_cookie_check(struct netaddr laddr, struct netaddr raddr,
+			     tcp_seq irs, tcp_seq cookie,
+			     struct tcp_options *opts)
+{
+	uint64_t period = microtime() / TCP_COOKIE_PERIOD;
+	uint32_t age = (period - (cookie >> TCP_COOKIE_TS_SHIFT)) & 0x1f;
+	uint32_t ts_info = cookie & ~TCP_COOKIE_HASH_MASK;
+	uint32_t info = (cookie >> TCP_COOKIE_INFO_SHIFT) & 0x7f;
+	uint64_t last_us = ACCESS_ONCE(tcp_cookie_last_us);
+
+	/* don't bother (or risk a forged match) unless cookies are in use */
+	if (!last_us || microtime() - last_us > 2 * TCP_COOKIE_PERIOD)
+		return false;
+
+	/* accept cookies from the current and the previous period */
+	if (age > 1)
+		return false;
+	if (tcp_cookie_hash(laddr, raddr, irs, ts_info, period - age) !=
+	    (cookie & TCP_COOKIE_HASH_MASK))
+		return false;
+
+	memset(opts, 0, sizeof(*opts));
+	if ((info >> TCP_COOKIE_MSS_SHIFT) >= TCP_COOKIE_NR_MSS)
+		return false;
+	opts->mss = tcp_cookie_mss(info >> TCP_COOKIE_MSS_SHIFT);
+	opts->sack_permitted = (info & 0x10) > 0;
+	opts->wscale_ok = (info & 0xf) != TCP_COOKIE_NO_WSCALE;
+	opts->wscale = opts->wscale_ok ? (info & 0xf) : 0;
+	return opts->wscale <= TCP_MAX_WSCALE;
+}
+
+/* creates an established connection from the ACK that returned a cookie */
+static tcpconn_t *tcp_rx_cookie(struct netaddr laddr, struct netaddr raddr,
+				const struct tcp_hdr *tcphdr,
+				const struct tcp_options *opts)
+{
+	tcp_seq seq = ntoh32(tcphdr->seq), ack = ntoh32(tcphdr->ack);
+	uint32_t win;
+	tcpconn_t *c;
+	int ret;
+
+	c = tcp_conn_alloc();
+	if (unlikely(!c))
+		return NULL;
+	c->pcb.irs = seq - 1;
+	c->pcb.rcv_nxt = seq;
+	c->pcb.iss = ack - 1;
+	c->pcb.snd_una = ack;
+	c->pcb.snd_nxt = ack;
+	c->retransmit_end = c->pcb.iss;
+	c->sack_ok = opts->sack_permitted;
+	tcp_wscale_negotiate(c, opts);
+	tcp_cc_init_conn(c);
+	tcp_mss_negotiate(c, opts, &raddr);
+
+	ret = tcp_conn_attach(c, laddr, raddr);
+	if (unlikely(ret)) {
+		tcp_conn_free(c);
+		return NULL;
+	}
+
+	/* any payload is dropped, the peer will retransmit it */
+	spin_lock_np(&c->lock);
+	win = tcp_peer_wnd(c, tcphdr);
+	c->pcb.snd_wnd = win > 1 ? win - 2 : 0;
+	c->pcb.snd_wl1 = seq;
+	c->pcb.snd_wl2 = ack;
+	tcp_conn_get(c); /* take a ref for the state machine */
+	tcp_conn_set_state(c, TCP_STATE_ESTABLISHED);
+	spin_unlock_np(&c->lock);
+
+	STAT(TCP_SYNCOOKIES_OK)++;
+	return c;
+}
+
 /* handles ingress packets for TCP listener queues */
 tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 {
 	struct netaddr raddr;
-	const struct ip_hdr *iphdr;
 	const struct tcp_hdr *tcphdr;
+	struct tcp_options opts;
 	tcpconn_t *c;
 	int ret;
 
 	/* find header offsets */
-	iphdr = mbuf_network_hdr(m, *iphdr);
 	tcphdr = mbuf_pull_hdr_or_null(m, *tcphdr);
 	if (unlikely(!tcphdr))
 		return NULL;
 
 	/* calculate local and remote network addresses */
-	raddr.ip = ntoh32(iphdr->saddr);
-	raddr.port = ntoh16(tcphdr->sport);
+	raddr = net_rx_saddr(m, ntoh16(tcphdr->sport));
 
 	/* do exactly what RFC 793 says */
 	if ((tcphdr->flags & TCP_RST) > 0)
 		return NULL;
+	if ((tcphdr->flags & (TCP_SYN | TCP_ACK)) == TCP_ACK &&
+	    tcphdr->off * 4 >= sizeof(struct tcp_hdr) &&
+	    tcp_cookie_check(laddr, raddr, ntoh32(tcphdr->seq) - 1,
+			     ntoh32(tcphdr->ack) - 1, &opts)) {
+		return tcp_rx_cookie(laddr, raddr, tcphdr, &opts);
+	}
 	if ((tcphdr->flags & TCP_ACK) > 0) {
 		tcp_tx_raw_rst(laddr, raddr, ntoh32(tcphdr->ack));
 		return NULL;
@@ -447,9 +1038,32 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 	if ((tcphdr->flags & TCP_SYN) == 0)
 		return NULL;
 
+	/* overloaded, refuse the connection before it costs anything */
+	if (unlikely(overload_shedding())) {
+		tcp_tx_raw_rst_ack(laddr, raddr, 0, ntoh32(tcphdr->seq) + 1);
+		return NULL;
+	}
+
 	/* TODO: the spec requires us to enqueue but not post any data */
-	if (ntoh16(iphdr->len) - sizeof(*iphdr) != tcphdr->off * 4)
+	if (net_rx_l4_len(m) != tcphdr->off * 4)
 		return NULL;
+	if (tcphdr->off * 4 < sizeof(struct tcp_hdr) ||
+	    tcphdr->off * 4 - sizeof(struct tcp_hdr) > mbuf_length(m))
+		return NULL;
+	tcp_parse_options(tcphdr, &opts);
+
+	/* too many half-open connections, answer statelessly with a cookie */
+	if (atomic_read(&tcp_half_open) >= (int)tcp_syn_backlog) {
+		tcp_seq irs = ntoh32(tcphdr->seq);
+
+		tcp_tx_raw_synack(laddr, raddr,
+				  tcp_cookie_make(laddr, raddr, irs, &opts),
+				  irs + 1, opts.sack_permitted,
+				  opts.wscale_ok ?
+				  tcp_wscale_for_buf(tcp_rx_buf_default) : -1);
+		STAT(TCP_SYNCOOKIES_SENT)++;
+		return NULL;
+	}
 
 	/* we have a valid SYN packet, initialize a new connection */
 	c = tcp_conn_alloc();
@@ -457,6 +1071,11 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 		return NULL;
 	c->pcb.irs = ntoh32(tcphdr->seq);
 	c->pcb.rcv_nxt = c->pcb.irs + 1;
+	c->ecn_ok = c->cc->ecn &&
+		    (tcphdr->flags & (TCP_ECE | TCP_CWR)) == (TCP_ECE | TCP_CWR);
+	c->sack_ok = opts.sack_permitted;
+	tcp_wscale_negotiate(c, &opts);
+	tcp_mss_negotiate(c, &opts, &raddr);
 
 	/*
 	 * attach the connection to the transport layer. From this point onward
@@ -464,14 +1083,14 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 	 */
 	ret = tcp_conn_attach(c, laddr, raddr);
 	if (unlikely(ret)) {
-		sfree(c);
+		tcp_conn_free(c);
 		return NULL;
 	}
 	tcp_debug_ingress_pkt(c, m);
 
 	/* finally, send a SYN/ACK to the remote host */
 	spin_lock_np(&c->lock);
-	ret = tcp_tx_ctl(c, TCP_SYN | TCP_ACK);
+	ret = tcp_tx_ctl(c, TCP_SYN | TCP_ACK | (c->ecn_ok ? TCP_ECE : 0));
 	if (unlikely(ret)) {
 		spin_unlock_np(&c->lock);
 		tcp_conn_destroy(c);
@@ -479,6 +1098,8 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 	}
 	tcp_conn_get(c); /* take a ref for the state machine */
 	tcp_conn_set_state(c, TCP_STATE_SYN_RECEIVED);
+	c->half_open = true;
+	atomic_inc(&tcp_half_open);
 	spin_unlock_np(&c->lock);
 
 	return c;
@@ -488,10 +1109,8 @@ void tcp_rx_closed(struct mbuf *m)
 {
 	struct netaddr l, r;
 	uint32_t len;
-	const struct ip_hdr *iphdr;
 	const struct tcp_hdr *tcphdr;
 
-	iphdr = mbuf_network_hdr(m, *iphdr);
 	tcphdr = mbuf_pull_hdr_or_null(m, *tcphdr);
 	if (!tcphdr)
 		return;
@@ -499,16 +1118,13 @@ void tcp_rx_closed(struct mbuf *m)
 	if ((tcphdr->flags & TCP_RST) > 0)
 		return;
 
-	l.ip = ntoh32(iphdr->daddr);
-	l.port = ntoh16(tcphdr->dport);
-
-	r.ip = ntoh32(iphdr->saddr);
-	r.port = ntoh16(tcphdr->sport);
+	l = net_rx_daddr(m, ntoh16(tcphdr->dport));
+	r = net_rx_saddr(m, ntoh16(tcphdr->sport));
 
 	if ((tcphdr->flags & TCP_ACK) > 0) {
 		tcp_tx_raw_rst(l, r, ntoh32(tcphdr->ack));
 	} else {
-		len = ntoh16(iphdr->len) - sizeof(*iphdr) - tcphdr->off * 4;
+		len = net_rx_l4_len(m) - tcphdr->off * 4;
 		tcp_tx_raw_rst_ack(l, r, 0, ntoh32(tcphdr->seq) + len);
 	}
 }
@@ -18,30 +18,142 @@ static void tcp_tx_release_mbuf(struct mbuf *m)
 		net_tx_release_mbuf(m);
 }
 
+/* returns a segment to the application that owns its buffer */
+static void tcp_tx_release_zc_mbuf(struct mbuf *m)
+{
+	struct tcp_tx_buf *b = (struct tcp_tx_buf *)m->release_data;
+
+	if (atomic_dec_and_test(&m->ref))
+		b->done(b->arg);
+}
+
+/* the maximum payload of an egress segment */
+static unsigned int tcp_tx_seg_cap(tcpconn_t *c, struct mbuf *m)
+{
+	return m->head_len > net_buf_len() ? TCP_TSO_MAX_LEN(c->mss) : c->mss;
+}
+
+/* asks the NIC to split the segment if it's larger than the MSS */
+static void tcp_tx_set_tso(tcpconn_t *c, struct mbuf *m, uint16_t l4len)
+{
+	if (l4len > c->mss) {
+		m->txflags |= OLFLAG_TCP_TSO;
+		m->tso_segsz = c->mss;
+	} else {
+		m->txflags &= ~OLFLAG_TCP_TSO;
+	}
+}
+
+/* writes TCP options (if any are needed), returning their length */
+static unsigned int
+tcp_push_options(struct mbuf *m, tcpconn_t *c, uint8_t flags, uint16_t l4len)
+{
+	struct tcp_sack_block blk;
+	unsigned int i, nr;
+	uint8_t *opts;
+	uint32_t *pos;
+
+	/* SYN segments advertise the MSS and offer SACK and window scaling */
+	if (flags & TCP_SYN) {
+		bool sack = !(flags & TCP_ACK) || c->sack_ok;
+		bool wscale = !(flags & TCP_ACK) || c->wscale_ok;
+		unsigned int len = 4;
+
+		len += sack ? 4 : 0;
+		len += wscale ? 4 : 0;
+		opts = mbuf_push(m, len);
+		opts[0] = TCPOPT_MAXSEG;
+		opts[1] = TCPOLEN_MAXSEG;
+		*(uint16_t *)&opts[2] = hton16(tcp_mss_for(&c->e.raddr));
+		opts += 4;
+		if (sack) {
+			opts[0] = TCPOPT_NOP;
+			opts[1] = TCPOPT_NOP;
+			opts[2] = TCPOPT_SACK_PERMITTED;
+			opts[3] = TCPOLEN_SACK_PERMITTED;
+			opts += 4;
+		}
+		if (wscale) {
+			opts[0] = TCPOPT_NOP;
+			opts[1] = TCPOPT_WINDOW;
+			opts[2] = TCPOLEN_WINDOW;
+			opts[3] = c->rcv_wscale;
+		}
+		return len;
+	}
+
+	/* pure ACKs report out-of-order data with SACK blocks */
+	nr = load_acquire(&c->rx_sack_nr);
+	if (l4len > 0 || (flags & (TCP_FIN | TCP_RST)) || !c->sack_ok ||
+	    nr == 0)
+		return 0;
+
+	opts = mbuf_push(m, TCPOLEN_SACKHDR + 2 + nr * TCPOLEN_SACK);
+	opts[0] = TCPOPT_NOP;
+	opts[1] = TCPOPT_NOP;
+	opts[2] = TCPOPT_SACK;
+	opts[3] = TCPOLEN_SACKHDR + nr * TCPOLEN_SACK;
+	pos = (uint32_t *)&opts[4];
+	for (i = 0; i < nr; i++) {
+		blk.raw = ACCESS_ONCE(c->rx_sacks[i].raw);
+		*pos++ = hton32(blk.start);
+		*pos++ = hton32(blk.end);
+	}
+	return TCPOLEN_SACKHDR + 2 + nr * TCPOLEN_SACK;
+}
+
 static struct tcp_hdr *
 tcp_push_tcphdr(struct mbuf *m, tcpconn_t *c, uint8_t flags, uint16_t l4len)
 {
 	struct tcp_hdr *tcphdr;
 	uint64_t rcv_nxt_wnd = load_acquire(&c->pcb.rcv_nxt_wnd);
 	tcp_seq ack = c->tx_last_ack = (uint32_t)rcv_nxt_wnd;
-	uint16_t win = c->tx_last_win = rcv_nxt_wnd >> 32;
+	uint32_t wnd = rcv_nxt_wnd >> 32;
+	uint16_t win;
+	unsigned int optlen;
 
-	/* write the tcp header */
+	/* the window in a SYN is never scaled (RFC 7323 Section 2.2) */
+	if (!(flags & TCP_SYN) && c->wscale_ok)
+		wnd >>= c->rcv_wscale;
+	win = c->tx_last_win = min(wnd, (uint32_t)UINT16_MAX);
+
+	/* write the tcp options and header */
+	optlen = tcp_push_options(m, c, flags, l4len);
 	tcphdr = mbuf_push_hdr(m, *tcphdr);
 	mbuf_mark_transport_offset(m);
 	tcphdr->sport = hton16(c->e.laddr.port);
 	tcphdr->dport = hton16(c->e.raddr.port);
 	tcphdr->ack = hton32(ack);
-	tcphdr->off = 5;
+	tcphdr->off = (sizeof(struct tcp_hdr) + optlen) / 4;
 	tcphdr->flags = flags;
+	/* echo congestion experienced marks back to the sender (ECN) */
+	if (ACCESS_ONCE(c->ecn_ce) && (flags & (TCP_SYN | TCP_ACK)) == TCP_ACK)
+		tcphdr->flags |= TCP_ECE;
 	tcphdr->win = hton16(win);
 	tcphdr->seq = hton32(m->seg_seq);
-	tcphdr->sum = ipv4_phdr_cksum(IPPROTO_TCP,
-				      c->e.laddr.ip, c->e.raddr.ip,
-				      sizeof(struct tcp_hdr) + l4len);
+	/* with TSO, the length is left out and added to each segment by HW */
+	tcphdr->sum = net_phdr_cksum(IPPROTO_TCP, &c->e.laddr, &c->e.raddr,
+				     (m->txflags & OLFLAG_TCP_TSO) ? 0 :
+				     sizeof(struct tcp_hdr) + optlen + l4len);
 	return tcphdr;
 }
 
+/* transmits a segment to the connection's peer */
+static int tcp_tx_ip(tcpconn_t *c, struct mbuf *m, uint8_t tos)
+{
+	return net_tx_ip_addr(m, IPPROTO_TCP, tos, &c->e.laddr, &c->e.raddr,
+			      &c->e.rc);
+}
+
+/* transmits a data segment, marking it ECN-capable if ECN was negotiated */
+static int tcp_tx_data_ip(tcpconn_t *c, struct mbuf *m)
+{
+	uint8_t tos = IPTOS_DSCP_CS0;
+
+	tos |= c->ecn_ok ? IPTOS_ECN_ECT0 : IPTOS_ECN_NOTECT;
+	return tcp_tx_ip(c, m, tos);
+}
+
 /**
  * tcp_tx_raw_rst - send a RST without an established connection
  * @laddr: the local address
@@ -71,11 +183,11 @@ int tcp_tx_raw_rst(struct netaddr laddr, struct netaddr raddr, tcp_seq seq)
 	tcphdr->off = 5;
 	tcphdr->flags = TCP_RST;
 	tcphdr->win = hton16(0);
-	tcphdr->sum = ipv4_phdr_cksum(IPPROTO_TCP, laddr.ip, raddr.ip,
-				      sizeof(struct tcp_hdr));
+	tcphdr->sum = net_phdr_cksum(IPPROTO_TCP, &laddr, &raddr,
+				     sizeof(struct tcp_hdr));
 
 	/* transmit packet */
-	ret = net_tx_ip(m, IPPROTO_TCP, raddr.ip);
+	ret = net_tx_ip_addr(m, IPPROTO_TCP, 0, &laddr, &raddr, NULL);
 	if (unlikely(ret))
 		mbuf_free(m);
 	return ret;
@@ -112,11 +224,122 @@ int tcp_tx_raw_rst_ack(struct netaddr laddr, struct netaddr raddr,
 	tcphdr->off = 5;
 	tcphdr->flags = TCP_RST | TCP_ACK;
 	tcphdr->win = hton16(0);
-	tcphdr->sum = ipv4_phdr_cksum(IPPROTO_TCP, laddr.ip, raddr.ip,
-				      sizeof(struct tcp_hdr));
+	tcphdr->sum = net_phdr_cksum(IPPROTO_TCP, &laddr, &raddr,
+				     sizeof(struct tcp_hdr));
 
 	/* transmit packet */
-	ret = net_tx_ip(m, IPPROTO_TCP, raddr.ip);
+	ret = net_tx_ip_addr(m, IPPROTO_TCP, 0, &laddr, &raddr, NULL);
+	if (unlikely(ret))
+		mbuf_free(m);
+	return ret;
+}
+
+/**
+ * tcp_tx_raw_ack - send an ACK without a connection (for TIME-WAIT)
+ * @laddr: the local address
+ * @raddr: the remote address
+ * @seq: the segment's sequence number
+ * @ack: the segment's acknowledgement number
+ * @win: the window to advertise (already scaled)
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int tcp_tx_raw_ack(struct netaddr laddr, struct netaddr raddr,
+		   tcp_seq seq, tcp_seq ack, uint16_t win)
+{
+	struct tcp_hdr *tcphdr;
+	struct mbuf *m;
+	int ret;
+
+	m = net_tx_alloc_mbuf();
+	if (unlikely((!m)))
+		return -ENOMEM;
+
+	m->txflags = OLFLAG_TCP_CHKSUM;
+
+	/* write the tcp header */
+	tcphdr = mbuf_push_hdr(m, *tcphdr);
+	tcphdr->sport = hton16(laddr.port);
+	tcphdr->dport = hton16(raddr.port);
+	tcphdr->seq = hton32(seq);
+	tcphdr->ack = hton32(ack);
+	tcphdr->off = 5;
+	tcphdr->flags = TCP_ACK;
+	tcphdr->win = hton16(win);
+	tcphdr->sum = net_phdr_cksum(IPPROTO_TCP, &laddr, &raddr,
+				     sizeof(struct tcp_hdr));
+
+	/* transmit packet */
+	ret = net_tx_ip_addr(m, IPPROTO_TCP, 0, &laddr, &raddr, NULL);
+	if (unlikely(ret))
+		mbuf_free(m);
+	else
+		STAT(TCP_TX_ACKS)++;
+	return ret;
+}
+
+/**
+ * tcp_tx_raw_synack - send a SYN/ACK without a connection (for SYN cookies)
+ * @laddr: the local address
+ * @raddr: the remote address
+ * @seq: the segment's sequence number (the cookie)
+ * @ack: the segment's acknowledgement number
+ * @sack: offer SACK (the peer sent SACK permitted)
+ * @wscale: the local window scale to offer, or < 0 to omit window scaling
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int tcp_tx_raw_synack(struct netaddr laddr, struct netaddr raddr,
+		      tcp_seq seq, tcp_seq ack, bool sack, int wscale)
+{
+	struct tcp_hdr *tcphdr;
+	struct mbuf *m;
+	unsigned int optlen = 4;
+	uint8_t *opts;
+	int ret;
+
+	m = net_tx_alloc_mbuf();
+	if (unlikely((!m)))
+		return -ENOMEM;
+
+	m->txflags = OLFLAG_TCP_CHKSUM;
+
+	/* write the tcp options (the same layout as tcp_push_options()) */
+	optlen += sack ? 4 : 0;
+	optlen += wscale >= 0 ? 4 : 0;
+	opts = mbuf_push(m, optlen);
+	opts[0] = TCPOPT_MAXSEG;
+	opts[1] = TCPOLEN_MAXSEG;
+	*(uint16_t *)&opts[2] = hton16(tcp_mss_for(&raddr));
+	opts += 4;
+	if (sack) {
+		opts[0] = TCPOPT_NOP;
+		opts[1] = TCPOPT_NOP;
+		opts[2] = TCPOPT_SACK_PERMITTED;
+		opts[3] = TCPOLEN_SACK_PERMITTED;
+		opts += 4;
+	}
+	if (wscale >= 0) {
+		opts[0] = TCPOPT_NOP;
+		opts[1] = TCPOPT_WINDOW;
+		opts[2] = TCPOLEN_WINDOW;
+		opts[3] = wscale;
+	}
+
+	/* write the tcp header */
+	tcphdr = mbuf_push_hdr(m, *tcphdr);
+	tcphdr->sport = hton16(laddr.port);
+	tcphdr->dport = hton16(raddr.port);
+	tcphdr->seq = hton32(seq);
+	tcphdr->ack = hton32(ack);
+	tcphdr->off = (sizeof(struct tcp_hdr) + optlen) / 4;
+	tcphdr->flags = TCP_SYN | TCP_ACK;
+	tcphdr->win = hton16(min(tcp_rx_buf_default, (uint32_t)UINT16_MAX));
+	tcphdr->sum = net_phdr_cksum(IPPROTO_TCP, &laddr, &raddr,
+				     sizeof(struct tcp_hdr) + optlen);
+
+	/* transmit packet */
+	ret = net_tx_ip_addr(m, IPPROTO_TCP, 0, &laddr, &raddr, NULL);
 	if (unlikely(ret))
 		mbuf_free(m);
 	return ret;
@@ -143,9 +366,11 @@ int tcp_tx_ack(tcpconn_t *c)
 
 	/* transmit packet */
 	tcp_debug_egress_pkt(c, m);
-	ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
+	ret = tcp_tx_ip(c, m, IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT);
 	if (unlikely(ret))
 		mbuf_free(m);
+	else
+		STAT(TCP_TX_ACKS)++;
 	return ret;
 }
 
@@ -174,6 +399,7 @@ int tcp_tx_ctl(tcpconn_t *c, uint8_t flags)
 	m->seg_seq = c->pcb.snd_nxt;
 	m->seg_end = c->pcb.snd_nxt + 1;
 	m->flags = flags;
+	m->sacked = false;
 	tcp_push_tcphdr(m, c, flags, 0);
 	store_release(&c->pcb.snd_nxt, c->pcb.snd_nxt + 1);
 	list_add_tail(&c->txq, &m->link);
@@ -181,7 +407,101 @@ int tcp_tx_ctl(tcpconn_t *c, uint8_t flags)
 	atomic_write(&m->ref, 2);
 	m->release = tcp_tx_release_mbuf;
 	tcp_debug_egress_pkt(c, m);
-	ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
+	ret = tcp_tx_ip(c, m, IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT);
+	if (unlikely(ret)) {
+		/* pretend the packet was sent */
+		atomic_write(&m->ref, 1);
+	}
+	return ret;
+}
+
+/* the time it takes to send @len bytes at the paced rate (ns), or 0 */
+static uint64_t tcp_tx_pace_interval(tcpconn_t *c, uint32_t len)
+{
+	unsigned int ratio;
+
+	/* no rate can be estimated without an RTT sample */
+	if (c->srtt == 0)
+		return 0;
+
+	ratio = c->cwnd < c->ssthresh ? TCP_PACING_SS_RATIO :
+					TCP_PACING_CA_RATIO;
+	return (uint64_t)len * c->srtt * 1000 * 100 /
+	       ((uint64_t)max(c->cwnd, TCP_MIN_CWND(c)) * ratio);
+}
+
+/*
+ * Holds a data segment in @c->pace_q if it isn't due yet. Returns true if it
+ * was held, in which case the connection's timer will send it.
+ */
+static bool tcp_tx_pace(tcpconn_t *c, struct mbuf *m)
+{
+	uint64_t now_ns = m->timestamp * 1000;
+
+	spin_lock_np(&c->lock);
+	if (mbufq_empty(&c->pace_q) && c->pace_next_ns <= now_ns) {
+		/* idle time isn't saved up, so it can't become a burst */
+		c->pace_next_ns = now_ns +
+				  tcp_tx_pace_interval(c, m->seg_end - m->seg_seq);
+		spin_unlock_np(&c->lock);
+		return false;
+	}
+
+	mbufq_push_tail(&c->pace_q, m);
+	tcp_timer_update(c);
+	spin_unlock_np(&c->lock);
+	return true;
+}
+
+/**
+ * tcp_tx_pace_release - sends the held data segments that are now due
+ * @c: the TCP connection (must hold @c->lock)
+ * @now: the current time (us)
+ *
+ * Called from the connection's timer.
+ */
+void tcp_tx_pace_release(tcpconn_t *c, uint64_t now)
+{
+	uint64_t now_ns = now * 1000;
+	struct mbuf *m;
+
+	assert_spin_lock_held(&c->lock);
+
+	while ((m = mbufq_peak_head(&c->pace_q)) != NULL) {
+		if (c->pace_next_ns > now_ns)
+			break;
+
+		mbufq_pop_head(&c->pace_q);
+		c->pace_next_ns = max(c->pace_next_ns, now_ns) +
+				  tcp_tx_pace_interval(c, m->seg_end - m->seg_seq);
+		m->timestamp = now;
+		if (unlikely(tcp_tx_data_ip(c, m))) {
+			/* pretend the packet was sent */
+			atomic_write(&m->ref, 1);
+		}
+	}
+}
+
+/* pushes a TCP header onto a data segment and transmits it */
+static int tcp_tx_data_seg(tcpconn_t *c, struct mbuf *m, bool push)
+{
+	int ret;
+
+	/* initialize TCP header */
+	if (push)
+		m->flags |= TCP_PUSH;
+	m->txflags = OLFLAG_TCP_CHKSUM;
+	tcp_tx_set_tso(c, m, m->seg_end - m->seg_seq);
+	tcp_push_tcphdr(m, c, m->flags, m->seg_end - m->seg_seq);
+
+	/* transmit the packet */
+	list_add_tail(&c->txq, &m->link);
+	tcp_debug_egress_pkt(c, m);
+	m->timestamp = microtime();
+	/* callers without write exclusion already hold @c->lock */
+	if (tcp_pacing && c->tx_exclusive && tcp_tx_pace(c, m))
+		return 0;
+	ret = tcp_tx_data_ip(c, m);
 	if (unlikely(ret)) {
 		/* pretend the packet was sent */
 		atomic_write(&m->ref, 1);
@@ -212,6 +532,7 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 	const char *end = pos + len;
 	ssize_t ret = 0;
 	size_t seglen;
+	bool merged;
 
 	assert(c->pcb.state >= TCP_STATE_ESTABLISHED);
 	assert((c->tx_exclusive == true) || spin_lock_held(&c->lock));
@@ -222,51 +543,55 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 	/* the main TCP segmenter loop */
 	while (pos < end) {
 		/* allocate a buffer and copy payload data */
-		if (c->tx_pending) {
+		merged = c->tx_pending != NULL;
+		if (merged) {
 			m = c->tx_pending;
 			c->tx_pending = NULL;
-			seglen = min(end - pos, TCP_MSS - mbuf_length(m));
+			seglen = min(end - pos, tcp_tx_seg_cap(c, m) -
+					 mbuf_length(m));
 			m->seg_end += seglen;
 		} else {
-			m = net_tx_alloc_mbuf();
+			/* use a super-segment if there's more than an MSS */
+			m = NULL;
+			if (end - pos > c->mss)
+				m = net_tx_alloc_tso_mbuf();
+			if (!m)
+				m = net_tx_alloc_mbuf();
 			if (unlikely(!m)) {
 				ret = -ENOBUFS;
 				break;
 			}
-			seglen = min(end - pos, TCP_MSS);
+			seglen = min(end - pos, tcp_tx_seg_cap(c, m));
 			m->seg_seq = c->pcb.snd_nxt;
 			m->seg_end = c->pcb.snd_nxt + seglen;
 			m->flags = TCP_ACK;
+			m->sacked = false;
 			atomic_write(&m->ref, 2);
 			m->release = tcp_tx_release_mbuf;
 		}
 
-		memcpy(mbuf_put(m, seglen), pos, seglen);
+		/* a transform writes the payload instead of copying it */
+		if (c->xform && c->xform->tx) {
+			c->xform->tx(c->xform_arg, c->pcb.snd_nxt - c->pcb.iss - 1,
+				     mbuf_put(m, seglen), pos, seglen);
+		} else {
+			memcpy(mbuf_put(m, seglen), pos, seglen);
+		}
 		store_release(&c->pcb.snd_nxt, c->pcb.snd_nxt + seglen);
 		pos += seglen;
 
 		/* if not pushing, keep the last buffer for later */
 		if (!push && pos == end && mbuf_length(m) -
-		    sizeof(struct tcp_hdr) < TCP_MSS) {
+		    sizeof(struct tcp_hdr) < tcp_tx_seg_cap(c, m) &&
+		    mbuf_length(m) < c->cork_bytes) {
+			/* for TCP_CORK_TIMEOUT, replaced when it's sent */
+			if (!merged)
+				m->timestamp = microtime();
 			c->tx_pending = m;
 			break;
 		}
 
-		/* initialize TCP header */
-		if (push && pos == end)
-			m->flags |= TCP_PUSH;
-		tcp_push_tcphdr(m, c, m->flags, m->seg_end - m->seg_seq);
-
-		/* transmit the packet */
-		list_add_tail(&c->txq, &m->link);
-		tcp_debug_egress_pkt(c, m);
-		m->timestamp = microtime();
-		m->txflags = OLFLAG_TCP_CHKSUM;
-		ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
-		if (unlikely(ret)) {
-			/* pretend the packet was sent */
-			atomic_write(&m->ref, 1);
-		}
+		ret = tcp_tx_data_seg(c, m, push && pos == end);
 	}
 
 	/* if we sent anything return the length we sent instead of an error */
@@ -275,14 +600,92 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 	return ret;
 }
 
+/**
+ * tcp_tx_flush_pending - transmits the partial segment held back, if any
+ * @c: the TCP connection
+ *
+ * Does nothing if write exclusion is taken, because the writer owns
+ * @c->tx_pending. The caller must hold @c->lock.
+ */
+void tcp_tx_flush_pending(tcpconn_t *c)
+{
+	struct mbuf *m = c->tx_pending;
+
+	assert_spin_lock_held(&c->lock);
+	if (!m || c->tx_exclusive)
+		return;
+
+	/* a send error is treated as a loss, so the data is still accepted */
+	c->tx_pending = NULL;
+	tcp_tx_data_seg(c, m, true);
+}
+
+/**
+ * tcp_tx_send_zc - transmit an application-owned buffer on a TCP connection
+ * @c: the connection to transmit on
+ * @b: the buffer to transmit (its payload must already be filled in)
+ * @len: the length of the payload
+ *
+ * The buffer is sent as a single segment without copying. It stays referenced
+ * until it is acknowledged, and then @b->done is called.
+ *
+ * WARNING: The caller is responsible for respecting the TCP window size limit.
+ * WARNING: The caller must have write exclusive access to the socket or hold
+ * @c->lock while write exclusion isn't taken.
+ *
+ * Returns the number of bytes transmitted, or < 0 if there was an error.
+ */
+ssize_t tcp_tx_send_zc(tcpconn_t *c, struct tcp_tx_buf *b, size_t len)
+{
+	struct mbuf *m = b->handle;
+
+	assert(c->pcb.state >= TCP_STATE_ESTABLISHED);
+	assert((c->tx_exclusive == true) || spin_lock_held(&c->lock));
+	assert(len <= b->cap);
+
+	/* buffered data must go first to keep the stream in order */
+	if (c->tx_pending) {
+		struct mbuf *pending = c->tx_pending;
+
+		c->tx_pending = NULL;
+		tcp_tx_data_seg(c, pending, false);
+	}
+
+	/* the buffer may be reused, so start over from where the payload is */
+	mbuf_init(m, m->head, m->head_len, (unsigned char *)b->buf - m->head);
+	mbuf_put(m, len);
+	if (c->xform && c->xform->tx) {
+		c->xform->tx(c->xform_arg, c->pcb.snd_nxt - c->pcb.iss - 1,
+			     b->buf, b->buf, len);
+	}
+	m->csum_type = CHECKSUM_TYPE_NEEDED;
+	m->tso_segsz = 0;
+	m->seg_seq = c->pcb.snd_nxt;
+	m->seg_end = c->pcb.snd_nxt + len;
+	m->flags = TCP_ACK;
+	m->sacked = false;
+	atomic_write(&m->ref, 2);
+	m->release_data = (unsigned long)b;
+	m->release = tcp_tx_release_zc_mbuf;
+	store_release(&c->pcb.snd_nxt, c->pcb.snd_nxt + len);
+
+	/* a send error is treated as a loss, so the data is still accepted */
+	tcp_tx_data_seg(c, m, true);
+	return len;
+}
+
 static int tcp_tx_retransmit_one(tcpconn_t *c, struct mbuf *m)
 {
-	int ret;
+	const struct tcp_hdr *tcphdr;
+	unsigned int hdr_len;
 	uint16_t l4len;
+	int ret;
 
 	l4len = m->seg_end - m->seg_seq;
 	if (m->flags & (TCP_SYN | TCP_FIN))
 		l4len--;
+	tcphdr = mbuf_transport_hdr(m, *tcphdr);
+	hdr_len = tcphdr->off * 4;
 
 	/*
 	 * Check if still transmitting. Because of a limitation in some DPDK NIC
@@ -291,12 +694,16 @@ static int tcp_tx_retransmit_one(tcpconn_t *c, struct mbuf *m)
 	 * in such corner cases.
 	 */
 	if (unlikely(atomic_read(&m->ref) != 1)) {
-		struct mbuf *newm = net_tx_alloc_mbuf();
+		struct mbuf *newm;
+
+		if (l4len > tcp_mss)
+			newm = net_tx_alloc_tso_mbuf();
+		else
+			newm = net_tx_alloc_mbuf();
 		if (unlikely(!newm))
 			return -ENOMEM;
 		memcpy(mbuf_put(newm, l4len),
-		       mbuf_transport_offset(m) + sizeof(struct tcp_hdr),
-		       l4len);
+		       mbuf_transport_offset(m) + hdr_len, l4len);
 		newm->flags = m->flags;
 		newm->seg_seq = m->seg_seq;
 		newm->seg_end = m->seg_end;
@@ -304,7 +711,8 @@ static int tcp_tx_retransmit_one(tcpconn_t *c, struct mbuf *m)
 		m = newm;
 	} else {
 		/* strip headers and reset ref count */
-		mbuf_reset(m, m->transport_off + sizeof(struct tcp_hdr));
+		mbuf_reset(m, m->transport_off + hdr_len);
+		m->txflags = OLFLAG_TCP_CHKSUM;
 		atomic_write(&m->ref, 2);
 	}
 
@@ -315,22 +723,46 @@ static int tcp_tx_retransmit_one(tcpconn_t *c, struct mbuf *m)
 		return 0;
 	} else if (unlikely(wraps_lt(m->seg_seq, una))) {
 		mbuf_pull(m, una - m->seg_seq);
+		l4len -= una - m->seg_seq;
 		m->seg_seq = una;
 	}
 
 	/* push the TCP header back on (now with fresher ack) */
+	tcp_tx_set_tso(c, m, l4len);
 	tcp_push_tcphdr(m, c, m->flags, l4len);
 
 	/* transmit the packet */
 	tcp_debug_egress_pkt(c, m);
-	ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
-	if (unlikely(ret))
+	if (l4len > 0)
+		ret = tcp_tx_data_ip(c, m);
+	else
+		ret = tcp_tx_ip(c, m, IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT);
+	if (unlikely(ret)) {
 		mbuf_free(m);
-	return ret;
+		return ret;
+	}
+
+	c->retransmits++;
+	rtrace(RTRACE_TCP_RETRANSMIT, m->seg_seq, c->retransmits);
+	return 0;
+}
+
+/*
+ * Returns true if a segment doesn't need to be retransmitted. The segment
+ * containing snd_una is always resent so that a peer reneging on its SACK
+ * blocks can't stall the connection.
+ */
+static bool tcp_tx_should_skip(tcpconn_t *c, struct mbuf *m)
+{
+	uint32_t una = load_acquire(&c->pcb.snd_una);
+
+	if (wraps_lte(m->seg_end, una))
+		return true;
+	return m->sacked && wraps_gt(m->seg_seq, una);
 }
 
 /**
- * tcp_tx_fast_retransmit - resend the first pending egress packet
+ * tcp_tx_fast_retransmit_start - resend the first unacknowledged egress packet
  * @c: the TCP connection in which to send retransmissions
  */
 struct mbuf *tcp_tx_fast_retransmit_start(tcpconn_t *c)
@@ -342,13 +774,19 @@ struct mbuf *tcp_tx_fast_retransmit_start(tcpconn_t *c)
 	if (c->tx_exclusive)
 		return NULL;
 
-	m = list_top(&c->txq, struct mbuf, link);
-	if (m) {
+	/* resend the first segment the peer hasn't selectively acked */
+	list_for_each(&c->txq, m, link) {
+		if (tcp_tx_should_skip(c, m))
+			continue;
+
 		m->timestamp = microtime();
 		atomic_inc(&m->ref);
+		if (wraps_gt(m->seg_end, c->retransmit_end))
+			c->retransmit_end = m->seg_end;
+		return m;
 	}
 
-	return m;
+	return NULL;
 }
 
 void tcp_tx_fast_retransmit_finish(tcpconn_t *c, struct mbuf *m)
@@ -375,13 +813,15 @@ void tcp_tx_retransmit(tcpconn_t *c)
 	int count = 0;
 	list_for_each(&c->txq, m, link) {
 		/* check if the timeout expired */
-		if (now - m->timestamp < TCP_RETRANSMIT_TIMEOUT)
+		if (now - m->timestamp < c->rto)
 			break;
 
-		if (wraps_gte(load_acquire(&c->pcb.snd_una), m->seg_end))
+		if (tcp_tx_should_skip(c, m))
 			continue;
 
 		m->timestamp = now;
+		if (wraps_gt(m->seg_end, c->retransmit_end))
+			c->retransmit_end = m->seg_end;
 		ret = tcp_tx_retransmit_one(c, m);
 		if (ret)
 			break;
@@ -389,4 +829,8 @@ void tcp_tx_retransmit(tcpconn_t *c)
 		if (++count >= TCP_RETRANSMIT_BATCH)
 			break;
 	}
+
+	/* back off the timer (RFC 6298 Section 5.5) */
+	if (count > 0)
+		c->rto = min(c->rto * 2, TCP_RTO_MAX);
 }
@@ -0,0 +1,174 @@
+/*
+ * tcp_tw.c - compact TIME-WAIT state for closed TCP connections
+ *
+ * Once the application has closed a connection and it reaches TIME-WAIT, the
+ * full tcpconn is swapped out of the transport table for a small minisocket
+ * that only remembers enough to acknowledge a retransmitted FIN. This keeps
+ * memory and hash chains small when many short-lived connections churn.
+ *
+ * The stack has no TCP timestamps, so a new SYN may take over a 4-tuple in
+ * TIME-WAIT only if its sequence number is past the old incarnation's, as
+ * allowed by RFC 1122 Section 4.2.2.13. RSTs are ignored (RFC 1337).
+ */
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/smalloc.h>
+#include <net/tcp.h>
+
+#include "tcp.h"
+
+/* a connection in TIME-WAIT, standing in for the tcpconn */
+struct tcp_tw {
+	struct trans_entry	e;
+	spinlock_t		lock;
+	bool			dead;	/* removed from the transport table */
+	uint32_t		snd_nxt;
+	uint32_t		rcv_nxt;
+	uint16_t		win;	/* the last advertised window, scaled */
+	struct timer_entry	timer;
+};
+
+static void tcp_tw_recv(struct trans_entry *e, struct mbuf *m);
+
+static const struct trans_ops tcp_tw_ops = {
+	.recv = tcp_tw_recv,
+};
+
+static void tcp_tw_release(struct rcu_head *h)
+{
+	struct tcp_tw *tw = container_of(h, struct tcp_tw, e.rcu);
+
+	sfree(tw);
+}
+
+/* the timer handler, runs in the timer softirq with preemption disabled */
+static void tcp_tw_expire(unsigned long arg)
+{
+	struct tcp_tw *tw = (struct tcp_tw *)arg;
+	bool dead;
+
+	spin_lock_np(&tw->lock);
+	dead = tw->dead;
+	tw->dead = true;
+	spin_unlock_np(&tw->lock);
+
+	/* if it was killed meanwhile, freeing it was left to us */
+	if (!dead)
+		trans_table_remove(&tw->e);
+	rcu_free(&tw->e.rcu, tcp_tw_release);
+}
+
+/* removes a minisocket before it expires, returns false if it already did */
+static bool tcp_tw_kill(struct tcp_tw *tw)
+{
+	spin_lock_np(&tw->lock);
+	if (tw->dead) {
+		spin_unlock_np(&tw->lock);
+		return false;
+	}
+	tw->dead = true;
+	spin_unlock_np(&tw->lock);
+
+	trans_table_remove(&tw->e);
+
+	/* if the timer already popped, its handler frees the minisocket */
+	if (timer_cancel(&tw->timer))
+		rcu_free(&tw->e.rcu, tcp_tw_release);
+	return true;
+}
+
+/* handles ingress packets for connections in TIME-WAIT */
+static void tcp_tw_recv(struct trans_entry *e, struct mbuf *m)
+{
+	struct tcp_tw *tw = container_of(e, struct tcp_tw, e);
+	const struct tcp_hdr *tcphdr;
+	uint32_t seq, hdr_len, len;
+
+	assert_preempt_disabled();
+
+	/* the header isn't pulled, so the packet can be delivered again */
+	tcphdr = (const struct tcp_hdr *)mbuf_data(m);
+	if (unlikely(mbuf_length(m) < sizeof(*tcphdr)))
+		goto drop;
+	hdr_len = tcphdr->off * 4;
+	if (unlikely(hdr_len < sizeof(*tcphdr) ||
+		     hdr_len > net_rx_l4_len(m)))
+		goto drop;
+	seq = ntoh32(tcphdr->seq);
+	len = net_rx_l4_len(m) - hdr_len;
+	if (tcphdr->flags & TCP_FIN)
+		len++;
+
+	if (tcphdr->flags & TCP_RST)
+		goto drop;
+
+	/* a new incarnation, hand its SYN to the listener */
+	if ((tcphdr->flags & (TCP_SYN | TCP_ACK)) == TCP_SYN &&
+	    wraps_gt(seq, tw->rcv_nxt)) {
+		if (tcp_tw_kill(tw)) {
+			STAT(TCP_TIME_WAIT_REUSED)++;
+			trans_rx_redeliver(m);
+			return;
+		}
+		goto drop;
+	}
+
+	/* acknowledge a retransmitted FIN or anything else unexpected */
+	if (len > 0 || seq != tw->rcv_nxt) {
+		tcp_tx_raw_ack(tw->e.laddr, tw->e.raddr, tw->snd_nxt,
+			       tw->rcv_nxt, tw->win);
+	}
+
+drop:
+	mbuf_free(m);
+}
+
+/**
+ * tcp_tw_start - replaces a connection in TIME-WAIT with a minisocket
+ * @c: the TCP connection, which the application has closed
+ *
+ * The connection is closed and its reference from the protocol is dropped.
+ * If a minisocket can't be allocated, the connection stays in TIME-WAIT.
+ */
+void tcp_tw_start(tcpconn_t *c)
+{
+	struct tcp_tw *tw;
+	uint64_t deadline;
+	uint32_t wnd;
+
+	tw = smalloc(sizeof(*tw));
+	if (unlikely(!tw))
+		return;
+
+	spin_lock_np(&c->lock);
+	if (c->pcb.state != TCP_STATE_TIME_WAIT) {
+		spin_unlock_np(&c->lock);
+		sfree(tw);
+		return;
+	}
+
+	trans_init_5tuple(&tw->e, IPPROTO_TCP, &tcp_tw_ops, c->e.laddr,
+			  c->e.raddr);
+	spin_lock_init(&tw->lock);
+	tw->dead = false;
+	tw->snd_nxt = c->pcb.snd_nxt;
+	tw->rcv_nxt = c->pcb.rcv_nxt;
+	wnd = c->pcb.rcv_wnd;
+	if (c->wscale_ok)
+		wnd >>= c->rcv_wscale;
+	tw->win = min(wnd, (uint32_t)UINT16_MAX);
+	deadline = c->time_wait_ts + TCP_TIME_WAIT_TIMEOUT;
+
+	/* the lock holds off the timer and packets until both are set up */
+	timer_init(&tw->timer, tcp_tw_expire, (unsigned long)tw);
+	spin_lock_np(&tw->lock);
+	trans_table_replace(&c->e, &tw->e);
+	timer_start(&tw->timer, deadline);
+	spin_unlock_np(&tw->lock);
+	c->tw_replaced = true;
+
+	tcp_conn_set_state(c, TCP_STATE_CLOSED);
+	spin_unlock_np(&c->lock);
+	tcp_conn_put(c);
+}
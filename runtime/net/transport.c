@@ -2,129 +2,451 @@
  * transport.c - handles transport protocol packets (UDP and TCP)
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <base/stddef.h>
+#include <base/bitmap.h>
 #include <base/hash.h>
+#include <base/log.h>
 #include <runtime/rculist.h>
+#include <runtime/smalloc.h>
 #include <runtime/sync.h>
 #include <runtime/net.h>
 #include <net/ip.h>
 
 #include "defs.h"
 
-#define TRANS_TBL_SIZE	16384
+/* the table starts at the minimum and doubles until the maximum */
+#define TRANS_TBL_MIN	16384
+#define TRANS_TBL_MAX	(1 << 22)
+/* grow once there are this many entries per bucket */
+#define TRANS_LOAD_MAX	2
+/* the number of lock stripes protecting the table (must divide its size) */
+#define TRANS_LOCK_NR	1024
 
 /* ephemeral port definitions (IANA suggested range) */
 #define MIN_EPHEMERAL		49152
 #define MAX_EPHEMERAL		65535
+#define NR_EPHEMERAL		(MAX_EPHEMERAL - MIN_EPHEMERAL + 1)
+/* the buckets (and locks) of the per-remote ephemeral port allocators */
+#define TRANS_PORTS_NR		1024
 
 /* a seed value for transport handler table hashing calculations */
 static uint32_t trans_seed;
 
+/* ingress packets with at least this DSCP make their entry high priority */
+unsigned int trans_rx_prio_dscp;
+
 /* a simple counter used to further randomize ephemeral ports */
 static uint32_t ephemeral_offset;
 
+/* folds the 128 bits of an IPv6 address into a seed, IPv4 is left as is */
+static inline uint32_t trans_hash_ip6(uint32_t seed, const struct netaddr *a)
+{
+	uint64_t lo, hi;
+
+	if (likely(a->family != NET_AF_INET6))
+		return seed;
+	memcpy(&lo, &a->ip6.addr[0], sizeof(lo));
+	memcpy(&hi, &a->ip6.addr[8], sizeof(hi));
+	return hash_crc32c_two(seed, lo, hi);
+}
+
 static inline uint32_t trans_hash_3tuple(uint8_t proto, struct netaddr laddr)
 {
-	return hash_crc32c_one(trans_seed,
+	return hash_crc32c_one(trans_hash_ip6(trans_seed, &laddr),
 		(uint64_t)laddr.ip | ((uint64_t)laddr.port << 32) |
-		((uint64_t)proto << 48));
+		((uint64_t)proto << 48) | ((uint64_t)laddr.family << 56));
+}
+
+/* gets the seed and the two words that a 5-tuple's hash is computed from */
+static inline uint32_t trans_5tuple_words(uint8_t proto,
+					  const struct netaddr *laddr,
+					  const struct netaddr *raddr,
+					  uint64_t *a, uint64_t *b)
+{
+	uint32_t seed = trans_seed;
+
+	if (unlikely(raddr->family == NET_AF_INET6))
+		seed = trans_hash_ip6(trans_hash_ip6(seed, laddr), raddr);
+	*a = (uint64_t)laddr->ip | ((uint64_t)laddr->port << 32);
+	*b = (uint64_t)raddr->ip | ((uint64_t)raddr->port << 32) |
+	     ((uint64_t)proto << 48) | ((uint64_t)raddr->family << 56);
+	return seed;
 }
 
 static inline uint32_t trans_hash_5tuple(uint8_t proto, struct netaddr laddr,
 				         struct netaddr raddr)
 {
-	return hash_crc32c_two(trans_seed,
-		(uint64_t)laddr.ip | ((uint64_t)laddr.port << 32),
-		(uint64_t)raddr.ip | ((uint64_t)raddr.port << 32) |
-		((uint64_t)proto << 48));
-}
+	uint64_t a, b;
+	uint32_t seed = trans_5tuple_words(proto, &laddr, &raddr, &a, &b);
 
-static DEFINE_SPINLOCK(trans_lock);
-static struct rcu_hlist_head trans_tbl[TRANS_TBL_SIZE];
+	return hash_crc32c_two(seed, a, b);
+}
 
-/**
- * trans_table_add - adds an entry to the match table
- * @e: the entry to add
+/*
+ * Updates are serialized per stripe of buckets rather than by a single global
+ * lock, so connection setup and teardown on different kthreads rarely contend.
+ * Lookups and full table walks are lock-free under RCU.
  *
- * Returns 0 if successful, or -EADDRINUSE if a conflicting entry is already in
- * the table, or -EINVAL if the local port is zero.
+ * The table grows by doubling, one bucket at a time, while lookups continue.
+ * A resize links the new table as the old one's @future, then moves the
+ * entries of each old bucket over, tail first. A moved entry is linked into
+ * its new bucket before it is unlinked from the old one, so a lookup that
+ * searches the old table and then its future can't miss it. Table sizes are
+ * multiples of TRANS_LOCK_NR, so an entry's old and new buckets share a stripe.
  */
-int trans_table_add(struct trans_entry *e)
-{
-	struct trans_entry *pos;
-	struct rcu_hlist_node *node;
-	uint32_t idx;
+struct trans_lock {
+	spinlock_t	lock;
+	unsigned int	nr;	/* the entries in this stripe's buckets */
+} __aligned(CACHE_LINE_SIZE);
+
+struct trans_tbl {
+	uint32_t		mask;
+	struct trans_tbl __rcu	*future; /* the table being resized into */
+	struct rcu_hlist_head	buckets[];
+};
 
-	/* port zero is reserved for ephemeral port auto-assign */
-	if (e->laddr.port == 0)
-		return -EINVAL;
+BUILD_ASSERT(is_power_of_two(TRANS_LOCK_NR));
+BUILD_ASSERT(TRANS_TBL_MIN % TRANS_LOCK_NR == 0);
 
+static struct trans_lock trans_locks[TRANS_LOCK_NR];
+static struct trans_tbl __rcu *trans_tbl;
+static atomic_t trans_resizing;
+
+static uint32_t trans_entry_hash(struct trans_entry *e)
+{
 	assert(e->match == TRANS_MATCH_3TUPLE ||
 	       e->match == TRANS_MATCH_5TUPLE);
 	if (e->match == TRANS_MATCH_3TUPLE)
-		idx = trans_hash_3tuple(e->proto, e->laddr);
-	else
-		idx = trans_hash_5tuple(e->proto, e->laddr, e->raddr);
-	idx %= TRANS_TBL_SIZE;
+		return trans_hash_3tuple(e->proto, e->laddr);
+	return trans_hash_5tuple(e->proto, e->laddr, e->raddr);
+}
+
+static inline struct trans_lock *trans_stripe(uint32_t hash)
+{
+	return &trans_locks[hash & (TRANS_LOCK_NR - 1)];
+}
+
+static struct trans_tbl *trans_tbl_alloc(uint32_t size)
+{
+	struct trans_tbl *tbl;
+	uint32_t i;
+
+	tbl = aligned_alloc(CACHE_LINE_SIZE, sizeof(*tbl) +
+			    sizeof(struct rcu_hlist_head) * size);
+	if (!tbl)
+		return NULL;
+
+	tbl->mask = size - 1;
+	RCU_INIT_POINTER(tbl->future, NULL);
+	for (i = 0; i < size; i++)
+		rcu_hlist_init_head(&tbl->buckets[i]);
+	return tbl;
+}
+
+/* moves every entry in an old bucket to the future table */
+static void trans_rehash_bucket(struct trans_tbl *old, struct trans_tbl *new,
+				uint32_t idx)
+{
+	struct rcu_hlist_head *h = &old->buckets[idx];
+	struct rcu_hlist_node *node, *tail;
+	struct rcu_hlist_node * __rcu *pprev;
+	struct trans_entry *e;
+	uint32_t hash;
+
+	while (!rcu_hlist_empty(h, true)) {
+		/* readers still in the old chain continue into the new one */
+		tail = NULL;
+		rcu_hlist_for_each(h, node, true)
+			tail = node;
+
+		e = rcu_hlist_entry(tail, struct trans_entry, link);
+		hash = trans_entry_hash(e);
+		pprev = tail->pprev;
+		rcu_hlist_add_head(&new->buckets[hash & new->mask], tail);
+		rcu_assign_pointer(*pprev, NULL);
+	}
+}
+
+static void trans_resize_worker(void *arg)
+{
+	struct trans_tbl *old, *new;
+	uint32_t i;
+
+	old = rcu_dereference_protected(trans_tbl, true);
+	new = trans_tbl_alloc((old->mask + 1) * 2);
+	if (!new) {
+		log_warn("trans: couldn't grow the table past %u buckets",
+			 old->mask + 1);
+		atomic_write(&trans_resizing, 0);
+		return;
+	}
+
+	/* from here on, inserts go straight to the new table */
+	rcu_assign_pointer(old->future, new);
+	for (i = 0; i <= old->mask; i++) {
+		spinlock_t *l = &trans_stripe(i)->lock;
 
-	spin_lock_np(&trans_lock);
-	rcu_hlist_for_each(&trans_tbl[idx], node, true) {
+		spin_lock_np(l);
+		trans_rehash_bucket(old, new, i);
+		spin_unlock_np(l);
+	}
+
+	rcu_assign_pointer(trans_tbl, new);
+	synchronize_rcu();
+	free(old);
+
+	log_info("trans: grew the table to %u buckets", new->mask + 1);
+	atomic_write(&trans_resizing, 0);
+}
+
+/* starts a resize if a stripe has too many entries for its buckets */
+static void trans_maybe_grow(unsigned int nr)
+{
+	struct trans_tbl *tbl;
+	uint32_t size;
+
+	rcu_read_lock();
+	tbl = rcu_dereference(trans_tbl);
+	size = tbl->mask + 1;
+	rcu_read_unlock();
+
+	if (likely(nr <= size / TRANS_LOCK_NR * TRANS_LOAD_MAX))
+		return;
+	if (size >= TRANS_TBL_MAX || atomic_read(&trans_resizing) ||
+	    !atomic_cmpxchg(&trans_resizing, 0, 1))
+		return;
+
+	if (thread_spawn(trans_resize_worker, NULL))
+		atomic_write(&trans_resizing, 0);
+}
+
+/* finds the table an insert should go to, must hold a stripe lock */
+static struct trans_tbl *trans_tbl_locked(void)
+{
+	struct trans_tbl *tbl, *future;
+
+	tbl = rcu_dereference_protected(trans_tbl, true);
+	future = rcu_dereference_protected(tbl->future, true);
+	return future ? future : tbl;
+}
+
+static bool trans_entry_conflicts(struct rcu_hlist_head *h,
+				  struct trans_entry *e)
+{
+	struct trans_entry *pos;
+	struct rcu_hlist_node *node;
+
+	rcu_hlist_for_each(h, node, true) {
 		pos = rcu_hlist_entry(node, struct trans_entry, link);
 		if (pos->match != e->match)
 			continue;
 		if (e->match == TRANS_MATCH_3TUPLE &&
 		    e->proto == pos->proto &&
-		    e->laddr.ip == pos->laddr.ip &&
+		    netaddr_ip_equal(&e->laddr, &pos->laddr) &&
 		    e->laddr.port == pos->laddr.port) {
-			spin_unlock_np(&trans_lock);
-			return -EADDRINUSE;
+			return true;
 		} else if (e->proto == pos->proto &&
-			   e->laddr.ip == pos->laddr.ip &&
+			   netaddr_ip_equal(&e->laddr, &pos->laddr) &&
 			   e->laddr.port == pos->laddr.port &&
-			   e->raddr.ip == pos->raddr.ip &&
+			   netaddr_ip_equal(&e->raddr, &pos->raddr) &&
 			   e->raddr.port == pos->raddr.port) {
-			spin_unlock_np(&trans_lock);
-			return -EADDRINUSE;
+			return true;
 		}
 	}
-	rcu_hlist_add_head(&trans_tbl[idx], &e->link);
-	store_release(&ephemeral_offset, ephemeral_offset + 1);
-	spin_unlock_np(&trans_lock);
 
+	return false;
+}
+
+/**
+ * trans_table_add - adds an entry to the match table
+ * @e: the entry to add
+ *
+ * Returns 0 if successful, or -EADDRINUSE if a conflicting entry is already in
+ * the table, or -EINVAL if the local port is zero.
+ */
+int trans_table_add(struct trans_entry *e)
+{
+	struct trans_tbl *tbl, *future;
+	struct trans_lock *s;
+	unsigned int nr;
+	uint32_t hash;
+
+	/* port zero is reserved for ephemeral port auto-assign */
+	if (e->laddr.port == 0)
+		return -EINVAL;
+
+	hash = trans_entry_hash(e);
+	s = trans_stripe(hash);
+
+	spin_lock_np(&s->lock);
+
+	/* during a resize, a conflicting entry may be in either table */
+	tbl = rcu_dereference_protected(trans_tbl, true);
+	future = rcu_dereference_protected(tbl->future, true);
+	if (trans_entry_conflicts(&tbl->buckets[hash & tbl->mask], e) ||
+	    (future && trans_entry_conflicts(
+			&future->buckets[hash & future->mask], e))) {
+		spin_unlock_np(&s->lock);
+		return -EADDRINUSE;
+	}
+
+	tbl = trans_tbl_locked();
+	rcu_hlist_add_head(&tbl->buckets[hash & tbl->mask], &e->link);
+	nr = ++s->nr;
+	spin_unlock_np(&s->lock);
+
+	/* racy across stripes, but this only perturbs port selection */
+	store_release(&ephemeral_offset, ACCESS_ONCE(ephemeral_offset) + 1);
+
+	trans_maybe_grow(nr);
 	return 0;
 }
 
+/*
+ * Ephemeral ports are tracked per protocol and remote address, since a local
+ * port only has to be unique among connections to the same remote. Each
+ * allocator is a bitmap of the ephemeral range with a rotating cursor, so
+ * finding a free port is a short scan no matter how many are taken, and dials
+ * to different remotes take different locks.
+ */
+struct trans_ports {
+	struct trans_ports	*next;
+	uint8_t			proto;
+	struct netaddr		raddr;
+	unsigned int		nr_used;
+	int			cursor;
+	DEFINE_BITMAP(used, NR_EPHEMERAL);
+};
+
+struct trans_ports_bucket {
+	spinlock_t		lock;
+	struct trans_ports	*head;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct trans_ports_bucket trans_ports_tbl[TRANS_PORTS_NR];
+
+static inline struct trans_ports_bucket *
+trans_ports_bucket(uint8_t proto, struct netaddr raddr)
+{
+	return &trans_ports_tbl[trans_hash_3tuple(proto, raddr) %
+				TRANS_PORTS_NR];
+}
+
+/* finds the allocator for a remote, must hold the bucket lock */
+static struct trans_ports **trans_ports_find(struct trans_ports_bucket *b,
+					     uint8_t proto,
+					     struct netaddr raddr)
+{
+	struct trans_ports **pp;
+
+	for (pp = &b->head; *pp; pp = &(*pp)->next) {
+		if ((*pp)->proto == proto &&
+		    netaddr_ip_equal(&(*pp)->raddr, &raddr) &&
+		    (*pp)->raddr.port == raddr.port)
+			break;
+	}
+
+	return pp;
+}
+
 /**
  * trans_table_add_with_ephemeral_port - adds an entry to the match table
  * while automatically selecting the local port number
  * @e: the entry to add
  *
- * We use algorithm 3 from RFC 6056.
+ * Ports are taken from the remote address's bitmap, starting at a randomized
+ * offset (like algorithm 3 from RFC 6056) and continuing from the last port
+ * handed out.
  *
- * Returns 0 if successful or -EADDRNOTAVAIL if all ports are taken.
+ * Returns 0 if successful, -ENOMEM if out of memory, or -EADDRNOTAVAIL if all
+ * ports are taken.
  */
 int trans_table_add_with_ephemeral_port(struct trans_entry *e)
 {
-	uint16_t offset, next_ephemeral = 0;
-	uint16_t num_ephemeral = MAX_EPHEMERAL - MIN_EPHEMERAL + 1;
-	int ret;
+	struct trans_ports_bucket *b;
+	struct trans_ports **pp, *p;
+	int pos, tries, ret = -EADDRNOTAVAIL;
 
 	if (e->match != TRANS_MATCH_5TUPLE)
 		return -EINVAL;
 
-	e->laddr.port = 0;
-	offset = trans_hash_5tuple(e->proto, e->laddr, e->raddr) +
-							load_acquire(&ephemeral_offset);
-	while (next_ephemeral < num_ephemeral) {
-		uint32_t port = MIN_EPHEMERAL +
-				(next_ephemeral++ + offset) % num_ephemeral;
-		e->laddr.port = port;
+	b = trans_ports_bucket(e->proto, e->raddr);
+	spin_lock_np(&b->lock);
+
+	pp = trans_ports_find(b, e->proto, e->raddr);
+	p = *pp;
+	if (!p) {
+		p = smalloc(sizeof(*p));
+		if (unlikely(!p)) {
+			spin_unlock_np(&b->lock);
+			return -ENOMEM;
+		}
+		p->next = NULL;
+		p->proto = e->proto;
+		p->raddr = e->raddr;
+		p->nr_used = 0;
+		e->laddr.port = 0;
+		p->cursor = (trans_hash_5tuple(e->proto, e->laddr, e->raddr) +
+			     load_acquire(&ephemeral_offset)) % NR_EPHEMERAL;
+		bitmap_init(p->used, NR_EPHEMERAL, false);
+		*pp = p;
+	}
+
+	/*
+	 * A port can still conflict with an entry bound to it explicitly, so
+	 * skip over any that the table rejects.
+	 */
+	for (tries = 0; tries < NR_EPHEMERAL - p->nr_used; tries++) {
+		pos = bitmap_find_next_cleared(p->used, NR_EPHEMERAL,
+					       p->cursor);
+		if (pos == NR_EPHEMERAL)
+			pos = bitmap_find_next_cleared(p->used, NR_EPHEMERAL, 0);
+		if (pos == NR_EPHEMERAL)
+			break;
+		p->cursor = (pos + 1) % NR_EPHEMERAL;
+
+		e->laddr.port = MIN_EPHEMERAL + pos;
 		ret = trans_table_add(e);
-		if (!ret)
-			return 0;
+		if (ret == 0) {
+			bitmap_set(p->used, pos);
+			p->nr_used++;
+			e->ephemeral = true;
+			break;
+		}
+		ret = -EADDRNOTAVAIL;
+	}
+
+	/* don't keep an allocator for a remote with no connections */
+	if (p->nr_used == 0) {
+		*pp = p->next;
+		sfree(p);
 	}
+	spin_unlock_np(&b->lock);
 
-	return -EADDRNOTAVAIL;
+	return ret;
+}
+
+/* returns an entry's ephemeral port to its allocator */
+static void trans_ports_release(struct trans_entry *e)
+{
+	struct trans_ports_bucket *b;
+	struct trans_ports **pp, *p;
+
+	b = trans_ports_bucket(e->proto, e->raddr);
+	spin_lock_np(&b->lock);
+	pp = trans_ports_find(b, e->proto, e->raddr);
+	p = *pp;
+	assert(p);
+	bitmap_clear(p->used, e->laddr.port - MIN_EPHEMERAL);
+	if (--p->nr_used == 0) {
+		*pp = p->next;
+		sfree(p);
+	}
+	spin_unlock_np(&b->lock);
+	e->ephemeral = false;
 }
 
 /**
@@ -135,9 +457,42 @@ int trans_table_add_with_ephemeral_port(struct trans_entry *e)
  */
 void trans_table_remove(struct trans_entry *e)
 {
-	spin_lock_np(&trans_lock);
+	struct trans_lock *s = trans_stripe(trans_entry_hash(e));
+
+	spin_lock_np(&s->lock);
 	rcu_hlist_del(&e->link);
-	spin_unlock_np(&trans_lock);
+	s->nr--;
+	spin_unlock_np(&s->lock);
+
+	if (e->ephemeral)
+		trans_ports_release(e);
+}
+
+/**
+ * trans_table_replace - swaps an entry in the match table for another
+ * @old: the entry to remove
+ * @new: the entry to add, with the same match type and addresses
+ *
+ * Lookups find one entry or the other, never neither. An ephemeral port stays
+ * reserved, now by @new. The caller is responsible for eventually freeing
+ * @old with rcu_free(), without removing it again.
+ */
+void trans_table_replace(struct trans_entry *old, struct trans_entry *new)
+{
+	uint32_t hash = trans_entry_hash(old);
+	struct trans_lock *s = trans_stripe(hash);
+	struct trans_tbl *tbl;
+
+	assert(hash == trans_entry_hash(new));
+
+	spin_lock_np(&s->lock);
+	tbl = trans_tbl_locked();
+	rcu_hlist_add_head(&tbl->buckets[hash & tbl->mask], &new->link);
+	rcu_hlist_del(&old->link);
+	spin_unlock_np(&s->lock);
+
+	new->ephemeral = old->ephemeral;
+	old->ephemeral = false;
 }
 
 /* the first 4 bytes are identical for TCP and UDP */
@@ -145,54 +500,87 @@ struct l4_hdr {
 	uint16_t sport, dport;
 };
 
-static struct trans_entry *trans_lookup(struct mbuf *m)
+/* the addresses a packet is demultiplexed on */
+struct trans_key {
+	struct netaddr	laddr;
+	struct netaddr	raddr;
+	uint8_t		proto;
+	uint32_t	hash;	/* of the 5-tuple */
+};
+
+/*
+ * Parses a packet's addresses, but not the hash. Returns false if it has no
+ * valid L4 header.
+ */
+static bool __trans_parse(struct mbuf *m, struct trans_key *k)
 {
-	const struct ip_hdr *iphdr;
 	const struct l4_hdr *l4hdr;
-	struct trans_entry *e;
-	struct rcu_hlist_node *node;
-	struct netaddr laddr, raddr;
-	uint32_t hash;
-
-	assert(rcu_read_lock_held());
 
 	/* set up the network header pointers */
 	mbuf_mark_transport_offset(m);
-	iphdr = mbuf_network_hdr(m, *iphdr);
-	if (unlikely(iphdr->proto != IPPROTO_UDP &&
-		     iphdr->proto != IPPROTO_TCP))
-		return NULL;
+	k->proto = net_rx_proto(m);
+	if (unlikely(k->proto != IPPROTO_UDP && k->proto != IPPROTO_TCP))
+		return false;
 	l4hdr = (struct l4_hdr *)mbuf_data(m);
 	if (unlikely(mbuf_length(m) < sizeof(*l4hdr)))
-		return NULL;
+		return false;
 
 	/* parse the source and destination network address */
-	laddr.ip = ntoh32(iphdr->daddr);
-	laddr.port = ntoh16(l4hdr->dport);
-	raddr.ip = ntoh32(iphdr->saddr);
-	raddr.port = ntoh16(l4hdr->sport);
+	k->laddr = net_rx_daddr(m, ntoh16(l4hdr->dport));
+	/* groups and broadcasts go to whichever socket is bound to the port */
+	if (unlikely(k->laddr.family == NET_AF_INET &&
+		     (ip_addr_is_multicast(k->laddr.ip) ||
+		      net_ip_is_broadcast(k->laddr.ip))))
+		k->laddr.ip = netcfg.addr;
+	k->raddr = net_rx_saddr(m, ntoh16(l4hdr->sport));
+	return true;
+}
 
-	/* attempt to find a 5-tuple match */
-	hash = trans_hash_5tuple(iphdr->proto, laddr, raddr);
-	rcu_hlist_for_each(&trans_tbl[hash % TRANS_TBL_SIZE], node, false) {
+/* parses a packet's addresses, returns false if it has no valid L4 header */
+static bool trans_parse(struct mbuf *m, struct trans_key *k)
+{
+	if (unlikely(!__trans_parse(m, k)))
+		return false;
+	k->hash = trans_hash_5tuple(k->proto, k->laddr, k->raddr);
+	return true;
+}
+
+static struct trans_entry *trans_lookup_5tuple(struct trans_tbl *tbl,
+					       const struct trans_key *k)
+{
+	struct trans_entry *e;
+	struct rcu_hlist_node *node;
+
+	rcu_hlist_for_each(&tbl->buckets[k->hash & tbl->mask], node, false) {
 		e = rcu_hlist_entry(node, struct trans_entry, link);
 		if (e->match != TRANS_MATCH_5TUPLE)
 			continue;
-		if (e->proto == iphdr->proto &&
-		    e->laddr.ip == laddr.ip && e->laddr.port == laddr.port &&
-		    e->raddr.ip == raddr.ip && e->raddr.port == raddr.port) {
+		if (e->proto == k->proto &&
+		    netaddr_ip_equal(&e->laddr, &k->laddr) &&
+		    e->laddr.port == k->laddr.port &&
+		    netaddr_ip_equal(&e->raddr, &k->raddr) &&
+		    e->raddr.port == k->raddr.port) {
 			return e;
 		}
 	}
 
-	/* attempt to find a 3-tuple match */
-	hash = trans_hash_3tuple(iphdr->proto, laddr);
-	rcu_hlist_for_each(&trans_tbl[hash % TRANS_TBL_SIZE], node, false) {
+	return NULL;
+}
+
+static struct trans_entry *trans_lookup_3tuple(struct trans_tbl *tbl,
+					       uint32_t hash,
+					       const struct trans_key *k)
+{
+	struct trans_entry *e;
+	struct rcu_hlist_node *node;
+
+	rcu_hlist_for_each(&tbl->buckets[hash & tbl->mask], node, false) {
 		e = rcu_hlist_entry(node, struct trans_entry, link);
 		if (e->match != TRANS_MATCH_3TUPLE)
 			continue;
-		if (e->proto == iphdr->proto &&
-		    e->laddr.ip == laddr.ip && e->laddr.port == laddr.port) {
+		if (e->proto == k->proto &&
+		    netaddr_ip_equal(&e->laddr, &k->laddr) &&
+		    e->laddr.port == k->laddr.port) {
 			return e;
 		}
 	}
@@ -200,36 +588,326 @@ static struct trans_entry *trans_lookup(struct mbuf *m)
 	return NULL;
 }
 
+static struct trans_entry *trans_lookup_key(struct trans_tbl *tbl,
+					    const struct trans_key *k)
+{
+	struct trans_tbl *future;
+	struct trans_entry *e;
+	uint32_t hash;
+
+	assert(rcu_read_lock_held());
+
+	/* an entry that isn't in the old table has moved to its future */
+	future = rcu_dereference(tbl->future);
+
+	/* attempt to find a 5-tuple match */
+	e = trans_lookup_5tuple(tbl, k);
+	if (e)
+		return e;
+	if (unlikely(future)) {
+		e = trans_lookup_5tuple(future, k);
+		if (e)
+			return e;
+	}
+
+	/* attempt to find a 3-tuple match */
+	hash = trans_hash_3tuple(k->proto, k->laddr);
+	e = trans_lookup_3tuple(tbl, hash, k);
+	if (e)
+		return e;
+	if (unlikely(future))
+		return trans_lookup_3tuple(future, hash, k);
+
+	return NULL;
+}
+
+static struct trans_entry *trans_lookup(struct mbuf *m)
+{
+	struct trans_key k;
+
+	assert(rcu_read_lock_held());
+
+	if (unlikely(!trans_parse(m, &k)))
+		return NULL;
+	return trans_lookup_key(rcu_dereference(trans_tbl), &k);
+}
+
+/* the number of buckets trans_table_hist() counts per RCU read-side section */
+#define TRANS_HIST_CHUNK	4096
+
 /**
- * net_rx_trans - receive L4 packets
- * @ms: an array of mbufs to process
- * @nr: the size of the @ms array
+ * trans_table_hist - reports the distribution of chain lengths in the table
+ * @hist: an array of TRANS_HIST_NR counters, for chains of 0, 1, 2 and 3
+ * entries, then 4-7, then 8 or more
+ *
+ * The table is walked a chunk at a time, so preemption is only disabled
+ * briefly even for large tables. If the table is resized, the count starts
+ * over on the new one. Returns the number of buckets.
  */
-void net_rx_trans(struct mbuf **ms, const unsigned int nr)
+unsigned int trans_table_hist(uint64_t *hist)
 {
-	int i;
-	const struct ip_hdr *iphdr;
+	struct rcu_hlist_node *node;
+	struct trans_tbl *tbl, *last = NULL;
+	unsigned int len;
+	uint32_t i = 0, end, size = 0;
+
+	while (true) {
+		rcu_read_lock();
+		tbl = rcu_dereference(trans_tbl);
+		if (tbl != last || tbl->mask + 1 != size) {
+			last = tbl;
+			size = tbl->mask + 1;
+			i = 0;
+			memset(hist, 0, sizeof(*hist) * TRANS_HIST_NR);
+		}
 
-	/* deliver each packet to a L4 protocol handler */
+		end = min(i + TRANS_HIST_CHUNK, size);
+		for (; i < end; i++) {
+			len = 0;
+			rcu_hlist_for_each(&tbl->buckets[i], node, false)
+				len++;
+			hist[len < 4 ? len : (len < 8 ? 4 : 5)]++;
+		}
+		rcu_read_unlock();
+
+		if (i == size)
+			return size;
+		thread_yield();
+	}
+}
+
+/**
+ * trans_table_for_each - calls a function for each entry in the table
+ * @fn: the function, called in an RCU read-side critical section
+ * @arg: an argument passed to @fn
+ *
+ * During a resize, only the old table is walked, so entries added meanwhile
+ * may be missed.
+ */
+void trans_table_for_each(void (*fn)(struct trans_entry *e, void *arg),
+			  void *arg)
+{
+	struct rcu_hlist_node *node;
+	struct trans_tbl *tbl;
+	uint32_t i, size;
+
+	rcu_read_lock();
+	tbl = rcu_dereference(trans_tbl);
+	size = tbl->mask + 1;
+	for (i = 0; i < size; i++) {
+		rcu_hlist_for_each(&tbl->buckets[i], node, false)
+			fn(rcu_hlist_entry(node, struct trans_entry, link), arg);
+	}
+	rcu_read_unlock();
+}
+
+/* handles a packet that matched no entry */
+static void trans_rx_unmatched(struct mbuf *m)
+{
+	if (net_rx_proto(m) == IPPROTO_TCP)
+		tcp_rx_closed(m);
+	mbuf_free(m);
+}
+
+/**
+ * trans_rx_redeliver - looks up an ingress packet again and delivers it
+ * @m: the mbuf, starting at the transport header
+ *
+ * For an entry that just removed itself to hand a packet to whatever matches
+ * next, such as a TCP listener. Must be called in an RCU read-side section.
+ */
+void trans_rx_redeliver(struct mbuf *m)
+{
+	struct trans_entry *e = trans_lookup(m);
+
+	if (e)
+		e->ops->recv(e, m);
+	else
+		trans_rx_unmatched(m);
+}
+
+/*
+ * Looks up the entries of up to TRANS_RX_BATCH packets, hashing them with the
+ * crc32s interleaved and prefetching the table loads. Must be called in an RCU
+ * read-side section.
+ */
+static void trans_lookup_batch(struct mbuf **ms, struct trans_entry **es,
+			       unsigned int nr)
+{
+	struct trans_key keys[TRANS_RX_BATCH];
+	uint64_t words_a[TRANS_RX_BATCH], words_b[TRANS_RX_BATCH];
+	uint32_t seeds[TRANS_RX_BATCH], hashes[TRANS_RX_BATCH];
+	struct trans_tbl *tbl = rcu_dereference(trans_tbl);
+	bool valid[TRANS_RX_BATCH];
+	unsigned int i;
+
+	/* parse the whole batch, then hash it with the crc32s interleaved */
 	for (i = 0; i < nr; i++) {
-		struct mbuf *m = ms[i];
-		struct trans_entry *e;
+		valid[i] = __trans_parse(ms[i], &keys[i]);
+		if (valid[i]) {
+			seeds[i] = trans_5tuple_words(keys[i].proto,
+						      &keys[i].laddr,
+						      &keys[i].raddr,
+						      &words_a[i], &words_b[i]);
+		} else {
+			seeds[i] = 0;
+			words_a[i] = words_b[i] = 0;
+		}
+	}
+	hash_crc32c_two_batch(seeds, words_a, words_b, hashes, nr);
 
-		rcu_read_lock();
-		e = trans_lookup(m);
-		if (unlikely(!e)) {
-			rcu_read_unlock();
-			iphdr = mbuf_network_hdr(m, *iphdr);
-			if (iphdr->proto == IPPROTO_TCP)
-				tcp_rx_closed(m);
-			mbuf_free(m);
+	/* so all of the bucket heads load at once */
+	for (i = 0; i < nr; i++) {
+		keys[i].hash = hashes[i];
+		if (valid[i])
+			prefetch(&tbl->buckets[keys[i].hash & tbl->mask]);
+	}
+
+	/* then the first entry of each chain */
+	for (i = 0; i < nr; i++) {
+		if (valid[i]) {
+			prefetch(rcu_dereference(
+				tbl->buckets[keys[i].hash & tbl->mask].head));
+		}
+	}
+
+	for (i = 0; i < nr; i++)
+		es[i] = valid[i] ? trans_lookup_key(tbl, &keys[i]) : NULL;
+}
+
+/*
+ * Fills in @prio for the looked-up packets of a whole batch. All packets of an
+ * entry get the same priority, so a flow is never reordered, even if a packet
+ * in the middle of the batch marks it or trans_set_priority() races with us.
+ * Returns how many packets are high priority.
+ */
+static unsigned int trans_prio_batch(struct mbuf **ms,
+				     struct trans_entry **es, bool *prio,
+				     unsigned int nr)
+{
+	unsigned int i, j, nr_prio = 0;
+	bool raced = false;
+
+	/* a latency-critical DSCP marks the whole entry for good */
+	if (trans_rx_prio_dscp) {
+		for (i = 0; i < nr; i++) {
+			if (es[i] && !ACCESS_ONCE(es[i]->priority) &&
+			    (net_rx_tos(ms[i]) >> 2) >= trans_rx_prio_dscp)
+				ACCESS_ONCE(es[i]->priority) = true;
+		}
+	}
+
+	for (i = 0; i < nr; i++)
+		prio[i] = es[i] && ACCESS_ONCE(es[i]->priority);
+
+	/* if no entry changed since it was read, every packet agrees */
+	for (i = 0; i < nr; i++)
+		raced |= es[i] && ACCESS_ONCE(es[i]->priority) != prio[i];
+	if (unlikely(raced)) {
+		for (i = 1; i < nr; i++) {
+			for (j = 0; j < i; j++) {
+				if (es[j] == es[i]) {
+					prio[i] = prio[j];
+					break;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < nr; i++)
+		nr_prio += prio[i];
+	return nr_prio;
+}
+
+/*
+ * Dispatches the packets of a batch from trans_lookup_batch() whose priority
+ * is @high. Each entry's packets are handed over together, in the order they
+ * arrived. A TCP listener's packets are looked up again, since earlier
+ * packets can set up the connection a later one belongs to.
+ */
+static void trans_dispatch_batch(struct mbuf **ms, struct trans_entry **es,
+				 const bool *prio, unsigned int nr, bool high)
+{
+	struct mbuf *group[TRANS_RX_BATCH];
+	struct trans_entry *e;
+	unsigned int i, j, n;
+	bool taken[TRANS_RX_BATCH];
+
+	for (i = 0; i < nr; i++)
+		taken[i] = prio[i] != high;
+
+	for (i = 0; i < nr; i++) {
+		if (taken[i])
+			continue;
+		e = es[i];
+		if (e && e->match == TRANS_MATCH_3TUPLE &&
+		    e->proto == IPPROTO_TCP) {
+			trans_rx_redeliver(ms[i]);
 			continue;
 		}
-		e->ops->recv(e, m);
-		rcu_read_unlock();
+		if (!e) {
+			trans_rx_unmatched(ms[i]);
+			continue;
+		}
+
+		n = 0;
+		group[n++] = ms[i];
+		for (j = i + 1; j < nr; j++) {
+			if (taken[j] || es[j] != e)
+				continue;
+			group[n++] = ms[j];
+			taken[j] = true;
+		}
+
+		if (e->ops->recv_batch && n > 1) {
+			e->ops->recv_batch(e, group, n);
+		} else {
+			for (j = 0; j < n; j++)
+				e->ops->recv(e, group[j]);
+		}
 	}
 }
 
+/**
+ * net_rx_trans - receive L4 packets
+ * @ms: an array of mbufs to process
+ * @nr: the size of the @ms array (at most SOFTIRQ_MAX_BUDGET)
+ *
+ * Each chunk of up to TRANS_RX_BATCH packets is hashed and looked up
+ * together, with the table loads prefetched, and the packets for each entry
+ * are dispatched as a group. The packets of high-priority entries (see
+ * trans_set_priority()) in the whole batch go first, so their threads wake up
+ * before a burst of bulk traffic is handled.
+ */
+void net_rx_trans(struct mbuf **ms, const unsigned int nr)
+{
+	struct trans_entry *es[SOFTIRQ_MAX_BUDGET];
+	bool prio[SOFTIRQ_MAX_BUDGET];
+	unsigned int i, nr_prio;
+
+	assert(nr <= SOFTIRQ_MAX_BUDGET);
+
+	rcu_read_lock();
+	for (i = 0; i < nr; i += TRANS_RX_BATCH)
+		trans_lookup_batch(&ms[i], &es[i], min(nr - i, TRANS_RX_BATCH));
+	nr_prio = trans_prio_batch(ms, es, prio, nr);
+
+	if (nr_prio > 0) {
+		STAT(RX_PRIORITY_PACKETS) += nr_prio;
+		for (i = 0; i < nr; i += TRANS_RX_BATCH) {
+			trans_dispatch_batch(&ms[i], &es[i], &prio[i],
+					     min(nr - i, TRANS_RX_BATCH), true);
+		}
+	}
+	if (nr_prio < nr) {
+		for (i = 0; i < nr; i += TRANS_RX_BATCH) {
+			trans_dispatch_batch(&ms[i], &es[i], &prio[i],
+					     min(nr - i, TRANS_RX_BATCH), false);
+		}
+	}
+	rcu_read_unlock();
+}
+
 /**
  * trans_error - reports a network error to the L4 layer
  * @m: the mbuf that triggered the error
@@ -249,16 +927,28 @@ void trans_error(struct mbuf *m, int err)
 /**
  * trans_init - initializes transport protocol infrastructure
  *
- * Returns 0 (always successful).
+ * Returns 0 if successful, otherwise -ENOMEM.
  */
 int trans_init(void)
 {
+	struct trans_tbl *tbl;
 	int i;
 
-	spin_lock_init(&trans_lock);
+	for (i = 0; i < TRANS_LOCK_NR; i++) {
+		spin_lock_init(&trans_locks[i].lock);
+		trans_locks[i].nr = 0;
+	}
+
+	for (i = 0; i < TRANS_PORTS_NR; i++) {
+		spin_lock_init(&trans_ports_tbl[i].lock);
+		trans_ports_tbl[i].head = NULL;
+	}
 
-	for (i = 0; i < TRANS_TBL_SIZE; i++)
-		rcu_hlist_init_head(&trans_tbl[i]);
+	tbl = trans_tbl_alloc(TRANS_TBL_MIN);
+	if (!tbl)
+		return -ENOMEM;
+	RCU_INIT_POINTER(trans_tbl, tbl);
+	atomic_write(&trans_resizing, 0);
 
 	trans_seed = rand_crc32c(0x48FA8BC1 ^ iok.key);
 	return 0;
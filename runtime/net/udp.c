@@ -6,6 +6,10 @@
 
 #include <base/hash.h>
 #include <base/kref.h>
+#include <base/slab.h>
+#include <base/tcache.h>
+#include <net/chksum.h>
+#include <runtime/overload.h>
 #include <runtime/smalloc.h>
 #include <runtime/rculist.h>
 #include <runtime/sync.h>
@@ -17,9 +21,16 @@
 
 #define UDP_IN_DEFAULT_CAP	512
 #define UDP_OUT_DEFAULT_CAP	2048
+/* the most multicast groups one socket may join */
+#define UDP_MAX_GROUPS		8
 
-static int udp_send_raw(struct mbuf *m, size_t len,
-			struct netaddr laddr, struct netaddr raddr)
+/* sockets get their own cache-aligned, colored slab (see udp_init()) */
+static struct slab udp_conn_slab;
+static struct tcache *udp_conn_tcache;
+static DEFINE_PERTHREAD(struct tcache_perthread, udp_conn_pt);
+
+static void udp_push_hdr(struct mbuf *m, size_t len,
+			 struct netaddr laddr, struct netaddr raddr)
 {
 	struct udp_hdr *udphdr;
 
@@ -28,10 +39,117 @@ static int udp_send_raw(struct mbuf *m, size_t len,
 	udphdr->src_port = hton16(laddr.port);
 	udphdr->dst_port = hton16(raddr.port);
 	udphdr->len = hton16(len + sizeof(*udphdr));
-	udphdr->chksum = 0;
+	/* the NIC completes the checksum from the pseudo-header's sum */
+	udphdr->chksum = net_phdr_cksum(IPPROTO_UDP, &laddr, &raddr,
+					len + sizeof(*udphdr));
+	m->txflags |= OLFLAG_UDP_CHKSUM;
+}
+
+static int udp_send_raw(struct mbuf *m, size_t len,
+			struct netaddr laddr, struct netaddr raddr,
+			struct net_route_cache *rc)
+{
+	udp_push_hdr(m, len, laddr, raddr);
 
 	/* send the IP packet */
-	return net_tx_ip(m, IPPROTO_UDP, raddr.ip);
+	return net_tx_ip_addr(m, IPPROTO_UDP, IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT,
+			      &laddr, &raddr, rc);
+}
+
+/* the largest datagram that can be sent to @raddr */
+static size_t udp_max_payload_for(const struct netaddr *raddr)
+{
+	return udp_max_payload() + sizeof(struct ip_hdr) -
+	       net_ip_hdr_len(raddr);
+}
+
+
+/*
+ * UDP Ingress Rings
+ *
+ * Packets for a socket may arrive on any kthread, so the ingress queue is a
+ * bounded multi-producer ring (after Vyukov). Producers claim a slot with a
+ * compare-and-swap on the tail and never take a lock. Readers are serialized
+ * by the socket's inq_lock, which producers only touch to wake a sleeper.
+ */
+
+struct udp_inq_slot {
+	unsigned long		seq;
+	struct mbuf		*m;
+};
+
+struct udp_inq {
+	atomic64_t		tail;
+	unsigned long		mask;
+	unsigned long		pad[6];
+	struct udp_inq_slot	slots[];
+};
+
+BUILD_ASSERT(offsetof(struct udp_inq, slots) == CACHE_LINE_SIZE);
+
+static struct udp_inq *udp_inq_alloc(int cap)
+{
+	struct udp_inq *q;
+	unsigned long i, size = 1;
+
+	while (size < cap)
+		size <<= 1;
+
+	q = smalloc(sizeof(*q) + sizeof(struct udp_inq_slot) * size);
+	if (!q)
+		return NULL;
+
+	atomic64_write(&q->tail, 0);
+	q->mask = size - 1;
+	for (i = 0; i < size; i++)
+		q->slots[i].seq = i;
+	return q;
+}
+
+/* adds an mbuf to the ring, returns false if it is full */
+static bool udp_inq_push(struct udp_inq *q, struct mbuf *m)
+{
+	struct udp_inq_slot *s;
+	long pos, diff;
+
+	pos = atomic64_read(&q->tail);
+	while (true) {
+		s = &q->slots[pos & q->mask];
+		diff = (long)load_acquire(&s->seq) - pos;
+		if (diff == 0) {
+			if (atomic64_cmpxchg(&q->tail, pos, pos + 1))
+				break;
+			pos = atomic64_read(&q->tail);
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic64_read(&q->tail);
+		}
+	}
+
+	s->m = m;
+	store_release(&s->seq, pos + 1);
+	return true;
+}
+
+/* removes the oldest mbuf from the ring, or returns NULL if empty */
+static struct mbuf *udp_inq_pop(struct udp_inq *q, unsigned long *head)
+{
+	struct udp_inq_slot *s = &q->slots[*head & q->mask];
+	struct mbuf *m;
+
+	if (load_acquire(&s->seq) != *head + 1)
+		return NULL;
+
+	m = s->m;
+	store_release(&s->seq, *head + q->mask + 1);
+	(*head)++;
+	return m;
+}
+
+static bool udp_inq_empty(struct udp_inq *q, unsigned long head)
+{
+	return load_acquire(&q->slots[head & q->mask].seq) != head + 1;
 }
 
 
@@ -42,14 +160,21 @@ static int udp_send_raw(struct mbuf *m, size_t len,
 struct udpconn {
 	struct trans_entry	e;
 	bool			shutdown;
+	bool			nonblock; /* return -EAGAIN instead of blocking */
+	unsigned int		busy_poll_us; /* spin before reads block */
+	poll_trigger_t		poll; /* readiness notification, see poll.h */
 
 	/* ingress support */
-	spinlock_t		inq_lock;
-	int			inq_cap;
-	int			inq_len;
+	struct udp_inq __rcu	*inq;
+	bool			inq_waiting;
 	int			inq_err;
+	int			inq_cap;
+	atomic64_t		inq_drops;
+
+	/* ingress consumers, protected by inq_lock */
+	spinlock_t		inq_lock;
+	unsigned long		inq_head;
 	waitq_t			inq_wq;
-	struct mbufq		inq;
 
 	/* egress support */
 	spinlock_t		outq_lock;
@@ -57,36 +182,92 @@ struct udpconn {
 	int			outq_cap;
 	int			outq_len;
 	waitq_t			outq_wq;
+
+	/* IPv4 multicast groups joined through this socket */
+	spinlock_t		groups_lock;
+	int			nr_groups;
+	uint32_t		groups[UDP_MAX_GROUPS];
 };
 
-/* handles ingress packets for UDP sockets */
-static void udp_conn_recv(struct trans_entry *e, struct mbuf *m)
+/* the ingress ring, for readers holding inq_lock */
+static inline struct udp_inq *udp_inq_locked(udpconn_t *c)
 {
-	udpconn_t *c = container_of(e, udpconn_t, e);
-	thread_t *th;
+	return rcu_dereference_protected(c->inq, spin_lock_held(&c->inq_lock));
+}
 
+/* adds an ingress packet to the ring, returns true if it was queued */
+static bool udp_conn_enqueue(udpconn_t *c, struct mbuf *m)
+{
 	if (unlikely(!mbuf_pull_hdr_or_null(m, sizeof(struct udp_hdr)))) {
 		mbuf_free(m);
-		return;
+		return false;
 	}
 
-	spin_lock_np(&c->inq_lock);
-	/* drop packet if the ingress queue is full */
-	if (c->inq_len >= c->inq_cap || c->inq_err || c->shutdown) {
-		spin_unlock_np(&c->inq_lock);
+	if (unlikely(ACCESS_ONCE(c->inq_err) || ACCESS_ONCE(c->shutdown))) {
 		mbuf_drop(m);
-		return;
+		return false;
 	}
 
-	/* enqueue the packet on the ingress queue */
-	mbufq_push_tail(&c->inq, m);
-	c->inq_len++;
+	/* enqueue the packet, or drop it if the ingress ring is full */
+	if (unlikely(!udp_inq_push(rcu_dereference(c->inq), m))) {
+		atomic64_inc(&c->inq_drops);
+		STAT(RX_UDP_INQ_DROPS)++;
+		mbuf_drop(m);
+		return false;
+	}
+
+	return true;
+}
+
+/* wakes up to @nr readers after packets were queued */
+static void udp_conn_wake(udpconn_t *c, int nr)
+{
+	thread_t *ths[TRANS_RX_BATCH];
+	int i, woken = 0;
+
+	poll_set(&c->poll, POLL_IN);
+
+	/* pairs with the barrier in udp_read_wait() */
+	mb();
+	if (!load_acquire(&c->inq_waiting))
+		return;
 
-	/* wake up a waiter */
-	th = waitq_signal(&c->inq_wq, &c->inq_lock);
+	nr = min(nr, TRANS_RX_BATCH);
+	spin_lock_np(&c->inq_lock);
+	while (woken < nr) {
+		ths[woken] = waitq_signal(&c->inq_wq, &c->inq_lock);
+		if (!ths[woken])
+			break;
+		woken++;
+	}
+	c->inq_waiting = !waitq_empty(&c->inq_wq);
 	spin_unlock_np(&c->inq_lock);
 
-	waitq_signal_finish(th);
+	for (i = 0; i < woken; i++)
+		waitq_signal_finish(ths[i]);
+}
+
+/* handles ingress packets for UDP sockets */
+static void udp_conn_recv(struct trans_entry *e, struct mbuf *m)
+{
+	udpconn_t *c = container_of(e, udpconn_t, e);
+
+	if (udp_conn_enqueue(c, m))
+		udp_conn_wake(c, 1);
+}
+
+/* handles a batch of ingress packets for the same UDP socket */
+static void udp_conn_recv_batch(struct trans_entry *e, struct mbuf **ms,
+				int nr)
+{
+	udpconn_t *c = container_of(e, udpconn_t, e);
+	int i, queued = 0;
+
+	for (i = 0; i < nr; i++)
+		queued += udp_conn_enqueue(c, ms[i]);
+
+	if (queued)
+		udp_conn_wake(c, queued);
 }
 
 /* handles network errors for UDP sockets */
@@ -101,27 +282,57 @@ static void udp_conn_err(struct trans_entry *e, int err)
 	c->inq_err = err;
 	spin_unlock_np(&c->inq_lock);
 
-	if (do_release)
+	if (do_release) {
 		waitq_release(&c->inq_wq);
+		poll_set(&c->poll, POLL_IN);
+	}
 }
 
 /* operations for UDP sockets */
 const struct trans_ops udp_conn_ops = {
 	.recv = udp_conn_recv,
+	.recv_batch = udp_conn_recv_batch,
 	.err = udp_conn_err,
 };
 
-static void udp_init_conn(udpconn_t *c)
+static udpconn_t *udp_conn_alloc(void)
+{
+	udpconn_t *c;
+
+	preempt_disable();
+	c = tcache_alloc(&perthread_get(udp_conn_pt));
+	preempt_enable();
+	return c;
+}
+
+static void udp_conn_free(udpconn_t *c)
+{
+	preempt_disable();
+	tcache_free(&perthread_get(udp_conn_pt), c);
+	preempt_enable();
+}
+
+static int udp_init_conn(udpconn_t *c)
 {
+	struct udp_inq *q;
+
 	c->shutdown = false;
+	c->nonblock = false;
+	c->busy_poll_us = 0;
+	poll_trigger_init(&c->poll);
 
 	/* initialize ingress fields */
-	spin_lock_init(&c->inq_lock);
-	c->inq_cap = UDP_IN_DEFAULT_CAP;
-	c->inq_len = 0;
+	q = udp_inq_alloc(UDP_IN_DEFAULT_CAP);
+	if (!q)
+		return -ENOMEM;
+	RCU_INIT_POINTER(c->inq, q);
+	c->inq_waiting = false;
 	c->inq_err = 0;
+	c->inq_cap = UDP_IN_DEFAULT_CAP;
+	atomic64_write(&c->inq_drops, 0);
+	spin_lock_init(&c->inq_lock);
+	c->inq_head = 0;
 	waitq_init(&c->inq_wq);
-	mbufq_init(&c->inq);
 
 	/* initialize egress fields */
 	spin_lock_init(&c->outq_lock);
@@ -129,18 +340,35 @@ static void udp_init_conn(udpconn_t *c)
 	c->outq_cap = UDP_OUT_DEFAULT_CAP;
 	c->outq_len = 0;
 	waitq_init(&c->outq_wq);
+
+	spin_lock_init(&c->groups_lock);
+	c->nr_groups = 0;
+	return 0;
+}
+
+/* frees every mbuf left in an ingress ring */
+static void udp_inq_drain(struct udp_inq *q, unsigned long *head)
+{
+	struct mbuf *m;
+
+	while ((m = udp_inq_pop(q, head)) != NULL)
+		mbuf_free(m);
 }
 
 static void udp_finish_release_conn(struct rcu_head *h)
 {
 	udpconn_t *c = container_of(h, udpconn_t, e.rcu);
-	sfree(c);
+	struct udp_inq *q = rcu_dereference_protected(c->inq, true);
+
+	/* a packet may have slipped in before the socket left the table */
+	udp_inq_drain(q, &c->inq_head);
+	sfree(q);
+	udp_conn_free(c);
 }
 
 static void udp_release_conn(udpconn_t *c)
 {
 	assert(waitq_empty(&c->inq_wq) && waitq_empty(&c->outq_wq));
-	assert(mbufq_empty(&c->inq));
 	rcu_free(&c->e.rcu, udp_finish_release_conn);
 }
 
@@ -157,17 +385,20 @@ int udp_dial(struct netaddr laddr, struct netaddr raddr, udpconn_t **c_out)
 	udpconn_t *c;
 	int ret;
 
-	/* only can support one local IP so far */
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	/* only can support one local IP per family so far */
+	ret = net_bind_laddr(&laddr, &raddr);
+	if (ret)
+		return ret;
 
-	c = smalloc(sizeof(*c));
+	c = udp_conn_alloc();
 	if (!c)
 		return -ENOMEM;
 
-	udp_init_conn(c);
+	ret = udp_init_conn(c);
+	if (ret) {
+		udp_conn_free(c);
+		return ret;
+	}
 	trans_init_5tuple(&c->e, IPPROTO_UDP, &udp_conn_ops, laddr, raddr);
 
 	if (laddr.port == 0)
@@ -175,7 +406,8 @@ int udp_dial(struct netaddr laddr, struct netaddr raddr, udpconn_t **c_out)
 	else
 		ret = trans_table_add(&c->e);
 	if (ret) {
-		sfree(c);
+		sfree(rcu_dereference_protected(c->inq, true));
+		udp_conn_free(c);
 		return ret;
 	}
 
@@ -195,22 +427,26 @@ int udp_listen(struct netaddr laddr, udpconn_t **c_out)
 	udpconn_t *c;
 	int ret;
 
-	/* only can support one local IP so far */
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	/* only can support one local IP per family so far */
+	ret = net_bind_laddr(&laddr, NULL);
+	if (ret)
+		return ret;
 
-	c = smalloc(sizeof(*c));
+	c = udp_conn_alloc();
 	if (!c)
 		return -ENOMEM;
 
-	udp_init_conn(c);
+	ret = udp_init_conn(c);
+	if (ret) {
+		udp_conn_free(c);
+		return ret;
+	}
 	trans_init_3tuple(&c->e, IPPROTO_UDP, &udp_conn_ops, laddr);
 
 	ret = trans_table_add(&c->e);
 	if (ret) {
-		sfree(c);
+		sfree(rcu_dereference_protected(c->inq, true));
+		udp_conn_free(c);
 		return ret;
 	}
 
@@ -245,17 +481,265 @@ struct netaddr udp_remote_addr(udpconn_t *c)
  * @read_mbufs: the maximum number of read mbufs to buffer
  * @write_mbufs: the maximum number of write mbufs to buffer
  *
+ * The receive ring holds @read_mbufs rounded up to a power of two. Resizing it
+ * waits for an RCU grace period, so don't call this on a hot path.
+ *
  * Returns 0 if the inputs were valid.
  */
 int udp_set_buffers(udpconn_t *c, int read_mbufs, int write_mbufs)
 {
-	c->inq_cap = read_mbufs;
+	struct udp_inq *newq, *oldq;
+	unsigned long head = 0;
+	struct mbuf *m;
+
+	if (read_mbufs <= 0 || write_mbufs <= 0)
+		return -EINVAL;
+
 	c->outq_cap = write_mbufs;
+	if (read_mbufs == c->inq_cap)
+		return 0;
+
+	newq = udp_inq_alloc(read_mbufs);
+	if (!newq)
+		return -ENOMEM;
+
+	/* readers switch rings at once, receivers after a grace period */
+	spin_lock_np(&c->inq_lock);
+	oldq = udp_inq_locked(c);
+	rcu_assign_pointer(c->inq, newq);
+	swapvars(head, c->inq_head);
+	c->inq_cap = read_mbufs;
+	spin_unlock_np(&c->inq_lock);
+	synchronize_rcu();
+
+	/* move over what arrived in the old ring, dropping any overflow */
+	while ((m = udp_inq_pop(oldq, &head)) != NULL) {
+		if (!udp_inq_push(newq, m)) {
+			atomic64_inc(&c->inq_drops);
+			mbuf_free(m);
+		}
+	}
+	sfree(oldq);
+
+	return 0;
+}
+
+/**
+ * udp_rx_drops - returns how many datagrams were dropped for a full ring
+ * @c: the UDP socket
+ */
+uint64_t udp_rx_drops(udpconn_t *c)
+{
+	return atomic64_read(&c->inq_drops);
+}
+
+/**
+ * udp_join_group - receives datagrams sent to an IPv4 multicast group
+ * @c: the UDP socket, bound to an IPv4 address
+ * @group: the group address (in native byte order)
+ *
+ * Datagrams to @group and the socket's port are delivered to the socket. The
+ * iokernel copies a datagram to each runtime that joined its group by sharing
+ * one buffer. Groups are left when the socket is closed.
+ *
+ * Returns 0 if successful, -EAFNOSUPPORT if @c isn't IPv4, -EALREADY if it
+ * joined @group already, -EINVAL if @group isn't a routable multicast group,
+ * -ENOSPC if too many groups are joined, or -EAGAIN if this should be retried.
+ */
+int udp_join_group(udpconn_t *c, uint32_t group)
+{
+	int i, ret;
+
+	if (c->e.laddr.family != NET_AF_INET)
+		return -EAFNOSUPPORT;
+
+	spin_lock_np(&c->groups_lock);
+	for (i = 0; i < c->nr_groups; i++) {
+		if (c->groups[i] == group) {
+			spin_unlock_np(&c->groups_lock);
+			return -EALREADY;
+		}
+	}
+	if (c->nr_groups >= UDP_MAX_GROUPS) {
+		spin_unlock_np(&c->groups_lock);
+		return -ENOSPC;
+	}
+
+	ret = net_mcast_join(group);
+	if (!ret)
+		c->groups[c->nr_groups++] = group;
+	spin_unlock_np(&c->groups_lock);
+	return ret;
+}
+
+/**
+ * udp_leave_group - stops receiving datagrams sent to a multicast group
+ * @c: the UDP socket
+ * @group: the group address (in native byte order)
+ *
+ * Returns 0 if successful, or -ENOENT if @c hasn't joined @group.
+ */
+int udp_leave_group(udpconn_t *c, uint32_t group)
+{
+	int i;
+
+	spin_lock_np(&c->groups_lock);
+	for (i = 0; i < c->nr_groups; i++) {
+		if (c->groups[i] == group)
+			break;
+	}
+	if (i == c->nr_groups) {
+		spin_unlock_np(&c->groups_lock);
+		return -ENOENT;
+	}
 
-	/* TODO: free mbufs that go over new limits? */
+	c->groups[i] = c->groups[--c->nr_groups];
+	net_mcast_leave(group);
+	spin_unlock_np(&c->groups_lock);
 	return 0;
 }
 
+/**
+ * udp_max_payload - returns the largest datagram that can be sent
+ *
+ * Depends on the "mtu" config option, UDP_MAX_PAYLOAD by default.
+ */
+size_t udp_max_payload(void)
+{
+	return netcfg.mtu - sizeof(struct ip_hdr) - sizeof(struct udp_hdr);
+}
+
+/* checked while busy-polling, so only a hint for udp_read_wait() */
+static bool udp_read_ready(void *arg)
+{
+	udpconn_t *c = arg;
+	bool ready;
+
+	spin_lock_np(&c->inq_lock);
+	ready = !udp_inq_empty(udp_inq_locked(c), c->inq_head) ||
+		c->inq_err || c->shutdown;
+	spin_unlock_np(&c->inq_lock);
+	return ready;
+}
+
+/*
+ * Waits until there are datagrams to read. Called with inq_lock held. Returns
+ * 1 with the lock still held if there are, otherwise releases it and returns
+ * 0 if the socket is drained and shutdown, or < 0 on an error.
+ */
+static int udp_read_wait(udpconn_t *c)
+{
+	bool busy_polled = false;
+
+	/* block until there is an actionable event */
+	while (udp_inq_empty(udp_inq_locked(c), c->inq_head) &&
+	       !c->inq_err && !c->shutdown) {
+		if (c->nonblock) {
+			spin_unlock_np(&c->inq_lock);
+			return -EAGAIN;
+		}
+		if (c->busy_poll_us > 0 && !busy_polled) {
+			busy_polled = true;
+			spin_unlock_np(&c->inq_lock);
+			net_busy_poll(c->busy_poll_us, udp_read_ready, c);
+			spin_lock_np(&c->inq_lock);
+			continue;
+		}
+		/* pairs with the barrier in udp_conn_recv() */
+		store_release(&c->inq_waiting, true);
+		mb();
+		if (!udp_inq_empty(udp_inq_locked(c), c->inq_head))
+			break;
+		waitq_wait(&c->inq_wq, &c->inq_lock);
+	}
+
+	/* is the socket drained and shutdown? */
+	if (udp_inq_empty(udp_inq_locked(c), c->inq_head) && c->shutdown) {
+		spin_unlock_np(&c->inq_lock);
+		return 0;
+	}
+
+	/* propagate error status code if an error was detected */
+	if (c->inq_err) {
+		spin_unlock_np(&c->inq_lock);
+		return -c->inq_err;
+	}
+
+	return 1;
+}
+
+/* copies a datagram into an iovec, returns the number of bytes copied */
+static size_t udp_copy_to_iov(struct mbuf *m, const struct iovec *iov,
+			      int iovcnt)
+{
+	size_t n, len = 0, remain = mbuf_length(m);
+	unsigned char *pos = mbuf_data(m);
+	int i;
+
+	for (i = 0; i < iovcnt && remain > 0; i++) {
+		n = min(iov[i].iov_len, remain);
+		memcpy(iov[i].iov_base, pos, n);
+		pos += n;
+		len += n;
+		remain -= n;
+	}
+
+	return len;
+}
+
+static ssize_t __udp_readv_from(udpconn_t *c, const struct iovec *iov,
+				int iovcnt, struct netaddr *raddr,
+				struct net_rx_ts *ts)
+{
+	ssize_t ret;
+	struct mbuf *m;
+
+	spin_lock_np(&c->inq_lock);
+	ret = udp_read_wait(c);
+	if (ret <= 0)
+		return ret;
+
+	/* pop an mbuf and deliver the payload */
+	m = udp_inq_pop(udp_inq_locked(c), &c->inq_head);
+	spin_unlock_np(&c->inq_lock);
+
+	ret = udp_copy_to_iov(m, iov, iovcnt);
+	if (raddr) {
+		struct udp_hdr *udphdr = mbuf_transport_hdr(m, *udphdr);
+		*raddr = net_rx_saddr(m, ntoh16(udphdr->src_port));
+		if (c->e.match == TRANS_MATCH_5TUPLE) {
+			assert(netaddr_ip_equal(&c->e.raddr, raddr) &&
+			       c->e.raddr.port == raddr->port);
+		}
+	}
+	if (ts)
+		net_rx_get_ts(m, ts);
+	mbuf_free(m);
+	return ret;
+}
+
+/**
+ * udp_read_from_ts - reads from a UDP socket, with the datagram's arrival time
+ * @c: the UDP socket
+ * @buf: a buffer to store the datagram
+ * @len: the size of @buf
+ * @raddr: a pointer to store the remote address of the datagram (if not NULL)
+ * @ts: a pointer to store when the datagram arrived (if not NULL)
+ *
+ * WARNING: This a blocking function. It will wait until a datagram is
+ * available, an error occurs, or the socket is shutdown.
+ *
+ * Returns the number of bytes in the datagram, or @len if the datagram
+ * is >= @len in size. If the socket has been shutdown, returns 0.
+ */
+ssize_t udp_read_from_ts(udpconn_t *c, void *buf, size_t len,
+			 struct netaddr *raddr, struct net_rx_ts *ts)
+{
+	struct iovec iov = {.iov_base = buf, .iov_len = len};
+
+	return __udp_readv_from(c, &iov, 1, raddr, ts);
+}
+
 /**
  * udp_read_from - reads from a UDP socket
  * @c: the UDP socket
@@ -272,103 +756,435 @@ int udp_set_buffers(udpconn_t *c, int read_mbufs, int write_mbufs)
 ssize_t udp_read_from(udpconn_t *c, void *buf, size_t len,
                       struct netaddr *raddr)
 {
+	return udp_read_from_ts(c, buf, len, raddr, NULL);
+}
+
+/**
+ * udp_readv_from - reads a datagram from a UDP socket into several buffers
+ * @c: the UDP socket
+ * @iov: the buffers to fill, in order
+ * @iovcnt: the number of entries in @iov
+ * @raddr: a pointer to store the remote address of the datagram (if not NULL)
+ *
+ * WARNING: This a blocking function. It will wait until a datagram is
+ * available, an error occurs, or the socket is shutdown.
+ *
+ * Returns the number of bytes stored, which is less than the datagram's
+ * length if the buffers are too small (the rest is dropped). If the socket
+ * has been shutdown, returns 0.
+ */
+ssize_t udp_readv_from(udpconn_t *c, const struct iovec *iov, int iovcnt,
+		       struct netaddr *raddr)
+{
+	return __udp_readv_from(c, iov, iovcnt, raddr, NULL);
+}
+
+static void udp_tx_release_mbuf(struct mbuf *m)
+{
+	udpconn_t *c = (udpconn_t *)m->release_data;
+	thread_t *th = NULL;
+	bool free_conn;
+
+	spin_lock_np(&c->outq_lock);
+	c->outq_len--;
+	free_conn = (c->outq_free && c->outq_len == 0);
+	if (!c->shutdown) {
+		th = waitq_signal(&c->outq_wq, &c->outq_lock);
+		poll_set(&c->poll, POLL_OUT);
+	}
+	spin_unlock_np(&c->outq_lock);
+	waitq_signal_finish(th);
+
+	net_tx_release_mbuf(m);
+	if (free_conn)
+		udp_release_conn(c);
+}
+
+/**
+ * udp_writev_to - writes a datagram gathered from several buffers
+ * @c: the UDP socket
+ * @iov: the pieces of the payload, in order
+ * @iovcnt: the number of entries in @iov
+ * @raddr: the remote address of the datagram (if not NULL)
+ *
+ * WARNING: This a blocking function. It will wait until space in the transmit
+ * buffer is available or the socket is shutdown.
+ *
+ * Returns the number of payload bytes sent in the datagram. If an error
+ * occurs, returns < 0 to indicate the error code.
+ */
+ssize_t udp_writev_to(udpconn_t *c, const struct iovec *iov, int iovcnt,
+		      const struct netaddr *raddr)
+{
+	struct net_route_cache *rc = NULL;
+	struct netaddr addr;
 	ssize_t ret;
 	struct mbuf *m;
+	size_t len = 0;
+	int i;
 
-	spin_lock_np(&c->inq_lock);
+	if (!raddr) {
+		if (c->e.match == TRANS_MATCH_3TUPLE)
+			return -EDESTADDRREQ;
+		addr = c->e.raddr;
+		rc = &c->e.rc;
+	} else {
+		addr = *raddr;
+		if (addr.family != c->e.laddr.family)
+			return -EAFNOSUPPORT;
+	}
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len > udp_max_payload_for(&addr))
+		return -EMSGSIZE;
+
+	spin_lock_np(&c->outq_lock);
 
 	/* block until there is an actionable event */
-	while (mbufq_empty(&c->inq) && !c->inq_err && !c->shutdown)
-		waitq_wait(&c->inq_wq, &c->inq_lock);
+	while (c->outq_len >= c->outq_cap && !c->shutdown) {
+		if (c->nonblock) {
+			spin_unlock_np(&c->outq_lock);
+			return -EAGAIN;
+		}
+		waitq_wait(&c->outq_wq, &c->outq_lock);
+	}
 
-	/* is the socket drained and shutdown? */
-	if (mbufq_empty(&c->inq) && c->shutdown) {
-		spin_unlock_np(&c->inq_lock);
-		return 0;
+	/* is the socket shutdown? */
+	if (c->shutdown) {
+		spin_unlock_np(&c->outq_lock);
+		return -EPIPE;
 	}
 
-	/* propagate error status code if an error was detected */
-	if (c->inq_err) {
-		spin_unlock_np(&c->inq_lock);
-		return -c->inq_err;
+	c->outq_len++;
+	spin_unlock_np(&c->outq_lock);
+
+	m = net_tx_alloc_mbuf();
+	if (unlikely(!m))
+		return -ENOBUFS;
+
+	/* write datagram payload */
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(mbuf_put(m, iov[i].iov_len), iov[i].iov_base,
+		       iov[i].iov_len);
+	}
+
+	/* override mbuf release method */
+	m->release = udp_tx_release_mbuf;
+	m->release_data = (unsigned long)c;
+
+	ret = udp_send_raw(m, len, c->e.laddr, addr, rc);
+	if (unlikely(ret)) {
+		net_tx_release_mbuf(m);
+		return ret;
 	}
 
-	/* pop an mbuf and deliver the payload */
-	m = mbufq_pop_head(&c->inq);
-	c->inq_len--;
-	spin_unlock_np(&c->inq_lock);
+	return len;
+}
+
+/**
+ * udp_write_to - writes to a UDP socket
+ * @c: the UDP socket
+ * @buf: a buffer from which to load the payload
+ * @len: the length of the payload
+ * @raddr: the remote address of the datagram (if not NULL)
+ *
+ * WARNING: This a blocking function. It will wait until space in the transmit
+ * buffer is available or the socket is shutdown.
+ *
+ * Returns the number of payload bytes sent in the datagram. If an error
+ * occurs, returns < 0 to indicate the error code.
+ */
+ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
+                     const struct netaddr *raddr)
+{
+	struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+
+	return udp_writev_to(c, &iov, 1, raddr);
+}
+
+/**
+ * udp_read - reads from a UDP socket
+ * @c: the UDP socket
+ * @buf: a buffer to store the datagram
+ * @len: the size of @buf
+ *
+ * WARNING: This a blocking function. It will wait until a datagram is
+ * available, an error occurs, or the socket is shutdown.
+ *
+ * Returns the number of bytes in the datagram, or @len if the datagram
+ * is >= @len in size. If the socket has been shutdown, returns 0.
+ */
+ssize_t udp_read(udpconn_t *c, void *buf, size_t len)
+{
+	return udp_read_from(c, buf, len, NULL);
+}
+
+/**
+ * udp_read_batch - reads several datagrams from a UDP socket
+ * @c: the UDP socket
+ * @msgs: the buffers to store the datagrams
+ * @n: the number of entries in @msgs
+ *
+ * Each datagram is stored like udp_read_from(), and its length is written to
+ * the entry's @recv_len. At most UDP_BATCH_MAX datagrams are read per call.
+ *
+ * WARNING: This a blocking function. It will wait until at least one datagram
+ * is available, an error occurs, or the socket is shutdown.
+ *
+ * Returns the number of datagrams read. If the socket has been shutdown,
+ * returns 0. If an error occurs, returns < 0 to indicate the error code.
+ */
+int udp_read_batch(udpconn_t *c, struct udp_msg *msgs, int n)
+{
+	struct mbuf *ms[UDP_BATCH_MAX];
+	int i, ret, nr = 0;
+
+	if (n <= 0)
+		return -EINVAL;
+
+	spin_lock_np(&c->inq_lock);
+	ret = udp_read_wait(c);
+	if (ret <= 0)
+		return ret;
+
+	/* pop the mbufs under a single hold of the lock */
+	n = min(n, UDP_BATCH_MAX);
+	while (nr < n) {
+		ms[nr] = udp_inq_pop(udp_inq_locked(c), &c->inq_head);
+		if (!ms[nr])
+			break;
+		nr++;
+	}
+	spin_unlock_np(&c->inq_lock);
+
+	for (i = 0; i < nr; i++) {
+		struct udp_msg *msg = &msgs[i];
+		struct mbuf *m = ms[i];
+
+		if (i + 1 < nr)
+			prefetch(mbuf_data(ms[i + 1]));
+
+		msg->recv_len = min(msg->len, mbuf_length(m));
+		memcpy(msg->buf, mbuf_data(m), msg->recv_len);
+		if (msg->raddr) {
+			struct udp_hdr *udphdr = mbuf_transport_hdr(m, *udphdr);
+			*msg->raddr = net_rx_saddr(m, ntoh16(udphdr->src_port));
+		}
+		mbuf_free(m);
+	}
+
+	return nr;
+}
+
+/* gives back egress slots that were reserved but not used */
+static void udp_tx_unreserve(udpconn_t *c, int nr)
+{
+	struct list_head waiters;
+	bool free_conn;
+
+	list_head_init(&waiters);
+	spin_lock_np(&c->outq_lock);
+	c->outq_len -= nr;
+	free_conn = (c->outq_free && c->outq_len == 0);
+	if (!c->shutdown) {
+		waitq_release_start(&c->outq_wq, &waiters);
+		poll_set(&c->poll, POLL_OUT);
+	}
+	spin_unlock_np(&c->outq_lock);
+	waitq_release_finish(&waiters);
+
+	if (free_conn)
+		udp_release_conn(c);
+}
+
+/**
+ * udp_write_batch - writes several datagrams to a UDP socket
+ * @c: the UDP socket
+ * @msgs: the datagrams to send
+ * @n: the number of entries in @msgs
+ *
+ * Each entry is sent like udp_write_to(). Consecutive datagrams to the same IP
+ * address are transmitted as one burst. At most UDP_BATCH_MAX datagrams, and
+ * no more than there is transmit buffer space for, are sent per call.
+ *
+ * WARNING: This a blocking function. It will wait until space in the transmit
+ * buffer is available or the socket is shutdown.
+ *
+ * Returns the number of datagrams sent. If an error occurs before any were
+ * sent, returns < 0 to indicate the error code.
+ */
+int udp_write_batch(udpconn_t *c, const struct udp_msg *msgs, int n)
+{
+	struct mbuf *ms[UDP_BATCH_MAX];
+	struct netaddr addrs[UDP_BATCH_MAX];
+	int i, start, nr, sent = 0, ret = 0;
+
+	if (n <= 0)
+		return -EINVAL;
+	n = min(n, UDP_BATCH_MAX);
+
+	/* validate everything before committing to send any of it */
+	for (i = 0; i < n; i++) {
+		if (!msgs[i].raddr) {
+			if (c->e.match == TRANS_MATCH_3TUPLE)
+				return -EDESTADDRREQ;
+			addrs[i] = c->e.raddr;
+		} else {
+			addrs[i] = *msgs[i].raddr;
+			if (addrs[i].family != c->e.laddr.family)
+				return -EAFNOSUPPORT;
+		}
+		if (msgs[i].len > udp_max_payload_for(&addrs[i]))
+			return -EMSGSIZE;
+	}
+
+	spin_lock_np(&c->outq_lock);
+
+	/* block until there is an actionable event */
+	while (c->outq_len >= c->outq_cap && !c->shutdown) {
+		if (c->nonblock) {
+			spin_unlock_np(&c->outq_lock);
+			return -EAGAIN;
+		}
+		waitq_wait(&c->outq_wq, &c->outq_lock);
+	}
+
+	/* is the socket shutdown? */
+	if (c->shutdown) {
+		spin_unlock_np(&c->outq_lock);
+		return -EPIPE;
+	}
+
+	nr = min(n, c->outq_cap - c->outq_len);
+	c->outq_len += nr;
+	spin_unlock_np(&c->outq_lock);
+
+	for (i = 0; i < nr; i++) {
+		ms[i] = net_tx_alloc_mbuf();
+		if (unlikely(!ms[i])) {
+			udp_tx_unreserve(c, nr - i);
+			nr = i;
+			if (!nr)
+				return -ENOBUFS;
+			break;
+		}
+
+		/* write datagram payload */
+		memcpy(mbuf_put(ms[i], msgs[i].len), msgs[i].buf, msgs[i].len);
+
+		/* override mbuf release method */
+		ms[i]->release = udp_tx_release_mbuf;
+		ms[i]->release_data = (unsigned long)c;
+
+		udp_push_hdr(ms[i], msgs[i].len, c->e.laddr, addrs[i]);
+	}
 
-	ret = min(len, mbuf_length(m));
-	memcpy(buf, mbuf_data(m), ret);
-	if (raddr) {
-		struct ip_hdr *iphdr = mbuf_network_hdr(m, *iphdr);
-		struct udp_hdr *udphdr = mbuf_transport_hdr(m, *udphdr);
-		raddr->ip = ntoh32(iphdr->saddr);
-		raddr->port = ntoh16(udphdr->src_port);
-		if (c->e.match == TRANS_MATCH_5TUPLE) {
-			assert(c->e.raddr.ip == raddr->ip &&
-			       c->e.raddr.port == raddr->port);
+	/*
+	 * Send each run of datagrams to the same host as one burst. There's no
+	 * burst path for IPv6, so those are sent one at a time.
+	 */
+	for (start = 0, i = 1; i <= nr; i++) {
+		if (i < nr && addrs[i].family == NET_AF_INET &&
+		    netaddr_ip_equal(&addrs[i], &addrs[start]))
+			continue;
+
+		if (likely(!ret)) {
+			if (addrs[start].family == NET_AF_INET6) {
+				ret = net_tx_ip_addr(ms[start], IPPROTO_UDP,
+					IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT,
+					&c->e.laddr, &addrs[start], NULL);
+			} else {
+				ret = net_tx_ip_burst(&ms[start], i - start,
+						IPPROTO_UDP, addrs[start].ip);
+			}
+			if (likely(!ret)) {
+				sent += i - start;
+				start = i;
+				continue;
+			}
 		}
+
+		/* after a failure, drop the rest */
+		for (; start < i; start++)
+			mbuf_free(ms[start]);
 	}
-	mbuf_free(m);
-	return ret;
+
+	return sent ? sent : ret;
 }
 
-static void udp_tx_release_mbuf(struct mbuf *m)
+/* sends a GSO buffer one datagram at a time, when there are no TSO mbufs */
+static ssize_t udp_write_gso_slow(udpconn_t *c, const void *buf, size_t len,
+				  size_t segsz, const struct netaddr *raddr)
 {
-	udpconn_t *c = (udpconn_t *)m->release_data;
-	thread_t *th = NULL;
-	bool free_conn;
+	size_t off, seg_len;
+	ssize_t ret;
 
-	spin_lock_np(&c->outq_lock);
-	c->outq_len--;
-	free_conn = (c->outq_free && c->outq_len == 0);
-	if (!c->shutdown)
-		th = waitq_signal(&c->outq_wq, &c->outq_lock);
-	spin_unlock_np(&c->outq_lock);
-	waitq_signal_finish(th);
+	for (off = 0; off < len; off += seg_len) {
+		seg_len = min(len - off, segsz);
+		ret = udp_write_to(c, (const char *)buf + off, seg_len, raddr);
+		if (ret < 0)
+			return off ? off : ret;
+	}
 
-	net_tx_release_mbuf(m);
-	if (free_conn)
-		udp_release_conn(c);
+	return len;
 }
 
 /**
- * udp_write_to - writes to a UDP socket
+ * udp_write_gso_to - writes a buffer as a series of datagrams
  * @c: the UDP socket
- * @buf: a buffer from which to load the payload
+ * @buf: the payload to send
  * @len: the length of the payload
- * @raddr: the remote address of the datagram (if not NULL)
+ * @segsz: the payload size of each datagram (the last one may be shorter)
+ * @raddr: the remote address of the datagrams (if not NULL)
+ *
+ * Sends the same datagrams as calling udp_write_to() on each @segsz piece of
+ * @buf, but as one large packet that the iokernel splits up, so only one
+ * transmit buffer slot and one queue message are used. Without
+ * enable_tso, the datagrams are sent one at a time instead. At most
+ * UDP_GSO_MAX_SEGS datagrams and UDP_GSO_MAX_LEN bytes are sent per call.
  *
  * WARNING: This a blocking function. It will wait until space in the transmit
  * buffer is available or the socket is shutdown.
  *
- * Returns the number of payload bytes sent in the datagram. If an error
- * occurs, returns < 0 to indicate the error code.
+ * Returns the number of payload bytes sent. If an error occurs, returns < 0 to
+ * indicate the error code.
  */
-ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
-                     const struct netaddr *raddr)
+ssize_t udp_write_gso_to(udpconn_t *c, const void *buf, size_t len,
+			 size_t segsz, const struct netaddr *raddr)
 {
+	struct net_route_cache *rc = NULL;
 	struct netaddr addr;
 	ssize_t ret;
 	struct mbuf *m;
-	void *payload;
 
-	if (len > UDP_MAX_PAYLOAD)
-		return -EMSGSIZE;
 	if (!raddr) {
 		if (c->e.match == TRANS_MATCH_3TUPLE)
 			return -EDESTADDRREQ;
 		addr = c->e.raddr;
+		rc = &c->e.rc;
 	} else {
 		addr = *raddr;
+		if (addr.family != c->e.laddr.family)
+			return -EAFNOSUPPORT;
 	}
+	if (segsz == 0 || segsz > udp_max_payload_for(&addr) ||
+	    len > UDP_GSO_MAX_LEN || div_up(len, segsz) > UDP_GSO_MAX_SEGS)
+		return -EMSGSIZE;
+	if (len <= segsz)
+		return udp_write_to(c, buf, len, raddr);
+	if (!enable_tso)
+		return udp_write_gso_slow(c, buf, len, segsz, raddr);
 
 	spin_lock_np(&c->outq_lock);
 
 	/* block until there is an actionable event */
-	while (c->outq_len >= c->outq_cap && !c->shutdown)
+	while (c->outq_len >= c->outq_cap && !c->shutdown) {
+		if (c->nonblock) {
+			spin_unlock_np(&c->outq_lock);
+			return -EAGAIN;
+		}
 		waitq_wait(&c->outq_wq, &c->outq_lock);
+	}
 
 	/* is the socket shutdown? */
 	if (c->shutdown) {
@@ -379,19 +1195,23 @@ ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
 	c->outq_len++;
 	spin_unlock_np(&c->outq_lock);
 
-	m = net_tx_alloc_mbuf();
-	if (unlikely(!m))
+	m = net_tx_alloc_tso_mbuf();
+	if (unlikely(!m)) {
+		udp_tx_unreserve(c, 1);
 		return -ENOBUFS;
+	}
 
-	/* write datagram payload */
-	payload = mbuf_put(m, len);
-	memcpy(payload, buf, len);
+	memcpy(mbuf_put(m, len), buf, len);
 
 	/* override mbuf release method */
 	m->release = udp_tx_release_mbuf;
 	m->release_data = (unsigned long)c;
 
-	ret = udp_send_raw(m, len, c->e.laddr, addr);
+	/* the iokernel rewrites the lengths and checksum of each datagram */
+	m->txflags |= OLFLAG_UDP_GSO;
+	m->tso_segsz = segsz;
+
+	ret = udp_send_raw(m, len, c->e.laddr, addr, rc);
 	if (unlikely(ret)) {
 		net_tx_release_mbuf(m);
 		return ret;
@@ -400,23 +1220,6 @@ ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
 	return len;
 }
 
-/**
- * udp_read - reads from a UDP socket
- * @c: the UDP socket
- * @buf: a buffer to store the datagram
- * @len: the size of @buf
- *
- * WARNING: This a blocking function. It will wait until a datagram is
- * available, an error occurs, or the socket is shutdown.
- *
- * Returns the number of bytes in the datagram, or @len if the datagram
- * is >= @len in size. If the socket has been shutdown, returns 0.
- */
-ssize_t udp_read(udpconn_t *c, void *buf, size_t len)
-{
-	return udp_read_from(c, buf, len, NULL);
-}
-
 /**
  * udp_write - writes to a UDP socket
  * @c: the UDP socket
@@ -462,6 +1265,90 @@ void udp_shutdown(udpconn_t *c)
 	if (!c->inq_err)
 		waitq_release(&c->inq_wq);
 	waitq_release(&c->outq_wq);
+	poll_set(&c->poll, POLL_IN | POLL_OUT);
+}
+
+/**
+ * udp_set_nonblocking - makes reads and writes fail instead of blocking
+ * @c: the UDP socket
+ * @nonblock: if true, udp_read(), udp_write(), etc. return -EAGAIN when they
+ * would block
+ */
+void udp_set_nonblocking(udpconn_t *c, bool nonblock)
+{
+	ACCESS_ONCE(c->nonblock) = nonblock;
+}
+
+/**
+ * udp_set_busy_poll - makes reads spin for a while before blocking
+ * @c: the UDP socket
+ * @us: how long to spin handling packets on this core, in microseconds, or 0
+ * to block right away (the default)
+ *
+ * Returns 0 if successful, or -EINVAL if @us is more than
+ * NET_BUSY_POLL_MAX_US.
+ */
+int udp_set_busy_poll(udpconn_t *c, unsigned int us)
+{
+	if (us > NET_BUSY_POLL_MAX_US)
+		return -EINVAL;
+
+	ACCESS_ONCE(c->busy_poll_us) = us;
+	return 0;
+}
+
+/**
+ * udp_set_priority - handles a socket's ingress packets ahead of others
+ * @c: the UDP socket
+ * @high: true if the socket is latency-critical
+ *
+ * Each batch of ingress packets is handled for high-priority sockets first,
+ * so their threads wake up without waiting behind bulk traffic.
+ */
+void udp_set_priority(udpconn_t *c, bool high)
+{
+	trans_set_priority(&c->e, high);
+}
+
+/**
+ * udp_poll_register - reports a UDP socket's readiness to a waiter
+ * @c: the UDP socket
+ * @w: the waiter, replacing any previous one
+ * @data: a value returned with each event
+ *
+ * The socket reports POLL_IN when a datagram arrived, or it was shut down or
+ * failed, and POLL_OUT when there is room to write or it was shut down.
+ * udp_close() unregisters the socket.
+ */
+void udp_poll_register(udpconn_t *c, poll_waiter_t *w, unsigned long data)
+{
+	unsigned int events = 0;
+
+	poll_arm(&c->poll, w, data);
+
+	/* report readiness that came before registering */
+	spin_lock_np(&c->inq_lock);
+	if (!udp_inq_empty(udp_inq_locked(c), c->inq_head) || c->inq_err ||
+	    c->shutdown)
+		events |= POLL_IN;
+	spin_unlock_np(&c->inq_lock);
+
+	spin_lock_np(&c->outq_lock);
+	if (c->outq_len < c->outq_cap || c->shutdown)
+		events |= POLL_OUT;
+	spin_unlock_np(&c->outq_lock);
+
+	if (events)
+		poll_set(&c->poll, events);
+}
+
+/**
+ * udp_poll_unregister - stops reporting a UDP socket's readiness
+ * @c: the UDP socket
+ */
+void udp_poll_unregister(udpconn_t *c)
+{
+	poll_disarm(&c->poll);
 }
 
 /**
@@ -475,19 +1362,23 @@ void udp_close(udpconn_t *c)
 {
 	bool free_conn;
 
+	poll_disarm(&c->poll);
 	if (!c->shutdown)
 		__udp_shutdown(c);
 
+	/* leave multicast groups, which may still be delivering */
+	spin_lock_np(&c->groups_lock);
+	while (c->nr_groups > 0)
+		net_mcast_leave(c->groups[--c->nr_groups]);
+	spin_unlock_np(&c->groups_lock);
+
 	BUG_ON(!waitq_empty(&c->inq_wq));
 	BUG_ON(!waitq_empty(&c->outq_wq));
 
 	/* free all in-flight mbufs */
-	while (true) {
-		struct mbuf *m = mbufq_pop_head(&c->inq);
-		if (!m)
-			break;
-		mbuf_free(m);
-	}
+	spin_lock_np(&c->inq_lock);
+	udp_inq_drain(udp_inq_locked(c), &c->inq_head);
+	spin_unlock_np(&c->inq_lock);
 
 	spin_lock_np(&c->outq_lock);
 	free_conn = c->outq_len == 0;
@@ -503,40 +1394,178 @@ void udp_close(udpconn_t *c)
  * Parallel API
  */
 
+/* the idle workers of a spawner on one kthread */
+struct udp_spawn_pool {
+	spinlock_t		lock;
+	int			nr;	/* workers created for this pool */
+	struct list_head	idle;
+} __aligned(CACHE_LINE_SIZE);
+
 struct udpspawner {
 	struct trans_entry	e;
 	udpspawn_fn_t		fn;
+	udpspawn_fn_t		reject;	/* see udp_spawner_set_reject() */
+
+	/* worker pools, see udp_create_spawner_pool() */
+	struct udp_spawn_pool	*pools;	/* one per kthread, or NULL */
+	int			pool_cap;
+	bool			stopping;
+	struct kref		ref;	/* one for the spawner, one per worker */
+};
+
+/* a uthread that handles datagrams for a spawner until it is destroyed */
+struct udp_worker {
+	struct udp_spawn_data	d;
+	udpspawner_t		*s;
+	struct udp_spawn_pool	*pool;
+	thread_t		*th;
+	struct list_node	link;
+};
+
+static void udp_free_spawner(struct kref *ref)
+{
+	udpspawner_t *s = container_of(ref, udpspawner_t, ref);
+
+	if (s->pools)
+		sfree(s->pools);
+	sfree(s);
+}
+
+static void udp_worker_loop(void *arg)
+{
+	struct udp_worker *w = arg;
+	udpspawner_t *s = w->s;
+	struct udp_spawn_pool *pool = w->pool;
+
+	/* woken without a datagram when the spawner is stopping */
+	while (w->d.release_data) {
+		s->fn(&w->d);
+		overload_complete();
+		w->d.release_data = NULL;
+
+		spin_lock_np(&pool->lock);
+		if (unlikely(s->stopping)) {
+			spin_unlock_np(&pool->lock);
+			break;
+		}
+		list_add(&pool->idle, &w->link);
+		thread_park_and_unlock_np(&pool->lock);
+	}
+
+	kref_put(&s->ref, udp_free_spawner);
+}
+
+static void udp_par_fill(struct udp_spawn_data *d, struct trans_entry *e,
+			 const struct udp_hdr *udphdr, struct mbuf *m)
+{
+	d->buf = mbuf_data(m);
+	d->len = mbuf_length(m);
+	d->laddr = e->laddr;
+	d->raddr = net_rx_saddr(m, ntoh16(udphdr->src_port));
+	d->release_data = m;
+}
+
+/* a datagram for a newly spawned thread */
+struct udp_spawn_req {
+	struct udp_spawn_data	d;
+	udpspawn_fn_t		fn;
 };
 
+static void udp_spawn_trampoline(void *arg)
+{
+	struct udp_spawn_req *r = arg;
+
+	/* the spawner may be gone by now, so don't touch it */
+	r->fn(&r->d);
+	overload_complete();
+}
+
+/* hands a datagram to a pooled worker, returns false if none is available */
+static bool udp_par_recv_pool(udpspawner_t *s, struct trans_entry *e,
+			      const struct udp_hdr *udphdr, struct mbuf *m)
+{
+	struct udp_spawn_pool *pool;
+	struct udp_worker *w;
+	struct kthread *k;
+	thread_t *th;
+	bool create = false;
+
+	k = getk();
+	pool = &s->pools[k->idx];
+	putk();
+
+	spin_lock_np(&pool->lock);
+	w = list_pop(&pool->idle, struct udp_worker, link);
+	if (!w && pool->nr < s->pool_cap) {
+		pool->nr++;
+		create = true;
+	}
+	spin_unlock_np(&pool->lock);
+
+	if (w) {
+		udp_par_fill(&w->d, e, udphdr, m);
+		thread_ready(w->th);
+		return true;
+	}
+	if (!create)
+		return false;
+
+	th = thread_create_with_buf(udp_worker_loop, (void **)&w, sizeof(*w));
+	if (unlikely(!th)) {
+		spin_lock_np(&pool->lock);
+		pool->nr--;
+		spin_unlock_np(&pool->lock);
+		return false;
+	}
+
+	kref_get(&s->ref);
+	w->s = s;
+	w->pool = pool;
+	w->th = th;
+	udp_par_fill(&w->d, e, udphdr, m);
+	thread_ready(th);
+	return true;
+}
+
 /* handles ingress packets with parallel threads */
 static void udp_par_recv(struct trans_entry *e, struct mbuf *m)
 {
 	udpspawner_t *s = container_of(e, udpspawner_t, e);
-	const struct ip_hdr *iphdr;
 	const struct udp_hdr *udphdr;
-	struct udp_spawn_data *d;
+	struct udp_spawn_data rd;
+	struct udp_spawn_req *r;
 	thread_t *th;
 
-	iphdr = mbuf_network_hdr(m, *iphdr);
 	udphdr = mbuf_pull_hdr_or_null(m, *udphdr);
 	if (unlikely(!udphdr)) {
 		mbuf_free(m);
 		return;
 	}
 
-	th = thread_create_with_buf((thread_fn_t)s->fn,
-				    (void **)&d, sizeof(*d));
+	if (unlikely(!overload_admit())) {
+		if (s->reject) {
+			udp_par_fill(&rd, e, udphdr, m);
+			s->reject(&rd);
+		} else {
+			mbuf_free(m);
+		}
+		return;
+	}
+
+	/* prefer a pooled worker, but spawn a thread if they're all busy */
+	if (s->pools && udp_par_recv_pool(s, e, udphdr, m))
+		return;
+
+	th = thread_create_with_buf(udp_spawn_trampoline,
+				    (void **)&r, sizeof(*r));
 	if (unlikely(!th)) {
+		overload_complete();
 		mbuf_drop(m);
 		return;
 	}
 
-	d->buf = mbuf_data(m);
-	d->len = mbuf_length(m);
-	d->laddr = e->laddr;
-	d->raddr.ip = ntoh32(iphdr->saddr);
-	d->raddr.port = ntoh16(udphdr->src_port);
-	d->release_data = m;
+	udp_par_fill(&r->d, e, udphdr, m);
+	r->fn = s->fn;
 	thread_ready(th);
 }
 
@@ -545,34 +1574,45 @@ const struct trans_ops udp_par_ops = {
 	.recv = udp_par_recv,
 };
 
-/**
- * udp_create_spawner - creates a UDP spawner for ingress datagrams
- * @laddr: the local address to bind to
- * @fn: a handler function for each datagram
- * @s_out: if successful, set to a pointer to the spawner
- *
- * Returns 0 if successful, otherwise fail.
- */
-int udp_create_spawner(struct netaddr laddr, udpspawn_fn_t fn,
-		       udpspawner_t **s_out)
+static int __udp_create_spawner(struct netaddr laddr, udpspawn_fn_t fn,
+				int pool_cap, udpspawner_t **s_out)
 {
 	udpspawner_t *s;
-	int ret;
+	int i, ret;
 
-	/* only can support one local IP so far */
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	/* only can support one local IP per family so far */
+	ret = net_bind_laddr(&laddr, NULL);
+	if (ret)
+		return ret;
 
 	s = smalloc(sizeof(*s));
 	if (!s)
 		return -ENOMEM;
 
+	s->pools = NULL;
+	if (pool_cap > 0) {
+		s->pools = smalloc(sizeof(*s->pools) * maxks);
+		if (!s->pools) {
+			sfree(s);
+			return -ENOMEM;
+		}
+		for (i = 0; i < maxks; i++) {
+			spin_lock_init(&s->pools[i].lock);
+			s->pools[i].nr = 0;
+			list_head_init(&s->pools[i].idle);
+		}
+	}
+	s->pool_cap = pool_cap;
+	s->stopping = false;
+	kref_init(&s->ref);
+
 	trans_init_3tuple(&s->e, IPPROTO_UDP, &udp_par_ops, laddr);
 	s->fn = fn;
+	s->reject = NULL;
 	ret = trans_table_add(&s->e);
 	if (ret) {
+		if (s->pools)
+			sfree(s->pools);
 		sfree(s);
 		return ret;
 	}
@@ -581,10 +1621,70 @@ int udp_create_spawner(struct netaddr laddr, udpspawn_fn_t fn,
 	return 0;
 }
 
+/**
+ * udp_create_spawner - creates a UDP spawner for ingress datagrams
+ * @laddr: the local address to bind to
+ * @fn: a handler function for each datagram
+ * @s_out: if successful, set to a pointer to the spawner
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int udp_create_spawner(struct netaddr laddr, udpspawn_fn_t fn,
+		       udpspawner_t **s_out)
+{
+	return __udp_create_spawner(laddr, fn, 0, s_out);
+}
+
+/**
+ * udp_create_spawner_pool - creates a UDP spawner backed by worker pools
+ * @laddr: the local address to bind to
+ * @fn: a handler function for each datagram
+ * @pool_size: the most workers to keep per kthread
+ * @s_out: if successful, set to a pointer to the spawner
+ *
+ * Instead of a new thread per datagram, each kthread keeps up to @pool_size
+ * worker threads that call @fn for one datagram after another. A thread is
+ * spawned as before when all of a kthread's workers are busy. @fn must not
+ * use its struct udp_spawn_data after returning.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int udp_create_spawner_pool(struct netaddr laddr, udpspawn_fn_t fn,
+			    int pool_size, udpspawner_t **s_out)
+{
+	if (pool_size <= 0)
+		return -EINVAL;
+
+	return __udp_create_spawner(laddr, fn, pool_size, s_out);
+}
+
+/* wakes every idle worker so that it exits */
+static void udp_stop_workers(udpspawner_t *s)
+{
+	struct udp_worker *w;
+	struct list_head idle;
+	int i;
+
+	for (i = 0; i < maxks; i++) {
+		list_head_init(&idle);
+		spin_lock_np(&s->pools[i].lock);
+		s->stopping = true;
+		list_append_list(&idle, &s->pools[i].idle);
+		spin_unlock_np(&s->pools[i].lock);
+
+		while ((w = list_pop(&idle, struct udp_worker, link)) != NULL)
+			thread_ready(w->th);
+	}
+}
+
 static void udp_release_spawner(struct rcu_head *h)
 {
 	udpspawner_t *s = container_of(h, udpspawner_t, e.rcu);
-	sfree(s);
+
+	/* no more datagrams can arrive, so the workers can go */
+	if (s->pools)
+		udp_stop_workers(s);
+	kref_put(&s->ref, udp_free_spawner);
 }
 
 /**
@@ -597,6 +1697,24 @@ void udp_destroy_spawner(udpspawner_t *s)
 	rcu_free(&s->e.rcu, udp_release_spawner);
 }
 
+/**
+ * udp_spawner_set_reject - sets a handler for datagrams turned away by
+ * admission control
+ * @s: the spawner
+ * @reject: the handler, or NULL to drop them
+ *
+ * When runtime_qdelay_target_us is set and the runtime is overloaded,
+ * datagrams aren't given to the spawner's handler. @reject is called for them
+ * instead, from softirq context, so it must not block; it's meant for sending
+ * a short error reply (e.g., with udp_respond()). Like the spawner's handler,
+ * it must call udp_spawn_data_release() and must not use its struct
+ * udp_spawn_data after returning.
+ */
+void udp_spawner_set_reject(udpspawner_t *s, udpspawn_fn_t reject)
+{
+	ACCESS_ONCE(s->reject) = reject;
+}
+
 /**
  * udp_send - sends a UDP datagram
  * @buf: the payload to send
@@ -614,12 +1732,11 @@ ssize_t udp_send(const void *buf, size_t len,
 	struct mbuf *m;
 	int ret;
 
-	if (len > UDP_MAX_PAYLOAD)
+	if (len > udp_max_payload_for(&raddr))
 		return -EMSGSIZE;
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	ret = net_bind_laddr(&laddr, &raddr);
+	if (ret)
+		return ret;
 	if (laddr.port == 0)
 		return -EINVAL;
 
@@ -631,7 +1748,7 @@ ssize_t udp_send(const void *buf, size_t len,
 	payload = mbuf_put(m, len);
 	memcpy(payload, buf, len);
 
-	ret = udp_send_raw(m, len, laddr, raddr);
+	ret = udp_send_raw(m, len, laddr, raddr, NULL);
 	if (unlikely(ret)) {
 		mbuf_free(m);
 		return ret;
@@ -647,10 +1764,9 @@ ssize_t udp_sendv(const struct iovec *iov, int iovcnt,
 	int i, ret;
 	ssize_t len = 0;
 
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	ret = net_bind_laddr(&laddr, &raddr);
+	if (ret)
+		return ret;
 	if (laddr.port == 0)
 		return -EINVAL;
 
@@ -661,7 +1777,7 @@ ssize_t udp_sendv(const struct iovec *iov, int iovcnt,
 	/* write datagram payload */
 	for (i = 0; i < iovcnt; i++) {
 		len += iov[i].iov_len;
-		if (unlikely(len > UDP_MAX_PAYLOAD)) {
+		if (unlikely(len > udp_max_payload_for(&raddr))) {
 			mbuf_free(m);
 			return -EMSGSIZE;
 		}
@@ -669,7 +1785,7 @@ ssize_t udp_sendv(const struct iovec *iov, int iovcnt,
 		       iov[i].iov_base, iov[i].iov_len);
 	}
 
-	ret = udp_send_raw(m, len, laddr, raddr);
+	ret = udp_send_raw(m, len, laddr, raddr, NULL);
 	if (unlikely(ret)) {
 		mbuf_free(m);
 		return ret;
@@ -689,3 +1805,41 @@ void udp_spawn_data_release(void *release_data)
 	struct mbuf *m = release_data;
 	mbuf_free(m);
 }
+
+
+/*
+ * UDP initialization
+ */
+
+/**
+ * udp_init - allocates the UDP socket cache
+ *
+ * Returns 0 if successful.
+ */
+int udp_init(void)
+{
+	int ret;
+
+	ret = slab_create(&udp_conn_slab, "runtime_udp_conns",
+			  sizeof(udpconn_t), SLAB_FLAG_CACHE_ALIGNED);
+	if (ret)
+		return ret;
+
+	udp_conn_tcache = slab_create_tcache(&udp_conn_slab,
+					     TCACHE_DEFAULT_MAG_SIZE);
+	if (!udp_conn_tcache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * udp_init_thread - initializes per-thread UDP state
+ *
+ * Returns 0 if successful.
+ */
+int udp_init_thread(void)
+{
+	tcache_init_perthread(udp_conn_tcache, &perthread_get(udp_conn_pt));
+	return 0;
+}
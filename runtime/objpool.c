@@ -0,0 +1,118 @@
+/*
+ * objpool.c - pools of fixed-size objects with per-kthread caches
+ *
+ * Each pool is a slab with a thread-local cache, like a single smalloc size
+ * class, but private to the objects of one type so they pack tightly and
+ * don't share magazines with unrelated allocations. Every kthread loads its
+ * own magazines, and allocations and frees disable preemption so a uthread
+ * can't migrate while touching them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/slab.h>
+#include <base/tcache.h>
+#include <runtime/objpool.h>
+
+#include "defs.h"
+
+struct objpool_perthread {
+	struct tcache_perthread	ltc;
+} __aligned(CACHE_LINE_SIZE);
+
+struct objpool {
+	struct slab		slab;
+	struct tcache		*tc;
+	struct objpool_perthread *pts;
+	char			*name;
+};
+
+/**
+ * objpool_create - creates a pool of objects
+ * @name: a name for the pool, shown in allocator usage dumps
+ * @size: the size of each object
+ * @flags: OBJPOOL_* flags
+ *
+ * Must be called after the runtime has started. Pools are never destroyed,
+ * like the other slabs and thread-local caches, so create one per object type
+ * rather than one per use.
+ *
+ * Returns a pool, or NULL if out of memory or @size is too large.
+ */
+struct objpool *objpool_create(const char *name, size_t size, int flags)
+{
+	struct objpool *p;
+	int ret;
+
+	p = aligned_alloc(CACHE_LINE_SIZE, align_up(sizeof(*p), CACHE_LINE_SIZE));
+	if (!p)
+		return NULL;
+
+	p->name = strdup(name);
+	p->pts = aligned_alloc(CACHE_LINE_SIZE, sizeof(*p->pts) * maxks);
+	if (!p->name || !p->pts)
+		goto fail;
+	/* handles are set up by each kthread on first use */
+	memset(p->pts, 0, sizeof(*p->pts) * maxks);
+
+	ret = slab_create(&p->slab, p->name, max(size, TCACHE_MIN_ITEM_SIZE),
+			  (flags & OBJPOOL_CACHE_ALIGNED) ?
+			  SLAB_FLAG_CACHE_ALIGNED : SLAB_FLAG_FALSE_OKAY);
+	if (ret)
+		goto fail;
+
+	p->tc = slab_create_tcache(&p->slab, TCACHE_DEFAULT_MAG_SIZE);
+	if (!p->tc) {
+		slab_destroy(&p->slab);
+		goto fail;
+	}
+
+	return p;
+
+fail:
+	free(p->pts);
+	free(p->name);
+	free(p);
+	return NULL;
+}
+
+/* returns this kthread's handle for @p, preemption must be disabled */
+static struct tcache_perthread *objpool_local(struct objpool *p)
+{
+	struct tcache_perthread *ltc = &p->pts[myk()->idx].ltc;
+
+	if (unlikely(!ltc->tc))
+		tcache_init_perthread(p->tc, ltc);
+	return ltc;
+}
+
+/**
+ * objpool_alloc - allocates an object from a pool
+ * @p: the pool
+ *
+ * Returns an uninitialized object, or NULL if out of memory.
+ */
+void *objpool_alloc(struct objpool *p)
+{
+	void *item;
+
+	preempt_disable();
+	item = tcache_alloc(objpool_local(p));
+	preempt_enable();
+
+	return item;
+}
+
+/**
+ * objpool_free - returns an object to its pool
+ * @p: the pool it was allocated from
+ * @item: the object
+ */
+void objpool_free(struct objpool *p, void *item)
+{
+	preempt_disable();
+	tcache_free(objpool_local(p), item);
+	preempt_enable();
+}
@@ -0,0 +1,208 @@
+/*
+ * offload.c - runs blocking calls on helper kernel threads
+ *
+ * A uthread that makes a blocking system call stalls its whole kthread, and
+ * every uthread queued behind it. Instead, the call is queued for a small pool
+ * of helper pthreads while the uthread parks. Helpers can't touch runqueues,
+ * so finished calls go on a completion list that kthreads drain as softirq
+ * work (see offload_softirq()). If every kthread parks while calls are still
+ * outstanding, the last one asks the iokernel to wake it up again after
+ * RUNTIME_OFFLOAD_POLL_US (see kthread_park()).
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <base/list.h>
+#include <base/lock.h>
+#include <runtime/offload.h>
+#include <runtime/sync.h>
+
+#include "defs.h"
+
+struct offload_req {
+	struct list_node	link;
+	offload_fn_t		fn;
+	void			*arg;
+	long			ret;
+	thread_t		*th;
+};
+
+/* the number of helper threads, zero runs calls in place */
+unsigned int offload_threads = 2;
+/* calls that were submitted but whose threads aren't ready again yet */
+atomic_t offload_nr_pending;
+/* calls on the completion list */
+unsigned int offload_nr_done;
+
+/* submitted calls, and the helpers waiting for them */
+static DEFINE_SPINLOCK(offload_lock);
+static LIST_HEAD(offload_queue);
+static unsigned int offload_nr_idle;
+static unsigned int offload_seq;	/* the futex helpers sleep on */
+
+/* finished calls */
+static DEFINE_SPINLOCK(offload_done_lock);
+static LIST_HEAD(offload_done);
+
+static long offload_futex(unsigned int *uaddr, int op, unsigned int val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static void *offload_helper(void *arg)
+{
+	struct offload_req *req;
+	unsigned int seq;
+	sigset_t mask;
+
+	/* preemption signals are meant for kthreads */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	while (true) {
+		spin_lock(&offload_lock);
+		while (!(req = list_pop(&offload_queue, struct offload_req,
+					link))) {
+			seq = offload_seq;
+			offload_nr_idle++;
+			spin_unlock(&offload_lock);
+			offload_futex(&offload_seq, FUTEX_WAIT_PRIVATE, seq);
+			spin_lock(&offload_lock);
+			offload_nr_idle--;
+		}
+		spin_unlock(&offload_lock);
+
+		req->ret = req->fn(req->arg);
+
+		spin_lock(&offload_done_lock);
+		list_add_tail(&offload_done, &req->link);
+		store_release(&offload_nr_done, offload_nr_done + 1);
+		spin_unlock(&offload_done_lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * offload_softirq - makes the threads of finished calls runnable
+ *
+ * Called from softirq context on any kthread.
+ */
+void offload_softirq(void)
+{
+	struct offload_req *req;
+	struct list_head tmp;
+	thread_t *th;
+
+	list_head_init(&tmp);
+
+	spin_lock_np(&offload_done_lock);
+	list_append_list(&tmp, &offload_done);
+	store_release(&offload_nr_done, 0);
+	spin_unlock_np(&offload_done_lock);
+
+	while ((req = list_pop(&tmp, struct offload_req, link))) {
+		/* @req is gone once its thread runs */
+		th = req->th;
+		atomic_dec(&offload_nr_pending);
+		thread_ready(th);
+	}
+}
+
+/**
+ * offload_call - runs a function on a helper thread
+ * @fn: the function, which may block
+ * @arg: an argument passed to @fn
+ *
+ * The calling thread parks until @fn returns, so other threads keep running
+ * on its kthread. @fn runs outside of the runtime and must not use it (e.g.
+ * create threads or take runtime locks). Calls from outside of a thread, or
+ * with no helper threads configured, run @fn in place.
+ *
+ * Returns what @fn returned.
+ */
+long offload_call(offload_fn_t fn, void *arg)
+{
+	struct offload_req req;
+
+	if (unlikely(!thread_self() || !offload_threads))
+		return fn(arg);
+
+	req.fn = fn;
+	req.arg = arg;
+	atomic_inc(&offload_nr_pending);
+
+	spin_lock_np(&offload_lock);
+	req.th = thread_self();
+	list_add_tail(&offload_queue, &req.link);
+	STAT(OFFLOAD_CALLS)++;
+	if (offload_nr_idle > 0) {
+		offload_seq++;
+		offload_futex(&offload_seq, FUTEX_WAKE_PRIVATE, 1);
+	}
+	thread_park_and_unlock_np(&offload_lock);
+
+	return req.ret;
+}
+
+struct offload_syscall_args {
+	long nr;
+	long args[6];
+};
+
+static long offload_do_syscall(void *arg)
+{
+	struct offload_syscall_args *a = arg;
+	long ret;
+
+	ret = syscall(a->nr, a->args[0], a->args[1], a->args[2], a->args[3],
+		      a->args[4], a->args[5]);
+	return ret == -1 ? -errno : ret;
+}
+
+/**
+ * offload_syscall - makes a system call on a helper thread
+ * @nr: the system call number (SYS_*)
+ *
+ * Takes up to six arguments after @nr, like syscall(2).
+ *
+ * Returns the result, or -errno on failure.
+ */
+long offload_syscall(long nr, ...)
+{
+	struct offload_syscall_args a;
+	va_list ap;
+	int i;
+
+	a.nr = nr;
+	va_start(ap, nr);
+	for (i = 0; i < ARRAY_SIZE(a.args); i++)
+		a.args[i] = va_arg(ap, long);
+	va_end(ap);
+
+	return offload_call(offload_do_syscall, &a);
+}
+
+/**
+ * offload_init - starts the helper threads
+ */
+int offload_init(void)
+{
+	pthread_t tid;
+	int i, ret;
+
+	for (i = 0; i < offload_threads; i++) {
+		ret = pthread_create(&tid, NULL, offload_helper, NULL);
+		if (ret)
+			return -ret;
+		pthread_detach(tid);
+	}
+
+	return 0;
+}
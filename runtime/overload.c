@@ -0,0 +1,125 @@
+/*
+ * overload.c - receiver-driven admission control and load shedding
+ *
+ * Modeled on Breakwater. Each kthread records the longest time a uthread
+ * waited in its runqueue. About once per target delay, the longest wait
+ * across kthreads adjusts a pool of credits: up by a constant while it is at
+ * or below the target, and down in proportion to the overshoot while it is
+ * above. A request is admitted only while fewer requests than credits are in
+ * flight, so excess load is turned away on arrival instead of queueing until
+ * every request times out, and goodput stays near its peak.
+ */
+
+#include <base/stddef.h>
+#include <base/atomic.h>
+#include <runtime/overload.h>
+
+#include "defs.h"
+
+/* the fewest and most credits */
+#define OVERLOAD_CREDITS_MIN	1
+#define OVERLOAD_CREDITS_MAX	(1 << 20)
+/* the credits each kthread starts with and adds per update below target */
+#define OVERLOAD_CREDITS_PER_K	8
+
+/* the queueing delay to stay under (us), or 0 if disabled */
+unsigned int overload_target_us;
+
+static atomic_t overload_inflight;
+static unsigned int overload_credits;
+static bool overload_over;	/* the last delay was above the target */
+static uint64_t overload_update_tsc;
+
+/* takes the longest runqueue wait of all kthreads since the last update */
+static uint64_t overload_qdelay(void)
+{
+	struct kthread *k;
+	uint64_t delay = 0, d;
+	int i;
+
+	for (i = 0; i < maxks; i++) {
+		k = ACCESS_ONCE(allks[i]);
+		if (!k)
+			continue;
+		d = ACCESS_ONCE(k->qdelay_max);
+		if (d) {
+			ACCESS_ONCE(k->qdelay_max) = 0;
+			delay = max(delay, d);
+		}
+	}
+
+	return delay;
+}
+
+static void overload_update(void)
+{
+	uint64_t delay = overload_qdelay();
+	uint64_t target = (uint64_t)overload_target_us * cycles_per_us;
+	unsigned int credits = ACCESS_ONCE(overload_credits);
+
+	if (delay <= target) {
+		credits = min(credits + OVERLOAD_CREDITS_PER_K * maxks,
+			      OVERLOAD_CREDITS_MAX);
+	} else {
+		/* cut by (delay - target) / (2 * delay), less than half */
+		credits -= (uint64_t)credits * (delay - target) / (2 * delay);
+		credits = max(credits, OVERLOAD_CREDITS_MIN);
+	}
+
+	ACCESS_ONCE(overload_over) = delay > target;
+	ACCESS_ONCE(overload_credits) = credits;
+}
+
+/* updates the credits if a target delay has passed, on one caller only */
+static void overload_tick(void)
+{
+	uint64_t now = rdtsc(), last = ACCESS_ONCE(overload_update_tsc);
+
+	if (now - last < (uint64_t)overload_target_us * cycles_per_us)
+		return;
+	if (__sync_bool_compare_and_swap(&overload_update_tsc, last, now))
+		overload_update();
+}
+
+bool __overload_admit(void)
+{
+	overload_tick();
+
+	if (atomic_read(&overload_inflight) >=
+	    (int)ACCESS_ONCE(overload_credits)) {
+		STAT(OVERLOAD_REJECTS)++;
+		return false;
+	}
+
+	atomic_inc(&overload_inflight);
+	STAT(OVERLOAD_ADMITS)++;
+	return true;
+}
+
+void __overload_complete(void)
+{
+	atomic_dec(&overload_inflight);
+}
+
+bool __overload_shedding(void)
+{
+	overload_tick();
+
+	if (!ACCESS_ONCE(overload_over))
+		return false;
+	STAT(OVERLOAD_REJECTS)++;
+	return true;
+}
+
+/**
+ * overload_init - initializes admission control
+ *
+ * Returns 0 (always successful).
+ */
+int overload_init(void)
+{
+	atomic_write(&overload_inflight, 0);
+	overload_credits = OVERLOAD_CREDITS_PER_K * maxks;
+	overload_update_tsc = rdtsc();
+	return 0;
+}
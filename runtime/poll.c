@@ -0,0 +1,274 @@
+/*
+ * poll.c - readiness notification for many connections
+ *
+ * Locks nest socket lock -> trigger lock -> waiter lock. The trigger lock
+ * keeps a waiter from being unregistered (and freed) while an event is being
+ * queued on it, and the waiter lock protects its ready list.
+ */
+
+#include <base/lock.h>
+#include <base/log.h>
+#include <runtime/poll.h>
+#include <runtime/sync.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+
+#include "defs.h"
+
+/* a thread blocked in poll_wait() or poll_wait_timeout() */
+struct poll_sleeper {
+	struct list_node	link;
+	thread_t		*th;	/* cleared once it's woken */
+	poll_waiter_t		*w;
+	bool			expired; /* protected by the waiter's lock */
+	bool			done;	/* the timeout handler has finished */
+};
+
+/**
+ * poll_init - initializes a poll waiter
+ * @w: the waiter to initialize
+ */
+void poll_init(poll_waiter_t *w)
+{
+	spin_lock_init(&w->lock);
+	list_head_init(&w->ready);
+	list_head_init(&w->waiters);
+}
+
+static int poll_pop_events(poll_waiter_t *w, struct poll_event *evs, int n)
+{
+	poll_trigger_t *t;
+	int i;
+
+	assert_spin_lock_held(&w->lock);
+
+	for (i = 0; i < n; i++) {
+		t = list_pop(&w->ready, poll_trigger_t, link);
+		if (!t)
+			break;
+		evs[i].data = t->data;
+		evs[i].events = t->events;
+		t->events = 0;
+	}
+
+	return i;
+}
+
+/**
+ * poll_wait - waits for sockets to become ready
+ * @w: the waiter
+ * @evs: an array to store the ready sockets
+ * @n: the number of entries in @evs
+ *
+ * Blocks until at least one socket registered with @w is ready. Any number of
+ * threads may wait on the same waiter, and each event is reported to only one
+ * of them.
+ *
+ * Returns the number of events stored in @evs, or -EINVAL if @n < 1.
+ */
+int poll_wait(poll_waiter_t *w, struct poll_event *evs, int n)
+{
+	struct poll_sleeper s;
+	int ret;
+
+	if (n < 1)
+		return -EINVAL;
+
+	s.w = w;
+	spin_lock_np(&w->lock);
+	while (list_empty(&w->ready)) {
+		s.th = thread_self();
+		list_add_tail(&w->waiters, &s.link);
+		thread_park_and_unlock_np(&w->lock);
+		spin_lock_np(&w->lock);
+	}
+	ret = poll_pop_events(w, evs, n);
+	spin_unlock_np(&w->lock);
+
+	return ret;
+}
+
+static void poll_wait_expired(unsigned long arg)
+{
+	struct poll_sleeper *s = (struct poll_sleeper *)arg;
+	poll_waiter_t *w = s->w;
+	thread_t *th;
+
+	spin_lock_np(&w->lock);
+	s->expired = true;
+	th = s->th;
+	if (th) {
+		list_del_from(&w->waiters, &s->link);
+		s->th = NULL;
+	}
+	spin_unlock_np(&w->lock);
+
+	if (th)
+		thread_ready(th);
+	store_release(&s->done, true);
+}
+
+/**
+ * poll_wait_timeout - waits for sockets to become ready, or a timeout
+ * @w: the waiter
+ * @evs: an array to store the ready sockets
+ * @n: the number of entries in @evs
+ * @timeout_us: how long to wait in microseconds
+ *
+ * Like poll_wait(), but gives up after @timeout_us.
+ *
+ * Returns the number of events stored in @evs, 0 if the timeout expired first,
+ * or -EINVAL if @n < 1.
+ */
+int poll_wait_timeout(poll_waiter_t *w, struct poll_event *evs, int n,
+		      uint64_t timeout_us)
+{
+	struct poll_sleeper s;
+	struct timer_entry e;
+	bool armed = false;
+	int ret;
+
+	if (n < 1)
+		return -EINVAL;
+
+	s.w = w;
+	s.expired = false;
+	s.done = false;
+	timer_init(&e, poll_wait_expired, (unsigned long)&s);
+
+	spin_lock_np(&w->lock);
+	while (list_empty(&w->ready) && !s.expired) {
+		if (!armed) {
+			timer_start(&e, microtime() + timeout_us);
+			armed = true;
+		}
+		s.th = thread_self();
+		list_add_tail(&w->waiters, &s.link);
+		thread_park_and_unlock_np(&w->lock);
+		spin_lock_np(&w->lock);
+	}
+	ret = poll_pop_events(w, evs, n);
+	spin_unlock_np(&w->lock);
+
+	/* the handler may be running, and @s and @e live on this stack */
+	if (armed && !timer_cancel(&e)) {
+		while (!load_acquire(&s.done))
+			cpu_relax();
+	}
+
+	return ret;
+}
+
+/**
+ * poll_try_wait - collects ready sockets without blocking
+ * @w: the waiter
+ * @evs: an array to store the ready sockets
+ * @n: the number of entries in @evs
+ *
+ * Returns the number of events stored in @evs (possibly zero), or -EINVAL if
+ * @n < 1.
+ */
+int poll_try_wait(poll_waiter_t *w, struct poll_event *evs, int n)
+{
+	int ret;
+
+	if (n < 1)
+		return -EINVAL;
+
+	spin_lock_np(&w->lock);
+	ret = poll_pop_events(w, evs, n);
+	spin_unlock_np(&w->lock);
+
+	return ret;
+}
+
+/**
+ * poll_trigger_init - initializes a socket's trigger
+ * @t: the trigger to initialize
+ */
+void poll_trigger_init(poll_trigger_t *t)
+{
+	spin_lock_init(&t->lock);
+	t->waiter = NULL;
+	t->data = 0;
+	t->events = 0;
+}
+
+/**
+ * poll_arm - registers a socket's trigger with a waiter
+ * @t: the socket's trigger
+ * @w: the waiter to notify, replacing any previous one
+ * @data: a value returned with each event
+ *
+ * The caller must then check whether the socket is already ready, and if so
+ * report it with poll_set().
+ */
+void poll_arm(poll_trigger_t *t, poll_waiter_t *w, unsigned long data)
+{
+	poll_disarm(t);
+
+	spin_lock_np(&t->lock);
+	t->data = data;
+	store_release(&t->waiter, w);
+	spin_unlock_np(&t->lock);
+}
+
+/**
+ * poll_disarm - unregisters a socket's trigger from its waiter
+ * @t: the socket's trigger
+ *
+ * Events that were fired but not yet reported are discarded. Afterward, the
+ * waiter won't touch the trigger again.
+ */
+void poll_disarm(poll_trigger_t *t)
+{
+	poll_waiter_t *w;
+
+	spin_lock_np(&t->lock);
+	w = t->waiter;
+	if (!w) {
+		spin_unlock_np(&t->lock);
+		return;
+	}
+
+	spin_lock_np(&w->lock);
+	if (t->events) {
+		list_del_from(&w->ready, &t->link);
+		t->events = 0;
+	}
+	spin_unlock_np(&w->lock);
+
+	t->waiter = NULL;
+	spin_unlock_np(&t->lock);
+}
+
+void __poll_set(poll_trigger_t *t, unsigned int events)
+{
+	poll_waiter_t *w;
+	thread_t *th = NULL;
+
+	spin_lock_np(&t->lock);
+	w = t->waiter;
+	if (unlikely(!w)) {
+		spin_unlock_np(&t->lock);
+		return;
+	}
+
+	spin_lock_np(&w->lock);
+	if (!t->events) {
+		struct poll_sleeper *s;
+
+		list_add_tail(&w->ready, &t->link);
+		s = list_pop(&w->waiters, struct poll_sleeper, link);
+		if (s) {
+			th = s->th;
+			s->th = NULL;
+		}
+	}
+	t->events |= events;
+	spin_unlock_np(&w->lock);
+	spin_unlock_np(&t->lock);
+
+	if (th)
+		thread_ready(th);
+}
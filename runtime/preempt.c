@@ -4,15 +4,31 @@
 
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 
 #include "base/log.h"
+#include "base/thread.h"
 #include "runtime/thread.h"
 #include "runtime/preempt.h"
 
 #include "defs.h"
 
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 /* the current preemption count */
 volatile __thread unsigned int preempt_cnt = PREEMPT_NOT_PENDING;
+/* never set, used until a kthread attaches its shared queue pointers */
+static volatile uint32_t preempt_req_none;
+/* this kthread's preemption request flag, set by the iokernel */
+__thread volatile uint32_t *preempt_req = &preempt_req_none;
+/* the time slice given to each uthread in microseconds (0 is unlimited) */
+unsigned int preempt_quantum_us;
+/* when the running uthread was scheduled */
+__thread uint64_t slice_start_tsc;
+/* fires every quantum to check if the running uthread should yield */
+static __thread timer_t slice_timer;
 
 /* set a flag to indicate a preemption request is pending */
 static void set_preempt_needed(void)
@@ -39,6 +55,109 @@ static void handle_sigusr1(int s, siginfo_t *si, void *c)
 		STAT(PREEMPTIONS_STOLEN)++;
 }
 
+/* returns true if the running uthread is holding up softirqs too long */
+static bool preempt_softirq_starved(uint64_t now)
+{
+	struct kthread *k;
+	bool starved;
+
+	if (!softirq_starve_us || disable_watchdog)
+		return false;
+
+	k = getk();
+	starved = softirq_delay(k, now) > cycles_per_us * softirq_starve_us;
+	if (starved) {
+		STAT(PREEMPTIONS_STARVED)++;
+		sched_request_watchdog();
+	}
+	putk();
+
+	return starved;
+}
+
+/* handles time slice expiration from the per-kthread timer */
+static void handle_sigusr2(int s, siginfo_t *si, void *c)
+{
+	uint64_t now;
+
+	/*
+	 * Only switch at a safe point: a uthread is running and hasn't
+	 * disabled preemption. Otherwise a later tick will try again.
+	 */
+	if (!preempt_enabled() || !thread_self())
+		return;
+
+	now = rdtsc();
+	if (preempt_softirq_starved(now)) {
+		thread_yield();
+		return;
+	}
+
+	if (!preempt_quantum_us ||
+	    now - slice_start_tsc < cycles_per_us * preempt_quantum_us)
+		return;
+
+	STAT(PREEMPTIONS_QUANTUM)++;
+	thread_yield();
+}
+
+/*
+ * The interval of the per-kthread timer, which checks both the time slice and
+ * softirq starvation (see runtime_softirq_starve_us). Returns 0 if neither is
+ * enabled.
+ */
+static unsigned int preempt_tick_us(void)
+{
+	unsigned int us = preempt_quantum_us;
+
+	if (softirq_starve_us && !disable_watchdog)
+		us = us ? min(us, softirq_starve_us) : softirq_starve_us;
+	return us;
+}
+
+static void preempt_set_slice_timer(unsigned int us)
+{
+	struct itimerspec its;
+
+	its.it_interval.tv_sec = us / ONE_SECOND;
+	its.it_interval.tv_nsec = (us % ONE_SECOND) * 1000;
+	its.it_value = its.it_interval;
+	if (timer_settime(slice_timer, 0, &its, NULL) == -1)
+		WARN();
+}
+
+/**
+ * preempt_quantum_pause - stops time slice preemption for this kthread
+ *
+ * Called before parking so an idle kthread doesn't receive timer signals.
+ */
+void preempt_quantum_pause(void)
+{
+	if (preempt_tick_us())
+		preempt_set_slice_timer(0);
+}
+
+/**
+ * preempt_quantum_resume - restarts time slice preemption for this kthread
+ */
+void preempt_quantum_resume(void)
+{
+	unsigned int us = preempt_tick_us();
+
+	if (us)
+		preempt_set_slice_timer(us);
+}
+
+/**
+ * __preempt_poll - marks a preemption requested through shared memory pending
+ */
+void __preempt_poll(void)
+{
+	if (!preempt_needed())
+		STAT(PREEMPTIONS_POLLED)++;
+	set_preempt_needed();
+}
+
 /**
  * preempt - entry point for preemption
  */
@@ -70,5 +189,42 @@ int preempt_init(void)
 		return -errno;
 	}
 
+	if (!preempt_tick_us())
+		return 0;
+
+	act.sa_sigaction = handle_sigusr2;
+	if (sigaction(SIGUSR2, &act, NULL) == -1) {
+		log_err("couldn't register time slice signal handler");
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * preempt_init_thread - per-kthread initializer for preemption support
+ *
+ * Creates a timer that delivers SIGUSR2 to this kthread every time slice, if
+ * time slice preemption or softirq starvation checks are enabled.
+ *
+ * Returns 0 if successful. otherwise fail.
+ */
+int preempt_init_thread(void)
+{
+	struct sigevent sev;
+
+	if (!preempt_tick_us())
+		return 0;
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGUSR2;
+	sev.sigev_notify_thread_id = gettid();
+	if (timer_create(CLOCK_MONOTONIC, &sev, &slice_timer) == -1) {
+		log_err("couldn't create time slice timer");
+		return -errno;
+	}
+
+	preempt_quantum_resume();
 	return 0;
 }
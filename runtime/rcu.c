@@ -10,9 +10,11 @@
  * each kthread count is either even & >= the previous value (to detect parking)
  * or odd & > the previous value (to detect rescheduling).
  *
- * FIXME: Freeing objects is expensive with this minimal implementation. This
- * should be fine as long as RCU updates are rare. The Linux Kernel uses several
- * more optimized strategies that we may want to consider in the future.
+ * Callbacks are queued on a lock-free list in the local kthread, so rcu_free()
+ * never touches shared state. A single worker detaches every kthread's list at
+ * once and waits for one grace period that covers the whole batch, overlapping
+ * the wait with the arrival of the next batch. synchronize_rcu_expedited()
+ * skips the batching and polls the counters from the caller instead.
  */
 
 #include <base/stddef.h>
@@ -27,68 +29,99 @@
 /* the time RCU waits before checking if it can free objects */
 #define RCU_SLEEP_PERIOD (10 * ONE_MS)
 
-/* Protects @rcu_head. */
-static DEFINE_SPINLOCK(rcu_lock);
-/* The head of the list of objects waiting to be freed */
-static struct rcu_head *rcu_head;
 static bool rcu_worker_launched;
 
 #ifdef DEBUG
 __thread int rcu_read_count;
 #endif /* DEBUG */
 
-static void rcu_worker(void *arg)
+/*
+ * rcu_wait_gp - waits until every kthread has passed a quiescent state
+ * @sleep_us: the time to sleep between checks, or zero to yield instead
+ */
+static void rcu_wait_gp(uint64_t sleep_us)
 {
-	struct rcu_head *head, *next;
 	unsigned int last_rcu_gen[NCPU];
 	unsigned int gen;
 	int i;
 
-	while (true) {
-		/* check if any RCU objects are waiting to be freed */
-		spin_lock_np(&rcu_lock);
-		if (!rcu_head) {
-			spin_unlock_np(&rcu_lock);
-			timer_sleep(RCU_SLEEP_PERIOD);
-			continue;
-		}
-		head = rcu_head;
-		rcu_head = NULL;
-		spin_unlock_np(&rcu_lock);
-
-		/* read the RCU generation counters */
-		for (i = 0; i < maxks; i++)
-			last_rcu_gen[i] = load_acquire(&allks[i]->rcu_gen);
+	/* read the RCU generation counters */
+	for (i = 0; i < maxks; i++)
+		last_rcu_gen[i] = load_acquire(&allks[i]->rcu_gen);
 
+	/* wait for each kthread to reschedule or park */
+	for (i = 0; i < maxks; i++) {
 		while (true) {
-			/* wait for RCU generation counters to increase */
-			timer_sleep(RCU_SLEEP_PERIOD);
+			gen = load_acquire(&allks[i]->rcu_gen);
+			if ((gen & 0x1) == 0x0 || gen != last_rcu_gen[i])
+				break;
+			if (sleep_us)
+				timer_sleep(sleep_us);
+			else
+				thread_yield();
+		}
+	}
+}
 
-			/* read the RCU generation counters again */
-			for (i = 0; i < maxks; i++) {
-				gen = load_acquire(&allks[i]->rcu_gen);
-				if ((gen & 0x1) == 0x1 &&
-				    gen == last_rcu_gen[i]) {
-					break;
-				}
-			}
+static void rcu_worker(void *arg)
+{
+	struct rcu_head *batch[NCPU];
+	struct rcu_head *head, *next;
+	bool pending;
+	int i;
 
-			/* did any of the RCU generation checks fail? */
-			if (i != maxks)
+	while (true) {
+		/* detach the callbacks queued on each kthread */
+		pending = false;
+		for (i = 0; i < maxks; i++) {
+			batch[i] = NULL;
+			if (!ACCESS_ONCE(allks[i]->rcu_head))
 				continue;
+			batch[i] = __atomic_exchange_n(&allks[i]->rcu_head,
+						       NULL, __ATOMIC_ACQUIRE);
+			pending = true;
+		}
 
-			/* actually free the RCU objects */
+		if (!pending) {
+			timer_sleep(RCU_SLEEP_PERIOD);
+			continue;
+		}
+
+		/* one grace period covers the whole batch */
+		rcu_wait_gp(RCU_SLEEP_PERIOD);
+
+		/* actually free the RCU objects */
+		for (i = 0; i < maxks; i++) {
+			head = batch[i];
 			while (head) {
 				next = head->next;
 				head->func(head);
 				head = next;
 			}
-
-			break;
 		}
 	}
 }
 
+static void rcu_enqueue(struct rcu_head *head)
+{
+	struct kthread *k;
+	struct rcu_head *old;
+
+	if (unlikely(!ACCESS_ONCE(rcu_worker_launched)) &&
+	    __sync_bool_compare_and_swap(&rcu_worker_launched, false, true))
+		BUG_ON(thread_spawn(rcu_worker, NULL));
+
+	/* only the worker removes entries, and it takes the whole list */
+	k = getk();
+	old = ACCESS_ONCE(k->rcu_head);
+	do {
+		head->next = old;
+	} while (!__atomic_compare_exchange_n(&k->rcu_head, &old, head, false,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	putk();
+}
+
 /**
  * rcu_free - frees an RCU object after the quiescent period
  * @head: the RCU head structure embedded within the object
@@ -96,30 +129,25 @@ static void rcu_worker(void *arg)
  */
 void rcu_free(struct rcu_head *head, rcu_callback_t func)
 {
-	bool launch_worker = false;
-
 	head->func = func;
-
-	spin_lock_np(&rcu_lock);
-	if (unlikely(!rcu_worker_launched))
-		launch_worker = rcu_worker_launched = true;
-	head->next = rcu_head;
-	rcu_head = head;
-	spin_unlock_np(&rcu_lock);
-
-	if (unlikely(launch_worker))
-		BUG_ON(thread_spawn(rcu_worker, NULL));
+	rcu_enqueue(head);
 }
 
 struct sync_arg {
 	struct rcu_head rcu;
+	spinlock_t lock;
 	thread_t *th;
 };
 
 static void synchronize_rcu_finish(struct rcu_head *head)
 {
 	struct sync_arg *tmp = container_of(head, struct sync_arg, rcu);
-	thread_ready(tmp->th);
+	thread_t *th = tmp->th;
+
+	/* wait for the caller to finish parking; @tmp dies once it wakes */
+	spin_lock_np(&tmp->lock);
+	spin_unlock_np(&tmp->lock);
+	thread_ready(th);
 }
 
 /**
@@ -129,21 +157,30 @@ static void synchronize_rcu_finish(struct rcu_head *head)
  */
 void synchronize_rcu(void)
 {
-	bool launch_worker = false;
 	struct sync_arg tmp;
 
 	tmp.rcu.func = synchronize_rcu_finish;
 	tmp.th = thread_self();
+	spin_lock_init(&tmp.lock);
 
-	spin_lock_np(&rcu_lock);
-	if (unlikely(!rcu_worker_launched))
-		launch_worker = rcu_worker_launched = true;
-	tmp.rcu.next = rcu_head;
-	rcu_head = &tmp.rcu;
-	thread_park_and_unlock_np(&rcu_lock);
+	spin_lock_np(&tmp.lock);
+	rcu_enqueue(&tmp.rcu);
+	thread_park_and_unlock_np(&tmp.lock);
+}
 
-	if (unlikely(launch_worker))
-		BUG_ON(thread_spawn(rcu_worker, NULL));
+/**
+ * synchronize_rcu_expedited - blocks until it is safe to free an RCU object
+ *
+ * Unlike synchronize_rcu(), this doesn't wait for the next callback batch.
+ * The caller polls the kthreads directly, yielding between checks, so the
+ * grace period ends as soon as every kthread has rescheduled. This burns CPU
+ * time and should be reserved for latency-sensitive slow paths.
+ *
+ * WARNING: Can only be called from thread context.
+ */
+void synchronize_rcu_expedited(void)
+{
+	rcu_wait_gp(0);
 }
 
 /**
@@ -9,10 +9,7 @@
 #include <base/stddef.h>
 #include <base/lock.h>
 #include <base/list.h>
-#include <base/hash.h>
 #include <base/limits.h>
-#include <base/tcache.h>
-#include <base/slab.h>
 #include <base/log.h>
 #include <runtime/sync.h>
 #include <runtime/thread.h>
@@ -28,11 +25,14 @@ static __thread void *runtime_stack_base;
 
 /* Flag to prevent watchdog from running */
 bool disable_watchdog;
-
-/* fast allocation of struct thread */
-static struct slab thread_slab;
-static struct tcache *thread_tcache;
-static DEFINE_PERTHREAD(struct tcache_perthread, thread_pt);
+/* the scheduler's watchdog period, and how long it polls before parking */
+unsigned int watchdog_us = RUNTIME_WATCHDOG_US;
+/* softirq delays past this are starvation, a thread is made to yield (0 off) */
+unsigned int softirq_starve_us;
+unsigned int sched_poll_iters = RUNTIME_SCHED_POLL_ITERS;
+unsigned int sched_min_poll_us = RUNTIME_SCHED_MIN_POLL_US;
+/* threads past their deadline wait until there's no other work */
+bool edf_drop_expired;
 
 /* used to track cycle usage in scheduler */
 static __thread uint64_t last_tsc;
@@ -46,6 +46,31 @@ static __thread uint64_t last_watchdog_tsc;
  */
 thread_t *thread_self(void);
 
+/* records how long @th waited to run, and marks when it started running */
+static __always_inline void thread_account_start(thread_t *th)
+{
+	struct kthread *k = myk();
+	uint64_t now = rdtsc(), delay = now - th->ready_tsc;
+
+	k->lat_hist[sched_hist_idx(delay)]++;
+	if (delay > k->qdelay_max)
+		k->qdelay_max = delay;
+	if (delay > k->spin_qdelay_max)
+		k->spin_qdelay_max = delay;
+	th->run_tsc = now;
+	rtrace(RTRACE_SWITCH, (uintptr_t)th, 0);
+}
+
+/* records how long @th ran for since it was last scheduled */
+static __always_inline void thread_account_stop(thread_t *th)
+{
+	struct kthread *k = myk();
+	uint64_t cycles = rdtsc() - th->run_tsc;
+
+	k->run_hist[sched_hist_idx(cycles)]++;
+	th->run_cycles += cycles;
+}
+
 /**
  * jmp_thread - runs a thread, popping its trap frame
  * @th: the thread to run
@@ -60,6 +85,7 @@ static __noreturn void jmp_thread(thread_t *th)
 
 	__self = th;
 	th->state = THREAD_STATE_RUNNING;
+	thread_account_start(th);
 	if (unlikely(load_acquire(&th->stack_busy))) {
 		/* wait until the scheduler finishes switching stacks */
 		while (load_acquire(&th->stack_busy))
@@ -81,8 +107,10 @@ static void jmp_thread_direct(thread_t *oldth, thread_t *newth)
 	assert_preempt_disabled();
 	assert(newth->state == THREAD_STATE_RUNNABLE);
 
+	thread_account_stop(oldth);
 	__self = newth;
 	newth->state = THREAD_STATE_RUNNING;
+	thread_account_start(newth);
 	if (unlikely(load_acquire(&newth->stack_busy))) {
 		/* wait until the scheduler finishes switching stacks */
 		while (load_acquire(&newth->stack_busy))
@@ -121,91 +149,381 @@ static __noreturn void jmp_runtime_nosave(runtime_fn_t fn)
 	__jmp_runtime_nosave(fn, runtime_stack);
 }
 
+/*
+ * The runqueue has a single producer (the owning kthread), which publishes
+ * threads by advancing rq_head, and many consumers (the owner and thieves),
+ * which claim threads with a CAS on rq_tail. No lock is needed to pop from or
+ * steal out of the runqueue. The indexes are never reset, so the copies in
+ * q_ptrs shared with the iokernel mirror them and only ever move forward.
+ */
+
+/**
+ * rq_claim - removes threads from the tail of a kthread's runqueue
+ * @k: the kthread that owns the runqueue
+ * @out: an array (of at least RUNTIME_RQ_SIZE) to store the threads
+ * @half: if true, claim half the threads, otherwise claim one thread
+ *
+ * Returns the number of threads claimed.
+ */
+static uint32_t rq_claim(struct kthread *k, thread_t **out, bool half)
+{
+	uint32_t i, n, rq_tail, shared;
+
+	do {
+		rq_tail = load_acquire(&k->rq_tail);
+		n = load_acquire(&k->rq_head) - rq_tail;
+		if (n == 0)
+			return 0;
+		/* the tail moved after it was read, try again */
+		if (unlikely(n > RUNTIME_RQ_SIZE))
+			continue;
+		n = half ? div_up(n, 2) : 1;
+
+		/*
+		 * The owner can't overwrite these slots until rq_tail moves
+		 * past them, in which case the CAS below fails.
+		 */
+		for (i = 0; i < n; i++)
+			out[i] = k->rq[(rq_tail + i) & RUNTIME_RQ_MASK];
+	} while (!__sync_bool_compare_and_swap(&k->rq_tail, rq_tail,
+					       rq_tail + n));
+
+	/* a slower consumer must not move the mirror back behind a faster one */
+	rq_tail += n;
+	do {
+		shared = ACCESS_ONCE(k->q_ptrs->rq_tail);
+		if (wraps_lte(rq_tail, shared))
+			break;
+	} while (!__sync_bool_compare_and_swap(&k->q_ptrs->rq_tail, shared,
+					       rq_tail));
+
+	return n;
+}
+
 static void drain_overflow(struct kthread *l)
 {
 	thread_t *th;
 
-	assert_spin_lock_held(&l->lock);
+	assert_ticket_lock_held(&l->lock);
 
-	while (l->rq_head - l->rq_tail < RUNTIME_RQ_SIZE) {
+	while (l->rq_head - load_acquire(&l->rq_tail) < RUNTIME_RQ_SIZE) {
 		th = list_pop(&l->rq_overflow, thread_t, link);
 		if (!th)
 			break;
-		l->rq[l->rq_head++ % RUNTIME_RQ_SIZE] = th;
+		l->rq_overflow_len--;
+		l->rq[l->rq_head & RUNTIME_RQ_MASK] = th;
+		store_release(&l->rq_head, l->rq_head + 1);
 		l->q_ptrs->rq_head++;
 	}
 }
 
-static bool steal_work(struct kthread *l, struct kthread *r)
+/*
+ * Threads with deadlines wait in a bounded min-heap instead, ordered by
+ * deadline and protected by the kthread's lock like the overflow queue. They
+ * run before the FIFO runqueue. Once the heap is full, more of them just wait
+ * in FIFO order.
+ */
+
+static void edf_push(struct kthread *k, thread_t *th)
+{
+	unsigned int i = k->rq_edf_len, p;
+
+	assert_ticket_lock_held(&k->lock);
+	assert(i < RUNTIME_EDF_SIZE);
+
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (k->rq_edf[p]->deadline_us <= th->deadline_us)
+			break;
+		k->rq_edf[i] = k->rq_edf[p];
+		i = p;
+	}
+
+	k->rq_edf[i] = th;
+	ACCESS_ONCE(k->rq_edf_len) = k->rq_edf_len + 1;
+}
+
+static thread_t *edf_pop_min(struct kthread *k)
+{
+	thread_t *th, *last;
+	unsigned int i = 0, c, n;
+
+	if (!k->rq_edf_len)
+		return NULL;
+
+	th = k->rq_edf[0];
+	n = k->rq_edf_len - 1;
+	last = k->rq_edf[n];
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n &&
+		    k->rq_edf[c + 1]->deadline_us < k->rq_edf[c]->deadline_us)
+			c++;
+		if (last->deadline_us <= k->rq_edf[c]->deadline_us)
+			break;
+		k->rq_edf[i] = k->rq_edf[c];
+		i = c;
+	}
+
+	k->rq_edf[i] = last;
+	ACCESS_ONCE(k->rq_edf_len) = n;
+	return th;
+}
+
+/* pops the thread with the earliest deadline that hasn't passed */
+static thread_t *edf_pop(struct kthread *k)
 {
 	thread_t *th;
-	uint32_t i, avail, rq_tail;
+	uint64_t now;
+
+	assert_ticket_lock_held(&k->lock);
+
+	if (likely(!k->rq_edf_len))
+		return NULL;
+	if (!edf_drop_expired)
+		return edf_pop_min(k);
+
+	now = microtime();
+	while ((th = edf_pop_min(k)) != NULL) {
+		if (th->deadline_us > now)
+			return th;
+
+		/* too late to matter, run it once nothing else is waiting */
+		list_add_tail(&k->rq_bg, &th->link);
+		k->rq_bg_len++;
+		STAT(EDF_EXPIRED)++;
+	}
+
+	return NULL;
+}
+
+/* steals the earliest half of @r's threads with deadlines */
+static bool steal_deadline(struct kthread *l, struct kthread *r)
+{
+	unsigned int i, nr;
 
-	assert_spin_lock_held(&l->lock);
-	assert(l->rq_head == 0 && l->rq_tail == 0);
+	assert_ticket_lock_held(&l->lock);
 
-	if (!spin_try_lock(&r->lock))
+	if (!ACCESS_ONCE(r->rq_edf_len) || !ticket_try_lock(&r->lock))
 		return false;
 
 	/* harmless race condition */
 	if (unlikely(r->detached)) {
-		spin_unlock(&r->lock);
+		ticket_unlock(&r->lock);
 		return false;
 	}
 
-	/* try to steal directly from the runqueue */
-	avail = load_acquire(&r->rq_head) - r->rq_tail;
-	if (avail) {
-		/* steal half the tasks */
-		avail = div_up(avail, 2);
-		assert(avail <= div_up(RUNTIME_RQ_SIZE, 2));
-		rq_tail = r->rq_tail;
-		for (i = 0; i < avail; i++)
-			l->rq[i] = r->rq[rq_tail++ % RUNTIME_RQ_SIZE];
-		store_release(&r->rq_tail, rq_tail);
-		r->q_ptrs->rq_tail += avail;
-		spin_unlock(&r->lock);
-
-		l->rq_head = avail;
-		l->q_ptrs->rq_head += avail;
-		STAT(THREADS_STOLEN) += avail;
+	nr = min(div_up(r->rq_edf_len, 2), RUNTIME_EDF_SIZE - l->rq_edf_len);
+	for (i = 0; i < nr; i++)
+		edf_push(l, edf_pop_min(r));
+	ticket_unlock(&r->lock);
+
+	if (!nr)
+		return false;
+	STAT(THREADS_STOLEN) += nr;
+	STAT(EDF_THREADS_STOLEN) += nr;
+	rtrace(RTRACE_STEAL, r->idx, nr);
+	return true;
+}
+
+static bool steal_work(struct kthread *l, struct kthread *r)
+{
+	thread_t *th, *stolen[RUNTIME_RQ_SIZE];
+	uint32_t i, nr, nr_overflow;
+
+	assert_ticket_lock_held(&l->lock);
+	assert(l->rq_head == l->rq_tail);
+
+	STAT(STEAL_ATTEMPTS)++;
+
+	/* the most urgent work first */
+	if (steal_deadline(l, r))
 		return true;
+
+	/* steal half the runqueue without taking the victim's lock */
+	nr = rq_claim(r, stolen, true);
+	if (nr && !ACCESS_ONCE(r->rq_overflow_len))
+		goto done;
+
+	if (!ticket_try_lock(&r->lock))
+		goto done;
+
+	/* harmless race condition */
+	if (unlikely(r->detached)) {
+		ticket_unlock(&r->lock);
+		goto done;
 	}
 
-	/* check for overflow tasks */
-	th = list_pop(&r->rq_overflow, thread_t, link);
-	if (th)
+	/* then steal half the overflow tasks, as many as will fit */
+	nr_overflow = min(div_up(r->rq_overflow_len, 2), RUNTIME_RQ_SIZE - nr);
+	for (i = 0; i < nr_overflow; i++) {
+		th = list_pop(&r->rq_overflow, thread_t, link);
+		assert(th);
+		stolen[nr++] = th;
+	}
+	r->rq_overflow_len -= nr_overflow;
+	if (nr) {
+		ticket_unlock(&r->lock);
 		goto done;
+	}
 
 	/* check for softirqs */
-	th = softirq_run_thread(r, RUNTIME_SOFTIRQ_BUDGET);
+	th = softirq_run_thread(r);
 	if (th) {
 		STAT(SOFTIRQS_STOLEN)++;
-		goto done;
+		stolen[nr++] = th;
+	} else if (r->parked) {
+		kthread_detach(r);
 	}
 
+	ticket_unlock(&r->lock);
+
 done:
-	/* either enqueue the stolen work or detach the kthread */
-	if (th) {
-		l->rq[l->rq_head++] = th;
-		l->q_ptrs->rq_head++;
-		STAT(THREADS_STOLEN)++;
-	} else if (r->parked) {
-		kthread_detach(r);
+	if (!nr)
+		return false;
+
+	/* enqueue the stolen work */
+	for (i = 0; i < nr; i++)
+		l->rq[(l->rq_head + i) & RUNTIME_RQ_MASK] = stolen[i];
+	store_release(&l->rq_head, l->rq_head + nr);
+	l->q_ptrs->rq_head += nr;
+	STAT(THREADS_STOLEN) += nr;
+	rtrace(RTRACE_STEAL, r->idx, nr);
+	return true;
+}
+
+/* steals half of @r's background threads and returns one of them to run */
+static thread_t *steal_background(struct kthread *l, struct kthread *r)
+{
+	thread_t *th;
+	unsigned int i, nr;
+
+	assert_ticket_lock_held(&l->lock);
+
+	if (!ACCESS_ONCE(r->rq_bg_len) || !ticket_try_lock(&r->lock))
+		return NULL;
+
+	/* harmless race condition */
+	if (unlikely(r->detached)) {
+		ticket_unlock(&r->lock);
+		return NULL;
+	}
+
+	nr = div_up(r->rq_bg_len, 2);
+	for (i = 0; i < nr; i++) {
+		th = list_pop(&r->rq_bg, thread_t, link);
+		assert(th);
+		list_add_tail(&l->rq_bg, &th->link);
+	}
+	r->rq_bg_len -= nr;
+	l->rq_bg_len += nr;
+	ticket_unlock(&r->lock);
+
+	STAT(BG_THREADS_STOLEN) += nr;
+	if (!nr)
+		return NULL;
+	l->rq_bg_len--;
+	return list_pop(&l->rq_bg, thread_t, link);
+}
+
+/* steal distances, nearest first (matches the STAT_STEALS_* order) */
+enum {
+	STEAL_CORE = 0,	/* a hyperthread sibling on the same physical core */
+	STEAL_LLC,	/* a core sharing the last-level cache */
+	STEAL_SOCKET,	/* a core in the same package */
+	STEAL_REMOTE,	/* everything else */
+	STEAL_NR_LEVELS,
+};
+
+static int steal_level(unsigned int lcpu, unsigned int rcpu)
+{
+	switch (cpu_distance(lcpu, rcpu)) {
+	case CPU_DIST_SELF:
+	case CPU_DIST_CORE:
+		return STEAL_CORE;
+	case CPU_DIST_LLC:
+		return STEAL_LLC;
+	case CPU_DIST_NODE:
+	case CPU_DIST_PACKAGE:
+		return STEAL_SOCKET;
+	default:
+		return STEAL_REMOTE;
 	}
+}
+
+static bool steal_work_level(struct kthread *l, struct kthread *r, int level)
+{
+	if (!steal_work(l, r))
+		return false;
+	STAT(STEALS_CORE + level)++;
+	return true;
+}
+
+/*
+ * Picks the kthread with the deepest runqueue at the nearest distance that
+ * has any queued work. The depths are read without locks, so they are only
+ * a hint; steal_work() rechecks under the victim's lock.
+ */
+static struct kthread *steal_pick_victim(struct kthread *l,
+					 unsigned int nrks, int *level_out)
+{
+	struct kthread *best[STEAL_NR_LEVELS] = {NULL};
+	uint32_t best_depth[STEAL_NR_LEVELS] = {0};
+	struct kthread *r;
+	uint32_t depth;
+	int i, level;
+
+	for (i = 0; i < nrks; i++) {
+		r = ks[i];
+		if (r == l)
+			continue;
+		depth = load_acquire(&r->rq_head) - ACCESS_ONCE(r->rq_tail);
+		if (depth > RUNTIME_RQ_SIZE)
+			continue;
+		depth += ACCESS_ONCE(r->rq_edf_len);
+		if (depth == 0)
+			continue;
+		level = steal_level(l->curr_cpu, ACCESS_ONCE(r->curr_cpu));
+		if (depth > best_depth[level]) {
+			best[level] = r;
+			best_depth[level] = depth;
+		}
+	}
+
+	for (level = 0; level < STEAL_NR_LEVELS; level++) {
+		if (best[level]) {
+			*level_out = level;
+			return best[level];
+		}
+	}
+
+	return NULL;
+}
 
-	spin_unlock(&r->lock);
-	return th != NULL;
+/**
+ * sched_request_watchdog - makes the next reschedule on this kthread run the
+ * watchdog, so pending softirqs are handled then
+ */
+void sched_request_watchdog(void)
+{
+	last_watchdog_tsc = 0;
 }
 
 static __noinline struct thread *do_watchdog(struct kthread *l)
 {
+	uint64_t delay;
 	thread_t *th;
 
-	assert_spin_lock_held(&l->lock);
+	assert_ticket_lock_held(&l->lock);
+
+	/* record how long softirqs have been waiting on this kthread */
+	delay = softirq_delay(l, rdtsc());
+	l->softirq_hist[sched_hist_idx(delay)]++;
+	STAT(WATCHDOG_RUNS)++;
+	if (softirq_starve_us && delay > cycles_per_us * softirq_starve_us)
+		STAT(SOFTIRQ_STARVED)++;
 
 	/* then check the network queues */
-	th = softirq_run_thread(l, RUNTIME_SOFTIRQ_BUDGET);
+	th = softirq_run_thread(l);
 	if (th) {
 		STAT(SOFTIRQS_LOCAL)++;
 		return th;
@@ -222,14 +540,16 @@ static __noreturn __noinline void schedule(void)
 	thread_t *th = NULL;
 	unsigned int last_nrks;
 	unsigned int iters = 0;
-	int i, sibling;
+	int i, sibling, level;
 
-	assert_spin_lock_held(&l->lock);
+	assert_ticket_lock_held(&l->lock);
 	assert(l->parked == false);
 	assert(l->detached == false);
 
 	/* unmark busy for the stack of the last uthread */
 	if (__self != NULL) {
+		thread_account_stop(__self);
+		rtrace(RTRACE_SCHED, (uintptr_t)__self, 0);
 		store_release(&__self->stack_busy, false);
 		__self = NULL;
 	}
@@ -237,6 +557,9 @@ static __noreturn __noinline void schedule(void)
 	/* detect misuse of preempt disable */
 	BUG_ON((preempt_cnt & ~PREEMPT_NOT_PENDING) != 1);
 
+	/* publish the packets of the uthreads that have run */
+	net_tx_flush(l);
+
 	/* update entry stat counters */
 	STAT(RESCHEDULES)++;
 	start_tsc = rdtsc();
@@ -249,27 +572,31 @@ static __noreturn __noinline void schedule(void)
 	/* if it's been too long, run the softirq handler */
 	if (!disable_watchdog &&
 	    unlikely(start_tsc - last_watchdog_tsc >
-	             cycles_per_us * RUNTIME_WATCHDOG_US)) {
+	             cycles_per_us * watchdog_us)) {
 		last_watchdog_tsc = start_tsc;
 		th = do_watchdog(l);
 		if (th)
 			goto done;
 	}
 
-	/* move overflow tasks into the runqueue */
-	if (unlikely(!list_empty(&l->rq_overflow)))
+	/* move overflow tasks into the runqueue, and ask for more kthreads */
+	if (unlikely(!list_empty(&l->rq_overflow))) {
+		kthread_grow_limit();
 		drain_overflow(l);
+	}
 
 again:
-	/* first try the local runqueue */
-	if (l->rq_head != l->rq_tail)
+	/* first try the earliest deadline, then the local runqueue */
+	th = edf_pop(l);
+	if (th)
+		goto done;
+	if (rq_claim(l, &th, false))
 		goto done;
 
-	/* reset the local runqueue since it's empty */
-	l->rq_head = l->rq_tail = 0;
-
-	/* then check for local softirqs */
-	th = softirq_run_thread(l, RUNTIME_SOFTIRQ_BUDGET);
+	/* then check for local softirqs, handling small batches right here */
+	if (softirq_run_inline(l))
+		goto again;
+	th = softirq_run_thread(l);
 	if (th) {
 		STAT(SOFTIRQS_LOCAL)++;
 		goto done;
@@ -280,24 +607,65 @@ again:
 	/* then try to steal from a sibling kthread */
 	sibling = cpu_map[l->curr_cpu].sibling_core;
 	r = cpu_map[sibling].recent_kthread;
-	if (r && r != l && steal_work(l, r))
+	if (r && r != l && steal_work_level(l, r, STEAL_CORE))
 		goto done;
 
-	/* then try to steal from a random kthread */
-	r = ks[rand_crc32c((uintptr_t)l) % last_nrks];
-	if (r != l && steal_work(l, r))
+	/* then try the nearest kthread with the most queued threads */
+	r = steal_pick_victim(l, last_nrks, &level);
+	if (r && steal_work_level(l, r, level))
 		goto done;
 
-	/* finally try to steal from every kthread */
-	for (i = 0; i < last_nrks; i++)
-		if (ks[i] != l && steal_work(l, ks[i]))
-			goto done;
+	/*
+	 * finally try to steal from every kthread, nearest first, which also
+	 * picks up overflow tasks and softirqs that the depth scan can't see
+	 */
+	for (level = 0; level < STEAL_NR_LEVELS; level++) {
+		for (i = 0; i < last_nrks; i++) {
+			r = ks[i];
+			if (r == l ||
+			    steal_level(l->curr_cpu,
+					ACCESS_ONCE(r->curr_cpu)) != level)
+				continue;
+			if (steal_work_level(l, r, level))
+				goto done;
+		}
+	}
+
+	/*
+	 * only run background threads once there is no latency-critical work
+	 * or softirqs anywhere, first locally and then from other kthreads
+	 */
+	th = list_pop(&l->rq_bg, thread_t, link);
+	if (th) {
+		l->rq_bg_len--;
+		goto done;
+	}
+	for (level = 0; level < STEAL_NR_LEVELS; level++) {
+		for (i = 0; i < last_nrks; i++) {
+			r = ks[i];
+			if (r == l ||
+			    steal_level(l->curr_cpu,
+					ACCESS_ONCE(r->curr_cpu)) != level)
+				continue;
+			th = steal_background(l, r);
+			if (th)
+				goto done;
+		}
+	}
 
 	/* keep trying to find work until the polling timeout expires */
+	preempt_poll();
 	if (!preempt_needed() &&
-	    (++iters < RUNTIME_SCHED_POLL_ITERS ||
-	     rdtsc() - start_tsc < cycles_per_us * RUNTIME_SCHED_MIN_POLL_US))
+	    (++iters < sched_poll_iters ||
+	     rdtsc() - start_tsc < cycles_per_us * sched_min_poll_us ||
+	     rdtsc() < ACCESS_ONCE(core_demand_deadline_tsc)))
+		goto again;
+
+	/* a timer is due before a parked kthread could be woken up for it */
+	if (!preempt_needed() && timer_imminent(l)) {
+		STAT(TIMER_POLLS)++;
 		goto again;
+	}
 
 	/* did not find anything to run, park this kthread */
 	STAT(SCHED_CYCLES) += rdtsc() - start_tsc;
@@ -308,23 +676,23 @@ again:
 	goto again;
 
 done:
-	/* pop off a thread and run it */
-	if (!th) {
-		assert(l->rq_head != l->rq_tail);
-		th = l->rq[l->rq_tail++ % RUNTIME_RQ_SIZE];
-		l->q_ptrs->rq_tail++;
-	}
+	/* pop off a thread and run it (another thief may have beaten us) */
+	if (!th)
+		th = edf_pop(l);
+	if (!th && !rq_claim(l, &th, false))
+		goto again;
 
 	/* move overflow tasks into the runqueue */
 	if (unlikely(!list_empty(&l->rq_overflow)))
 		drain_overflow(l);
 
-	spin_unlock(&l->lock);
+	ticket_unlock(&l->lock);
 
 	/* update exit stat counters */
 	end_tsc = rdtsc();
 	STAT(SCHED_CYCLES) += end_tsc - start_tsc;
 	last_tsc = end_tsc;
+	slice_start_tsc = end_tsc;
 
 	/* increment the RCU generation number (odd is in thread) */
 	store_release(&l->rcu_gen, l->rcu_gen + 1);
@@ -342,7 +710,7 @@ done:
  */
 void join_kthread(struct kthread *k)
 {
-	thread_t *waketh;
+	thread_t *waketh = NULL;
 	struct list_head tmp;
 
 	//log_info_ratelimited("join_kthread() %p", k);
@@ -350,28 +718,30 @@ void join_kthread(struct kthread *k)
 	list_head_init(&tmp);
 
 	/* if the lock can't be acquired, the kthread is unparking */
-	if (!spin_try_lock_np(&k->lock))
+	if (!ticket_try_lock_np(&k->lock))
 		return;
 
 	/* harmless race conditions */
 	if (k->detached || !k->parked || k == myk()) {
-		spin_unlock_np(&k->lock);
+		ticket_unlock_np(&k->lock);
 		return;
 	}
 
 	/* drain the runqueue */
-	for (; k->rq_tail < k->rq_head; k->rq_tail++) {
-		list_add_tail(&tmp, &k->rq[k->rq_tail % RUNTIME_RQ_SIZE]->link);
-		k->q_ptrs->rq_tail++;
-	}
-	k->rq_head = k->rq_tail = 0;
+	while (rq_claim(k, &waketh, false))
+		list_add_tail(&tmp, &waketh->link);
 
-	/* drain the overflow runqueue */
+	/* drain the overflow and background runqueues */
 	list_append_list(&tmp, &k->rq_overflow);
+	k->rq_overflow_len = 0;
+	list_append_list(&tmp, &k->rq_bg);
+	k->rq_bg_len = 0;
+	while ((waketh = edf_pop_min(k)) != NULL)
+		list_add_tail(&tmp, &waketh->link);
 
 	/* detach the kthread */
 	kthread_detach(k);
-	spin_unlock_np(&k->lock);
+	ticket_unlock_np(&k->lock);
 
 	/* re-wake all the runnable threads belonging to the detached kthread */
 	while (true) {
@@ -386,27 +756,28 @@ void join_kthread(struct kthread *k)
 static __always_inline void enter_schedule(thread_t *myth)
 {
 	struct kthread *k = myk();
-	thread_t *th;
+	thread_t *th = NULL;
 
 	assert_preempt_disabled();
-
-	spin_lock(&k->lock);
+	stack_check_canary(myth->stack);
 
 	/* slow path: switch from the uthread stack to the runtime stack */
-	if (k->rq_head == k->rq_tail ||
-	    (!disable_watchdog &&
+	if ((!disable_watchdog &&
 	     unlikely(rdtsc() - last_watchdog_tsc >
-		      cycles_per_us * RUNTIME_WATCHDOG_US))) {
+		      cycles_per_us * watchdog_us)) ||
+	    ACCESS_ONCE(k->rq_edf_len) || !rq_claim(k, &th, false)) {
+		ticket_lock(&k->lock);
 		jmp_runtime(schedule);
 		return;
 	}
 
-	/* fast path: switch directly to the next uthread */
+	/* fast path: switch directly to the next uthread without locking */
+	if (preempt_quantum_us)
+		slice_start_tsc = rdtsc();
 
-	/* pop the next runnable thread from the queue */
-	th = k->rq[k->rq_tail++ % RUNTIME_RQ_SIZE];
-	k->q_ptrs->rq_tail++;
-	spin_unlock(&k->lock);
+	/* no uthread is queued behind the next one to add to the burst */
+	if (k->rq_head == ACCESS_ONCE(k->rq_tail))
+		net_tx_flush(k);
 
 	/* increment the RCU generation number (odd is in thread) */
 	store_release(&k->rcu_gen, k->rcu_gen + 2);
@@ -446,6 +817,24 @@ void thread_park_and_unlock_np(spinlock_t *l)
 	enter_schedule(myth);
 }
 
+/**
+ * thread_run_us - returns how long the calling thread has run (in us)
+ *
+ * Only time spent running counts, not time spent waiting in a runqueue.
+ */
+uint64_t thread_run_us(void)
+{
+	thread_t *myth;
+	uint64_t cycles;
+
+	preempt_disable();
+	myth = thread_self();
+	cycles = myth->run_cycles + rdtsc() - myth->run_tsc;
+	preempt_enable();
+
+	return cycles / cycles_per_us;
+}
+
 /**
  * thread_yield - yields the currently running thread
  *
@@ -456,7 +845,7 @@ void thread_yield(void)
 	thread_t *myth = thread_self();
 
 	/* check for softirqs */
-	softirq_run(RUNTIME_SOFTIRQ_BUDGET);
+	softirq_run();
 
 	preempt_disable();
 	assert(myth->state == THREAD_STATE_RUNNING);
@@ -467,6 +856,57 @@ void thread_yield(void)
 	enter_schedule(myth);
 }
 
+/**
+ * thread_yield_to - wakes a thread and switches straight to it
+ * @th: the thread to wake (it must be sleeping)
+ *
+ * Like thread_ready() followed by thread_yield(), except that @th runs right
+ * away on this kthread, with the data its waker just produced still in cache,
+ * instead of waiting behind the runqueue. The caller is queued like
+ * thread_yield() does. Falls back to thread_ready() outside of a uthread, with
+ * preemption disabled by the caller, and for background threads and threads
+ * with deadlines, which are ordered separately. It also falls back while
+ * deadline threads are queued, since they must run first.
+ */
+void thread_yield_to(thread_t *th)
+{
+	struct kthread *k;
+	thread_t *myth;
+
+	preempt_disable();
+	myth = thread_self();
+	k = myk();
+	/* queued deadline threads run first, as in enter_schedule() */
+	if (unlikely(!myth || th->background || th->deadline_us ||
+		     ACCESS_ONCE(k->rq_edf_len) ||
+		     (preempt_cnt & ~PREEMPT_NOT_PENDING) != 1 ||
+		     (!disable_watchdog &&
+		      rdtsc() - last_watchdog_tsc >
+		      cycles_per_us * watchdog_us))) {
+		thread_ready(th);
+		preempt_enable();
+		return;
+	}
+
+	assert(myth->state == THREAD_STATE_RUNNING);
+	assert(th->state == THREAD_STATE_SLEEPING);
+	stack_check_canary(myth->stack);
+	thread_set_runnable(th);
+	myth->state = THREAD_STATE_SLEEPING;
+	store_release(&myth->stack_busy, true);
+	thread_ready(myth);
+
+	if (preempt_quantum_us)
+		slice_start_tsc = rdtsc();
+
+	/* increment the RCU generation number (odd is in thread) */
+	store_release(&k->rcu_gen, k->rcu_gen + 2);
+	assert((k->rcu_gen & 0x1) == 0x1);
+
+	STAT(DIRECT_SWITCHES)++;
+	jmp_thread_direct(myth, th);
+}
+
 /**
  * thread_ready - marks a thread as a runnable
  * @th: the thread to mark runnable
@@ -479,20 +919,44 @@ void thread_ready(thread_t *th)
 	uint32_t rq_tail;
 
 	assert(th->state == THREAD_STATE_SLEEPING);
-	th->state = THREAD_STATE_RUNNABLE;
+	thread_set_runnable(th);
 
 	k = getk();
+
+	/* background threads wait until there's no other work (see schedule) */
+	if (unlikely(th->background)) {
+		ticket_lock(&k->lock);
+		list_add_tail(&k->rq_bg, &th->link);
+		k->rq_bg_len++;
+		ticket_unlock(&k->lock);
+		putk();
+		return;
+	}
+
+	/* threads with deadlines run earliest deadline first (see schedule) */
+	if (unlikely(th->deadline_us)) {
+		ticket_lock(&k->lock);
+		if (likely(k->rq_edf_len < RUNTIME_EDF_SIZE)) {
+			edf_push(k, th);
+			ticket_unlock(&k->lock);
+			putk();
+			return;
+		}
+		ticket_unlock(&k->lock);
+	}
+
 	rq_tail = load_acquire(&k->rq_tail);
 	if (unlikely(k->rq_head - rq_tail >= RUNTIME_RQ_SIZE)) {
 		assert(k->rq_head - rq_tail == RUNTIME_RQ_SIZE);
-		spin_lock(&k->lock);
+		ticket_lock(&k->lock);
 		list_add_tail(&k->rq_overflow, &th->link);
-		spin_unlock(&k->lock);
+		k->rq_overflow_len++;
+		ticket_unlock(&k->lock);
 		putk();
 		return;
 	}
 
-	k->rq[k->rq_head % RUNTIME_RQ_SIZE] = th;
+	k->rq[k->rq_head & RUNTIME_RQ_MASK] = th;
 	store_release(&k->rq_head, k->rq_head + 1);
 	k->q_ptrs->rq_head++;
 	putk();
@@ -509,7 +973,7 @@ static void thread_finish_yield_kthread(void)
 
 	STAT(PROGRAM_CYCLES) += rdtsc() - last_tsc;
 
-	spin_lock(&k->lock);
+	ticket_lock(&k->lock);
 	clear_preempt_needed();
 	kthread_park(false);
 	last_tsc = rdtsc();
@@ -527,29 +991,27 @@ void thread_yield_kthread(void)
 	jmp_runtime(thread_finish_yield_kthread);
 }
 
-static __always_inline thread_t *__thread_create(void)
+static __always_inline thread_t *__thread_create(int stack_class)
 {
 	struct thread *th;
 	struct stack *s;
 
+	/* the thread is embedded at the top of its stack */
 	preempt_disable();
-	th = tcache_alloc(&perthread_get(thread_pt));
-	if (unlikely(!th)) {
-		preempt_enable();
-		return NULL;
-	}
-
-	s = stack_alloc();
-	if (unlikely(!s)) {
-		tcache_free(&perthread_get(thread_pt), th);
-		preempt_enable();
-		return NULL;
-	}
+	s = stack_alloc(stack_class);
 	preempt_enable();
+	if (unlikely(!s))
+		return NULL;
 
+	th = stack_thread(s, stack_class);
 	th->stack = s;
+	th->stack_class = stack_class;
 	th->state = THREAD_STATE_SLEEPING;
 	th->main_thread = false;
+	th->background = false;
+	th->run_cycles = 0;
+	th->deadline_us = 0;
+	th->tls = NULL;
 
 	return th;
 }
@@ -563,14 +1025,31 @@ static __always_inline thread_t *__thread_create(void)
  */
 thread_t *thread_create(thread_fn_t fn, void *arg)
 {
-	thread_t *th = __thread_create();
+	return thread_create_with_stack(fn, arg, THREAD_STACK_DEFAULT);
+}
+
+/**
+ * thread_create_with_stack - creates a new thread with a given stack size
+ * @fn: a function pointer to the starting method of the thread
+ * @arg: an argument passed to @fn
+ * @stack_class: the size of the stack (THREAD_STACK_*)
+ *
+ * Returns 0 if successful, otherwise -ENOMEM if out of memory.
+ */
+thread_t *thread_create_with_stack(thread_fn_t fn, void *arg, int stack_class)
+{
+	thread_t *th;
+
+	assert(stack_class >= 0 && stack_class < THREAD_STACK_NR_CLASSES);
+	th = __thread_create(stack_class);
 	if (unlikely(!th))
 		return NULL;
 
-	th->tf.rsp = stack_init_to_rsp(th->stack, thread_exit);
+	th->tf.rsp = stack_init_to_rsp(th->stack, stack_class, thread_exit);
 	th->tf.rdi = (uint64_t)arg;
 	th->tf.rbp = (uint64_t)0; /* just in case base pointers are enabled */
 	th->tf.rip = (uint64_t)fn;
+	th->entry = (uintptr_t)fn;
 	th->stack_busy = false;
 	return th;
 }
@@ -587,15 +1066,16 @@ thread_t *thread_create(thread_fn_t fn, void *arg)
 thread_t *thread_create_with_buf(thread_fn_t fn, void **buf, size_t buf_len)
 {
 	void *ptr;
-	thread_t *th = __thread_create();
+	thread_t *th = __thread_create(THREAD_STACK_DEFAULT);
 	if (unlikely(!th))
 		return NULL;
 
-	th->tf.rsp = stack_init_to_rsp_with_buf(th->stack, &ptr,
-						buf_len, thread_exit);
+	th->tf.rsp = stack_init_to_rsp_with_buf(th->stack, THREAD_STACK_DEFAULT,
+						&ptr, buf_len, thread_exit);
 	th->tf.rdi = (uint64_t)ptr;
 	th->tf.rbp = (uint64_t)0; /* just in case base pointers are enabled */
 	th->tf.rip = (uint64_t)fn;
+	th->entry = (uintptr_t)fn;
 	th->stack_busy = false;
 	*buf = ptr;
 	return th;
@@ -617,6 +1097,86 @@ int thread_spawn(thread_fn_t fn, void *arg)
 	return 0;
 }
 
+/**
+ * thread_spawn_with_stack - creates and launches a new thread with a given
+ * stack size
+ * @fn: a function pointer to the starting method of the thread
+ * @arg: an argument passed to @fn
+ * @stack_class: the size of the stack (THREAD_STACK_*)
+ *
+ * Returns 0 if successful, otherwise -ENOMEM if out of memory.
+ */
+int thread_spawn_with_stack(thread_fn_t fn, void *arg, int stack_class)
+{
+	thread_t *th = thread_create_with_stack(fn, arg, stack_class);
+	if (unlikely(!th))
+		return -ENOMEM;
+	thread_ready(th);
+	return 0;
+}
+
+/**
+ * thread_set_background - sets the scheduling class of a thread
+ * @th: the thread
+ * @background: if true, @th only runs when no latency-critical threads or
+ *		softirqs are waiting; otherwise it is latency-critical (the
+ *		default)
+ *
+ * Takes effect the next time @th becomes runnable.
+ */
+void thread_set_background(thread_t *th, bool background)
+{
+	th->background = background;
+}
+
+/**
+ * thread_set_deadline - sets when a thread's work is due
+ * @th: the thread
+ * @deadline_us: the deadline, in microtime(), or 0 for none (the default)
+ *
+ * Runnable threads with deadlines run before other latency-critical threads,
+ * earliest deadline first, and are stolen first too. With
+ * runtime_edf_drop_expired, threads past their deadline instead wait until
+ * there is no other work, like background threads.
+ *
+ * Takes effect the next time @th becomes runnable.
+ */
+void thread_set_deadline(thread_t *th, uint64_t deadline_us)
+{
+	th->deadline_us = deadline_us;
+}
+
+/**
+ * thread_deadline_passed - returns true if the calling thread's deadline has
+ * passed
+ *
+ * Lets a handler drop work that is already too late instead of finishing it.
+ * Always false for threads without a deadline.
+ */
+bool thread_deadline_passed(void)
+{
+	uint64_t deadline_us = thread_self()->deadline_us;
+
+	return deadline_us && microtime() >= deadline_us;
+}
+
+/**
+ * thread_spawn_background - creates and launches a new background thread
+ * @fn: a function pointer to the starting method of the thread
+ * @arg: an argument passed to @fn
+ *
+ * Returns 0 if successful, otherwise -ENOMEM if out of memory.
+ */
+int thread_spawn_background(thread_fn_t fn, void *arg)
+{
+	thread_t *th = thread_create(fn, arg);
+	if (unlikely(!th))
+		return -ENOMEM;
+	thread_set_background(th, true);
+	thread_ready(th);
+	return 0;
+}
+
 /**
  * thread_spawn_main - creates and launches the main thread
  * @fn: a function pointer to the starting method of the thread
@@ -649,11 +1209,15 @@ static void thread_finish_exit(void)
 	/* if the main thread dies, kill the whole program */
 	if (unlikely(th->main_thread))
 		init_shutdown(EXIT_SUCCESS);
-	stack_free(th->stack);
-	tcache_free(&perthread_get(thread_pt), th);
+	thread_account_stop(th);
+	rtrace(RTRACE_SCHED, (uintptr_t)th, 0);
+	/* this also frees @th, which lives in its stack */
+	stack_check_canary(th->stack);
+	stack_record_depth(th);
+	stack_free(th->stack, th->stack_class);
 	__self = NULL;
 
-	spin_lock(&myk()->lock);
+	ticket_lock(&myk()->lock);
 	schedule();
 }
 
@@ -662,6 +1226,9 @@ static void thread_finish_exit(void)
  */
 void thread_exit(void)
 {
+	if (unlikely(thread_self()->tls))
+		thread_tls_exit();
+
 	/* can't free the stack we're currently using, so switch */
 	preempt_disable();
 	jmp_runtime_nosave(thread_finish_exit);
@@ -683,7 +1250,7 @@ static __noreturn void schedule_start(void)
 	kthread_wait_to_attach();
 	store_release(&k->rcu_gen, 1);
 
-	spin_lock(&k->lock);
+	ticket_lock(&k->lock);
 	schedule();
 }
 
@@ -711,14 +1278,13 @@ int sched_init_thread(void)
 {
 	struct stack *s;
 
-	tcache_init_perthread(thread_tcache, &perthread_get(thread_pt));
-
-	s = stack_alloc();
+	s = stack_alloc(THREAD_STACK_DEFAULT);
 	if (!s)
 		return -ENOMEM;
 
 	runtime_stack_base = (void *)s;
-	runtime_stack = (void *)stack_init_to_rsp(s, runtime_top_of_stack); 
+	runtime_stack = (void *)stack_init_to_rsp(s, THREAD_STACK_DEFAULT,
+						  runtime_top_of_stack);
 
 	return 0;
 }
@@ -730,22 +1296,7 @@ int sched_init_thread(void)
  */
 int sched_init(void)
 {
-	int ret, i, j, siblings;
-
-	/*
-	 * set up allocation routines for threads
-	 */
-	ret = slab_create(&thread_slab, "runtime_threads",
-			  sizeof(struct thread), 0);
-	if (ret)
-		return ret;
-
-	thread_tcache = slab_create_tcache(&thread_slab,
-					   TCACHE_DEFAULT_MAG_SIZE);
-	if (!thread_tcache) {
-		slab_destroy(&thread_slab);
-		return -ENOMEM;
-	}
+	int i, j, siblings;
 
 	for (i = 0; i < cpu_count; i++) {
 		siblings = 0;
@@ -3,23 +3,46 @@
  * libary slab and thread-local cache allocator
  */
 
+#include <stdio.h>
+
+#include <base/allocprof.h>
 #include <base/page.h>
 #include <base/slab.h>
 #include <base/tcache.h>
 #include <runtime/sync.h>
 #include <runtime/smalloc.h>
+#include <runtime/timer.h>
 
 #include "defs.h"
 
 #define SMALLOC_MAG_SIZE	8
-#define SMALLOC_BITS            15
+/* how often to reclaim memory if large pages are unmapped immediately */
+#define SMALLOC_RECLAIM_PERIOD	ONE_SECOND
+/* the shortest reclaim period, so the depots still cache magazines */
+#define SMALLOC_RECLAIM_MIN	(10 * ONE_MS)
 #define SMALLOC_MIN_SIZE	SLAB_MIN_SIZE
-#define SMALLOC_MAX_SIZE        (SMALLOC_MIN_SIZE << (SMALLOC_BITS - 1))
+#define SMALLOC_MAX_SIZE	(256 * 1024)
 BUILD_ASSERT(SMALLOC_MIN_SIZE >= SLAB_MIN_SIZE);
 
-static struct slab smalloc_slabs[SMALLOC_BITS];
-static struct tcache *smalloc_tcaches[SMALLOC_BITS];
-static DEFINE_PERTHREAD(struct tcache_perthread, smalloc_pts[SMALLOC_BITS]);
+/*
+ * Size classes are spaced SMALLOC_MIN_SIZE apart up to SMALLOC_LINEAR_MAX, and
+ * above that each power-of-two range is split into SMALLOC_STEPS classes (e.g.
+ * 80 B, 96 B, 112 B, 128 B). This bounds internal fragmentation to 25% while
+ * keeping every class a multiple of SMALLOC_MIN_SIZE.
+ */
+#define SMALLOC_STEP_BITS	2
+#define SMALLOC_STEPS		(1 << SMALLOC_STEP_BITS)
+#define SMALLOC_LINEAR_MAX	(SMALLOC_MIN_SIZE * SMALLOC_STEPS)
+#define SMALLOC_NR		(SMALLOC_STEPS + SMALLOC_STEPS *		\
+				 (__builtin_ctz(SMALLOC_MAX_SIZE) -		\
+				  __builtin_ctz(SMALLOC_LINEAR_MAX)))
+BUILD_ASSERT(is_power_of_two(SMALLOC_MAX_SIZE));
+BUILD_ASSERT(SMALLOC_MIN_SIZE << SMALLOC_STEP_BITS == SMALLOC_LINEAR_MAX);
+
+static struct slab smalloc_slabs[SMALLOC_NR];
+static struct tcache *smalloc_tcaches[SMALLOC_NR];
+static DEFINE_PERTHREAD(struct tcache_perthread, smalloc_pts[SMALLOC_NR]);
+static char smalloc_names[SMALLOC_NR][32];
 
 /**
  * smalloc_size_to_idx - converts a size to a cache index
@@ -29,35 +52,39 @@ static DEFINE_PERTHREAD(struct tcache_perthread, smalloc_pts[SMALLOC_BITS]);
  */
 static inline int smalloc_size_to_idx(size_t size)
 {
-	return  64 - __builtin_ctz(SMALLOC_MIN_SIZE) -
-		__builtin_clzl((size - 1) | SMALLOC_MIN_SIZE);
-}
+	size_t s = size - 1;
+	int order;
+
+	if (size <= SMALLOC_LINEAR_MAX)
+		return s / SMALLOC_MIN_SIZE;
 
-static const char *slab_names[SMALLOC_BITS] = {
-	"smalloc (16 B)",
-	"smalloc (32 B)",
-	"smalloc (64 B)",
-	"smalloc (128 B)",
-	"smalloc (256 B)",
-	"smalloc (512 B)",
-	"smalloc (1 KB)",
-	"smalloc (2 KB)",
-	"smalloc (4 KB)",
-	"smalloc (8 KB)",
-	"smalloc (16 KB)",
-	"smalloc (32 KB)",
-	"smalloc (64 KB)",
-	"smalloc (128 KB)",
-	"smalloc (256 KB)",
-};
+	/* @s lies in [2^order, 2^(order + 1)) */
+	order = 63 - __builtin_clzl(s);
+	return SMALLOC_STEPS +
+	       ((order - __builtin_ctz(SMALLOC_LINEAR_MAX)) << SMALLOC_STEP_BITS) +
+	       ((s >> (order - SMALLOC_STEP_BITS)) & (SMALLOC_STEPS - 1));
+}
 
 /**
- * smalloc - allocates memory (non-inlined path)
- * @size: the size of the item
+ * smalloc_idx_to_size - converts a cache index to the size of its items
+ * @idx: the smalloc cache index
  *
- * Returns an item or NULL if out of memory.
+ * Returns the item size.
  */
-void *smalloc(size_t size)
+static size_t smalloc_idx_to_size(int idx)
+{
+	int order;
+
+	if (idx < SMALLOC_STEPS)
+		return SMALLOC_MIN_SIZE * (idx + 1);
+
+	idx -= SMALLOC_STEPS;
+	order = __builtin_ctz(SMALLOC_LINEAR_MAX) + (idx >> SMALLOC_STEP_BITS);
+	return (size_t)(SMALLOC_STEPS + 1 + (idx & (SMALLOC_STEPS - 1))) <<
+	       (order - SMALLOC_STEP_BITS);
+}
+
+static __always_inline void *__smalloc(size_t size, const void *caller)
 {
 	struct tcache_perthread *pt;
 	void *item;
@@ -66,6 +93,7 @@ void *smalloc(size_t size)
 		return NULL;
 
 	preempt_disable();
+	allocprof_sample(ALLOCPROF_SMALLOC, caller, NULL, size);
 	pt = &perthread_get(smalloc_pts[smalloc_size_to_idx(size)]);
 	item = tcache_alloc(pt);
 	preempt_enable();
@@ -73,6 +101,17 @@ void *smalloc(size_t size)
 	return item;
 }
 
+/**
+ * smalloc - allocates memory (non-inlined path)
+ * @size: the size of the item
+ *
+ * Returns an item or NULL if out of memory.
+ */
+void *smalloc(size_t size)
+{
+	return __smalloc(size, __builtin_return_address(0));
+}
+
 /**
  * __szmalloc - allocates zeroed memory (non-inlined path)
  * @size: the size of the item
@@ -81,7 +120,7 @@ void *smalloc(size_t size)
  */
 void *__szalloc(size_t size)
 {
-	void *item = smalloc(size);
+	void *item = __smalloc(size, __builtin_return_address(0));
 	if (unlikely(!item))
 		return NULL;
 
@@ -104,6 +143,27 @@ void sfree(void *item)
 	preempt_enable();
 }
 
+/**
+ * sfree_sized - frees memory of a known size back to the generic allocator
+ * @item: the item to free
+ * @size: the size passed to smalloc() when @item was allocated
+ *
+ * Faster than sfree() because the size class is computed directly instead of
+ * being looked up from the slab page.
+ */
+void sfree_sized(void *item, size_t size)
+{
+	struct tcache_perthread *pt;
+	int idx = smalloc_size_to_idx(size);
+
+	assert(smalloc_size_to_idx(addr_to_page(item)->snode->size) == idx);
+
+	preempt_disable();
+	pt = &perthread_get(smalloc_pts[idx]);
+	tcache_free(pt, item);
+	preempt_enable();
+}
+
 /**
  * smalloc_init - initializes slab malloc
  *
@@ -113,9 +173,19 @@ int smalloc_init(void)
 {
 	int i, ret;
 
-	for (i = 0; i < SMALLOC_BITS; i++) {
-		ret = slab_create(&smalloc_slabs[i], slab_names[i],
-				  (SMALLOC_MIN_SIZE << i),
+	for (i = 0; i < SMALLOC_NR; i++) {
+		size_t size = smalloc_idx_to_size(i);
+
+		BUG_ON(smalloc_size_to_idx(size) != i);
+		if (size % 1024) {
+			snprintf(smalloc_names[i], sizeof(smalloc_names[i]),
+				 "smalloc (%ld B)", size);
+		} else {
+			snprintf(smalloc_names[i], sizeof(smalloc_names[i]),
+				 "smalloc (%ld KB)", size / 1024);
+		}
+
+		ret = slab_create(&smalloc_slabs[i], smalloc_names[i], size,
 				  SLAB_FLAG_FALSE_OKAY);
 		if (ret)
 			return ret;
@@ -136,9 +206,58 @@ int smalloc_init_thread(void)
 {
 	int i;
 
-	for (i = 0; i < SMALLOC_BITS; i++)
+	for (i = 0; i < SMALLOC_NR; i++)
 		tcache_init_perthread(smalloc_tcaches[i],
 				      &perthread_get(smalloc_pts[i]));
 
 	return 0;
 }
+
+static void smalloc_reclaim_worker(void *arg)
+{
+	LIST_HEAD(victims);
+	uint64_t period;
+	int i;
+
+	while (true) {
+		period = ACCESS_ONCE(page_reclaim_idle_us);
+		timer_sleep(period ? max(period / 2, SMALLOC_RECLAIM_MIN) :
+			    SMALLOC_RECLAIM_PERIOD);
+
+		/*
+		 * Only the smalloc caches are drained. Caches like stacks and
+		 * mbufs are refilled so often that draining them only adds
+		 * page faults. Freeing uses per-kthread state, so preemption is
+		 * disabled one cache at a time.
+		 */
+		for (i = 0; i < SMALLOC_NR; i++) {
+			preempt_disable();
+			tcache_reclaim(smalloc_tcaches[i]);
+			preempt_enable();
+		}
+
+		/* the page lists need the locks, but munmap() can be preempted */
+		preempt_disable();
+		page_reclaim_collect(&victims);
+		preempt_enable();
+		if (list_empty(&victims))
+			continue;
+		page_reclaim_unmap(&victims);
+		preempt_disable();
+		page_reclaim_finish(&victims);
+		preempt_enable();
+	}
+}
+
+/**
+ * smalloc_init_late - starts the memory reclaim thread
+ *
+ * The thread periodically drains the shared smalloc depots so that empty slab
+ * pages are freed, then unmaps large pages that have stayed idle.
+ *
+ * Returns 0 if successful.
+ */
+int smalloc_init_late(void)
+{
+	return thread_spawn_background(smalloc_reclaim_worker, NULL);
+}
@@ -22,6 +22,9 @@ static void softirq_fn(void *arg)
 	struct softirq_work *w = arg;
 	int i;
 
+	rtrace(RTRACE_SOFTIRQ_START, w->recv_cnt + w->compl_cnt + w->join_cnt,
+	       w->recv_cnt);
+
 	/* complete TX requests and free packets */
 	for (i = 0; i < w->compl_cnt; i++)
 		mbuf_free(w->compl_reqs[i]);
@@ -30,27 +33,64 @@ static void softirq_fn(void *arg)
 	net_rx_softirq(w->recv_reqs, w->recv_cnt);
 
 	/* handle any pending timeouts */
-	if (timer_needed(w->k))
+	if (w->k && timer_needed(w->k))
 		timer_softirq(w->k, w->timer_budget);
 
+	/* wake threads whose offloaded calls or file I/O finished */
+	if (w->k && offload_needed())
+		offload_softirq();
+	if (w->k && fileio_needed())
+		fileio_softirq();
+
 	/* join parked kthreads */
 	for (i = 0; i < w->join_cnt; i++)
 		join_kthread(w->join_reqs[i]);
+
+	rtrace(RTRACE_SOFTIRQ_END, 0, 0);
 }
 
-static void softirq_gather_work(struct softirq_work *w, struct kthread *k,
-				unsigned int budget)
+/*
+ * Adapts a kthread's budget after a batch of @nr events. The budget doubles
+ * while the RX queue still has a backlog after a full batch, since spawning
+ * softirq threads for small batches costs more under load. It halves while
+ * latency-critical threads wait in the runqueue, so they aren't held up for
+ * long. Otherwise, it drifts back toward RUNTIME_SOFTIRQ_BUDGET.
+ */
+static void softirq_adapt_budget(struct kthread *k, unsigned int nr)
+{
+	unsigned int budget = k->softirq_budget;
+
+	assert_ticket_lock_held(&k->lock);
+
+	if (ACCESS_ONCE(k->rq_head) != k->rq_tail || k->rq_overflow_len > 0 ||
+	    k->rq_edf_len > 0)
+		budget = max(budget / 2, SOFTIRQ_MIN_BUDGET);
+	else if (nr == budget && !lrpc_empty(&k->rxq))
+		budget = min(budget * 2, SOFTIRQ_MAX_BUDGET);
+	else if (budget > RUNTIME_SOFTIRQ_BUDGET && nr < budget / 2)
+		budget = max(budget / 2, RUNTIME_SOFTIRQ_BUDGET);
+	else if (budget < RUNTIME_SOFTIRQ_BUDGET)
+		budget = min(budget * 2, RUNTIME_SOFTIRQ_BUDGET);
+
+	k->softirq_budget = budget;
+}
+
+static void softirq_gather_work(struct softirq_work *w, struct kthread *k)
 {
 	unsigned int recv_cnt = 0, compl_cnt = 0, join_cnt = 0;
+	unsigned int budget = k->softirq_budget;
 	int budget_left;
 
-	budget_left = min(budget, SOFTIRQ_MAX_BUDGET);
-	while (budget_left--) {
+	assert_ticket_lock_held(&k->lock);
+
+	budget_left = budget;
+	while (budget_left) {
 		uint64_t cmd;
 		unsigned long payload;
 
 		if (!lrpc_recv(&k->rxq, &cmd, &payload))
 			break;
+		budget_left--;
 
 		switch (cmd) {
 		case RX_NET_RECV:
@@ -74,60 +114,196 @@ static void softirq_gather_work(struct softirq_work *w, struct kthread *k,
 		}
 	}
 
+	if (lrpc_empty(&k->rxq))
+		ACCESS_ONCE(k->rxq_empty_tsc) = rdtsc();
+
 	w->k = k;
 	w->recv_cnt = recv_cnt;
 	w->compl_cnt = compl_cnt;
 	w->join_cnt = join_cnt;
 	w->timer_budget = budget_left;
+
+	STAT(SOFTIRQ_BATCHES)++;
+	STAT(SOFTIRQ_EVENTS) += budget - budget_left;
+	STAT(SOFTIRQ_BUDGET) += budget;
+	softirq_adapt_budget(k, budget - budget_left);
+}
+
+/**
+ * softirq_delay - estimates how long @k's oldest softirq work has waited
+ * @k: the kthread to check
+ * @now: the current TSC
+ *
+ * RX queue entries don't carry a timestamp, so their age is measured from the
+ * last time the queue was seen empty. That overestimates it by at most the
+ * time between checks. Safe to call from a signal handler on @k.
+ *
+ * Returns the delay in cycles, or 0 if no softirq work is pending.
+ */
+uint64_t softirq_delay(struct kthread *k, uint64_t now)
+{
+	uint64_t delay = 0, empty_tsc, next_us, now_us;
+
+	if (lrpc_empty(&k->rxq)) {
+		ACCESS_ONCE(k->rxq_empty_tsc) = now;
+	} else {
+		empty_tsc = ACCESS_ONCE(k->rxq_empty_tsc);
+		if (now > empty_tsc)
+			delay = now - empty_tsc;
+	}
+
+	if (ACCESS_ONCE(k->timern) > 0) {
+		next_us = ACCESS_ONCE(k->timer_next_us);
+		now_us = (now - start_tsc) / cycles_per_us;
+		if (next_us < now_us)
+			delay = max(delay, (now_us - next_us) * cycles_per_us);
+	}
+
+	return delay;
+}
+
+/*
+ * Splits a large batch of ingress packets by RSS hash into several threads,
+ * so idle kthreads can steal them and process the batch in parallel. A flow's
+ * packets all land in the same thread, in order. Only @w handles timers,
+ * completions, and joins. The extra threads go to the local kthread's
+ * overflow queue, which the scheduler moves into its runqueue.
+ */
+static void softirq_split_work(struct softirq_work *w)
+{
+	struct softirq_work *units[SOFTIRQ_SPLIT_MAX];
+	thread_t *ths[SOFTIRQ_SPLIT_MAX];
+	struct kthread *l = myk();
+	unsigned int i, u, n, nr;
+
+	assert_ticket_lock_held(&l->lock);
+
+	n = min(w->recv_cnt / SOFTIRQ_SPLIT_MIN, SOFTIRQ_SPLIT_MAX);
+	if (n < 2)
+		return;
+
+	units[0] = w;
+	for (i = 1; i < n; i++) {
+		ths[i] = thread_create_with_buf(softirq_fn, (void **)&units[i],
+						sizeof(*units[i]));
+		if (unlikely(!ths[i]))
+			break;
+		units[i]->k = NULL;
+		units[i]->recv_cnt = 0;
+		units[i]->compl_cnt = 0;
+		units[i]->join_cnt = 0;
+		units[i]->timer_budget = 0;
+	}
+	n = i;
+	if (n < 2)
+		return;
+
+	/* a stable partition, so each flow keeps its order */
+	nr = w->recv_cnt;
+	w->recv_cnt = 0;
+	for (i = 0; i < nr; i++) {
+		u = w->recv_reqs[i]->rss_hash % n;
+		units[u]->recv_reqs[units[u]->recv_cnt++] = w->recv_reqs[i];
+	}
+
+	for (i = 1; i < n; i++) {
+		thread_set_runnable(ths[i]);
+		list_add_tail(&l->rq_overflow, &ths[i]->link);
+		l->rq_overflow_len++;
+	}
+	STAT(SOFTIRQS_SPLIT) += n - 1;
 }
 
 /**
  * softirq_run_thread - creates a closure for softirq handling
  * @k: the kthread from which to take RX queue commands
- * @budget: the maximum number of events to process
  *
- * Returns a thread that handles receive processing when executed or
- * NULL if no receive processing work is available.
+ * Processes up to @k's current budget of events. Large batches of ingress
+ * packets are split across several threads (see softirq_split_work()), so the
+ * local kthread's lock must be held too. Returns a thread that handles
+ * receive processing when executed or NULL if no receive processing work is
+ * available.
  */
-thread_t *softirq_run_thread(struct kthread *k, unsigned int budget)
+thread_t *softirq_run_thread(struct kthread *k)
 {
 	thread_t *th;
 	struct softirq_work *w;
 
-	assert_spin_lock_held(&k->lock);
+	assert_ticket_lock_held(&k->lock);
 
 	/* check if there's any work available */
-	if (lrpc_empty(&k->rxq) && !timer_needed(k))
+	if (lrpc_empty(&k->rxq) && !timer_needed(k) && !blocking_io_needed())
 		return NULL;
 
 	th = thread_create_with_buf(softirq_fn, (void **)&w, sizeof(*w));
 	if (unlikely(!th))
 		return NULL;
 
-	softirq_gather_work(w, k, budget);
-	th->state = THREAD_STATE_RUNNABLE;
+	softirq_gather_work(w, k);
+	softirq_split_work(w);
+	thread_set_runnable(th);
 	return th;
 }
 
+/**
+ * softirq_run_inline - handles a small batch of softirq work on the
+ * scheduler's stack
+ * @k: the local kthread, whose lock must be held
+ *
+ * Avoids creating a thread and switching to it when a few events arrive at an
+ * idle kthread. Larger batches are left to softirq_run_thread(), so they can
+ * be stolen or run alongside other threads. The lock is dropped while the
+ * events are handled, and the kthread appears busy to RCU meanwhile.
+ *
+ * Returns true if any work was handled, so the caller should recheck its
+ * runqueue.
+ */
+bool softirq_run_inline(struct kthread *k)
+{
+	struct softirq_work w;
+
+	assert_ticket_lock_held(&k->lock);
+	assert(k == myk());
+
+	/* check if there's any work available */
+	if (lrpc_empty(&k->rxq) && !timer_needed(k) && !blocking_io_needed())
+		return false;
+	if (lrpc_has_more_than(&k->rxq, SOFTIRQ_INLINE_MAX))
+		return false;
+
+	softirq_gather_work(&w, k);
+	ticket_unlock(&k->lock);
+
+	/* handlers may free RCU-protected objects, so leave quiescence */
+	store_release(&k->rcu_gen, k->rcu_gen + 1);
+	softirq_fn(&w);
+	store_release(&k->rcu_gen, k->rcu_gen + 1);
+
+	ticket_lock(&k->lock);
+	STAT(SOFTIRQS_INLINE)++;
+	return true;
+}
+
 /**
  * softirq_run - handles softirq processing in the current thread
- * @budget: the maximum number of events to process
+ *
+ * Processes up to the local kthread's current budget of events.
  */
-void softirq_run(unsigned int budget)
+void softirq_run(void)
 {
 	struct kthread *k;
 	struct softirq_work w;
 
 	k = getk();
 	/* check if there's any work available */
-	if (lrpc_empty(&k->rxq) && !timer_needed(k)) {
+	if (lrpc_empty(&k->rxq) && !timer_needed(k) && !blocking_io_needed()) {
 		putk();
 		return;
 	}
 
-	spin_lock(&k->lock);
-	softirq_gather_work(&w, k, budget);
-	spin_unlock(&k->lock);
+	ticket_lock(&k->lock);
+	softirq_gather_work(&w, k);
+	ticket_unlock(&k->lock);
 	putk();
 
 	softirq_fn(&w);
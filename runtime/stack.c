@@ -2,87 +2,171 @@
  * stack.c - allocates and manages per-thread stacks
  */
 
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include <base/stddef.h>
+#include <base/cpu.h>
 #include <base/lock.h>
+#include <base/mem.h>
 #include <base/page.h>
 #include <base/atomic.h>
+#include <base/hash.h>
 #include <base/limits.h>
 #include <base/log.h>
 
 #include "defs.h"
 
-#define STACK_BASE_ADDR	0x200000000000UL
+#define STACK_BASE_ADDR		0x200000000000UL
+#define SMALL_STACK_BASE_ADDR	0x300000000000UL
+#define HUGE_STACK_BASE_ADDR	0x400000000000UL
+#define HUGE_SMALL_STACK_BASE_ADDR 0x500000000000UL
 
-static struct tcache *stack_tcache;
+/* each NUMA node gets its own range of huge page stacks */
+#define HUGE_STACK_NODE_SHIFT	40
+BUILD_ASSERT(((uintptr_t)NNUMA << HUGE_STACK_NODE_SHIFT) <=
+	     HUGE_SMALL_STACK_BASE_ADDR - HUGE_STACK_BASE_ADDR);
+
+#ifndef MADV_FREE
+#define MADV_FREE		8
+#endif
+
+/*
+ * the number of free stacks in each class kept resident for reuse, beyond
+ * which freed stacks are lazily released with MADV_FREE (0 always releases
+ * them immediately with MADV_DONTNEED)
+ */
+unsigned int stack_reclaim_watermark;
+
+/*
+ * back stacks with 2MB pages local to the allocating kthread, relying on
+ * canaries instead of guard pages to detect overflows
+ */
+bool stack_hugepages;
+
+/* record how deep each thread's stack went, by entry function */
+bool stack_depth_enabled;
+/* exits lost because the site table was full */
+uint64_t stack_depth_dropped;
+
+struct stack_depth_slot {
+	/* the entry function shifted left one bit, ORed with the stack class */
+	uintptr_t	tag;
+	uint64_t	exits;
+	uint64_t	max;
+	uint64_t	hist[STACK_DEPTH_NR_BUCKETS];
+};
+
+static struct stack_depth_slot stack_depth_slots[STACK_DEPTH_NR_SITES];
+
+BUILD_ASSERT(is_power_of_two(STACK_DEPTH_NR_SITES));
+BUILD_ASSERT(RUNTIME_STACK_SIZE <= KB << (STACK_DEPTH_NR_BUCKETS - 1));
+
+/* per-NUMA node state of a huge page stack pool */
+struct stack_node {
+	spinlock_t	lock;
+	int		free_count;
+	struct stack	**free_stacks;
+	/* the unused part of the most recently mapped page */
+	uintptr_t	pos;
+	uintptr_t	end;
+} __aligned(CACHE_LINE_SIZE);
+
+struct stack_pool {
+	spinlock_t	lock;
+	int		free_count;
+	size_t		usable_size;
+	size_t		guard_size;
+	atomic64_t	pos;
+	struct tcache	*tc;
+	struct stack	*free_stacks[RUNTIME_MAX_THREADS +
+				     TCACHE_DEFAULT_MAG_SIZE];
+
+	/* used instead of the above if @stack_hugepages is set */
+	uintptr_t	huge_base;
+	struct stack_node nodes[NNUMA];
+};
+
+static struct stack_pool stack_pools[THREAD_STACK_NR_CLASSES];
 DEFINE_PERTHREAD(struct tcache_perthread, stack_pt);
+DEFINE_PERTHREAD(struct tcache_perthread, small_stack_pt);
 
-static struct stack *stack_create(void *base)
+static struct stack *stack_create(struct stack_pool *p, void *base)
 {
 	void *stack_addr;
-	struct stack *s;
+	size_t len = p->usable_size + p->guard_size;
 
-	stack_addr = mmap(base, sizeof(struct stack), PROT_READ | PROT_WRITE,
+	stack_addr = mmap(base, len, PROT_READ | PROT_WRITE,
 			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 	if (stack_addr == MAP_FAILED)
 		return NULL;
 
-	s = (struct stack *)stack_addr;
-	if (mprotect(s->guard, RUNTIME_GUARD_SIZE, PROT_NONE) == - 1) {
-		munmap(stack_addr, sizeof(struct stack));
+	if (mprotect((char *)stack_addr + p->usable_size, p->guard_size,
+		     PROT_NONE) == - 1) {
+		munmap(stack_addr, len);
 		return NULL;
 	}
 
-	return s;
+	return (struct stack *)stack_addr;
 }
 
 /* WARNING: the contents of the stack may be lost after reclaiming. */
-static void stack_reclaim(struct stack *s)
+static void stack_reclaim(struct stack_pool *p, struct stack *s, bool lazy)
 {
 	int ret;
-	ret = madvise(s->usable, RUNTIME_STACK_SIZE, MADV_DONTNEED);
+
+	/* MADV_FREE needs Linux 4.5, so fall back if it isn't supported */
+	if (lazy && madvise(s->usable, p->usable_size, MADV_FREE) == 0)
+		return;
+	ret = madvise(s->usable, p->usable_size, MADV_DONTNEED);
 	WARN_ON_ONCE(ret);
 }
 
-static DEFINE_SPINLOCK(stack_lock);
-static int free_stack_count;
-static struct stack *free_stacks[RUNTIME_MAX_THREADS];
-static atomic64_t stack_pos = ATOMIC_INIT(STACK_BASE_ADDR);
-
 static void stack_tcache_free(struct tcache *tc, int nr, void **items)
 {
-	int i;
+	struct stack_pool *p = (struct stack_pool *)tc->data;
+	int i, resident = 0;
+
+	/* leave the stacks resident if the pool is below the watermark */
+	if (stack_reclaim_watermark) {
+		resident = (int)stack_reclaim_watermark -
+			   ACCESS_ONCE(p->free_count);
+		resident = max(resident, 0);
+	}
 
 	/* try to release the backing memory first */
-	for (i = 0; i < nr; i++)
-		stack_reclaim((struct stack *)items[i]);
+	for (i = resident; i < nr; i++)
+		stack_reclaim(p, (struct stack *)items[i],
+			      stack_reclaim_watermark > 0);
 
 	/* then make the stacks available for reallocation */
-	spin_lock(&stack_lock);
+	spin_lock(&p->lock);
 	for (i = 0; i < nr; i++)
-		free_stacks[free_stack_count++] = items[i];
-	BUG_ON(free_stack_count >=
+		p->free_stacks[p->free_count++] = items[i];
+	BUG_ON(p->free_count >=
 	       RUNTIME_MAX_THREADS + TCACHE_DEFAULT_MAG_SIZE);
-	spin_unlock(&stack_lock);
+	spin_unlock(&p->lock);
 }
 
 static int stack_tcache_alloc(struct tcache *tc, int nr, void **items)
 {
+	struct stack_pool *p = (struct stack_pool *)tc->data;
 	void *base;
 	int i = 0;
 
-	spin_lock(&stack_lock);
-	while (free_stack_count && i < nr) {
-		items[i++] = free_stacks[--free_stack_count];
+	spin_lock(&p->lock);
+	while (p->free_count && i < nr) {
+		items[i++] = p->free_stacks[--p->free_count];
 	}
-	spin_unlock(&stack_lock);
+	spin_unlock(&p->lock);
 
 
 	for (; i < nr; i++) {
-		base = (void *)atomic64_fetch_and_and(&stack_pos,
-						      sizeof(struct stack));
-		items[i] = stack_create(base);
+		base = (void *)atomic64_fetch_and_add(&p->pos,
+				p->usable_size + p->guard_size);
+		items[i] = stack_create(p, base);
 		if (unlikely(!items[i]))
 			goto fail;
 	}
@@ -100,13 +184,264 @@ static const struct tcache_ops stack_tcache_ops = {
 	.free	= stack_tcache_free,
 };
 
+static void stack_depth_charge(uintptr_t tag, uint64_t depth)
+{
+	uint32_t idx = hash_crc32c_one(0, tag);
+	struct stack_depth_slot *slot;
+	uint64_t max;
+	int i, bucket;
+
+	bucket = depth < KB ? 0 : 64 - __builtin_clzll(depth / KB);
+	bucket = min(bucket, STACK_DEPTH_NR_BUCKETS - 1);
+
+	for (i = 0; i < STACK_DEPTH_NR_SITES; i++, idx++) {
+		slot = &stack_depth_slots[idx & (STACK_DEPTH_NR_SITES - 1)];
+		if (ACCESS_ONCE(slot->tag) != tag &&
+		    !__sync_bool_compare_and_swap(&slot->tag, 0, tag) &&
+		    ACCESS_ONCE(slot->tag) != tag)
+			continue;
+
+		__sync_fetch_and_add(&slot->exits, 1);
+		__sync_fetch_and_add(&slot->hist[bucket], 1);
+		do {
+			max = ACCESS_ONCE(slot->max);
+		} while (depth > max &&
+			 !__sync_bool_compare_and_swap(&slot->max, max, depth));
+		return;
+	}
+
+	__sync_fetch_and_add(&stack_depth_dropped, 1);
+}
+
+/**
+ * __stack_record_depth - records how deep an exiting thread's stack went
+ * @th: the thread, which must not be running
+ *
+ * Unused words are zero, though words the thread wrote zeros to at the very
+ * bottom of its use are missed. The used part is zeroed again afterwards.
+ */
+void __stack_record_depth(struct thread *th)
+{
+	struct stack *s = th->stack;
+	size_t top = stack_ptr_size(th->stack_class);
+	size_t i = stack_hugepages ? STACK_CANARY_WORDS : 0;
+
+	while (i < top && !s->usable[i])
+		i++;
+
+	stack_depth_charge((th->entry << 1) | th->stack_class,
+			   (top - i) * sizeof(uintptr_t));
+	memset(&s->usable[i], 0, (top - i) * sizeof(uintptr_t));
+}
+
+static int stack_depth_site_cmp(const void *a, const void *b)
+{
+	const struct stack_depth_site *sa = a, *sb = b;
+
+	if (sa->max == sb->max)
+		return 0;
+	return sa->max < sb->max ? 1 : -1;
+}
+
+/**
+ * stack_depth_snapshot - copies out the stack depths of each entry function
+ * @sites: an array to store the entry functions
+ * @capacity: the size of @sites
+ *
+ * Sites are sorted by their deepest stack, deepest first. If @capacity is
+ * STACK_DEPTH_NR_SITES in size, then all sites will fit.
+ *
+ * Returns the number of sites stored.
+ */
+int stack_depth_snapshot(struct stack_depth_site *sites, int capacity)
+{
+	struct stack_depth_site *all;
+	struct stack_depth_slot *slot;
+	uintptr_t tag;
+	int i, nr = 0;
+
+	all = malloc(sizeof(*all) * STACK_DEPTH_NR_SITES);
+	if (!all)
+		return -ENOMEM;
+
+	for (i = 0; i < STACK_DEPTH_NR_SITES; i++) {
+		slot = &stack_depth_slots[i];
+		tag = ACCESS_ONCE(slot->tag);
+
+		if (!tag)
+			continue;
+		all[nr].entry = tag >> 1;
+		all[nr].cls = tag & 1;
+		all[nr].exits = ACCESS_ONCE(slot->exits);
+		all[nr].max = ACCESS_ONCE(slot->max);
+		memcpy(all[nr].hist, slot->hist, sizeof(all[nr].hist));
+		nr++;
+	}
+
+	qsort(all, nr, sizeof(all[0]), stack_depth_site_cmp);
+	nr = min(nr, capacity);
+	memcpy(sites, all, sizeof(all[0]) * nr);
+	free(all);
+	return nr;
+}
+
+/**
+ * stack_depth_reset - discards the stack depths recorded so far
+ *
+ * Exits recorded concurrently with a reset may be partially lost.
+ */
+void stack_depth_reset(void)
+{
+	int i;
+
+	for (i = 0; i < STACK_DEPTH_NR_SITES; i++)
+		memset(&stack_depth_slots[i], 0, sizeof(stack_depth_slots[i]));
+	ACCESS_ONCE(stack_depth_dropped) = 0;
+}
+
+/**
+ * __stack_canary_failed - reports a corrupted stack canary
+ * @s: the stack that overflowed
+ */
+void __stack_canary_failed(struct stack *s)
+{
+	panic("stack: overflow detected on stack %p", s);
+}
+
+static int stack_local_node(void)
+{
+	int cpu = sched_getcpu();
+
+	if (unlikely(cpu < 0 || cpu >= cpu_count))
+		return 0;
+	return cpu_to_node(cpu);
+}
+
+static void stack_huge_free(struct tcache *tc, int nr, void **items)
+{
+	struct stack_pool *p = (struct stack_pool *)tc->data;
+	struct stack_node *n;
+	int i, node;
+
+	/* stacks stay resident, so they go back to the node they came from */
+	for (i = 0; i < nr; i++) {
+		node = ((uintptr_t)items[i] - p->huge_base) >>
+		       HUGE_STACK_NODE_SHIFT;
+		n = &p->nodes[node];
+
+		spin_lock(&n->lock);
+		n->free_stacks[n->free_count++] = items[i];
+		BUG_ON(n->free_count >=
+		       RUNTIME_MAX_THREADS + TCACHE_DEFAULT_MAG_SIZE);
+		spin_unlock(&n->lock);
+	}
+}
+
+static int stack_huge_alloc(struct tcache *tc, int nr, void **items)
+{
+	struct stack_pool *p = (struct stack_pool *)tc->data;
+	int i = 0, node = stack_local_node();
+	struct stack_node *n = &p->nodes[node];
+	struct stack *st;
+	void *addr;
+
+	spin_lock(&n->lock);
+	while (n->free_count && i < nr)
+		items[i++] = n->free_stacks[--n->free_count];
+
+	for (; i < nr; i++) {
+		if (n->pos == n->end) {
+			addr = mem_map_anom_fallback((void *)n->end,
+						     PGSIZE_2MB, PGSIZE_2MB,
+						     PGSIZE_4KB, node, NULL);
+			if (unlikely(addr == MAP_FAILED))
+				goto fail;
+			n->end += PGSIZE_2MB;
+		}
+
+		st = (struct stack *)n->pos;
+		n->pos += p->usable_size;
+		stack_set_canary(st);
+		items[i] = st;
+	}
+	spin_unlock(&n->lock);
+
+	return 0;
+
+fail:
+	spin_unlock(&n->lock);
+	log_err_ratelimited("stack: failed to allocate huge page stack memory");
+	stack_huge_free(tc, i, items);
+	return -ENOMEM;
+}
+
+static const struct tcache_ops stack_huge_tcache_ops = {
+	.alloc	= stack_huge_alloc,
+	.free	= stack_huge_free,
+};
+
 /**
  * stack_init_thread - intializes per-thread state
  * Returns 0 (always successful).
  */
 int stack_init_thread(void)
 {
-	tcache_init_perthread(stack_tcache, &perthread_get(stack_pt));
+	tcache_init_perthread(stack_pools[THREAD_STACK_DEFAULT].tc,
+			      &perthread_get(stack_pt));
+	tcache_init_perthread(stack_pools[THREAD_STACK_SMALL].tc,
+			      &perthread_get(small_stack_pt));
+	return 0;
+}
+
+static int stack_pool_init_huge(struct stack_pool *p, uintptr_t huge_base)
+{
+	struct stack_node *n;
+	int i;
+
+	BUILD_ASSERT(PGSIZE_2MB % RUNTIME_STACK_SIZE == 0);
+	BUILD_ASSERT(PGSIZE_2MB % RUNTIME_SMALL_STACK_SIZE == 0);
+
+	p->huge_base = huge_base;
+	for (i = 0; i < numa_count; i++) {
+		n = &p->nodes[i];
+		spin_lock_init(&n->lock);
+		n->free_count = 0;
+		n->free_stacks = calloc(RUNTIME_MAX_THREADS +
+					TCACHE_DEFAULT_MAG_SIZE,
+					sizeof(*n->free_stacks));
+		if (!n->free_stacks)
+			return -ENOMEM;
+		n->pos = n->end = huge_base +
+				  ((uintptr_t)i << HUGE_STACK_NODE_SHIFT);
+	}
+
+	return 0;
+}
+
+static int stack_pool_init(struct stack_pool *p, const char *name,
+			   uintptr_t base, uintptr_t huge_base,
+			   size_t usable_size, size_t guard_size)
+{
+	int ret;
+
+	spin_lock_init(&p->lock);
+	p->free_count = 0;
+	p->usable_size = usable_size;
+	p->guard_size = guard_size;
+	atomic64_write(&p->pos, base);
+
+	if (stack_hugepages) {
+		ret = stack_pool_init_huge(p, huge_base);
+		if (ret)
+			return ret;
+	}
+
+	p->tc = tcache_create(name, stack_hugepages ? &stack_huge_tcache_ops :
+			      &stack_tcache_ops, TCACHE_DEFAULT_MAG_SIZE,
+			      usable_size);
+	if (!p->tc)
+		return -ENOMEM;
+	p->tc->data = (unsigned long)p;
 	return 0;
 }
 
@@ -116,10 +451,22 @@ int stack_init_thread(void)
  */
 int stack_init(void)
 {
-	stack_tcache = tcache_create("runtime_stacks", &stack_tcache_ops,
-				     TCACHE_DEFAULT_MAG_SIZE,
-				     RUNTIME_STACK_SIZE);
-	if (!stack_tcache)
-		return -ENOMEM;
-	return 0;
+	int ret;
+
+	if (stack_hugepages)
+		log_info("stack: using huge pages with canaries instead of "
+			 "guard pages");
+
+	ret = stack_pool_init(&stack_pools[THREAD_STACK_DEFAULT],
+			      "runtime_stacks", STACK_BASE_ADDR,
+			      HUGE_STACK_BASE_ADDR, RUNTIME_STACK_SIZE,
+			      RUNTIME_GUARD_SIZE);
+	if (ret)
+		return ret;
+
+	return stack_pool_init(&stack_pools[THREAD_STACK_SMALL],
+			       "runtime_small_stacks", SMALL_STACK_BASE_ADDR,
+			       HUGE_SMALL_STACK_BASE_ADDR,
+			       RUNTIME_SMALL_STACK_SIZE,
+			       RUNTIME_SMALL_GUARD_SIZE);
 }
@@ -2,19 +2,38 @@
  * stat.c - support for statistics and counters
  */
 
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <base/stddef.h>
+#include <base/allocprof.h>
+#include <base/lockprof.h>
 #include <base/log.h>
 #include <base/time.h>
+#include <runtime/counter.h>
+#include <runtime/stat.h>
+#include <runtime/tcp.h>
 #include <runtime/thread.h>
+#include <runtime/timer.h>
 #include <runtime/udp.h>
 
 #include "defs.h"
 
 /* port 40 is permanently reserved, so should be fine for now */
 #define STAT_PORT	40
+/* the default and the most connections reported by the "tcp" command */
+#define STAT_TCP_TOP_DEFAULT	16
+#define STAT_TCP_TOP_MAX	64
+/* how often the shared-memory stats page is rewritten */
+#define STAT_PAGE_PERIOD_US	(100 * ONE_MS)
+
+/* publish counters in a shared-memory page (the runtime_stat_page option) */
+bool stat_page_enabled;
 
 static const char *stat_names[] = {
 	/* scheduler counters */
@@ -22,12 +41,44 @@ static const char *stat_names[] = {
 	"sched_cycles",
 	"program_cycles",
 	"threads_stolen",
+	"steal_attempts",
+	"bg_threads_stolen",
+	"edf_threads_stolen",
+	"edf_expired",
+	"direct_switches",
 	"softirqs_stolen",
 	"softirqs_local",
+	"softirqs_inline",
+	"softirqs_split",
 	"parks",
+	"park_spin_hits",
+	"park_spin_misses",
+	"timer_polls",
+	"timer_spins",
+	"kthread_limit_raises",
+	"spinks_raises",
+	"spinks_cuts",
+	"flow_steers",
+	"flow_adopts",
 	"preemptions",
 	"preemptions_stolen",
+	"preemptions_quantum",
+	"preemptions_polled",
+	"preemptions_starved",
 	"core_migrations",
+	"steals_core",
+	"steals_llc",
+	"steals_socket",
+	"steals_remote",
+	"softirq_batches",
+	"softirq_events",
+	"softirq_budget",
+	"watchdog_runs",
+	"softirq_starved",
+	"offload_calls",
+	"fileio_requests",
+	"overload_admits",
+	"overload_rejects",
 
 	/* network stack counters */
 	"rx_bytes",
@@ -38,34 +89,101 @@ static const char *stat_names[] = {
 	"rx_tcp_in_order",
 	"rx_tcp_out_of_order",
 	"rx_tcp_text_cycles",
+	"rx_gro_merged",
+	"rx_queue_cycles",
+	"rx_udp_inq_drops",
+	"rx_priority_packets",
+	"arp_pending_drops",
+	"ndisc_pending_drops",
+	"rx_l4_csum_errors",
+	"tcp_syncookies_sent",
+	"tcp_syncookies_ok",
+	"tcp_rx_bytes",
+	"tcp_tx_acks",
+	"tcp_time_wait_reused",
+	"net_busy_poll_hits",
+	"net_busy_poll_misses",
 };
 
 /* must correspond exactly to STAT_* enum definitions in defs.h */
 BUILD_ASSERT(ARRAY_SIZE(stat_names) == STAT_NR);
 
+/* must correspond to the buckets of trans_table_hist() */
+static const char *trans_hist_names[] = {
+	"trans_chain_0",
+	"trans_chain_1",
+	"trans_chain_2",
+	"trans_chain_3",
+	"trans_chain_4_7",
+	"trans_chain_8_up",
+};
+
+BUILD_ASSERT(ARRAY_SIZE(trans_hist_names) == TRANS_HIST_NR);
+
+/* the application's counters, placed in this section by the linker */
+extern const struct stat_counter __start_stat_counters[] __weak;
+extern const struct stat_counter __stop_stat_counters[] __weak;
+
+/* the exported counters: the runtime's, then up to STAT_COUNTERS_MAX more */
+#define STAT_MAX	(STAT_NR + STAT_COUNTERS_MAX)
+static int stat_nr;
+
+/**
+ * stat_counter_read - returns the total of a counter across kthreads
+ * @c: the counter
+ */
+uint64_t stat_counter_read(const struct stat_counter *c)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for_each_thread(i) {
+		sum += ACCESS_ONCE(*(uint64_t *)((uintptr_t)c->key +
+				   (uintptr_t)perthread_offsets[i]));
+	}
+
+	return sum;
+}
+
+static const char *stat_name(int j)
+{
+	if (j < STAT_NR)
+		return stat_names[j];
+	return __start_stat_counters[j - STAT_NR].name;
+}
+
 static int append_stat(char *pos, size_t len, const char *name, uint64_t val)
 {
 	return snprintf(pos, len, "%s:%ld,", name, val);
 }
 
-static ssize_t stat_write_buf(char *buf, size_t len)
+/* sums the counters of every kthread, stores @stat_nr of them */
+static void stat_gather(uint64_t *stats)
 {
-	uint64_t stats[STAT_NR];
-	char *pos = buf, *end = buf + len;
-	int i, j, ret;
-
-	memset(stats, 0, sizeof(stats));
+	int i, j;
 
-	/* gather stats from each kthread */
-	/* FIXME: not correct when parked kthreads removed from @ks */
+	memset(stats, 0, sizeof(*stats) * STAT_NR);
 	for (i = 0; i < maxks; i++) {
 		for (j = 0; j < STAT_NR; j++)
-			stats[j] += allks[i]->stats[j];
+			stats[j] += ACCESS_ONCE(allks[i]->stats[j]);
+	}
+	for (j = STAT_NR; j < stat_nr; j++) {
+		stats[j] =
+			stat_counter_read(&__start_stat_counters[j - STAT_NR]);
 	}
+}
+
+static ssize_t stat_write_buf(char *buf, size_t len)
+{
+	uint64_t stats[STAT_MAX];
+	char *pos = buf, *end = buf + len;
+	int j, ret;
+
+	stat_gather(stats);
 
 	/* write out the stats to the buffer */
-	for (j = 0; j < STAT_NR; j++) {
-		ret = append_stat(pos, end - pos, stat_names[j], stats[j]);
+	for (j = 0; j < stat_nr; j++) {
+		ret = append_stat(pos, end - pos, stat_name(j), stats[j]);
 		if (ret < 0) {
 			return -EINVAL;
 		} else if (ret >= end - pos) {
@@ -88,11 +206,714 @@ static ssize_t stat_write_buf(char *buf, size_t len)
 	return pos - buf;
 }
 
+/*
+ * Writes the allocation profile as a list of
+ * "<kind>:<call site or cache>:<samples>:<bytes>" entries, most frequent
+ * first, stopping when the buffer is full. Call sites are code addresses to be
+ * resolved against the binary (e.g. with addr2line).
+ */
+static ssize_t stat_write_allocprof(char *buf, size_t len)
+{
+	struct allocprof_site sites[ALLOCPROF_NR_SITES];
+	char *pos = buf, *end = buf + len;
+	int i, nr, ret;
+
+	ret = append_stat(pos, end - pos, "allocprof_rate", allocprof_rate);
+	if (ret < 0 || ret >= end - pos)
+		return -EINVAL;
+	pos += ret;
+
+	ret = append_stat(pos, end - pos, "allocprof_dropped",
+			  allocprof_dropped);
+	if (ret < 0 || ret >= end - pos)
+		return -EINVAL;
+	pos += ret;
+
+	nr = allocprof_snapshot(sites, ALLOCPROF_NR_SITES);
+	for (i = 0; i < nr; i++) {
+		struct allocprof_site *site = &sites[i];
+		const char *kind = allocprof_kind_name(site->kind);
+
+		/* tcaches are identified by name, call sites by address */
+		if (site->kind == ALLOCPROF_TCACHE && site->name) {
+			ret = snprintf(pos, end - pos, "%s:%s:%ld:%ld,", kind,
+				       site->name, site->samples, site->bytes);
+		} else {
+			ret = snprintf(pos, end - pos, "%s:%p:%ld:%ld,", kind,
+				       site->key, site->samples, site->bytes);
+		}
+		if (ret < 0)
+			return -EINVAL;
+		if (ret >= end - pos)
+			break;
+
+		pos += ret;
+	}
+
+	pos[-1] = '\0'; /* clip off last ',' */
+	return pos - buf;
+}
+
+/*
+ * Handles "allocprof [<rate>|reset]". A rate of 0 disables sampling.
+ */
+static ssize_t stat_handle_allocprof(char *buf, ssize_t len)
+{
+	const char *arg;
+	long rate;
+
+	buf[min(len, (ssize_t)UDP_MAX_PAYLOAD - 1)] = '\0';
+	arg = buf + strlen("allocprof");
+	while (*arg == ' ')
+		arg++;
+
+	if (strncmp(arg, "reset", strlen("reset")) == 0) {
+		allocprof_reset();
+	} else if (*arg) {
+		rate = strtol(arg, NULL, 10);
+		if (rate >= 0 && rate <= UINT_MAX)
+			allocprof_set_rate(rate);
+	}
+
+	return stat_write_allocprof(buf, UDP_MAX_PAYLOAD);
+}
+
+/*
+ * Writes the lock profile as a list of
+ * "<kind>:<call site>:<acquires>:<contended>:<wait cycles>:<hold cycles>"
+ * entries, most waited on first, stopping when the buffer is full. Call sites
+ * are code addresses to be resolved against the binary (e.g. with addr2line).
+ */
+static ssize_t stat_write_lockprof(char *buf, size_t len)
+{
+	struct lockprof_site sites[LOCKPROF_NR_SITES];
+	char *pos = buf, *end = buf + len;
+	int i, nr, ret;
+
+	ret = append_stat(pos, end - pos, "lockprof_enabled",
+			  lockprof_enabled());
+	if (ret < 0 || ret >= end - pos)
+		return -EINVAL;
+	pos += ret;
+
+	ret = append_stat(pos, end - pos, "lockprof_dropped",
+			  lockprof_dropped);
+	if (ret < 0 || ret >= end - pos)
+		return -EINVAL;
+	pos += ret;
+
+	nr = lockprof_snapshot(sites, LOCKPROF_NR_SITES);
+	for (i = 0; i < nr; i++) {
+		struct lockprof_site *site = &sites[i];
+
+		ret = snprintf(pos, end - pos, "%s:%p:%ld:%ld:%ld:%ld,",
+			       lockprof_kind_name(site->kind), site->site,
+			       site->acquires, site->contended,
+			       site->wait_cycles, site->hold_cycles);
+		if (ret < 0)
+			return -EINVAL;
+		if (ret >= end - pos)
+			break;
+
+		pos += ret;
+	}
+
+	pos[-1] = '\0'; /* clip off last ',' */
+	return pos - buf;
+}
+
+/*
+ * Handles "lockprof [on|off|reset]".
+ */
+static ssize_t stat_handle_lockprof(char *buf, ssize_t len)
+{
+	const char *arg;
+
+	buf[min(len, (ssize_t)UDP_MAX_PAYLOAD - 1)] = '\0';
+	arg = buf + strlen("lockprof");
+	while (*arg == ' ')
+		arg++;
+
+	if (strncmp(arg, "on", strlen("on")) == 0)
+		lockprof_enable(true);
+	else if (strncmp(arg, "off", strlen("off")) == 0)
+		lockprof_enable(false);
+	else if (strncmp(arg, "reset", strlen("reset")) == 0)
+		lockprof_reset();
+
+	return stat_write_lockprof(buf, UDP_MAX_PAYLOAD);
+}
+
+/*
+ * Handles "trans". Reports the transport table's size and the distribution of
+ * its chain lengths. Every bucket is walked, so this is kept out of "stat".
+ */
+static ssize_t stat_handle_trans(char *buf, size_t len)
+{
+	uint64_t hist[TRANS_HIST_NR];
+	char *pos = buf, *end = buf + len;
+	int i, ret;
+
+	ret = append_stat(pos, end - pos, "trans_buckets",
+			  trans_table_hist(hist));
+	if (ret < 0 || ret >= end - pos)
+		return -EINVAL;
+	pos += ret;
+
+	for (i = 0; i < TRANS_HIST_NR; i++) {
+		ret = append_stat(pos, end - pos, trans_hist_names[i], hist[i]);
+		if (ret < 0 || ret >= end - pos)
+			return -EINVAL;
+		pos += ret;
+	}
+
+	pos[-1] = '\0'; /* clip off last ',' */
+	return pos - buf;
+}
+
+/*
+ * Handles "stackdepth [reset]". Replies with a list of
+ * "<entry>:<small|default>:<exits>:<max bytes>:<histogram>" entries, deepest first,
+ * where the histogram counts exits by log2 KB of stack used (<1KB, <2KB, ...)
+ * separated by '/'. Entries are the code addresses of the functions threads
+ * were created with.
+ */
+static ssize_t stat_handle_stackdepth(char *buf, ssize_t len)
+{
+	struct stack_depth_site *sites;
+	char *pos = buf, *end = buf + UDP_MAX_PAYLOAD;
+	const char *arg;
+	int i, j, nr, ret;
+
+	buf[min(len, (ssize_t)UDP_MAX_PAYLOAD - 1)] = '\0';
+	arg = buf + strlen("stackdepth");
+	while (*arg == ' ')
+		arg++;
+	if (strncmp(arg, "reset", strlen("reset")) == 0)
+		stack_depth_reset();
+
+	ret = append_stat(pos, end - pos, "stack_depth_enabled",
+			  stack_depth_enabled);
+	if (ret < 0 || ret >= end - pos)
+		return -EINVAL;
+	pos += ret;
+
+	ret = append_stat(pos, end - pos, "stack_depth_dropped",
+			  ACCESS_ONCE(stack_depth_dropped));
+	if (ret < 0 || ret >= end - pos)
+		return -EINVAL;
+	pos += ret;
+
+	sites = malloc(sizeof(*sites) * STACK_DEPTH_NR_SITES);
+	if (!sites)
+		return -ENOMEM;
+	nr = stack_depth_snapshot(sites, STACK_DEPTH_NR_SITES);
+	if (nr < 0) {
+		free(sites);
+		return nr;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct stack_depth_site *site = &sites[i];
+		char hist[STACK_DEPTH_NR_BUCKETS * 21];
+		char *hpos = hist;
+
+		for (j = 0; j < STACK_DEPTH_NR_BUCKETS; j++)
+			hpos += sprintf(hpos, "%s%ld", j ? "/" : "",
+					site->hist[j]);
+
+		ret = snprintf(pos, end - pos, "%p:%s:%ld:%ld:%s,",
+			       (void *)site->entry,
+			       site->cls == THREAD_STACK_SMALL ? "small" :
+			       "default", site->exits, site->max, hist);
+		if (ret < 0) {
+			free(sites);
+			return -EINVAL;
+		}
+		if (ret >= end - pos)
+			break;
+
+		pos += ret;
+	}
+	free(sites);
+
+	pos[-1] = '\0'; /* clip off last ',' */
+	return pos - buf;
+}
+
+/* formats an address as "ip:port", with brackets around IPv6 addresses */
+static void stat_addr_to_str(const struct netaddr *a, char *str, size_t len)
+{
+	char ip[NETADDR_IP_STR_LEN];
+
+	netaddr_ip_to_str(a, ip);
+	if (a->family == NET_AF_INET6)
+		snprintf(str, len, "[%s]:%u", ip, a->port);
+	else
+		snprintf(str, len, "%s:%u", ip, a->port);
+}
+
+/*
+ * Handles "tcp [retrans|queue] [<n>]". Writes the top connections, ranked by
+ * retransmits (the default) or by bytes queued, as a list of
+ * "<local>-<remote>:<state>:<srtt>:<rttvar>:<retransmits>:<cwnd>:<snd_wnd>:
+ * <in_flight>:<rx_queued>:<tx_queued>" entries, highest first.
+ */
+static ssize_t stat_handle_tcp(char *buf, ssize_t len)
+{
+	struct tcp_conn_info infos[STAT_TCP_TOP_MAX];
+	char laddr[NETADDR_IP_STR_LEN + 8], raddr[NETADDR_IP_STR_LEN + 8];
+	char *pos = buf, *end = buf + UDP_MAX_PAYLOAD;
+	int key = TCP_TOP_RETRANSMITS;
+	long n = STAT_TCP_TOP_DEFAULT;
+	const char *arg;
+	int i, nr, ret;
+
+	buf[min(len, (ssize_t)UDP_MAX_PAYLOAD - 1)] = '\0';
+	arg = buf + strlen("tcp");
+	while (*arg == ' ')
+		arg++;
+
+	if (strncmp(arg, "queue", strlen("queue")) == 0) {
+		key = TCP_TOP_QUEUED;
+		arg += strlen("queue");
+	} else if (strncmp(arg, "retrans", strlen("retrans")) == 0) {
+		arg += strlen("retrans");
+	}
+	while (*arg == ' ')
+		arg++;
+	if (*arg)
+		n = min(max(strtol(arg, NULL, 10), 1L),
+			(long)STAT_TCP_TOP_MAX);
+
+	nr = tcp_top_conns(infos, n, key);
+	ret = append_stat(pos, end - pos, "tcp_conns", nr);
+	if (ret < 0 || ret >= end - pos)
+		return -EINVAL;
+	pos += ret;
+
+	for (i = 0; i < nr; i++) {
+		struct tcp_conn_info *info = &infos[i];
+
+		stat_addr_to_str(&info->laddr, laddr, sizeof(laddr));
+		stat_addr_to_str(&info->raddr, raddr, sizeof(raddr));
+		ret = snprintf(pos, end - pos,
+			       "%s-%s:%s:%u:%u:%u:%u:%u:%u:%u:%u,",
+			       laddr, raddr, tcp_state_name(info->state),
+			       info->srtt, info->rttvar, info->retransmits,
+			       info->cwnd, info->snd_wnd, info->in_flight,
+			       info->rx_queued, info->tx_queued);
+		if (ret < 0)
+			return -EINVAL;
+		if (ret >= end - pos)
+			break;
+
+		pos += ret;
+	}
+
+	pos[-1] = '\0'; /* clip off last ',' */
+	return pos - buf;
+}
+
+/*
+ * Handles "sched [lat|run|softirq|timer] [<kthread>]". Writes the histogram of
+ * scheduling latencies (runnable until running, the default), of run lengths,
+ * of how long softirqs had waited when the watchdog ran, or of how late timers
+ * ran after their deadlines, summed over every kthread unless one is given. The first entry names the histogram
+ * and the kthread (or -1), then "<ns>:<count>" entries follow for non-empty
+ * buckets, each starting at <ns>.
+ */
+static ssize_t stat_handle_sched(char *buf, ssize_t len)
+{
+	uint64_t hist[SCHED_HIST_NR], *src;
+	char *pos = buf, *end = buf + UDP_MAX_PAYLOAD;
+	size_t off = offsetof(struct kthread, lat_hist);
+	const char *name = "sched_lat";
+	long kidx = -1;
+	const char *arg;
+	int i, j, ret;
+
+	buf[min(len, (ssize_t)UDP_MAX_PAYLOAD - 1)] = '\0';
+	arg = buf + strlen("sched");
+	while (*arg == ' ')
+		arg++;
+
+	if (strncmp(arg, "run", strlen("run")) == 0) {
+		name = "sched_run";
+		off = offsetof(struct kthread, run_hist);
+		arg += strlen("run");
+	} else if (strncmp(arg, "softirq", strlen("softirq")) == 0) {
+		name = "sched_softirq";
+		off = offsetof(struct kthread, softirq_hist);
+		arg += strlen("softirq");
+	} else if (strncmp(arg, "timer", strlen("timer")) == 0) {
+		name = "sched_timer";
+		off = offsetof(struct kthread, timer_hist);
+		arg += strlen("timer");
+	} else if (strncmp(arg, "lat", strlen("lat")) == 0) {
+		arg += strlen("lat");
+	}
+	while (*arg == ' ')
+		arg++;
+	if (*arg) {
+		kidx = strtol(arg, NULL, 10);
+		if (kidx < 0 || kidx >= maxks)
+			return -EINVAL;
+	}
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < maxks; i++) {
+		if (kidx >= 0 && i != kidx)
+			continue;
+		src = (uint64_t *)((char *)allks[i] + off);
+		for (j = 0; j < SCHED_HIST_NR; j++)
+			hist[j] += ACCESS_ONCE(src[j]);
+	}
+
+	ret = append_stat(pos, end - pos, name, kidx);
+	if (ret < 0 || ret >= end - pos)
+		return -EINVAL;
+	pos += ret;
+
+	for (j = 0; j < SCHED_HIST_NR; j++) {
+		if (!hist[j])
+			continue;
+		ret = snprintf(pos, end - pos, "%lu:%lu,",
+			       sched_hist_lower(j) * 1000 / cycles_per_us,
+			       hist[j]);
+		if (ret < 0)
+			return -EINVAL;
+		if (ret >= end - pos)
+			break;
+
+		pos += ret;
+	}
+
+	pos[-1] = '\0'; /* clip off last ',' */
+	return pos - buf;
+}
+
+/* appends @v as a zigzag LEB128 varint, returns the bytes used or 0 if full */
+static size_t stat_put_varint(char *pos, char *end, int64_t v)
+{
+	uint64_t u = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+	char *start = pos;
+
+	do {
+		if (pos == end)
+			return 0;
+		*pos++ = (u & 0x7f) | (u >= 0x80 ? 0x80 : 0);
+		u >>= 7;
+	} while (u);
+
+	return pos - start;
+}
+
+/* writes every counter name, each NUL-terminated, returns the bytes used */
+static ssize_t stat_write_names(char *buf, size_t len)
+{
+	char *pos = buf, *end = buf + len;
+	size_t n;
+	int j;
+
+	for (j = 0; j < stat_nr; j++) {
+		n = strlen(stat_name(j)) + 1;
+		if (n > end - pos)
+			return -E2BIG;
+		memcpy(pos, stat_name(j), n);
+		pos += n;
+	}
+
+	return pos - buf;
+}
+
+/*
+ * Handles "bstat [<base_seq>|names]" (see struct stat_msg_hdr). Only the last
+ * snapshot sent is kept, so deltas are only sent to the requester that
+ * fetched it. Anyone else gets the counters in full.
+ */
+static ssize_t stat_handle_bstat(char *buf, ssize_t len)
+{
+	static uint64_t last_stats[STAT_MAX];
+	static uint32_t last_seq;
+	uint64_t stats[STAT_MAX];
+	struct stat_msg_hdr *hdr = (struct stat_msg_hdr *)buf;
+	char *pos, *end = buf + UDP_MAX_PAYLOAD;
+	bool delta = false;
+	const char *arg;
+	size_t ret;
+	int j;
+
+	buf[min(len, (ssize_t)UDP_MAX_PAYLOAD - 1)] = '\0';
+	arg = buf + strlen("bstat");
+	while (*arg == ' ')
+		arg++;
+
+	if (strncmp(arg, "names", strlen("names")) == 0)
+		return stat_write_names(buf, UDP_MAX_PAYLOAD);
+	if (*arg && last_seq != 0)
+		delta = strtoul(arg, NULL, 10) == last_seq;
+
+	stat_gather(stats);
+	hdr->magic = STAT_FMT_MAGIC;
+	hdr->version = STAT_FMT_VERSION;
+	hdr->flags = delta ? STAT_MSG_DELTA : 0;
+	hdr->base_seq = delta ? last_seq : 0;
+	hdr->seq = ++last_seq;
+	hdr->nr_stats = stat_nr;
+	hdr->pad = 0;
+	hdr->cycles_per_us = cycles_per_us;
+
+	pos = buf + sizeof(*hdr);
+	for (j = 0; j < stat_nr; j++) {
+		ret = stat_put_varint(pos, end, delta ?
+				      (int64_t)(stats[j] - last_stats[j]) :
+				      (int64_t)stats[j]);
+		if (!ret)
+			return -E2BIG;
+		pos += ret;
+	}
+
+	memcpy(last_stats, stats, sizeof(*stats) * stat_nr);
+	return pos - buf;
+}
+
+/*
+ * Handles "kstat <kthread>" (see struct stat_kthread_hdr), so per-kthread rates
+ * can be computed without a counter per kthread in the "stat" reply.
+ */
+static ssize_t stat_handle_kstat(char *buf, ssize_t len)
+{
+	struct stat_msg_hdr *hdr = (struct stat_msg_hdr *)buf;
+	struct stat_kthread_hdr *khdr;
+	char *pos, *end = buf + UDP_MAX_PAYLOAD;
+	struct kthread *k;
+	const char *arg;
+	long kidx;
+	size_t ret;
+	int j;
+
+	buf[min(len, (ssize_t)UDP_MAX_PAYLOAD - 1)] = '\0';
+	arg = buf + strlen("kstat");
+	kidx = strtol(arg, NULL, 10);
+	if (kidx < 0 || kidx >= maxks)
+		return -EINVAL;
+	k = allks[kidx];
+
+	hdr->magic = STAT_FMT_MAGIC;
+	hdr->version = STAT_FMT_VERSION;
+	hdr->flags = STAT_MSG_KTHREAD;
+	hdr->seq = 0;
+	hdr->base_seq = 0;
+	hdr->nr_stats = STAT_NR;
+	hdr->pad = 0;
+	hdr->cycles_per_us = cycles_per_us;
+
+	khdr = (struct stat_kthread_hdr *)(buf + sizeof(*hdr));
+	khdr->idx = kidx;
+	khdr->nr_kthreads = maxks;
+	/* unlocked, so only a hint if the kthread is parking or waking */
+	khdr->core = k->parked ? -1 : (int32_t)ACCESS_ONCE(k->curr_cpu);
+
+	pos = buf + sizeof(*hdr) + sizeof(*khdr);
+	for (j = 0; j < STAT_NR; j++) {
+		ret = stat_put_varint(pos, end,
+				      (int64_t)ACCESS_ONCE(k->stats[j]));
+		if (!ret)
+			return -E2BIG;
+		pos += ret;
+	}
+
+	return pos - buf;
+}
+
+static struct stat_page *stat_page;
+
+static void stat_page_unlink(void)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), STAT_PAGE_PATH, getpid());
+	unlink(path);
+}
+
+/* creates the shared-memory stats page, returns 0 if successful */
+static int stat_page_create(void)
+{
+	struct stat_page *p;
+	size_t len, names_len;
+	char path[64];
+	ssize_t ret;
+	int fd, j;
+
+	names_len = 0;
+	for (j = 0; j < stat_nr; j++)
+		names_len += strlen(stat_name(j)) + 1;
+	len = align_up(sizeof(*p), sizeof(uint64_t)) +
+	      align_up(names_len, sizeof(uint64_t)) +
+	      sizeof(uint64_t) * stat_nr;
+	len = align_up(len, PGSIZE_4KB);
+
+	snprintf(path, sizeof(path), STAT_PAGE_PATH, getpid());
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+	if (ftruncate(fd, len)) {
+		ret = -errno;
+		close(fd);
+		unlink(path);
+		return ret;
+	}
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		unlink(path);
+		return -ENOMEM;
+	}
+
+	p->version = STAT_FMT_VERSION;
+	p->nr_stats = stat_nr;
+	p->names_off = align_up(sizeof(*p), sizeof(uint64_t));
+	p->values_off = p->names_off + align_up(names_len, sizeof(uint64_t));
+	p->seq = 0;
+	p->cycles_per_us = cycles_per_us;
+	p->period_us = STAT_PAGE_PERIOD_US;
+	ret = stat_write_names((char *)p + p->names_off, names_len);
+	BUG_ON(ret != names_len);
+	/* readers check the magic last */
+	store_release(&p->magic, STAT_FMT_MAGIC);
+
+	atexit(stat_page_unlink);
+	stat_page = p;
+	return 0;
+}
+
+static void stat_page_worker(void *arg)
+{
+	uint64_t stats[STAT_MAX], *values;
+
+	values = (uint64_t *)((char *)stat_page + stat_page->values_off);
+	while (true) {
+		stat_gather(stats);
+
+		store_release(&stat_page->seq, stat_page->seq + 1);
+		memcpy(values, stats, sizeof(*stats) * stat_nr);
+		stat_page->update_us = microtime();
+		store_release(&stat_page->seq, stat_page->seq + 1);
+
+		timer_sleep(STAT_PAGE_PERIOD_US);
+	}
+}
+
+/*
+ * Handles "trace [on|off|dump]" (see inc/runtime/trace.h). Replies with
+ * whether tracing is on, and after a dump the number of entries written.
+ */
+static ssize_t stat_handle_trace(char *buf, ssize_t len)
+{
+	char *pos = buf, *end = buf + UDP_MAX_PAYLOAD;
+	ssize_t dumped = -1;
+	const char *arg;
+	int ret;
+
+	buf[min(len, (ssize_t)UDP_MAX_PAYLOAD - 1)] = '\0';
+	arg = buf + strlen("trace");
+	while (*arg == ' ')
+		arg++;
+
+	if (strncmp(arg, "on", strlen("on")) == 0) {
+		ret = rtrace_start();
+		if (ret)
+			return ret;
+	} else if (strncmp(arg, "off", strlen("off")) == 0) {
+		rtrace_stop();
+	} else if (strncmp(arg, "dump", strlen("dump")) == 0) {
+		dumped = rtrace_dump();
+		if (dumped < 0)
+			return dumped;
+	}
+
+	ret = append_stat(pos, end - pos, "trace_enabled",
+			  ACCESS_ONCE(rtrace_enabled));
+	if (ret < 0 || ret >= end - pos)
+		return -EINVAL;
+	pos += ret;
+
+	if (dumped >= 0) {
+		ret = append_stat(pos, end - pos, "trace_entries", dumped);
+		if (ret < 0 || ret >= end - pos)
+			return -EINVAL;
+		pos += ret;
+	}
+
+	pos[-1] = '\0'; /* clip off last ',' */
+	return pos - buf;
+}
+
+/*
+ * Handles "cpuprof [on|off|dump [threads]]" (see cpuprof.c). Replies with
+ * whether profiling is on, and after a dump the number of samples written.
+ */
+static ssize_t stat_handle_cpuprof(char *buf, ssize_t len)
+{
+	char *pos = buf, *end = buf + UDP_MAX_PAYLOAD;
+	ssize_t dumped = -1;
+	const char *arg;
+	int ret;
+
+	buf[min(len, (ssize_t)UDP_MAX_PAYLOAD - 1)] = '\0';
+	arg = buf + strlen("cpuprof");
+	while (*arg == ' ')
+		arg++;
+
+	if (strncmp(arg, "on", strlen("on")) == 0) {
+		ret = cpuprof_start();
+		if (ret)
+			return ret;
+	} else if (strncmp(arg, "off", strlen("off")) == 0) {
+		cpuprof_stop();
+	} else if (strncmp(arg, "dump", strlen("dump")) == 0) {
+		arg += strlen("dump");
+		while (*arg == ' ')
+			arg++;
+		dumped = cpuprof_dump(strncmp(arg, "threads",
+					      strlen("threads")) == 0);
+		if (dumped < 0)
+			return dumped;
+	}
+
+	ret = append_stat(pos, end - pos, "cpuprof_enabled",
+			  ACCESS_ONCE(cpuprof_enabled));
+	if (ret < 0 || ret >= end - pos)
+		return -EINVAL;
+	pos += ret;
+
+	if (dumped >= 0) {
+		ret = append_stat(pos, end - pos, "cpuprof_samples", dumped);
+		if (ret < 0 || ret >= end - pos)
+			return -EINVAL;
+		pos += ret;
+	}
+
+	pos[-1] = '\0'; /* clip off last ',' */
+	return pos - buf;
+}
+
 static void stat_worker(void *arg)
 {
 	const size_t cmd_len = strlen("stat");
+	const size_t prof_len = strlen("allocprof");
+	const size_t tcp_len = strlen("tcp");
+	const size_t sched_len = strlen("sched");
+	const size_t bstat_len = strlen("bstat");
+	const size_t kstat_len = strlen("kstat");
+	const size_t trace_len = strlen("trace");
+	const size_t cpuprof_len = strlen("cpuprof");
+	const size_t lockprof_len = strlen("lockprof");
+	const size_t stackdepth_len = strlen("stackdepth");
+	const size_t trans_len = strlen("trans");
 	char buf[UDP_MAX_PAYLOAD];
-	struct netaddr laddr, raddr;
+	struct netaddr laddr = { 0 }, raddr;
 	udpconn_t *c;
 	ssize_t ret, len;
 
@@ -107,12 +928,35 @@ static void stat_worker(void *arg)
 
 	while (true) {
 		ret = udp_read_from(c, buf, UDP_MAX_PAYLOAD, &raddr);
-		if (ret < cmd_len)
+		if (ret < tcp_len)
 			continue;
-		if (strncmp(buf, "stat", cmd_len) != 0)
+		if (ret >= prof_len && strncmp(buf, "allocprof", prof_len) == 0)
+			len = stat_handle_allocprof(buf, ret);
+		else if (strncmp(buf, "tcp", tcp_len) == 0)
+			len = stat_handle_tcp(buf, ret);
+		else if (ret >= sched_len && strncmp(buf, "sched", sched_len) == 0)
+			len = stat_handle_sched(buf, ret);
+		else if (ret >= bstat_len && strncmp(buf, "bstat", bstat_len) == 0)
+			len = stat_handle_bstat(buf, ret);
+		else if (ret >= kstat_len && strncmp(buf, "kstat", kstat_len) == 0)
+			len = stat_handle_kstat(buf, ret);
+		else if (ret >= trace_len && strncmp(buf, "trace", trace_len) == 0)
+			len = stat_handle_trace(buf, ret);
+		else if (ret >= cpuprof_len &&
+			 strncmp(buf, "cpuprof", cpuprof_len) == 0)
+			len = stat_handle_cpuprof(buf, ret);
+		else if (ret >= lockprof_len &&
+			 strncmp(buf, "lockprof", lockprof_len) == 0)
+			len = stat_handle_lockprof(buf, ret);
+		else if (ret >= stackdepth_len &&
+			 strncmp(buf, "stackdepth", stackdepth_len) == 0)
+			len = stat_handle_stackdepth(buf, ret);
+		else if (ret >= trans_len && strncmp(buf, "trans", trans_len) == 0)
+			len = stat_handle_trans(buf, UDP_MAX_PAYLOAD);
+		else if (ret >= cmd_len && strncmp(buf, "stat", cmd_len) == 0)
+			len = stat_write_buf(buf, UDP_MAX_PAYLOAD);
+		else
 			continue;
-
-		len = stat_write_buf(buf, UDP_MAX_PAYLOAD);
 		if (len < 0) {
 			log_err("stat: couldn't generate stat buffer");
 			continue;
@@ -125,11 +969,35 @@ static void stat_worker(void *arg)
 }
 
 /**
- * stat_init_late - starts the stat responder thread
+ * stat_init_late - starts the stat responder thread, and the stats page if
+ * enabled
  *
  * Returns 0 if succesful.
  */
 int stat_init_late(void)
 {
+	long nr_counters = __stop_stat_counters - __start_stat_counters;
+	int ret;
+
+	if (nr_counters > STAT_COUNTERS_MAX) {
+		log_warn("stat: only exporting the first %d of %ld counters",
+			 STAT_COUNTERS_MAX, nr_counters);
+		nr_counters = STAT_COUNTERS_MAX;
+	}
+	stat_nr = STAT_NR + nr_counters;
+
+	if (stat_page_enabled) {
+		ret = stat_page_create();
+		if (ret) {
+			log_err("stat: couldn't create the stats page, ret = %d",
+				ret);
+			return ret;
+		}
+
+		ret = thread_spawn(stat_page_worker, NULL);
+		if (ret)
+			return ret;
+	}
+
 	return thread_spawn(stat_worker, NULL);
 }
@@ -2,9 +2,14 @@
  * sync.c - support for synchronization
  */
 
+#include <base/hash.h>
 #include <base/lock.h>
+#include <base/lockprof.h>
 #include <base/log.h>
+#include <base/time.h>
+#include <runtime/smalloc.h>
 #include <runtime/thread.h>
+#include <runtime/timer.h>
 #include <runtime/sync.h>
 
 #include "defs.h"
@@ -12,8 +17,62 @@
 
 /*
  * Mutex support
+ *
+ * Contended mutexes spin briefly before parking, but only while the owner is
+ * running on another core. Parking and waking cost a few microseconds, so
+ * for short critical sections it's usually cheaper to wait for the release.
  */
 
+/* the longest a contended mutex_lock() spins before parking (us) */
+#define MUTEX_SPIN_US	2
+
+/* spins until the mutex is released or spinning stops paying off */
+static void mutex_spin(mutex_t *m)
+{
+	uint64_t deadline = rdtsc() + MUTEX_SPIN_US * cycles_per_us;
+	thread_t *owner;
+
+	while (rdtsc() < deadline) {
+		if (!ACCESS_ONCE(m->held))
+			return;
+
+		/*
+		 * The owner is parked or waiting to run, so it won't be quick.
+		 * This also stops spinning once the mutex is handed to a parked
+		 * waiter, since it isn't running yet.
+		 */
+		owner = ACCESS_ONCE(m->owner);
+		if (!owner || ACCESS_ONCE(owner->state) != THREAD_STATE_RUNNING)
+			return;
+
+		cpu_relax();
+	}
+}
+
+/*
+ * Charges an acquisition to the lock profiler. For exclusive holds, also
+ * starts timing the hold in @prof_tsc and @prof_site (NULL for readers).
+ */
+static void sync_prof_acquired(int kind, uint64_t *prof_tsc,
+			       const void **prof_site, const void *site,
+			       uint64_t wait_start)
+{
+	__lockprof_acquired(kind, site, wait_start);
+	if (prof_tsc) {
+		*prof_site = site;
+		*prof_tsc = rdtsc();
+	}
+}
+
+/* charges the time a lock was held, if profiling is still on */
+static void sync_prof_released(int kind, uint64_t *prof_tsc,
+			       const void *prof_site)
+{
+	if (lockprof_enabled())
+		__lockprof_released(kind, prof_site, *prof_tsc);
+	*prof_tsc = 0;
+}
+
 /**
  * mutex_try_lock - attempts to acquire a mutex
  * @m: the mutex to acquire
@@ -28,7 +87,11 @@ bool mutex_try_lock(mutex_t *m)
 		return false;
 	}
 	m->held = true;
+	m->owner = thread_self();
 	spin_unlock_np(&m->waiter_lock);
+	if (lockprof_enabled())
+		sync_prof_acquired(LOCKPROF_MUTEX, &m->prof_tsc, &m->prof_site,
+				   __builtin_return_address(0), 0);
 	return true;
 }
 
@@ -38,17 +101,36 @@ bool mutex_try_lock(mutex_t *m)
  */
 void mutex_lock(mutex_t *m)
 {
+	uint64_t wait_start = 0;
 	thread_t *myth;
+	bool spun = false;
 
+again:
 	spin_lock_np(&m->waiter_lock);
 	myth = thread_self();
 	if (!m->held) {
 		m->held = true;
+		m->owner = myth;
 		spin_unlock_np(&m->waiter_lock);
-		return;
+		goto acquired;
+	}
+	if (!spun) {
+		spin_unlock_np(&m->waiter_lock);
+		if (lockprof_enabled())
+			wait_start = rdtsc();
+		mutex_spin(m);
+		spun = true;
+		goto again;
 	}
+
+	/* mutex_unlock() hands ownership over directly */
 	list_add_tail(&m->waiters, &myth->link);
 	thread_park_and_unlock_np(&m->waiter_lock);
+
+acquired:
+	if (lockprof_enabled())
+		sync_prof_acquired(LOCKPROF_MUTEX, &m->prof_tsc, &m->prof_site,
+				   __builtin_return_address(0), wait_start);
 }
 
 /**
@@ -59,13 +141,18 @@ void mutex_unlock(mutex_t *m)
 {
 	thread_t *waketh;
 
+	if (unlikely(m->prof_tsc))
+		sync_prof_released(LOCKPROF_MUTEX, &m->prof_tsc, m->prof_site);
+
 	spin_lock_np(&m->waiter_lock);
 	waketh = list_pop(&m->waiters, thread_t, link);
 	if (!waketh) {
 		m->held = false;
+		m->owner = NULL;
 		spin_unlock_np(&m->waiter_lock);
 		return;
 	}
+	m->owner = waketh;
 	spin_unlock_np(&m->waiter_lock);
 	thread_ready(waketh);
 }
@@ -77,6 +164,9 @@ void mutex_unlock(mutex_t *m)
 void mutex_init(mutex_t *m)
 {
 	m->held = false;
+	m->owner = NULL;
+	m->prof_tsc = 0;
+	m->prof_site = NULL;
 	spin_lock_init(&m->waiter_lock);
 	list_head_init(&m->waiters);
 }
@@ -96,6 +186,8 @@ void rwmutex_init(rwmutex_t *m)
 	list_head_init(&m->write_waiters);
 	m->count = 0;
 	m->read_waiter_count = 0;
+	m->prof_tsc = 0;
+	m->prof_site = NULL;
 }
 
 /**
@@ -104,6 +196,7 @@ void rwmutex_init(rwmutex_t *m)
  */
 void rwmutex_rdlock(rwmutex_t *m)
 {
+	uint64_t wait_start = 0;
 	thread_t *myth;
 
 	spin_lock_np(&m->waiter_lock);
@@ -111,11 +204,18 @@ void rwmutex_rdlock(rwmutex_t *m)
 	if (m->count >= 0) {
 		m->count++;
 		spin_unlock_np(&m->waiter_lock);
-		return;
+		goto acquired;
 	}
 	m->read_waiter_count++;
 	list_add_tail(&m->read_waiters, &myth->link);
+	if (lockprof_enabled())
+		wait_start = rdtsc();
 	thread_park_and_unlock_np(&m->waiter_lock);
+
+acquired:
+	if (lockprof_enabled())
+		sync_prof_acquired(LOCKPROF_RWMUTEX_RD, NULL, NULL,
+				   __builtin_return_address(0), wait_start);
 }
 
 /**
@@ -130,6 +230,9 @@ bool rwmutex_try_rdlock(rwmutex_t *m)
 	if (m->count >= 0) {
 		m->count++;
 		spin_unlock_np(&m->waiter_lock);
+		if (lockprof_enabled())
+			sync_prof_acquired(LOCKPROF_RWMUTEX_RD, NULL, NULL,
+					   __builtin_return_address(0), 0);
 		return true;
 	}
 	spin_unlock_np(&m->waiter_lock);
@@ -142,6 +245,7 @@ bool rwmutex_try_rdlock(rwmutex_t *m)
  */
 void rwmutex_wrlock(rwmutex_t *m)
 {
+	uint64_t wait_start = 0;
 	thread_t *myth;
 
 	spin_lock_np(&m->waiter_lock);
@@ -149,10 +253,18 @@ void rwmutex_wrlock(rwmutex_t *m)
 	if (m->count == 0) {
 		m->count = -1;
 		spin_unlock_np(&m->waiter_lock);
-		return;
+		goto acquired;
 	}
 	list_add_tail(&m->write_waiters, &myth->link);
+	if (lockprof_enabled())
+		wait_start = rdtsc();
 	thread_park_and_unlock_np(&m->waiter_lock);
+
+acquired:
+	if (lockprof_enabled())
+		sync_prof_acquired(LOCKPROF_RWMUTEX_WR, &m->prof_tsc,
+				   &m->prof_site, __builtin_return_address(0),
+				   wait_start);
 }
 
 /**
@@ -167,6 +279,10 @@ bool rwmutex_try_wrlock(rwmutex_t *m)
 	if (m->count == 0) {
 		m->count = -1;
 		spin_unlock_np(&m->waiter_lock);
+		if (lockprof_enabled())
+			sync_prof_acquired(LOCKPROF_RWMUTEX_WR, &m->prof_tsc,
+					   &m->prof_site,
+					   __builtin_return_address(0), 0);
 		return true;
 	}
 	spin_unlock_np(&m->waiter_lock);
@@ -183,6 +299,11 @@ void rwmutex_unlock(rwmutex_t *m)
 	struct list_head tmp;
 	list_head_init(&tmp);
 
+	/* only set while a writer holds it */
+	if (unlikely(m->prof_tsc))
+		sync_prof_released(LOCKPROF_RWMUTEX_WR, &m->prof_tsc,
+				   m->prof_site);
+
 	spin_lock_np(&m->waiter_lock);
 	assert(m->count != 0);
 	if (m->count < 0)
@@ -220,10 +341,192 @@ void rwmutex_unlock(rwmutex_t *m)
 
 }
 
+/*
+ * Big-reader mutex support
+ *
+ * For data that is read from every kthread and rarely written. Readers only
+ * touch a counter in their local kthread's cache line, while writers sweep
+ * the counters of all kthreads and wait for them to sum to zero. A reader may
+ * unlock on a different kthread than it locked on, so individual counters can
+ * go negative, but the sum is always the number of readers.
+ */
+
+static int brmutex_reader_count(brmutex_t *m)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < maxks; i++)
+		cnt += atomic_read(&m->readers[i].cnt);
+	return cnt;
+}
+
+/* wakes a writer waiting for the readers to exit, if they all have */
+static void brmutex_wake_writer(brmutex_t *m)
+{
+	thread_t *th = NULL;
+
+	spin_lock_np(&m->waiter_lock);
+	if (m->write_waiter && brmutex_reader_count(m) == 0) {
+		th = m->write_waiter;
+		m->write_waiter = NULL;
+	}
+	spin_unlock_np(&m->waiter_lock);
+
+	if (th)
+		thread_ready(th);
+}
+
+/**
+ * brmutex_init - initializes a big-reader mutex
+ * @m: the brmutex to initialize
+ *
+ * Returns 0 if successful, or -ENOMEM if out of memory.
+ */
+int brmutex_init(brmutex_t *m)
+{
+	int i;
+
+	m->readers = smalloc(sizeof(*m->readers) * maxks);
+	if (!m->readers)
+		return -ENOMEM;
+	for (i = 0; i < maxks; i++)
+		atomic_write(&m->readers[i].cnt, 0);
+
+	mutex_init(&m->write_lock);
+	spin_lock_init(&m->waiter_lock);
+	m->writer = false;
+	m->write_waiter = NULL;
+	list_head_init(&m->read_waiters);
+	return 0;
+}
+
+/**
+ * brmutex_destroy - frees the resources of a big-reader mutex
+ * @m: the brmutex, which must not be held
+ */
+void brmutex_destroy(brmutex_t *m)
+{
+	assert(!m->writer && brmutex_reader_count(m) == 0);
+	sfree(m->readers);
+	m->readers = NULL;
+}
+
+/**
+ * brmutex_rdlock - acquires a read lock on a big-reader mutex
+ * @m: the brmutex to acquire
+ *
+ * Blocks while a writer holds or is waiting for the lock.
+ */
+void brmutex_rdlock(brmutex_t *m)
+{
+	atomic_t *cnt;
+	thread_t *myth;
+
+	while (true) {
+		/* the atomic increment orders the count before the check */
+		preempt_disable();
+		cnt = &m->readers[myk()->idx].cnt;
+		atomic_inc(cnt);
+		if (likely(!ACCESS_ONCE(m->writer))) {
+			preempt_enable();
+			return;
+		}
+
+		/* back out and wait for the writer to finish */
+		atomic_dec(cnt);
+		preempt_enable();
+		brmutex_wake_writer(m);
+
+		spin_lock_np(&m->waiter_lock);
+		myth = thread_self();
+		if (!m->writer) {
+			spin_unlock_np(&m->waiter_lock);
+			continue;
+		}
+		list_add_tail(&m->read_waiters, &myth->link);
+		thread_park_and_unlock_np(&m->waiter_lock);
+	}
+}
+
+/**
+ * brmutex_rdunlock - releases a read lock on a big-reader mutex
+ * @m: the brmutex to release
+ */
+void brmutex_rdunlock(brmutex_t *m)
+{
+	bool writer;
+
+	preempt_disable();
+	atomic_dec(&m->readers[myk()->idx].cnt);
+	writer = ACCESS_ONCE(m->writer);
+	preempt_enable();
+
+	if (unlikely(writer))
+		brmutex_wake_writer(m);
+}
+
+/**
+ * brmutex_wrlock - acquires a write lock on a big-reader mutex
+ * @m: the brmutex to acquire
+ *
+ * New readers block as soon as a writer arrives, so writers can't starve.
+ */
+void brmutex_wrlock(brmutex_t *m)
+{
+	mutex_lock(&m->write_lock);
+
+	spin_lock_np(&m->waiter_lock);
+	m->writer = true;
+	/* order the flag before reading counts (pairs with brmutex_rdlock()) */
+	__sync_synchronize();
+	while (brmutex_reader_count(m) != 0) {
+		m->write_waiter = thread_self();
+		thread_park_and_unlock_np(&m->waiter_lock);
+		spin_lock_np(&m->waiter_lock);
+	}
+	spin_unlock_np(&m->waiter_lock);
+}
+
+/**
+ * brmutex_wrunlock - releases a write lock on a big-reader mutex
+ * @m: the brmutex to release
+ */
+void brmutex_wrunlock(brmutex_t *m)
+{
+	struct list_head tmp;
+	thread_t *th;
+
+	list_head_init(&tmp);
+	spin_lock_np(&m->waiter_lock);
+	assert(m->writer);
+	m->writer = false;
+	list_append_list(&tmp, &m->read_waiters);
+	spin_unlock_np(&m->waiter_lock);
+
+	while (true) {
+		th = list_pop(&tmp, thread_t, link);
+		if (!th)
+			break;
+		thread_ready(th);
+	}
+
+	mutex_unlock(&m->write_lock);
+}
+
 /*
  * Condition variable support
  */
 
+/* a thread blocked in condvar_wait() or condvar_wait_timeout() */
+struct condvar_sleeper {
+	struct list_node	link;
+	thread_t		*th;
+	condvar_t		*cv;
+	bool			queued;	 /* in @cv's waiters, protected by its lock */
+	bool			expired; /* woken by the timeout */
+	bool			done;	 /* the timeout handler has finished */
+};
+
 /**
  * condvar_wait - waits for a condition variable to be signalled
  * @cv: the condition variable to wait for
@@ -231,16 +534,79 @@ void rwmutex_unlock(rwmutex_t *m)
  */
 void condvar_wait(condvar_t *cv, mutex_t *m)
 {
-	thread_t *myth;
+	struct condvar_sleeper s;
 
 	assert_mutex_held(m);
 	spin_lock_np(&cv->waiter_lock);
-	myth = thread_self();
+	s.th = thread_self();
+	s.queued = true;
+	mutex_unlock(m);
+	list_add_tail(&cv->waiters, &s.link);
+	thread_park_and_unlock_np(&cv->waiter_lock);
+
+	mutex_lock(m);
+}
+
+static void condvar_wait_expired(unsigned long arg)
+{
+	struct condvar_sleeper *s = (struct condvar_sleeper *)arg;
+	condvar_t *cv = s->cv;
+	thread_t *th = NULL;
+
+	spin_lock_np(&cv->waiter_lock);
+	if (s->queued) {
+		list_del_from(&cv->waiters, &s->link);
+		s->queued = false;
+		s->expired = true;
+		th = s->th;
+	}
+	spin_unlock_np(&cv->waiter_lock);
+
+	if (th)
+		thread_ready(th);
+	store_release(&s->done, true);
+}
+
+/**
+ * condvar_wait_timeout - waits for a condition variable to be signalled, or a
+ * timeout
+ * @cv: the condition variable to wait for
+ * @m: the currently held mutex that projects the condition
+ * @timeout_us: how long to wait in microseconds
+ *
+ * Like condvar_wait(), but gives up after @timeout_us. @m is held again on
+ * return either way.
+ *
+ * Returns true if the condition variable was signalled, or false if the
+ * timeout expired first.
+ */
+bool condvar_wait_timeout(condvar_t *cv, mutex_t *m, uint64_t timeout_us)
+{
+	struct condvar_sleeper s;
+	struct timer_entry e;
+
+	assert_mutex_held(m);
+	s.cv = cv;
+	s.expired = false;
+	s.done = false;
+	timer_init(&e, condvar_wait_expired, (unsigned long)&s);
+
+	spin_lock_np(&cv->waiter_lock);
+	s.th = thread_self();
+	s.queued = true;
 	mutex_unlock(m);
-	list_add_tail(&cv->waiters, &myth->link);
+	list_add_tail(&cv->waiters, &s.link);
+	timer_start(&e, microtime() + timeout_us);
 	thread_park_and_unlock_np(&cv->waiter_lock);
 
+	/* the handler may be running, and @s and @e live on this stack */
+	if (!timer_cancel(&e)) {
+		while (!load_acquire(&s.done))
+			cpu_relax();
+	}
+
 	mutex_lock(m);
+	return !s.expired;
 }
 
 /**
@@ -249,34 +615,69 @@ void condvar_wait(condvar_t *cv, mutex_t *m)
  */
 void condvar_signal(condvar_t *cv)
 {
-	thread_t *waketh;
+	struct condvar_sleeper *s;
+	thread_t *waketh = NULL;
 
 	spin_lock_np(&cv->waiter_lock);
-	waketh = list_pop(&cv->waiters, thread_t, link);
+	s = list_pop(&cv->waiters, struct condvar_sleeper, link);
+	if (s) {
+		s->queued = false;
+		waketh = s->th;
+	}
 	spin_unlock_np(&cv->waiter_lock);
 	if (waketh)
 		thread_ready(waketh);
 }
 
+/**
+ * condvar_signal_yield - signals a waiter and switches straight to it
+ * @cv: the condition variable to signal
+ *
+ * Like condvar_signal(), but the woken thread runs right away on this
+ * kthread (see thread_yield_to()), which shortens ping-pong patterns such as
+ * a handler waiting for a backend's reply. Call it after unlocking the mutex,
+ * or the waiter will block on it again at once.
+ */
+void condvar_signal_yield(condvar_t *cv)
+{
+	struct condvar_sleeper *s;
+	thread_t *waketh = NULL;
+
+	spin_lock_np(&cv->waiter_lock);
+	s = list_pop(&cv->waiters, struct condvar_sleeper, link);
+	if (s) {
+		s->queued = false;
+		waketh = s->th;
+	}
+	spin_unlock_np(&cv->waiter_lock);
+	if (waketh)
+		thread_yield_to(waketh);
+}
+
 /**
  * condvar_broadcast - signals all waiting threads on a condition variable
  * @cv: the condition variable to signal
  */
 void condvar_broadcast(condvar_t *cv)
 {
-	thread_t *waketh;
+	struct condvar_sleeper *s;
 	struct list_head tmp;
+	thread_t *waketh;
 
 	list_head_init(&tmp);
 
 	spin_lock_np(&cv->waiter_lock);
+	list_for_each(&cv->waiters, s, link)
+		s->queued = false;
 	list_append_list(&tmp, &cv->waiters);
 	spin_unlock_np(&cv->waiter_lock);
 
 	while (true) {
-		waketh = list_pop(&tmp, thread_t, link);
-		if (!waketh)
+		s = list_pop(&tmp, struct condvar_sleeper, link);
+		if (!s)
 			break;
+		/* @s is gone once its thread runs */
+		waketh = s->th;
 		thread_ready(waketh);
 	}
 }
@@ -357,6 +758,144 @@ void waitgroup_init(waitgroup_t *wg)
 }
 
 
+/*
+ * Sharded wait group support
+ */
+
+/* keeps the combined count above zero while the shards are folded into it */
+#define SWAITGROUP_BIAS		(1L << 48)
+
+/**
+ * swaitgroup_init - initializes a sharded wait group
+ * @wg: the wait group to initialize
+ *
+ * Returns 0 if successful, or -ENOMEM if out of memory.
+ */
+int swaitgroup_init(swaitgroup_t *wg)
+{
+	int i;
+
+	wg->shards = aligned_alloc(CACHE_LINE_SIZE,
+				   sizeof(*wg->shards) * maxks);
+	if (!wg->shards)
+		return -ENOMEM;
+
+	for (i = 0; i < maxks; i++) {
+		spin_lock_init(&wg->shards[i].lock);
+		wg->shards[i].cnt = 0;
+	}
+	wg->combined = false;
+	atomic64_write(&wg->cnt, 0);
+	spin_lock_init(&wg->lock);
+	list_head_init(&wg->waiters);
+	return 0;
+}
+
+/**
+ * swaitgroup_destroy - frees a sharded wait group
+ * @wg: the wait group, which must have no waiters
+ */
+void swaitgroup_destroy(swaitgroup_t *wg)
+{
+	assert(list_empty(&wg->waiters));
+	free(wg->shards);
+}
+
+/* wakes the waiters if the combined count is still zero */
+static void swaitgroup_release(swaitgroup_t *wg)
+{
+	struct list_head tmp;
+	thread_t *waketh;
+
+	list_head_init(&tmp);
+
+	spin_lock_np(&wg->lock);
+	if (atomic64_read(&wg->cnt) == 0) {
+		/* go back to counting in the shards */
+		wg->combined = false;
+		list_append_list(&tmp, &wg->waiters);
+	}
+	spin_unlock_np(&wg->lock);
+
+	while (true) {
+		waketh = list_pop(&tmp, thread_t, link);
+		if (!waketh)
+			break;
+		thread_ready(waketh);
+	}
+}
+
+/**
+ * swaitgroup_add - adds or removes waiters from a sharded wait group
+ * @wg: the wait group to update
+ * @cnt: the count to add to the waitgroup (can be negative)
+ *
+ * Until a thread waits, only the local kthread's count is updated. The wait
+ * group must be incremented at least once before calling swaitgroup_wait().
+ */
+void swaitgroup_add(swaitgroup_t *wg, long cnt)
+{
+	struct swaitgroup_shard *shard;
+	long val;
+
+	preempt_disable();
+	shard = &wg->shards[myk()->idx];
+	spin_lock(&shard->lock);
+	if (likely(!ACCESS_ONCE(wg->combined))) {
+		shard->cnt += cnt;
+		spin_unlock_np(&shard->lock);
+		return;
+	}
+	spin_unlock_np(&shard->lock);
+
+	val = atomic64_add_and_fetch(&wg->cnt, cnt);
+	BUG_ON(val < 0);
+	if (val == 0)
+		swaitgroup_release(wg);
+}
+
+/**
+ * swaitgroup_wait - waits for the wait group count to become zero
+ * @wg: the wait group to wait on
+ *
+ * Folds the kthreads' counts into one the first time a thread waits, so adds
+ * and dones that follow pay for an atomic until the count reaches zero.
+ */
+void swaitgroup_wait(swaitgroup_t *wg)
+{
+	struct swaitgroup_shard *shard;
+	long sum = 0, val;
+	int i;
+
+	spin_lock_np(&wg->lock);
+	if (!wg->combined) {
+		atomic64_fetch_and_add(&wg->cnt, SWAITGROUP_BIAS);
+		ACCESS_ONCE(wg->combined) = true;
+
+		/* adds check @combined under their shard's lock */
+		for (i = 0; i < maxks; i++) {
+			shard = &wg->shards[i];
+			spin_lock(&shard->lock);
+			sum += shard->cnt;
+			shard->cnt = 0;
+			spin_unlock(&shard->lock);
+		}
+
+		val = atomic64_add_and_fetch(&wg->cnt, sum - SWAITGROUP_BIAS);
+		BUG_ON(val < 0);
+		if (val == 0)
+			wg->combined = false;
+	}
+
+	if (atomic64_read(&wg->cnt) == 0) {
+		spin_unlock_np(&wg->lock);
+		return;
+	}
+	list_add_tail(&wg->waiters, &thread_self()->link);
+	thread_park_and_unlock_np(&wg->lock);
+}
+
+
 /*
  * Barrier support
  */
@@ -407,3 +946,316 @@ bool barrier_wait(barrier_t *b)
 	thread_park_and_unlock_np(&b->lock);
 	return false;
 }
+
+
+/*
+ * Tree barrier support
+ */
+
+/**
+ * tbarrier_init - initializes a tree barrier
+ * @b: the barrier to initialize
+ * @count: number of threads that must wait before releasing
+ *
+ * Returns 0 if successful, -EINVAL if @count is too small or too large, or
+ * -ENOMEM if out of memory.
+ */
+int tbarrier_init(tbarrier_t *b, int count)
+{
+	int l, i, width, prev, nr_nodes = 0;
+
+	if (count < 1)
+		return -EINVAL;
+
+	/* every level has a node per TBARRIER_FANIN nodes (or threads) below */
+	b->nr_levels = 0;
+	width = count;
+	do {
+		if (b->nr_levels == TBARRIER_MAX_LEVELS)
+			return -EINVAL;
+		width = div_up(width, TBARRIER_FANIN);
+		b->level_start[b->nr_levels++] = nr_nodes;
+		nr_nodes += width;
+	} while (width > 1);
+
+	b->nodes = aligned_alloc(CACHE_LINE_SIZE, sizeof(*b->nodes) * nr_nodes);
+	if (!b->nodes)
+		return -ENOMEM;
+
+	prev = count;
+	for (l = 0; l < b->nr_levels; l++) {
+		width = div_up(prev, TBARRIER_FANIN);
+		for (i = 0; i < width; i++) {
+			struct tbarrier_node *n = &b->nodes[b->level_start[l] + i];
+
+			spin_lock_init(&n->lock);
+			n->arrived = 0;
+			n->expected = min(TBARRIER_FANIN,
+					  prev - i * TBARRIER_FANIN);
+			list_head_init(&n->waiters);
+		}
+		prev = width;
+	}
+
+	b->count = count;
+	return 0;
+}
+
+/**
+ * tbarrier_destroy - frees a tree barrier
+ * @b: the barrier, which must have no waiters
+ */
+void tbarrier_destroy(tbarrier_t *b)
+{
+	free(b->nodes);
+}
+
+/**
+ * tbarrier_wait - waits on a tree barrier
+ * @b: the barrier to wait on
+ * @idx: the caller's participant number, from 0 to the count minus one
+ *
+ * Each participant must pass a different @idx. Participants with adjacent
+ * numbers share nodes, so number threads that run together consecutively.
+ *
+ * Returns true if the calling thread releases the barrier
+ */
+bool tbarrier_wait(tbarrier_t *b, int idx)
+{
+	struct list_head won[TBARRIER_MAX_LEVELS];
+	struct tbarrier_node *n;
+	bool released = true;
+	thread_t *th;
+	int l, nr_won = 0;
+
+	assert(idx >= 0 && idx < b->count);
+
+	for (l = 0; l < b->nr_levels; l++) {
+		idx /= TBARRIER_FANIN;
+		n = &b->nodes[b->level_start[l] + idx];
+
+		spin_lock_np(&n->lock);
+		if (++n->arrived < n->expected) {
+			list_add_tail(&n->waiters, &thread_self()->link);
+			thread_park_and_unlock_np(&n->lock);
+			released = false;
+			break;
+		}
+
+		/* the last to arrive carries the node's waiters upwards */
+		n->arrived = 0;
+		list_head_init(&won[nr_won]);
+		list_append_list(&won[nr_won++], &n->waiters);
+		spin_unlock_np(&n->lock);
+	}
+
+	/* wake the nodes nearest the root first, they lead the most threads */
+	while (nr_won--) {
+		while (true) {
+			th = list_pop(&won[nr_won], thread_t, link);
+			if (!th)
+				break;
+			thread_ready(th);
+		}
+	}
+
+	return released;
+}
+
+
+/*
+ * Wait/notify support
+ */
+
+/* the number of wait queues addresses are hashed to (a power of two) */
+#define WAITADDR_NR_BUCKETS	1024
+
+struct waitaddr_bucket {
+	spinlock_t		lock;
+	struct list_head	waiters;
+} __aligned(CACHE_LINE_SIZE);
+
+/* a thread blocked in thread_wait_on() or thread_wait_on_timeout() */
+struct waitaddr_sleeper {
+	struct list_node	link;
+	thread_t		*th;
+	const uint32_t		*addr;
+	struct waitaddr_bucket	*bucket;
+	bool			queued;	 /* in @bucket, protected by its lock */
+	bool			expired; /* woken by the timeout */
+	bool			done;	 /* the timeout handler has finished */
+};
+
+static struct waitaddr_bucket waitaddr_buckets[WAITADDR_NR_BUCKETS];
+
+BUILD_ASSERT(is_power_of_two(WAITADDR_NR_BUCKETS));
+
+static struct waitaddr_bucket *waitaddr_bucket(const uint32_t *addr)
+{
+	uint32_t idx = hash_crc32c_one(0, (uint64_t)addr);
+
+	return &waitaddr_buckets[idx & (WAITADDR_NR_BUCKETS - 1)];
+}
+
+/*
+ * Queues the calling thread on @addr's bucket, returning with the bucket
+ * locked (and preemption disabled), or returns -EAGAIN if @addr no longer
+ * holds @expected.
+ */
+static int waitaddr_prepare(struct waitaddr_sleeper *s, const uint32_t *addr,
+			 uint32_t expected)
+{
+	s->addr = addr;
+	s->bucket = waitaddr_bucket(addr);
+	s->expired = false;
+	s->done = false;
+
+	spin_lock_np(&s->bucket->lock);
+	if (ACCESS_ONCE(*addr) != expected) {
+		spin_unlock_np(&s->bucket->lock);
+		return -EAGAIN;
+	}
+
+	s->th = thread_self();
+	s->queued = true;
+	list_add_tail(&s->bucket->waiters, &s->link);
+	return 0;
+}
+
+/**
+ * thread_wait_on - waits for a notification on an address
+ * @addr: the address
+ * @expected: the value @addr must hold to wait
+ *
+ * Checking @addr and going to sleep are atomic with respect to
+ * thread_notify(), so a notification that follows a change to @addr can't be
+ * missed. Like futex(2), callers must recheck their condition on return.
+ *
+ * Returns 0 if woken by thread_notify(), or -EAGAIN if @addr didn't hold
+ * @expected.
+ */
+int thread_wait_on(const uint32_t *addr, uint32_t expected)
+{
+	struct waitaddr_sleeper s;
+	int ret;
+
+	ret = waitaddr_prepare(&s, addr, expected);
+	if (ret)
+		return ret;
+
+	thread_park_and_unlock_np(&s.bucket->lock);
+	return 0;
+}
+
+static void waitaddr_expired(unsigned long arg)
+{
+	struct waitaddr_sleeper *s = (struct waitaddr_sleeper *)arg;
+	thread_t *th = NULL;
+
+	spin_lock_np(&s->bucket->lock);
+	if (s->queued) {
+		list_del_from(&s->bucket->waiters, &s->link);
+		s->queued = false;
+		s->expired = true;
+		th = s->th;
+	}
+	spin_unlock_np(&s->bucket->lock);
+
+	if (th)
+		thread_ready(th);
+	store_release(&s->done, true);
+}
+
+/**
+ * thread_wait_on_timeout - waits for a notification on an address, or a
+ * timeout
+ * @addr: the address
+ * @expected: the value @addr must hold to wait
+ * @timeout_us: how long to wait in microseconds
+ *
+ * Returns 0 if woken by thread_notify(), -EAGAIN if @addr didn't hold
+ * @expected, or -ETIMEDOUT if the timeout expired first.
+ */
+int thread_wait_on_timeout(const uint32_t *addr, uint32_t expected,
+			   uint64_t timeout_us)
+{
+	struct waitaddr_sleeper s;
+	struct timer_entry e;
+	int ret;
+
+	timer_init(&e, waitaddr_expired, (unsigned long)&s);
+	ret = waitaddr_prepare(&s, addr, expected);
+	if (ret)
+		return ret;
+
+	timer_start(&e, microtime() + timeout_us);
+	thread_park_and_unlock_np(&s.bucket->lock);
+
+	/* the handler may be running, and @s and @e live on this stack */
+	if (!timer_cancel(&e)) {
+		while (!load_acquire(&s.done))
+			cpu_relax();
+	}
+
+	return s.expired ? -ETIMEDOUT : 0;
+}
+
+/**
+ * thread_notify - wakes threads waiting on an address
+ * @addr: the address
+ * @n: the most threads to wake, oldest waiters first
+ *
+ * Change the value at @addr before notifying, so woken threads see it.
+ *
+ * Returns the number of threads woken.
+ */
+int thread_notify(const uint32_t *addr, int n)
+{
+	struct waitaddr_bucket *b = waitaddr_bucket(addr);
+	struct waitaddr_sleeper *s, *next;
+	struct list_head tmp;
+	thread_t *th;
+	int nr = 0;
+
+	list_head_init(&tmp);
+
+	spin_lock_np(&b->lock);
+	list_for_each_safe(&b->waiters, s, next, link) {
+		if (nr >= n)
+			break;
+		if (s->addr != addr)
+			continue;
+		list_del_from(&b->waiters, &s->link);
+		s->queued = false;
+		/* @s is gone once its thread runs, so queue the thread itself */
+		list_add_tail(&tmp, &s->th->link);
+		nr++;
+	}
+	spin_unlock_np(&b->lock);
+
+	while (true) {
+		th = list_pop(&tmp, thread_t, link);
+		if (!th)
+			break;
+		thread_ready(th);
+	}
+
+	return nr;
+}
+
+/**
+ * waitaddr_init - initializes the wait/notify queues
+ *
+ * Returns 0 (always successful).
+ */
+int waitaddr_init(void)
+{
+	int i;
+
+	for (i = 0; i < WAITADDR_NR_BUCKETS; i++) {
+		spin_lock_init(&waitaddr_buckets[i].lock);
+		list_head_init(&waitaddr_buckets[i].waiters);
+	}
+
+	return 0;
+}
@@ -1,12 +1,24 @@
 /*
  * timer.c - support for timers
  *
- * So far we use a D-ary heap just like the Go runtime. We may want to consider
- * adding a lower-resolution shared timer wheel as well.
+ * Each kthread has a hierarchical timing wheel with microsecond resolution,
+ * so starting and cancelling a timer is O(1) and the number of timers is
+ * unbounded. Level 0 has one slot per microsecond, and each higher level
+ * covers WHEEL_SLOTS times more time per slot. Timers in higher levels are
+ * cascaded down as the wheel's clock reaches their slot, so they fire
+ * exactly at their deadline no matter how far away it was when armed.
+ *
+ * Deadlines can also be given in nanoseconds. Such a timer sits in the slot
+ * of the microsecond it falls in, and once that slot expires, the handler
+ * spins for what is left of the microsecond before running. The scheduler
+ * polls rather than parks while a timer is due within timer_spin_us (see
+ * timer_imminent()), since a wakeup from the iokernel takes several
+ * microseconds. How late each timer runs is kept in a histogram.
  */
 
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <base/time.h>
 #include <runtime/sync.h>
@@ -15,93 +27,198 @@
 
 #include "defs.h"
 
-/* the arity of the heap */
-#define D	4
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS	6 /* the top level spans about 19 hours */
+#define WHEEL_EXPIRED	(WHEEL_LEVELS * WHEEL_SLOTS)
 
-/**
- * is_valid_heap - checks that the timer heap is a valid min heap
- * @heap: the timer heap
- * @n: the number of timers in the heap
- *
- * Returns true if valid, false otherwise.
- */
-static bool is_valid_heap(struct timer_idx *heap, int n)
+/* the time covered by each slot at a given level */
+#define LEVEL_SHIFT(l)	((l) * WHEEL_BITS)
+
+BUILD_ASSERT(WHEEL_SLOTS == sizeof(uint64_t) * 8);
+
+struct timer_wheel {
+	/* the next microsecond that hasn't been processed yet */
+	uint64_t		clk;
+	/* a bit is set for each non-empty slot */
+	uint64_t		bitmap[WHEEL_LEVELS];
+	struct list_head	slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	/* timers that are due but haven't been run yet */
+	struct list_head	expired;
+};
+
+static inline unsigned int slot_idx(uint64_t t, int level)
 {
-	int i, p;
-
-	/* check that each timer's deadline is later or equal to its parent's
-	 * deadline */
-	for (i = n-1; i > 1; i--) {
-		p = (i - 1) / D;
-		if (heap[p].deadline_us > heap[i].deadline_us)
-			return false;
+	return (t >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+}
+
+static void wheel_add(struct timer_wheel *w, struct timer_entry *e)
+{
+	uint64_t t = max(e->deadline_us, w->clk);
+	uint64_t delta = t - w->clk;
+	unsigned int s;
+	int l;
+
+	for (l = 0; l < WHEEL_LEVELS - 1; l++) {
+		if (delta < (1UL << LEVEL_SHIFT(l + 1)))
+			break;
 	}
 
-	return true;
+	/* too far away, park it in the slot that will be cascaded last */
+	if (unlikely(delta >= (1UL << LEVEL_SHIFT(WHEEL_LEVELS))))
+		s = slot_idx(w->clk, l);
+	else
+		s = slot_idx(t, l);
+
+	list_add_tail(&w->slots[l][s], &e->link);
+	w->bitmap[l] |= 1UL << s;
+	e->idx = l * WHEEL_SLOTS + s;
 }
 
-/**
- * timer_heap_is_valid - checks that this kthread's timer heap is a
- * valid min heap
- * @k: the kthread
- */
-static void assert_timer_heap_is_valid(struct kthread *k)
+static void wheel_del(struct timer_wheel *w, struct timer_entry *e)
+{
+	unsigned int l = e->idx / WHEEL_SLOTS, s = e->idx % WHEEL_SLOTS;
+
+	list_del_from(e->idx == WHEEL_EXPIRED ? &w->expired : &w->slots[l][s],
+		      &e->link);
+	if (e->idx != WHEEL_EXPIRED && list_empty(&w->slots[l][s]))
+		w->bitmap[l] &= ~(1UL << s);
+}
+
+/* moves a slot's timers to lower levels once the clock reaches the slot */
+static void wheel_cascade_slot(struct timer_wheel *w, int l, unsigned int s)
 {
-	assert(is_valid_heap(k->timers, k->timern));
+	struct timer_entry *e;
+	struct list_head tmp;
+
+	if (!(w->bitmap[l] & (1UL << s)))
+		return;
+
+	list_head_init(&tmp);
+	list_append_list(&tmp, &w->slots[l][s]);
+	w->bitmap[l] &= ~(1UL << s);
+
+	while ((e = list_pop(&tmp, struct timer_entry, link)))
+		wheel_add(w, e);
 }
 
-static void sift_up(struct timer_idx *heap, int i)
+/* cascades every level whose slot boundary the clock just reached */
+static void wheel_cascade(struct timer_wheel *w)
 {
-	struct timer_idx tmp = heap[i];
-	int p;
+	unsigned int s;
+	int l;
 
-	while (i > 0) {
-		p = (i - 1) / D;
-		if (tmp.deadline_us >= heap[p].deadline_us)
+	for (l = 1; l < WHEEL_LEVELS; l++) {
+		s = slot_idx(w->clk, l);
+		wheel_cascade_slot(w, l, s);
+		if (s != 0)
 			break;
-		heap[i] = heap[p];
-		heap[i].e->idx = i;
-		heap[p] = tmp;
-		heap[p].e->idx = p;
-		i = p;
 	}
 }
 
-static void sift_down(struct timer_idx *heap, int i, int n)
+/* returns the lowest set bit at or above @start, or -1 if there is none */
+static inline int first_bit_from(uint64_t bitmap, unsigned int start)
 {
-	struct timer_idx tmp = heap[i];
-	uint64_t w;
-	int c, j;
-
-	while (1) {
-		w = tmp.deadline_us;
-		c = INT_MAX;
-		for (j = (i * D + 1); j <= (i * D + D); j++) {
-			if (j >= n)
-				break;
-			if (heap[j].deadline_us < w) {
-				w = heap[j].deadline_us;
-				c = j;
-			}
-		}
-		if (c == INT_MAX)
+	if (start >= WHEEL_SLOTS)
+		return -1;
+	bitmap &= ~0UL << start;
+	return bitmap ? __builtin_ctzl(bitmap) : -1;
+}
+
+/**
+ * wheel_next_event - finds the next time the wheel has work to do
+ * @w: the wheel
+ * @cascade: set to true if the work is a cascade rather than an expiration
+ *
+ * Every slot boundary between the clock and the returned time is for an empty
+ * slot, so the clock can jump straight to it.
+ *
+ * Returns the time, or UINT64_MAX if the wheel is empty.
+ */
+static uint64_t wheel_next_event(struct timer_wheel *w, bool *cascade)
+{
+	uint64_t clk = w->clk, base;
+	int l, s;
+
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+		if (w->bitmap[l])
 			break;
-		heap[i] = heap[c];
-		heap[i].e->idx = i;
-		heap[c] = tmp;
-		heap[c].e->idx = c;
-		i = c;
 	}
+	if (l == WHEEL_LEVELS)
+		return UINT64_MAX;
+
+	/* the slots later in the current window of this level */
+	s = first_bit_from(w->bitmap[l], slot_idx(clk, l) + (l > 0));
+	base = clk & ~((1UL << LEVEL_SHIFT(l + 1)) - 1);
+	if (s >= 0) {
+		*cascade = l > 0;
+		return base + ((uint64_t)s << LEVEL_SHIFT(l));
+	}
+
+	/* otherwise the level's remaining slots are in its next window */
+	*cascade = true;
+	return base + (1UL << LEVEL_SHIFT(l + 1));
+}
+
+/* runs the wheel up to @now_us, moving due timers to the expired list */
+static void wheel_advance(struct timer_wheel *w, uint64_t now_us)
+{
+	struct list_head *slot;
+	struct timer_entry *e;
+	bool cascade;
+	uint64_t t;
+
+	while (w->clk <= now_us) {
+		t = wheel_next_event(w, &cascade);
+		if (t > now_us) {
+			w->clk = now_us + 1;
+			if (t == w->clk && cascade)
+				wheel_cascade(w);
+			break;
+		}
+
+		w->clk = t;
+		if (cascade) {
+			wheel_cascade(w);
+			continue;
+		}
+
+		/* every timer in a level 0 slot is due at the same time */
+		slot = &w->slots[0][slot_idx(t, 0)];
+		list_for_each(slot, e, link)
+			e->idx = WHEEL_EXPIRED;
+		list_append_list(&w->expired, slot);
+		w->bitmap[0] &= ~(1UL << slot_idx(t, 0));
+
+		w->clk = t + 1;
+		if (slot_idx(w->clk, 0) == 0)
+			wheel_cascade(w);
+	}
+}
+
+static void timer_update_next(struct kthread *k)
+{
+	struct timer_wheel *w = k->timer_wheel;
+	bool cascade;
+
+	if (!list_empty(&w->expired))
+		k->timer_next_us = 0;
+	else
+		k->timer_next_us = wheel_next_event(w, &cascade);
 }
 
 /**
- * timer_merge - merges a timer heap from another kthread into our timer heap
- * @r: the remote kthread whose timer heap we will absorb
+ * timer_merge - merges the timers from another kthread into our timer wheel
+ * @r: the remote kthread whose timers we will absorb
  */
 void timer_merge(struct kthread *r)
 {
 	struct kthread *k = myk();
-	int i;
+	struct timer_wheel *w = k->timer_wheel, *rw = r->timer_wheel;
+	struct timer_entry *e;
+	struct list_head tmp;
+	int l, s;
 
 	spin_lock(&k->timer_lock);
 	spin_lock(&r->timer_lock);
@@ -111,26 +228,25 @@ void timer_merge(struct kthread *r)
 		goto done;
 	}
 
-	/* move all timers from r to the end of our array */
-	for (i = 0; i < r->timern; i++) {
-		k->timers[k->timern] = r->timers[i];
-		k->timers[k->timern].e->idx = k->timern;
-		k->timers[k->timern].e->localk = k;
-		k->timern++;
-
-		if (k->timern >= RUNTIME_MAX_TIMERS)
-			BUG();
+	/* take all of the timers from r */
+	list_head_init(&tmp);
+	list_append_list(&tmp, &rw->expired);
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+		for (s = 0; s < WHEEL_SLOTS; s++)
+			list_append_list(&tmp, &rw->slots[l][s]);
+		rw->bitmap[l] = 0;
 	}
+	k->timern += r->timern;
 	r->timern = 0;
+	r->timer_next_us = UINT64_MAX;
 	spin_unlock(&r->timer_lock);
 
-	/*
-         * Restore heap order by sifting each non-leaf element downward,
-         * starting from the bottom of the heap and working upward (runs in
-	 * linear time).
-	 */
-	for (i = k->timern / D; i >= 0; i--)
-		sift_down(k->timers, i, k->timern);
+	/* then insert them relative to our clock */
+	while ((e = list_pop(&tmp, struct timer_entry, link))) {
+		e->localk = k;
+		wheel_add(w, e);
+	}
+	timer_update_next(k);
 
 done:
 	spin_unlock(&k->timer_lock);
@@ -139,6 +255,8 @@ done:
 /**
  * timer_earliest_deadline - return the first deadline for this kthread or 0 if
  * there are no active timers.
+ *
+ * The result may be earlier than any actual deadline, but never later.
  */
 uint64_t timer_earliest_deadline()
 {
@@ -149,33 +267,34 @@ uint64_t timer_earliest_deadline()
 	if (k->timern == 0)
 		deadline_us = 0;
 	else
-		deadline_us = k->timers[0].deadline_us;
+		deadline_us = max(ACCESS_ONCE(k->timer_next_us), 1UL);
 
 	return deadline_us;
 }
 
-static void timer_start_locked(struct timer_entry *e, uint64_t deadline_us)
+/* polls instead of parking for a timer due this soon (us) */
+unsigned int timer_spin_us = RUNTIME_TIMER_SPIN_US;
+
+static void timer_start_locked(struct timer_entry *e, uint64_t deadline_ns)
 {
 	struct kthread *k = myk();
-	int i;
+	struct timer_wheel *w = k->timer_wheel;
+	uint64_t deadline_us = deadline_ns / 1000;
 
 	assert_spin_lock_held(&k->timer_lock);
 
 	/* can't insert a timer twice! */
 	BUG_ON(e->armed);
 
-	i = k->timern++;
-	if (k->timern >= RUNTIME_MAX_TIMERS) {
-		/* TODO: support unlimited timers */
-		BUG();
-	}
-
-	k->timers[i].deadline_us = deadline_us;
-	k->timers[i].e = e;
-	e->idx = i;
+	e->deadline_us = deadline_us;
+	e->deadline_ns = deadline_ns;
 	e->localk = k;
-	sift_up(k->timers, i);
+	wheel_add(w, e);
 	e->armed = true;
+	k->timern++;
+
+	/* a due timer fires at the clock, since earlier times are done */
+	k->timer_next_us = min(k->timer_next_us, max(deadline_us, w->clk));
 }
 
 /**
@@ -186,11 +305,23 @@ static void timer_start_locked(struct timer_entry *e, uint64_t deadline_us)
  * @e must have been initialized with timer_init().
  */
 void timer_start(struct timer_entry *e, uint64_t deadline_us)
+{
+	timer_start_ns(e, deadline_us * 1000);
+}
+
+/**
+ * timer_start_ns - arms a timer with a nanosecond deadline
+ * @e: the timer entry to start
+ * @deadline_ns: the deadline in nanoseconds (as nanotime())
+ *
+ * @e must have been initialized with timer_init().
+ */
+void timer_start_ns(struct timer_entry *e, uint64_t deadline_ns)
 {
 	struct kthread *k = getk();
 
 	spin_lock_np(&k->timer_lock);
-	timer_start_locked(e, deadline_us);
+	timer_start_locked(e, deadline_ns);
 	spin_unlock_np(&k->timer_lock);
 	putk();
 }
@@ -205,7 +336,6 @@ void timer_start(struct timer_entry *e, uint64_t deadline_us)
 bool timer_cancel(struct timer_entry *e)
 {
 	struct kthread *k;
-	int last;
 
 try_again:
 	preempt_disable();
@@ -214,7 +344,7 @@ try_again:
 	spin_lock_np(&k->timer_lock);
 
 	if (e->localk != k) {
-		/* Timer was merged to a different heap */
+		/* Timer was merged to a different wheel */
 		spin_unlock_np(&k->timer_lock);
 		preempt_enable();
 		goto try_again;
@@ -227,17 +357,9 @@ try_again:
 	}
 	e->armed = false;
 
-	last = --k->timern;
-	if (e->idx == last) {
-		spin_unlock_np(&k->timer_lock);
-		preempt_enable();
-		return true;
-	}
-
-	k->timers[e->idx] = k->timers[last];
-	k->timers[e->idx].e->idx = e->idx;
-	sift_up(k->timers, e->idx);
-	sift_down(k->timers, e->idx, k->timern);
+	/* timer_next_us is allowed to be early, so leave it alone */
+	wheel_del(k->timer_wheel, e);
+	k->timern--;
 	spin_unlock_np(&k->timer_lock);
 
 	preempt_enable();
@@ -250,7 +372,7 @@ static void timer_finish_sleep(unsigned long arg)
 	thread_ready(th);
 }
 
-static void __timer_sleep(uint64_t deadline_us)
+static void __timer_sleep(uint64_t deadline_ns)
 {
 	struct kthread *k;
 	struct timer_entry e;
@@ -260,7 +382,7 @@ static void __timer_sleep(uint64_t deadline_us)
 	k = getk();
 	spin_lock_np(&k->timer_lock);
 	putk();
-	timer_start_locked(&e, deadline_us);
+	timer_start_locked(&e, deadline_ns);
 	thread_park_and_unlock_np(&k->timer_lock);
 }
 
@@ -273,7 +395,7 @@ void timer_sleep_until(uint64_t deadline_us)
 	if (unlikely(microtime() >= deadline_us))
 		return;
 
-	__timer_sleep(deadline_us);
+	__timer_sleep(deadline_us * 1000);
 }
 
 /**
@@ -282,42 +404,87 @@ void timer_sleep_until(uint64_t deadline_us)
  */
 void timer_sleep(uint64_t duration_us)
 {
-	__timer_sleep(microtime() + duration_us);
+	__timer_sleep((microtime() + duration_us) * 1000);
+}
+
+/**
+ * timer_sleep_until_ns - sleeps until a nanosecond deadline
+ * @deadline_ns: the deadline time in nanoseconds (as nanotime())
+ */
+void timer_sleep_until_ns(uint64_t deadline_ns)
+{
+	if (unlikely(nanotime() >= deadline_ns))
+		return;
+
+	__timer_sleep(deadline_ns);
+}
+
+/**
+ * timer_sleep_ns - sleeps for a nanosecond duration
+ * @duration_ns: the duration time in nanoseconds
+ */
+void timer_sleep_ns(uint64_t duration_ns)
+{
+	__timer_sleep(nanotime() + duration_ns);
+}
+
+/*
+ * Waits out the part of a timer's deadline below the wheel's resolution, at
+ * most a microsecond. Returns the time the wait ended.
+ */
+static uint64_t timer_spin_until(uint64_t deadline_ns)
+{
+	uint64_t now_ns;
+
+	STAT(TIMER_SPINS)++;
+	while ((now_ns = nanotime()) < deadline_ns)
+		cpu_relax();
+
+	return now_ns;
 }
 
 /**
  * timer_softirq - handles expired timers
  * @k: the kthread to check
  * @budget: the maximum number of timers to handle
+ *
+ * Handlers are called with preemption disabled and must not block.
  */
 void timer_softirq(struct kthread *k, unsigned int budget)
 {
+	struct timer_wheel *w = k->timer_wheel;
 	struct timer_entry *e;
-	uint64_t now_us;
-	int i;
+	uint64_t now_ns;
 
 	spin_lock_np(&k->timer_lock);
-	assert_timer_heap_is_valid(k);
-
-	now_us = microtime();
-	while (budget-- && k->timern > 0 &&
-	       k->timers[0].deadline_us <= now_us) {
-		i = --k->timern;
-		e = k->timers[0].e;
-		if (i > 0) {
-			k->timers[0] = k->timers[i];
-			k->timers[0].e->idx = 0;
-			sift_down(k->timers, 0, i);
-		}
-		spin_unlock_np(&k->timer_lock);
+	wheel_advance(w, microtime());
 
-		/* execute the timer handler */
+	while (budget--) {
+		e = list_pop(&w->expired, struct timer_entry, link);
+		if (!e)
+			break;
+		e->armed = false;
+		k->timern--;
+		spin_unlock(&k->timer_lock);
+
+		/* the wheel expires a whole microsecond at once */
+		now_ns = nanotime();
+		if (unlikely(now_ns < e->deadline_ns))
+			now_ns = timer_spin_until(e->deadline_ns);
+		k->timer_hist[sched_hist_idx((now_ns - e->deadline_ns) *
+					     cycles_per_us / 1000)]++;
+
+		/*
+		 * Execute the timer handler. Preemption stays disabled from the
+		 * pop through the handler, so the handler runs inside an RCU
+		 * read-side section that began while the timer was still armed.
+		 */
 		e->fn(e->arg);
 
-		spin_lock_np(&k->timer_lock);
-		now_us = microtime();
+		spin_lock(&k->timer_lock);
 	}
 
+	timer_update_next(k);
 	spin_unlock_np(&k->timer_lock);
 }
 
@@ -329,12 +496,45 @@ void timer_softirq(struct kthread *k, unsigned int budget)
 int timer_init_thread(void)
 {
 	struct kthread *k = myk();
+	struct timer_wheel *w;
+	int l, s;
 
-	k->timers = aligned_alloc(CACHE_LINE_SIZE,
-			align_up(sizeof(struct timer_idx) * RUNTIME_MAX_TIMERS,
-				 CACHE_LINE_SIZE));
-	if (!k->timers)
+	w = aligned_alloc(CACHE_LINE_SIZE,
+			  align_up(sizeof(*w), CACHE_LINE_SIZE));
+	if (!w)
 		return -ENOMEM;
 
+	w->clk = microtime();
+	memset(w->bitmap, 0, sizeof(w->bitmap));
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+		for (s = 0; s < WHEEL_SLOTS; s++)
+			list_head_init(&w->slots[l][s]);
+	}
+	list_head_init(&w->expired);
+
+	k->timer_wheel = w;
+	k->timer_next_us = UINT64_MAX;
 	return 0;
 }
+
+static void timer_clock_worker(void *arg)
+{
+	while (true) {
+		timer_sleep(TIME_RECALIBRATE_US);
+
+		/* readers on other kthreads spin while the clock is updated */
+		preempt_disable();
+		time_recalibrate();
+		preempt_enable();
+	}
+}
+
+/**
+ * timer_init_late - starts keeping the TSC clock in sync
+ *
+ * Returns 0 if successful.
+ */
+int timer_init_late(void)
+{
+	return thread_spawn_background(timer_clock_worker, NULL);
+}
@@ -0,0 +1,170 @@
+/*
+ * tls.c - per-thread (uthread) storage keys
+ *
+ * Each thread gets a table of values, indexed by key, the first time it sets
+ * one, so threads that never use keys (and context switches) don't pay for
+ * them. Keys carry a sequence number that is odd while the key is in use and
+ * is bumped when it is deleted, which invalidates the values threads still
+ * hold for it without having to visit them.
+ */
+
+#include <errno.h>
+
+#include <base/lock.h>
+#include <runtime/smalloc.h>
+#include <runtime/sync.h>
+
+#include "defs.h"
+
+/* how many times destructors are retried if they set values again */
+#define THREAD_KEY_DTOR_PASSES	4
+
+struct thread_key {
+	uint64_t	seq;
+	void		(*dtor)(void *val);
+};
+
+struct thread_tls_slot {
+	uint64_t	seq;	/* the key's sequence number when @val was set */
+	void		*val;
+};
+
+static DEFINE_SPINLOCK(thread_key_lock);
+static struct thread_key thread_keys[THREAD_KEYS_MAX];
+
+/**
+ * thread_key_create - allocates a key for per-thread values
+ * @key: set to the new key
+ * @dtor: called with a thread's non-NULL value when it exits (can be NULL)
+ *
+ * Doesn't require a thread context. Returns 0 if successful, or -EAGAIN if all
+ * keys are in use.
+ */
+int thread_key_create(unsigned int *key, void (*dtor)(void *val))
+{
+	unsigned int i;
+
+	spin_lock_np(&thread_key_lock);
+	for (i = 0; i < THREAD_KEYS_MAX; i++) {
+		if (thread_keys[i].seq & 1)
+			continue;
+		thread_keys[i].dtor = dtor;
+		store_release(&thread_keys[i].seq, thread_keys[i].seq + 1);
+		spin_unlock_np(&thread_key_lock);
+		*key = i;
+		return 0;
+	}
+	spin_unlock_np(&thread_key_lock);
+
+	return -EAGAIN;
+}
+
+/**
+ * thread_key_delete - frees a key
+ * @key: the key
+ *
+ * Values threads hold for @key are dropped without calling its destructor.
+ * Returns 0 if successful, or -EINVAL if @key isn't in use.
+ */
+int thread_key_delete(unsigned int key)
+{
+	int ret = 0;
+
+	if (key >= THREAD_KEYS_MAX)
+		return -EINVAL;
+
+	spin_lock_np(&thread_key_lock);
+	if (thread_keys[key].seq & 1)
+		store_release(&thread_keys[key].seq, thread_keys[key].seq + 1);
+	else
+		ret = -EINVAL;
+	spin_unlock_np(&thread_key_lock);
+
+	return ret;
+}
+
+/**
+ * thread_getspecific - gets the calling thread's value for a key
+ * @key: the key
+ *
+ * Returns the value, or NULL if none was set.
+ */
+void *thread_getspecific(unsigned int key)
+{
+	struct thread_tls_slot *slot;
+	thread_t *th = thread_self();
+
+	if (unlikely(key >= THREAD_KEYS_MAX) || !th->tls)
+		return NULL;
+
+	slot = &th->tls[key];
+	if (slot->seq != load_acquire(&thread_keys[key].seq))
+		return NULL;
+	return slot->val;
+}
+
+/**
+ * thread_setspecific - sets the calling thread's value for a key
+ * @key: the key
+ * @val: the value
+ *
+ * Returns 0 if successful, -EINVAL if @key isn't in use, or -ENOMEM if the
+ * thread's table couldn't be allocated.
+ */
+int thread_setspecific(unsigned int key, void *val)
+{
+	thread_t *th = thread_self();
+	uint64_t seq;
+
+	if (unlikely(key >= THREAD_KEYS_MAX))
+		return -EINVAL;
+	seq = load_acquire(&thread_keys[key].seq);
+	if (unlikely(!(seq & 1)))
+		return -EINVAL;
+
+	if (unlikely(!th->tls)) {
+		th->tls = szalloc(sizeof(*th->tls) * THREAD_KEYS_MAX);
+		if (!th->tls)
+			return -ENOMEM;
+	}
+
+	th->tls[key].seq = seq;
+	th->tls[key].val = val;
+	return 0;
+}
+
+/**
+ * thread_tls_exit - calls the destructors for the calling thread's values and
+ * frees its table
+ *
+ * Called on the thread's stack, with preemption enabled, as it exits.
+ */
+void thread_tls_exit(void)
+{
+	struct thread_tls_slot *slot;
+	thread_t *th = thread_self();
+	void (*dtor)(void *val);
+	unsigned int i, pass;
+	bool again = true;
+	void *val;
+
+	for (pass = 0; again && pass < THREAD_KEY_DTOR_PASSES; pass++) {
+		again = false;
+		for (i = 0; i < THREAD_KEYS_MAX; i++) {
+			slot = &th->tls[i];
+			if (!slot->val ||
+			    slot->seq != load_acquire(&thread_keys[i].seq))
+				continue;
+			dtor = ACCESS_ONCE(thread_keys[i].dtor);
+			val = slot->val;
+			slot->val = NULL;
+			if (dtor) {
+				dtor(val);
+				again = true;
+			}
+		}
+	}
+
+	sfree(th->tls);
+	th->tls = NULL;
+}
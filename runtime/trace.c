@@ -0,0 +1,190 @@
+/*
+ * trace.c - per-kthread rings of scheduling events for offline analysis
+ *
+ * Each kthread is the only writer of its ring, so recording an event is a few
+ * stores and a release of the head index. Dumps copy the rings without
+ * stopping the writers, then discard any entries that may have been
+ * overwritten while they were copying (as done by the iokernel's trace).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+
+#include "defs.h"
+
+BUILD_ASSERT(is_power_of_two(RTRACE_RING_SIZE));
+
+/* true while events are being recorded */
+bool rtrace_enabled;
+
+void __rtrace(int event, uint64_t arg, uint32_t aux)
+{
+	struct rtrace_entry *e;
+	struct kthread *k;
+	uint64_t head;
+
+	k = getk();
+	if (unlikely(!k->trace_ring)) {
+		putk();
+		return;
+	}
+
+	head = k->trace_head;
+	e = &k->trace_ring[head & (RTRACE_RING_SIZE - 1)];
+	e->tsc = rdtsc();
+	e->arg = arg;
+	e->aux = aux;
+	e->event = event;
+	e->pad = 0;
+	store_release(&k->trace_head, head + 1);
+	putk();
+}
+
+/**
+ * rtrace_start - starts recording events
+ *
+ * Returns 0 if successful, or -ENOMEM if the rings couldn't be allocated.
+ */
+int rtrace_start(void)
+{
+	struct rtrace_entry *ring;
+	int i;
+
+	for (i = 0; i < maxks; i++) {
+		if (allks[i]->trace_ring)
+			continue;
+		ring = aligned_alloc(CACHE_LINE_SIZE,
+				     sizeof(*ring) * RTRACE_RING_SIZE);
+		if (!ring)
+			return -ENOMEM;
+		store_release(&allks[i]->trace_ring, ring);
+	}
+
+	store_release(&rtrace_enabled, true);
+	return 0;
+}
+
+/**
+ * rtrace_stop - stops recording events, keeping the rings for a later dump
+ */
+void rtrace_stop(void)
+{
+	store_release(&rtrace_enabled, false);
+}
+
+static int rtrace_write(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, pos, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* writes a snapshot of @k's ring, returns the number of entries or < 0 */
+static ssize_t rtrace_dump_kthread(int fd, struct kthread *k,
+				   struct rtrace_entry *entries)
+{
+	struct rtrace_entry *ring = load_acquire(&k->trace_ring);
+	struct rtrace_kthread tk;
+	uint64_t first, last, start, i;
+	int ret;
+
+	tk.idx = k->idx;
+	tk.nr_entries = 0;
+	tk.nr_lost = 0;
+	if (!ring)
+		return rtrace_write(fd, &tk, sizeof(tk));
+
+	/* copy the slots that were written before @last */
+	last = load_acquire(&k->trace_head);
+	first = last > RTRACE_RING_SIZE ? last - RTRACE_RING_SIZE : 0;
+	for (i = first; i < last; i++)
+		entries[i - first] = ring[i & (RTRACE_RING_SIZE - 1)];
+
+	/* the writer may have lapped us while copying */
+	mb();
+	start = load_acquire(&k->trace_head);
+	start = start >= RTRACE_RING_SIZE ? start - RTRACE_RING_SIZE + 1 : 0;
+	start = max(start, first);
+	if (start > last)
+		start = last;
+
+	tk.nr_entries = last - start;
+	tk.nr_lost = start;
+	ret = rtrace_write(fd, &tk, sizeof(tk));
+	if (ret)
+		return ret;
+	ret = rtrace_write(fd, &entries[start - first],
+			   sizeof(*entries) * (last - start));
+	if (ret)
+		return ret;
+	return last - start;
+}
+
+/**
+ * rtrace_dump - writes a snapshot of every kthread's ring to RTRACE_PATH
+ *
+ * Tracing may stay on while dumping. Returns the number of entries written,
+ * or < 0 on failure.
+ */
+ssize_t rtrace_dump(void)
+{
+	struct rtrace_entry *entries;
+	struct rtrace_hdr hdr;
+	char path[64];
+	ssize_t ret, total = 0;
+	int fd, i;
+
+	entries = malloc(sizeof(*entries) * RTRACE_RING_SIZE);
+	if (!entries)
+		return -ENOMEM;
+
+	snprintf(path, sizeof(path), RTRACE_PATH, getpid());
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	hdr.magic = RTRACE_MAGIC;
+	hdr.cycles_per_us = cycles_per_us;
+	hdr.start_tsc = start_tsc;
+	hdr.nr_kthreads = maxks;
+	hdr.pad = 0;
+	ret = rtrace_write(fd, &hdr, sizeof(hdr));
+	if (ret)
+		goto out_close;
+
+	for (i = 0; i < maxks; i++) {
+		ret = rtrace_dump_kthread(fd, allks[i], entries);
+		if (ret < 0)
+			goto out_close;
+		total += ret;
+	}
+	ret = total;
+
+out_close:
+	close(fd);
+out:
+	free(entries);
+	return ret;
+}
@@ -0,0 +1,194 @@
+#!/bin/bash
+#
+# colocate.sh - colocates a latency-critical runtime with batch runtimes
+#
+# Runs the netbench server as the latency-critical (LC) app next to one or
+# more copies of the stress batch app, sweeps the load offered to the LC app
+# with loadgen, and prints one CSV line per load with the metrics of the
+# Shenango paper's colocation experiments: LC throughput and tail latency,
+# total batch throughput, and from the iokernel's trace (see iktrace.c), how
+# many cores the LC app was granted and the batch apps gave up, and how long
+# that took.
+#
+# The iokernel must already be running (sudo ./iokerneld). Each runtime needs
+# its own config file, and load is sent to the LC config's host_addr. loadgen
+# shouldn't share the LC app's machine, so -c gives the command that starts
+# its client elsewhere (e.g. "ssh client shenango/apps/bench/loadgen
+# client.config client"), to which the harness appends the arguments.
+#
+# A runtime that crashes marks its line and is restarted before the next
+# load, and everything the harness started is killed when it exits. Logs and
+# traces are kept in the output directory.
+#
+# usage: colocate.sh [-c client_cmd] [-l lc_cfg] [-b batch_cfg]... [-o dir]
+#                    [-n conns] [-s service_us] [-d duration_us]
+#                    [-w "threads n worker_spec"] start_rps:end_rps:step_rps
+
+set -u
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$DIR")
+
+client_cmd="$ROOT/apps/bench/loadgen $ROOT/client.config client"
+lc_cfg=$ROOT/server.config
+batch_cfgs=()
+out=colocate.$(date +%Y%m%d-%H%M%S)
+conns=32
+service_us=10
+duration_us=5000000
+worker="22 1000 sqrt"
+
+usage() {
+	sed -n '/^# usage:/,/^$/p' "$0" | sed 's/^# \{0,1\}//' >&2
+	exit 1
+}
+
+while getopts "c:l:b:o:n:s:d:w:h" opt; do
+	case $opt in
+	c) client_cmd=$OPTARG ;;
+	l) lc_cfg=$OPTARG ;;
+	b) batch_cfgs+=("$OPTARG") ;;
+	o) out=$OPTARG ;;
+	n) conns=$OPTARG ;;
+	s) service_us=$OPTARG ;;
+	d) duration_us=$OPTARG ;;
+	w) worker=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 1 ] || usage
+IFS=: read -r start_rps end_rps step_rps <<< "$1"
+[ -n "$step_rps" ] && [ "$step_rps" -gt 0 ] 2>/dev/null || usage
+[ ${#batch_cfgs[@]} -gt 0 ] || batch_cfgs=("$ROOT/apps/bench/stress.config")
+
+server_ip=$(awk '$1 == "host_addr" { print $2 }' "$lc_cfg")
+[ -n "$server_ip" ] || { echo "no host_addr in $lc_cfg" >&2; exit 1; }
+
+mkdir -p "$out" || exit 1
+iktrace=$out/iktrace
+gcc -O2 -I"$ROOT/inc" -o "$iktrace" "$DIR/iktrace.c" || exit 1
+if ! "$iktrace" -w "$out/trace.start" 2> /dev/null; then
+	echo "can't reach the iokernel; is iokerneld running?" >&2
+	exit 1
+fi
+
+# runtimes by name: lc, batch0, batch1, ...
+declare -A pids cmds lines
+
+start_runtime() {
+	local name=$1
+
+	# a new session, so the whole runtime can be killed as a group, and
+	# line-buffered so each load's log lines land before it's measured
+	setsid stdbuf -oL ${cmds[$name]} >> "$out/$name.log" 2>&1 < /dev/null &
+	pids[$name]=$!
+}
+
+alive() {
+	kill -0 "${pids[$1]}" 2>/dev/null
+}
+
+stop_runtime() {
+	local pid=${pids[$1]}
+
+	kill -TERM -- -"$pid" 2>/dev/null
+	for _ in 1 2 3 4 5; do
+		kill -0 "$pid" 2>/dev/null || break
+		sleep 1
+	done
+	kill -KILL -- -"$pid" 2>/dev/null
+	wait "$pid" 2>/dev/null
+}
+
+cleanup() {
+	local name
+
+	for name in "${!pids[@]}"; do
+		stop_runtime "$name"
+	done
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+cmds[lc]="$ROOT/apps/bench/netbench $lc_cfg server"
+for i in "${!batch_cfgs[@]}"; do
+	cmds[batch$i]="$ROOT/apps/bench/stress ${batch_cfgs[$i]} $worker"
+done
+
+# the average of the per-second throughputs stress logged after line $2
+batch_rate() {
+	tail -n +$(($2 + 1)) "$out/$1.log" |
+		awk '/\| <[0-9]> [0-9.]+$/ { s += $NF; n++ }
+		     END { printf "%.0f", n ? s / n : 0 }'
+}
+
+log_lines() {
+	wc -l < "$out/$1.log"
+}
+
+for name in "${!cmds[@]}"; do
+	start_runtime "$name"
+done
+sleep 2
+
+echo "offered_rps,lc_rps,lc_lost,lc_p50_us,lc_p99_us,lc_p999_us," \
+     "batch_ops_per_sec,lc_grants,grant_p50_us,grant_p99_us," \
+     "batch_preempts,preempt_signals,preempt_p50_us,preempt_p99_us," \
+     "status" | tr -d ' ' | tee "$out/results.csv"
+
+for ((rps = start_rps; rps <= end_rps; rps += step_rps)); do
+	status=ok
+
+	# bring back anything that died during the last load
+	for name in "${!cmds[@]}"; do
+		if ! alive "$name"; then
+			echo "restarting $name" >&2
+			start_runtime "$name"
+			sleep 2
+		fi
+	done
+
+	for name in "${!cmds[@]}"; do
+		lines[$name]=$(log_lines "$name")
+	done
+
+	# loadgen prints a header and then one line for this load
+	lc=$(timeout $((duration_us / 1000000 + 60)) $client_cmd "$conns" \
+	     "$server_ip" exponential exponential "$service_us" \
+	     "$duration_us" "$rps:$rps:1" 2>> "$out/loadgen.log" | tail -n 1)
+	lc=$(echo "$lc" | awk -F, 'NF >= 15 { print $4 "," $7 "," $10 "," \
+				   $12 "," $13 }')
+	[ -n "$lc" ] || { lc=",,,,"; status=loadgen_failed; }
+
+	if ! "$iktrace" -w "$out/trace.$rps" 2>> "$out/iktrace.log"; then
+		echo "$rps,$lc,,,,,,,,,iokernel_down" | tee -a "$out/results.csv"
+		exit 1
+	fi
+	summary=$("$iktrace" -s "$out/trace.$rps" "$duration_us")
+
+	batch=0
+	batch_pids=" "
+	for name in "${!cmds[@]}"; do
+		[ "$name" = lc ] && continue
+		batch=$((batch + $(batch_rate "$name" "${lines[$name]}")))
+		batch_pids+="${pids[$name]} "
+	done
+
+	lc_rows=$(echo "$summary" | awk -F, -v pid="${pids[lc]}" \
+		'$1 == pid { print $2 "," $3 "," $4 }')
+	preempts=$(echo "$summary" | awk -F, -v pids="$batch_pids" \
+		'index(pids, " " $1 " ") { n += $6; s += $7 }
+		 END { print n + 0 "," s + 0 }')
+	preempt_lat=$(echo "$summary" | awk -F, '$1 == "all" { print $8 "," $9 }')
+
+	for name in "${!cmds[@]}"; do
+		if ! alive "$name"; then
+			[ "$name" = lc ] && status=lc_crashed ||
+				status=batch_crashed
+		fi
+	done
+
+	echo "$rps,$lc,$batch,${lc_rows:-0,,},$preempts,$preempt_lat,$status" |
+		tee -a "$out/results.csv"
+done
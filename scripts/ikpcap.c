@@ -0,0 +1,253 @@
+/*
+ * ikpcap.c - saves the iokernel's packet capture ring as pcapng
+ *
+ * Build: gcc -O2 -I../inc -o ikpcap ikpcap.c
+ *
+ * usage: ikpcap <file>  write the captured packets to @file ("-" for stdout),
+ *                       oldest first
+ *
+ * The iokernel must be started with pcap (see iokernel/pcap.c). Each packet
+ * is marked inbound if it was received from the NIC, or outbound if a runtime
+ * sent it. Records that were overwritten before the dump are counted on
+ * stderr.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <iokernel/control.h>
+#include <iokernel/pcap.h>
+
+#define PCAPNG_SHB		0x0a0d0d0a
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER	0x1a2b3c4d
+#define PCAPNG_LINKTYPE_ETHER	1
+
+#define PCAPNG_OPT_END		0
+#define PCAPNG_OPT_IF_NAME	2
+#define PCAPNG_OPT_IF_TSRESOL	9
+#define PCAPNG_OPT_EPB_FLAGS	2
+
+/* the epb_flags direction bits */
+#define PCAPNG_INBOUND		1
+#define PCAPNG_OUTBOUND		2
+
+#define PAD4(len)		(((len) + 3) & ~3u)
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int connect_iokernel(void)
+{
+	struct sockaddr_un addr;
+	mem_key_t key = CONTROL_PCAP_KEY;
+	size_t len = 0;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	/* must match how runtimes address the socket */
+	strncpy(addr.sun_path, CONTROL_SOCK_PATH, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect to iokernel");
+		exit(1);
+	}
+
+	if (write_full(fd, &key, sizeof(key)) ||
+	    write_full(fd, &len, sizeof(len))) {
+		perror("write");
+		exit(1);
+	}
+
+	return fd;
+}
+
+/* appends a pcapng option to @pos, returns the end of it */
+static char *put_opt(char *pos, uint16_t code, const void *val, uint16_t len)
+{
+	memcpy(pos, &code, sizeof(code));
+	memcpy(pos + 2, &len, sizeof(len));
+	if (len)
+		memcpy(pos + 4, val, len);
+	memset(pos + 4 + len, 0, PAD4(len) - len);
+	return pos + 4 + PAD4(len);
+}
+
+/* fills in the type and both lengths of the block from @blk to @end */
+static size_t finish_block(char *blk, char *end, uint32_t type)
+{
+	uint32_t len = end - blk + sizeof(uint32_t);
+
+	memcpy(blk, &type, sizeof(type));
+	memcpy(blk + 4, &len, sizeof(len));
+	memcpy(end, &len, sizeof(len));
+	return len;
+}
+
+static void write_headers(int out, uint32_t snaplen)
+{
+	static const char if_name[] = "iokernel";
+	char blk[128], *pos;
+	uint32_t magic = PCAPNG_BYTE_ORDER, snap = snaplen;
+	uint16_t version[2] = { 1, 0 }, linktype[2] = { PCAPNG_LINKTYPE_ETHER };
+	int64_t section_len = -1;
+	uint8_t tsresol = 9; /* nanoseconds */
+	size_t len;
+
+	/* a section header block */
+	pos = blk + 8;
+	memcpy(pos, &magic, sizeof(magic));
+	memcpy(pos + 4, version, sizeof(version));
+	memcpy(pos + 8, &section_len, sizeof(section_len));
+	pos += 16;
+	len = finish_block(blk, pos, PCAPNG_SHB);
+	if (write_full(out, blk, len))
+		goto fail;
+
+	/* and the one interface, with timestamps in ns */
+	pos = blk + 8;
+	memcpy(pos, linktype, sizeof(linktype));
+	memcpy(pos + 4, &snap, sizeof(snap));
+	pos += 8;
+	pos = put_opt(pos, PCAPNG_OPT_IF_NAME, if_name, strlen(if_name));
+	pos = put_opt(pos, PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+	pos = put_opt(pos, PCAPNG_OPT_END, NULL, 0);
+	len = finish_block(blk, pos, PCAPNG_IDB);
+	if (write_full(out, blk, len))
+		goto fail;
+	return;
+
+fail:
+	perror("ikpcap: write");
+	exit(1);
+}
+
+static void write_record(int out, const struct ikpcap_hdr *hdr,
+			 const struct ikpcap_rec *r)
+{
+	char blk[64 + IKPCAP_MAX_SNAPLEN], *pos;
+	uint32_t words[5], flags;
+	uint64_t ns;
+	size_t len;
+
+	/* the TSC ticks cycles_per_us times a microsecond */
+	ns = hdr->now_ns - (hdr->now_tsc - r->tsc) * 1000 / hdr->cycles_per_us;
+	words[0] = 0; /* the interface */
+	words[1] = ns >> 32;
+	words[2] = ns;
+	words[3] = r->cap_len;
+	words[4] = r->wire_len;
+	flags = r->dir == IKPCAP_DIR_RX ? PCAPNG_INBOUND : PCAPNG_OUTBOUND;
+
+	pos = blk + 8;
+	memcpy(pos, words, sizeof(words));
+	pos += sizeof(words);
+	memcpy(pos, r->data, r->cap_len);
+	memset(pos + r->cap_len, 0, PAD4(r->cap_len) - r->cap_len);
+	pos += PAD4(r->cap_len);
+	pos = put_opt(pos, PCAPNG_OPT_EPB_FLAGS, &flags, sizeof(flags));
+	pos = put_opt(pos, PCAPNG_OPT_END, NULL, 0);
+	len = finish_block(blk, pos, PCAPNG_EPB);
+	if (write_full(out, blk, len)) {
+		perror("ikpcap: write");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct ikpcap_hdr hdr;
+	struct ikpcap_rec r;
+	uint32_t i;
+	int fd, out;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <file | ->\n", argv[0]);
+		return 1;
+	}
+
+	if (strcmp(argv[1], "-") == 0) {
+		out = STDOUT_FILENO;
+	} else {
+		out = creat(argv[1], 0644);
+		if (out < 0) {
+			perror("ikpcap: creat");
+			return 1;
+		}
+	}
+
+	fd = connect_iokernel();
+	if (read_full(fd, &hdr, sizeof(hdr)) || hdr.magic != IKPCAP_MAGIC ||
+	    hdr.cycles_per_us == 0) {
+		fprintf(stderr, "ikpcap: bad reply from the iokernel\n");
+		return 1;
+	}
+
+	write_headers(out, hdr.snaplen);
+	for (i = 0; i < hdr.nr_records; i++) {
+		if (read_full(fd, &r, sizeof(r)) ||
+		    r.cap_len > IKPCAP_MAX_SNAPLEN) {
+			fprintf(stderr, "ikpcap: short reply from the "
+				"iokernel\n");
+			return 1;
+		}
+		write_record(out, &hdr, &r);
+	}
+
+	close(fd);
+	if (out != STDOUT_FILENO && close(out)) {
+		perror("ikpcap: close");
+		return 1;
+	}
+
+	fprintf(stderr, "ikpcap: %u packets, %lu overwritten\n",
+		hdr.nr_records, hdr.nr_lost);
+	return 0;
+}
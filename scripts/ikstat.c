@@ -0,0 +1,216 @@
+/*
+ * ikstat.c - prints the iokernel's counters
+ *
+ * Build: gcc -O2 -I../inc -o ikstat ikstat.c
+ *
+ * usage: ikstat              print every counter's total since startup
+ *        ikstat <interval_s>  print how much each counter changed, every
+ *                             @interval_s seconds
+ *
+ * Counters that didn't change are left out. After them comes one line per
+ * running proc, with the packets and bytes it received and sent, the packets
+ * dropped on the way to it, and the cores granted to it and taken from it.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <iokernel/control.h>
+#include <iokernel/stat.h>
+
+#define IKSTAT_MAX_PROCS	4096
+
+struct snapshot {
+	struct ikstat_hdr	hdr;
+	struct ikstat_counter	*counters;
+	struct ikstat_proc	*procs;
+};
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int connect_iokernel(void)
+{
+	struct sockaddr_un addr;
+	mem_key_t key = CONTROL_STATS_KEY;
+	size_t len = 0;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	/* must match how runtimes address the socket */
+	strncpy(addr.sun_path, CONTROL_SOCK_PATH, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect to iokernel");
+		exit(1);
+	}
+
+	if (write_full(fd, &key, sizeof(key)) ||
+	    write_full(fd, &len, sizeof(len))) {
+		perror("write");
+		exit(1);
+	}
+
+	return fd;
+}
+
+static void read_snapshot(struct snapshot *s)
+{
+	int fd = connect_iokernel();
+
+	if (read_full(fd, &s->hdr, sizeof(s->hdr)) ||
+	    s->hdr.magic != IKSTAT_MAGIC ||
+	    s->hdr.nr_procs > IKSTAT_MAX_PROCS) {
+		fprintf(stderr, "ikstat: bad reply from the iokernel\n");
+		exit(1);
+	}
+
+	s->counters = calloc(s->hdr.nr_counters, sizeof(*s->counters));
+	s->procs = calloc(s->hdr.nr_procs + 1, sizeof(*s->procs));
+	if (!s->counters || !s->procs) {
+		perror("calloc");
+		exit(1);
+	}
+
+	if (read_full(fd, s->counters,
+		      sizeof(*s->counters) * s->hdr.nr_counters) ||
+	    read_full(fd, s->procs, sizeof(*s->procs) * s->hdr.nr_procs)) {
+		fprintf(stderr, "ikstat: short reply from the iokernel\n");
+		exit(1);
+	}
+
+	close(fd);
+}
+
+static void free_snapshot(struct snapshot *s)
+{
+	free(s->counters);
+	free(s->procs);
+}
+
+/* finds @uniqid in @s, or returns NULL if the proc is new */
+static const struct ikstat_proc *find_proc(const struct snapshot *s,
+					   uint64_t uniqid)
+{
+	uint32_t i;
+
+	for (i = 0; i < s->hdr.nr_procs; i++) {
+		if (s->procs[i].uniqid == uniqid)
+			return &s->procs[i];
+	}
+
+	return NULL;
+}
+
+/* prints @cur, less @last if given */
+static void print_snapshot(const struct snapshot *cur,
+			   const struct snapshot *last)
+{
+	static const struct ikstat_proc zero;
+	const struct ikstat_proc_counters *a, *b;
+	const struct ikstat_proc *lp;
+	uint64_t val;
+	uint32_t i;
+
+	printf("uptime %lu.%06lu s\n", cur->hdr.uptime_us / 1000000,
+	       cur->hdr.uptime_us % 1000000);
+
+	for (i = 0; i < cur->hdr.nr_counters; i++) {
+		val = cur->counters[i].val;
+		if (last && i < last->hdr.nr_counters)
+			val -= last->counters[i].val;
+		if (val)
+			printf("%-*.*s %lu\n", IKSTAT_NAME_LEN, IKSTAT_NAME_LEN,
+			       cur->counters[i].name, val);
+	}
+
+	printf("%8s %12s %14s %10s %12s %14s %8s %8s\n", "pid", "rx_pkts",
+	       "rx_bytes", "rx_drops", "tx_pkts", "tx_bytes", "grants",
+	       "preempts");
+	for (i = 0; i < cur->hdr.nr_procs; i++) {
+		lp = last ? find_proc(last, cur->procs[i].uniqid) : NULL;
+		a = &cur->procs[i].c;
+		b = lp ? &lp->c : &zero.c;
+		printf("%8d %12lu %14lu %10lu %12lu %14lu %8lu %8lu\n",
+		       cur->procs[i].pid, a->rx_pkts - b->rx_pkts,
+		       a->rx_bytes - b->rx_bytes, a->rx_drops - b->rx_drops,
+		       a->tx_pkts - b->tx_pkts, a->tx_bytes - b->tx_bytes,
+		       a->grants - b->grants, a->preempts - b->preempts);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	struct snapshot last, cur;
+	unsigned int interval;
+
+	if (argc == 1) {
+		read_snapshot(&cur);
+		print_snapshot(&cur, NULL);
+		free_snapshot(&cur);
+		return 0;
+	}
+
+	if (argc != 2 || (interval = atoi(argv[1])) == 0) {
+		fprintf(stderr, "usage: %s [interval_s]\n", argv[0]);
+		return 1;
+	}
+
+	read_snapshot(&last);
+	while (true) {
+		sleep(interval);
+		read_snapshot(&cur);
+		print_snapshot(&cur, &last);
+		printf("\n");
+		free_snapshot(&last);
+		last = cur;
+	}
+
+	return 0;
+}
@@ -0,0 +1,441 @@
+/*
+ * iktrace.c - dumps and decodes the iokernel's core allocation trace
+ *
+ * Build: gcc -O2 -I../inc -o iktrace iktrace.c
+ *
+ * usage: iktrace            dump the running iokernel's trace as text
+ *        iktrace -w <file>  save the raw trace to a file
+ *        iktrace -r <file>  decode a saved trace
+ *        iktrace -s <file> [last_us]
+ *                           summarize a saved trace, or its last @last_us
+ *
+ * Each line is: time (us since iokernel start), pid, kthread, core, event,
+ * reason. A GRANT is followed by either a WAKE on an idle core, or a PREEMPT
+ * of the core's current kthread, its PARK, and then a WAKE (handoff); the gaps
+ * between them are the scheduler's reaction and preemption latencies.
+ *
+ * The summary is CSV, one line per proc and a last one for all of them: the
+ * grants to the proc and their latency (GRANT to the proc's WAKE on that
+ * core), then the preemptions of the proc's kthreads, how many needed a
+ * signal, and their latency (PREEMPT to the kthread's PARK), in us.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <iokernel/control.h>
+#include <iokernel/trace.h>
+
+static const char *event_names[] = {
+	[TRACE_GRANT] = "GRANT",
+	[TRACE_PREEMPT] = "PREEMPT",
+	[TRACE_PARK] = "PARK",
+	[TRACE_WAKE] = "WAKE",
+};
+
+static const char *grant_reasons[] = {
+	"launch", "congested", "burst", "rx_backlog", "rx_wake", "demand",
+};
+static const char *preempt_reasons[] = { "request", "signal" };
+static const char *park_reasons[] = { "idle", "preempted", "forced", "race" };
+static const char *wake_reasons[] = { "idle", "handoff" };
+
+static const char *reason_name(unsigned int event, unsigned int reason)
+{
+	const char **names;
+	size_t nr;
+
+	switch (event) {
+	case TRACE_GRANT:
+		names = grant_reasons;
+		nr = sizeof(grant_reasons) / sizeof(grant_reasons[0]);
+		break;
+	case TRACE_PREEMPT:
+		names = preempt_reasons;
+		nr = sizeof(preempt_reasons) / sizeof(preempt_reasons[0]);
+		break;
+	case TRACE_PARK:
+		names = park_reasons;
+		nr = sizeof(park_reasons) / sizeof(park_reasons[0]);
+		break;
+	case TRACE_WAKE:
+		names = wake_reasons;
+		nr = sizeof(wake_reasons) / sizeof(wake_reasons[0]);
+		break;
+	default:
+		return "?";
+	}
+
+	return reason < nr ? names[reason] : "?";
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int connect_iokernel(void)
+{
+	struct sockaddr_un addr;
+	mem_key_t key = CONTROL_TRACE_KEY;
+	size_t len = 0;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	/* must match how runtimes address the socket */
+	strncpy(addr.sun_path, CONTROL_SOCK_PATH, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect to iokernel");
+		exit(1);
+	}
+
+	if (write_full(fd, &key, sizeof(key)) ||
+	    write_full(fd, &len, sizeof(len))) {
+		perror("write");
+		exit(1);
+	}
+
+	return fd;
+}
+
+static void save(int in, const char *path)
+{
+	char buf[65536];
+	ssize_t ret;
+	int out;
+
+	out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		perror(path);
+		exit(1);
+	}
+
+	while ((ret = read(in, buf, sizeof(buf))) > 0) {
+		if (write_full(out, buf, ret)) {
+			perror("write");
+			exit(1);
+		}
+	}
+
+	close(out);
+}
+
+static int pid_of(struct trace_proc *procs, uint32_t nr, uint64_t uniqid)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr; i++) {
+		if (procs[i].uniqid == uniqid)
+			return procs[i].pid;
+	}
+
+	return -1;
+}
+
+static void decode(int fd)
+{
+	struct trace_hdr hdr;
+	struct trace_proc *procs;
+	struct trace_entry e;
+	uint32_t i;
+	int pid;
+
+	if (read_full(fd, &hdr, sizeof(hdr)) || hdr.magic != TRACE_MAGIC) {
+		fprintf(stderr, "not a trace, or an unsupported version\n");
+		exit(1);
+	}
+
+	procs = calloc(hdr.nr_procs ? hdr.nr_procs : 1, sizeof(*procs));
+	if (!procs ||
+	    read_full(fd, procs, sizeof(*procs) * hdr.nr_procs)) {
+		fprintf(stderr, "truncated trace\n");
+		exit(1);
+	}
+
+	printf("# %u entries, %lu lost, %lu cycles/us\n", hdr.nr_entries,
+	       hdr.nr_lost, hdr.cycles_per_us);
+	printf("# time_us pid kthread core event reason\n");
+	for (i = 0; i < hdr.nr_entries; i++) {
+		if (read_full(fd, &e, sizeof(e))) {
+			fprintf(stderr, "truncated trace\n");
+			exit(1);
+		}
+
+		/* procs that have exited are shown by uniqid */
+		pid = pid_of(procs, hdr.nr_procs, e.uniqid);
+		printf("%.3f ", (double)(e.tsc - hdr.start_tsc) /
+		       hdr.cycles_per_us);
+		if (pid >= 0)
+			printf("%d ", pid);
+		else
+			printf("#%lx ", e.uniqid);
+		printf("%u %u %s %s\n", e.kthread, e.core,
+		       e.event < TRACE_NR ? event_names[e.event] : "?",
+		       reason_name(e.event, e.reason));
+	}
+
+	free(procs);
+}
+
+/* latencies (in cycles) of one kind of event, for computing percentiles */
+struct lat {
+	uint64_t	*v;
+	size_t		nr, cap;
+};
+
+static void lat_add(struct lat *l, uint64_t cycles)
+{
+	if (l->nr == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 64;
+		l->v = realloc(l->v, sizeof(*l->v) * l->cap);
+		if (!l->v) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	l->v[l->nr++] = cycles;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* prints the p50, p99, and max of @l, in us */
+static void lat_print(struct lat *l, uint64_t cycles_per_us)
+{
+	double us = (double)cycles_per_us;
+
+	if (l->nr == 0) {
+		printf(",,,");
+		return;
+	}
+
+	qsort(l->v, l->nr, sizeof(*l->v), cmp_u64);
+	printf(",%.3f,%.3f,%.3f", l->v[l->nr / 2] / us,
+	       l->v[l->nr * 99 / 100] / us, l->v[l->nr - 1] / us);
+}
+
+struct summary {
+	uint64_t	uniqid;
+	unsigned long	grants, preempts, signals;
+	struct lat	grant, preempt;
+};
+
+/* the GRANT or PREEMPT on each core that is waiting for its WAKE or PARK */
+struct pending {
+	uint64_t	tsc;
+	uint64_t	uniqid;
+	uint32_t	kthread;
+	bool		valid;
+};
+
+static struct summary *summary_of(struct summary **sums, size_t *nr,
+				  uint64_t uniqid)
+{
+	size_t i;
+
+	for (i = 0; i < *nr; i++) {
+		if ((*sums)[i].uniqid == uniqid)
+			return &(*sums)[i];
+	}
+
+	*sums = realloc(*sums, sizeof(**sums) * (*nr + 1));
+	if (!*sums) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memset(&(*sums)[*nr], 0, sizeof(**sums));
+	(*sums)[*nr].uniqid = uniqid;
+	return &(*sums)[(*nr)++];
+}
+
+static void summarize(int fd, uint64_t last_us)
+{
+	static struct pending grants[UINT16_MAX + 1], preempts[UINT16_MAX + 1];
+	struct summary *sums = NULL, all;
+	struct trace_hdr hdr;
+	struct trace_proc *procs;
+	struct trace_entry *e;
+	uint64_t since = 0;
+	size_t i, nr_sums = 0;
+	int pid;
+
+	if (read_full(fd, &hdr, sizeof(hdr)) || hdr.magic != TRACE_MAGIC) {
+		fprintf(stderr, "not a trace, or an unsupported version\n");
+		exit(1);
+	}
+
+	procs = calloc(hdr.nr_procs ? hdr.nr_procs : 1, sizeof(*procs));
+	e = calloc(hdr.nr_entries ? hdr.nr_entries : 1, sizeof(*e));
+	if (!procs || !e ||
+	    read_full(fd, procs, sizeof(*procs) * hdr.nr_procs) ||
+	    read_full(fd, e, sizeof(*e) * hdr.nr_entries)) {
+		fprintf(stderr, "truncated trace\n");
+		exit(1);
+	}
+
+	if (last_us && hdr.nr_entries > 0 &&
+	    e[hdr.nr_entries - 1].tsc > last_us * hdr.cycles_per_us)
+		since = e[hdr.nr_entries - 1].tsc - last_us * hdr.cycles_per_us;
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < hdr.nr_entries; i++) {
+		struct pending *p;
+		struct summary *s;
+
+		if (e[i].tsc < since)
+			continue;
+
+		switch (e[i].event) {
+		case TRACE_GRANT:
+			s = summary_of(&sums, &nr_sums, e[i].uniqid);
+			s->grants++;
+			all.grants++;
+			grants[e[i].core] = (struct pending){e[i].tsc,
+				e[i].uniqid, e[i].kthread, true};
+			break;
+		case TRACE_WAKE:
+			p = &grants[e[i].core];
+			if (!p->valid || p->uniqid != e[i].uniqid)
+				break;
+			s = summary_of(&sums, &nr_sums, e[i].uniqid);
+			lat_add(&s->grant, e[i].tsc - p->tsc);
+			lat_add(&all.grant, e[i].tsc - p->tsc);
+			p->valid = false;
+			break;
+		case TRACE_PREEMPT:
+			s = summary_of(&sums, &nr_sums, e[i].uniqid);
+			if (e[i].reason == TRACE_PREEMPT_SIGNAL) {
+				/* a retry of an earlier request, keep its time */
+				s->signals++;
+				all.signals++;
+				break;
+			}
+			s->preempts++;
+			all.preempts++;
+			preempts[e[i].core] = (struct pending){e[i].tsc,
+				e[i].uniqid, e[i].kthread, true};
+			break;
+		case TRACE_PARK:
+			p = &preempts[e[i].core];
+			if (!p->valid || p->uniqid != e[i].uniqid ||
+			    p->kthread != e[i].kthread)
+				break;
+			s = summary_of(&sums, &nr_sums, e[i].uniqid);
+			lat_add(&s->preempt, e[i].tsc - p->tsc);
+			lat_add(&all.preempt, e[i].tsc - p->tsc);
+			p->valid = false;
+			break;
+		}
+	}
+
+	printf("pid,grants,grant_p50_us,grant_p99_us,grant_max_us,preempts,"
+	       "signals,preempt_p50_us,preempt_p99_us,preempt_max_us\n");
+	for (i = 0; i < nr_sums; i++) {
+		pid = pid_of(procs, hdr.nr_procs, sums[i].uniqid);
+		if (pid >= 0)
+			printf("%d", pid);
+		else
+			printf("#%lx", sums[i].uniqid);
+		printf(",%lu", sums[i].grants);
+		lat_print(&sums[i].grant, hdr.cycles_per_us);
+		printf(",%lu,%lu", sums[i].preempts, sums[i].signals);
+		lat_print(&sums[i].preempt, hdr.cycles_per_us);
+		printf("\n");
+		free(sums[i].grant.v);
+		free(sums[i].preempt.v);
+	}
+	printf("all,%lu", all.grants);
+	lat_print(&all.grant, hdr.cycles_per_us);
+	printf(",%lu,%lu", all.preempts, all.signals);
+	lat_print(&all.preempt, hdr.cycles_per_us);
+	printf("\n");
+
+	free(all.grant.v);
+	free(all.preempt.v);
+	free(sums);
+	free(e);
+	free(procs);
+}
+
+int main(int argc, char *argv[])
+{
+	int fd;
+
+	if (argc == 1) {
+		fd = connect_iokernel();
+		decode(fd);
+	} else if (argc == 3 && !strcmp(argv[1], "-w")) {
+		fd = connect_iokernel();
+		save(fd, argv[2]);
+	} else if (argc == 3 && !strcmp(argv[1], "-r")) {
+		fd = open(argv[2], O_RDONLY);
+		if (fd < 0) {
+			perror(argv[2]);
+			return 1;
+		}
+		decode(fd);
+	} else if ((argc == 3 || argc == 4) && !strcmp(argv[1], "-s")) {
+		fd = open(argv[2], O_RDONLY);
+		if (fd < 0) {
+			perror(argv[2]);
+			return 1;
+		}
+		summarize(fd, argc == 4 ? strtoull(argv[3], NULL, 0) : 0);
+	} else {
+		fprintf(stderr, "usage: %s [-w file | -r file | -s file [last_us]]\n",
+			argv[0]);
+		return 1;
+	}
+
+	close(fd);
+	return 0;
+}
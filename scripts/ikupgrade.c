@@ -0,0 +1,67 @@
+/*
+ * ikupgrade.c - upgrades the running iokernel in place
+ *
+ * Build: gcc -O2 -I../inc -o ikupgrade ikupgrade.c
+ *
+ * usage: ikupgrade
+ *
+ * Replace the iokerneld binary first (e.g., with make), then run this as the
+ * iokernel's user. The iokernel parks every runtime and re-executes its
+ * binary, which takes the runtimes over (see iokernel/handover.c). Exits once
+ * the old image has stopped, with 0 if it is about to exec the new one.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <base/mem.h>
+#include <iokernel/control.h>
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	mem_key_t key = CONTROL_HANDOVER_KEY;
+	size_t len = 0;
+	int32_t ret;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	/* must match how runtimes address the socket */
+	strncpy(addr.sun_path, CONTROL_SOCK_PATH, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect to iokernel");
+		return 1;
+	}
+
+	if (write(fd, &key, sizeof(key)) != sizeof(key) ||
+	    write(fd, &len, sizeof(len)) != sizeof(len)) {
+		perror("write");
+		return 1;
+	}
+
+	if (read(fd, &ret, sizeof(ret)) != sizeof(ret)) {
+		fprintf(stderr, "ikupgrade: the iokernel closed the connection\n");
+		return 1;
+	}
+	if (ret) {
+		fprintf(stderr, "ikupgrade: the iokernel refused [%s]\n",
+			strerror(-ret));
+		return 1;
+	}
+
+	printf("ikupgrade: the iokernel is handing over, see its log\n");
+	return 0;
+}
@@ -1,104 +1,544 @@
+// rstat - watches Shenango runtimes through their stat ports (UDP port 40)
+//
+// usage:
+//
+//	rstat [-i secs] [-listen addr] [-plain] host...
+//	rstat host interval
+//
+// By default, rstat redraws a dashboard every interval with, for each host,
+// the totals, the percentiles of the scheduling latency, run length and
+// softirq wait histograms, and per-kthread and per-core tables of busy time,
+// steals, parks, preemptions and packet rates. Rates and percentiles cover the
+// last interval. Cores are the ones the iokernel last placed each kthread on,
+// so a core's busy time is this runtime's share of it.
+//
+// -plain prints the original two summary lines per interval instead, for one
+// host. -listen also serves every host's counters, per-kthread counters and
+// histograms at http://<addr>/metrics for Prometheus.
 package main
 
 import (
+	"encoding/binary"
+	"errors"
+	"flag"
+	"fmt"
 	"net"
+	"net/http"
 	"os"
-	"time"
+	"sort"
 	"strconv"
-	"fmt"
 	"strings"
+	"sync"
+	"time"
 )
 
-func prettyPrint(m, lastm map[string]uint64, interval int) {
-	dm := make(map[string]float64)
-	for i, v := range m {
-		dm[i] = float64(v - lastm[i]) / float64(interval)
-	}
-	fmt.Printf("net: RX %.1f pkts, %.1f bytes | TX %.1f pkts, %.1f bytes | %.1f drops | %.2f%% rx out of order (%.2f%% reorder time)\n",
-		   dm["rx_packets"], dm["rx_bytes"],
-		   dm["tx_packets"], dm["tx_bytes"], dm["drops"],
-		   dm["rx_tcp_out_of_order"] / (dm["rx_tcp_in_order"] + dm["rx_tcp_out_of_order"]) * 100,
-		   dm["rx_tcp_text_cycles"] / (dm["sched_cycles"] + dm["program_cycles"]) * 100)
-	fmt.Printf("sched: %.1f rescheds (%.1f%% sched time, %.1f%% local)," +
-		   " %.1f softirqs (%.1f%% stolen), %.1f %%CPU, %.1f parks" +
-		   " (%.1f%% migrated), %.1f preempts (%.1f stolen)\n",
-		   dm["reschedules"],
-		   dm["sched_cycles"] / (dm["sched_cycles"] + dm["program_cycles"]) * 100,
-		   (1 - dm["threads_stolen"] / dm["reschedules"]) * 100,
-		   dm["softirqs_local"] + dm["softirqs_stolen"],
-		   (dm["softirqs_stolen"] / (dm["softirqs_local"] +
-		    dm["softirqs_stolen"])) * 100,
-		   (dm["sched_cycles"] + dm["program_cycles"]) * 100 /
-		    (float64(m["cycles_per_us"]) * 1000000), dm["parks"],
-		   dm["core_migrations"] * 100 / dm["parks"],
-		   dm["preemptions"], dm["preemptions_stolen"])
+const (
+	statPort = 40
+	// how long to wait for each reply, and how many times to ask
+	replyTimeout = 20 * time.Millisecond
+	replyTries   = 3
+
+	// see inc/runtime/stat.h
+	statMagic      = 0x73746174
+	statVersion    = 1
+	statMsgDelta   = 0x1
+	statMsgKthread = 0x2
+	msgHdrLen      = 24
+	kthreadHdrLen  = 8
+)
+
+// the counters shown and exported per kthread
+var kthreadCounters = []string{
+	"sched_cycles", "program_cycles", "threads_stolen", "parks",
+	"preemptions", "rx_packets", "tx_packets",
 }
 
-func main() {
-	if len(os.Args) != 3 {
-		fmt.Fprintf(os.Stderr, "usage:%s [host] [interval]", os.Args[0])
-		os.Exit(1)
-	}
+// the histograms reported by the "sched" command
+var histNames = []string{"lat", "run", "softirq"}
+
+type bucket struct {
+	ns    uint64 // the bucket's lower bound
+	count uint64
+}
+
+type kthread struct {
+	core  int // -1 if parked
+	stats map[string]uint64
+}
+
+type snapshot struct {
+	at          time.Time
+	cyclesPerUs uint64
+	totals      map[string]uint64
+	kthreads    []kthread
+	hists       map[string][]bucket
+}
+
+type runtime struct {
+	host  string
+	c     *net.UDPConn
+	names []string
 
-	host := os.Args[1]
-	uaddr, err := net.ResolveUDPAddr("udp4", host + ":40")
+	mu   sync.Mutex
+	prev *snapshot
+	cur  *snapshot
+	err  error
+}
+
+func dial(host string) (*runtime, error) {
+	uaddr, err := net.ResolveUDPAddr("udp4",
+		net.JoinHostPort(host, strconv.Itoa(statPort)))
 	if err != nil {
-		os.Exit(1)
+		return nil, err
 	}
-
 	c, err := net.DialUDP("udp", nil, uaddr)
 	if err != nil {
-		os.Exit(1)
+		return nil, err
 	}
+	return &runtime{host: host, c: c}, nil
+}
 
-	interval, err := strconv.Atoi(os.Args[2])
+// request sends cmd and returns the reply, retrying lost ones.
+func (r *runtime) request(cmd string) ([]byte, error) {
+	var buf [1500]byte
+
+	for i := 0; i < replyTries; i++ {
+		if _, err := r.c.Write([]byte(cmd)); err != nil {
+			return nil, err
+		}
+		r.c.SetReadDeadline(time.Now().Add(replyTimeout))
+		n, err := r.c.Read(buf[0:])
+		if err == nil {
+			return append([]byte(nil), buf[:n]...), nil
+		}
+		if nerr, ok := err.(net.Error); !ok || !nerr.Timeout() {
+			return nil, err
+		}
+	}
+	return nil, fmt.Errorf("%s: no reply to %q", r.host, cmd)
+}
+
+// decodeCounters parses a binary reply (see struct stat_msg_hdr), returning
+// its header flags, its cycles per us, what follows the header and the
+// counters after @extra more bytes.
+func (r *runtime) decodeCounters(buf []byte, extra int) (uint16, uint64,
+	[]byte, map[string]uint64, error) {
+	le := binary.LittleEndian
+
+	if len(buf) < msgHdrLen+extra || le.Uint32(buf) != statMagic ||
+		le.Uint16(buf[4:]) != statVersion {
+		return 0, 0, nil, nil, errors.New("bad binary stats reply")
+	}
+	flags := le.Uint16(buf[6:])
+	nr := int(le.Uint16(buf[16:]))
+	if nr != len(r.names) || flags&statMsgDelta != 0 {
+		return 0, 0, nil, nil, errors.New("unexpected binary stats reply")
+	}
+
+	body := buf[msgHdrLen:]
+	pos := body[extra:]
+	m := make(map[string]uint64, nr)
+	for _, name := range r.names {
+		v, n := binary.Varint(pos)
+		if n <= 0 {
+			return 0, 0, nil, nil, errors.New("truncated stats reply")
+		}
+		m[name] = uint64(v)
+		pos = pos[n:]
+	}
+	return flags, uint64(le.Uint32(buf[20:])), body, m, nil
+}
+
+// parseHist parses a "sched" reply: "sched_<name>:<kthread>,<ns>:<count>,...".
+func parseHist(buf []byte) ([]bucket, error) {
+	var hist []bucket
+
+	for i, v := range strings.Split(string(buf), ",") {
+		if i == 0 {
+			continue
+		}
+		fields := strings.Split(v, ":")
+		if len(fields) != 2 {
+			return nil, fmt.Errorf("can't parse %q", v)
+		}
+		ns, err1 := strconv.ParseUint(fields[0], 10, 64)
+		count, err2 := strconv.ParseUint(fields[1], 10, 64)
+		if err1 != nil || err2 != nil {
+			return nil, fmt.Errorf("can't parse %q", v)
+		}
+		hist = append(hist, bucket{ns, count})
+	}
+	return hist, nil
+}
+
+func (r *runtime) poll() (*snapshot, error) {
+	if r.names == nil {
+		buf, err := r.request("bstat names")
+		if err != nil {
+			return nil, err
+		}
+		r.names = strings.Split(strings.TrimRight(string(buf), "\x00"),
+			"\x00")
+	}
+
+	s := &snapshot{at: time.Now(), hists: make(map[string][]bucket)}
+	buf, err := r.request("bstat")
+	if err == nil {
+		_, s.cyclesPerUs, _, s.totals, err = r.decodeCounters(buf, 0)
+	}
 	if err != nil {
-		os.Exit(1)
+		r.names = nil // the runtime may have been replaced
+		return nil, err
 	}
 
-	var buf [1500]byte
-	lastm := make(map[string]uint64)
+	for i, nr := 0, 1; i < nr; i++ {
+		buf, err := r.request(fmt.Sprintf("kstat %d", i))
+		if err != nil {
+			return nil, err
+		}
+		flags, _, body, m, err := r.decodeCounters(buf, kthreadHdrLen)
+		if err != nil || flags&statMsgKthread == 0 {
+			return nil, errors.New("bad kstat reply")
+		}
+		nr = int(binary.LittleEndian.Uint16(body[2:]))
+		core := int(int32(binary.LittleEndian.Uint32(body[4:])))
+		s.kthreads = append(s.kthreads, kthread{core, m})
+	}
 
-	for {
-		_, err = c.Write([]byte("stat"))
+	for _, name := range histNames {
+		buf, err := r.request("sched " + name)
 		if err != nil {
-			os.Exit(1)
+			return nil, err
 		}
+		if s.hists[name], err = parseHist(buf); err != nil {
+			return nil, err
+		}
+	}
+
+	return s, nil
+}
 
-		c.SetReadDeadline(time.Now().Add(time.Duration(4) * time.Millisecond))
-		n, err := c.Read(buf[0:])
+func (r *runtime) run(interval time.Duration) {
+	for {
+		s, err := r.poll()
+		r.mu.Lock()
 		if err != nil {
-			if nerr, ok := err.(net.Error); ok && nerr.Timeout() {
-				lastm = make(map[string]uint64)
-				continue
-			}
-			os.Exit(1)
+			r.prev, r.cur = nil, nil
+		} else {
+			r.prev, r.cur = r.cur, s
 		}
-		strs := strings.Split(string(buf[0:n-1]), ",")
-		m := make(map[string]uint64)
+		r.err = err
+		r.mu.Unlock()
+		time.Sleep(interval)
+	}
+}
 
-		for _, v := range strs {
+// rates returns the change per second of each counter.
+func rates(cur, prev map[string]uint64, dt float64) map[string]float64 {
+	d := make(map[string]float64, len(cur))
+	for name, v := range cur {
+		d[name] = float64(v-prev[name]) / dt
+	}
+	return d
+}
 
-			fields := strings.Split(v, ":")
-			if len(fields) != 2 {
-				fmt.Println("can't parse", v)
-				os.Exit(1)
-			}
+// histDelta returns the counts added to each bucket of @cur since @prev.
+func histDelta(cur, prev []bucket) []bucket {
+	old := make(map[uint64]uint64, len(prev))
+	for _, b := range prev {
+		old[b.ns] = b.count
+	}
+	d := make([]bucket, 0, len(cur))
+	for _, b := range cur {
+		d = append(d, bucket{b.ns, b.count - old[b.ns]})
+	}
+	return d
+}
+
+// percentile returns the lower bound (in us) of the bucket holding quantile
+// @q, or -1 if @hist is empty.
+func percentile(hist []bucket, q float64) float64 {
+	var total, sum uint64
+	for _, b := range hist {
+		total += b.count
+	}
+	if total == 0 {
+		return -1
+	}
+	for _, b := range hist {
+		sum += b.count
+		if float64(sum) >= q*float64(total) {
+			return float64(b.ns) / 1000
+		}
+	}
+	return float64(hist[len(hist)-1].ns) / 1000
+}
+
+func formatPercentiles(hist []bucket) string {
+	p := func(q float64) string {
+		v := percentile(hist, q)
+		if v < 0 {
+			return "-"
+		}
+		return strconv.FormatFloat(v, 'f', 1, 64)
+	}
+	return p(0.5) + "/" + p(0.99) + "/" + p(0.999)
+}
+
+// busy returns the share of a core (in %) spent running kthreads, from their
+// scheduler and program cycle rates @d.
+func busy(d map[string]float64, cyclesPerUs uint64) float64 {
+	return (d["sched_cycles"] + d["program_cycles"]) * 100 /
+		(float64(cyclesPerUs) * 1000000)
+}
+
+func (r *runtime) dashboard(b *strings.Builder) {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+
+	if r.err != nil {
+		fmt.Fprintf(b, "%s: %v\n\n", r.host, r.err)
+		return
+	}
+	if r.prev == nil || len(r.prev.kthreads) != len(r.cur.kthreads) {
+		fmt.Fprintf(b, "%s: waiting for data\n\n", r.host)
+		return
+	}
+	cur, prev := r.cur, r.prev
+	dt := cur.at.Sub(prev.at).Seconds()
+	d := rates(cur.totals, prev.totals, dt)
+
+	fmt.Fprintf(b, "%s: %d kthreads, %.1f%% CPU, RX %.0f pps, TX %.0f pps,"+
+		" %.0f drops/s, %.0f rescheds/s\n", r.host, len(cur.kthreads),
+		busy(d, cur.cyclesPerUs), d["rx_packets"], d["tx_packets"],
+		d["drops"], d["reschedules"])
+	fmt.Fprintf(b, "  p50/p99/p99.9 us: sched lat %s | run %s | softirq"+
+		" wait %s\n", formatPercentiles(histDelta(cur.hists["lat"],
+		prev.hists["lat"])), formatPercentiles(histDelta(cur.hists["run"],
+		prev.hists["run"])), formatPercentiles(histDelta(
+		cur.hists["softirq"], prev.hists["softirq"])))
+
+	fmt.Fprintf(b, "  %7s %5s %6s %9s %8s %10s %10s %10s\n", "kthread",
+		"core", "busy%", "steals/s", "parks/s", "preempts/s", "rx pps",
+		"tx pps")
+	cores := make(map[int][]int)
+	coreBusy := make(map[int]float64)
+	for i, k := range cur.kthreads {
+		kd := rates(k.stats, prev.kthreads[i].stats, dt)
+		// a parked kthread last ran where it was before
+		core := k.core
+		if core < 0 {
+			core = prev.kthreads[i].core
+		}
+		kb := busy(kd, cur.cyclesPerUs)
+		coreName := "-"
+		if k.core >= 0 {
+			coreName = strconv.Itoa(k.core)
+		}
+		fmt.Fprintf(b, "  %7d %5s %6.1f %9.0f %8.0f %10.0f %10.0f"+
+			" %10.0f\n", i, coreName, kb, kd["threads_stolen"],
+			kd["parks"], kd["preemptions"], kd["rx_packets"],
+			kd["tx_packets"])
+		if core >= 0 {
+			cores[core] = append(cores[core], i)
+			coreBusy[core] += kb
+		}
+	}
+
+	ids := make([]int, 0, len(cores))
+	for core := range cores {
+		ids = append(ids, core)
+	}
+	sort.Ints(ids)
+	fmt.Fprintf(b, "  %7s %6s  %s\n", "core", "busy%", "kthreads")
+	for _, core := range ids {
+		ks := make([]string, 0, len(cores[core]))
+		for _, i := range cores[core] {
+			ks = append(ks, strconv.Itoa(i))
+		}
+		fmt.Fprintf(b, "  %7d %6.1f  %s\n", core, coreBusy[core],
+			strings.Join(ks, ","))
+	}
+	b.WriteString("\n")
+}
+
+// prettyPrint prints the original two-line summary of the last interval.
+func (r *runtime) prettyPrint() {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+
+	if r.prev == nil {
+		return
+	}
+	m := r.cur.totals
+	dm := rates(m, r.prev.totals, r.cur.at.Sub(r.prev.at).Seconds())
+	fmt.Printf("net: RX %.1f pkts, %.1f bytes | TX %.1f pkts, %.1f bytes | %.1f drops | %.2f%% rx out of order (%.2f%% reorder time)\n",
+		dm["rx_packets"], dm["rx_bytes"],
+		dm["tx_packets"], dm["tx_bytes"], dm["drops"],
+		dm["rx_tcp_out_of_order"]/(dm["rx_tcp_in_order"]+dm["rx_tcp_out_of_order"])*100,
+		dm["rx_tcp_text_cycles"]/(dm["sched_cycles"]+dm["program_cycles"])*100)
+	fmt.Printf("sched: %.1f rescheds (%.1f%% sched time, %.1f%% local),"+
+		" %.1f softirqs (%.1f%% stolen), %.1f %%CPU, %.1f parks"+
+		" (%.1f%% migrated), %.1f preempts (%.1f stolen)\n",
+		dm["reschedules"],
+		dm["sched_cycles"]/(dm["sched_cycles"]+dm["program_cycles"])*100,
+		(1-dm["threads_stolen"]/dm["reschedules"])*100,
+		dm["softirqs_local"]+dm["softirqs_stolen"],
+		(dm["softirqs_stolen"]/(dm["softirqs_local"]+
+			dm["softirqs_stolen"]))*100,
+		busy(dm, r.cur.cyclesPerUs), dm["parks"],
+		dm["core_migrations"]*100/dm["parks"],
+		dm["preemptions"], dm["preemptions_stolen"])
+}
 
-			value, err := strconv.ParseUint(fields[1], 10, 64)
-			if err != nil {
-				fmt.Println("can't parse uint64", fields[1])
-				os.Exit(1)
+// metrics writes every runtime's latest counters in the Prometheus text
+// format. Histogram buckets are cumulative since the runtime started, and
+// each bucket's "le" is the lower bound of the next one, so _sum is only an
+// estimate.
+func metrics(w http.ResponseWriter, rts []*runtime) {
+	type sample struct {
+		name, labels string
+		value        float64
+	}
+	type family struct {
+		typ     string
+		samples []sample
+	}
+	families := make(map[string]*family)
+	add := func(fam, typ, name, labels string, v float64) {
+		f := families[fam]
+		if f == nil {
+			f = &family{typ: typ}
+			families[fam] = f
+		}
+		f.samples = append(f.samples, sample{name, labels, v})
+	}
+	gauge := func(name, labels string, v float64) {
+		add(name, "gauge", name, labels, v)
+	}
+	counter := func(name, labels string, v float64) {
+		add(name, "counter", name, labels, v)
+	}
+
+	for _, r := range rts {
+		r.mu.Lock()
+		host := fmt.Sprintf("host=%q", r.host)
+		if r.cur == nil {
+			gauge("shenango_up", host, 0)
+			r.mu.Unlock()
+			continue
+		}
+		s := r.cur
+		gauge("shenango_up", host, 1)
+		gauge("shenango_cycles_per_us", host, float64(s.cyclesPerUs))
+		for name, v := range s.totals {
+			counter("shenango_"+name+"_total", host, float64(v))
+		}
+		for i, k := range s.kthreads {
+			labels := fmt.Sprintf("%s,kthread=\"%d\"", host, i)
+			gauge("shenango_kthread_core", labels, float64(k.core))
+			for _, name := range kthreadCounters {
+				counter("shenango_kthread_"+name+"_total", labels,
+					float64(k.stats[name]))
 			}
+		}
+		for _, hname := range histNames {
+			fam := "shenango_sched_" + hname + "_ns"
+			var cum, sum uint64
+			for _, b := range s.hists[hname] {
+				add(fam, "histogram", fam+"_bucket",
+					fmt.Sprintf("%s,le=\"%d\"", host, b.ns),
+					float64(cum))
+				cum += b.count
+				sum += b.ns * b.count
+			}
+			add(fam, "histogram", fam+"_bucket", host+",le=\"+Inf\"",
+				float64(cum))
+			add(fam, "histogram", fam+"_sum", host, float64(sum))
+			add(fam, "histogram", fam+"_count", host, float64(cum))
+		}
+		r.mu.Unlock()
+	}
+
+	names := make([]string, 0, len(families))
+	for name := range families {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	for _, name := range names {
+		f := families[name]
+		fmt.Fprintf(w, "# TYPE %s %s\n", name, f.typ)
+		for _, s := range f.samples {
+			fmt.Fprintf(w, "%s{%s} %g\n", s.name, s.labels, s.value)
+		}
+	}
+}
+
+func usage() {
+	fmt.Fprintf(os.Stderr, "usage: %s [-i secs] [-listen addr] [-plain]"+
+		" host...\n       %s host interval\n", os.Args[0], os.Args[0])
+	os.Exit(1)
+}
+
+func main() {
+	secs := flag.Int("i", 1, "the polling interval in seconds")
+	listen := flag.String("listen", "",
+		"serve Prometheus metrics on this address")
+	plain := flag.Bool("plain", false,
+		"print summary lines for one host instead of a dashboard")
+	flag.Usage = usage
+	flag.Parse()
 
-			m[fields[0]] = value
+	hosts := flag.Args()
+	if len(hosts) == 2 {
+		// the original "rstat host interval"
+		if v, err := strconv.Atoi(hosts[1]); err == nil {
+			hosts, *secs, *plain = hosts[:1], v, true
 		}
+	}
+	if len(hosts) == 0 || *secs <= 0 || (*plain && len(hosts) != 1) {
+		usage()
+	}
+	interval := time.Duration(*secs) * time.Second
 
-		if len(lastm) > 0 {
-			prettyPrint(m, lastm, interval)
+	var rts []*runtime
+	for _, host := range hosts {
+		r, err := dial(host)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "%s: %v\n", host, err)
+			os.Exit(1)
 		}
-		lastm = m
+		rts = append(rts, r)
+		go r.run(interval)
+	}
+
+	if *listen != "" {
+		http.HandleFunc("/metrics", func(w http.ResponseWriter,
+			req *http.Request) {
+			metrics(w, rts)
+		})
+		go func() {
+			err := http.ListenAndServe(*listen, nil)
+			fmt.Fprintf(os.Stderr, "listen: %v\n", err)
+			os.Exit(1)
+		}()
+	}
 
-		time.Sleep(time.Duration(interval) * time.Second)
+	for {
+		time.Sleep(interval)
+		if *plain {
+			rts[0].prettyPrint()
+			continue
+		}
+
+		var b strings.Builder
+		b.WriteString("\033[H\033[2J")
+		fmt.Fprintf(&b, "rstat, every %v, %s\n\n", interval,
+			time.Now().Format("15:04:05"))
+		for _, r := range rts {
+			r.dashboard(&b)
+		}
+		os.Stdout.WriteString(b.String())
 	}
 }
@@ -0,0 +1,187 @@
+/*
+ * rtrace.c - converts a runtime event trace to the Chrome trace format
+ *
+ * Build: gcc -O2 -I../inc -o rtrace rtrace.c
+ *
+ * usage: rtrace <dump> > trace.json
+ *
+ * Get a dump by sending "trace on", and later "trace dump", to the runtime's
+ * stat port; it is written to /tmp/shenango-trace.<pid>. The output can be
+ * loaded into Perfetto (ui.perfetto.dev) or chrome://tracing. Each kthread is
+ * shown as its own track, with a span for every time a thread ran, a span for
+ * every softirq batch and for every time the kthread was parked, and instant
+ * events for steals and TCP retransmissions.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <runtime/trace.h>
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	char *pos = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static struct rtrace_hdr hdr;
+static int first_event = 1;
+
+static double to_us(uint64_t tsc)
+{
+	return (double)(int64_t)(tsc - hdr.start_tsc) / hdr.cycles_per_us;
+}
+
+static void emit(const char *name, const char *ph, uint32_t tid, uint64_t tsc,
+		 const char *args)
+{
+	printf("%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":1,\"tid\":%u,"
+	       "\"ts\":%.3f", first_event ? "" : ",", name, ph, tid, to_us(tsc));
+	if (!strcmp(ph, "i"))
+		printf(",\"s\":\"t\"");
+	if (args)
+		printf(",\"args\":{%s}", args);
+	printf("}");
+	first_event = 0;
+}
+
+static void emit_span(const char *name, uint32_t tid, uint64_t start,
+		      uint64_t end, const char *args)
+{
+	printf("%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+	       "\"ts\":%.3f,\"dur\":%.3f", first_event ? "" : ",", name, tid,
+	       to_us(start), to_us(end) - to_us(start));
+	if (args)
+		printf(",\"args\":{%s}", args);
+	printf("}");
+	first_event = 0;
+}
+
+static void decode_kthread(int fd)
+{
+	struct rtrace_kthread tk;
+	struct rtrace_entry e;
+	uint64_t run_start = 0, run_th = 0, park_start = 0;
+	int running = 0, parked = 0, in_softirq = 0;
+	char args[128];
+	uint32_t i, tid;
+
+	if (read_full(fd, &tk, sizeof(tk))) {
+		fprintf(stderr, "truncated trace\n");
+		exit(1);
+	}
+
+	tid = tk.idx;
+	printf("%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+	       "\"tid\":%u,\"args\":{\"name\":\"kthread %u\"}}",
+	       first_event ? "" : ",", tid, tid);
+	first_event = 0;
+	if (tk.nr_lost)
+		fprintf(stderr, "kthread %u: %lu older entries were lost\n",
+			tid, tk.nr_lost);
+
+	for (i = 0; i < tk.nr_entries; i++) {
+		if (read_full(fd, &e, sizeof(e))) {
+			fprintf(stderr, "truncated trace\n");
+			exit(1);
+		}
+
+		switch (e.event) {
+		case RTRACE_SWITCH:
+			running = 1;
+			run_start = e.tsc;
+			run_th = e.arg;
+			break;
+		case RTRACE_SCHED:
+			if (!running)
+				break;
+			snprintf(args, sizeof(args), "\"thread\":\"0x%lx\"",
+				 run_th);
+			emit_span("run", tid, run_start, e.tsc, args);
+			running = 0;
+			break;
+		case RTRACE_PARK:
+			parked = 1;
+			park_start = e.tsc;
+			break;
+		case RTRACE_UNPARK:
+			if (!parked)
+				break;
+			snprintf(args, sizeof(args), "\"core\":%lu", e.arg);
+			emit_span("parked", tid, park_start, e.tsc, args);
+			parked = 0;
+			break;
+		case RTRACE_SOFTIRQ_START:
+			snprintf(args, sizeof(args),
+				 "\"events\":%lu,\"packets\":%u", e.arg, e.aux);
+			emit("softirq", "B", tid, e.tsc, args);
+			in_softirq = 1;
+			break;
+		case RTRACE_SOFTIRQ_END:
+			/* the start may have been overwritten */
+			if (in_softirq)
+				emit("softirq", "E", tid, e.tsc, NULL);
+			in_softirq = 0;
+			break;
+		case RTRACE_STEAL:
+			snprintf(args, sizeof(args),
+				 "\"victim\":%lu,\"threads\":%u", e.arg, e.aux);
+			emit("steal", "i", tid, e.tsc, args);
+			break;
+		case RTRACE_TCP_RETRANSMIT:
+			snprintf(args, sizeof(args),
+				 "\"seq\":%lu,\"retransmits\":%u", e.arg, e.aux);
+			emit("tcp_retransmit", "i", tid, e.tsc, args);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t i;
+	int fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <dump>\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (read_full(fd, &hdr, sizeof(hdr)) || hdr.magic != RTRACE_MAGIC ||
+	    !hdr.cycles_per_us) {
+		fprintf(stderr, "not a trace, or an unsupported version\n");
+		return 1;
+	}
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (i = 0; i < hdr.nr_kthreads; i++)
+		decode_kthread(fd);
+	printf("\n]}\n");
+
+	close(fd);
+	return 0;
+}
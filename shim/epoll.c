@@ -0,0 +1,382 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <base/time.h>
+#include <runtime/thread.h>
+
+#include "socket.h"
+
+/* the most events collected from the runtime per call */
+#define SHIM_EPOLL_BATCH	64
+/* how often kernel files in a set are polled while waiting */
+#define SHIM_EPOLL_KERNEL_US	100
+
+/*
+ * Protects socket membership in epoll sets (see struct shim_fd). Taken before
+ * a set's lock.
+ */
+static DEFINE_SPINLOCK(shim_ep_lock);
+
+static struct shim_epoll *shim_epoll_lock(struct shim_fd *f)
+{
+	struct shim_epoll *ep;
+
+	spin_lock_np(&shim_ep_lock);
+	ep = f->ep;
+	if (ep)
+		spin_lock_np(&ep->lock);
+	return ep;
+}
+
+static void shim_epoll_unlock(struct shim_epoll *ep)
+{
+	if (ep)
+		spin_unlock_np(&ep->lock);
+	spin_unlock_np(&shim_ep_lock);
+}
+
+/* removes @f from its set, with both locks held */
+static void shim_epoll_remove(struct shim_epoll *ep, struct shim_fd *f)
+{
+	shim_sock_poll_unregister(f);
+	list_del_from(&ep->members, &f->ep_link);
+	if (f->ep_rearm) {
+		list_del_from(&ep->rearm, &f->ep_rearm_link);
+		f->ep_rearm = false;
+	}
+	f->ep = NULL;
+}
+
+/**
+ * shim_epoll_attach - registers a socket that just started listening or
+ * connected with its epoll set, if it's in one
+ * @f: the socket
+ */
+void shim_epoll_attach(struct shim_fd *f)
+{
+	struct shim_epoll *ep = shim_epoll_lock(f);
+
+	if (ep)
+		shim_sock_poll_register(f);
+	shim_epoll_unlock(ep);
+}
+
+/**
+ * shim_epoll_detach - removes a socket from its epoll set, if it's in one
+ * @f: the socket
+ */
+void shim_epoll_detach(struct shim_fd *f)
+{
+	struct shim_epoll *ep = shim_epoll_lock(f);
+
+	if (ep)
+		shim_epoll_remove(ep, f);
+	shim_epoll_unlock(ep);
+}
+
+/**
+ * shim_epoll_to_kernel - moves a socket that was handed to the kernel into
+ * the kernel side of its epoll set
+ * @f: the socket, whose file descriptor is now a kernel socket
+ *
+ * Returns 0 if successful, otherwise the socket was dropped from the set.
+ */
+int shim_epoll_to_kernel(struct shim_fd *f)
+{
+	struct shim_epoll *ep = shim_epoll_lock(f);
+	struct epoll_event ev;
+	int ret = 0;
+
+	if (ep) {
+		ev.events = f->ep_events;
+		ev.data.u64 = f->ep_data;
+		shim_epoll_remove(ep, f);
+		ret = SHIM_REAL(epoll_ctl)(ep->fd, EPOLL_CTL_ADD, f->fd, &ev);
+		if (ret)
+			ret = -errno;
+		else
+			ep->nr_kernel++;
+	}
+	shim_epoll_unlock(ep);
+
+	return ret;
+}
+
+/**
+ * shim_epoll_close - removes every socket from an epoll set and frees it
+ * @f: the epoll set
+ */
+void shim_epoll_close(struct shim_fd *f)
+{
+	struct shim_epoll *ep = f->epoll;
+	struct shim_fd *m;
+
+	spin_lock_np(&shim_ep_lock);
+	spin_lock_np(&ep->lock);
+	while ((m = list_top(&ep->members, struct shim_fd, ep_link)))
+		shim_epoll_remove(ep, m);
+	spin_unlock_np(&ep->lock);
+	spin_unlock_np(&shim_ep_lock);
+
+	free(ep);
+}
+
+int epoll_create1(int flags)
+{
+	struct shim_epoll *ep;
+	struct shim_fd *f;
+	int fd;
+
+	/* the placeholder is a real set, which holds any kernel files */
+	fd = SHIM_REAL(epoll_create1)(flags);
+	if (fd < 0 || !__self)
+		return fd;
+
+	ep = calloc(1, sizeof(*ep));
+	f = shim_fd_alloc(SHIM_FD_EPOLL, fd);
+	if (!ep || !f) {
+		free(ep);
+		free(f);
+		SHIM_REAL(close)(fd);
+		errno = fd >= SHIM_MAX_FDS ? EMFILE : ENOMEM;
+		return -1;
+	}
+
+	ep->fd = fd;
+	spin_lock_init(&ep->lock);
+	poll_init(&ep->w);
+	list_head_init(&ep->members);
+	list_head_init(&ep->rearm);
+	f->epoll = ep;
+	shim_fd_install(f);
+	return fd;
+}
+
+int epoll_create(int size)
+{
+	if (size <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return epoll_create1(0);
+}
+
+static int shim_epoll_ctl_kernel(struct shim_epoll *ep, int op, int fd,
+				 struct epoll_event *event)
+{
+	int ret;
+
+	ret = SHIM_REAL(epoll_ctl)(ep->fd, op, fd, event);
+	if (ret)
+		return ret;
+
+	spin_lock_np(&ep->lock);
+	if (op == EPOLL_CTL_ADD)
+		ep->nr_kernel++;
+	else if (op == EPOLL_CTL_DEL)
+		ep->nr_kernel--;
+	spin_unlock_np(&ep->lock);
+	return 0;
+}
+
+/*
+ * A socket can only be in one epoll set at a time; adding it to a second one
+ * fails with EBUSY.
+ */
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	struct shim_fd *ef = shim_fd_get(epfd), *f;
+	struct shim_epoll *ep, *cur;
+	int ret = 0;
+
+	if (!ef)
+		return SHIM_REAL(epoll_ctl)(epfd, op, fd, event);
+	if (ef->kind != SHIM_FD_EPOLL || fd == epfd)
+		return shim_ret(-EINVAL);
+	ep = ef->epoll;
+
+	f = shim_fd_get(fd);
+	if (!f)
+		return shim_epoll_ctl_kernel(ep, op, fd, event);
+	if (f->kind == SHIM_FD_EPOLL)
+		return shim_ret(-EINVAL);
+	if (op != EPOLL_CTL_DEL && !event)
+		return shim_ret(-EFAULT);
+
+	spin_lock_np(&shim_ep_lock);
+	cur = f->ep;
+	if (op == EPOLL_CTL_ADD && cur) {
+		ret = cur == ep ? -EEXIST : -EBUSY;
+		goto out;
+	} else if (op != EPOLL_CTL_ADD && cur != ep) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	spin_lock_np(&ep->lock);
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		f->ep = ep;
+		list_add_tail(&ep->members, &f->ep_link);
+		/* fallthrough */
+	case EPOLL_CTL_MOD:
+		f->ep_events = event->events;
+		f->ep_data = event->data.u64;
+		/* re-registering reports the socket again if it's ready */
+		if (f->ep_events & (EPOLLIN | EPOLLOUT))
+			shim_sock_poll_register(f);
+		else
+			shim_sock_poll_unregister(f);
+		break;
+	case EPOLL_CTL_DEL:
+		shim_epoll_remove(ep, f);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	spin_unlock_np(&ep->lock);
+
+out:
+	spin_unlock_np(&shim_ep_lock);
+	return shim_ret(ret);
+}
+
+/*
+ * Level-triggered sockets are re-registered before each wait, which reports
+ * them again if they are still ready.
+ */
+static void shim_epoll_rearm(struct shim_epoll *ep)
+{
+	struct shim_fd *f;
+
+	spin_lock_np(&ep->lock);
+	while ((f = list_pop(&ep->rearm, struct shim_fd, ep_rearm_link))) {
+		f->ep_rearm = false;
+		shim_sock_poll_register(f);
+	}
+	spin_unlock_np(&ep->lock);
+}
+
+/* converts runtime events to epoll events, returns how many were stored */
+static int shim_epoll_report(struct shim_epoll *ep, struct poll_event *pevs,
+			     int n, struct epoll_event *evs)
+{
+	struct shim_fd *f;
+	uint32_t events;
+	int i, cnt = 0;
+
+	spin_lock_np(&ep->lock);
+	rcu_read_lock();
+	for (i = 0; i < n; i++) {
+		/* the socket may have been closed since the event fired */
+		f = shim_fd_get(pevs[i].data);
+		if (!f || f->ep != ep)
+			continue;
+
+		events = 0;
+		if (pevs[i].events & POLL_IN)
+			events |= EPOLLIN | EPOLLRDNORM;
+		if (pevs[i].events & POLL_OUT)
+			events |= EPOLLOUT | EPOLLWRNORM;
+		events &= f->ep_events;
+		if (!events)
+			continue;
+
+		evs[cnt].events = events;
+		evs[cnt].data.u64 = f->ep_data;
+		cnt++;
+
+		if (f->ep_events & EPOLLONESHOT) {
+			f->ep_events = 0;
+			shim_sock_poll_unregister(f);
+		} else if (!(f->ep_events & EPOLLET) && !f->ep_rearm) {
+			list_add_tail(&ep->rearm, &f->ep_rearm_link);
+			f->ep_rearm = true;
+		}
+	}
+	rcu_read_unlock();
+	spin_unlock_np(&ep->lock);
+
+	return cnt;
+}
+
+/*
+ * Blocks the uthread until a socket is ready. If the set has kernel files,
+ * they are polled every SHIM_EPOLL_KERNEL_US instead, since waiting in the
+ * kernel would block the whole kthread.
+ */
+static int shim_epoll_wait(struct shim_epoll *ep, struct epoll_event *evs,
+			   int maxevents, int timeout)
+{
+	struct poll_event pevs[SHIM_EPOLL_BATCH];
+	uint64_t deadline_us = 0, now_us, wait_us;
+	int n, cnt, max;
+
+	if (maxevents <= 0)
+		return -EINVAL;
+	max = min(maxevents, SHIM_EPOLL_BATCH);
+	if (timeout > 0)
+		deadline_us = microtime() + (uint64_t)timeout * 1000;
+
+	shim_epoll_rearm(ep);
+
+	while (true) {
+		n = poll_try_wait(&ep->w, pevs, max);
+		cnt = shim_epoll_report(ep, pevs, n, evs);
+		if (ACCESS_ONCE(ep->nr_kernel) > 0 && cnt < maxevents) {
+			n = SHIM_REAL(epoll_wait)(ep->fd, evs + cnt,
+						  maxevents - cnt, 0);
+			if (n < 0 && !cnt)
+				return -errno;
+			cnt += max(n, 0);
+		}
+		if (cnt || timeout == 0)
+			return cnt;
+
+		now_us = microtime();
+		if (timeout > 0 && now_us >= deadline_us)
+			return 0;
+
+		/* zero waits until a socket is ready */
+		wait_us = timeout > 0 ? deadline_us - now_us : 0;
+		if (ACCESS_ONCE(ep->nr_kernel) > 0) {
+			wait_us = wait_us ? min(wait_us, SHIM_EPOLL_KERNEL_US) :
+				  SHIM_EPOLL_KERNEL_US;
+		}
+
+		if (wait_us)
+			n = poll_wait_timeout(&ep->w, pevs, max, wait_us);
+		else
+			n = poll_wait(&ep->w, pevs, max);
+		cnt = shim_epoll_report(ep, pevs, n, evs);
+		if (cnt)
+			return cnt;
+	}
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+	       int timeout)
+{
+	struct shim_fd *ef = shim_fd_get(epfd);
+
+	if (!ef)
+		return SHIM_REAL(epoll_wait)(epfd, events, maxevents, timeout);
+	if (ef->kind != SHIM_FD_EPOLL)
+		return shim_ret(-EINVAL);
+	return shim_ret(shim_epoll_wait(ef->epoll, events, maxevents, timeout));
+}
+
+/* uthreads don't block signals, so @sigmask is ignored for runtime sets */
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout, const sigset_t *sigmask)
+{
+	struct shim_fd *ef = shim_fd_get(epfd);
+
+	if (!ef)
+		return SHIM_REAL(epoll_pwait)(epfd, events, maxevents, timeout,
+					      sigmask);
+	if (ef->kind != SHIM_FD_EPOLL)
+		return shim_ret(-EINVAL);
+	return shim_ret(shim_epoll_wait(ef->epoll, events, maxevents, timeout));
+}
@@ -0,0 +1,142 @@
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <runtime/offload.h>
+#include <runtime/thread.h>
+
+#include "socket.h"
+
+/* what I/O on a kernel file descriptor does, cached per file descriptor */
+enum {
+	SHIM_KFD_UNKNOWN = 0,
+	SHIM_KFD_DIRECT,	/* sockets, pipes, etc., passed through */
+	SHIM_KFD_OFFLOAD,	/* regular files and block devices */
+};
+
+static uint8_t shim_kfd_class[SHIM_MAX_FDS];
+
+/**
+ * shim_kfd_offload - decides whether a call on a kernel file descriptor should
+ * run on an offload helper
+ * @fd: the file descriptor
+ *
+ * Disk I/O can block for milliseconds, which would stall every uthread on the
+ * calling kthread. Other files are usually nonblocking or event-driven, and
+ * pay less for the call than for the handoff.
+ */
+bool shim_kfd_offload(int fd)
+{
+	struct stat st;
+	uint8_t c;
+
+	if (!__self || (unsigned int)fd >= SHIM_MAX_FDS)
+		return false;
+
+	c = ACCESS_ONCE(shim_kfd_class[fd]);
+	if (likely(c != SHIM_KFD_UNKNOWN))
+		return c == SHIM_KFD_OFFLOAD;
+
+	if (fstat(fd, &st))
+		return false;
+	c = S_ISREG(st.st_mode) || S_ISBLK(st.st_mode) ?
+	    SHIM_KFD_OFFLOAD : SHIM_KFD_DIRECT;
+	ACCESS_ONCE(shim_kfd_class[fd]) = c;
+	return c == SHIM_KFD_OFFLOAD;
+}
+
+/**
+ * shim_kfd_forget - drops what is known about a file descriptor being closed
+ * @fd: the file descriptor
+ */
+void shim_kfd_forget(int fd)
+{
+	if ((unsigned int)fd < SHIM_MAX_FDS)
+		ACCESS_ONCE(shim_kfd_class[fd]) = SHIM_KFD_UNKNOWN;
+}
+
+ssize_t pread(int fd, void *buf, size_t len, off_t off)
+{
+	if (!shim_kfd_offload(fd))
+		return SHIM_REAL(pread)(fd, buf, len, off);
+	return shim_ret(offload_syscall(SYS_pread64, (long)fd, buf, len,
+					 off));
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	if (!shim_kfd_offload(fd))
+		return SHIM_REAL(pwrite)(fd, buf, len, off);
+	return shim_ret(offload_syscall(SYS_pwrite64, (long)fd, buf, len,
+					 off));
+}
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t off)
+{
+	if (!shim_kfd_offload(fd))
+		return SHIM_REAL(preadv)(fd, iov, iovcnt, off);
+	return shim_ret(offload_syscall(SYS_preadv, (long)fd, iov,
+					 (long)iovcnt, off, 0L));
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t off)
+{
+	if (!shim_kfd_offload(fd))
+		return SHIM_REAL(pwritev)(fd, iov, iovcnt, off);
+	return shim_ret(offload_syscall(SYS_pwritev, (long)fd, iov,
+					 (long)iovcnt, off, 0L));
+}
+
+int fsync(int fd)
+{
+	if (!__self)
+		return SHIM_REAL(fsync)(fd);
+	return shim_ret(offload_syscall(SYS_fsync, (long)fd));
+}
+
+int fdatasync(int fd)
+{
+	if (!__self)
+		return SHIM_REAL(fdatasync)(fd);
+	return shim_ret(offload_syscall(SYS_fdatasync, (long)fd));
+}
+
+struct shim_getaddrinfo_args {
+	const char *node;
+	const char *service;
+	const struct addrinfo *hints;
+	struct addrinfo **res;
+	int err;	/* errno, for EAI_SYSTEM */
+};
+
+static long shim_do_getaddrinfo(void *arg)
+{
+	struct shim_getaddrinfo_args *a = arg;
+	int ret;
+
+	ret = SHIM_REAL(getaddrinfo)(a->node, a->service, a->hints, a->res);
+	a->err = errno;
+	return ret;
+}
+
+/* name lookups can wait on DNS servers for seconds */
+int getaddrinfo(const char *node, const char *service,
+		const struct addrinfo *hints, struct addrinfo **res)
+{
+	struct shim_getaddrinfo_args a;
+	int ret;
+
+	if (!__self)
+		return SHIM_REAL(getaddrinfo)(node, service, hints, res);
+
+	a.node = node;
+	a.service = service;
+	a.hints = hints;
+	a.res = res;
+	ret = offload_call(shim_do_getaddrinfo, &a);
+	if (ret == EAI_SYSTEM)
+		errno = a.err;
+	return ret;
+}
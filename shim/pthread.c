@@ -142,3 +142,47 @@ int pthread_yield(void)
 	thread_yield();
 	return 0;
 }
+
+/*
+ * Keys are always allocated by the runtime, so they mean the same thing in and
+ * out of uthreads. Outside of uthreads, values live in a per-kthread table and
+ * their destructors aren't called.
+ */
+static __thread void *shim_key_vals[THREAD_KEYS_MAX];
+
+int pthread_key_create(pthread_key_t *key, void (*destructor)(void *))
+{
+	unsigned int k;
+	int ret;
+
+	ret = thread_key_create(&k, destructor);
+	if (ret)
+		return -ret;
+	*key = k;
+	return 0;
+}
+
+int pthread_key_delete(pthread_key_t key)
+{
+	return -thread_key_delete(key);
+}
+
+void *pthread_getspecific(pthread_key_t key)
+{
+	if (unlikely(!__self))
+		return key < THREAD_KEYS_MAX ? shim_key_vals[key] : NULL;
+
+	return thread_getspecific(key);
+}
+
+int pthread_setspecific(pthread_key_t key, const void *value)
+{
+	if (unlikely(!__self)) {
+		if (key >= THREAD_KEYS_MAX)
+			return EINVAL;
+		shim_key_vals[key] = (void *)value;
+		return 0;
+	}
+
+	return -thread_setspecific(key, (void *)value);
+}
@@ -0,0 +1,1082 @@
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/thread.h>
+
+#include "socket.h"
+
+/* the range tried when binding to port zero */
+#define SHIM_PORT_MIN		49152
+#define SHIM_PORT_MAX		65535
+#define SHIM_PORT_TRIES		64
+
+/*
+ * With _GNU_SOURCE, glibc declares socket address arguments as transparent
+ * unions, so the definitions below must take them the same way.
+ */
+#define SHIM_SA(arg)		((arg).__sockaddr__)
+
+struct shim_fd *shim_fds[SHIM_MAX_FDS];
+
+/**
+ * shim_fd_alloc - allocates a shim object for a placeholder file descriptor
+ * @kind: one of SHIM_FD_*
+ * @fd: the placeholder
+ *
+ * Returns the object, or NULL if out of memory or @fd is too large. Call
+ * shim_fd_install() to make it visible.
+ */
+struct shim_fd *shim_fd_alloc(int kind, int fd)
+{
+	struct shim_fd *f;
+
+	if (fd >= SHIM_MAX_FDS)
+		return NULL;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+
+	f->kind = kind;
+	f->fd = fd;
+	mutex_init(&f->lock);
+	return f;
+}
+
+/**
+ * shim_fd_install - makes a shim object visible through its file descriptor
+ * @f: the object
+ */
+void shim_fd_install(struct shim_fd *f)
+{
+	store_release(&shim_fds[f->fd], f);
+}
+
+static void shim_fd_free(struct rcu_head *head)
+{
+	free(container_of(head, struct shim_fd, rcu));
+}
+
+/**
+ * shim_fd_release - removes a shim object from the table and frees it
+ * @f: the object
+ *
+ * It's freed after an RCU grace period, and the caller must then close the
+ * placeholder, so the kernel can't reuse its number while still in the table.
+ */
+void shim_fd_release(struct shim_fd *f)
+{
+	store_release(&shim_fds[f->fd], NULL);
+	rcu_free(&f->rcu, shim_fd_free);
+}
+
+static int shim_sockaddr_to_netaddr(const struct sockaddr *sa, socklen_t len,
+				    struct netaddr *a)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+
+	memset(a, 0, sizeof(*a));
+	if (!sa || len < sizeof(sa->sa_family))
+		return -EINVAL;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		if (len < sizeof(*sin))
+			return -EINVAL;
+		a->ip = ntohl(sin->sin_addr.s_addr);
+		a->port = ntohs(sin->sin_port);
+		return 0;
+
+	case AF_INET6:
+		if (len < sizeof(*sin6))
+			return -EINVAL;
+		a->port = ntohs(sin6->sin6_port);
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			a->ip = ntohl(sin6->sin6_addr.s6_addr32[3]);
+			return 0;
+		}
+		a->family = NET_AF_INET6;
+		memcpy(&a->ip6, &sin6->sin6_addr, sizeof(a->ip6));
+		return 0;
+
+	default:
+		return -EAFNOSUPPORT;
+	}
+}
+
+static void shim_netaddr_to_sockaddr(struct shim_fd *f,
+				     const struct netaddr *a,
+				     struct sockaddr *sa, socklen_t *len)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+	const void *src;
+	socklen_t size;
+
+	if (!sa || !len)
+		return;
+
+	if (f->domain == AF_INET) {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(a->port);
+		sin.sin_addr.s_addr = htonl(a->ip);
+		src = &sin;
+		size = sizeof(sin);
+	} else {
+		memset(&sin6, 0, sizeof(sin6));
+		sin6.sin6_family = AF_INET6;
+		sin6.sin6_port = htons(a->port);
+		if (a->family == NET_AF_INET6) {
+			memcpy(&sin6.sin6_addr, &a->ip6, sizeof(a->ip6));
+		} else if (a->ip) {
+			/* an IPv4 peer of a dual-stack socket */
+			sin6.sin6_addr.s6_addr16[5] = 0xffff;
+			sin6.sin6_addr.s6_addr32[3] = htonl(a->ip);
+		}
+		src = &sin6;
+		size = sizeof(sin6);
+	}
+
+	memcpy(sa, src, min(*len, size));
+	*len = size;
+}
+
+/* the runtime can't reach loopback addresses, the kernel handles those */
+static bool shim_netaddr_is_loopback(const struct netaddr *a)
+{
+	static const struct ip6_addr ip6_loopback = {
+		.addr = { [15] = 1 },
+	};
+
+	if (a->family == NET_AF_INET6)
+		return ip6_addr_equal(&a->ip6, &ip6_loopback);
+	return (a->ip >> 24) == 127;
+}
+
+/* the default local address of a socket that wasn't bound */
+static struct netaddr shim_laddr(struct shim_fd *f,
+				 const struct netaddr *raddr)
+{
+	struct netaddr laddr;
+
+	if (f->bound)
+		return f->laddr;
+
+	memset(&laddr, 0, sizeof(laddr));
+	if (raddr)
+		laddr.family = raddr->family;
+	else if (f->domain == AF_INET6)
+		laddr.family = NET_AF_INET6;
+	return laddr;
+}
+
+/**
+ * shim_sock_poll_register - reports a socket's readiness to its epoll set
+ * @f: the socket
+ *
+ * Must be called with the set's lock held. Sockets that aren't listening or
+ * connected yet are registered when they are.
+ */
+void shim_sock_poll_register(struct shim_fd *f)
+{
+	poll_waiter_t *w = &f->ep->w;
+
+	if (!(f->ep_events & (EPOLLIN | EPOLLOUT)))
+		return;
+
+	if (f->c)
+		tcp_poll_register(f->c, w, f->fd);
+	else if (f->q)
+		tcp_qpoll_register(f->q, w, f->fd);
+	else if (f->u)
+		udp_poll_register(f->u, w, f->fd);
+}
+
+/**
+ * shim_sock_poll_unregister - stops reporting a socket's readiness
+ * @f: the socket
+ */
+void shim_sock_poll_unregister(struct shim_fd *f)
+{
+	if (f->c)
+		tcp_poll_unregister(f->c);
+	else if (f->q)
+		tcp_qpoll_unregister(f->q);
+	else if (f->u)
+		udp_poll_unregister(f->u);
+}
+
+static void shim_sock_set_nonblocking(struct shim_fd *f, bool nonblock)
+{
+	if (f->c)
+		tcp_set_nonblocking(f->c, nonblock);
+	else if (f->q)
+		tcp_qset_nonblocking(f->q, nonblock);
+	else if (f->u)
+		udp_set_nonblocking(f->u, nonblock);
+}
+
+/* listens on @laddr, picking a free port if its port is zero */
+static int shim_sock_listen(struct shim_fd *f, struct netaddr laddr,
+			    int backlog)
+{
+	unsigned int range = SHIM_PORT_MAX - SHIM_PORT_MIN + 1;
+	unsigned int start = rdtsc() % range;
+	bool any = laddr.port == 0;
+	int i, ret;
+
+	assert_mutex_held(&f->lock);
+
+	for (i = 0; i < (any ? SHIM_PORT_TRIES : 1); i++) {
+		if (any)
+			laddr.port = SHIM_PORT_MIN + (start + i) % range;
+		if (f->type == SOCK_STREAM)
+			ret = tcp_listen(laddr, backlog, &f->q);
+		else
+			ret = udp_listen(laddr, &f->u);
+		if (ret != -EADDRINUSE)
+			break;
+	}
+	if (ret)
+		return ret;
+
+	f->laddr = laddr;
+	f->bound = true;
+	if (f->nonblock)
+		shim_sock_set_nonblocking(f, true);
+	shim_epoll_attach(f);
+	return 0;
+}
+
+/* binds a UDP socket to an ephemeral port the first time it's used */
+static int shim_udp_autobind(struct shim_fd *f)
+{
+	int ret = 0;
+
+	if (load_acquire(&f->u))
+		return 0;
+
+	mutex_lock(&f->lock);
+	if (!f->u)
+		ret = shim_sock_listen(f, shim_laddr(f, NULL), 0);
+	mutex_unlock(&f->lock);
+	return ret;
+}
+
+/*
+ * Hands a socket that hasn't been used yet over to the kernel, in place of
+ * its placeholder. If successful, unlocks and frees @f.
+ */
+static int shim_sock_to_kernel(struct shim_fd *f)
+{
+	int kfd, flags, ret;
+
+	assert_mutex_held(&f->lock);
+
+	if (f->bound || f->c || f->q || f->u)
+		return -EINVAL;
+
+	kfd = SHIM_REAL(socket)(f->domain,
+				f->type | (f->nonblock ? SOCK_NONBLOCK : 0), 0);
+	if (kfd < 0)
+		return -errno;
+
+	flags = SHIM_REAL(fcntl)(f->fd, F_GETFD);
+	ret = dup3(kfd, f->fd, (flags & FD_CLOEXEC) ? O_CLOEXEC : 0);
+	SHIM_REAL(close)(kfd);
+	if (ret < 0)
+		return -errno;
+
+	ret = shim_epoll_to_kernel(f);
+	if (ret)
+		log_warn("shim: fd %d left its epoll set (%d)", f->fd, ret);
+	mutex_unlock(&f->lock);
+	shim_fd_release(f);
+	return 0;
+}
+
+int socket(int domain, int type, int protocol)
+{
+	int base = type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+	struct shim_fd *f;
+	int fd;
+
+	if (!__self || (domain != AF_INET && domain != AF_INET6))
+		return SHIM_REAL(socket)(domain, type, protocol);
+	if (!(base == SOCK_STREAM && (!protocol || protocol == IPPROTO_TCP)) &&
+	    !(base == SOCK_DGRAM && (!protocol || protocol == IPPROTO_UDP)))
+		return SHIM_REAL(socket)(domain, type, protocol);
+
+	fd = eventfd(0, (type & SOCK_CLOEXEC) ? EFD_CLOEXEC : 0);
+	if (fd < 0)
+		return -1;
+
+	f = shim_fd_alloc(base == SOCK_STREAM ? SHIM_FD_TCP : SHIM_FD_UDP, fd);
+	if (!f) {
+		SHIM_REAL(close)(fd);
+		errno = fd >= SHIM_MAX_FDS ? EMFILE : ENOMEM;
+		return -1;
+	}
+
+	f->domain = domain;
+	f->type = base;
+	f->nonblock = !!(type & SOCK_NONBLOCK);
+	shim_fd_install(f);
+	return fd;
+}
+
+int bind(int fd, __CONST_SOCKADDR_ARG addr, socklen_t len)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	struct netaddr laddr;
+	int ret;
+
+	if (!f)
+		return SHIM_REAL(bind)(fd, addr, len);
+	if (f->kind == SHIM_FD_EPOLL)
+		return shim_ret(-ENOTSOCK);
+
+	ret = shim_sockaddr_to_netaddr(SHIM_SA(addr), len, &laddr);
+	if (ret)
+		return shim_ret(ret);
+
+	mutex_lock(&f->lock);
+	if (shim_netaddr_is_loopback(&laddr)) {
+		ret = shim_sock_to_kernel(f);
+		if (ret) {
+			mutex_unlock(&f->lock);
+			return shim_ret(ret);
+		}
+		return SHIM_REAL(bind)(fd, addr, len);
+	}
+
+	if (f->bound || f->state != SHIM_TCP_NEW) {
+		ret = -EINVAL;
+	} else if (f->type == SOCK_DGRAM) {
+		/* UDP sockets receive as soon as they are bound */
+		ret = shim_sock_listen(f, laddr, 0);
+	} else {
+		f->laddr = laddr;
+		f->bound = true;
+	}
+	mutex_unlock(&f->lock);
+
+	return shim_ret(ret);
+}
+
+int listen(int fd, int backlog)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	int ret;
+
+	if (!f)
+		return SHIM_REAL(listen)(fd, backlog);
+	if (f->type != SOCK_STREAM || f->kind != SHIM_FD_TCP)
+		return shim_ret(f->kind == SHIM_FD_EPOLL ? -ENOTSOCK :
+				-EOPNOTSUPP);
+
+	mutex_lock(&f->lock);
+	if (f->state == SHIM_TCP_LISTEN) {
+		ret = 0;
+	} else if (f->state != SHIM_TCP_NEW) {
+		ret = -EINVAL;
+	} else {
+		ret = shim_sock_listen(f, shim_laddr(f, NULL),
+				       max(backlog, 1));
+		if (!ret)
+			store_release(&f->state, SHIM_TCP_LISTEN);
+	}
+	mutex_unlock(&f->lock);
+
+	return shim_ret(ret);
+}
+
+int accept4(int fd, __SOCKADDR_ARG addr, socklen_t *len, int flags)
+{
+	struct shim_fd *f = shim_fd_get(fd), *nf;
+	struct netaddr raddr;
+	tcpconn_t *c;
+	int nfd, ret;
+
+	if (!f)
+		return SHIM_REAL(accept4)(fd, addr, len, flags);
+	if (load_acquire(&f->state) != SHIM_TCP_LISTEN)
+		return shim_ret(-EINVAL);
+
+	ret = tcp_accept(f->q, &c);
+	if (ret)
+		return shim_ret(ret);
+
+	nfd = eventfd(0, (flags & SOCK_CLOEXEC) ? EFD_CLOEXEC : 0);
+	if (nfd < 0) {
+		tcp_close(c);
+		return -1;
+	}
+	nf = shim_fd_alloc(SHIM_FD_TCP, nfd);
+	if (!nf) {
+		tcp_close(c);
+		SHIM_REAL(close)(nfd);
+		errno = nfd >= SHIM_MAX_FDS ? EMFILE : ENOMEM;
+		return -1;
+	}
+
+	nf->domain = f->domain;
+	nf->type = SOCK_STREAM;
+	nf->state = SHIM_TCP_CONN;
+	nf->nonblock = !!(flags & SOCK_NONBLOCK);
+	nf->laddr = tcp_local_addr(c);
+	nf->bound = true;
+	nf->c = c;
+	if (nf->nonblock)
+		tcp_set_nonblocking(c, true);
+	shim_fd_install(nf);
+
+	raddr = tcp_remote_addr(c);
+	shim_netaddr_to_sockaddr(nf, &raddr, SHIM_SA(addr), len);
+	return nfd;
+}
+
+int accept(int fd, __SOCKADDR_ARG addr, socklen_t *len)
+{
+	if (!shim_fd_get(fd))
+		return SHIM_REAL(accept)(fd, addr, len);
+	return accept4(fd, addr, len, 0);
+}
+
+/*
+ * Connecting blocks the calling uthread even on a nonblocking socket, since
+ * uthreads are cheap. Returning 0 there is valid, so callers that expect
+ * EINPROGRESS still work.
+ */
+int connect(int fd, __CONST_SOCKADDR_ARG addr, socklen_t len)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	struct netaddr laddr, raddr;
+	udpconn_t *u;
+	int ret;
+
+	if (!f)
+		return SHIM_REAL(connect)(fd, addr, len);
+	if (f->kind == SHIM_FD_EPOLL)
+		return shim_ret(-ENOTSOCK);
+
+	ret = shim_sockaddr_to_netaddr(SHIM_SA(addr), len, &raddr);
+	if (ret)
+		return shim_ret(ret);
+
+	mutex_lock(&f->lock);
+	if (shim_netaddr_is_loopback(&raddr)) {
+		ret = shim_sock_to_kernel(f);
+		if (ret) {
+			mutex_unlock(&f->lock);
+			return shim_ret(ret);
+		}
+		return SHIM_REAL(connect)(fd, addr, len);
+	}
+
+	laddr = shim_laddr(f, &raddr);
+	if (f->type == SOCK_STREAM) {
+		if (f->state != SHIM_TCP_NEW) {
+			ret = f->state == SHIM_TCP_CONN ? -EISCONN : -EINVAL;
+			goto out;
+		}
+		ret = tcp_dial(laddr, raddr, &f->c);
+		if (ret)
+			goto out;
+		f->laddr = tcp_local_addr(f->c);
+		f->bound = true;
+		if (f->nonblock)
+			tcp_set_nonblocking(f->c, true);
+		store_release(&f->state, SHIM_TCP_CONN);
+		shim_epoll_attach(f);
+		goto out;
+	}
+
+	/* a UDP socket keeps its local address, but gets a fixed peer */
+	ret = udp_dial(laddr, raddr, &u);
+	if (ret == -EADDRINUSE && f->u) {
+		shim_epoll_detach(f);
+		udp_close(f->u);
+		f->u = NULL;
+		ret = udp_dial(laddr, raddr, &u);
+	} else if (!ret && f->u) {
+		shim_epoll_detach(f);
+		udp_close(f->u);
+	}
+	if (ret)
+		goto out;
+	store_release(&f->u, u);
+	f->laddr = udp_local_addr(u);
+	f->bound = true;
+	if (f->nonblock)
+		udp_set_nonblocking(u, true);
+	shim_epoll_attach(f);
+
+out:
+	mutex_unlock(&f->lock);
+	return shim_ret(ret);
+}
+
+/*
+ * Runs a socket call without blocking for MSG_DONTWAIT. Another thread's
+ * concurrent call on the same socket may also fail with EAGAIN meanwhile.
+ */
+#define SHIM_DONTWAIT(f, flags, call)					\
+({									\
+	bool __dontwait = ((flags) & MSG_DONTWAIT) && !(f)->nonblock;	\
+	ssize_t __ret;							\
+	if (__dontwait)							\
+		shim_sock_set_nonblocking(f, true);			\
+	__ret = (call);							\
+	if (__dontwait)							\
+		shim_sock_set_nonblocking(f, false);			\
+	__ret;								\
+})
+
+static ssize_t shim_tcp_recv(struct shim_fd *f, void *buf, size_t len,
+			     int flags)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	if (load_acquire(&f->state) != SHIM_TCP_CONN)
+		return -ENOTCONN;
+	if (!(flags & MSG_WAITALL) || (flags & MSG_DONTWAIT) || f->nonblock)
+		return SHIM_DONTWAIT(f, flags, tcp_read(f->c, buf, len));
+
+	while (done < len) {
+		ret = tcp_read(f->c, (char *)buf + done, len - done);
+		if (ret <= 0)
+			return done ? done : ret;
+		done += ret;
+	}
+	return done;
+}
+
+static ssize_t shim_recv(struct shim_fd *f, void *buf, size_t len, int flags,
+			 struct sockaddr *addr, socklen_t *addrlen)
+{
+	struct netaddr raddr;
+	ssize_t ret;
+
+	if (f->kind == SHIM_FD_EPOLL)
+		return -EINVAL;
+	if (flags & (MSG_PEEK | MSG_OOB | MSG_ERRQUEUE))
+		return -EOPNOTSUPP;
+
+	if (f->type == SOCK_STREAM) {
+		ret = shim_tcp_recv(f, buf, len, flags);
+		if (ret >= 0 && addr && addrlen) {
+			raddr = tcp_remote_addr(f->c);
+			shim_netaddr_to_sockaddr(f, &raddr, addr, addrlen);
+		}
+		return ret;
+	}
+
+	ret = shim_udp_autobind(f);
+	if (ret)
+		return ret;
+	ret = SHIM_DONTWAIT(f, flags, udp_read_from(f->u, buf, len, &raddr));
+	if (ret >= 0)
+		shim_netaddr_to_sockaddr(f, &raddr, addr, addrlen);
+	return ret;
+}
+
+static ssize_t shim_send(struct shim_fd *f, const void *buf, size_t len,
+			 int flags, const struct sockaddr *addr,
+			 socklen_t addrlen)
+{
+	struct netaddr raddr;
+	ssize_t ret;
+
+	if (f->kind == SHIM_FD_EPOLL)
+		return -EINVAL;
+	if (flags & MSG_OOB)
+		return -EOPNOTSUPP;
+
+	if (f->type == SOCK_STREAM) {
+		if (load_acquire(&f->state) != SHIM_TCP_CONN)
+			return -ENOTCONN;
+		return SHIM_DONTWAIT(f, flags, tcp_write(f->c, buf, len));
+	}
+
+	if (addr) {
+		ret = shim_sockaddr_to_netaddr(addr, addrlen, &raddr);
+		if (ret)
+			return ret;
+	}
+	ret = shim_udp_autobind(f);
+	if (ret)
+		return ret;
+	return SHIM_DONTWAIT(f, flags, udp_write_to(f->u, buf, len,
+						    addr ? &raddr : NULL));
+}
+
+ssize_t read(int fd, void *buf, size_t len)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+
+	if (!f) {
+		if (shim_kfd_offload(fd))
+			return shim_ret(offload_syscall(SYS_read, (long)fd,
+							buf, len));
+		return SHIM_REAL(read)(fd, buf, len);
+	}
+	return shim_ret(shim_recv(f, buf, len, 0, NULL, NULL));
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+
+	if (!f)
+		return SHIM_REAL(recv)(fd, buf, len, flags);
+	return shim_ret(shim_recv(f, buf, len, flags, NULL, NULL));
+}
+
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags,
+		 __SOCKADDR_ARG addr, socklen_t *addrlen)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+
+	if (!f)
+		return SHIM_REAL(recvfrom)(fd, buf, len, flags, addr, addrlen);
+	return shim_ret(shim_recv(f, buf, len, flags, SHIM_SA(addr), addrlen));
+}
+
+ssize_t write(int fd, const void *buf, size_t len)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+
+	if (!f) {
+		if (shim_kfd_offload(fd))
+			return shim_ret(offload_syscall(SYS_write, (long)fd,
+							buf, len));
+		return SHIM_REAL(write)(fd, buf, len);
+	}
+	return shim_ret(shim_send(f, buf, len, 0, NULL, 0));
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+
+	if (!f)
+		return SHIM_REAL(send)(fd, buf, len, flags);
+	return shim_ret(shim_send(f, buf, len, flags, NULL, 0));
+}
+
+ssize_t sendto(int fd, const void *buf, size_t len, int flags,
+	       __CONST_SOCKADDR_ARG addr, socklen_t addrlen)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+
+	if (!f)
+		return SHIM_REAL(sendto)(fd, buf, len, flags, addr, addrlen);
+	return shim_ret(shim_send(f, buf, len, flags, SHIM_SA(addr), addrlen));
+}
+
+/* datagrams are copied through a bounce buffer to (or from) the iovecs */
+static ssize_t shim_udp_recvmsg(struct shim_fd *f, struct msghdr *msg,
+				int flags)
+{
+	char buf[UDP_MAX_PAYLOAD_JUMBO];
+	size_t off = 0, n;
+	ssize_t ret;
+	int i;
+
+	ret = shim_recv(f, buf, sizeof(buf), flags, msg->msg_name,
+			&msg->msg_namelen);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < msg->msg_iovlen && off < ret; i++) {
+		n = min(msg->msg_iov[i].iov_len, (size_t)ret - off);
+		memcpy(msg->msg_iov[i].iov_base, buf + off, n);
+		off += n;
+	}
+	msg->msg_flags = off < ret ? MSG_TRUNC : 0;
+	return off;
+}
+
+static ssize_t shim_udp_sendmsg(struct shim_fd *f, const struct msghdr *msg,
+				int flags)
+{
+	char buf[UDP_MAX_PAYLOAD_JUMBO];
+	size_t off = 0;
+	int i;
+
+	for (i = 0; i < msg->msg_iovlen; i++) {
+		if (msg->msg_iov[i].iov_len > sizeof(buf) - off)
+			return -EMSGSIZE;
+		memcpy(buf + off, msg->msg_iov[i].iov_base,
+		       msg->msg_iov[i].iov_len);
+		off += msg->msg_iov[i].iov_len;
+	}
+
+	return shim_send(f, buf, off, flags, msg->msg_name, msg->msg_namelen);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	struct msghdr msg;
+
+	if (!f) {
+		if (shim_kfd_offload(fd))
+			return shim_ret(offload_syscall(SYS_readv, (long)fd,
+							iov, (long)iovcnt));
+		return SHIM_REAL(readv)(fd, iov, iovcnt);
+	}
+	if (f->kind == SHIM_FD_TCP) {
+		if (load_acquire(&f->state) != SHIM_TCP_CONN)
+			return shim_ret(-ENOTCONN);
+		return shim_ret(tcp_readv(f->c, iov, iovcnt));
+	}
+	if (f->kind != SHIM_FD_UDP)
+		return shim_ret(-EINVAL);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
+	return shim_ret(shim_udp_recvmsg(f, &msg, 0));
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	struct msghdr msg;
+
+	if (!f) {
+		if (shim_kfd_offload(fd))
+			return shim_ret(offload_syscall(SYS_writev, (long)fd,
+							iov, (long)iovcnt));
+		return SHIM_REAL(writev)(fd, iov, iovcnt);
+	}
+	if (f->kind == SHIM_FD_TCP) {
+		if (load_acquire(&f->state) != SHIM_TCP_CONN)
+			return shim_ret(-ENOTCONN);
+		return shim_ret(tcp_writev(f->c, iov, iovcnt));
+	}
+	if (f->kind != SHIM_FD_UDP)
+		return shim_ret(-EINVAL);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
+	return shim_ret(shim_udp_sendmsg(f, &msg, 0));
+}
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+
+	if (!f)
+		return SHIM_REAL(recvmsg)(fd, msg, flags);
+	if (f->kind == SHIM_FD_UDP)
+		return shim_ret(shim_udp_recvmsg(f, msg, flags));
+	if (f->kind != SHIM_FD_TCP)
+		return shim_ret(-EINVAL);
+	if (flags & ~MSG_NOSIGNAL)
+		return shim_ret(-EOPNOTSUPP);
+
+	msg->msg_namelen = 0;
+	msg->msg_controllen = 0;
+	msg->msg_flags = 0;
+	return readv(fd, msg->msg_iov, msg->msg_iovlen);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+
+	if (!f)
+		return SHIM_REAL(sendmsg)(fd, msg, flags);
+	if (f->kind == SHIM_FD_UDP)
+		return shim_ret(shim_udp_sendmsg(f, msg, flags));
+	if (f->kind != SHIM_FD_TCP)
+		return shim_ret(-EINVAL);
+	if (flags & ~MSG_NOSIGNAL)
+		return shim_ret(-EOPNOTSUPP);
+
+	return writev(fd, msg->msg_iov, msg->msg_iovlen);
+}
+
+int shutdown(int fd, int how)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	int state;
+
+	if (!f)
+		return SHIM_REAL(shutdown)(fd, how);
+	if (f->kind == SHIM_FD_EPOLL)
+		return shim_ret(-ENOTSOCK);
+
+	if (f->kind == SHIM_FD_UDP) {
+		if (!load_acquire(&f->u))
+			return shim_ret(-ENOTCONN);
+		udp_shutdown(f->u);
+		return 0;
+	}
+
+	state = load_acquire(&f->state);
+	if (state == SHIM_TCP_LISTEN) {
+		tcp_qshutdown(f->q);
+		return 0;
+	}
+	if (state != SHIM_TCP_CONN)
+		return shim_ret(-ENOTCONN);
+	return shim_ret(tcp_shutdown(f->c, how));
+}
+
+int close(int fd)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+
+	if (!f) {
+		shim_kfd_forget(fd);
+		return SHIM_REAL(close)(fd);
+	}
+
+	if (f->kind == SHIM_FD_EPOLL) {
+		shim_epoll_close(f);
+	} else {
+		mutex_lock(&f->lock);
+		shim_epoll_detach(f);
+		if (f->c)
+			tcp_close(f->c);
+		else if (f->q)
+			tcp_qclose(f->q);
+		else if (f->u)
+			udp_close(f->u);
+		mutex_unlock(&f->lock);
+	}
+
+	shim_fd_release(f);
+	return SHIM_REAL(close)(fd);
+}
+
+int getsockname(int fd, __SOCKADDR_ARG addr, socklen_t *len)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	struct netaddr laddr;
+
+	if (!f)
+		return SHIM_REAL(getsockname)(fd, addr, len);
+	if (f->kind == SHIM_FD_EPOLL)
+		return shim_ret(-ENOTSOCK);
+
+	mutex_lock(&f->lock);
+	laddr = shim_laddr(f, NULL);
+	mutex_unlock(&f->lock);
+
+	shim_netaddr_to_sockaddr(f, &laddr, SHIM_SA(addr), len);
+	return 0;
+}
+
+int getpeername(int fd, __SOCKADDR_ARG addr, socklen_t *len)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	struct netaddr raddr;
+
+	if (!f)
+		return SHIM_REAL(getpeername)(fd, addr, len);
+	if (f->kind == SHIM_FD_EPOLL)
+		return shim_ret(-ENOTSOCK);
+
+	if (f->kind == SHIM_FD_TCP && load_acquire(&f->state) == SHIM_TCP_CONN)
+		raddr = tcp_remote_addr(f->c);
+	else if (f->kind == SHIM_FD_UDP && load_acquire(&f->u))
+		raddr = udp_remote_addr(f->u);
+	else
+		return shim_ret(-ENOTCONN);
+	if (!raddr.port)
+		return shim_ret(-ENOTCONN);
+
+	shim_netaddr_to_sockaddr(f, &raddr, SHIM_SA(addr), len);
+	return 0;
+}
+
+/*
+ * Options that only tune the kernel's stack are accepted and ignored, so
+ * applications that set them at startup keep working. Anything else fails
+ * with ENOPROTOOPT.
+ */
+int setsockopt(int fd, int level, int name, const void *val, socklen_t len)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+
+	if (!f)
+		return SHIM_REAL(setsockopt)(fd, level, name, val, len);
+	if (f->kind == SHIM_FD_EPOLL)
+		return shim_ret(-ENOTSOCK);
+
+	switch (level) {
+	case SOL_SOCKET:
+		switch (name) {
+		case SO_REUSEADDR:
+		case SO_REUSEPORT:
+		case SO_KEEPALIVE:
+		case SO_LINGER:
+		case SO_RCVBUF:
+		case SO_SNDBUF:
+		case SO_RCVLOWAT:
+		case SO_PRIORITY:
+			return 0;
+		}
+		break;
+
+	case IPPROTO_TCP:
+		switch (name) {
+		case TCP_NODELAY:
+		case TCP_KEEPIDLE:
+		case TCP_KEEPINTVL:
+		case TCP_KEEPCNT:
+		case TCP_QUICKACK:
+		case TCP_DEFER_ACCEPT:
+			return f->type == SOCK_STREAM ? 0 : shim_ret(-EINVAL);
+		}
+		break;
+
+	case IPPROTO_IPV6:
+		if (name == IPV6_V6ONLY)
+			return 0;
+		break;
+	}
+
+	return shim_ret(-ENOPROTOOPT);
+}
+
+int getsockopt(int fd, int level, int name, void *val, socklen_t *len)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	int v;
+
+	if (!f)
+		return SHIM_REAL(getsockopt)(fd, level, name, val, len);
+	if (f->kind == SHIM_FD_EPOLL)
+		return shim_ret(-ENOTSOCK);
+
+	if (level == SOL_SOCKET && name == SO_ERROR)
+		v = 0; /* failures are already returned by connect() */
+	else if (level == SOL_SOCKET && name == SO_TYPE)
+		v = f->type;
+	else if (level == SOL_SOCKET && name == SO_DOMAIN)
+		v = f->domain;
+	else if (level == SOL_SOCKET && name == SO_ACCEPTCONN)
+		v = load_acquire(&f->state) == SHIM_TCP_LISTEN;
+	else if (level == IPPROTO_TCP && name == TCP_NODELAY)
+		v = 1;
+	else
+		return shim_ret(-ENOPROTOOPT);
+
+	if (!val || !len || *len < sizeof(v))
+		return shim_ret(-EINVAL);
+	memcpy(val, &v, sizeof(v));
+	*len = sizeof(v);
+	return 0;
+}
+
+static void shim_fd_set_nonblocking(struct shim_fd *f, bool nonblock)
+{
+	mutex_lock(&f->lock);
+	f->nonblock = nonblock;
+	shim_sock_set_nonblocking(f, nonblock);
+	mutex_unlock(&f->lock);
+}
+
+/* handles the status flags, the rest applies to the placeholder */
+static int shim_fcntl(struct shim_fd *f, int cmd, void *arg)
+{
+	long flags;
+
+	if (f->kind == SHIM_FD_EPOLL)
+		return SHIM_REAL(fcntl)(f->fd, cmd, arg);
+
+	switch (cmd) {
+	case F_GETFL:
+		return O_RDWR | (f->nonblock ? O_NONBLOCK : 0);
+	case F_SETFL:
+		flags = (long)arg;
+		shim_fd_set_nonblocking(f, flags & O_NONBLOCK);
+		return 0;
+	default:
+		return SHIM_REAL(fcntl)(f->fd, cmd, arg);
+	}
+}
+
+int fcntl(int fd, int cmd, ...)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	va_list ap;
+	void *arg;
+
+	va_start(ap, cmd);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (!f)
+		return SHIM_REAL(fcntl)(fd, cmd, arg);
+	return shim_fcntl(f, cmd, arg);
+}
+
+int fcntl64(int fd, int cmd, ...)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	va_list ap;
+	void *arg;
+
+	va_start(ap, cmd);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (!f)
+		return SHIM_REAL(fcntl64)(fd, cmd, arg);
+	return shim_fcntl(f, cmd, arg);
+}
+
+int ioctl(int fd, unsigned long req, ...)
+{
+	struct shim_fd *f = shim_fd_get(fd);
+	struct tcp_conn_info info;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, req);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (!f)
+		return SHIM_REAL(ioctl)(fd, req, arg);
+
+	switch (req) {
+	case FIONBIO:
+		if (f->kind == SHIM_FD_EPOLL)
+			break;
+		shim_fd_set_nonblocking(f, *(int *)arg);
+		return 0;
+	case FIONREAD:
+		if (f->kind != SHIM_FD_TCP ||
+		    load_acquire(&f->state) != SHIM_TCP_CONN)
+			return shim_ret(-EINVAL);
+		tcp_get_info(f->c, &info);
+		*(int *)arg = info.rx_queued;
+		return 0;
+	}
+
+	return SHIM_REAL(ioctl)(fd, req, arg);
+}
@@ -0,0 +1,137 @@
+/*
+ * socket.h - the shim's table of sockets and epoll sets backed by the runtime
+ *
+ * Each shim file descriptor is a real (placeholder) kernel file descriptor,
+ * so its number can't collide with files the application opens itself. The
+ * table maps the number to the runtime object behind it. Anything not in the
+ * table is passed through to libc.
+ */
+
+#pragma once
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <base/list.h>
+#include <base/lock.h>
+#include <runtime/offload.h>
+#include <runtime/poll.h>
+#include <runtime/rcu.h>
+#include <runtime/sync.h>
+#include <runtime/tcp.h>
+#include <runtime/udp.h>
+
+/* file descriptors at or above this are always passed through */
+#define SHIM_MAX_FDS		65536
+
+/* calls the libc version of a function the shim overrides */
+#define SHIM_REAL(fn)							\
+({									\
+	static typeof(&fn) __real_##fn;					\
+	if (unlikely(!__real_##fn))					\
+		__real_##fn = dlsym(RTLD_NEXT, #fn);			\
+	__real_##fn;							\
+})
+
+enum {
+	SHIM_FD_TCP = 0,
+	SHIM_FD_UDP,
+	SHIM_FD_EPOLL,
+};
+
+/* the states of a TCP socket */
+enum {
+	SHIM_TCP_NEW = 0,	/* not yet listening or connected */
+	SHIM_TCP_LISTEN,
+	SHIM_TCP_CONN,
+};
+
+struct shim_epoll;
+
+struct shim_fd {
+	int			kind;	/* one of SHIM_FD_* */
+	int			fd;
+	struct rcu_head		rcu;
+
+	/* sockets, bind(), listen(), and connect() hold @lock */
+	mutex_t			lock;
+	int			domain;	/* AF_INET or AF_INET6 */
+	int			type;	/* SOCK_STREAM or SOCK_DGRAM */
+	int			state;	/* one of SHIM_TCP_* */
+	bool			nonblock;
+	bool			bound;
+	struct netaddr		laddr;
+	tcpconn_t		*c;
+	tcpqueue_t		*q;
+	udpconn_t		*u;
+
+	/*
+	 * The epoll set this socket is in. Changing @ep takes the global epoll
+	 * lock and the set's lock, the rest is protected by the set's lock.
+	 */
+	struct shim_epoll	*ep;
+	uint32_t		ep_events;
+	uint64_t		ep_data;
+	struct list_node	ep_link;	/* in the set's @members */
+	struct list_node	ep_rearm_link;	/* in the set's @rearm */
+	bool			ep_rearm;
+
+	/* epoll sets */
+	struct shim_epoll	*epoll;
+};
+
+struct shim_epoll {
+	int			fd;	/* a real epoll set, for kernel files */
+	spinlock_t		lock;
+	poll_waiter_t		w;
+	struct list_head	members;
+	/* level-triggered sockets reported since the last epoll_wait() */
+	struct list_head	rearm;
+	/* kernel files in the set, polled through the placeholder */
+	int			nr_kernel;
+};
+
+extern struct shim_fd *shim_fds[SHIM_MAX_FDS];
+
+/**
+ * shim_fd_get - finds the shim object behind a file descriptor
+ * @fd: the file descriptor
+ *
+ * Returns the object, or NULL if @fd belongs to the kernel.
+ */
+static inline struct shim_fd *shim_fd_get(int fd)
+{
+	if (unlikely((unsigned int)fd >= SHIM_MAX_FDS))
+		return NULL;
+	return load_acquire(&shim_fds[fd]);
+}
+
+extern struct shim_fd *shim_fd_alloc(int kind, int fd);
+extern void shim_fd_install(struct shim_fd *f);
+extern void shim_fd_release(struct shim_fd *f);
+
+/* socket.c */
+extern void shim_sock_poll_register(struct shim_fd *f);
+extern void shim_sock_poll_unregister(struct shim_fd *f);
+
+/* offload.c */
+extern bool shim_kfd_offload(int fd);
+extern void shim_kfd_forget(int fd);
+
+/* epoll.c */
+extern void shim_epoll_attach(struct shim_fd *f);
+extern void shim_epoll_detach(struct shim_fd *f);
+extern int shim_epoll_to_kernel(struct shim_fd *f);
+extern void shim_epoll_close(struct shim_fd *f);
+
+/* returns -1 and sets errno if @ret is a negative errno */
+static inline long shim_ret(long ret)
+{
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
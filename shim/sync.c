@@ -1,36 +1,116 @@
 
 #include <dlfcn.h>
 #include <pthread.h>
+#include <time.h>
 
+#include <base/time.h>
 #include <runtime/sync.h>
 
+/*
+ * PTHREAD_*_INITIALIZER leaves the object in a state the runtime can't use
+ * (e.g. its waiter lists aren't linked), so mutexes, condvars, and rwlocks
+ * carry a flag after the runtime object that says whether it was initialized.
+ * Objects that weren't are initialized on first use.
+ */
+#define SHIM_SYNC_READY		0x53594e43	/* "SYNC" */
+#define SHIM_SYNC_BUSY		0x42555359	/* "BUSY" */
+
+struct shim_mutex {
+	mutex_t		m;
+	unsigned int	init;
+};
+
+struct shim_cond {
+	condvar_t	cv;
+	unsigned int	init;
+};
+
+struct shim_rwlock {
+	rwmutex_t	rw;
+	unsigned int	init;
+};
+
 BUILD_ASSERT(sizeof(pthread_barrier_t) >= sizeof(barrier_t));
-BUILD_ASSERT(sizeof(pthread_mutex_t) >= sizeof(mutex_t));
+BUILD_ASSERT(sizeof(pthread_mutex_t) >= sizeof(struct shim_mutex));
 BUILD_ASSERT(sizeof(pthread_spinlock_t) >= sizeof(spinlock_t));
-BUILD_ASSERT(sizeof(pthread_cond_t) >= sizeof(condvar_t));
-BUILD_ASSERT(sizeof(pthread_rwlock_t) >= sizeof(rwmutex_t));
+BUILD_ASSERT(sizeof(pthread_cond_t) >= sizeof(struct shim_cond));
+BUILD_ASSERT(sizeof(pthread_rwlock_t) >= sizeof(struct shim_rwlock));
+
+/* initializes an object on first use, racing callers wait for the winner */
+static void shim_sync_init_slow(unsigned int *init, void (*fn)(void *),
+				void *obj)
+{
+	unsigned int v;
+
+	while (true) {
+		v = load_acquire(init);
+		if (v == SHIM_SYNC_READY)
+			return;
+		if (v != SHIM_SYNC_BUSY &&
+		    __sync_bool_compare_and_swap(init, v, SHIM_SYNC_BUSY)) {
+			fn(obj);
+			store_release(init, SHIM_SYNC_READY);
+			return;
+		}
+		cpu_relax();
+	}
+}
+
+static void shim_mutex_init_fn(void *obj) { mutex_init(obj); }
+static void shim_cond_init_fn(void *obj) { condvar_init(obj); }
+static void shim_rwlock_init_fn(void *obj) { rwmutex_init(obj); }
+
+static inline mutex_t *shim_mutex(pthread_mutex_t *mutex)
+{
+	struct shim_mutex *sm = (struct shim_mutex *)mutex;
+
+	if (unlikely(load_acquire(&sm->init) != SHIM_SYNC_READY))
+		shim_sync_init_slow(&sm->init, shim_mutex_init_fn, &sm->m);
+	return &sm->m;
+}
+
+static inline condvar_t *shim_cond(pthread_cond_t *cond)
+{
+	struct shim_cond *sc = (struct shim_cond *)cond;
+
+	if (unlikely(load_acquire(&sc->init) != SHIM_SYNC_READY))
+		shim_sync_init_slow(&sc->init, shim_cond_init_fn, &sc->cv);
+	return &sc->cv;
+}
+
+static inline rwmutex_t *shim_rwlock(pthread_rwlock_t *r)
+{
+	struct shim_rwlock *sr = (struct shim_rwlock *)r;
+
+	if (unlikely(load_acquire(&sr->init) != SHIM_SYNC_READY))
+		shim_sync_init_slow(&sr->init, shim_rwlock_init_fn, &sr->rw);
+	return &sr->rw;
+}
 
 int pthread_mutex_init(pthread_mutex_t *mutex,
 		       const pthread_mutexattr_t *mutexattr)
 {
-	mutex_init((mutex_t *)mutex);
+	struct shim_mutex *sm = (struct shim_mutex *)mutex;
+
+	mutex_init(&sm->m);
+	store_release(&sm->init, SHIM_SYNC_READY);
 	return 0;
 }
 
 int pthread_mutex_lock(pthread_mutex_t *mutex)
 {
-	mutex_lock((mutex_t *)mutex);
+	mutex_lock(shim_mutex(mutex));
 	return 0;
 }
 
 int pthread_mutex_trylock(pthread_mutex_t *mutex)
 {
-	return mutex_try_lock((mutex_t *)mutex) ? 0 : EBUSY;
+	return mutex_try_lock(shim_mutex(mutex)) ? 0 : EBUSY;
 }
 
 int pthread_mutex_unlock(pthread_mutex_t *mutex)
 {
-	mutex_unlock((mutex_t *)mutex);
+	mutex_unlock(shim_mutex(mutex));
 	return 0;
 }
 
@@ -109,32 +189,51 @@ int pthread_spin_unlock(pthread_spinlock_t *lock)
 int pthread_cond_init(pthread_cond_t *__restrict cond,
 		      const pthread_condattr_t *__restrict cond_attr)
 {
-	condvar_init((condvar_t *)cond);
+	struct shim_cond *sc = (struct shim_cond *)cond;
+
+	condvar_init(&sc->cv);
+	store_release(&sc->init, SHIM_SYNC_READY);
 	return 0;
 }
 
 int pthread_cond_signal(pthread_cond_t *cond)
 {
-	condvar_signal((condvar_t *)cond);
+	condvar_signal(shim_cond(cond));
 	return 0;
 }
 
 int pthread_cond_broadcast(pthread_cond_t *cond)
 {
-	condvar_broadcast((condvar_t *)cond);
+	condvar_broadcast(shim_cond(cond));
 	return 0;
 }
 
 int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
 {
-	condvar_wait((condvar_t *)cond, (mutex_t *)mutex);
+	condvar_wait(shim_cond(cond), shim_mutex(mutex));
 	return 0;
 }
 
+/* @abstime is always CLOCK_REALTIME, since condvar attributes are ignored */
 int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
 			   const struct timespec *abstime)
 {
-	BUG();
+	struct timespec now;
+	int64_t timeout_us;
+
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000)
+		return EINVAL;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	timeout_us = (int64_t)(abstime->tv_sec - now.tv_sec) * ONE_SECOND +
+		     (abstime->tv_nsec - now.tv_nsec) / 1000;
+	if (timeout_us <= 0)
+		return ETIMEDOUT;
+
+	if (!condvar_wait_timeout(shim_cond(cond), shim_mutex(mutex),
+				  timeout_us))
+		return ETIMEDOUT;
+	return 0;
 }
 
 int pthread_cond_destroy(pthread_cond_t *cond) { return 0; }
@@ -143,34 +242,37 @@ int pthread_rwlock_destroy(pthread_rwlock_t *r) { return 0; }
 
 int pthread_rwlock_init(pthread_rwlock_t *r, const pthread_rwlockattr_t *attr)
 {
-	rwmutex_init((rwmutex_t *)r);
+	struct shim_rwlock *sr = (struct shim_rwlock *)r;
+
+	rwmutex_init(&sr->rw);
+	store_release(&sr->init, SHIM_SYNC_READY);
 	return 0;
 }
 
 int pthread_rwlock_rdlock(pthread_rwlock_t *r)
 {
-	rwmutex_rdlock((rwmutex_t *)r);
+	rwmutex_rdlock(shim_rwlock(r));
 	return 0;
 }
 
 int pthread_rwlock_tryrdlock(pthread_rwlock_t *r)
 {
-	return rwmutex_try_rdlock((rwmutex_t *)r) ? 0 : EBUSY;
+	return rwmutex_try_rdlock(shim_rwlock(r)) ? 0 : EBUSY;
 }
 
 int pthread_rwlock_trywrlock(pthread_rwlock_t *r)
 {
-	return rwmutex_try_wrlock((rwmutex_t *)r) ? 0 : EBUSY;
+	return rwmutex_try_wrlock(shim_rwlock(r)) ? 0 : EBUSY;
 }
 
 int pthread_rwlock_wrlock(pthread_rwlock_t *r)
 {
-	rwmutex_wrlock((rwmutex_t *)r);
+	rwmutex_wrlock(shim_rwlock(r));
 	return 0;
 }
 
 int pthread_rwlock_unlock(pthread_rwlock_t *r)
 {
-	rwmutex_unlock((rwmutex_t *)r);
+	rwmutex_unlock(shim_rwlock(r));
 	return 0;
 }
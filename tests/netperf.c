@@ -36,7 +36,7 @@ static void client_worker(void *arg)
 	unsigned char buf[BUF_SIZE];
 	struct client_rr_args *args = (struct client_rr_args *)arg;
 	tcpconn_t *c;
-	struct netaddr laddr;
+	struct netaddr laddr = { 0 };
 	ssize_t ret;
 	int budget = depth;
 
@@ -132,7 +132,7 @@ static void server_worker(void *arg)
 
 static void do_server(void *arg)
 {
-	struct netaddr laddr;
+	struct netaddr laddr = { 0 };
 	tcpqueue_t *q;
 	int ret;
 
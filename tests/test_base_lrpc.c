@@ -15,6 +15,7 @@
 #define QUEUE_SIZE	128
 #define N		1000000
 #define QUIT		0XDEADBEEF
+#define BURST		16
 
 struct params {
 	struct lrpc_msg	*client_buf, *server_buf;
@@ -59,6 +60,36 @@ static void client(struct params *p)
 	msgs_per_second = (double)N / ((microtime() - start_us) * 0.000001);
 	log_info("echoed %f messages / second", msgs_per_second);
 
+	start_us = microtime();
+
+	for (i = 0; i < N; i += BURST) {
+		struct lrpc_msg msgs[BURST];
+		unsigned int j, n = 0;
+
+		for (j = 0; j < BURST; j++) {
+			msgs[j].cmd = i + j;
+			msgs[j].payload = start_us;
+		}
+		while (n < BURST) {
+			n += lrpc_send_burst(&c_out, &msgs[n], BURST - n);
+			cpu_relax();
+		}
+
+		j = 0;
+		while (j < BURST) {
+			n = lrpc_recv_burst(&c_in, msgs, BURST - j);
+			for (ret = 0; ret < n; ret++, j++) {
+				BUG_ON(msgs[ret].cmd != i + j);
+				BUG_ON(msgs[ret].payload != start_us);
+			}
+			cpu_relax();
+		}
+	}
+
+	msgs_per_second = (double)N / ((microtime() - start_us) * 0.000001);
+	log_info("echoed %f messages / second in bursts of %d",
+		 msgs_per_second, BURST);
+
 	while (!lrpc_send(&c_out, QUIT, 0))
 		cpu_relax();
 }
@@ -67,8 +98,8 @@ static void server(struct params *p)
 {
 	struct lrpc_chan_out c_out;
 	struct lrpc_chan_in c_in;
-	uint64_t cmd;
-	unsigned long payload;
+	struct lrpc_msg msgs[BURST];
+	unsigned int i, n, sent;
 	int ret;
 
 	ret = lrpc_init_in(&c_in, p->server_buf, QUEUE_SIZE, p->server_wb);
@@ -78,14 +109,19 @@ static void server(struct params *p)
 	BUG_ON(ret);
 
 	while (true) {
-		while (!lrpc_recv(&c_in, &cmd, &payload))
+		while (!(n = lrpc_recv_burst(&c_in, msgs, BURST)))
 			cpu_relax();
 
-		if (cmd == QUIT)
-			break;
+		for (i = 0; i < n; i++) {
+			if (msgs[i].cmd == QUIT)
+				return;
+		}
 
-		while (!lrpc_send(&c_out, cmd, payload))
+		sent = 0;
+		while (sent < n) {
+			sent += lrpc_send_burst(&c_out, &msgs[sent], n - sent);
 			cpu_relax();
+		}
 	}
 }
 
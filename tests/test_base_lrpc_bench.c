@@ -0,0 +1,156 @@
+/*
+ * test_base_lrpc_bench.c - measures one-way LRPC throughput across cores
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <base/init.h>
+#include <base/log.h>
+#include <base/assert.h>
+#include <base/cpu.h>
+#include <base/lrpc.h>
+#include <base/time.h>
+
+#define QUEUE_SIZE	1024
+#define N		(16 * 1000 * 1000)
+#define BURST		32
+
+struct params {
+	struct lrpc_msg	*buf;
+	uint32_t	*wb;
+	unsigned int	burst;
+};
+
+static void pin_to_cpu(int cpu)
+{
+	cpu_set_t mask;
+	int ret;
+
+	CPU_ZERO(&mask);
+	CPU_SET(cpu % cpu_count, &mask);
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+	if (ret)
+		log_warn("couldn't pin to cpu %d, ret = %d", cpu, ret);
+}
+
+static void *producer(void *data)
+{
+	struct params *p = (struct params *)data;
+	struct lrpc_chan_out c_out;
+	struct lrpc_msg msgs[BURST];
+	unsigned int i, n;
+	int ret;
+
+	ret = base_init_thread();
+	BUG_ON(ret);
+	pin_to_cpu(1);
+
+	ret = lrpc_init_out(&c_out, p->buf, QUEUE_SIZE, p->wb);
+	BUG_ON(ret);
+
+	for (i = 0; i < N; i += n) {
+		if (p->burst == 1) {
+			n = lrpc_send(&c_out, i, i) ? 1 : 0;
+		} else {
+			unsigned int j, cnt = min(p->burst, N - i);
+
+			for (j = 0; j < cnt; j++) {
+				msgs[j].cmd = i + j;
+				msgs[j].payload = i + j;
+			}
+			n = lrpc_send_burst(&c_out, msgs, cnt);
+		}
+		if (!n)
+			cpu_relax();
+	}
+
+	return NULL;
+}
+
+static void consumer(struct params *p)
+{
+	struct lrpc_chan_in c_in;
+	struct lrpc_msg msgs[BURST];
+	unsigned int i, j, n;
+	uint64_t start_us;
+	int ret;
+
+	ret = lrpc_init_in(&c_in, p->buf, QUEUE_SIZE, p->wb);
+	BUG_ON(ret);
+
+	start_us = microtime();
+	for (i = 0; i < N; i += n) {
+		if (p->burst == 1) {
+			n = lrpc_recv(&c_in, &msgs[0].cmd, &msgs[0].payload);
+		} else {
+			n = lrpc_recv_burst(&c_in, msgs, p->burst);
+		}
+		if (!n) {
+			cpu_relax();
+			continue;
+		}
+
+		for (j = 0; j < n; j++) {
+			BUG_ON(msgs[j].cmd != i + j);
+			BUG_ON(msgs[j].payload != i + j);
+		}
+	}
+
+	log_info("burst %u: %f messages / second", p->burst,
+		 (double)N / ((microtime() - start_us) * 0.000001));
+}
+
+static void run(unsigned int burst)
+{
+	pthread_t tid;
+	struct params p;
+	int ret;
+
+	p.burst = burst;
+	p.buf = aligned_alloc(CACHE_LINE_SIZE,
+			      sizeof(struct lrpc_msg) * QUEUE_SIZE);
+	BUG_ON(!p.buf);
+	memset(p.buf, 0, sizeof(struct lrpc_msg) * QUEUE_SIZE);
+
+	p.wb = aligned_alloc(CACHE_LINE_SIZE, CACHE_LINE_SIZE);
+	BUG_ON(!p.wb);
+	memset(p.wb, 0, CACHE_LINE_SIZE);
+
+	ret = pthread_create(&tid, NULL, producer, &p);
+	BUG_ON(ret);
+
+	consumer(&p);
+
+	ret = pthread_join(tid, NULL);
+	BUG_ON(ret);
+	free(p.buf);
+	free(p.wb);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	ret = base_init();
+	if (ret) {
+		log_err("base_init() failed, ret = %d", ret);
+		return 1;
+	}
+	BUG_ON(!base_init_done);
+
+	ret = base_init_thread();
+	if (ret) {
+		log_err("base_init_thread() failed, ret = %d", ret);
+		BUG();
+	}
+	BUG_ON(!thread_init_done);
+	pin_to_cpu(0);
+
+	run(1);
+	run(4);
+	run(BURST);
+	return 0;
+}
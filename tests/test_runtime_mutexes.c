@@ -28,6 +28,29 @@ mutex_t start_lock;
 condvar_t start_cv;
 bool start;
 
+#define CONTENDED_THREADS	(NCORES * 2)
+#define CONTENDED_ITERS		200000
+
+mutex_t contended_lock;
+unsigned long contended_count;
+
+#define BR_READERS	(NCORES * 4)
+#define BR_ITERS	100000
+
+brmutex_t br_lock;
+unsigned long br_a, br_b;
+
+#define FJ_THREADS	64
+#define FJ_ROUNDS	10000
+
+#define WN_ITERS	100000
+
+uint32_t wn_word;
+
+tbarrier_t fj_barrier;
+swaitgroup_t fj_wg;
+unsigned long fj_phase;
+
 static void work_handler(void *arg)
 {
 	int bucket;
@@ -63,6 +86,177 @@ static void work_handler(void *arg)
 	waitgroup_done(wg_parent);
 }
 
+static void contended_handler(void *arg)
+{
+	waitgroup_t *wg_parent = (waitgroup_t *)arg;
+	int i;
+
+	for (i = 0; i < CONTENDED_ITERS; i++) {
+		mutex_lock(&contended_lock);
+		contended_count++;
+		mutex_unlock(&contended_lock);
+	}
+
+	waitgroup_done(wg_parent);
+}
+
+/* many threads taking one mutex with a very short critical section */
+static void contended_bench(void)
+{
+	waitgroup_t wg;
+	uint64_t start_us;
+	int i, ret;
+
+	mutex_init(&contended_lock);
+	contended_count = 0;
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, CONTENDED_THREADS);
+	start_us = microtime();
+	for (i = 0; i < CONTENDED_THREADS; i++) {
+		ret = thread_spawn(contended_handler, &wg);
+		BUG_ON(ret);
+	}
+	waitgroup_wait(&wg);
+
+	BUG_ON(contended_count !=
+	       (unsigned long)CONTENDED_THREADS * CONTENDED_ITERS);
+	log_info("contended: %f acquires / second",
+		 (double)contended_count /
+		 ((microtime() - start_us) * 0.000001));
+}
+
+static void br_reader(void *arg)
+{
+	waitgroup_t *wg_parent = (waitgroup_t *)arg;
+	int i;
+
+	for (i = 0; i < BR_ITERS; i++) {
+		brmutex_rdlock(&br_lock);
+		BUG_ON(br_a != br_b);
+		brmutex_rdunlock(&br_lock);
+		if (i % 1000 == 0)
+			thread_yield();
+	}
+
+	waitgroup_done(wg_parent);
+}
+
+/* mostly readers, with a writer that must never be seen halfway through */
+static void br_bench(void)
+{
+	waitgroup_t wg;
+	uint64_t start_us;
+	int i, ret;
+
+	BUG_ON(brmutex_init(&br_lock));
+	br_a = br_b = 0;
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, BR_READERS);
+	start_us = microtime();
+	for (i = 0; i < BR_READERS; i++) {
+		ret = thread_spawn(br_reader, &wg);
+		BUG_ON(ret);
+	}
+	for (i = 0; i < BR_ITERS / 100; i++) {
+		brmutex_wrlock(&br_lock);
+		br_a++;
+		thread_yield();
+		br_b++;
+		brmutex_wrunlock(&br_lock);
+	}
+	waitgroup_wait(&wg);
+
+	log_info("brmutex: %f read acquires / second",
+		 (double)BR_READERS * BR_ITERS /
+		 ((microtime() - start_us) * 0.000001));
+	brmutex_destroy(&br_lock);
+}
+
+static void wn_handler(void *arg)
+{
+	waitgroup_t *wg_parent = (waitgroup_t *)arg;
+	uint32_t i;
+
+	/* wait for each odd value, then hand back the next even one */
+	for (i = 0; i < WN_ITERS; i++) {
+		while (load_acquire(&wn_word) != 2 * i + 1)
+			thread_wait_on(&wn_word, 2 * i);
+		store_release(&wn_word, 2 * i + 2);
+		thread_notify(&wn_word, 1);
+	}
+
+	waitgroup_done(wg_parent);
+}
+
+/* two threads taking turns through thread_wait_on() and thread_notify() */
+static void wn_bench(void)
+{
+	waitgroup_t wg;
+	uint64_t start_us;
+	uint32_t i;
+
+	wn_word = 0;
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, 1);
+	start_us = microtime();
+	BUG_ON(thread_spawn(wn_handler, &wg));
+
+	for (i = 0; i < WN_ITERS; i++) {
+		store_release(&wn_word, 2 * i + 1);
+		thread_notify(&wn_word, 1);
+		while (load_acquire(&wn_word) != 2 * i + 2)
+			thread_wait_on(&wn_word, 2 * i + 1);
+	}
+	waitgroup_wait(&wg);
+
+	BUG_ON(thread_wait_on_timeout(&wn_word, 2 * WN_ITERS, 10) !=
+	       -ETIMEDOUT);
+	log_info("wait/notify: %f handoffs / second",
+		 (double)WN_ITERS * 2 / ((microtime() - start_us) * 0.000001));
+}
+
+static void fj_handler(void *arg)
+{
+	int i, idx = (long)arg;
+
+	for (i = 0; i < FJ_ROUNDS; i++) {
+		BUG_ON(ACCESS_ONCE(fj_phase) != i);
+		if (tbarrier_wait(&fj_barrier, idx))
+			fj_phase++;
+		tbarrier_wait(&fj_barrier, idx);
+	}
+
+	swaitgroup_done(&fj_wg);
+}
+
+/* threads stepping through phases together on a tree barrier */
+static void fj_bench(void)
+{
+	uint64_t start_us;
+	long i;
+	int ret;
+
+	BUG_ON(tbarrier_init(&fj_barrier, FJ_THREADS));
+	BUG_ON(swaitgroup_init(&fj_wg));
+	fj_phase = 0;
+
+	swaitgroup_add(&fj_wg, FJ_THREADS);
+	start_us = microtime();
+	for (i = 0; i < FJ_THREADS; i++) {
+		ret = thread_spawn(fj_handler, (void *)i);
+		BUG_ON(ret);
+	}
+	swaitgroup_wait(&fj_wg);
+
+	BUG_ON(fj_phase != FJ_ROUNDS);
+	log_info("tbarrier: %f rounds / second",
+		 (double)FJ_ROUNDS * 2 / ((microtime() - start_us) * 0.000001));
+	tbarrier_destroy(&fj_barrier);
+	swaitgroup_destroy(&fj_wg);
+}
+
 static void main_handler(void *arg)
 {
 	waitgroup_t wg;
@@ -134,6 +328,11 @@ static void main_handler(void *arg)
 
 	waitgroup_wait(&wg);
 	log_info("%f messages / second", messages_per_second);
+
+	contended_bench();
+	br_bench();
+	fj_bench();
+	wn_bench();
 }
 
 int main(int argc, char *argv[])
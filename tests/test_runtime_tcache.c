@@ -0,0 +1,123 @@
+/*
+ * test_runtime_tcache.c - stresses the thread-local cache depot by freeing
+ * items on different threads than the ones that allocated them
+ */
+
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/assert.h>
+#include <base/slab.h>
+#include <base/tcache.h>
+#include <base/time.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+#include <runtime/smalloc.h>
+
+#define NTHREADS	32
+#define ITERS		20000
+#define BATCH		64
+#define SIZE		96
+
+struct slot {
+	spinlock_t	lock;
+	int		nr;
+	unsigned long	*items[BATCH];
+} __aligned(CACHE_LINE_SIZE);
+
+static struct slot slots[NTHREADS];
+static waitgroup_t wg;
+
+static void free_batch(struct slot *s)
+{
+	unsigned long *items[BATCH];
+	int i, nr;
+
+	spin_lock_np(&s->lock);
+	nr = s->nr;
+	memcpy(items, s->items, sizeof(items[0]) * nr);
+	s->nr = 0;
+	spin_unlock_np(&s->lock);
+
+	for (i = 0; i < nr; i++) {
+		/* the item must not have been handed out twice */
+		BUG_ON(*items[i] != (unsigned long)items[i]);
+		*items[i] = 0;
+		sfree(items[i]);
+	}
+}
+
+static void work_handler(void *arg)
+{
+	int id = (long)arg;
+	struct slot *mine = &slots[id];
+	struct slot *next = &slots[(id + 1) % NTHREADS];
+	unsigned long *item;
+	int i;
+
+	for (i = 0; i < ITERS; i++) {
+		/* fill our slot with fresh items */
+		spin_lock_np(&mine->lock);
+		while (mine->nr < BATCH) {
+			item = smalloc(SIZE);
+			BUG_ON(!item);
+			*item = (unsigned long)item;
+			mine->items[mine->nr++] = item;
+		}
+		spin_unlock_np(&mine->lock);
+
+		/* free the items our neighbor allocated */
+		free_batch(next);
+
+		if (i % 16 == 0)
+			thread_yield();
+	}
+
+	waitgroup_done(&wg);
+}
+
+static void main_handler(void *arg)
+{
+	uint64_t start_us;
+	int i, ret;
+
+	for (i = 0; i < NTHREADS; i++)
+		spin_lock_init(&slots[i].lock);
+
+	log_info("testing cross-thread frees with %d threads", NTHREADS);
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, NTHREADS);
+	start_us = microtime();
+	for (i = 0; i < NTHREADS; i++) {
+		ret = thread_spawn(work_handler, (void *)(long)i);
+		BUG_ON(ret);
+	}
+	waitgroup_wait(&wg);
+
+	for (i = 0; i < NTHREADS; i++)
+		free_batch(&slots[i]);
+
+	log_info("%f ns / item", (double)(microtime() - start_us) * 1000 /
+		 ((uint64_t)NTHREADS * ITERS * BATCH));
+	tcache_print_usage();
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}